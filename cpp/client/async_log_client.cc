@@ -2,6 +2,7 @@
 
 #include <event2/http.h>
 #include <glog/logging.h>
+#include <zlib.h>
 #include <algorithm>
 #include <iterator>
 #include <memory>
@@ -9,11 +10,13 @@
 #include "log/cert.h"
 #include "proto/cert_serializer.h"
 #include "proto/serializer.h"
+#include "util/json_reader.h"
 #include "util/json_wrapper.h"
 
 using cert_trans::AsyncLogClient;
 using cert_trans::Cert;
 using cert_trans::CertChain;
+using cert_trans::JsonReader;
 using cert_trans::PreCertChain;
 using cert_trans::URL;
 using cert_trans::UrlFetcher;
@@ -49,6 +52,10 @@ bool SanityCheck(UrlFetcher::Response* resp,
   // TODO(pphaneuf): We should report errors better. The easiest way
   // would be for this to use util::Task as well, so it could simply
   // pass on the status.
+  if (task->status().ok() && resp->status_code == HTTP_SERVUNAVAIL) {
+    done(AsyncLogClient::SERVICE_UNAVAILABLE);
+    return false;
+  }
   if (!task->status().ok() || resp->status_code != HTTP_OK) {
     done(AsyncLogClient::UNKNOWN_ERROR);
     return false;
@@ -142,6 +149,76 @@ void DoneGetRoots(UrlFetcher::Response* resp, vector<unique_ptr<Cert>>* roots,
 }
 
 
+// Reads one element of the "entries" array of a get-entries response.
+// The decoded fields go through |leaf_input| and |extra_data|, which
+// are reused from one entry to the next.
+bool ReadEntry(JsonReader* reader, string* leaf_input, string* extra_data,
+               AsyncLogClient::Entry* log_entry) {
+  bool have_leaf_input(false);
+  bool have_extra_data(false);
+  string key;
+  if (!reader->BeginObject()) {
+    return false;
+  }
+  while (reader->NextKey(&key)) {
+    if (key == "leaf_input") {
+      if (!reader->Base64(leaf_input) ||
+          Deserializer::DeserializeMerkleTreeLeaf(*leaf_input,
+                                                  &log_entry->leaf) !=
+              DeserializeResult::OK) {
+        return false;
+      }
+      have_leaf_input = true;
+    } else if (key == "extra_data") {
+      if (!reader->Base64(extra_data)) {
+        return false;
+      }
+      have_extra_data = true;
+    } else if (key == "sct") {
+      // This is an optional non-standard extension, used only by the
+      // log internally when running in clustered mode.
+      string sct_data;
+      unique_ptr<SignedCertificateTimestamp> sct(
+          new SignedCertificateTimestamp);
+      if (!reader->Base64(&sct_data) ||
+          Deserializer::DeserializeSCT(sct_data, sct.get()) !=
+              DeserializeResult::OK) {
+        return false;
+      }
+      log_entry->sct = move(sct);
+    } else if (!reader->Skip()) {
+      return false;
+    }
+  }
+  if (!reader->ok() || !have_leaf_input || !have_extra_data) {
+    return false;
+  }
+
+  // The members can come in any order, so this has to wait until we
+  // know the type of the entry.
+  switch (log_entry->leaf.timestamped_entry().entry_type()) {
+    case ct::X509_ENTRY:
+      DeserializeX509Chain(*extra_data, log_entry->entry.mutable_x509_entry());
+      break;
+    case ct::PRECERT_ENTRY:
+      DeserializePrecertChainEntry(*extra_data,
+                                   log_entry->entry.mutable_precert_entry());
+      break;
+    case ct::X_JSON_ENTRY:
+      // nothing to do
+      break;
+    default:
+      LOG(FATAL) << "Don't understand entry type: "
+                 << log_entry->leaf.timestamped_entry().entry_type();
+  }
+
+  return true;
+}
+
+
+// Responses can have thousands of entries, so rather than building a
+// json-c tree of the whole response, this decodes them as it reads
+// through it.
 void DoneGetEntries(UrlFetcher::Response* resp,
                     vector<AsyncLogClient::Entry>* entries,
                     const AsyncLogClient::Callback& done, util::Task* task) {
@@ -152,72 +229,161 @@ void DoneGetEntries(UrlFetcher::Response* resp,
     return;
   }
 
-  JsonObject jresponse(resp->body);
-  if (!jresponse.Ok())
-    return done(AsyncLogClient::BAD_RESPONSE);
-
-  JsonArray jentries(jresponse, "entries");
-  if (!jentries.Ok())
+  JsonReader reader(resp->body);
+  if (!reader.BeginObject()) {
     return done(AsyncLogClient::BAD_RESPONSE);
+  }
 
   vector<AsyncLogClient::Entry> new_entries;
-  new_entries.reserve(jentries.Length());
-
-  for (int n = 0; n < jentries.Length(); ++n) {
-    JsonObject entry(jentries, n);
-    if (!entry.Ok()) {
-      return done(AsyncLogClient::BAD_RESPONSE);
+  bool have_entries(false);
+  string key;
+  string leaf_input;
+  string extra_data;
+  while (reader.NextKey(&key)) {
+    if (key != "entries") {
+      if (!reader.Skip()) {
+        return done(AsyncLogClient::BAD_RESPONSE);
+      }
+      continue;
     }
 
-    JsonString leaf_input(entry, "leaf_input");
-    if (!leaf_input.Ok()) {
+    if (!reader.BeginArray()) {
       return done(AsyncLogClient::BAD_RESPONSE);
     }
+    have_entries = true;
+    while (reader.NextElement()) {
+      AsyncLogClient::Entry log_entry;
+      if (!ReadEntry(&reader, &leaf_input, &extra_data, &log_entry)) {
+        return done(AsyncLogClient::BAD_RESPONSE);
+      }
+      new_entries.emplace_back(move(log_entry));
+    }
+  }
+  if (!reader.ok() || !have_entries) {
+    return done(AsyncLogClient::BAD_RESPONSE);
+  }
 
-    AsyncLogClient::Entry log_entry;
-    if (Deserializer::DeserializeMerkleTreeLeaf(leaf_input.FromBase64(),
-                                                &log_entry.leaf) !=
-        DeserializeResult::OK) {
+  entries->reserve(entries->size() + new_entries.size());
+  move(new_entries.begin(), new_entries.end(), back_inserter(*entries));
+
+  return done(AsyncLogClient::OK);
+}
+
+
+// Reads a size (4 bytes, big-endian) at |*pos| in |data|, and moves
+// past it.
+bool ReadSize(const string& data, size_t* pos, size_t* size) {
+  if (data.size() - *pos < 4) {
+    return false;
+  }
+  *size = 0;
+  for (int i = 0; i < 4; ++i) {
+    *size = (*size << 8) | static_cast<unsigned char>(data[(*pos)++]);
+  }
+  return true;
+}
+
+
+// Reads a record (prefixed by its size) at |*pos| in |data|, and
+// moves past it.
+bool ReadRecord(const string& data, size_t* pos, string* record) {
+  size_t size;
+  if (!ReadSize(data, pos, &size) || data.size() - *pos < size) {
+    return false;
+  }
+  record->assign(data, *pos, size);
+  *pos += size;
+  return true;
+}
+
+
+// Rebuilds the parts of |log_entry| that get-entries would have sent
+// from the stored entry in |logged|.
+bool EntryFromLogged(const ct::LoggedEntryPB& logged,
+                     AsyncLogClient::Entry* log_entry) {
+  const ct::LogEntry& entry(logged.contents().entry());
+  const SignedCertificateTimestamp& sct(logged.contents().sct());
+  log_entry->leaf.set_version(sct.version());
+  log_entry->leaf.set_type(ct::TIMESTAMPED_ENTRY);
+  ct::TimestampedEntry* const timestamped(
+      log_entry->leaf.mutable_timestamped_entry());
+  timestamped->set_timestamp(sct.timestamp());
+  timestamped->set_entry_type(entry.type());
+  timestamped->set_extensions(sct.extensions());
+  ct::SignedEntry* const signed_entry(timestamped->mutable_signed_entry());
+  switch (entry.type()) {
+    case ct::X509_ENTRY:
+      signed_entry->set_x509(entry.x509_entry().leaf_certificate());
+      break;
+    case ct::PRECERT_ENTRY:
+      signed_entry->mutable_precert()->CopyFrom(
+          entry.precert_entry().pre_cert());
+      break;
+    case ct::X_JSON_ENTRY:
+      signed_entry->set_json(entry.x_json_entry().json());
+      break;
+    default:
+      return false;
+  }
+  log_entry->entry = entry;
+  log_entry->sct.reset(new SignedCertificateTimestamp(sct));
+  return true;
+}
+
+
+void DoneGetLoggedEntries(UrlFetcher::Response* resp, int first,
+                          bool compressed,
+                          vector<AsyncLogClient::Entry>* entries,
+                          const AsyncLogClient::Callback& done,
+                          util::Task* task) {
+  unique_ptr<UrlFetcher::Response> resp_deleter(CHECK_NOTNULL(resp));
+  unique_ptr<util::Task> task_deleter(CHECK_NOTNULL(task));
+
+  if (!SanityCheck(resp, done, task)) {
+    return;
+  }
+
+  size_t pos(0);
+  string uncompressed;
+  if (compressed) {
+    size_t size;
+    if (!ReadSize(resp->body, &pos, &size)) {
       return done(AsyncLogClient::BAD_RESPONSE);
     }
-
-    JsonString extra_data(entry, "extra_data");
-    if (!extra_data.Ok()) {
+    uncompressed.resize(size);
+    uLongf uncompressed_size(size);
+    if (uncompress(reinterpret_cast<Bytef*>(&uncompressed[0]),
+                   &uncompressed_size,
+                   reinterpret_cast<const Bytef*>(resp->body.data() + pos),
+                   resp->body.size() - pos) != Z_OK ||
+        uncompressed_size != size) {
       return done(AsyncLogClient::BAD_RESPONSE);
     }
+    pos = 0;
+  }
+  const string& body(compressed ? uncompressed : resp->body);
 
-    // This is an optional non-standard extension, used only by the log
-    // internally when running in clustered mode.
-    JsonString sct_data(entry, "sct");
-    if (sct_data.Ok()) {
-      unique_ptr<SignedCertificateTimestamp> sct(
-          new SignedCertificateTimestamp);
-      if (Deserializer::DeserializeSCT(sct_data.FromBase64(), sct.get()) !=
-          DeserializeResult::OK) {
-        return done(AsyncLogClient::BAD_RESPONSE);
-      }
-      log_entry.sct = move(sct);
+  vector<AsyncLogClient::Entry> new_entries;
+  ct::LoggedEntryPB logged;
+  while (pos < body.size()) {
+    size_t size;
+    if (!ReadSize(body, &pos, &size) || body.size() - pos < size ||
+        !logged.ParseFromArray(body.data() + pos, size) ||
+        logged.sequence_number() !=
+            static_cast<int64_t>(first + new_entries.size())) {
+      return done(AsyncLogClient::BAD_RESPONSE);
     }
+    pos += size;
 
-    switch (log_entry.leaf.timestamped_entry().entry_type()) {
-      case ct::X509_ENTRY:
-        DeserializeX509Chain(extra_data.FromBase64(),
-                             log_entry.entry.mutable_x509_entry());
-        break;
-      case ct::PRECERT_ENTRY:
-        DeserializePrecertChainEntry(extra_data.FromBase64(),
-                                     log_entry.entry.mutable_precert_entry());
-        break;
-      case ct::X_JSON_ENTRY:
-        // nothing to do
-        break;
-      default:
-        LOG(FATAL) << "Don't understand entry type: "
-                   << log_entry.leaf.timestamped_entry().entry_type();
+    AsyncLogClient::Entry log_entry;
+    if (!EntryFromLogged(logged, &log_entry)) {
+      return done(AsyncLogClient::BAD_RESPONSE);
     }
-
     new_entries.emplace_back(move(log_entry));
   }
+  if (new_entries.empty()) {
+    return done(AsyncLogClient::BAD_RESPONSE);
+  }
 
   entries->reserve(entries->size() + new_entries.size());
   move(new_entries.begin(), new_entries.end(), back_inserter(*entries));
@@ -272,6 +438,63 @@ void DoneQueryInclusionProof(UrlFetcher::Response* resp,
 }
 
 
+void DoneGetSTHBinary(UrlFetcher::Response* resp, SignedTreeHead* sth,
+                      const AsyncLogClient::Callback& done,
+                      util::Task* task) {
+  unique_ptr<UrlFetcher::Response> resp_deleter(CHECK_NOTNULL(resp));
+  unique_ptr<util::Task> task_deleter(CHECK_NOTNULL(task));
+
+  if (!SanityCheck(resp, done, task)) {
+    return;
+  }
+
+  size_t pos(0);
+  string record;
+  SignedTreeHead new_sth;
+  if (!ReadRecord(resp->body, &pos, &record) || pos != resp->body.size() ||
+      !new_sth.ParseFromString(record) || new_sth.tree_size() < 0 ||
+      new_sth.timestamp() < 0) {
+    return done(AsyncLogClient::BAD_RESPONSE);
+  }
+
+  sth->Swap(&new_sth);
+
+  return done(AsyncLogClient::OK);
+}
+
+
+void DoneQueryInclusionProofBinary(UrlFetcher::Response* resp,
+                                   const SignedTreeHead& sth,
+                                   MerkleAuditProof* proof,
+                                   const AsyncLogClient::Callback& done,
+                                   util::Task* task) {
+  unique_ptr<UrlFetcher::Response> resp_deleter(CHECK_NOTNULL(resp));
+  unique_ptr<util::Task> task_deleter(CHECK_NOTNULL(task));
+
+  if (!SanityCheck(resp, done, task)) {
+    return;
+  }
+
+  size_t pos(0);
+  string record;
+  ct::ShortMerkleAuditProof short_proof;
+  if (!ReadRecord(resp->body, &pos, &record) || pos != resp->body.size() ||
+      !short_proof.ParseFromString(record) || short_proof.leaf_index() < 0) {
+    return done(AsyncLogClient::BAD_RESPONSE);
+  }
+
+  proof->Clear();
+  proof->set_version(ct::V1);
+  proof->set_tree_size(sth.tree_size());
+  proof->set_timestamp(sth.timestamp());
+  proof->mutable_tree_head_signature()->CopyFrom(sth.signature());
+  proof->set_leaf_index(short_proof.leaf_index());
+  proof->mutable_path_node()->Swap(short_proof.mutable_path_node());
+
+  return done(AsyncLogClient::OK);
+}
+
+
 void DoneGetSTHConsistency(UrlFetcher::Response* resp, vector<string>* proof,
                            const AsyncLogClient::Callback& done,
                            util::Task* task) {
@@ -306,6 +529,34 @@ void DoneGetSTHConsistency(UrlFetcher::Response* resp, vector<string>* proof,
 }
 
 
+void DoneGetSTHConsistencyBinary(UrlFetcher::Response* resp,
+                                 vector<string>* proof,
+                                 const AsyncLogClient::Callback& done,
+                                 util::Task* task) {
+  unique_ptr<UrlFetcher::Response> resp_deleter(CHECK_NOTNULL(resp));
+  unique_ptr<util::Task> task_deleter(CHECK_NOTNULL(task));
+
+  if (!SanityCheck(resp, done, task)) {
+    return;
+  }
+
+  vector<string> nodes;
+  size_t pos(0);
+  while (pos < resp->body.size()) {
+    string node;
+    if (!ReadRecord(resp->body, &pos, &node)) {
+      return done(AsyncLogClient::BAD_RESPONSE);
+    }
+    nodes.emplace_back(move(node));
+  }
+
+  proof->reserve(proof->size() + nodes.size());
+  move(nodes.begin(), nodes.end(), back_inserter(*proof));
+
+  return done(AsyncLogClient::OK);
+}
+
+
 void DoneInternalAddChain(UrlFetcher::Response* resp,
                           SignedCertificateTimestamp* sct,
                           const AsyncLogClient::Callback& done,
@@ -441,6 +692,29 @@ void AsyncLogClient::InternalGetEntries(int first, int last,
 }
 
 
+void AsyncLogClient::GetLoggedEntries(int first, int last, bool compressed,
+                                      vector<Entry>* entries,
+                                      const Callback& done) {
+  CHECK_GE(first, 0);
+  CHECK_GE(last, 0);
+
+  if (last < first) {
+    done(INVALID_INPUT);
+    return;
+  }
+
+  URL url(GetURL("internal/get-logged-entries"));
+  url.SetQuery("start=" + to_string(first) + "&end=" + to_string(last) +
+               (compressed ? "&compress=true" : ""));
+
+  UrlFetcher::Response* const resp(new UrlFetcher::Response);
+  fetcher_->Fetch(url, resp,
+                  new util::Task(bind(DoneGetLoggedEntries, resp, first,
+                                      compressed, entries, done, _1),
+                                 executor_));
+}
+
+
 void AsyncLogClient::QueryInclusionProof(const SignedTreeHead& sth,
                                          const std::string& merkle_leaf_hash,
                                          MerkleAuditProof* proof,
@@ -474,6 +748,47 @@ void AsyncLogClient::GetSTHConsistency(int64_t first, int64_t second,
 }
 
 
+void AsyncLogClient::GetSTHBinary(SignedTreeHead* sth, const Callback& done) {
+  UrlFetcher::Response* const resp(new UrlFetcher::Response);
+  fetcher_->Fetch(GetURL("internal/get-sth"), resp,
+                  new util::Task(bind(DoneGetSTHBinary, resp, sth, done, _1),
+                                 executor_));
+}
+
+
+void AsyncLogClient::QueryInclusionProofBinary(
+    const SignedTreeHead& sth, const string& merkle_leaf_hash,
+    MerkleAuditProof* proof, const Callback& done) {
+  CHECK_GE(sth.tree_size(), 0);
+
+  URL url(GetURL("internal/get-proof-by-hash"));
+  url.SetQuery("hash=" + UriEncode(util::ToBase64(merkle_leaf_hash)) +
+               "&tree_size=" + to_string(sth.tree_size()));
+
+  UrlFetcher::Response* const resp(new UrlFetcher::Response);
+  fetcher_->Fetch(url, resp,
+                  new util::Task(bind(DoneQueryInclusionProofBinary, resp, sth,
+                                      proof, done, _1),
+                                 executor_));
+}
+
+
+void AsyncLogClient::GetSTHConsistencyBinary(int64_t first, int64_t second,
+                                             vector<string>* proof,
+                                             const Callback& done) {
+  CHECK_GE(first, 0);
+  CHECK_GE(second, 0);
+
+  URL url(GetURL("internal/get-sth-consistency"));
+  url.SetQuery("first=" + to_string(first) + "&second=" + to_string(second));
+
+  UrlFetcher::Response* const resp(new UrlFetcher::Response);
+  fetcher_->Fetch(url, resp, new util::Task(bind(DoneGetSTHConsistencyBinary,
+                                                 resp, proof, done, _1),
+                                            executor_));
+}
+
+
 void AsyncLogClient::AddCertChain(const CertChain& cert_chain,
                                   SignedCertificateTimestamp* sct,
                                   const Callback& done) {
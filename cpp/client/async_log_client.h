@@ -31,6 +31,9 @@ class AsyncLogClient {
     BAD_RESPONSE,
     UNKNOWN_ERROR,
     INVALID_INPUT,
+    // The server is overloaded (HTTP 503), the request can be retried
+    // later.
+    SERVICE_UNAVAILABLE,
   };
 
   struct Entry {
@@ -72,6 +75,13 @@ class AsyncLogClient {
   void GetEntriesAndSCTs(int first, int last, std::vector<Entry>* entries,
                          const Callback& done);
 
+  // Same as above, also NON-standard, but the entries are sent the way
+  // they are stored (as serialized LoggedEntryPB, each prefixed by its
+  // size), optionally compressed, which costs a lot less than JSON to
+  // produce and to read, on both ends.
+  void GetLoggedEntries(int first, int last, bool compressed,
+                        std::vector<Entry>* entries, const Callback& done);
+
   void QueryInclusionProof(const ct::SignedTreeHead& sth,
                            const std::string& merkle_leaf_hash,
                            ct::MerkleAuditProof* proof, const Callback& done);
@@ -81,6 +91,22 @@ class AsyncLogClient {
                          std::vector<std::string>* proof,
                          const Callback& done);
 
+  // These are NON-standard too, and only work with this log
+  // implementation. They are the same as the above, but the replies
+  // are binary (serialized protocol buffers and hashes, each prefixed
+  // by its size) rather than JSON with base64 fields, which is smaller
+  // and cheaper to produce and to read, for internal readers making
+  // a lot of these requests.
+  void GetSTHBinary(ct::SignedTreeHead* sth, const Callback& done);
+  void QueryInclusionProofBinary(const ct::SignedTreeHead& sth,
+                                 const std::string& merkle_leaf_hash,
+                                 ct::MerkleAuditProof* proof,
+                                 const Callback& done);
+  // This does not clear "proof" before appending to it.
+  void GetSTHConsistencyBinary(int64_t first, int64_t second,
+                               std::vector<std::string>* proof,
+                               const Callback& done);
+
   // Note: these methods can call "done" inline (before they return),
   // if there is a problem with the (pre-)certificate chain.
   void AddCertChain(const CertChain& cert_chain,
@@ -13,28 +13,43 @@
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <sstream>
 #include <string>
 
+#include "base/macros.h"
 #include "client/http_log_client.h"
 #include "client/ssl_client.h"
+#include "client/ssl_scanner.h"
 #include "log/cert.h"
 #include "log/cert_submission_handler.h"
 #include "log/ct_extensions.h"
+#include "log/leaf_hasher.h"
 #include "log/log_signer.h"
 #include "log/log_verifier.h"
+#include "log/logged_entry.h"
+#include "merkletree/compact_merkle_tree.h"
 #include "merkletree/merkle_tree.h"
 #include "merkletree/merkle_verifier.h"
 #include "merkletree/serial_hasher.h"
+#include "net/url_fetcher.h"
 #include "proto/cert_serializer.h"
 #include "proto/ct.pb.h"
 #include "proto/serializer.h"
 #include "util/init.h"
+#include "util/libevent_wrapper.h"
 #include "util/openssl_scoped_types.h"
 #include "util/read_key.h"
+#include "util/task.h"
+#include "util/thread_pool.h"
 #include "util/util.h"
 
 DEFINE_string(ssl_client_trusted_cert_dir, "",
@@ -43,6 +58,20 @@ DEFINE_string(ct_server_public_key, "",
               "PEM-encoded public key file of the CT log server");
 DEFINE_string(ssl_server, "", "SSL server to connect to");
 DEFINE_string(ssl_server_port, "https", "SSL server port");
+DEFINE_string(scan_hosts, "",
+              "File listing the servers for the 'scan' command, one per "
+              "line, as host or host:port (port 443 by default)");
+DEFINE_string(scan_log_keys, "",
+              "Comma-separated list of the public key files of the logs "
+              "the 'scan' command checks SCTs against (by default, "
+              "--ct_server_public_key)");
+DEFINE_string(scan_out, "",
+              "File to which 'scan' writes a line for each server (by "
+              "default, standard output)");
+DEFINE_int32(scan_concurrency, 1000,
+             "Number of concurrent handshakes of 'scan'");
+DEFINE_int32(scan_timeout_ms, 10000,
+             "Time 'scan' gives each server to complete the handshake");
 DEFINE_string(ct_server_submission, "",
               "Certificate chain to submit to a CT log server. "
               "The file must consist of concatenated PEM certificates.");
@@ -79,6 +108,37 @@ DEFINE_string(certificate_chain_in, "",
 DEFINE_string(sct_in, "", "SCT to wrap");
 DEFINE_int32(get_first, 0, "First entry to retrieve with the 'get' command");
 DEFINE_int32(get_last, 0, "Last entry to retrieve with the 'get' command");
+DEFINE_string(get_entries_out, "",
+              "If set, 'get_entries' downloads the entries into this "
+              "file instead of writing their certificates to "
+              "--certificate_base, with several concurrent requests. How "
+              "far it got is recorded in <file>.checkpoint, from which an "
+              "interrupted download resumes (delete it to start over). A "
+              "negative --get_last then means the last entry of the "
+              "current STH.");
+DEFINE_string(bulk_upload_list, "",
+              "File listing the submissions of the 'bulk_upload' command, "
+              "one file name per line (each like --ct_server_submission)");
+DEFINE_string(bulk_upload_sct_out, "",
+              "File to which 'bulk_upload' appends a line for each SCT "
+              "received: the submission file name, a space, then the SCT "
+              "in base64");
+DEFINE_int32(bulk_upload_concurrency, 16,
+             "Number of concurrent submissions of 'bulk_upload'");
+DEFINE_int32(bulk_upload_batch_size, 1000,
+             "Number of SCTs 'bulk_upload' writes out at a time");
+DEFINE_int32(bulk_upload_max_attempts, 8,
+             "Number of times 'bulk_upload' tries a submission while the "
+             "log is overloaded (HTTP 503), waiting twice as long each "
+             "time");
+DEFINE_int32(bulk_upload_retry_delay_ms, 1000,
+             "Time 'bulk_upload' waits before trying an overloaded "
+             "submission again for the first time");
+DEFINE_int32(get_entries_concurrency, 8,
+             "Number of concurrent requests with --get_entries_out");
+DEFINE_int32(get_entries_batch_size, 1000,
+             "Number of entries asked for in each request with "
+             "--get_entries_out");
 DEFINE_string(certificate_base, "",
               "Base name for retrieved certificates - "
               "files will be <base><entry>.<cert>.der");
@@ -90,13 +150,18 @@ DEFINE_string(sth2, "", "File containing second STH");
 DEFINE_uint64(monitor_sleep_time_secs, 60,
               "Amount of time the monitor shall "
               "sleep between probing for a new STH.");
+DEFINE_string(monitor_state, "",
+              "File where the monitor keeps the last STH verified and the "
+              "frontier of the tree, to carry on from there when restarted.");
 
 
 static const char kUsage[] =
     " <command> ...\n"
     "Known commands:\n"
     "connect - connect to an SSL server\n"
+    "scan - connect to many SSL servers and check the SCTs they serve\n"
     "upload - upload a submission to a CT log server\n"
+    "bulk_upload - upload many submissions to a CT log server\n"
     "certificate - make a superfluous proof certificate\n"
     "extension_data - convert an audit proof to TLS extension format\n"
     "configure_proof - write the proof in an X509v3 configuration file\n"
@@ -109,6 +174,7 @@ static const char kUsage[] =
     "get_entries - get entries from the log\n"
     "sth - get the current STH from the log\n"
     "consistency - get and check consistency of two STHs\n"
+    "monitor - follow the log, checking every new STH against its entries\n"
     "Use --help to display command-line flag options\n";
 
 using cert_trans::AsyncLogClient;
@@ -116,9 +182,13 @@ using cert_trans::Cert;
 using cert_trans::CertChain;
 using cert_trans::CertSubmissionHandler;
 using cert_trans::HTTPLogClient;
+using cert_trans::LeafHasher;
+using cert_trans::LoggedEntry;
 using cert_trans::PreCertChain;
 using cert_trans::ReadPublicKey;
 using cert_trans::SSLClient;
+using cert_trans::SSLScanList;
+using cert_trans::SSLScanner;
 using cert_trans::ScopedASN1_OCTET_STRING;
 using cert_trans::ScopedBIGNUM;
 using cert_trans::ScopedBIO;
@@ -127,6 +197,8 @@ using cert_trans::ScopedRSA;
 using cert_trans::ScopedX509;
 using cert_trans::ScopedX509_NAME;
 using cert_trans::TbsCertificate;
+using cert_trans::ThreadPool;
+using cert_trans::UrlFetcher;
 using cert_trans::serialization::SerializeResult;
 using cert_trans::serialization::DeserializeResult;
 using ct::LogEntry;
@@ -135,6 +207,17 @@ using ct::SSLClientCTData;
 using ct::SignedCertificateTimestamp;
 using ct::SignedCertificateTimestampList;
 using ct::SignedTreeHead;
+using std::bind;
+using std::chrono::duration;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::deque;
+using std::map;
+using std::min;
+using std::move;
+using std::placeholders::_1;
+using std::placeholders::_2;
+using std::placeholders::_3;
 using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
@@ -142,6 +225,8 @@ using std::vector;
 using util::Status;
 using util::StatusOr;
 
+namespace libevent = cert_trans::libevent;
+
 // SCTs presented to clients have to be encoded as a list.
 // Helper method for encoding a single SCT.
 static string SCTToList(const string& serialized_sct) {
@@ -368,6 +453,214 @@ static int Upload() {
   return 0;
 }
 
+static const char* ClientStatusString(AsyncLogClient::Status status) {
+  switch (status) {
+    case AsyncLogClient::OK:
+      return "ok";
+    case AsyncLogClient::BAD_RESPONSE:
+      return "bad response";
+    case AsyncLogClient::UNKNOWN_ERROR:
+      return "unknown error";
+    case AsyncLogClient::INVALID_INPUT:
+      return "invalid input";
+    case AsyncLogClient::SERVICE_UNAVAILABLE:
+      return "service unavailable";
+  }
+  return "unexpected status";
+}
+
+
+// Submits the chains of the files listed in |list| with several
+// concurrent requests, and writes the SCTs received to |sct_out| in
+// batches. The submissions the log rejects because it is overloaded
+// are tried again later, with an exponential backoff.
+class BulkUpload {
+ public:
+  BulkUpload(libevent::Base* base, AsyncLogClient* client,
+             std::istream* list, FILE* sct_out)
+      : base_(CHECK_NOTNULL(base)),
+        client_(CHECK_NOTNULL(client)),
+        list_(CHECK_NOTNULL(list)),
+        sct_out_(CHECK_NOTNULL(sct_out)),
+        start_time_(steady_clock::now()),
+        end_of_list_(false),
+        starting_(false),
+        num_submitting_(0),
+        num_pending_scts_(0),
+        num_ok_(0),
+        num_retries_(0) {
+  }
+
+  // Returns false if some of the submissions failed.
+  bool Run() {
+    StartSubmissions();
+    while (num_submitting_ > 0) {
+      base_->DispatchOnce();
+    }
+    WriteSCTs();
+    return num_failed_.empty();
+  }
+
+ private:
+  struct Submission {
+    Submission() : attempts(0) {
+    }
+
+    string file;
+    string contents;
+    SignedCertificateTimestamp sct;
+    int attempts;
+  };
+
+  void StartSubmissions() {
+    // Submissions can complete inline (if their chain is invalid), in
+    // which case the loop below carries on.
+    if (starting_) {
+      return;
+    }
+    starting_ = true;
+
+    string file;
+    while (num_submitting_ < FLAGS_bulk_upload_concurrency &&
+           !end_of_list_) {
+      if (!std::getline(*list_, file)) {
+        end_of_list_ = true;
+        break;
+      }
+      if (file.empty()) {
+        continue;
+      }
+
+      unique_ptr<Submission> submission(new Submission);
+      submission->file = file;
+      if (!util::ReadBinaryFile(file, &submission->contents)) {
+        LOG(ERROR) << "Could not read " << file;
+        ++num_failed_[AsyncLogClient::INVALID_INPUT];
+        continue;
+      }
+      ++num_submitting_;
+      Submit(submission.release());
+    }
+
+    starting_ = false;
+  }
+
+  void Submit(Submission* submission) {
+    ++submission->attempts;
+    const AsyncLogClient::Callback done(
+        bind(&BulkUpload::SubmitDone, this, submission, _1));
+    if (FLAGS_precert) {
+      client_->AddPreCertChain(PreCertChain(submission->contents),
+                               &submission->sct, done);
+    } else {
+      client_->AddCertChain(CertChain(submission->contents),
+                            &submission->sct, done);
+    }
+  }
+
+  void SubmitDone(Submission* s, AsyncLogClient::Status status) {
+    unique_ptr<Submission> submission(s);
+
+    if (status == AsyncLogClient::SERVICE_UNAVAILABLE &&
+        submission->attempts < FLAGS_bulk_upload_max_attempts) {
+      ++num_retries_;
+      const milliseconds delay(FLAGS_bulk_upload_retry_delay_ms
+                               << (submission->attempts - 1));
+      base_->Delay(delay,
+                   new util::Task(bind(&BulkUpload::RetryDelayDone, this,
+                                       submission.release(), _1),
+                                  base_));
+      return;
+    }
+
+    --num_submitting_;
+    if (status == AsyncLogClient::OK) {
+      string sct;
+      CHECK_EQ(SerializeResult::OK,
+               Serializer::SerializeSCT(submission->sct, &sct));
+      pending_scts_ += submission->file + ' ' + util::ToBase64(sct) + '\n';
+      ++num_ok_;
+      if (++num_pending_scts_ >= FLAGS_bulk_upload_batch_size) {
+        WriteSCTs();
+      }
+    } else {
+      LOG(ERROR) << "Submission of " << submission->file << " failed: "
+                 << ClientStatusString(status);
+      ++num_failed_[status];
+    }
+
+    StartSubmissions();
+  }
+
+  void RetryDelayDone(Submission* submission, util::Task* task) {
+    CHECK_EQ(util::Status::OK, task->status());
+    delete task;
+    Submit(submission);
+  }
+
+  void WriteSCTs() {
+    PCHECK(fwrite(pending_scts_.data(), 1, pending_scts_.size(), sct_out_) ==
+           pending_scts_.size())
+        << "Could not write to " << FLAGS_bulk_upload_sct_out;
+    PCHECK(fflush(sct_out_) == 0) << "Could not write to "
+                                  << FLAGS_bulk_upload_sct_out;
+    pending_scts_.clear();
+    num_pending_scts_ = 0;
+
+    const duration<double> elapsed(steady_clock::now() - start_time_);
+    LOG(INFO) << num_ok_ << " SCTs received in " << elapsed.count()
+              << " seconds (" << num_ok_ / elapsed.count() << "/s), "
+              << num_retries_ << " retries after a 503";
+    for (const auto& failed : num_failed_) {
+      LOG(INFO) << failed.second << " submissions failed with "
+                << ClientStatusString(failed.first);
+    }
+  }
+
+  libevent::Base* const base_;
+  AsyncLogClient* const client_;
+  std::istream* const list_;
+  FILE* const sct_out_;
+  const steady_clock::time_point start_time_;
+  bool end_of_list_;
+  bool starting_;
+  // Including the ones waiting to be tried again.
+  int num_submitting_;
+  string pending_scts_;
+  int num_pending_scts_;
+  int64_t num_ok_;
+  int64_t num_retries_;
+  map<AsyncLogClient::Status, int64_t> num_failed_;
+
+  DISALLOW_COPY_AND_ASSIGN(BulkUpload);
+};
+
+
+static int BulkUploadSubmissions() {
+  CHECK_NE(FLAGS_ct_server, "");
+  CHECK_GT(FLAGS_bulk_upload_concurrency, 0);
+  CHECK_GT(FLAGS_bulk_upload_max_attempts, 0);
+  CHECK(!FLAGS_bulk_upload_sct_out.empty())
+      << "Please give a file for the SCTs with --bulk_upload_sct_out";
+
+  std::ifstream list(FLAGS_bulk_upload_list.c_str());
+  PCHECK(list.good()) << "Could not open " << FLAGS_bulk_upload_list;
+  FILE* const sct_out(fopen(FLAGS_bulk_upload_sct_out.c_str(), "ab"));
+  PCHECK(sct_out) << "Could not open " << FLAGS_bulk_upload_sct_out;
+
+  const unique_ptr<libevent::Base> base(new libevent::Base);
+  ThreadPool pool;
+  UrlFetcher fetcher(base.get(), &pool);
+  AsyncLogClient client(base.get(), &fetcher, FLAGS_ct_server);
+
+  BulkUpload upload(base.get(), &client, &list, sct_out);
+  const bool ok(upload.Run());
+  PCHECK(fclose(sct_out) == 0) << "Could not close "
+                               << FLAGS_bulk_upload_sct_out;
+
+  return ok ? 0 : 1;
+}
+
 // FIXME: fix all the memory leaks in this code.
 static void MakeCert() {
   string sct;
@@ -591,6 +884,61 @@ static SSLClient::HandshakeResult Connect() {
   return result;
 }
 
+
+// Writes a line to |out| for the result of a scan, with
+// tab-separated fields: host:port, the status, the number of SCTs in
+// the TLS extension, in the OCSP response and in the certificate, the
+// number of valid SCTs, and the base64 key IDs of the logs these are
+// from, comma-separated.
+static void PrintScanResult(FILE* out, const SSLScanner::Result& result) {
+  string log_ids;
+  for (const auto& log_id : result.valid_log_ids) {
+    if (!log_ids.empty()) {
+      log_ids += ",";
+    }
+    log_ids += util::ToBase64(log_id);
+  }
+  fprintf(out, "%s:%u\t%s\t%d\t%d\t%d\t%d\t%s\n", result.host.c_str(),
+          result.port, SSLScanner::StatusString(result.status),
+          result.tls_scts, result.ocsp_scts, result.cert_scts,
+          result.valid_scts, log_ids.c_str());
+}
+
+
+static void ScanServers() {
+  CHECK_GT(FLAGS_scan_concurrency, 0);
+  CHECK_GT(FLAGS_scan_timeout_ms, 0);
+
+  std::ifstream list(FLAGS_scan_hosts.c_str());
+  PCHECK(list.good()) << "Could not open " << FLAGS_scan_hosts;
+  FILE* const out(FLAGS_scan_out.empty() ? stdout
+                                         : fopen(FLAGS_scan_out.c_str(), "w"));
+  PCHECK(out) << "Could not open " << FLAGS_scan_out;
+
+  const unique_ptr<libevent::Base> base(new libevent::Base);
+  SSLScanner scanner(base.get(), milliseconds(FLAGS_scan_timeout_ms));
+  if (FLAGS_scan_log_keys.empty()) {
+    scanner.AddLogVerifier(GetLogVerifierFromFlags());
+  } else {
+    for (const auto& key_file : util::split(FLAGS_scan_log_keys)) {
+      StatusOr<EVP_PKEY*> pkey(ReadPublicKey(key_file));
+      CHECK(pkey.ok()) << "could not read log public key file " << key_file
+                       << ": " << pkey.status();
+      scanner.AddLogVerifier(new LogVerifier(
+          new LogSigVerifier(pkey.ValueOrDie()),
+          new MerkleVerifier(unique_ptr<Sha256Hasher>(new Sha256Hasher))));
+    }
+  }
+
+  SSLScanList scan(base.get(), bind(&SSLScanner::Scan, &scanner, _1, _2, _3),
+                   FLAGS_scan_concurrency, &list,
+                   bind(&PrintScanResult, out, _1));
+  scan.Run();
+  if (out != stdout) {
+    PCHECK(fclose(out) == 0) << "Could not close " << FLAGS_scan_out;
+  }
+}
+
 enum AuditResult {
   // At least one SCT has a valid proof.
   // (Should be unusual to have more than one SCT from the same log,
@@ -873,6 +1221,445 @@ void GetEntries() {
   }
 }
 
+// Downloads a range of entries with several concurrent get-entries
+// requests, and passes them in order to |consume|, batch by batch, as
+// they become contiguous.
+class BulkEntriesDownload {
+ public:
+  // Called with the index of the first entry of the batch.
+  typedef std::function<void(int64_t first,
+                             const vector<AsyncLogClient::Entry>& entries)>
+      ConsumeFunction;
+
+  BulkEntriesDownload(libevent::Base* base, AsyncLogClient* client,
+                      int64_t first, int64_t last,
+                      const ConsumeFunction& consume)
+      : base_(CHECK_NOTNULL(base)),
+        client_(CHECK_NOTNULL(client)),
+        consume_(consume),
+        last_(last),
+        next_fetch_(first),
+        next_consume_(first),
+        num_fetching_(0),
+        failed_(false) {
+  }
+
+  // Returns false if some of the entries could not be fetched.
+  bool Run() {
+    StartFetches();
+    while (num_fetching_ > 0) {
+      base_->DispatchOnce();
+    }
+    LOG(INFO) << "Downloaded the entries up to " << next_consume_ - 1;
+    return !failed_ && next_consume_ > last_;
+  }
+
+ private:
+  // Number of attempts at each request before giving up.
+  static const int kMaxAttempts = 3;
+
+  struct Fetch {
+    Fetch(int64_t f, int64_t l) : first(f), last(l), attempts(0) {
+    }
+
+    int64_t first;
+    int64_t last;
+    int attempts;
+    vector<AsyncLogClient::Entry> entries;
+  };
+
+  void StartFetches() {
+    while (!failed_ && num_fetching_ < FLAGS_get_entries_concurrency) {
+      unique_ptr<Fetch> fetch;
+      if (!to_fetch_.empty()) {
+        fetch = move(to_fetch_.front());
+        to_fetch_.pop_front();
+      } else if (next_fetch_ <= last_ &&
+                 // Do not get too far ahead of a slow request.
+                 fetched_.size() <
+                     static_cast<size_t>(4 * FLAGS_get_entries_concurrency)) {
+        fetch.reset(new Fetch(
+            next_fetch_,
+            min<int64_t>(last_,
+                         next_fetch_ + FLAGS_get_entries_batch_size - 1)));
+        next_fetch_ = fetch->last + 1;
+      } else {
+        return;
+      }
+
+      ++num_fetching_;
+      Fetch* const f(fetch.release());
+      client_->GetEntries(f->first, f->last, &f->entries,
+                          bind(&BulkEntriesDownload::FetchDone, this, f, _1));
+    }
+  }
+
+  void FetchDone(Fetch* f, AsyncLogClient::Status status) {
+    unique_ptr<Fetch> fetch(f);
+    --num_fetching_;
+
+    if (status != AsyncLogClient::OK || fetch->entries.empty()) {
+      if (++fetch->attempts < kMaxAttempts) {
+        LOG(WARNING) << "Failed to fetch the entries from " << fetch->first
+                     << " to " << fetch->last << ", retrying";
+        fetch->entries.clear();
+        to_fetch_.emplace_front(move(fetch));
+      } else {
+        LOG(ERROR) << "Failed to fetch the entries from " << fetch->first
+                   << " to " << fetch->last;
+        failed_ = true;
+      }
+    } else {
+      const int64_t fetched_last(
+          min<int64_t>(fetch->last,
+                       fetch->first + fetch->entries.size() - 1));
+      fetch->entries.resize(fetched_last - fetch->first + 1);
+      if (fetched_last < fetch->last) {
+        // The server returns fewer entries than asked for when it has
+        // a lower limit, fetch the rest.
+        to_fetch_.emplace_front(new Fetch(fetched_last + 1, fetch->last));
+        fetch->last = fetched_last;
+      }
+      const int64_t first(fetch->first);
+      fetched_.emplace(first, move(fetch));
+      ConsumeFetched();
+    }
+
+    StartFetches();
+  }
+
+  void ConsumeFetched() {
+    for (map<int64_t, unique_ptr<Fetch>>::iterator it = fetched_.begin();
+         it != fetched_.end() && it->first == next_consume_;
+         it = fetched_.erase(it)) {
+      consume_(next_consume_, it->second->entries);
+      next_consume_ += it->second->entries.size();
+    }
+  }
+
+  libevent::Base* const base_;
+  AsyncLogClient* const client_;
+  const ConsumeFunction consume_;
+  const int64_t last_;
+  int64_t next_fetch_;
+  int64_t next_consume_;
+  int num_fetching_;
+  bool failed_;
+  // Ranges to fetch before |next_fetch_|: failed requests being
+  // retried, and the rest of short responses.
+  deque<unique_ptr<Fetch>> to_fetch_;
+  // Fetched, waiting for the entries before them, by first index.
+  map<int64_t, unique_ptr<Fetch>> fetched_;
+
+  DISALLOW_COPY_AND_ASSIGN(BulkEntriesDownload);
+};
+
+
+// Replaces |path| with |contents|, atomically.
+static void ReplaceFile(const string& path, const string& contents) {
+  const string tmp_path(path + ".tmp");
+  {
+    std::ofstream out(tmp_path.c_str(),
+                      std::ios::out | std::ios::trunc | std::ios::binary);
+    out << contents;
+    PCHECK(out.good()) << "Could not write " << tmp_path;
+  }
+  PCHECK(rename(tmp_path.c_str(), path.c_str()) == 0) << "Could not rename "
+                                                      << tmp_path;
+}
+
+
+// Appends the entries downloaded to |out|. Each entry is written as
+// its index (8 bytes), then its MerkleTreeLeaf and LogEntry protobufs,
+// each preceded by its size (4 bytes). After every batch, the file is
+// synced and the index of the next entry and the size of the file are
+// recorded in the checkpoint file.
+class EntriesFileWriter {
+ public:
+  EntriesFileWriter(FILE* out, const string& checkpoint_path)
+      : out_(CHECK_NOTNULL(out)), checkpoint_path_(checkpoint_path) {
+  }
+
+  void Write(int64_t first, const vector<AsyncLogClient::Entry>& entries) {
+    for (size_t i = 0; i < entries.size(); ++i) {
+      WriteEntry(first + i, entries[i]);
+    }
+    Checkpoint(first + entries.size());
+  }
+
+ private:
+  void WriteEntry(int64_t index, const AsyncLogClient::Entry& entry) {
+    string leaf;
+    string log_entry;
+    CHECK(entry.leaf.SerializeToString(&leaf));
+    CHECK(entry.entry.SerializeToString(&log_entry));
+    const string record(Serializer::SerializeUint(index, 8) +
+                        Serializer::SerializeUint(leaf.size(), 4) + leaf +
+                        Serializer::SerializeUint(log_entry.size(), 4) +
+                        log_entry);
+    PCHECK(fwrite(record.data(), 1, record.size(), out_) == record.size())
+        << "Could not write to " << FLAGS_get_entries_out;
+  }
+
+  void Checkpoint(int64_t next) {
+    PCHECK(fflush(out_) == 0) << "Could not write to "
+                              << FLAGS_get_entries_out;
+    PCHECK(fsync(fileno(out_)) == 0) << "Could not sync "
+                                     << FLAGS_get_entries_out;
+    std::ostringstream checkpoint;
+    checkpoint << next << ' ' << ftello(out_) << '\n';
+    ReplaceFile(checkpoint_path_, checkpoint.str());
+  }
+
+  FILE* const out_;
+  const string checkpoint_path_;
+
+  DISALLOW_COPY_AND_ASSIGN(EntriesFileWriter);
+};
+
+
+// Calls |start| with a callback, and runs |base| until it is called.
+static AsyncLogClient::Status WaitForClient(
+    libevent::Base* base,
+    const std::function<void(const AsyncLogClient::Callback&)>& start) {
+  AsyncLogClient::Status status(AsyncLogClient::UNKNOWN_ERROR);
+  bool done(false);
+  start([&status, &done](AsyncLogClient::Status s) {
+    status = s;
+    done = true;
+  });
+  while (!done) {
+    base->DispatchOnce();
+  }
+  return status;
+}
+
+
+int GetEntriesBulk() {
+  CHECK_NE(FLAGS_ct_server, "");
+  CHECK_GT(FLAGS_get_entries_concurrency, 0);
+  CHECK_GT(FLAGS_get_entries_batch_size, 0);
+
+  const string checkpoint_path(FLAGS_get_entries_out + ".checkpoint");
+  int64_t first(FLAGS_get_first);
+  off_t offset(0);
+  string checkpoint;
+  if (util::ReadTextFile(checkpoint_path, &checkpoint)) {
+    std::istringstream in(checkpoint);
+    CHECK(in >> first >> offset) << "Invalid checkpoint file "
+                                 << checkpoint_path;
+    LOG(INFO) << "Resuming the download at entry " << first;
+  }
+
+  // Anything past the checkpoint might be incomplete.
+  FILE* const out(
+      fopen(FLAGS_get_entries_out.c_str(), offset > 0 ? "r+b" : "wb"));
+  PCHECK(out) << "Could not open " << FLAGS_get_entries_out;
+  PCHECK(ftruncate(fileno(out), offset) == 0)
+      << "Could not truncate " << FLAGS_get_entries_out;
+  PCHECK(fseeko(out, offset, SEEK_SET) == 0);
+
+  const unique_ptr<libevent::Base> base(new libevent::Base);
+  ThreadPool pool;
+  UrlFetcher fetcher(base.get(), &pool);
+  AsyncLogClient client(base.get(), &fetcher, FLAGS_ct_server);
+
+  int64_t last(FLAGS_get_last);
+  if (last < 0) {
+    SignedTreeHead sth;
+    CHECK_EQ(AsyncLogClient::OK,
+             WaitForClient(base.get(),
+                           [&client, &sth](const AsyncLogClient::Callback& cb) {
+                             client.GetSTH(&sth, cb);
+                           }))
+        << "Could not get the STH";
+    last = sth.tree_size() - 1;
+  }
+
+  EntriesFileWriter writer(out, checkpoint_path);
+  BulkEntriesDownload download(base.get(), &client, first, last,
+                               bind(&EntriesFileWriter::Write, &writer, _1,
+                                    std::placeholders::_2));
+  const bool ok(download.Run());
+  PCHECK(fclose(out) == 0) << "Could not close " << FLAGS_get_entries_out;
+
+  return ok ? 0 : 1;
+}
+
+
+// Entries between the saves of the monitor state while catching up.
+static const int64_t kMonitorSaveInterval = 100000;
+
+
+// The state of the monitor, kept in --monitor_state between runs: the
+// last STH verified, and the frontier of the tree built from the
+// entries, which can be ahead of the STH when it was saved in the
+// middle of a download (it is then checked against the next STH).
+struct MonitorState {
+  SignedTreeHead sth;
+  string frontier;
+};
+
+
+// The STH, as 4 bytes of size followed by the protobuf, then the
+// frontier.
+static bool ReadMonitorState(const string& path, MonitorState* state) {
+  string data;
+  if (!util::ReadBinaryFile(path, &data)) {
+    return false;
+  }
+  uint64_t sth_size;
+  CHECK_EQ(DeserializeResult::OK,
+           Deserializer::DeserializeUint(data.substr(0, 4), 4, &sth_size))
+      << "Invalid monitor state " << path;
+  CHECK_LE(4 + sth_size, data.size()) << "Invalid monitor state " << path;
+  CHECK(state->sth.ParseFromString(data.substr(4, sth_size)))
+      << "Invalid monitor state " << path;
+  state->frontier = data.substr(4 + sth_size);
+  return true;
+}
+
+
+static void WriteMonitorState(const string& path, const MonitorState& state) {
+  string sth;
+  CHECK(state.sth.SerializeToString(&sth));
+  ReplaceFile(path, Serializer::SerializeUint(sth.size(), 4) + sth +
+                        state.frontier);
+}
+
+
+// Follows the log: for every new STH, checks its signature and its
+// consistency with the last one, downloads only the new entries, and
+// checks that they build up to its root. The tree is kept as a
+// CompactMerkleTree frontier in --monitor_state, so the work is
+// proportional to the growth of the log, across runs too. Returns 1 as
+// soon as a check fails.
+int Monitor() {
+  CHECK_NE(FLAGS_ct_server, "");
+  CHECK(!FLAGS_monitor_state.empty()) << "Please give a --monitor_state";
+  CHECK_GT(FLAGS_get_entries_concurrency, 0);
+  CHECK_GT(FLAGS_get_entries_batch_size, 0);
+  const unique_ptr<LogVerifier> verifier(GetLogVerifierFromFlags());
+
+  unique_ptr<CompactMerkleTree> tree(
+      new CompactMerkleTree(unique_ptr<SerialHasher>(new Sha256Hasher)));
+  MonitorState state;
+  bool have_sth(false);
+  if (ReadMonitorState(FLAGS_monitor_state, &state)) {
+    CHECK(tree->LoadFrontier(state.frontier))
+        << "Invalid frontier in " << FLAGS_monitor_state;
+    have_sth = state.sth.has_timestamp();
+    if (have_sth &&
+        tree->LeafCount() == static_cast<size_t>(state.sth.tree_size())) {
+      CHECK_EQ(util::HexString(state.sth.sha256_root_hash()),
+               util::HexString(tree->CurrentRoot()))
+          << "The frontier in " << FLAGS_monitor_state
+          << " does not match its STH";
+    }
+    LOG(INFO) << "Resuming with " << tree->LeafCount() << " entries, and the "
+              << "STH of size " << state.sth.tree_size();
+  }
+
+  const unique_ptr<libevent::Base> base(new libevent::Base);
+  ThreadPool pool;
+  UrlFetcher fetcher(base.get(), &pool);
+  AsyncLogClient client(base.get(), &fetcher, FLAGS_ct_server);
+  const LeafHasher leaf_hasher(unique_ptr<SerialHasher>(new Sha256Hasher),
+                               &pool);
+
+  while (true) {
+    SignedTreeHead sth;
+    const AsyncLogClient::Status status(WaitForClient(
+        base.get(), [&client, &sth](const AsyncLogClient::Callback& cb) {
+          client.GetSTH(&sth, cb);
+        }));
+    if (status != AsyncLogClient::OK) {
+      LOG(WARNING) << "Could not get the STH: " << ClientStatusString(status);
+    } else if (!have_sth || sth.timestamp() > state.sth.timestamp()) {
+      const LogVerifier::LogVerifyResult result(
+          verifier->VerifySignedTreeHead(sth));
+      if (result != LogVerifier::VERIFY_OK) {
+        LOG(ERROR) << "Invalid STH: " << LogVerifier::VerifyResultString(result)
+                   << "\n" << sth.DebugString();
+        return 1;
+      }
+      if (have_sth) {
+        if (sth.tree_size() < state.sth.tree_size()) {
+          LOG(ERROR) << "The log shrank from " << state.sth.tree_size()
+                     << " to " << sth.tree_size() << " entries";
+          return 1;
+        }
+        vector<string> proof;
+        if (WaitForClient(base.get(),
+                          [&](const AsyncLogClient::Callback& cb) {
+                            client.GetSTHConsistency(state.sth.tree_size(),
+                                                     sth.tree_size(), &proof,
+                                                     cb);
+                          }) != AsyncLogClient::OK) {
+          LOG(WARNING) << "Could not get the consistency proof";
+          sleep(FLAGS_monitor_sleep_time_secs);
+          continue;
+        }
+        if (!verifier->VerifyConsistency(state.sth, sth, proof)) {
+          LOG(ERROR) << "Consistency proof from " << state.sth.tree_size()
+                     << " to " << sth.tree_size() << " does not verify";
+          return 1;
+        }
+      }
+
+      if (static_cast<size_t>(sth.tree_size()) < tree->LeafCount()) {
+        // The entries saved past the last STH are not in this one, so
+        // they cannot be trusted: start again from scratch.
+        LOG(WARNING) << "The tree is ahead of the STH, downloading all the "
+                     << "entries again";
+        tree.reset(
+            new CompactMerkleTree(unique_ptr<SerialHasher>(new Sha256Hasher)));
+      }
+
+      // Save the progress of long downloads every so often (but not
+      // while the tree is behind the STH saved with it).
+      int64_t next_save(
+          std::max<int64_t>(tree->LeafCount() + kMonitorSaveInterval,
+                            state.sth.tree_size()));
+      BulkEntriesDownload download(
+          base.get(), &client, tree->LeafCount(), sth.tree_size() - 1,
+          [&](int64_t first, const vector<AsyncLogClient::Entry>& entries) {
+            CHECK_EQ(tree->LeafCount(), static_cast<size_t>(first));
+            vector<LoggedEntry> leaves(entries.size());
+            for (size_t i = 0; i < entries.size(); ++i) {
+              CHECK(leaves[i].CopyFromClientLogEntry(entries[i]))
+                  << "Invalid entry " << first + i;
+            }
+            tree->AddLeafHashes(leaf_hasher.HashLeaves(leaves));
+            if (static_cast<int64_t>(tree->LeafCount()) >= next_save) {
+              state.frontier = tree->SerializeFrontier();
+              WriteMonitorState(FLAGS_monitor_state, state);
+              next_save = tree->LeafCount() + kMonitorSaveInterval;
+            }
+          });
+      if (!download.Run()) {
+        LOG(WARNING) << "Could not get all the entries up to "
+                     << sth.tree_size();
+      } else if (util::HexString(tree->CurrentRoot()) !=
+                 util::HexString(sth.sha256_root_hash())) {
+        LOG(ERROR) << "The entries do not build up to the root of the STH:\n"
+                   << sth.DebugString();
+        return 1;
+      } else {
+        LOG(INFO) << "Verified the STH of size " << sth.tree_size()
+                  << " at " << sth.timestamp();
+        state.sth = sth;
+        state.frontier = tree->SerializeFrontier();
+        WriteMonitorState(FLAGS_monitor_state, state);
+        have_sth = true;
+      }
+    }
+
+    sleep(FLAGS_monitor_sleep_time_secs);
+  }
+}
+
+
 int GetRoots() {
   HTTPLogClient client(FLAGS_ct_server);
 
@@ -958,8 +1745,12 @@ int main(int argc, char** argv) {
     if ((!want_fail && result != SSLClient::OK) ||
         (want_fail && result != SSLClient::HANDSHAKE_FAILED))
       ret = 1;
+  } else if (cmd == "scan") {
+    ScanServers();
   } else if (cmd == "upload") {
     ret = Upload();
+  } else if (cmd == "bulk_upload") {
+    ret = BulkUploadSubmissions();
   } else if (cmd == "audit") {
     ret = Audit();
   } else if (cmd == "consistency") {
@@ -977,11 +1768,17 @@ int main(int argc, char** argv) {
   } else if (cmd == "wrap_embedded") {
     WrapEmbedded();
   } else if (cmd == "get_entries") {
-    GetEntries();
+    if (FLAGS_get_entries_out.empty()) {
+      GetEntries();
+    } else {
+      ret = GetEntriesBulk();
+    }
   } else if (cmd == "get_roots") {
     ret = GetRoots();
   } else if (cmd == "sth") {
     ret = GetSTH();
+  } else if (cmd == "monitor") {
+    ret = Monitor();
   } else {
     std::cout << google::ProgramUsage();
     ret = 1;
@@ -0,0 +1,444 @@
+#include "client/ssl_scanner.h"
+
+#include <event2/bufferevent_ssl.h>
+#include <glog/logging.h>
+#include <openssl/err.h>
+#ifndef OPENSSL_IS_BORINGSSL
+#include <openssl/ocsp.h>
+#endif
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+#include "log/cert.h"
+#include "log/cert_submission_handler.h"
+#include "log/ct_extensions.h"
+#include "merkletree/serial_hasher.h"
+#include "proto/serializer.h"
+#include "util/openssl_scoped_types.h"
+#include "util/util.h"
+
+using cert_trans::serialization::DeserializeResult;
+using ct::LogEntry;
+using ct::SignedCertificateTimestamp;
+using ct::SignedCertificateTimestampList;
+using std::bind;
+using std::chrono::duration;
+using std::placeholders::_1;
+using std::string;
+using std::unique_ptr;
+using util::StatusOr;
+
+namespace cert_trans {
+namespace {
+
+const uint16_t CT_EXTENSION_TYPE = 18;
+
+// The verification results are dropped when there are this many of
+// them, which should only happen on very large scans.
+const size_t kMaxCachedResults = 1 << 16;
+
+
+#ifndef OPENSSL_IS_BORINGSSL
+// Returns the serialized SCT list of the OCSP response stapled by the
+// server, or an empty string if there is none.
+string OcspSCTList(SSL* ssl) {
+  const unsigned char* resp(nullptr);
+  const long resp_len(SSL_get_tlsext_status_ocsp_resp(ssl, &resp));
+  if (resp_len <= 0 || !resp) {
+    return "";
+  }
+
+  unique_ptr<OCSP_RESPONSE, void (*)(OCSP_RESPONSE*)> response(
+      d2i_OCSP_RESPONSE(nullptr, &resp, resp_len), OCSP_RESPONSE_free);
+  if (!response) {
+    return "";
+  }
+  unique_ptr<OCSP_BASICRESP, void (*)(OCSP_BASICRESP*)> basic(
+      OCSP_response_get1_basic(response.get()), OCSP_BASICRESP_free);
+  if (!basic) {
+    return "";
+  }
+
+  // RFC 6962, section 3.3: the SCT list is in an extension of the
+  // single response, as an OCTET STRING wrapped in another one.
+  unique_ptr<ASN1_OBJECT, void (*)(ASN1_OBJECT*)> oid(
+      OBJ_txt2obj("1.3.6.1.4.1.11129.2.4.5", 1), ASN1_OBJECT_free);
+  CHECK(oid);
+  for (int i = 0; i < OCSP_resp_count(basic.get()); ++i) {
+    OCSP_SINGLERESP* const single(OCSP_resp_get0(basic.get(), i));
+    const int index(OCSP_SINGLERESP_get_ext_by_OBJ(single, oid.get(), -1));
+    if (index < 0) {
+      continue;
+    }
+    const ASN1_OCTET_STRING* const outer(
+        X509_EXTENSION_get_data(OCSP_SINGLERESP_get_ext(single, index)));
+    const unsigned char* data(outer->data);
+    ScopedASN1_OCTET_STRING inner(
+        d2i_ASN1_OCTET_STRING(nullptr, &data, outer->length));
+    if (!inner) {
+      continue;
+    }
+    return string(reinterpret_cast<const char*>(inner->data), inner->length);
+  }
+
+  return "";
+}
+#else
+string OcspSCTList(SSL*) {
+  return "";
+}
+#endif
+
+
+}  // namespace
+
+
+class SSLScanner::Connection {
+ public:
+  Connection(SSLScanner* scanner, const string& host, uint16_t port,
+             const ResultCallback& done);
+
+  void Start();
+
+  // Called from SSLScanner::ExtensionCallback().
+  void SetTLSExtension(const string& scts) {
+    tls_scts_ = scts;
+  }
+
+ private:
+  ~Connection() = default;
+
+  static void EventCallback(bufferevent* bev, short events, void* arg);
+  void HandshakeDone();
+  void Finish(ScanStatus status);
+
+  SSLScanner* const scanner_;
+  const ResultCallback done_;
+  Result result_;
+  // Owned by |bev_|.
+  SSL* ssl_;
+  bufferevent* bev_;
+  libevent::Event timeout_;
+  bool finished_;
+  string tls_scts_;
+
+  DISALLOW_COPY_AND_ASSIGN(Connection);
+};
+
+
+SSLScanner::Connection::Connection(SSLScanner* scanner, const string& host,
+                                   uint16_t port, const ResultCallback& done)
+    : scanner_(CHECK_NOTNULL(scanner)),
+      done_(done),
+      ssl_(CHECK_NOTNULL(SSL_new(scanner_->ctx_.get()))),
+      bev_(nullptr),
+      timeout_(*scanner_->base_, -1, 0,
+               [this](evutil_socket_t, short) { Finish(TIMED_OUT); }),
+      finished_(false) {
+  result_.host = host;
+  result_.port = port;
+  SSL_set_app_data(ssl_, this);
+  SSL_set_tlsext_host_name(ssl_, host.c_str());
+  SSL_set_tlsext_status_type(ssl_, TLSEXT_STATUSTYPE_ocsp);
+}
+
+
+void SSLScanner::Connection::Start() {
+  bev_ = scanner_->base_->SslSocketNew(ssl_);
+  bufferevent_openssl_set_allow_dirty_shutdown(bev_, 1);
+  bufferevent_setcb(bev_, nullptr, nullptr, &EventCallback, this);
+  timeout_.Add(scanner_->timeout_);
+
+  if (bufferevent_socket_connect_hostname(bev_, scanner_->base_->GetDns(),
+                                          AF_UNSPEC, result_.host.c_str(),
+                                          result_.port) != 0) {
+    Finish(CONNECT_FAILED);
+  }
+}
+
+
+// static
+void SSLScanner::Connection::EventCallback(bufferevent*, short events,
+                                           void* arg) {
+  Connection* const conn(static_cast<Connection*>(arg));
+  if (events & BEV_EVENT_CONNECTED) {
+    conn->HandshakeDone();
+  } else if (events & (BEV_EVENT_ERROR | BEV_EVENT_EOF)) {
+    // Having sent some of the ClientHello means that we got as far as
+    // the handshake. The OpenSSL error cannot tell: libevent reports
+    // a refused connection as one too (SSL_ERROR_SYSCALL).
+    BIO* const wbio(SSL_get_wbio(conn->ssl_));
+    conn->Finish(wbio && BIO_number_written(wbio) > 0 ? HANDSHAKE_FAILED
+                                                     : CONNECT_FAILED);
+  }
+}
+
+
+void SSLScanner::Connection::HandshakeDone() {
+  // This includes the leaf certificate, on the client side.
+  STACK_OF(X509)* const peer_chain(SSL_get_peer_cert_chain(ssl_));
+  CertChain chain;
+  for (int i = 0; peer_chain && i < sk_X509_num(peer_chain); ++i) {
+    chain.AddCert(
+        Cert::FromX509(ScopedX509(X509_dup(sk_X509_value(peer_chain, i)))));
+  }
+  if (!chain.IsLoaded()) {
+    Finish(HANDSHAKE_FAILED);
+    return;
+  }
+
+  // The SCTs from the TLS extension and OCSP are for the certificate
+  // itself, those embedded in it for the precertificate.
+  string der_cert;
+  if (chain.LeafCert()->DerEncoding(&der_cert).ok()) {
+    LogEntry entry;
+    entry.set_type(ct::X509_ENTRY);
+    entry.mutable_x509_entry()->set_leaf_certificate(der_cert);
+    if (!tls_scts_.empty()) {
+      result_.tls_scts = scanner_->CheckSCTList(entry, tls_scts_, &result_);
+    }
+    const string ocsp_scts(OcspSCTList(ssl_));
+    if (!ocsp_scts.empty()) {
+      result_.ocsp_scts =
+          scanner_->CheckSCTList(entry, ocsp_scts, &result_);
+    }
+  }
+
+  const StatusOr<bool> has_embedded_scts(chain.LeafCert()->HasExtension(
+      NID_ctEmbeddedSignedCertificateTimestampList));
+  string embedded_scts;
+  LogEntry precert_entry;
+  if (has_embedded_scts.ok() && has_embedded_scts.ValueOrDie() &&
+      chain.LeafCert()
+          ->OctetStringExtensionData(
+              NID_ctEmbeddedSignedCertificateTimestampList, &embedded_scts)
+          .ok() &&
+      CertSubmissionHandler::X509ChainToEntry(chain, &precert_entry)) {
+    result_.cert_scts =
+        scanner_->CheckSCTList(precert_entry, embedded_scts, &result_);
+  }
+
+  Finish(OK);
+}
+
+
+void SSLScanner::Connection::Finish(ScanStatus status) {
+  if (finished_) {
+    return;
+  }
+  finished_ = true;
+
+  result_.status = status;
+  if (bev_) {
+    // Frees |ssl_| too.
+    bufferevent_free(bev_);
+    bev_ = nullptr;
+  } else {
+    SSL_free(ssl_);
+  }
+  ssl_ = nullptr;
+
+  // This might be running from the callback of |timeout_|, which
+  // cannot be freed from there.
+  scanner_->base_->Add([this]() {
+    done_(result_);
+    delete this;
+  });
+}
+
+
+SSLScanner::SSLScanner(libevent::Base* base, const duration<double>& timeout)
+    : base_(CHECK_NOTNULL(base)),
+      timeout_(timeout),
+      ctx_(CHECK_NOTNULL(SSL_CTX_new(SSLv23_client_method()))) {
+  // The chain is not checked, so that the SCTs of every server are
+  // looked at.
+  SSL_CTX_set_verify(ctx_.get(), SSL_VERIFY_NONE, NULL);
+
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+  SSL_CTX_add_client_custom_ext(ctx_.get(), CT_EXTENSION_TYPE, NULL, NULL,
+                                NULL, ExtensionCallback, NULL);
+#else
+  LOG(WARNING) << "OpenSSL version is too low to check the Certificate "
+                  "Transparency TLS extension";
+#endif
+}
+
+
+SSLScanner::~SSLScanner() {
+}
+
+
+void SSLScanner::AddLogVerifier(LogVerifier* verifier) {
+  CHECK_NOTNULL(verifier);
+  const string key_id(verifier->KeyID());
+  CHECK(verifiers_.emplace(key_id, unique_ptr<LogVerifier>(verifier)).second)
+      << "duplicate log key ID " << util::ToBase64(key_id);
+}
+
+
+void SSLScanner::Scan(const string& host, uint16_t port,
+                      const ResultCallback& done) {
+  (new Connection(this, host, port, done))->Start();
+}
+
+
+// static
+const char* SSLScanner::StatusString(ScanStatus status) {
+  switch (status) {
+    case OK:
+      return "ok";
+    case CONNECT_FAILED:
+      return "connect_failed";
+    case HANDSHAKE_FAILED:
+      return "handshake_failed";
+    case TIMED_OUT:
+      return "timed_out";
+  }
+  LOG(FATAL) << "unknown status " << status;
+  return "";
+}
+
+
+// static
+int SSLScanner::ExtensionCallback(SSL* s, unsigned ext_type,
+                                  const unsigned char* in, size_t inlen, int*,
+                                  void*) {
+  CHECK_EQ(ext_type, CT_EXTENSION_TYPE);
+  static_cast<Connection*>(SSL_get_app_data(s))
+      ->SetTLSExtension(string(reinterpret_cast<const char*>(in), inlen));
+  return 1;
+}
+
+
+int SSLScanner::CheckSCTList(const LogEntry& entry, const string& scts,
+                             Result* result) {
+  SignedCertificateTimestampList sct_list;
+  if (Deserializer::DeserializeSCTList(scts, &sct_list) !=
+      DeserializeResult::OK) {
+    VLOG(1) << result->host << ": failed to parse SCT list";
+    return 0;
+  }
+
+  const string leaf_hash(
+      Sha256Hasher::Sha256Digest(Serializer::LeafData(entry)));
+  for (int i = 0; i < sct_list.sct_list_size(); ++i) {
+    SignedCertificateTimestamp sct;
+    if (Deserializer::DeserializeSCT(sct_list.sct_list(i), &sct) !=
+        DeserializeResult::OK) {
+      continue;
+    }
+    if (VerifySCT(entry, leaf_hash, sct, sct_list.sct_list(i)) ==
+        LogVerifier::VERIFY_OK) {
+      ++result->valid_scts;
+      result->valid_log_ids.insert(sct.id().key_id());
+    }
+  }
+
+  return sct_list.sct_list_size();
+}
+
+
+LogVerifier::LogVerifyResult SSLScanner::VerifySCT(
+    const LogEntry& entry, const string& leaf_hash,
+    const SignedCertificateTimestamp& sct, const string& token) {
+  const auto verifier(verifiers_.find(sct.id().key_id()));
+  if (verifier == verifiers_.end()) {
+    return LogVerifier::INVALID_SIGNATURE;
+  }
+
+  const string key(leaf_hash + token);
+  const auto cached(results_.find(key));
+  if (cached != results_.end()) {
+    return cached->second;
+  }
+
+  const LogVerifier::LogVerifyResult result(
+      verifier->second->VerifySignedCertificateTimestamp(entry, sct));
+  if (results_.size() >= kMaxCachedResults) {
+    results_.clear();
+  }
+  results_.emplace(key, result);
+  return result;
+}
+
+
+bool ParseScanTarget(const string& line, string* host, uint16_t* port) {
+  CHECK_NOTNULL(host);
+  CHECK_NOTNULL(port);
+  const size_t colon(line.rfind(':'));
+  if (colon == string::npos) {
+    *host = line;
+    *port = 443;
+    return true;
+  }
+
+  char* end;
+  const unsigned long value(strtoul(line.c_str() + colon + 1, &end, 10));
+  if (*end != '\0' || value == 0 || value > 65535) {
+    return false;
+  }
+  *host = line.substr(0, colon);
+  *port = value;
+  return true;
+}
+
+
+SSLScanList::SSLScanList(libevent::Base* base, const ScanFunction& scan,
+                         int concurrency, std::istream* list,
+                         const SSLScanner::ResultCallback& done)
+    : base_(CHECK_NOTNULL(base)),
+      scan_(scan),
+      concurrency_(concurrency),
+      list_(CHECK_NOTNULL(list)),
+      done_(done),
+      end_of_list_(false),
+      num_scanning_(0) {
+  CHECK(scan_);
+  CHECK_GT(concurrency_, 0);
+  CHECK(done_);
+}
+
+
+void SSLScanList::Run() {
+  StartScans();
+  while (num_scanning_ > 0) {
+    base_->DispatchOnce();
+  }
+}
+
+
+void SSLScanList::StartScans() {
+  string line;
+  while (num_scanning_ < concurrency_ && !end_of_list_) {
+    if (!std::getline(*list_, line)) {
+      end_of_list_ = true;
+      break;
+    }
+    if (line.empty()) {
+      continue;
+    }
+
+    string host;
+    uint16_t port;
+    if (!ParseScanTarget(line, &host, &port)) {
+      LOG(ERROR) << "Invalid port: " << line;
+      continue;
+    }
+
+    ++num_scanning_;
+    scan_(host, port, bind(&SSLScanList::ScanDone, this, _1));
+  }
+}
+
+
+void SSLScanList::ScanDone(const SSLScanner::Result& result) {
+  done_(result);
+  --num_scanning_;
+  StartScans();
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,156 @@
+#ifndef CERT_TRANS_CLIENT_SSL_SCANNER_H_
+#define CERT_TRANS_CLIENT_SSL_SCANNER_H_
+
+#include <openssl/ssl.h>
+#include <stdint.h>
+#include <chrono>
+#include <functional>
+#include <istream>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+
+#include "base/macros.h"
+#include "log/log_verifier.h"
+#include "proto/ct.pb.h"
+#include "util/libevent_wrapper.h"
+#include "util/openssl_scoped_ssl_types.h"
+
+namespace cert_trans {
+
+
+// Does the handshake of SSLClient with many servers at a time, on a
+// libevent::Base rather than with one blocking socket each, and
+// checks the SCTs they present against a set of logs. Unlike
+// SSLClient, the certificate chain is not verified: this is meant for
+// surveying the SCTs served, not for trusting the servers.
+//
+// The SCTs are looked for in the TLS extension, in a stapled OCSP
+// response, and embedded in the leaf certificate. The verification
+// results are cached, as many hosts usually serve the same
+// certificates.
+class SSLScanner {
+ public:
+  enum ScanStatus {
+    OK = 0,
+    CONNECT_FAILED = 1,
+    HANDSHAKE_FAILED = 2,
+    TIMED_OUT = 3,
+  };
+
+  struct Result {
+    Result()
+        : port(0),
+          status(OK),
+          tls_scts(0),
+          ocsp_scts(0),
+          cert_scts(0),
+          valid_scts(0) {
+    }
+
+    std::string host;
+    uint16_t port;
+    ScanStatus status;
+    // The number of SCTs found in each place.
+    int tls_scts;
+    int ocsp_scts;
+    int cert_scts;
+    // How many of them verified with one of the known logs.
+    int valid_scts;
+    // The key IDs of the logs with a valid SCT.
+    std::set<std::string> valid_log_ids;
+  };
+
+  typedef std::function<void(const Result&)> ResultCallback;
+
+  SSLScanner(libevent::Base* base,
+             const std::chrono::duration<double>& timeout);
+  ~SSLScanner();
+
+  // Adds a log to check SCTs against, taking ownership of the
+  // verifier. Must be called before any Scan().
+  void AddLogVerifier(LogVerifier* verifier);
+
+  // Connects to |host|:|port| and calls |done| with the result, from
+  // the event thread. Must be called from the event thread, or before
+  // |base| is dispatched.
+  void Scan(const std::string& host, uint16_t port,
+            const ResultCallback& done);
+
+  static const char* StatusString(ScanStatus status);
+
+ private:
+  class Connection;
+
+  static int ExtensionCallback(SSL* s, unsigned ext_type,
+                               const unsigned char* in, size_t inlen, int* al,
+                               void* arg);
+
+  // Verifies the serialized SCT list |scts| against |entry|, adding
+  // to the counts of |result|, and returns how many SCTs it had.
+  int CheckSCTList(const ct::LogEntry& entry, const std::string& scts,
+                   Result* result);
+  LogVerifier::LogVerifyResult VerifySCT(
+      const ct::LogEntry& entry, const std::string& leaf_hash,
+      const ct::SignedCertificateTimestamp& sct, const std::string& token);
+
+  libevent::Base* const base_;
+  const std::chrono::duration<double> timeout_;
+  ScopedSSL_CTX ctx_;
+
+  // By key ID.
+  std::map<std::string, std::unique_ptr<LogVerifier>> verifiers_;
+
+  // By the hash of the leaf data, followed by the serialized SCT.
+  // Only used on the event thread.
+  std::unordered_map<std::string, LogVerifier::LogVerifyResult> results_;
+
+  DISALLOW_COPY_AND_ASSIGN(SSLScanner);
+};
+
+
+// Parses a line of a list of servers to scan, "host" or "host:port",
+// the port defaulting to 443. Returns false if the port is invalid.
+bool ParseScanTarget(const std::string& line, std::string* host,
+                     uint16_t* port);
+
+
+// Scans the servers listed in |list|, one per line (see
+// ParseScanTarget(), the empty and invalid lines are skipped), with up
+// to |concurrency| scans at a time, and calls |done| with the result
+// of each as they complete.
+class SSLScanList {
+ public:
+  // Starts a scan and calls the callback once it is done, from the
+  // event thread, like SSLScanner::Scan().
+  typedef std::function<void(const std::string& host, uint16_t port,
+                             const SSLScanner::ResultCallback& done)>
+      ScanFunction;
+
+  SSLScanList(libevent::Base* base, const ScanFunction& scan, int concurrency,
+              std::istream* list, const SSLScanner::ResultCallback& done);
+
+  // Dispatches |base| until every server listed has been scanned.
+  void Run();
+
+ private:
+  void StartScans();
+  void ScanDone(const SSLScanner::Result& result);
+
+  libevent::Base* const base_;
+  const ScanFunction scan_;
+  const int concurrency_;
+  std::istream* const list_;
+  const SSLScanner::ResultCallback done_;
+  bool end_of_list_;
+  int num_scanning_;
+
+  DISALLOW_COPY_AND_ASSIGN(SSLScanList);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_CLIENT_SSL_SCANNER_H_
@@ -0,0 +1,240 @@
+#include "client/ssl_scanner.h"
+
+#include <arpa/inet.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "util/libevent_wrapper.h"
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::istringstream;
+using std::max;
+using std::set;
+using std::string;
+using std::vector;
+
+
+// Returns a socket listening on the loopback interface, and its port
+// in |port|.
+int Listen(uint16_t* port) {
+  const int fd(socket(AF_INET, SOCK_STREAM, 0));
+  PCHECK(fd >= 0);
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  PCHECK(bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+  PCHECK(listen(fd, 8) == 0);
+  socklen_t len(sizeof(addr));
+  PCHECK(getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) == 0);
+  *port = ntohs(addr.sin_port);
+  return fd;
+}
+
+
+class SSLScannerTest : public ::testing::Test {
+ protected:
+  SSLScannerTest() : scanner_(&base_, seconds(5)) {
+  }
+
+  SSLScanner::Result Scan(SSLScanner* scanner, uint16_t port) {
+    SSLScanner::Result result;
+    bool done(false);
+    scanner->Scan("127.0.0.1", port,
+                  [&result, &done](const SSLScanner::Result& r) {
+                    result = r;
+                    done = true;
+                  });
+    while (!done) {
+      base_.DispatchOnce();
+    }
+    EXPECT_EQ("127.0.0.1", result.host);
+    EXPECT_EQ(port, result.port);
+    return result;
+  }
+
+  libevent::Base base_;
+  SSLScanner scanner_;
+};
+
+
+// Scans with a fake scanner, which completes the scans in the order
+// they were started, and keeps track of how many are in flight.
+class SSLScanListTest : public ::testing::Test {
+ protected:
+  SSLScanListTest() : num_scanning_(0), max_scanning_(0) {
+  }
+
+  void Run(const string& list, int concurrency) {
+    istringstream in(list);
+    SSLScanList scan(&base_,
+                     [this](const string& host, uint16_t port,
+                            const SSLScanner::ResultCallback& done) {
+                       FakeScan(host, port, done);
+                     },
+                     concurrency, &in,
+                     [this](const SSLScanner::Result& result) {
+                       --num_scanning_;
+                       results_.push_back(result.host + ":" +
+                                          std::to_string(result.port));
+                     });
+    scan.Run();
+    EXPECT_EQ(0, num_scanning_);
+  }
+
+  void FakeScan(const string& host, uint16_t port,
+                const SSLScanner::ResultCallback& done) {
+    ++num_scanning_;
+    max_scanning_ = max(max_scanning_, num_scanning_);
+    SSLScanner::Result result;
+    result.host = host;
+    result.port = port;
+    base_.Add([done, result]() { done(result); });
+  }
+
+  libevent::Base base_;
+  int num_scanning_;
+  int max_scanning_;
+  vector<string> results_;
+};
+
+
+TEST(ParseScanTargetTest, ParsesHostAndPort) {
+  string host;
+  uint16_t port;
+  EXPECT_TRUE(ParseScanTarget("example.com", &host, &port));
+  EXPECT_EQ("example.com", host);
+  EXPECT_EQ(443, port);
+
+  EXPECT_TRUE(ParseScanTarget("example.com:8443", &host, &port));
+  EXPECT_EQ("example.com", host);
+  EXPECT_EQ(8443, port);
+
+  EXPECT_TRUE(ParseScanTarget("10.0.0.1:65535", &host, &port));
+  EXPECT_EQ("10.0.0.1", host);
+  EXPECT_EQ(65535, port);
+}
+
+
+TEST(ParseScanTargetTest, RejectsInvalidPorts) {
+  string host;
+  uint16_t port;
+  EXPECT_FALSE(ParseScanTarget("example.com:", &host, &port));
+  EXPECT_FALSE(ParseScanTarget("example.com:0", &host, &port));
+  EXPECT_FALSE(ParseScanTarget("example.com:65536", &host, &port));
+  EXPECT_FALSE(ParseScanTarget("example.com:443x", &host, &port));
+  EXPECT_FALSE(ParseScanTarget("example.com:https", &host, &port));
+}
+
+
+TEST_F(SSLScanListTest, ScansEveryValidLine) {
+  Run("a.com\n\nb.com:8443\nc.com:0\nd.com:https\ne.com\n", 10);
+  EXPECT_EQ((vector<string>{"a.com:443", "b.com:8443", "e.com:443"}),
+            results_);
+}
+
+
+TEST_F(SSLScanListTest, LimitsConcurrency) {
+  string list;
+  for (int i = 0; i < 10; ++i) {
+    list += "host" + std::to_string(i) + "\n";
+  }
+  Run(list, 3);
+  EXPECT_EQ(3, max_scanning_);
+  EXPECT_EQ(10U, results_.size());
+  EXPECT_EQ(10U, set<string>(results_.begin(), results_.end()).size());
+}
+
+
+TEST_F(SSLScanListTest, ScansOneAtATime) {
+  Run("a.com\nb.com\nc.com\n", 1);
+  EXPECT_EQ(1, max_scanning_);
+  EXPECT_EQ((vector<string>{"a.com:443", "b.com:443", "c.com:443"}),
+            results_);
+}
+
+
+TEST_F(SSLScanListTest, EmptyList) {
+  Run("", 3);
+  EXPECT_EQ(0, max_scanning_);
+  EXPECT_TRUE(results_.empty());
+}
+
+
+TEST_F(SSLScannerTest, ConnectFailed) {
+  // Nothing listens on the port once the socket is closed.
+  uint16_t port;
+  PCHECK(close(Listen(&port)) == 0);
+
+  EXPECT_EQ(SSLScanner::CONNECT_FAILED, Scan(&scanner_, port).status);
+}
+
+
+TEST_F(SSLScannerTest, HandshakeFailed) {
+  uint16_t port;
+  const int fd(Listen(&port));
+  // Answers the ClientHello with something that is not TLS.
+  libevent::Event listener(base_, fd, EV_READ, [](evutil_socket_t sock,
+                                                  short) {
+    const int conn(accept(sock, nullptr, nullptr));
+    PCHECK(conn >= 0);
+    const string garbage("HTTP/1.0 400 Bad Request\r\n\r\n");
+    PCHECK(write(conn, garbage.data(), garbage.size()) ==
+           static_cast<ssize_t>(garbage.size()));
+    PCHECK(close(conn) == 0);
+  });
+  listener.Add(std::chrono::duration<double>::zero());
+
+  const SSLScanner::Result result(Scan(&scanner_, port));
+  EXPECT_EQ(SSLScanner::HANDSHAKE_FAILED, result.status);
+  EXPECT_EQ(0, result.tls_scts);
+  EXPECT_EQ(0, result.valid_scts);
+  PCHECK(close(fd) == 0);
+}
+
+
+TEST_F(SSLScannerTest, TimedOut) {
+  // The kernel completes the TCP connection, but no one ever answers
+  // the ClientHello.
+  uint16_t port;
+  const int fd(Listen(&port));
+  SSLScanner scanner(&base_, milliseconds(100));
+
+  EXPECT_EQ(SSLScanner::TIMED_OUT, Scan(&scanner, port).status);
+  PCHECK(close(fd) == 0);
+}
+
+
+TEST(SSLScannerStatusTest, StatusString) {
+  EXPECT_STREQ("ok", SSLScanner::StatusString(SSLScanner::OK));
+  EXPECT_STREQ("connect_failed",
+               SSLScanner::StatusString(SSLScanner::CONNECT_FAILED));
+  EXPECT_STREQ("handshake_failed",
+               SSLScanner::StatusString(SSLScanner::HANDSHAKE_FAILED));
+  EXPECT_STREQ("timed_out", SSLScanner::StatusString(SSLScanner::TIMED_OUT));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
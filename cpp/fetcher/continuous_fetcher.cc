@@ -35,11 +35,12 @@ class ContinuousFetcherImpl : public ContinuousFetcher {
 
   void AddPeer(const string& node_id, const shared_ptr<Peer>& peer) override;
   void RemovePeer(const string& node_id) override;
+  void NewTreeSize(int64_t tree_size) override;
 
  private:
   void StartFetch(const unique_lock<mutex>& lock);
   void FetchDone(Task* task);
-  void FetchDelayDone(Task* task);
+  void FetchDelayDone(int64_t generation, Task* task);
 
   libevent::Base* const base_;
   Executor* const executor_;
@@ -52,6 +53,15 @@ class ContinuousFetcherImpl : public ContinuousFetcher {
 
   bool restart_fetch_;
   unique_ptr<Task> fetch_task_;
+  // The tree size the current fetch is going up to.
+  int64_t fetch_tree_size_;
+  // Set when a peer reported entries beyond |fetch_tree_size_| during
+  // the current fetch, so that another one follows it immediately.
+  bool fetch_again_;
+  // Incremented every time a fetch is started, so that the delay
+  // scheduled after the previous one is ignored if a notification
+  // started the next fetch early.
+  int64_t fetch_generation_;
 
   DISALLOW_COPY_AND_ASSIGN(ContinuousFetcherImpl);
 };
@@ -65,7 +75,10 @@ ContinuousFetcherImpl::ContinuousFetcherImpl(
       db_(CHECK_NOTNULL(db)),
       log_verifier_(CHECK_NOTNULL(log_verifier)),
       fetch_scts_(fetch_scts),
-      restart_fetch_(false) {
+      restart_fetch_(false),
+      fetch_tree_size_(-1),
+      fetch_again_(false),
+      fetch_generation_(0) {
 }
 
 
@@ -105,11 +118,31 @@ void ContinuousFetcherImpl::RemovePeer(const string& node_id) {
 }
 
 
+void ContinuousFetcherImpl::NewTreeSize(int64_t tree_size) {
+  unique_lock<mutex> lock(lock_);
+
+  if (tree_size <= db_->TreeSize()) {
+    return;
+  }
+
+  if (!fetch_task_) {
+    VLOG(1) << "peer has " << tree_size << " entries, fetching now";
+    StartFetch(lock);
+  } else if (tree_size > fetch_tree_size_) {
+    // Let the current fetch finish, the entries it is getting are
+    // still needed.
+    fetch_again_ = true;
+  }
+}
+
+
 void ContinuousFetcherImpl::StartFetch(const unique_lock<mutex>& lock) {
   CHECK(lock.owns_lock());
   CHECK(!fetch_task_);
 
   restart_fetch_ = false;
+  fetch_again_ = false;
+  ++fetch_generation_;
 
   unique_ptr<PeerGroup> peer_group(new PeerGroup(fetch_scts_));
   for (const auto& peer : peers_) {
@@ -119,7 +152,8 @@ void ContinuousFetcherImpl::StartFetch(const unique_lock<mutex>& lock) {
   fetch_task_.reset(
       new Task(bind(&ContinuousFetcherImpl::FetchDone, this, _1), executor_));
 
-  VLOG(1) << "starting fetch with tree size: " << peer_group->TreeSize();
+  fetch_tree_size_ = peer_group->TreeSize();
+  VLOG(1) << "starting fetch with tree size: " << fetch_tree_size_;
   FetchLogEntries(db_, move(peer_group), log_verifier_, fetch_task_.get());
 }
 
@@ -132,19 +166,19 @@ void ContinuousFetcherImpl::FetchDone(Task* task) {
   lock_guard<mutex> lock(lock_);
   fetch_task_.reset();
 
-  if (restart_fetch_) {
-    executor_->Add(
-        bind(&ContinuousFetcherImpl::FetchDelayDone, this, nullptr));
+  if (restart_fetch_ || fetch_again_) {
+    executor_->Add(bind(&ContinuousFetcherImpl::FetchDelayDone, this,
+                        fetch_generation_, nullptr));
   } else {
     base_->Delay(seconds(FLAGS_delay_between_fetches_seconds),
                  new Task(bind(&ContinuousFetcherImpl::FetchDelayDone, this,
-                               _1),
+                               fetch_generation_, _1),
                           executor_));
   }
 }
 
 
-void ContinuousFetcherImpl::FetchDelayDone(Task* task) {
+void ContinuousFetcherImpl::FetchDelayDone(int64_t generation, Task* task) {
   // "task" can be null, if we're restarting a fetch.
   if (task) {
     CHECK_EQ(util::Status::OK, task->status());
@@ -152,7 +186,9 @@ void ContinuousFetcherImpl::FetchDelayDone(Task* task) {
   }
 
   unique_lock<mutex> lock(lock_);
-  if (!fetch_task_) {
+  // If another fetch was started since this was scheduled, it will
+  // schedule its own.
+  if (!fetch_task_ && generation == fetch_generation_) {
     StartFetch(lock);
   }
 }
@@ -1,6 +1,7 @@
 #ifndef CERT_TRANS_FETCHER_CONTINUOUS_FETCHER_H_
 #define CERT_TRANS_FETCHER_CONTINUOUS_FETCHER_H_
 
+#include <stdint.h>
 #include <map>
 #include <memory>
 #include <mutex>
@@ -33,6 +34,12 @@ class ContinuousFetcher {
 
   virtual void RemovePeer(const std::string& node_id) = 0;
 
+  // Tells the fetcher that one of its peers now has |tree_size|
+  // entries. If that is more than the local database has, fetching
+  // starts right away instead of after the delay between fetches (or
+  // once the current fetch is done, if one is in progress).
+  virtual void NewTreeSize(int64_t tree_size) = 0;
+
  protected:
   ContinuousFetcher() = default;
 
@@ -2,20 +2,32 @@
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <map>
 #include <memory>
 #include <mutex>
 
 #include "base/macros.h"
 #include "log/log_verifier.h"
 #include "monitoring/monitoring.h"
+#include "util/logging.h"
 
 using cert_trans::AsyncLogClient;
 using cert_trans::LoggedEntry;
 using cert_trans::PeerGroup;
 using std::bind;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::deque;
 using std::lock_guard;
+using std::map;
+using std::max;
+using std::min;
 using std::move;
 using std::mutex;
+using std::pair;
 using std::placeholders::_1;
 using std::string;
 using std::to_string;
@@ -27,9 +39,22 @@ using util::Task;
 using util::TaskHold;
 
 DEFINE_int32(fetcher_concurrent_fetches, 2,
-             "number of concurrent fetch requests");
+             "initial number of concurrent fetch requests");
+DEFINE_int32(fetcher_max_concurrent_fetches, 32,
+             "maximum number of concurrent fetch requests");
+DEFINE_int32(fetcher_target_latency_ms, 5000,
+             "the number of concurrent fetch requests is reduced when one "
+             "takes longer than this many milliseconds");
 DEFINE_int32(fetcher_batch_size, 1000,
              "maximum number of entries to fetch per request");
+DEFINE_int32(fetcher_max_pending_entries, 20000,
+             "maximum number of fetched entries waiting to be verified or "
+             "written to the database, before fetching more");
+DEFINE_int32(fetcher_global_max_concurrent_fetches, 0,
+             "maximum number of concurrent fetch requests for all the logs "
+             "fetched by this process together, which take turns for them "
+             "(0 for no limit beyond --fetcher_max_concurrent_fetches for "
+             "each)");
 
 namespace cert_trans {
 
@@ -42,16 +67,93 @@ Counter<string>* num_invalid_entries_fetched =
 namespace {
 
 
+// Number of entries verified at a time, by a single thread.
+const size_t kVerifyChunkSize = 100;
+
+// Number of full responses after which a reduced batch size is
+// doubled again (towards --fetcher_batch_size).
+const int kFullBatchesBeforeGrowing = 16;
+
+
+// The fetch slots of --fetcher_global_max_concurrent_fetches. When
+// they are all in use, the logs wanting one queue up, each at most
+// once, so that a log with a large backlog does not starve the
+// others.
+class FetchBudget {
+ public:
+  static FetchBudget* Instance() {
+    static FetchBudget* const budget(new FetchBudget);
+    return budget;
+  }
+
+  // Returns true if a fetch can start right away, in which case
+  // Release() must be called once it is done.
+  bool TryAcquire() {
+    lock_guard<mutex> lock(lock_);
+    if (in_use_ >= FLAGS_fetcher_global_max_concurrent_fetches ||
+        !waiting_.empty()) {
+      return false;
+    }
+    ++in_use_;
+    return true;
+  }
+
+  // Returns |turn| once a slot is handed to it, which must be
+  // released the same way, or CANCELLED if it is cancelled first.
+  void Wait(Task* turn) {
+    {
+      lock_guard<mutex> lock(lock_);
+      waiting_.push_back(turn);
+    }
+    turn->WhenCancelled(bind(&FetchBudget::Cancel, this, turn));
+  }
+
+  void Release() {
+    lock_guard<mutex> lock(lock_);
+    if (waiting_.empty()) {
+      CHECK_GT(in_use_, 0);
+      --in_use_;
+      return;
+    }
+    // The slot goes straight to the next in line.
+    waiting_.front()->Return();
+    waiting_.pop_front();
+  }
+
+ private:
+  FetchBudget() : in_use_(0) {
+  }
+
+  void Cancel(Task* turn) {
+    lock_guard<mutex> lock(lock_);
+    const auto it(std::find(waiting_.begin(), waiting_.end(), turn));
+    if (it != waiting_.end()) {
+      waiting_.erase(it);
+      turn->Return(Status::CANCELLED);
+    }
+  }
+
+  mutex lock_;
+  int in_use_;
+  deque<Task*> waiting_;
+
+  DISALLOW_COPY_AND_ASSIGN(FetchBudget);
+};
+
+
 struct Range {
   enum State {
     HAVE,
     FETCHING,
+    // Fetched, but not verified or written to the database yet.
+    PROCESSING,
     WANT,
   };
 
   Range(State state, int64_t size, unique_ptr<Range> next = nullptr)
       : state_(state), size_(size), next_(move(next)) {
-    CHECK(state_ == HAVE || state_ == FETCHING || state_ == WANT);
+    CHECK(state_ == HAVE || state_ == FETCHING || state_ == PROCESSING ||
+          state_ == WANT);
     CHECK_GT(size_, 0);
   };
 
@@ -61,25 +163,142 @@ struct Range {
 };
 
 
+// Returns the ranges from |start| to |end|, HAVE for the entries
+// already in |db| and WANT for the others. The database only counts
+// contiguous entries in its TreeSize(), but batches can be written out
+// of order, so a previous run might have left some further along.
+unique_ptr<Range> RangesFromDatabase(const Database* db, int64_t start,
+                                     int64_t end) {
+  CHECK_LT(start, end);
+  vector<pair<Range::State, int64_t>> ranges;
+  int64_t index(start);
+  int64_t num_have(0);
+  const unique_ptr<Database::Iterator> it(db->ScanEntries(start));
+  LoggedEntry entry;
+  while (index < end && it->GetNextEntry(&entry)) {
+    const int64_t sequence_number(entry.sequence_number());
+    if (sequence_number >= end) {
+      break;
+    }
+    CHECK_GE(sequence_number, index);
+    if (sequence_number > index) {
+      ranges.emplace_back(Range::WANT, sequence_number - index);
+    }
+    if (!ranges.empty() && ranges.back().first == Range::HAVE) {
+      ++ranges.back().second;
+    } else {
+      ranges.emplace_back(Range::HAVE, 1);
+    }
+    ++num_have;
+    index = sequence_number + 1;
+  }
+  if (index < end) {
+    ranges.emplace_back(Range::WANT, end - index);
+  }
+
+  if (num_have > 0) {
+    LOG(INFO) << "already have " << num_have << " of the entries from "
+              << start << " to " << end << ", in " << ranges.size()
+              << " ranges";
+  }
+
+  unique_ptr<Range> retval;
+  for (auto range(ranges.rbegin()); range != ranges.rend(); ++range) {
+    retval.reset(new Range(range->first, range->second, move(retval)));
+  }
+  return retval;
+}
+
+
+// The entries fetched for a range, on their way to the database.
+struct FetchedBatch {
+  FetchedBatch(int64_t index, Range* range,
+               const vector<AsyncLogClient::Entry>* entries, Task* range_task)
+      : index_(index),
+        range_(range),
+        entries_(entries),
+        range_task_(range_task),
+        certs_(entries_->size()),
+        num_valid_(entries_->size()),
+        chunks_left_((entries_->size() + kVerifyChunkSize - 1) /
+                     kVerifyChunkSize) {
+  }
+
+  const int64_t index_;
+  Range* const range_;
+  const vector<AsyncLogClient::Entry>* const entries_;
+  Task* const range_task_;
+  // Filled in by the verification, in chunks.
+  vector<LoggedEntry> certs_;
+
+  mutex lock_;
+  // The entries before the first one that could not be converted.
+  size_t num_valid_;
+  size_t chunks_left_;
+  Status status_;
+};
+
+
 struct FetchState {
   FetchState(Database* db, unique_ptr<PeerGroup> peer_group,
              const LogVerifier* log_verifier, Task* task);
 
   void WalkEntries();
+  // Returns true if a fetch can be started, as far as
+  // --fetcher_global_max_concurrent_fetches goes. Otherwise, waits
+  // for a turn, which calls WalkEntries() again.
+  bool AcquireFetchSlot(const unique_lock<mutex>& lock);
+  void TurnCame(Task* turn);
   void FetchRange(const unique_lock<mutex>& lock, Range* current,
                   int64_t index, Task* range_task);
-  void WriteToDatabase(int64_t index, Range* range,
-                       const vector<AsyncLogClient::Entry>* retval,
-                       Task* range_task, Task* fetch_task);
+  void FetchDone(int64_t index, Range* range,
+                 const vector<AsyncLogClient::Entry>* retval,
+                 const steady_clock::time_point& started, Task* range_task,
+                 Task* fetch_task);
+  void VerifyChunk(FetchedBatch* batch, size_t begin, size_t end);
+  void BatchVerified(FetchedBatch* batch);
+  // Writes the verified batches, in order, until there are none left.
+  void WriteToDatabase();
+  // Adjusts the fetch window after a fetch of |requested| entries,
+  // sent at |started|, returned |received| of them (zero on error).
+  void UpdateWindow(const unique_lock<mutex>& lock,
+                    const steady_clock::time_point& started,
+                    int64_t requested, int64_t received);
 
   Database* const db_;
   const unique_ptr<PeerGroup> peer_group_;
   const LogVerifier* const log_verifier_;
   Task* const task_;
+  const int max_concurrent_fetches_;
+  const steady_clock::duration target_latency_;
 
   mutex lock_;
   int64_t start_;
   unique_ptr<Range> entries_;
+  // Fractional, so that it grows by about one for every round of
+  // fetches completing in time.
+  double concurrent_fetches_;
+  steady_clock::time_point last_decrease_;
+  // The largest batch the peers returned in full, once one returned
+  // fewer entries than asked for (they cap their responses). It grows
+  // back after a while, as that peer could be a flaky one, or one of
+  // several.
+  int64_t batch_size_;
+  // The number of responses of |batch_size_| entries in full since it
+  // was reduced or grown.
+  int full_batches_;
+  // The number of entries in PROCESSING ranges.
+  int64_t pending_entries_;
+  // The verified batches, by index, and whether a thread is writing
+  // them to the database.
+  map<int64_t, FetchedBatch*> verified_batches_;
+  bool writing_;
+  // Whether the fetches count against
+  // --fetcher_global_max_concurrent_fetches, and if so, the slots
+  // handed to us and not used yet, and whether we wait for one.
+  const bool budgeted_;
+  int granted_slots_;
+  bool waiting_turn_;
 
  private:
   DISALLOW_COPY_AND_ASSIGN(FetchState);
@@ -92,7 +311,21 @@ FetchState::FetchState(Database* db, unique_ptr<PeerGroup> peer_group,
       peer_group_(move(peer_group)),
       log_verifier_(CHECK_NOTNULL(log_verifier)),
       task_(CHECK_NOTNULL(task)),
-      start_(db_->TreeSize()) {
+      max_concurrent_fetches_(max(FLAGS_fetcher_concurrent_fetches,
+                                  FLAGS_fetcher_max_concurrent_fetches)),
+      target_latency_(milliseconds(FLAGS_fetcher_target_latency_ms)),
+      start_(db_->TreeSize()),
+      concurrent_fetches_(FLAGS_fetcher_concurrent_fetches),
+      last_decrease_(steady_clock::now()),
+      batch_size_(FLAGS_fetcher_batch_size),
+      full_batches_(0),
+      pending_entries_(0),
+      writing_(false),
+      budgeted_(FLAGS_fetcher_global_max_concurrent_fetches > 0),
+      granted_slots_(0),
+      waiting_turn_(false) {
+  CHECK_GT(FLAGS_fetcher_concurrent_fetches, 0);
+  CHECK_GT(FLAGS_fetcher_batch_size, 0);
   // TODO(pphaneuf): Might be better to get that as a parameter?
   const int64_t remote_tree_size(peer_group_->TreeSize());
   CHECK_GE(start_, 0);
@@ -105,15 +338,15 @@ FetchState::FetchState(Database* db, unique_ptr<PeerGroup> peer_group,
     return;
   }
 
-  entries_.reset(new Range(Range::WANT, remote_tree_size - start_));
+  entries_ = RangesFromDatabase(db_, start_, remote_tree_size);
 
   WalkEntries();
 }
 
 
 // This is called either when starting the fetching, or when fetching
-// a range completed. In that both cases, there's a hold on our task,
-// so it shouldn't go away from under us.
+// or writing a range completed. In all cases, there's a hold on our
+// task, so it shouldn't go away from under us.
 void FetchState::WalkEntries() {
   if (!task_->IsActive()) {
     // We've already stopped, for one reason or another, no point
@@ -146,10 +379,11 @@ void FetchState::WalkEntries() {
 
   int64_t index(start_);
   int num_fetch(0);
-  for (Range *current = entries_.get(); current;
+  bool out_of_slots(false);
+  for (Range *current = entries_.get(); current && !out_of_slots;
        index += current->size_, current = current->next_.get()) {
     // Coalesce with the next Range, if possible.
-    if (current->state_ != Range::FETCHING) {
+    if (current->state_ == Range::HAVE || current->state_ == Range::WANT) {
       while (current->next_ && current->next_->state_ == current->state_) {
         current->size_ += current->next_->size_;
         current->next_ = move(current->next_->next_);
@@ -158,34 +392,49 @@ void FetchState::WalkEntries() {
 
     switch (current->state_) {
       case Range::HAVE:
-        VLOG(2) << "at offset " << index << ", we have " << current->size_
-                << " entries";
+        VLOG_EVERY_N_SEC(2, 1) << "at offset " << index << ", we have "
+                               << current->size_ << " entries";
         break;
 
       case Range::FETCHING:
-        VLOG(2) << "at offset " << index << ", fetching " << current->size_
-                << " entries";
+        VLOG_EVERY_N_SEC(2, 1) << "at offset " << index << ", fetching "
+                               << current->size_ << " entries";
         ++num_fetch;
         break;
 
+      case Range::PROCESSING:
+        VLOG_EVERY_N_SEC(2, 1) << "at offset " << index << ", processing "
+                               << current->size_ << " entries";
+        break;
+
       case Range::WANT:
-        VLOG(2) << "at offset " << index << ", we want " << current->size_
-                << " entries";
+        VLOG_EVERY_N_SEC(2, 1) << "at offset " << index << ", we want "
+                               << current->size_ << " entries";
 
         // Do not start a fetch if we think our peer group does not
-        // have it.
-        if (index >= remote_tree_size) {
+        // have it, or if the database is not keeping up.
+        if (index >= remote_tree_size ||
+            pending_entries_ >= FLAGS_fetcher_max_pending_entries) {
           break;
         }
 
-        // If the range is bigger than the maximum batch size, split it.
-        if (current->size_ > FLAGS_fetcher_batch_size) {
-          current->next_.reset(
-              new Range(Range::WANT, current->size_ - FLAGS_fetcher_batch_size,
-                        move(current->next_)));
-          current->size_ = FLAGS_fetcher_batch_size;
+        // If the range goes past the next multiple of the batch size,
+        // split it there, so that fetches are aligned (logs tend to
+        // cache their responses that way).
+        {
+          const int64_t batch_size(batch_size_ - index % batch_size_);
+          if (current->size_ > batch_size) {
+            current->next_.reset(new Range(Range::WANT,
+                                           current->size_ - batch_size,
+                                           move(current->next_)));
+            current->size_ = batch_size;
+          }
         }
 
+        if (!AcquireFetchSlot(lock)) {
+          out_of_slots = true;
+          break;
+        }
         FetchRange(lock, current, index,
                    task_->AddChild(bind(&FetchState::WalkEntries, this)));
         ++num_fetch;
@@ -193,14 +442,57 @@ void FetchState::WalkEntries() {
         break;
     }
 
-    if (num_fetch >= FLAGS_fetcher_concurrent_fetches ||
-        index >= remote_tree_size) {
+    if (num_fetch >= static_cast<int>(concurrent_fetches_) ||
+        index >= remote_tree_size ||
+        pending_entries_ >= FLAGS_fetcher_max_pending_entries) {
       break;
     }
   }
 }
 
 
+bool FetchState::AcquireFetchSlot(const unique_lock<mutex>& lock) {
+  CHECK(lock.owns_lock());
+  if (!budgeted_) {
+    return true;
+  }
+  if (granted_slots_ > 0) {
+    --granted_slots_;
+    return true;
+  }
+  if (FetchBudget::Instance()->TryAcquire()) {
+    return true;
+  }
+  if (!waiting_turn_) {
+    waiting_turn_ = true;
+    FetchBudget::Instance()->Wait(
+        task_->AddChild(bind(&FetchState::TurnCame, this, _1)));
+  }
+  return false;
+}
+
+
+void FetchState::TurnCame(Task* turn) {
+  {
+    lock_guard<mutex> lock(lock_);
+    waiting_turn_ = false;
+    if (!turn->status().ok()) {
+      // We're done.
+      return;
+    }
+    ++granted_slots_;
+  }
+
+  WalkEntries();
+
+  // Whatever slot WalkEntries() did not use goes to the next in line.
+  lock_guard<mutex> lock(lock_);
+  for (; granted_slots_ > 0; --granted_slots_) {
+    FetchBudget::Instance()->Release();
+  }
+}
+
+
 void FetchState::FetchRange(const unique_lock<mutex>& lock, Range* current,
                             int64_t index, Task* range_task) {
   CHECK(lock.owns_lock());
@@ -215,18 +507,24 @@ void FetchState::FetchRange(const unique_lock<mutex>& lock, Range* current,
 
   peer_group_->FetchEntries(index, end_index, retval,
                             range_task->AddChild(
-                                bind(&FetchState::WriteToDatabase, this, index,
-                                     current, retval, range_task, _1)));
+                                bind(&FetchState::FetchDone, this, index,
+                                     current, retval, steady_clock::now(),
+                                     range_task, _1)));
 }
 
 
-void FetchState::WriteToDatabase(int64_t index, Range* range,
-                                 const vector<AsyncLogClient::Entry>* retval,
-                                 Task* range_task, Task* fetch_task) {
+void FetchState::FetchDone(int64_t index, Range* range,
+                           const vector<AsyncLogClient::Entry>* retval,
+                           const steady_clock::time_point& started,
+                           Task* range_task, Task* fetch_task) {
+  if (budgeted_) {
+    FetchBudget::Instance()->Release();
+  }
   if (!fetch_task->status().ok()) {
     LOG(INFO) << "error fetching entries at index " << index << ": "
               << fetch_task->status();
-    lock_guard<mutex> lock(lock_);
+    unique_lock<mutex> lock(lock_);
+    UpdateWindow(lock, started, range->size_, 0);
     range->state_ = Range::WANT;
     range_task->Return(fetch_task->status());
     return;
@@ -235,12 +533,39 @@ void FetchState::WriteToDatabase(int64_t index, Range* range,
   CHECK_GT(retval->size(), static_cast<size_t>(0));
 
   VLOG(1) << "received " << retval->size() << " entries at offset " << index;
-  int64_t processed(0);
-  for (const auto& entry : *retval) {
-    LoggedEntry cert;
+  {
+    unique_lock<mutex> lock(lock_);
+    UpdateWindow(lock, started, range->size_, retval->size());
+    range->state_ = Range::PROCESSING;
+    pending_entries_ += range->size_;
+  }
+
+  // The range does not count against the fetch window anymore, so
+  // more can be fetched while this is verified and written.
+  task_->AddChild(bind(&FetchState::WalkEntries, this))->Return();
+
+  FetchedBatch* const batch(
+      new FetchedBatch(index, range, retval, range_task));
+  range_task->DeleteWhenDone(batch);
+  for (size_t begin = 0; begin < retval->size(); begin += kVerifyChunkSize) {
+    task_->executor()->Add(
+        bind(&FetchState::VerifyChunk, this, batch, begin,
+             min(retval->size(), begin + kVerifyChunkSize)));
+  }
+}
+
+
+void FetchState::VerifyChunk(FetchedBatch* batch, size_t begin, size_t end) {
+  Status status;
+  size_t num_valid(end);
+  for (size_t i = begin; i < end; ++i) {
+    const AsyncLogClient::Entry& entry(batch->entries_->at(i));
+    const int64_t index(batch->index_ + i);
+    LoggedEntry& cert(batch->certs_[i]);
     if (!cert.CopyFromClientLogEntry(entry)) {
       LOG(WARNING) << "could not convert entry to a LoggedEntry";
       num_invalid_entries_fetched->Increment("format");
+      num_valid = i;
       break;
     }
     if (entry.sct) {
@@ -251,30 +576,97 @@ void FetchState::WriteToDatabase(int64_t index, Range* range,
       const LogVerifier::LogVerifyResult verify_result(
           log_verifier_->VerifySignedCertificateTimestamp(
               cert.contents().entry(), cert.sct()));
-      VLOG(1) << "SCT verify entry #" << index << ": "
-              << LogVerifier::VerifyResultString(verify_result);
+      VLOG_EVERY_N_SEC(1, 1) << "SCT verify entry #" << index << ": "
+                             << LogVerifier::VerifyResultString(
+                                    verify_result);
       if (verify_result != LogVerifier::VERIFY_OK) {
         num_invalid_entries_fetched->Increment("sct_verify_failed");
         const string msg("Failed to verify SCT signature for entry# " +
                          to_string(index) + " : " +
                          LogVerifier::VerifyResultString(verify_result));
         LOG(WARNING) << msg;
-        task_->Return(Status(util::error::FAILED_PRECONDITION, msg));
-        return;
+        status = Status(util::error::FAILED_PRECONDITION, msg);
+        num_valid = i;
+        break;
       }
     }
-    cert.set_sequence_number(index++);
-    if (db_->CreateSequencedEntry(cert) == Database::OK) {
-      ++processed;
-    } else {
-      LOG(WARNING) << "could not insert entry into the database:\n"
-                   << cert.DebugString();
+    cert.set_sequence_number(index);
+    if (!cert.PrepareForStorage()) {
+      LOG(WARNING) << "could not serialize entry #" << index;
+      num_invalid_entries_fetched->Increment("format");
+      num_valid = i;
       break;
     }
   }
 
+  bool last_chunk;
+  {
+    lock_guard<mutex> lock(batch->lock_);
+    batch->num_valid_ = min(batch->num_valid_, num_valid);
+    if (batch->status_.ok()) {
+      batch->status_ = status;
+    }
+    last_chunk = --batch->chunks_left_ == 0;
+  }
+
+  if (last_chunk) {
+    BatchVerified(batch);
+  }
+}
+
+
+void FetchState::BatchVerified(FetchedBatch* batch) {
+  if (!batch->status_.ok()) {
+    task_->Return(batch->status_);
+    {
+      lock_guard<mutex> lock(lock_);
+      pending_entries_ -= batch->range_->size_;
+      batch->range_->state_ = Range::WANT;
+    }
+    batch->range_task_->Return(batch->status_);
+    return;
+  }
+
+  // Nothing can be written after an entry we could not convert.
+  batch->certs_.resize(batch->num_valid_);
+
   {
     lock_guard<mutex> lock(lock_);
+    CHECK(verified_batches_.emplace(batch->index_, batch).second);
+    if (writing_) {
+      // The thread already writing will pick it up.
+      return;
+    }
+    writing_ = true;
+  }
+
+  WriteToDatabase();
+}
+
+
+void FetchState::WriteToDatabase() {
+  // Returning the range tasks could otherwise let our task finish, and
+  // delete us, while we are still looking for work.
+  const TaskHold hold(task_);
+  unique_lock<mutex> lock(lock_);
+  while (!verified_batches_.empty()) {
+    // Lowest index first, which is the order the tree grows in.
+    FetchedBatch* const batch(verified_batches_.begin()->second);
+    verified_batches_.erase(verified_batches_.begin());
+    Range* const range(batch->range_);
+    lock.unlock();
+
+    size_t num_written(0);
+    if (db_->CreateSequencedEntries(batch->certs_, &num_written) !=
+        Database::OK) {
+      LOG_EVERY_N_SEC(WARNING, 1)
+          << "could not insert entry into the database:\n"
+          << batch->certs_[num_written].DebugString();
+    }
+    const int64_t processed(num_written);
+
+    lock.lock();
+    pending_entries_ -= range->size_;
     // TODO(pphaneuf): If we have problems fetching entries, to what
     // point should we retry? Or should we just return on the task
     // with an error?
@@ -290,17 +682,55 @@ void FetchState::WriteToDatabase(int64_t index, Range* range,
     } else {
       range->state_ = Range::WANT;
     }
+    lock.unlock();
+
+    if (static_cast<uint64_t>(processed) < batch->entries_->size()) {
+      // We couldn't insert everything that we received into the
+      // database, this is fairly serious, return an error for the
+      // overall operation and let the higher level deal with it.
+      task_->Return(Status(util::error::INTERNAL,
+                           "could not write some entries to the database"));
+    }
+
+    // This deletes |batch|.
+    batch->range_task_->Return();
+    lock.lock();
   }
+  writing_ = false;
+}
 
-  if (static_cast<uint64_t>(processed) < retval->size()) {
-    // We couldn't insert everything that we received into the
-    // database, this is fairly serious, return an error for the
-    // overall operation and let the higher level deal with it.
-    task_->Return(Status(util::error::INTERNAL,
-                         "could not write some entries to the database"));
+
+void FetchState::UpdateWindow(const unique_lock<mutex>& lock,
+                              const steady_clock::time_point& started,
+                              int64_t requested, int64_t received) {
+  CHECK(lock.owns_lock());
+  const steady_clock::time_point now(steady_clock::now());
+  if (received > 0 && now - started <= target_latency_) {
+    concurrent_fetches_ = min<double>(max_concurrent_fetches_,
+                                      concurrent_fetches_ +
+                                          1 / concurrent_fetches_);
+  } else if (started >= last_decrease_) {
+    // Only back off once for the fetches that were outstanding at the
+    // same time.
+    concurrent_fetches_ = max(1.0, concurrent_fetches_ / 2);
+    last_decrease_ = now;
   }
 
-  range_task->Return();
+  if (received > 0 && received < requested && received < batch_size_) {
+    // Asking for more would only split the ranges further.
+    VLOG(1) << "peer returned " << received << " of " << requested
+            << " entries, fetching at most that many at a time";
+    batch_size_ = received;
+    full_batches_ = 0;
+  } else if (received == requested && requested == batch_size_ &&
+             batch_size_ < FLAGS_fetcher_batch_size &&
+             ++full_batches_ >= kFullBatchesBeforeGrowing) {
+    // If the peers still cap their responses, this only costs the
+    // rest of one range being split off and fetched separately.
+    batch_size_ = min<int64_t>(FLAGS_fetcher_batch_size, 2 * batch_size_);
+    full_batches_ = 0;
+    VLOG(1) << "fetching up to " << batch_size_ << " entries at a time again";
+  }
 }
 
 
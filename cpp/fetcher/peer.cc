@@ -3,6 +3,7 @@
 #include <glog/logging.h>
 
 using std::unique_ptr;
+using std::vector;
 
 namespace cert_trans {
 
@@ -12,4 +13,15 @@ Peer::Peer(unique_ptr<AsyncLogClient> client) : client_(move(client)) {
 }
 
 
+void Peer::FetchEntries(int first, int last, bool want_scts,
+                        vector<AsyncLogClient::Entry>* entries,
+                        const AsyncLogClient::Callback& done) {
+  if (want_scts) {
+    client_->GetEntriesAndSCTs(first, last, entries, done);
+  } else {
+    client_->GetEntries(first, last, entries, done);
+  }
+}
+
+
 }  // namespace cert_trans
@@ -2,6 +2,7 @@
 #define CERT_TRANS_FETCHER_PEER_H_
 
 #include <memory>
+#include <vector>
 
 #include "base/macros.h"
 #include "client/async_log_client.h"
@@ -22,6 +23,12 @@ class Peer {
   // Returns -1 if we do not know yet.
   virtual int64_t TreeSize() const = 0;
 
+  // Fetches the entries from |first| to |last| (inclusive), with their
+  // SCTs if |want_scts|, through the client() by default.
+  virtual void FetchEntries(int first, int last, bool want_scts,
+                            std::vector<AsyncLogClient::Entry>* entries,
+                            const AsyncLogClient::Callback& done);
+
  protected:
   const std::unique_ptr<AsyncLogClient> client_;
 
@@ -1,23 +1,68 @@
 #include "fetcher/peer_group.h"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <algorithm>
+#include <chrono>
 
+#include "monitoring/latency.h"
+#include "monitoring/monitoring.h"
+
+using std::bind;
+using std::chrono::duration;
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::lock_guard;
+using std::make_shared;
 using std::max;
 using std::mutex;
+using std::nth_element;
+using std::pair;
 using std::placeholders::_1;
 using std::shared_ptr;
+using std::string;
+using std::unique_lock;
 using std::vector;
 using util::Status;
 using util::Task;
+using util::TaskHold;
+
+DEFINE_int32(peer_group_max_consecutive_errors, 3,
+             "Number of consecutive failed fetches after which a peer is "
+             "avoided for --peer_group_ejection_seconds.");
+DEFINE_int32(peer_group_ejection_seconds, 30,
+             "Number of seconds during which a peer that keeps failing is "
+             "only used if no other peer can serve a fetch.");
+DEFINE_double(peer_group_hedge_percentile, 0,
+              "If non-zero, a fetch that takes longer than this percentile "
+              "of the recent latencies of its peer is also sent to another "
+              "peer, and the first answer is used.");
 
 namespace cert_trans {
 
 namespace {
 
 
-void GetEntriesDone(AsyncLogClient::Status client_status,
-                    const vector<AsyncLogClient::Entry>* entries, Task* task) {
+// Weight of the latest sample in the moving averages.
+const double kAverageWeight = 0.2;
+// Number of latencies kept per peer, for the hedging percentile.
+const size_t kMaxLatencySamples = 100;
+// Hedging needs to know what a normal latency is, first.
+const size_t kMinLatencySamples = 10;
+
+Counter<string>* num_hedged_fetches =
+    Counter<string>::New("peer_group_hedged_fetches", "outcome",
+                         "Number of fetches also sent to a second peer, "
+                         "broken down by which peer answered first.");
+
+Latency<milliseconds, string> peer_fetch_latency_ms(
+    "peer_group_fetch_latency_ms", "result",
+    "Latency of fetches of entries from peers, broken down by result.");
+
+
+Status ToStatus(AsyncLogClient::Status client_status,
+                const vector<AsyncLogClient::Entry>& entries) {
   Status status;
 
   switch (client_status) {
@@ -30,19 +75,130 @@ void GetEntriesDone(AsyncLogClient::Status client_status,
       status = util::Status::UNKNOWN;
   }
 
-  if (status.ok() && entries->empty()) {
+  if (status.ok() && entries.empty()) {
     // This should never happen.
     status =
         Status(util::error::INTERNAL, "log server did not return any entries");
   }
 
-  task->Return(status);
+  return status;
 }
 
 
 }  // namespace
 
 
+struct PeerGroup::PeerState {
+  // All the methods require |lock| to be held.
+  PeerState()
+      : in_flight(0),
+        latency_ms(0),
+        error_rate(0),
+        consecutive_errors(0),
+        next_latency_sample(0) {
+  }
+
+  // Lower is better: roughly how long a new fetch would take, if it
+  // had to wait for those already in flight, and what it would cost
+  // to retry it if it failed.
+  double Score() const {
+    // Unknown peers look fast, so that they are tried.
+    return (latency_ms + 1) * (in_flight + 1) / max(0.1, 1 - error_rate);
+  }
+
+  bool IsEjected(const steady_clock::time_point& now) const {
+    return now < ejected_until;
+  }
+
+  // Returns a negative value if there are not enough samples.
+  double LatencyPercentile(double percentile) const {
+    if (recent_latencies_ms.size() < kMinLatencySamples) {
+      return -1;
+    }
+    vector<double> latencies(recent_latencies_ms);
+    const size_t index(
+        std::min(latencies.size() - 1,
+                 static_cast<size_t>(latencies.size() * percentile / 100)));
+    nth_element(latencies.begin(), latencies.begin() + index,
+                latencies.end());
+    return latencies[index];
+  }
+
+  void RecordResult(bool ok, double request_latency_ms) {
+    CHECK_GT(in_flight, 0);
+    --in_flight;
+    error_rate = (1 - kAverageWeight) * error_rate + (ok ? 0 : kAverageWeight);
+    if (!ok) {
+      if (++consecutive_errors >= FLAGS_peer_group_max_consecutive_errors) {
+        LOG(WARNING) << "peer failed " << consecutive_errors
+                     << " fetches in a row, avoiding it for "
+                     << FLAGS_peer_group_ejection_seconds << " second(s)";
+        ejected_until = steady_clock::now() +
+                        seconds(FLAGS_peer_group_ejection_seconds);
+        consecutive_errors = 0;
+      }
+      return;
+    }
+
+    consecutive_errors = 0;
+    latency_ms = recent_latencies_ms.empty()
+                     ? request_latency_ms
+                     : (1 - kAverageWeight) * latency_ms +
+                           kAverageWeight * request_latency_ms;
+    if (recent_latencies_ms.size() < kMaxLatencySamples) {
+      recent_latencies_ms.push_back(request_latency_ms);
+    } else {
+      recent_latencies_ms[next_latency_sample] = request_latency_ms;
+      next_latency_sample = (next_latency_sample + 1) % kMaxLatencySamples;
+    }
+  }
+
+  mutex lock;
+  int in_flight;
+  // Moving averages of the latency of successful fetches, and of the
+  // fraction of fetches that failed.
+  double latency_ms;
+  double error_rate;
+  int consecutive_errors;
+  steady_clock::time_point ejected_until;
+  // The latest latencies, with |next_latency_sample| the oldest once
+  // there are |kMaxLatencySamples| of them.
+  vector<double> recent_latencies_ms;
+  size_t next_latency_sample;
+};
+
+
+// A fetch of a range of entries, sent to one peer and possibly to a
+// second one (the hedge).
+struct PeerGroup::FetchRequest {
+  FetchRequest(int64_t start, int64_t end,
+               vector<AsyncLogClient::Entry>* out, Task* t)
+      : start_index(start),
+        end_index(end),
+        entries(out),
+        task(t),
+        done(false),
+        outstanding(0) {
+  }
+
+  const int64_t start_index;
+  const int64_t end_index;
+  vector<AsyncLogClient::Entry>* const entries;
+  Task* const task;
+
+  mutex lock;
+  // Once set, |task| might be gone.
+  bool done;
+  int outstanding;
+  // Each attempt gets its own entries, as the one that does not win
+  // can complete after |task|. This also keeps the peers (and so
+  // their clients) around for as long as needed.
+  shared_ptr<Peer> peers[2];
+  vector<AsyncLogClient::Entry> attempt_entries[2];
+  steady_clock::time_point sent_at[2];
+};
+
+
 PeerGroup::PeerGroup(bool fetch_scts) : fetch_scts_(fetch_scts) {
 }
 
@@ -50,7 +206,7 @@ PeerGroup::PeerGroup(bool fetch_scts) : fetch_scts_(fetch_scts) {
 void PeerGroup::Add(const shared_ptr<Peer>& peer) {
   lock_guard<mutex> lock(lock_);
 
-  CHECK(peers_.emplace(peer, PeerState()).second);
+  CHECK(peers_.emplace(peer, make_shared<PeerState>()).second);
 }
 
 
@@ -71,50 +227,173 @@ void PeerGroup::FetchEntries(int64_t start_index, int64_t end_index,
                              Task* task) {
   CHECK_GE(start_index, 0);
   CHECK_GE(end_index, start_index);
+  CHECK_NOTNULL(entries);
+  // The primary fetch could complete before we are done here.
+  TaskHold hold(task);
 
-  const shared_ptr<Peer> peer(PickPeer(end_index + 1));
-  if (!peer) {
+  const pair<shared_ptr<Peer>, shared_ptr<PeerState>> peer(
+      PickPeer(end_index + 1, nullptr));
+  if (!peer.first) {
     task->Return(Status(util::error::UNAVAILABLE,
                         "requested entries not available in the peer group"));
     return;
   }
 
-  // TODO(pphaneuf): Handle the case where we have no peer more cleanly.
-  if (fetch_scts_) {
-    peer->client().GetEntriesAndSCTs(start_index, end_index,
-                                     CHECK_NOTNULL(entries),
-                                     bind(GetEntriesDone, _1, entries, task));
-  } else {
-    peer->client().GetEntries(start_index, end_index, CHECK_NOTNULL(entries),
-                              bind(GetEntriesDone, _1, entries, task));
+  const shared_ptr<FetchRequest> request(
+      make_shared<FetchRequest>(start_index, end_index, entries, task));
+  double hedge_delay_ms(-1);
+  if (FLAGS_peer_group_hedge_percentile > 0) {
+    lock_guard<mutex> lock(peer.second->lock);
+    hedge_delay_ms =
+        peer.second->LatencyPercentile(FLAGS_peer_group_hedge_percentile);
+  }
+
+  SendRequest(request, 0, peer.first, peer.second);
+
+  if (hedge_delay_ms >= 0) {
+    // As a child of |task|, this gets cancelled once |task| returns.
+    task->executor()->Delay(duration<double, std::milli>(hedge_delay_ms),
+                            task->AddChild(bind(&PeerGroup::StartHedge, this,
+                                                request, _1)));
   }
 }
 
 
-shared_ptr<Peer> PeerGroup::PickPeer(const int64_t needed_size) const {
+pair<shared_ptr<Peer>, shared_ptr<PeerGroup::PeerState>> PeerGroup::PickPeer(
+    const int64_t needed_size, const shared_ptr<Peer>& exclude) const {
   lock_guard<mutex> lock(lock_);
 
-  // TODO(pphaneuf): We should pick peers a bit more cleverly, to
-  // spread the load somewhat.
+  const steady_clock::time_point now(steady_clock::now());
   int64_t group_tree_size(-1);
-  vector<shared_ptr<Peer>> capable_peers;
+  // The best healthy peers, or the best ejected ones, if there are no
+  // healthy ones (it might have recovered, and it is all we have).
+  vector<pair<shared_ptr<Peer>, shared_ptr<PeerState>>> best_peers;
+  bool best_ejected(true);
+  double best_score(0);
   for (const auto& peer : peers_) {
     const int64_t tree_size(peer.first->TreeSize());
     group_tree_size = max(group_tree_size, tree_size);
-    if (tree_size >= needed_size) {
-      capable_peers.push_back(peer.first);
+    if (tree_size < needed_size || peer.first == exclude) {
+      continue;
+    }
+
+    lock_guard<mutex> state_lock(peer.second->lock);
+    const bool ejected(peer.second->IsEjected(now));
+    const double score(peer.second->Score());
+    if (best_peers.empty() || (best_ejected && !ejected) ||
+        (ejected == best_ejected && score < best_score)) {
+      best_peers.clear();
+      best_ejected = ejected;
+      best_score = score;
+    }
+    if (ejected == best_ejected && score == best_score) {
+      best_peers.push_back(peer);
+    }
+  }
+
+  if (!best_peers.empty()) {
+    // Spread the load between equally good peers.
+    return best_peers[std::rand() % best_peers.size()];
+  }
+
+  if (!exclude) {
+    LOG(INFO) << "requested a peer with " << needed_size
+              << " entries but the peer group only has " << group_tree_size
+              << " entries";
+  }
+
+  return {nullptr, nullptr};
+}
+
+
+void PeerGroup::SendRequest(const shared_ptr<FetchRequest>& request,
+                            int attempt, const shared_ptr<Peer>& peer,
+                            const shared_ptr<PeerState>& state) const {
+  {
+    lock_guard<mutex> lock(state->lock);
+    ++state->in_flight;
+  }
+  {
+    lock_guard<mutex> lock(request->lock);
+    ++request->outstanding;
+    request->peers[attempt] = peer;
+    request->sent_at[attempt] = steady_clock::now();
+  }
+
+  vector<AsyncLogClient::Entry>* const entries(
+      &request->attempt_entries[attempt]);
+  const AsyncLogClient::Callback done(
+      bind(&PeerGroup::RequestDone, request, attempt, state, _1));
+  peer->FetchEntries(request->start_index, request->end_index, fetch_scts_,
+                     entries, done);
+}
+
+
+void PeerGroup::StartHedge(const shared_ptr<FetchRequest>& request,
+                           Task* timer_task) const {
+  if (!timer_task->status().ok()) {
+    // The fetch completed already.
+    return;
+  }
+
+  shared_ptr<Peer> primary;
+  {
+    lock_guard<mutex> lock(request->lock);
+    if (request->done) {
+      return;
     }
+    primary = request->peers[0];
+  }
+
+  const pair<shared_ptr<Peer>, shared_ptr<PeerState>> peer(
+      PickPeer(request->end_index + 1, primary));
+  if (!peer.first) {
+    return;
   }
 
-  if (!capable_peers.empty()) {
-    return capable_peers[std::rand() % capable_peers.size()];
+  VLOG(1) << "fetch from offset " << request->start_index
+          << " is slow, also sending it to another peer";
+  num_hedged_fetches->Increment("sent");
+  SendRequest(request, 1, peer.first, peer.second);
+}
+
+
+// static
+void PeerGroup::RequestDone(const shared_ptr<FetchRequest>& request,
+                            int attempt, const shared_ptr<PeerState>& state,
+                            AsyncLogClient::Status client_status) {
+  const Status status(
+      ToStatus(client_status, request->attempt_entries[attempt]));
+  unique_lock<mutex> lock(request->lock);
+  const duration<double, std::milli> latency(steady_clock::now() -
+                                             request->sent_at[attempt]);
+  peer_fetch_latency_ms.RecordLatency(status.ok() ? "ok" : "error", latency);
+  {
+    lock_guard<mutex> state_lock(state->lock);
+    state->RecordResult(status.ok(), latency.count());
   }
 
-  LOG(INFO) << "requested a peer with " << needed_size
-            << " entries but the peer group only has " << group_tree_size
-            << " entries";
+  --request->outstanding;
+  if (request->done) {
+    // The other peer was faster.
+    request->attempt_entries[attempt].clear();
+    return;
+  }
+  if (!status.ok() && request->outstanding > 0) {
+    // Maybe the other peer will do better.
+    return;
+  }
+
+  request->done = true;
+  if (status.ok()) {
+    request->entries->swap(request->attempt_entries[attempt]);
+    if (attempt > 0) {
+      num_hedged_fetches->Increment("won");
+    }
+  }
+  lock.unlock();
 
-  return nullptr;
+  request->task->Return(status);
 }
 
 
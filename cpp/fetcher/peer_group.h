@@ -2,9 +2,11 @@
 #define CERT_TRANS_FETCHER_PEER_GROUP_H_
 
 #include <stdint.h>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <set>
+#include <utility>
 #include <vector>
 
 #include "base/macros.h"
@@ -16,10 +18,14 @@ namespace cert_trans {
 
 
 // A PeerGroup is a set of peers used for a fetch operation, providing
-// a slightly higher level abstraction for fetching entries. Fetch
-// errors will be retried, and unhealthy peers will be dropped (so the
-// available tree size can get smaller).
-// TODO(pphaneuf): Make that last sentence true!
+// a slightly higher level abstraction for fetching entries.
+//
+// The group keeps track of the latency, error rate and number of
+// requests in flight of each peer, and sends every request to the
+// capable peer that looks likely to answer it the soonest. Peers that
+// keep failing are avoided for a while. Optionally, a request that
+// takes longer than most, for its peer, is also sent to another peer,
+// and the first answer wins.
 class PeerGroup {
  public:
   explicit PeerGroup(bool fetch_scts_);
@@ -35,16 +41,32 @@ class PeerGroup {
                     util::Task* task);
 
  private:
-  struct PeerState {
-    // TODO(pphaneuf): Keep a count of errors here, to prune away
-    // unhealthy peers.
-  };
+  struct PeerState;
+  struct FetchRequest;
 
-  std::shared_ptr<Peer> PickPeer(const int64_t needed_size) const;
+  // Returns the capable peer with the best score, other than
+  // |exclude|, along with its state.
+  std::pair<std::shared_ptr<Peer>, std::shared_ptr<PeerState>> PickPeer(
+      const int64_t needed_size, const std::shared_ptr<Peer>& exclude) const;
+
+  // Sends |request| to the peer, which will be the primary or the
+  // hedge for it.
+  void SendRequest(const std::shared_ptr<FetchRequest>& request, int attempt,
+                   const std::shared_ptr<Peer>& peer,
+                   const std::shared_ptr<PeerState>& state) const;
+  void StartHedge(const std::shared_ptr<FetchRequest>& request,
+                  util::Task* timer_task) const;
+
+  // These are static, as requests can complete after the peer group
+  // is gone (when they lost to the other peer).
+  static void RequestDone(const std::shared_ptr<FetchRequest>& request,
+                          int attempt, const std::shared_ptr<PeerState>& state,
+                          AsyncLogClient::Status client_status);
 
   mutable std::mutex lock_;
   const bool fetch_scts_;
-  std::map<std::shared_ptr<Peer>, PeerState> peers_;
+  // The states are shared with the requests in flight.
+  std::map<std::shared_ptr<Peer>, std::shared_ptr<PeerState>> peers_;
 
   DISALLOW_COPY_AND_ASSIGN(PeerGroup);
 };
@@ -0,0 +1,293 @@
+#include "fetcher/peer_group.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "client/async_log_client.h"
+#include "fetcher/peer.h"
+#include "net/mock_url_fetcher.h"
+#include "util/status_test_util.h"
+#include "util/sync_task.h"
+#include "util/testing.h"
+#include "util/thread_pool.h"
+
+DECLARE_int32(peer_group_ejection_seconds);
+DECLARE_double(peer_group_hedge_percentile);
+DECLARE_int32(peer_group_max_consecutive_errors);
+
+namespace cert_trans {
+namespace {
+
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::condition_variable;
+using std::deque;
+using std::lock_guard;
+using std::make_shared;
+using std::mutex;
+using std::shared_ptr;
+using std::this_thread::sleep_for;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+using util::SyncTask;
+using util::testing::StatusIs;
+
+
+// A peer whose fetches are answered by the test, when it wants.
+class FakePeer : public Peer {
+ public:
+  FakePeer(util::Executor* executor, UrlFetcher* fetcher, int64_t tree_size)
+      : Peer(unique_ptr<AsyncLogClient>(
+            new AsyncLogClient(executor, fetcher, "http://example.com"))),
+        tree_size_(tree_size) {
+  }
+
+  int64_t TreeSize() const override {
+    lock_guard<mutex> lock(lock_);
+    return tree_size_;
+  }
+
+  void set_tree_size(int64_t tree_size) {
+    lock_guard<mutex> lock(lock_);
+    tree_size_ = tree_size;
+  }
+
+  void FetchEntries(int first, int last, bool want_scts,
+                    vector<AsyncLogClient::Entry>* entries,
+                    const AsyncLogClient::Callback& done) override {
+    lock_guard<mutex> lock(lock_);
+    fetches_.push_back(Fetch{first, last, entries, done});
+    fetch_sent_.notify_all();
+  }
+
+  // The number of fetches sent to this peer and not answered yet.
+  int pending() const {
+    lock_guard<mutex> lock(lock_);
+    return fetches_.size();
+  }
+
+  // Returns whether a fetch is pending within |timeout|.
+  bool WaitForFetch(milliseconds timeout) {
+    unique_lock<mutex> lock(lock_);
+    return fetch_sent_.wait_for(lock, timeout,
+                                [this]() { return !fetches_.empty(); });
+  }
+
+  // Answers the oldest pending fetch, with the entries if |status| is
+  // OK.
+  void Answer(AsyncLogClient::Status status) {
+    unique_lock<mutex> lock(lock_);
+    CHECK(!fetches_.empty());
+    const Fetch fetch(fetches_.front());
+    fetches_.pop_front();
+    lock.unlock();
+
+    if (status == AsyncLogClient::OK) {
+      for (int i = fetch.first; i <= fetch.last; ++i) {
+        fetch.entries->emplace_back();
+      }
+    }
+    fetch.done(status);
+  }
+
+ private:
+  struct Fetch {
+    int first;
+    int last;
+    vector<AsyncLogClient::Entry>* entries;
+    AsyncLogClient::Callback done;
+  };
+
+  mutable mutex lock_;
+  condition_variable fetch_sent_;
+  int64_t tree_size_;
+  deque<Fetch> fetches_;
+};
+
+
+class PeerGroupTest : public ::testing::Test {
+ protected:
+  struct Fetch {
+    explicit Fetch(util::Executor* executor) : task(executor) {
+    }
+
+    vector<AsyncLogClient::Entry> entries;
+    SyncTask task;
+  };
+
+  PeerGroupTest() : group_(false) {
+    FLAGS_peer_group_hedge_percentile = 0;
+  }
+
+  shared_ptr<FakePeer> AddPeer(int64_t tree_size) {
+    const shared_ptr<FakePeer> peer(
+        make_shared<FakePeer>(&pool_, &fetcher_, tree_size));
+    group_.Add(peer);
+    return peer;
+  }
+
+  // Starts fetching the entries up to |last| from the group.
+  unique_ptr<Fetch> StartFetch(int64_t last = 9) {
+    unique_ptr<Fetch> fetch(new Fetch(&pool_));
+    group_.FetchEntries(0, last, &fetch->entries, fetch->task.task());
+    return fetch;
+  }
+
+  // Fetches from the group, expecting it to go to |peer|, which
+  // answers with |status| after |latency|.
+  void FetchFrom(const shared_ptr<FakePeer>& peer,
+                 AsyncLogClient::Status status,
+                 milliseconds latency = milliseconds(0)) {
+    const unique_ptr<Fetch> fetch(StartFetch());
+    ASSERT_TRUE(peer->WaitForFetch(seconds(5)));
+    sleep_for(latency);
+    peer->Answer(status);
+    fetch->task.Wait();
+    EXPECT_EQ(status == AsyncLogClient::OK, fetch->task.status().ok());
+  }
+
+  google::FlagSaver saver_;
+  ThreadPool pool_;
+  MockUrlFetcher fetcher_;
+  PeerGroup group_;
+};
+
+
+TEST_F(PeerGroupTest, UnavailableWithoutPeerWithTheEntries) {
+  AddPeer(5);
+  const unique_ptr<Fetch> fetch(StartFetch(9));
+  fetch->task.Wait();
+  EXPECT_THAT(fetch->task.status(), StatusIs(util::error::UNAVAILABLE));
+}
+
+
+TEST_F(PeerGroupTest, SkipsPeersWithoutTheEntries) {
+  const shared_ptr<FakePeer> small(AddPeer(5));
+  const shared_ptr<FakePeer> large(AddPeer(100));
+  for (int i = 0; i < 5; ++i) {
+    FetchFrom(large, AsyncLogClient::OK);
+    EXPECT_EQ(0, small->pending());
+  }
+}
+
+
+TEST_F(PeerGroupTest, PrefersTheFasterPeer) {
+  const shared_ptr<FakePeer> slow(AddPeer(100));
+  FetchFrom(slow, AsyncLogClient::OK, milliseconds(100));
+
+  // Unknown, so it looks fast.
+  const shared_ptr<FakePeer> fast(AddPeer(100));
+  FetchFrom(fast, AsyncLogClient::OK);
+  for (int i = 0; i < 5; ++i) {
+    FetchFrom(fast, AsyncLogClient::OK);
+    EXPECT_EQ(0, slow->pending());
+  }
+}
+
+
+TEST_F(PeerGroupTest, PrefersThePeerWithFewerFetchesInFlight) {
+  const shared_ptr<FakePeer> first(AddPeer(100));
+  FetchFrom(first, AsyncLogClient::OK, milliseconds(50));
+  const shared_ptr<FakePeer> second(AddPeer(100));
+  FetchFrom(second, AsyncLogClient::OK, milliseconds(50));
+
+  // Both about as fast, but the busy one would take longer.
+  const unique_ptr<Fetch> fetch(StartFetch());
+  const shared_ptr<FakePeer> busy(first->pending() > 0 ? first : second);
+  const shared_ptr<FakePeer> idle(busy == first ? second : first);
+  FetchFrom(idle, AsyncLogClient::OK, milliseconds(50));
+  EXPECT_EQ(1, busy->pending());
+
+  busy->Answer(AsyncLogClient::OK);
+  fetch->task.Wait();
+  EXPECT_OK(fetch->task.status());
+}
+
+
+TEST_F(PeerGroupTest, EjectsAndReadmitsFailingPeer) {
+  FLAGS_peer_group_max_consecutive_errors = 2;
+  FLAGS_peer_group_ejection_seconds = 1;
+  const shared_ptr<FakePeer> slow(AddPeer(100));
+  FetchFrom(slow, AsyncLogClient::OK, milliseconds(100));
+  const shared_ptr<FakePeer> fast(AddPeer(100));
+  FetchFrom(fast, AsyncLogClient::OK);
+
+  // Still the better one after a single error.
+  FetchFrom(fast, AsyncLogClient::UNKNOWN_ERROR);
+  FetchFrom(fast, AsyncLogClient::UNKNOWN_ERROR);
+  // Ejected after the second one in a row.
+  FetchFrom(slow, AsyncLogClient::OK, milliseconds(100));
+  EXPECT_EQ(0, fast->pending());
+
+  // Still used, when it is the only one with the entries.
+  slow->set_tree_size(5);
+  FetchFrom(fast, AsyncLogClient::OK);
+  slow->set_tree_size(100);
+  FetchFrom(slow, AsyncLogClient::OK, milliseconds(100));
+
+  // Back in the running once the ejection is over.
+  sleep_for(milliseconds(1100));
+  FetchFrom(fast, AsyncLogClient::OK);
+  EXPECT_EQ(0, slow->pending());
+}
+
+
+TEST_F(PeerGroupTest, HedgesSlowFetchAfterTheDelay) {
+  // Too few latencies known for this one to get hedged.
+  const shared_ptr<FakePeer> hedge(AddPeer(100));
+  FetchFrom(hedge, AsyncLogClient::OK, milliseconds(500));
+  const shared_ptr<FakePeer> primary(AddPeer(100));
+  for (int i = 0; i < 10; ++i) {
+    FetchFrom(primary, AsyncLogClient::OK, milliseconds(100));
+  }
+
+  FLAGS_peer_group_hedge_percentile = 50;
+  const unique_ptr<Fetch> fetch(StartFetch());
+  ASSERT_TRUE(primary->WaitForFetch(seconds(5)));
+  // Not before it took longer than usual.
+  EXPECT_FALSE(hedge->WaitForFetch(milliseconds(50)));
+  ASSERT_TRUE(hedge->WaitForFetch(seconds(5)));
+
+  // The first answer wins.
+  hedge->Answer(AsyncLogClient::OK);
+  fetch->task.Wait();
+  EXPECT_OK(fetch->task.status());
+  EXPECT_EQ(10U, fetch->entries.size());
+  primary->Answer(AsyncLogClient::OK);
+  EXPECT_EQ(10U, fetch->entries.size());
+}
+
+
+TEST_F(PeerGroupTest, DoesNotHedgeFastFetch) {
+  const shared_ptr<FakePeer> other(AddPeer(100));
+  FetchFrom(other, AsyncLogClient::OK, milliseconds(500));
+  const shared_ptr<FakePeer> primary(AddPeer(100));
+  for (int i = 0; i < 10; ++i) {
+    FetchFrom(primary, AsyncLogClient::OK, milliseconds(100));
+  }
+
+  FLAGS_peer_group_hedge_percentile = 90;
+  FetchFrom(primary, AsyncLogClient::OK);
+  // Past when the hedge would have been sent.
+  sleep_for(milliseconds(300));
+  EXPECT_EQ(0, other->pending());
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,440 @@
+// Benchmarks the Database implementations on the operations the log
+// servers rely on: appending sequenced entries (one at a time, and in
+// batches), looking them up by hash and by index, scanning ranges of
+// them, and opening an existing database (which rebuilds the indexes
+// of some of them), along with the memory used.
+//
+// The entries are built from real chains (see --chains), or are
+// synthetic ones of about the same size, sharing their intermediates
+// like real ones do.
+#include <ftw.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "log/cert.h"
+#include "log/database.h"
+#include "log/file_db.h"
+#include "log/file_storage.h"
+#include "log/leveldb_db.h"
+#include "log/logged_entry.h"
+#include "log/segment_db.h"
+#include "log/sqlite_db.h"
+#include "merkletree/serial_hasher.h"
+#include "merkletree/tree_hasher.h"
+#include "proto/cert_serializer.h"
+#include "proto/serializer.h"
+#include "util/util.h"
+
+namespace sc = std::chrono;
+
+using cert_trans::CertChain;
+using cert_trans::Database;
+using cert_trans::FileDB;
+using cert_trans::FileStorage;
+using cert_trans::LevelDB;
+using cert_trans::LoggedEntry;
+using cert_trans::SQLiteDB;
+using cert_trans::SegmentDB;
+using std::cout;
+using std::mt19937_64;
+using std::ostringstream;
+using std::setw;
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+
+DEFINE_string(databases, "file,sqlite,leveldb,segment",
+              "comma-separated list of the databases to benchmark, among "
+              "\"file\", \"sqlite\", \"leveldb\" and \"segment\"");
+DEFINE_string(num_entries, "10000,100000",
+              "comma-separated list of the numbers of entries to benchmark "
+              "each database with (be careful, as the entries take a few kB "
+              "each on disk)");
+DEFINE_int32(batch_size, 256,
+             "number of entries written by each CreateSequencedEntries() "
+             "call");
+DEFINE_int32(num_lookups, 10000,
+             "number of random entries to look up by hash and by index");
+DEFINE_int32(scan_length, 1000,
+             "number of entries read by each ScanEntries() iterator");
+DEFINE_string(chains, "",
+              "comma-separated list of PEM files, each with a chain (leaf "
+              "first) to build the entries from; their leaves are made "
+              "unique by appending the index of the entry");
+DEFINE_string(bench_dir, "/tmp",
+              "existing directory to create the databases in (a new "
+              "directory in it, deleted at the end)");
+DEFINE_string(output, "text",
+              "\"text\" for aligned columns, or \"json\" for one JSON object "
+              "per result and line");
+
+namespace {
+
+
+const unsigned kCertStorageDepth = 3;
+const unsigned kTreeStorageDepth = 8;
+// Synthetic chains have one or two of these intermediates.
+const int kNumIntermediates = 16;
+
+
+string RandomBytes(size_t size, mt19937_64* rng) {
+  string bytes(size, '\0');
+  for (size_t i = 0; i < size; ++i) {
+    bytes[i] = static_cast<char>((*rng)());
+  }
+  return bytes;
+}
+
+
+// Builds the |index|th entry of the databases being benchmarked, the
+// same way every time, so that it can be built again to look it up.
+class EntryGenerator {
+ public:
+  explicit EntryGenerator(const string& chain_files)
+      : tree_hasher_(unique_ptr<SerialHasher>(new Sha256Hasher)) {
+    for (const string& file : util::split(chain_files)) {
+      string pem;
+      CHECK(util::ReadTextFile(file, &pem)) << "could not read " << file;
+      const CertChain chain(pem);
+      CHECK(chain.IsLoaded()) << "no valid chain in " << file;
+      chains_.emplace_back();
+      for (size_t i = 0; i < chain.Length(); ++i) {
+        string der;
+        CHECK(chain.CertAt(i)->DerEncoding(&der).ok());
+        chains_.back().emplace_back(der);
+      }
+    }
+
+    mt19937_64 rng(0);
+    for (int i = 0; i < kNumIntermediates; ++i) {
+      intermediates_.emplace_back(RandomBytes(1000 + rng() % 500, &rng));
+    }
+  }
+
+  LoggedEntry Entry(int64_t index) const {
+    LoggedEntry logged;
+    ct::X509ChainEntry* const x509(
+        logged.mutable_entry()->mutable_x509_entry());
+    logged.mutable_entry()->set_type(ct::X509_ENTRY);
+    mt19937_64 rng(index);
+    if (chains_.empty()) {
+      x509->set_leaf_certificate(RandomBytes(1000 + rng() % 1000, &rng));
+      const int chain_length(1 + rng() % 2);
+      for (int i = 0; i < chain_length; ++i) {
+        x509->add_certificate_chain(
+            intermediates_[rng() % intermediates_.size()]);
+      }
+    } else {
+      const vector<string>& chain(chains_[index % chains_.size()]);
+      x509->set_leaf_certificate(chain[0] + to_string(index));
+      for (size_t i = 1; i < chain.size(); ++i) {
+        x509->add_certificate_chain(chain[i]);
+      }
+    }
+
+    ct::SignedCertificateTimestamp* const sct(logged.mutable_sct());
+    sct->set_version(ct::V1);
+    sct->mutable_id()->set_key_id(string(32, 'k'));
+    sct->set_timestamp(1000000000000 + index);
+    sct->mutable_signature()->set_hash_algorithm(
+        ct::DigitallySigned::SHA256);
+    sct->mutable_signature()->set_sig_algorithm(ct::DigitallySigned::ECDSA);
+    sct->mutable_signature()->set_signature(RandomBytes(72, &rng));
+
+    string leaf;
+    CHECK_EQ(cert_trans::serialization::SerializeResult::OK,
+             Serializer::SerializeSCTMerkleTreeLeaf(logged.sct(),
+                                                    logged.entry(), &leaf));
+    logged.set_merkle_leaf_hash(tree_hasher_.HashLeaf(leaf));
+    logged.set_sequence_number(index);
+    return logged;
+  }
+
+ private:
+  const TreeHasher tree_hasher_;
+  vector<vector<string>> chains_;
+  vector<string> intermediates_;
+};
+
+
+unique_ptr<Database> OpenDatabase(const string& type, const string& dir) {
+  if (type == "file") {
+    return unique_ptr<Database>(
+        new FileDB(new FileStorage(dir + "/certs", kCertStorageDepth),
+                   new FileStorage(dir + "/tree", kTreeStorageDepth),
+                   new FileStorage(dir + "/meta", 0)));
+  } else if (type == "sqlite") {
+    return unique_ptr<Database>(new SQLiteDB(dir + "/sqlite"));
+  } else if (type == "leveldb") {
+    return unique_ptr<Database>(new LevelDB(dir + "/leveldb"));
+  } else if (type == "segment") {
+    return unique_ptr<Database>(new SegmentDB(dir + "/segments"));
+  }
+  LOG(FATAL) << "unknown database type: " << type;
+}
+
+
+void MakeDir(const string& dir) {
+  PCHECK(mkdir(dir.c_str(), 0700) == 0) << "mkdir(" << dir << ")";
+}
+
+
+// Makes a new, empty directory for a database of |type|.
+string NewDatabaseDir(const string& root, const string& type,
+                      int64_t num_entries) {
+  const string dir(root + "/" + type + "-" + to_string(num_entries));
+  MakeDir(dir);
+  if (type == "file") {
+    MakeDir(dir + "/certs");
+    MakeDir(dir + "/tree");
+    MakeDir(dir + "/meta");
+  }
+  return dir;
+}
+
+
+int RemoveFile(const char* path, const struct stat*, int, struct FTW*) {
+  PCHECK(remove(path) == 0) << "remove(" << path << ")";
+  return 0;
+}
+
+
+void RemoveTree(const string& dir) {
+  CHECK_EQ(0, nftw(dir.c_str(), &RemoveFile, 64, FTW_DEPTH | FTW_PHYS));
+}
+
+
+// The resident set size of this process, in kB, or -1 if unknown.
+int64_t CurrentRssKb() {
+  std::ifstream statm("/proc/self/statm");
+  int64_t size, resident;
+  if (!(statm >> size >> resident)) {
+    return -1;
+  }
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+
+int64_t MaxRssKb() {
+  struct rusage usage;
+  PCHECK(getrusage(RUSAGE_SELF, &usage) == 0);
+  return usage.ru_maxrss;
+}
+
+
+struct Result {
+  string database;
+  int64_t num_entries;
+  string benchmark;
+  int64_t ops;
+  sc::duration<double> elapsed;
+};
+
+
+void Report(const Result& result) {
+  const double seconds(result.elapsed.count());
+  const double ops_per_second(seconds > 0 ? result.ops / seconds : 0);
+  if (FLAGS_output == "json") {
+    ostringstream json;
+    json << "{\"database\": \"" << result.database
+         << "\", \"num_entries\": " << result.num_entries
+         << ", \"benchmark\": \"" << result.benchmark
+         << "\", \"ops\": " << result.ops << ", \"seconds\": " << seconds
+         << ", \"ops_per_second\": " << ops_per_second
+         << ", \"rss_kb\": " << CurrentRssKb()
+         << ", \"max_rss_kb\": " << MaxRssKb() << "}";
+    cout << json.str() << std::endl;
+    return;
+  }
+  cout << std::left << setw(10) << result.database << std::right << setw(10)
+       << result.num_entries << "  " << std::left << setw(28)
+       << result.benchmark << std::right << setw(10) << result.ops
+       << setw(12) << std::fixed << std::setprecision(3) << seconds << " s"
+       << setw(12) << std::setprecision(0) << ops_per_second << " op/s"
+       << setw(10) << CurrentRssKb() << " kB RSS" << std::endl;
+}
+
+
+// Times the calls to the database in the benchmarks, but not the
+// generation of the entries.
+class Timer {
+ public:
+  Timer() : elapsed_(0) {
+  }
+
+  void Start() {
+    start_ = sc::steady_clock::now();
+  }
+
+  void Stop() {
+    elapsed_ += sc::steady_clock::now() - start_;
+  }
+
+  sc::duration<double> elapsed() const {
+    return elapsed_;
+  }
+
+ private:
+  sc::steady_clock::time_point start_;
+  sc::duration<double> elapsed_;
+};
+
+
+// Fills the database with |num_entries| entries, the first half one
+// at a time, and the rest in batches.
+void BenchmarkWrites(const EntryGenerator& generator, const string& type,
+                     int64_t num_entries, Database* db) {
+  const int64_t num_single(num_entries / 2);
+  Timer single;
+  for (int64_t index = 0; index < num_single; ++index) {
+    const LoggedEntry logged(generator.Entry(index));
+    single.Start();
+    CHECK_EQ(Database::OK, db->CreateSequencedEntry(logged));
+    single.Stop();
+  }
+
+  Timer batched;
+  vector<LoggedEntry> batch;
+  for (int64_t index = num_single; index < num_entries;) {
+    batch.clear();
+    for (int i = 0; i < FLAGS_batch_size && index < num_entries; ++i) {
+      batch.emplace_back(generator.Entry(index++));
+    }
+    batched.Start();
+    CHECK_EQ(Database::OK, db->CreateSequencedEntries(batch, nullptr));
+    batched.Stop();
+  }
+  Report({type, num_entries, "CreateSequencedEntry", num_single,
+          single.elapsed()});
+  Report({type, num_entries,
+          "CreateSequencedEntries/" + to_string(FLAGS_batch_size),
+          num_entries - num_single, batched.elapsed()});
+
+  ct::SignedTreeHead sth;
+  sth.set_version(ct::V1);
+  sth.set_timestamp(1000000000000 + num_entries);
+  sth.set_tree_size(num_entries);
+  sth.set_sha256_root_hash(string(32, 'r'));
+  CHECK_EQ(Database::OK, db->WriteTreeHead(sth));
+}
+
+
+void BenchmarkLookups(const EntryGenerator& generator, const string& type,
+                      int64_t num_entries, const Database& db) {
+  mt19937_64 rng(num_entries);
+  vector<int64_t> indexes;
+  vector<string> hashes;
+  for (int i = 0; i < FLAGS_num_lookups; ++i) {
+    indexes.push_back(rng() % num_entries);
+    hashes.push_back(generator.Entry(indexes.back()).Hash());
+  }
+
+  LoggedEntry logged;
+  Timer timer;
+  timer.Start();
+  for (const string& hash : hashes) {
+    CHECK_EQ(Database::LOOKUP_OK, db.LookupByHash(hash, &logged));
+  }
+  timer.Stop();
+  Report({type, num_entries, "LookupByHash", FLAGS_num_lookups,
+          timer.elapsed()});
+
+  timer = Timer();
+  timer.Start();
+  for (const int64_t index : indexes) {
+    CHECK_EQ(Database::LOOKUP_OK, db.LookupByIndex(index, &logged));
+  }
+  timer.Stop();
+  Report({type, num_entries, "LookupByIndex", FLAGS_num_lookups,
+          timer.elapsed()});
+
+  // As many entries as the lookups, in ranges starting at random.
+  int64_t scanned(0);
+  timer = Timer();
+  timer.Start();
+  while (scanned < FLAGS_num_lookups) {
+    const int64_t start(rng() % num_entries);
+    const unique_ptr<Database::Iterator> it(db.ScanEntries(start));
+    for (int i = 0; i < FLAGS_scan_length && it->GetNextEntry(&logged);
+         ++i) {
+      ++scanned;
+    }
+  }
+  timer.Stop();
+  Report({type, num_entries, "ScanEntries/" + to_string(FLAGS_scan_length),
+          scanned, timer.elapsed()});
+}
+
+
+void BenchmarkDatabase(const EntryGenerator& generator, const string& root,
+                       const string& type, int64_t num_entries) {
+  const string dir(NewDatabaseDir(root, type, num_entries));
+  unique_ptr<Database> db(OpenDatabase(type, dir));
+  BenchmarkWrites(generator, type, num_entries, db.get());
+  BenchmarkLookups(generator, type, num_entries, *db);
+
+  // Opening it again rebuilds the in-memory indexes of the FileDB and
+  // SegmentDB, for example.
+  db.reset();
+  Timer timer;
+  timer.Start();
+  db = OpenDatabase(type, dir);
+  CHECK_EQ(num_entries, db->TreeSize());
+  timer.Stop();
+  Report({type, num_entries, "Open", 1, timer.elapsed()});
+
+  db.reset();
+  RemoveTree(dir);
+}
+
+
+}  // namespace
+
+
+int main(int argc, char* argv[]) {
+  google::SetUsageMessage(
+      "Benchmarks the databases, printing the time taken by each kind of "
+      "operation, and the memory used.");
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  ConfigureSerializerForV1CT();
+
+  CHECK_GT(FLAGS_batch_size, 0);
+  CHECK_GT(FLAGS_num_lookups, 0);
+  CHECK_GT(FLAGS_scan_length, 0);
+  CHECK(FLAGS_output == "text" || FLAGS_output == "json")
+      << "--output must be \"text\" or \"json\"";
+
+  const EntryGenerator generator(FLAGS_chains);
+  string root(FLAGS_bench_dir + "/bench_database.XXXXXX");
+  PCHECK(mkdtemp(&root[0])) << "mkdtemp(" << root << ")";
+
+  for (const string& num_entries_str : util::split(FLAGS_num_entries)) {
+    char* end;
+    const int64_t num_entries(strtoll(num_entries_str.c_str(), &end, 10));
+    CHECK(*end == '\0' && num_entries > 0)
+        << "invalid --num_entries: " << num_entries_str;
+    for (const string& type : util::split(FLAGS_databases)) {
+      BenchmarkDatabase(generator, root, type, num_entries);
+    }
+  }
+
+  RemoveTree(root);
+  return 0;
+}
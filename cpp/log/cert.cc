@@ -18,9 +18,11 @@
 #include <time.h>
 #include <algorithm>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
+using std::call_once;
 using std::move;
 using std::string;
 using std::to_string;
@@ -141,8 +143,28 @@ StatusOr<bool> check_dsa_signature(const X509* cert,
 }
 
 #endif
+
+
+// Reads the header of the DER element at |p|, which must fit before
+// |end|, and sets |*content| and |*content_end| around its contents.
+bool ReadDerHeader(const unsigned char* p, const unsigned char* end,
+                   int* tag, int* xclass, const unsigned char** content,
+                   const unsigned char** content_end) {
+  long length;
+  const int ret(ASN1_get_object(&p, &length, tag, xclass, end - p));
+  // Either an error, or BER with an indefinite length.
+  if (ret & 0x81) {
+    ClearOpenSSLErrors();
+    return false;
+  }
+  *content = p;
+  *content_end = p + length;
+  return true;
 }
 
+
+}  // namespace
+
 namespace cert_trans {
 
 
@@ -174,12 +196,71 @@ string ASN1ToStringAndCheckForNulls(ASN1_STRING* asn1_string,
 
 
 unique_ptr<Cert> Cert::FromX509(ScopedX509 x509) {
-  return x509 ? unique_ptr<Cert>(new Cert(move(x509))) : nullptr;
+  return x509 ? unique_ptr<Cert>(new Cert(move(x509), string())) : nullptr;
 }
 
 
-Cert::Cert(ScopedX509 x509) : x509_(move(x509)) {
+Cert::Cert(ScopedX509 x509, const string& der)
+    : x509_(move(x509)),
+      der_(der),
+      subject_name_hash_(0),
+      issuer_name_hash_(0) {
   CHECK(x509_);
+  if (der_.empty()) {
+    unsigned char* der_buf(nullptr);
+    const int der_length(i2d_X509(x509_.get(), &der_buf));
+    if (der_length >= 0) {
+      der_.assign(reinterpret_cast<char*>(der_buf), der_length);
+      OPENSSL_free(der_buf);
+    }
+  }
+  LocateParts();
+}
+
+
+void Cert::LocateParts() {
+  const unsigned char* const begin(
+      reinterpret_cast<const unsigned char*>(der_.data()));
+  const unsigned char* const end(begin + der_.size());
+  const unsigned char* content;
+  const unsigned char* content_end;
+  int tag, xclass;
+
+  // Certificate ::= SEQUENCE { tbsCertificate SEQUENCE { ... }, ... }
+  if (!ReadDerHeader(begin, end, &tag, &xclass, &content, &content_end) ||
+      tag != V_ASN1_SEQUENCE) {
+    return;
+  }
+  const unsigned char* const tbs(content);
+  if (!ReadDerHeader(tbs, content_end, &tag, &xclass, &content,
+                     &content_end) ||
+      tag != V_ASN1_SEQUENCE) {
+    return;
+  }
+  const size_t tbs_length(content_end - tbs);
+  const unsigned char* const tbs_end(content_end);
+
+  // Skip the optional [0] version, then the serialNumber, signature,
+  // issuer, validity and subject.
+  const unsigned char* p(content);
+  for (int skip = 0; skip < 5; ++skip) {
+    if (!ReadDerHeader(p, tbs_end, &tag, &xclass, &content, &content_end)) {
+      return;
+    }
+    if (skip == 0 && xclass == V_ASN1_CONTEXT_SPECIFIC && tag == 0) {
+      --skip;
+    }
+    p = content_end;
+  }
+  if (!ReadDerHeader(p, tbs_end, &tag, &xclass, &content, &content_end) ||
+      tag != V_ASN1_SEQUENCE) {
+    return;
+  }
+
+  tbs_offset_ = tbs - begin;
+  tbs_length_ = tbs_length;
+  spki_offset_ = p - begin;
+  spki_length_ = content_end - p;
 }
 
 
@@ -218,14 +299,27 @@ unique_ptr<Cert> Cert::Clone() const {
 
 
 unique_ptr<Cert> Cert::FromDerString(const string& der_string) {
-  const unsigned char* start =
-      reinterpret_cast<const unsigned char*>(der_string.data());
-  ScopedX509 x509(d2i_X509(nullptr, &start, der_string.size()));
+  return FromDer(reinterpret_cast<const unsigned char*>(der_string.data()),
+                 der_string.size());
+}
+
+
+// static
+unique_ptr<Cert> Cert::FromDer(const unsigned char* der, size_t length) {
+  const unsigned char* end(der);
+  ScopedX509 x509(d2i_X509(nullptr, &end, length));
   if (!x509) {
     LOG(WARNING) << "Input is not a valid DER-encoded certificate";
     LOG_OPENSSL_ERRORS(WARNING);
+    return nullptr;
   }
-  return FromX509(move(x509));
+  // Keep the input as the encoding, unless there was trailing data.
+  const size_t der_length(end - der);
+  return unique_ptr<Cert>(new Cert(
+      move(x509),
+      der_length == length
+          ? string(reinterpret_cast<const char*>(der), length)
+          : string()));
 }
 
 
@@ -427,6 +521,14 @@ StatusOr<bool> Cert::HasExtendedKeyUsage(int key_usage_nid) const {
 
 
 StatusOr<bool> Cert::IsIssuedBy(const Cert& issuer) const {
+  // Most candidate issuers are rejected on their name alone, which
+  // the hashes check without going through the names again.
+  ComputeNameHashes();
+  issuer.ComputeNameHashes();
+  if (issuer_name_hash_ != issuer.subject_name_hash_) {
+    return false;
+  }
+
   // Seemingly no negative "real" error codes are returned from openssl api.
   return X509_check_issued(CHECK_NOTNULL(issuer.x509_.get()),
                            CHECK_NOTNULL(x509_.get())) == X509_V_OK;
@@ -439,15 +541,13 @@ StatusOr<bool> Cert::LogUnsupportedAlgorithm() const {
 }
 
 StatusOr<bool> Cert::IsSignedBy(const Cert& issuer) const {
-  const ScopedEVP_PKEY issuer_key(
-      X509_get_pubkey(CHECK_NOTNULL(issuer.x509_.get())));
+  EVP_PKEY* const issuer_key(issuer.PublicKey());
   if (!issuer_key) {
     LOG(WARNING) << "NULL issuer key";
-    LOG_OPENSSL_ERRORS(WARNING);
     return false;
   }
 
-  const int ret(X509_verify(CHECK_NOTNULL(x509_.get()), issuer_key.get()));
+  const int ret(X509_verify(CHECK_NOTNULL(x509_.get()), issuer_key));
   if (ret == 1) {
     return true;
   }
@@ -459,7 +559,7 @@ StatusOr<bool> Cert::IsSignedBy(const Cert& issuer) const {
   // spam rather than intending to trust the certificate.
   // Let's see if we can verify a DSA signature
   const StatusOr<bool> is_valid_dsa_sig =
-      check_dsa_signature(x509_.get(), issuer_key.get());
+      check_dsa_signature(x509_.get(), issuer_key);
 
   if (is_valid_dsa_sig.ok()) {
     if (is_valid_dsa_sig.ValueOrDie()) {
@@ -512,6 +612,11 @@ StatusOr<bool> Cert::IsSignedBy(const Cert& issuer) const {
 
 
 util::Status Cert::DerEncoding(string* result) const {
+  if (!der_.empty()) {
+    result->assign(der_);
+    return util::Status::OK;
+  }
+
   unsigned char* der_buf(nullptr);
   int der_length = i2d_X509(CHECK_NOTNULL(x509_.get()), &der_buf);
 
@@ -548,24 +653,60 @@ util::Status Cert::PemEncoding(string* result) const {
 }
 
 
+EVP_PKEY* Cert::PublicKey() const {
+  call_once(public_key_once_, [this]() {
+    public_key_.reset(X509_get_pubkey(CHECK_NOTNULL(x509_.get())));
+    if (!public_key_) {
+      LOG_OPENSSL_ERRORS(WARNING);
+    }
+  });
+  return public_key_.get();
+}
+
+
+void Cert::ComputeNameHashes() const {
+  call_once(name_hashes_once_, [this]() {
+    subject_name_hash_ = X509_subject_name_hash(CHECK_NOTNULL(x509_.get()));
+    issuer_name_hash_ = X509_issuer_name_hash(x509_.get());
+  });
+}
+
+
 util::Status Cert::Sha256Digest(string* result) const {
-  unsigned char digest[EVP_MAX_MD_SIZE];
-  unsigned int len;
-  if (X509_digest(CHECK_NOTNULL(x509_.get()), EVP_sha256(), digest, &len) !=
-      1) {
-    // Failed to digest. Several possible reasons but we will just reject
-    // the input rather than trying to interpret the cause
-    LOG(WARNING) << "Failed to compute cert digest";
-    LOG_OPENSSL_ERRORS(WARNING);
-    return util::Status(Code::INVALID_ARGUMENT, "SHA256 digest failed");
-  }
+  call_once(sha256_once_, [this]() {
+    if (!der_.empty()) {
+      sha256_digest_ = Sha256Hasher::Sha256Digest(der_);
+      return;
+    }
 
-  result->assign(reinterpret_cast<char*>(digest), len);
-  return util::Status::OK;
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int len;
+    if (X509_digest(CHECK_NOTNULL(x509_.get()), EVP_sha256(), digest,
+                    &len) != 1) {
+      // Failed to digest. Several possible reasons but we will just reject
+      // the input rather than trying to interpret the cause
+      LOG(WARNING) << "Failed to compute cert digest";
+      LOG_OPENSSL_ERRORS(WARNING);
+      sha256_status_ =
+          util::Status(Code::INVALID_ARGUMENT, "SHA256 digest failed");
+      return;
+    }
+    sha256_digest_.assign(reinterpret_cast<char*>(digest), len);
+  });
+
+  if (sha256_status_.ok()) {
+    result->assign(sha256_digest_);
+  }
+  return sha256_status_;
 }
 
 
 util::Status Cert::DerEncodedTbsCertificate(string* result) const {
+  if (tbs_length_ > 0) {
+    result->assign(der_, tbs_offset_, tbs_length_);
+    return util::Status::OK;
+  }
+
   unsigned char* der_buf(nullptr);
   int der_length = i2d_re_X509_tbs(CHECK_NOTNULL(x509_.get()), &der_buf);
   if (der_length < 0) {
@@ -627,6 +768,10 @@ util::Status Cert::PublicKeySha256Digest(string* result) const {
 
 
 StatusOr<string> Cert::SPKI() const {
+  if (spki_length_ > 0) {
+    return der_.substr(spki_offset_, spki_length_);
+  }
+
   unsigned char* der_buf(nullptr);
   const int der_length(
       i2d_X509_PUBKEY(X509_get_X509_PUBKEY(CHECK_NOTNULL(x509_.get())),
@@ -649,12 +794,18 @@ StatusOr<string> Cert::SPKI() const {
 
 
 util::Status Cert::SPKISha256Digest(string* result) const {
-  const util::StatusOr<string> spki(SPKI());
-  if (spki.ok()) {
-    string sha256_digest = Sha256Hasher::Sha256Digest(spki.ValueOrDie());
-    CHECK_NOTNULL(result)->assign(sha256_digest);
+  call_once(spki_sha256_once_, [this]() {
+    const util::StatusOr<string> spki(SPKI());
+    if (spki.ok()) {
+      spki_sha256_digest_ = Sha256Hasher::Sha256Digest(spki.ValueOrDie());
+    }
+    spki_sha256_status_ = spki.status();
+  });
+
+  if (spki_sha256_status_.ok()) {
+    CHECK_NOTNULL(result)->assign(spki_sha256_digest_);
   }
-  return spki.status();
+  return spki_sha256_status_;
 }
 
 util::Status Cert::OctetStringExtensionData(int extension_nid,
@@ -5,6 +5,7 @@
 #include <openssl/asn1.h>
 #include <openssl/x509.h>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -25,6 +26,11 @@ class Cert {
   // The following factory static methods return null if the input is
   // not valid.
   static std::unique_ptr<Cert> FromDerString(const std::string& der_string);
+  // Parses the |length| bytes at |der| directly, keeping them as the
+  // encoding returned by DerEncoding() and the encodings of the parts
+  // of the cert, rather than encoding them again.
+  static std::unique_ptr<Cert> FromDer(const unsigned char* der,
+                                       size_t length);
   // Caller still owns the BIO afterwards.
   static std::unique_ptr<Cert> FromDerBio(BIO* bio_in);
   static std::unique_ptr<Cert> FromPemString(const std::string& pem_string);
@@ -95,7 +101,8 @@ class Cert {
     return IsIssuedBy(*this);
   }
 
-  // Sets the DER encoding of the cert in |result|.
+  // Sets the DER encoding of the cert in |result|, which is the one
+  // it was parsed from, if any, and is only computed once otherwise.
   // Returns TRUE if the encoding succeeded.
   // Returns FALSE if the encoding failed.
   // Returns ERROR if the cert is not loaded.
@@ -107,7 +114,8 @@ class Cert {
   // Returns ERROR if the cert is not loaded.
   util::Status PemEncoding(std::string* result) const;
 
-  // Sets the SHA256 digest of the cert in |result|.
+  // Sets the SHA256 digest of the cert in |result|, only computed on
+  // the first call.
   // Returns TRUE if computing the digest succeeded.
   // Returns FALSE if computing the digest failed.
   // Returns ERROR if the cert is not loaded.
@@ -143,7 +151,8 @@ class Cert {
   // Returns FAILED_PRECONDITION if the cert is not loaded.
   util::Status SubjectAltNames(std::vector<std::string>* dns_alt_names) const;
 
-  // Sets the SHA256 digest of the cert's subjectPublicKeyInfo in |result|.
+  // Sets the SHA256 digest of the cert's subjectPublicKeyInfo in |result|,
+  // only computed on the first call.
   // Returns TRUE if computing the digest succeeded.
   // Returns FALSE if computing the digest failed.
   // Returns ERROR if the cert is not loaded.
@@ -194,8 +203,9 @@ class Cert {
   FRIEND_TEST(CtExtensionsTest, TestPrecertSigning);
 
  private:
-  // Will CHECK-fail if |x509| is null.
-  explicit Cert(ScopedX509 x509);
+  // Will CHECK-fail if |x509| is null. The |der| encoding of |x509|
+  // is computed if empty.
+  Cert(ScopedX509 x509, const std::string& der);
   Cert() = delete;
 
   util::StatusOr<int> ExtensionIndex(int extension_nid) const;
@@ -207,7 +217,43 @@ class Cert {
   static std::string PrintName(X509_NAME* name);
   static std::string PrintTime(ASN1_TIME* when);
   static util::Status DerEncodedName(X509_NAME* name, std::string* result);
+  // The public key of the certificate, parsed on first use and kept
+  // for verifying the certificates it issues. NULL if it cannot be
+  // parsed. Owned by this Cert.
+  EVP_PKEY* PublicKey() const;
+  // Hashes of the canonical encodings of the subject and issuer names,
+  // as from X509_subject_name_hash(), computed on first use. Names that
+  // compare equal have the same hash.
+  void ComputeNameHashes() const;
+  // Finds the TBS and the subjectPublicKeyInfo in |der_|, leaving
+  // their lengths at zero if it cannot.
+  void LocateParts();
   const ScopedX509 x509_;
+  // Empty if encoding failed, in which case DerEncoding() tries again
+  // to report the error.
+  std::string der_;
+  // Where the TBS and the subjectPublicKeyInfo are in |der_|, to slice
+  // them from it rather than encoding them again. Zero lengths if they
+  // could not be found.
+  size_t tbs_offset_ = 0;
+  size_t tbs_length_ = 0;
+  size_t spki_offset_ = 0;
+  size_t spki_length_ = 0;
+
+  // The digests, computed on first use, possibly by several threads
+  // at once (for the trusted roots and intermediates, shared by the
+  // chains being checked).
+  mutable std::once_flag sha256_once_;
+  mutable util::Status sha256_status_;
+  mutable std::string sha256_digest_;
+  mutable std::once_flag spki_sha256_once_;
+  mutable util::Status spki_sha256_status_;
+  mutable std::string spki_sha256_digest_;
+  mutable std::once_flag public_key_once_;
+  mutable ScopedEVP_PKEY public_key_;
+  mutable std::once_flag name_hashes_once_;
+  mutable unsigned long subject_name_hash_;
+  mutable unsigned long issuer_name_hash_;
 
   DISALLOW_COPY_AND_ASSIGN(Cert);
 };
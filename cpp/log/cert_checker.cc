@@ -1,6 +1,7 @@
 /* -*- indent-tabs-mode: nil -*- */
 #include "log/cert_checker.h"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <openssl/asn1.h>
 #include <openssl/bio.h>
@@ -8,8 +9,11 @@
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
 #include <string.h>
+#include <algorithm>
+#include <condition_variable>
 #include <memory>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -17,12 +21,21 @@
 #include "log/ct_extensions.h"
 #include "util/openssl_scoped_types.h"
 #include "util/openssl_util.h"  // for LOG_OPENSSL_ERRORS
+#include "util/thread_pool.h"
 #include "util/util.h"
 
+using std::atomic_load;
+using std::atomic_store;
+using std::condition_variable;
+using std::lock_guard;
+using std::make_shared;
+using std::min;
 using std::move;
-using std::multimap;
-using std::pair;
+using std::mutex;
+using std::shared_ptr;
 using std::string;
+using std::thread;
+using std::unique_lock;
 using std::unique_ptr;
 using std::vector;
 using util::ClearOpenSSLErrors;
@@ -30,23 +43,298 @@ using util::Status;
 using util::StatusOr;
 using util::error::Code;
 
+DEFINE_int32(cert_checker_verified_links, 10000,
+             "Number of verified signatures between intermediate and root "
+             "certificates to remember, so that chains sharing them only "
+             "need their leaf checked (0 to disable).");
+
 namespace cert_trans {
 
-bool CertChecker::LoadTrustedCertificates(const string& cert_file) {
-  // A read-only BIO.
-  ScopedBIO bio_in(BIO_new(BIO_s_file()));
-  if (!bio_in) {
-    LOG_OPENSSL_ERRORS(ERROR);
+// The links of a chain being checked, claimed one at a time by
+// whichever thread gets to them first.
+struct CertChecker::LinksCheck {
+  explicit LinksCheck(size_t num_links)
+      : results(num_links), next(0), done(0) {
+  }
+
+  mutex lock;
+  condition_variable all_done;
+  vector<Status> results;
+  size_t next;
+  size_t done;
+};
+
+namespace {
+
+const char kPemBegin[] = "-----BEGIN ";
+const char kPemEnd[] = "-----END ";
+const char kPemDashes[] = "-----";
+
+
+// Splits |pem| into the blocks of the certificates in it, skipping
+// anything else, as PEM_read_bio_X509() would. Returns false if a
+// certificate block is not terminated.
+bool SplitPemCertificates(const string& pem, vector<string>* blocks) {
+  size_t pos(0);
+  while ((pos = pem.find(kPemBegin, pos)) != string::npos) {
+    const size_t label_start(pos + strlen(kPemBegin));
+    const size_t label_end(pem.find(kPemDashes, label_start));
+    if (label_end == string::npos) {
+      return false;
+    }
+    const string label(pem, label_start, label_end - label_start);
+    if (label != PEM_STRING_X509 && label != PEM_STRING_X509_OLD) {
+      pos = label_end;
+      continue;
+    }
+
+    const string end_line(kPemEnd + label + kPemDashes);
+    const size_t end(pem.find(end_line, label_end));
+    if (end == string::npos) {
+      return false;
+    }
+    blocks->emplace_back(pem, pos, end + end_line.size() - pos);
+    pos = end + end_line.size();
+  }
+  return true;
+}
+
+
+}  // namespace
+
+
+// The PEM blocks of a bundle being parsed, claimed one at a time by
+// whichever thread gets to them first.
+struct CertChecker::PemParse {
+  explicit PemParse(vector<string>&& pem_blocks)
+      : blocks(move(pem_blocks)), certs(blocks.size()), next(0), done(0) {
+  }
+
+  const vector<string> blocks;
+  mutex lock;
+  condition_variable all_done;
+  // Null for the blocks that did not parse.
+  vector<unique_ptr<Cert>> certs;
+  size_t next;
+  size_t done;
+};
+
+
+// static
+void CertChecker::ParsePemBlocks(PemParse* parse) {
+  unique_lock<mutex> lock(parse->lock);
+  while (parse->next < parse->blocks.size()) {
+    const size_t index(parse->next++);
+    lock.unlock();
+    unique_ptr<Cert> cert(Cert::FromPemString(parse->blocks[index]));
+    lock.lock();
+
+    parse->certs[index] = move(cert);
+    if (++parse->done == parse->certs.size()) {
+      parse->all_done.notify_all();
+    }
+  }
+}
+
+namespace {
+
+const unsigned char kDerSequence = 0x30;
+const unsigned char kDerInteger = 0x02;
+const unsigned char kDerExplicitVersion = 0xa0;
+const unsigned char kDerUtcTime = 0x17;
+const unsigned char kDerGeneralizedTime = 0x18;
+
+// Reads the DER element at |*pos|, which must have tag |tag| (unless
+// that is zero), moving |*pos| past it and pointing |*contents| and
+// |*length| at its contents.
+bool ReadDerElement(const unsigned char** pos, const unsigned char* end,
+                    unsigned char tag, const unsigned char** contents,
+                    size_t* length) {
+  const unsigned char* p(*pos);
+  if (end - p < 2 || (tag != 0 && *p != tag)) {
+    return false;
+  }
+  ++p;
+
+  size_t len(*p++);
+  if (len & 0x80) {
+    const size_t num_bytes(len & 0x7f);
+    if (num_bytes == 0 || num_bytes > 4 ||
+        static_cast<size_t>(end - p) < num_bytes) {
+      return false;
+    }
+    len = 0;
+    for (size_t i = 0; i < num_bytes; ++i) {
+      len = (len << 8) | *p++;
+    }
+  }
+  if (static_cast<size_t>(end - p) < len) {
     return false;
   }
 
-  if (BIO_read_filename(bio_in.get(), cert_file.c_str()) <= 0) {
-    LOG(ERROR) << "Failed to open file " << cert_file << " for reading";
-    LOG_OPENSSL_ERRORS(ERROR);
+  *contents = p;
+  *length = len;
+  *pos = p + len;
+  return true;
+}
+
+// Parses |count| decimal digits at |*pos|, moving past them.
+bool ReadDigits(const unsigned char** pos, int count, int* value) {
+  *value = 0;
+  for (int i = 0; i < count; ++i) {
+    const unsigned char c((*pos)[i]);
+    if (c < '0' || c > '9') {
+      return false;
+    }
+    *value = *value * 10 + (c - '0');
+  }
+  *pos += count;
+  return true;
+}
+
+// The number of days from 1970-01-01 to the given date, in the
+// proleptic Gregorian calendar.
+int64_t DaysFromCivil(int64_t year, int month, int day) {
+  year -= month <= 2;
+  const int64_t era((year >= 0 ? year : year - 399) / 400);
+  const int64_t year_of_era(year - era * 400);
+  const int64_t day_of_year((153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 +
+                            day - 1);
+  const int64_t day_of_era(year_of_era * 365 + year_of_era / 4 -
+                           year_of_era / 100 + day_of_year);
+  return era * 146097 + day_of_era - 719468;
+}
+
+// Parses a Time of RFC 5280 (UTCTime or GeneralizedTime, always in
+// UTC and with seconds), into seconds since the epoch.
+bool ParseDerTime(unsigned char tag, const unsigned char* contents,
+                  size_t length, int64_t* result) {
+  int year, month, day, hour, minute, second;
+  const unsigned char* p(contents);
+  if (tag == kDerUtcTime && length == 13) {
+    if (!ReadDigits(&p, 2, &year)) {
+      return false;
+    }
+    year += year >= 50 ? 1900 : 2000;
+  } else if (tag == kDerGeneralizedTime && length == 15) {
+    if (!ReadDigits(&p, 4, &year)) {
+      return false;
+    }
+  } else {
     return false;
   }
 
-  return LoadTrustedCertificatesFromBIO(bio_in.get());
+  if (!ReadDigits(&p, 2, &month) || !ReadDigits(&p, 2, &day) ||
+      !ReadDigits(&p, 2, &hour) || !ReadDigits(&p, 2, &minute) ||
+      !ReadDigits(&p, 2, &second) || *p != 'Z' || month < 1 || month > 12 ||
+      day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60) {
+    return false;
+  }
+
+  *result = ((DaysFromCivil(year, month, day) * 24 + hour) * 60 + minute) *
+                60 +
+            second;
+  return true;
+}
+
+}  // namespace
+
+CertChecker::CertChecker(ThreadPool* pool) : pool_(CHECK_NOTNULL(pool)) {
+}
+
+void CertChecker::SetNotAfterRange(int64_t start, int64_t limit) {
+  CHECK(start == 0 || limit == 0 || start < limit);
+  not_after_start_ = start;
+  not_after_limit_ = limit;
+}
+
+bool CertChecker::AcceptsNotAfter(int64_t not_after) const {
+  return (not_after_start_ == 0 || not_after >= not_after_start_) &&
+         (not_after_limit_ == 0 || not_after < not_after_limit_);
+}
+
+// static
+StatusOr<int64_t> CertChecker::ParseNotAfter(const string& der) {
+  const Status invalid(Code::INVALID_ARGUMENT, "invalid certificate");
+  const unsigned char* pos(reinterpret_cast<const unsigned char*>(der.data()));
+  const unsigned char* end(pos + der.size());
+  const unsigned char* contents;
+  size_t length;
+
+  // Certificate, then TBSCertificate.
+  if (!ReadDerElement(&pos, end, kDerSequence, &contents, &length)) {
+    return invalid;
+  }
+  pos = contents;
+  end = contents + length;
+  if (!ReadDerElement(&pos, end, kDerSequence, &contents, &length)) {
+    return invalid;
+  }
+  pos = contents;
+  end = contents + length;
+
+  // Skip the version (if any), the serial number, the signature
+  // algorithm and the issuer.
+  if (pos < end && *pos == kDerExplicitVersion &&
+      !ReadDerElement(&pos, end, kDerExplicitVersion, &contents, &length)) {
+    return invalid;
+  }
+  if (!ReadDerElement(&pos, end, kDerInteger, &contents, &length) ||
+      !ReadDerElement(&pos, end, kDerSequence, &contents, &length) ||
+      !ReadDerElement(&pos, end, kDerSequence, &contents, &length)) {
+    return invalid;
+  }
+
+  // The validity, of which we want the second time.
+  if (!ReadDerElement(&pos, end, kDerSequence, &contents, &length)) {
+    return invalid;
+  }
+  pos = contents;
+  end = contents + length;
+  if (!ReadDerElement(&pos, end, 0, &contents, &length) || pos == end) {
+    return invalid;
+  }
+  const unsigned char tag(*pos);
+  int64_t not_after;
+  if (!ReadDerElement(&pos, end, 0, &contents, &length) ||
+      !ParseDerTime(tag, contents, length, &not_after)) {
+    return invalid;
+  }
+
+  return not_after;
+}
+
+Status CertChecker::CheckNotAfter(const string& der) const {
+  if (!HasNotAfterRange()) {
+    return Status::OK;
+  }
+
+  const StatusOr<int64_t> not_after(ParseNotAfter(der));
+  if (!not_after.ok()) {
+    return not_after.status();
+  }
+  if (!AcceptsNotAfter(not_after.ValueOrDie())) {
+    return Status(Code::OUT_OF_RANGE,
+                  "certificate expiry outside of the range of this log");
+  }
+  return Status::OK;
+}
+
+Status CertChecker::CheckLeafNotAfter(const CertChain& chain) const {
+  if (!HasNotAfterRange()) {
+    return Status::OK;
+  }
+
+  string der;
+  const Status status(chain.LeafCert()->DerEncoding(&der));
+  if (!status.ok()) {
+    return status;
+  }
+  return CheckNotAfter(der);
+}
+
+bool CertChecker::LoadTrustedCertificates(const string& cert_file) {
+  return AddTrustedCertificatesFromFile(cert_file, false /* replace */);
 }
 
 bool CertChecker::LoadTrustedCertificates(
@@ -56,70 +344,91 @@ bool CertChecker::LoadTrustedCertificates(
        it != trusted_certs.end(); ++it) {
     concat_certs.append(*it);
   }
-  // A read-only memory BIO.
-  ScopedBIO bio_in(BIO_new_mem_buf(
-      const_cast<void*>(reinterpret_cast<const void*>(concat_certs.c_str())),
-      -1 /* no length, since null-terminated */));
-  if (!bio_in) {
-    LOG_OPENSSL_ERRORS(ERROR);
+  return AddTrustedCertificates(concat_certs, false /* replace */);
+}
+
+bool CertChecker::ReloadTrustedCertificates(const string& cert_file) {
+  return AddTrustedCertificatesFromFile(cert_file, true /* replace */);
+}
+
+shared_ptr<const CertChecker::TrustedCertificates>
+CertChecker::GetTrustedCertificates() const {
+  return atomic_load(&trusted_);
+}
+
+bool CertChecker::AddTrustedCertificatesFromFile(const string& cert_file,
+                                                 bool replace) {
+  string pem;
+  if (!util::ReadBinaryFile(cert_file, &pem)) {
+    LOG(ERROR) << "Failed to open file " << cert_file << " for reading";
     return false;
   }
-
-  return LoadTrustedCertificatesFromBIO(bio_in.get());
+  return AddTrustedCertificates(pem, replace);
 }
 
-bool CertChecker::LoadTrustedCertificatesFromBIO(BIO* bio_in) {
-  CHECK_NOTNULL(bio_in);
-  vector<pair<string, unique_ptr<const Cert>>> certs_to_add;
-  bool error = false;
-  // certs_to_add may be empty if no new certs were added, so keep track of
-  // successfully parsed cert count separately.
-  size_t cert_count = 0;
-
-  while (!error) {
-    ScopedX509 x509(PEM_read_bio_X509(bio_in, nullptr, nullptr, nullptr));
-    if (x509) {
-      // TODO(ekasper): check that the issuing CA cert is temporally valid
-      // and at least warn if it isn't.
-      unique_ptr<Cert> cert(Cert::FromX509(move(x509)));
-      string subject_name;
-      const StatusOr<bool> is_trusted(IsTrusted(*cert, &subject_name));
-      if (!is_trusted.ok()) {
-        error = true;
-        break;
-      }
+bool CertChecker::AddTrustedCertificates(const string& pem, bool replace) {
+  vector<string> blocks;
+  if (!SplitPemCertificates(pem, &blocks)) {
+    LOG(ERROR) << "Badly encoded certificate file.";
+    return false;
+  }
+  if (blocks.empty()) {
+    return false;
+  }
 
-      ++cert_count;
-      if (!is_trusted.ValueOrDie()) {
-        certs_to_add.push_back(make_pair(subject_name, move(cert)));
-      }
-    } else {
-      // See if we reached the end of the file.
-      auto err = ERR_peek_last_error();
-      if (ERR_GET_LIB(err) == ERR_LIB_PEM &&
-          ERR_GET_REASON(err) == PEM_R_NO_START_LINE) {
-        ClearOpenSSLErrors();
-        break;
-      } else {
-        // A real error.
-        LOG(ERROR) << "Badly encoded certificate file.";
-        LOG_OPENSSL_ERRORS(WARNING);
-        error = true;
-        break;
-      }
+  // Parsing is done before taking |load_lock_|, as it is most of the
+  // work, and does not depend on the certificates already loaded.
+  const shared_ptr<PemParse> parse(make_shared<PemParse>(move(blocks)));
+  if (pool_) {
+    const size_t num_helpers(
+        min<size_t>(parse->blocks.size(), thread::hardware_concurrency()));
+    for (size_t i = 1; i < num_helpers; ++i) {
+      pool_->Add([parse]() { ParsePemBlocks(parse.get()); });
+    }
+  }
+  ParsePemBlocks(parse.get());
+  {
+    unique_lock<mutex> lock(parse->lock);
+    parse->all_done.wait(lock, [&parse]() {
+      return parse->done == parse->certs.size();
+    });
+  }
+  for (const auto& cert : parse->certs) {
+    if (!cert) {
+      LOG(ERROR) << "Badly encoded certificate file.";
+      return false;
     }
   }
 
-  if (error || !cert_count) {
-    return false;
+  lock_guard<mutex> lock(load_lock_);
+  const shared_ptr<TrustedCertificates> trusted(
+      replace ? make_shared<TrustedCertificates>()
+              : make_shared<TrustedCertificates>(*atomic_load(&trusted_)));
+  size_t new_certs(0);
+  for (auto& cert : parse->certs) {
+    // TODO(ekasper): check that the issuing CA cert is temporally valid
+    // and at least warn if it isn't.
+    string subject_name;
+    const StatusOr<bool> is_trusted(
+        IsTrusted(*trusted, *cert, &subject_name));
+    if (!is_trusted.ok()) {
+      return false;
+    }
+    if (!is_trusted.ValueOrDie()) {
+      trusted->emplace(subject_name, move(cert));
+      ++new_certs;
+    }
   }
 
-  size_t new_certs = certs_to_add.size();
-  while (!certs_to_add.empty()) {
-    trusted_.insert(move(certs_to_add.back()));
-    certs_to_add.pop_back();
+  atomic_store(&trusted_, shared_ptr<const TrustedCertificates>(trusted));
+  ++trusted_generation_;
+  if (replace) {
+    LOG(INFO) << "Replaced trusted store with " << new_certs
+              << " certificate(s)";
+  } else {
+    LOG(INFO) << "Added " << new_certs
+              << " new certificate(s) to trusted store";
   }
-  LOG(INFO) << "Added " << new_certs << " new certificate(s) to trusted store";
 
   return true;
 }
@@ -128,6 +437,11 @@ Status CertChecker::CheckCertChain(CertChain* chain) const {
   if (!chain || !chain->IsLoaded())
     return Status(util::error::INVALID_ARGUMENT, "invalid certificate chain");
 
+  const Status not_after(CheckLeafNotAfter(*chain));
+  if (!not_after.ok()) {
+    return not_after;
+  }
+
   // Weed out things that should obviously be precert chains instead.
   const StatusOr<bool> has_poison =
       chain->LeafCert()->HasCriticalExtension(cert_trans::NID_ctPoison);
@@ -156,7 +470,7 @@ Status CertChecker::CheckIssuerChain(CertChain* chain) const {
     return Status(status.CanonicalCode(), "invalid certificate chain");
   }
 
-  const Status valid_chain(chain->IsValidSignatureChain());
+  const Status valid_chain(CheckSignatureChain(*chain));
   if (!valid_chain.ok()) {
     return valid_chain;
   }
@@ -164,6 +478,70 @@ Status CertChecker::CheckIssuerChain(CertChain* chain) const {
   return GetTrustedCa(chain);
 }
 
+// Same as chain.IsValidSignatureChain(), except for the links already
+// verified, and for the parallelism.
+Status CertChecker::CheckSignatureChain(const CertChain& chain) const {
+  const size_t num_links(chain.Length() > 0 ? chain.Length() - 1 : 0);
+  if (!pool_ || num_links < 2) {
+    for (size_t i = 0; i < num_links; ++i) {
+      const Status status(CheckLink(chain, i));
+      if (!status.ok()) {
+        return status;
+      }
+    }
+    return Status::OK;
+  }
+
+  // The helpers that only get to run once all the links are claimed
+  // return without touching |chain|, which may be gone by then.
+  const shared_ptr<LinksCheck> check(make_shared<LinksCheck>(num_links));
+  for (size_t i = 1; i < num_links; ++i) {
+    pool_->Add([this, &chain, check]() { CheckLinks(chain, check.get()); });
+  }
+  CheckLinks(chain, check.get());
+
+  unique_lock<mutex> lock(check->lock);
+  check->all_done.wait(lock, [&check]() {
+    return check->done == check->results.size();
+  });
+  // The first failure in chain order, as if checked one by one.
+  for (const auto& status : check->results) {
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  return Status::OK;
+}
+
+void CertChecker::CheckLinks(const CertChain& chain, LinksCheck* check) const {
+  unique_lock<mutex> lock(check->lock);
+  while (check->next < check->results.size()) {
+    const size_t index(check->next++);
+    lock.unlock();
+    const Status status(CheckLink(chain, index));
+    lock.lock();
+
+    check->results[index] = status;
+    if (++check->done == check->results.size()) {
+      check->all_done.notify_all();
+    }
+  }
+}
+
+Status CertChecker::CheckLink(const CertChain& chain, size_t index) const {
+  const StatusOr<bool> signed_by_issuer(IsSignedBy(
+      *chain.CertAt(index), *chain.CertAt(index + 1), index > 0));
+  // Propagate any failure, including UNIMPLEMENTED for unsupported
+  // algorithms, which make the chain invalid.
+  if (!signed_by_issuer.ok()) {
+    return signed_by_issuer.status();
+  }
+  if (!signed_by_issuer.ValueOrDie()) {
+    return Status(util::error::INVALID_ARGUMENT, "invalid certificate chain");
+  }
+  return Status::OK;
+}
+
 Status CertChecker::CheckPreCertChain(PreCertChain* chain,
                                       string* issuer_key_hash,
                                       string* tbs_certificate) const {
@@ -171,6 +549,11 @@ Status CertChecker::CheckPreCertChain(PreCertChain* chain,
     return Status(util::error::INVALID_ARGUMENT, "invalid certificate chain");
   }
 
+  const Status not_after(CheckLeafNotAfter(*chain));
+  if (!not_after.ok()) {
+    return not_after;
+  }
+
   const StatusOr<bool> chain_well_formed(chain->IsWellFormed());
   if (chain_well_formed.ok() && !chain_well_formed.ValueOrDie()) {
     return Status(util::error::INVALID_ARGUMENT, "prechain not well formed");
@@ -250,15 +633,18 @@ Status CertChecker::GetTrustedCa(CertChain* chain) const {
     return Status(util::error::INTERNAL, "chain has no valid certificate");
   }
 
-  // Look up issuer from the trusted store.
-  if (trusted_.empty()) {
+  // Look up issuer from the trusted store, as it is now: it stays
+  // alive until we are done, even if it is replaced meanwhile.
+  const shared_ptr<const TrustedCertificates> trusted(
+      GetTrustedCertificates());
+  if (trusted->empty()) {
     LOG(WARNING) << "No trusted certificates loaded";
     return Status(util::error::FAILED_PRECONDITION,
                   "no trusted certificates loaded");
   }
 
   string subject_name;
-  const StatusOr<bool> is_trusted(IsTrusted(*subject, &subject_name));
+  const StatusOr<bool> is_trusted(IsTrusted(*trusted, *subject, &subject_name));
   // Either an error, or true, meaning the last cert is in our trusted
   // store.  Note the trusted cert need not necessarily be
   // self-signed.
@@ -279,14 +665,13 @@ Status CertChecker::GetTrustedCa(CertChain* chain) const {
                   "untrusted self-signed certificate");
   }
 
-  const auto issuer_range(trusted_.equal_range(issuer_name));
+  const auto issuer_range(trusted->equal_range(issuer_name));
   const Cert* issuer(nullptr);
-  for (multimap<string, unique_ptr<const Cert>>::const_iterator it =
-           issuer_range.first;
-       it != issuer_range.second; ++it) {
-    const unique_ptr<const Cert>& issuer_cand(it->second);
+  for (auto it(issuer_range.first); it != issuer_range.second; ++it) {
+    const shared_ptr<const Cert>& issuer_cand(it->second);
 
-    StatusOr<bool> signed_by_issuer = subject->IsSignedBy(*issuer_cand);
+    StatusOr<bool> signed_by_issuer =
+        IsSignedBy(*subject, *issuer_cand, chain->Length() > 1);
     if (signed_by_issuer.status().CanonicalCode() == Code::UNIMPLEMENTED) {
       // If the cert's algorithm is unsupported, then there's no point
       // continuing: it's unconditionally invalid.
@@ -320,8 +705,43 @@ Status CertChecker::GetTrustedCa(CertChain* chain) const {
   return Status::OK;
 }
 
-StatusOr<bool> CertChecker::IsTrusted(const Cert& cert,
-                                      string* subject_name) const {
+StatusOr<bool> CertChecker::IsSignedBy(const Cert& subject,
+                                       const Cert& issuer,
+                                       bool remember) const {
+  remember = remember && FLAGS_cert_checker_verified_links > 0;
+  string key, issuer_digest;
+  if (remember) {
+    // Without the digests, just check the signature as usual.
+    remember = subject.Sha256Digest(&key).ok() &&
+               issuer.Sha256Digest(&issuer_digest).ok();
+    key.append(issuer_digest);
+  }
+  if (remember) {
+    lock_guard<mutex> lock(verified_lock_);
+    if (verified_.count(key) > 0) {
+      return true;
+    }
+  }
+
+  const StatusOr<bool> signed_by_issuer(subject.IsSignedBy(issuer));
+  if (remember && signed_by_issuer.ok() && signed_by_issuer.ValueOrDie()) {
+    lock_guard<mutex> lock(verified_lock_);
+    if (verified_.insert(key).second) {
+      verified_order_.emplace_back(move(key));
+      while (verified_order_.size() >
+             static_cast<size_t>(FLAGS_cert_checker_verified_links)) {
+        verified_.erase(verified_order_.front());
+        verified_order_.pop_front();
+      }
+    }
+  }
+  return signed_by_issuer;
+}
+
+// static
+StatusOr<bool> CertChecker::IsTrusted(const TrustedCertificates& trusted,
+                                      const Cert& cert,
+                                      string* subject_name) {
   string cert_name;
   util::Status status = cert.DerEncodedSubjectName(&cert_name);
   if (status != util::Status::OK) {
@@ -331,10 +751,8 @@ StatusOr<bool> CertChecker::IsTrusted(const Cert& cert,
 
   *subject_name = cert_name;
 
-  const auto cand_range(trusted_.equal_range(cert_name));
-  for (multimap<string, unique_ptr<const Cert>>::const_iterator it(
-           cand_range.first);
-       it != cand_range.second; ++it) {
+  const auto cand_range(trusted.equal_range(cert_name));
+  for (auto it(cand_range.first); it != cand_range.second; ++it) {
     if (cert.IsIdenticalTo(*it->second)) {
       return true;
     }
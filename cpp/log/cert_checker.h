@@ -4,10 +4,15 @@
 #include <openssl/pem.h>
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
+#include <stdint.h>
 
-#include <map>
+#include <atomic>
+#include <deque>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "base/macros.h"
@@ -20,6 +25,7 @@ namespace cert_trans {
 class Cert;
 class CertChain;
 class PreCertChain;
+class ThreadPool;
 
 // A class for doing sanity-checks on log submissions before accepting them.
 // We don't necessarily want to do full certificate verification
@@ -32,8 +38,15 @@ class PreCertChain;
 class CertChecker {
  public:
   CertChecker() = default;
+  // Checks the signatures of longer chains in parallel on |pool|,
+  // which must outlive this object.
+  explicit CertChecker(ThreadPool* pool);
   virtual ~CertChecker() = default;
 
+  // By the DER encoding of their subject name.
+  typedef std::unordered_multimap<std::string, std::shared_ptr<const Cert>>
+      TrustedCertificates;
+
   // Load a file of concatenated PEM-certs.
   // Returns true if at least one certificate was successfully loaded, and no
   // errors were encountered. Returns false otherwise (and will not load any
@@ -46,15 +59,49 @@ class CertChecker {
   virtual bool LoadTrustedCertificates(
       const std::vector<std::string>& trusted_certs);
 
-  virtual const std::multimap<std::string, std::unique_ptr<const Cert>>&
-  GetTrustedCertificates() const {
-    return trusted_;
-  }
+  // Replaces the trusted certificates with the ones in
+  // |trusted_cert_file|, or keeps them as they are if it does not load
+  // as with LoadTrustedCertificates(). The chains being checked
+  // meanwhile use either the old or the new ones, never a mix.
+  virtual bool ReloadTrustedCertificates(const std::string& trusted_cert_file);
+
+  // A snapshot of the trusted certificates, in no particular order,
+  // which loading more of them does not change.
+  virtual std::shared_ptr<const TrustedCertificates> GetTrustedCertificates()
+      const;
 
   virtual size_t NumTrustedCertificates() const {
-    return trusted_.size();
+    return GetTrustedCertificates()->size();
+  }
+
+  // Changes whenever trusted certificates are loaded, so that what is
+  // derived from them knows when to be computed again.
+  int64_t TrustedCertificatesGeneration() const {
+    return trusted_generation_.load();
+  }
+
+  // Only accept the certificates whose notAfter is in [|start|,
+  // |limit|), in seconds since the epoch, for a log sharded by expiry.
+  // A bound of zero is no bound, which is the default.
+  void SetNotAfterRange(int64_t start, int64_t limit);
+
+  bool HasNotAfterRange() const {
+    return not_after_start_ != 0 || not_after_limit_ != 0;
   }
 
+  bool AcceptsNotAfter(int64_t not_after) const;
+
+  // Returns the notAfter of the DER-encoded certificate |der|, in
+  // seconds since the epoch, reading only as much of it as needed to
+  // get to its validity period.
+  static util::StatusOr<int64_t> ParseNotAfter(const std::string& der);
+
+  // Checks the notAfter of the DER-encoded certificate |der| against
+  // the range set with SetNotAfterRange(), returning OUT_OF_RANGE if
+  // it falls outside of it. This is cheap enough to be the first check
+  // of a submission, before parsing its chain.
+  util::Status CheckNotAfter(const std::string& der) const;
+
   // Check that:
   // (1) Each certificate is correctly signed by the next one in the chain; and
   // (2) The last certificate is issued by a certificate in our trusted store.
@@ -82,24 +129,63 @@ class CertChecker {
 
  private:
   util::Status CheckIssuerChain(CertChain* chain) const;
+  util::Status CheckLeafNotAfter(const CertChain& chain) const;
+
+  // Checks that each certificate of |chain| is signed by the next one,
+  // the links being shared between the calling thread and |pool_|.
+  struct LinksCheck;
+  util::Status CheckSignatureChain(const CertChain& chain) const;
+  void CheckLinks(const CertChain& chain, LinksCheck* check) const;
+  util::Status CheckLink(const CertChain& chain, size_t index) const;
 
   // Look issuer up from the trusted store, and verify signature.
   util::Status GetTrustedCa(CertChain* chain) const;
 
+  // Same as |subject.IsSignedBy(issuer)|, but answers from the links
+  // already verified, and remembers this one if it is valid and
+  // |remember| is set. Worth it for the links between intermediates
+  // and roots, which most submissions share, not for leaves.
+  util::StatusOr<bool> IsSignedBy(const Cert& subject, const Cert& issuer,
+                                  bool remember) const;
+
   // Returns true if the cert is trusted, false if it's not,
   // INVALID_ARGUMENT if something is wrong with the cert, and
   // INTERNAL if something terrible happened.
-  util::StatusOr<bool> IsTrusted(const Cert& cert,
-                                 std::string* subject_name) const;
-
-  // A map by the DER encoding of the subject name.
-  // All code manipulating this container must ensure contained elements are
-  // deallocated appropriately.
-  std::multimap<std::string, std::unique_ptr<const Cert>> trusted_;
-
-  // Helper for LoadTrustedCertificates, whether reading from file or memory.
-  // Takes ownership of bio_in and frees it.
-  bool LoadTrustedCertificatesFromBIO(BIO* bio_in);
+  static util::StatusOr<bool> IsTrusted(const TrustedCertificates& trusted,
+                                        const Cert& cert,
+                                        std::string* subject_name);
+
+  // Parses the certificates of the PEM bundle |pem|, in parallel on
+  // |pool_| if there is one, and swaps in a copy of the trusted
+  // certificates with them added, or only them if |replace| is set.
+  bool AddTrustedCertificates(const std::string& pem, bool replace);
+  bool AddTrustedCertificatesFromFile(const std::string& cert_file,
+                                      bool replace);
+  struct PemParse;
+  static void ParsePemBlocks(PemParse* parse);
+
+  // Keyed by the DER encoding of the subject name, which is computed
+  // once when loading, so that finding the candidates for a name is a
+  // single hash lookup. Never changed once set, but replaced whole
+  // (with std::atomic_store) when loading, so that checking a chain
+  // only takes a reference to it and never waits for a load.
+  std::shared_ptr<const TrustedCertificates> trusted_ =
+      std::make_shared<const TrustedCertificates>();
+  std::atomic<int64_t> trusted_generation_{0};
+  // Held by loads, so that they do not lose each other's certificates.
+  std::mutex load_lock_;
+
+  ThreadPool* const pool_ = nullptr;
+
+  int64_t not_after_start_ = 0;
+  int64_t not_after_limit_ = 0;
+
+  mutable std::mutex verified_lock_;
+  // The SHA256 digests of the subject and issuer DER encodings, one
+  // after the other, of the links known to be correctly signed.
+  mutable std::unordered_set<std::string> verified_;
+  // The keys of |verified_|, oldest first.
+  mutable std::deque<std::string> verified_order_;
 
   DISALLOW_COPY_AND_ASSIGN(CertChecker);
 };
@@ -12,13 +12,16 @@
 #include "log/ct_extensions.h"
 #include "util/status_test_util.h"
 #include "util/testing.h"
+#include "util/thread_pool.h"
 #include "util/util.h"
 
 using cert_trans::Cert;
 using cert_trans::CertChain;
 using cert_trans::CertChecker;
 using cert_trans::PreCertChain;
+using cert_trans::ThreadPool;
 using std::move;
+using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
 using std::vector;
@@ -384,6 +387,44 @@ TEST_F(CertCheckerTest, LoadTrustedCertificatesCorruptedFile) {
   EXPECT_EQ(0U, checker_.NumTrustedCertificates());
 }
 
+TEST_F(CertCheckerTest, LoadTrustedCertificatesInParallel) {
+  ThreadPool pool(2);
+  CertChecker checker(&pool);
+
+  EXPECT_TRUE(
+      checker.LoadTrustedCertificates(cert_dir_ + "/" + kCollidingRoots));
+  EXPECT_EQ(2U, checker.NumTrustedCertificates());
+  EXPECT_FALSE(checker.LoadTrustedCertificates(cert_dir_ + "/" + kCorrupted));
+  EXPECT_EQ(2U, checker.NumTrustedCertificates());
+}
+
+TEST_F(CertCheckerTest, ReloadTrustedCertificates) {
+  EXPECT_TRUE(checker_.LoadTrustedCertificates(cert_dir_ + "/" + kCaCert));
+  EXPECT_TRUE(
+      checker_.LoadTrustedCertificates(cert_dir_ + "/" + kIntermediateCert));
+  const shared_ptr<const CertChecker::TrustedCertificates> before(
+      checker_.GetTrustedCertificates());
+  const int64_t generation(checker_.TrustedCertificatesGeneration());
+  EXPECT_EQ(2U, before->size());
+
+  EXPECT_TRUE(checker_.ReloadTrustedCertificates(cert_dir_ + "/" + kCaCert));
+  EXPECT_EQ(1U, checker_.NumTrustedCertificates());
+  EXPECT_LT(generation, checker_.TrustedCertificatesGeneration());
+  // Snapshots taken before are not affected.
+  EXPECT_EQ(2U, before->size());
+
+  // A failed reload keeps the certificates there were.
+  EXPECT_FALSE(
+      checker_.ReloadTrustedCertificates(cert_dir_ + "/" + kCorrupted));
+  EXPECT_FALSE(
+      checker_.ReloadTrustedCertificates(cert_dir_ + "/" + kNonexistent));
+  EXPECT_EQ(1U, checker_.NumTrustedCertificates());
+
+  CertChain chain(leaf_pem_);
+  ASSERT_TRUE(chain.IsLoaded());
+  EXPECT_OK(checker_.CheckCertChain(&chain));
+}
+
 TEST_F(CertCheckerTest, Certificate) {
   CertChain chain(leaf_pem_);
   ASSERT_TRUE(chain.IsLoaded());
@@ -398,6 +439,36 @@ TEST_F(CertCheckerTest, Certificate) {
   EXPECT_EQ(2U, chain.Length());
 }
 
+TEST_F(CertCheckerTest, NotAfterRange) {
+  // The notAfter of kLeafCert, 2022-06-01 00:00:00 UTC.
+  const int64_t kLeafNotAfter(1654041600);
+  CertChain chain(leaf_pem_);
+  ASSERT_TRUE(chain.IsLoaded());
+  string der;
+  ASSERT_OK(chain.LeafCert()->DerEncoding(&der));
+
+  util::StatusOr<int64_t> not_after(CertChecker::ParseNotAfter(der));
+  ASSERT_OK(not_after.status());
+  EXPECT_EQ(kLeafNotAfter, not_after.ValueOrDie());
+  EXPECT_THAT(CertChecker::ParseNotAfter(der.substr(0, 40)).status(),
+              StatusIs(util::error::INVALID_ARGUMENT));
+
+  EXPECT_TRUE(checker_.LoadTrustedCertificates(cert_dir_ + "/" + kCaCert));
+  checker_.SetNotAfterRange(kLeafNotAfter + 1, 0);
+  EXPECT_THAT(checker_.CheckNotAfter(der),
+              StatusIs(util::error::OUT_OF_RANGE));
+  EXPECT_THAT(checker_.CheckCertChain(&chain),
+              StatusIs(util::error::OUT_OF_RANGE));
+
+  checker_.SetNotAfterRange(0, kLeafNotAfter);
+  EXPECT_THAT(checker_.CheckNotAfter(der),
+              StatusIs(util::error::OUT_OF_RANGE));
+
+  checker_.SetNotAfterRange(kLeafNotAfter, kLeafNotAfter + 1);
+  EXPECT_OK(checker_.CheckNotAfter(der));
+  EXPECT_OK(checker_.CheckCertChain(&chain));
+}
+
 TEST_F(CertCheckerTest, CertificateWithRoot) {
   CertChain chain(leaf_pem_);
   ASSERT_TRUE(chain.IsLoaded());
@@ -447,6 +518,40 @@ TEST_F(CertCheckerTest, Intermediates) {
               StatusIs(util::error::INVALID_ARGUMENT));
 }
 
+TEST_F(CertCheckerTest, RemembersOnlyIntermediateLinks) {
+  EXPECT_TRUE(checker_.LoadTrustedCertificates(cert_dir_ + "/" + kCaCert));
+  for (int i = 0; i < 2; ++i) {
+    CertChain chain(chain_leaf_pem_ + intermediate_pem_);
+    ASSERT_TRUE(chain.IsLoaded());
+    EXPECT_OK(checker_.CheckCertChain(&chain));
+    EXPECT_EQ(3U, chain.Length());
+  }
+
+  // The intermediate is known good by now, but this leaf is not
+  // signed by it.
+  CertChain invalid(leaf_pem_ + intermediate_pem_);
+  ASSERT_TRUE(invalid.IsLoaded());
+  EXPECT_THAT(checker_.CheckCertChain(&invalid),
+              StatusIs(util::error::INVALID_ARGUMENT));
+}
+
+TEST_F(CertCheckerTest, ChecksLinksInParallel) {
+  ThreadPool pool(2);
+  CertChecker checker(&pool);
+  EXPECT_TRUE(checker.LoadTrustedCertificates(cert_dir_ + "/" + kCaCert));
+
+  CertChain chain(chain_leaf_pem_ + intermediate_pem_ + ca_pem_);
+  ASSERT_TRUE(chain.IsLoaded());
+  EXPECT_OK(checker.CheckCertChain(&chain));
+  EXPECT_EQ(3U, chain.Length());
+
+  // Only the first link is wrong.
+  CertChain invalid(leaf_pem_ + intermediate_pem_ + ca_pem_);
+  ASSERT_TRUE(invalid.IsLoaded());
+  EXPECT_THAT(checker.CheckCertChain(&invalid),
+              StatusIs(util::error::INVALID_ARGUMENT));
+}
+
 TEST_F(CertCheckerTest, PreCert) {
   const string chain_pem = precert_pem_ + ca_pem_;
   PreCertChain chain(chain_pem);
@@ -362,6 +362,25 @@ TEST_F(CertTest, LoadValidFromDer) {
   EXPECT_TRUE(second.get());
 }
 
+TEST_F(CertTest, KeepsDerAndDigest) {
+  string der;
+  ASSERT_OK(leaf_cert_->DerEncoding(&der));
+  const unique_ptr<Cert> second(Cert::FromDerString(der));
+  ASSERT_TRUE(second.get());
+  string second_der;
+  ASSERT_OK(second->DerEncoding(&second_der));
+  EXPECT_EQ(der, second_der);
+
+  string digest, second_digest;
+  ASSERT_OK(leaf_cert_->Sha256Digest(&digest));
+  EXPECT_EQ(Sha256Hasher::Sha256Digest(der), digest);
+  ASSERT_OK(second->Sha256Digest(&second_digest));
+  EXPECT_EQ(digest, second_digest);
+  // The second time is from the cached value.
+  ASSERT_OK(second->Sha256Digest(&second_digest));
+  EXPECT_EQ(digest, second_digest);
+}
+
 TEST_F(CertTest, LoadInvalidFromDer) {
   // Make it look almost good for extra fun.
   string der;
@@ -454,6 +473,19 @@ TEST_F(CertTest, Issuers) {
   EXPECT_TRUE(ca_cert_->IsSelfSigned().ValueOrDie());
 }
 
+
+TEST_F(CertTest, IssuersRepeated) {
+  // The issuer's key and names are only parsed once, but give the
+  // same answers every time.
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_TRUE(leaf_cert_->IsIssuedBy(*ca_cert_).ValueOrDie());
+    EXPECT_TRUE(leaf_cert_->IsSignedBy(*ca_cert_).ValueOrDie());
+    EXPECT_FALSE(leaf_cert_->IsIssuedBy(*leaf_cert_).ValueOrDie());
+    EXPECT_FALSE(leaf_cert_->IsSignedBy(*leaf_cert_).ValueOrDie());
+    EXPECT_TRUE(ca_cert_->IsIssuedBy(*ca_cert_).ValueOrDie());
+  }
+}
+
 TEST_F(CertTest, DerEncodedNames) {
   ASSERT_TRUE(leaf_cert_->IsIssuedBy(*ca_cert_).ValueOrDie());
 
@@ -530,6 +562,39 @@ TEST_F(CertTest, SPKISha256Digest) {
             util::ToBase64(digest));
 }
 
+TEST_F(CertTest, FromDer) {
+  string der;
+  ASSERT_OK(leaf_cert_->DerEncoding(&der));
+  const unique_ptr<Cert> cert(Cert::FromDer(
+      reinterpret_cast<const unsigned char*>(der.data()), der.size()));
+  ASSERT_TRUE(cert.get() != nullptr);
+
+  string cert_der;
+  EXPECT_OK(cert->DerEncoding(&cert_der));
+  EXPECT_EQ(der, cert_der);
+
+  // The parts sliced from the encoding are what OpenSSL would encode.
+  TbsCertificate tbs(*cert);
+  string tbs_der, raw_tbs_der;
+  EXPECT_OK(cert->DerEncodedTbsCertificate(&tbs_der));
+  EXPECT_OK(tbs.DerEncoding(&raw_tbs_der));
+  EXPECT_EQ(raw_tbs_der, tbs_der);
+  EXPECT_EQ(leaf_cert_->SPKI().ValueOrDie(), cert->SPKI().ValueOrDie());
+
+  // Trailing data is ignored, and the cert encoded again.
+  const string trailing(der + "trailing");
+  const unique_ptr<Cert> trailing_cert(Cert::FromDer(
+      reinterpret_cast<const unsigned char*>(trailing.data()),
+      trailing.size()));
+  ASSERT_TRUE(trailing_cert.get() != nullptr);
+  EXPECT_OK(trailing_cert->DerEncoding(&cert_der));
+  EXPECT_EQ(der, cert_der);
+
+  EXPECT_EQ(nullptr, Cert::FromDer(
+                         reinterpret_cast<const unsigned char*>(der.data()),
+                         der.size() / 2).get());
+}
+
 TEST_F(CertTest, TestIsRedactedHost) {
   EXPECT_FALSE(cert_trans::IsRedactedHost(""));
   EXPECT_FALSE(cert_trans::IsRedactedHost("example.com"));
@@ -0,0 +1,265 @@
+#include "log/chain_cert_cache.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "log/logged_entry.h"
+#include "merkletree/serial_hasher.h"
+#include "monitoring/monitoring.h"
+#include "util/util.h"
+
+DEFINE_bool(deduplicate_chain_certs, false,
+            "store every distinct certificate of the chains of the entries "
+            "once in the database, rather than with every entry; entries "
+            "already stored are read either way");
+DEFINE_int32(chain_cert_cache_size, 4096,
+             "number of deduplicated chain certificates kept in memory by "
+             "the databases");
+
+using std::bind;
+using std::lock_guard;
+using std::make_pair;
+using std::map;
+using std::mutex;
+using std::placeholders::_1;
+using std::string;
+
+namespace cert_trans {
+namespace {
+
+
+static Counter<string>* chain_cert_lookups(
+    Counter<string>::New("chain_cert_lookups", "result",
+                         "Number of lookups of deduplicated chain "
+                         "certificates, by result (hit, loaded or "
+                         "not_found)."));
+
+
+// Certificates are DER sequences, which start with 0x30, so a chain
+// element starting with a zero byte is a reference: the marker,
+// followed by the SHA-256 hash of the certificate.
+const char kReferenceMarker = '\0';
+const size_t kHashSize = 32;
+// The bookkeeping of a cached certificate: the hash, twice, the list
+// and hash table nodes.
+const size_t kCachedCertOverhead =
+    2 * (sizeof(string) + kHashSize) + 8 * sizeof(void*);
+
+
+bool IsReference(const string& element) {
+  return element.size() == 1 + kHashSize && element[0] == kReferenceMarker;
+}
+
+
+bool HasReferences(const LoggedEntry& entry) {
+  if (!entry.chain()) {
+    return false;
+  }
+  for (const auto& element : *entry.chain()) {
+    if (IsReference(element)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+}  // namespace
+
+
+ChainCertCache::ChainCertCache()
+    : max_certs_(FLAGS_chain_cert_cache_size),
+      bytes_(0),
+      memory_(MemoryAccounting::Instance()->Register(
+          "chain_cert_cache",
+          [this]() {
+            lock_guard<mutex> lock(lock_);
+            return bytes_;
+          },
+          bind(&ChainCertCache::Shrink, this, _1))) {
+  CHECK_GT(FLAGS_chain_cert_cache_size, 0);
+}
+
+
+ChainCertCache::~ChainCertCache() {
+}
+
+
+bool ChainCertCache::Deduplicate(const LoadFunction& load,
+                                 const LoggedEntry& entry,
+                                 LoggedEntry* deduplicated,
+                                 map<string, string>* to_store) {
+  return FLAGS_deduplicate_chain_certs &&
+         ReplaceChain(load, entry, deduplicated, to_store);
+}
+
+
+bool ChainCertCache::ReplaceChain(const LoadFunction& load,
+                                  const LoggedEntry& entry,
+                                  LoggedEntry* deduplicated,
+                                  map<string, string>* to_store) {
+  CHECK_NOTNULL(deduplicated);
+  CHECK_NOTNULL(to_store);
+  if (!entry.chain() || entry.chain()->size() == 0) {
+    return false;
+  }
+
+  deduplicated->CopyFrom(entry);
+  string stored;
+  for (auto& element : *deduplicated->mutable_chain()) {
+    if (IsReference(element)) {
+      continue;
+    }
+    string hash(Sha256Hasher::Sha256Digest(element));
+    CHECK_EQ(hash.size(), kHashSize);
+    if (to_store->count(hash) == 0 && !Get(load, hash, &stored)) {
+      to_store->insert(make_pair(hash, element));
+    }
+    element.assign(1, kReferenceMarker);
+    element.append(hash);
+  }
+  return true;
+}
+
+
+void ChainCertCache::Stored(const map<string, string>& certs) {
+  lock_guard<mutex> lock(lock_);
+  for (const auto& cert : certs) {
+    Put(cert.first, cert.second);
+  }
+}
+
+
+bool ChainCertCache::Restore(const LoadFunction& load, LoggedEntry* entry) {
+  // Do not drop the extra_data of the entries that need nothing.
+  if (!HasReferences(*entry)) {
+    return true;
+  }
+
+  for (auto& element : *entry->mutable_chain()) {
+    if (IsReference(element)) {
+      string cert;
+      if (!Get(load, element.substr(1), &cert)) {
+        LOG(ERROR) << "Missing chain certificate "
+                   << util::HexString(element.substr(1));
+        return false;
+      }
+      element.swap(cert);
+    }
+  }
+  return true;
+}
+
+
+bool ChainCertCache::RestoreSerialized(const LoadFunction& load,
+                                       string* serialized) {
+  // A reference is serialized as its length, followed by the marker:
+  // most entries do not have that anywhere, and need not be parsed.
+  const char reference_start[] = {static_cast<char>(1 + kHashSize),
+                                  kReferenceMarker};
+  if (serialized->find(reference_start, 0, sizeof(reference_start)) ==
+      string::npos) {
+    return true;
+  }
+
+  LoggedEntry entry;
+  if (!entry.ParseFromString(*serialized)) {
+    return false;
+  }
+  if (!HasReferences(entry)) {
+    return true;
+  }
+  return Restore(load, &entry) && entry.SerializeToString(serialized);
+}
+
+
+bool ChainCertCache::SameEntry(const LoadFunction& load, const string& stored,
+                               const LoggedEntry& entry) {
+  LoggedEntry stored_entry;
+  if (!stored_entry.ParseFromStorage(stored) ||
+      !Restore(load, &stored_entry)) {
+    return false;
+  }
+  LoggedEntry copy;
+  copy.CopyFrom(entry);
+  // One of them might have been stored without its extra_data, which
+  // holds the chain too: compare them both without it.
+  if (stored_entry.chain()) {
+    stored_entry.mutable_chain();
+  }
+  if (copy.chain()) {
+    copy.mutable_chain();
+  }
+
+  string serialized_stored;
+  string serialized_copy;
+  CHECK(stored_entry.SerializeToString(&serialized_stored));
+  CHECK(copy.SerializeToString(&serialized_copy));
+  return serialized_stored == serialized_copy;
+}
+
+
+bool ChainCertCache::Get(const LoadFunction& load, const string& hash,
+                         string* cert) {
+  {
+    lock_guard<mutex> lock(lock_);
+    const auto it(certs_.find(hash));
+    if (it != certs_.end()) {
+      lru_.splice(lru_.begin(), lru_, it->second.lru_position);
+      *cert = it->second.cert;
+      chain_cert_lookups->Increment("hit");
+      return true;
+    }
+  }
+
+  // Loaded without holding the lock, a certificate might be loaded
+  // twice, which is harmless.
+  if (!load(hash, cert)) {
+    chain_cert_lookups->Increment("not_found");
+    return false;
+  }
+  chain_cert_lookups->Increment("loaded");
+
+  lock_guard<mutex> lock(lock_);
+  Put(hash, *cert);
+  return true;
+}
+
+
+void ChainCertCache::Put(const string& hash, const string& cert) {
+  const auto it(certs_.find(hash));
+  if (it != certs_.end()) {
+    lru_.splice(lru_.begin(), lru_, it->second.lru_position);
+    return;
+  }
+
+  CachedCert& cached(certs_[hash]);
+  cached.cert = cert;
+  cached.lru_position = lru_.insert(lru_.begin(), hash);
+  bytes_ += cert.size() + kCachedCertOverhead;
+  while (certs_.size() > max_certs_) {
+    EvictLeastRecentlyUsed();
+  }
+}
+
+
+void ChainCertCache::EvictLeastRecentlyUsed() {
+  const auto it(certs_.find(lru_.back()));
+  CHECK(it != certs_.end());
+  bytes_ -= it->second.cert.size() + kCachedCertOverhead;
+  certs_.erase(it);
+  lru_.pop_back();
+}
+
+
+size_t ChainCertCache::Shrink(size_t bytes) {
+  lock_guard<mutex> lock(lock_);
+  const size_t before(bytes_);
+  while (!lru_.empty() && before - bytes_ < bytes) {
+    EvictLeastRecentlyUsed();
+  }
+  return before - bytes_;
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,111 @@
+#ifndef CERT_TRANS_LOG_CHAIN_CERT_CACHE_H_
+#define CERT_TRANS_LOG_CHAIN_CERT_CACHE_H_
+
+#include <stddef.h>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "base/macros.h"
+#include "util/memory_accounting.h"
+
+namespace cert_trans {
+
+class LoggedEntry;
+
+
+// With --deduplicate_chain_certs, the databases store every distinct
+// certificate found in the chains of the entries once, by SHA-256
+// hash, and only a reference to it in each entry (the certificates of
+// the leaves are left alone). Entries stored either way can be read
+// whatever the flag says. The EtcdConsistentStore does the same with
+// the pending entries (see --etcd_deduplicate_chain_certs).
+//
+// This does the replacing both ways, and keeps the certificates most
+// recently used in memory, so that the hot intermediates need not be
+// read along with every entry.
+//
+// This class is thread-safe.
+class ChainCertCache {
+ public:
+  // Reads the certificate stored by the database under |hash| into
+  // |*cert|, and returns true, or returns false if there is none.
+  typedef std::function<bool(const std::string& hash, std::string* cert)>
+      LoadFunction;
+
+  // Keeps up to --chain_cert_cache_size certificates in memory, fewer
+  // if MemoryAccounting asks for some of them back.
+  ChainCertCache();
+  ~ChainCertCache();
+
+  // With --deduplicate_chain_certs, the same as ReplaceChain().
+  // Returns false, leaving it all alone, if there is nothing to do.
+  bool Deduplicate(const LoadFunction& load, const LoggedEntry& entry,
+                   LoggedEntry* deduplicated,
+                   std::map<std::string, std::string>* to_store);
+
+  // Puts in |*deduplicated| a copy of |entry| with the certificates of
+  // its chain replaced by references, and returns true. The
+  // certificates that neither this nor |load| know about are added to
+  // |*to_store|, by hash: they must be stored along with (or before)
+  // the entry, and then be passed to Stored().
+  // Returns false, leaving it all alone, if the entry has no chain.
+  bool ReplaceChain(const LoadFunction& load, const LoggedEntry& entry,
+                    LoggedEntry* deduplicated,
+                    std::map<std::string, std::string>* to_store);
+
+  void Stored(const std::map<std::string, std::string>& certs);
+
+  // Puts the certificates referenced by |entry| back in it, with
+  // |load| for the ones not in memory. Returns false if one of them
+  // could not be loaded.
+  bool Restore(const LoadFunction& load, LoggedEntry* entry);
+
+  // The same, for an entry serialized with SerializeToString().
+  bool RestoreSerialized(const LoadFunction& load, std::string* serialized);
+
+  // Whether |stored|, written by LoggedEntry::SerializeForStorage(),
+  // holds |entry|, even if it was not stored the same way (with or
+  // without references, compressed or not).
+  bool SameEntry(const LoadFunction& load, const std::string& stored,
+                 const LoggedEntry& entry);
+
+ private:
+  struct CachedCert {
+    std::string cert;
+    std::list<std::string>::iterator lru_position;
+  };
+
+  // Returns false if neither this nor |load| have the certificate.
+  bool Get(const LoadFunction& load, const std::string& hash,
+           std::string* cert);
+  // |lock_| must be held.
+  void Put(const std::string& hash, const std::string& cert);
+  // |lock_| must be held.
+  void EvictLeastRecentlyUsed();
+  // Evicts the least recently used certificates until |bytes| have
+  // been freed, returns how many were.
+  size_t Shrink(size_t bytes);
+
+  const size_t max_certs_;
+
+  std::mutex lock_;
+  // Hashes, most recently used first.
+  std::list<std::string> lru_;
+  std::unordered_map<std::string, CachedCert> certs_;
+  // Roughly how much memory |certs_| and |lru_| take.
+  size_t bytes_;
+
+  const std::unique_ptr<MemoryAccounting::Registration> memory_;
+
+  DISALLOW_COPY_AND_ASSIGN(ChainCertCache);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_CHAIN_CERT_CACHE_H_
@@ -0,0 +1,184 @@
+#include "log/chain_cert_cache.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "log/logged_entry.h"
+#include "merkletree/serial_hasher.h"
+#include "util/memory_accounting.h"
+#include "util/testing.h"
+
+DECLARE_int32(chain_cert_cache_size);
+DECLARE_int32(memory_budget_mb);
+
+namespace cert_trans {
+namespace {
+
+using std::map;
+using std::string;
+using std::vector;
+
+
+// Certificates of 64 KiB, different for every |i|.
+string TestCert(int i) {
+  string cert(1 << 16, '\x30');
+  cert[1] = static_cast<char>(i);
+  cert[2] = static_cast<char>(i >> 8);
+  return cert;
+}
+
+
+// What the chain of a deduplicated entry holds instead of |cert|.
+string Reference(const string& cert) {
+  return string(1, '\0') + Sha256Hasher::Sha256Digest(cert);
+}
+
+
+class ChainCertCacheTest : public ::testing::Test {
+ protected:
+  ChainCertCacheTest()
+      : load_([this](const string& hash, string* cert) {
+          ++num_loads_;
+          const auto it(stored_.find(hash));
+          if (it == stored_.end()) {
+            return false;
+          }
+          *cert = it->second;
+          return true;
+        }),
+        num_loads_(0) {
+  }
+
+  // Makes an entry with |certs| as its chain.
+  LoggedEntry MakeEntry(const vector<string>& certs) {
+    LoggedEntry entry;
+    ct::X509ChainEntry* const x509_entry(
+        entry.mutable_entry()->mutable_x509_entry());
+    x509_entry->set_leaf_certificate("leaf");
+    for (const auto& cert : certs) {
+      x509_entry->add_certificate_chain(cert);
+    }
+    return entry;
+  }
+
+  // Deduplicates |cert| in |cache|, storing it, as the databases do.
+  void Store(ChainCertCache* cache, const string& cert) {
+    LoggedEntry deduplicated;
+    map<string, string> to_store;
+    ASSERT_TRUE(
+        cache->ReplaceChain(load_, MakeEntry({cert}), &deduplicated,
+                            &to_store));
+    stored_.insert(to_store.begin(), to_store.end());
+    cache->Stored(to_store);
+  }
+
+  // Restores an entry referencing |cert| with |cache|, and returns the
+  // number of certificates that had to be loaded for it.
+  int Restore(ChainCertCache* cache, const string& cert) {
+    LoggedEntry deduplicated(MakeEntry({Reference(cert)}));
+    const int num_loads_before(num_loads_);
+    CHECK(cache->Restore(load_, &deduplicated));
+    CHECK_EQ(1, deduplicated.chain()->size());
+    CHECK_EQ(cert, deduplicated.chain()->Get(0));
+    return num_loads_ - num_loads_before;
+  }
+
+  const ChainCertCache::LoadFunction load_;
+  // What the database would have stored, by hash.
+  map<string, string> stored_;
+  int num_loads_;
+};
+
+
+TEST_F(ChainCertCacheTest, ReplacesAndRestoresChain) {
+  ChainCertCache cache;
+  const LoggedEntry entry(MakeEntry({TestCert(1), TestCert(2)}));
+
+  LoggedEntry deduplicated;
+  map<string, string> to_store;
+  ASSERT_TRUE(cache.ReplaceChain(load_, entry, &deduplicated, &to_store));
+  ASSERT_EQ(2, deduplicated.chain()->size());
+  EXPECT_EQ(Reference(TestCert(1)), deduplicated.chain()->Get(0));
+  EXPECT_EQ(Reference(TestCert(2)), deduplicated.chain()->Get(1));
+  EXPECT_EQ(TestCert(1),
+            to_store[Sha256Hasher::Sha256Digest(TestCert(1))]);
+  EXPECT_EQ(TestCert(2),
+            to_store[Sha256Hasher::Sha256Digest(TestCert(2))]);
+  stored_.insert(to_store.begin(), to_store.end());
+  cache.Stored(to_store);
+
+  // Both are in memory.
+  const int num_loads(num_loads_);
+  ASSERT_TRUE(cache.Restore(load_, &deduplicated));
+  EXPECT_EQ(num_loads, num_loads_);
+  ASSERT_EQ(2, deduplicated.chain()->size());
+  EXPECT_EQ(TestCert(1), deduplicated.chain()->Get(0));
+  EXPECT_EQ(TestCert(2), deduplicated.chain()->Get(1));
+}
+
+
+TEST_F(ChainCertCacheTest, FailsToRestoreMissingCert) {
+  ChainCertCache cache;
+  LoggedEntry deduplicated;
+  map<string, string> to_store;
+  ASSERT_TRUE(cache.ReplaceChain(load_, MakeEntry({TestCert(1)}),
+                                 &deduplicated, &to_store));
+  // Never stored.
+  EXPECT_FALSE(cache.Restore(load_, &deduplicated));
+}
+
+
+TEST_F(ChainCertCacheTest, EvictsLeastRecentlyUsed) {
+  google::FlagSaver saver;
+  FLAGS_chain_cert_cache_size = 2;
+  ChainCertCache cache;
+  Store(&cache, TestCert(1));
+  Store(&cache, TestCert(2));
+  // Makes the first one the most recently used.
+  EXPECT_EQ(0, Restore(&cache, TestCert(1)));
+  Store(&cache, TestCert(3));
+
+  EXPECT_EQ(0, Restore(&cache, TestCert(1)));
+  EXPECT_EQ(0, Restore(&cache, TestCert(3)));
+  // Loaded back, evicting the first one in turn.
+  EXPECT_EQ(1, Restore(&cache, TestCert(2)));
+  EXPECT_EQ(0, Restore(&cache, TestCert(2)));
+  EXPECT_EQ(1, Restore(&cache, TestCert(1)));
+}
+
+
+TEST_F(ChainCertCacheTest, ShrinksWhenOverMemoryBudget) {
+  google::FlagSaver saver;
+  FLAGS_chain_cert_cache_size = 100;
+  ChainCertCache cache;
+  // Twice the budget of 1 MB (see main()).
+  const int kNumCerts(32);
+  for (int i = 0; i < kNumCerts; ++i) {
+    Store(&cache, TestCert(i));
+  }
+
+  const size_t usage(
+      MemoryAccounting::Instance()->Update()["chain_cert_cache"]);
+  EXPECT_GE(static_cast<size_t>(1 << 20), usage);
+  EXPECT_LT(static_cast<size_t>(1 << 19), usage);
+  // The most recently used were kept.
+  EXPECT_EQ(0, Restore(&cache, TestCert(kNumCerts - 1)));
+  EXPECT_EQ(1, Restore(&cache, TestCert(0)));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  // Read once, when the caches first register with
+  // MemoryAccounting::Instance().
+  FLAGS_memory_budget_mb = 1;
+  return RUN_ALL_TESTS();
+}
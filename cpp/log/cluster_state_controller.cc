@@ -1,11 +1,14 @@
 #include "log/cluster_state_controller.h"
 
+#include <gflags/gflags.h>
 #include <stdint.h>
+#include <chrono>
 #include <functional>
 
 #include "fetcher/peer.h"
 #include "log/database.h"
 #include "log/etcd_consistent_store.h"
+#include "log/merge_delay.h"
 #include "monitoring/monitoring.h"
 #include "proto/ct.pb.h"
 
@@ -13,10 +16,12 @@ using ct::ClusterConfig;
 using ct::ClusterNodeState;
 using ct::SignedTreeHead;
 using std::bind;
+using std::chrono::milliseconds;
 using std::lock_guard;
 using std::make_pair;
 using std::make_shared;
 using std::map;
+using std::move;
 using std::mutex;
 using std::pair;
 using std::placeholders::_1;
@@ -29,6 +34,19 @@ using std::vector;
 using util::Executor;
 using util::Status;
 using util::StatusOr;
+using util::Task;
+
+DEFINE_bool(cluster_fetch_logged_entries, false,
+            "fetch the entries from the other nodes of the cluster in their "
+            "stored binary form, rather than as get-entries JSON (all the "
+            "nodes must support it)");
+DEFINE_bool(cluster_compress_fetched_entries, false,
+            "with --cluster_fetch_logged_entries, have the other nodes "
+            "compress the entries they send");
+DEFINE_int32(cluster_state_coalesce_ms, 50,
+             "recalculate the serving STH once for all the node state "
+             "updates received within this many milliseconds, rather than "
+             "for every one of them (0 to disable)");
 
 namespace cert_trans {
 namespace {
@@ -44,7 +62,7 @@ Gauge<>* serving_tree_timestamp =
 
 unique_ptr<AsyncLogClient> BuildAsyncLogClient(
     const shared_ptr<libevent::Base>& base, UrlFetcher* fetcher,
-    const ClusterNodeState& state) {
+    const string& path_prefix, const ClusterNodeState& state) {
   CHECK(!state.hostname().empty());
   CHECK_GT(state.log_port(), 0);
   CHECK_LE(state.log_port(), UINT16_MAX);
@@ -52,7 +70,33 @@ unique_ptr<AsyncLogClient> BuildAsyncLogClient(
   // TODO(pphaneuf): We'd like to support HTTPS at some point.
   return unique_ptr<AsyncLogClient>(new AsyncLogClient(
       base.get(), fetcher,
-      "http://" + state.hostname() + ":" + to_string(state.log_port())));
+      "http://" + state.hostname() + ":" + to_string(state.log_port()) +
+          path_prefix));
+}
+
+
+void AddNodeSTH(const string& node_id, const ClusterNodeState& state,
+                map<int64_t, map<string, SignedTreeHead>>* sths_by_size) {
+  if (state.has_newest_sth()) {
+    CHECK((*sths_by_size)[state.newest_sth().tree_size()]
+              .emplace(node_id, state.newest_sth())
+              .second);
+  }
+}
+
+
+void RemoveNodeSTH(const string& node_id, const ClusterNodeState& state,
+                   map<int64_t, map<string, SignedTreeHead>>* sths_by_size) {
+  if (!state.has_newest_sth()) {
+    return;
+  }
+  const map<int64_t, map<string, SignedTreeHead>>::iterator it(
+      sths_by_size->find(state.newest_sth().tree_size()));
+  CHECK(it != sths_by_size->end());
+  CHECK_EQ(static_cast<size_t>(1), it->second.erase(node_id));
+  if (it->second.empty()) {
+    sths_by_size->erase(it);
+  }
 }
 
 
@@ -61,8 +105,9 @@ unique_ptr<AsyncLogClient> BuildAsyncLogClient(
 
 ClusterStateController::ClusterPeer::ClusterPeer(
     const shared_ptr<libevent::Base>& base, UrlFetcher* fetcher,
-    const ClusterNodeState& state)
-    : Peer(BuildAsyncLogClient(base, fetcher, state)), state_(state) {
+    const string& path_prefix, const ClusterNodeState& state)
+    : Peer(BuildAsyncLogClient(base, fetcher, path_prefix, state)),
+      state_(state) {
 }
 
 
@@ -83,6 +128,21 @@ void ClusterStateController::ClusterPeer::UpdateClusterNodeState(
 }
 
 
+void ClusterStateController::ClusterPeer::FetchEntries(
+    int first, int last, bool want_scts,
+    vector<AsyncLogClient::Entry>* entries,
+    const AsyncLogClient::Callback& done) {
+  // The stored entries always have their SCTs.
+  if (FLAGS_cluster_fetch_logged_entries) {
+    client_->GetLoggedEntries(first, last,
+                              FLAGS_cluster_compress_fetched_entries, entries,
+                              done);
+  } else {
+    Peer::FetchEntries(first, last, want_scts, entries, done);
+  }
+}
+
+
 ClusterNodeState ClusterStateController::ClusterPeer::state() const {
   lock_guard<mutex> lock(lock_);
   return state_;
@@ -100,16 +160,21 @@ pair<string, int> ClusterStateController::ClusterPeer::GetHostPort() const {
 ClusterStateController::ClusterStateController(
     Executor* executor, const shared_ptr<libevent::Base>& base,
     UrlFetcher* url_fetcher, Database* database, ConsistentStore* store,
-    MasterElection* election, ContinuousFetcher* fetcher)
+    MasterElection* election, ContinuousFetcher* fetcher,
+    const string& path_prefix)
     : base_(base),
       url_fetcher_(CHECK_NOTNULL(url_fetcher)),
       database_(CHECK_NOTNULL(database)),
       store_(CHECK_NOTNULL(store)),
       election_(CHECK_NOTNULL(election)),
       fetcher_(CHECK_NOTNULL(fetcher)),
+      path_prefix_(path_prefix),
       watch_config_task_(CHECK_NOTNULL(executor)),
       watch_node_states_task_(CHECK_NOTNULL(executor)),
       watch_serving_sth_task_(CHECK_NOTNULL(executor)),
+      recalculate_task_(CHECK_NOTNULL(executor)),
+      fresh_nodes_(make_shared<vector<ClusterNodeState>>()),
+      recalculation_scheduled_(false),
       exiting_(false),
       update_required_(false),
       cluster_serving_sth_update_thread_(
@@ -140,6 +205,9 @@ ClusterStateController::~ClusterStateController() {
   watch_config_task_.Wait();
   watch_node_states_task_.Wait();
   watch_serving_sth_task_.Wait();
+  // Cancels the pending recalculation, if any.
+  recalculate_task_.task()->Return();
+  recalculate_task_.Wait();
 }
 
 
@@ -209,12 +277,18 @@ void ClusterStateController::SetNodeHostPort(const string& host,
   local_node_state_.set_hostname(host);
   local_node_state_.set_log_port(port);
   PushLocalNodeState(lock);
+  UpdateFreshNodes(lock);
 }
 
 
 void ClusterStateController::RefreshNodeState() {
   unique_lock<mutex> lock(mutex_);
   PushLocalNodeState(lock);
+  // The node states are only written when they change, so this is
+  // what makes a newly elected master push out the serving STH.
+  if (election_->IsMaster()) {
+    CalculateServingSTH(lock);
+  }
 }
 
 
@@ -228,12 +302,26 @@ bool ClusterStateController::NodeIsStale() const {
 
 
 vector<ClusterNodeState> ClusterStateController::GetFreshNodes() const {
+  return *GetFreshNodesSnapshot();
+}
+
+
+shared_ptr<const vector<ClusterNodeState>>
+ClusterStateController::GetFreshNodesSnapshot() const {
   lock_guard<mutex> lock(mutex_);
+  return fresh_nodes_;
+}
+
+
+void ClusterStateController::UpdateFreshNodes(const unique_lock<mutex>& lock) {
+  CHECK(lock.owns_lock());
+  const shared_ptr<vector<ClusterNodeState>> fresh(
+      make_shared<vector<ClusterNodeState>>());  // for 1983.
+  fresh_nodes_ = fresh;
   if (!actual_serving_sth_) {
     LOG(WARNING) << "Cluster has no ServingSTH, all nodes are stale.";
-    return {};
+    return;
   }
-  vector<ClusterNodeState> fresh;  // for 1983.
   // Here we go:
   for (const auto& node : all_peers_) {
     const bool is_self(
@@ -243,10 +331,9 @@ vector<ClusterNodeState> ClusterStateController::GetFreshNodes() const {
         node.second->state().newest_sth().tree_size() >=
             actual_serving_sth_->tree_size()) {
       VLOG(1) << "Node is fresh: " << node.second->state().node_id();
-      fresh.push_back(node.second->state());
+      fresh->push_back(node.second->state());
     }
   }
-  return fresh;
 }
 
 
@@ -254,20 +341,47 @@ void ClusterStateController::PushLocalNodeState(
     const unique_lock<mutex>& lock) {
   CHECK(lock.owns_lock());
 
+  string serialized;
+  CHECK(local_node_state_.SerializeToString(&serialized));
+  if (pushed_local_node_state_ && *pushed_local_node_state_ == serialized) {
+    const Status status(store_->RefreshClusterNodeState());
+    if (status.ok()) {
+      return;
+    }
+    // It might have expired, set it again.
+    LOG(WARNING) << "Couldn't refresh ClusterNodeState: " << status;
+  }
+
   const Status status(store_->SetClusterNodeState(local_node_state_));
   LOG_IF(WARNING, !status.ok()) << "Couldn't set ClusterNodeState: " << status;
+  if (status.ok()) {
+    pushed_local_node_state_.reset(new string(move(serialized)));
+  } else {
+    pushed_local_node_state_.reset();
+  }
 }
 
 
 void ClusterStateController::OnClusterStateUpdated(
     const vector<Update<ClusterNodeState>>& updates) {
   unique_lock<mutex> lock(mutex_);
+  bool changed(false);
   for (const auto& update : updates) {
     const string& node_id(update.handle_.Key());
     if (update.exists_) {
       auto it(all_peers_.find(node_id));
       VLOG_IF(1, it == all_peers_.end()) << "Node joined: " << node_id;
 
+      if (it != all_peers_.end()) {
+        const ClusterNodeState old_state(it->second->state());
+        if (old_state.SerializeAsString() ==
+            update.handle_.Entry().SerializeAsString()) {
+          continue;
+        }
+        RemoveNodeSTH(node_id, old_state, &node_sths_by_size_);
+      }
+      AddNodeSTH(node_id, update.handle_.Entry(), &node_sths_by_size_);
+
       // If the host or port change, remove the ClusterPeer, so that
       // we re-create it.
       if (it != all_peers_.end() &&
@@ -282,7 +396,7 @@ void ClusterStateController::OnClusterStateUpdated(
         it->second->UpdateClusterNodeState(update.handle_.Entry());
       } else {
         const shared_ptr<ClusterPeer> peer(
-            make_shared<ClusterPeer>(base_, url_fetcher_,
+            make_shared<ClusterPeer>(base_, url_fetcher_, path_prefix_,
                                      update.handle_.Entry()));
         // TODO(pphaneuf): all_peers_ and fetcher_ both maintain a
         // list of cluster members, this should be split off into its
@@ -291,13 +405,52 @@ void ClusterStateController::OnClusterStateUpdated(
         all_peers_.emplace(node_id, peer);
         fetcher_->AddPeer(node_id, peer);
       }
+      // Start fetching whatever new entries this node has right away,
+      // rather than on the next periodic fetch.
+      fetcher_->NewTreeSize(update.handle_.Entry().newest_sth().tree_size());
     } else {
       VLOG(1) << "Node left: " << node_id;
-      CHECK_EQ(static_cast<size_t>(1), all_peers_.erase(node_id));
+      const auto it(all_peers_.find(node_id));
+      CHECK(it != all_peers_.end());
+      RemoveNodeSTH(node_id, it->second->state(), &node_sths_by_size_);
+      all_peers_.erase(it);
       fetcher_->RemovePeer(node_id);
     }
+    changed = true;
+  }
+
+  // Nothing the results depend on has changed.
+  if (!changed) {
+    return;
   }
 
+  if (FLAGS_cluster_state_coalesce_ms <= 0) {
+    UpdateFreshNodes(lock);
+    CalculateServingSTH(lock);
+    return;
+  }
+
+  // When many nodes refresh at once, wait for the others and only
+  // recalculate once. The updates above are applied to the indexes
+  // right away, so there is nothing to accumulate meanwhile.
+  if (!recalculation_scheduled_) {
+    recalculation_scheduled_ = true;
+    base_->Delay(milliseconds(FLAGS_cluster_state_coalesce_ms),
+                 recalculate_task_.task()->AddChild(
+                     bind(&ClusterStateController::RecalculateClusterState,
+                          this, _1)));
+  }
+}
+
+
+void ClusterStateController::RecalculateClusterState(Task* task) {
+  if (!task->status().ok()) {
+    // Cancelled, we are going away.
+    return;
+  }
+  unique_lock<mutex> lock(mutex_);
+  recalculation_scheduled_ = false;
+  UpdateFreshNodes(lock);
   CalculateServingSTH(lock);
 }
 
@@ -380,9 +533,12 @@ void ClusterStateController::OnServingSthUpdated(
       LOG(INFO) << "Local node doesn't yet have all entries for "
                 << "serving STH, not writing to DB.";
       write_sth = false;
+      fetcher_->NewTreeSize(actual_serving_sth_->tree_size());
     }
   }
 
+  UpdateFreshNodes(lock);
+
   SignedTreeHead sth_to_write;
   if (write_sth) {
     sth_to_write = *actual_serving_sth_;
@@ -402,29 +558,7 @@ void ClusterStateController::CalculateServingSTH(
   VLOG(1) << "Calculating new ServingSTH...";
   CHECK(lock.owns_lock());
 
-  // First, create a mapping of tree size to number of nodes at that size, and
-  // a mapping of the newst STH for any given size:
-  map<int64_t, SignedTreeHead> sth_by_size;
-  map<int64_t, int> num_nodes_by_sth_size;
-  for (const auto& node : all_peers_) {
-    const ClusterNodeState node_state(node.second->state());
-    if (node_state.has_newest_sth()) {
-      const int64_t tree_size(node_state.newest_sth().tree_size());
-      CHECK_LE(0, tree_size);
-      const int64_t timestamp(node_state.newest_sth().timestamp());
-      CHECK_LE(0, timestamp);
-
-      num_nodes_by_sth_size[tree_size]++;
-
-      // Default timestamp (first call in here) will be 0
-      if (node_state.newest_sth().timestamp() >
-          sth_by_size[tree_size].timestamp()) {
-        sth_by_size[tree_size] = node_state.newest_sth();
-      }
-    }
-  }
-
-  // Next calculate the newest STH we've seen which satisfies the following
+  // Calculate the newest STH we've seen which satisfies the following
   // criteria:
   //   - at least minimum_serving_nodes have an STH at least as large
   //   - at least minimum_serving_fraction have an STH at least as large
@@ -439,18 +573,27 @@ void ClusterStateController::CalculateServingSTH(
   // Work backwards (from largest STH size) until we see that there's enough
   // coverage (according to the criteria above) to serve an STH (or determine
   // that there are insufficient nodes to serve anything.)
-  for (auto it = num_nodes_by_sth_size.rbegin();
-       it != num_nodes_by_sth_size.rend() && it->first >= current_tree_size;
+  for (auto it = node_sths_by_size_.rbegin();
+       it != node_sths_by_size_.rend() && it->first >= current_tree_size;
        ++it) {
+    CHECK_LE(0, it->first);
     // num_nodes_seen keeps track of the number of nodes we've seen so far (and
     // since we're working from larger to smaller size STH, they should all be
     // able to serve this [and smaller] STHs.)
-    num_nodes_seen += it->second;
+    num_nodes_seen += it->second.size();
     const double serving_fraction(static_cast<double>(num_nodes_seen) /
                                   all_peers_.size());
     if (serving_fraction >= cluster_config_.minimum_serving_fraction() &&
         num_nodes_seen >= cluster_config_.minimum_serving_nodes()) {
-      const SignedTreeHead& candidate_sth(sth_by_size[it->first]);
+      // The newest STH of this size.
+      const SignedTreeHead* newest_sth(nullptr);
+      for (const auto& node_sth : it->second) {
+        if (!newest_sth ||
+            node_sth.second.timestamp() > newest_sth->timestamp()) {
+          newest_sth = &node_sth.second;
+        }
+      }
+      const SignedTreeHead& candidate_sth(*newest_sth);
 
       // This STH isn't a viable candidate unless its timestamp is strictly
       // newer than any current serving STH:
@@ -466,8 +609,8 @@ void ClusterStateController::CalculateServingSTH(
 
       LOG(INFO) << "Can serve @" << it->first << " with " << num_nodes_seen
                 << " nodes (" << (serving_fraction * 100) << "% of cluster)";
-      calculated_serving_sth_.reset(
-          new SignedTreeHead(sth_by_size[it->first]));
+      calculated_serving_sth_.reset(new SignedTreeHead(candidate_sth));
+      RecordSTHDelay("calculated", candidate_sth);
       // Push this STH out to the cluster if we're master:
       if (election_->IsMaster()) {
         VLOG(1) << "Pushing new STH out to cluster";
@@ -31,11 +31,14 @@ class Database;
 //    and leaves/joins the election as appropriate.
 class ClusterStateController {
  public:
+  // The other nodes serve the log under |path_prefix| (see
+  // HttpHandler::SetPathPrefix()), like this one.
   ClusterStateController(util::Executor* executor,
                          const std::shared_ptr<libevent::Base>& base,
                          UrlFetcher* url_fetcher, Database* database,
                          ConsistentStore* store, MasterElection* election,
-                         ContinuousFetcher* fetcher);
+                         ContinuousFetcher* fetcher,
+                         const std::string& path_prefix = "");
 
   ~ClusterStateController();
 
@@ -68,13 +71,24 @@ class ClusterStateController {
   // returned list regardless of its freshness.
   std::vector<ct::ClusterNodeState> GetFreshNodes() const;
 
+  // Like GetFreshNodes(), but without copying them. The snapshot is
+  // only replaced when the set of fresh nodes might have changed, so
+  // callers can cache what they derive from it, for as long as they
+  // keep getting the same one.
+  std::shared_ptr<const std::vector<ct::ClusterNodeState>>
+  GetFreshNodesSnapshot() const;
+
  private:
   class ClusterPeer : public Peer {
    public:
     ClusterPeer(const std::shared_ptr<libevent::Base>& base,
-                UrlFetcher* fetcher, const ct::ClusterNodeState& state);
+                UrlFetcher* fetcher, const std::string& path_prefix,
+                const ct::ClusterNodeState& state);
 
     int64_t TreeSize() const override;
+    void FetchEntries(int first, int last, bool want_scts,
+                      std::vector<AsyncLogClient::Entry>* entries,
+                      const AsyncLogClient::Callback& done) override;
     void UpdateClusterNodeState(const ct::ClusterNodeState& new_state);
     ct::ClusterNodeState state() const;
     std::pair<std::string, int> GetHostPort() const;
@@ -86,7 +100,9 @@ class ClusterStateController {
     DISALLOW_COPY_AND_ASSIGN(ClusterPeer);
   };
 
-  // Updates the representation of *this* node's state in the consistent store.
+  // Updates the representation of *this* node's state in the consistent
+  // store. If it has not changed since it was last written, only its TTL
+  // is refreshed, which does not wake up the other nodes.
   void PushLocalNodeState(const std::unique_lock<std::mutex>& lock);
 
   // Entry point for the watcher callback.
@@ -94,6 +110,11 @@ class ClusterStateController {
   void OnClusterStateUpdated(
       const std::vector<Update<ct::ClusterNodeState>>& updates);
 
+  // Runs UpdateFreshNodes() and CalculateServingSTH() once for all
+  // the node state updates received since it was scheduled, after
+  // --cluster_state_coalesce_ms.
+  void RecalculateClusterState(util::Task* task);
+
   // Entry point for the config watcher callback.
   // Called whenever the ClusterConfig is changed.
   void OnClusterConfigUpdated(const Update<ct::ClusterConfig>& update);
@@ -103,11 +124,15 @@ class ClusterStateController {
   void OnServingSthUpdated(const Update<ct::SignedTreeHead>& update);
 
   // Calculates the STH which should be served by the cluster, given the
-  // current state of the nodes.
+  // current state of the nodes (as indexed in |node_sths_by_size_|).
   // If this node is the cluster master then the calculated serving STH is
   // pushed out to the consistent store.
   void CalculateServingSTH(const std::unique_lock<std::mutex>& lock);
 
+  // Replaces |fresh_nodes_| after a change to the node states, the
+  // serving STH, or this node's address.
+  void UpdateFreshNodes(const std::unique_lock<std::mutex>& lock);
+
   // Determines whether this node should be participating in the election based
   // on the current node's state.
   void DetermineElectionParticipation(
@@ -122,16 +147,29 @@ class ClusterStateController {
   ConsistentStore* const store_;      // Not owned by us
   MasterElection* const election_;    // Not owned by us
   ContinuousFetcher* const fetcher_;  // Not owned by us
+  const std::string path_prefix_;
   util::SyncTask watch_config_task_;
   util::SyncTask watch_node_states_task_;
   util::SyncTask watch_serving_sth_task_;
+  // The parent of the delayed RecalculateClusterState() calls.
+  util::SyncTask recalculate_task_;
   ct::ClusterConfig cluster_config_;
 
   mutable std::mutex mutex_;  // covers the members below:
   ct::ClusterNodeState local_node_state_;
+  // What was last successfully written for |local_node_state_|, if
+  // anything.
+  std::unique_ptr<std::string> pushed_local_node_state_;
   std::map<std::string, const std::shared_ptr<ClusterPeer>> all_peers_;
+  // The newest STH of each node which has one, by tree size then node
+  // ID, updated as the node states change.
+  std::map<int64_t, std::map<std::string, ct::SignedTreeHead>>
+      node_sths_by_size_;
   std::unique_ptr<ct::SignedTreeHead> calculated_serving_sth_;
   std::unique_ptr<ct::SignedTreeHead> actual_serving_sth_;
+  std::shared_ptr<const std::vector<ct::ClusterNodeState>> fresh_nodes_;
+  // Whether a RecalculateClusterState() call is pending.
+  bool recalculation_scheduled_;
   bool exiting_;
   bool update_required_;
   std::condition_variable update_required_cv_;
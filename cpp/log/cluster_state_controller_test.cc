@@ -1,3 +1,4 @@
+#include <gflags/gflags.h>
 #include <gtest/gtest.h>
 #include <map>
 #include <memory>
@@ -14,6 +15,7 @@
 #include "util/fake_etcd.h"
 #include "util/libevent_wrapper.h"
 #include "util/mock_masterelection.h"
+#include "util/sync_task.h"
 #include "util/testing.h"
 #include "util/thread_pool.h"
 #include "util/util.h"
@@ -26,11 +28,14 @@ using std::shared_ptr;
 using std::string;
 using std::vector;
 using testing::AnyNumber;
+using testing::AtLeast;
 using testing::NiceMock;
 using testing::Return;
 using testing::_;
 using util::StatusOr;
 
+DECLARE_int32(cluster_state_coalesce_ms);
+
 namespace cert_trans {
 
 const char kNodeId1[] = "node1";
@@ -66,6 +71,7 @@ class ClusterStateControllerTest : public ::testing::Test {
     // this test, but this isn't what we're testing here, so just
     // ignore them.
     EXPECT_CALL(fetcher_, AddPeer(_, _)).Times(AnyNumber());
+    EXPECT_CALL(fetcher_, NewTreeSize(_)).Times(AnyNumber());
 
     // Set default cluster config:
     ct::ClusterConfig default_config;
@@ -109,6 +115,15 @@ class ClusterStateControllerTest : public ::testing::Test {
     return it->second->state();
   }
 
+  int64_t GetNodeModifiedIndex(const string& node_id) {
+    util::SyncTask task(base_.get());
+    EtcdClient::GetResponse resp;
+    etcd_.Get(EtcdClient::Request("/nodes/" + node_id), &resp, task.task());
+    task.Wait();
+    CHECK(task.status().ok()) << task.status();
+    return resp.node.modified_index_;
+  }
+
   static void SetClusterConfig(ConsistentStore* store, const int min_nodes,
                                const double min_fraction) {
     ClusterConfig config;
@@ -149,6 +164,24 @@ TEST_F(ClusterStateControllerTest, TestNewTreeHead) {
 }
 
 
+TEST_F(ClusterStateControllerTest, TestRefreshUnchangedNodeState) {
+  const int64_t index(GetNodeModifiedIndex(kNodeId1));
+  controller_.RefreshNodeState();
+  // Only its TTL was refreshed.
+  EXPECT_EQ(index, GetNodeModifiedIndex(kNodeId1));
+
+  controller_.NewTreeHead(sth100_);
+  EXPECT_LT(index, GetNodeModifiedIndex(kNodeId1));
+}
+
+
+TEST_F(ClusterStateControllerTest, TestNotifiesFetcherOfNewTreeSize) {
+  EXPECT_CALL(fetcher_, NewTreeSize(200)).Times(AtLeast(1));
+  store2_->SetClusterNodeState(cns200_);
+  sleep(1);
+}
+
+
 TEST_F(ClusterStateControllerTest, TestCalculateServingSTHAt50Percent) {
   NiceMock<MockMasterElection> election_is_master;
   EXPECT_CALL(election_is_master, IsMaster()).WillRepeatedly(Return(true));
@@ -491,6 +524,29 @@ TEST_F(ClusterStateControllerTest,
 }
 
 
+TEST_F(ClusterStateControllerTest, TestCoalescesNodeStateUpdates) {
+  FLAGS_cluster_state_coalesce_ms = 2000;
+  SetClusterConfig(store1_.get(), 1 /* nodes */, 0.5 /* fraction */);
+  NiceMock<MockMasterElection> election_is_master;
+  EXPECT_CALL(election_is_master, IsMaster()).WillRepeatedly(Return(true));
+  ClusterStateController controller(&pool_, base_, &url_fetcher_,
+                                    test_db_.db(), store1_.get(),
+                                    &election_is_master, &fetcher_);
+  store1_->SetClusterNodeState(cns100_);
+  store2_->SetClusterNodeState(cns200_);
+  store3_->SetClusterNodeState(cns300_);
+  sleep(1);
+  // Still waiting for more updates.
+  EXPECT_FALSE(controller.GetCalculatedServingSTH().ok());
+
+  sleep(2);
+  // Calculated once, for all of them.
+  StatusOr<SignedTreeHead> sth(controller.GetCalculatedServingSTH());
+  EXPECT_EQ(sth200_.tree_size(), sth.ValueOrDie().tree_size());
+  FLAGS_cluster_state_coalesce_ms = 50;
+}
+
+
 TEST_F(ClusterStateControllerTest, TestGetLocalNodeState) {
   SignedTreeHead sth;
   sth.set_timestamp(10000);
@@ -632,6 +688,9 @@ TEST_F(ClusterStateControllerTest, TestGetFreshNodes) {
     EXPECT_EQ(static_cast<size_t>(0),
               fresh.size());  // no STH yet - everyone is stale.
   }
+  // The snapshot is only replaced on changes.
+  EXPECT_EQ(controller_.GetFreshNodesSnapshot(),
+            controller_.GetFreshNodesSnapshot());
 
   // The 3 nodes have states which claim to have 100, 200, and 300 certs in
   // their DBs, iterate around setting the ServingSTH higher and higher to see
@@ -1,6 +1,7 @@
 /* -*- indent-tabs-mode: nil -*- */
 #include "log/cms_verifier.h"
 #include "log/ct_extensions.h"
+#include "merkletree/serial_hasher.h"
 #include "util/cms_scoped_types.h"
 #include "util/openssl_scoped_types.h"
 
@@ -10,6 +11,30 @@ using util::Status;
 using util::StatusOr;
 
 namespace cert_trans {
+namespace {
+
+
+// Parses a DER encoded CMS object straight from memory, rather than
+// copying it into a BIO first.
+ScopedCMS_ContentInfo ParseCms(const string& cms_object) {
+  const unsigned char* data(
+      reinterpret_cast<const unsigned char*>(cms_object.data()));
+  return ScopedCMS_ContentInfo(
+      d2i_CMS_ContentInfo(nullptr, &data, cms_object.size()));
+}
+
+
+}  // namespace
+
+
+const size_t CmsVerifier::kDefaultCacheSize = 1024;
+
+
+CmsVerifier::CmsVerifier(size_t cache_size)
+    : signed_by_(cache_size), unpacked_(cache_size) {
+}
+
+
 util::StatusOr<bool> CmsVerifier::IsCmsSignedByCert(BIO* cms_bio_in,
                                                     const Cert& cert) const {
   CHECK_NOTNULL(cms_bio_in);
@@ -42,12 +67,23 @@ util::StatusOr<bool> CmsVerifier::IsCmsSignedByCert(BIO* cms_bio_in,
 
 StatusOr<bool> CmsVerifier::IsCmsSignedByCert(const string& cms_object,
                                               const Cert& cert) const {
-  // Load a source bio with the CMS signed data object and parse it
-  ScopedBIO source_bio(BIO_new(BIO_s_mem()));
-  BIO_write(source_bio.get(), cms_object.c_str(), cms_object.length());
+  string fingerprint;
+  const Status status(cert.Sha256Digest(&fingerprint));
+  if (!status.ok()) {
+    return status;
+  }
+
+  // The result only depends on the bytes of both, so it can be kept.
+  return signed_by_.Get(Sha256Hasher::Sha256Digest(cms_object) + fingerprint,
+                        [this, &cms_object, &cert]() {
+                          return VerifyCmsSignedByCert(cms_object, cert);
+                        });
+}
 
-  ScopedCMS_ContentInfo cms_content_info(
-      d2i_CMS_bio(source_bio.get(), nullptr));
+
+StatusOr<bool> CmsVerifier::VerifyCmsSignedByCert(const string& cms_object,
+                                                  const Cert& cert) const {
+  const ScopedCMS_ContentInfo cms_content_info(ParseCms(cms_object));
 
   if (!cms_content_info) {
     LOG(ERROR) << "Could not parse CMS data";
@@ -142,17 +178,13 @@ util::Status CmsVerifier::UnpackCmsDerBio(BIO* cms_bio_in, const Cert& cert,
 }
 
 
-util::Status CmsVerifier::UnpackCmsDerBio(BIO* cms_bio_in, BIO* cms_bio_out) {
-  CHECK_NOTNULL(cms_bio_in);
-  CHECK_NOTNULL(cms_bio_out);
-
-  ScopedCMS_ContentInfo cms_content_info(d2i_CMS_bio(cms_bio_in, nullptr));
+string CmsVerifier::UnpackCmsDer(const string& cms_object) const {
+  const ScopedCMS_ContentInfo cms_content_info(ParseCms(cms_object));
 
   if (!cms_content_info) {
     LOG(ERROR) << "Could not parse CMS data";
     LOG_OPENSSL_ERRORS(WARNING);
-    return Status(util::error::INVALID_ARGUMENT,
-                  "CMS data could not be parsed");
+    return "";
   }
 
   const ASN1_OBJECT* message_content_type(
@@ -172,14 +204,20 @@ util::Status CmsVerifier::UnpackCmsDerBio(BIO* cms_bio_in, BIO* cms_bio_out) {
   // can't apply the RFC mandated signature checks until we have the unpacked
   // cert to examine. We don't check it's a signed data object CMS type as
   // OpenSSL does this.
+  const ScopedBIO unpacked_bio(BIO_new(BIO_s_mem()));
   const int verified =
       CMS_verify(cms_content_info.get(), nullptr, nullptr, nullptr,
-                 cms_bio_out, CMS_NO_SIGNER_CERT_VERIFY | CMS_NOINTERN |
-                                  CMS_BINARY | CMS_NO_CONTENT_VERIFY);
+                 unpacked_bio.get(), CMS_NO_SIGNER_CERT_VERIFY |
+                                         CMS_NOINTERN | CMS_BINARY |
+                                         CMS_NO_CONTENT_VERIFY);
+  if (verified != 1) {
+    LOG_OPENSSL_ERRORS(ERROR);
+    return "";
+  }
 
-  return (verified == 1) ? util::Status::OK
-                         : util::Status(util::error::INVALID_ARGUMENT,
-                                        "CMS unpack failed");
+  char* data;
+  const long size(BIO_get_mem_data(unpacked_bio.get(), &data));
+  return size > 0 ? string(data, size) : "";
 }
 
 
@@ -207,24 +245,19 @@ unique_ptr<Cert> CmsVerifier::UnpackCmsSignedCertificate(
 
 unique_ptr<Cert> CmsVerifier::UnpackCmsSignedCertificate(
     const string& cms_object) {
-  // Load the source bio with the CMS signed data object
-  ScopedBIO source_bio(BIO_new(BIO_s_mem()));
-  BIO_write(source_bio.get(), cms_object.c_str(), cms_object.length());
-
-  ScopedBIO unpacked_bio(BIO_new(BIO_s_mem()));
-  unique_ptr<Cert> cert;
-
-  if (UnpackCmsDerBio(source_bio.get(), unpacked_bio.get()).ok()) {
-    // The unpacked data should be a valid DER certificate.
-    // TODO: The RFC does not yet define this as the format so this may
-    // need to change.
-    cert = Cert::FromDerBio(unpacked_bio.get());
+  const string unpacked(unpacked_.Get(
+      Sha256Hasher::Sha256Digest(cms_object),
+      [this, &cms_object]() { return UnpackCmsDer(cms_object); }));
+  if (unpacked.empty()) {
+    return nullptr;
+  }
 
-    if (!cert) {
-      LOG(WARNING) << "Could not unpack cert from CMS DER encoded data";
-    }
-  } else {
-    LOG_OPENSSL_ERRORS(ERROR);
+  // The unpacked data should be a valid DER certificate.
+  // TODO: The RFC does not yet define this as the format so this may
+  // need to change.
+  unique_ptr<Cert> cert(Cert::FromDerString(unpacked));
+  if (!cert) {
+    LOG(WARNING) << "Could not unpack cert from CMS DER encoded data";
   }
 
   return cert;
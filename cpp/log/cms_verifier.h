@@ -4,18 +4,30 @@
 #include <openssl/asn1.h>
 #include <openssl/bio.h>
 #include <openssl/cms.h>
+#include <stddef.h>
 #include <memory>
+#include <string>
 
 #include "base/macros.h"
 #include "log/cert.h"
 #include "util/openssl_util.h"  // for LOG_OPENSSL_ERRORS
+#include "util/single_flight_cache.h"
 #include "util/status.h"
+#include "util/statusor.h"
 
 namespace cert_trans {
 
+// The methods taking the CMS object as a string remember their
+// results for the |cache_size| most recently seen objects (and signer
+// certificates), as the same CMS-signed intermediates come with many
+// submissions. The objects are parsed straight from memory.
+//
+// This class is thread-safe.
 class CmsVerifier {
  public:
-  CmsVerifier() = default;
+  static const size_t kDefaultCacheSize;
+
+  explicit CmsVerifier(size_t cache_size = kDefaultCacheSize);
 
   virtual ~CmsVerifier() = default;
 
@@ -61,12 +73,18 @@ class CmsVerifier {
   // CMS message or validate that the CMS signature is trusted to root.
   util::Status UnpackCmsDerBio(BIO* cms_bio_in, const Cert& certChain,
                                BIO* cms_bio_out);
-  // Writes the unwrapped content from a CMS object to another BIO. Does
-  // not free either BIO. Does not do any checks on the content of the
-  // CMS message or validate that the CMS signature is trusted to root.
-  // The unpacked data may not be a valid X.509 cert. The caller must
-  // apply any additional checks necessary.
-  util::Status UnpackCmsDerBio(BIO* cms_bio_in, BIO* cms_bio_out);
+  // The uncached versions of IsCmsSignedByCert() and
+  // UnpackCmsSignedCertificate() for strings, the latter returning the
+  // unwrapped content (which may not be a valid X.509 cert), or an
+  // empty string if |cms_object| could not be unpacked.
+  util::StatusOr<bool> VerifyCmsSignedByCert(const std::string& cms_object,
+                                             const Cert& cert) const;
+  std::string UnpackCmsDer(const std::string& cms_object) const;
+
+  // By the SHA-256 hashes of the CMS object and of the certificate.
+  mutable SingleFlightCache<std::string, util::StatusOr<bool>> signed_by_;
+  // By the SHA-256 hash of the CMS object.
+  SingleFlightCache<std::string, std::string> unpacked_;
 
   DISALLOW_COPY_AND_ASSIGN(CmsVerifier);
 };
@@ -184,6 +184,30 @@ TEST_F(CmsVerifierTest, CmsVerifyTestCase8) {
   ASSERT_FALSE(unpacked_cert.get());
 }
 
+
+TEST_F(CmsVerifierTest, CachesResultsForStrings) {
+  string cms3;
+  ASSERT_TRUE(util::ReadBinaryFile(cert_dir_v2_ + kCmsSignedDataTest3, &cms3));
+  string cms4;
+  ASSERT_TRUE(util::ReadBinaryFile(cert_dir_v2_ + kCmsSignedDataTest4, &cms4));
+
+  // The second time around comes from the cache, and must be the same,
+  // including for the other certificate.
+  for (int i = 0; i < 2; ++i) {
+    EXPECT_TRUE(verifier_.IsCmsSignedByCert(cms3, *ca_cert_).ValueOrDie());
+    EXPECT_FALSE(verifier_.IsCmsSignedByCert(cms3, *leaf_cert_).ValueOrDie());
+    EXPECT_FALSE(verifier_.IsCmsSignedByCert(cms4, *ca_cert_).ValueOrDie());
+    EXPECT_THAT(verifier_.IsCmsSignedByCert("not CMS", *ca_cert_).status(),
+                StatusIs(util::error::INVALID_ARGUMENT));
+
+    const unique_ptr<Cert> unpacked_cert(
+        verifier_.UnpackCmsSignedCertificate(cms3));
+    ASSERT_TRUE(unpacked_cert.get());
+    EXPECT_EQ(kCmsTestSubject, unpacked_cert->PrintSubjectName());
+    EXPECT_FALSE(verifier_.UnpackCmsSignedCertificate("not CMS"));
+  }
+}
+
 }  // namespace
 
 
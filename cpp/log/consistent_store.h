@@ -2,7 +2,9 @@
 #define CERT_TRANS_LOG_CONSISTENT_STORE_H_
 
 #include <stdint.h>
+#include <chrono>
 #include <mutex>
+#include <thread>
 #include <vector>
 
 #include "base/macros.h"
@@ -146,12 +148,47 @@ class ConsistentStore {
 
   virtual util::Status AddPendingEntry(LoggedEntry* entry) = 0;
 
+  // Same as AddPendingEntry() above, but returns |task| with the status
+  // once done, rather than blocking the calling thread until then.
+  // |entry| must remain valid until |task| is done. The default
+  // implementation blocks anyway.
+  virtual void AddPendingEntry(LoggedEntry* entry, util::Task* task) {
+    task->Return(AddPendingEntry(entry));
+  }
+
+  // Same as calling AddPendingEntry() on each of |entries|, returning
+  // the status for each of them, but implementations may write them
+  // concurrently.
+  virtual std::vector<util::Status> AddPendingEntries(
+      const std::vector<LoggedEntry*>& entries) {
+    std::vector<util::Status> statuses;
+    for (LoggedEntry* const entry : entries) {
+      statuses.emplace_back(AddPendingEntry(entry));
+    }
+    return statuses;
+  }
+
   virtual util::Status GetPendingEntryForHash(
       const std::string& hash, EntryHandle<LoggedEntry>* entry) const = 0;
 
   virtual util::Status GetPendingEntries(
       std::vector<EntryHandle<LoggedEntry>>* entries) const = 0;
 
+  // The number of pending entries this process has seen being added to
+  // the store so far, by anyone, or 0 if the implementation does not
+  // keep track.
+  virtual int64_t NumPendingEntriesAdded() const {
+    return 0;
+  }
+
+  // Blocks until NumPendingEntriesAdded() reaches |count|, or until
+  // |deadline|.
+  virtual void WaitForPendingEntriesAdded(
+      int64_t count,
+      const std::chrono::steady_clock::time_point& deadline) const {
+    std::this_thread::sleep_until(deadline);
+  }
+
   virtual util::Status GetSequenceMapping(
       EntryHandle<ct::SequenceMapping>* entry) const = 0;
 
@@ -163,6 +200,10 @@ class ConsistentStore {
   virtual util::Status SetClusterNodeState(
       const ct::ClusterNodeState& state) = 0;
 
+  // Extends the lifetime of this node's ClusterNodeState, as last set,
+  // without notifying the watchers. Fails if it has expired already.
+  virtual util::Status RefreshClusterNodeState() = 0;
+
   virtual void WatchServingSTH(const ServingSTHCallback& cb,
                                util::Task* task) = 0;
 
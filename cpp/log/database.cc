@@ -1,8 +1,85 @@
 #include "log/database.h"
 
+#include "util/executor.h"
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
 namespace cert_trans {
 
 
+void ReadOnlyDatabase::ReadRange(int64_t start, size_t count,
+                                 vector<LoggedEntry>* entries) const {
+  CHECK_GE(start, 0);
+  CHECK_NOTNULL(entries);
+  size_t num_read(0);
+  if (count > 0) {
+    entries->reserve(count);
+    const unique_ptr<Iterator> it(ScanEntries(start));
+    for (; num_read < count; ++num_read) {
+      if (num_read == entries->size()) {
+        entries->emplace_back();
+      }
+      LoggedEntry* const entry(&(*entries)[num_read]);
+      if (!it->GetNextEntry(entry) ||
+          entry->sequence_number() != start + static_cast<int64_t>(num_read)) {
+        break;
+      }
+    }
+  }
+  entries->resize(num_read);
+}
+
+
+void ReadOnlyDatabase::ReadLeafRange(int64_t start, size_t count,
+                                     vector<LoggedEntry>* entries) const {
+  ReadRange(start, count, entries);
+}
+
+
+ReadOnlyDatabase::LookupResult ReadOnlyDatabase::LatestTreeFrontier(
+    string* frontier) const {
+  return NOT_FOUND;
+}
+
+
+void ReadOnlyDatabase::ReadRawRange(int64_t start, size_t count,
+                                    vector<string>* entries) const {
+  CHECK_NOTNULL(entries)->clear();
+  vector<LoggedEntry> parsed;
+  ReadRange(start, count, &parsed);
+  entries->resize(parsed.size());
+  for (size_t i = 0; i < parsed.size(); ++i) {
+    CHECK(parsed[i].SerializeToString(&(*entries)[i]));
+  }
+}
+
+
+void ReadOnlyDatabase::ReadEntries(int64_t start, int64_t end,
+                                   util::Executor* executor,
+                                   vector<LoggedEntry>* entries,
+                                   util::Task* task) const {
+  CHECK_GE(start, 0);
+  CHECK_GE(end, start);
+  CHECK_NOTNULL(entries);
+  CHECK_NOTNULL(task);
+  CHECK_NOTNULL(executor)->Add([this, start, end, entries, task]() {
+    if (task->CancelRequested()) {
+      task->Return(util::Status::CANCELLED);
+      return;
+    }
+
+    ReadRange(start, end - start + 1, entries);
+    task->Return();
+  });
+}
+
+
+void Database::WriteTreeFrontier(const string& frontier) {
+}
+
+
 DatabaseNotifierHelper::~DatabaseNotifierHelper() {
   CHECK(callbacks_.empty());
 }
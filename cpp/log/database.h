@@ -6,10 +6,13 @@
 #include <functional>
 #include <memory>
 #include <set>
+#include <string>
+#include <vector>
 
 #include "base/macros.h"
 #include "log/logged_entry.h"
 #include "proto/ct.pb.h"
+#include "util/task.h"
 
 namespace cert_trans {
 
@@ -62,9 +65,49 @@ class ReadOnlyDatabase {
   // Return the tree head with the freshest timestamp.
   virtual LookupResult LatestTreeHead(ct::SignedTreeHead* result) const = 0;
 
+  // Fills |frontier| with the one last written by WriteTreeFrontier().
+  // Returns NOT_FOUND if there is none, which is always the case with
+  // the implementations that do not keep it.
+  virtual LookupResult LatestTreeFrontier(std::string* frontier) const;
+
+  // Replaces the contents of |results| with all the tree heads, by
+  // increasing timestamp. For auditing the log, not for serving.
+  virtual void ReadTreeHeads(
+      std::vector<ct::SignedTreeHead>* results) const = 0;
+
   // Scan the entries, starting with the given index.
   virtual std::unique_ptr<Iterator> ScanEntries(int64_t start_index) const = 0;
 
+  // Replaces the contents of |entries| with up to |count| entries,
+  // from |start| on, stopping short at the first one missing. This is
+  // much cheaper than ScanEntries() for more than a few entries, as
+  // implementations read the range in one go. The entries already in
+  // |entries| are parsed into again, which reuses their memory, so
+  // callers reading batch after batch should keep the same vector.
+  virtual void ReadRange(int64_t start, size_t count,
+                         std::vector<LoggedEntry>* entries) const;
+
+  // Same as above, with every entry as a serialized LoggedEntryPB (with
+  // its sequence number), for the callers that only pass them on and
+  // need not pay for parsing them.
+  virtual void ReadRawRange(int64_t start, size_t count,
+                            std::vector<std::string>* entries) const;
+
+  // Same as ReadRange(), for the callers that only need the sequence
+  // numbers and the leaves of the entries (or their hash), such as
+  // those building a tree. Implementations can leave out the rest,
+  // see LoggedEntry::ParseFromStorageWithoutChain(), which is most of
+  // what they read.
+  virtual void ReadLeafRange(int64_t start, size_t count,
+                             std::vector<LoggedEntry>* entries) const;
+
+  // Reads the entries from |start| to |end| (inclusive) into
+  // |entries| on |executor|, stopping short at the first one missing,
+  // then returns |task|. For the callers that must not wait for the
+  // database, like the event threads of the HTTP server.
+  void ReadEntries(int64_t start, int64_t end, util::Executor* executor,
+                   std::vector<LoggedEntry>* entries, util::Task* task) const;
+
   // Return the number of entries of contiguous entries (what could be
   // put in a signed tree head). This can be greater than the tree
   // size returned by LatestTreeHead.
@@ -120,6 +163,27 @@ class Database : public ReadOnlyDatabase {
     return CreateSequencedEntry_(logged);
   }
 
+  // Same as CreateSequencedEntry(), for several entries at once, which
+  // is a lot cheaper than one at a time. The entries are written in
+  // order, stopping at the first one that fails, whose result is then
+  // returned. If |num_written| is not NULL, it is set to the number of
+  // entries that were successfully written before that (all of them,
+  // if OK is returned).
+  WriteResult CreateSequencedEntries(const std::vector<LoggedEntry>& entries,
+                                     size_t* num_written) {
+    for (const auto& logged : entries) {
+      CHECK(logged.has_sequence_number());
+      CHECK_GE(logged.sequence_number(), 0);
+    }
+    size_t written(0);
+    const WriteResult result(CreateSequencedEntries_(entries, &written));
+    CHECK(result != OK || written == entries.size());
+    if (num_written) {
+      *num_written = written;
+    }
+    return result;
+  }
+
   // Attempt to write a tree head. Fails only if a tree head with this
   // timestamp already exists (i.e., |timestamp| is primary key). Does
   // not check that the timestamp is newer than previous entries.
@@ -129,12 +193,20 @@ class Database : public ReadOnlyDatabase {
     return WriteTreeHead_(sth);
   }
 
+  // Replaces the frontier of the tree (see
+  // CompactMerkleTree::SerializeFrontier()) kept alongside the tree
+  // heads, so that a signer can carry on from it rather than rebuild
+  // the tree. The implementations that do not keep it ignore it.
+  virtual void WriteTreeFrontier(const std::string& frontier);
+
  protected:
   Database() = default;
 
   // See the inline methods with similar names defined above for more
   // documentation.
   virtual WriteResult CreateSequencedEntry_(const LoggedEntry& logged) = 0;
+  virtual WriteResult CreateSequencedEntries_(
+      const std::vector<LoggedEntry>& entries, size_t* num_written) = 0;
   virtual WriteResult WriteTreeHead_(const ct::SignedTreeHead& sth) = 0;
 
  private:
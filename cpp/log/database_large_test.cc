@@ -12,6 +12,7 @@
 #include "log/file_storage.h"
 #include "log/leveldb_db.h"
 #include "log/logged_entry.h"
+#include "log/segment_db.h"
 #include "log/sqlite_db.h"
 #include "log/test_db.h"
 #include "log/test_signer.h"
@@ -32,6 +33,7 @@ using cert_trans::FileDB;
 using cert_trans::LevelDB;
 using cert_trans::LoggedEntry;
 using cert_trans::SQLiteDB;
+using cert_trans::SegmentDB;
 using std::string;
 
 
@@ -71,7 +73,9 @@ class LargeDBTest : public ::testing::Test {
   TestSigner test_signer_;
 };
 
-typedef testing::Types<FileDB, SQLiteDB, LevelDB> Databases;
+// A quick check that filling and reading a larger database works; see
+// bench_database for benchmarks of all the operations.
+typedef testing::Types<FileDB, SQLiteDB, LevelDB, SegmentDB> Databases;
 
 TYPED_TEST_CASE(LargeDBTest, Databases);
 
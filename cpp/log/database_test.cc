@@ -1,20 +1,35 @@
 /* -*- indent-tabs-mode: nil -*- */
+#include <gflags/gflags.h>
 #include <gtest/gtest.h>
+#include <inttypes.h>
+#include <leveldb/db.h>
+#include <stdio.h>
 #include <set>
 #include <string>
+#include <vector>
 
 #include "log/database.h"
 #include "log/file_db.h"
 #include "log/file_storage.h"
 #include "log/leveldb_db.h"
 #include "log/logged_entry.h"
+#include "log/segment_db.h"
 #include "log/sqlite_db.h"
 #include "log/test_db.h"
 #include "log/test_signer.h"
 #include "proto/cert_serializer.h"
+#include "util/sync_task.h"
 #include "util/testing.h"
+#include "util/thread_pool.h"
 #include "util/util.h"
 
+DECLARE_bool(compress_stored_entries);
+DECLARE_bool(deduplicate_chain_certs);
+DECLARE_int32(leveldb_hash_filter_bits_per_entry);
+DECLARE_int32(sqlite_sth_retention_days);
+DECLARE_int32(sqlite_sth_retention_interval_hours);
+DECLARE_string(stored_entries_dictionary);
+
 // TODO(benl): Introduce a test |Logged| type.
 
 namespace {
@@ -24,9 +39,46 @@ using cert_trans::FileDB;
 using cert_trans::LevelDB;
 using cert_trans::LoggedEntry;
 using cert_trans::SQLiteDB;
+using cert_trans::SegmentDB;
+using cert_trans::ThreadPool;
 using ct::SignedTreeHead;
 using std::string;
 using std::unique_ptr;
+using std::vector;
+using util::SyncTask;
+
+
+// Makes |data| the --stored_entries_dictionary for its lifetime.
+class ScopedDictionary {
+ public:
+  explicit ScopedDictionary(const string& data)
+      : previous_(FLAGS_stored_entries_dictionary) {
+    FLAGS_stored_entries_dictionary = util::WriteTemporaryBinaryFile(
+        tmp_.TmpStorageDir() + "/dictionaryXXXXXX", data);
+    CHECK(!FLAGS_stored_entries_dictionary.empty());
+    LoggedEntry::ReloadDictionaryForTestingOnly();
+  }
+
+  ~ScopedDictionary() {
+    FLAGS_stored_entries_dictionary = previous_;
+    LoggedEntry::ReloadDictionaryForTestingOnly();
+  }
+
+ private:
+  const string previous_;
+  TmpStorage tmp_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedDictionary);
+};
+
+
+// Whether |entry| is compressed when stored, which it only is when
+// --compress_stored_entries is set, and that makes it smaller.
+bool IsStoredCompressed(const LoggedEntry& entry) {
+  string stored;
+  CHECK(entry.SerializeForStorage(&stored));
+  return !stored.empty() && stored[0] == '\0';
+}
 
 
 template <class T>
@@ -42,11 +94,42 @@ class DBTest : public ::testing::Test {
     return test_db_.db();
   }
 
+  // Checks that |entries|, stored from index 0, read back the same, and
+  // still do from a second database opened after this one.
+  void ExpectEntriesStored(const vector<LoggedEntry>& entries) {
+    vector<string> raw;
+    db()->ReadRawRange(0, entries.size(), &raw);
+    ASSERT_EQ(entries.size(), raw.size());
+    for (size_t i = 0; i < raw.size(); ++i) {
+      LoggedEntry entry;
+      ASSERT_TRUE(entry.ParseFromString(raw[i]));
+      TestSigner::TestEqualLoggedCerts(entries[i], entry);
+    }
+
+    // Commits them, for the SQLiteDB.
+    SignedTreeHead sth;
+    test_signer_.CreateUnique(&sth);
+    EXPECT_EQ(Database::OK, db()->WriteTreeHead(sth));
+
+    // Without the certificates in memory.
+    unique_ptr<Database> db2(test_db_.SecondDB());
+    vector<LoggedEntry> read;
+    db2->ReadRange(0, entries.size(), &read);
+    ASSERT_EQ(entries.size(), read.size());
+    for (size_t i = 0; i < read.size(); ++i) {
+      TestSigner::TestEqualLoggedCerts(entries[i], read[i]);
+      LoggedEntry lookup_cert;
+      EXPECT_EQ(Database::LOOKUP_OK,
+                db2->LookupByHash(entries[i].Hash(), &lookup_cert));
+      TestSigner::TestEqualLoggedCerts(entries[i], lookup_cert);
+    }
+  }
+
   TestDB<T> test_db_;
   TestSigner test_signer_;
 };
 
-typedef testing::Types<FileDB, SQLiteDB, LevelDB> Databases;
+typedef testing::Types<FileDB, SQLiteDB, LevelDB, SegmentDB> Databases;
 
 
 template <class T>
@@ -218,6 +301,64 @@ TYPED_TEST(DBTest, TreeSize) {
 }
 
 
+TYPED_TEST(DBTest, CreateSequencedEntries) {
+  vector<LoggedEntry> entries(5);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    this->test_signer_.CreateUnique(&entries[i]);
+    entries[i].set_sequence_number(i);
+  }
+  // Already there (and identical), and duplicated within the batch.
+  EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntry(entries[1]));
+  entries.push_back(entries[3]);
+
+  size_t num_written(0);
+  EXPECT_EQ(Database::OK,
+            this->db()->CreateSequencedEntries(entries, &num_written));
+  EXPECT_EQ(entries.size(), num_written);
+  EXPECT_EQ(5, this->db()->TreeSize());
+
+  for (const auto& logged_cert : entries) {
+    LoggedEntry lookup_cert;
+    EXPECT_EQ(Database::LOOKUP_OK,
+              this->db()->LookupByIndex(logged_cert.sequence_number(),
+                                        &lookup_cert));
+    TestSigner::TestEqualLoggedCerts(logged_cert, lookup_cert);
+
+    lookup_cert.Clear();
+    EXPECT_EQ(Database::LOOKUP_OK,
+              this->db()->LookupByHash(logged_cert.Hash(), &lookup_cert));
+    TestSigner::TestEqualLoggedCerts(logged_cert, lookup_cert);
+  }
+}
+
+
+TYPED_TEST(DBTest, CreateSequencedEntriesDuplicateSequenceNumber) {
+  vector<LoggedEntry> entries(5);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    this->test_signer_.CreateUnique(&entries[i]);
+    entries[i].set_sequence_number(i);
+  }
+  LoggedEntry existing;
+  this->test_signer_.CreateUnique(&existing);
+  existing.set_sequence_number(2);
+  EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntry(existing));
+
+  size_t num_written(0);
+  EXPECT_EQ(Database::SEQUENCE_NUMBER_ALREADY_IN_USE,
+            this->db()->CreateSequencedEntries(entries, &num_written));
+  EXPECT_EQ(2U, num_written);
+  EXPECT_EQ(3, this->db()->TreeSize());
+
+  LoggedEntry lookup_cert;
+  EXPECT_EQ(Database::LOOKUP_OK, this->db()->LookupByIndex(1, &lookup_cert));
+  TestSigner::TestEqualLoggedCerts(entries[1], lookup_cert);
+  lookup_cert.Clear();
+  EXPECT_EQ(Database::LOOKUP_OK, this->db()->LookupByIndex(2, &lookup_cert));
+  TestSigner::TestEqualLoggedCerts(existing, lookup_cert);
+  EXPECT_EQ(Database::NOT_FOUND, this->db()->LookupByIndex(3, &lookup_cert));
+}
+
+
 TYPED_TEST(DBTest, LookupBySequenceNumber) {
   LoggedEntry logged_cert, logged_cert2, lookup_cert, lookup_cert2;
   this->test_signer_.CreateUnique(&logged_cert);
@@ -242,6 +383,195 @@ TYPED_TEST(DBTest, LookupBySequenceNumber) {
 }
 
 
+TYPED_TEST(DBTest, ReadRange) {
+  vector<LoggedEntry> entries(6);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    this->test_signer_.CreateUnique(&entries[i]);
+    entries[i].set_sequence_number(i);
+  }
+  // Leave a gap after the first four.
+  entries.erase(entries.begin() + 4);
+  EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntries(entries, NULL));
+
+  vector<LoggedEntry> read;
+  this->db()->ReadRange(1, 2, &read);
+  ASSERT_EQ(2U, read.size());
+  TestSigner::TestEqualLoggedCerts(entries[1], read[0]);
+  TestSigner::TestEqualLoggedCerts(entries[2], read[1]);
+
+  // The entries already there are reused, but keep nothing of what they
+  // held before.
+  const vector<LoggedEntry> fresh(read);
+  read.assign(3, entries[4]);
+  read[0].set_merkle_leaf_hash("stale");
+  this->db()->ReadRange(1, 2, &read);
+  ASSERT_EQ(2U, read.size());
+  EXPECT_TRUE(fresh[0] == read[0]);
+  EXPECT_TRUE(fresh[1] == read[1]);
+
+  // Stops at the gap, and replaces what was there.
+  this->db()->ReadRange(2, 10, &read);
+  ASSERT_EQ(2U, read.size());
+  TestSigner::TestEqualLoggedCerts(entries[2], read[0]);
+  TestSigner::TestEqualLoggedCerts(entries[3], read[1]);
+
+  this->db()->ReadRange(4, 10, &read);
+  EXPECT_TRUE(read.empty());
+  this->db()->ReadRange(0, 0, &read);
+  EXPECT_TRUE(read.empty());
+}
+
+
+TYPED_TEST(DBTest, ReadRawRange) {
+  vector<LoggedEntry> entries(3);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    this->test_signer_.CreateUnique(&entries[i]);
+    entries[i].set_sequence_number(i);
+  }
+  EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntries(entries, NULL));
+
+  vector<string> read;
+  this->db()->ReadRawRange(1, 5, &read);
+  ASSERT_EQ(2U, read.size());
+  for (size_t i = 0; i < read.size(); ++i) {
+    LoggedEntry entry;
+    ASSERT_TRUE(entry.ParseFromString(read[i]));
+    TestSigner::TestEqualLoggedCerts(entries[i + 1], entry);
+  }
+}
+
+
+TYPED_TEST(DBTest, ReadLeafRange) {
+  vector<LoggedEntry> entries(3);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    this->test_signer_.CreateUnique(&entries[i]);
+    entries[i].set_sequence_number(i);
+    *entries[i].mutable_chain()->Add() =
+        this->test_signer_.UniqueFakeCertBytestring();
+  }
+  EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntries(entries, NULL));
+
+  vector<LoggedEntry> read;
+  this->db()->ReadLeafRange(1, 5, &read);
+  ASSERT_EQ(2U, read.size());
+  for (size_t i = 0; i < read.size(); ++i) {
+    EXPECT_EQ(entries[i + 1].sequence_number(), read[i].sequence_number());
+    EXPECT_EQ(entries[i + 1].Hash(), read[i].Hash());
+    string leaf, read_leaf;
+    EXPECT_TRUE(entries[i + 1].SerializeForLeaf(&leaf));
+    EXPECT_TRUE(read[i].SerializeForLeaf(&read_leaf));
+    EXPECT_EQ(leaf, read_leaf);
+  }
+}
+
+
+TYPED_TEST(DBTest, DeduplicateChainCerts) {
+  google::FlagSaver saver;
+  const string intermediate(this->test_signer_.UniqueFakeCertBytestring());
+  const string root(this->test_signer_.UniqueFakeCertBytestring());
+  vector<LoggedEntry> entries(kEntriesPerSegment + 2);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    this->test_signer_.CreateUnique(&entries[i]);
+    entries[i].set_sequence_number(i);
+    entries[i].mutable_chain()->Clear();
+    *entries[i].mutable_chain()->Add() = intermediate;
+    *entries[i].mutable_chain()->Add() = root;
+  }
+
+  // Entries stored before the flag was turned on can be read along
+  // with the others.
+  EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntry(entries[0]));
+  FLAGS_deduplicate_chain_certs = true;
+  EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntries(entries, NULL));
+  FLAGS_deduplicate_chain_certs = false;
+  EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntry(entries[1]));
+
+  this->ExpectEntriesStored(entries);
+}
+
+
+TYPED_TEST(DBTest, CompressStoredEntries) {
+  google::FlagSaver saver;
+  FLAGS_compress_stored_entries = true;
+  const string intermediate(this->test_signer_.UniqueFakeCertBytestring());
+  const string root(this->test_signer_.UniqueFakeCertBytestring());
+  ScopedDictionary dictionary(intermediate + root);
+  vector<LoggedEntry> entries(kEntriesPerSegment + 2);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    this->test_signer_.CreateUnique(&entries[i]);
+    entries[i].set_sequence_number(i);
+    entries[i].mutable_chain()->Clear();
+    *entries[i].mutable_chain()->Add() = intermediate;
+    *entries[i].mutable_chain()->Add() = root;
+    // With the chain in the dictionary, it is worth compressing.
+    ASSERT_TRUE(IsStoredCompressed(entries[i]));
+  }
+
+  EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntries(entries, NULL));
+
+  this->ExpectEntriesStored(entries);
+}
+
+
+TYPED_TEST(DBTest, CompressSomeStoredEntries) {
+  google::FlagSaver saver;
+  vector<LoggedEntry> entries(kEntriesPerSegment + 2);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    this->test_signer_.CreateUnique(&entries[i]);
+    entries[i].set_sequence_number(i);
+    // Without a dictionary, it takes some repetition to be worth
+    // compressing.
+    const string cert(this->test_signer_.UniqueFakeCertBytestring());
+    entries[i].mutable_chain()->Clear();
+    *entries[i].mutable_chain()->Add() = cert;
+    *entries[i].mutable_chain()->Add() = cert;
+    FLAGS_compress_stored_entries = true;
+    ASSERT_TRUE(IsStoredCompressed(entries[i]));
+    FLAGS_compress_stored_entries = false;
+  }
+
+  // Entries stored before the flag was turned on, or after it was
+  // turned off, can be read along with the others, and are the same
+  // entries as the compressed ones, for duplicate checks.
+  EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntry(entries[0]));
+  FLAGS_compress_stored_entries = true;
+  EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntries(entries, NULL));
+  FLAGS_compress_stored_entries = false;
+  EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntry(entries[1]));
+
+  this->ExpectEntriesStored(entries);
+}
+
+
+TYPED_TEST(DBTest, ReadEntries) {
+  vector<LoggedEntry> entries(5);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    this->test_signer_.CreateUnique(&entries[i]);
+    entries[i].set_sequence_number(i);
+  }
+  // Leave a gap after the first three.
+  entries.erase(entries.begin() + 3);
+  EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntries(entries, NULL));
+
+  ThreadPool pool(1);
+  vector<LoggedEntry> read;
+  SyncTask task(&pool);
+  this->db()->ReadEntries(1, 4, &pool, &read, task.task());
+  task.Wait();
+  EXPECT_TRUE(task.status().ok());
+  ASSERT_EQ(2U, read.size());
+  TestSigner::TestEqualLoggedCerts(entries[1], read[0]);
+  TestSigner::TestEqualLoggedCerts(entries[2], read[1]);
+
+  read.clear();
+  SyncTask past_end(&pool);
+  this->db()->ReadEntries(5, 10, &pool, &read, past_end.task());
+  past_end.Wait();
+  EXPECT_TRUE(past_end.status().ok());
+  EXPECT_TRUE(read.empty());
+}
+
+
 TYPED_TEST(DBTest, WriteTreeHead) {
   SignedTreeHead sth, lookup_sth;
   this->test_signer_.CreateUnique(&sth);
@@ -299,6 +629,30 @@ TYPED_TEST(DBTest, WriteTreeHeadOlderTimestamp) {
 }
 
 
+TYPED_TEST(DBTest, ReadTreeHeads) {
+  SignedTreeHead sth, sth2, sth3;
+  this->test_signer_.CreateUnique(&sth);
+  this->test_signer_.CreateUnique(&sth2);
+  this->test_signer_.CreateUnique(&sth3);
+  sth2.set_timestamp(sth.timestamp() - 1000);
+  sth3.set_timestamp(sth.timestamp() + 1000);
+
+  vector<SignedTreeHead> sths;
+  this->db()->ReadTreeHeads(&sths);
+  EXPECT_TRUE(sths.empty());
+
+  EXPECT_EQ(Database::OK, this->db()->WriteTreeHead(sth));
+  EXPECT_EQ(Database::OK, this->db()->WriteTreeHead(sth2));
+  EXPECT_EQ(Database::OK, this->db()->WriteTreeHead(sth3));
+
+  this->db()->ReadTreeHeads(&sths);
+  ASSERT_EQ(3U, sths.size());
+  TestSigner::TestEqualTreeHeads(sth2, sths[0]);
+  TestSigner::TestEqualTreeHeads(sth, sths[1]);
+  TestSigner::TestEqualTreeHeads(sth3, sths[2]);
+}
+
+
 TYPED_TEST(DBTest, Resume) {
   LoggedEntry logged_cert, logged_cert2, lookup_cert, lookup_cert2;
   const int64_t kSeq1(129);
@@ -380,6 +734,30 @@ TYPED_TEST(DBTestDeathTest, CannotHaveEmptyNodeId) {
 }
 
 
+TYPED_TEST(DBTestDeathTest, CannotReadEntryCompressedWithOtherDictionary) {
+  google::FlagSaver saver;
+  FLAGS_compress_stored_entries = true;
+  const string intermediate(this->test_signer_.UniqueFakeCertBytestring());
+  const string root(this->test_signer_.UniqueFakeCertBytestring());
+  LoggedEntry logged_cert;
+  this->test_signer_.CreateUnique(&logged_cert);
+  logged_cert.set_sequence_number(0);
+  logged_cert.mutable_chain()->Clear();
+  *logged_cert.mutable_chain()->Add() = intermediate;
+  *logged_cert.mutable_chain()->Add() = root;
+  {
+    ScopedDictionary dictionary(intermediate + root);
+    ASSERT_TRUE(IsStoredCompressed(logged_cert));
+    EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntry(logged_cert));
+  }
+
+  ScopedDictionary other_dictionary(root + intermediate);
+  LoggedEntry lookup_cert;
+  EXPECT_DEATH(this->db()->LookupByIndex(0, &lookup_cert),
+               "another dictionary");
+}
+
+
 TYPED_TEST(DBTest, Iterator) {
   LoggedEntry logged_cert1, logged_cert2, logged_cert3;
   const int64_t kSeq1(129);
@@ -428,6 +806,248 @@ TYPED_TEST(DBTest, Iterator) {
 }
 
 
+TYPED_TEST(DBTest, IteratorManyEntries) {
+  // More than a few batches of the LevelDB read ahead, and not a
+  // multiple of them.
+  vector<LoggedEntry> entries(3000);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    this->test_signer_.CreateUnique(&entries[i]);
+    entries[i].set_sequence_number(i);
+  }
+  size_t num_written(0);
+  ASSERT_EQ(Database::OK,
+            this->db()->CreateSequencedEntries(entries, &num_written));
+  ASSERT_EQ(entries.size(), num_written);
+
+  for (const int64_t start : {0, 1023, 2048}) {
+    unique_ptr<Database::Iterator> it(this->db()->ScanEntries(start));
+    LoggedEntry it_cert;
+    for (size_t i = start; i < entries.size(); ++i) {
+      ASSERT_TRUE(it->GetNextEntry(&it_cert)) << i;
+      EXPECT_EQ(static_cast<int64_t>(i), it_cert.sequence_number());
+    }
+    EXPECT_FALSE(it->GetNextEntry(&it_cert));
+  }
+
+  // Dropping an iterator in the middle of a scan is fine too.
+  unique_ptr<Database::Iterator> it(this->db()->ScanEntries(0));
+  LoggedEntry it_cert;
+  for (int i = 0; i < 1500; ++i) {
+    ASSERT_TRUE(it->GetNextEntry(&it_cert));
+  }
+}
+
+
+// Databases written before the hash index was added only have the
+// entries and tree heads, and need to be indexed when opened.
+TEST(LevelDBTest, IndexesOldDatabase) {
+  TmpStorage tmp;
+  TestSigner test_signer;
+  const string dbfile(tmp.TmpStorageDir() + "/leveldb");
+  vector<LoggedEntry> entries(4);
+  {
+    leveldb::Options options;
+    options.create_if_missing = true;
+    leveldb::DB* db;
+    ASSERT_TRUE(leveldb::DB::Open(options, dbfile, &db).ok());
+    const unique_ptr<leveldb::DB> old_db(db);
+
+    for (size_t i = 0; i < entries.size(); ++i) {
+      test_signer.CreateUnique(&entries[i]);
+      // Leave a gap, to make a sparse entry.
+      entries[i].set_sequence_number(i < 2 ? i : i + 1);
+      string data;
+      ASSERT_TRUE(entries[i].SerializeToString(&data));
+      char key[32];
+      snprintf(key, sizeof(key), "entry-%016" PRIx64,
+               entries[i].sequence_number());
+      ASSERT_TRUE(old_db->Put(leveldb::WriteOptions(), key, data).ok());
+    }
+  }
+
+  for (int i = 0; i < 2; ++i) {
+    // The second time around, the index is already there.
+    LevelDB db(dbfile);
+    EXPECT_EQ(2, db.TreeSize());
+    for (const auto& logged_cert : entries) {
+      LoggedEntry lookup_cert;
+      EXPECT_EQ(Database::LOOKUP_OK,
+                db.LookupByHash(logged_cert.Hash(), &lookup_cert));
+      TestSigner::TestEqualLoggedCerts(logged_cert, lookup_cert);
+    }
+  }
+
+  LevelDB db(dbfile);
+  LoggedEntry logged_cert;
+  test_signer.CreateUnique(&logged_cert);
+  logged_cert.set_sequence_number(2);
+  EXPECT_EQ(Database::OK, db.CreateSequencedEntry(logged_cert));
+  EXPECT_EQ(5, db.TreeSize());
+}
+
+
+// A truncated contiguous size must not be read as a (partly undefined)
+// tree size.
+TEST(LevelDBDeathTest, CorruptContiguousSize) {
+  TmpStorage tmp;
+  const string dbfile(tmp.TmpStorageDir() + "/leveldb");
+  {
+    LevelDB db(dbfile);
+  }
+  {
+    leveldb::DB* db;
+    ASSERT_TRUE(leveldb::DB::Open(leveldb::Options(), dbfile, &db).ok());
+    const unique_ptr<leveldb::DB> raw_db(db);
+    ASSERT_TRUE(raw_db->Put(leveldb::WriteOptions(), "meta-contiguous_size",
+                            string(4, '\0')).ok());
+  }
+
+  EXPECT_DEATH({ LevelDB db(dbfile); }, "DeserializeUint");
+}
+
+
+TEST(LevelDBTest, CompactEntries) {
+  TmpStorage tmp;
+  TestSigner test_signer;
+  LevelDB db(tmp.TmpStorageDir() + "/leveldb");
+  vector<LoggedEntry> entries(100);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    test_signer.CreateUnique(&entries[i]);
+    entries[i].set_sequence_number(i);
+    ASSERT_EQ(Database::OK, db.CreateSequencedEntry(entries[i]));
+  }
+
+  db.CompactEntries(0, 49);
+  db.CompactEntries(50, 50);
+  for (const auto& logged_cert : entries) {
+    LoggedEntry lookup_cert;
+    EXPECT_EQ(Database::LOOKUP_OK,
+              db.LookupByIndex(logged_cert.sequence_number(), &lookup_cert));
+    TestSigner::TestEqualLoggedCerts(logged_cert, lookup_cert);
+  }
+  EXPECT_EQ(100, db.TreeSize());
+}
+
+
+// The hash filter is rebuilt when opening the database, and kept up to
+// date by the writes.
+TEST(LevelDBTest, HashFilter) {
+  google::FlagSaver saver;
+  FLAGS_leveldb_hash_filter_bits_per_entry = 10;
+  TmpStorage tmp;
+  TestSigner test_signer;
+  const string dbfile(tmp.TmpStorageDir() + "/leveldb");
+  vector<LoggedEntry> entries(20);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    test_signer.CreateUnique(&entries[i]);
+    entries[i].set_sequence_number(i);
+  }
+  {
+    LevelDB db(dbfile);
+    for (size_t i = 0; i < entries.size() / 2; ++i) {
+      ASSERT_EQ(Database::OK, db.CreateSequencedEntry(entries[i]));
+    }
+  }
+
+  LevelDB db(dbfile);
+  for (size_t i = entries.size() / 2; i < entries.size(); ++i) {
+    LoggedEntry lookup_cert;
+    EXPECT_EQ(Database::NOT_FOUND,
+              db.LookupByHash(entries[i].Hash(), &lookup_cert));
+    ASSERT_EQ(Database::OK, db.CreateSequencedEntry(entries[i]));
+  }
+  for (const auto& logged_cert : entries) {
+    LoggedEntry lookup_cert;
+    EXPECT_EQ(Database::LOOKUP_OK,
+              db.LookupByHash(logged_cert.Hash(), &lookup_cert));
+    TestSigner::TestEqualLoggedCerts(logged_cert, lookup_cert);
+  }
+
+  // Duplicates under a new sequence number are still detected.
+  LoggedEntry duplicate(entries[0]);
+  duplicate.set_sequence_number(entries.size());
+  EXPECT_EQ(Database::OK, db.CreateSequencedEntry(duplicate));
+  LoggedEntry lookup_cert;
+  EXPECT_EQ(Database::LOOKUP_OK,
+            db.LookupByHash(entries[0].Hash(), &lookup_cert));
+  EXPECT_EQ(0, lookup_cert.sequence_number());
+}
+
+
+TEST(SQLiteDBTest, ThinsOldTreeHeads) {
+  google::FlagSaver saver;
+  FLAGS_sqlite_sth_retention_days = 1;
+  FLAGS_sqlite_sth_retention_interval_hours = 1;
+  TmpStorage tmp;
+  TestSigner test_signer;
+  SQLiteDB db(tmp.TmpStorageDir() + "/sqlite");
+
+  // One every half hour, for 72 hours.
+  const uint64_t kHalfHour(30 * 60 * 1000);
+  SignedTreeHead sth;
+  for (uint64_t i = 0; i < 144; ++i) {
+    test_signer.CreateUnique(&sth);
+    sth.set_timestamp(i * kHalfHour);
+    ASSERT_EQ(Database::OK, db.WriteTreeHead(sth));
+  }
+
+  // Thinned last with the tree head at 71h, the ones before 47h are
+  // down to the second of every hour.
+  vector<SignedTreeHead> sths;
+  db.ReadTreeHeads(&sths);
+  ASSERT_EQ(47U + 50U, sths.size());
+  for (size_t i = 0; i < sths.size(); ++i) {
+    EXPECT_EQ(i < 47 ? (2 * i + 1) * kHalfHour : (i + 47) * kHalfHour,
+              sths[i].timestamp());
+  }
+
+  SignedTreeHead lookup_sth;
+  EXPECT_EQ(Database::LOOKUP_OK, db.LatestTreeHead(&lookup_sth));
+  TestSigner::TestEqualTreeHeads(sth, lookup_sth);
+}
+
+
+// A crash while appending to a segment leaves a torn record at its
+// end, which must be dropped when the database is opened again.
+TEST(SegmentDBTest, DropsTornRecord) {
+  TmpStorage tmp;
+  TestSigner test_signer;
+  const string dir(tmp.TmpStorageDir() + "/segments");
+  // Fills the first segment, and starts the second one.
+  vector<LoggedEntry> entries(kEntriesPerSegment + 2);
+  {
+    SegmentDB db(dir, kEntriesPerSegment);
+    for (size_t i = 0; i < entries.size(); ++i) {
+      test_signer.CreateUnique(&entries[i]);
+      entries[i].set_sequence_number(i);
+      EXPECT_EQ(Database::OK, db.CreateSequencedEntry(entries[i]));
+    }
+  }
+
+  char name[64];
+  snprintf(name, sizeof(name), "/entries-%020" PRId64, kEntriesPerSegment);
+  FILE* const segment(fopen((dir + name).c_str(), "a"));
+  ASSERT_TRUE(segment != nullptr);
+  ASSERT_EQ(5U, fwrite("\x06\0\0\0\0", 1, 5, segment));
+  ASSERT_EQ(0, fclose(segment));
+
+  SegmentDB db(dir, kEntriesPerSegment);
+  EXPECT_EQ(static_cast<int64_t>(entries.size()), db.TreeSize());
+  for (const auto& logged_cert : entries) {
+    LoggedEntry lookup_cert;
+    EXPECT_EQ(Database::LOOKUP_OK,
+              db.LookupByHash(logged_cert.Hash(), &lookup_cert));
+    TestSigner::TestEqualLoggedCerts(logged_cert, lookup_cert);
+  }
+
+  LoggedEntry logged_cert;
+  test_signer.CreateUnique(&logged_cert);
+  logged_cert.set_sequence_number(entries.size());
+  EXPECT_EQ(Database::OK, db.CreateSequencedEntry(logged_cert));
+  EXPECT_EQ(static_cast<int64_t>(entries.size()) + 1, db.TreeSize());
+}
+
+
 }  // namespace
 
 
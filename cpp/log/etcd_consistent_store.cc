@@ -2,7 +2,13 @@
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <zlib.h>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <iomanip>
+#include <random>
+#include <sstream>
 #include <unordered_map>
 #include <vector>
 
@@ -13,6 +19,7 @@
 #include "util/etcd_delete.h"
 #include "util/executor.h"
 #include "util/masterelection.h"
+#include "util/task_sequence.h"
 #include "util/util.h"
 
 using ct::ClusterConfig;
@@ -21,11 +28,18 @@ using ct::SequenceMapping;
 using ct::SignedTreeHead;
 using std::bind;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::lock_guard;
+using std::make_pair;
 using std::map;
+using std::max;
 using std::move;
 using std::mutex;
+using std::ostringstream;
+using std::pair;
 using std::placeholders::_1;
+using std::setfill;
+using std::setw;
 using std::string;
 using std::unique_lock;
 using std::unique_ptr;
@@ -35,25 +49,78 @@ using util::Status;
 using util::StatusOr;
 using util::SyncTask;
 using util::Task;
+using util::TaskSequence;
 using util::ToBase64;
 
-// This needs to be quite frequent since the number of entries which can be
-// added every second can be pretty high.
-DEFINE_int32(etcd_stats_collection_interval_seconds, 2,
-             "Number of seconds between fetches of etcd stats.");
+// The admission control goes by the local copy of the pending entries,
+// the etcd stats are only fetched to be exported.
+DEFINE_int32(etcd_stats_collection_interval_seconds, 0,
+             "Number of seconds between fetches of etcd stats, to export "
+             "them as metrics, or 0 not to fetch them.");
+DEFINE_double(etcd_reject_ramp_fraction, 0.9,
+              "fraction of the etcd_reject_add_pending_threshold of the "
+              "cluster config from which add-chain requests start being "
+              "rejected, with a probability growing linearly up to 1 at the "
+              "threshold; 1 rejects them all past the threshold only");
 DEFINE_int32(node_state_ttl_seconds, 60,
              "TTL in seconds on the node state files.");
+DEFINE_int32(etcd_cleanup_batch_size, 1000,
+             "Maximum number of old entries to delete from etcd at a time.");
+DEFINE_int32(etcd_entries_shard_prefix_length, 0,
+             "Number of hex digits of the hash of pending entries to shard "
+             "them by in etcd, as /entries/<prefix>/<hash>, from 0 (not "
+             "sharded) to 2 (256 shards). All the nodes of a cluster must "
+             "use the same value.");
+DEFINE_int32(etcd_pending_entries_sync_timeout_seconds, 10,
+             "Number of seconds to wait for the local copy of the pending "
+             "entries to catch up with etcd, before fetching them all from "
+             "etcd instead.");
+DEFINE_bool(etcd_deduplicate_chain_certs, false,
+            "write every distinct certificate of the chains of the pending "
+            "entries to etcd once, under /chain_certs/<hash>, with only "
+            "references to them in the entries; entries are read either "
+            "way, so every node of a cluster must be able to read these "
+            "before any of them writes them");
+DEFINE_bool(etcd_compact_values, false,
+            "write the values to etcd zlib-compressed (when that makes them "
+            "smaller), in base64url rather than base64, which takes no "
+            "escaping in the etcd requests; values in either encoding are "
+            "read either way, so every node of a cluster must be able to "
+            "read these before any of them writes them");
 
 namespace cert_trans {
 namespace {
 
 // etcd path constants.
+const char kChainCertsDir[] = "/chain_certs/";
 const char kClusterConfigFile[] = "/cluster_config";
 const char kEntriesDir[] = "/entries/";
-const char kSequenceFile[] = "/sequence_mapping";
+// Not a valid entry hash.
+const char kEntriesSyncFile[] = "sync";
+const char kHexDigits[] = "0123456789abcdef";
+const char kSequenceMappingDir[] = "/sequence_mapping_chunks/";
+// Where the whole sequence mapping used to be kept, in a single value,
+// before it was split into chunks. etcd cannot have a directory and a
+// file by the same name, hence the different name of the directory.
+const char kLegacySequenceMappingFile[] = "/sequence_mapping";
 const char kServingSthFile[] = "/serving_sth";
 const char kNodesDir[] = "/nodes/";
 
+// The sequence mapping is split into chunks of this many consecutive
+// sequence numbers, each in its own key, so that sequencing a few more
+// entries only rewrites the last chunk or two, however many entries
+// are awaiting cleanup. Changing this on a running log would make the
+// old and new chunks overlap.
+const int64_t kSequenceMappingChunkSize = 1000;
+
+// The values written with --etcd_compact_values start with one of
+// these, which are not in the base64 alphabet of the other values. The
+// rest is in base64url, without padding: the serialized protobuf, or
+// its size (4 bytes, little-endian) followed by its zlib compression.
+const char kCompactValueMarker = '.';
+const char kCompressedValueMarker = '~';
+const size_t kCompressedHeaderSize = 4;
+
 
 static Gauge<string>* etcd_total_entries =
     Gauge<string>::New("etcd_total_entries", "type",
@@ -80,6 +147,97 @@ static Latency<std::chrono::milliseconds, string> etcd_latency_by_op_ms(
     "Etcd latency in ms broken down by operation.");
 
 
+string ToBase64Url(const string& from) {
+  string b64(ToBase64(from));
+  while (!b64.empty() && b64.back() == '=') {
+    b64.pop_back();
+  }
+  for (char& c : b64) {
+    if (c == '+') {
+      c = '-';
+    } else if (c == '/') {
+      c = '_';
+    }
+  }
+  return b64;
+}
+
+
+string FromBase64Url(const char* data, size_t size) {
+  string b64(data, size);
+  for (char& c : b64) {
+    if (c == '-') {
+      c = '+';
+    } else if (c == '_') {
+      c = '/';
+    }
+  }
+  b64.append((4 - b64.size() % 4) % 4, '=');
+  return FromBase64(b64.c_str());
+}
+
+
+// Encodes a serialized protobuf into an etcd value.
+string EncodeValue(const string& serialized) {
+  if (!FLAGS_etcd_compact_values) {
+    return ToBase64(serialized);
+  }
+
+  uLongf compressed_size(compressBound(serialized.size()));
+  string compressed(kCompressedHeaderSize + compressed_size, '\0');
+  for (size_t i = 0; i < kCompressedHeaderSize; ++i) {
+    compressed[i] = static_cast<char>(serialized.size() >> (8 * i));
+  }
+  CHECK_EQ(Z_OK, compress2(reinterpret_cast<Bytef*>(
+                                &compressed[kCompressedHeaderSize]),
+                            &compressed_size,
+                            reinterpret_cast<const Bytef*>(serialized.data()),
+                            serialized.size(), Z_DEFAULT_COMPRESSION));
+  compressed.resize(kCompressedHeaderSize + compressed_size);
+
+  if (compressed.size() < serialized.size()) {
+    return kCompressedValueMarker + ToBase64Url(compressed);
+  }
+  return kCompactValueMarker + ToBase64Url(serialized);
+}
+
+
+// Decodes an etcd value back into a serialized protobuf, whichever
+// way it was encoded. Returns an empty string if it is corrupt.
+string DecodeValue(const string& value) {
+  if (value.empty() || (value[0] != kCompactValueMarker &&
+                        value[0] != kCompressedValueMarker)) {
+    return FromBase64(value.c_str());
+  }
+
+  string decoded(FromBase64Url(value.data() + 1, value.size() - 1));
+  if (value[0] == kCompactValueMarker) {
+    return decoded;
+  }
+
+  if (decoded.size() < kCompressedHeaderSize) {
+    LOG(ERROR) << "Truncated compressed etcd value";
+    return string();
+  }
+  size_t size(0);
+  for (size_t i = 0; i < kCompressedHeaderSize; ++i) {
+    size |= static_cast<size_t>(static_cast<unsigned char>(decoded[i]))
+            << (8 * i);
+  }
+  string serialized(size, '\0');
+  uLongf serialized_size(size);
+  if (uncompress(reinterpret_cast<Bytef*>(&serialized[0]), &serialized_size,
+                 reinterpret_cast<const Bytef*>(decoded.data() +
+                                                kCompressedHeaderSize),
+                 decoded.size() - kCompressedHeaderSize) != Z_OK ||
+      serialized_size != size) {
+    LOG(ERROR) << "Corrupt compressed etcd value";
+    return string();
+  }
+  return serialized;
+}
+
+
 // TODO(pphaneuf): Hmm, I think this should check that it's not just
 // ordered, but contiguous?
 void CheckMappingIsOrdered(const SequenceMapping& mapping) {
@@ -104,6 +262,12 @@ StatusOr<int64_t> GetStat(const map<string, int64_t>& stats,
 
 
 StatusOr<int64_t> CalculateNumEtcdEntries(const map<string, int64_t>& stats) {
+  // Counted directly, with etcd v3.
+  const auto keys(stats.find("keys"));
+  if (keys != stats.end()) {
+    return keys->second;
+  }
+
   StatusOr<int64_t> created(GetStat(stats, "createSuccess"));
   if (!created.ok()) {
     return created;
@@ -144,9 +308,24 @@ EtcdConsistentStore::EtcdConsistentStore(
       serving_sth_watch_task_(CHECK_NOTNULL(executor)),
       cluster_config_watch_task_(CHECK_NOTNULL(executor)),
       etcd_stats_task_(executor_),
+      pending_entries_watch_task_(executor_),
       received_initial_sth_(false),
       exiting_(false),
-      num_etcd_entries_(0) {
+      num_etcd_entries_(0),
+      cleaned_up_to_(-1),
+      reject_rng_(std::random_device()()),
+      pending_entries_sync_index_(-1),
+      num_pending_entries_added_(0),
+      load_chain_cert_([this](const string& hash, string* cert) {
+        return LoadChainCert(hash, cert);
+      }),
+      sequence_mapping_index_(-1),
+      sequence_mapping_migrated_(false) {
+  CHECK_GE(FLAGS_etcd_reject_ramp_fraction, 0);
+  CHECK_LE(FLAGS_etcd_reject_ramp_fraction, 1);
+  CHECK_LE(0, FLAGS_etcd_entries_shard_prefix_length);
+  CHECK_GE(2, FLAGS_etcd_entries_shard_prefix_length);
+
   // Set up watches on things we're interested in...
   WatchServingSTH(bind(&EtcdConsistentStore::OnEtcdServingSTHUpdated, this,
                        _1),
@@ -154,8 +333,16 @@ EtcdConsistentStore::EtcdConsistentStore(
   WatchClusterConfig(bind(&EtcdConsistentStore::OnClusterConfigUpdated, this,
                           _1),
                      cluster_config_watch_task_.task());
+  client_->Watch(GetFullPath(kEntriesDir),
+                 bind(&EtcdConsistentStore::OnEtcdPendingEntriesUpdated, this,
+                      _1),
+                 pending_entries_watch_task_.task());
 
-  StartEtcdStatsFetch();
+  if (FLAGS_etcd_stats_collection_interval_seconds > 0) {
+    StartEtcdStatsFetch();
+  } else {
+    etcd_stats_task_.task()->Return();
+  }
 
   // And wait for the initial updates to come back so that we've got a
   // view on the current state before proceding...
@@ -170,9 +357,11 @@ EtcdConsistentStore::~EtcdConsistentStore() {
   VLOG(1) << "Cancelling watch tasks.";
   serving_sth_watch_task_.Cancel();
   cluster_config_watch_task_.Cancel();
+  pending_entries_watch_task_.Cancel();
   VLOG(1) << "Waiting for watch tasks to return.";
   serving_sth_watch_task_.Wait();
   cluster_config_watch_task_.Wait();
+  pending_entries_watch_task_.Wait();
   VLOG(1) << "Cancelling stats task.";
   etcd_stats_task_.Cancel();
   etcd_stats_task_.Wait();
@@ -306,35 +495,164 @@ Status EtcdConsistentStore::AddPendingEntry(LoggedEntry* entry) {
   ScopedLatency scoped_latency(
       etcd_latency_by_op_ms.GetScopedLatency("add_pending_entry"));
 
+  SyncTask task(executor_);
+  AddPendingEntry(entry, task.task());
+  task.Wait();
+  return task.status();
+}
+
+
+void EtcdConsistentStore::AddPendingEntry(LoggedEntry* entry, Task* task) {
+  CHECK_NOTNULL(task);
+
+  const Status status(MaybeReject("add_pending_entry"));
+  if (!status.ok()) {
+    task->Return(status);
+    return;
+  }
+
+  CreatePendingEntry(entry, task);
+}
+
+
+vector<Status> EtcdConsistentStore::AddPendingEntries(
+    const vector<LoggedEntry*>& entries) {
+  ScopedLatency scoped_latency(
+      etcd_latency_by_op_ms.GetScopedLatency("add_pending_entries"));
+
+  const Status reject_status(MaybeReject("add_pending_entry"));
+  if (!reject_status.ok()) {
+    return vector<Status>(entries.size(), reject_status);
+  }
+
+  // Send all the requests as child tasks of a single task, so that
+  // the calling thread only blocks once, until they are all done.
+  vector<Status> statuses(entries.size());
+  SyncTask task(executor_);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    Status* const create_status(&statuses[i]);
+    CreatePendingEntry(entries[i],
+                       task.task()->AddChild([create_status](Task* child_task) {
+                         *create_status = child_task->status();
+                       }));
+  }
+  task.task()->Return();
+  task.Wait();
+
+  return statuses;
+}
+
+
+void EtcdConsistentStore::CreatePendingEntry(LoggedEntry* entry, Task* task) {
   CHECK_NOTNULL(entry);
+  CHECK_NOTNULL(task);
   CHECK(!entry->has_sequence_number());
 
-  Status status(MaybeReject("add_pending_entry"));
-  if (!status.ok()) {
-    return status;
+  EntryHandle<LoggedEntry>* const handle(
+      new EntryHandle<LoggedEntry>(GetEntryPath(*entry), *entry));
+  task->DeleteWhenDone(handle);
+  map<string, string>* const chain_certs(new map<string, string>);
+  task->DeleteWhenDone(chain_certs);
+  // Only the certificates this node has not seen in etcd yet are
+  // written (the others are not even looked up), before the entry
+  // referencing them.
+  if (!FLAGS_etcd_deduplicate_chain_certs ||
+      !chain_certs_.ReplaceChain(
+          [](const string&, string*) { return false; }, *entry,
+          handle->MutableEntry(), chain_certs) ||
+      chain_certs->empty()) {
+    WritePendingEntry(handle, entry, task);
+    return;
   }
 
-  const string full_path(GetEntryPath(*entry));
-  EntryHandle<LoggedEntry> handle(full_path, *entry);
-  status = CreateEntry(&handle);
-  if (status.CanonicalCode() == util::error::FAILED_PRECONDITION) {
-    // Entry with that hash already exists.
-    EntryHandle<LoggedEntry> preexisting_entry;
-    status = GetEntry(full_path, &preexisting_entry);
-    if (!status.ok()) {
-      LOG(ERROR) << "Couldn't create or fetch " << full_path << " : "
-                 << status;
-      return status;
+  TaskSequence(task)
+      .Then([this, chain_certs](Task* step) {
+        StoreChainCerts(*chain_certs, step);
+      })
+      .Then([this, handle, entry, chain_certs](Task* step) {
+        chain_certs_.Stored(*chain_certs);
+        WritePendingEntry(handle, entry, step);
+      })
+      .Run();
+}
+
+
+void EtcdConsistentStore::WritePendingEntry(EntryHandle<LoggedEntry>* handle,
+                                            LoggedEntry* entry, Task* task) {
+  const string full_path(handle->Key());
+  // Counted by MaybeReject() until the watch brings it into
+  // |pending_entries_|.
+  {
+    lock_guard<mutex> lock(pending_entries_mutex_);
+    adding_entries_.insert(full_path);
+  }
+  CreateEntry(handle, task->AddChild([this, full_path, entry,
+                                      task](Task* child_task) {
+    if (!child_task->status().ok()) {
+      // Not added by us, after all.
+      lock_guard<mutex> lock(pending_entries_mutex_);
+      adding_entries_.erase(full_path);
     }
+    if (child_task->status().CanonicalCode() ==
+        util::error::FAILED_PRECONDITION) {
+      ResolveExistingPendingEntry(full_path, entry, task);
+      return;
+    }
+    task->Return(child_task->status());
+  }));
+}
 
-    // Check the leaf certs are the same (we might be seeing the same cert
-    // submitted with a different chain.)
-    CHECK(LeafEntriesMatch(preexisting_entry.Entry(), *entry));
-    *entry->mutable_sct() = preexisting_entry.Entry().sct();
-    return Status(util::error::ALREADY_EXISTS,
-                  "Pending entry already exists.");
+
+void EtcdConsistentStore::StoreChainCerts(const map<string, string>& certs,
+                                          Task* task) {
+  CHECK(!certs.empty());
+  std::atomic<size_t>* const remaining(
+      new std::atomic<size_t>(certs.size()));
+  task->DeleteWhenDone(remaining);
+  for (const auto& cert : certs) {
+    EtcdClient::Response* const resp(new EtcdClient::Response);
+    task->DeleteWhenDone(resp);
+    client_->Create(GetChainCertPath(cert.first), EncodeValue(cert.second),
+                    resp, task->AddChild([remaining, task](Task* child_task) {
+                      // Written by another node already, which is as
+                      // good, since the keys are the hashes.
+                      if (!child_task->status().ok() &&
+                          child_task->status().CanonicalCode() !=
+                              util::error::FAILED_PRECONDITION) {
+                        task->Return(child_task->status());
+                      } else if (--*remaining == 0) {
+                        task->Return();
+                      }
+                    }));
   }
-  return status;
+}
+
+
+bool EtcdConsistentStore::LoadChainCert(const string& hash,
+                                        string* cert) const {
+  ScopedLatency scoped_latency(
+      etcd_latency_by_op_ms.GetScopedLatency("load_chain_cert"));
+
+  SyncTask task(executor_);
+  EtcdClient::GetResponse resp;
+  client_->Get(GetChainCertPath(hash), &resp, task.task());
+  task.Wait();
+  if (!task.status().ok()) {
+    LOG(WARNING) << "Couldn't read chain certificate "
+                 << util::HexString(hash) << ": " << task.status();
+    return false;
+  }
+  *cert = DecodeValue(resp.node.value_);
+  return !cert->empty();
+}
+
+
+Status EtcdConsistentStore::RestoreChainCerts(LoggedEntry* entry) const {
+  if (!chain_certs_.Restore(load_chain_cert_, entry)) {
+    return Status(util::error::UNAVAILABLE,
+                  "Couldn't read the chain certificates of a pending entry.");
+  }
+  return Status::OK;
 }
 
 
@@ -346,6 +664,7 @@ Status EtcdConsistentStore::GetPendingEntryForHash(
   Status status(GetEntry(GetEntryPath(hash), entry));
   if (status.ok()) {
     CHECK(!entry->Entry().has_sequence_number());
+    status = RestoreChainCerts(entry->MutableEntry());
   }
 
   return status;
@@ -357,10 +676,28 @@ Status EtcdConsistentStore::GetPendingEntries(
   ScopedLatency scoped_latency(
       etcd_latency_by_op_ms.GetScopedLatency("get_pending_entries"));
 
-  Status status(GetAllEntriesInDir(GetFullPath(kEntriesDir), entries));
+  Status status;
+  if (SyncPendingEntries()) {
+    CHECK_NOTNULL(entries);
+    CHECK_EQ(static_cast<size_t>(0), entries->size());
+    lock_guard<mutex> lock(pending_entries_mutex_);
+    entries->reserve(pending_entries_.size());
+    for (const auto& entry : pending_entries_) {
+      entries->push_back(entry.second);
+    }
+  } else {
+    LOG(WARNING) << "Local pending entries are lagging behind, fetching "
+                 << "them from etcd.";
+    status = GetAllPendingEntries(entries);
+  }
   if (status.ok()) {
-    for (const auto& entry : *entries) {
+    for (auto& entry : *entries) {
       CHECK(!entry.Entry().has_sequence_number());
+      // The hot intermediates come from |chain_certs_|.
+      status = RestoreChainCerts(entry.MutableEntry());
+      if (!status.ok()) {
+        break;
+      }
     }
   }
   etcd_total_entries->Set("entries", entries->size());
@@ -368,19 +705,79 @@ Status EtcdConsistentStore::GetPendingEntries(
 }
 
 
+int64_t EtcdConsistentStore::NumPendingEntriesAdded() const {
+  lock_guard<mutex> lock(pending_entries_mutex_);
+  return num_pending_entries_added_;
+}
+
+
+void EtcdConsistentStore::WaitForPendingEntriesAdded(
+    int64_t count, const steady_clock::time_point& deadline) const {
+  unique_lock<mutex> lock(pending_entries_mutex_);
+  pending_entries_cv_.wait_until(lock, deadline, [this, count]() {
+    return num_pending_entries_added_ >= count;
+  });
+}
+
+
 Status EtcdConsistentStore::GetSequenceMapping(
     EntryHandle<SequenceMapping>* sequence_mapping) const {
   ScopedLatency scoped_latency(
       etcd_latency_by_op_ms.GetScopedLatency("get_sequence_mapping"));
 
-  Status status(GetEntry(GetFullPath(kSequenceFile), sequence_mapping));
-  if (!status.ok()) {
-    return status;
+  CHECK_NOTNULL(sequence_mapping);
+  {
+    lock_guard<mutex> lock(sequence_mapping_mutex_);
+    if (!sequence_mapping_migrated_) {
+      const Status status(MigrateLegacySequenceMapping());
+      if (!status.ok()) {
+        return status;
+      }
+      sequence_mapping_migrated_ = true;
+    }
   }
-  CheckMappingIsOrdered(sequence_mapping->Entry());
-  CheckMappingIsContiguousWithServingTree(sequence_mapping->Entry());
-  etcd_total_entries->Set("sequenced",
-                          sequence_mapping->Entry().mapping_size());
+
+  const string dir(GetFullPath(kSequenceMappingDir));
+  SyncTask task(executor_);
+  EtcdClient::GetResponse resp;
+  client_->Get(dir, &resp, task.task());
+  task.Wait();
+  if (task.status().CanonicalCode() == util::error::NOT_FOUND) {
+    VLOG(1) << "No sequence mapping yet, treating it as empty.";
+  } else if (!task.status().ok()) {
+    return task.status();
+  } else if (!resp.node.is_dir_) {
+    return Status(util::error::FAILED_PRECONDITION,
+                  "node is not a directory: " + dir);
+  }
+
+  // The chunk keys sort in the order of their sequence numbers.
+  map<string, pair<int64_t, string>> chunks;
+  for (const auto& node : resp.node.nodes_) {
+    chunks[node.key_] = make_pair(node.modified_index_, node.value_);
+  }
+  SequenceMapping mapping;
+  for (const auto& chunk : chunks) {
+    SequenceMapping chunk_mapping;
+    CHECK(chunk_mapping.ParseFromString(DecodeValue(chunk.second.second)))
+        << chunk.first;
+    mapping.mutable_mapping()->MergeFrom(chunk_mapping.mapping());
+  }
+  CheckMappingIsOrdered(mapping);
+  CheckMappingIsContiguousWithServingTree(mapping);
+
+  {
+    lock_guard<mutex> lock(sequence_mapping_mutex_);
+    // Don't go back to an older view, if an update finished while we
+    // were reading.
+    if (resp.etcd_index >= sequence_mapping_index_) {
+      sequence_mapping_chunks_.swap(chunks);
+      sequence_mapping_index_ = resp.etcd_index;
+    }
+  }
+
+  sequence_mapping->Set(dir, mapping, resp.etcd_index);
+  etcd_total_entries->Set("sequenced", mapping.mapping_size());
   return Status::OK;
 }
 
@@ -393,7 +790,75 @@ Status EtcdConsistentStore::UpdateSequenceMapping(
   CHECK(entry->HasHandle());
   CheckMappingIsOrdered(entry->Entry());
   CheckMappingIsContiguousWithServingTree(entry->Entry());
-  return UpdateEntry(entry);
+
+  const map<string, string> new_chunks(
+      EncodeSequenceMappingChunks(entry->Entry()));
+
+  lock_guard<mutex> lock(sequence_mapping_mutex_);
+  CHECK(sequence_mapping_migrated_) << "mapping was not read first?";
+  for (const auto& chunk : sequence_mapping_chunks_) {
+    if (chunk.second.first > entry->Handle()) {
+      return Status(util::error::FAILED_PRECONDITION,
+                    "Sequence mapping changed since it was read: " +
+                        chunk.first);
+    }
+  }
+
+  // Only the chunks which changed are written, in a single
+  // transaction, which is atomic with etcd v3. Otherwise, they are
+  // written in order: mappings are only removed below the serving
+  // tree and added at the end, so if we fail part of the way, etcd is
+  // still left with a valid mapping.
+  vector<EtcdClient::TxnOp> ops;
+  auto old_it(sequence_mapping_chunks_.begin());
+  auto new_it(new_chunks.begin());
+  while (old_it != sequence_mapping_chunks_.end() ||
+         new_it != new_chunks.end()) {
+    if (new_it == new_chunks.end() ||
+        (old_it != sequence_mapping_chunks_.end() &&
+         old_it->first < new_it->first)) {
+      // All the mappings in this chunk are gone.
+      ops.emplace_back(EtcdClient::TxnOp::Type::DELETE, old_it->first, "",
+                       old_it->second.first);
+      ++old_it;
+      continue;
+    }
+
+    if (old_it != sequence_mapping_chunks_.end() &&
+        old_it->first == new_it->first) {
+      if (old_it->second.second != new_it->second) {
+        ops.emplace_back(EtcdClient::TxnOp::Type::UPDATE, new_it->first,
+                         new_it->second, old_it->second.first);
+      }
+      ++old_it;
+    } else {
+      ops.emplace_back(EtcdClient::TxnOp::Type::CREATE, new_it->first,
+                       new_it->second, -1);
+    }
+    ++new_it;
+  }
+
+  SyncTask task(executor_);
+  EtcdClient::TxnResponse resp;
+  client_->Txn(ops, &resp, task.task());
+  task.Wait();
+  int64_t index(entry->Handle());
+  for (size_t i = 0; i < resp.num_applied; ++i) {
+    if (ops[i].type == EtcdClient::TxnOp::Type::DELETE) {
+      sequence_mapping_chunks_.erase(ops[i].key);
+    } else {
+      sequence_mapping_chunks_[ops[i].key] =
+          make_pair(resp.indices[i], ops[i].value);
+      index = max(index, resp.indices[i]);
+    }
+  }
+  if (!task.status().ok()) {
+    return task.status();
+  }
+
+  sequence_mapping_index_ = max(sequence_mapping_index_, index);
+  entry->SetHandle(index);
+  return Status::OK;
 }
 
 
@@ -425,6 +890,20 @@ Status EtcdConsistentStore::SetClusterNodeState(
 }
 
 
+Status EtcdConsistentStore::RefreshClusterNodeState() {
+  ScopedLatency scoped_latency(
+      etcd_latency_by_op_ms.GetScopedLatency("refresh_cluster_node_state"));
+
+  SyncTask task(executor_);
+  EtcdClient::Response resp;
+  client_->RefreshTTL(GetNodePath(node_id_),
+                      seconds(FLAGS_node_state_ttl_seconds), &resp,
+                      task.task());
+  task.Wait();
+  return task.status();
+}
+
+
 // static
 template <class T, class CB>
 void EtcdConsistentStore::ConvertSingleUpdate(
@@ -502,46 +981,120 @@ Status EtcdConsistentStore::GetEntry(const string& path,
   ScopedLatency scoped_latency(
       etcd_latency_by_op_ms.GetScopedLatency("get_entry"));
 
-  CHECK_NOTNULL(entry);
   SyncTask task(executor_);
-  EtcdClient::GetResponse resp;
-  client_->Get(path, &resp, task.task());
+  GetEntry(path, entry, task.task());
   task.Wait();
-  if (!task.status().ok()) {
-    return task.status();
-  }
-  T t;
-  CHECK(t.ParseFromString(FromBase64(resp.node.value_.c_str())));
-  entry->Set(path, t, resp.node.modified_index_);
-  return Status::OK;
+  return task.status();
 }
 
 
-Status EtcdConsistentStore::GetAllEntriesInDir(
-    const string& dir, vector<EntryHandle<LoggedEntry>>* entries) const {
+template <class T>
+void EtcdConsistentStore::GetEntry(const string& path, EntryHandle<T>* entry,
+                                   Task* task) const {
+  CHECK_NOTNULL(entry);
+  CHECK_NOTNULL(task);
+  EtcdClient::GetResponse* const resp(new EtcdClient::GetResponse);
+  task->DeleteWhenDone(resp);
+  TaskSequence(task)
+      .Then([this, path, resp](Task* step) {
+        client_->Get(path, resp, step);
+      })
+      .Then([path, entry, resp](Task* step) {
+        T t;
+        CHECK(t.ParseFromString(DecodeValue(resp->node.value_)));
+        entry->Set(path, t, resp->node.modified_index_);
+        step->Return();
+      })
+      .Run();
+}
+
+
+Status EtcdConsistentStore::GetAllPendingEntries(
+    vector<EntryHandle<LoggedEntry>>* entries) const {
   ScopedLatency scoped_latency(
-      etcd_latency_by_op_ms.GetScopedLatency("get_all_entries_in_dir"));
+      etcd_latency_by_op_ms.GetScopedLatency("get_all_pending_entries"));
 
   CHECK_NOTNULL(entries);
   CHECK_EQ(static_cast<size_t>(0), entries->size());
+  const vector<string> dirs(GetEntriesShardPaths());
+  const bool sharded(dirs.size() > 1);
+
+  // Send all the requests as child tasks of a single task, so that
+  // the calling thread only blocks once, until they are all done.
+  vector<EtcdClient::GetResponse> resps(dirs.size());
+  vector<Status> statuses(dirs.size());
   SyncTask task(executor_);
-  EtcdClient::GetResponse resp;
-  client_->Get(dir, &resp, task.task());
-  task.Wait();
-  if (!task.status().ok()) {
-    return task.status();
+  for (size_t i = 0; i < dirs.size(); ++i) {
+    Status* const get_status(&statuses[i]);
+    client_->Get(dirs[i], &resps[i],
+                 task.task()->AddChild([get_status](Task* child_task) {
+                   *get_status = child_task->status();
+                 }));
   }
-  if (!resp.node.is_dir_) {
-    return Status(util::error::FAILED_PRECONDITION,
-                  "node is not a directory: " + dir);
+  task.task()->Return();
+  task.Wait();
+
+  Status status;
+  for (size_t i = 0; i < dirs.size(); ++i) {
+    if (!status.ok()) {
+      break;
+    }
+    if (sharded && statuses[i].CanonicalCode() == util::error::NOT_FOUND) {
+      // Shards only get created with their first entry.
+      continue;
+    }
+    if (!statuses[i].ok()) {
+      status = statuses[i];
+    } else if (!resps[i].node.is_dir_) {
+      status = Status(util::error::FAILED_PRECONDITION,
+                      "node is not a directory: " + dirs[i]);
+    } else {
+      AppendEntriesInDir(resps[i].node, entries);
+    }
   }
-  for (const auto& node : resp.node.nodes_) {
+  return status;
+}
+
+
+void EtcdConsistentStore::AppendEntriesInDir(
+    const EtcdClient::Node& dir,
+    vector<EntryHandle<LoggedEntry>>* entries) const {
+  const string sync_path(GetPendingEntriesSyncPath());
+  for (const auto& node : dir.nodes_) {
+    if (node.key_ == sync_path || node.is_dir_) {
+      continue;
+    }
     LoggedEntry entry;
-    CHECK(entry.ParseFromString(FromBase64(node.value_.c_str())));
+    CHECK(entry.ParseFromString(DecodeValue(node.value_)));
     entries->emplace_back(
         EntryHandle<LoggedEntry>(node.key_, entry, node.modified_index_));
   }
-  return Status::OK;
+}
+
+
+bool EtcdConsistentStore::SyncPendingEntries() const {
+  ScopedLatency scoped_latency(
+      etcd_latency_by_op_ms.GetScopedLatency("sync_pending_entries"));
+
+  // Etcd delivers the changes to a watched directory in order, so once
+  // the watch has seen this write, it has also seen every change to the
+  // entries made before it.
+  SyncTask task(executor_);
+  EtcdClient::Response resp;
+  client_->ForceSet(GetPendingEntriesSyncPath(), "", &resp, task.task());
+  task.Wait();
+  if (!task.status().ok()) {
+    LOG(WARNING) << "Couldn't write " << GetPendingEntriesSyncPath() << ": "
+                 << task.status();
+    return false;
+  }
+
+  unique_lock<mutex> lock(pending_entries_mutex_);
+  return pending_entries_cv_.wait_for(
+      lock, seconds(FLAGS_etcd_pending_entries_sync_timeout_seconds),
+      [this, &resp]() {
+        return pending_entries_sync_index_ >= resp.etcd_index;
+      });
 }
 
 
@@ -549,20 +1102,22 @@ Status EtcdConsistentStore::UpdateEntry(EntryHandleBase* t) {
   ScopedLatency scoped_latency(
       etcd_latency_by_op_ms.GetScopedLatency("update_entry"));
 
+  SyncTask task(executor_);
+  UpdateEntry(t, task.task());
+  task.Wait();
+  return task.status();
+}
+
+
+void EtcdConsistentStore::UpdateEntry(EntryHandleBase* t, Task* task) {
   CHECK_NOTNULL(t);
   CHECK(t->HasHandle());
   CHECK(t->HasKey());
   string flat_entry;
   CHECK(t->SerializeToString(&flat_entry));
-  SyncTask task(executor_);
-  EtcdClient::Response resp;
-  client_->Update(t->Key(), ToBase64(flat_entry), t->Handle(), &resp,
-                  task.task());
-  task.Wait();
-  if (task.status().ok()) {
-    t->SetHandle(resp.etcd_index);
-  }
-  return task.status();
+  EtcdClient::Response* const resp(new EtcdClient::Response);
+  client_->Update(t->Key(), EncodeValue(flat_entry), t->Handle(), resp,
+                  AddEntryWriteTask(t, resp, task));
 }
 
 
@@ -570,19 +1125,22 @@ Status EtcdConsistentStore::CreateEntry(EntryHandleBase* t) {
   ScopedLatency scoped_latency(
       etcd_latency_by_op_ms.GetScopedLatency("create_entry"));
 
+  SyncTask task(executor_);
+  CreateEntry(t, task.task());
+  task.Wait();
+  return task.status();
+}
+
+
+void EtcdConsistentStore::CreateEntry(EntryHandleBase* t, Task* task) {
   CHECK_NOTNULL(t);
   CHECK(!t->HasHandle());
   CHECK(t->HasKey());
   string flat_entry;
   CHECK(t->SerializeToString(&flat_entry));
-  SyncTask task(executor_);
-  EtcdClient::Response resp;
-  client_->Create(t->Key(), ToBase64(flat_entry), &resp, task.task());
-  task.Wait();
-  if (task.status().ok()) {
-    t->SetHandle(resp.etcd_index);
-  }
-  return task.status();
+  EtcdClient::Response* const resp(new EtcdClient::Response);
+  client_->Create(t->Key(), EncodeValue(flat_entry), resp,
+                  AddEntryWriteTask(t, resp, task));
 }
 
 
@@ -590,6 +1148,14 @@ Status EtcdConsistentStore::ForceSetEntry(EntryHandleBase* t) {
   ScopedLatency scoped_latency(
       etcd_latency_by_op_ms.GetScopedLatency("force_set_entry"));
 
+  SyncTask task(executor_);
+  ForceSetEntry(t, task.task());
+  task.Wait();
+  return task.status();
+}
+
+
+void EtcdConsistentStore::ForceSetEntry(EntryHandleBase* t, Task* task) {
   CHECK_NOTNULL(t);
   CHECK(t->HasKey());
   // For now we check that |t| wasn't fetched from the etcd store (i.e. it's a
@@ -599,14 +1165,23 @@ Status EtcdConsistentStore::ForceSetEntry(EntryHandleBase* t) {
   CHECK(!t->HasHandle());
   string flat_entry;
   CHECK(t->SerializeToString(&flat_entry));
-  SyncTask task(executor_);
-  EtcdClient::Response resp;
-  client_->ForceSet(t->Key(), ToBase64(flat_entry), &resp, task.task());
-  task.Wait();
-  if (task.status().ok()) {
-    t->SetHandle(resp.etcd_index);
-  }
-  return task.status();
+  EtcdClient::Response* const resp(new EtcdClient::Response);
+  client_->ForceSet(t->Key(), EncodeValue(flat_entry), resp,
+                    AddEntryWriteTask(t, resp, task));
+}
+
+
+Task* EtcdConsistentStore::AddEntryWriteTask(EntryHandleBase* t,
+                                             EtcdClient::Response* resp,
+                                             Task* task) const {
+  CHECK_NOTNULL(task);
+  task->DeleteWhenDone(resp);
+  return task->AddChild([t, resp, task](Task* child_task) {
+    if (child_task->status().ok()) {
+      t->SetHandle(resp->etcd_index);
+    }
+    task->Return(child_task->status());
+  });
 }
 
 
@@ -627,7 +1202,7 @@ Status EtcdConsistentStore::ForceSetEntryWithTTL(const seconds& ttl,
   CHECK(t->SerializeToString(&flat_entry));
   SyncTask task(executor_);
   EtcdClient::Response resp;
-  client_->ForceSetWithTTL(t->Key(), ToBase64(flat_entry), ttl, &resp,
+  client_->ForceSetWithTTL(t->Key(), EncodeValue(flat_entry), ttl, &resp,
                            task.task());
   task.Wait();
   if (task.status().ok()) {
@@ -650,13 +1225,65 @@ Status EtcdConsistentStore::DeleteEntry(const EntryHandleBase& entry) {
 }
 
 
+void EtcdConsistentStore::ResolveExistingPendingEntry(const string& full_path,
+                                                      LoggedEntry* entry,
+                                                      Task* task) const {
+  EntryHandle<LoggedEntry>* const preexisting_entry(
+      new EntryHandle<LoggedEntry>);
+  task->DeleteWhenDone(preexisting_entry);
+  GetEntry(full_path, preexisting_entry,
+           task->AddChild([full_path, entry, preexisting_entry,
+                           task](Task* child_task) {
+             if (!child_task->status().ok()) {
+               LOG(ERROR) << "Couldn't create or fetch " << full_path
+                          << " : " << child_task->status();
+               task->Return(child_task->status());
+               return;
+             }
+
+             // Check the leaf certs are the same (we might be seeing the
+             // same cert submitted with a different chain.)
+             CHECK(LeafEntriesMatch(preexisting_entry->Entry(), *entry));
+             *entry->mutable_sct() = preexisting_entry->Entry().sct();
+             task->Return(Status(util::error::ALREADY_EXISTS,
+                                 "Pending entry already exists."));
+           }));
+}
+
+
 string EtcdConsistentStore::GetEntryPath(const LoggedEntry& entry) const {
   return GetEntryPath(entry.Hash());
 }
 
 
 string EtcdConsistentStore::GetEntryPath(const string& hash) const {
-  return GetFullPath(string(kEntriesDir) + util::HexString(hash));
+  const string hex_hash(util::HexString(hash));
+  if (FLAGS_etcd_entries_shard_prefix_length == 0) {
+    return GetFullPath(string(kEntriesDir) + hex_hash);
+  }
+  const string shard(
+      hex_hash.substr(0, FLAGS_etcd_entries_shard_prefix_length));
+  return GetFullPath(string(kEntriesDir) + shard + "/" + hex_hash);
+}
+
+
+vector<string> EtcdConsistentStore::GetEntriesShardPaths() const {
+  vector<string> prefixes{""};
+  for (int i = 0; i < FLAGS_etcd_entries_shard_prefix_length; ++i) {
+    vector<string> longer_prefixes;
+    for (const string& prefix : prefixes) {
+      for (const char* digit = kHexDigits; *digit; ++digit) {
+        longer_prefixes.emplace_back(prefix + *digit);
+      }
+    }
+    prefixes.swap(longer_prefixes);
+  }
+
+  vector<string> paths;
+  for (const string& prefix : prefixes) {
+    paths.emplace_back(GetFullPath(string(kEntriesDir) + prefix));
+  }
+  return paths;
 }
 
 
@@ -665,6 +1292,126 @@ string EtcdConsistentStore::GetNodePath(const string& id) const {
 }
 
 
+string EtcdConsistentStore::GetChainCertPath(const string& hash) const {
+  return GetFullPath(string(kChainCertsDir) + util::HexString(hash));
+}
+
+
+string EtcdConsistentStore::GetSequenceMappingChunkPath(
+    int64_t first_sequence_number) const {
+  CHECK_LE(0, first_sequence_number);
+  // Padded, so that the keys sort in the same order as the numbers.
+  ostringstream key;
+  key << kSequenceMappingDir << setfill('0') << setw(20)
+      << first_sequence_number;
+  return GetFullPath(key.str());
+}
+
+
+map<string, string> EtcdConsistentStore::EncodeSequenceMappingChunks(
+    const SequenceMapping& mapping) const {
+  map<int64_t, SequenceMapping> chunk_mappings;
+  for (const auto& m : mapping.mapping()) {
+    CHECK_LE(0, m.sequence_number());
+    *chunk_mappings[m.sequence_number() / kSequenceMappingChunkSize]
+         .add_mapping() = m;
+  }
+  map<string, string> chunks;
+  for (const auto& chunk : chunk_mappings) {
+    string flat_chunk;
+    CHECK(chunk.second.SerializeToString(&flat_chunk));
+    chunks[GetSequenceMappingChunkPath(
+        chunk.first * kSequenceMappingChunkSize)] = EncodeValue(flat_chunk);
+  }
+  return chunks;
+}
+
+
+Status EtcdConsistentStore::MigrateLegacySequenceMapping() const {
+  // Listed before looking at the legacy file: as long as that is
+  // there, nobody uses the chunks, so if one changes after this, it can
+  // only be another node migrating at the same time, which the
+  // compare-and-sets below catch.
+  const string dir(GetFullPath(kSequenceMappingDir));
+  EtcdClient::GetResponse dir_resp;
+  {
+    SyncTask task(executor_);
+    client_->Get(dir, &dir_resp, task.task());
+    task.Wait();
+    if (!task.status().ok() &&
+        task.status().CanonicalCode() != util::error::NOT_FOUND) {
+      return task.status();
+    }
+  }
+
+  const string legacy_file(GetFullPath(kLegacySequenceMappingFile));
+  EtcdClient::GetResponse legacy_resp;
+  {
+    SyncTask task(executor_);
+    client_->Get(legacy_file, &legacy_resp, task.task());
+    task.Wait();
+    if (task.status().CanonicalCode() == util::error::NOT_FOUND) {
+      return Status::OK;
+    } else if (!task.status().ok()) {
+      return task.status();
+    }
+  }
+  SequenceMapping mapping;
+  CHECK(mapping.ParseFromString(DecodeValue(legacy_resp.node.value_)))
+      << legacy_file;
+  CheckMappingIsOrdered(mapping);
+  LOG(INFO) << "Moving " << mapping.mapping_size()
+            << " sequence mappings from " << legacy_file << " to " << dir;
+
+  // Chunks already there were left by an earlier attempt which did
+  // not get to the end, and are overwritten or deleted.
+  map<string, int64_t> old_chunks;
+  for (const auto& node : dir_resp.node.nodes_) {
+    old_chunks[node.key_] = node.modified_index_;
+  }
+  for (const auto& chunk : EncodeSequenceMappingChunks(mapping)) {
+    SyncTask task(executor_);
+    EtcdClient::Response resp;
+    const auto it(old_chunks.find(chunk.first));
+    if (it == old_chunks.end()) {
+      client_->Create(chunk.first, chunk.second, &resp, task.task());
+    } else {
+      client_->Update(chunk.first, chunk.second, it->second, &resp,
+                      task.task());
+      old_chunks.erase(it);
+    }
+    task.Wait();
+    if (!task.status().ok()) {
+      return task.status();
+    }
+  }
+  for (const auto& chunk : old_chunks) {
+    SyncTask task(executor_);
+    client_->Delete(chunk.first, chunk.second, task.task());
+    task.Wait();
+    if (!task.status().ok()) {
+      return task.status();
+    }
+  }
+
+  // From here on, the chunks are the sequence mapping.
+  SyncTask task(executor_);
+  client_->Delete(legacy_file, legacy_resp.node.modified_index_,
+                  task.task());
+  task.Wait();
+  if (task.status().CanonicalCode() == util::error::NOT_FOUND) {
+    // Another node got there first, with the same mapping.
+    return Status::OK;
+  }
+  return task.status();
+}
+
+
+string EtcdConsistentStore::GetPendingEntriesSyncPath() const {
+  return GetFullPath(string(kEntriesDir) + kEntriesSyncFile);
+}
+
+
 string EtcdConsistentStore::GetFullPath(const string& key) const {
   CHECK(key.size() > 0);
   CHECK_EQ('/', key[0]);
@@ -706,7 +1453,7 @@ void EtcdConsistentStore::CheckMappingIsContiguousWithServingTree(
 template <class T>
 Update<T> EtcdConsistentStore::TypedUpdateFromNode(
     const EtcdClient::Node& node) {
-  const string raw_value(FromBase64(node.value_.c_str()));
+  const string raw_value(DecodeValue(node.value_));
   T thing;
   CHECK(thing.ParseFromString(raw_value)) << raw_value;
   EntryHandle<T> handle(node.key_, thing);
@@ -762,6 +1509,54 @@ void EtcdConsistentStore::OnClusterConfigUpdated(
 }
 
 
+void EtcdConsistentStore::OnEtcdPendingEntriesUpdated(
+    const vector<EtcdClient::Node>& updates) {
+  const string sync_path(GetPendingEntriesSyncPath());
+  int64_t sync_index(-1);
+  // Parse the entries before taking the lock.
+  vector<Update<LoggedEntry>> changes;
+  for (const auto& node : updates) {
+    if (node.key_ == sync_path) {
+      if (!node.deleted_) {
+        sync_index = max(sync_index, node.modified_index_);
+      }
+    } else if (node.is_dir_) {
+      // The shards of the entries directory.
+      continue;
+    } else if (node.deleted_) {
+      // Deleted nodes have no value to parse.
+      EntryHandle<LoggedEntry> handle;
+      handle.SetKey(node.key_);
+      changes.emplace_back(handle, false /* exists */);
+    } else {
+      changes.emplace_back(TypedUpdateFromNode<LoggedEntry>(node));
+    }
+  }
+
+  {
+    lock_guard<mutex> lock(pending_entries_mutex_);
+    for (const auto& change : changes) {
+      adding_entries_.erase(change.handle_.Key());
+      if (change.exists_) {
+        const auto inserted(pending_entries_.insert(
+            make_pair(change.handle_.Key(), change.handle_)));
+        if (inserted.second) {
+          ++num_pending_entries_added_;
+        } else {
+          inserted.first->second = change.handle_;
+        }
+      } else {
+        pending_entries_.erase(change.handle_.Key());
+      }
+    }
+    pending_entries_sync_index_ =
+        max(pending_entries_sync_index_, sync_index);
+    etcd_total_entries->Set("pending", pending_entries_.size());
+  }
+  pending_entries_cv_.notify_all();
+}
+
+
 StatusOr<int64_t> EtcdConsistentStore::CleanupOldEntries() {
   ScopedLatency scoped_latency(
       etcd_latency_by_op_ms.GetScopedLatency("cleanup_old_entries"));
@@ -779,9 +1574,17 @@ StatusOr<int64_t> EtcdConsistentStore::CleanupOldEntries() {
   }
   const int64_t clean_up_to_sequence_number(serving_sth_->Entry().tree_size() -
                                             1);
+  // Where the previous runs got to.
+  const int64_t cleaned_up_to(cleaned_up_to_);
   lock.unlock();
 
-  LOG(INFO) << "Cleaning old entries up to and including sequence number: "
+  if (clean_up_to_sequence_number <= cleaned_up_to) {
+    VLOG(1) << "Already cleaned up to sequence number " << cleaned_up_to;
+    return 0;
+  }
+
+  LOG(INFO) << "Cleaning old entries after sequence number " << cleaned_up_to
+            << " up to and including sequence number: "
             << clean_up_to_sequence_number;
 
   EntryHandle<SequenceMapping> sequence_mapping;
@@ -791,15 +1594,25 @@ StatusOr<int64_t> EtcdConsistentStore::CleanupOldEntries() {
     return status;
   }
 
+  // Only do a batch at a time, so that progress is recorded as we go,
+  // the caller will call again until there is nothing left to do.
+  CHECK_LT(0, FLAGS_etcd_cleanup_batch_size);
   vector<string> keys_to_delete;
-  for (int mapping_index = 0;
-       mapping_index < sequence_mapping.Entry().mapping_size() &&
-       sequence_mapping.Entry().mapping(mapping_index).sequence_number() <=
-           clean_up_to_sequence_number;
-       ++mapping_index) {
+  int64_t batch_end(clean_up_to_sequence_number);
+  for (const auto& mapping : sequence_mapping.Entry().mapping()) {
+    if (mapping.sequence_number() <= cleaned_up_to) {
+      continue;
+    }
+    if (mapping.sequence_number() > clean_up_to_sequence_number) {
+      break;
+    }
+    if (keys_to_delete.size() >=
+        static_cast<size_t>(FLAGS_etcd_cleanup_batch_size)) {
+      batch_end = mapping.sequence_number() - 1;
+      break;
+    }
     // Delete the entry from /entries.
-    keys_to_delete.emplace_back(GetEntryPath(
-        sequence_mapping.Entry().mapping(mapping_index).entry_hash()));
+    keys_to_delete.emplace_back(GetEntryPath(mapping.entry_hash()));
   }
 
 
@@ -810,6 +1623,9 @@ StatusOr<int64_t> EtcdConsistentStore::CleanupOldEntries() {
   status = task.status();
   if (!status.ok()) {
     LOG(WARNING) << "EtcdDeleteKeys failed: " << task.status();
+  } else {
+    lock.lock();
+    cleaned_up_to_ = max(cleaned_up_to_, batch_end);
   }
   return num_entries_cleaned;
 }
@@ -857,26 +1673,44 @@ void EtcdConsistentStore::EtcdStatsFetchDone(
                    bind(&EtcdConsistentStore::StartEtcdStatsFetch, this)));
 }
 
+int64_t EtcdConsistentStore::NumPendingEntries() const {
+  lock_guard<mutex> lock(pending_entries_mutex_);
+  return pending_entries_.size() + adding_entries_.size();
+}
+
+
 // This method attempts to modulate the incoming traffic in response to the
-// number of entries currently in etcd.
+// number of entries currently in etcd, as seen by the watch on the
+// entries directory (rather than the etcd stats, which lag behind),
+// plus those on their way there from this node.
 //
-// Once the number of entries is above reject_threshold, we will start
-// returning a RESOURCE_EXHAUSTED status, which should result in a 503 being
-// sent to the client.
+// Past --etcd_reject_ramp_fraction of the reject threshold, we start
+// returning a RESOURCE_EXHAUSTED status, which should result in a 503
+// being sent to the client, to more and more of the requests, and to
+// all of them from the threshold on. Shedding some of the load early
+// lets the cluster settle below the threshold rather than swing
+// between accepting and rejecting everything.
 Status EtcdConsistentStore::MaybeReject(const string& type) const {
-  unique_lock<mutex> lock(mutex_);
+  const int64_t num_entries(NumPendingEntries());
 
+  lock_guard<mutex> lock(mutex_);
   if (!cluster_config_) {
     // No config, whatever.
     return Status::OK;
   }
 
-  const int64_t etcd_size(num_etcd_entries_);
-  const int64_t reject_threshold(
+  const double reject_threshold(
       cluster_config_->etcd_reject_add_pending_threshold());
-  lock.unlock();
+  const double ramp_start(reject_threshold * FLAGS_etcd_reject_ramp_fraction);
+  bool reject(num_entries >= reject_threshold);
+  if (!reject && num_entries > ramp_start) {
+    const double reject_probability((num_entries - ramp_start) /
+                                    (reject_threshold - ramp_start));
+    reject = std::uniform_real_distribution<double>()(reject_rng_) <
+             reject_probability;
+  }
 
-  if (etcd_size >= reject_threshold) {
+  if (reject) {
     etcd_rejected_requests->Increment(type);
     return Status(util::error::RESOURCE_EXHAUSTED,
                   "Rejected due to high number of pending entries.");
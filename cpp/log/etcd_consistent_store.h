@@ -2,11 +2,18 @@
 #define CERT_TRANS_LOG_ETCD_CONSISTENT_STORE_H_
 
 #include <stdint.h>
+#include <condition_variable>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <random>
+#include <string>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include "base/macros.h"
+#include "log/chain_cert_cache.h"
 #include "log/consistent_store.h"
 #include "log/logged_entry.h"
 #include "proto/ct.pb.h"
@@ -39,12 +46,25 @@ class EtcdConsistentStore : public ConsistentStore {
 
   util::Status AddPendingEntry(LoggedEntry* entry) override;
 
+  void AddPendingEntry(LoggedEntry* entry, util::Task* task) override;
+
+  // Writes all the entries to etcd concurrently.
+  std::vector<util::Status> AddPendingEntries(
+      const std::vector<LoggedEntry*>& entries) override;
+
   util::Status GetPendingEntryForHash(
       const std::string& hash, EntryHandle<LoggedEntry>* entry) const override;
 
   util::Status GetPendingEntries(
       std::vector<EntryHandle<LoggedEntry>>* entries) const override;
 
+  // Counts the new keys seen by the watch on the entries directory.
+  int64_t NumPendingEntriesAdded() const override;
+
+  void WaitForPendingEntriesAdded(
+      int64_t count,
+      const std::chrono::steady_clock::time_point& deadline) const override;
+
   util::Status GetSequenceMapping(
       EntryHandle<ct::SequenceMapping>* entry) const override;
 
@@ -55,6 +75,8 @@ class EtcdConsistentStore : public ConsistentStore {
 
   util::Status SetClusterNodeState(const ct::ClusterNodeState& state) override;
 
+  util::Status RefreshClusterNodeState() override;
+
   void WatchServingSTH(const ConsistentStore::ServingSTHCallback& cb,
                        util::Task* task) override;
 
@@ -68,7 +90,8 @@ class EtcdConsistentStore : public ConsistentStore {
   util::Status SetClusterConfig(const ct::ClusterConfig& config) override;
 
   // Removes sequenced entries with sequence numbers covered by the current
-  // serving STH.
+  // serving STH, up to --etcd_cleanup_batch_size of them (the next call
+  // carries on from there).
   util::StatusOr<int64_t> CleanupOldEntries() override;
 
  private:
@@ -78,27 +101,111 @@ class EtcdConsistentStore : public ConsistentStore {
   template <class T>
   util::Status GetEntry(const std::string& path, EntryHandle<T>* entry) const;
 
-  util::Status GetAllEntriesInDir(
-      const std::string& dir,
+  // Same as above, but without blocking: fills in |entry| and returns
+  // |task| once etcd replies. |entry| must stay valid until then.
+  template <class T>
+  void GetEntry(const std::string& path, EntryHandle<T>* entry,
+                util::Task* task) const;
+
+  // Reads all the pending entries from etcd, reading all the shards of
+  // the entries directory at once when it is sharded.
+  util::Status GetAllPendingEntries(
       std::vector<EntryHandle<LoggedEntry>>* entries) const;
 
+  // Adds the entries in the directory |dir| to |entries|.
+  void AppendEntriesInDir(const EtcdClient::Node& dir,
+                          std::vector<EntryHandle<LoggedEntry>>* entries) const;
+
+  // Waits until the local copy of the pending entries has caught up
+  // with etcd, as of the time of the call. Returns false if that did
+  // not happen in time.
+  bool SyncPendingEntries() const;
+
+  // Writes |entry| to etcd (without checking MaybeReject()), returning
+  // |task| once done.
+  void CreatePendingEntry(LoggedEntry* entry, util::Task* task);
+
+  // Writes |handle|, the pending entry for |entry| (possibly with
+  // references to its chain certificates), to etcd.
+  void WritePendingEntry(EntryHandle<LoggedEntry>* handle, LoggedEntry* entry,
+                         util::Task* task);
+
+  // Writes the chain certificates |certs|, by hash, to etcd (where some
+  // of them may already be), returning |task| once done.
+  void StoreChainCerts(const std::map<std::string, std::string>& certs,
+                       util::Task* task);
+
+  // Reads the chain certificate with the hash |hash| from etcd.
+  bool LoadChainCert(const std::string& hash, std::string* cert) const;
+
+  // Puts the chain certificates back in a pending entry read from etcd.
+  util::Status RestoreChainCerts(LoggedEntry* entry) const;
+
   util::Status UpdateEntry(EntryHandleBase* entry);
 
   util::Status CreateEntry(EntryHandleBase* entry);
 
   util::Status ForceSetEntry(EntryHandleBase* entry);
 
+  // Same as the three methods above, but without blocking: |task| is
+  // returned with the status once etcd replies. |entry| must remain
+  // valid until then.
+  void UpdateEntry(EntryHandleBase* entry, util::Task* task);
+
+  void CreateEntry(EntryHandleBase* entry, util::Task* task);
+
+  void ForceSetEntry(EntryHandleBase* entry, util::Task* task);
+
+  // Returns a child task of |task| to pass to an EtcdClient write of
+  // |entry|. Once that is done, it updates the handle of |entry| from
+  // |resp| (which is deleted along with |task|) if it worked, and
+  // returns |task| with its status.
+  util::Task* AddEntryWriteTask(EntryHandleBase* entry,
+                                EtcdClient::Response* resp,
+                                util::Task* task) const;
+
   util::Status ForceSetEntryWithTTL(const std::chrono::seconds& ttl,
                                     EntryHandleBase* entry);
 
   util::Status DeleteEntry(const EntryHandleBase& entry);
 
+  // Called when creating the pending entry at |full_path| for |entry|
+  // failed because it already exists: fetches it, checks that it is
+  // for the same leaf, and updates the SCT of |entry| to the existing
+  // one, before returning |task| with ALREADY_EXISTS.
+  void ResolveExistingPendingEntry(const std::string& full_path,
+                                   LoggedEntry* entry, util::Task* task) const;
+
   std::string GetEntryPath(const LoggedEntry& entry) const;
 
   std::string GetEntryPath(const std::string& hash) const;
 
+  // The directories holding the pending entries: the entries directory
+  // itself, or all its shards (see --etcd_entries_shard_prefix_length).
+  std::vector<std::string> GetEntriesShardPaths() const;
+
   std::string GetNodePath(const std::string& node_id) const;
 
+  std::string GetChainCertPath(const std::string& hash) const;
+
+  // The key holding the mappings for the chunk of sequence numbers
+  // starting at |first_sequence_number|.
+  std::string GetSequenceMappingChunkPath(int64_t first_sequence_number) const;
+
+  // Splits |mapping| into chunks, returning their encoded values by
+  // key.
+  std::map<std::string, std::string> EncodeSequenceMappingChunks(
+      const ct::SequenceMapping& mapping) const;
+
+  // Writes out the sequence mapping kept in a single file by older
+  // versions as chunks, and then deletes that file, if it is still
+  // there. Must be called with |sequence_mapping_mutex_| held.
+  util::Status MigrateLegacySequenceMapping() const;
+
+  // A key in the entries directory which is not an entry, written to by
+  // SyncPendingEntries().
+  std::string GetPendingEntriesSyncPath() const;
+
   std::string GetFullPath(const std::string& key) const;
 
   void CheckMappingIsContiguousWithServingTree(
@@ -132,10 +239,16 @@ class EtcdConsistentStore : public ConsistentStore {
 
   void OnClusterConfigUpdated(const Update<ct::ClusterConfig>& update);
 
+  void OnEtcdPendingEntriesUpdated(
+      const std::vector<EtcdClient::Node>& updates);
+
   void StartEtcdStatsFetch();
   void EtcdStatsFetchDone(EtcdClient::StatsResponse* response,
                           util::Task* task);
 
+  // The number of entries in the entries directory, including those
+  // being added by this node.
+  int64_t NumPendingEntries() const;
   util::Status MaybeReject(const std::string& type) const;
 
   EtcdClient* const client_;              // We don't own this.
@@ -148,13 +261,49 @@ class EtcdConsistentStore : public ConsistentStore {
   util::SyncTask serving_sth_watch_task_;
   util::SyncTask cluster_config_watch_task_;
   util::SyncTask etcd_stats_task_;
+  util::SyncTask pending_entries_watch_task_;
 
   mutable std::mutex mutex_;
   bool received_initial_sth_;
   std::unique_ptr<EntryHandle<ct::SignedTreeHead>> serving_sth_;
   std::unique_ptr<ct::ClusterConfig> cluster_config_;
   bool exiting_;
+  // As of the last etcd stats fetched, if any, only exported.
   int64_t num_etcd_entries_;
+  // The highest sequence number up to which CleanupOldEntries() has
+  // deleted all the entries.
+  int64_t cleaned_up_to_;
+  // For MaybeReject().
+  mutable std::mt19937 reject_rng_;
+
+  // The local copy of the entries directory, kept up to date by
+  // |pending_entries_watch_task_|, by key.
+  mutable std::mutex pending_entries_mutex_;
+  mutable std::condition_variable pending_entries_cv_;
+  std::map<std::string, EntryHandle<LoggedEntry>> pending_entries_;
+  // The modified index of the sync key, as last seen by the watch.
+  int64_t pending_entries_sync_index_;
+  // The number of keys that were added to |pending_entries_|.
+  int64_t num_pending_entries_added_;
+  // The keys of the entries being written to etcd by this node, until
+  // the watch sees them.
+  std::unordered_set<std::string> adding_entries_;
+
+  // The chain certificates of the pending entries, which are known to
+  // be in etcd (see --etcd_deduplicate_chain_certs).
+  mutable ChainCertCache chain_certs_;
+  const ChainCertCache::LoadFunction load_chain_cert_;
+
+  // The chunks of the sequence mapping as of the last time it was read
+  // or written (as of |sequence_mapping_index_|), by key: their
+  // modified index and value.
+  mutable std::mutex sequence_mapping_mutex_;
+  mutable std::map<std::string, std::pair<int64_t, std::string>>
+      sequence_mapping_chunks_;
+  mutable int64_t sequence_mapping_index_;
+  // Whether MigrateLegacySequenceMapping() succeeded, which is done
+  // the first time the mapping is read.
+  mutable bool sequence_mapping_migrated_;
 
   friend class EtcdConsistentStoreTest;
   template <class T>
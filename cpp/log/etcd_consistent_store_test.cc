@@ -13,6 +13,7 @@
 #include <unordered_set>
 
 #include "log/logged_entry.h"
+#include "merkletree/serial_hasher.h"
 #include "monitoring/registry.h"
 #include "proto/cert_serializer.h"
 #include "proto/ct.pb.h"
@@ -26,6 +27,11 @@
 
 DECLARE_int32(node_state_ttl_seconds);
 DECLARE_int32(etcd_stats_collection_interval_seconds);
+DECLARE_int32(etcd_cleanup_batch_size);
+DECLARE_int32(etcd_entries_shard_prefix_length);
+DECLARE_bool(etcd_compact_values);
+DECLARE_bool(etcd_deduplicate_chain_certs);
+DECLARE_double(etcd_reject_ramp_fraction);
 
 namespace cert_trans {
 
@@ -35,9 +41,12 @@ using ct::SignedTreeHead;
 using std::atomic;
 using std::bind;
 using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::lock_guard;
 using std::make_pair;
 using std::make_shared;
+using std::map;
 using std::mutex;
 using std::ostringstream;
 using std::pair;
@@ -45,6 +54,7 @@ using std::placeholders::_1;
 using std::shared_ptr;
 using std::string;
 using std::thread;
+using std::to_string;
 using std::unique_ptr;
 using std::unordered_map;
 using std::unordered_set;
@@ -82,7 +92,6 @@ class EtcdConsistentStoreTest : public ::testing::Test {
     FLAGS_etcd_stats_collection_interval_seconds = 1;
     store_.reset(new EtcdConsistentStore(base_.get(), &executor_, &client_,
                                          &election_, kRoot, kNodeId));
-    InsertEntry("/root/sequence_mapping", SequenceMapping());
   }
 
   LoggedEntry DefaultCert() {
@@ -186,6 +195,19 @@ class EtcdConsistentStoreTest : public ::testing::Test {
     Deserialize(resp.node.value_, thing);
   }
 
+  // Fetches the modified index of each chunk of the sequence mapping.
+  void GetChunkIndices(map<string, int64_t>* indices) {
+    EtcdClient::GetResponse resp;
+    SyncTask task(base_.get());
+    client_.Get(string(kRoot) + "/sequence_mapping_chunks", &resp,
+                task.task());
+    task.Wait();
+    ASSERT_EQ(Status::OK, task.status());
+    for (const auto& node : resp.node.nodes_) {
+      (*indices)[node.key_] = node.modified_index_;
+    }
+  }
+
   template <class T>
   string Serialize(const T& t) {
     string flat;
@@ -321,6 +343,75 @@ TEST_F(EtcdConsistentStoreTest, TestAddPendingEntryWorks) {
 }
 
 
+TEST_F(EtcdConsistentStoreTest, TestCompactValues) {
+  FLAGS_etcd_compact_values = true;
+  LoggedEntry cert(DefaultCert());
+  ASSERT_EQ(Status::OK, store_->AddPendingEntry(&cert));
+  EtcdClient::GetResponse resp;
+  SyncTask task(base_.get());
+  client_.Get(string(kRoot) + "/entries/" + util::HexString(cert.Hash()),
+              &resp, task.task());
+  task.Wait();
+  EXPECT_EQ(Status::OK, task.status());
+  ASSERT_FALSE(resp.node.value_.empty());
+  EXPECT_NE(string::npos, string(".~").find(resp.node.value_[0]));
+  EXPECT_EQ(string::npos, resp.node.value_.find_first_of("+/="));
+
+  // Both encodings can be read.
+  const LoggedEntry other(MakeCert(123, "other"));
+  InsertEntry(string(kRoot) + "/entries/" + util::HexString(other.Hash()),
+              other);
+  EntryHandle<LoggedEntry> handle;
+  EXPECT_OK(store_->GetPendingEntryForHash(cert.Hash(), &handle));
+  EXPECT_EQ(cert, handle.Entry());
+  EXPECT_OK(store_->GetPendingEntryForHash(other.Hash(), &handle));
+  EXPECT_EQ(other, handle.Entry());
+  FLAGS_etcd_compact_values = false;
+}
+
+
+TEST_F(EtcdConsistentStoreTest, TestDeduplicatesChainCerts) {
+  FLAGS_etcd_deduplicate_chain_certs = true;
+  LoggedEntry cert(DefaultCert());
+  cert.mutable_chain()->Add()->assign("intermediate");
+  LoggedEntry other(MakeCert(kTimestamp, "other"));
+  other.mutable_chain()->Add()->assign("intermediate");
+  ASSERT_OK(store_->AddPendingEntry(&cert));
+  ASSERT_OK(store_->AddPendingEntry(&other));
+  FLAGS_etcd_deduplicate_chain_certs = false;
+
+  // The entries only reference the certificate, stored on its own.
+  LoggedEntry stored;
+  PeekEntry(string(kRoot) + "/entries/" + util::HexString(cert.Hash()),
+            &stored);
+  ASSERT_EQ(1, stored.chain()->size());
+  EXPECT_NE("intermediate", stored.chain()->Get(0));
+  const string hash(Sha256Hasher::Sha256Digest("intermediate"));
+  EtcdClient::GetResponse resp;
+  SyncTask task(base_.get());
+  client_.Get(string(kRoot) + "/chain_certs/" + util::HexString(hash), &resp,
+              task.task());
+  task.Wait();
+  ASSERT_OK(task.status());
+  EXPECT_EQ("intermediate", util::FromBase64(resp.node.value_.c_str()));
+
+  // Another node, which has to read the certificate from etcd, gets
+  // the entries back as they were.
+  store_.reset(new EtcdConsistentStore(base_.get(), &executor_, &client_,
+                                       &election_, kRoot, kNodeId));
+  EntryHandle<LoggedEntry> handle;
+  EXPECT_OK(store_->GetPendingEntryForHash(cert.Hash(), &handle));
+  EXPECT_EQ(cert, handle.Entry());
+  vector<EntryHandle<LoggedEntry>> entries;
+  EXPECT_OK(store_->GetPendingEntries(&entries));
+  ASSERT_EQ(2U, entries.size());
+  for (const auto& entry : entries) {
+    ASSERT_EQ(1, entry.Entry().chain()->size());
+    EXPECT_EQ("intermediate", entry.Entry().chain()->Get(0));
+  }
+}
+
+
 TEST_F(EtcdConsistentStoreTest,
        TestAddPendingEntryForExistingEntryReturnsSct) {
   LoggedEntry cert(DefaultCert());
@@ -402,6 +493,93 @@ TEST_F(EtcdConsistentStoreTest, TestGetPendingEntries) {
 }
 
 
+TEST_F(EtcdConsistentStoreTest, TestGetPendingEntriesSeesChanges) {
+  const string kPath(string(kRoot) + "/entries/");
+  const LoggedEntry one(MakeCert(123, "one"));
+  const LoggedEntry two(MakeCert(456, "two"));
+  InsertEntry(kPath + "one", one);
+
+  vector<EntryHandle<LoggedEntry>> entries;
+  EXPECT_OK(store_->GetPendingEntries(&entries));
+  ASSERT_EQ(static_cast<size_t>(1), entries.size());
+  EXPECT_EQ(kPath + "one", entries[0].Key());
+  EXPECT_EQ(one, entries[0].Entry());
+
+  InsertEntry(kPath + "two", two);
+  {
+    SyncTask task(base_.get());
+    client_.ForceDelete(kPath + "one", task.task());
+    task.Wait();
+    ASSERT_OK(task.status());
+  }
+
+  entries.clear();
+  EXPECT_OK(store_->GetPendingEntries(&entries));
+  ASSERT_EQ(static_cast<size_t>(1), entries.size());
+  EXPECT_EQ(kPath + "two", entries[0].Key());
+  EXPECT_EQ(two, entries[0].Entry());
+  EXPECT_TRUE(entries[0].HasHandle());
+}
+
+
+TEST_F(EtcdConsistentStoreTest, TestShardedPendingEntries) {
+  FLAGS_etcd_entries_shard_prefix_length = 1;
+  store_.reset(new EtcdConsistentStore(base_.get(), &executor_, &client_,
+                                       &election_, kRoot, kNodeId));
+  LoggedEntry cert(DefaultCert());
+  ASSERT_OK(store_->AddPendingEntry(&cert));
+  const string hex_hash(util::HexString(cert.Hash()));
+  const string kPath(string(kRoot) + "/entries/" + hex_hash.substr(0, 1) +
+                     "/" + hex_hash);
+  {
+    EtcdClient::GetResponse resp;
+    SyncTask task(base_.get());
+    client_.Get(kPath, &resp, task.task());
+    task.Wait();
+    ASSERT_OK(task.status());
+    EXPECT_EQ(Serialize(cert), resp.node.value_);
+  }
+
+  EntryHandle<LoggedEntry> entry;
+  EXPECT_OK(store_->GetPendingEntryForHash(cert.Hash(), &entry));
+  EXPECT_EQ(cert, entry.Entry());
+
+  vector<EntryHandle<LoggedEntry>> entries;
+  EXPECT_OK(store_->GetPendingEntries(&entries));
+  ASSERT_EQ(static_cast<size_t>(1), entries.size());
+  EXPECT_EQ(kPath, entries[0].Key());
+  EXPECT_EQ(cert, entries[0].Entry());
+
+  store_.reset();
+  FLAGS_etcd_entries_shard_prefix_length = 0;
+}
+
+
+TEST_F(EtcdConsistentStoreTest, TestWaitForPendingEntriesAdded) {
+  const string kPath(string(kRoot) + "/entries/");
+  const int64_t num_added(store_->NumPendingEntriesAdded());
+  const LoggedEntry one(MakeCert(123, "one"));
+  InsertEntry(kPath + "one", one);
+  store_->WaitForPendingEntriesAdded(num_added + 1,
+                                     steady_clock::now() + seconds(10));
+  EXPECT_EQ(num_added + 1, store_->NumPendingEntriesAdded());
+
+  // Changing or deleting an entry doesn't count.
+  ForceSetEntry(kPath + "one", MakeCert(123, "changed"));
+  {
+    SyncTask task(base_.get());
+    client_.ForceDelete(kPath + "one", task.task());
+    task.Wait();
+    ASSERT_OK(task.status());
+  }
+  const steady_clock::time_point started(steady_clock::now());
+  store_->WaitForPendingEntriesAdded(num_added + 2,
+                                     started + milliseconds(200));
+  EXPECT_LE(started + milliseconds(200), steady_clock::now());
+  EXPECT_EQ(num_added + 1, store_->NumPendingEntriesAdded());
+}
+
+
 TEST_F(EtcdConsistentStoreDeathTest,
        TestGetPendingEntriesBarfsWithSequencedEntry) {
   const string kPath(string(kRoot) + "/entries/");
@@ -436,7 +614,8 @@ TEST_F(EtcdConsistentStoreTest,
   SequenceMapping mapping;
   mapping.add_mapping()->set_sequence_number(0);
   mapping.add_mapping()->set_sequence_number(2);
-  ForceSetEntry("/root/sequence_mapping", mapping);
+  ForceSetEntry("/root/sequence_mapping_chunks/00000000000000000000",
+                mapping);
   EntryHandle<SequenceMapping> entry;
   EXPECT_OK(store_->GetSequenceMapping(&entry));
 }
@@ -451,7 +630,8 @@ TEST_F(EtcdConsistentStoreDeathTest,
   SequenceMapping mapping;
   mapping.add_mapping()->set_sequence_number(0);
   mapping.add_mapping()->set_sequence_number(2);
-  ForceSetEntry("/root/sequence_mapping", mapping);
+  ForceSetEntry("/root/sequence_mapping_chunks/00000000000000000000",
+                mapping);
   EntryHandle<SequenceMapping> entry;
   EXPECT_DEATH(store_->GetSequenceMapping(&entry), "mapped_seq \\+ 1");
 }
@@ -482,6 +662,103 @@ TEST_F(EtcdConsistentStoreTest, TestUpdateSequenceMapping) {
 }
 
 
+TEST_F(EtcdConsistentStoreTest, TestUpdateSequenceMappingWritesChunks) {
+  EntryHandle<SequenceMapping> mapping;
+  ASSERT_OK(store_->GetSequenceMapping(&mapping));
+  for (int i = 0; i < 2500; ++i) {
+    SequenceMapping::Mapping* m(mapping.MutableEntry()->add_mapping());
+    m->set_sequence_number(i);
+    m->set_entry_hash("hash " + to_string(i));
+  }
+  ASSERT_OK(store_->UpdateSequenceMapping(&mapping));
+
+  map<string, int64_t> chunk_indices;
+  GetChunkIndices(&chunk_indices);
+  EXPECT_EQ(static_cast<size_t>(3), chunk_indices.size());
+
+  // Drop the first chunk's worth of mappings, and add one more.
+  ASSERT_OK(store_->GetSequenceMapping(&mapping));
+  SequenceMapping expected;
+  for (const auto& m : mapping.Entry().mapping()) {
+    if (m.sequence_number() >= 1000) {
+      *expected.add_mapping() = m;
+    }
+  }
+  SequenceMapping::Mapping* m(expected.add_mapping());
+  m->set_sequence_number(2500);
+  m->set_entry_hash("hash 2500");
+  *mapping.MutableEntry() = expected;
+  ASSERT_OK(store_->UpdateSequenceMapping(&mapping));
+
+  map<string, int64_t> new_chunk_indices;
+  GetChunkIndices(&new_chunk_indices);
+  ASSERT_EQ(static_cast<size_t>(2), new_chunk_indices.size());
+  const string kFirstChunk(
+      "/root/sequence_mapping_chunks/00000000000000001000");
+  const string kLastChunk(
+      "/root/sequence_mapping_chunks/00000000000000002000");
+  // The untouched chunk was not rewritten.
+  EXPECT_EQ(chunk_indices[kFirstChunk], new_chunk_indices[kFirstChunk]);
+  EXPECT_LT(chunk_indices[kLastChunk], new_chunk_indices[kLastChunk]);
+
+  ASSERT_OK(store_->GetSequenceMapping(&mapping));
+  EXPECT_EQ(expected.DebugString(), mapping.Entry().DebugString());
+}
+
+
+TEST_F(EtcdConsistentStoreTest, TestMigratesLegacySequenceMapping) {
+  // As left by an older version, with the whole mapping in one file.
+  SequenceMapping legacy;
+  for (int i = 0; i < 1500; ++i) {
+    SequenceMapping::Mapping* m(legacy.add_mapping());
+    m->set_sequence_number(i);
+    m->set_entry_hash("hash " + to_string(i));
+  }
+  const string kLegacyFile(string(kRoot) + "/sequence_mapping");
+  ForceSetEntry(kLegacyFile, legacy);
+  // Starting up again on it.
+  store_.reset(new EtcdConsistentStore(base_.get(), &executor_, &client_,
+                                       &election_, kRoot, kNodeId));
+
+  EntryHandle<SequenceMapping> mapping;
+  ASSERT_OK(store_->GetSequenceMapping(&mapping));
+  EXPECT_EQ(legacy.DebugString(), mapping.Entry().DebugString());
+
+  map<string, int64_t> chunk_indices;
+  GetChunkIndices(&chunk_indices);
+  EXPECT_EQ(static_cast<size_t>(2), chunk_indices.size());
+  {
+    EtcdClient::GetResponse resp;
+    SyncTask task(base_.get());
+    client_.Get(kLegacyFile, &resp, task.task());
+    task.Wait();
+    EXPECT_THAT(task.status(), StatusIs(util::error::NOT_FOUND));
+  }
+
+  // Carries on from there.
+  SequenceMapping::Mapping* m(mapping.MutableEntry()->add_mapping());
+  m->set_sequence_number(1500);
+  m->set_entry_hash("hash 1500");
+  ASSERT_OK(store_->UpdateSequenceMapping(&mapping));
+  const SequenceMapping expected(mapping.Entry());
+  ASSERT_OK(store_->GetSequenceMapping(&mapping));
+  EXPECT_EQ(expected.DebugString(), mapping.Entry().DebugString());
+}
+
+TEST_F(EtcdConsistentStoreTest,
+       TestUpdateSequenceMappingFailsIfChangedSinceRead) {
+  EntryHandle<SequenceMapping> mapping;
+  ASSERT_OK(store_->GetSequenceMapping(&mapping));
+  AddSequenceMapping(0, "zero");
+
+  SequenceMapping::Mapping* m(mapping.MutableEntry()->add_mapping());
+  m->set_sequence_number(0);
+  m->set_entry_hash("other");
+  EXPECT_THAT(store_->UpdateSequenceMapping(&mapping),
+              StatusIs(util::error::FAILED_PRECONDITION));
+}
+
+
 TEST_F(EtcdConsistentStoreDeathTest,
        TestUpdateSequenceMappingBarfsWithOutOfOrderSequenceNumber) {
   EntryHandle<SequenceMapping> mapping;
@@ -735,9 +1012,10 @@ TEST_F(EtcdConsistentStoreTest, TestCleansUpToNewSTH) {
   sth.set_tree_size(105);
   CHECK(store_->SetServingSTH(sth).ok());
   {
+    // 100, 101, and 102 were cleaned up already.
     const StatusOr<int64_t> num_cleaned(CleanupOldEntries());
     ASSERT_OK(num_cleaned.status());
-    EXPECT_EQ(5, num_cleaned.ValueOrDie());
+    EXPECT_EQ(2, num_cleaned.ValueOrDie());
   }
 
 
@@ -764,6 +1042,33 @@ TEST_F(EtcdConsistentStoreTest, TestCleansUpToNewSTH) {
 }
 
 
+TEST_F(EtcdConsistentStoreTest, TestCleansUpInBatches) {
+  FLAGS_etcd_cleanup_batch_size = 2;
+  PopulateForCleanupTests(5, 0, 100);
+  EXPECT_CALL(election_, IsMaster()).WillRepeatedly(Return(true));
+
+  SignedTreeHead sth;
+  sth.set_timestamp(345345);
+  sth.set_tree_size(105);
+  CHECK(store_->SetServingSTH(sth).ok());
+
+  EntryHandle<SequenceMapping> seq_mapping;
+  CHECK(store_->GetSequenceMapping(&seq_mapping).ok());
+  for (const int expected : {2, 2, 1, 0}) {
+    const StatusOr<int64_t> num_cleaned(CleanupOldEntries());
+    ASSERT_OK(num_cleaned.status());
+    EXPECT_EQ(expected, num_cleaned.ValueOrDie());
+  }
+  FLAGS_etcd_cleanup_batch_size = 1000;
+
+  for (const auto& m : seq_mapping.Entry().mapping()) {
+    EntryHandle<LoggedEntry> unused;
+    EXPECT_THAT(store_->GetPendingEntryForHash(m.entry_hash(), &unused),
+                StatusIs(util::error::NOT_FOUND));
+  }
+}
+
+
 TEST_F(EtcdConsistentStoreTest, TestStoreStatsFetcher) {
   EXPECT_EQ(0, GetNumEtcdEntries());
   PopulateForCleanupTests(100, 100, 100);
@@ -791,6 +1096,42 @@ TEST_F(EtcdConsistentStoreTest, TestRejectsAddsWhenOverCapacity) {
 }
 
 
+TEST_F(EtcdConsistentStoreTest, TestRejectsSomeAddsWhenNearCapacity) {
+  // Restores the flags even if an assertion returns early.
+  google::FlagSaver flag_saver;
+  ct::ClusterConfig config;
+  config.set_etcd_reject_add_pending_threshold(20);
+  ASSERT_OK(store_->SetClusterConfig(config));
+
+  // Past half the threshold, but still below it, without waiting for
+  // any etcd stats. Without a ramp while adding them, so that none of
+  // them is rejected.
+  FLAGS_etcd_reject_ramp_fraction = 1;
+  PopulateForCleanupTests(0, 15, 1);
+  vector<EntryHandle<LoggedEntry>> pending;
+  ASSERT_OK(store_->GetPendingEntries(&pending));
+  ASSERT_EQ(15U, pending.size());
+  FLAGS_etcd_reject_ramp_fraction = 0.5;
+
+  int num_added(0);
+  int num_rejected(0);
+  for (int i = 0; i < 100; ++i) {
+    LoggedEntry cert(MakeCert(1000 + i, "cert" + std::to_string(i)));
+    const Status status(store_->AddPendingEntry(&cert));
+    if (status.ok()) {
+      ++num_added;
+    } else {
+      EXPECT_THAT(status, StatusIs(util::error::RESOURCE_EXHAUSTED));
+      ++num_rejected;
+    }
+  }
+
+  // Some get in, but never past the threshold.
+  EXPECT_LT(0, num_rejected);
+  EXPECT_GE(5, num_added);
+}
+
+
 }  // namespace cert_trans
 
 int main(int argc, char** argv) {
@@ -2,9 +2,11 @@
 
 #include <glog/logging.h>
 #include <stdint.h>
+#include <algorithm>
 #include <map>
 #include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "log/file_storage.h"
@@ -17,15 +19,16 @@
 using cert_trans::serialization::DeserializeResult;
 using std::chrono::milliseconds;
 using std::lock_guard;
-using std::make_pair;
-using std::min;
+using std::map;
 using std::mutex;
+using std::pair;
 using std::set;
 using std::stoll;
 using std::string;
 using std::to_string;
 using std::unique_lock;
 using std::unique_ptr;
+using std::vector;
 
 namespace cert_trans {
 namespace {
@@ -37,6 +40,8 @@ static Latency<milliseconds, string> latency_by_op_ms(
 
 
 const char kMetaNodeIdKey[] = "node_id";
+const char kMetaTreeFrontierKey[] = "tree_frontier";
+const char kMetaChainCertPrefix[] = "chain_cert_";
 
 
 string FormatSequenceNumber(const int64_t seq) {
@@ -93,8 +98,17 @@ FileDB::FileDB(FileStorage* cert_storage, FileStorage* tree_storage,
     : cert_storage_(CHECK_NOTNULL(cert_storage)),
       tree_storage_(CHECK_NOTNULL(tree_storage)),
       meta_storage_(CHECK_NOTNULL(meta_storage)),
+      load_chain_cert_([this](const string& hash, string* cert) {
+        return LoadChainCert(hash, cert);
+      }),
       contiguous_size_(0),
-      latest_tree_timestamp_(0) {
+      latest_tree_timestamp_(0),
+      index_memory_(MemoryAccounting::Instance()->Register(
+          "database_index", [this]() {
+            lock_guard<mutex> lock(lock_);
+            return id_by_hash_.MemoryUsage() +
+                   SetMemoryUsage(sparse_entries_);
+          })) {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("open"));
   BuildIndex();
 }
@@ -111,12 +125,81 @@ Database::WriteResult FileDB::CreateSequencedEntry_(
   ScopedLatency latency(
       latency_by_op_ms.GetScopedLatency("create_sequenced_entry"));
 
+  LoggedEntry deduplicated;
+  map<string, string> chain_certs;
+  const bool is_deduplicated(chain_certs_.Deduplicate(
+      load_chain_cert_, logged, &deduplicated, &chain_certs));
   string data;
-  CHECK(logged.SerializeToString(&data));
+  CHECK((is_deduplicated ? deduplicated : logged).SerializeForStorage(&data));
 
-  const string seq_str(FormatSequenceNumber(logged.sequence_number()));
+  lock_guard<mutex> lock(lock_);
 
-  unique_lock<mutex> lock(lock_);
+  StoreChainCerts(chain_certs);
+  return CreateSequencedEntryLocked(logged, data);
+}
+
+
+Database::WriteResult FileDB::CreateSequencedEntries_(
+    const vector<LoggedEntry>& entries, size_t* num_written) {
+  CHECK_NOTNULL(num_written);
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("create_sequenced_entries"));
+
+  vector<string> data(entries.size());
+  map<string, string> chain_certs;
+  LoggedEntry deduplicated;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    const bool is_deduplicated(chain_certs_.Deduplicate(
+        load_chain_cert_, entries[i], &deduplicated, &chain_certs));
+    CHECK((is_deduplicated ? deduplicated : entries[i])
+              .SerializeForStorage(&data[i]));
+  }
+
+  lock_guard<mutex> lock(lock_);
+
+  StoreChainCerts(chain_certs);
+
+  // The entries up to the first one that conflicts with an existing
+  // entry are written as a single batch (sharing the syncs of
+  // --file_storage_sync), leaving out those already stored.
+  WriteResult result(this->OK);
+  vector<pair<string, string>> batch;
+  // The index in |entries| of each entry of |batch|, by sequence
+  // number.
+  map<int64_t, size_t> batched;
+  for (*num_written = 0; *num_written < entries.size(); ++*num_written) {
+    const LoggedEntry& logged(entries[*num_written]);
+    const string& entry_data(data[*num_written]);
+    const string seq_str(FormatSequenceNumber(logged.sequence_number()));
+
+    string existing_data;
+    const auto it(batched.find(logged.sequence_number()));
+    if (it != batched.end()) {
+      existing_data = data[it->second];
+    } else if (!cert_storage_->LookupEntry(seq_str, &existing_data).ok()) {
+      batched.emplace(logged.sequence_number(), *num_written);
+      batch.emplace_back(seq_str, entry_data);
+      continue;
+    }
+    if (!LoggedEntry::SameStored(existing_data, entry_data) &&
+        !chain_certs_.SameEntry(load_chain_cert_, existing_data, logged)) {
+      result = this->SEQUENCE_NUMBER_ALREADY_IN_USE;
+      break;
+    }
+  }
+
+  CHECK_EQ(cert_storage_->CreateEntries(batch), util::Status::OK);
+  for (const auto& entry : batched) {
+    InsertEntryMapping(entry.first, entries[entry.second].Hash());
+  }
+
+  return result;
+}
+
+
+Database::WriteResult FileDB::CreateSequencedEntryLocked(
+    const LoggedEntry& logged, const string& data) {
+  const string seq_str(FormatSequenceNumber(logged.sequence_number()));
 
   // Try to create.
   util::Status status(cert_storage_->CreateEntry(seq_str, data));
@@ -124,7 +207,8 @@ Database::WriteResult FileDB::CreateSequencedEntry_(
     string existing_data;
     status = cert_storage_->LookupEntry(seq_str, &existing_data);
     CHECK_EQ(status, util::Status::OK);
-    if (existing_data == data) {
+    if (LoggedEntry::SameStored(existing_data, data) ||
+        chain_certs_.SameEntry(load_chain_cert_, existing_data, logged)) {
       return this->OK;
     }
     return this->SEQUENCE_NUMBER_ALREADY_IN_USE;
@@ -143,11 +227,11 @@ Database::LookupResult FileDB::LookupByHash(const string& hash,
 
   unique_lock<mutex> lock(lock_);
 
-  auto i(id_by_hash_.find(hash));
-  if (i == id_by_hash_.end()) {
+  int64_t sequence_number;
+  if (!id_by_hash_.Find(hash, &sequence_number)) {
     return this->NOT_FOUND;
   }
-  const string seq_str(FormatSequenceNumber(i->second));
+  const string seq_str(FormatSequenceNumber(sequence_number));
 
   lock.unlock();
 
@@ -157,7 +241,8 @@ Database::LookupResult FileDB::LookupByHash(const string& hash,
   CHECK_EQ(status, util::Status::OK);
 
   if (result) {
-    CHECK(result->ParseFromString(cert_data));
+    CHECK(result->ParseFromStorage(cert_data));
+    CHECK(chain_certs_.Restore(load_chain_cert_, result));
     CHECK_EQ(result->Hash(), hash);
   }
 
@@ -177,7 +262,8 @@ Database::LookupResult FileDB::LookupByIndex(int64_t sequence_number,
     return this->NOT_FOUND;
   }
   if (result) {
-    CHECK(result->ParseFromString(cert_data));
+    CHECK(result->ParseFromStorage(cert_data));
+    CHECK(chain_certs_.Restore(load_chain_cert_, result));
     CHECK_EQ(result->sequence_number(), sequence_number);
   }
   return this->LOOKUP_OK;
@@ -189,6 +275,44 @@ unique_ptr<Database::Iterator> FileDB::ScanEntries(int64_t start_index) const {
 }
 
 
+void FileDB::ReadRange(int64_t start, size_t count,
+                       vector<LoggedEntry>* entries) const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("read_range"));
+  ReadEntryRange(start, count, true, entries);
+}
+
+
+void FileDB::ReadLeafRange(int64_t start, size_t count,
+                           vector<LoggedEntry>* entries) const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("read_leaf_range"));
+  ReadEntryRange(start, count, false, entries);
+}
+
+
+void FileDB::ReadEntryRange(int64_t start, size_t count, bool with_chain,
+                            vector<LoggedEntry>* entries) const {
+  CHECK_GE(start, 0);
+  CHECK_NOTNULL(entries);
+
+  // Each entry is a file, they are all read at once.
+  vector<string> keys(count);
+  for (size_t i = 0; i < count; ++i) {
+    keys[i] = FormatSequenceNumber(start + i);
+  }
+  vector<string> data;
+  entries->resize(cert_storage_->LookupEntries(keys, &data));
+  for (size_t i = 0; i < entries->size(); ++i) {
+    if (with_chain) {
+      CHECK((*entries)[i].ParseFromStorage(data[i]));
+      CHECK(chain_certs_.Restore(load_chain_cert_, &(*entries)[i]));
+    } else {
+      CHECK((*entries)[i].ParseFromStorageWithoutChain(data[i]));
+    }
+    CHECK_EQ((*entries)[i].sequence_number(), start + static_cast<int64_t>(i));
+  }
+}
+
+
 Database::WriteResult FileDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
   CHECK_GE(sth.tree_size(), 0);
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("write_tree_head"));
@@ -235,6 +359,47 @@ Database::LookupResult FileDB::LatestTreeHead(
 }
 
 
+void FileDB::ReadTreeHeads(vector<ct::SignedTreeHead>* results) const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("read_tree_heads"));
+  lock_guard<mutex> lock(lock_);
+
+  results->clear();
+  // The keys sort by timestamp.
+  for (const auto& timestamp_key : tree_storage_->Scan()) {
+    string tree_data;
+    CHECK_EQ(tree_storage_->LookupEntry(timestamp_key, &tree_data),
+             util::Status::OK);
+    results->emplace_back();
+    CHECK(results->back().ParseFromString(tree_data));
+  }
+}
+
+
+Database::LookupResult FileDB::LatestTreeFrontier(string* frontier) const {
+  CHECK_NOTNULL(frontier);
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("latest_tree_frontier"));
+  lock_guard<mutex> lock(lock_);
+  if (!meta_storage_->LookupEntry(kMetaTreeFrontierKey, frontier).ok()) {
+    return this->NOT_FOUND;
+  }
+  return this->LOOKUP_OK;
+}
+
+
+void FileDB::WriteTreeFrontier(const string& frontier) {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("write_tree_frontier"));
+  lock_guard<mutex> lock(lock_);
+  util::Status status(
+      meta_storage_->UpdateEntry(kMetaTreeFrontierKey, frontier));
+  if (status.CanonicalCode() == util::error::NOT_FOUND) {
+    status = meta_storage_->CreateEntry(kMetaTreeFrontierKey, frontier);
+  }
+  CHECK(status.ok()) << "Failed to write the tree frontier: " << status;
+}
+
+
 int64_t FileDB::TreeSize() const {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("tree_size"));
   lock_guard<mutex> lock(lock_);
@@ -293,33 +458,57 @@ void FileDB::BuildIndex() {
   // this should not be necessarily, but just to be sure...
   lock_guard<mutex> lock(lock_);
 
-  const set<string> sequence_numbers(cert_storage_->Scan());
-  id_by_hash_.reserve(sequence_numbers.size());
-
-  for (const auto& seq_path : sequence_numbers) {
-    const int64_t seq(ParseSequenceNumber(seq_path));
-    string cert_data;
-    // Read the data; tolerate no errors.
-    CHECK_EQ(cert_storage_->LookupEntry(seq_path, &cert_data),
-             util::Status::OK)
-        << "Failed to read entry with sequence number " << seq;
-
-    LoggedEntry logged;
-    CHECK(logged.ParseFromString(cert_data))
-        << "Failed to parse entry with sequence number " << seq;
-    CHECK(logged.has_sequence_number())
-        << "sequence_number() is unset for for entry with sequence number "
-        << seq;
-    CHECK_EQ(logged.sequence_number(), seq)
-        << "Entry has a negative sequence_number(): " << seq;
-
-    InsertEntryMapping(logged.sequence_number(), logged.Hash());
+  // The entries are read and parsed by several threads, only their
+  // sequence numbers are kept until they are all indexed.
+  mutex index_lock;
+  vector<int64_t> sequence_numbers;
+  cert_storage_->Scan(
+      [this, &index_lock, &sequence_numbers](const string& seq_path) {
+        const int64_t seq(ParseSequenceNumber(seq_path));
+        string cert_data;
+        // Read the data; tolerate no errors.
+        CHECK_EQ(cert_storage_->LookupEntry(seq_path, &cert_data),
+                 util::Status::OK)
+            << "Failed to read entry with sequence number " << seq;
+
+        LoggedEntry logged;
+        CHECK(logged.ParseFromStorageWithoutChain(cert_data))
+            << "Failed to parse entry with sequence number " << seq;
+        CHECK(logged.has_sequence_number())
+            << "sequence_number() is unset for for entry with sequence "
+            << "number " << seq;
+        CHECK_EQ(logged.sequence_number(), seq)
+            << "Entry has a negative sequence_number(): " << seq;
+        const string hash(logged.Hash());
+
+        lock_guard<mutex> lock(index_lock);
+        // Track duplicate hashes under their lowest sequence number,
+        // like InsertEntryMapping().
+        int64_t existing;
+        if (!id_by_hash_.Find(hash, &existing) || seq < existing) {
+          id_by_hash_.Set(hash, seq);
+        }
+        sequence_numbers.push_back(seq);
+      },
+      std::max(1U, std::thread::hardware_concurrency()));
+
+  std::sort(sequence_numbers.begin(), sequence_numbers.end());
+  for (const int64_t seq : sequence_numbers) {
+    if (seq == contiguous_size_) {
+      ++contiguous_size_;
+    } else {
+      CHECK(sparse_entries_.insert(seq).second)
+          << "sequence number " << seq << " already assigned.";
+    }
   }
 
-  // Now read the STH entries.
-  set<string> sth_timestamps = tree_storage_->Scan();
-  if (!sth_timestamps.empty()) {
-    latest_timestamp_key_ = *sth_timestamps.rbegin();
+  // Now read the STH entries. The keys sort by timestamp.
+  tree_storage_->Scan(
+      [this](const string& timestamp_key) {
+        latest_timestamp_key_ = std::max(latest_timestamp_key_, timestamp_key);
+      },
+      1);
+  if (!latest_timestamp_key_.empty()) {
     CHECK_EQ(DeserializeResult::OK,
              Deserializer::DeserializeUint<uint64_t>(
                  latest_timestamp_key_, FileDB::kTimestampBytesIndexed,
@@ -347,10 +536,11 @@ Database::LookupResult FileDB::LatestTreeHeadNoLock(
 
 // This must be called with "lock_" held.
 void FileDB::InsertEntryMapping(int64_t sequence_number, const string& hash) {
-  if (!id_by_hash_.insert(make_pair(hash, sequence_number)).second) {
-    // This is a duplicate hash under a new sequence number.
-    // Make sure we track the entry with the lowest sequence number:
-    id_by_hash_[hash] = min(id_by_hash_[hash], sequence_number);
+  // If this is a duplicate hash under a new sequence number, make
+  // sure we track the entry with the lowest sequence number.
+  int64_t existing;
+  if (!id_by_hash_.Find(hash, &existing) || sequence_number < existing) {
+    id_by_hash_.Set(hash, sequence_number);
   }
 
   if (sequence_number == contiguous_size_) {
@@ -368,4 +558,22 @@ void FileDB::InsertEntryMapping(int64_t sequence_number, const string& hash) {
 }
 
 
+// This must be called with "lock_" held.
+void FileDB::StoreChainCerts(const map<string, string>& certs) {
+  for (const auto& cert : certs) {
+    const util::Status status(
+        meta_storage_->CreateEntry(kMetaChainCertPrefix + cert.first,
+                                   cert.second));
+    CHECK(status.ok() || status.CanonicalCode() == util::error::ALREADY_EXISTS)
+        << status;
+  }
+  chain_certs_.Stored(certs);
+}
+
+
+bool FileDB::LoadChainCert(const string& hash, string* cert) const {
+  return meta_storage_->LookupEntry(kMetaChainCertPrefix + hash, cert).ok();
+}
+
+
 }  // namespace cert_trans
@@ -6,12 +6,14 @@
 #include <memory>
 #include <mutex>
 #include <set>
-#include <unordered_map>
 #include <vector>
 
 #include "base/macros.h"
+#include "log/chain_cert_cache.h"
 #include "log/database.h"
 #include "proto/ct.pb.h"
+#include "util/hash_index.h"
+#include "util/memory_accounting.h"
 #include "util/statusor.h"
 
 namespace cert_trans {
@@ -44,6 +46,9 @@ class FileDB : public Database {
   Database::WriteResult CreateSequencedEntry_(
       const LoggedEntry& logged) override;
 
+  Database::WriteResult CreateSequencedEntries_(
+      const std::vector<LoggedEntry>& entries, size_t* num_written) override;
+
   Database::LookupResult LookupByHash(const std::string& hash,
                                       LoggedEntry* result) const override;
 
@@ -53,11 +58,24 @@ class FileDB : public Database {
   std::unique_ptr<Database::Iterator> ScanEntries(
       int64_t start_index) const override;
 
+  void ReadRange(int64_t start, size_t count,
+                 std::vector<LoggedEntry>* entries) const override;
+
+  void ReadLeafRange(int64_t start, size_t count,
+                     std::vector<LoggedEntry>* entries) const override;
+
   Database::WriteResult WriteTreeHead_(const ct::SignedTreeHead& sth) override;
 
   Database::LookupResult LatestTreeHead(
       ct::SignedTreeHead* result) const override;
 
+  void ReadTreeHeads(std::vector<ct::SignedTreeHead>* results) const override;
+
+  Database::LookupResult LatestTreeFrontier(
+      std::string* frontier) const override;
+
+  void WriteTreeFrontier(const std::string& frontier) override;
+
   int64_t TreeSize() const override;
 
   void AddNotifySTHCallback(
@@ -74,9 +92,17 @@ class FileDB : public Database {
   class Iterator;
 
   void BuildIndex();
+  // ReadRange() or, without |with_chain|, ReadLeafRange().
+  void ReadEntryRange(int64_t start, size_t count, bool with_chain,
+                      std::vector<LoggedEntry>* entries) const;
+  // This must be called with "lock_" held.
+  Database::WriteResult CreateSequencedEntryLocked(const LoggedEntry& logged,
+                                                   const std::string& data);
   Database::LookupResult LatestTreeHeadNoLock(
       ct::SignedTreeHead* result) const;
   void InsertEntryMapping(int64_t sequence_number, const std::string& hash);
+  void StoreChainCerts(const std::map<std::string, std::string>& certs);
+  bool LoadChainCert(const std::string& hash, std::string* cert) const;
 
   const std::unique_ptr<FileStorage> cert_storage_;
   // Store all tree heads, but currently only support looking up the latest
@@ -84,12 +110,16 @@ class FileDB : public Database {
   // Other necessary lookup indices (by tree size, by timestamp range?) TBD.
   const std::unique_ptr<FileStorage> tree_storage_;
 
+  // Also holds the deduplicated chain certificates.
   const std::unique_ptr<FileStorage> meta_storage_;
 
+  mutable ChainCertCache chain_certs_;
+  const ChainCertCache::LoadFunction load_chain_cert_;
+
   mutable std::mutex lock_;
 
   int64_t contiguous_size_;
-  std::unordered_map<std::string, int64_t> id_by_hash_;
+  HashIndex id_by_hash_;
 
   // This is a mapping of the non-contiguous entries of the log (which
   // can happen while it is being fetched). When entries here become
@@ -101,6 +131,9 @@ class FileDB : public Database {
   std::string latest_timestamp_key_;
   DatabaseNotifierHelper callbacks_;
 
+  // Last, to stop counting the indexes before they go.
+  const std::unique_ptr<MemoryAccounting::Registration> index_memory_;
+
   DISALLOW_COPY_AND_ASSIGN(FileDB);
 };
 
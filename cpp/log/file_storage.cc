@@ -3,21 +3,94 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #include <unistd.h>
+#include <algorithm>
+#include <atomic>
 #include <cstdlib>
 #include <set>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "log/filesystem_ops.h"
+#include "util/io_batch.h"
 #include "util/util.h"
 
+DEFINE_bool(file_storage_sync, false,
+            "make the writes of the file databases durable before "
+            "acknowledging them, with a couple of filesystem syncs per "
+            "batch of entries");
+
 using cert_trans::BasicFilesystemOps;
 using cert_trans::FilesystemOps;
+using std::atomic;
+using std::function;
+using std::make_pair;
+using std::pair;
 using std::string;
+using std::thread;
+using std::vector;
 
 namespace cert_trans {
+namespace {
+
+
+// Calls |callback| with the name of every entry of the directory
+// |dir_path| not starting with a dot. On Linux, this reads the
+// entries with getdents64 and a large buffer, so that a directory
+// of a few thousand entries only takes a couple of system calls.
+void ListDir(const string& dir_path,
+             const function<void(const char* name)>& callback) {
+#ifdef __linux__
+  struct LinuxDirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+  };
+  const size_t kBufferSize = 64 * 1024;
+
+  const int fd(open(dir_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  PCHECK(fd >= 0) << "open(" << dir_path << ")";
+  const std::unique_ptr<char[]> buffer(new char[kBufferSize]);
+  while (true) {
+    const long size(syscall(SYS_getdents64, fd, buffer.get(), kBufferSize));
+    PCHECK(size >= 0) << "getdents64(" << dir_path << ")";
+    if (size == 0) {
+      break;
+    }
+    for (long offset = 0; offset < size;) {
+      const LinuxDirent64* const entry(
+          reinterpret_cast<const LinuxDirent64*>(buffer.get() + offset));
+      if (entry->d_name[0] != '.') {
+        callback(entry->d_name);
+      }
+      offset += entry->d_reclen;
+    }
+  }
+  PCHECK(close(fd) == 0) << "close(" << dir_path << ")";
+#else
+  DIR* dir = CHECK_NOTNULL(opendir(dir_path.c_str()));
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] != '.') {
+      callback(entry->d_name);
+    }
+  }
+  closedir(dir);
+#endif
+}
+
+
+}  // namespace
 
 
 FileStorage::FileStorage(const string& file_base, int storage_depth)
@@ -52,17 +125,63 @@ FileStorage::~FileStorage() {
 
 std::set<string> FileStorage::Scan() const {
   std::set<string> storage_keys;
-  ScanDir(storage_dir_, storage_depth_, &storage_keys);
+  ScanDir(storage_dir_, storage_depth_, "", false,
+          [&storage_keys](const string& key) { storage_keys.insert(key); });
   return storage_keys;
 }
 
 
+void FileStorage::Scan(const ScanCallback& callback, int num_threads) const {
+  CHECK_GT(num_threads, 0);
+  if (storage_depth_ == 0 || num_threads == 1) {
+    ScanDir(storage_dir_, storage_depth_, "", false, callback);
+    return;
+  }
+
+  // Each top-level directory is scanned by a single thread, there
+  // are only a few of them (one per hex digit).
+  vector<string> shards;
+  ListDir(storage_dir_, [&shards](const char* name) {
+    shards.emplace_back(name);
+  });
+  atomic<size_t> next_shard(0);
+  const auto scan_shards([this, &callback, &shards, &next_shard]() {
+    size_t shard;
+    while ((shard = next_shard++) < shards.size()) {
+      const string& name(shards[shard]);
+      const bool complete(name == "-");
+      ScanDir(storage_dir_ + "/" + name, storage_depth_ - 1,
+              complete ? "" : name, complete, callback);
+    }
+  });
+
+  vector<thread> threads;
+  for (size_t i = 1; i < std::min<size_t>(num_threads, shards.size()); ++i) {
+    threads.emplace_back(scan_shards);
+  }
+  scan_shards();
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+
 util::Status FileStorage::CreateEntry(const string& key, const string& data) {
-  if (LookupEntry(key, NULL).ok()) {
-    return util::Status(util::error::ALREADY_EXISTS,
-                        "entry already exists: " + key);
+  return CreateEntries({make_pair(key, data)});
+}
+
+
+util::Status FileStorage::CreateEntries(
+    const vector<pair<string, string>>& entries) {
+  std::set<string> keys;
+  for (const auto& entry : entries) {
+    if (!keys.insert(entry.first).second ||
+        LookupEntry(entry.first, NULL).ok()) {
+      return util::Status(util::error::ALREADY_EXISTS,
+                          "entry already exists: " + entry.first);
+    }
   }
-  WriteStorageEntry(key, data);
+  WriteStorageEntries(entries);
   return util::Status::OK;
 }
 
@@ -72,7 +191,7 @@ util::Status FileStorage::UpdateEntry(const string& key, const string& data) {
     return util::Status(util::error::NOT_FOUND,
                         "tried to update non-existent entry: " + key);
   }
-  WriteStorageEntry(key, data);
+  WriteStorageEntries({make_pair(key, data)});
   return util::Status::OK;
 }
 
@@ -90,6 +209,40 @@ util::Status FileStorage::LookupEntry(const string& key,
 }
 
 
+size_t FileStorage::LookupEntries(const vector<string>& keys,
+                                  vector<string>* results) const {
+  CHECK_NOTNULL(results)->resize(keys.size());
+  vector<int> fds;
+  fds.reserve(keys.size());
+  IoBatch batch;
+  for (const auto& key : keys) {
+    const string data_file(StoragePath(key));
+    const int fd(open(data_file.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd < 0) {
+      PCHECK(errno == ENOENT) << "open(" << data_file << ")";
+      break;
+    }
+    struct stat st;
+    PCHECK(fstat(fd, &st) == 0) << "fstat(" << data_file << ")";
+
+    string* const result(&(*results)[fds.size()]);
+    result->resize(st.st_size);
+    batch.AddRead(fd, &(*result)[0], result->size(), 0);
+    fds.push_back(fd);
+  }
+
+  vector<ssize_t> read;
+  batch.Run(&read);
+  for (size_t i = 0; i < fds.size(); ++i) {
+    CHECK_EQ(read[i], static_cast<ssize_t>((*results)[i].size()))
+        << "reading " << util::HexString(keys[i]);
+    PCHECK(close(fds[i]) == 0);
+  }
+  results->resize(fds.size());
+  return fds.size();
+}
+
+
 string FileStorage::StoragePathBasename(const string& hex) const {
   if (hex.length() <= static_cast<uint>(storage_depth_))
     return "-";
@@ -115,70 +268,89 @@ string FileStorage::StoragePath(const string& key) const {
 }
 
 
-string FileStorage::StorageKey(const string& storage_path) const {
-  CHECK_EQ(storage_path.substr(0, storage_dir_.size()), storage_dir_);
-  string key_path = storage_path.substr(storage_dir_.size() + 1);
-  string hex_key;
-  for (int n = 0; n < storage_depth_; ++n) {
-    char hex_char = key_path[2 * n];
-    if (hex_char == '-')
-      return util::BinaryString(hex_key);
-    hex_key.push_back(hex_char);
-  }
-  string basename = key_path.substr(2 * storage_depth_);
-  if (basename != "-")
-    hex_key.append(basename);
-  return util::BinaryString(hex_key);
-}
-
-
-void FileStorage::WriteStorageEntry(const string& key, const string& data) {
-  string hex = util::HexString(key);
+// The entries are written to temporary files, then renamed into
+// place, so that each of them appears atomically. With
+// --file_storage_sync, the temporary files are synced (all at once)
+// before being renamed, so that a crash cannot leave an incomplete
+// entry behind, and the renames are synced after.
+void FileStorage::WriteStorageEntries(
+    const vector<pair<string, string>>& entries) {
+  // Pairs of temporary file and final path.
+  vector<pair<string, string>> renames;
+  renames.reserve(entries.size());
+  for (const auto& entry : entries) {
+    string hex = util::HexString(entry.first);
+
+    // Make the intermediate directories, if needed.
+    // TODO(ekasper): we can skip this if we know we're updating.
+    string dir = storage_dir_;
+    for (int n = 0; n < storage_depth_; ++n) {
+      dir += "/" + StoragePathComponent(hex, n);
+      CreateMissingDirectory(dir);
+    }
 
-  // Make the intermediate directories, if needed.
-  // TODO(ekasper): we can skip this if we know we're updating.
-  string dir = storage_dir_;
-  for (int n = 0; n < storage_depth_; ++n) {
-    dir += "/" + StoragePathComponent(hex, n);
-    CreateMissingDirectory(dir);
+    // == StoragePath(key)
+    renames.emplace_back("", dir + "/" + StoragePathBasename(hex));
   }
 
-  // == StoragePath(key)
-  string filename = dir + "/" + StoragePathBasename(hex);
-  AtomicWriteBinaryFile(filename, data);
-}
-
+  // The temporary files are written as a single IoBatch, unless there
+  // is just the one.
+  if (entries.size() == 1) {
+    renames[0].first =
+        util::WriteTemporaryBinaryFile(tmp_file_template_, entries[0].second);
+    CHECK(!renames[0].first.empty());
+  } else {
+    vector<int> fds;
+    IoBatch batch;
+    for (size_t i = 0; i < entries.size(); ++i) {
+      string tmp_file(tmp_file_template_);
+      const int fd(mkstemp(&tmp_file[0]));
+      PCHECK(fd >= 0) << "mkstemp(" << tmp_file_template_ << ")";
+      batch.AddWrite(fd, entries[i].second.data(), entries[i].second.size(),
+                     0);
+      fds.push_back(fd);
+      renames[i].first = tmp_file;
+    }
+    vector<ssize_t> written;
+    batch.Run(&written);
+    for (size_t i = 0; i < entries.size(); ++i) {
+      CHECK_EQ(written[i], static_cast<ssize_t>(entries[i].second.size()))
+          << "writing " << renames[i].first;
+      PCHECK(close(fds[i]) == 0);
+    }
+  }
 
-void FileStorage::ScanFiles(const string& dir_path,
-                            std::set<string>* keys) const {
-  DIR* dir = CHECK_NOTNULL(opendir(dir_path.c_str()));
-  struct dirent* entry;
-  while ((entry = readdir(dir)) != NULL) {
-    if (entry->d_name[0] == '.')
-      continue;
-    keys->insert(StorageKey(dir_path + "/" + entry->d_name));
+  SyncWrites();
+  for (const auto& rename : renames) {
+    CHECK_EQ(file_op_->rename(rename.first, rename.second), 0);
   }
-  closedir(dir);
+  SyncWrites();
 }
 
 
+// The keys are rebuilt from the path components as they are listed
+// (the reverse of StoragePath()), without stat'ing anything.
 void FileStorage::ScanDir(const string& dir_path, int depth,
-                          std::set<string>* keys) const {
+                          const string& hex_prefix, bool prefix_complete,
+                          const ScanCallback& callback) const {
   CHECK_GE(depth, 0);
+  // TODO: make the directory listing part of filesystemop.
   if (depth > 0) {
-    // Parse subdirectories. (TODO: make opendir part of filesystemop).
-    DIR* dir = CHECK_NOTNULL(opendir(dir_path.c_str()));
-    struct dirent* entry;
-    std::set<string> result;
-    while ((entry = readdir(dir)) != NULL) {
-      if (entry->d_name[0] == '.')
-        continue;
-      ScanDir(dir_path + "/" + entry->d_name, depth - 1, keys);
-    }
-    closedir(dir);
+    // Parse subdirectories.
+    ListDir(dir_path, [&](const char* name) {
+      const bool complete(prefix_complete || string(name) == "-");
+      ScanDir(dir_path + "/" + name, depth - 1,
+              complete ? hex_prefix : hex_prefix + name, complete, callback);
+    });
   } else {
     // depth == 0; parse files.
-    ScanFiles(dir_path, keys);
+    ListDir(dir_path, [&](const char* name) {
+      if (prefix_complete || string(name) == "-") {
+        callback(util::BinaryString(hex_prefix));
+      } else {
+        callback(util::BinaryString(hex_prefix + name));
+      }
+    });
   }
 }
 
@@ -193,13 +365,20 @@ bool FileStorage::FileExists(const string& file_path) const {
 }
 
 
-void FileStorage::AtomicWriteBinaryFile(const string& file_path,
-                                        const string& data) {
-  const string tmp_file(
-      util::WriteTemporaryBinaryFile(tmp_file_template_, data));
-
-  CHECK(!tmp_file.empty());
-  CHECK_EQ(file_op_->rename(tmp_file, file_path), 0);
+void FileStorage::SyncWrites() const {
+  if (!FLAGS_file_storage_sync) {
+    return;
+  }
+#ifdef __linux__
+  // One syncfs() covers all the files and directories written, on the
+  // filesystem shared by |storage_dir_| and |tmp_dir_|.
+  const int fd(open(storage_dir_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  PCHECK(fd >= 0) << "open(" << storage_dir_ << ")";
+  PCHECK(syncfs(fd) == 0) << "syncfs(" << storage_dir_ << ")";
+  PCHECK(close(fd) == 0) << "close(" << storage_dir_ << ")";
+#else
+  sync();
+#endif
 }
 
 
@@ -2,9 +2,12 @@
 #define CERT_TRANS_LOG_FILE_STORAGE_H_
 
 #include <stdint.h>
+#include <functional>
 #include <memory>
 #include <set>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "base/macros.h"
 #include "util/status.h"
@@ -40,6 +43,11 @@ class FilesystemOps;
 // <root>/tmp     - Temporary storage for atomicity. Must be on the
 //                  same filesystem as <root>/storage.
 //
+// With --file_storage_sync, writes are durable once they return: the
+// temporary files are synced before being renamed into place, and the
+// renames after that. CreateEntries() shares these syncs among all
+// the entries of a batch.
+//
 // FileStorage aborts upon any FilesystemOps error. This class is
 // threadsafe.
 class FileStorage {
@@ -51,34 +59,54 @@ class FileStorage {
               cert_trans::FilesystemOps* file_op);
   ~FileStorage();
 
+  typedef std::function<void(const std::string& key)> ScanCallback;
+
   // Scan the entire database and return the list of keys.
   std::set<std::string> Scan() const;
 
+  // Calls |callback| with every key of the database, in no particular
+  // order, without keeping them in memory. The top-level directories
+  // are scanned by up to |num_threads| threads, which call |callback|
+  // concurrently.
+  void Scan(const ScanCallback& callback, int num_threads) const;
+
   // Write (key, data) unless an entry matching |key| already exists.
   util::Status CreateEntry(const std::string& key, const std::string& data);
 
+  // Write a batch of (key, data) entries, none of which may exist yet
+  // (nothing is written otherwise).
+  util::Status CreateEntries(
+      const std::vector<std::pair<std::string, std::string>>& entries);
+
   // Update an existing entry; fail if it doesn't already exist.
   util::Status UpdateEntry(const std::string& key, const std::string& data);
 
   // Lookup entry based on key.
   util::Status LookupEntry(const std::string& key, std::string* result) const;
 
+  // Looks up the entries of |keys| in order, stopping at the first
+  // missing one, and returns how many were found. Their data is read
+  // into |results| as a single IoBatch.
+  size_t LookupEntries(const std::vector<std::string>& keys,
+                       std::vector<std::string>* results) const;
+
  private:
   std::string StoragePathBasename(const std::string& hex) const;
   std::string StoragePathComponent(const std::string& hex, int n) const;
   std::string StoragePath(const std::string& key) const;
-  std::string StorageKey(const std::string& storage_path) const;
   // Write or overwrite.
-  void WriteStorageEntry(const std::string& key, const std::string& data);
-  void ScanFiles(const std::string& dir_path,
-                 std::set<std::string>* keys) const;
+  void WriteStorageEntries(
+      const std::vector<std::pair<std::string, std::string>>& entries);
+  // |hex_prefix| is the hex key of |dir_path|, which is complete if
+  // one of its components was "-".
   void ScanDir(const std::string& dir_path, int depth,
-               std::set<std::string>* keys) const;
+               const std::string& hex_prefix, bool prefix_complete,
+               const ScanCallback& callback) const;
 
   // The following methods abort upon any error.
   bool FileExists(const std::string& file_path) const;
-  void AtomicWriteBinaryFile(const std::string& file_path,
-                             const std::string& data);
+  // Makes the writes so far durable, with --file_storage_sync.
+  void SyncWrites() const;
   // Create directory, unless it already exists.
   void CreateMissingDirectory(const std::string& dir_path);
 
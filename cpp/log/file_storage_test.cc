@@ -1,11 +1,15 @@
 #include <errno.h>
+#include <gflags/gflags.h>
 #include <gtest/gtest.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <iostream>
+#include <mutex>
 #include <set>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "log/file_storage.h"
 #include "log/filesystem_ops.h"
@@ -14,9 +18,14 @@
 #include "util/testing.h"
 #include "util/util.h"
 
+DECLARE_bool(file_storage_sync);
+
 using cert_trans::FailingFilesystemOps;
 using cert_trans::FileStorage;
+using std::make_pair;
+using std::pair;
 using std::string;
+using std::vector;
 using util::testing::StatusIs;
 
 namespace {
@@ -73,6 +82,32 @@ TEST_F(BasicFileStorageTest, Scan) {
   EXPECT_EQ(keys, scan_keys);
 }
 
+TEST_F(BasicFileStorageTest, ScanCallback) {
+  std::set<string> keys;
+  // Keys shorter than the storage depth are stored under "-".
+  keys.insert(string("", 0));
+  keys.insert(string("1", 1));
+  for (int i = 0; i < 100; ++i) {
+    keys.insert("key" + std::to_string(i));
+  }
+  for (const auto& key : keys) {
+    EXPECT_OK(fs()->CreateEntry(key, "value"));
+  }
+
+  for (int num_threads : {1, 4}) {
+    std::mutex lock;
+    std::set<string> scan_keys;
+    fs()->Scan(
+        [&lock, &scan_keys](const string& key) {
+          std::lock_guard<std::mutex> guard(lock);
+          EXPECT_TRUE(scan_keys.insert(key).second);
+        },
+        num_threads);
+    EXPECT_EQ(keys, scan_keys) << num_threads;
+  }
+  EXPECT_EQ(keys, fs()->Scan());
+}
+
 TEST_F(BasicFileStorageTest, CreateDuplicate) {
   string key("1234xyzw", 8);
   string value("unicorn", 7);
@@ -94,6 +129,45 @@ TEST_F(BasicFileStorageTest, CreateDuplicate) {
   EXPECT_EQ(value, lookup_result);
 }
 
+TEST_F(BasicFileStorageTest, CreateEntries) {
+  FLAGS_file_storage_sync = true;
+  const vector<pair<string, string>> entries{make_pair("1234xyzw", "unicorn"),
+                                             make_pair("1245abcd", "Alice")};
+  EXPECT_OK(fs()->CreateEntries(entries));
+  string lookup_result;
+  for (const auto& entry : entries) {
+    EXPECT_OK(fs()->LookupEntry(entry.first, &lookup_result));
+    EXPECT_EQ(entry.second, lookup_result);
+  }
+
+  // Nothing is written if one of the entries exists.
+  EXPECT_THAT(fs()->CreateEntries({make_pair("1256efgh", "Bob"), entries[0]}),
+              StatusIs(util::error::ALREADY_EXISTS));
+  EXPECT_THAT(fs()->LookupEntry("1256efgh", NULL),
+              StatusIs(util::error::NOT_FOUND));
+
+  // Or if a key is there twice.
+  EXPECT_THAT(fs()->CreateEntries({make_pair("1256efgh", "Bob"),
+                                   make_pair("1256efgh", "Bob")}),
+              StatusIs(util::error::ALREADY_EXISTS));
+  EXPECT_THAT(fs()->LookupEntry("1256efgh", NULL),
+              StatusIs(util::error::NOT_FOUND));
+  FLAGS_file_storage_sync = false;
+}
+
+TEST_F(BasicFileStorageTest, LookupEntries) {
+  EXPECT_OK(fs()->CreateEntries({make_pair("0", "zero"), make_pair("1", ""),
+                                 make_pair("2", "two"),
+                                 make_pair("4", "four")}));
+
+  vector<string> results;
+  EXPECT_EQ(3U, fs()->LookupEntries({"0", "1", "2", "3", "4"}, &results));
+  EXPECT_EQ((vector<string>{"zero", "", "two"}), results);
+
+  EXPECT_EQ(0U, fs()->LookupEntries({"3", "4"}, &results));
+  EXPECT_TRUE(results.empty());
+}
+
 TEST_F(BasicFileStorageTest, Update) {
   string key("1234xyzw", 8);
   string value("unicorn", 7);
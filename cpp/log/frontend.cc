@@ -9,6 +9,7 @@
 #include "monitoring/event_metric.h"
 #include "proto/ct.pb.h"
 #include "util/status.h"
+#include "util/task.h"
 
 using cert_trans::CertChain;
 using cert_trans::PreCertChain;
@@ -18,6 +19,7 @@ using std::string;
 using std::lock_guard;
 using std::mutex;
 using util::Status;
+using util::Task;
 
 namespace {
 
@@ -55,3 +57,19 @@ Status Frontend::QueueProcessedEntry(Status pre_status, const LogEntry& entry,
   // Step 2. Submit to database.
   return UpdateStats(entry.type(), signer_->QueueEntry(entry, sct));
 }
+
+void Frontend::QueueProcessedEntry(Status pre_status, const LogEntry& entry,
+                                   SignedCertificateTimestamp* sct,
+                                   Task* task) {
+  CHECK(entry.has_type());
+  CHECK_NOTNULL(task);
+  if (!pre_status.ok()) {
+    task->Return(UpdateStats(entry.type(), pre_status));
+    return;
+  }
+
+  const ct::LogEntryType type(entry.type());
+  signer_->QueueEntry(entry, sct, task->AddChild([type, task](Task* child) {
+    task->Return(UpdateStats(type, child->status()));
+  }));
+}
@@ -12,6 +12,7 @@ class FrontendSigner;
 
 namespace util {
 class Status;
+class Task;
 }  // namespace util
 
 // Frontend for accepting new submissions.
@@ -25,6 +26,12 @@ class Frontend {
                                    const ct::LogEntry& entry,
                                    ct::SignedCertificateTimestamp* sct);
 
+  // Same as above, but returns |task| with the status once done, rather
+  // than blocking. |sct| must remain valid until then.
+  void QueueProcessedEntry(util::Status pre_status, const ct::LogEntry& entry,
+                           ct::SignedCertificateTimestamp* sct,
+                           util::Task* task);
+
  private:
   const std::unique_ptr<FrontendSigner> signer_;
 
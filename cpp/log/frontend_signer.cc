@@ -1,34 +1,144 @@
 /* -*- indent-tabs-mode: nil -*- */
 #include "log/frontend_signer.h"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <chrono>
 
 #include "log/database.h"
 #include "log/log_signer.h"
+#include "log/merge_delay.h"
+#include "log/submission_journal.h"
 #include "merkletree/serial_hasher.h"
 #include "proto/ct.pb.h"
 #include "proto/serializer.h"
 #include "util/status.h"
+#include "util/task.h"
 #include "util/util.h"
 
 using cert_trans::ConsistentStore;
 using cert_trans::Database;
 using cert_trans::LoggedEntry;
+using cert_trans::MergeDelayRecorder;
+using cert_trans::SubmissionJournal;
 using ct::LogEntry;
 using ct::SignedCertificateTimestamp;
+using std::chrono::milliseconds;
+using std::mutex;
 using std::string;
+using std::unique_lock;
+using std::vector;
 using util::Status;
+using util::Task;
+
+DEFINE_int32(frontend_batch_window_ms, 0,
+             "If positive, new entries submitted within this many "
+             "milliseconds of each other are written to the consistent store "
+             "together, rather than one at a time.");
+DEFINE_int32(frontend_max_batch_size, 100,
+             "Maximum number of new entries written to the consistent store "
+             "together.");
+
+namespace {
+
+
+void RecordPending(const LoggedEntry& entry) {
+  MergeDelayRecorder recorder("pending");
+  recorder.Add(entry);
+  recorder.Record();
+}
+
+
+}  // namespace
+
+
+struct FrontendSigner::PendingAdd {
+  explicit PendingAdd(LoggedEntry* e) : entry(e), done(false) {
+  }
+
+  LoggedEntry* const entry;
+  Status status;
+  bool done;
+};
 
 
 FrontendSigner::FrontendSigner(Database* db, ConsistentStore* store,
-                               LogSigner* signer)
+                               LogSigner* signer, SubmissionJournal* journal)
     : db_(CHECK_NOTNULL(db)),
       store_(CHECK_NOTNULL(store)),
-      signer_(CHECK_NOTNULL(signer)) {
+      signer_(CHECK_NOTNULL(signer)),
+      journal_(journal),
+      collecting_batch_(false) {
 }
 
 Status FrontendSigner::QueueEntry(const LogEntry& entry,
                                   SignedCertificateTimestamp* sct) {
+  cert_trans::LoggedEntry new_logged;
+  util::Status status(PrepareEntry(entry, sct, &new_logged));
+  if (!status.ok()) {
+    return status;
+  }
+  const string sha256_hash(new_logged.Hash());
+
+  // If this cert has already been added (but not yet integrated into the
+  // tree), then this call will update new_logged.sct with the previously
+  // issued one.
+  status = AddPendingEntry(&new_logged);
+  CHECK_EQ(new_logged.Hash(), sha256_hash);
+  if (status.ok()) {
+    RecordPending(new_logged);
+  }
+
+  if (sct != nullptr) {
+    *sct = new_logged.sct();
+  }
+
+  return status;
+}
+
+
+void FrontendSigner::QueueEntry(const LogEntry& entry,
+                                SignedCertificateTimestamp* sct, Task* task) {
+  CHECK_NOTNULL(task);
+  LoggedEntry* const new_logged(new LoggedEntry);
+  task->DeleteWhenDone(new_logged);
+  const Status status(PrepareEntry(entry, sct, new_logged));
+  if (!status.ok()) {
+    task->Return(status);
+    return;
+  }
+
+  // The batches are collected by blocking, and the journal waits for
+  // the disk, fall back to that.
+  if (FLAGS_frontend_batch_window_ms > 0 || journal_) {
+    const Status add_status(AddPendingEntry(new_logged));
+    if (add_status.ok()) {
+      RecordPending(*new_logged);
+    }
+    if (sct != nullptr) {
+      *sct = new_logged->sct();
+    }
+    task->Return(add_status);
+    return;
+  }
+
+  store_->AddPendingEntry(new_logged, task->AddChild([new_logged, sct,
+                                                      task](Task* child_task) {
+    if (child_task->status().ok()) {
+      RecordPending(*new_logged);
+    }
+    // As above, this may be the SCT of an earlier submission.
+    if (sct != nullptr) {
+      *sct = new_logged->sct();
+    }
+    task->Return(child_task->status());
+  }));
+}
+
+
+Status FrontendSigner::PrepareEntry(const LogEntry& entry,
+                                    SignedCertificateTimestamp* sct,
+                                    LoggedEntry* new_logged) const {
   const string sha256_hash(
       Sha256Hasher::Sha256Digest(Serializer::LeafData(entry)));
   CHECK(!sha256_hash.empty());
@@ -56,22 +166,63 @@ Status FrontendSigner::QueueEntry(const LogEntry& entry,
   SignedCertificateTimestamp local_sct;
   TimestampAndSign(entry, &local_sct);
 
-  cert_trans::LoggedEntry new_logged;
-  new_logged.mutable_sct()->CopyFrom(local_sct);
-  new_logged.mutable_entry()->CopyFrom(entry);
-  CHECK_EQ(new_logged.Hash(), sha256_hash);
+  new_logged->mutable_sct()->CopyFrom(local_sct);
+  new_logged->mutable_entry()->CopyFrom(entry);
+  CHECK_EQ(new_logged->Hash(), sha256_hash);
+  return Status::OK;
+}
 
-  // If this cert has already been added (but not yet integrated into the
-  // tree), then this call will update new_logged.sct with the previously
-  // issued one.
-  util::Status status(store_->AddPendingEntry(&new_logged));
-  CHECK_EQ(new_logged.Hash(), sha256_hash);
 
-  if (sct != nullptr) {
-    *sct = new_logged.sct();
+Status FrontendSigner::AddPendingEntry(LoggedEntry* entry) {
+  if (journal_) {
+    return journal_->Append(entry);
+  }
+  if (FLAGS_frontend_batch_window_ms <= 0) {
+    return store_->AddPendingEntry(entry);
   }
 
-  return status;
+  PendingAdd add(entry);
+  unique_lock<mutex> lock(mutex_);
+  batch_.push_back(&add);
+  if (collecting_batch_) {
+    // Someone else will write it for us.
+    if (batch_.size() >= static_cast<size_t>(FLAGS_frontend_max_batch_size)) {
+      batch_cv_.notify_all();
+    }
+    batch_cv_.wait(lock, [&add]() { return add.done; });
+    return add.status;
+  }
+
+  // We're first, wait a little for others to join in.
+  collecting_batch_ = true;
+  batch_cv_.wait_for(lock, milliseconds(FLAGS_frontend_batch_window_ms),
+                     [this]() {
+                       return batch_.size() >=
+                              static_cast<size_t>(
+                                  FLAGS_frontend_max_batch_size);
+                     });
+  vector<PendingAdd*> batch;
+  batch.swap(batch_);
+  // Callers arriving from now on start the next batch, which can be
+  // written at the same time as this one.
+  collecting_batch_ = false;
+  lock.unlock();
+
+  vector<LoggedEntry*> entries;
+  for (const PendingAdd* const pending : batch) {
+    entries.push_back(pending->entry);
+  }
+  const vector<Status> statuses(store_->AddPendingEntries(entries));
+  CHECK_EQ(batch.size(), statuses.size());
+
+  lock.lock();
+  for (size_t i = 0; i < batch.size(); ++i) {
+    batch[i]->status = statuses[i];
+    batch[i]->done = true;
+  }
+  lock.unlock();
+  batch_cv_.notify_all();
+  return add.status;
 }
 
 
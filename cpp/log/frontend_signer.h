@@ -2,7 +2,10 @@
 #define CERT_TRANS_LOG_FRONTEND_SIGNER_H_
 
 #include <stdint.h>
+#include <condition_variable>
+#include <mutex>
 #include <string>
+#include <vector>
 
 #include "base/macros.h"
 #include "log/consistent_store.h"
@@ -12,18 +15,24 @@ class LogSigner;
 
 namespace util {
 class Status;
+class Task;
 }  // namespace util
 
 namespace cert_trans {
 class Database;
+class SubmissionJournal;
 }  // namespace cert_trans
 
 
 class FrontendSigner {
  public:
-  // Does not take ownership of |db|, |store| or |signer|.
+  // Does not take ownership of |db|, |store|, |signer| or |journal|.
+  // If |journal| is not NULL, the new entries are appended to it (and
+  // their SCT returned once they are durable there), rather than added
+  // to |store| directly.
   FrontendSigner(cert_trans::Database* db, cert_trans::ConsistentStore* store,
-                 LogSigner* signer);
+                 LogSigner* signer,
+                 cert_trans::SubmissionJournal* journal = nullptr);
 
   // Log the entry if it's not already in the database,
   // and return either a new timestamp-signature pair,
@@ -32,13 +41,44 @@ class FrontendSigner {
   util::Status QueueEntry(const ct::LogEntry& entry,
                           ct::SignedCertificateTimestamp* sct);
 
+  // Same as above, but returns |task| with the status once done, rather
+  // than blocking the calling thread until the entry is in the
+  // consistent store. |sct| must remain valid until then. This still
+  // blocks when batching entries (see --frontend_batch_window_ms), or
+  // on the journal.
+  void QueueEntry(const ct::LogEntry& entry,
+                  ct::SignedCertificateTimestamp* sct, util::Task* task);
+
  private:
+  struct PendingAdd;
+
+  // Looks up |entry| in the database, returning ALREADY_EXISTS (and the
+  // SCT issued for it in |sct|) if it is there. Otherwise, fills in
+  // |new_logged| with it and a new SCT, for adding to the consistent
+  // store.
+  util::Status PrepareEntry(const ct::LogEntry& entry,
+                            ct::SignedCertificateTimestamp* sct,
+                            cert_trans::LoggedEntry* new_logged) const;
+
   void TimestampAndSign(const ct::LogEntry& entry,
                         ct::SignedCertificateTimestamp* sct) const;
 
+  // Adds |entry| to the journal, if any, or to the consistent store.
+  // With --frontend_batch_window_ms set, the entries of concurrent
+  // callers are written to the latter together.
+  util::Status AddPendingEntry(cert_trans::LoggedEntry* entry);
+
   cert_trans::Database* const db_;
   cert_trans::ConsistentStore* const store_;
   LogSigner* const signer_;
+  cert_trans::SubmissionJournal* const journal_;
+
+  std::mutex mutex_;
+  std::condition_variable batch_cv_;
+  // The entries waiting to be written with the next batch.
+  std::vector<PendingAdd*> batch_;
+  // Whether a caller is waiting to write |batch_|.
+  bool collecting_batch_;
 
   DISALLOW_COPY_AND_ASSIGN(FrontendSigner);
 };
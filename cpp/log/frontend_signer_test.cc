@@ -1,9 +1,12 @@
 /* -*- indent-tabs-mode: nil -*- */
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 #include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "log/etcd_consistent_store.h"
 #include "log/file_db.h"
@@ -23,10 +26,13 @@
 #include "util/mock_masterelection.h"
 #include "util/status.h"
 #include "util/status_test_util.h"
+#include "util/sync_task.h"
 #include "util/testing.h"
 #include "util/thread_pool.h"
 #include "util/util.h"
 
+DECLARE_int32(frontend_batch_window_ms);
+
 namespace {
 
 namespace libevent = cert_trans::libevent;
@@ -46,6 +52,7 @@ using ct::SignedCertificateTimestamp;
 using std::make_shared;
 using std::shared_ptr;
 using std::string;
+using std::thread;
 using std::unique_ptr;
 using std::vector;
 using testing::NiceMock;
@@ -168,6 +175,28 @@ TYPED_TEST(FrontendSignerTest, LogDuplicates) {
   EXPECT_EQ(sct0.timestamp(), sct1.timestamp());
 }
 
+TYPED_TEST(FrontendSignerTest, LogWithoutBlocking) {
+  LogEntry entry;
+  this->test_signer_.CreateUnique(&entry);
+
+  SignedCertificateTimestamp sct0, sct1;
+  util::SyncTask task0(&this->pool_);
+  this->frontend_.QueueEntry(entry, &sct0, task0.task());
+  task0.Wait();
+  EXPECT_OK(task0.status());
+  EXPECT_EQ(LogVerifier::VERIFY_OK,
+            this->verifier_.VerifySignedCertificateTimestamp(entry, sct0));
+
+  // Wait for time to change.
+  usleep(2000);
+  // Try to log again, getting the SCT of the pending entry.
+  util::SyncTask task1(&this->pool_);
+  this->frontend_.QueueEntry(entry, &sct1, task1.task());
+  task1.Wait();
+  EXPECT_THAT(task1.status(), StatusIs(util::error::ALREADY_EXISTS, _));
+  EXPECT_EQ(sct0.timestamp(), sct1.timestamp());
+}
+
 TYPED_TEST(FrontendSignerTest, LogDuplicatesDifferentChain) {
   LogEntry entry0, entry1;
   this->test_signer_.CreateUnique(&entry0);
@@ -194,6 +223,46 @@ TYPED_TEST(FrontendSignerTest, LogDuplicatesDifferentChain) {
   EXPECT_EQ(sct0.timestamp(), sct1.timestamp());
 }
 
+TYPED_TEST(FrontendSignerTest, LogConcurrentlyInBatches) {
+  FLAGS_frontend_batch_window_ms = 50;
+  const int kNumEntries(10);
+  vector<LogEntry> entries(kNumEntries);
+  for (auto& entry : entries) {
+    this->test_signer_.CreateUnique(&entry);
+  }
+  // Submit the first one twice.
+  entries.push_back(entries[0]);
+
+  vector<SignedCertificateTimestamp> scts(entries.size());
+  vector<util::Status> statuses(entries.size());
+  vector<thread> threads;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    threads.emplace_back([this, &entries, &scts, &statuses, i]() {
+      statuses[i] = this->frontend_.QueueEntry(entries[i], &scts[i]);
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  FLAGS_frontend_batch_window_ms = 0;
+
+  // One of the two submissions of the first entry got there first.
+  EXPECT_NE(statuses[0].ok(), statuses[kNumEntries].ok());
+  EXPECT_EQ(scts[0].timestamp(), scts[kNumEntries].timestamp());
+  for (int i = 0; i < kNumEntries; ++i) {
+    if (i > 0) {
+      EXPECT_OK(statuses[i]);
+    }
+    EXPECT_EQ(LogVerifier::VERIFY_OK,
+              this->verifier_.VerifySignedCertificateTimestamp(entries[i],
+                                                               scts[i]));
+    EntryHandle<LoggedEntry> entry_handle;
+    EXPECT_OK(this->store_.GetPendingEntryForHash(
+        Sha256Hasher::Sha256Digest(Serializer::LeafData(entries[i])),
+        &entry_handle));
+  }
+}
+
 TYPED_TEST(FrontendSignerTest, Verify) {
   LogEntry entry0, entry1;
   this->test_signer_.CreateUnique(&entry0);
@@ -0,0 +1,143 @@
+#include "log/leaf_hasher.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "merkletree/tree_hasher.h"
+#include "util/thread_pool.h"
+
+using std::atomic;
+using std::condition_variable;
+using std::lock_guard;
+using std::make_shared;
+using std::min;
+using std::mutex;
+using std::shared_ptr;
+using std::string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+
+// Number of entries hashed by a thread every time it picks up work.
+const size_t kChunkSize = 256;
+
+
+}  // namespace
+
+
+// The work for one HashLeaves() call, shared by all the threads that
+// take part in it. Helpers from the pool might only start running
+// after all the work is done (and HashLeaves() has returned), so they
+// hold a reference to it, but they only touch the entries (and the
+// hasher) if there are chunks left, which means it has not returned.
+class LeafHasher::Job {
+ public:
+  Job(const SerialHasher* hasher, const vector<LoggedEntry>* entries,
+      vector<Digest>* hashes)
+      : hasher_(CHECK_NOTNULL(hasher)),
+        entries_(CHECK_NOTNULL(entries)),
+        hashes_(CHECK_NOTNULL(hashes)),
+        num_chunks_((entries_->size() + kChunkSize - 1) / kChunkSize),
+        next_chunk_(0),
+        done_chunks_(0) {
+  }
+
+  size_t num_chunks() const {
+    return num_chunks_;
+  }
+
+  // Hashes chunks until there are none left.
+  void Run() {
+    unique_ptr<TreeHasher> tree_hasher;
+    vector<string> serialized;
+    vector<const uint8_t*> data;
+    vector<size_t> sizes;
+    for (size_t chunk = next_chunk_++; chunk < num_chunks_;
+         chunk = next_chunk_++) {
+      if (!tree_hasher) {
+        tree_hasher.reset(new TreeHasher(hasher_->Create()));
+      }
+
+      const size_t begin(chunk * kChunkSize);
+      const size_t count(min(entries_->size(), begin + kChunkSize) - begin);
+      serialized.resize(count);
+      data.resize(count);
+      sizes.resize(count);
+      for (size_t i = 0; i < count; ++i) {
+        CHECK((*entries_)[begin + i].SerializeForLeaf(&serialized[i]));
+        data[i] = reinterpret_cast<const uint8_t*>(serialized[i].data());
+        sizes[i] = serialized[i].size();
+      }
+      tree_hasher->HashLeaves(count, data.data(), sizes.data(),
+                              &(*hashes_)[begin]);
+
+      lock_guard<mutex> lock(lock_);
+      if (++done_chunks_ == num_chunks_) {
+        done_.notify_all();
+      }
+    }
+  }
+
+  // Blocks until all the chunks have been hashed.
+  void Wait() {
+    unique_lock<mutex> lock(lock_);
+    done_.wait(lock, [this]() { return done_chunks_ == num_chunks_; });
+  }
+
+ private:
+  const SerialHasher* const hasher_;
+  const vector<LoggedEntry>* const entries_;
+  vector<Digest>* const hashes_;
+  const size_t num_chunks_;
+  atomic<size_t> next_chunk_;
+
+  mutex lock_;
+  condition_variable done_;
+  size_t done_chunks_;
+
+  DISALLOW_COPY_AND_ASSIGN(Job);
+};
+
+
+LeafHasher::LeafHasher(unique_ptr<SerialHasher> hasher, ThreadPool* pool)
+    : hasher_(move(hasher)), pool_(pool) {
+  CHECK(hasher_);
+  CHECK_EQ(Digest::kSize, hasher_->DigestSize());
+}
+
+
+LeafHasher::~LeafHasher() {
+}
+
+
+vector<Digest> LeafHasher::HashLeaves(
+    const vector<LoggedEntry>& entries) const {
+  vector<Digest> hashes(entries.size());
+  const shared_ptr<Job> job(make_shared<Job>(hasher_.get(), &entries,
+                                             &hashes));
+
+  if (pool_) {
+    const size_t num_helpers(
+        min<size_t>(job->num_chunks(), std::thread::hardware_concurrency()));
+    // The calling thread is one of them.
+    for (size_t i = 1; i < num_helpers; ++i) {
+      pool_->Add([job]() { job->Run(); });
+    }
+  }
+
+  job->Run();
+  job->Wait();
+
+  return hashes;
+}
+
+
+}  // namespace cert_trans
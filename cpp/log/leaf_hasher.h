@@ -0,0 +1,48 @@
+#ifndef CERT_TRANS_LOG_LEAF_HASHER_H_
+#define CERT_TRANS_LOG_LEAF_HASHER_H_
+
+#include <memory>
+#include <vector>
+
+#include "base/macros.h"
+#include "log/logged_entry.h"
+#include "merkletree/digest.h"
+#include "merkletree/serial_hasher.h"
+
+namespace cert_trans {
+
+class ThreadPool;
+
+
+// Serializes log entries and computes their Merkle tree leaf hashes,
+// spreading the work over a thread pool in chunks of entries (each
+// with its own hasher), so that catching up with a lot of entries is
+// not bound by a single core.
+class LeafHasher {
+ public:
+  // Does not take ownership of |pool|, which can be NULL, in which
+  // case all the work is done on the calling thread. |hasher| is only
+  // used to create the hashers of the chunks.
+  LeafHasher(std::unique_ptr<SerialHasher> hasher, ThreadPool* pool);
+  ~LeafHasher();
+
+  // Returns the leaf hashes of |entries|, in the same order. The
+  // calling thread takes part in the work (and does all of it if the
+  // pool is busy), so this can safely be called from a thread of the
+  // pool itself.
+  std::vector<Digest> HashLeaves(
+      const std::vector<LoggedEntry>& entries) const;
+
+ private:
+  class Job;
+
+  const std::unique_ptr<SerialHasher> hasher_;
+  ThreadPool* const pool_;
+
+  DISALLOW_COPY_AND_ASSIGN(LeafHasher);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_LEAF_HASHER_H_
@@ -0,0 +1,83 @@
+#include "log/leaf_hasher.h"
+
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "log/logged_entry.h"
+#include "merkletree/serial_hasher.h"
+#include "merkletree/tree_hasher.h"
+#include "proto/cert_serializer.h"
+#include "util/testing.h"
+#include "util/thread_pool.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+
+class LeafHasherTest : public ::testing::Test {
+ protected:
+  LeafHasherTest() : pool_(3), tree_hasher_(unique_ptr<Sha256Hasher>(
+                                   new Sha256Hasher)) {
+  }
+
+  vector<LoggedEntry> RandomEntries(int count) const {
+    vector<LoggedEntry> entries(count);
+    for (auto& entry : entries) {
+      entry.RandomForTest();
+    }
+    return entries;
+  }
+
+  vector<Digest> Expected(const vector<LoggedEntry>& entries) const {
+    vector<Digest> hashes;
+    for (const auto& entry : entries) {
+      string serialized;
+      CHECK(entry.SerializeForLeaf(&serialized));
+      hashes.push_back(Digest(tree_hasher_.HashLeaf(serialized)));
+    }
+    return hashes;
+  }
+
+  ThreadPool pool_;
+  const TreeHasher tree_hasher_;
+};
+
+
+TEST_F(LeafHasherTest, Empty) {
+  LeafHasher hasher(unique_ptr<Sha256Hasher>(new Sha256Hasher), &pool_);
+  EXPECT_TRUE(hasher.HashLeaves(vector<LoggedEntry>()).empty());
+}
+
+
+TEST_F(LeafHasherTest, WithoutPool) {
+  LeafHasher hasher(unique_ptr<Sha256Hasher>(new Sha256Hasher), NULL);
+  const vector<LoggedEntry> entries(RandomEntries(300));
+  EXPECT_EQ(Expected(entries), hasher.HashLeaves(entries));
+}
+
+
+TEST_F(LeafHasherTest, WithPool) {
+  LeafHasher hasher(unique_ptr<Sha256Hasher>(new Sha256Hasher), &pool_);
+  // A few sizes around the chunk size.
+  for (int count : {1, 255, 256, 257, 1000}) {
+    const vector<LoggedEntry> entries(RandomEntries(count));
+    EXPECT_EQ(Expected(entries), hasher.HashLeaves(entries)) << count;
+  }
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  ConfigureSerializerForV1CT();
+  return RUN_ALL_TESTS();
+}
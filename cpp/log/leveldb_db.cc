@@ -2,30 +2,79 @@
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <leveldb/cache.h>
+#include <leveldb/write_batch.h>
 #include <stdint.h>
+#include <time.h>
+#include <algorithm>
 #include <map>
+#include <sstream>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
+#include "base/notification.h"
 #include "monitoring/latency.h"
 #include "monitoring/monitoring.h"
 #include "proto/ct.pb.h"
 #include "proto/serializer.h"
+#include "util/thread_pool.h"
 #include "util/util.h"
 
 using cert_trans::serialization::DeserializeResult;
+using google::RegisterFlagValidator;
 using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::istringstream;
 using std::lock_guard;
 using std::make_pair;
+using std::map;
 using std::min;
 using std::mutex;
+using std::pair;
 using std::string;
+using std::thread;
 using std::unique_lock;
 using std::unique_ptr;
+using std::unordered_map;
+using std::unordered_set;
+using std::vector;
 
 DEFINE_int32(leveldb_max_open_files, 0,
              "number of open files that can be used by leveldb");
 DEFINE_int32(leveldb_bloom_filter_bits_per_key, 0,
              "number of open files that can be used by leveldb");
+DEFINE_int32(leveldb_block_cache_size_mb, 0,
+             "size of the leveldb cache of uncompressed blocks, in MB (0 "
+             "to use the leveldb default)");
+DEFINE_int32(leveldb_write_buffer_size_mb, 0,
+             "amount of data to build up in memory before writing it out "
+             "to disk, in MB (0 to use the leveldb default)");
+DEFINE_int32(leveldb_block_size_kb, 0,
+             "approximate size of the data blocks of leveldb, in kB (0 to "
+             "use the leveldb default)");
+DEFINE_bool(leveldb_compression, true,
+            "whether leveldb should compress its blocks with Snappy");
+DEFINE_int32(leveldb_stats_interval_seconds, 60,
+             "how often to export the compaction stats of leveldb as "
+             "metrics (0 to never)");
+DEFINE_string(leveldb_compaction_hours, "",
+              "hours of the day (UTC) during which to compact the cold "
+              "entries, as <first>-<last>, e.g. \"2-4\" for 02:00 to "
+              "04:59 (empty to leave all compactions to leveldb)");
+DEFINE_int32(leveldb_compaction_hot_entries, 1000000,
+             "number of the latest entries which are not compacted "
+             "during the compaction hours, as they still change levels "
+             "often");
+DEFINE_int32(leveldb_compaction_batch_entries, 100000,
+             "number of entries compacted at once during the compaction "
+             "hours");
+DEFINE_int32(leveldb_hash_filter_bits_per_entry, 0,
+             "size of the in-memory Bloom filter of the hash index, in "
+             "bits per entry (0 for none), which saves a disk read when "
+             "looking up a hash that is not in the log (10 bits per entry "
+             "give about 1% false positives)");
 
 namespace cert_trans {
 namespace {
@@ -34,12 +83,95 @@ namespace {
 static Latency<milliseconds, string> latency_by_op_ms(
     "leveldb_latency_by_operation_ms", "operation",
     "Database latency in ms broken out by operation.");
+static Gauge<>* block_cache_usage_bytes(
+    Gauge<>::New("leveldb_block_cache_usage_bytes",
+                 "Amount of data in the leveldb cache of uncompressed "
+                 "blocks."));
+static Gauge<>* block_cache_capacity_bytes(
+    Gauge<>::New("leveldb_block_cache_capacity_bytes",
+                 "Capacity of the leveldb cache of uncompressed blocks "
+                 "(if not the default)."));
+static Gauge<int>* level_files(
+    Gauge<int>::New("leveldb_level_files", "level",
+                    "Number of table files of leveldb, by level."));
+static Gauge<int>* level_size_mb(
+    Gauge<int>::New("leveldb_level_size_mb", "level",
+                    "Size of the table files of leveldb, by level."));
+static Gauge<int>* compaction_seconds(
+    Gauge<int>::New("leveldb_compaction_seconds", "level",
+                    "Time spent by leveldb compacting into each level, "
+                    "since the database was opened."));
+static Gauge<int>* compaction_read_mb(
+    Gauge<int>::New("leveldb_compaction_read_mb", "level",
+                    "Amount of data read by leveldb compacting into each "
+                    "level, since the database was opened."));
+static Gauge<int>* compaction_written_mb(
+    Gauge<int>::New("leveldb_compaction_written_mb", "level",
+                    "Amount of data written by leveldb compacting into "
+                    "each level, since the database was opened."));
+static Gauge<>* compacted_entries(
+    Gauge<>::New("leveldb_compacted_entries",
+                 "Number of the first entries compacted during the "
+                 "compaction hours."));
+static Counter<string>* hash_filter_lookups(
+    Counter<string>::New("leveldb_hash_filter_lookups", "result",
+                         "Lookups of the hash index which were answered "
+                         "by its Bloom filter (negative) or went to the "
+                         "index for nothing (false_positive)."));
 
 
 const char kMetaNodeIdKey[] = "metadata";
+const char kMetaContiguousSizeKey[] = "contiguous_size";
+const char kMetaTreeFrontierKey[] = "tree_frontier";
+const char kMetaCompactedSizeKey[] = "compacted_size";
 const char kEntryPrefix[] = "entry-";
 const char kTreeHeadPrefix[] = "sth-";
 const char kMetaPrefix[] = "meta-";
+const char kHashPrefix[] = "hash-";
+const char kChainCertPrefix[] = "chaincert-";
+
+const int64_t kMigrationBatchSize = 10000;
+
+
+// Returns false if |hours| is not of the form <first>-<last>.
+bool ParseCompactionHours(const string& hours, int* first, int* last) {
+  istringstream in(hours);
+  char dash;
+  return in >> *first >> dash >> *last && in.eof() && dash == '-' &&
+         *first >= 0 && *first < 24 && *last >= 0 && *last < 24;
+}
+
+
+bool ValidateCompactionHours(const char* flagname, const string& hours) {
+  int first, last;
+  if (!hours.empty() && !ParseCompactionHours(hours, &first, &last)) {
+    LOG(ERROR) << "--" << flagname << " must be of the form <first>-<last> "
+               << "(hours from 0 to 23), not \"" << hours << "\"";
+    return false;
+  }
+  return true;
+}
+
+
+static const bool compaction_hours_dummy =
+    RegisterFlagValidator(&FLAGS_leveldb_compaction_hours,
+                          &ValidateCompactionHours);
+
+
+// The last hour can be before the first, for a window spanning
+// midnight.
+bool InCompactionHours() {
+  int first, last;
+  if (!ParseCompactionHours(FLAGS_leveldb_compaction_hours, &first,
+                            &last)) {
+    return false;
+  }
+  const time_t now(time(nullptr));
+  struct tm tm;
+  CHECK_NOTNULL(gmtime_r(&now, &tm));
+  return first <= last ? first <= tm.tm_hour && tm.tm_hour <= last
+                       : first <= tm.tm_hour || tm.tm_hour <= last;
+}
 
 
 #ifdef HAVE_LEVELDB_FILTER_POLICY_H
@@ -56,6 +188,20 @@ unique_ptr<const leveldb::FilterPolicy> BuildFilterPolicy() {
 #endif
 
 
+unique_ptr<leveldb::Cache> BuildBlockCache() {
+  unique_ptr<leveldb::Cache> retval;
+
+  if (FLAGS_leveldb_block_cache_size_mb > 0) {
+    const size_t capacity(static_cast<size_t>(
+                              FLAGS_leveldb_block_cache_size_mb) << 20);
+    retval.reset(CHECK_NOTNULL(leveldb::NewLRUCache(capacity)));
+    block_cache_capacity_bytes->Set(capacity);
+  }
+
+  return retval;
+}
+
+
 // WARNING: Do NOT change the type of "index" from int64_t, or you'll
 // break existing databases!
 string IndexToKey(int64_t index) {
@@ -85,37 +231,139 @@ int64_t KeyToIndex(leveldb::Slice key) {
 }
 
 
+string HashToKey(const string& hash) {
+  return kHashPrefix + hash;
+}
+
+
+string IndexToValue(int64_t index) {
+  CHECK_GE(index, 0);
+  return Serializer::SerializeUint(static_cast<uint64_t>(index),
+                                   sizeof(index));
+}
+
+
+int64_t ValueToIndex(const string& value) {
+  uint64_t index(0);
+  CHECK_EQ(DeserializeResult::OK, Deserializer::DeserializeUint<uint64_t>(
+                                      value, sizeof(index), &index));
+  CHECK_LE(index, static_cast<uint64_t>(INT64_MAX));
+  return index;
+}
+
+
 }  // namespace
 
 
+// Reads the entries in batches of kScanBatchSize, the next batch
+// being read ahead on another thread while the current one is parsed,
+// and without filling the block cache, which a scan would only evict
+// the blocks of the lookups from. The leveldb iterator reads from an
+// implicit snapshot, so the scan sees the entries as they were when it
+// started.
 class LevelDB::Iterator : public Database::Iterator {
  public:
   Iterator(const LevelDB* db, int64_t start_index)
-      : it_(CHECK_NOTNULL(db)->db_->NewIterator(leveldb::ReadOptions())) {
+      : db_(CHECK_NOTNULL(db)),
+        it_(db_->db_->NewIterator(ScanOptions())),
+        next_(0) {
     CHECK(it_);
     it_->Seek(IndexToKey(start_index));
+    // Short scans are common, so the read ahead only starts with the
+    // second batch.
+    ReadBatch(&batch_);
+  }
+
+  ~Iterator() {
+    if (prefetched_) {
+      prefetched_->WaitForNotification();
+    }
   }
 
   bool GetNextEntry(LoggedEntry* entry) override {
-    if (!it_->Valid() || !it_->key().starts_with(kEntryPrefix)) {
-      return false;
+    if (next_ == batch_.size()) {
+      if (batch_.size() < kScanBatchSize) {
+        // That was the last one.
+        return false;
+      }
+      NextBatch();
+      if (batch_.empty()) {
+        return false;
+      }
     }
 
-    const int64_t seq(KeyToIndex(it_->key()));
-    CHECK(entry->ParseFromArray(it_->value().data(), it_->value().size()))
-        << "failed to parse entry for key " << it_->key().ToString();
+    const leveldb::Slice key(batch_[next_].first);
+    const string& value(batch_[next_].second);
+    ++next_;
+    const int64_t seq(KeyToIndex(key));
+    CHECK(entry->ParseFromStorage(value.data(), value.size()))
+        << "failed to parse entry for key " << key.ToString();
+    CHECK(db_->chain_certs_.Restore(db_->load_chain_cert_, entry));
     CHECK(entry->has_sequence_number())
         << "no sequence number for entry with expected sequence number "
         << seq;
     CHECK_EQ(entry->sequence_number(), seq) << "unexpected sequence_number";
 
-    it_->Next();
-
     return true;
   }
 
  private:
+  typedef vector<pair<string, string>> Batch;
+
+  static const size_t kScanBatchSize = 1024;
+
+  static leveldb::ReadOptions ScanOptions() {
+    leveldb::ReadOptions options;
+    options.fill_cache = false;
+    return options;
+  }
+
+  static ThreadPool* ReadAheadPool() {
+    static ThreadPool* const pool(new ThreadPool("leveldb_read_ahead", 2));
+    return pool;
+  }
+
+  // Replaces the contents of |batch| with the next entries, up to
+  // kScanBatchSize of them.
+  void ReadBatch(Batch* batch) {
+    batch->clear();
+    for (; batch->size() < kScanBatchSize && it_->Valid() &&
+           it_->key().starts_with(kEntryPrefix);
+         it_->Next()) {
+      batch->emplace_back(it_->key().ToString(), it_->value().ToString());
+    }
+  }
+
+  // Makes the batch read ahead the current one, and starts reading the
+  // one after it.
+  void NextBatch() {
+    if (prefetched_) {
+      prefetched_->WaitForNotification();
+      batch_.swap(prefetch_);
+    } else {
+      ReadBatch(&batch_);
+    }
+    next_ = 0;
+
+    if (batch_.size() < kScanBatchSize) {
+      prefetched_.reset();
+      return;
+    }
+    prefetched_.reset(new Notification);
+    ReadAheadPool()->Add([this]() {
+      ReadBatch(&prefetch_);
+      prefetched_->Notify();
+    });
+  }
+
+  const LevelDB* const db_;
   const unique_ptr<leveldb::Iterator> it_;
+  Batch batch_;
+  size_t next_;
+  // While |prefetched_| is set and not notified, |it_| and |prefetch_|
+  // belong to the read ahead.
+  Batch prefetch_;
+  unique_ptr<Notification> prefetched_;
 };
 
 
@@ -127,8 +375,27 @@ LevelDB::LevelDB(const string& dbfile)
 #ifdef HAVE_LEVELDB_FILTER_POLICY_H
       filter_policy_(BuildFilterPolicy()),
 #endif
+      block_cache_(BuildBlockCache()),
+      load_chain_cert_([this](const string& hash, string* cert) {
+        return LoadChainCert(hash, cert);
+      }),
       contiguous_size_(0),
-      latest_tree_timestamp_(0) {
+      latest_tree_timestamp_(0),
+      exiting_(false),
+      compacted_size_(0),
+      index_memory_(MemoryAccounting::Instance()->Register(
+          "database_index",
+          [this]() {
+            SharedLock lock(&lock_);
+            return SetMemoryUsage(sparse_entries_) +
+                   (hash_filter_ ? hash_filter_->MemoryUsage() : 0);
+          })),
+      // leveldb keeps it within its capacity by itself.
+      block_cache_memory_(
+          block_cache_ ? MemoryAccounting::Instance()->Register(
+                             "leveldb_block_cache",
+                             [this]() { return block_cache_->TotalCharge(); })
+                       : nullptr) {
   LOG(INFO) << "Opening " << dbfile;
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("open"));
   leveldb::Options options;
@@ -136,6 +403,17 @@ LevelDB::LevelDB(const string& dbfile)
   if (FLAGS_leveldb_max_open_files > 0) {
     options.max_open_files = FLAGS_leveldb_max_open_files;
   }
+  options.block_cache = block_cache_.get();
+  if (FLAGS_leveldb_write_buffer_size_mb > 0) {
+    options.write_buffer_size =
+        static_cast<size_t>(FLAGS_leveldb_write_buffer_size_mb) << 20;
+  }
+  if (FLAGS_leveldb_block_size_kb > 0) {
+    options.block_size = static_cast<size_t>(FLAGS_leveldb_block_size_kb)
+                         << 10;
+  }
+  options.compression = FLAGS_leveldb_compression ? leveldb::kSnappyCompression
+                                                  : leveldb::kNoCompression;
 #ifdef HAVE_LEVELDB_FILTER_POLICY_H
   options.filter_policy = filter_policy_.get();
 #else
@@ -148,6 +426,35 @@ LevelDB::LevelDB(const string& dbfile)
   db_.reset(db);
 
   BuildIndex();
+
+  string compacted_size;
+  status = db_->Get(leveldb::ReadOptions(),
+                    string(kMetaPrefix) + kMetaCompactedSizeKey,
+                    &compacted_size);
+  if (status.ok()) {
+    compacted_size_ = ValueToIndex(compacted_size);
+  } else {
+    CHECK(status.IsNotFound()) << "Failed to read the compacted size: "
+                               << status.ToString();
+  }
+  compacted_entries->Set(compacted_size_);
+
+  if (FLAGS_leveldb_stats_interval_seconds > 0 ||
+      !FLAGS_leveldb_compaction_hours.empty()) {
+    maintenance_thread_ = thread(&LevelDB::Maintenance, this);
+  }
+}
+
+
+LevelDB::~LevelDB() {
+  {
+    lock_guard<mutex> lock(maintenance_lock_);
+    exiting_ = true;
+  }
+  exiting_cv_.notify_all();
+  if (maintenance_thread_.joinable()) {
+    maintenance_thread_.join();
+  }
 }
 
 
@@ -158,31 +465,25 @@ Database::WriteResult LevelDB::CreateSequencedEntry_(
   ScopedLatency latency(
       latency_by_op_ms.GetScopedLatency("create_sequenced_entry"));
 
-  unique_lock<mutex> lock(lock_);
+  size_t num_written;
+  return WriteSequencedEntries(vector<const LoggedEntry*>(1, &logged),
+                               &num_written);
+}
 
-  string data;
-  CHECK(logged.SerializeToString(&data));
 
-  const string key(IndexToKey(logged.sequence_number()));
+Database::WriteResult LevelDB::CreateSequencedEntries_(
+    const vector<LoggedEntry>& entries, size_t* num_written) {
+  CHECK_NOTNULL(num_written);
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("create_sequenced_entries"));
 
-  string existing_data;
-  leveldb::Status status(
-      db_->Get(leveldb::ReadOptions(), key, &existing_data));
-  if (status.IsNotFound()) {
-    status = db_->Put(leveldb::WriteOptions(), key, data);
-    CHECK(status.ok()) << "Failed to write sequenced entry (seq: "
-                       << logged.sequence_number()
-                       << "): " << status.ToString();
-  } else {
-    if (existing_data == data) {
-      return this->OK;
-    }
-    return this->SEQUENCE_NUMBER_ALREADY_IN_USE;
+  vector<const LoggedEntry*> pointers;
+  pointers.reserve(entries.size());
+  for (const auto& logged : entries) {
+    pointers.push_back(&logged);
   }
 
-  InsertEntryMapping(logged.sequence_number(), logged.Hash());
-
-  return this->OK;
+  return WriteSequencedEntries(pointers, num_written);
 }
 
 
@@ -190,16 +491,24 @@ Database::LookupResult LevelDB::LookupByHash(const string& hash,
                                              LoggedEntry* result) const {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_hash"));
 
-  unique_lock<mutex> lock(lock_);
+  {
+    SharedLock lock(&lock_);
+    if (!MayHaveHash(hash)) {
+      return this->NOT_FOUND;
+    }
+  }
 
-  auto i(id_by_hash_.find(hash));
-  if (i == id_by_hash_.end()) {
+  int64_t sequence_number;
+  if (!LookupHashIndex(hash, &sequence_number)) {
+    if (hash_filter_) {
+      hash_filter_lookups->Increment("false_positive");
+    }
     return this->NOT_FOUND;
   }
 
   string cert_data;
   const leveldb::Status status(
-      db_->Get(leveldb::ReadOptions(), IndexToKey(i->second), &cert_data));
+      db_->Get(leveldb::ReadOptions(), IndexToKey(sequence_number), &cert_data));
   if (status.IsNotFound()) {
     return this->NOT_FOUND;
   }
@@ -207,7 +516,8 @@ Database::LookupResult LevelDB::LookupByHash(const string& hash,
                      << "): " << status.ToString();
 
   if (result) {
-    CHECK(result->ParseFromString(cert_data));
+    CHECK(result->ParseFromStorage(cert_data));
+    CHECK(chain_certs_.Restore(load_chain_cert_, result));
     CHECK_EQ(result->Hash(), hash);
   }
 
@@ -230,7 +540,8 @@ Database::LookupResult LevelDB::LookupByIndex(int64_t sequence_number,
                      << sequence_number;
 
   if (result) {
-    CHECK(result->ParseFromString(cert_data));
+    CHECK(result->ParseFromStorage(cert_data));
+    CHECK(chain_certs_.Restore(load_chain_cert_, result));
     CHECK_EQ(result->sequence_number(), sequence_number);
   }
 
@@ -244,6 +555,80 @@ unique_ptr<Database::Iterator> LevelDB::ScanEntries(
 }
 
 
+void LevelDB::ReadRange(int64_t start, size_t count,
+                        vector<LoggedEntry>* entries) const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("read_range"));
+  ReadEntryRange(start, count, true, entries);
+}
+
+
+void LevelDB::ReadLeafRange(int64_t start, size_t count,
+                            vector<LoggedEntry>* entries) const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("read_leaf_range"));
+  ReadEntryRange(start, count, false, entries);
+}
+
+
+void LevelDB::ReadEntryRange(int64_t start, size_t count, bool with_chain,
+                             vector<LoggedEntry>* entries) const {
+  CHECK_GE(start, 0);
+  CHECK_NOTNULL(entries)->reserve(count);
+
+  const unique_ptr<leveldb::Iterator> it(
+      db_->NewIterator(leveldb::ReadOptions()));
+  it->Seek(IndexToKey(start));
+  size_t num_read(0);
+  for (int64_t seq = start; num_read < count; ++seq, ++num_read, it->Next()) {
+    if (!it->Valid() || !it->key().starts_with(kEntryPrefix) ||
+        KeyToIndex(it->key()) != seq) {
+      break;
+    }
+    if (num_read == entries->size()) {
+      entries->emplace_back();
+    }
+    // Parsing into an entry that was already there reuses its memory.
+    LoggedEntry* const entry(&(*entries)[num_read]);
+    if (with_chain) {
+      CHECK(entry->ParseFromStorage(it->value().data(), it->value().size()))
+          << "failed to parse entry for key " << it->key().ToString();
+      CHECK(chain_certs_.Restore(load_chain_cert_, entry));
+    } else {
+      CHECK(entry->ParseFromStorageWithoutChain(it->value().data(),
+                                                it->value().size()))
+          << "failed to parse entry for key " << it->key().ToString();
+    }
+    CHECK_EQ(entry->sequence_number(), seq) << "unexpected sequence_number";
+  }
+  entries->resize(num_read);
+}
+
+
+void LevelDB::ReadRawRange(int64_t start, size_t count,
+                           vector<string>* entries) const {
+  CHECK_GE(start, 0);
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("read_raw_range"));
+  CHECK_NOTNULL(entries)->clear();
+  entries->reserve(count);
+
+  const unique_ptr<leveldb::Iterator> it(
+      db_->NewIterator(leveldb::ReadOptions()));
+  it->Seek(IndexToKey(start));
+  for (int64_t seq = start; entries->size() < count; ++seq, it->Next()) {
+    if (!it->Valid() || !it->key().starts_with(kEntryPrefix) ||
+        KeyToIndex(it->key()) != seq) {
+      break;
+    }
+    // Unless compressed, or with references to chain certificates,
+    // the entries are stored the way the callers want them.
+    entries->emplace_back();
+    CHECK(LoggedEntry::UncompressStored(it->value().data(), it->value().size(),
+                                        &entries->back()))
+        << "failed to uncompress entry for key " << it->key().ToString();
+    CHECK(chain_certs_.RestoreSerialized(load_chain_cert_, &entries->back()));
+  }
+}
+
+
 Database::WriteResult LevelDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
   CHECK_GE(sth.tree_size(), 0);
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("write_tree_head"));
@@ -255,7 +640,7 @@ Database::WriteResult LevelDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
   string data;
   CHECK(sth.SerializeToString(&data));
 
-  unique_lock<mutex> lock(lock_);
+  unique_lock<mutex> write_lock(write_lock_);
   string existing_data;
   leveldb::Status status(db_->Get(leveldb::ReadOptions(),
                                   kTreeHeadPrefix + timestamp_key,
@@ -274,11 +659,17 @@ Database::WriteResult LevelDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
                      << "): " << status.ToString();
 
   if (sth.timestamp() > latest_tree_timestamp_) {
+    lock_guard<SharedMutex> lock(lock_);
     latest_tree_timestamp_ = sth.timestamp();
     latest_timestamp_key_ = timestamp_key;
   }
 
-  lock.unlock();
+  write_lock.unlock();
+  // Tree heads are written regularly, which makes it a good time to
+  // update this.
+  if (block_cache_) {
+    block_cache_usage_bytes->Set(block_cache_->TotalCharge());
+  }
   callbacks_.Call(sth);
 
   return this->OK;
@@ -288,15 +679,66 @@ Database::WriteResult LevelDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
 Database::LookupResult LevelDB::LatestTreeHead(
     ct::SignedTreeHead* result) const {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("latest_tree_head"));
-  lock_guard<mutex> lock(lock_);
+  uint64_t timestamp;
+  string timestamp_key;
+  {
+    SharedLock lock(&lock_);
+    timestamp = latest_tree_timestamp_;
+    timestamp_key = latest_timestamp_key_;
+  }
+
+  // Tree heads are never removed, so this one is still there.
+  return ReadTreeHead(timestamp, timestamp_key, result);
+}
+
+
+void LevelDB::ReadTreeHeads(vector<ct::SignedTreeHead>* results) const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("read_tree_heads"));
+  results->clear();
+
+  // The keys of the tree heads sort by timestamp.
+  unique_ptr<leveldb::Iterator> it(db_->NewIterator(leveldb::ReadOptions()));
+  for (it->Seek(kTreeHeadPrefix);
+       it->Valid() && it->key().starts_with(kTreeHeadPrefix); it->Next()) {
+    results->emplace_back();
+    CHECK(results->back().ParseFromArray(it->value().data(),
+                                         it->value().size()));
+  }
+  CHECK(it->status().ok()) << "Failed to read the tree heads: "
+                           << it->status().ToString();
+}
+
+
+Database::LookupResult LevelDB::LatestTreeFrontier(string* frontier) const {
+  CHECK_NOTNULL(frontier);
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("latest_tree_frontier"));
+  const leveldb::Status status(db_->Get(
+      leveldb::ReadOptions(), string(kMetaPrefix) + kMetaTreeFrontierKey,
+      frontier));
+  if (status.IsNotFound()) {
+    return this->NOT_FOUND;
+  }
+  CHECK(status.ok()) << "Failed to read the tree frontier: "
+                     << status.ToString();
+  return this->LOOKUP_OK;
+}
 
-  return LatestTreeHeadNoLock(result);
+
+void LevelDB::WriteTreeFrontier(const string& frontier) {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("write_tree_frontier"));
+  const leveldb::Status status(db_->Put(
+      leveldb::WriteOptions(), string(kMetaPrefix) + kMetaTreeFrontierKey,
+      frontier));
+  CHECK(status.ok()) << "Failed to write the tree frontier: "
+                     << status.ToString();
 }
 
 
 int64_t LevelDB::TreeSize() const {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("tree_size"));
-  lock_guard<mutex> lock(lock_);
+  SharedLock lock(&lock_);
 
   return contiguous_size_;
 }
@@ -304,12 +746,13 @@ int64_t LevelDB::TreeSize() const {
 
 void LevelDB::AddNotifySTHCallback(
     const Database::NotifySTHCallback* callback) {
-  unique_lock<mutex> lock(lock_);
+  unique_lock<SharedMutex> lock(lock_);
 
   callbacks_.Add(callback);
 
   ct::SignedTreeHead sth;
-  if (LatestTreeHeadNoLock(&sth) == this->LOOKUP_OK) {
+  if (ReadTreeHead(latest_tree_timestamp_, latest_timestamp_key_, &sth) ==
+      this->LOOKUP_OK) {
     lock.unlock();
     (*callback)(sth);
   }
@@ -318,7 +761,7 @@ void LevelDB::AddNotifySTHCallback(
 
 void LevelDB::RemoveNotifySTHCallback(
     const Database::NotifySTHCallback* callback) {
-  lock_guard<mutex> lock(lock_);
+  lock_guard<SharedMutex> lock(lock_);
 
   callbacks_.Remove(callback);
 }
@@ -327,7 +770,7 @@ void LevelDB::RemoveNotifySTHCallback(
 void LevelDB::InitializeNode(const string& node_id) {
   CHECK(!node_id.empty());
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("initialize_node"));
-  unique_lock<mutex> lock(lock_);
+  lock_guard<mutex> write_lock(write_lock_);
   string existing_id;
   leveldb::Status status(db_->Get(leveldb::ReadOptions(),
                                   string(kMetaPrefix) + kMetaNodeIdKey,
@@ -353,34 +796,78 @@ Database::LookupResult LevelDB::NodeId(string* node_id) {
 }
 
 
+void LevelDB::CompactEntries(int64_t start, int64_t end) {
+  CHECK_GE(start, 0);
+  CHECK_LE(start, end);
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("compact_entries"));
+  const string start_key(IndexToKey(start));
+  const string end_key(IndexToKey(end));
+  const leveldb::Slice start_slice(start_key);
+  const leveldb::Slice end_slice(end_key);
+  db_->CompactRange(&start_slice, &end_slice);
+}
+
+
 void LevelDB::BuildIndex() {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("build_index"));
   // Technically, this should only be called from the constructor, so
   // this should not be necessarily, but just to be sure...
-  lock_guard<mutex> lock(lock_);
+  lock_guard<mutex> write_lock(write_lock_);
+  lock_guard<SharedMutex> lock(lock_);
+
+  string contiguous_size;
+  const leveldb::Status status(
+      db_->Get(leveldb::ReadOptions(),
+               string(kMetaPrefix) + kMetaContiguousSizeKey,
+               &contiguous_size));
+  if (status.IsNotFound()) {
+    MigrateIndex();
+  } else {
+    CHECK(status.ok()) << "Failed to read the contiguous size: "
+                       << status.ToString();
+    contiguous_size_ = ValueToIndex(contiguous_size);
+  }
 
   leveldb::ReadOptions options;
   options.fill_cache = false;
   unique_ptr<leveldb::Iterator> it(db_->NewIterator(options));
   CHECK(it);
-  it->Seek(kEntryPrefix);
 
+  // Only the entries past the contiguous part of the log (if it is
+  // still being fetched) need to be looked at, and only their keys.
+  it->Seek(IndexToKey(contiguous_size_));
   for (; it->Valid() && it->key().starts_with(kEntryPrefix); it->Next()) {
-    const int64_t seq(KeyToIndex(it->key()));
-    LoggedEntry logged;
-    CHECK(logged.ParseFromString(it->value().ToString()))
-        << "Failed to parse entry with sequence number " << seq;
-    CHECK(logged.has_sequence_number())
-        << "No sequence number for entry with sequence number " << seq;
-    CHECK_EQ(logged.sequence_number(), seq)
-        << "Entry has unexpected sequence_number: " << seq;
+    UpdateContiguousSize(KeyToIndex(it->key()));
+  }
 
-    InsertEntryMapping(logged.sequence_number(), logged.Hash());
+  if (FLAGS_leveldb_hash_filter_bits_per_entry > 0) {
+    // Room for the log to double before the filter has to grow.
+    hash_filter_.reset(new BloomFilter(
+        2 * (contiguous_size_ + sparse_entries_.size()) + (1 << 20),
+        FLAGS_leveldb_hash_filter_bits_per_entry));
+    // This only reads the keys of the hash index, in order.
+    for (it->Seek(kHashPrefix);
+         it->Valid() && it->key().starts_with(kHashPrefix); it->Next()) {
+      leveldb::Slice hash(it->key());
+      hash.remove_prefix(strlen(kHashPrefix));
+      hash_filter_->Add(hash.ToString());
+    }
+    LOG(INFO) << "Hash filter built for " << hash_filter_->size()
+              << " hashes, using " << (hash_filter_->MemoryUsage() >> 20)
+              << " MB";
   }
 
-  // Now read the STH entries.
-  it->Seek(kTreeHeadPrefix);
-  for (; it->Valid() && it->key().starts_with(kTreeHeadPrefix); it->Next()) {
+  // The keys of the tree heads sort by timestamp, so the latest one
+  // is the last one.
+  string tree_head_limit(kTreeHeadPrefix);
+  ++tree_head_limit[tree_head_limit.size() - 1];
+  it->Seek(tree_head_limit);
+  if (it->Valid()) {
+    it->Prev();
+  } else {
+    it->SeekToLast();
+  }
+  if (it->Valid() && it->key().starts_with(kTreeHeadPrefix)) {
     leveldb::Slice key_slice(it->key());
     key_slice.remove_prefix(strlen(kTreeHeadPrefix));
     latest_timestamp_key_ = key_slice.ToString();
@@ -392,33 +879,223 @@ void LevelDB::BuildIndex() {
 }
 
 
-Database::LookupResult LevelDB::LatestTreeHeadNoLock(
+// This must be called with both locks held.
+void LevelDB::MigrateIndex() {
+  LOG(INFO) << "No hash index found, building it from the entries";
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("migrate_index"));
+
+  leveldb::ReadOptions options;
+  options.fill_cache = false;
+  unique_ptr<leveldb::Iterator> it(db_->NewIterator(options));
+  CHECK(it);
+  it->Seek(kEntryPrefix);
+
+  // The entries are visited in order of sequence number, so the first
+  // time a hash is seen is the one that should be indexed.
+  leveldb::WriteBatch batch;
+  unordered_set<string> batched_hashes;
+  int64_t num_entries(0);
+  for (; it->Valid() && it->key().starts_with(kEntryPrefix); it->Next()) {
+    const int64_t seq(KeyToIndex(it->key()));
+    LoggedEntry logged;
+    CHECK(logged.ParseFromStorageWithoutChain(it->value().data(),
+                                              it->value().size()))
+        << "Failed to parse entry with sequence number " << seq;
+    CHECK(logged.has_sequence_number())
+        << "No sequence number for entry with sequence number " << seq;
+    CHECK_EQ(logged.sequence_number(), seq)
+        << "Entry has unexpected sequence_number: " << seq;
+
+    const string hash(logged.Hash());
+    int64_t existing;
+    if (batched_hashes.count(hash) == 0 && !LookupHashIndex(hash, &existing)) {
+      batch.Put(HashToKey(hash), IndexToValue(seq));
+      batched_hashes.insert(hash);
+    }
+    UpdateContiguousSize(seq);
+
+    if (++num_entries % kMigrationBatchSize == 0) {
+      const leveldb::Status status(db_->Write(leveldb::WriteOptions(), &batch));
+      CHECK(status.ok()) << "Failed to write hash index: "
+                         << status.ToString();
+      batch.Clear();
+      batched_hashes.clear();
+      LOG(INFO) << "Indexed " << num_entries << " entries";
+    }
+  }
+
+  // This marks the migration as complete, so it goes last.
+  batch.Put(string(kMetaPrefix) + kMetaContiguousSizeKey,
+            IndexToValue(contiguous_size_));
+  leveldb::WriteOptions write_options;
+  write_options.sync = true;
+  const leveldb::Status status(db_->Write(write_options, &batch));
+  CHECK(status.ok()) << "Failed to write hash index: " << status.ToString();
+  LOG(INFO) << "Hash index built for " << num_entries << " entries, this "
+            << "will not be needed again";
+
+  // The sparse entries will be found again by BuildIndex().
+  sparse_entries_.clear();
+}
+
+
+Database::LookupResult LevelDB::ReadTreeHead(
+    uint64_t timestamp, const string& timestamp_key,
     ct::SignedTreeHead* result) const {
-  if (latest_tree_timestamp_ == 0) {
+  if (timestamp == 0) {
     return this->NOT_FOUND;
   }
 
   string tree_data;
   leveldb::Status status(db_->Get(leveldb::ReadOptions(),
-                                  kTreeHeadPrefix + latest_timestamp_key_,
+                                  kTreeHeadPrefix + timestamp_key,
                                   &tree_data));
   CHECK(status.ok()) << "Failed to read latest tree head: "
                      << status.ToString();
 
   CHECK(result->ParseFromString(tree_data));
-  CHECK_EQ(result->timestamp(), latest_tree_timestamp_);
+  CHECK_EQ(result->timestamp(), timestamp);
 
   return this->LOOKUP_OK;
 }
 
 
-// This must be called with "lock_" held.
-void LevelDB::InsertEntryMapping(int64_t sequence_number, const string& hash) {
-  if (!id_by_hash_.insert(make_pair(hash, sequence_number)).second) {
-    // This is a duplicate hash under a new sequence number.
-    // Make sure we track the entry with the lowest sequence number:
-    id_by_hash_[hash] = min(id_by_hash_[hash], sequence_number);
+Database::WriteResult LevelDB::WriteSequencedEntries(
+    const vector<const LoggedEntry*>& entries, size_t* num_written) {
+  vector<string> data(entries.size());
+  vector<string> hashes(entries.size());
+  map<string, string> chain_certs;
+  LoggedEntry deduplicated;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    const bool is_deduplicated(chain_certs_.Deduplicate(
+        load_chain_cert_, *entries[i], &deduplicated, &chain_certs));
+    CHECK((is_deduplicated ? deduplicated : *entries[i])
+              .SerializeForStorage(&data[i]));
+    hashes[i] = entries[i]->Hash();
+  }
+
+  lock_guard<mutex> write_lock(write_lock_);
+
+  // The new entries, by sequence number (with their index in
+  // |entries|), so that duplicates within the batch itself are
+  // handled the same way as those already in the database.
+  unordered_map<int64_t, size_t> batched;
+  // The hash index entries to write. If this is a duplicate hash
+  // under a new sequence number, make sure we track the entry with
+  // the lowest sequence number.
+  unordered_map<string, int64_t> batched_hashes;
+  leveldb::WriteBatch batch;
+  WriteResult result(this->OK);
+  for (*num_written = 0; *num_written < entries.size(); ++*num_written) {
+    const size_t i(*num_written);
+    const int64_t sequence_number(entries[i]->sequence_number());
+    const auto it(batched.find(sequence_number));
+    if (it != batched.end()) {
+      if (!LoggedEntry::SameStored(data[it->second], data[i])) {
+        result = this->SEQUENCE_NUMBER_ALREADY_IN_USE;
+        break;
+      }
+      continue;
+    }
+
+    const string key(IndexToKey(sequence_number));
+    string existing_data;
+    const leveldb::Status status(
+        db_->Get(leveldb::ReadOptions(), key, &existing_data));
+    if (!status.IsNotFound()) {
+      CHECK(status.ok()) << "Failed to read sequenced entry (seq: "
+                         << sequence_number << "): " << status.ToString();
+      if (!LoggedEntry::SameStored(existing_data, data[i]) &&
+          !chain_certs_.SameEntry(load_chain_cert_, existing_data,
+                                  *entries[i])) {
+        result = this->SEQUENCE_NUMBER_ALREADY_IN_USE;
+        break;
+      }
+      continue;
+    }
+
+    batch.Put(key, data[i]);
+    batched.insert(make_pair(sequence_number, i));
+
+    const auto hash_it(batched_hashes.find(hashes[i]));
+    int64_t existing;
+    if (hash_it != batched_hashes.end()) {
+      hash_it->second = min(hash_it->second, sequence_number);
+    } else if (!MayHaveHash(hashes[i]) ||
+               !LookupHashIndex(hashes[i], &existing) ||
+               sequence_number < existing) {
+      batched_hashes.insert(make_pair(hashes[i], sequence_number));
+    }
+  }
+
+  if (batched.empty()) {
+    return result;
+  }
+
+  for (const auto& hash : batched_hashes) {
+    batch.Put(HashToKey(hash.first), IndexToValue(hash.second));
+  }
+  // Some of these might only be needed by entries which were not
+  // written after all, which is harmless.
+  for (const auto& cert : chain_certs) {
+    batch.Put(kChainCertPrefix + cert.first, cert.second);
+  }
+  int64_t contiguous_size(contiguous_size_);
+  while (batched.count(contiguous_size) > 0 ||
+         sparse_entries_.count(contiguous_size) > 0) {
+    ++contiguous_size;
+  }
+  batch.Put(string(kMetaPrefix) + kMetaContiguousSizeKey,
+            IndexToValue(contiguous_size));
+
+  const leveldb::Status status(db_->Write(leveldb::WriteOptions(), &batch));
+  CHECK(status.ok()) << "Failed to write " << batched.size()
+                     << " sequenced entries: " << status.ToString();
+  chain_certs_.Stored(chain_certs);
+
+  // Only now that they can be read.
+  lock_guard<SharedMutex> lock(lock_);
+  for (const auto& entry : batched) {
+    UpdateContiguousSize(entry.first);
+  }
+  CHECK_EQ(contiguous_size_, contiguous_size);
+  if (hash_filter_) {
+    for (const auto& hash : batched_hashes) {
+      hash_filter_->Add(hash.first);
+    }
+  }
+
+  return result;
+}
+
+
+bool LevelDB::LookupHashIndex(const string& hash,
+                              int64_t* sequence_number) const {
+  string value;
+  const leveldb::Status status(
+      db_->Get(leveldb::ReadOptions(), HashToKey(hash), &value));
+  if (status.IsNotFound()) {
+    return false;
+  }
+  CHECK(status.ok()) << "Failed to read hash index (" << util::HexString(hash)
+                     << "): " << status.ToString();
+
+  *CHECK_NOTNULL(sequence_number) = ValueToIndex(value);
+  return true;
+}
+
+
+bool LevelDB::MayHaveHash(const string& hash) const {
+  if (!hash_filter_ || hash_filter_->MayContain(hash)) {
+    return true;
   }
+  hash_filter_lookups->Increment("negative");
+  return false;
+}
+
+
+// This must be called with both locks held.
+void LevelDB::UpdateContiguousSize(int64_t sequence_number) {
   if (sequence_number == contiguous_size_) {
     ++contiguous_size_;
     for (auto i = sparse_entries_.find(contiguous_size_);
@@ -434,4 +1111,99 @@ void LevelDB::InsertEntryMapping(int64_t sequence_number, const string& hash) {
 }
 
 
+bool LevelDB::LoadChainCert(const string& hash, string* cert) const {
+  const leveldb::Status status(
+      db_->Get(leveldb::ReadOptions(), kChainCertPrefix + hash, cert));
+  if (status.IsNotFound()) {
+    return false;
+  }
+  CHECK(status.ok()) << "Failed to read chain certificate ("
+                     << util::HexString(hash) << "): " << status.ToString();
+  return true;
+}
+
+
+// Thread entry point for maintenance_thread_.
+void LevelDB::Maintenance() {
+  // Whether compacting or not, the hours are checked every minute.
+  const seconds interval(FLAGS_leveldb_stats_interval_seconds > 0
+                             ? FLAGS_leveldb_stats_interval_seconds
+                             : 60);
+  unique_lock<mutex> lock(maintenance_lock_);
+  while (!exiting_) {
+    lock.unlock();
+    if (FLAGS_leveldb_stats_interval_seconds > 0) {
+      UpdateStats();
+    }
+    if (InCompactionHours()) {
+      CompactColdEntries();
+    }
+    lock.lock();
+    exiting_cv_.wait_for(lock, interval, [this]() { return exiting_; });
+  }
+}
+
+
+void LevelDB::UpdateStats() const {
+  string stats;
+  if (!db_->GetProperty("leveldb.stats", &stats)) {
+    LOG(WARNING) << "leveldb did not return its stats";
+    return;
+  }
+
+  // A table, one line per level, under a line of dashes:
+  // Level  Files Size(MB) Time(sec) Read(MB) Write(MB)
+  // --------------------------------------------------
+  //   0        2        0         0        0         0
+  istringstream in(stats);
+  string line;
+  while (getline(in, line) && line.compare(0, 3, "---") != 0) {
+  }
+  while (getline(in, line)) {
+    istringstream row(line);
+    int level, files;
+    double size, compaction_time, read, written;
+    if (!(row >> level >> files >> size >> compaction_time >> read >>
+          written)) {
+      LOG(WARNING) << "unexpected line in the leveldb stats: " << line;
+      return;
+    }
+    level_files->Set(level, files);
+    level_size_mb->Set(level, size);
+    compaction_seconds->Set(level, compaction_time);
+    compaction_read_mb->Set(level, read);
+    compaction_written_mb->Set(level, written);
+  }
+}
+
+
+void LevelDB::CompactColdEntries() {
+  CHECK_GT(FLAGS_leveldb_compaction_batch_entries, 0);
+  const int64_t cold_size(TreeSize() - FLAGS_leveldb_compaction_hot_entries);
+  // Batch by batch, so that the end of the compaction hours or our
+  // destruction do not have to wait for all of it.
+  while (compacted_size_ < cold_size && InCompactionHours()) {
+    {
+      lock_guard<mutex> lock(maintenance_lock_);
+      if (exiting_) {
+        return;
+      }
+    }
+    const int64_t end(
+        min(cold_size,
+            compacted_size_ + FLAGS_leveldb_compaction_batch_entries));
+    VLOG(1) << "compacting entries " << compacted_size_ << " to " << end - 1;
+    CompactEntries(compacted_size_, end - 1);
+    const leveldb::Status status(
+        db_->Put(leveldb::WriteOptions(),
+                 string(kMetaPrefix) + kMetaCompactedSizeKey,
+                 IndexToValue(end)));
+    CHECK(status.ok()) << "Failed to store the compacted size: "
+                       << status.ToString();
+    compacted_size_ = end;
+    compacted_entries->Set(compacted_size_);
+  }
+}
+
+
 }  // namespace cert_trans
@@ -3,36 +3,63 @@
 
 #include "config.h"
 
+#include <leveldb/cache.h>
 #include <leveldb/db.h>
 #ifdef HAVE_LEVELDB_FILTER_POLICY_H
 #include <leveldb/filter_policy.h>
 #endif
 #include <stdint.h>
+#include <condition_variable>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <set>
-#include <unordered_map>
+#include <string>
+#include <thread>
 #include <vector>
 
 #include "base/macros.h"
+#include "log/chain_cert_cache.h"
 #include "log/database.h"
 #include "proto/ct.pb.h"
+#include "util/bloom_filter.h"
+#include "util/memory_accounting.h"
+#include "util/shared_mutex.h"
 
 namespace cert_trans {
 
 
+// Database interface that stores everything in a LevelDB database.
+// Besides the entries and tree heads, it keeps an index of the
+// entries by hash and the size of the contiguous part of the log, so
+// that opening the database does not require reading all the entries
+// (databases written before these existed are indexed once, when
+// first opened).
+//
+// With --leveldb_hash_filter_bits_per_entry, the hashes of the index
+// are also kept in an in-memory Bloom filter (rebuilt from the index
+// when opening the database), so that looking up a hash which is not
+// there, as is the case for most new submissions, does not go to disk.
+//
+// A background thread exports the compaction stats of leveldb as
+// metrics every --leveldb_stats_interval_seconds, and, during the
+// --leveldb_compaction_hours, compacts the entries which are no
+// longer among the --leveldb_compaction_hot_entries latest ones, so
+// that leveldb has less of it left to do at busier times.
 class LevelDB : public Database {
  public:
   static const size_t kTimestampBytesIndexed;
 
   explicit LevelDB(const std::string& dbfile);
-  ~LevelDB() = default;
+  ~LevelDB();
 
   // Implement abstract functions, see database.h for comments.
   Database::WriteResult CreateSequencedEntry_(
       const LoggedEntry& logged) override;
 
+  Database::WriteResult CreateSequencedEntries_(
+      const std::vector<LoggedEntry>& entries, size_t* num_written) override;
+
   Database::LookupResult LookupByHash(const std::string& hash,
                                       LoggedEntry* result) const override;
 
@@ -42,11 +69,27 @@ class LevelDB : public Database {
   std::unique_ptr<Database::Iterator> ScanEntries(
       int64_t start_index) const override;
 
+  void ReadRange(int64_t start, size_t count,
+                 std::vector<LoggedEntry>* entries) const override;
+
+  void ReadRawRange(int64_t start, size_t count,
+                    std::vector<std::string>* entries) const override;
+
+  void ReadLeafRange(int64_t start, size_t count,
+                     std::vector<LoggedEntry>* entries) const override;
+
   Database::WriteResult WriteTreeHead_(const ct::SignedTreeHead& sth) override;
 
   Database::LookupResult LatestTreeHead(
       ct::SignedTreeHead* result) const override;
 
+  void ReadTreeHeads(std::vector<ct::SignedTreeHead>* results) const override;
+
+  Database::LookupResult LatestTreeFrontier(
+      std::string* frontier) const override;
+
+  void WriteTreeFrontier(const std::string& frontier) override;
+
   int64_t TreeSize() const override;
 
   void AddNotifySTHCallback(
@@ -59,34 +102,85 @@ class LevelDB : public Database {
 
   Database::LookupResult NodeId(std::string* node_id) override;
 
+  // Compacts the entries from |start| to |end| (inclusive) right
+  // away, rather than leaving it to leveldb. This can take a while,
+  // the database can be used meanwhile.
+  void CompactEntries(int64_t start, int64_t end);
+
  private:
   class Iterator;
 
   void BuildIndex();
-  Database::LookupResult LatestTreeHeadNoLock(
-      ct::SignedTreeHead* result) const;
-  void InsertEntryMapping(int64_t sequence_number, const std::string& hash);
-
-  mutable std::mutex lock_;
+  void MigrateIndex();
+  // ReadRange() or, without |with_chain|, ReadLeafRange().
+  void ReadEntryRange(int64_t start, size_t count, bool with_chain,
+                      std::vector<LoggedEntry>* entries) const;
+  Database::LookupResult ReadTreeHead(uint64_t timestamp,
+                                      const std::string& timestamp_key,
+                                      ct::SignedTreeHead* result) const;
+  Database::WriteResult WriteSequencedEntries(
+      const std::vector<const LoggedEntry*>& entries, size_t* num_written);
+  bool LookupHashIndex(const std::string& hash,
+                       int64_t* sequence_number) const;
+  // Returns false if |hash| is certainly not in the hash index. Must
+  // be called with |write_lock_| or |lock_| held.
+  bool MayHaveHash(const std::string& hash) const;
+  void UpdateContiguousSize(int64_t sequence_number);
+  bool LoadChainCert(const std::string& hash, std::string* cert) const;
+  // Thread entry point for |maintenance_thread_|.
+  void Maintenance();
+  void UpdateStats() const;
+  void CompactColdEntries();
+
+  // The leveldb::DB can be used concurrently, these only cover the
+  // in-memory state (from |contiguous_size_| on). The writers are
+  // serialized by |write_lock_|, and also take |lock_| (exclusively)
+  // to change the state, only once their writes are done: the readers
+  // only hold |lock_| (shared) for as long as they read the state.
+  std::mutex write_lock_;
+  mutable SharedMutex lock_;
 #ifdef HAVE_LEVELDB_FILTER_POLICY_H
   // filter_policy_ must be valid for at least as long as db_ is, so
   // keep this order.
   const std::unique_ptr<const leveldb::FilterPolicy> filter_policy_;
 #endif
+  // Same thing for block_cache_, which is NULL if the default cache
+  // is used.
+  const std::unique_ptr<leveldb::Cache> block_cache_;
   std::unique_ptr<leveldb::DB> db_;
 
+  mutable ChainCertCache chain_certs_;
+  const ChainCertCache::LoadFunction load_chain_cert_;
+
   int64_t contiguous_size_;
-  std::unordered_map<std::string, int64_t> id_by_hash_;
 
   // This is a mapping of the non-contiguous entries of the log (which
   // can happen while it is being fetched). When entries here become
   // contiguous with the beginning of the tree, they are removed.
   std::set<int64_t> sparse_entries_;
 
+  // The hashes of the hash index, NULL without
+  // --leveldb_hash_filter_bits_per_entry. Hashes are added once
+  // written, with both locks held.
+  std::unique_ptr<BloomFilter> hash_filter_;
+
   uint64_t latest_tree_timestamp_;
   std::string latest_timestamp_key_;
   cert_trans::DatabaseNotifierHelper callbacks_;
 
+  std::mutex maintenance_lock_;  // covers |exiting_|
+  bool exiting_;
+  std::condition_variable exiting_cv_;
+  // How many of the first entries were compacted during the
+  // compaction hours, only used by |maintenance_thread_|.
+  int64_t compacted_size_;
+  std::thread maintenance_thread_;
+
+  // Last, to stop counting the index and the block cache before they
+  // go.
+  const std::unique_ptr<MemoryAccounting::Registration> index_memory_;
+  const std::unique_ptr<MemoryAccounting::Registration> block_cache_memory_;
+
   DISALLOW_COPY_AND_ASSIGN(LevelDB);
 };
 
@@ -1,16 +1,20 @@
 #include "log/log_lookup.h"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <stdint.h>
 #include <stdlib.h>
-#include <map>
+#include <algorithm>
+#include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include "base/time_support.h"
+#include "log/merge_delay.h"
 #include "merkletree/merkle_tree.h"
 #include "merkletree/serial_hasher.h"
+#include "monitoring/trace.h"
 #include "proto/ct.pb.h"
 #include "proto/serializer.h"
 #include "util/util.h"
@@ -18,29 +22,95 @@
 using ct::MerkleAuditProof;
 using ct::ShortMerkleAuditProof;
 using ct::SignedTreeHead;
+using std::atomic_load;
+using std::atomic_store;
 using std::bind;
 using std::lock_guard;
 using std::make_pair;
-using std::map;
+using std::make_shared;
+using std::max;
+using std::min;
+using std::move;
 using std::mutex;
 using std::placeholders::_1;
+using std::shared_ptr;
 using std::string;
-using std::unique_lock;
 using std::unique_ptr;
 using std::vector;
 using util::HexString;
 
+DEFINE_int32(precomputed_consistency_proofs, 8,
+             "number of previous tree sizes from which to compute the "
+             "consistency proofs to every new STH in advance, for the "
+             "monitors asking for them");
+
+DEFINE_int32(precompute_audit_proofs, 0,
+             "number of the entries added by every new STH (the last ones) "
+             "for which to compute the audit proof against it in advance, "
+             "kept until the next STH, for the submitters polling "
+             "get-proof-by-hash (0 to disable)");
+
 namespace cert_trans {
 
 
 static const int kCtimeBufSize = 26;
+// Number of entries added to the tree for every acquisition of the
+// exclusive lock, while catching up with a new STH.
+static const int64_t kUpdateBatchSize = 10000;
 
 
-LogLookup::LogLookup(ReadOnlyDatabase* db)
+LogLookup::LogLookup(ReadOnlyDatabase* db, ThreadPool* pool)
     : db_(CHECK_NOTNULL(db)),
+      leaf_hasher_(unique_ptr<Sha256Hasher>(new Sha256Hasher), pool),
       cert_tree_(unique_ptr<Sha256Hasher>(new Sha256Hasher)),
+      proofs_(unique_ptr<Sha256Hasher>(new Sha256Hasher),
+              cert_tree_.NodeStore()),
+      latest_tree_head_(),
+      latest_sth_(make_shared<const SignedTreeHead>()),
+      recent_consistency_proofs_(make_shared<const ConsistencyProofs>()),
+      recent_audit_proofs_(make_shared<const RecentAuditProofs>()),
+      update_from_sth_cb_(bind(&LogLookup::UpdateFromSTH, this, _1)),
+      tree_memory_(MemoryAccounting::Instance()->Register(
+          "merkle_tree",
+          [this]() {
+            SharedLock lock(&lock_);
+            return cert_tree_.NodeBytes();
+          })),
+      index_memory_(MemoryAccounting::Instance()->Register(
+          "leaf_index", [this]() {
+            SharedLock lock(&lock_);
+            return leaf_index_.MemoryUsage();
+          })) {
+  db_->AddNotifySTHCallback(&update_from_sth_cb_);
+}
+
+
+LogLookup::LogLookup(ReadOnlyDatabase* db,
+                     unique_ptr<MerkleNodeStore> node_store,
+                     ThreadPool* pool)
+    : db_(CHECK_NOTNULL(db)),
+      leaf_hasher_(unique_ptr<Sha256Hasher>(new Sha256Hasher), pool),
+      cert_tree_(unique_ptr<Sha256Hasher>(new Sha256Hasher),
+                 move(node_store)),
+      proofs_(unique_ptr<Sha256Hasher>(new Sha256Hasher),
+              cert_tree_.NodeStore()),
       latest_tree_head_(),
-      update_from_sth_cb_(bind(&LogLookup::UpdateFromSTH, this, _1)) {
+      latest_sth_(make_shared<const SignedTreeHead>()),
+      recent_consistency_proofs_(make_shared<const ConsistencyProofs>()),
+      recent_audit_proofs_(make_shared<const RecentAuditProofs>()),
+      update_from_sth_cb_(bind(&LogLookup::UpdateFromSTH, this, _1)),
+      tree_memory_(MemoryAccounting::Instance()->Register(
+          "merkle_tree",
+          [this]() {
+            SharedLock lock(&lock_);
+            return cert_tree_.NodeBytes();
+          })),
+      index_memory_(MemoryAccounting::Instance()->Register(
+          "leaf_index", [this]() {
+            SharedLock lock(&lock_);
+            return leaf_index_.MemoryUsage();
+          })) {
+  LoadLeafIndex();
   db_->AddNotifySTHCallback(&update_from_sth_cb_);
 }
 
@@ -50,8 +120,100 @@ LogLookup::~LogLookup() {
 }
 
 
+vector<string> LogLookup::ConsistencyProof(size_t first, size_t second) {
+  const shared_ptr<const ConsistencyProofs> recent(
+      atomic_load(&recent_consistency_proofs_));
+  const auto it(recent->find(make_pair(first, second)));
+  if (it != recent->end()) {
+    return it->second;
+  }
+
+  SharedLock lock(&lock_);
+  return proofs_.SnapshotConsistency(first, second);
+}
+
+
+void LogLookup::PrecomputeConsistencyProofs(int64_t tree_size) {
+  const shared_ptr<ConsistencyProofs> proofs(make_shared<ConsistencyProofs>());
+  {
+    SharedLock lock(&lock_);
+    for (const auto& first : recent_tree_sizes_) {
+      if (first > 0 && first < tree_size) {
+        (*proofs)[make_pair(first, tree_size)] =
+            proofs_.SnapshotConsistency(first, tree_size);
+      }
+    }
+  }
+  atomic_store(&recent_consistency_proofs_,
+               shared_ptr<const ConsistencyProofs>(proofs));
+
+  if (recent_tree_sizes_.empty() || recent_tree_sizes_.back() != tree_size) {
+    recent_tree_sizes_.push_back(tree_size);
+  }
+  while (recent_tree_sizes_.size() >
+         static_cast<size_t>(max(FLAGS_precomputed_consistency_proofs, 0))) {
+    recent_tree_sizes_.pop_front();
+  }
+}
+
+
+void LogLookup::PrecomputeAuditProofs(int64_t begin, int64_t end) {
+  const shared_ptr<RecentAuditProofs> proofs(
+      make_shared<RecentAuditProofs>());
+  proofs->tree_size = end;
+  begin = max(begin, end - max<int64_t>(FLAGS_precompute_audit_proofs, 0));
+  {
+    SharedLock lock(&lock_);
+    for (int64_t index = begin; index < end; ++index) {
+      string leaf_hash(cert_tree_.LeafHash(index + 1));
+      int64_t first_index;
+      // The proof is for the first occurrence of a duplicate leaf.
+      if (!leaf_index_.Find(leaf_hash, &first_index) ||
+          first_index != index) {
+        continue;
+      }
+      ShortMerkleAuditProof* const proof(&proofs->by_hash[move(leaf_hash)]);
+      proof->set_leaf_index(index);
+      for (const auto& node : proofs_.PathToRootAtSnapshot(index + 1, end)) {
+        proof->add_path_node(node);
+      }
+    }
+  }
+  atomic_store(&recent_audit_proofs_,
+               shared_ptr<const RecentAuditProofs>(proofs));
+}
+
+
+void LogLookup::AddNewSTHCallback(const NewSTHCallback* callback) {
+  lock_guard<mutex> lock(new_sth_callbacks_lock_);
+  CHECK(new_sth_callbacks_.insert(CHECK_NOTNULL(callback)).second);
+}
+
+
+void LogLookup::RemoveNewSTHCallback(const NewSTHCallback* callback) {
+  lock_guard<mutex> lock(new_sth_callbacks_lock_);
+  CHECK_EQ(1U, new_sth_callbacks_.erase(callback));
+}
+
+
+void LogLookup::LoadLeafIndex() {
+  lock_guard<mutex> update_lock(update_lock_);
+  lock_guard<SharedMutex> lock(lock_);
+  leaf_index_.Reserve(cert_tree_.LeafCount());
+  for (size_t leaf = 1; leaf <= cert_tree_.LeafCount(); ++leaf) {
+    leaf_index_.Insert(cert_tree_.LeafHash(leaf), leaf - 1);
+  }
+  // Make sure lookups will not have to update the tree.
+  cert_tree_.CurrentRoot();
+  if (cert_tree_.LeafCount() > 0) {
+    LOG(INFO) << "Resumed with " << cert_tree_.LeafCount()
+              << " leaves from the node store";
+  }
+}
+
+
 void LogLookup::UpdateFromSTH(const SignedTreeHead& sth) {
-  lock_guard<mutex> lock(lock_);
+  lock_guard<mutex> update_lock(update_lock_);
 
   CHECK_EQ(ct::V1, sth.version())
       << "Tree head signed with an unknown version";
@@ -60,6 +222,19 @@ void LogLookup::UpdateFromSTH(const SignedTreeHead& sth) {
     return;
 
   CHECK_LE(0, sth.tree_size());
+  if (!latest_tree_head_.has_timestamp() &&
+      static_cast<uint64_t>(sth.tree_size()) < cert_tree_.LeafCount()) {
+    // This is the first STH since we resumed from a node store, which
+    // got ahead of the database (it might have kept leaves from an
+    // update that did not complete, or the database might have been
+    // restored from an older backup). Roll it back, the leaves we keep
+    // are verified against this STH below.
+    LOG(WARNING) << "Node store has " << cert_tree_.LeafCount()
+                 << " leaves, truncating to the " << sth.tree_size()
+                 << " entries of the database STH";
+    TruncateTree(sth.tree_size());
+  }
+
   if (sth.timestamp() <= latest_tree_head_.timestamp() ||
       static_cast<uint64_t>(sth.tree_size()) < cert_tree_.LeafCount()) {
     LOG(WARNING) << "Database replied with an STH that is older than ours: "
@@ -71,52 +246,137 @@ void LogLookup::UpdateFromSTH(const SignedTreeHead& sth) {
   // Record the new hashes: append all of them, die on any error.
   // TODO(ekasper): make tree signer write leaves out to the database,
   // so that we don't have to read the entries in.
-  string leaf_hash;
-  auto it(db_->ScanEntries(cert_tree_.LeafCount()));
   // LeafCount() is potentially unsigned here but as this is using memory
   // the count can never get close to overflow in 64 bits.
   CHECK_LE(cert_tree_.LeafCount(), static_cast<uint64_t>(INT64_MAX));
 
-  for (int64_t sequence_number = cert_tree_.LeafCount();
-       sequence_number < sth.tree_size(); ++sequence_number) {
-    LoggedEntry logged;
-    // TODO(ekasper): perhaps some of these errors can/should be
-    // handled more gracefully. E.g. we could retry a failed update
-    // a number of times -- but until we know under which conditions
-    // the database might fail (database busy?), just die.
-    CHECK(it->GetNextEntry(&logged))
-        << "Latest STH has " << sth.tree_size() << "entries but we failed to "
-        << "retrieve entry number " << sequence_number;
-    CHECK(logged.has_sequence_number())
-        << "Logged entry has no sequence number";
-    CHECK_EQ(sequence_number, logged.sequence_number());
-
-    leaf_hash = LeafHash(logged);
-    // TODO(ekasper): plug in the log public key so that we can verify the STH.
-    CHECK_EQ(static_cast<size_t>(sequence_number + 1),
-             cert_tree_.AddLeafHash(leaf_hash));
-    // Duplicate leaves shouldn't really happen but are not a problem either:
-    // we just return the Merkle proof of the first occurrence.
-    leaf_index_.insert(make_pair(leaf_hash, sequence_number));
+  if (!latest_tree_head_.has_timestamp()) {
+    LoadSTHIndex(sth);
   }
+
+  const int64_t old_size(cert_tree_.LeafCount());
+  // Not for the entries loaded when starting, which are not new.
+  const bool caught_up(latest_tree_head_.has_timestamp());
+  MergeDelayRecorder merge_delay("served");
+  for (int64_t begin = old_size; begin < sth.tree_size();
+       begin += kUpdateBatchSize) {
+    AddLeaves(begin, min(begin + kUpdateBatchSize, sth.tree_size()), sth,
+              caught_up ? &merge_delay : nullptr);
+  }
+  // TODO(ekasper): plug in the log public key so that we can verify the STH.
+  // The tree is fully evaluated at this point, so this is read-only.
   CHECK_EQ(HexString(cert_tree_.CurrentRoot()),
            HexString(sth.sha256_root_hash()))
       << "Computed root hash and stored STH root hash do not match";
+  cert_tree_.SyncNodes();
   LOG(INFO) << "Found " << sth.tree_size() - latest_tree_head_.tree_size()
             << " new log entries";
-  latest_tree_head_.CopyFrom(sth);
+  PrecomputeConsistencyProofs(sth.tree_size());
+  PrecomputeAuditProofs(old_size, sth.tree_size());
+  const shared_ptr<const SignedTreeHead> new_sth(
+      make_shared<const SignedTreeHead>(sth));
+  {
+    lock_guard<SharedMutex> lock(lock_);
+    latest_tree_head_.CopyFrom(sth);
+    atomic_store(&latest_sth_, new_sth);
+    IndexSTH(new_sth);
+  }
+  {
+    lock_guard<mutex> lock(new_sth_callbacks_lock_);
+    for (const auto& callback : new_sth_callbacks_) {
+      (*callback)(new_sth);
+    }
+  }
+  merge_delay.Record();
+  if (caught_up) {
+    RecordSTHDelay("loaded", sth);
+  }
 
-  const time_t last_update(static_cast<time_t>(latest_tree_head_.timestamp() /
-                                               kNumMillisPerSecond));
+  const time_t last_update(
+      static_cast<time_t>(sth.timestamp() / kNumMillisPerSecond));
   char buf[kCtimeBufSize];
   LOG(INFO) << "Tree successfully updated at " << ctime_r(&last_update, buf);
 }
 
 
+void LogLookup::LoadSTHIndex(const SignedTreeHead& sth) {
+  vector<SignedTreeHead> sths;
+  db_->ReadTreeHeads(&sths);
+  lock_guard<SharedMutex> lock(lock_);
+  // By increasing timestamp, so the first of every size wins.
+  for (const SignedTreeHead& old_sth : sths) {
+    if (old_sth.timestamp() < sth.timestamp()) {
+      IndexSTH(make_shared<const SignedTreeHead>(old_sth));
+    }
+  }
+  LOG(INFO) << "Indexed " << sths_by_tree_size_.size()
+            << " tree sizes from " << sths.size() << " tree heads";
+}
+
+
+void LogLookup::IndexSTH(const shared_ptr<const SignedTreeHead>& sth) {
+  sths_by_tree_size_.insert(make_pair(sth->tree_size(), sth));
+}
+
+
+void LogLookup::AddLeaves(int64_t begin, int64_t end,
+                          const SignedTreeHead& sth,
+                          MergeDelayRecorder* merge_delay) {
+  vector<LoggedEntry> entries;
+  db_->ReadLeafRange(begin, end - begin, &entries);
+  // TODO(ekasper): perhaps some of these errors can/should be
+  // handled more gracefully. E.g. we could retry a failed update
+  // a number of times -- but until we know under which conditions
+  // the database might fail (database busy?), just die.
+  CHECK_EQ(static_cast<size_t>(end - begin), entries.size())
+      << "Latest STH has " << sth.tree_size() << "entries but we failed to "
+      << "retrieve entry number " << begin + entries.size();
+  const vector<Digest> leaf_hashes(leaf_hasher_.HashLeaves(entries));
+  if (merge_delay) {
+    for (const LoggedEntry& entry : entries) {
+      merge_delay->Add(entry);
+    }
+  }
+
+  lock_guard<SharedMutex> lock(lock_);
+  CHECK_EQ(static_cast<size_t>(end), cert_tree_.AddLeafHashes(leaf_hashes));
+  leaf_index_.Reserve(end);
+  for (const auto& leaf_hash : leaf_hashes) {
+    // Duplicate leaves shouldn't really happen but are not a problem either:
+    // we just return the Merkle proof of the first occurrence.
+    leaf_index_.Insert(leaf_hash.ToString(), begin);
+    ++begin;
+  }
+  // Make sure lookups will not have to update the tree.
+  cert_tree_.CurrentRoot();
+}
+
+
+void LogLookup::TruncateTree(int64_t tree_size) {
+  lock_guard<SharedMutex> lock(lock_);
+  for (size_t leaf = tree_size + 1; leaf <= cert_tree_.LeafCount(); ++leaf) {
+    const string leaf_hash(cert_tree_.LeafHash(leaf));
+    int64_t index;
+    // Only remove the mapping if it is for this leaf, and not an
+    // earlier duplicate.
+    if (leaf_index_.Find(leaf_hash, &index) &&
+        index == static_cast<int64_t>(leaf - 1)) {
+      leaf_index_.Erase(leaf_hash);
+    }
+  }
+  cert_tree_.Truncate(tree_size);
+  cert_tree_.CurrentRoot();
+  cert_tree_.SyncNodes();
+}
+
+
 LogLookup::LookupResult LogLookup::GetIndex(const string& merkle_leaf_hash,
                                             int64_t* index) {
-  unique_lock<mutex> lock(lock_);
-  const int64_t myindex(GetIndexInternal(lock, merkle_leaf_hash));
+  ScopedSpan span("log_lookup_get_index");
+  ScopedSpan lock_wait("log_lookup_lock_wait");
+  SharedLock lock(&lock_);
+  lock_wait.End();
+  const int64_t myindex(GetIndexInternal(merkle_leaf_hash));
 
   if (myindex < 0) {
     return NOT_FOUND;
@@ -130,21 +390,28 @@ LogLookup::LookupResult LogLookup::GetIndex(const string& merkle_leaf_hash,
 // Look up by SHA256-hash of the certificate.
 LogLookup::LookupResult LogLookup::AuditProof(const string& merkle_leaf_hash,
                                               MerkleAuditProof* proof) {
-  unique_lock<mutex> lock(lock_);
+  ScopedSpan span("log_lookup_audit_proof");
+  ScopedSpan lock_wait("log_lookup_lock_wait");
+  SharedLock lock(&lock_);
+  lock_wait.End();
 
-  const int64_t leaf_index(GetIndexInternal(lock, merkle_leaf_hash));
+  const int64_t leaf_index(GetIndexInternal(merkle_leaf_hash));
   if (leaf_index < 0) {
     return NOT_FOUND;
   }
 
   CHECK_GE(leaf_index, 0);
+  // The tree might have more leaves than the STH, while it is being
+  // updated.
+  const int64_t tree_size(latest_tree_head_.tree_size());
   proof->set_version(ct::V1);
-  proof->set_tree_size(cert_tree_.LeafCount());
+  proof->set_tree_size(tree_size);
   proof->set_timestamp(latest_tree_head_.timestamp());
   proof->set_leaf_index(leaf_index);
 
   proof->clear_path_node();
-  vector<string> audit_path = cert_tree_.PathToCurrentRoot(leaf_index + 1);
+  vector<string> audit_path =
+      proofs_.PathToRootAtSnapshot(leaf_index + 1, tree_size);
   for (size_t i = 0; i < audit_path.size(); ++i)
     proof->add_path_node(audit_path[i]);
 
@@ -158,13 +425,16 @@ LogLookup::LookupResult LogLookup::AuditProof(const string& merkle_leaf_hash,
 LogLookup::LookupResult LogLookup::AuditProof(int64_t leaf_index,
                                               size_t tree_size,
                                               ShortMerkleAuditProof* proof) {
-  lock_guard<mutex> lock(lock_);
+  ScopedSpan span("log_lookup_audit_proof");
+  ScopedSpan lock_wait("log_lookup_lock_wait");
+  SharedLock lock(&lock_);
+  lock_wait.End();
 
   proof->set_leaf_index(leaf_index);
 
   proof->clear_path_node();
   vector<string> audit_path =
-      cert_tree_.PathToRootAtSnapshot(leaf_index + 1, tree_size);
+      proofs_.PathToRootAtSnapshot(leaf_index + 1, tree_size);
   for (size_t i = 0; i < audit_path.size(); ++i)
     proof->add_path_node(audit_path[i]);
 
@@ -172,10 +442,41 @@ LogLookup::LookupResult LogLookup::AuditProof(int64_t leaf_index,
 }
 
 
+void LogLookup::AuditProofs(int64_t begin, int64_t end, size_t tree_size,
+                            vector<ShortMerkleAuditProof>* proofs) {
+  CHECK_LE(0, begin);
+  CHECK_LE(begin, end);
+  ScopedSpan span("log_lookup_audit_proofs");
+  ScopedSpan lock_wait("log_lookup_lock_wait");
+  SharedLock lock(&lock_);
+  lock_wait.End();
+
+  proofs->resize(end - begin);
+  for (int64_t i = begin; i < end; ++i) {
+    ShortMerkleAuditProof* const proof(&(*proofs)[i - begin]);
+    proof->set_leaf_index(i);
+    proof->clear_path_node();
+    for (const auto& node : proofs_.PathToRootAtSnapshot(i + 1, tree_size)) {
+      proof->add_path_node(node);
+    }
+  }
+}
+
+
 // Look up by SHA256-hash of the certificate and tree size.
 LogLookup::LookupResult LogLookup::AuditProof(const string& merkle_leaf_hash,
                                               size_t tree_size,
                                               ShortMerkleAuditProof* proof) {
+  const shared_ptr<const RecentAuditProofs> recent(
+      atomic_load(&recent_audit_proofs_));
+  if (static_cast<int64_t>(tree_size) == recent->tree_size) {
+    const auto it(recent->by_hash.find(merkle_leaf_hash));
+    if (it != recent->by_hash.end()) {
+      proof->CopyFrom(it->second);
+      return OK;
+    }
+  }
+
   int64_t leaf_index;
   if (GetIndex(merkle_leaf_hash, &leaf_index) != OK)
     return NOT_FOUND;
@@ -186,8 +487,27 @@ LogLookup::LookupResult LogLookup::AuditProof(const string& merkle_leaf_hash,
 
 
 string LogLookup::RootAtSnapshot(size_t tree_size) {
-  lock_guard<mutex> lock(lock_);
-  return cert_tree_.RootAtSnapshot(tree_size);
+  ScopedSpan span("log_lookup_root_at_snapshot");
+  ScopedSpan lock_wait("log_lookup_lock_wait");
+  SharedLock lock(&lock_);
+  lock_wait.End();
+  const auto it(sths_by_tree_size_.find(tree_size));
+  if (it != sths_by_tree_size_.end()) {
+    return it->second->sha256_root_hash();
+  }
+  return proofs_.RootAtSnapshot(tree_size);
+}
+
+
+LogLookup::LookupResult LogLookup::STHAtTreeSize(int64_t tree_size,
+                                                 SignedTreeHead* sth) const {
+  SharedLock lock(&lock_);
+  const auto it(sths_by_tree_size_.find(tree_size));
+  if (it == sths_by_tree_size_.end()) {
+    return NOT_FOUND;
+  }
+  sth->CopyFrom(*it->second);
+  return OK;
 }
 
 
@@ -203,23 +523,24 @@ string LogLookup::LeafHash(const LoggedEntry& logged) const {
 
 unique_ptr<CompactMerkleTree> LogLookup::GetCompactMerkleTree(
     SerialHasher* hasher) {
-  lock_guard<mutex> lock(lock_);
+  // Holding |update_lock_| makes sure that the tree matches the latest
+  // STH (rather than being in the middle of an update).
+  lock_guard<mutex> update_lock(update_lock_);
+  SharedLock lock(&lock_);
   return unique_ptr<CompactMerkleTree>(
       new CompactMerkleTree(&cert_tree_, unique_ptr<SerialHasher>(hasher)));
 }
 
 
-int64_t LogLookup::GetIndexInternal(const unique_lock<mutex>& lock,
-                                    const string& merkle_leaf_hash) const {
-  CHECK(lock.owns_lock());
-
-  const map<string, int64_t>::const_iterator it(
-      leaf_index_.find(merkle_leaf_hash));
-  if (it == leaf_index_.end())
+int64_t LogLookup::GetIndexInternal(const string& merkle_leaf_hash) const {
+  int64_t index;
+  // Ignore the leaves that are not covered by the latest STH yet.
+  if (!leaf_index_.Find(merkle_leaf_hash, &index) ||
+      index >= latest_tree_head_.tree_size())
     return -1;
 
-  CHECK_GE(it->second, 0);
-  return it->second;
+  CHECK_GE(index, 0);
+  return index;
 }
 
 
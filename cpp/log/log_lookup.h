@@ -2,25 +2,58 @@
 #define CERT_TRANS_LOG_LOG_LOOKUP_H_
 
 #include <stdint.h>
+#include <deque>
+#include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <set>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "base/macros.h"
 #include "log/database.h"
+#include "log/leaf_hasher.h"
 #include "merkletree/compact_merkle_tree.h"
+#include "merkletree/merkle_node_store.h"
 #include "merkletree/merkle_tree.h"
+#include "merkletree/subtree_proofs.h"
 #include "proto/ct.pb.h"
+#include "util/hash_index.h"
+#include "util/memory_accounting.h"
+#include "util/shared_mutex.h"
 
 namespace cert_trans {
 
+class MergeDelayRecorder;
+class ThreadPool;
+
 
 // Lookups into the database. Read-only, so could also be a mirror.
-// Keeps the entire Merkle Tree in memory to serve audit proofs.
+// Keeps the entire Merkle Tree in memory (or in a persistent node
+// store) to serve audit proofs.
+//
+// Lookups only take a shared lock, so that they can proceed in
+// parallel. New entries are read and hashed without holding the lock
+// at all, and then added to the tree in batches under an exclusive
+// lock, so lookups are only held up briefly while catching up with a
+// big STH. Lookups only see the entries covered by the latest STH.
 class LogLookup {
  public:
-  // The constructor loads the content from the database.
-  explicit LogLookup(ReadOnlyDatabase* db);
+  // The constructor loads the content from the database. New entries
+  // are hashed on |pool| (which can be NULL, to hash them on the
+  // thread updating the tree). Does not take ownership of |pool|.
+  LogLookup(ReadOnlyDatabase* db, ThreadPool* pool);
+  // Same as above, but keeps the Merkle Tree nodes in |node_store|. If
+  // the store already contains leaves from a previous run, they act as
+  // a checkpoint: they are reused (after checking them against the
+  // latest STH of the database) and only the newer entries are read
+  // from the database. Leaves that are not covered by the database's
+  // STH are discarded.
+  LogLookup(ReadOnlyDatabase* db, std::unique_ptr<MerkleNodeStore> node_store,
+            ThreadPool* pool);
   ~LogLookup();
 
   enum LookupResult {
@@ -41,23 +74,54 @@ class LogLookup {
   LookupResult AuditProof(int64_t index, size_t tree_size,
                           ct::ShortMerkleAuditProof* proof);
 
-  // Look up by hash of the logged item and tree_size.
+  // Look up by hash of the logged item and tree_size. With
+  // --precompute_audit_proofs, the proofs of the entries that the
+  // latest STH added to the tree, against that STH, are returned
+  // without taking any lock, for the submitters polling for them.
   LookupResult AuditProof(const std::string& merkle_leaf_hash,
                           size_t tree_size, ct::ShortMerkleAuditProof* proof);
 
-  // Get a consitency proof between two tree heads
-  std::vector<std::string> ConsistencyProof(size_t first, size_t second) {
-    std::lock_guard<std::mutex> lock(lock_);
-    return cert_tree_.SnapshotConsistency(first, second);
-  }
+  // The same as AuditProof() by index, for all the items from |begin|
+  // to |end| (exclusive), under a single lock.
+  void AuditProofs(int64_t begin, int64_t end, size_t tree_size,
+                   std::vector<ct::ShortMerkleAuditProof>* proofs);
+
+  // Get a consitency proof between two tree heads. The proofs from
+  // the last few tree sizes to the current one, which most monitors
+  // ask for right after a new STH, are computed in advance, and
+  // returned without taking any lock.
+  std::vector<std::string> ConsistencyProof(size_t first, size_t second);
 
-  const ct::SignedTreeHead& GetSTH() const {
-    std::lock_guard<std::mutex> lock(lock_);
+  ct::SignedTreeHead GetSTH() const {
+    SharedLock lock(&lock_);
     return latest_tree_head_;
   }
 
+  // Same as GetSTH(), without taking any lock or copying the STH. The
+  // object never changes, a new one is published whenever the STH
+  // does.
+  std::shared_ptr<const ct::SignedTreeHead> GetSTHSnapshot() const {
+    return std::atomic_load(&latest_sth_);
+  }
+
+  // Called with every new STH, as soon as GetSTHSnapshot() returns it,
+  // on the thread updating the tree (so they should be quick). The
+  // callbacks must be removed before they go away.
+  typedef std::function<void(
+      const std::shared_ptr<const ct::SignedTreeHead>&)> NewSTHCallback;
+  void AddNewSTHCallback(const NewSTHCallback* callback);
+  void RemoveNewSTHCallback(const NewSTHCallback* callback);
+
+  // The root hash of the tree at |tree_size|, straight from the STH
+  // of that size if the log published one.
   std::string RootAtSnapshot(size_t tree_size);
 
+  // Fills |sth| with the first STH of the database (up to the latest
+  // one) with |tree_size| entries, for the consistency checks and
+  // audits against historical tree heads. Returns NOT_FOUND if there
+  // is none.
+  LookupResult STHAtTreeSize(int64_t tree_size, ct::SignedTreeHead* sth) const;
+
   std::string LeafHash(const LoggedEntry& logged) const;
 
   // Creates a CompactMerkleTree based on the current state of our MerkleTree.
@@ -66,23 +130,84 @@ class LogLookup {
       SerialHasher* hasher);
 
  private:
+  void LoadLeafIndex();
+  // Discard the leaves of |cert_tree_| past |tree_size|, and their
+  // entries from |leaf_index_|.
+  void TruncateTree(int64_t tree_size);
   void UpdateFromSTH(const ct::SignedTreeHead& sth);
-  int64_t GetIndexInternal(const std::unique_lock<std::mutex>& lock,
-                           const std::string& merkle_leaf_hash) const;
-
-  mutable std::mutex lock_;
+  // Indexes the STHs of the database up to |sth|, the first one
+  // loaded. |update_lock_| must be held.
+  void LoadSTHIndex(const ct::SignedTreeHead& sth);
+  // Adds |sth| to |sths_by_tree_size_|, unless it already has one of
+  // that size. |lock_| must be held in exclusive mode.
+  void IndexSTH(const std::shared_ptr<const ct::SignedTreeHead>& sth);
+  // Adds the leaves for the entries [|begin|, |end|) to the tree, with
+  // only a brief exclusive lock, and the entries to |merge_delay|, if
+  // not NULL.
+  void AddLeaves(int64_t begin, int64_t end, const ct::SignedTreeHead& sth,
+                 MergeDelayRecorder* merge_delay);
+  // Computes |recent_consistency_proofs_| for the new |tree_size|,
+  // before it is published. |update_lock_| must be held.
+  void PrecomputeConsistencyProofs(int64_t tree_size);
+  // Computes |recent_audit_proofs_| for the leaves from |begin| to
+  // |end| (exclusive), added for the new STH of size |end|, before it
+  // is published. |update_lock_| must be held.
+  void PrecomputeAuditProofs(int64_t begin, int64_t end);
+  // |lock_| must be held (in either mode).
+  int64_t GetIndexInternal(const std::string& merkle_leaf_hash) const;
+
+  // Serializes the updates to |cert_tree_|, |leaf_index_| and
+  // |latest_tree_head_|, which (besides this lock) also need |lock_| in
+  // exclusive mode. As a result, updates can read them without
+  // holding |lock_|.
+  std::mutex update_lock_;
+  // Held in shared mode to perform lookups. Every time it is released
+  // from exclusive mode, all the leaves of |cert_tree_| have been
+  // processed, so that lookups do not modify |cert_tree_| (which
+  // evaluates lazily otherwise).
+  mutable SharedMutex lock_;
   // We keep a hash -> index mapping in memory so that we can quickly serve
   // Merkle proofs without having to query the database at all.
-  // Note that 32 bytes is an overkill and we can optimize this to use
-  // a shorter prefix (possibly with a multimap).
-  std::map<std::string, int64_t> leaf_index_;
+  HashIndex leaf_index_;
 
   ReadOnlyDatabase* const db_;
+  const LeafHasher leaf_hasher_;
   MerkleTree cert_tree_;
+  // Serves the proofs from the nodes of |cert_tree_|.
+  const SubtreeProofs proofs_;
   ct::SignedTreeHead latest_tree_head_;
+  // A copy of |latest_tree_head_|, swapped atomically.
+  std::shared_ptr<const ct::SignedTreeHead> latest_sth_;
+  // The first STH of every tree size published, up to
+  // |latest_tree_head_|. The tree heads are persisted by the database,
+  // this is rebuilt from them when starting.
+  std::unordered_map<int64_t, std::shared_ptr<const ct::SignedTreeHead>>
+      sths_by_tree_size_;
+  // The tree sizes of the last STHs, oldest first, only accessed with
+  // |update_lock_| held.
+  std::deque<int64_t> recent_tree_sizes_;
+  // The consistency proofs from |recent_tree_sizes_| to the current
+  // tree size, by (first, second), swapped atomically.
+  typedef std::map<std::pair<size_t, size_t>, std::vector<std::string>>
+      ConsistencyProofs;
+  std::shared_ptr<const ConsistencyProofs> recent_consistency_proofs_;
+  // The audit proofs of (some of) the leaves added for the current
+  // tree size, against it, by leaf hash, swapped atomically.
+  struct RecentAuditProofs {
+    int64_t tree_size = -1;
+    std::unordered_map<std::string, ct::ShortMerkleAuditProof> by_hash;
+  };
+  std::shared_ptr<const RecentAuditProofs> recent_audit_proofs_;
 
   const Database::NotifySTHCallback update_from_sth_cb_;
 
+  std::mutex new_sth_callbacks_lock_;
+  std::set<const NewSTHCallback*> new_sth_callbacks_;
+
+  // Last, to stop counting the tree and the index before they go.
+  const std::unique_ptr<MemoryAccounting::Registration> tree_memory_;
+  const std::unique_ptr<MemoryAccounting::Registration> index_memory_;
+
   DISALLOW_COPY_AND_ASSIGN(LogLookup);
 };
 
@@ -1,7 +1,10 @@
 /* -*- indent-tabs-mode: nil -*- */
+#include <gflags/gflags.h>
 #include <gtest/gtest.h>
 #include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "log/etcd_consistent_store.h"
 #include "log/file_db.h"
@@ -14,16 +17,19 @@
 #include "log/test_db.h"
 #include "log/test_signer.h"
 #include "log/tree_signer.h"
+#include "merkletree/merkle_tree.h"
 #include "merkletree/merkle_verifier.h"
+#include "merkletree/mmap_node_store.h"
 #include "merkletree/serial_hasher.h"
 #include "proto/cert_serializer.h"
 #include "util/fake_etcd.h"
 #include "util/mock_masterelection.h"
-#include "util/sync_task.h"
 #include "util/testing.h"
 #include "util/thread_pool.h"
 #include "util/util.h"
 
+DECLARE_int32(precompute_audit_proofs);
+
 namespace {
 
 namespace libevent = cert_trans::libevent;
@@ -35,12 +41,16 @@ using cert_trans::FakeEtcdClient;
 using cert_trans::FileDB;
 using cert_trans::LogLookup;
 using cert_trans::LoggedEntry;
+using cert_trans::MerkleNodeStore;
+using cert_trans::MmapNodeStore;
 using cert_trans::MockMasterElection;
 using cert_trans::SQLiteDB;
 using cert_trans::ThreadPool;
 using cert_trans::TreeSigner;
 using ct::MerkleAuditProof;
+using ct::SignedTreeHead;
 using ct::SequenceMapping;
+using ct::ShortMerkleAuditProof;
 using std::make_shared;
 using std::shared_ptr;
 using std::string;
@@ -63,19 +73,12 @@ class LogLookupTest : public ::testing::Test {
         tree_signer_(std::chrono::duration<double>(0), db(),
                      unique_ptr<CompactMerkleTree>(new CompactMerkleTree(
                          unique_ptr<Sha256Hasher>(new Sha256Hasher))),
-                     &store_, log_signer_.get()),
+                     &store_, log_signer_.get(), &pool_),
         verifier_(TestSigner::DefaultLogSigVerifier(),
                   new MerkleVerifier(
                       unique_ptr<Sha256Hasher>(new Sha256Hasher))) {
     // Set some noddy STH so that we can call UpdateTree on the Tree Signer.
     store_.SetServingSTH(ct::SignedTreeHead());
-    // Force an empty sequence mapping file:
-    {
-      util::SyncTask task(&pool_);
-      EtcdClient::Response r;
-      etcd_client_.ForceSet("/root/sequence_mapping", "", &r, task.task());
-      task.Wait();
-    }
   }
 
 
@@ -145,7 +148,7 @@ TYPED_TEST(LogLookupTest, Lookup) {
   MerkleAuditProof proof;
   this->UpdateTree();
 
-  LogLookup lookup(this->db());
+  LogLookup lookup(this->db(), &this->pool_);
   // Look the new entry up.
   EXPECT_EQ(LogLookup::OK,
             lookup.AuditProof(logged_cert.merkle_leaf_hash(), &proof));
@@ -160,7 +163,7 @@ TYPED_TEST(LogLookupTest, NotFound) {
   MerkleAuditProof proof;
   this->UpdateTree();
 
-  LogLookup lookup(this->db());
+  LogLookup lookup(this->db(), &this->pool_);
 
   // Look up using a wrong hash.
   string hash = this->test_signer_.UniqueHash();
@@ -169,7 +172,7 @@ TYPED_TEST(LogLookupTest, NotFound) {
 
 
 TYPED_TEST(LogLookupTest, Update) {
-  LogLookup lookup(this->db());
+  LogLookup lookup(this->db(), &this->pool_);
   LoggedEntry logged_cert;
   this->test_signer_.CreateUnique(&logged_cert);
   this->CreateSequencedEntry(&logged_cert, 0);
@@ -183,6 +186,50 @@ TYPED_TEST(LogLookupTest, Update) {
 }
 
 
+TYPED_TEST(LogLookupTest, STHSnapshot) {
+  LogLookup lookup(this->db(), &this->pool_);
+  const shared_ptr<const SignedTreeHead> before(lookup.GetSTHSnapshot());
+  EXPECT_EQ(0, before->tree_size());
+
+  LoggedEntry logged_cert;
+  this->test_signer_.CreateUnique(&logged_cert);
+  this->CreateSequencedEntry(&logged_cert, 0);
+  this->UpdateTree();
+
+  const shared_ptr<const SignedTreeHead> after(lookup.GetSTHSnapshot());
+  EXPECT_EQ(1, after->tree_size());
+  EXPECT_EQ(lookup.GetSTH().DebugString(), after->DebugString());
+  // Earlier snapshots are left alone.
+  EXPECT_EQ(0, before->tree_size());
+}
+
+
+TYPED_TEST(LogLookupTest, NewSTHCallback) {
+  LogLookup lookup(this->db(), &this->pool_);
+  std::vector<shared_ptr<const SignedTreeHead>> published;
+  const LogLookup::NewSTHCallback callback(
+      [&published](const shared_ptr<const SignedTreeHead>& sth) {
+        published.push_back(sth);
+      });
+  lookup.AddNewSTHCallback(&callback);
+
+  LoggedEntry logged_cert;
+  this->test_signer_.CreateUnique(&logged_cert);
+  this->CreateSequencedEntry(&logged_cert, 0);
+  this->UpdateTree();
+  ASSERT_EQ(1U, published.size());
+  EXPECT_EQ(lookup.GetSTHSnapshot(), published[0]);
+  EXPECT_EQ(1, published[0]->tree_size());
+
+  lookup.RemoveNewSTHCallback(&callback);
+  this->test_signer_.CreateUnique(&logged_cert);
+  this->CreateSequencedEntry(&logged_cert, 1);
+  this->UpdateTree();
+  EXPECT_EQ(1U, published.size());
+  EXPECT_EQ(2, lookup.GetSTHSnapshot()->tree_size());
+}
+
+
 // Verify that the audit proof constructed is correct (assuming the signer
 // operates correctly). TODO(ekasper): KAT tests.
 TYPED_TEST(LogLookupTest, Verify) {
@@ -193,7 +240,7 @@ TYPED_TEST(LogLookupTest, Verify) {
   MerkleAuditProof proof;
   this->UpdateTree();
 
-  LogLookup lookup(this->db());
+  LogLookup lookup(this->db(), &this->pool_);
   // Look the new entry up.
   EXPECT_EQ(LogLookup::OK,
             lookup.AuditProof(logged_cert.merkle_leaf_hash(), &proof));
@@ -215,7 +262,7 @@ TYPED_TEST(LogLookupTest, VerifyWithPath) {
 
   this->UpdateTree();
 
-  LogLookup lookup(this->db());
+  LogLookup lookup(this->db(), &this->pool_);
   MerkleAuditProof proof;
 
   for (int i = 0; i < 13; ++i) {
@@ -229,6 +276,242 @@ TYPED_TEST(LogLookupTest, VerifyWithPath) {
 }
 
 
+TYPED_TEST(LogLookupTest, VerifyBatch) {
+  LoggedEntry logged_certs[13];
+  for (int i = 0; i < 13; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+
+  this->UpdateTree();
+
+  LogLookup lookup(this->db(), &this->pool_);
+  std::vector<ct::LogEntry> entries;
+  std::vector<ct::SignedCertificateTimestamp> scts;
+  std::vector<MerkleAuditProof> proofs;
+  // Every other entry.
+  for (int i = 0; i < 13; i += 2) {
+    entries.push_back(logged_certs[i].entry());
+    scts.push_back(logged_certs[i].sct());
+    proofs.emplace_back();
+    EXPECT_EQ(LogLookup::OK, lookup.AuditProof(
+                                 logged_certs[i].merkle_leaf_hash(),
+                                 &proofs.back()));
+  }
+  EXPECT_EQ(LogVerifier::VERIFY_OK,
+            this->verifier_.VerifyMerkleAuditProofs(entries, scts, proofs));
+
+  // An entry that is not where its proof says.
+  std::swap(entries[1], entries[2]);
+  std::swap(scts[1], scts[2]);
+  EXPECT_EQ(LogVerifier::INVALID_MERKLE_PATH,
+            this->verifier_.VerifyMerkleAuditProofs(entries, scts, proofs));
+  std::swap(entries[1], entries[2]);
+  std::swap(scts[1], scts[2]);
+
+  // Proofs for different tree heads.
+  proofs[1].set_tree_size(proofs[1].tree_size() - 1);
+  EXPECT_EQ(LogVerifier::INVALID_FORMAT,
+            this->verifier_.VerifyMerkleAuditProofs(entries, scts, proofs));
+}
+
+
+TYPED_TEST(LogLookupTest, AuditProofs) {
+  for (int i = 0; i < 13; ++i) {
+    LoggedEntry logged_cert;
+    this->test_signer_.CreateUnique(&logged_cert);
+    this->CreateSequencedEntry(&logged_cert, i);
+  }
+  this->UpdateTree();
+
+  LogLookup lookup(this->db(), &this->pool_);
+  std::vector<ShortMerkleAuditProof> proofs;
+  // A range of an older tree, the same as asking one by one.
+  lookup.AuditProofs(3, 9, 11, &proofs);
+  ASSERT_EQ(6U, proofs.size());
+  for (int i = 3; i < 9; ++i) {
+    ShortMerkleAuditProof proof;
+    EXPECT_EQ(LogLookup::OK, lookup.AuditProof(i, 11, &proof));
+    EXPECT_EQ(proof.DebugString(), proofs[i - 3].DebugString());
+  }
+}
+
+
+TYPED_TEST(LogLookupTest, ConsistencyProof) {
+  LogLookup lookup(this->db(), &this->pool_);
+  LoggedEntry logged_cert;
+  // Tree sizes 2, 3, 5, 8, 13.
+  for (int i = 0, size = 2, next = 3; i < 13; ++i) {
+    this->test_signer_.CreateUnique(&logged_cert);
+    this->CreateSequencedEntry(&logged_cert, i);
+    if (i + 1 == size) {
+      this->UpdateTree();
+      const int sum(size + next);
+      size = next;
+      next = sum;
+    }
+  }
+
+  // The proofs to 13 from the previous tree sizes were computed in
+  // advance, the others not, which a new lookup does not know about.
+  LogLookup fresh(this->db(), &this->pool_);
+  for (size_t first = 1; first < 13; ++first) {
+    EXPECT_EQ(fresh.ConsistencyProof(first, 13),
+              lookup.ConsistencyProof(first, 13))
+        << first;
+  }
+  EXPECT_EQ(fresh.ConsistencyProof(3, 8), lookup.ConsistencyProof(3, 8));
+}
+
+
+TYPED_TEST(LogLookupTest, STHAtTreeSize) {
+  LogLookup lookup(this->db(), &this->pool_);
+  LoggedEntry logged_cert;
+  std::vector<SignedTreeHead> sths;
+  for (int i = 0; i < 3; ++i) {
+    this->test_signer_.CreateUnique(&logged_cert);
+    this->CreateSequencedEntry(&logged_cert, i);
+    this->UpdateTree();
+    sths.push_back(lookup.GetSTH());
+  }
+
+  // A new lookup gets the earlier ones from the database.
+  LogLookup fresh(this->db(), &this->pool_);
+  for (LogLookup* l : {&lookup, &fresh}) {
+    SignedTreeHead sth;
+    for (const SignedTreeHead& expected : sths) {
+      EXPECT_EQ(LogLookup::OK, l->STHAtTreeSize(expected.tree_size(), &sth));
+      EXPECT_EQ(expected.DebugString(), sth.DebugString());
+      EXPECT_EQ(expected.sha256_root_hash(),
+                l->RootAtSnapshot(expected.tree_size()));
+    }
+    EXPECT_EQ(LogLookup::NOT_FOUND, l->STHAtTreeSize(4, &sth));
+  }
+}
+
+
+TYPED_TEST(LogLookupTest, PrecomputedAuditProofs) {
+  FLAGS_precompute_audit_proofs = 3;
+  LogLookup lookup(this->db(), &this->pool_);
+  LoggedEntry logged_certs[9];
+  for (int i = 0; i < 9; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+    if (i == 4) {
+      this->UpdateTree();
+    }
+  }
+  this->UpdateTree();
+  FLAGS_precompute_audit_proofs = 0;
+
+  // Precomputed for the last three entries, the same for the others.
+  LogLookup fresh(this->db(), &this->pool_);
+  for (int i = 0; i < 9; ++i) {
+    for (int tree_size : {5, 9}) {
+      if (i >= tree_size) {
+        continue;
+      }
+      ShortMerkleAuditProof proof, expected;
+      const string hash(logged_certs[i].merkle_leaf_hash());
+      const LogLookup::LookupResult result(
+          fresh.AuditProof(hash, tree_size, &expected));
+      EXPECT_EQ(result, lookup.AuditProof(hash, tree_size, &proof));
+      EXPECT_EQ(expected.DebugString(), proof.DebugString())
+          << i << " " << tree_size;
+    }
+  }
+}
+
+
+TYPED_TEST(LogLookupTest, ResumeFromNodeStore) {
+  TmpStorage node_dir;
+  LoggedEntry logged_certs[7];
+  for (int i = 0; i < 5; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->UpdateTree();
+
+  {
+    LogLookup lookup(this->db(),
+                     unique_ptr<MerkleNodeStore>(
+                         new MmapNodeStore(node_dir.TmpStorageDir(), 32)),
+                     &this->pool_);
+    EXPECT_EQ(5, lookup.GetSTH().tree_size());
+  }
+
+  for (int i = 5; i < 7; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->UpdateTree();
+
+  // The first five leaves come from the node store, the others from
+  // the database.
+  LogLookup lookup(this->db(),
+                   unique_ptr<MerkleNodeStore>(
+                       new MmapNodeStore(node_dir.TmpStorageDir(), 32)),
+                   &this->pool_);
+  EXPECT_EQ(7, lookup.GetSTH().tree_size());
+  MerkleAuditProof proof;
+  for (int i = 0; i < 7; ++i) {
+    EXPECT_EQ(LogLookup::OK,
+              lookup.AuditProof(logged_certs[i].merkle_leaf_hash(), &proof));
+    EXPECT_EQ(LogVerifier::VERIFY_OK,
+              this->verifier_.VerifyMerkleAuditProof(logged_certs[i].entry(),
+                                                     logged_certs[i].sct(),
+                                                     proof));
+  }
+}
+
+
+TYPED_TEST(LogLookupTest, NodeStoreAheadOfDatabase) {
+  TmpStorage node_dir;
+  LoggedEntry logged_certs[5];
+  for (int i = 0; i < 5; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->UpdateTree();
+
+  {
+    LogLookup lookup(this->db(),
+                     unique_ptr<MerkleNodeStore>(
+                         new MmapNodeStore(node_dir.TmpStorageDir(), 32)),
+                     &this->pool_);
+  }
+  const string kBogusHash("0123456789abcdef0123456789abcdef");
+  {
+    // Add leaves that the database doesn't know about.
+    MerkleTree tree(unique_ptr<Sha256Hasher>(new Sha256Hasher),
+                    unique_ptr<MerkleNodeStore>(
+                        new MmapNodeStore(node_dir.TmpStorageDir(), 32)));
+    ASSERT_EQ(5U, tree.LeafCount());
+    tree.AddLeafHash(kBogusHash);
+    tree.AddLeafHash(kBogusHash);
+    tree.CurrentRoot();
+    tree.SyncNodes();
+  }
+
+  LogLookup lookup(this->db(),
+                   unique_ptr<MerkleNodeStore>(
+                       new MmapNodeStore(node_dir.TmpStorageDir(), 32)),
+                   &this->pool_);
+  EXPECT_EQ(5, lookup.GetSTH().tree_size());
+  int64_t index;
+  EXPECT_EQ(LogLookup::NOT_FOUND, lookup.GetIndex(kBogusHash, &index));
+  MerkleAuditProof proof;
+  for (int i = 0; i < 5; ++i) {
+    EXPECT_EQ(LogLookup::OK,
+              lookup.AuditProof(logged_certs[i].merkle_leaf_hash(), &proof));
+    EXPECT_EQ(LogVerifier::VERIFY_OK,
+              this->verifier_.VerifyMerkleAuditProof(logged_certs[i].entry(),
+                                                     logged_certs[i].sct(),
+                                                     proof));
+  }
+}
+
+
 }  // namespace
 
 
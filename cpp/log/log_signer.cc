@@ -20,6 +20,8 @@ using ct::LogEntryType;
 using ct::SignedCertificateTimestamp;
 using ct::SignedTreeHead;
 using std::string;
+using util::Status;
+using util::Task;
 
 #if OPENSSL_VERSION_NUMBER < 0x10000000
 #error "Need OpenSSL >= 1.0.0"
@@ -121,6 +123,24 @@ LogSigner::SignResult LogSigner::SignCertificateTimestamp(
   return OK;
 }
 
+void LogSigner::SignCertificateTimestamp(const LogEntry& entry,
+                                         SignedCertificateTimestamp* sct,
+                                         Task* task) const {
+  CHECK(sct->has_timestamp())
+      << "Attempt to sign an SCT with a missing timestamp";
+
+  string serialized_input;
+  const SerializeResult res(
+      Serializer::SerializeSCTSignatureInput(*sct, entry, &serialized_input));
+  if (res != SerializeResult::OK) {
+    task->Return(
+        Status(util::error::INVALID_ARGUMENT, "could not serialize the SCT"));
+    return;
+  }
+  SignAndSetKeyId(serialized_input, sct->mutable_signature(),
+                  sct->mutable_id(), task);
+}
+
 LogSigner::SignResult LogSigner::SignV1TreeHead(uint64_t timestamp,
                                                 int64_t tree_size,
                                                 const string& root_hash,
@@ -152,6 +172,30 @@ LogSigner::SignResult LogSigner::SignTreeHead(SignedTreeHead* sth) const {
   return OK;
 }
 
+void LogSigner::SignTreeHead(SignedTreeHead* sth, Task* task) const {
+  string serialized_sth;
+  const SerializeResult res(
+      Serializer::SerializeSTHSignatureInput(*sth, &serialized_sth));
+  if (res != SerializeResult::OK) {
+    task->Return(
+        Status(util::error::INVALID_ARGUMENT, "could not serialize the STH"));
+    return;
+  }
+  SignAndSetKeyId(serialized_sth, sth->mutable_signature(), sth->mutable_id(),
+                  task);
+}
+
+void LogSigner::SignAndSetKeyId(const string& serialized,
+                                DigitallySigned* signature, ct::LogID* id,
+                                Task* task) const {
+  Sign(serialized, signature, task->AddChild([this, id, task](Task* child) {
+    if (child->status().ok()) {
+      id->set_key_id(KeyID());
+    }
+    task->Return(child->status());
+  }));
+}
+
 // static
 LogSigner::SignResult LogSigner::GetSerializeError(SerializeResult result) {
   SignResult sign_result;
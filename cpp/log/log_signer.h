@@ -46,15 +46,31 @@ class LogSigner : public cert_trans::Signer {
   SignResult SignCertificateTimestamp(
       const ct::LogEntry& entry, ct::SignedCertificateTimestamp* sct) const;
 
+  // Same as above, but through the asynchronous Sign(), returning
+  // |task| once done, with INVALID_ARGUMENT if the SCT could not be
+  // serialized.
+  void SignCertificateTimestamp(const ct::LogEntry& entry,
+                                ct::SignedCertificateTimestamp* sct,
+                                util::Task* task) const;
+
   SignResult SignV1TreeHead(uint64_t timestamp, int64_t tree_size,
                             const std::string& root_hash,
                             std::string* result) const;
 
   SignResult SignTreeHead(ct::SignedTreeHead* sth) const;
 
+  // Same as above, but through the asynchronous Sign().
+  void SignTreeHead(ct::SignedTreeHead* sth, util::Task* task) const;
+
  private:
   static SignResult GetSerializeError(
       cert_trans::serialization::SerializeResult result);
+
+  // Signs |serialized| into |signature|, and sets the key ID in |id|,
+  // before returning |task|.
+  void SignAndSetKeyId(const std::string& serialized,
+                       ct::DigitallySigned* signature, ct::LogID* id,
+                       util::Task* task) const;
 };
 
 class LogSigVerifier : public cert_trans::Verifier {
@@ -9,7 +9,10 @@
 #include "proto/cert_serializer.h"
 #include "proto/ct.pb.h"
 #include "proto/serializer.h"
+#include "util/status_test_util.h"
+#include "util/sync_task.h"
 #include "util/testing.h"
+#include "util/thread_pool.h"
 #include "util/util.h"
 
 namespace {
@@ -232,6 +235,32 @@ TEST_F(LogSignerTest, SignAndVerifySTH) {
                                             default_serialized_sig));
 }
 
+TEST_F(LogSignerTest, SignAndVerifyAsync) {
+  cert_trans::ThreadPool pool(1);
+  SignedTreeHead sth;
+  TestSigner::SetDefaults(&sth);
+  sth.clear_signature();
+  sth.clear_id();
+
+  util::SyncTask task(&pool);
+  signer_->SignTreeHead(&sth, task.task());
+  task.Wait();
+  EXPECT_OK(task.status());
+  EXPECT_EQ(signer_->KeyID(), sth.id().key_id());
+  EXPECT_EQ(LogSigVerifier::OK, verifier_->VerifySTHSignature(sth));
+
+  LogEntry entry;
+  test_signer_.CreateUnique(&entry);
+  SignedCertificateTimestamp sct;
+  sct.set_version(ct::V1);
+  sct.set_timestamp(util::TimeInMilliseconds());
+  util::SyncTask sct_task(&pool);
+  signer_->SignCertificateTimestamp(entry, &sct, sct_task.task());
+  sct_task.Wait();
+  EXPECT_OK(sct_task.status());
+  EXPECT_EQ(LogSigVerifier::OK, verifier_->VerifySCTSignature(entry, sct));
+}
+
 TEST_F(LogSignerTest, SignAndVerifyCertSCTApiCrossCheck) {
   LogEntry default_entry;
   TestSigner::SetDefaults(&default_entry);
@@ -16,6 +16,7 @@ using ct::MerkleAuditProof;
 using ct::SignedCertificateTimestamp;
 using ct::SignedTreeHead;
 using std::string;
+using std::vector;
 
 LogVerifier::LogVerifier(LogSigVerifier* sig_verifier,
                          MerkleVerifier* merkle_verifier)
@@ -113,6 +114,62 @@ LogVerifier::LogVerifyResult LogVerifier::VerifyMerkleAuditProof(
   return VERIFY_OK;
 }
 
+LogVerifier::LogVerifyResult LogVerifier::VerifyMerkleAuditProofs(
+    const vector<LogEntry>& entries,
+    const vector<SignedCertificateTimestamp>& scts,
+    const vector<MerkleAuditProof>& merkle_proofs) const {
+  if (merkle_proofs.empty() || entries.size() != merkle_proofs.size() ||
+      scts.size() != merkle_proofs.size())
+    return INVALID_FORMAT;
+
+  const MerkleAuditProof& first(merkle_proofs.front());
+  const string id(first.id().SerializeAsString());
+  const string signature(first.tree_head_signature().SerializeAsString());
+  vector<MerkleVerifier::AuditPath> paths(merkle_proofs.size());
+  for (size_t i = 0; i < merkle_proofs.size(); ++i) {
+    const MerkleAuditProof& merkle_proof(merkle_proofs[i]);
+    if (merkle_proof.version() != first.version() ||
+        merkle_proof.timestamp() != first.timestamp() ||
+        merkle_proof.tree_size() != first.tree_size() ||
+        merkle_proof.id().SerializeAsString() != id ||
+        merkle_proof.tree_head_signature().SerializeAsString() != signature)
+      return INVALID_FORMAT;
+
+    if (!IsBetween(merkle_proof.timestamp(), scts[i].timestamp(),
+                   util::TimeInMilliseconds() + 1000))
+      return INCONSISTENT_TIMESTAMPS;
+
+    string serialized_leaf;
+    if (Serializer::SerializeSCTMerkleTreeLeaf(scts[i], entries[i],
+                                               &serialized_leaf) !=
+        SerializeResult::OK)
+      return INVALID_FORMAT;
+
+    // Leaf indexing in the MerkleTree starts from 1.
+    paths[i].leaf = merkle_proof.leaf_index() + 1;
+    paths[i].leaf_hash = merkle_verifier_->LeafHash(serialized_leaf);
+    paths[i].path.assign(merkle_proof.path_node().begin(),
+                         merkle_proof.path_node().end());
+  }
+
+  const string root_hash(
+      merkle_verifier_->RootFromPaths(first.tree_size(), paths));
+  if (root_hash.empty())
+    return INVALID_MERKLE_PATH;
+
+  SignedTreeHead sth;
+  sth.set_version(first.version());
+  sth.mutable_id()->CopyFrom(first.id());
+  sth.set_timestamp(first.timestamp());
+  sth.set_tree_size(first.tree_size());
+  sth.set_sha256_root_hash(root_hash);
+  sth.mutable_signature()->CopyFrom(first.tree_head_signature());
+
+  if (sig_verifier_->VerifySTHSignature(sth) != LogSigVerifier::OK)
+    return INVALID_SIGNATURE;
+  return VERIFY_OK;
+}
+
 /* static */
 bool LogVerifier::IsBetween(uint64_t timestamp, uint64_t earliest,
                             uint64_t latest) {
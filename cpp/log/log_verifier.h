@@ -3,6 +3,8 @@
 
 #include <glog/logging.h>
 #include <stdint.h>
+#include <string>
+#include <vector>
 
 #include "base/macros.h"
 #include "log/log_signer.h"
@@ -107,6 +109,17 @@ class LogVerifier {
       const ct::LogEntry& entry, const ct::SignedCertificateTimestamp& sct,
       const ct::MerkleAuditProof& merkle_proof) const;
 
+  // Same as VerifyMerkleAuditProof(), for many entries (and their
+  // SCTs, in the same order) included in the same tree head: all of
+  // |merkle_proofs| must have the same tree head, whose signature is
+  // checked once, and the parts of their paths that they share are
+  // only hashed once. Returns VERIFY_OK iff VerifyMerkleAuditProof()
+  // would for every entry, and the first error found otherwise.
+  LogVerifyResult VerifyMerkleAuditProofs(
+      const std::vector<ct::LogEntry>& entries,
+      const std::vector<ct::SignedCertificateTimestamp>& scts,
+      const std::vector<ct::MerkleAuditProof>& merkle_proofs) const;
+
   bool VerifyConsistency(const ct::SignedTreeHead& sth1,
                          const ct::SignedTreeHead& sth2,
                          const std::vector<std::string>& proof) const;
@@ -1,5 +1,14 @@
+#include "config.h"
 #include "log/logged_entry.h"
 
+#include <gflags/gflags.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
+#include <string.h>
+#include <zlib.h>
+#include <functional>
+
+#include "base/macros.h"
 #include "proto/cert_serializer.h"
 #include "proto/serializer.h"
 #include "util/util.h"
@@ -7,26 +16,490 @@
 using cert_trans::serialization::SerializeResult;
 using ct::CertInfo;
 using ct::LogEntry;
+using ct::LoggedEntryPB;
+using ct::PrecertChainEntry;
 using ct::PreCert;
 using ct::SignedCertificateTimestamp;
+using ct::X509ChainEntry;
+using google::protobuf::MessageLite;
+using google::protobuf::internal::WireFormatLite;
+using google::protobuf::io::CodedInputStream;
+using std::atomic_load;
+using std::atomic_store;
+using std::function;
+using std::make_shared;
+using std::shared_ptr;
 using std::string;
 using util::RandomString;
 
+DEFINE_bool(store_serialized_entries, false,
+            "store the leaf_input and extra_data of the entries in the "
+            "database, alongside the entries, so that get-entries replies "
+            "can be sent without serializing them again (this roughly "
+            "doubles the size of the database)");
+DEFINE_bool(compress_stored_entries, false,
+            "compress the entries stored in the database (with the "
+            "--stored_entries_dictionary, if any); entries already stored "
+            "are read either way");
+DEFINE_string(stored_entries_dictionary, "",
+              "file of data likely to be found in the entries, such as the "
+              "most common intermediate certificates, with the most common "
+              "at the end (only the last 32 KiB are used); entries "
+              "compressed with it cannot be read without it, so it must "
+              "never change");
+
 namespace cert_trans {
+namespace {
+
+
+// The buffers and compression streams are kept from one entry to the
+// next, to reuse their memory. Not with __thread, which only takes
+// plain old data, they are made for each entry then.
+#ifdef HAVE_THREAD_LOCAL
+#define PER_THREAD static thread_local
+#else
+#define PER_THREAD
+#endif
+
+
+// Serialized protobufs never start with a zero byte (there is no field
+// number 0), so this marks the compressed ones. It is followed by the
+// size of the uncompressed data (4 bytes, little-endian), and a zlib
+// stream.
+const char kCompressedMarker = '\0';
+const size_t kCompressedHeaderSize = 5;
+
+
+class Dictionary {
+ public:
+  static const Dictionary& Get() {
+    return *Instance();
+  }
+
+  static void Reload() {
+    Instance()->Load();
+  }
+
+  bool empty() const {
+    return data_.empty();
+  }
+
+  const Bytef* data() const {
+    return reinterpret_cast<const Bytef*>(data_.data());
+  }
+
+  uInt size() const {
+    return data_.size();
+  }
+
+  // The adler32 checksum zlib records in the streams compressed with
+  // the dictionary.
+  uLong id() const {
+    return id_;
+  }
+
+ private:
+  static Dictionary* Instance() {
+    static Dictionary* const dictionary(new Dictionary);
+    return dictionary;
+  }
+
+  Dictionary() {
+    Load();
+  }
+
+  void Load() {
+    data_.clear();
+    id_ = 0;
+    if (FLAGS_stored_entries_dictionary.empty()) {
+      return;
+    }
+    CHECK(util::ReadBinaryFile(FLAGS_stored_entries_dictionary, &data_))
+        << "Could not read " << FLAGS_stored_entries_dictionary;
+    // Anything further back than the window is useless.
+    if (data_.size() > (1 << MAX_WBITS)) {
+      data_.erase(0, data_.size() - (1 << MAX_WBITS));
+    }
+    id_ = adler32(adler32(0, Z_NULL, 0), data(), size());
+  }
+
+  string data_;
+  uLong id_;
+};
+
+
+// The streams are set up once per thread, as that costs more than
+// compressing an entry.
+class Deflater {
+ public:
+  Deflater() {
+    memset(&stream_, 0, sizeof(stream_));
+    CHECK_EQ(Z_OK, deflateInit(&stream_, Z_DEFAULT_COMPRESSION));
+  }
+
+  ~Deflater() {
+    deflateEnd(&stream_);
+  }
+
+  // Sets |*dst| to |src|, compressed if that makes it smaller.
+  void Compress(const string& src, string* dst) {
+    CHECK_EQ(Z_OK, deflateReset(&stream_));
+    const Dictionary& dictionary(Dictionary::Get());
+    if (!dictionary.empty()) {
+      CHECK_EQ(Z_OK, deflateSetDictionary(&stream_, dictionary.data(),
+                                          dictionary.size()));
+    }
+
+    dst->resize(kCompressedHeaderSize + deflateBound(&stream_, src.size()));
+    (*dst)[0] = kCompressedMarker;
+    for (size_t i = 0; i < 4; ++i) {
+      (*dst)[1 + i] = static_cast<char>(src.size() >> (8 * i));
+    }
+    stream_.next_in =
+        reinterpret_cast<Bytef*>(const_cast<char*>(src.data()));
+    stream_.avail_in = src.size();
+    stream_.next_out = reinterpret_cast<Bytef*>(&(*dst)[kCompressedHeaderSize]);
+    stream_.avail_out = dst->size() - kCompressedHeaderSize;
+    CHECK_EQ(Z_STREAM_END, deflate(&stream_, Z_FINISH));
+    dst->resize(dst->size() - stream_.avail_out);
+
+    if (dst->size() >= src.size()) {
+      *dst = src;
+    }
+  }
+
+ private:
+  z_stream stream_;
+
+  DISALLOW_COPY_AND_ASSIGN(Deflater);
+};
+
+
+class Inflater {
+ public:
+  Inflater() {
+    memset(&stream_, 0, sizeof(stream_));
+    CHECK_EQ(Z_OK, inflateInit(&stream_));
+  }
+
+  ~Inflater() {
+    inflateEnd(&stream_);
+  }
+
+  // |src| must start with kCompressedMarker.
+  bool Uncompress(const char* src, size_t size, string* dst) {
+    if (size < kCompressedHeaderSize) {
+      return false;
+    }
+    size_t uncompressed_size(0);
+    for (size_t i = 0; i < 4; ++i) {
+      uncompressed_size |= static_cast<size_t>(
+                               static_cast<unsigned char>(src[1 + i]))
+                           << (8 * i);
+    }
+
+    CHECK_EQ(Z_OK, inflateReset(&stream_));
+    dst->resize(uncompressed_size);
+    stream_.next_in = reinterpret_cast<Bytef*>(
+        const_cast<char*>(src + kCompressedHeaderSize));
+    stream_.avail_in = size - kCompressedHeaderSize;
+    stream_.next_out = reinterpret_cast<Bytef*>(&(*dst)[0]);
+    stream_.avail_out = dst->size();
+    int ret(inflate(&stream_, Z_FINISH));
+    if (ret == Z_NEED_DICT) {
+      const Dictionary& dictionary(Dictionary::Get());
+      if (dictionary.empty() || stream_.adler != dictionary.id()) {
+        LOG(ERROR) << "Entry compressed with another dictionary than "
+                   << "--stored_entries_dictionary";
+        return false;
+      }
+      CHECK_EQ(Z_OK, inflateSetDictionary(&stream_, dictionary.data(),
+                                          dictionary.size()));
+      ret = inflate(&stream_, Z_FINISH);
+    }
+    return ret == Z_STREAM_END && stream_.avail_out == 0;
+  }
+
+ private:
+  z_stream stream_;
+
+  DISALLOW_COPY_AND_ASSIGN(Inflater);
+};
+
+
+bool IsCompressed(const char* data, size_t size) {
+  return size > 0 && data[0] == kCompressedMarker;
+}
+
+
+// Serializes |message| into |dst|, compressed with
+// --compress_stored_entries.
+bool SerializeMaybeCompressed(const google::protobuf::MessageLite& message,
+                              string* dst) {
+  if (!FLAGS_compress_stored_entries) {
+    return message.SerializeToString(dst);
+  }
+  PER_THREAD string serialized;
+  if (!message.SerializeToString(&serialized)) {
+    return false;
+  }
+  PER_THREAD Deflater deflater;
+  deflater.Compress(serialized, dst);
+  return true;
+}
+
+
+// Parses |data| into |message|, uncompressing it first if needed.
+bool ParseMaybeCompressed(const char* data, size_t size,
+                          google::protobuf::MessageLite* message) {
+  if (!IsCompressed(data, size)) {
+    return message->ParseFromArray(data, size);
+  }
+  PER_THREAD string uncompressed;
+  return LoggedEntry::UncompressStored(data, size, &uncompressed) &&
+         message->ParseFromString(uncompressed);
+}
+
+
+// Called by ForEachField() with the number of a field, and the field
+// itself (tag included). For the length-delimited fields, |value| and
+// |value_size| are what is inside, otherwise |value| is NULL.
+typedef function<bool(int number, const uint8_t* field, int field_size,
+                      const uint8_t* value, int value_size)> FieldVisitor;
+
+
+// Calls |visit| with every field of the serialized message |data|, in
+// order, without parsing them. Returns false if the message is broken,
+// or if |visit| does.
+bool ForEachField(const uint8_t* data, int size, const FieldVisitor& visit) {
+  CodedInputStream in(data, size);
+  while (true) {
+    const int start(in.CurrentPosition());
+    const uint32_t tag(in.ReadTag());
+    if (tag == 0) {
+      // The end, unless the message is broken.
+      return in.CurrentPosition() == size;
+    }
+    const uint8_t* value(nullptr);
+    uint32_t value_size(0);
+    if (WireFormatLite::GetTagWireType(tag) ==
+        WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+      if (!in.ReadVarint32(&value_size)) {
+        return false;
+      }
+      value = data + in.CurrentPosition();
+      if (!in.Skip(value_size)) {
+        return false;
+      }
+    } else if (!WireFormatLite::SkipField(&in, tag)) {
+      return false;
+    }
+    if (!visit(WireFormatLite::GetTagFieldNumber(tag), data + start,
+               in.CurrentPosition() - start, value, value_size)) {
+      return false;
+    }
+  }
+}
+
+
+// Merges a field passed to a FieldVisitor into |message|.
+bool MergeField(const uint8_t* field, int size, MessageLite* message) {
+  CodedInputStream in(field, size);
+  return message->MergePartialFromCodedStream(&in);
+}
+
+
+// Merges the serialized message |data| into |message|, but for the
+// field |skipped|.
+bool MergeSkipping(const uint8_t* data, int size, int skipped,
+                   MessageLite* message) {
+  return ForEachField(data, size, [skipped, message](
+                                      int number, const uint8_t* field,
+                                      int field_size, const uint8_t*, int) {
+    return number == skipped || MergeField(field, field_size, message);
+  });
+}
+
+
+bool MergeLogEntryWithoutChain(const uint8_t* data, int size,
+                               LogEntry* entry) {
+  return ForEachField(data, size, [entry](int number, const uint8_t* field,
+                                          int field_size,
+                                          const uint8_t* value,
+                                          int value_size) {
+    if (value && number == LogEntry::kX509EntryFieldNumber) {
+      return MergeSkipping(value, value_size,
+                           X509ChainEntry::kCertificateChainFieldNumber,
+                           entry->mutable_x509_entry());
+    }
+    if (value && number == LogEntry::kPrecertEntryFieldNumber) {
+      return MergeSkipping(value, value_size,
+                           PrecertChainEntry::kPrecertificateChainFieldNumber,
+                           entry->mutable_precert_entry());
+    }
+    return MergeField(field, field_size, entry);
+  });
+}
+
+
+bool MergeContentsWithoutChain(const uint8_t* data, int size,
+                               LoggedEntryPB::Contents* contents) {
+  return ForEachField(data, size, [contents](int number, const uint8_t* field,
+                                             int field_size,
+                                             const uint8_t* value,
+                                             int value_size) {
+    if (number == LoggedEntryPB::Contents::kExtraDataFieldNumber) {
+      return true;
+    }
+    if (value && number == LoggedEntryPB::Contents::kEntryFieldNumber) {
+      return MergeLogEntryWithoutChain(value, value_size,
+                                       contents->mutable_entry());
+    }
+    return MergeField(field, field_size, contents);
+  });
+}
+
+
+}  // namespace
 
 
 string LoggedEntry::Hash() const {
-  return Sha256Hasher::Sha256Digest(Serializer::LeafData(entry()));
+  if (!contents().has_entry()) {
+    return Sha256Hasher::Sha256Digest(Serializer::LeafData(entry()));
+  }
+
+  shared_ptr<const string> hash(atomic_load(&hash_));
+  if (!hash) {
+    hash = make_shared<const string>(
+        Sha256Hasher::Sha256Digest(Serializer::LeafData(entry())));
+    // Concurrent callers all store the same value.
+    atomic_store(&hash_, hash);
+  }
+  return *hash;
+}
+
+
+bool LoggedEntry::SerializeForDatabase(string* dst) const {
+  return SerializeMaybeCompressed(contents(), dst);
+}
+
+
+bool LoggedEntry::ParseFromDatabase(const string& src) {
+  hash_.reset();
+  return ParseMaybeCompressed(src.data(), src.size(), mutable_contents());
+}
+
+
+bool LoggedEntry::SerializeForStorage(string* dst) const {
+  return SerializeMaybeCompressed(*this, dst);
+}
+
+
+bool LoggedEntry::ParseFromStorage(const char* data, size_t size) {
+  hash_.reset();
+  return ParseMaybeCompressed(data, size, this);
+}
+
+
+bool LoggedEntry::ParseFromStorageWithoutChain(const char* data,
+                                               size_t size) {
+  Clear();
+  hash_.reset();
+  if (IsCompressed(data, size)) {
+    PER_THREAD string uncompressed;
+    if (!UncompressStored(data, size, &uncompressed)) {
+      return false;
+    }
+    data = uncompressed.data();
+    size = uncompressed.size();
+  }
+  return ForEachField(reinterpret_cast<const uint8_t*>(data), size,
+                      [this](int number, const uint8_t* field,
+                             int field_size, const uint8_t* value,
+                             int value_size) {
+                        if (value && number == kContentsFieldNumber) {
+                          return MergeContentsWithoutChain(
+                              value, value_size, mutable_contents());
+                        }
+                        return MergeField(field, field_size, this);
+                      }) &&
+         IsInitialized();
+}
+
+
+// static
+bool LoggedEntry::UncompressStored(const char* data, size_t size,
+                                   string* dst) {
+  if (!IsCompressed(data, size)) {
+    dst->assign(data, size);
+    return true;
+  }
+  PER_THREAD Inflater inflater;
+  return inflater.Uncompress(data, size, dst);
+}
+
+
+// static
+void LoggedEntry::ReloadDictionaryForTestingOnly() {
+  Dictionary::Reload();
+}
+
+
+// static
+bool LoggedEntry::SameStored(const string& a, const string& b) {
+  if (a == b) {
+    return true;
+  }
+  if (!IsCompressed(a.data(), a.size()) && !IsCompressed(b.data(), b.size())) {
+    return false;
+  }
+  string uncompressed_a;
+  string uncompressed_b;
+  return UncompressStored(a.data(), a.size(), &uncompressed_a) &&
+         UncompressStored(b.data(), b.size(), &uncompressed_b) &&
+         uncompressed_a == uncompressed_b;
+}
+
+
+const google::protobuf::RepeatedPtrField<string>* LoggedEntry::chain() const {
+  if (entry().has_x509_entry()) {
+    return &entry().x509_entry().certificate_chain();
+  }
+  if (entry().has_precert_entry()) {
+    return &entry().precert_entry().precertificate_chain();
+  }
+  return nullptr;
+}
+
+
+google::protobuf::RepeatedPtrField<string>* LoggedEntry::mutable_chain() {
+  if (!chain()) {
+    return nullptr;
+  }
+  mutable_contents()->clear_extra_data();
+  LogEntry* const log_entry(mutable_contents()->mutable_entry());
+  if (log_entry->has_x509_entry()) {
+    return log_entry->mutable_x509_entry()->mutable_certificate_chain();
+  }
+  return log_entry->mutable_precert_entry()->mutable_precertificate_chain();
 }
 
 
 bool LoggedEntry::SerializeForLeaf(string* dst) const {
+  if (contents().has_leaf_input()) {
+    *dst = contents().leaf_input();
+    return true;
+  }
   return Serializer::SerializeSCTMerkleTreeLeaf(sct(), entry(), dst) ==
          SerializeResult::OK;
 }
 
 
 bool LoggedEntry::SerializeExtraData(string* dst) const {
+  if (contents().has_extra_data()) {
+    *dst = contents().extra_data();
+    return true;
+  }
   switch (entry().type()) {
     case ct::X509_ENTRY:
       return SerializeX509Chain(entry().x509_entry(), dst) ==
@@ -49,6 +522,23 @@ bool LoggedEntry::SerializeExtraData(string* dst) const {
 }
 
 
+bool LoggedEntry::PrepareForStorage() {
+  ClearSerialized();
+  if (!FLAGS_store_serialized_entries) {
+    return true;
+  }
+
+  string leaf_input;
+  string extra_data;
+  if (!SerializeForLeaf(&leaf_input) || !SerializeExtraData(&extra_data)) {
+    return false;
+  }
+  mutable_contents()->set_leaf_input(leaf_input);
+  mutable_contents()->set_extra_data(extra_data);
+  return true;
+}
+
+
 bool LoggedEntry::CopyFromClientLogEntry(const AsyncLogClient::Entry& entry) {
   if (entry.leaf.timestamped_entry().entry_type() != ct::X509_ENTRY &&
       entry.leaf.timestamped_entry().entry_type() != ct::PRECERT_ENTRY &&
@@ -59,6 +549,7 @@ bool LoggedEntry::CopyFromClientLogEntry(const AsyncLogClient::Entry& entry) {
   }
 
   Clear();
+  hash_.reset();
 
   ct::SignedCertificateTimestamp* const sct(mutable_contents()->mutable_sct());
   sct->set_version(ct::V1);
@@ -2,6 +2,8 @@
 #define CERT_TRANS_LOG_LOGGED_ENTRY_H_
 
 #include <glog/logging.h>
+#include <memory>
+#include <string>
 
 #include "client/async_log_client.h"
 #include "merkletree/serial_hasher.h"
@@ -11,13 +13,26 @@ namespace cert_trans {
 
 class LoggedEntry : private ct::LoggedEntryPB {
  public:
+  LoggedEntry() = default;
+  LoggedEntry(const LoggedEntry& other)
+      : LoggedEntryPB(other), hash_(std::atomic_load(&other.hash_)) {
+  }
+  LoggedEntry(LoggedEntry&& other) {
+    Swap(&other);
+  }
+  LoggedEntry& operator=(const LoggedEntry& other) {
+    CopyFrom(other);
+    return *this;
+  }
+  LoggedEntry& operator=(LoggedEntry&& other) {
+    Swap(&other);
+    return *this;
+  }
+
   // Pull only what is used.
   using LoggedEntryPB::Clear;
   using LoggedEntryPB::DebugString;
-  using LoggedEntryPB::ParseFromArray;
-  using LoggedEntryPB::ParseFromString;
   using LoggedEntryPB::SerializeToString;
-  using LoggedEntryPB::Swap;
   using LoggedEntryPB::clear_sequence_number;
   using LoggedEntryPB::contents;
   using LoggedEntryPB::has_sequence_number;
@@ -25,13 +40,34 @@ class LoggedEntry : private ct::LoggedEntryPB {
   using LoggedEntryPB::merkle_leaf_hash;
   using LoggedEntryPB::set_merkle_leaf_hash;
   using LoggedEntryPB::set_sequence_number;
+  bool ParseFromArray(const void* data, int size) {
+    hash_.reset();
+    return LoggedEntryPB::ParseFromArray(data, size);
+  }
+  bool ParseFromString(const std::string& data) {
+    hash_.reset();
+    return LoggedEntryPB::ParseFromString(data);
+  }
   void CopyFrom(const ::google::protobuf::Message& from) {
     LoggedEntryPB::CopyFrom(from);
+    hash_.reset();
   }
   void CopyFrom(const LoggedEntry& from) {
-    LoggedEntryPB::CopyFrom(from);
+    if (&from != this) {
+      LoggedEntryPB::CopyFrom(from);
+      hash_ = std::atomic_load(&from.hash_);
+    }
+  }
+  void Swap(LoggedEntry* other) {
+    LoggedEntryPB::Swap(other);
+    hash_.swap(other->hash_);
   }
 
+  // The hash of the leaf data of the entry, which identifies it. It is
+  // computed on the first call, and kept until the entry changes (see
+  // mutable_entry()). Clear() cannot drop it (it is virtual in the
+  // base class), but it removes the entry, and only entries that are
+  // present have their hash kept.
   std::string Hash() const;
 
   uint64_t timestamp() const {
@@ -43,6 +79,7 @@ class LoggedEntry : private ct::LoggedEntryPB {
   }
 
   ct::SignedCertificateTimestamp* mutable_sct() {
+    ClearSerialized();
     return mutable_contents()->mutable_sct();
   }
 
@@ -50,26 +87,84 @@ class LoggedEntry : private ct::LoggedEntryPB {
     return contents().entry();
   }
 
+  // Drops the serialized forms and the hash, so the returned pointer
+  // should not be kept past a call to SerializeForLeaf() or Hash().
   ct::LogEntry* mutable_entry() {
+    ClearSerialized();
+    hash_.reset();
     return mutable_contents()->mutable_entry();
   }
 
-  bool SerializeForDatabase(std::string* dst) const {
-    return contents().SerializeToString(dst);
+  // The forms of the entry kept by the databases: only its contents
+  // (for those that store the sequence number on the side), or all of
+  // it. With --compress_stored_entries, these are compressed, but the
+  // Parse methods take either.
+  bool SerializeForDatabase(std::string* dst) const;
+  bool ParseFromDatabase(const std::string& src);
+  bool SerializeForStorage(std::string* dst) const;
+  bool ParseFromStorage(const char* data, size_t size);
+  bool ParseFromStorage(const std::string& src) {
+    return ParseFromStorage(src.data(), src.size());
   }
 
-  bool ParseFromDatabase(const std::string& src) {
-    return mutable_contents()->ParseFromString(src);
+  // Same as ParseFromStorage(), but skips the certificates of the
+  // chain and the stored extra_data, which are most of the entry, for
+  // the scans that only need the sequence numbers and the leaves (or
+  // their hash). The entries parsed this way must not be stored or
+  // served.
+  bool ParseFromStorageWithoutChain(const char* data, size_t size);
+  bool ParseFromStorageWithoutChain(const std::string& src) {
+    return ParseFromStorageWithoutChain(src.data(), src.size());
   }
 
+  // Turns the output of SerializeForDatabase() or
+  // SerializeForStorage() back into a plain serialized protobuf.
+  static bool UncompressStored(const char* data, size_t size,
+                               std::string* dst);
+
+  // Whether two outputs of SerializeForDatabase() or
+  // SerializeForStorage() hold the same thing, even if they were not
+  // compressed the same way.
+  static bool SameStored(const std::string& a, const std::string& b);
+
+  // Reads --stored_entries_dictionary again, which is otherwise only
+  // read once. This method is only for use in testing, and no entries
+  // must be serialized or parsed at the same time.
+  static void ReloadDictionaryForTestingOnly();
+
+  // The certificates of the chain of the entry, or NULL if it has no
+  // chain. Changing them drops the serialized extra_data, which holds
+  // them too (but not the leaf_input, nor the hash).
+  const google::protobuf::RepeatedPtrField<std::string>* chain() const;
+  google::protobuf::RepeatedPtrField<std::string>* mutable_chain();
+
+  // These only copy the serialized forms if PrepareForStorage() put
+  // them in the entry.
   bool SerializeForLeaf(std::string* dst) const;
   bool SerializeExtraData(std::string* dst) const;
 
+  // With --store_serialized_entries, also keeps the serialized
+  // leaf_input and extra_data in the entry, to be stored with it, so
+  // that the get-entries replies need not build them every time.
+  // Returns false if the entry cannot be serialized.
+  bool PrepareForStorage();
+
   // Note that this method will not fully populate the SCT.
   bool CopyFromClientLogEntry(const AsyncLogClient::Entry& entry);
 
   // FIXME(benl): unify with TestSigner?
   void RandomForTest();
+
+ private:
+  // Drops the serialized forms, which would be stale after a change.
+  void ClearSerialized() {
+    mutable_contents()->clear_leaf_input();
+    mutable_contents()->clear_extra_data();
+  }
+
+  // The result of Hash(), if it was called since the entry last
+  // changed. Set by const callers, hence the atomic accesses.
+  mutable std::shared_ptr<const std::string> hash_;
 };
 
 
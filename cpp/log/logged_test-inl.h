@@ -2,11 +2,15 @@
 #ifndef CERT_TRANS_LOG_LOGGED_TEST_INL_H_
 #define CERT_TRANS_LOG_LOGGED_TEST_INL_H_
 
+#include <gflags/gflags.h>
 #include <string>
 
 #include "proto/cert_serializer.h"
 #include "util/testing.h"
 
+DECLARE_bool(compress_stored_entries);
+DECLARE_bool(store_serialized_entries);
+
 
 template <class Logged>
 class LoggedTest : public ::testing::Test {
@@ -51,6 +55,34 @@ TYPED_TEST(LoggedTest, DifferentHash) {
   EXPECT_NE(l1.Hash(), l2.Hash());
 }
 
+TYPED_TEST(LoggedTest, HashFollowsChanges) {
+  TypeParam l1;
+  l1.RandomForTest();
+  const std::string hash(l1.Hash());
+  EXPECT_EQ(hash, l1.Hash());
+
+  // Copies keep it, changes to the entry drop it.
+  TypeParam l2(l1);
+  EXPECT_EQ(hash, l2.Hash());
+  l2.RandomForTest();
+  EXPECT_NE(hash, l2.Hash());
+  EXPECT_EQ(hash, l1.Hash());
+
+  std::string stored;
+  EXPECT_TRUE(l2.SerializeForStorage(&stored));
+  const std::string other_hash(l2.Hash());
+  EXPECT_TRUE(l1.ParseFromStorage(stored));
+  EXPECT_EQ(other_hash, l1.Hash());
+
+  l1.Swap(&l2);
+  l2.RandomForTest();
+  EXPECT_EQ(other_hash, l1.Hash());
+  const std::string swapped_hash(l2.Hash());
+  l1.Swap(&l2);
+  EXPECT_EQ(swapped_hash, l1.Hash());
+  EXPECT_EQ(other_hash, l2.Hash());
+}
+
 TYPED_TEST(LoggedTest, SerializationPreservesHash) {
   TypeParam l1;
   l1.RandomForTest();
@@ -97,6 +129,136 @@ TYPED_TEST(LoggedTest, DifferentMerkleSerialization) {
   EXPECT_NE(s1, s2);
 }
 
+TYPED_TEST(LoggedTest, StoredSerialization) {
+  FLAGS_store_serialized_entries = true;
+  TypeParam l1;
+  l1.RandomForTest();
+
+  std::string leaf;
+  std::string extra_data;
+  EXPECT_TRUE(l1.SerializeForLeaf(&leaf));
+  EXPECT_TRUE(l1.SerializeExtraData(&extra_data));
+  EXPECT_TRUE(l1.PrepareForStorage());
+
+  std::string d1;
+  EXPECT_TRUE(l1.SerializeForDatabase(&d1));
+  TypeParam l2;
+  EXPECT_TRUE(l2.ParseFromDatabase(d1));
+  EXPECT_EQ(leaf, l2.contents().leaf_input());
+
+  std::string s2;
+  EXPECT_TRUE(l2.SerializeForLeaf(&s2));
+  EXPECT_EQ(leaf, s2);
+  EXPECT_TRUE(l2.SerializeExtraData(&s2));
+  EXPECT_EQ(extra_data, s2);
+
+  // Changing the entry drops what was stored.
+  l2.mutable_sct()->set_timestamp(l2.timestamp() + 1);
+  EXPECT_FALSE(l2.contents().has_leaf_input());
+  EXPECT_TRUE(l2.SerializeForLeaf(&s2));
+  EXPECT_NE(leaf, s2);
+  FLAGS_store_serialized_entries = false;
+}
+
+TYPED_TEST(LoggedTest, CompressedStorage) {
+  TypeParam l1;
+  l1.RandomForTest();
+  l1.set_sequence_number(42);
+  // Something that compresses well.
+  l1.mutable_sct()->set_extensions(std::string(4096, 'x'));
+
+  std::string plain;
+  std::string plain_contents;
+  EXPECT_TRUE(l1.SerializeForStorage(&plain));
+  EXPECT_TRUE(l1.SerializeForDatabase(&plain_contents));
+
+  FLAGS_compress_stored_entries = true;
+  std::string compressed;
+  std::string compressed_contents;
+  EXPECT_TRUE(l1.SerializeForStorage(&compressed));
+  EXPECT_TRUE(l1.SerializeForDatabase(&compressed_contents));
+  EXPECT_LT(compressed.size(), plain.size());
+  EXPECT_LT(compressed_contents.size(), plain_contents.size());
+
+  // Either form can be read, whatever the flag says.
+  for (int i = 0; i < 2; ++i) {
+    for (const std::string* stored : {&plain, &compressed}) {
+      TypeParam l2;
+      EXPECT_TRUE(l2.ParseFromStorage(*stored));
+      EXPECT_EQ(42, l2.sequence_number());
+      EXPECT_EQ(l1.Hash(), l2.Hash());
+      EXPECT_EQ(l1.sct().extensions(), l2.sct().extensions());
+
+      std::string uncompressed;
+      EXPECT_TRUE(TypeParam::UncompressStored(stored->data(), stored->size(),
+                                              &uncompressed));
+      EXPECT_EQ(plain, uncompressed);
+    }
+    for (const std::string* stored : {&plain_contents, &compressed_contents}) {
+      TypeParam l2;
+      EXPECT_TRUE(l2.ParseFromDatabase(*stored));
+      EXPECT_EQ(l1.Hash(), l2.Hash());
+    }
+    FLAGS_compress_stored_entries = false;
+  }
+
+  EXPECT_TRUE(TypeParam::SameStored(plain, compressed));
+  l1.set_sequence_number(43);
+  EXPECT_TRUE(l1.SerializeForStorage(&plain));
+  EXPECT_FALSE(TypeParam::SameStored(plain, compressed));
+
+  // Truncated.
+  const std::string truncated(compressed.substr(0, compressed.size() / 2));
+  TypeParam l2;
+  EXPECT_FALSE(l2.ParseFromStorage(truncated));
+}
+
+TYPED_TEST(LoggedTest, StorageWithoutChain) {
+  FLAGS_store_serialized_entries = true;
+  TypeParam l1;
+  do {
+    l1.RandomForTest();
+  } while (!l1.chain());
+  l1.set_sequence_number(42);
+  l1.mutable_chain()->Add()->assign(1024, 'c');
+  l1.mutable_chain()->Add()->assign(2048, 'd');
+  EXPECT_TRUE(l1.PrepareForStorage());
+
+  std::string leaf;
+  EXPECT_TRUE(l1.SerializeForLeaf(&leaf));
+  std::string plain;
+  EXPECT_TRUE(l1.SerializeForStorage(&plain));
+  FLAGS_compress_stored_entries = true;
+  std::string compressed;
+  EXPECT_TRUE(l1.SerializeForStorage(&compressed));
+  FLAGS_compress_stored_entries = false;
+  FLAGS_store_serialized_entries = false;
+
+  for (const std::string* stored : {&plain, &compressed}) {
+    // Parsing over a complete entry leaves nothing of it.
+    TypeParam l2(l1);
+    EXPECT_TRUE(l2.ParseFromStorageWithoutChain(*stored));
+    EXPECT_EQ(42, l2.sequence_number());
+    EXPECT_EQ(l1.Hash(), l2.Hash());
+    EXPECT_EQ(l1.sct().DebugString(), l2.sct().DebugString());
+    EXPECT_EQ(0, l2.chain()->size());
+    EXPECT_FALSE(l2.contents().has_extra_data());
+    std::string l2_leaf;
+    EXPECT_TRUE(l2.SerializeForLeaf(&l2_leaf));
+    EXPECT_EQ(leaf, l2_leaf);
+
+    // The same without the stored leaf_input.
+    TypeParam l3(l2);
+    l3.mutable_sct()->set_timestamp(l1.timestamp());
+    EXPECT_TRUE(l3.SerializeForLeaf(&l2_leaf));
+    EXPECT_EQ(leaf, l2_leaf);
+  }
+
+  TypeParam l2;
+  EXPECT_FALSE(
+      l2.ParseFromStorageWithoutChain(plain.substr(0, plain.size() / 2)));
+}
+
 int main(int argc, char** argv) {
   cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
   ConfigureSerializerForV1CT();
@@ -0,0 +1,70 @@
+#include "log/merge_delay.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "log/logged_entry.h"
+#include "util/util.h"
+
+using std::string;
+
+DEFINE_int32(merge_delay_sample_one_in, 1,
+             "record the merge_delay_ms metric for one entry in this many, "
+             "picked by SCT timestamp so that it is the same entries at "
+             "every stage");
+
+namespace cert_trans {
+namespace {
+
+
+static Histogram<string>* merge_delay_ms(Histogram<string>::New(
+    "merge_delay_ms", "stage",
+    "Time in ms from the SCT timestamp of a sample of the entries to when "
+    "they reach each stage (pending, sequenced, stored, signed or served) "
+    "of their way into the log."));
+
+static Histogram<string>* sth_delay_ms(Histogram<string>::New(
+    "sth_delay_ms", "stage",
+    "Time in ms from the timestamp of the STHs to when they reach each "
+    "stage (calculated as the serving STH, or loaded by a node)."));
+
+
+uint64_t DelayMs(uint64_t now_ms, uint64_t timestamp_ms) {
+  // The timestamp may come from another node, with a clock ahead.
+  return now_ms > timestamp_ms ? now_ms - timestamp_ms : 0;
+}
+
+
+}  // namespace
+
+
+MergeDelayRecorder::MergeDelayRecorder(const string& stage)
+    : cell_(merge_delay_ms->Bind(stage)),
+      sample_one_in_(FLAGS_merge_delay_sample_one_in) {
+  CHECK_GT(FLAGS_merge_delay_sample_one_in, 0);
+}
+
+
+void MergeDelayRecorder::Add(const LoggedEntry& entry) {
+  if (entry.timestamp() % sample_one_in_ == 0) {
+    timestamps_ms_.push_back(entry.timestamp());
+  }
+}
+
+
+void MergeDelayRecorder::Record() {
+  const uint64_t now_ms(util::TimeInMilliseconds());
+  for (const uint64_t timestamp_ms : timestamps_ms_) {
+    cell_->Record(DelayMs(now_ms, timestamp_ms));
+  }
+  timestamps_ms_.clear();
+}
+
+
+void RecordSTHDelay(const string& stage, const ct::SignedTreeHead& sth) {
+  sth_delay_ms->Record(stage,
+                       DelayMs(util::TimeInMilliseconds(), sth.timestamp()));
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,68 @@
+#ifndef CERT_TRANS_LOG_MERGE_DELAY_H_
+#define CERT_TRANS_LOG_MERGE_DELAY_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "base/macros.h"
+#include "monitoring/histogram.h"
+#include "proto/ct.pb.h"
+
+namespace cert_trans {
+
+class LoggedEntry;
+
+
+// Records, in the merge_delay_ms metric, how long after their SCT
+// timestamp the entries reach each stage of their way into the log:
+//
+//   pending:   their SCT is returned (FrontendSigner)
+//   sequenced: they get a sequence number, after the guard window
+//              (TreeSigner::SequenceNewEntries(), on the master)
+//   stored:    they are in the database of the master
+//   signed:    they are in a tree head signed by a node
+//              (TreeSigner::UpdateTree())
+//   served:    they are in the tree of the serving STH, as loaded by
+//              a node (LogLookup::UpdateFromSTH())
+//
+// The entries a node catches up with when it starts are not recorded.
+//
+// The stages in between are seen from the STHs: RecordSTHDelay()
+// records how long after their timestamp they are picked to be served
+// (ClusterStateController), and loaded by every node.
+//
+// Only the entries whose SCT timestamp is a multiple of
+// --merge_delay_sample_one_in are recorded, which picks the same
+// sample of entries at every stage, on every node.
+//
+// This class is thread-compatible.
+class MergeDelayRecorder {
+ public:
+  explicit MergeDelayRecorder(const std::string& stage);
+
+  // Takes note of |entry|, if it is in the sample.
+  void Add(const LoggedEntry& entry);
+
+  // Records the entries added as reaching the stage now, and forgets
+  // them.
+  void Record();
+
+ private:
+  HistogramCell* const cell_;
+  const uint64_t sample_one_in_;
+  // Of the entries added.
+  std::vector<uint64_t> timestamps_ms_;
+
+  DISALLOW_COPY_AND_ASSIGN(MergeDelayRecorder);
+};
+
+
+// Records, in the sth_delay_ms metric, how long after its timestamp
+// |sth| reaches |stage|.
+void RecordSTHDelay(const std::string& stage, const ct::SignedTreeHead& sth);
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_MERGE_DELAY_H_
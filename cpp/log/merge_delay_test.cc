@@ -0,0 +1,99 @@
+#include "log/merge_delay.h"
+
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+#include <string>
+
+#include "log/logged_entry.h"
+#include "monitoring/registry.h"
+#include "util/testing.h"
+#include "util/util.h"
+
+DECLARE_int32(merge_delay_sample_one_in);
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+
+
+class MergeDelayTest : public ::testing::Test {
+ protected:
+  // The merge_delay_ms or sth_delay_ms values for |stage|.
+  Metric::HistogramValue Value(const string& name, const string& stage) {
+    for (const Metric* metric : Registry::Instance()->GetMetrics()) {
+      if (metric->Name() == name) {
+        return metric->CurrentHistogramValues()[{stage}];
+      }
+    }
+    return Metric::HistogramValue();
+  }
+
+  LoggedEntry Entry(uint64_t timestamp) {
+    LoggedEntry entry;
+    entry.mutable_sct()->set_timestamp(timestamp);
+    return entry;
+  }
+};
+
+
+TEST_F(MergeDelayTest, RecordsWhenToldTo) {
+  const uint64_t now(util::TimeInMilliseconds());
+  MergeDelayRecorder recorder("test_recorded");
+  recorder.Add(Entry(now - 1000));
+  recorder.Add(Entry(now - 3000));
+  EXPECT_EQ(0U, Value("merge_delay_ms", "test_recorded").count);
+
+  recorder.Record();
+  const Metric::HistogramValue value(
+      Value("merge_delay_ms", "test_recorded"));
+  EXPECT_EQ(2U, value.count);
+  EXPECT_LE(4000, value.sum);
+  EXPECT_GT(14000, value.sum);
+
+  // Only once.
+  recorder.Record();
+  EXPECT_EQ(2U, Value("merge_delay_ms", "test_recorded").count);
+}
+
+
+TEST_F(MergeDelayTest, Samples) {
+  FLAGS_merge_delay_sample_one_in = 10;
+  MergeDelayRecorder recorder("test_sampled");
+  for (uint64_t timestamp = 1000; timestamp < 1100; ++timestamp) {
+    recorder.Add(Entry(timestamp));
+  }
+  recorder.Record();
+  EXPECT_EQ(10U, Value("merge_delay_ms", "test_sampled").count);
+  FLAGS_merge_delay_sample_one_in = 1;
+}
+
+
+TEST_F(MergeDelayTest, ClockAhead) {
+  MergeDelayRecorder recorder("test_ahead");
+  recorder.Add(Entry(util::TimeInMilliseconds() + 60000));
+  recorder.Record();
+  const Metric::HistogramValue value(Value("merge_delay_ms", "test_ahead"));
+  EXPECT_EQ(1U, value.count);
+  EXPECT_EQ(0, value.sum);
+}
+
+
+TEST_F(MergeDelayTest, STHDelay) {
+  ct::SignedTreeHead sth;
+  sth.set_timestamp(util::TimeInMilliseconds() - 2000);
+  RecordSTHDelay("test_sth", sth);
+  const Metric::HistogramValue value(Value("sth_delay_ms", "test_sth"));
+  EXPECT_EQ(1U, value.count);
+  EXPECT_LE(2000, value.sum);
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -38,6 +38,8 @@ class MockConsistentStore : public ConsistentStore {
   MOCK_METHOD1_T(SetClusterNodeState,
                  util::Status(const ct::ClusterNodeState& state));
 
+  MOCK_METHOD0_T(RefreshClusterNodeState, util::Status());
+
   MOCK_METHOD2_T(WatchServingSTH,
                  void(const ConsistentStore::ServingSTHCallback& cb,
                       util::Task* task));
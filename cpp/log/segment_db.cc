@@ -0,0 +1,1231 @@
+#include "log/segment_db.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "merkletree/serial_hasher.h"
+#include "monitoring/latency.h"
+#include "monitoring/monitoring.h"
+#include "proto/ct.pb.h"
+#include "util/util.h"
+
+using std::chrono::milliseconds;
+using std::lock_guard;
+using std::make_pair;
+using std::map;
+using std::max;
+using std::min;
+using std::move;
+using std::mutex;
+using std::pair;
+using std::set;
+using std::shared_ptr;
+using std::string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+
+static Latency<milliseconds, string> latency_by_op_ms(
+    "segmentdb_latency_by_operation_ms", "operation",
+    "Database latency in ms broken out by operation.");
+
+
+const char kSegmentPrefix[] = "entries-";
+const char kTreeHeadsFile[] = "tree_heads";
+const char kChainCertsFile[] = "chain_certs";
+const char kNodeIdFile[] = "node_id";
+const char kTreeFrontierFile[] = "tree_frontier";
+const char kLockFile[] = "LOCK";
+const char kSegmentMagic[8] = {'C', 'T', 'S', 'E', 'G', 'M', 'N', 'T'};
+const char kIndexMagic[8] = {'C', 'T', 'S', 'E', 'G', 'I', 'D', 'X'};
+
+// All the integers in the files are in host byte order.
+
+// At the start of every segment file.
+struct SegmentHeader {
+  char magic[8];
+  int64_t first_sequence_number;
+  int64_t entries_per_segment;
+};
+
+// Before every entry in a segment file (keyed by sequence number),
+// every tree head in the tree heads file (keyed by timestamp), and
+// every certificate in the chain certificates file (keyed by nothing,
+// its hash is at the start of the record).
+struct RecordHeader {
+  int64_t key;
+  uint32_t size;
+  uint32_t reserved;
+};
+
+// At the end of a sealed segment.
+struct SegmentTrailer {
+  uint64_t index_offset;
+  char magic[8];
+};
+
+
+uint64_t FileSize(int fd) {
+  struct stat st;
+  PCHECK(fstat(fd, &st) == 0);
+  return st.st_size;
+}
+
+
+void WriteFully(int fd, const char* data, size_t size, uint64_t offset) {
+  while (size > 0) {
+    const ssize_t written(pwrite(fd, data, size, offset));
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    PCHECK(written > 0);
+    data += written;
+    size -= written;
+    offset += written;
+  }
+}
+
+
+// Returns false if the file ends before |size| bytes could be read.
+bool ReadFully(int fd, char* data, size_t size, uint64_t offset) {
+  while (size > 0) {
+    const ssize_t num_read(pread(fd, data, size, offset));
+    if (num_read < 0 && errno == EINTR) {
+      continue;
+    }
+    PCHECK(num_read >= 0);
+    if (num_read == 0) {
+      return false;
+    }
+    data += num_read;
+    size -= num_read;
+    offset += num_read;
+  }
+  return true;
+}
+
+
+// Appends a record at |*end|, which is moved past it, and returns the
+// offset of |data|.
+uint64_t AppendRecord(int fd, int64_t key, const string& data,
+                      uint64_t* end) {
+  RecordHeader header;
+  memset(&header, 0, sizeof(header));
+  header.key = key;
+  header.size = data.size();
+  CHECK_EQ(header.size, data.size());
+
+  string record(reinterpret_cast<const char*>(&header), sizeof(header));
+  record.append(data);
+  WriteFully(fd, record.data(), record.size(), *end);
+
+  const uint64_t offset(*end + sizeof(header));
+  *end += record.size();
+  return offset;
+}
+
+
+// Reads the record at |offset|, returning false if it goes past
+// |file_size|.
+bool ReadRecord(int fd, uint64_t offset, uint64_t file_size,
+                RecordHeader* header, string* data) {
+  if (offset + sizeof(*header) > file_size ||
+      !ReadFully(fd, reinterpret_cast<char*>(header), sizeof(*header),
+                 offset)) {
+    return false;
+  }
+  offset += sizeof(*header);
+  if (header->size > file_size - offset) {
+    return false;
+  }
+  data->resize(header->size);
+  return ReadFully(fd, &(*data)[0], data->size(), offset);
+}
+
+
+void Truncate(int fd, uint64_t size, const string& path) {
+  LOG(WARNING) << "Dropping " << FileSize(fd) - size
+               << " bytes of incomplete records at the end of " << path;
+  PCHECK(ftruncate(fd, size) == 0) << path;
+}
+
+
+}  // namespace
+
+
+const int64_t SegmentDB::kDefaultEntriesPerSegment = 1 << 16;
+
+
+// The index section of a sealed segment has one of these for every
+// sequence number of the segment, in order. In memory, an offset of
+// zero marks a missing entry.
+struct SegmentDB::IndexEntry {
+  // Of the serialized LoggedEntryPB, past its RecordHeader.
+  uint64_t offset;
+  uint32_t size;
+  uint32_t reserved;
+  char hash[HashIndex::kKeySize];
+};
+
+
+// A read-only mapping of a segment file. Entries never move once
+// written, so the readers use the mapping of the segment as it was
+// when they looked them up, which they keep alive meanwhile: no
+// system call, nor copy, is needed to get to an entry.
+//
+// The mapping of a segment still being filled covers more than what
+// was written to it so far (only what was written is ever read),
+// and is replaced by a larger one when it runs out.
+class SegmentDB::Mapping {
+ public:
+  Mapping(int fd, size_t size, const string& path);
+  ~Mapping();
+
+  const char* data() const {
+    return data_;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  // As stored, maybe compressed.
+  void Read(const IndexEntry& entry, string* data) const {
+    data->assign(data_ + entry.offset, entry.size);
+  }
+
+  bool ReadUncompressed(const IndexEntry& entry, string* data) const {
+    return LoggedEntry::UncompressStored(data_ + entry.offset, entry.size,
+                                         data);
+  }
+
+  bool Parse(const IndexEntry& entry, LoggedEntry* logged) const {
+    return logged->ParseFromStorage(data_ + entry.offset, entry.size);
+  }
+
+  bool ParseWithoutChain(const IndexEntry& entry, LoggedEntry* logged) const {
+    return logged->ParseFromStorageWithoutChain(data_ + entry.offset,
+                                                entry.size);
+  }
+
+  // Hints that everything between |a| and |b| (whichever comes first)
+  // is about to be read, so that it gets read ahead.
+  void WillNeed(const IndexEntry& a, const IndexEntry& b) const;
+
+ private:
+  const string path_;
+  const char* data_;
+  const size_t size_;
+
+  DISALLOW_COPY_AND_ASSIGN(Mapping);
+};
+
+
+SegmentDB::Mapping::Mapping(int fd, size_t size, const string& path)
+    : path_(path), size_(size) {
+  void* const data(mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0));
+  PCHECK(data != MAP_FAILED) << "Could not map " << path_;
+  data_ = static_cast<const char*>(data);
+}
+
+
+SegmentDB::Mapping::~Mapping() {
+  PCHECK(munmap(const_cast<char*>(data_), size_) == 0) << path_;
+}
+
+
+void SegmentDB::Mapping::WillNeed(const IndexEntry& a,
+                                  const IndexEntry& b) const {
+  static const uint64_t kPageSize(sysconf(_SC_PAGESIZE));
+  const uint64_t begin(min(a.offset, b.offset) / kPageSize * kPageSize);
+  const uint64_t end(max(a.offset + a.size, b.offset + b.size));
+  // Only advice, so failures do not matter.
+  madvise(const_cast<char*>(data_) + begin, end - begin, MADV_WILLNEED);
+}
+
+
+// An open segment file. Its |entries_| and |mapping_| are only read or
+// changed with the database lock held, but once sealed, everything is
+// immutable.
+class SegmentDB::Segment {
+ public:
+  // Creates a new, empty segment file.
+  static shared_ptr<Segment> Create(const string& path,
+                                    int64_t first_sequence_number,
+                                    int64_t entries_per_segment);
+
+  // Opens an existing segment file, dropping whatever follows the
+  // last complete entry (if it is not sealed).
+  static shared_ptr<Segment> Open(const string& path,
+                                  int64_t first_sequence_number,
+                                  int64_t entries_per_segment);
+
+  ~Segment();
+
+  bool sealed() const {
+    return sealed_;
+  }
+
+  bool full() const {
+    return num_entries_ == entries_per_segment_;
+  }
+
+  int64_t num_entries() const {
+    return num_entries_;
+  }
+
+  const shared_ptr<const Mapping>& mapping() const {
+    return mapping_;
+  }
+
+  // Returns NULL if |sequence_number| is not in this segment.
+  const IndexEntry* Find(int64_t sequence_number) const {
+    const int64_t i(sequence_number - first_sequence_number_);
+    CHECK_GE(i, 0);
+    CHECK_LT(i, entries_per_segment_);
+    const IndexEntry* const entry(&index_[i]);
+    return entry->offset == 0 ? nullptr : entry;
+  }
+
+  // Not sealed only. The segment must not already hold this
+  // sequence number.
+  void Append(int64_t sequence_number, const string& data,
+              const string& hash);
+
+  // Not sealed, but full only. Writes out the index section; the
+  // segment must then be opened again to be used sealed.
+  void Seal();
+
+ private:
+  Segment(const string& path, int fd, int64_t first_sequence_number,
+          int64_t entries_per_segment);
+
+  // Maps the segment if it is sealed.
+  bool MaybeMapSealed();
+  void Recover();
+  // Maps at least the first |size| bytes of a segment that is not
+  // sealed, with room to grow.
+  void Remap(uint64_t size);
+
+  const string path_;
+  // Closed once the segment is sealed and mapped.
+  int fd_;
+  const int64_t first_sequence_number_;
+  const int64_t entries_per_segment_;
+  bool sealed_;
+  shared_ptr<const Mapping> mapping_;
+
+  // Not sealed only (then, |index_| points into it).
+  vector<IndexEntry> entries_;
+  uint64_t end_;
+
+  const IndexEntry* index_;
+  int64_t num_entries_;
+
+  DISALLOW_COPY_AND_ASSIGN(Segment);
+};
+
+
+SegmentDB::Segment::Segment(const string& path, int fd,
+                            int64_t first_sequence_number,
+                            int64_t entries_per_segment)
+    : path_(path),
+      fd_(fd),
+      first_sequence_number_(first_sequence_number),
+      entries_per_segment_(entries_per_segment),
+      sealed_(false),
+      end_(sizeof(SegmentHeader)),
+      index_(nullptr),
+      num_entries_(0) {
+}
+
+
+SegmentDB::Segment::~Segment() {
+  if (fd_ >= 0) {
+    PCHECK(close(fd_) == 0) << path_;
+  }
+}
+
+
+// static
+shared_ptr<SegmentDB::Segment> SegmentDB::Segment::Create(
+    const string& path, int64_t first_sequence_number,
+    int64_t entries_per_segment) {
+  const int fd(open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644));
+  PCHECK(fd >= 0) << "Could not create " << path;
+
+  SegmentHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kSegmentMagic, sizeof(header.magic));
+  header.first_sequence_number = first_sequence_number;
+  header.entries_per_segment = entries_per_segment;
+  WriteFully(fd, reinterpret_cast<const char*>(&header), sizeof(header), 0);
+
+  shared_ptr<Segment> segment(
+      new Segment(path, fd, first_sequence_number, entries_per_segment));
+  segment->entries_.resize(entries_per_segment);
+  memset(segment->entries_.data(), 0,
+         entries_per_segment * sizeof(IndexEntry));
+  segment->index_ = segment->entries_.data();
+  segment->Remap(segment->end_);
+  return segment;
+}
+
+
+// static
+shared_ptr<SegmentDB::Segment> SegmentDB::Segment::Open(
+    const string& path, int64_t first_sequence_number,
+    int64_t entries_per_segment) {
+  const int fd(open(path.c_str(), O_RDWR));
+  PCHECK(fd >= 0) << "Could not open " << path;
+
+  SegmentHeader header;
+  CHECK(ReadFully(fd, reinterpret_cast<char*>(&header), sizeof(header), 0))
+      << "Truncated segment header in " << path;
+  CHECK_EQ(memcmp(header.magic, kSegmentMagic, sizeof(header.magic)), 0)
+      << path << " is not a segment file";
+  CHECK_EQ(header.first_sequence_number, first_sequence_number) << path;
+  CHECK_EQ(header.entries_per_segment, entries_per_segment)
+      << path << " was written with a different number of entries per "
+      << "segment";
+
+  shared_ptr<Segment> segment(
+      new Segment(path, fd, first_sequence_number, entries_per_segment));
+  if (!segment->MaybeMapSealed()) {
+    segment->Recover();
+  }
+  return segment;
+}
+
+
+bool SegmentDB::Segment::MaybeMapSealed() {
+  const uint64_t size(FileSize(fd_));
+  const uint64_t index_size(entries_per_segment_ * sizeof(IndexEntry));
+  SegmentTrailer trailer;
+  if (size < sizeof(SegmentHeader) + index_size + sizeof(trailer) ||
+      !ReadFully(fd_, reinterpret_cast<char*>(&trailer), sizeof(trailer),
+                 size - sizeof(trailer)) ||
+      memcmp(trailer.magic, kIndexMagic, sizeof(trailer.magic)) != 0) {
+    return false;
+  }
+  CHECK_EQ(trailer.index_offset + index_size + sizeof(trailer), size)
+      << "Corrupted index section in " << path_;
+  CHECK_EQ(trailer.index_offset % alignof(IndexEntry), 0U) << path_;
+
+  sealed_ = true;
+  Remap(size);
+  index_ = reinterpret_cast<const IndexEntry*>(
+      mapping_->data() + trailer.index_offset);
+  num_entries_ = entries_per_segment_;
+  // Sealed segments are only read through the mapping, so there is no
+  // need to hold on to a file descriptor for each.
+  PCHECK(close(fd_) == 0) << path_;
+  fd_ = -1;
+  return true;
+}
+
+
+void SegmentDB::Segment::Recover() {
+  entries_.resize(entries_per_segment_);
+  memset(entries_.data(), 0, entries_per_segment_ * sizeof(IndexEntry));
+  index_ = entries_.data();
+
+  const uint64_t size(FileSize(fd_));
+  Remap(size);
+  const char* const data(mapping_->data());
+  LoggedEntry logged;
+  while (end_ + sizeof(RecordHeader) <= size) {
+    RecordHeader header;
+    memcpy(&header, data + end_, sizeof(header));
+    const uint64_t offset(end_ + sizeof(header));
+    // A torn record (or index section) fails one of these.
+    const int64_t i(header.key - first_sequence_number_);
+    if (header.size > size - offset || i < 0 || i >= entries_per_segment_ ||
+        entries_[i].offset != 0 ||
+        !logged.ParseFromStorageWithoutChain(data + offset, header.size) ||
+        !logged.has_sequence_number() ||
+        logged.sequence_number() != header.key) {
+      break;
+    }
+
+    const string hash(logged.Hash());
+    CHECK_EQ(hash.size(), sizeof(entries_[i].hash));
+    entries_[i].offset = offset;
+    entries_[i].size = header.size;
+    memcpy(entries_[i].hash, hash.data(), hash.size());
+    ++num_entries_;
+    end_ = offset + header.size;
+  }
+
+  if (end_ != size) {
+    Truncate(fd_, end_, path_);
+  }
+}
+
+
+void SegmentDB::Segment::Remap(uint64_t size) {
+  if (sealed_) {
+    mapping_.reset(new Mapping(fd_, size, path_));
+    return;
+  }
+
+  // Grows geometrically, so that a segment is only mapped a few times
+  // while it is filled.
+  static const uint64_t kMinMappingSize(1 << 20);
+  uint64_t mapping_size(mapping_ ? mapping_->size() : kMinMappingSize);
+  while (mapping_size < size) {
+    mapping_size *= 2;
+  }
+  // Past the end of the file, the mapping is never touched.
+  mapping_.reset(new Mapping(fd_, mapping_size, path_));
+}
+
+
+void SegmentDB::Segment::Append(int64_t sequence_number, const string& data,
+                                const string& hash) {
+  CHECK(!sealed());
+  CHECK_EQ(hash.size(), HashIndex::kKeySize);
+  const int64_t i(sequence_number - first_sequence_number_);
+  CHECK_GE(i, 0);
+  CHECK_LT(i, entries_per_segment_);
+  CHECK_EQ(entries_[i].offset, 0U);
+
+  IndexEntry entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.offset = AppendRecord(fd_, sequence_number, data, &end_);
+  entry.size = data.size();
+  memcpy(entry.hash, hash.data(), hash.size());
+  if (end_ > mapping_->size()) {
+    Remap(end_);
+  }
+  entries_[i] = entry;
+  ++num_entries_;
+}
+
+
+void SegmentDB::Segment::Seal() {
+  CHECK(!sealed());
+  CHECK(full());
+
+  const uint64_t padding((alignof(IndexEntry) - end_ % alignof(IndexEntry)) %
+                         alignof(IndexEntry));
+  const uint64_t index_offset(end_ + padding);
+  string section(padding, '\0');
+  section.append(reinterpret_cast<const char*>(entries_.data()),
+                 entries_.size() * sizeof(IndexEntry));
+
+  SegmentTrailer trailer;
+  memset(&trailer, 0, sizeof(trailer));
+  trailer.index_offset = index_offset;
+  memcpy(trailer.magic, kIndexMagic, sizeof(trailer.magic));
+  section.append(reinterpret_cast<const char*>(&trailer), sizeof(trailer));
+
+  WriteFully(fd_, section.data(), section.size(), end_);
+  // Once sealed, a segment is never looked at again when opening the
+  // database, so make sure it really is all there.
+  PCHECK(fdatasync(fd_) == 0) << path_;
+}
+
+
+// Reads ahead a batch of entries at a time, so that scanning does
+// not take the database lock for every entry.
+class SegmentDB::Iterator : public Database::Iterator {
+ public:
+  Iterator(const SegmentDB* db, int64_t start_index)
+      : db_(CHECK_NOTNULL(db)), next_index_(start_index), next_in_batch_(0) {
+    CHECK_GE(next_index_, 0);
+  }
+
+  bool GetNextEntry(LoggedEntry* entry) override {
+    CHECK_NOTNULL(entry);
+    if (next_in_batch_ == batch_.size() && !ReadBatch()) {
+      return false;
+    }
+
+    const pair<shared_ptr<const Mapping>, IndexEntry>& next(
+        batch_[next_in_batch_++]);
+    CHECK(next.first->Parse(next.second, entry));
+    CHECK(db_->chain_certs_.Restore(db_->load_chain_cert_, entry));
+    CHECK_EQ(entry->sequence_number(), next_index_);
+    ++next_index_;
+    return true;
+  }
+
+ private:
+  static const size_t kBatchSize;
+
+  bool ReadBatch() {
+    {
+      lock_guard<mutex> lock(db_->lock_);
+      if (next_index_ >= db_->contiguous_size_) {
+        set<int64_t>::const_iterator it(
+            db_->sparse_entries_.lower_bound(next_index_));
+        if (it == db_->sparse_entries_.end()) {
+          return false;
+        }
+
+        next_index_ = *it;
+      }
+    }
+
+    batch_.clear();
+    next_in_batch_ = 0;
+    db_->LocateRange(next_index_, kBatchSize, &batch_);
+    CHECK(!batch_.empty());
+    // Scans read on through the segments, let the kernel know.
+    batch_.front().first->WillNeed(batch_.front().second,
+                                   batch_.back().second);
+    return true;
+  }
+
+  const SegmentDB* const db_;
+  int64_t next_index_;
+  vector<pair<shared_ptr<const Mapping>, IndexEntry>> batch_;
+  size_t next_in_batch_;
+};
+
+
+const size_t SegmentDB::Iterator::kBatchSize = 256;
+
+
+SegmentDB::SegmentDB(const string& dir, int64_t entries_per_segment)
+    : dir_(dir),
+      entries_per_segment_(entries_per_segment),
+      lock_fd_(-1),
+      contiguous_size_(0),
+      tree_heads_fd_(-1),
+      tree_heads_end_(0),
+      chain_certs_fd_(-1),
+      chain_certs_end_(0),
+      load_chain_cert_([this](const string& hash, string* cert) {
+        return LoadChainCert(hash, cert);
+      }),
+      index_memory_(MemoryAccounting::Instance()->Register(
+          "database_index", [this]() {
+            lock_guard<mutex> lock(lock_);
+            return id_by_hash_.MemoryUsage() +
+                   SetMemoryUsage(sparse_entries_);
+          })) {
+  CHECK_GT(entries_per_segment_, 0);
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("open"));
+  Open();
+}
+
+
+SegmentDB::~SegmentDB() {
+  segments_.clear();
+  if (tree_heads_fd_ >= 0) {
+    PCHECK(close(tree_heads_fd_) == 0);
+  }
+  if (chain_certs_fd_ >= 0) {
+    PCHECK(close(chain_certs_fd_) == 0);
+  }
+  if (lock_fd_ >= 0) {
+    PCHECK(close(lock_fd_) == 0);
+  }
+}
+
+
+Database::WriteResult SegmentDB::CreateSequencedEntry_(
+    const LoggedEntry& logged) {
+  CHECK(logged.has_sequence_number());
+  CHECK_GE(logged.sequence_number(), 0);
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("create_sequenced_entry"));
+
+  LoggedEntry deduplicated;
+  map<string, string> chain_certs;
+  const bool is_deduplicated(chain_certs_.Deduplicate(
+      load_chain_cert_, logged, &deduplicated, &chain_certs));
+  string data;
+  CHECK((is_deduplicated ? deduplicated : logged).SerializeForStorage(&data));
+
+  lock_guard<mutex> lock(lock_);
+
+  StoreChainCertsLocked(chain_certs);
+  return CreateSequencedEntryLocked(logged, data);
+}
+
+
+Database::WriteResult SegmentDB::CreateSequencedEntries_(
+    const vector<LoggedEntry>& entries, size_t* num_written) {
+  CHECK_NOTNULL(num_written);
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("create_sequenced_entries"));
+
+  vector<string> data(entries.size());
+  map<string, string> chain_certs;
+  LoggedEntry deduplicated;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    const bool is_deduplicated(chain_certs_.Deduplicate(
+        load_chain_cert_, entries[i], &deduplicated, &chain_certs));
+    CHECK((is_deduplicated ? deduplicated : entries[i])
+              .SerializeForStorage(&data[i]));
+  }
+
+  lock_guard<mutex> lock(lock_);
+
+  StoreChainCertsLocked(chain_certs);
+  for (*num_written = 0; *num_written < entries.size(); ++*num_written) {
+    const WriteResult result(CreateSequencedEntryLocked(
+        entries[*num_written], data[*num_written]));
+    if (result != this->OK) {
+      return result;
+    }
+  }
+
+  return this->OK;
+}
+
+
+Database::WriteResult SegmentDB::CreateSequencedEntryLocked(
+    const LoggedEntry& logged, const string& data) {
+  const int64_t seq(logged.sequence_number());
+  CHECK_GE(seq, 0);
+  const int64_t first(seq - seq % entries_per_segment_);
+
+  shared_ptr<Segment>& segment(segments_[first]);
+  if (!segment) {
+    segment = Segment::Create(SegmentPath(first), first, entries_per_segment_);
+  }
+
+  const IndexEntry* const existing(segment->Find(seq));
+  if (existing) {
+    string existing_data;
+    segment->mapping()->Read(*existing, &existing_data);
+    if (LoggedEntry::SameStored(existing_data, data) ||
+        chain_certs_.SameEntry(
+            [this](const string& hash, string* cert) {
+              return LoadChainCertLocked(hash, cert);
+            },
+            existing_data, logged)) {
+      return this->OK;
+    }
+    return this->SEQUENCE_NUMBER_ALREADY_IN_USE;
+  }
+
+  const string hash(logged.Hash());
+  segment->Append(seq, data, hash);
+  InsertEntryMapping(seq, hash);
+
+  if (segment->full()) {
+    // The chain certificates referenced by the entries of a sealed
+    // segment must be there too.
+    PCHECK(fdatasync(chain_certs_fd_) == 0);
+    segment->Seal();
+    segment = Segment::Open(SegmentPath(first), first, entries_per_segment_);
+    CHECK(segment->sealed());
+  }
+
+  return this->OK;
+}
+
+
+Database::LookupResult SegmentDB::LookupByHash(const string& hash,
+                                               LoggedEntry* result) const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_hash"));
+
+  int64_t sequence_number;
+  {
+    lock_guard<mutex> lock(lock_);
+    if (!id_by_hash_.Find(hash, &sequence_number)) {
+      return this->NOT_FOUND;
+    }
+  }
+
+  if (result) {
+    // Gotta be there, or we're in trouble...
+    CHECK_EQ(LookupByIndex(sequence_number, result), this->LOOKUP_OK);
+    CHECK_EQ(result->Hash(), hash);
+  }
+
+  return this->LOOKUP_OK;
+}
+
+
+Database::LookupResult SegmentDB::LookupByIndex(int64_t sequence_number,
+                                                LoggedEntry* result) const {
+  CHECK_GE(sequence_number, 0);
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_index"));
+
+  vector<pair<shared_ptr<const Mapping>, IndexEntry>> found;
+  LocateRange(sequence_number, 1, &found);
+  if (found.empty()) {
+    return this->NOT_FOUND;
+  }
+
+  if (result) {
+    CHECK(found[0].first->Parse(found[0].second, result));
+    CHECK(chain_certs_.Restore(load_chain_cert_, result));
+    CHECK_EQ(result->sequence_number(), sequence_number);
+  }
+  return this->LOOKUP_OK;
+}
+
+
+unique_ptr<Database::Iterator> SegmentDB::ScanEntries(
+    int64_t start_index) const {
+  return unique_ptr<Iterator>(new Iterator(this, start_index));
+}
+
+
+void SegmentDB::ReadRange(int64_t start, size_t count,
+                          vector<LoggedEntry>* entries) const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("read_range"));
+  ReadEntryRange(start, count, true, entries);
+}
+
+
+void SegmentDB::ReadLeafRange(int64_t start, size_t count,
+                              vector<LoggedEntry>* entries) const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("read_leaf_range"));
+  ReadEntryRange(start, count, false, entries);
+}
+
+
+void SegmentDB::ReadEntryRange(int64_t start, size_t count, bool with_chain,
+                               vector<LoggedEntry>* entries) const {
+  CHECK_GE(start, 0);
+  CHECK_NOTNULL(entries);
+
+  vector<pair<shared_ptr<const Mapping>, IndexEntry>> found;
+  LocateRange(start, count, &found);
+
+  entries->resize(found.size());
+  if (!found.empty()) {
+    found.front().first->WillNeed(found.front().second,
+                                  found.back().second);
+  }
+  for (size_t i = 0; i < found.size(); ++i) {
+    if (with_chain) {
+      CHECK(found[i].first->Parse(found[i].second, &(*entries)[i]));
+      CHECK(chain_certs_.Restore(load_chain_cert_, &(*entries)[i]));
+    } else {
+      CHECK(found[i].first->ParseWithoutChain(found[i].second,
+                                              &(*entries)[i]));
+    }
+    CHECK_EQ((*entries)[i].sequence_number(), start + static_cast<int64_t>(i));
+  }
+}
+
+
+void SegmentDB::ReadRawRange(int64_t start, size_t count,
+                             vector<string>* entries) const {
+  CHECK_GE(start, 0);
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("read_raw_range"));
+  CHECK_NOTNULL(entries)->clear();
+
+  vector<pair<shared_ptr<const Mapping>, IndexEntry>> found;
+  LocateRange(start, count, &found);
+
+  // Unless compressed, or with references to chain certificates, the
+  // entries are stored the way the callers want them.
+  entries->resize(found.size());
+  if (!found.empty()) {
+    found.front().first->WillNeed(found.front().second,
+                                  found.back().second);
+  }
+  for (size_t i = 0; i < found.size(); ++i) {
+    CHECK(found[i].first->ReadUncompressed(found[i].second, &(*entries)[i]));
+    CHECK(chain_certs_.RestoreSerialized(load_chain_cert_, &(*entries)[i]));
+  }
+}
+
+
+Database::WriteResult SegmentDB::WriteTreeHead_(
+    const ct::SignedTreeHead& sth) {
+  CHECK_GE(sth.tree_size(), 0);
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("write_tree_head"));
+
+  string data;
+  CHECK(sth.SerializeToString(&data));
+
+  unique_lock<mutex> lock(lock_);
+  const map<uint64_t, Location>::const_iterator existing(
+      tree_heads_.find(sth.timestamp()));
+  if (existing != tree_heads_.end()) {
+    string existing_data(existing->second.size, '\0');
+    CHECK(ReadFully(tree_heads_fd_, &existing_data[0], existing_data.size(),
+                    existing->second.offset));
+    if (existing_data == data) {
+      LOG(WARNING) << "Attempted to store identical STH in DB.";
+      return this->OK;
+    }
+    return this->DUPLICATE_TREE_HEAD_TIMESTAMP;
+  }
+
+  Location location;
+  location.offset =
+      AppendRecord(tree_heads_fd_, sth.timestamp(), data, &tree_heads_end_);
+  location.size = data.size();
+  tree_heads_.insert(make_pair(sth.timestamp(), location));
+
+  lock.unlock();
+  callbacks_.Call(sth);
+
+  return this->OK;
+}
+
+
+Database::LookupResult SegmentDB::LatestTreeHead(
+    ct::SignedTreeHead* result) const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("latest_tree_head"));
+  lock_guard<mutex> lock(lock_);
+
+  return LatestTreeHeadNoLock(result);
+}
+
+
+void SegmentDB::ReadTreeHeads(vector<ct::SignedTreeHead>* results) const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("read_tree_heads"));
+  lock_guard<mutex> lock(lock_);
+
+  results->clear();
+  string tree_data;
+  for (const auto& tree_head : tree_heads_) {
+    tree_data.resize(tree_head.second.size);
+    CHECK(ReadFully(tree_heads_fd_, &tree_data[0], tree_data.size(),
+                    tree_head.second.offset));
+    results->emplace_back();
+    CHECK(results->back().ParseFromString(tree_data));
+    CHECK_EQ(results->back().timestamp(), tree_head.first);
+  }
+}
+
+
+Database::LookupResult SegmentDB::LatestTreeFrontier(string* frontier) const {
+  CHECK_NOTNULL(frontier);
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("latest_tree_frontier"));
+  lock_guard<mutex> lock(lock_);
+  if (!util::ReadBinaryFile(dir_ + "/" + kTreeFrontierFile, frontier)) {
+    return this->NOT_FOUND;
+  }
+  return this->LOOKUP_OK;
+}
+
+
+void SegmentDB::WriteTreeFrontier(const string& frontier) {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("write_tree_frontier"));
+  lock_guard<mutex> lock(lock_);
+  // Written to a temporary file first, like the node id, so that the
+  // previous one is still there if we crash halfway.
+  const string path(dir_ + "/" + kTreeFrontierFile);
+  const string tmp_path(
+      util::WriteTemporaryBinaryFile(path + ".XXXXXX", frontier));
+  CHECK(!tmp_path.empty()) << "Could not write " << path;
+  PCHECK(rename(tmp_path.c_str(), path.c_str()) == 0) << path;
+}
+
+
+int64_t SegmentDB::TreeSize() const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("tree_size"));
+  lock_guard<mutex> lock(lock_);
+
+  return contiguous_size_;
+}
+
+
+void SegmentDB::AddNotifySTHCallback(
+    const Database::NotifySTHCallback* callback) {
+  unique_lock<mutex> lock(lock_);
+
+  callbacks_.Add(callback);
+
+  ct::SignedTreeHead sth;
+  if (LatestTreeHeadNoLock(&sth) == this->LOOKUP_OK) {
+    lock.unlock();
+    (*callback)(sth);
+  }
+}
+
+
+void SegmentDB::RemoveNotifySTHCallback(
+    const Database::NotifySTHCallback* callback) {
+  lock_guard<mutex> lock(lock_);
+
+  callbacks_.Remove(callback);
+}
+
+
+void SegmentDB::InitializeNode(const string& node_id) {
+  CHECK(!node_id.empty());
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("initialize_node"));
+  unique_lock<mutex> lock(lock_);
+  string existing_id;
+  if (NodeId(&existing_id) != this->NOT_FOUND) {
+    LOG(FATAL) << "Attempting to initialze DB belonging to node with node_id: "
+               << existing_id;
+  }
+
+  // Written to a temporary file first, so that it is either all there
+  // or not at all.
+  const string path(dir_ + "/" + kNodeIdFile);
+  const string tmp_path(
+      util::WriteTemporaryBinaryFile(path + ".XXXXXX", node_id));
+  CHECK(!tmp_path.empty()) << "Could not write " << path;
+  PCHECK(rename(tmp_path.c_str(), path.c_str()) == 0) << path;
+}
+
+
+Database::LookupResult SegmentDB::NodeId(string* node_id) {
+  CHECK_NOTNULL(node_id);
+  if (!util::ReadBinaryFile(dir_ + "/" + kNodeIdFile, node_id)) {
+    return this->NOT_FOUND;
+  }
+  return this->LOOKUP_OK;
+}
+
+
+void SegmentDB::Open() {
+  lock_guard<mutex> lock(lock_);
+
+  if (mkdir(dir_.c_str(), 0755) != 0) {
+    PCHECK(errno == EEXIST) << "Could not create " << dir_;
+  }
+  const string lock_path(dir_ + "/" + kLockFile);
+  lock_fd_ = open(lock_path.c_str(), O_RDWR | O_CREAT, 0644);
+  PCHECK(lock_fd_ >= 0) << "Could not open " << lock_path;
+  PCHECK(flock(lock_fd_, LOCK_EX | LOCK_NB) == 0)
+      << dir_ << " is already in use by another SegmentDB";
+
+  set<int64_t> firsts;
+  DIR* const dir(opendir(dir_.c_str()));
+  PCHECK(dir != nullptr) << "Could not read " << dir_;
+  const size_t prefix_size(strlen(kSegmentPrefix));
+  while (const struct dirent* const file = readdir(dir)) {
+    const string name(file->d_name);
+    if (name.compare(0, prefix_size, kSegmentPrefix) == 0) {
+      const string first(name.substr(prefix_size));
+      CHECK(!first.empty() &&
+            first.find_first_not_of("0123456789") == string::npos)
+          << "Unexpected file " << name << " in " << dir_;
+      firsts.insert(std::stoll(first));
+    }
+  }
+  PCHECK(closedir(dir) == 0);
+
+  for (const int64_t first : firsts) {
+    CHECK_EQ(first % entries_per_segment_, 0)
+        << SegmentPath(first) << " does not start a segment; was "
+        << dir_ << " written with a different number of entries per segment?";
+    shared_ptr<Segment> segment(
+        Segment::Open(SegmentPath(first), first, entries_per_segment_));
+    if (!segment->sealed() && segment->full()) {
+      // We crashed before sealing it.
+      segment->Seal();
+      segment = Segment::Open(SegmentPath(first), first, entries_per_segment_);
+      CHECK(segment->sealed());
+    }
+
+    id_by_hash_.Reserve(id_by_hash_.size() + segment->num_entries());
+    for (int64_t seq = first; seq < first + entries_per_segment_; ++seq) {
+      const IndexEntry* const entry(segment->Find(seq));
+      if (entry) {
+        InsertEntryMapping(seq, string(entry->hash, sizeof(entry->hash)));
+      }
+    }
+    segments_.insert(make_pair(first, move(segment)));
+  }
+
+  OpenTreeHeads();
+  OpenChainCerts();
+}
+
+
+void SegmentDB::OpenTreeHeads() {
+  const string path(dir_ + "/" + kTreeHeadsFile);
+  tree_heads_fd_ = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  PCHECK(tree_heads_fd_ >= 0) << "Could not open " << path;
+
+  const uint64_t size(FileSize(tree_heads_fd_));
+  RecordHeader header;
+  string data;
+  ct::SignedTreeHead sth;
+  while (ReadRecord(tree_heads_fd_, tree_heads_end_, size, &header, &data) &&
+         sth.ParseFromString(data) &&
+         sth.timestamp() == static_cast<uint64_t>(header.key)) {
+    Location location;
+    location.offset = tree_heads_end_ + sizeof(header);
+    location.size = header.size;
+    tree_heads_[sth.timestamp()] = location;
+    tree_heads_end_ += sizeof(header) + header.size;
+  }
+
+  if (tree_heads_end_ != size) {
+    Truncate(tree_heads_fd_, tree_heads_end_, path);
+  }
+}
+
+
+void SegmentDB::OpenChainCerts() {
+  const string path(dir_ + "/" + kChainCertsFile);
+  chain_certs_fd_ = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  PCHECK(chain_certs_fd_ >= 0) << "Could not open " << path;
+
+  const uint64_t size(FileSize(chain_certs_fd_));
+  RecordHeader header;
+  string data;
+  while (ReadRecord(chain_certs_fd_, chain_certs_end_, size, &header, &data) &&
+         data.size() > HashIndex::kKeySize) {
+    const string hash(data, 0, HashIndex::kKeySize);
+    if (Sha256Hasher::Sha256Digest(data.substr(hash.size())) != hash) {
+      break;
+    }
+    Location location;
+    location.offset = chain_certs_end_ + sizeof(header) + hash.size();
+    location.size = header.size - hash.size();
+    chain_cert_locations_[hash] = location;
+    chain_certs_end_ += sizeof(header) + header.size;
+  }
+
+  if (chain_certs_end_ != size) {
+    Truncate(chain_certs_fd_, chain_certs_end_, path);
+  }
+}
+
+
+bool SegmentDB::LoadChainCert(const string& hash, string* cert) const {
+  lock_guard<mutex> lock(lock_);
+  return LoadChainCertLocked(hash, cert);
+}
+
+
+Database::LookupResult SegmentDB::LatestTreeHeadNoLock(
+    ct::SignedTreeHead* result) const {
+  if (tree_heads_.empty()) {
+    return this->NOT_FOUND;
+  }
+
+  const map<uint64_t, Location>::const_reverse_iterator latest(
+      tree_heads_.rbegin());
+  string tree_data(latest->second.size, '\0');
+  CHECK(ReadFully(tree_heads_fd_, &tree_data[0], tree_data.size(),
+                  latest->second.offset));
+
+  CHECK(result->ParseFromString(tree_data));
+  CHECK_EQ(result->timestamp(), latest->first);
+
+  return this->LOOKUP_OK;
+}
+
+
+// This must be called with "lock_" held.
+void SegmentDB::InsertEntryMapping(int64_t sequence_number,
+                                   const string& hash) {
+  // If this is a duplicate hash under a new sequence number, make
+  // sure we track the entry with the lowest sequence number.
+  int64_t existing;
+  if (!id_by_hash_.Find(hash, &existing) || sequence_number < existing) {
+    id_by_hash_.Set(hash, sequence_number);
+  }
+
+  if (sequence_number == contiguous_size_) {
+    ++contiguous_size_;
+    for (auto i = sparse_entries_.find(contiguous_size_);
+         i != sparse_entries_.end() && *i == contiguous_size_;) {
+      ++contiguous_size_;
+      i = sparse_entries_.erase(i);
+    }
+  } else {
+    // It's not contiguous, put it with the other sparse entries.
+    CHECK(sparse_entries_.insert(sequence_number).second)
+        << "sequence number " << sequence_number << " already assigned.";
+  }
+}
+
+
+// This must be called with "lock_" held.
+shared_ptr<const SegmentDB::Segment> SegmentDB::FindSegment(
+    int64_t sequence_number) const {
+  const map<int64_t, shared_ptr<Segment>>::const_iterator it(
+      segments_.find(sequence_number - sequence_number % entries_per_segment_));
+  if (it == segments_.end()) {
+    return nullptr;
+  }
+  return it->second;
+}
+
+
+// Only looks up where the entries are, so that they can be read
+// without holding "lock_".
+void SegmentDB::LocateRange(
+    int64_t start, size_t count,
+    vector<pair<shared_ptr<const Mapping>, IndexEntry>>* found) const {
+  lock_guard<mutex> lock(lock_);
+  shared_ptr<const Segment> segment;
+  for (int64_t seq = start; found->size() < count; ++seq) {
+    if (!segment || seq % entries_per_segment_ == 0) {
+      segment = FindSegment(seq);
+    }
+    const IndexEntry* const entry(segment ? segment->Find(seq) : nullptr);
+    if (!entry) {
+      break;
+    }
+    found->emplace_back(segment->mapping(), *entry);
+  }
+}
+
+
+string SegmentDB::SegmentPath(int64_t first_sequence_number) const {
+  // Zero-padded, so that the segments sort in order.
+  char name[32];
+  snprintf(name, sizeof(name), "%020lld",
+           static_cast<long long>(first_sequence_number));
+  return dir_ + "/" + kSegmentPrefix + name;
+}
+
+
+// This must be called with "lock_" held.
+void SegmentDB::StoreChainCertsLocked(const map<string, string>& certs) {
+  for (const auto& cert : certs) {
+    CHECK_EQ(cert.first.size(), HashIndex::kKeySize);
+    if (chain_cert_locations_.count(cert.first) > 0) {
+      continue;
+    }
+    Location location;
+    location.offset = AppendRecord(chain_certs_fd_, 0, cert.first + cert.second,
+                                   &chain_certs_end_) +
+                      cert.first.size();
+    location.size = cert.second.size();
+    chain_cert_locations_.insert(make_pair(cert.first, location));
+  }
+  chain_certs_.Stored(certs);
+}
+
+
+// This must be called with "lock_" held.
+bool SegmentDB::LoadChainCertLocked(const string& hash, string* cert) const {
+  const map<string, Location>::const_iterator it(
+      chain_cert_locations_.find(hash));
+  if (it == chain_cert_locations_.end()) {
+    return false;
+  }
+  cert->resize(it->second.size);
+  CHECK(ReadFully(chain_certs_fd_, &(*cert)[0], cert->size(),
+                  it->second.offset));
+  return true;
+}
+
+
+}  // namespace cert_trans
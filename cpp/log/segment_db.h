@@ -0,0 +1,182 @@
+#ifndef CERT_TRANS_LOG_SEGMENT_DB_H_
+#define CERT_TRANS_LOG_SEGMENT_DB_H_
+
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "base/macros.h"
+#include "log/chain_cert_cache.h"
+#include "log/database.h"
+#include "proto/ct.pb.h"
+#include "util/hash_index.h"
+#include "util/memory_accounting.h"
+
+namespace cert_trans {
+
+
+// Database interface that stores the entries in a few large,
+// append-only segment files in a directory, rather than one file per
+// entry like the FileDB.
+//
+// Each segment file holds the entries of a fixed range of
+// |entries_per_segment| sequence numbers, appended in the order they
+// are written. Once all the entries of a segment are present, an
+// index section is appended to it (a fixed-width array of offsets and
+// hashes, by sequence number) and it is never written again: such
+// "sealed" segments are looked up through it. Segments still
+// being filled (usually only the last one, but possibly a few while
+// the log is being fetched) are indexed in memory, by reading them
+// when the database is opened; if the process crashed while
+// appending to one, the torn record at its end is dropped.
+//
+// All the segments are read through read-only mmap'ings, without a
+// system call or a copy for every entry.
+//
+// Tree heads are appended to a single file as well, and so are the
+// deduplicated chain certificates (see ChainCertCache), which are
+// indexed in memory. The node ID is kept in a file of its own. Only
+// one SegmentDB can have a given directory open at a time.
+class SegmentDB : public Database {
+ public:
+  static const int64_t kDefaultEntriesPerSegment;
+
+  // |entries_per_segment| must be the same every time the database in
+  // |dir| is opened.
+  explicit SegmentDB(const std::string& dir,
+                     int64_t entries_per_segment = kDefaultEntriesPerSegment);
+  ~SegmentDB();
+
+  // Implement abstract functions, see database.h for comments.
+  Database::WriteResult CreateSequencedEntry_(
+      const LoggedEntry& logged) override;
+
+  Database::WriteResult CreateSequencedEntries_(
+      const std::vector<LoggedEntry>& entries, size_t* num_written) override;
+
+  Database::LookupResult LookupByHash(const std::string& hash,
+                                      LoggedEntry* result) const override;
+
+  Database::LookupResult LookupByIndex(int64_t sequence_number,
+                                       LoggedEntry* result) const override;
+
+  std::unique_ptr<Database::Iterator> ScanEntries(
+      int64_t start_index) const override;
+
+  void ReadRange(int64_t start, size_t count,
+                 std::vector<LoggedEntry>* entries) const override;
+
+  void ReadRawRange(int64_t start, size_t count,
+                    std::vector<std::string>* entries) const override;
+
+  void ReadLeafRange(int64_t start, size_t count,
+                     std::vector<LoggedEntry>* entries) const override;
+
+  Database::WriteResult WriteTreeHead_(const ct::SignedTreeHead& sth) override;
+
+  Database::LookupResult LatestTreeHead(
+      ct::SignedTreeHead* result) const override;
+
+  void ReadTreeHeads(std::vector<ct::SignedTreeHead>* results) const override;
+
+  Database::LookupResult LatestTreeFrontier(
+      std::string* frontier) const override;
+
+  void WriteTreeFrontier(const std::string& frontier) override;
+
+  int64_t TreeSize() const override;
+
+  void AddNotifySTHCallback(
+      const Database::NotifySTHCallback* callback) override;
+
+  void RemoveNotifySTHCallback(
+      const Database::NotifySTHCallback* callback) override;
+
+  void InitializeNode(const std::string& node_id) override;
+
+  Database::LookupResult NodeId(std::string* node_id) override;
+
+ private:
+  class Iterator;
+  class Mapping;
+  class Segment;
+  struct IndexEntry;
+  struct Location {
+    uint64_t offset;
+    uint32_t size;
+  };
+
+  void Open();
+  void OpenTreeHeads();
+  // ReadRange() or, without |with_chain|, ReadLeafRange().
+  void ReadEntryRange(int64_t start, size_t count, bool with_chain,
+                      std::vector<LoggedEntry>* entries) const;
+  void OpenChainCerts();
+  bool LoadChainCert(const std::string& hash, std::string* cert) const;
+  // These must be called with "lock_" held.
+  Database::WriteResult CreateSequencedEntryLocked(const LoggedEntry& logged,
+                                                   const std::string& data);
+  Database::LookupResult LatestTreeHeadNoLock(
+      ct::SignedTreeHead* result) const;
+  void InsertEntryMapping(int64_t sequence_number, const std::string& hash);
+  void StoreChainCertsLocked(const std::map<std::string, std::string>& certs);
+  bool LoadChainCertLocked(const std::string& hash, std::string* cert) const;
+  // Returns the segment holding |sequence_number|, or NULL if it has
+  // not been written.
+  std::shared_ptr<const Segment> FindSegment(int64_t sequence_number) const;
+  // Finds the entries from |start|, up to |count| of them, stopping
+  // short at the first one missing.
+  void LocateRange(
+      int64_t start, size_t count,
+      std::vector<std::pair<std::shared_ptr<const Mapping>, IndexEntry>>*
+          found) const;
+  std::string SegmentPath(int64_t first_sequence_number) const;
+
+  const std::string dir_;
+  const int64_t entries_per_segment_;
+  int lock_fd_;
+
+  mutable std::mutex lock_;
+
+  // By the first sequence number of each segment. Sealing a segment
+  // replaces it here, readers still using the old one keep it alive.
+  std::map<int64_t, std::shared_ptr<Segment>> segments_;
+
+  int64_t contiguous_size_;
+  HashIndex id_by_hash_;
+
+  // This is a mapping of the non-contiguous entries of the log (which
+  // can happen while it is being fetched). When entries here become
+  // contiguous with the head of the tree they'll be removed.
+  std::set<int64_t> sparse_entries_;
+
+  int tree_heads_fd_;
+  uint64_t tree_heads_end_;
+  // The location of every tree head in the tree heads file, by
+  // timestamp.
+  std::map<uint64_t, Location> tree_heads_;
+  DatabaseNotifierHelper callbacks_;
+
+  int chain_certs_fd_;
+  uint64_t chain_certs_end_;
+  // The location of every chain certificate in the chain certificates
+  // file, by hash.
+  std::map<std::string, Location> chain_cert_locations_;
+  mutable ChainCertCache chain_certs_;
+  const ChainCertCache::LoadFunction load_chain_cert_;
+
+  // Last, to stop counting the indexes before they go.
+  const std::unique_ptr<MemoryAccounting::Registration> index_memory_;
+
+  DISALLOW_COPY_AND_ASSIGN(SegmentDB);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_SEGMENT_DB_H_
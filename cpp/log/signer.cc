@@ -1,12 +1,16 @@
 /* -*- indent-tabs-mode: nil -*- */
 #include "log/signer.h"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
 #include <openssl/evp.h>
 #include <openssl/opensslv.h>
 #include <stdint.h>
 
 #include "log/verifier.h"
+#include "merkletree/serial_hasher.h"
 #include "proto/ct.pb.h"
 #include "util/util.h"
 
@@ -16,6 +20,11 @@
 
 using cert_trans::Verifier;
 
+DEFINE_bool(signer_cache_ec_key, true,
+            "Precompute the multiples of the generator used to make ECDSA "
+            "signatures once, and sign with the key directly, rather than "
+            "setting up a generic private key context for every signature.");
+
 namespace cert_trans {
 
 Signer::Signer(EVP_PKEY* pkey) : pkey_(CHECK_NOTNULL(pkey)) {
@@ -23,6 +32,10 @@ Signer::Signer(EVP_PKEY* pkey) : pkey_(CHECK_NOTNULL(pkey)) {
     case EVP_PKEY_EC:
       hash_algo_ = ct::DigitallySigned::SHA256;
       sig_algo_ = ct::DigitallySigned::ECDSA;
+      if (FLAGS_signer_cache_ec_key) {
+        ec_key_.reset(CHECK_NOTNULL(EVP_PKEY_get1_EC_KEY(pkey_.get())));
+        CHECK_EQ(1, EC_KEY_precompute_mult(ec_key_.get(), NULL));
+      }
       break;
     case EVP_PKEY_RSA:
       hash_algo_ = ct::DigitallySigned::SHA256;
@@ -45,26 +58,46 @@ void Signer::Sign(const std::string& data,
   signature->set_signature(RawSign(data));
 }
 
+void Signer::Sign(const std::string& data, ct::DigitallySigned* signature,
+                  util::Task* task) const {
+  Sign(data, signature);
+  task->Return();
+}
+
 Signer::Signer()
     : hash_algo_(ct::DigitallySigned::NONE),
       sig_algo_(ct::DigitallySigned::ANONYMOUS) {
 }
 
 std::string Signer::RawSign(const std::string& data) const {
+  // Signed directly into the result, trimmed to the actual size after.
+  std::string ret;
+  unsigned int sig_size;
+  if (ec_key_) {
+    const std::string digest(Sha256Hasher::Sha256Digest(data));
+    ret.resize(ECDSA_size(ec_key_.get()));
+    sig_size = ret.size();
+    CHECK_EQ(1, ECDSA_sign(
+                    0, reinterpret_cast<const unsigned char*>(digest.data()),
+                    digest.size(), reinterpret_cast<unsigned char*>(&ret[0]),
+                    &sig_size, ec_key_.get()));
+    ret.resize(sig_size);
+    return ret;
+  }
+
   EVP_MD_CTX ctx;
   EVP_MD_CTX_init(&ctx);
   // NOTE: this syntax for setting the hash function requires OpenSSL >= 1.0.0.
   CHECK_EQ(1, EVP_SignInit(&ctx, EVP_sha256()));
   CHECK_EQ(1, EVP_SignUpdate(&ctx, data.data(), data.size()));
-  unsigned int sig_size = EVP_PKEY_size(pkey_.get());
-  unsigned char* sig = new unsigned char[sig_size];
+  ret.resize(EVP_PKEY_size(pkey_.get()));
+  sig_size = ret.size();
 
-  CHECK_EQ(1, EVP_SignFinal(&ctx, sig, &sig_size, pkey_.get()));
+  CHECK_EQ(1, EVP_SignFinal(&ctx, reinterpret_cast<unsigned char*>(&ret[0]),
+                            &sig_size, pkey_.get()));
 
   EVP_MD_CTX_cleanup(&ctx);
-  std::string ret(reinterpret_cast<char*>(sig), sig_size);
-
-  delete[] sig;
+  ret.resize(sig_size);
   return ret;
 }
 
@@ -10,6 +10,7 @@
 #include "base/macros.h"
 #include "proto/ct.pb.h"
 #include "util/openssl_scoped_types.h"
+#include "util/task.h"
 
 namespace cert_trans {
 
@@ -23,6 +24,13 @@ class Signer {
   virtual void Sign(const std::string& data,
                     ct::DigitallySigned* signature) const;
 
+  // Same as above, but returns |task| once |signature| is set, which
+  // can be later, from another thread, for a key that is not in
+  // memory (in a hardware module, say), without holding on to the
+  // calling thread until then. This one signs right away.
+  virtual void Sign(const std::string& data, ct::DigitallySigned* signature,
+                    util::Task* task) const;
+
  protected:
   // A constructor for mocking.
   Signer();
@@ -31,6 +39,8 @@ class Signer {
   std::string RawSign(const std::string& data) const;
 
   ScopedEVP_PKEY pkey_;
+  // Set for ECDSA keys, when signing with it directly.
+  ScopedEC_KEY ec_key_;
   ct::DigitallySigned::HashAlgorithm hash_algo_;
   ct::DigitallySigned::SignatureAlgorithm sig_algo_;
   std::string key_id_;
@@ -1,7 +1,9 @@
 /* -*- indent-tabs-mode: nil -*- */
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 #include <stdint.h>
+#include <memory>
 #include <string>
 
 #include "log/signer.h"
@@ -16,6 +18,10 @@
 using cert_trans::Verifier;
 using ct::DigitallySigned;
 using std::string;
+using std::unique_ptr;
+
+DECLARE_bool(signer_cache_ec_key);
+DECLARE_bool(verifier_cache_ec_key);
 
 namespace cert_trans {
 namespace {
@@ -91,6 +97,37 @@ TEST_F(SignerVerifierTest, SignAndVerify) {
   EXPECT_EQ(Verifier::OK, verifier_->Verify(kTestString, signature2));
 }
 
+// Check that a verifier set up for every signature agrees.
+TEST_F(SignerVerifierTest, VerifyWithoutCachedKey) {
+  FLAGS_verifier_cache_ec_key = false;
+  const unique_ptr<Verifier> verifier(TestSigner::DefaultVerifier());
+  FLAGS_verifier_cache_ec_key = true;
+
+  DigitallySigned signature;
+  signer_->Sign(kTestString, &signature);
+  EXPECT_EQ(Verifier::OK, verifier->Verify(kTestString, signature));
+  EXPECT_EQ(Verifier::OK, verifier_->Verify(kTestString, signature));
+
+  signature.mutable_signature()->at(0) ^= 0x01;
+  EXPECT_EQ(Verifier::INVALID_SIGNATURE,
+            verifier->Verify(kTestString, signature));
+  EXPECT_EQ(Verifier::INVALID_SIGNATURE,
+            verifier_->Verify(kTestString, signature));
+}
+
+// Check that a signer set up for every signature makes signatures
+// that verify the same.
+TEST_F(SignerVerifierTest, SignWithoutCachedKey) {
+  FLAGS_signer_cache_ec_key = false;
+  const unique_ptr<Signer> signer(TestSigner::DefaultSigner());
+  FLAGS_signer_cache_ec_key = true;
+
+  DigitallySigned signature;
+  signer->Sign(kTestString, &signature);
+  EXPECT_EQ(DigitallySigned::ECDSA, signature.sig_algorithm());
+  EXPECT_EQ(Verifier::OK, verifier_->Verify(kTestString, signature));
+}
+
 // Check various error cases.
 TEST_F(SignerVerifierTest, Errors) {
   DigitallySigned signature;
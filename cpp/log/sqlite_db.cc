@@ -2,7 +2,12 @@
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <google/protobuf/wire_format_lite.h>
 #include <sqlite3.h>
+#include <stdint.h>
+#include <algorithm>
 
 #include "log/sqlite_statement.h"
 #include "monitoring/latency.h"
@@ -12,10 +17,15 @@
 using std::unique_ptr;
 using std::chrono::milliseconds;
 using std::lock_guard;
+using std::find_if;
+using std::map;
+using std::max;
+using std::move;
 using std::mutex;
 using std::ostringstream;
 using std::string;
 using std::unique_lock;
+using std::vector;
 
 // Several of these flags pass their value directly through to SQLite PRAGMA
 // statements, see the SQLite documentation
@@ -42,14 +52,32 @@ DEFINE_bool(sqlite_batch_into_transactions, true,
             "scenes.");
 DEFINE_int32(sqlite_transaction_batch_size, 400,
              "Max number of operations to batch into one transaction.");
+DEFINE_int32(sqlite_reader_connections, 8,
+             "Max number of read-only connections for lookups running "
+             "concurrently with writes and each other, in WAL journal mode "
+             "(0 to do everything on the writer connection).");
+DEFINE_int32(sqlite_sth_retention_days, 0,
+             "Age after which the tree heads are thinned out to one every "
+             "--sqlite_sth_retention_interval_hours (0 to keep them all).");
+DEFINE_int32(sqlite_sth_retention_interval_hours, 24,
+             "Once older than --sqlite_sth_retention_days, only the latest "
+             "tree head of each period this long is kept.");
 
 namespace cert_trans {
 namespace {
 
+// Number of entries read at a time by the iterators.
+const size_t kScanBatchSize = 256;
 
 static Latency<milliseconds, string> latency_by_op_ms(
     "sqlitedb_latency_by_operation_ms", "operation",
     "Database latency in ms broken out by operation");
+static Counter<>* tree_heads_thinned(
+    Counter<>::New("sqlitedb_tree_heads_thinned",
+                   "Number of old tree heads deleted by the STH retention "
+                   "policy."));
+
+const uint64_t kMillisPerHour = 3600 * 1000;
 
 
 sqlite3* SQLiteOpen(const string& dbfile) {
@@ -97,51 +125,358 @@ sqlite3* SQLiteOpen(const string& dbfile) {
 }
 
 
+sqlite3* SQLiteOpenReader(const string& dbfile) {
+  ScopedLatency scoped_latency(
+      latency_by_op_ms.GetScopedLatency("open_reader"));
+  sqlite3* retval;
+
+  // Opened read-write, as read-only connections cannot always open a
+  // WAL database.
+  CHECK_EQ(SQLITE_OK, sqlite3_open_v2(dbfile.c_str(), &retval,
+                                      SQLITE_OPEN_READWRITE, nullptr))
+      << sqlite3_errmsg(retval);
+  CHECK_EQ(SQLITE_OK, sqlite3_exec(retval, "PRAGMA query_only = ON", nullptr,
+                                   nullptr, nullptr))
+      << sqlite3_errmsg(retval);
+  // In WAL mode, readers only have to wait while the WAL is reset
+  // after a checkpoint.
+  CHECK_EQ(SQLITE_OK, sqlite3_busy_timeout(retval, 5000))
+      << sqlite3_errmsg(retval);
+
+  return retval;
+}
+
+
+ChainCertCache::LoadFunction ChainCertLoader(sqlite::Connection* conn) {
+  return [conn](const string& hash, string* cert) {
+    sqlite::Statement statement(conn,
+                                "SELECT cert FROM chain_certs WHERE hash = ?");
+    statement.BindBlob(0, hash);
+    const int ret(statement.Step());
+    if (ret == SQLITE_DONE) {
+      return false;
+    }
+    CHECK_EQ(SQLITE_ROW, ret) << sqlite3_errmsg(conn->get());
+    statement.GetBlob(0, cert);
+    return true;
+  };
+}
+
+
+// The following work the same way on the writer and reader
+// connections, and leave the |tree_size_| bookkeeping to their
+// callers.
+
+Database::LookupResult LookupByHash(sqlite::Connection* conn,
+                                    ChainCertCache* chain_certs,
+                                    const string& hash, LoggedEntry* result) {
+  sqlite::Statement statement(conn,
+                              "SELECT entry, sequence FROM leaves "
+                              "WHERE hash = ? ORDER BY sequence LIMIT 1");
+
+  statement.BindBlob(0, hash);
+
+  int ret = statement.Step();
+  if (ret == SQLITE_DONE) {
+    return Database::NOT_FOUND;
+  }
+  CHECK_EQ(SQLITE_ROW, ret) << sqlite3_errmsg(conn->get());
+
+  string data;
+  statement.GetBlob(0, &data);
+  CHECK(result->ParseFromDatabase(data));
+  CHECK(chain_certs->Restore(ChainCertLoader(conn), result));
+
+  if (statement.GetType(1) == SQLITE_NULL) {
+    result->clear_sequence_number();
+  } else {
+    result->set_sequence_number(statement.GetUInt64(1));
+  }
+
+  return Database::LOOKUP_OK;
+}
+
+
+Database::LookupResult LookupByIndex(sqlite::Connection* conn,
+                                     ChainCertCache* chain_certs,
+                                     int64_t sequence_number,
+                                     LoggedEntry* result) {
+  CHECK_GE(sequence_number, 0);
+  sqlite::Statement statement(conn,
+                              "SELECT entry, hash FROM leaves "
+                              "WHERE sequence = ?");
+  statement.BindUInt64(0, sequence_number);
+  int ret = statement.Step();
+  if (ret == SQLITE_DONE) {
+    return Database::NOT_FOUND;
+  }
+  CHECK_EQ(SQLITE_ROW, ret) << sqlite3_errmsg(conn->get());
+
+  string data;
+  statement.GetBlob(0, &data);
+  CHECK(result->ParseFromDatabase(data));
+  CHECK(chain_certs->Restore(ChainCertLoader(conn), result));
+
+  string hash;
+  statement.GetBlob(1, &hash);
+
+  CHECK_EQ(result->Hash(), hash);
+
+  result->set_sequence_number(sequence_number);
+
+  return Database::LOOKUP_OK;
+}
+
+
+// Returns the number of entries read.
+size_t ScanRange(sqlite::Connection* conn, ChainCertCache* chain_certs,
+                 int64_t start, size_t count, vector<LoggedEntry>* entries) {
+  CHECK_GE(start, 0);
+  sqlite::Statement statement(conn,
+                              "SELECT entry, hash, sequence FROM leaves "
+                              "WHERE sequence >= ? ORDER BY sequence "
+                              "LIMIT ?");
+  statement.BindUInt64(0, start);
+  statement.BindUInt64(1, count);
+  const ChainCertCache::LoadFunction load_chain_cert(ChainCertLoader(conn));
+  string data;
+  string hash;
+  size_t num_read(0);
+  int ret;
+  while ((ret = statement.Step()) == SQLITE_ROW) {
+    statement.GetBlob(0, &data);
+    if (num_read == entries->size()) {
+      entries->emplace_back();
+    }
+    // Clearing an entry that was already there keeps its memory.
+    LoggedEntry* const entry(&(*entries)[num_read]);
+    entry->Clear();
+    CHECK(entry->ParseFromDatabase(data));
+    CHECK(chain_certs->Restore(load_chain_cert, entry));
+    statement.GetBlob(1, &hash);
+    CHECK_EQ(entry->Hash(), hash);
+    entry->set_sequence_number(statement.GetUInt64(2));
+    ++num_read;
+  }
+  CHECK_EQ(SQLITE_DONE, ret) << sqlite3_errmsg(conn->get());
+  entries->resize(num_read);
+
+  return num_read;
+}
+
+
+// Returns the number of contiguous entries read from |start|.
+size_t ReadRange(sqlite::Connection* conn, ChainCertCache* chain_certs,
+                 int64_t start, size_t count, vector<LoggedEntry>* entries) {
+  sqlite::Statement statement(conn,
+                              "SELECT entry, hash, sequence FROM leaves "
+                              "WHERE sequence >= ? AND sequence < ? "
+                              "ORDER BY sequence");
+  statement.BindUInt64(0, start);
+  statement.BindUInt64(1, start + count);
+  const ChainCertCache::LoadFunction load_chain_cert(ChainCertLoader(conn));
+  string data;
+  string hash;
+  size_t num_read(0);
+  for (int64_t seq = start; statement.Step() == SQLITE_ROW;
+       ++seq, ++num_read) {
+    if (static_cast<int64_t>(statement.GetUInt64(2)) != seq) {
+      break;
+    }
+
+    statement.GetBlob(0, &data);
+    if (num_read == entries->size()) {
+      entries->emplace_back();
+    }
+    // Clearing an entry that was already there keeps its memory.
+    LoggedEntry* const entry(&(*entries)[num_read]);
+    entry->Clear();
+    CHECK(entry->ParseFromDatabase(data));
+    CHECK(chain_certs->Restore(load_chain_cert, entry));
+    statement.GetBlob(1, &hash);
+    CHECK_EQ(entry->Hash(), hash);
+    entry->set_sequence_number(seq);
+  }
+  entries->resize(num_read);
+
+  return num_read;
+}
+
+
+// Returns the number of contiguous entries read from |start|.
+size_t ReadRawRange(sqlite::Connection* conn, ChainCertCache* chain_certs,
+                    int64_t start, size_t count, vector<string>* entries) {
+  entries->clear();
+  sqlite::Statement statement(conn,
+                              "SELECT entry, sequence FROM leaves "
+                              "WHERE sequence >= ? AND sequence < ? "
+                              "ORDER BY sequence");
+  statement.BindUInt64(0, start);
+  statement.BindUInt64(1, start + count);
+  const ChainCertCache::LoadFunction load_chain_cert(ChainCertLoader(conn));
+  string stored;
+  string contents;
+  for (int64_t seq = start; statement.Step() == SQLITE_ROW; ++seq) {
+    if (static_cast<int64_t>(statement.GetUInt64(1)) != seq) {
+      break;
+    }
+
+    // Only the contents are stored, the rest of the LoggedEntryPB is
+    // put around them without parsing them.
+    statement.GetBlob(0, &stored);
+    CHECK(LoggedEntry::UncompressStored(stored.data(), stored.size(),
+                                        &contents));
+    entries->emplace_back();
+    {
+      google::protobuf::io::StringOutputStream output(&entries->back());
+      google::protobuf::io::CodedOutputStream coded(&output);
+      google::protobuf::internal::WireFormatLite::WriteInt64(
+          ct::LoggedEntryPB::kSequenceNumberFieldNumber, seq, &coded);
+      google::protobuf::internal::WireFormatLite::WriteBytes(
+          ct::LoggedEntryPB::kContentsFieldNumber, contents, &coded);
+    }
+    CHECK(chain_certs->RestoreSerialized(load_chain_cert, &entries->back()));
+  }
+
+  return entries->size();
+}
+
+
+Database::LookupResult LatestTreeHead(sqlite::Connection* conn,
+                                      ct::SignedTreeHead* result) {
+  sqlite::Statement statement(conn,
+                              "SELECT sth FROM trees WHERE timestamp IN "
+                              "(SELECT MAX(timestamp) FROM trees)");
+
+  int ret = statement.Step();
+  if (ret == SQLITE_DONE) {
+    return Database::NOT_FOUND;
+  }
+  CHECK_EQ(SQLITE_ROW, ret) << sqlite3_errmsg(conn->get());
+
+  string sth;
+  statement.GetBlob(0, &sth);
+  CHECK(result->ParseFromString(sth));
+
+  return Database::LOOKUP_OK;
+}
+
+
+void ReadTreeHeads(sqlite::Connection* conn,
+                   vector<ct::SignedTreeHead>* results) {
+  sqlite::Statement statement(conn,
+                              "SELECT sth FROM trees ORDER BY timestamp");
+
+  results->clear();
+  string sth;
+  int ret;
+  while ((ret = statement.Step()) == SQLITE_ROW) {
+    statement.GetBlob(0, &sth);
+    results->emplace_back();
+    CHECK(results->back().ParseFromString(sth));
+  }
+  CHECK_EQ(SQLITE_DONE, ret) << sqlite3_errmsg(conn->get());
+}
+
+
 }  // namespace
 
 
+// Takes one of the reader connections for the duration of a lookup,
+// opening it if needed. There might not be any available, in which
+// case get() returns NULL.
+class SQLiteDB::Reader {
+ public:
+  explicit Reader(const SQLiteDB* db) : db_(CHECK_NOTNULL(db)) {
+    if (!db_->use_readers_) {
+      return;
+    }
+    {
+      lock_guard<mutex> lock(db_->readers_lock_);
+      if (!db_->idle_readers_.empty()) {
+        conn_ = move(db_->idle_readers_.back());
+        db_->idle_readers_.pop_back();
+        return;
+      }
+      if (db_->num_readers_ >= FLAGS_sqlite_reader_connections) {
+        return;
+      }
+      ++db_->num_readers_;
+    }
+    conn_.reset(new sqlite::Connection(SQLiteOpenReader(db_->dbfile_)));
+  }
+
+  ~Reader() {
+    if (conn_) {
+      lock_guard<mutex> lock(db_->readers_lock_);
+      db_->idle_readers_.emplace_back(move(conn_));
+    }
+  }
+
+  sqlite::Connection* get() const {
+    return conn_.get();
+  }
+
+ private:
+  const SQLiteDB* const db_;
+  unique_ptr<sqlite::Connection> conn_;
+
+  DISALLOW_COPY_AND_ASSIGN(Reader);
+};
+
+
+// Reads the entries a batch at a time, rather than keeping a
+// statement going between calls, which would hold on to a connection
+// and to a snapshot of the database (holding up WAL checkpoints) for
+// as long as the iterator lives.
 class SQLiteDB::Iterator : public Database::Iterator {
  public:
   Iterator(const SQLiteDB* db, int64_t start_index)
-      : db_(CHECK_NOTNULL(db)), next_index_(start_index) {
+      : db_(CHECK_NOTNULL(db)), next_index_(start_index), next_in_batch_(0) {
     CHECK_GE(next_index_, 0);
   }
 
   bool GetNextEntry(LoggedEntry* entry) override {
     CHECK_NOTNULL(entry);
-    unique_lock<mutex> lock(db_->lock_);
-    if (next_index_ < db_->tree_size_) {
-      CHECK_EQ(db_->LookupByIndex(lock, next_index_, entry), db_->LOOKUP_OK);
-      ++next_index_;
-      return true;
+    if (next_in_batch_ == batch_.size()) {
+      // Entries written since the last batch are picked up here.
+      db_->ScanRange(next_index_, kScanBatchSize, &batch_);
+      next_in_batch_ = 0;
+      if (batch_.empty()) {
+        return false;
+      }
     }
 
-    const bool retval(db_->LookupNextIndex(lock, next_index_, entry) ==
-                      db_->LOOKUP_OK);
-    if (retval) {
-      next_index_ = entry->sequence_number() + 1;
-    }
+    entry->Swap(&batch_[next_in_batch_++]);
+    next_index_ = entry->sequence_number() + 1;
 
-    return retval;
+    return true;
   }
 
  private:
   const SQLiteDB* const db_;
   int64_t next_index_;
+  vector<LoggedEntry> batch_;
+  size_t next_in_batch_;
 };
 
 
 SQLiteDB::SQLiteDB(const string& dbfile)
-    : db_(SQLiteOpen(dbfile)),
+    : dbfile_(dbfile),
+      db_(new sqlite::Connection(SQLiteOpen(dbfile))),
       tree_size_(0),
       transaction_size_(0),
-      in_transaction_(false) {
+      in_transaction_(false),
+      min_uncommitted_sequence_(INT64_MAX),
+      tree_heads_thinned_at_(0),
+      use_readers_(false),
+      num_readers_(0) {
   unique_lock<mutex> lock(lock_);
   {
     ostringstream oss;
     oss << "PRAGMA synchronous = " << FLAGS_sqlite_synchronous_mode;
-    sqlite::Statement statement(db_, oss.str().c_str());
-    CHECK_EQ(SQLITE_DONE, statement.Step()) << sqlite3_errmsg(db_);
+    sqlite::Statement statement(db_->get(), oss.str().c_str());
+    CHECK_EQ(SQLITE_DONE, statement.Step()) << sqlite3_errmsg(db_->get());
     LOG(WARNING) << "SQLite \"synchronous\" pragma set to "
                  << FLAGS_sqlite_synchronous_mode;
     if (FLAGS_sqlite_batch_into_transactions) {
@@ -153,19 +488,41 @@ SQLiteDB::SQLiteDB(const string& dbfile)
   {
     ostringstream oss;
     oss << "PRAGMA journal_mode = " << FLAGS_sqlite_journal_mode;
-    sqlite::Statement statement(db_, oss.str().c_str());
-    CHECK_EQ(SQLITE_ROW, statement.Step()) << sqlite3_errmsg(db_);
+    sqlite::Statement statement(db_->get(), oss.str().c_str());
+    CHECK_EQ(SQLITE_ROW, statement.Step()) << sqlite3_errmsg(db_->get());
     string mode;
     statement.GetBlob(0, &mode);
     CHECK_STRCASEEQ(mode.c_str(), FLAGS_sqlite_journal_mode.c_str());
-    CHECK_EQ(SQLITE_DONE, statement.Step()) << sqlite3_errmsg(db_);
+    CHECK_EQ(SQLITE_DONE, statement.Step()) << sqlite3_errmsg(db_->get());
+    // Otherwise, the readers would wait for the writer anyway.
+    use_readers_ = FLAGS_sqlite_reader_connections > 0 &&
+                   sqlite3_stricmp(mode.c_str(), "WAL") == 0;
   }
 
   {
     ostringstream oss;
     oss << "PRAGMA cache_size = " << FLAGS_sqlite_cache_size;
-    sqlite::Statement statement(db_, oss.str().c_str());
-    CHECK_EQ(SQLITE_DONE, statement.Step()) << sqlite3_errmsg(db_);
+    sqlite::Statement statement(db_->get(), oss.str().c_str());
+    CHECK_EQ(SQLITE_DONE, statement.Step()) << sqlite3_errmsg(db_->get());
+  }
+
+  // Not in the databases created before --deduplicate_chain_certs.
+  CHECK_EQ(SQLITE_OK, sqlite3_exec(db_->get(),
+                                   "CREATE TABLE IF NOT EXISTS "
+                                   "chain_certs(hash BLOB PRIMARY KEY, "
+                                   "cert BLOB)",
+                                   nullptr, nullptr, nullptr))
+      << sqlite3_errmsg(db_->get());
+  // Likewise for the tree frontier, which has a single row.
+  CHECK_EQ(SQLITE_OK, sqlite3_exec(db_->get(),
+                                   "CREATE TABLE IF NOT EXISTS "
+                                   "tree_frontier(frontier BLOB)",
+                                   nullptr, nullptr, nullptr))
+      << sqlite3_errmsg(db_->get());
+
+  ct::SignedTreeHead sth;
+  if (LatestTreeHeadNoLock(lock, &sth) == LOOKUP_OK) {
+    SetLatestTreeHead(sth);
   }
 
   BeginTransaction(lock);
@@ -173,7 +530,6 @@ SQLiteDB::SQLiteDB(const string& dbfile)
 
 
 SQLiteDB::~SQLiteDB() {
-  CHECK_EQ(SQLITE_OK, sqlite3_close(db_)) << sqlite3_errmsg(db_);
 }
 
 
@@ -185,25 +541,84 @@ Database::WriteResult SQLiteDB::CreateSequencedEntry_(
 
   MaybeStartNewTransaction(lock);
 
-  sqlite::Statement statement(db_,
+  const WriteResult result(CreateSequencedEntryNoLock(lock, logged));
+  if (!FLAGS_sqlite_batch_into_transactions) {
+    WritesCommitted(lock);
+  }
+
+  return result;
+}
+
+
+Database::WriteResult SQLiteDB::CreateSequencedEntries_(
+    const vector<LoggedEntry>& entries, size_t* num_written) {
+  CHECK_NOTNULL(num_written);
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("create_sequenced_entries"));
+  unique_lock<mutex> lock(lock_);
+
+  // The whole batch goes into a single transaction (which might make
+  // it a bit larger than --sqlite_transaction_batch_size).
+  if (FLAGS_sqlite_batch_into_transactions) {
+    MaybeStartNewTransaction(lock);
+  } else {
+    sqlite::Statement s(db_.get(), "BEGIN TRANSACTION");
+    CHECK_EQ(SQLITE_DONE, s.Step()) << sqlite3_errmsg(db_->get());
+  }
+
+  WriteResult result(this->OK);
+  for (*num_written = 0; *num_written < entries.size(); ++*num_written) {
+    result = CreateSequencedEntryNoLock(lock, entries[*num_written]);
+    if (result != this->OK) {
+      break;
+    }
+  }
+
+  if (FLAGS_sqlite_batch_into_transactions) {
+    // MaybeStartNewTransaction() already counted one of them.
+    transaction_size_ += max<int64_t>(*num_written, 1) - 1;
+  } else {
+    {
+      sqlite::Statement s(db_.get(), "END TRANSACTION");
+      CHECK_EQ(SQLITE_DONE, s.Step()) << sqlite3_errmsg(db_->get());
+    }
+    WritesCommitted(lock);
+  }
+
+  return result;
+}
+
+
+Database::WriteResult SQLiteDB::CreateSequencedEntryNoLock(
+    const unique_lock<mutex>& lock, const LoggedEntry& logged) {
+  CHECK(lock.owns_lock());
+  sqlite::Statement statement(db_.get(),
                               "INSERT INTO leaves(hash, entry, sequence) "
                               "VALUES(?, ?, ?)");
   const string hash(logged.Hash());
   statement.BindBlob(0, hash);
 
+  LoggedEntry deduplicated;
+  map<string, string> chain_certs;
+  const bool is_deduplicated(chain_certs_.Deduplicate(
+      ChainCertLoader(db_.get()), logged, &deduplicated, &chain_certs));
   string data;
-  CHECK(logged.SerializeForDatabase(&data));
+  CHECK((is_deduplicated ? deduplicated : logged).SerializeForDatabase(&data));
   statement.BindBlob(1, data);
+  StoreChainCerts(lock, chain_certs);
 
   CHECK(logged.has_sequence_number());
   statement.BindUInt64(2, logged.sequence_number());
+  if (logged.sequence_number() < min_uncommitted_sequence_) {
+    min_uncommitted_sequence_ = logged.sequence_number();
+  }
 
   int ret = statement.Step();
   if (ret == SQLITE_CONSTRAINT) {
     // Check whether we're trying to store a hash/sequence pair which already
     // exists - if it's identical we'll return OK as it could be the fetcher.
     sqlite::Statement s2(
-        db_, "SELECT sequence, hash FROM leaves WHERE sequence = ?");
+        db_.get(), "SELECT sequence, hash FROM leaves WHERE sequence = ?");
     s2.BindUInt64(0, logged.sequence_number());
     if (s2.Step() == SQLITE_ROW) {
       string existing_hash;
@@ -219,7 +634,7 @@ Database::WriteResult SQLiteDB::CreateSequencedEntry_(
     }
     return this->SEQUENCE_NUMBER_ALREADY_IN_USE;
   }
-  CHECK_EQ(SQLITE_DONE, ret) << sqlite3_errmsg(db_);
+  CHECK_EQ(SQLITE_DONE, ret) << sqlite3_errmsg(db_->get());
 
   if (logged.sequence_number() == tree_size_) {
     ++tree_size_;
@@ -229,119 +644,185 @@ Database::WriteResult SQLiteDB::CreateSequencedEntry_(
 }
 
 
+void SQLiteDB::StoreChainCerts(const unique_lock<mutex>& lock,
+                               const map<string, string>& certs) {
+  CHECK(lock.owns_lock());
+  for (const auto& cert : certs) {
+    sqlite::Statement statement(db_.get(),
+                                "INSERT OR IGNORE INTO chain_certs(hash, cert) "
+                                "VALUES(?, ?)");
+    statement.BindBlob(0, cert.first);
+    statement.BindBlob(1, cert.second);
+    CHECK_EQ(SQLITE_DONE, statement.Step()) << sqlite3_errmsg(db_->get());
+  }
+  chain_certs_.Stored(certs);
+}
+
+
 Database::LookupResult SQLiteDB::LookupByHash(const string& hash,
                                               LoggedEntry* result) const {
   CHECK_NOTNULL(result);
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_hash"));
 
-  lock_guard<mutex> lock(lock_);
-
-  sqlite::Statement statement(db_,
-                              "SELECT entry, sequence FROM leaves "
-                              "WHERE hash = ? ORDER BY sequence LIMIT 1");
-
-  statement.BindBlob(0, hash);
-
-  int ret = statement.Step();
-  if (ret == SQLITE_DONE) {
-    return this->NOT_FOUND;
+  {
+    // Loaded before the lookup, so that writes done before are seen.
+    const int64_t min_uncommitted(min_uncommitted_sequence_);
+    const Reader reader(this);
+    if (reader.get()) {
+      const LookupResult ret(
+          cert_trans::LookupByHash(reader.get(), &chain_certs_, hash, result));
+      // An uncommitted entry could have the same hash, with a lower
+      // sequence number.
+      if (ret == this->LOOKUP_OK
+              ? result->sequence_number() < min_uncommitted
+              : min_uncommitted == INT64_MAX) {
+        return ret;
+      }
+    }
   }
-  CHECK_EQ(SQLITE_ROW, ret) << sqlite3_errmsg(db_);
-
-  string data;
-  statement.GetBlob(0, &data);
-  CHECK(result->ParseFromDatabase(data));
 
-  if (statement.GetType(1) == SQLITE_NULL) {
-    result->clear_sequence_number();
-  } else {
-    result->set_sequence_number(statement.GetUInt64(1));
-    if (result->sequence_number() == tree_size_) {
-      ++tree_size_;
-    }
+  unique_lock<mutex> lock(lock_);
+  const LookupResult ret(
+      cert_trans::LookupByHash(db_.get(), &chain_certs_, hash, result));
+  if (ret == this->LOOKUP_OK && result->has_sequence_number()) {
+    EntriesRead(lock, result->sequence_number(),
+                result->sequence_number() + 1);
   }
 
-  return this->LOOKUP_OK;
+  return ret;
 }
 
 
 Database::LookupResult SQLiteDB::LookupByIndex(int64_t sequence_number,
                                                LoggedEntry* result) const {
+  CHECK_NOTNULL(result);
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_index"));
-  unique_lock<mutex> lock(lock_);
-
-  return LookupByIndex(lock, sequence_number, result);
-}
 
+  if (sequence_number < min_uncommitted_sequence_) {
+    const Reader reader(this);
+    if (reader.get()) {
+      return cert_trans::LookupByIndex(reader.get(), &chain_certs_,
+                                       sequence_number, result);
+    }
+  }
 
-Database::LookupResult SQLiteDB::LookupByIndex(const unique_lock<mutex>& lock,
-                                               int64_t sequence_number,
-                                               LoggedEntry* result) const {
-  CHECK(lock.owns_lock());
-  CHECK_GE(sequence_number, 0);
-  CHECK_NOTNULL(result);
-  sqlite::Statement statement(db_,
-                              "SELECT entry, hash FROM leaves "
-                              "WHERE sequence = ?");
-  statement.BindUInt64(0, sequence_number);
-  int ret = statement.Step();
-  if (ret == SQLITE_DONE) {
-    return this->NOT_FOUND;
+  unique_lock<mutex> lock(lock_);
+  const LookupResult ret(
+      cert_trans::LookupByIndex(db_.get(), &chain_certs_, sequence_number,
+                                result));
+  if (ret == this->LOOKUP_OK) {
+    EntriesRead(lock, sequence_number, sequence_number + 1);
   }
 
-  string data;
-  statement.GetBlob(0, &data);
-  CHECK(result->ParseFromDatabase(data));
+  return ret;
+}
 
-  string hash;
-  statement.GetBlob(1, &hash);
 
-  CHECK_EQ(result->Hash(), hash);
+void SQLiteDB::ScanRange(int64_t start, size_t count,
+                         vector<LoggedEntry>* entries) const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("scan_range"));
+  {
+    const int64_t min_uncommitted(min_uncommitted_sequence_);
+    const Reader reader(this);
+    if (reader.get()) {
+      cert_trans::ScanRange(reader.get(), &chain_certs_, start, count,
+                            entries);
+      // Only the entries before any uncommitted one are sure to be
+      // complete, and the end of the table only if there are none.
+      const auto uncommitted(find_if(
+          entries->begin(), entries->end(),
+          [min_uncommitted](const LoggedEntry& entry) {
+            return entry.sequence_number() >= min_uncommitted;
+          }));
+      if (uncommitted != entries->begin() || min_uncommitted == INT64_MAX) {
+        entries->erase(uncommitted, entries->end());
+        return;
+      }
+    }
+  }
 
-  result->set_sequence_number(sequence_number);
-  if (result->sequence_number() == tree_size_) {
-    ++tree_size_;
+  unique_lock<mutex> lock(lock_);
+  cert_trans::ScanRange(db_.get(), &chain_certs_, start, count, entries);
+  int64_t end(start);
+  for (const LoggedEntry& entry : *entries) {
+    if (entry.sequence_number() != end) {
+      break;
+    }
+    ++end;
   }
+  EntriesRead(lock, start, end);
+}
 
-  return this->LOOKUP_OK;
+
+unique_ptr<Database::Iterator> SQLiteDB::ScanEntries(
+    int64_t start_index) const {
+  return unique_ptr<Iterator>(new Iterator(this, start_index));
 }
 
 
-Database::LookupResult SQLiteDB::LookupNextIndex(
-    const unique_lock<mutex>& lock, int64_t sequence_number,
-    LoggedEntry* result) const {
-  CHECK(lock.owns_lock());
-  CHECK_GE(sequence_number, 0);
-  CHECK_NOTNULL(result);
-  sqlite::Statement statement(db_,
-                              "SELECT entry, hash, sequence FROM leaves "
-                              "WHERE sequence >= ? ORDER BY sequence");
-  statement.BindUInt64(0, sequence_number);
-  if (statement.Step() == SQLITE_DONE) {
-    return this->NOT_FOUND;
+void SQLiteDB::ReadRange(int64_t start, size_t count,
+                         vector<LoggedEntry>* entries) const {
+  CHECK_GE(start, 0);
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("read_range"));
+  CHECK_NOTNULL(entries)->reserve(count);
+
+  {
+    const int64_t min_uncommitted(min_uncommitted_sequence_);
+    const Reader reader(this);
+    if (reader.get()) {
+      const size_t num_read(
+          cert_trans::ReadRange(reader.get(), &chain_certs_, start, count,
+                                entries));
+      // Unless the entry after those read could be uncommitted.
+      if (num_read == count ||
+          start + static_cast<int64_t>(num_read) < min_uncommitted) {
+        return;
+      }
+    }
   }
 
-  string data;
-  statement.GetBlob(0, &data);
-  CHECK(result->ParseFromDatabase(data));
+  unique_lock<mutex> lock(lock_);
+  const size_t num_read(
+      cert_trans::ReadRange(db_.get(), &chain_certs_, start, count,
+                            entries));
+  EntriesRead(lock, start, start + num_read);
+}
 
-  string hash;
-  statement.GetBlob(1, &hash);
 
-  CHECK_EQ(result->Hash(), hash);
+void SQLiteDB::ReadRawRange(int64_t start, size_t count,
+                            vector<string>* entries) const {
+  CHECK_GE(start, 0);
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("read_raw_range"));
+  CHECK_NOTNULL(entries)->reserve(count);
 
-  result->set_sequence_number(statement.GetUInt64(2));
-  if (result->sequence_number() == tree_size_) {
-    ++tree_size_;
+  {
+    const int64_t min_uncommitted(min_uncommitted_sequence_);
+    const Reader reader(this);
+    if (reader.get()) {
+      const size_t num_read(
+          cert_trans::ReadRawRange(reader.get(), &chain_certs_, start, count,
+                                   entries));
+      if (num_read == count ||
+          start + static_cast<int64_t>(num_read) < min_uncommitted) {
+        return;
+      }
+    }
   }
 
-  return this->LOOKUP_OK;
+  unique_lock<mutex> lock(lock_);
+  const size_t num_read(
+      cert_trans::ReadRawRange(db_.get(), &chain_certs_, start, count,
+                               entries));
+  EntriesRead(lock, start, start + num_read);
 }
 
 
-unique_ptr<Database::Iterator> SQLiteDB::ScanEntries(
-    int64_t start_index) const {
-  return unique_ptr<Iterator>(new Iterator(this, start_index));
+void SQLiteDB::EntriesRead(const unique_lock<mutex>& lock, int64_t start,
+                           int64_t end) const {
+  CHECK(lock.owns_lock());
+  if (start <= tree_size_ && tree_size_ < end) {
+    tree_size_ = end;
+  }
 }
 
 
@@ -349,7 +830,7 @@ Database::WriteResult SQLiteDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("write_tree_head"));
   unique_lock<mutex> lock(lock_);
 
-  sqlite::Statement statement(db_,
+  sqlite::Statement statement(db_.get(),
                               "INSERT INTO trees(timestamp, sth) "
                               "VALUES(?, ?)");
   statement.BindUInt64(0, sth.timestamp());
@@ -360,11 +841,11 @@ Database::WriteResult SQLiteDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
 
   int r2 = statement.Step();
   if (r2 == SQLITE_CONSTRAINT) {
-    sqlite::Statement s2(db_,
+    sqlite::Statement s2(db_.get(),
                          "SELECT timestamp,sth FROM trees "
                          "WHERE timestamp = ?");
     s2.BindUInt64(0, sth.timestamp());
-    CHECK_EQ(SQLITE_ROW, s2.Step()) << sqlite3_errmsg(db_);
+    CHECK_EQ(SQLITE_ROW, s2.Step()) << sqlite3_errmsg(db_->get());
     string existing_sth_data;
     s2.GetBlob(1, &existing_sth_data);
     if (existing_sth_data == sth_data) {
@@ -373,10 +854,13 @@ Database::WriteResult SQLiteDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
     }
     return this->DUPLICATE_TREE_HEAD_TIMESTAMP;
   }
-  CHECK_EQ(SQLITE_DONE, r2) << sqlite3_errmsg(db_);
+  CHECK_EQ(SQLITE_DONE, r2) << sqlite3_errmsg(db_->get());
+
+  MaybeThinTreeHeads(lock, sth.timestamp());
 
   EndTransaction(lock);
   BeginTransaction(lock);
+  SetLatestTreeHead(sth);
 
   // Do not call the callbacks while holding the lock, as they might
   // want to perform some lookups.
@@ -390,9 +874,60 @@ Database::WriteResult SQLiteDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
 Database::LookupResult SQLiteDB::LatestTreeHead(
     ct::SignedTreeHead* result) const {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("latest_tree_head"));
-  unique_lock<mutex> lock(lock_);
+  lock_guard<mutex> lock(latest_tree_head_lock_);
+  if (!latest_tree_head_) {
+    return this->NOT_FOUND;
+  }
+  result->CopyFrom(*latest_tree_head_);
+  return this->LOOKUP_OK;
+}
+
+
+void SQLiteDB::ReadTreeHeads(vector<ct::SignedTreeHead>* results) const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("read_tree_heads"));
+  {
+    const Reader reader(this);
+    if (reader.get()) {
+      cert_trans::ReadTreeHeads(reader.get(), results);
+      return;
+    }
+  }
+
+  lock_guard<mutex> lock(lock_);
+  cert_trans::ReadTreeHeads(db_.get(), results);
+}
+
+
+Database::LookupResult SQLiteDB::LatestTreeFrontier(string* frontier) const {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("latest_tree_frontier"));
+  CHECK_NOTNULL(frontier);
+  lock_guard<mutex> lock(lock_);
+  sqlite::Statement statement(db_.get(),
+                              "SELECT frontier FROM tree_frontier");
 
-  return LatestTreeHeadNoLock(lock, result);
+  const int result(statement.Step());
+  if (result == SQLITE_DONE) {
+    return this->NOT_FOUND;
+  }
+  CHECK_EQ(SQLITE_ROW, result) << sqlite3_errmsg(db_->get());
+  statement.GetBlob(0, frontier);
+  return this->LOOKUP_OK;
+}
+
+
+void SQLiteDB::WriteTreeFrontier(const string& frontier) {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("write_tree_frontier"));
+  lock_guard<mutex> lock(lock_);
+  // Committed along with the entries, by the next tree head at the
+  // latest.
+  sqlite::Statement remove(db_.get(), "DELETE FROM tree_frontier");
+  CHECK_EQ(SQLITE_DONE, remove.Step()) << sqlite3_errmsg(db_->get());
+  sqlite::Statement insert(db_.get(),
+                           "INSERT INTO tree_frontier(frontier) VALUES(?)");
+  insert.BindBlob(0, frontier);
+  CHECK_EQ(SQLITE_DONE, insert.Step()) << sqlite3_errmsg(db_->get());
 }
 
 
@@ -402,7 +937,7 @@ int64_t SQLiteDB::TreeSize() const {
 
   CHECK_GE(tree_size_, 0);
   sqlite::Statement statement(
-      db_,
+      db_.get(),
       "SELECT sequence FROM leaves WHERE sequence >= ? ORDER BY sequence");
   statement.BindUInt64(0, tree_size_);
 
@@ -417,7 +952,7 @@ int64_t SQLiteDB::TreeSize() const {
     ++tree_size_;
     ret = statement.Step();
   }
-  CHECK_EQ(SQLITE_DONE, ret) << sqlite3_errmsg(db_);
+  CHECK_EQ(SQLITE_DONE, ret) << sqlite3_errmsg(db_->get());
 
   return tree_size_;
 }
@@ -456,11 +991,12 @@ void SQLiteDB::InitializeNode(const string& node_id) {
     LOG(FATAL) << "Attempting to initialize DB beloging to node with node_id: "
                << existing_id;
   }
-  sqlite::Statement statement(db_, "INSERT INTO node(node_id) VALUES(?)");
+  sqlite::Statement statement(db_.get(),
+                              "INSERT INTO node(node_id) VALUES(?)");
   statement.BindBlob(0, node_id);
 
   const int result(statement.Step());
-  CHECK_EQ(SQLITE_DONE, result) << sqlite3_errmsg(db_);
+  CHECK_EQ(SQLITE_DONE, result) << sqlite3_errmsg(db_->get());
 }
 
 
@@ -475,18 +1011,18 @@ Database::LookupResult SQLiteDB::NodeId(const unique_lock<mutex>& lock,
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("set_node_id"));
   CHECK(lock.owns_lock());
   CHECK_NOTNULL(node_id);
-  sqlite::Statement statement(db_, "SELECT node_id FROM node");
+  sqlite::Statement statement(db_.get(), "SELECT node_id FROM node");
 
   int result(statement.Step());
   if (result == SQLITE_DONE) {
     return this->NOT_FOUND;
   }
-  CHECK_EQ(SQLITE_ROW, result) << sqlite3_errmsg(db_);
+  CHECK_EQ(SQLITE_ROW, result) << sqlite3_errmsg(db_->get());
 
   statement.GetBlob(0, node_id);
   result = statement.Step();
   // There can only be one!
-  CHECK_EQ(SQLITE_DONE, result) << sqlite3_errmsg(db_);
+  CHECK_EQ(SQLITE_DONE, result) << sqlite3_errmsg(db_->get());
   return this->LOOKUP_OK;
 }
 
@@ -497,8 +1033,8 @@ void SQLiteDB::BeginTransaction(const unique_lock<mutex>& lock) {
     CHECK_EQ(0, transaction_size_);
     CHECK(!in_transaction_);
     VLOG(1) << "Beginning new transaction.";
-    sqlite::Statement s(db_, "BEGIN TRANSACTION");
-    CHECK_EQ(SQLITE_DONE, s.Step()) << sqlite3_errmsg(db_);
+    sqlite::Statement s(db_.get(), "BEGIN TRANSACTION");
+    CHECK_EQ(SQLITE_DONE, s.Step()) << sqlite3_errmsg(db_->get());
     in_transaction_ = true;
   }
 }
@@ -510,21 +1046,28 @@ void SQLiteDB::EndTransaction(const unique_lock<mutex>& lock) {
     CHECK(in_transaction_);
     VLOG(1) << "Committing transaction.";
     {
-      sqlite::Statement s(db_, "END TRANSACTION");
-      CHECK_EQ(SQLITE_DONE, s.Step()) << sqlite3_errmsg(db_);
+      sqlite::Statement s(db_.get(), "END TRANSACTION");
+      CHECK_EQ(SQLITE_DONE, s.Step()) << sqlite3_errmsg(db_->get());
     }
     {
-      sqlite::Statement s(db_, "PRAGMA wal_checkpoint(TRUNCATE)");
-      CHECK_EQ(SQLITE_ROW, s.Step()) << sqlite3_errmsg(db_);
-      CHECK_EQ(SQLITE_DONE, s.Step()) << sqlite3_errmsg(db_);
+      sqlite::Statement s(db_.get(), "PRAGMA wal_checkpoint(TRUNCATE)");
+      CHECK_EQ(SQLITE_ROW, s.Step()) << sqlite3_errmsg(db_->get());
+      CHECK_EQ(SQLITE_DONE, s.Step()) << sqlite3_errmsg(db_->get());
     }
 
     transaction_size_ = 0;
     in_transaction_ = false;
+    WritesCommitted(lock);
   }
 }
 
 
+void SQLiteDB::WritesCommitted(const unique_lock<mutex>& lock) {
+  CHECK(lock.owns_lock());
+  min_uncommitted_sequence_ = INT64_MAX;
+}
+
+
 void SQLiteDB::MaybeStartNewTransaction(const unique_lock<mutex>& lock) {
   CHECK(lock.owns_lock());
   if (FLAGS_sqlite_batch_into_transactions &&
@@ -548,6 +1091,7 @@ void SQLiteDB::ForceNotifySTH() {
   }
 
   CHECK(db_result == Database::LOOKUP_OK);
+  SetLatestTreeHead(sth);
 
   // Do not call the callbacks while holding the lock, as they might
   // want to perform some lookups.
@@ -559,21 +1103,51 @@ void SQLiteDB::ForceNotifySTH() {
 Database::LookupResult SQLiteDB::LatestTreeHeadNoLock(
     const unique_lock<mutex>& lock, ct::SignedTreeHead* result) const {
   CHECK(lock.owns_lock());
-  sqlite::Statement statement(db_,
-                              "SELECT sth FROM trees WHERE timestamp IN "
-                              "(SELECT MAX(timestamp) FROM trees)");
+  return cert_trans::LatestTreeHead(db_.get(), result);
+}
 
-  int ret = statement.Step();
-  if (ret == SQLITE_DONE) {
-    return this->NOT_FOUND;
+
+void SQLiteDB::SetLatestTreeHead(const ct::SignedTreeHead& sth) {
+  lock_guard<mutex> lock(latest_tree_head_lock_);
+  if (!latest_tree_head_ || latest_tree_head_->timestamp() < sth.timestamp()) {
+    latest_tree_head_.reset(new ct::SignedTreeHead(sth));
   }
-  CHECK_EQ(SQLITE_ROW, ret) << sqlite3_errmsg(db_);
+}
 
-  string sth;
-  statement.GetBlob(0, &sth);
-  CHECK(result->ParseFromString(sth));
 
-  return this->LOOKUP_OK;
+void SQLiteDB::MaybeThinTreeHeads(const unique_lock<mutex>& lock,
+                                  uint64_t timestamp) {
+  CHECK(lock.owns_lock());
+  if (FLAGS_sqlite_sth_retention_days <= 0) {
+    return;
+  }
+  CHECK_GT(FLAGS_sqlite_sth_retention_interval_hours, 0);
+  const uint64_t interval(
+      FLAGS_sqlite_sth_retention_interval_hours * kMillisPerHour);
+  const uint64_t retention(FLAGS_sqlite_sth_retention_days * 24 *
+                           kMillisPerHour);
+  // Nothing new would be deleted before that.
+  if (timestamp < retention ||
+      timestamp < tree_heads_thinned_at_ + interval) {
+    return;
+  }
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("thin_tree_heads"));
+
+  sqlite::Statement statement(db_.get(),
+                              "DELETE FROM trees WHERE timestamp < ?1 AND "
+                              "timestamp NOT IN (SELECT MAX(timestamp) "
+                              "FROM trees WHERE timestamp < ?1 "
+                              "GROUP BY timestamp / ?2)");
+  statement.BindUInt64(0, timestamp - retention);
+  statement.BindUInt64(1, interval);
+  CHECK_EQ(SQLITE_DONE, statement.Step()) << sqlite3_errmsg(db_->get());
+  const int deleted(sqlite3_changes(db_->get()));
+  if (deleted > 0) {
+    VLOG(1) << "deleted " << deleted << " old tree heads";
+    tree_heads_thinned->IncrementBy(deleted);
+  }
+  tree_heads_thinned_at_ = timestamp;
 }
 
 
@@ -1,18 +1,33 @@
 #ifndef CERT_TRANS_LOG_SQLITE_DB_H_
 #define CERT_TRANS_LOG_SQLITE_DB_H_
 
+#include <atomic>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <vector>
 
 #include "base/macros.h"
+#include "log/chain_cert_cache.h"
 #include "log/database.h"
 #include "log/logged_entry.h"
 
-struct sqlite3;
+namespace sqlite {
+class Connection;
+}  // namespace sqlite
 
 namespace cert_trans {
 
 
+// In WAL mode, lookups of committed data are done on a pool of
+// read-only connections (see --sqlite_reader_connections), without
+// waiting for the writes, or for each other. The rest goes through
+// the writer connection.
+//
+// The latest tree head is kept in memory, and only read from the
+// database when opening it, and by ForceNotifySTH() (for tree heads
+// written by another process).
 class SQLiteDB : public Database {
  public:
   explicit SQLiteDB(const std::string& dbfile);
@@ -24,6 +39,9 @@ class SQLiteDB : public Database {
 
   WriteResult CreateSequencedEntry_(const LoggedEntry& logged) override;
 
+  WriteResult CreateSequencedEntries_(const std::vector<LoggedEntry>& entries,
+                                      size_t* num_written) override;
+
   LookupResult LookupByHash(const std::string& hash,
                             LoggedEntry* result) const override;
 
@@ -33,10 +51,22 @@ class SQLiteDB : public Database {
   std::unique_ptr<Database::Iterator> ScanEntries(
       int64_t start_index) const override;
 
+  void ReadRange(int64_t start, size_t count,
+                 std::vector<LoggedEntry>* entries) const override;
+
+  void ReadRawRange(int64_t start, size_t count,
+                    std::vector<std::string>* entries) const override;
+
   WriteResult WriteTreeHead_(const ct::SignedTreeHead& sth) override;
 
   LookupResult LatestTreeHead(ct::SignedTreeHead* result) const override;
 
+  void ReadTreeHeads(std::vector<ct::SignedTreeHead>* results) const override;
+
+  LookupResult LatestTreeFrontier(std::string* frontier) const override;
+
+  void WriteTreeFrontier(const std::string& frontier) override;
+
   int64_t TreeSize() const override;
 
   void AddNotifySTHCallback(
@@ -50,20 +80,26 @@ class SQLiteDB : public Database {
 
   // Force an STH notification. This is needed only for ct-dns-server,
   // which shares a SQLite database with ct-server, but needs to
-  // refresh itself occasionally.
+  // refresh itself occasionally. This also refreshes the latest tree
+  // head returned by LatestTreeHead().
   void ForceNotifySTH();
 
  private:
   class Iterator;
-
-  LookupResult LookupByIndex(const std::unique_lock<std::mutex>& lock,
-                             int64_t sequence_number,
-                             LoggedEntry* result) const;
-  // This finds the next entry with a sequence number equal or greater
-  // to the one specified.
-  LookupResult LookupNextIndex(const std::unique_lock<std::mutex>& lock,
-                               int64_t sequence_number,
-                               LoggedEntry* result) const;
+  class Reader;
+
+  WriteResult CreateSequencedEntryNoLock(
+      const std::unique_lock<std::mutex>& lock, const LoggedEntry& logged);
+  void StoreChainCerts(const std::unique_lock<std::mutex>& lock,
+                       const std::map<std::string, std::string>& certs);
+  // Reads up to |count| entries from |start| on, in order, skipping
+  // over missing ones.
+  void ScanRange(int64_t start, size_t count,
+                 std::vector<LoggedEntry>* entries) const;
+  // Bumps |tree_size_| past the entries from |start| up to |end|
+  // (excluded), which have just been read.
+  void EntriesRead(const std::unique_lock<std::mutex>& lock, int64_t start,
+                   int64_t end) const;
   LookupResult LatestTreeHeadNoLock(const std::unique_lock<std::mutex>& lock,
                                     ct::SignedTreeHead* result) const;
   LookupResult NodeId(const std::unique_lock<std::mutex>& lock,
@@ -75,14 +111,46 @@ class SQLiteDB : public Database {
 
   void MaybeStartNewTransaction(const std::unique_lock<std::mutex>& lock);
 
+  // Called once the writes so far are committed, and visible to the
+  // readers.
+  void WritesCommitted(const std::unique_lock<std::mutex>& lock);
+
+  // Replaces |latest_tree_head_| with |sth|, if it is newer.
+  void SetLatestTreeHead(const ct::SignedTreeHead& sth);
+
+  // Deletes the tree heads older than --sqlite_sth_retention_days,
+  // but the latest one of every --sqlite_sth_retention_interval_hours,
+  // if |timestamp| (of the tree head being written) is far enough
+  // from the last time.
+  void MaybeThinTreeHeads(const std::unique_lock<std::mutex>& lock,
+                          uint64_t timestamp);
+
+  const std::string dbfile_;
   mutable std::mutex lock_;
-  sqlite3* const db_;
+  const std::unique_ptr<sqlite::Connection> db_;
+  mutable ChainCertCache chain_certs_;
   // This is marked mutable, as it is a lazily updated cache updated
   // from some of the getters.
   mutable int64_t tree_size_;
   DatabaseNotifierHelper callbacks_;
   int64_t transaction_size_;
   bool in_transaction_;
+  // The lowest sequence number written but not yet committed, or
+  // INT64_MAX if there is none. Results from the readers that this
+  // could change are looked up again on the writer connection.
+  std::atomic<int64_t> min_uncommitted_sequence_;
+  // The timestamp of the tree head written when the tree heads were
+  // last thinned, or 0.
+  uint64_t tree_heads_thinned_at_;
+
+  mutable std::mutex latest_tree_head_lock_;
+  // NULL if there is no tree head yet.
+  std::unique_ptr<const ct::SignedTreeHead> latest_tree_head_;
+
+  bool use_readers_;
+  mutable std::mutex readers_lock_;  // covers the members below:
+  mutable std::vector<std::unique_ptr<sqlite::Connection>> idle_readers_;
+  mutable int num_readers_;
 
   DISALLOW_COPY_AND_ASSIGN(SQLiteDB);
 };
@@ -3,26 +3,84 @@
 
 #include <glog/logging.h>
 #include <sqlite3.h>
+#include <map>
 #include <string>
 
 #include "base/macros.h"
 
 namespace sqlite {
 
+
+inline sqlite3_stmt* Prepare(sqlite3* db, const char* sql) {
+  sqlite3_stmt* stmt(NULL);
+  int ret = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    LOG(ERROR) << "ret = " << ret << ", err = " << sqlite3_errmsg(db)
+               << ", sql = " << sql << std::endl;
+
+  CHECK_EQ(SQLITE_OK, ret);
+  return stmt;
+}
+
+
+// A database connection, which keeps the statements prepared on it
+// for reuse. Like the connection itself, it must only be used by one
+// thread at a time.
+class Connection {
+ public:
+  // Takes ownership of |db|.
+  explicit Connection(sqlite3* db) : db_(CHECK_NOTNULL(db)) {
+  }
+
+  ~Connection() {
+    for (const auto& statement : statements_) {
+      sqlite3_finalize(statement.second);
+    }
+    CHECK_EQ(SQLITE_OK, sqlite3_close(db_)) << sqlite3_errmsg(db_);
+  }
+
+  sqlite3* get() const {
+    return db_;
+  }
+
+  // Prepares |sql| the first time only.
+  sqlite3_stmt* GetStatement(const char* sql) {
+    sqlite3_stmt*& stmt(statements_[sql]);
+    if (!stmt) {
+      stmt = Prepare(db_, sql);
+    }
+    return stmt;
+  }
+
+ private:
+  sqlite3* const db_;
+  std::map<std::string, sqlite3_stmt*> statements_;
+
+  DISALLOW_COPY_AND_ASSIGN(Connection);
+};
+
+
 // Reduce the ugliness of the sqlite3 API.
 class Statement {
  public:
-  Statement(sqlite3* db, const char* sql) : stmt_(NULL) {
-    int ret = sqlite3_prepare_v2(db, sql, -1, &stmt_, NULL);
-    if (ret != SQLITE_OK)
-      LOG(ERROR) << "ret = " << ret << ", err = " << sqlite3_errmsg(db)
-                 << ", sql = " << sql << std::endl;
+  Statement(sqlite3* db, const char* sql)
+      : stmt_(Prepare(db, sql)), cached_(false) {
+  }
 
-    CHECK_EQ(SQLITE_OK, ret);
+  // Uses the statement cached on |conn|, of which there must not be
+  // another Statement for the same |sql| at the same time.
+  Statement(Connection* conn, const char* sql)
+      : stmt_(conn->GetStatement(sql)), cached_(true) {
   }
 
   ~Statement() {
-    int ret = sqlite3_finalize(stmt_);
+    int ret;
+    if (cached_) {
+      ret = sqlite3_reset(stmt_);
+      CHECK_EQ(SQLITE_OK, sqlite3_clear_bindings(stmt_));
+    } else {
+      ret = sqlite3_finalize(stmt_);
+    }
     // can get SQLITE_CONSTRAINT if an insert failed due to a duplicate key.
     CHECK(ret == SQLITE_OK || ret == SQLITE_CONSTRAINT);
   }
@@ -59,7 +117,8 @@ class Statement {
   }
 
  private:
-  sqlite3_stmt* stmt_;
+  sqlite3_stmt* const stmt_;
+  const bool cached_;
 
   DISALLOW_COPY_AND_ASSIGN(Statement);
 };
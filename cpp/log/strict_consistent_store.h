@@ -45,6 +45,15 @@ class StrictConsistentStore : public ConsistentStore {
     return peer_->AddPendingEntry(entry);
   }
 
+  void AddPendingEntry(LoggedEntry* entry, util::Task* task) override {
+    peer_->AddPendingEntry(entry, task);
+  }
+
+  std::vector<util::Status> AddPendingEntries(
+      const std::vector<LoggedEntry*>& entries) override {
+    return peer_->AddPendingEntries(entries);
+  }
+
   util::Status GetPendingEntryForHash(
       const std::string& hash,
       EntryHandle<LoggedEntry>* entry) const override {
@@ -56,6 +65,16 @@ class StrictConsistentStore : public ConsistentStore {
     return peer_->GetPendingEntries(entries);
   }
 
+  int64_t NumPendingEntriesAdded() const override {
+    return peer_->NumPendingEntriesAdded();
+  }
+
+  void WaitForPendingEntriesAdded(
+      int64_t count,
+      const std::chrono::steady_clock::time_point& deadline) const override {
+    peer_->WaitForPendingEntriesAdded(count, deadline);
+  }
+
   util::Status GetSequenceMapping(
       EntryHandle<ct::SequenceMapping>* entry) const override {
     return peer_->GetSequenceMapping(entry);
@@ -70,6 +89,10 @@ class StrictConsistentStore : public ConsistentStore {
     return peer_->SetClusterNodeState(state);
   }
 
+  util::Status RefreshClusterNodeState() override {
+    return peer_->RefreshClusterNodeState();
+  }
+
   void WatchServingSTH(const ConsistentStore::ServingSTHCallback& cb,
                        util::Task* task) override {
     return peer_->WatchServingSTH(cb, task);
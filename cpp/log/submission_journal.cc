@@ -0,0 +1,560 @@
+#include "log/submission_journal.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <set>
+#include <vector>
+
+#include "log/consistent_store.h"
+#include "log/database.h"
+#include "monitoring/latency.h"
+#include "monitoring/monitoring.h"
+#include "util/logging.h"
+#include "util/util.h"
+
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::find;
+using std::lock_guard;
+using std::make_pair;
+using std::max;
+using std::min;
+using std::move;
+using std::mutex;
+using std::pair;
+using std::set;
+using std::string;
+using std::thread;
+using std::unique_lock;
+using std::vector;
+using util::Status;
+
+DEFINE_int32(submission_journal_max_pending, 100000,
+             "maximum number of entries waiting in the submission journal "
+             "to be added to the consistent store, beyond which new ones "
+             "are rejected");
+DEFINE_int32(submission_journal_batch_size, 100,
+             "maximum number of entries added from the submission journal "
+             "to the consistent store together");
+DEFINE_int32(submission_journal_retry_ms, 1000,
+             "how long to wait before adding entries from the submission "
+             "journal to the consistent store again, after a failure");
+DEFINE_int32(submission_journal_segment_mb, 64,
+             "size of the segment files of the submission journal, in MB, "
+             "past which a new one is started");
+DEFINE_int32(submission_journal_recheck_seconds, 60,
+             "how long to wait between checks of whether an entry added "
+             "from the submission journal to the consistent store is in "
+             "the database yet (until then, it is remembered so that "
+             "resubmitting it gets the same SCT)");
+
+namespace cert_trans {
+namespace {
+
+
+static Latency<milliseconds, string> journal_latency_by_op_ms(
+    "submission_journal_latency_by_operation_ms", "operation",
+    "Submission journal latency in ms broken out by operation.");
+
+static Gauge<>* journal_pending_entries(
+    Gauge<>::New("submission_journal_pending_entries",
+                 "Number of entries in the submission journal waiting to "
+                 "be added to the consistent store."));
+
+static Counter<string>* journal_entries(
+    Counter<string>::New("submission_journal_entries", "result",
+                         "Number of entries submitted to the submission "
+                         "journal, by result."));
+
+static Counter<>* journal_syncs(
+    Counter<>::New("submission_journal_syncs",
+                   "Number of writes (and fdatasync()s) of the submission "
+                   "journal, each for one or more entries."));
+
+static Counter<>* journal_replication_errors(
+    Counter<>::New("submission_journal_replication_errors",
+                   "Number of failures to add an entry of the submission "
+                   "journal to the consistent store (which are retried)."));
+
+static Counter<>* journal_sct_conflicts(
+    Counter<>::New("submission_journal_sct_conflicts",
+                   "Number of entries of the submission journal which were "
+                   "already pending in the consistent store with another "
+                   "SCT, so that the one returned by this node will not "
+                   "make it into the log."));
+
+
+const char kSegmentPrefix[] = "journal-";
+const char kLockFile[] = "LOCK";
+const char kReplicatedFile[] = "REPLICATED";
+
+// Whether |hash| is in |db|.
+bool InDatabase(Database* db, const string& hash) {
+  LoggedEntry entry;
+  return db->LookupByHash(hash, &entry) == Database::LOOKUP_OK;
+}
+
+
+// Before every entry in a segment file. The integers are in host byte
+// order.
+struct RecordHeader {
+  uint32_t size;
+  uint32_t reserved;
+};
+
+
+// The contents of the kReplicatedFile: the position in the journal
+// up to which all the entries are in the consistent store. Small enough
+// to be rewritten in place atomically. The integers are in host byte
+// order.
+struct Replicated {
+  int64_t segment;
+  uint64_t end;
+};
+
+
+void WriteFully(int fd, const char* data, size_t size, uint64_t offset) {
+  while (size > 0) {
+    const ssize_t written(pwrite(fd, data, size, offset));
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    PCHECK(written > 0);
+    data += written;
+    size -= written;
+    offset += written;
+  }
+}
+
+
+void ReadFile(const string& path, string* data) {
+  const int fd(open(path.c_str(), O_RDONLY));
+  PCHECK(fd >= 0) << "Could not open " << path;
+  data->clear();
+  char buf[65536];
+  while (true) {
+    const ssize_t num_read(read(fd, buf, sizeof(buf)));
+    if (num_read < 0 && errno == EINTR) {
+      continue;
+    }
+    PCHECK(num_read >= 0) << "Could not read " << path;
+    if (num_read == 0) {
+      break;
+    }
+    data->append(buf, num_read);
+  }
+  PCHECK(close(fd) == 0);
+}
+
+
+}  // namespace
+
+
+SubmissionJournal::SubmissionJournal(const string& dir, Database* db,
+                                     ConsistentStore* store)
+    : dir_(dir),
+      db_(CHECK_NOTNULL(db)),
+      store_(CHECK_NOTNULL(store)),
+      lock_fd_(-1),
+      replicated_fd_(-1),
+      buffered_(0),
+      syncing_(false),
+      synced_(0),
+      segment_(0),
+      fd_(-1),
+      segment_size_(0),
+      exiting_(false) {
+  if (mkdir(dir_.c_str(), 0755) != 0) {
+    PCHECK(errno == EEXIST) << "Could not create " << dir_;
+  }
+  const string lock_path(dir_ + "/" + kLockFile);
+  lock_fd_ = open(lock_path.c_str(), O_RDWR | O_CREAT, 0644);
+  PCHECK(lock_fd_ >= 0) << "Could not open " << lock_path;
+  PCHECK(flock(lock_fd_, LOCK_EX | LOCK_NB) == 0)
+      << dir_ << " is already in use by another SubmissionJournal";
+  const string replicated_path(dir_ + "/" + kReplicatedFile);
+  replicated_fd_ = open(replicated_path.c_str(), O_RDWR | O_CREAT, 0644);
+  PCHECK(replicated_fd_ >= 0) << "Could not open " << replicated_path;
+
+  Replay();
+  journal_pending_entries->Set(pending_.size());
+  replicator_ = thread(&SubmissionJournal::Replicate, this);
+}
+
+
+SubmissionJournal::~SubmissionJournal() {
+  {
+    lock_guard<mutex> lock(lock_);
+    exiting_ = true;
+  }
+  pending_cv_.notify_all();
+  replicator_.join();
+  PCHECK(close(fd_) == 0);
+  PCHECK(close(replicated_fd_) == 0);
+  PCHECK(close(lock_fd_) == 0);
+}
+
+
+Status SubmissionJournal::Append(LoggedEntry* entry) {
+  CHECK_NOTNULL(entry);
+  CHECK(entry->sct().has_timestamp());
+  CHECK(!entry->has_sequence_number());
+  ScopedLatency latency(journal_latency_by_op_ms.GetScopedLatency("append"));
+  string data;
+  CHECK(entry->SerializeForStorage(&data));
+  RecordHeader header;
+  memset(&header, 0, sizeof(header));
+  header.size = data.size();
+  CHECK_EQ(header.size, data.size());
+  const string hash(entry->Hash());
+
+  unique_lock<mutex> lock(lock_);
+  const auto it(scts_.find(hash));
+  if (it != scts_.end()) {
+    *entry->mutable_sct() = it->second;
+    journal_entries->Increment("duplicate");
+    return Status(util::error::ALREADY_EXISTS,
+                  "Pending entry already exists.");
+  }
+  if (pending_.size() >=
+      static_cast<size_t>(FLAGS_submission_journal_max_pending)) {
+    journal_entries->Increment("rejected");
+    return Status(util::error::RESOURCE_EXHAUSTED,
+                  "Too many entries waiting in the submission journal.");
+  }
+
+  buffer_.append(reinterpret_cast<const char*>(&header), sizeof(header));
+  buffer_.append(data);
+  const int64_t seq(++buffered_);
+  pending_.push_back(
+      Pending{*entry, seq, sizeof(header) + data.size(), -1, 0, false});
+  scts_.insert(make_pair(hash, entry->sct()));
+  journal_pending_entries->Set(pending_.size());
+  journal_entries->Increment("appended");
+
+  // The first caller to find nobody writing writes everything buffered
+  // so far, the others wait for it.
+  while (synced_ < seq) {
+    if (syncing_) {
+      synced_cv_.wait(lock);
+      continue;
+    }
+    syncing_ = true;
+    if (segment_size_ >=
+        static_cast<uint64_t>(FLAGS_submission_journal_segment_mb) << 20) {
+      const int64_t previous(segment_);
+      PCHECK(close(fd_) == 0);
+      OpenSegment(previous + 1);
+      MaybeDeleteSegment(previous);
+    }
+    string records;
+    records.swap(buffer_);
+    const int64_t last(buffered_);
+    uint64_t end(segment_size_ + records.size());
+    for (auto p = pending_.rbegin(); p != pending_.rend() && p->seq > synced_;
+         ++p) {
+      p->segment = segment_;
+      p->end = end;
+      end -= p->size;
+      ++segment_entries_[segment_];
+    }
+    const int fd(fd_);
+    const uint64_t offset(segment_size_);
+    segment_size_ += records.size();
+    lock.unlock();
+
+    {
+      ScopedLatency sync_latency(
+          journal_latency_by_op_ms.GetScopedLatency("sync"));
+      WriteFully(fd, records.data(), records.size(), offset);
+      PCHECK(fdatasync(fd) == 0) << "Could not sync " << dir_;
+    }
+    journal_syncs->Increment();
+
+    lock.lock();
+    synced_ = last;
+    syncing_ = false;
+    synced_cv_.notify_all();
+    pending_cv_.notify_all();
+  }
+
+  return Status::OK;
+}
+
+
+size_t SubmissionJournal::pending() const {
+  lock_guard<mutex> lock(lock_);
+  return pending_.size();
+}
+
+
+void SubmissionJournal::WaitForReplication() const {
+  unique_lock<mutex> lock(lock_);
+  const int64_t target(buffered_);
+  replicated_cv_.wait(lock, [this, target]() {
+    return pending_.empty() || pending_.front().seq > target;
+  });
+}
+
+
+void SubmissionJournal::Replay() {
+  set<int64_t> segments;
+  DIR* const dir(opendir(dir_.c_str()));
+  PCHECK(dir != nullptr) << "Could not read " << dir_;
+  const size_t prefix_size(strlen(kSegmentPrefix));
+  while (const struct dirent* const file = readdir(dir)) {
+    const string name(file->d_name);
+    if (name.compare(0, prefix_size, kSegmentPrefix) == 0) {
+      const string number(name.substr(prefix_size));
+      CHECK(!number.empty() &&
+            number.find_first_not_of("0123456789") == string::npos)
+          << "Unexpected file " << name << " in " << dir_;
+      segments.insert(stoll(number));
+    }
+  }
+  PCHECK(closedir(dir) == 0);
+
+  // Nothing is known to be replicated if the file is new (or was never
+  // completely written).
+  Replicated replicated{-1, 0};
+  if (pread(replicated_fd_, &replicated, sizeof(replicated), 0) !=
+      sizeof(replicated)) {
+    replicated = Replicated{-1, 0};
+  }
+
+  string data;
+  for (const int64_t segment : segments) {
+    const string path(SegmentPath(segment));
+    ReadFile(path, &data);
+    size_t offset(0);
+    while (offset + sizeof(RecordHeader) <= data.size()) {
+      RecordHeader header;
+      memcpy(&header, data.data() + offset, sizeof(header));
+      const size_t end(offset + sizeof(header) + header.size);
+      Pending pending{LoggedEntry(), buffered_ + 1,
+                      sizeof(header) + header.size, segment, end, true};
+      // A torn record fails one of these.
+      if (end > data.size() ||
+          !pending.entry.ParseFromStorage(data.data() + offset +
+                                              sizeof(header),
+                                          header.size) ||
+          !pending.entry.sct().has_timestamp()) {
+        break;
+      }
+      offset = end;
+      if (segment < replicated.segment ||
+          (segment == replicated.segment && end <= replicated.end)) {
+        // Already in the consistent store, and maybe long gone from
+        // there, so it must not be added again.
+        continue;
+      }
+      ++buffered_;
+      scts_.insert(make_pair(pending.entry.Hash(), pending.entry.sct()));
+      pending_.push_back(move(pending));
+      ++segment_entries_[segment];
+    }
+    if (offset < data.size()) {
+      LOG(WARNING) << "Dropping the torn record at offset " << offset
+                   << " of " << path;
+      PCHECK(truncate(path.c_str(), offset) == 0);
+    }
+    if (segment_entries_.count(segment) == 0) {
+      PCHECK(unlink(path.c_str()) == 0) << "Could not delete " << path;
+    }
+  }
+  synced_ = buffered_;
+  if (!pending_.empty()) {
+    LOG(INFO) << "Replaying " << pending_.size() << " entries from the "
+              << "submission journal in " << dir_;
+  }
+
+  // Never append after what may be a torn record, nor in a segment the
+  // replicated position is already past.
+  OpenSegment(max(segments.empty() ? -1 : *segments.rbegin(),
+                  replicated.segment) +
+              1);
+}
+
+
+void SubmissionJournal::WriteReplicated(int64_t segment, uint64_t end) {
+  const Replicated replicated{segment, end};
+  WriteFully(replicated_fd_, reinterpret_cast<const char*>(&replicated),
+             sizeof(replicated), 0);
+  PCHECK(fdatasync(replicated_fd_) == 0) << "Could not sync " << dir_;
+}
+
+
+void SubmissionJournal::OpenSegment(int64_t segment) {
+  const string path(SegmentPath(segment));
+  fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+  PCHECK(fd_ >= 0) << "Could not create " << path;
+  // Make the new file itself durable.
+  const int dir_fd(open(dir_.c_str(), O_RDONLY));
+  PCHECK(dir_fd >= 0) << "Could not open " << dir_;
+  PCHECK(fsync(dir_fd) == 0) << "Could not sync " << dir_;
+  PCHECK(close(dir_fd) == 0);
+  segment_ = segment;
+  segment_size_ = 0;
+}
+
+
+string SubmissionJournal::SegmentPath(int64_t segment) const {
+  char name[32];
+  snprintf(name, sizeof(name), "%s%016" PRId64, kSegmentPrefix, segment);
+  return dir_ + "/" + name;
+}
+
+
+void SubmissionJournal::MaybeDeleteSegment(int64_t segment) {
+  const auto it(segment_entries_.find(segment));
+  if (segment == segment_ || (it != segment_entries_.end() && it->second > 0)) {
+    return;
+  }
+  if (it != segment_entries_.end()) {
+    segment_entries_.erase(it);
+  }
+  const string path(SegmentPath(segment));
+  PCHECK(unlink(path.c_str()) == 0) << "Could not delete " << path;
+}
+
+
+void SubmissionJournal::ForgetIntegrated(unique_lock<mutex>* lock) {
+  const steady_clock::time_point now(steady_clock::now());
+  const seconds recheck(FLAGS_submission_journal_recheck_seconds);
+  for (int i = 0; i < FLAGS_submission_journal_batch_size &&
+                  !replicated_.empty() && replicated_.front().second <= now;
+       ++i) {
+    const string hash(replicated_.front().first);
+    replicated_.pop_front();
+    lock->unlock();
+    const bool integrated(InDatabase(db_, hash));
+    lock->lock();
+    if (integrated) {
+      scts_.erase(hash);
+    } else {
+      replicated_.emplace_back(hash, now + recheck);
+    }
+  }
+}
+
+
+void SubmissionJournal::Replicate() {
+  vector<LoggedEntry> batch;
+  vector<bool> replayed;
+  // The segment and end of the record of each entry of |batch|.
+  vector<pair<int64_t, uint64_t>> positions;
+  vector<LoggedEntry*> to_add;
+  vector<size_t> to_add_index;
+  unique_lock<mutex> lock(lock_);
+  while (true) {
+    pending_cv_.wait_for(lock, seconds(1), [this]() {
+      return exiting_ || (!pending_.empty() && pending_.front().seq <= synced_);
+    });
+    if (exiting_) {
+      break;
+    }
+    ForgetIntegrated(&lock);
+
+    batch.clear();
+    replayed.clear();
+    positions.clear();
+    for (size_t i = 0;
+         i < min(pending_.size(),
+                 static_cast<size_t>(FLAGS_submission_journal_batch_size)) &&
+         pending_[i].seq <= synced_;
+         ++i) {
+      batch.push_back(pending_[i].entry);
+      replayed.push_back(pending_[i].replayed);
+      positions.push_back(make_pair(pending_[i].segment, pending_[i].end));
+    }
+    if (batch.empty()) {
+      continue;
+    }
+    lock.unlock();
+
+    ScopedLatency latency(
+        journal_latency_by_op_ms.GetScopedLatency("replicate"));
+    // Entries from a previous run may have made it all the way into the
+    // database already, adding them again would log them twice.
+    to_add.clear();
+    to_add_index.clear();
+    vector<bool> done(batch.size(), false);
+    for (size_t i = 0; i < batch.size(); ++i) {
+      if (replayed[i] && InDatabase(db_, batch[i].Hash())) {
+        done[i] = true;
+        continue;
+      }
+      to_add.push_back(&batch[i]);
+      to_add_index.push_back(i);
+    }
+    vector<ct::SignedCertificateTimestamp> scts;
+    for (const LoggedEntry* const entry : to_add) {
+      scts.push_back(entry->sct());
+    }
+    const vector<Status> statuses(store_->AddPendingEntries(to_add));
+    CHECK_EQ(to_add.size(), statuses.size());
+    for (size_t i = 0; i < statuses.size(); ++i) {
+      const util::error::Code code(statuses[i].CanonicalCode());
+      if (code == util::error::OK || code == util::error::ALREADY_EXISTS) {
+        done[to_add_index[i]] = true;
+        if (code == util::error::ALREADY_EXISTS &&
+            !(to_add[i]->sct() == scts[i])) {
+          journal_sct_conflicts->Increment();
+          LOG_EVERY_N_SEC(ERROR, 10)
+              << "Entry " << util::ToBase64(to_add[i]->Hash())
+              << " was already pending with another SCT";
+        }
+      } else {
+        journal_replication_errors->Increment();
+        LOG_EVERY_N_SEC(WARNING, 10)
+            << "Could not add an entry from the submission journal to "
+            << "the consistent store, will retry: " << statuses[i];
+      }
+    }
+
+    // Retries are done in order, so the entries are all in the
+    // consistent store up to the first one which is not.
+    const size_t num_replicated(find(done.begin(), done.end(), false) -
+                                done.begin());
+    if (num_replicated > 0) {
+      WriteReplicated(positions[num_replicated - 1].first,
+                      positions[num_replicated - 1].second);
+    }
+
+    lock.lock();
+    // |pending_| only grows at the back meanwhile.
+    const steady_clock::time_point recheck(
+        steady_clock::now() +
+        seconds(FLAGS_submission_journal_recheck_seconds));
+    size_t num_done(0);
+    while (num_done < done.size() && done[num_done]) {
+      const Pending& front(pending_.front());
+      replicated_.emplace_back(front.entry.Hash(), recheck);
+      --segment_entries_[front.segment];
+      MaybeDeleteSegment(front.segment);
+      pending_.pop_front();
+      ++num_done;
+    }
+    journal_pending_entries->Set(pending_.size());
+    replicated_cv_.notify_all();
+    if (num_done < done.size()) {
+      pending_cv_.wait_for(
+          lock, milliseconds(FLAGS_submission_journal_retry_ms),
+          [this]() { return exiting_; });
+    }
+  }
+}
+
+
+}  // namespace cert_trans
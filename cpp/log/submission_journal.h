@@ -0,0 +1,155 @@
+#ifndef CERT_TRANS_LOG_SUBMISSION_JOURNAL_H_
+#define CERT_TRANS_LOG_SUBMISSION_JOURNAL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+#include "base/macros.h"
+#include "log/logged_entry.h"
+#include "proto/ct.pb.h"
+#include "util/status.h"
+
+namespace cert_trans {
+
+class ConsistentStore;
+class Database;
+
+
+// A local, durable journal of the new entries accepted by a frontend,
+// so that their SCT can be returned as soon as they are on the local
+// disk, rather than after a round trip to the etcd quorum (and
+// without stalling on etcd hiccups). A thread of its own adds them to
+// the consistent store afterwards, in batches, retrying until it
+// succeeds.
+//
+// Appends from concurrent callers are written and fdatasync()ed
+// together. The journal is a series of segment files in a directory,
+// each deleted once all of its entries are in the consistent store.
+// How far into them the entries are all there is also recorded, as
+// they get there, and what is left past that is replayed when the
+// journal is opened again. Only one SubmissionJournal can have a given
+// directory open at a time.
+//
+// Two caveats, compared to adding the entries to the consistent store
+// directly: the SCTs given for entries still in the journal of a node
+// which is lost for good will never be honoured, and if the same
+// certificate is submitted to two nodes before either has replicated
+// it, one of the two SCTs does not make it into the log (this is
+// counted in the submission_journal_sct_conflicts metric). The
+// replication lag should also stay well below the guard window of the
+// TreeSigner, so that entries are sequenced in timestamp order.
+//
+// This class is thread-safe.
+class SubmissionJournal {
+ public:
+  // Replays the entries left in |dir| by a previous run, and starts
+  // adding them to |store|. Entries replayed which are already in
+  // |db| are dropped. Does not take ownership of |db| or |store|.
+  SubmissionJournal(const std::string& dir, Database* db,
+                    ConsistentStore* store);
+  // The entries not yet in the consistent store stay in the journal,
+  // for the next run.
+  ~SubmissionJournal();
+
+  // Appends |entry|, which must have an SCT, and returns once it is
+  // durable. If an entry with the same hash was appended and is not
+  // yet in the database, sets the SCT of |entry| to its SCT and
+  // returns ALREADY_EXISTS instead. Returns RESOURCE_EXHAUSTED if
+  // --submission_journal_max_pending entries are already waiting.
+  util::Status Append(LoggedEntry* entry);
+
+  // The number of entries waiting to be added to the consistent store.
+  size_t pending() const;
+
+  // Waits until all the entries appended so far are in the consistent
+  // store.
+  void WaitForReplication() const;
+
+ private:
+  struct Pending {
+    LoggedEntry entry;
+    // In order of appending.
+    int64_t seq;
+    // The size of its record.
+    uint64_t size;
+    // The segment file holding it, and the offset right after its
+    // record in there, once written.
+    int64_t segment;
+    uint64_t end;
+    // Whether it comes from a previous run, and may have been
+    // sequenced already.
+    bool replayed;
+  };
+
+  void Replay();
+  // Records that the entries up to |end| in |segment|, and in the
+  // segments before it, are in the consistent store.
+  void WriteReplicated(int64_t segment, uint64_t end);
+  void OpenSegment(int64_t segment);
+  std::string SegmentPath(int64_t segment) const;
+  // Must be called with |lock_| held. Deletes |segment| if all its
+  // entries were replicated and it is no longer appended to.
+  void MaybeDeleteSegment(int64_t segment);
+  // Must be called with |lock_| held, through |lock|. Forgets the SCTs
+  // of the replicated entries which made it to the database.
+  void ForgetIntegrated(std::unique_lock<std::mutex>* lock);
+  // Thread entry point for |replicator_|.
+  void Replicate();
+
+  const std::string dir_;
+  Database* const db_;
+  ConsistentStore* const store_;
+  int lock_fd_;
+  // The file WriteReplicated() writes to.
+  int replicated_fd_;
+
+  mutable std::mutex lock_;
+  // The records appended but not yet written, and the sequence number
+  // (in order of appending) the last one of them will have.
+  std::string buffer_;
+  int64_t buffered_;
+  // Whether a caller is writing the buffered records, which the others
+  // wait for with |synced_cv_|.
+  bool syncing_;
+  int64_t synced_;
+  std::condition_variable synced_cv_;
+
+  // The segment file being appended to, and its size.
+  int64_t segment_;
+  int fd_;
+  uint64_t segment_size_;
+
+  // The entries not yet replicated, in order (those past |synced_|
+  // are not durable yet).
+  std::deque<Pending> pending_;
+  // The SCTs of the entries appended, by hash, until they are in the
+  // database, and the hashes of those already replicated, with when
+  // to check whether they are.
+  std::unordered_map<std::string, ct::SignedCertificateTimestamp> scts_;
+  std::deque<std::pair<std::string, std::chrono::steady_clock::time_point>>
+      replicated_;
+  // The number of entries of every segment not yet replicated (or
+  // written), by segment.
+  std::map<int64_t, int64_t> segment_entries_;
+  std::condition_variable pending_cv_;
+  mutable std::condition_variable replicated_cv_;
+  bool exiting_;
+
+  std::thread replicator_;
+
+  DISALLOW_COPY_AND_ASSIGN(SubmissionJournal);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_SUBMISSION_JOURNAL_H_
@@ -0,0 +1,233 @@
+#include "log/submission_journal.h"
+
+#include <dirent.h>
+#include <gflags/gflags.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "log/file_db.h"
+#include "log/logged_entry.h"
+#include "log/mock_consistent_store.h"
+#include "log/test_db.h"
+#include "log/test_signer.h"
+#include "proto/cert_serializer.h"
+#include "util/status_test_util.h"
+#include "util/testing.h"
+
+DECLARE_int32(submission_journal_max_pending);
+DECLARE_int32(submission_journal_retry_ms);
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using testing::NiceMock;
+using testing::Return;
+using testing::_;
+using util::Status;
+using util::testing::StatusIs;
+
+
+MATCHER_P(HasHash, hash, "") {
+  return arg->Hash() == hash;
+}
+
+
+class SubmissionJournalTest : public ::testing::Test {
+ protected:
+  SubmissionJournalTest() : dir_(tmp_.TmpStorageDir() + "/journal") {
+    FLAGS_submission_journal_retry_ms = 10;
+  }
+
+  void OpenJournal() {
+    journal_.reset(new SubmissionJournal(dir_, test_db_.db(), &store_));
+  }
+
+  LoggedEntry NewEntry() {
+    LoggedEntry entry;
+    test_signer_.CreateUnique(&entry);
+    entry.clear_sequence_number();
+    return entry;
+  }
+
+  // The segment files in the journal directory.
+  vector<string> Segments() const {
+    vector<string> segments;
+    DIR* const dir(opendir(dir_.c_str()));
+    CHECK_NOTNULL(dir);
+    while (const struct dirent* const file = readdir(dir)) {
+      const string name(file->d_name);
+      if (name.compare(0, 8, "journal-") == 0) {
+        segments.push_back(name);
+      }
+    }
+    CHECK_EQ(0, closedir(dir));
+    return segments;
+  }
+
+  TmpStorage tmp_;
+  const string dir_;
+  TestDB<FileDB> test_db_;
+  TestSigner test_signer_;
+  NiceMock<MockConsistentStore> store_;
+  unique_ptr<SubmissionJournal> journal_;
+};
+
+
+TEST_F(SubmissionJournalTest, ReplicatesAppendedEntries) {
+  OpenJournal();
+  vector<LoggedEntry> entries;
+  for (int i = 0; i < 3; ++i) {
+    entries.push_back(NewEntry());
+    EXPECT_CALL(store_, AddPendingEntry(HasHash(entries.back().Hash())))
+        .WillOnce(Return(Status::OK));
+  }
+
+  for (LoggedEntry& entry : entries) {
+    EXPECT_OK(journal_->Append(&entry));
+  }
+  journal_->WaitForReplication();
+  EXPECT_EQ(0U, journal_->pending());
+}
+
+
+TEST_F(SubmissionJournalTest, DuplicateGetsTheSameSct) {
+  ON_CALL(store_, AddPendingEntry(_))
+      .WillByDefault(Return(Status(util::error::UNAVAILABLE, "down")));
+  OpenJournal();
+
+  LoggedEntry entry(NewEntry());
+  EXPECT_OK(journal_->Append(&entry));
+
+  LoggedEntry duplicate(entry);
+  duplicate.mutable_sct()->set_timestamp(entry.sct().timestamp() + 1);
+  EXPECT_THAT(journal_->Append(&duplicate),
+              StatusIs(util::error::ALREADY_EXISTS));
+  EXPECT_EQ(entry.sct().timestamp(), duplicate.sct().timestamp());
+  EXPECT_EQ(1U, journal_->pending());
+}
+
+
+TEST_F(SubmissionJournalTest, RejectsWhenFull) {
+  FLAGS_submission_journal_max_pending = 1;
+  ON_CALL(store_, AddPendingEntry(_))
+      .WillByDefault(Return(Status(util::error::UNAVAILABLE, "down")));
+  OpenJournal();
+
+  LoggedEntry entry(NewEntry());
+  EXPECT_OK(journal_->Append(&entry));
+  LoggedEntry other(NewEntry());
+  EXPECT_THAT(journal_->Append(&other),
+              StatusIs(util::error::RESOURCE_EXHAUSTED));
+  FLAGS_submission_journal_max_pending = 100000;
+}
+
+
+TEST_F(SubmissionJournalTest, ReplaysAfterRestart) {
+  ON_CALL(store_, AddPendingEntry(_))
+      .WillByDefault(Return(Status(util::error::UNAVAILABLE, "down")));
+  OpenJournal();
+  vector<LoggedEntry> entries;
+  for (int i = 0; i < 3; ++i) {
+    entries.push_back(NewEntry());
+    EXPECT_OK(journal_->Append(&entries.back()));
+  }
+  journal_.reset();
+  EXPECT_EQ(1U, Segments().size());
+
+  testing::Mock::VerifyAndClearExpectations(&store_);
+  for (const LoggedEntry& entry : entries) {
+    EXPECT_CALL(store_, AddPendingEntry(HasHash(entry.Hash())))
+        .WillOnce(Return(Status::OK));
+  }
+  OpenJournal();
+  EXPECT_EQ(3U, journal_->pending());
+  journal_->WaitForReplication();
+  EXPECT_EQ(0U, journal_->pending());
+  // Only the new segment is left.
+  EXPECT_EQ(1U, Segments().size());
+}
+
+
+TEST_F(SubmissionJournalTest, SkipsReplayedEntriesInDatabase) {
+  ON_CALL(store_, AddPendingEntry(_))
+      .WillByDefault(Return(Status(util::error::UNAVAILABLE, "down")));
+  OpenJournal();
+  LoggedEntry sequenced(NewEntry());
+  EXPECT_OK(journal_->Append(&sequenced));
+  LoggedEntry unsequenced(NewEntry());
+  EXPECT_OK(journal_->Append(&unsequenced));
+  journal_.reset();
+
+  sequenced.set_sequence_number(0);
+  EXPECT_EQ(Database::OK, test_db_.db()->CreateSequencedEntry(sequenced));
+
+  testing::Mock::VerifyAndClearExpectations(&store_);
+  EXPECT_CALL(store_, AddPendingEntry(HasHash(sequenced.Hash()))).Times(0);
+  EXPECT_CALL(store_, AddPendingEntry(HasHash(unsequenced.Hash())))
+      .WillOnce(Return(Status::OK));
+  OpenJournal();
+  journal_->WaitForReplication();
+}
+
+
+TEST_F(SubmissionJournalTest, DoesNotReplayReplicatedEntries) {
+  OpenJournal();
+  vector<LoggedEntry> replicated;
+  for (int i = 0; i < 2; ++i) {
+    replicated.push_back(NewEntry());
+    EXPECT_CALL(store_, AddPendingEntry(HasHash(replicated.back().Hash())))
+        .WillOnce(Return(Status::OK));
+    EXPECT_OK(journal_->Append(&replicated.back()));
+  }
+  journal_->WaitForReplication();
+
+  // The next one goes to the same segment, which is kept for it.
+  testing::Mock::VerifyAndClearExpectations(&store_);
+  ON_CALL(store_, AddPendingEntry(_))
+      .WillByDefault(Return(Status(util::error::UNAVAILABLE, "down")));
+  LoggedEntry unreplicated(NewEntry());
+  EXPECT_OK(journal_->Append(&unreplicated));
+  journal_.reset();
+  EXPECT_EQ(1U, Segments().size());
+
+  // The replicated ones are not in the database yet, but may be gone
+  // from the consistent store already, they must not be added again.
+  testing::Mock::VerifyAndClearExpectations(&store_);
+  for (const LoggedEntry& entry : replicated) {
+    EXPECT_CALL(store_, AddPendingEntry(HasHash(entry.Hash()))).Times(0);
+  }
+  EXPECT_CALL(store_, AddPendingEntry(HasHash(unreplicated.Hash())))
+      .WillOnce(Return(Status::OK));
+  OpenJournal();
+  EXPECT_EQ(1U, journal_->pending());
+  journal_->WaitForReplication();
+  journal_.reset();
+
+  // Nothing left to replay, and the new segment is not numbered below
+  // what was replicated.
+  testing::Mock::VerifyAndClearExpectations(&store_);
+  EXPECT_CALL(store_, AddPendingEntry(_)).Times(0);
+  OpenJournal();
+  EXPECT_EQ(0U, journal_->pending());
+  LoggedEntry later(NewEntry());
+  EXPECT_CALL(store_, AddPendingEntry(HasHash(later.Hash())))
+      .WillOnce(Return(Status::OK));
+  EXPECT_OK(journal_->Append(&later));
+  journal_->WaitForReplication();
+}
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  ConfigureSerializerForV1CT();
+  return RUN_ALL_TESTS();
+}
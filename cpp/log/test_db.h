@@ -8,6 +8,7 @@
 #include "log/file_storage.h"
 #include "log/leveldb_db.h"
 #include "log/logged_entry.h"
+#include "log/segment_db.h"
 #include "log/sqlite_db.h"
 #include "util/test_db.h"
 
@@ -63,6 +64,23 @@ cert_trans::LevelDB* TestDB<cert_trans::LevelDB>::SecondDB() {
   return new cert_trans::LevelDB(tmp_.TmpStorageDir() + "/leveldb");
 }
 
+// Small segments, so that the tests fill and seal some.
+static const int64_t kEntriesPerSegment = 4;
+
+template <>
+void TestDB<cert_trans::SegmentDB>::Setup() {
+  db_.reset(new cert_trans::SegmentDB(tmp_.TmpStorageDir() + "/segments",
+                                      kEntriesPerSegment));
+}
+
+template <>
+cert_trans::SegmentDB* TestDB<cert_trans::SegmentDB>::SecondDB() {
+  // Only one SegmentDB can have the directory open at a time.
+  db_.reset();
+  return new cert_trans::SegmentDB(tmp_.TmpStorageDir() + "/segments",
+                                   kEntriesPerSegment);
+}
+
 // Not a Database; we just use the same template for setup.
 template <>
 void TestDB<cert_trans::FileStorage>::Setup() {
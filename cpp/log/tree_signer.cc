@@ -4,12 +4,17 @@
 #include <stdint.h>
 #include <algorithm>
 #include <chrono>
+#include <iterator>
+#include <mutex>
 #include <set>
 #include <unordered_map>
 
 #include "log/database.h"
 #include "log/log_signer.h"
+#include "log/merge_delay.h"
+#include "merkletree/serial_hasher.h"
 #include "proto/serializer.h"
+#include "util/logging.h"
 #include "util/status.h"
 #include "util/util.h"
 
@@ -19,14 +24,19 @@ using ct::SequenceMapping_Mapping;
 using ct::SignedTreeHead;
 using std::chrono::duration;
 using std::chrono::milliseconds;
+using std::chrono::steady_clock;
 using std::chrono::system_clock;
+using std::lock_guard;
+using std::make_move_iterator;
 using std::make_pair;
 using std::map;
 using std::max;
 using std::move;
+using std::mutex;
 using std::pair;
 using std::sort;
 using std::string;
+using std::unique_lock;
 using std::unique_ptr;
 using std::unordered_map;
 using std::vector;
@@ -39,6 +49,15 @@ namespace cert_trans {
 namespace {
 
 
+// Number of entries read from the database before hashing them (in
+// parallel) and adding them to the tree.
+const size_t kUpdateBatchSize = 10000;
+
+// Maximum number of sequenced entries kept around for UpdateTree(), in
+// case it falls behind. It reads any others from the database.
+const size_t kMaxSequencedEntries = 100000;
+
+
 bool LessThanBySequence(const SequenceMapping::Mapping& lhs,
                         const SequenceMapping::Mapping& rhs) {
   CHECK(lhs.has_sequence_number());
@@ -71,13 +90,17 @@ bool PendingEntriesOrder::operator()(const EntryHandle<LoggedEntry>& x,
 
 TreeSigner::TreeSigner(const duration<double>& guard_window, Database* db,
                        unique_ptr<CompactMerkleTree> merkle_tree,
-                       ConsistentStore* consistent_store, LogSigner* signer)
+                       ConsistentStore* consistent_store, LogSigner* signer,
+                       ThreadPool* pool)
     : guard_window_(guard_window),
       db_(db),
       consistent_store_(consistent_store),
       signer_(signer),
+      leaf_hasher_(unique_ptr<Sha256Hasher>(new Sha256Hasher), pool),
       cert_tree_(move(merkle_tree)),
-      latest_tree_head_() {
+      latest_tree_head_(),
+      caught_up_(false),
+      entries_sequenced_(false) {
   CHECK(cert_tree_);
   // Try to get any STH previously published by this node.
   const StatusOr<ClusterNodeState> node_state(
@@ -92,6 +115,41 @@ TreeSigner::TreeSigner(const duration<double>& guard_window, Database* db,
 }
 
 
+// static
+unique_ptr<CompactMerkleTree> TreeSigner::LoadTree(
+    const ReadOnlyDatabase* db, ConsistentStore* consistent_store) {
+  string frontier;
+  if (CHECK_NOTNULL(db)->LatestTreeFrontier(&frontier) != Database::LOOKUP_OK) {
+    return nullptr;
+  }
+  const StatusOr<ClusterNodeState> node_state(
+      CHECK_NOTNULL(consistent_store)->GetClusterNodeState());
+  if (!node_state.ok()) {
+    LOG(INFO) << "Not using the stored tree frontier, no STH to check it "
+              << "against: " << node_state.status();
+    return nullptr;
+  }
+
+  const SignedTreeHead& sth(node_state.ValueOrDie().newest_sth());
+  unique_ptr<CompactMerkleTree> tree(
+      new CompactMerkleTree(unique_ptr<Sha256Hasher>(new Sha256Hasher)));
+  if (!tree->LoadFrontier(frontier)) {
+    LOG(WARNING) << "Stored tree frontier is corrupt, ignoring it.";
+    return nullptr;
+  }
+  if (static_cast<int64_t>(tree->LeafCount()) != sth.tree_size() ||
+      tree->CurrentRoot() != sth.sha256_root_hash()) {
+    LOG(INFO) << "Stored tree frontier (" << tree->LeafCount()
+              << " leaves) does not match the newest STH of this node ("
+              << sth.tree_size() << " leaves), not using it.";
+    return nullptr;
+  }
+  LOG(INFO) << "Loaded the tree from its stored frontier, at "
+            << tree->LeafCount() << " leaves.";
+  return tree;
+}
+
+
 uint64_t TreeSigner::LastUpdateTime() const {
   return latest_tree_head_.timestamp();
 }
@@ -129,7 +187,25 @@ Status TreeSigner::SequenceNewEntries() {
   if (!status.ok()) {
     return status;
   }
-  sort(pending_entries.begin(), pending_entries.end(), PendingEntriesOrder());
+  // Put them in PendingEntriesOrder, but with the keys computed once
+  // per entry rather than in every comparison.
+  {
+    vector<pair<pair<uint64_t, string>, size_t>> keys;
+    keys.reserve(pending_entries.size());
+    for (size_t i = 0; i < pending_entries.size(); ++i) {
+      const LoggedEntry& entry(pending_entries[i].Entry());
+      CHECK(entry.sct().has_timestamp());
+      keys.emplace_back(make_pair(entry.timestamp(), entry.Hash()), i);
+    }
+    sort(keys.begin(), keys.end());
+
+    vector<EntryHandle<LoggedEntry>> sorted;
+    sorted.reserve(pending_entries.size());
+    for (const auto& key : keys) {
+      sorted.emplace_back(move(pending_entries[key.second]));
+    }
+    pending_entries.swap(sorted);
+  }
 
   VLOG(1) << "Sequencing " << pending_entries.size() << " entr"
           << (pending_entries.size() == 1 ? "y" : "ies");
@@ -144,13 +220,14 @@ Status TreeSigner::SequenceNewEntries() {
   google::protobuf::RepeatedPtrField<SequenceMapping_Mapping> new_mapping;
   map<int64_t, const LoggedEntry*> seq_to_entry;
   int num_sequenced(0);
+  MergeDelayRecorder merge_delay("sequenced");
   for (auto& pending_entry : pending_entries) {
     const string& pending_hash(pending_entry.Entry().Hash());
     const system_clock::time_point cert_time(
         milliseconds(pending_entry.Entry().timestamp()));
     if (now - cert_time < guard_window_) {
-      VLOG(1) << "Entry too recent: "
-              << ToBase64(pending_entry.Entry().Hash());
+      VLOG_EVERY_N_SEC(1, 1) << "Entry too recent: "
+                             << ToBase64(pending_entry.Entry().Hash());
       continue;
     }
     const auto seq_it(sequenced_hashes.find(pending_hash));
@@ -158,17 +235,20 @@ Status TreeSigner::SequenceNewEntries() {
 
     if (seq_it == sequenced_hashes.end()) {
       // Need to sequence this one.
-      VLOG(1) << ToBase64(pending_hash) << " = " << next_sequence_number;
+      VLOG_EVERY_N_SEC(1, 1) << ToBase64(pending_hash) << " = "
+                             << next_sequence_number;
 
       // Record the sequence -> hash mapping
       seq_mapping->set_sequence_number(next_sequence_number);
       seq_mapping->set_entry_hash(pending_entry.Entry().Hash());
       pending_entry.MutableEntry()->set_sequence_number(next_sequence_number);
+      merge_delay.Add(pending_entry.Entry());
       ++num_sequenced;
       ++next_sequence_number;
     } else {
-      VLOG(1) << "Previously sequenced " << ToBase64(pending_hash) << " = "
-              << seq_it->second.first;
+      VLOG_EVERY_N_SEC(1, 1) << "Previously sequenced "
+                             << ToBase64(pending_hash) << " = "
+                             << seq_it->second.first;
       CHECK(!seq_it->second.second /*present*/)
           << "Saw same sequenced cert twice.";
       CHECK(!pending_entry.Entry().has_sequence_number());
@@ -214,14 +294,40 @@ Status TreeSigner::SequenceNewEntries() {
   if (!status.ok()) {
     return status;
   }
+  merge_delay.Record();
 
   // Now add the sequenced entries to our local DB so that the local signer can
   // incorporate them.
+  vector<LoggedEntry> new_entries;
+  MergeDelayRecorder stored_merge_delay("stored");
   for (auto it(seq_to_entry.find(db_->TreeSize())); it != seq_to_entry.end();
        ++it) {
-    VLOG(1) << "Adding to local DB: " << it->first;
+    VLOG_EVERY_N_SEC(1, 1) << "Adding to local DB: " << it->first;
     CHECK_EQ(it->first, it->second->sequence_number());
-    CHECK_EQ(Database::OK, db_->CreateSequencedEntry(*(it->second)));
+    new_entries.push_back(*it->second);
+    CHECK(new_entries.back().PrepareForStorage());
+    stored_merge_delay.Add(new_entries.back());
+  }
+  CHECK_EQ(Database::OK, db_->CreateSequencedEntries(new_entries, nullptr));
+  stored_merge_delay.Record();
+
+  if (!new_entries.empty()) {
+    lock_guard<mutex> lock(sequenced_entries_lock_);
+    entries_sequenced_ = true;
+    if (!sequenced_entries_.empty() &&
+        sequenced_entries_.back().sequence_number() + 1 !=
+            new_entries.front().sequence_number()) {
+      sequenced_entries_.clear();
+    }
+    if (sequenced_entries_.size() + new_entries.size() <=
+        kMaxSequencedEntries) {
+      sequenced_entries_.insert(sequenced_entries_.end(),
+                                make_move_iterator(new_entries.begin()),
+                                make_move_iterator(new_entries.end()));
+    } else {
+      sequenced_entries_.clear();
+    }
+    sequenced_entries_cv_.notify_all();
   }
 
   VLOG(1) << "Sequenced " << num_sequenced << " entries.";
@@ -239,16 +345,54 @@ typename TreeSigner::UpdateResult TreeSigner::UpdateTree() {
   // That'll get handled by the Serving STH selection code.
   uint64_t min_timestamp = LastUpdateTime() + 1;
 
-  // Add any newly sequenced entries from our local DB.
+  // Add the entries that SequenceNewEntries() handed over, if they are
+  // the next ones for the tree.
+  vector<LoggedEntry> entries;
+  {
+    lock_guard<mutex> lock(sequenced_entries_lock_);
+    entries.swap(sequenced_entries_);
+    entries_sequenced_ = false;
+  }
+  MergeDelayRecorder merge_delay("signed");
+  const int64_t leaf_count(cert_tree_->LeafCount());
+  if (!entries.empty() && entries.front().sequence_number() <= leaf_count &&
+      entries.back().sequence_number() >= leaf_count) {
+    entries.erase(entries.begin(),
+                  entries.begin() +
+                      (leaf_count - entries.front().sequence_number()));
+    for (size_t i(0); i < entries.size(); ++i) {
+      CHECK_EQ(leaf_count + static_cast<int64_t>(i),
+               entries[i].sequence_number());
+      min_timestamp = max(min_timestamp, entries[i].sct().timestamp());
+      if (caught_up_) {
+        merge_delay.Add(entries[i]);
+      }
+    }
+    cert_tree_->AddLeafHashes(leaf_hasher_.HashLeaves(entries));
+  }
+
+  // Add any other newly sequenced entries from our local DB.
   auto it(db_->ScanEntries(cert_tree_->LeafCount()));
-  for (int64_t i(cert_tree_->LeafCount());; ++i) {
-    LoggedEntry logged;
-    if (!it->GetNextEntry(&logged) || logged.sequence_number() != i) {
-      break;
+  entries.reserve(kUpdateBatchSize);
+  bool done(false);
+  while (!done) {
+    entries.clear();
+    for (int64_t i(cert_tree_->LeafCount());
+         entries.size() < kUpdateBatchSize; ++i) {
+      entries.emplace_back();
+      if (!it->GetNextEntry(&entries.back()) ||
+          entries.back().sequence_number() != i) {
+        entries.pop_back();
+        done = true;
+        break;
+      }
+      min_timestamp = max(min_timestamp, entries.back().sct().timestamp());
+      if (caught_up_) {
+        merge_delay.Add(entries.back());
+      }
     }
-    CHECK_EQ(logged.sequence_number(), i);
-    AppendToTree(logged);
-    min_timestamp = max(min_timestamp, logged.sct().timestamp());
+
+    cert_tree_->AddLeafHashes(leaf_hasher_.HashLeaves(entries));
   }
   int64_t next_seq(cert_tree_->LeafCount());
   CHECK_GE(next_seq, 0);
@@ -258,6 +402,9 @@ typename TreeSigner::UpdateResult TreeSigner::UpdateTree() {
   // the sequence number is not allowed).
   SignedTreeHead new_sth;
   TimestampAndSign(min_timestamp, &new_sth);
+  merge_delay.Record();
+  caught_up_ = true;
+  db_->WriteTreeFrontier(cert_tree_->SerializeFrontier());
 
   // We don't actually store this STH anywhere durable yet, but rather let the
   // caller decide what to do with it.  (In practice, this will mean that it's
@@ -268,6 +415,15 @@ typename TreeSigner::UpdateResult TreeSigner::UpdateTree() {
 }
 
 
+bool TreeSigner::WaitForSequencedEntries(
+    const steady_clock::time_point& deadline) {
+  unique_lock<mutex> lock(sequenced_entries_lock_);
+  return sequenced_entries_cv_.wait_until(lock, deadline, [this]() {
+    return entries_sequenced_;
+  });
+}
+
+
 bool TreeSigner::Append(const LoggedEntry& logged) {
   // Serialize for inclusion in the tree.
   string serialized_leaf;
@@ -292,16 +448,6 @@ bool TreeSigner::Append(const LoggedEntry& logged) {
 }
 
 
-void TreeSigner::AppendToTree(const LoggedEntry& logged) {
-  // Serialize for inclusion in the tree.
-  string serialized_leaf;
-  CHECK(logged.SerializeForLeaf(&serialized_leaf));
-
-  // Update in-memory tree.
-  cert_tree_->AddLeaf(serialized_leaf);
-}
-
-
 void TreeSigner::TimestampAndSign(uint64_t min_timestamp,
                                   SignedTreeHead* sth) {
   sth->set_version(ct::V1);
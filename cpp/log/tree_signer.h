@@ -4,9 +4,13 @@
 #include <stdint.h>
 #include <algorithm>
 #include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
 
 #include "log/cluster_state_controller.h"
 #include "log/consistent_store.h"
+#include "log/leaf_hasher.h"
 #include "log/logged_entry.h"
 #include "merkletree/compact_merkle_tree.h"
 #include "proto/ct.pb.h"
@@ -22,6 +26,8 @@ class LogSigner;
 namespace cert_trans {
 
 class Database;
+class ReadOnlyDatabase;
+class ThreadPool;
 
 
 // Signer for appending new entries to the log.
@@ -33,10 +39,21 @@ class Database;
 class TreeSigner {
  public:
   // No transfer of ownership for params other than merkle_tree whose contents
-  // is moved into this object.
+  // is moved into this object. New entries are hashed on |pool|, which can
+  // be NULL to hash them on the thread calling UpdateTree().
   TreeSigner(const std::chrono::duration<double>& guard_window, Database* db,
              std::unique_ptr<CompactMerkleTree> merkle_tree,
-             cert_trans::ConsistentStore* consistent_store, LogSigner* signer);
+             cert_trans::ConsistentStore* consistent_store, LogSigner* signer,
+             ThreadPool* pool);
+
+  // Returns the tree for the constructor from the frontier that
+  // UpdateTree() last stored in |db|, which takes no time even for a
+  // large log, provided that its root is that of the newest STH of
+  // this node. Returns NULL otherwise, in which case the caller should
+  // use LogLookup::GetCompactMerkleTree() instead.
+  static std::unique_ptr<CompactMerkleTree> LoadTree(
+      const ReadOnlyDatabase* db,
+      cert_trans::ConsistentStore* consistent_store);
 
   enum UpdateResult {
     OK,
@@ -49,13 +66,24 @@ class TreeSigner {
   // Latest Tree Head timestamp;
   uint64_t LastUpdateTime() const;
 
+  // The newly sequenced entries are written to the database, and also
+  // handed over to the next UpdateTree(), which then does not have to
+  // read them back.
   util::Status SequenceNewEntries();
 
   // Simplest update mechanism: take all pending entries and append
   // (in random order) to the tree. Checks that the update it writes
-  // to the database is consistent with the latest STH.
+  // to the database is consistent with the latest STH. The frontier
+  // of the tree is stored in the database along with every new STH,
+  // for LoadTree().
   UpdateResult UpdateTree();
 
+  // Blocks until SequenceNewEntries() has written entries to the
+  // database that UpdateTree() has not added to the tree yet, or until
+  // |deadline|. Returns whether there are such entries.
+  bool WaitForSequencedEntries(
+      const std::chrono::steady_clock::time_point& deadline);
+
   // Latest Tree Head (does not build a new tree, just retrieves the
   // result of the most recent build).
   const ct::SignedTreeHead& LatestSTH() const {
@@ -64,15 +92,28 @@ class TreeSigner {
 
  private:
   bool Append(const LoggedEntry& logged);
-  void AppendToTree(const LoggedEntry& logged_cert);
   void TimestampAndSign(uint64_t min_timestamp, ct::SignedTreeHead* sth);
 
   const std::chrono::duration<double> guard_window_;
   Database* const db_;
   cert_trans::ConsistentStore* const consistent_store_;
   LogSigner* const signer_;
+  const LeafHasher leaf_hasher_;
   const std::unique_ptr<CompactMerkleTree> cert_tree_;
   ct::SignedTreeHead latest_tree_head_;
+  // Whether UpdateTree() already caught up with the database once,
+  // since the start, so that the merge delays are worth recording.
+  bool caught_up_;
+
+  // SequenceNewEntries() and UpdateTree() can run on different threads.
+  std::mutex sequenced_entries_lock_;
+  std::condition_variable sequenced_entries_cv_;
+  // Whether SequenceNewEntries() wrote entries since the last
+  // UpdateTree(), whether or not they are in |sequenced_entries_|.
+  bool entries_sequenced_;
+  // Entries written to the database by SequenceNewEntries() but not yet
+  // added to the tree, with consecutive sequence numbers.
+  std::vector<LoggedEntry> sequenced_entries_;
 
   template <class T>
   friend class TreeSignerTest;
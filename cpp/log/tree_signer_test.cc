@@ -18,7 +18,6 @@
 #include "util/fake_etcd.h"
 #include "util/mock_masterelection.h"
 #include "util/status_test_util.h"
-#include "util/sync_task.h"
 #include "util/testing.h"
 #include "util/thread_pool.h"
 #include "util/util.h"
@@ -31,6 +30,8 @@ using cert_trans::MockMasterElection;
 using ct::ClusterNodeState;
 using ct::SequenceMapping;
 using ct::SignedTreeHead;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
 using std::make_shared;
 using std::move;
 using std::shared_ptr;
@@ -70,16 +71,9 @@ class TreeSignerTest : public ::testing::Test {
         new TreeSigner(std::chrono::duration<double>(0), db(),
                        unique_ptr<CompactMerkleTree>(new CompactMerkleTree(
                            unique_ptr<Sha256Hasher>(new Sha256Hasher))),
-                       store_.get(), log_signer_.get()));
+                       store_.get(), log_signer_.get(), &pool_));
     // Set a default empty STH so that we can call UpdateTree() on the signer.
     store_->SetServingSTH(SignedTreeHead());
-    // Force an empty sequence mapping file:
-    {
-      util::SyncTask task(&pool_);
-      EtcdClient::Response r;
-      etcd_client_.ForceSet("/root/sequence_mapping", "", &r, task.task());
-      task.Wait();
-    }
   }
 
   void AddPendingEntry(LoggedEntry* logged_cert) const {
@@ -116,7 +110,7 @@ class TreeSignerTest : public ::testing::Test {
                           unique_ptr<CompactMerkleTree>(new CompactMerkleTree(
                               *tree_signer_->cert_tree_,
                               unique_ptr<Sha256Hasher>(new Sha256Hasher))),
-                          store_.get(), log_signer_.get());
+                          store_.get(), log_signer_.get(), &pool_);
   }
 
   T* db() const {
@@ -249,6 +243,47 @@ TYPED_TEST(TreeSignerTest, ResumeClean) {
 }
 
 
+TYPED_TEST(TreeSignerTest, ResumeFromFrontier) {
+  // Nothing stored yet.
+  EXPECT_FALSE(TreeSigner::LoadTree(this->db(), this->store_.get()));
+
+  for (int i(0); i < 5; ++i) {
+    LoggedEntry logged_cert;
+    this->test_signer_.CreateUnique(&logged_cert);
+    this->AddSequencedEntry(&logged_cert, i);
+  }
+  EXPECT_EQ(TreeSigner::OK, this->tree_signer_->UpdateTree());
+  const SignedTreeHead sth(this->tree_signer_->LatestSTH());
+
+  // Not until the STH it goes with is pushed out to the cluster.
+  EXPECT_FALSE(TreeSigner::LoadTree(this->db(), this->store_.get()));
+  {
+    ClusterNodeState node_state;
+    *node_state.mutable_newest_sth() = sth;
+    CHECK_EQ(util::Status::OK, this->store_->SetClusterNodeState(node_state));
+  }
+
+  unique_ptr<CompactMerkleTree> tree(
+      TreeSigner::LoadTree(this->db(), this->store_.get()));
+  ASSERT_TRUE(tree);
+  EXPECT_EQ(5U, tree->LeafCount());
+  EXPECT_EQ(sth.sha256_root_hash(), tree->CurrentRoot());
+
+  // And the signer carries on from there.
+  LoggedEntry logged_cert;
+  this->test_signer_.CreateUnique(&logged_cert);
+  this->AddSequencedEntry(&logged_cert, 5);
+  TreeSigner signer2(std::chrono::duration<double>(0), this->db(),
+                     move(tree), this->store_.get(), this->log_signer_.get(),
+                     &this->pool_);
+  EXPECT_EQ(TreeSigner::OK, signer2.UpdateTree());
+  EXPECT_EQ(TreeSigner::OK, this->tree_signer_->UpdateTree());
+  EXPECT_EQ(6U, signer2.LatestSTH().tree_size());
+  EXPECT_EQ(this->tree_signer_->LatestSTH().sha256_root_hash(),
+            signer2.LatestSTH().sha256_root_hash());
+}
+
+
 // Test resuming when the tree head signature is lagging behind the
 // sequence number commits.
 TYPED_TEST(TreeSignerTest, ResumePartialSign) {
@@ -285,6 +320,55 @@ TYPED_TEST(TreeSignerTest, SignEmpty) {
 }
 
 
+TYPED_TEST(TreeSignerTest, SignSameAsFromDatabase) {
+  for (int round(0); round < 3; ++round) {
+    for (int i(0); i < 3; ++i) {
+      LoggedEntry logged_cert;
+      this->test_signer_.CreateUnique(&logged_cert);
+      this->AddPendingEntry(&logged_cert);
+    }
+    EXPECT_OK(this->tree_signer_->SequenceNewEntries());
+    // Leave some of the sequenced entries for the next UpdateTree().
+    if (round == 0) {
+      EXPECT_EQ(TreeSigner::OK, this->tree_signer_->UpdateTree());
+    }
+  }
+  EXPECT_EQ(TreeSigner::OK, this->tree_signer_->UpdateTree());
+  const SignedTreeHead sth(this->tree_signer_->LatestSTH());
+  EXPECT_EQ(9U, sth.tree_size());
+
+  // A signer which reads all the entries from the database ends up
+  // with the same tree.
+  TreeSigner signer2(std::chrono::duration<double>(0), this->db(),
+                     unique_ptr<CompactMerkleTree>(new CompactMerkleTree(
+                         unique_ptr<Sha256Hasher>(new Sha256Hasher))),
+                     this->store_.get(), this->log_signer_.get(),
+                     &this->pool_);
+  EXPECT_EQ(TreeSigner::OK, signer2.UpdateTree());
+  EXPECT_EQ(sth.tree_size(), signer2.LatestSTH().tree_size());
+  EXPECT_EQ(sth.sha256_root_hash(), signer2.LatestSTH().sha256_root_hash());
+}
+
+
+TYPED_TEST(TreeSignerTest, WaitForSequencedEntries) {
+  const steady_clock::time_point started(steady_clock::now());
+  EXPECT_FALSE(this->tree_signer_->WaitForSequencedEntries(
+      started + milliseconds(100)));
+  EXPECT_LE(started + milliseconds(100), steady_clock::now());
+
+  LoggedEntry logged_cert;
+  this->test_signer_.CreateUnique(&logged_cert);
+  this->AddPendingEntry(&logged_cert);
+  EXPECT_OK(this->tree_signer_->SequenceNewEntries());
+  EXPECT_TRUE(
+      this->tree_signer_->WaitForSequencedEntries(steady_clock::now()));
+
+  EXPECT_EQ(TreeSigner::OK, this->tree_signer_->UpdateTree());
+  EXPECT_FALSE(
+      this->tree_signer_->WaitForSequencedEntries(steady_clock::now()));
+}
+
+
 TYPED_TEST(TreeSignerTest, SequenceNewEntriesCleansUpOldSequenceMappings) {
   LoggedEntry logged_cert;
   this->test_signer_.CreateUnique(&logged_cert);
@@ -1,9 +1,13 @@
 /* -*- indent-tabs-mode: nil -*- */
 #include "log/verifier.h"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
 #include <openssl/evp.h>
 #include <openssl/opensslv.h>
+#include <openssl/rsa.h>
 #include <stdint.h>
 
 #include "merkletree/serial_hasher.h"
@@ -16,6 +20,15 @@
 
 using ct::DigitallySigned;
 
+DEFINE_bool(verifier_cache_ec_key, true,
+            "Precompute the tables used to verify ECDSA signatures once, "
+            "and verify them with the key directly, rather than setting up "
+            "a generic public key context for every signature.");
+DEFINE_bool(verifier_cache_rsa_key, true,
+            "Extract the RSA key once, and verify RSA signatures with it "
+            "directly, rather than setting up a generic public key context "
+            "for every signature.");
+
 namespace cert_trans {
 
 Verifier::Verifier(EVP_PKEY* pkey) : pkey_(CHECK_NOTNULL(pkey)) {
@@ -23,10 +36,17 @@ Verifier::Verifier(EVP_PKEY* pkey) : pkey_(CHECK_NOTNULL(pkey)) {
     case EVP_PKEY_EC:
       hash_algo_ = DigitallySigned::SHA256;
       sig_algo_ = DigitallySigned::ECDSA;
+      if (FLAGS_verifier_cache_ec_key) {
+        ec_key_.reset(CHECK_NOTNULL(EVP_PKEY_get1_EC_KEY(pkey_.get())));
+        CHECK_EQ(1, EC_KEY_precompute_mult(ec_key_.get(), NULL));
+      }
       break;
     case EVP_PKEY_RSA:
       hash_algo_ = DigitallySigned::SHA256;
       sig_algo_ = DigitallySigned::RSA;
+      if (FLAGS_verifier_cache_rsa_key) {
+        rsa_key_.reset(CHECK_NOTNULL(EVP_PKEY_get1_RSA(pkey_.get())));
+      }
       break;
     default:
       LOG(FATAL) << "Unsupported key type " << pkey_->type;
@@ -71,6 +91,24 @@ Verifier::Verifier()
 
 bool Verifier::RawVerify(const std::string& data,
                          const std::string& sig_string) const {
+  if (ec_key_) {
+    const std::string digest(Sha256Hasher::Sha256Digest(data));
+    return ECDSA_verify(
+               0, reinterpret_cast<const unsigned char*>(digest.data()),
+               digest.size(),
+               reinterpret_cast<const unsigned char*>(sig_string.data()),
+               sig_string.size(), ec_key_.get()) == 1;
+  }
+  if (rsa_key_) {
+    // The same PKCS #1 v1.5 check as EVP_VerifyFinal() does.
+    const std::string digest(Sha256Hasher::Sha256Digest(data));
+    return RSA_verify(NID_sha256,
+                      reinterpret_cast<const unsigned char*>(digest.data()),
+                      digest.size(),
+                      reinterpret_cast<const unsigned char*>(sig_string.data()),
+                      sig_string.size(), rsa_key_.get()) == 1;
+  }
+
   EVP_MD_CTX ctx;
   EVP_MD_CTX_init(&ctx);
   // NOTE: this syntax for setting the hash function requires OpenSSL >= 1.0.0.
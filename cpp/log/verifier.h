@@ -41,6 +41,11 @@ class Verifier {
   bool RawVerify(const std::string& data, const std::string& sig_string) const;
 
   ScopedEVP_PKEY pkey_;
+  // For ECDSA keys, with --verifier_cache_ec_key: the key from |pkey_|,
+  // set up once for verifying many signatures.
+  ScopedEC_KEY ec_key_;
+  // Likewise for RSA keys, with --verifier_cache_rsa_key.
+  ScopedRSA rsa_key_;
   ct::DigitallySigned::HashAlgorithm hash_algo_;
   ct::DigitallySigned::SignatureAlgorithm sig_algo_;
   std::string key_id_;
@@ -0,0 +1,441 @@
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "merkletree/compact_merkle_tree.h"
+#include "merkletree/digest.h"
+#include "merkletree/merkle_tree.h"
+#include "merkletree/merkle_verifier.h"
+#include "merkletree/serial_hasher.h"
+#include "merkletree/sparse_merkle_tree.h"
+#include "merkletree/tree_hasher.h"
+#include "util/hash_index.h"
+
+namespace sc = std::chrono;
+
+using cert_trans::HashIndex;
+using std::cout;
+using std::function;
+using std::make_shared;
+using std::mt19937_64;
+using std::setw;
+using std::shared_ptr;
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+
+DEFINE_string(benchmark_filter, "",
+              "only run the benchmarks whose name contains this");
+DEFINE_uint64(min_tree_size, 1000, "smallest tree size to benchmark");
+DEFINE_uint64(max_tree_size, 1000000,
+              "largest tree size to benchmark (they go up by a factor of 10, "
+              "and can go up to 10^8, given enough memory and patience)");
+DEFINE_uint64(max_sparse_tree_size, 100000,
+              "largest sparse Merkle tree size to benchmark");
+DEFINE_int32(min_time_ms, 500,
+             "run every benchmark until it takes at least this long");
+
+namespace {
+
+
+// Keeps the results from being optimized away.
+uint64_t sink;
+
+void Consume(const string& s) {
+  sink += s.size() + (s.empty() ? 0 : s[0]);
+}
+
+void Consume(const Digest& d) {
+  sink += d.data()[0];
+}
+
+void Consume(const vector<string>& v) {
+  sink += v.size();
+}
+
+
+// Runs |iterations| operations of a benchmark.
+typedef function<void(uint64_t iterations)> BenchmarkLoop;
+
+// A benchmark, at a given size. Anything that should not be measured
+// (like building the tree to query) is done here rather than in the
+// loop.
+typedef function<BenchmarkLoop(uint64_t size)> BenchmarkSetup;
+
+struct Benchmark {
+  string name;
+  // The flag with the largest size to run this at, going up from
+  // --min_tree_size, or NULL if it does not depend on a tree size.
+  const uint64_t* max_size;
+  BenchmarkSetup setup;
+};
+
+
+unique_ptr<SerialHasher> NewHasher() {
+  return unique_ptr<SerialHasher>(new Sha256Hasher);
+}
+
+
+// The data of the |index|th leaf (starting at 0) of the trees built
+// here. Deterministic, so that runs can be compared.
+string LeafData(uint64_t index) {
+  return string(reinterpret_cast<const char*>(&index), sizeof(index));
+}
+
+
+vector<Digest> LeafHashes(uint64_t begin, uint64_t count) {
+  TreeHasher hasher(NewHasher());
+  vector<Digest> hashes(count);
+  for (uint64_t i = 0; i < count; ++i) {
+    const string data(LeafData(begin + i));
+    hasher.HashLeaf(reinterpret_cast<const uint8_t*>(data.data()),
+                    data.size(), &hashes[i]);
+  }
+  return hashes;
+}
+
+
+template <class Tree>
+void AddLeaves(uint64_t count, Tree* tree) {
+  // In chunks, to bound the memory used on top of the tree itself.
+  const uint64_t kChunkSize(1 << 16);
+  for (uint64_t begin = tree->LeafCount(); begin < count;
+       begin += kChunkSize) {
+    const uint64_t chunk(std::min(kChunkSize, count - begin));
+    CHECK_EQ(begin + chunk, tree->AddLeafHashes(LeafHashes(begin, chunk)));
+  }
+}
+
+
+shared_ptr<MerkleTree> BuildTree(uint64_t size) {
+  const shared_ptr<MerkleTree> tree(make_shared<MerkleTree>(NewHasher()));
+  AddLeaves(size, tree.get());
+  tree->CurrentRoot();
+  return tree;
+}
+
+
+SparseMerkleTree::Path RandomPath(mt19937_64* rng) {
+  SparseMerkleTree::Path path;
+  for (size_t i = 0; i < path.size(); i += sizeof(uint64_t)) {
+    const uint64_t r((*rng)());
+    memcpy(path.data() + i, &r, sizeof(r));
+  }
+  return path;
+}
+
+
+BenchmarkSetup HashData(size_t bytes) {
+  return [bytes](uint64_t) -> BenchmarkLoop {
+    const shared_ptr<SerialHasher> hasher(NewHasher());
+    const shared_ptr<string> data(make_shared<string>(bytes, 'x'));
+    return [hasher, data](uint64_t iterations) {
+      for (uint64_t i = 0; i < iterations; ++i) {
+        hasher->Reset();
+        hasher->Update(*data);
+        Consume(hasher->Final());
+      }
+    };
+  };
+}
+
+
+BenchmarkLoop HashChildren(uint64_t) {
+  const shared_ptr<TreeHasher> hasher(make_shared<TreeHasher>(NewHasher()));
+  return [hasher](uint64_t iterations) {
+    Digest node;
+    for (uint64_t i = 0; i < iterations; ++i) {
+      hasher->HashChildren(node, node, &node);
+    }
+    Consume(node);
+  };
+}
+
+
+BenchmarkLoop HashLeaf(uint64_t) {
+  const shared_ptr<TreeHasher> hasher(make_shared<TreeHasher>(NewHasher()));
+  return [hasher](uint64_t iterations) {
+    Digest leaf;
+    for (uint64_t i = 0; i < iterations; ++i) {
+      hasher->HashLeaf(leaf.data(), leaf.size(), &leaf);
+    }
+    Consume(leaf);
+  };
+}
+
+
+// Appends to a tree of |size| leaves.
+BenchmarkLoop CompactAddLeafHash(uint64_t size) {
+  const shared_ptr<CompactMerkleTree> tree(
+      make_shared<CompactMerkleTree>(NewHasher()));
+  AddLeaves(size, tree.get());
+  const shared_ptr<vector<Digest>> hashes(
+      make_shared<vector<Digest>>(LeafHashes(size, 1 << 16)));
+  return [tree, hashes](uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; ++i) {
+      tree->AddLeafHash((*hashes)[i % hashes->size()].ToString());
+    }
+    Consume(tree->CurrentRoot());
+  };
+}
+
+
+// Appends to a tree of |size| leaves, getting the new root after
+// every leaf.
+BenchmarkLoop CompactAddLeafHashAndRoot(uint64_t size) {
+  const shared_ptr<CompactMerkleTree> tree(
+      make_shared<CompactMerkleTree>(NewHasher()));
+  AddLeaves(size, tree.get());
+  const shared_ptr<vector<Digest>> hashes(
+      make_shared<vector<Digest>>(LeafHashes(size, 1 << 16)));
+  return [tree, hashes](uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; ++i) {
+      tree->AddLeafHash((*hashes)[i % hashes->size()].ToString());
+      Consume(tree->CurrentRoot());
+    }
+  };
+}
+
+
+// Audit paths for random leaves, in the current tree or in a random
+// earlier snapshot.
+BenchmarkSetup PathToRootAtSnapshot(bool historical) {
+  return [historical](uint64_t size) -> BenchmarkLoop {
+    const shared_ptr<MerkleTree> tree(BuildTree(size));
+    const shared_ptr<mt19937_64> rng(make_shared<mt19937_64>(size));
+    return [tree, rng, historical, size](uint64_t iterations) {
+      for (uint64_t i = 0; i < iterations; ++i) {
+        const uint64_t snapshot(historical ? 1 + (*rng)() % size : size);
+        const uint64_t leaf(1 + (*rng)() % snapshot);
+        Consume(tree->PathToRootAtSnapshot(leaf, snapshot));
+      }
+    };
+  };
+}
+
+
+// Consistency proofs from a random snapshot to the current tree.
+BenchmarkLoop SnapshotConsistency(uint64_t size) {
+  const shared_ptr<MerkleTree> tree(BuildTree(size));
+  const shared_ptr<mt19937_64> rng(make_shared<mt19937_64>(size));
+  return [tree, rng, size](uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; ++i) {
+      const uint64_t snapshot(1 + (*rng)() % size);
+      Consume(tree->SnapshotConsistency(snapshot, size));
+    }
+  };
+}
+
+
+// Sets random leaves in a tree of |size| leaves, only getting the
+// root (once) at the end.
+BenchmarkLoop SparseSetLeaf(uint64_t size) {
+  const shared_ptr<SparseMerkleTree> tree(
+      make_shared<SparseMerkleTree>(new Sha256Hasher));
+  const shared_ptr<mt19937_64> rng(make_shared<mt19937_64>(size));
+  for (uint64_t i = 0; i < size; ++i) {
+    tree->SetLeaf(RandomPath(rng.get()), to_string(i));
+  }
+  tree->CurrentRoot();
+  return [tree, rng](uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; ++i) {
+      tree->SetLeaf(RandomPath(rng.get()), to_string(i));
+    }
+    Consume(tree->CurrentRoot());
+  };
+}
+
+
+// Sets a random leaf in a tree of |size| leaves, and gets the new
+// root.
+BenchmarkLoop SparseCurrentRoot(uint64_t size) {
+  const shared_ptr<SparseMerkleTree> tree(
+      make_shared<SparseMerkleTree>(new Sha256Hasher));
+  const shared_ptr<mt19937_64> rng(make_shared<mt19937_64>(size));
+  for (uint64_t i = 0; i < size; ++i) {
+    tree->SetLeaf(RandomPath(rng.get()), to_string(i));
+  }
+  tree->CurrentRoot();
+  return [tree, rng](uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; ++i) {
+      tree->SetLeaf(RandomPath(rng.get()), to_string(i));
+      Consume(tree->CurrentRoot());
+    }
+  };
+}
+
+
+// Looks up random hashes present in an index of |size| of them. With
+// a large enough index, run it with --huge_pages=off and
+// --huge_pages=explicit to see what the TLB misses cost.
+BenchmarkLoop HashIndexFind(uint64_t size) {
+  const shared_ptr<HashIndex> index(make_shared<HashIndex>());
+  index->Reserve(size);
+  const vector<Digest> hashes(LeafHashes(0, size));
+  for (uint64_t i = 0; i < size; ++i) {
+    CHECK(index->Insert(hashes[i].ToString(), i));
+  }
+  const shared_ptr<vector<string>> keys(make_shared<vector<string>>());
+  mt19937_64 rng(size);
+  for (int i = 0; i < 1 << 16; ++i) {
+    keys->push_back(hashes[rng() % size].ToString());
+  }
+  return [index, keys](uint64_t iterations) {
+    int64_t value;
+    for (uint64_t i = 0; i < iterations; ++i) {
+      CHECK(index->Find((*keys)[i % keys->size()], &value));
+      sink += value;
+    }
+  };
+}
+
+
+// Verifies the audit path of a random leaf of the current tree.
+BenchmarkLoop VerifyPath(uint64_t size) {
+  const shared_ptr<MerkleTree> tree(BuildTree(size));
+  const shared_ptr<MerkleVerifier> verifier(
+      make_shared<MerkleVerifier>(NewHasher()));
+  mt19937_64 rng(size);
+  const string root(tree->CurrentRoot());
+  const shared_ptr<vector<uint64_t>> leaves(make_shared<vector<uint64_t>>());
+  const shared_ptr<vector<vector<string>>> paths(
+      make_shared<vector<vector<string>>>());
+  for (int i = 0; i < 1024; ++i) {
+    leaves->push_back(1 + rng() % size);
+    paths->push_back(tree->PathToRootAtSnapshot(leaves->back(), size));
+  }
+  return [verifier, leaves, paths, size, root](uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; ++i) {
+      const size_t j(i % leaves->size());
+      CHECK(verifier->VerifyPath((*leaves)[j], size, (*paths)[j], root,
+                                 LeafData((*leaves)[j] - 1)));
+    }
+  };
+}
+
+
+// Verifies the consistency proof from a random snapshot to the
+// current tree.
+BenchmarkLoop VerifyConsistency(uint64_t size) {
+  const shared_ptr<MerkleTree> tree(BuildTree(size));
+  const shared_ptr<MerkleVerifier> verifier(
+      make_shared<MerkleVerifier>(NewHasher()));
+  mt19937_64 rng(size);
+  const string root(tree->CurrentRoot());
+  const shared_ptr<vector<uint64_t>> snapshots(
+      make_shared<vector<uint64_t>>());
+  const shared_ptr<vector<string>> roots(make_shared<vector<string>>());
+  const shared_ptr<vector<vector<string>>> proofs(
+      make_shared<vector<vector<string>>>());
+  for (int i = 0; i < 1024; ++i) {
+    snapshots->push_back(1 + rng() % size);
+    roots->push_back(tree->RootAtSnapshot(snapshots->back()));
+    proofs->push_back(tree->SnapshotConsistency(snapshots->back(), size));
+  }
+  return [verifier, snapshots, roots, proofs, size,
+          root](uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; ++i) {
+      const size_t j(i % snapshots->size());
+      CHECK(verifier->VerifyConsistency((*snapshots)[j], size, (*roots)[j],
+                                        root, (*proofs)[j]));
+    }
+  };
+}
+
+
+const Benchmark kBenchmarks[] = {
+    {"Sha256Hasher/32", NULL, HashData(32)},
+    {"Sha256Hasher/1024", NULL, HashData(1024)},
+    {"TreeHasher::HashLeaf", NULL, HashLeaf},
+    {"TreeHasher::HashChildren", NULL, HashChildren},
+    {"CompactMerkleTree::AddLeafHash", &FLAGS_max_tree_size,
+     CompactAddLeafHash},
+    {"CompactMerkleTree::AddLeafHash+CurrentRoot", &FLAGS_max_tree_size,
+     CompactAddLeafHashAndRoot},
+    {"MerkleTree::PathToRootAtSnapshot/current", &FLAGS_max_tree_size,
+     PathToRootAtSnapshot(false)},
+    {"MerkleTree::PathToRootAtSnapshot/historical", &FLAGS_max_tree_size,
+     PathToRootAtSnapshot(true)},
+    {"MerkleTree::SnapshotConsistency", &FLAGS_max_tree_size,
+     SnapshotConsistency},
+    {"SparseMerkleTree::SetLeaf", &FLAGS_max_sparse_tree_size, SparseSetLeaf},
+    {"SparseMerkleTree::SetLeaf+CurrentRoot", &FLAGS_max_sparse_tree_size,
+     SparseCurrentRoot},
+    {"MerkleVerifier::VerifyPath", &FLAGS_max_tree_size, VerifyPath},
+    {"MerkleVerifier::VerifyConsistency", &FLAGS_max_tree_size,
+     VerifyConsistency},
+    {"HashIndex::Find", &FLAGS_max_tree_size, HashIndexFind},
+};
+
+
+void RunBenchmark(const string& name, const BenchmarkSetup& setup,
+                  uint64_t size) {
+  const BenchmarkLoop loop(setup(size));
+  const sc::nanoseconds min_time = sc::milliseconds(FLAGS_min_time_ms);
+
+  // Warm up, then keep doubling the number of iterations until they
+  // take long enough to be measured.
+  loop(1);
+  uint64_t iterations(1);
+  sc::nanoseconds elapsed;
+  while (true) {
+    const sc::steady_clock::time_point start(sc::steady_clock::now());
+    loop(iterations);
+    elapsed = sc::steady_clock::now() - start;
+    if (elapsed >= min_time) {
+      break;
+    }
+    iterations *= 2;
+  }
+
+  const double ns_per_op(static_cast<double>(elapsed.count()) / iterations);
+  cout << std::left << setw(50) << name << std::right << setw(12) << iterations
+       << setw(14) << std::fixed << std::setprecision(1) << ns_per_op
+       << " ns/op" << setw(14) << std::setprecision(0) << 1e9 / ns_per_op
+       << " op/s" << std::endl;
+}
+
+
+}  // namespace
+
+
+int main(int argc, char* argv[]) {
+  google::SetUsageMessage(
+      "Benchmarks the Merkle tree classes (and the hash index of the "
+      "leaves), printing the time per operation of each.");
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  CHECK_GT(FLAGS_min_tree_size, 0U);
+  CHECK_GT(FLAGS_min_time_ms, 0);
+
+  for (const Benchmark& benchmark : kBenchmarks) {
+    if (benchmark.name.find(FLAGS_benchmark_filter) == string::npos) {
+      continue;
+    }
+    if (!benchmark.max_size) {
+      RunBenchmark(benchmark.name, benchmark.setup, 0);
+      continue;
+    }
+    for (uint64_t size = FLAGS_min_tree_size; size <= *benchmark.max_size;
+         size *= 10) {
+      RunBenchmark(benchmark.name + "/" + to_string(size), benchmark.setup,
+                   size);
+    }
+  }
+  Consume(to_string(sink));
+
+  return 0;
+}
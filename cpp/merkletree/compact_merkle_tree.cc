@@ -3,6 +3,8 @@
 #include <assert.h>
 #include <glog/logging.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <limits>
 #include <string>
 #include <vector>
 
@@ -20,17 +22,20 @@ CompactMerkleTree::CompactMerkleTree(unique_ptr<SerialHasher> hasher)
       leaves_processed_(0),
       level_count_(0),
       root_(treehasher_.HashEmpty()) {
+  assert(treehasher_.DigestSize() == Digest::kSize);
 }
 
 CompactMerkleTree::CompactMerkleTree(MerkleTree* model,
                                      unique_ptr<SerialHasher> hasher)
     : MerkleTreeInterface(),
       tree_(std::max<int64_t>(0, CHECK_NOTNULL(model)->LevelCount() - 1)),
+      has_node_(tree_.size(), false),
       treehasher_(move(hasher)),
       leaf_count_(model->LeafCount()),
       leaves_processed_(0),
       level_count_(model->LevelCount()),
       root_(treehasher_.HashEmpty()) {
+  assert(treehasher_.DigestSize() == Digest::kSize);
   if (model->LeafCount() == 0) {
     return;
   }
@@ -79,7 +84,8 @@ CompactMerkleTree::CompactMerkleTree(MerkleTree* model,
         // if the level'th bit in the previous tree size is set, then we have
         // a proof path entry for this level (because proof entries cover the
         // maximum possible sub-tree.)
-        tree_[level] = *i;
+        tree_[level] = Digest(*i);
+        has_node_[level] = true;
         i++;
       }
       level++;
@@ -91,7 +97,7 @@ CompactMerkleTree::CompactMerkleTree(MerkleTree* model,
   // the last entry was added, so we PushBack the final right-hand entry
   // here, which will perform any recalculations necessary to reach the final
   // tree.
-  PushBack(0, model->LeafHash(model->LeafCount()));
+  PushBack(0, Digest(model->LeafHash(model->LeafCount())));
   assert(model->CurrentRoot() == CurrentRoot());
   assert(model->LeafCount() == LeafCount());
   assert(model->LevelCount() == LevelCount());
@@ -101,6 +107,7 @@ CompactMerkleTree::CompactMerkleTree(MerkleTree* model,
 CompactMerkleTree::CompactMerkleTree(const CompactMerkleTree& other,
                                      unique_ptr<SerialHasher> hasher)
     : tree_(other.tree_),
+      has_node_(other.has_node_),
       treehasher_(move(hasher)),
       leaf_count_(other.leaf_count_),
       leaves_processed_(other.leaves_processed_),
@@ -113,10 +120,17 @@ CompactMerkleTree::~CompactMerkleTree() {
 
 
 size_t CompactMerkleTree::AddLeaf(const string& data) {
-  return AddLeafHash(treehasher_.HashLeaf(data));
+  Digest hash;
+  treehasher_.HashLeaf(reinterpret_cast<const uint8_t*>(data.data()),
+                       data.size(), &hash);
+  return AddLeafDigest(hash);
 }
 
 size_t CompactMerkleTree::AddLeafHash(const string& hash) {
+  return AddLeafDigest(Digest(hash));
+}
+
+size_t CompactMerkleTree::AddLeafDigest(const Digest& hash) {
   PushBack(0, hash);
   // Update level count: a k-level tree can hold 2^{k-1} leaves,
   // so increment level count every time we overflow a power of two.
@@ -126,23 +140,111 @@ size_t CompactMerkleTree::AddLeafHash(const string& hash) {
   return leaf_count_;
 }
 
+size_t CompactMerkleTree::AddLeafHashes(const std::vector<Digest>& hashes) {
+  // The new complete nodes of the current level, starting with the
+  // leaves. Nodes only get added on the right, so once preceded by the
+  // lone left sibling waiting at their level (if any), they always
+  // start with a left sibling and can be hashed pairwise.
+  std::vector<Digest> nodes(hashes);
+  for (size_t level = 0; !nodes.empty(); ++level) {
+    if (tree_.size() <= level) {
+      tree_.emplace_back();
+      has_node_.push_back(false);
+    }
+    if (has_node_[level])
+      nodes.insert(nodes.begin(), tree_[level]);
+
+    const size_t pairs(nodes.size() / 2);
+    has_node_[level] = nodes.size() % 2 != 0;
+    if (has_node_[level])
+      tree_[level] = nodes.back();
+    treehasher_.HashChildrenPairs(nodes.data(), pairs, nodes.data());
+    nodes.resize(pairs);
+  }
+
+  if (!hashes.empty()) {
+    leaf_count_ += hashes.size();
+    level_count_ = 1;
+    for (size_t last_leaf = leaf_count_ - 1; last_leaf; last_leaf >>= 1)
+      ++level_count_;
+  }
+  return leaf_count_;
+}
+
 string CompactMerkleTree::CurrentRoot() {
   UpdateRoot();
   return root_;
 }
 
-void CompactMerkleTree::PushBack(size_t level, string node) {
-  assert(node.size() == treehasher_.DigestSize());
-  if (tree_.size() <= level) {
-    // First node at a new level.
-    tree_.push_back(node);
-  } else if (tree_[level].empty()) {
-    // Lone left sibling.
-    tree_[level] = node;
-  } else {
+string CompactMerkleTree::SerializeFrontier() const {
+  string frontier;
+  const uint64_t leaf_count(leaf_count_);
+  for (int shift = 56; shift >= 0; shift -= 8)
+    frontier.push_back(static_cast<char>((leaf_count >> shift) & 0xff));
+  for (size_t level = 0; level < tree_.size(); ++level) {
+    if (has_node_[level])
+      frontier.append(tree_[level].ToString());
+  }
+  return frontier;
+}
+
+bool CompactMerkleTree::LoadFrontier(const string& frontier) {
+  if (frontier.size() < 8)
+    return false;
+  uint64_t leaf_count(0);
+  for (size_t i = 0; i < 8; ++i)
+    leaf_count = (leaf_count << 8) | static_cast<uint8_t>(frontier[i]);
+  if (leaf_count > std::numeric_limits<size_t>::max() >> 1)
+    return false;
+
+  // There is a node at every level whose bit is set in the leaf count.
+  std::vector<Digest> tree;
+  std::vector<bool> has_node;
+  size_t offset(8);
+  for (uint64_t bits = leaf_count; bits != 0; bits >>= 1) {
+    has_node.push_back((bits & 1) != 0);
+    tree.emplace_back();
+    if (has_node.back()) {
+      if (frontier.size() < offset + Digest::kSize)
+        return false;
+      tree.back() = Digest(frontier.substr(offset, Digest::kSize));
+      offset += Digest::kSize;
+    }
+  }
+  if (offset != frontier.size())
+    return false;
+
+  tree_.swap(tree);
+  has_node_.swap(has_node);
+  leaf_count_ = leaf_count;
+  level_count_ = 0;
+  if (leaf_count_ > 0) {
+    level_count_ = 1;
+    for (size_t last_leaf = leaf_count_ - 1; last_leaf; last_leaf >>= 1)
+      ++level_count_;
+  }
+  leaves_processed_ = 0;
+  root_ = treehasher_.HashEmpty();
+  return true;
+}
+
+void CompactMerkleTree::PushBack(size_t level, const Digest& node) {
+  Digest carry(node);
+  for (;; ++level) {
+    if (tree_.size() <= level) {
+      // First node at a new level.
+      tree_.push_back(carry);
+      has_node_.push_back(true);
+      return;
+    } else if (!has_node_[level]) {
+      // Lone left sibling.
+      tree_[level] = carry;
+      has_node_[level] = true;
+      return;
+    }
     // Left sibling waiting: hash together and propagate up.
-    PushBack(level + 1, treehasher_.HashChildren(tree_[level], node));
-    tree_[level].clear();
+    treehasher_.HashChildren(tree_[level], carry, &carry);
+    has_node_[level] = false;
   }
 }
 
@@ -150,18 +252,21 @@ void CompactMerkleTree::UpdateRoot() {
   if (leaves_processed_ == LeafCount())
     return;
 
-  string right_sibling;
+  Digest right_sibling;
+  bool have_right_sibling(false);
 
   for (size_t level = 0; level < tree_.size(); ++level) {
-    if (!tree_[level].empty()) {
+    if (has_node_[level]) {
       // A lonely left sibling gets pulled up as a right sibling.
-      if (right_sibling.empty())
+      if (!have_right_sibling) {
         right_sibling = tree_[level];
-      else
-        right_sibling = treehasher_.HashChildren(tree_[level], right_sibling);
+        have_right_sibling = true;
+      } else {
+        treehasher_.HashChildren(tree_[level], right_sibling, &right_sibling);
+      }
     }
   }
 
-  root_ = right_sibling;
+  root_ = have_right_sibling ? right_sibling.ToString() : string();
   leaves_processed_ = LeafCount();
 }
@@ -6,6 +6,7 @@
 #include <string>
 #include <vector>
 
+#include "merkletree/digest.h"
 #include "merkletree/merkle_tree.h"
 #include "merkletree/merkle_tree_interface.h"
 #include "merkletree/tree_hasher.h"
@@ -84,6 +85,13 @@ class CompactMerkleTree : public cert_trans::MerkleTreeInterface {
   // @param hash leaf hash
   virtual size_t AddLeafHash(const std::string& hash);
 
+  // Add new leaves in bulk. Rather than cascading every leaf up the
+  // levels like AddLeafHash(), the new nodes are paired up and hashed
+  // in batches, one level at a time.
+  //
+  // Returns the number of leaves in the tree after this update.
+  virtual size_t AddLeafHashes(const std::vector<Digest>& hashes);
+
   // Get the current root of the tree.
   // Update the root to reflect the current shape of the tree,
   // and return the tree digest.
@@ -92,15 +100,30 @@ class CompactMerkleTree : public cert_trans::MerkleTreeInterface {
   // (and hence, no root).
   virtual std::string CurrentRoot();
 
+  // The frontier of the tree, i.e. its leaf count and the lone left
+  // node of each level (O(log n) hashes), which is all it takes to
+  // carry on adding leaves. The format is the leaf count, as 8 bytes
+  // big-endian, followed by the nodes from the bottom level up.
+  std::string SerializeFrontier() const;
+
+  // Replaces the contents of the tree with a frontier returned by
+  // SerializeFrontier(). Returns false, leaving the tree as it was, if
+  // |frontier| is malformed. The caller should check the resulting
+  // root against a trusted one (an STH), as the nodes cannot be
+  // checked here.
+  bool LoadFrontier(const std::string& frontier);
+
  private:
+  size_t AddLeafDigest(const Digest& hash);
+
   // Append a node to the level.
-  void PushBack(size_t level, std::string node);
+  void PushBack(size_t level, const Digest& node);
 
   void UpdateRoot();
   // Since the tree is append-only to the right, at any given point in time,
   // at each level, all nodes that have a right sibling are fixed and will
   // no longer change. Thus we store, for each level i, only the last lone
-  // left node (if one exists) or an empty string otherwise (tree_[i]).
+  // left node (tree_[i]), if one exists (as recorded in has_node_[i]).
   //
   //        ___hash___
   //       |          |
@@ -140,7 +163,8 @@ class CompactMerkleTree : public cert_trans::MerkleTreeInterface {
   // |      |      tree_[0]
   // --------
 
-  std::vector<std::string> tree_;
+  std::vector<Digest> tree_;
+  std::vector<bool> has_node_;
   TreeHasher treehasher_;
   // True number of leaves in the tree.
   size_t leaf_count_;
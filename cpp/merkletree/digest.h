@@ -0,0 +1,60 @@
+#ifndef CERT_TRANS_MERKLETREE_DIGEST_H_
+#define CERT_TRANS_MERKLETREE_DIGEST_H_
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <array>
+#include <string>
+
+// A fixed-size hash value, of the size of a SHA-256 digest (which is
+// what all the Merkle trees use). Unlike std::string, this is a plain
+// value that does not allocate, so the trees use it for the nodes
+// they compute, and only convert to std::string at their interfaces.
+class Digest {
+ public:
+  static const size_t kSize = 32;
+
+  Digest() : bytes_() {
+  }
+
+  // |bytes| must be exactly kSize bytes long.
+  explicit Digest(const std::string& bytes) {
+    assert(bytes.size() == kSize);
+    memcpy(bytes_.data(), bytes.data(), kSize);
+  }
+
+  uint8_t* data() {
+    return bytes_.data();
+  }
+
+  const uint8_t* data() const {
+    return bytes_.data();
+  }
+
+  size_t size() const {
+    return kSize;
+  }
+
+  std::string ToString() const {
+    return std::string(reinterpret_cast<const char*>(bytes_.data()), kSize);
+  }
+
+  bool operator==(const Digest& other) const {
+    return bytes_ == other.bytes_;
+  }
+
+  bool operator!=(const Digest& other) const {
+    return bytes_ != other.bytes_;
+  }
+
+ private:
+  std::array<uint8_t, kSize> bytes_;
+};
+
+// Arrays of digests are used as contiguous buffers of kSize-byte
+// nodes.
+static_assert(sizeof(Digest) == Digest::kSize, "Digest must not be padded");
+
+#endif  // CERT_TRANS_MERKLETREE_DIGEST_H_
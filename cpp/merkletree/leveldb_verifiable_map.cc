@@ -0,0 +1,394 @@
+#include "merkletree/leveldb_verifiable_map.h"
+
+#include <glog/logging.h>
+#include <leveldb/write_batch.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <array>
+
+#include "merkletree/serial_hasher.h"
+#include "util/util.h"
+
+using std::array;
+using std::copy;
+using std::map;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using util::Status;
+using util::StatusOr;
+
+namespace cert_trans {
+namespace {
+
+
+const char kNodePrefix[] = "node-";
+const char kValuePrefix[] = "value-";
+
+const char kInternalNodeType = 'I';
+const char kLeafNodeType = 'L';
+
+
+void SetPathBit(SparseMerkleTree::Path* path, size_t bit, int value) {
+  const uint8_t mask(0x80 >> (bit & 7));
+  if (value) {
+    (*path)[bit >> 3] |= mask;
+  } else {
+    (*path)[bit >> 3] &= ~mask;
+  }
+}
+
+
+}  // namespace
+
+
+// The stored form of a node of the tree. Internal nodes have the
+// hashes of their children (null ones if they have no such child).
+struct LevelDBVerifiableMap::Node {
+  Node() : leaf(false), dirty(false), has_child{false, false}, path() {
+  }
+
+  string Serialize() const {
+    string ret;
+    if (leaf) {
+      ret.push_back(kLeafNodeType);
+      ret.append(reinterpret_cast<const char*>(path.data()), path.size());
+      ret.append(reinterpret_cast<const char*>(leaf_hash.data()),
+                 leaf_hash.size());
+    } else {
+      ret.push_back(kInternalNodeType);
+      ret.push_back((has_child[0] ? 1 : 0) | (has_child[1] ? 2 : 0));
+      for (const Digest& hash : child_hash) {
+        ret.append(reinterpret_cast<const char*>(hash.data()), hash.size());
+      }
+    }
+    return ret;
+  }
+
+  bool Parse(const string& data) {
+    if (data.size() == 1 + path.size() + Digest::kSize &&
+        data[0] == kLeafNodeType) {
+      leaf = true;
+      memcpy(path.data(), data.data() + 1, path.size());
+      memcpy(leaf_hash.data(), data.data() + 1 + path.size(), Digest::kSize);
+      return true;
+    }
+    if (data.size() == 2 + 2 * Digest::kSize &&
+        data[0] == kInternalNodeType) {
+      leaf = false;
+      has_child[0] = (data[1] & 1) != 0;
+      has_child[1] = (data[1] & 2) != 0;
+      memcpy(child_hash[0].data(), data.data() + 2, Digest::kSize);
+      memcpy(child_hash[1].data(), data.data() + 2 + Digest::kSize,
+             Digest::kSize);
+      return true;
+    }
+    return false;
+  }
+
+  bool leaf;
+  // Whether the node was modified by the updates being applied, and
+  // needs to be rehashed and written back. Not stored.
+  bool dirty;
+
+  // For internal nodes.
+  bool has_child[2];
+  Digest child_hash[2];
+
+  // For leaves.
+  Path path;
+  Digest leaf_hash;
+};
+
+
+LevelDBVerifiableMap::LevelDBVerifiableMap(SerialHasher* hasher,
+                                           leveldb::DB* db,
+                                           const string& key_prefix)
+    : hasher_model_(CHECK_NOTNULL(hasher)->Create()),
+      treehasher_(unique_ptr<SerialHasher>(hasher)),
+      db_(CHECK_NOTNULL(db)),
+      key_prefix_(key_prefix) {
+  CHECK_EQ(Digest::kSize, treehasher_.DigestSize());
+  for (const auto& null_hash : *GetNullHashes(treehasher_)) {
+    null_nodes_.emplace_back(null_hash);
+  }
+
+  Node root;
+  if (!ReadNode(NodeKey(0, Path()), &root)) {
+    root.child_hash[0] = root.child_hash[1] = null_nodes_[0];
+  }
+  CHECK(!root.leaf);
+  Digest root_hash;
+  treehasher_.HashChildren(root.child_hash[0], root.child_hash[1],
+                           &root_hash);
+  root_ = root_hash.ToString();
+}
+
+
+LevelDBVerifiableMap::~LevelDBVerifiableMap() {
+}
+
+
+string LevelDBVerifiableMap::CurrentRoot() {
+  ApplyPending();
+  return root_;
+}
+
+
+void LevelDBVerifiableMap::Set(const string& key, const string& value) {
+  pending_[PathFromKey(key)] = value;
+}
+
+
+StatusOr<string> LevelDBVerifiableMap::Get(const string& key) const {
+  const Path path(PathFromKey(key));
+  const auto it(pending_.find(path));
+  if (it != pending_.end()) {
+    return it->second;
+  }
+
+  string value;
+  const leveldb::Status status(
+      db_->Get(leveldb::ReadOptions(), ValueKey(path), &value));
+  if (status.IsNotFound()) {
+    return Status(util::error::NOT_FOUND, "No such entry.");
+  }
+  CHECK(status.ok()) << status.ToString();
+  return value;
+}
+
+
+vector<string> LevelDBVerifiableMap::InclusionProof(const string& key) {
+  ApplyPending();
+  const Path path(PathFromKey(key));
+
+  // |siblings[i]| is the sibling of the node at depth i + 1 along |path|,
+  // which is null unless we find otherwise on the way down.
+  array<Digest, SparseMerkleTree::kDigestSizeBits> siblings;
+  copy(null_nodes_.begin(), null_nodes_.end(), siblings.begin());
+
+  Node node;
+  if (ReadNode(NodeKey(0, path), &node)) {
+    for (size_t depth(0); depth < siblings.size(); ++depth) {
+      const int bit(PathBit(path, depth));
+      if (node.has_child[1 - bit]) {
+        siblings[depth] = node.child_hash[1 - bit];
+      }
+      if (!node.has_child[bit]) {
+        break;
+      }
+
+      CHECK(ReadNode(NodeKey(depth + 1, path), &node))
+          << "missing child at depth " << depth + 1 << " along " << path;
+      if (!node.leaf) {
+        continue;
+      }
+
+      if (node.path != path) {
+        // Were |path| set, this leaf would be pushed down to where their
+        // paths diverge, as the sibling of the node along |path| there.
+        const size_t diverge(FirstDifferingBit(node.path, path, depth + 1));
+        CHECK_LT(diverge, siblings.size());
+        HashUpFromLeaf(node.path, node.leaf_hash, diverge + 1,
+                       &siblings[diverge]);
+      }
+      break;
+    }
+  }
+
+  vector<string> proof;
+  proof.reserve(siblings.size());
+  for (auto it(siblings.rbegin()); it != siblings.rend(); ++it) {
+    proof.emplace_back(it->ToString());
+  }
+  return proof;
+}
+
+
+SparseMerkleTree::Path LevelDBVerifiableMap::PathFromKey(
+    const string& key) const {
+  unique_ptr<SerialHasher> h(hasher_model_->Create());
+  h->Update(key);
+  return PathFromBytes(h->Final());
+}
+
+
+void LevelDBVerifiableMap::ApplyPending() {
+  if (pending_.empty()) {
+    return;
+  }
+
+  NodeMap nodes;
+  leveldb::WriteBatch batch;
+  const string root_key(NodeKey(0, Path()));
+  if (!LoadNode(root_key, &nodes)) {
+    // An empty tree.
+    nodes[root_key] = Node();
+  }
+
+  // Same as SparseMerkleTree::SetLeaf(), on the nodes along the paths.
+  for (const auto& update : pending_) {
+    const Path& path(update.first);
+    Digest leaf_hash;
+    treehasher_.HashLeaf(reinterpret_cast<const uint8_t*>(
+                             update.second.data()),
+                         update.second.size(), &leaf_hash);
+    batch.Put(ValueKey(path), update.second);
+
+    // Pointers into |nodes| remain valid as it grows.
+    Node* node(&nodes[root_key]);
+    for (size_t depth(0); depth < SparseMerkleTree::kDigestSizeBits;
+         ++depth) {
+      node->dirty = true;
+      const int bit(PathBit(path, depth));
+      const string child_key(NodeKey(depth + 1, path));
+      if (!node->has_child[bit]) {
+        node->has_child[bit] = true;
+        Node& leaf(nodes[child_key]);
+        leaf = Node();
+        leaf.leaf = true;
+        leaf.dirty = true;
+        leaf.path = path;
+        leaf.leaf_hash = leaf_hash;
+        break;
+      }
+
+      Node* const child(LoadNode(child_key, &nodes));
+      CHECK(child) << "missing child at depth " << depth + 1 << " along "
+                   << path;
+      if (!child->leaf) {
+        node = child;
+        continue;
+      }
+      if (child->path == path) {
+        // replacement
+        child->leaf_hash = leaf_hash;
+        child->dirty = true;
+        break;
+      }
+
+      // restructure: push the existing leaf down a level and replace it
+      // with an internal node
+      CHECK_LT(depth + 1,
+               static_cast<size_t>(SparseMerkleTree::kDigestSizeBits));
+      Node& moved(nodes[NodeKey(depth + 2, child->path)]);
+      moved = *child;
+      moved.dirty = true;
+      const int moved_bit(PathBit(moved.path, depth + 1));
+      *child = Node();
+      child->dirty = true;
+      child->has_child[moved_bit] = true;
+      node = child;
+    }
+  }
+
+  root_ = RehashNode(0, Path(), &nodes, &batch).ToString();
+  const leveldb::Status status(db_->Write(leveldb::WriteOptions(), &batch));
+  CHECK(status.ok()) << status.ToString();
+  pending_.clear();
+}
+
+
+string LevelDBVerifiableMap::NodeKey(size_t depth, const Path& path) const {
+  CHECK_LE(depth, path.size() * 8);
+  string key(key_prefix_ + kNodePrefix);
+  // The first |depth| bits of |path|, with the others cleared, which
+  // keeps the nodes along a path close together. The depth comes last,
+  // but the length of the key makes it unambiguous.
+  const size_t num_bytes((depth + 7) / 8);
+  key.append(reinterpret_cast<const char*>(path.data()), num_bytes);
+  if (depth % 8 != 0) {
+    key.back() &= static_cast<char>(0xff << (8 - depth % 8));
+  }
+  key.push_back(static_cast<char>(depth >> 8));
+  key.push_back(static_cast<char>(depth & 0xff));
+  return key;
+}
+
+
+string LevelDBVerifiableMap::ValueKey(const Path& path) const {
+  return key_prefix_ + kValuePrefix +
+         string(reinterpret_cast<const char*>(path.data()), path.size());
+}
+
+
+bool LevelDBVerifiableMap::ReadNode(const string& key, Node* node) const {
+  string data;
+  const leveldb::Status status(db_->Get(leveldb::ReadOptions(), key, &data));
+  if (status.IsNotFound()) {
+    return false;
+  }
+  CHECK(status.ok()) << status.ToString();
+  CHECK(node->Parse(data)) << "corrupt node " << util::HexString(key);
+  return true;
+}
+
+
+LevelDBVerifiableMap::Node* LevelDBVerifiableMap::LoadNode(
+    const string& key, NodeMap* nodes) const {
+  const auto it(nodes->find(key));
+  if (it != nodes->end()) {
+    return &it->second;
+  }
+
+  Node node;
+  if (!ReadNode(key, &node)) {
+    return NULL;
+  }
+  Node* const loaded(&(*nodes)[key]);
+  *loaded = node;
+  return loaded;
+}
+
+
+Digest LevelDBVerifiableMap::RehashNode(size_t depth, const Path& path,
+                                        NodeMap* nodes,
+                                        leveldb::WriteBatch* batch) {
+  const string key(NodeKey(depth, path));
+  Node& node(nodes->at(key));
+  CHECK(node.dirty);
+
+  Digest hash;
+  if (node.leaf) {
+    HashUpFromLeaf(node.path, node.leaf_hash, depth, &hash);
+  } else {
+    for (int side(0); side < 2; ++side) {
+      if (!node.has_child[side]) {
+        node.child_hash[side] = null_nodes_[depth];
+        continue;
+      }
+      // Children that were not touched keep their hash.
+      Path child_path(path);
+      SetPathBit(&child_path, depth, side);
+      const auto child(nodes->find(NodeKey(depth + 1, child_path)));
+      if (child != nodes->end() && child->second.dirty) {
+        node.child_hash[side] =
+            RehashNode(depth + 1, child_path, nodes, batch);
+      }
+    }
+    treehasher_.HashChildren(node.child_hash[0], node.child_hash[1], &hash);
+  }
+
+  batch->Put(key, node.Serialize());
+  node.dirty = false;
+  return hash;
+}
+
+
+void LevelDBVerifiableMap::HashUpFromLeaf(const Path& path,
+                                          const Digest& leaf_hash,
+                                          size_t depth, Digest* hash) const {
+  CHECK_LT(0U, depth);
+  *hash = leaf_hash;
+  for (size_t i(SparseMerkleTree::kDigestSizeBits - 1); i >= depth; --i) {
+    if (PathBit(path, i) == 0) {
+      treehasher_.HashChildren(*hash, null_nodes_[i], hash);
+    } else {
+      treehasher_.HashChildren(null_nodes_[i], *hash, hash);
+    }
+  }
+}
+
+
+}  // namespace cert_trans
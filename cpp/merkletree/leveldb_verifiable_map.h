@@ -0,0 +1,105 @@
+#ifndef CERT_TRANS_MERKLETREE_LEVELDB_VERIFIABLE_MAP_H_
+#define CERT_TRANS_MERKLETREE_LEVELDB_VERIFIABLE_MAP_H_
+
+#include <leveldb/db.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "base/macros.h"
+#include "merkletree/digest.h"
+#include "merkletree/sparse_merkle_tree.h"
+#include "merkletree/tree_hasher.h"
+#include "util/statusor.h"
+
+namespace leveldb {
+class WriteBatch;
+}  // namespace leveldb
+
+namespace cert_trans {
+
+
+// Same as VerifiableMap, but with the values and the nodes of the
+// sparse Merkle tree kept in LevelDB (under keys starting with a given
+// prefix), so that the map can be much larger than memory and survives
+// restarts.
+//
+// The tree has the same shape, and so the same roots and proofs, as a
+// SparseMerkleTree: a leaf is stored at the first node along its path
+// that has no other leaf below it. Every internal node is stored along
+// with the hashes of its two children, so that InclusionProof() only
+// reads the nodes along one path.
+//
+// Set() only buffers the update. The next CurrentRoot() or
+// InclusionProof() applies all the pending updates at once, reading
+// and rewriting every node along their paths once, however many of
+// the updates go through it, in a single (atomic) write batch.
+//
+// This class is thread-compatible, but not thread-safe.
+class LevelDBVerifiableMap {
+ public:
+  // Takes ownership of |hasher|. Does not take ownership of |db|, which
+  // must outlive this object, and must not be written to under
+  // |key_prefix| by anything else.
+  LevelDBVerifiableMap(SerialHasher* hasher, leveldb::DB* db,
+                       const std::string& key_prefix);
+  ~LevelDBVerifiableMap();
+
+  std::string CurrentRoot();
+
+  void Set(const std::string& key, const std::string& value);
+
+  util::StatusOr<std::string> Get(const std::string& key) const;
+
+  std::vector<std::string> InclusionProof(const std::string& key);
+
+ private:
+  typedef SparseMerkleTree::Path Path;
+  struct Node;
+  // The nodes read or written while applying a batch of updates, by
+  // key.
+  typedef std::map<std::string, Node> NodeMap;
+
+  SparseMerkleTree::Path PathFromKey(const std::string& key) const;
+
+  // Writes the updates in |pending_| to the database.
+  void ApplyPending();
+
+  // The key of the node at |depth| bits from the root along |path|.
+  std::string NodeKey(size_t depth, const Path& path) const;
+  std::string ValueKey(const Path& path) const;
+
+  // Returns false if there is no such node in the database.
+  bool ReadNode(const std::string& key, Node* node) const;
+  // Returns the node for |key| in |nodes|, reading it from the
+  // database if needed, or NULL if there is no such node.
+  Node* LoadNode(const std::string& key, NodeMap* nodes) const;
+  // Recomputes the hash of the dirty node at |depth| along |path|
+  // (and of its dirty descendants), adding them to |batch|.
+  Digest RehashNode(size_t depth, const Path& path, NodeMap* nodes,
+                    leveldb::WriteBatch* batch);
+  // The hash of a subtree at |depth| containing only |leaf_hash| at
+  // |path|, into |hash|.
+  void HashUpFromLeaf(const Path& path, const Digest& leaf_hash, size_t depth,
+                      Digest* hash) const;
+
+  const std::unique_ptr<SerialHasher> hasher_model_;
+  const TreeHasher treehasher_;
+  std::vector<Digest> null_nodes_;
+  leveldb::DB* const db_;
+  const std::string key_prefix_;
+
+  // The updates not written yet, in path order, so that the updates
+  // sharing a prefix are applied one after the other.
+  std::map<Path, std::string> pending_;
+  // As of the last time |pending_| was applied.
+  std::string root_;
+
+  DISALLOW_COPY_AND_ASSIGN(LevelDBVerifiableMap);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_MERKLETREE_LEVELDB_VERIFIABLE_MAP_H_
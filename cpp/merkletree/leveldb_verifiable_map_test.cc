@@ -0,0 +1,143 @@
+#include "merkletree/leveldb_verifiable_map.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <leveldb/db.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "merkletree/serial_hasher.h"
+#include "merkletree/verifiable_map.h"
+#include "util/status_test_util.h"
+#include "util/test_db.h"
+#include "util/testing.h"
+#include "util/util.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+using util::StatusOr;
+using util::testing::StatusIs;
+using util::ToBase64;
+
+
+class LevelDBVerifiableMapTest : public testing::Test {
+ public:
+  LevelDBVerifiableMapTest() : reference_(new Sha256Hasher) {
+    leveldb::Options options;
+    options.create_if_missing = true;
+    leveldb::DB* db;
+    const leveldb::Status status(
+        leveldb::DB::Open(options, tmp_.TmpStorageDir() + "/map", &db));
+    CHECK(status.ok()) << status.ToString();
+    db_.reset(db);
+  }
+
+ protected:
+  unique_ptr<LevelDBVerifiableMap> NewMap(const string& prefix) {
+    return unique_ptr<LevelDBVerifiableMap>(
+        new LevelDBVerifiableMap(new Sha256Hasher, db_.get(), prefix));
+  }
+
+  // Sets keys |begin| to |end| (excluded) in both |map| and
+  // |reference_|.
+  void Set(int begin, int end, LevelDBVerifiableMap* map) {
+    for (int i(begin); i < end; ++i) {
+      // The odd key is set more than once.
+      const string key(to_string(i % 7 == 0 ? i / 2 : i));
+      const string value("value" + to_string(i));
+      map->Set(key, value);
+      reference_.Set(key, value);
+    }
+  }
+
+  void ExpectSameAsReference(int num_keys, LevelDBVerifiableMap* map) {
+    EXPECT_EQ(ToBase64(reference_.CurrentRoot()),
+              ToBase64(map->CurrentRoot()));
+    // Including a few keys that are not set.
+    for (int i(0); i < num_keys + 10; ++i) {
+      const string key(to_string(i));
+      EXPECT_EQ(reference_.InclusionProof(key), map->InclusionProof(key))
+          << key;
+      const StatusOr<string> expected(reference_.Get(key));
+      const StatusOr<string> value(map->Get(key));
+      EXPECT_EQ(expected.ok(), value.ok()) << key;
+      if (expected.ok() && value.ok()) {
+        EXPECT_EQ(expected.ValueOrDie(), value.ValueOrDie());
+      }
+    }
+  }
+
+  TmpStorage tmp_;
+  unique_ptr<leveldb::DB> db_;
+  VerifiableMap reference_;
+};
+
+
+TEST_F(LevelDBVerifiableMapTest, Empty) {
+  const unique_ptr<LevelDBVerifiableMap> map(NewMap("map-"));
+  EXPECT_EQ(ToBase64(reference_.CurrentRoot()),
+            ToBase64(map->CurrentRoot()));
+  EXPECT_THAT(map->Get("unknown_key").status(),
+              StatusIs(util::error::NOT_FOUND));
+  EXPECT_EQ(reference_.InclusionProof("unknown_key"),
+            map->InclusionProof("unknown_key"));
+}
+
+
+TEST_F(LevelDBVerifiableMapTest, BatchedUpdates) {
+  const unique_ptr<LevelDBVerifiableMap> map(NewMap("map-"));
+  Set(0, 1, map.get());
+  ExpectSameAsReference(1, map.get());
+  Set(1, 100, map.get());
+  ExpectSameAsReference(100, map.get());
+  // Pending updates are visible before they are applied.
+  map->Set("pending", "value");
+  EXPECT_EQ("value", map->Get("pending").ValueOrDie());
+  reference_.Set("pending", "value");
+  Set(100, 300, map.get());
+  ExpectSameAsReference(300, map.get());
+}
+
+
+TEST_F(LevelDBVerifiableMapTest, Resumes) {
+  string root;
+  {
+    const unique_ptr<LevelDBVerifiableMap> map(NewMap("map-"));
+    Set(0, 100, map.get());
+    root = map->CurrentRoot();
+  }
+
+  const unique_ptr<LevelDBVerifiableMap> map(NewMap("map-"));
+  EXPECT_EQ(ToBase64(root), ToBase64(map->CurrentRoot()));
+  ExpectSameAsReference(100, map.get());
+  Set(100, 150, map.get());
+  ExpectSameAsReference(150, map.get());
+}
+
+
+TEST_F(LevelDBVerifiableMapTest, SeparatePrefixes) {
+  const unique_ptr<LevelDBVerifiableMap> map(NewMap("map-"));
+  const unique_ptr<LevelDBVerifiableMap> other(NewMap("other-"));
+  Set(0, 50, map.get());
+  other->Set("other", "value");
+  ExpectSameAsReference(50, map.get());
+  EXPECT_THAT(map->Get("other").status(), StatusIs(util::error::NOT_FOUND));
+  EXPECT_THAT(other->Get("1").status(), StatusIs(util::error::NOT_FOUND));
+  EXPECT_NE(ToBase64(map->CurrentRoot()), ToBase64(other->CurrentRoot()));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,74 @@
+#include "merkletree/merkle_node_store.h"
+
+#include <assert.h>
+#include <string.h>
+
+using std::string;
+
+namespace cert_trans {
+
+
+InMemoryNodeStore::InMemoryNodeStore(size_t node_size)
+    : node_size_(node_size), leaves_processed_(0) {
+  assert(node_size_ > 0);
+}
+
+
+void InMemoryNodeStore::AddLevel() {
+  levels_.push_back(Level());
+  // A level holds about half the nodes of the one below, reserving it
+  // up front spares the new level the copies of growing to that size.
+  if (levels_.size() > 1)
+    levels_.back().reserve(levels_[levels_.size() - 2].size() / 2);
+}
+
+
+void InMemoryNodeStore::RemoveLevel() {
+  assert(!levels_.empty());
+  levels_.pop_back();
+}
+
+
+size_t InMemoryNodeStore::NodeCount(size_t level) const {
+  assert(level < levels_.size());
+  return levels_[level].size() / node_size_;
+}
+
+
+string InMemoryNodeStore::Node(size_t level, size_t index) const {
+  assert(NodeCount(level) > index);
+  return string(levels_[level].data() + index * node_size_, node_size_);
+}
+
+
+void InMemoryNodeStore::CopyNodes(size_t level, size_t index, size_t count,
+                                  uint8_t* nodes) const {
+  assert(NodeCount(level) >= index + count);
+  memcpy(nodes, levels_[level].data() + index * node_size_,
+         count * node_size_);
+}
+
+
+void InMemoryNodeStore::PushBack(size_t level, const string& node) {
+  assert(node.size() == node_size_);
+  assert(level < levels_.size());
+  levels_[level].insert(levels_[level].end(), node.begin(), node.end());
+}
+
+
+void InMemoryNodeStore::PushBack(size_t level, const uint8_t* nodes,
+                                 size_t count) {
+  assert(level < levels_.size());
+  const char* const begin(reinterpret_cast<const char*>(nodes));
+  levels_[level].insert(levels_[level].end(), begin,
+                        begin + count * node_size_);
+}
+
+
+void InMemoryNodeStore::PopBack(size_t level) {
+  assert(NodeCount(level) >= 1U);
+  levels_[level].resize(levels_[level].size() - node_size_);
+}
+
+
+}  // namespace cert_trans
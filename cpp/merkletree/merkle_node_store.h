@@ -0,0 +1,125 @@
+#ifndef CERT_TRANS_MERKLETREE_MERKLE_NODE_STORE_H_
+#define CERT_TRANS_MERKLETREE_MERKLE_NODE_STORE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "base/macros.h"
+#include "util/huge_page_allocator.h"
+
+namespace cert_trans {
+
+
+// Storage for the nodes of a MerkleTree, organized in levels (level 0
+// being the leaves), each level being an append-only (at the right)
+// array of fixed-size nodes. See merkletree/merkle_tree.h for how the
+// levels are used.
+//
+// Implementations do not need to be thread-safe, MerkleTree is only
+// thread-compatible itself.
+class MerkleNodeStore {
+ public:
+  virtual ~MerkleNodeStore() = default;
+
+  // Size of every node, in bytes.
+  virtual size_t NodeSize() const = 0;
+
+  // Number of levels currently allocated.
+  virtual size_t LevelCount() const = 0;
+
+  // Start a new (empty) level on top of the existing ones.
+  virtual void AddLevel() = 0;
+
+  // Discard the topmost level, and all its nodes.
+  virtual void RemoveLevel() = 0;
+
+  // Number of nodes at |level|, which must be less than LevelCount().
+  virtual size_t NodeCount(size_t level) const = 0;
+
+  // Return the |index|-th node of |level|. Indexing starts at 0; the
+  // caller must ensure that the node exists.
+  virtual std::string Node(size_t level, size_t index) const = 0;
+  // Same as above, but copy |count| consecutive nodes (of NodeSize()
+  // bytes each), starting with the |index|-th one, to |nodes|, without
+  // allocating.
+  virtual void CopyNodes(size_t level, size_t index, size_t count,
+                         uint8_t* nodes) const = 0;
+
+  // Append a node (of size NodeSize()) to |level|.
+  virtual void PushBack(size_t level, const std::string& node) = 0;
+  // Same as above, for |count| nodes stored back to back at |nodes|.
+  virtual void PushBack(size_t level, const uint8_t* nodes, size_t count) = 0;
+
+  // Remove the last node of |level|, which must not be empty.
+  virtual void PopBack(size_t level) = 0;
+
+  // Number of leaves that have been propagated up the levels, as last
+  // recorded by SetLeavesProcessed(). This is kept with the nodes so
+  // that a persistent store can be resumed; it is only made durable by
+  // Sync(), after the nodes.
+  virtual size_t LeavesProcessed() const = 0;
+  virtual void SetLeavesProcessed(size_t leaves_processed) = 0;
+
+  // Make sure that everything written so far is durable. A no-op for
+  // non-persistent implementations.
+  virtual void Sync() = 0;
+
+ protected:
+  MerkleNodeStore() = default;
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(MerkleNodeStore);
+};
+
+
+// Keeps all the nodes in memory, each level as one contiguous array
+// (backed by huge pages if --huge_pages says so).
+class InMemoryNodeStore : public MerkleNodeStore {
+ public:
+  explicit InMemoryNodeStore(size_t node_size);
+
+  size_t NodeSize() const override {
+    return node_size_;
+  }
+
+  size_t LevelCount() const override {
+    return levels_.size();
+  }
+
+  void AddLevel() override;
+  void RemoveLevel() override;
+  size_t NodeCount(size_t level) const override;
+  std::string Node(size_t level, size_t index) const override;
+  void CopyNodes(size_t level, size_t index, size_t count,
+                 uint8_t* nodes) const override;
+  void PushBack(size_t level, const std::string& node) override;
+  void PushBack(size_t level, const uint8_t* nodes, size_t count) override;
+  void PopBack(size_t level) override;
+
+  size_t LeavesProcessed() const override {
+    return leaves_processed_;
+  }
+
+  void SetLeavesProcessed(size_t leaves_processed) override {
+    leaves_processed_ = leaves_processed;
+  }
+
+  void Sync() override {
+  }
+
+ private:
+  typedef std::vector<char, HugePageAllocator<char>> Level;
+
+  const size_t node_size_;
+  std::vector<Level> levels_;
+  size_t leaves_processed_;
+
+  DISALLOW_COPY_AND_ASSIGN(InMemoryNodeStore);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_MERKLETREE_MERKLE_NODE_STORE_H_
@@ -1,36 +1,89 @@
 #include "merkletree/merkle_tree.h"
 
 #include <assert.h>
+#include <glog/logging.h>
 #include <stddef.h>
+#include <algorithm>
 #include <string>
 #include <vector>
 
 #include "merkletree/merkle_tree_math.h"
 
+using cert_trans::InMemoryNodeStore;
+using cert_trans::MerkleNodeStore;
 using cert_trans::MerkleTreeInterface;
+using std::min;
 using std::move;
 using std::string;
 using std::unique_ptr;
 
+namespace {
+
+// Number of pairs of nodes hashed together, when updating the tree.
+const size_t kHashBatchSize = 256;
+
+// A tree with n > 0 leaves has ceil(log2(n)) + 1 levels.
+size_t LevelsForLeaves(size_t leaf_count) {
+  size_t levels = 1;
+  for (size_t last_node = leaf_count - 1; last_node; last_node >>= 1)
+    ++levels;
+  return levels;
+}
+
+std::vector<string> ToStrings(const std::vector<Digest>& digests) {
+  std::vector<string> strings;
+  strings.reserve(digests.size());
+  for (const Digest& digest : digests)
+    strings.push_back(digest.ToString());
+  return strings;
+}
+
+}  // namespace
+
 MerkleTree::MerkleTree(unique_ptr<SerialHasher> hasher)
     : MerkleTreeInterface(),
+      // |tree_| is initialized before |treehasher_|, so |hasher| is
+      // still ours here.
+      tree_(new InMemoryNodeStore(hasher->DigestSize())),
+      treehasher_(move(hasher)),
+      leaves_processed_(0),
+      level_count_(0) {
+  assert(treehasher_.DigestSize() == Digest::kSize);
+}
+
+MerkleTree::MerkleTree(unique_ptr<SerialHasher> hasher,
+                       unique_ptr<MerkleNodeStore> store)
+    : MerkleTreeInterface(),
+      tree_(move(store)),
       treehasher_(move(hasher)),
       leaves_processed_(0),
       level_count_(0) {
+  assert(tree_);
+  assert(treehasher_.DigestSize() == Digest::kSize);
+  assert(tree_->NodeSize() == treehasher_.DigestSize());
+  LoadFromStore();
 }
 
 MerkleTree::~MerkleTree() {
 }
 
 size_t MerkleTree::AddLeaf(const string& data) {
-  return AddLeafHash(treehasher_.HashLeaf(data));
+  Digest hash;
+  treehasher_.HashLeaf(reinterpret_cast<const uint8_t*>(data.data()),
+                       data.size(), &hash);
+  return AddLeafDigest(hash);
 }
 
 size_t MerkleTree::AddLeafHash(const string& hash) {
+  return AddLeafDigest(Digest(hash));
+}
+
+size_t MerkleTree::AddLeafDigest(const Digest& hash) {
   if (LazyLevelCount() == 0) {
     AddLevel();
     // The first leaf hash is also the first root.
     leaves_processed_ = 1;
+    tree_->SetLeavesProcessed(leaves_processed_);
   }
   PushBack(0, hash);
   size_t leaf_count = LeafCount();
@@ -43,6 +96,71 @@ size_t MerkleTree::AddLeafHash(const string& hash) {
   return leaf_count;
 }
 
+size_t MerkleTree::AddLeafHashes(const std::vector<Digest>& hashes) {
+  if (hashes.empty())
+    return LeafCount();
+  if (LazyLevelCount() == 0) {
+    AddLevel();
+    // The first leaf hash is also the first root.
+    leaves_processed_ = 1;
+    tree_->SetLeavesProcessed(leaves_processed_);
+  }
+  tree_->PushBack(0, hashes[0].data(), hashes.size());
+  const size_t leaf_count(LeafCount());
+  level_count_ = LevelsForLeaves(leaf_count);
+  return leaf_count;
+}
+
+void MerkleTree::Truncate(size_t leaf_count) {
+  if (leaf_count >= LeafCount())
+    return;
+
+  if (leaf_count == 0) {
+    while (LazyLevelCount() > 0)
+      tree_->RemoveLevel();
+    leaves_processed_ = 0;
+    level_count_ = 0;
+    tree_->SetLeavesProcessed(leaves_processed_);
+    return;
+  }
+
+  while (NodeCount(0) > leaf_count)
+    PopBack(0);
+  level_count_ = LevelsForLeaves(leaf_count);
+
+  if (leaves_processed_ <= leaf_count)
+    // The interior nodes only cover leaves we are keeping.
+    return;
+
+  // Drop the levels above the new root, and recompute the rightmost
+  // node of every remaining level, which may have covered discarded
+  // leaves.
+  while (LazyLevelCount() > level_count_)
+    tree_->RemoveLevel();
+  RecomputeLastNodes(leaf_count);
+
+  leaves_processed_ = leaf_count;
+  tree_->SetLeavesProcessed(leaves_processed_);
+}
+
+void MerkleTree::RecomputeLastNodes(size_t leaf_count) {
+  size_t last_node = leaf_count - 1;
+  for (size_t level = 1; level < LazyLevelCount(); ++level) {
+    const size_t child = last_node;
+    last_node = MerkleTreeMath::Parent(last_node);
+    while (NodeCount(level) > last_node)
+      PopBack(level);
+    if (MerkleTreeMath::IsRightChild(child)) {
+      Digest parent;
+      treehasher_.HashChildren(Node(level - 1, child - 1),
+                               Node(level - 1, child), &parent);
+      PushBack(level, parent);
+    } else {
+      PushBack(level, Node(level - 1, child));
+    }
+  }
+}
+
 string MerkleTree::CurrentRoot() {
   return RootAtSnapshot(LeafCount());
 }
@@ -56,7 +174,7 @@ string MerkleTree::RootAtSnapshot(size_t snapshot) {
   if (snapshot >= leaves_processed_)
     return UpdateToSnapshot(snapshot);
   // snapshot < leaves_processed_: recompute the snapshot root.
-  return RecomputePastSnapshot(snapshot, 0, NULL);
+  return RecomputePastSnapshot(snapshot, 0, NULL).ToString();
 }
 
 std::vector<string> MerkleTree::PathToCurrentRoot(size_t leaf) {
@@ -65,19 +183,33 @@ std::vector<string> MerkleTree::PathToCurrentRoot(size_t leaf) {
 
 std::vector<string> MerkleTree::PathToRootAtSnapshot(size_t leaf,
                                                      size_t snapshot) {
-  std::vector<string> path;
+  std::vector<Digest> path;
+  PathToRootAtSnapshot(leaf, snapshot, &path);
+  return ToStrings(path);
+}
+
+void MerkleTree::PathToRootAtSnapshot(size_t leaf, size_t snapshot,
+                                      std::vector<Digest>* path) {
+  path->clear();
   size_t leaf_count = LeafCount();
   if (leaf > snapshot || snapshot > leaf_count || leaf == 0)
-    return path;
-  return PathFromNodeToRootAtSnapshot(leaf - 1, 0, snapshot);
+    return;
+  PathFromNodeToRootAtSnapshot(leaf - 1, 0, snapshot, path);
 }
 
 std::vector<string> MerkleTree::SnapshotConsistency(size_t snapshot1,
                                                     size_t snapshot2) {
-  std::vector<string> proof;
+  std::vector<Digest> proof;
+  SnapshotConsistency(snapshot1, snapshot2, &proof);
+  return ToStrings(proof);
+}
+
+void MerkleTree::SnapshotConsistency(size_t snapshot1, size_t snapshot2,
+                                     std::vector<Digest>* proof) {
+  proof->clear();
   size_t leaf_count = LeafCount();
   if (snapshot1 == 0 || snapshot1 >= snapshot2 || snapshot2 > leaf_count)
-    return proof;
+    return;
 
   size_t level = 0;
   // Rightmost node in snapshot1.
@@ -96,22 +228,19 @@ std::vector<string> MerkleTree::SnapshotConsistency(size_t snapshot1,
 
   // Record the node, unless we already reached the root of snapshot1.
   if (node)
-    proof.push_back(Node(level, node));
+    proof->push_back(Node(level, node));
 
   // Now record the path from this node to the root of snapshot2.
-  std::vector<string> path =
-      PathFromNodeToRootAtSnapshot(node, level, snapshot2);
-  proof.insert(proof.end(), path.begin(), path.end());
-  return proof;
+  PathFromNodeToRootAtSnapshot(node, level, snapshot2, proof);
 }
 
 string MerkleTree::UpdateToSnapshot(size_t snapshot) {
   if (snapshot == 0)
     return treehasher_.HashEmpty();
   if (snapshot == 1)
-    return Node(0, 0);
+    return Node(0, 0).ToString();
   if (snapshot == leaves_processed_)
-    return Root();
+    return Root().ToString();
   assert(snapshot <= LeafCount());
   assert(snapshot > leaves_processed_);
 
@@ -122,6 +251,7 @@ string MerkleTree::UpdateToSnapshot(size_t snapshot) {
   // Index of the last node.
   size_t last_node = snapshot - 1;
 
+  std::vector<Digest> nodes;
   // Process level-by-level until we converge to a single node.
   // (first_node, last_node) = (0, 0) means we have reached the root level.
   while (last_node) {
@@ -134,11 +264,17 @@ string MerkleTree::UpdateToSnapshot(size_t snapshot) {
       PopBack(level + 1);
     }
 
-    // Compute the parents of new nodes at the current level.
-    // Start with a left sibling and parse an even number of nodes.
-    for (size_t j = first_node & ~1; j < last_node; j += 2) {
-      PushBack(level + 1,
-               treehasher_.HashChildren(Node(level, j), Node(level, j + 1)));
+    // Compute the parents of new nodes at the current level, in
+    // batches. Start with a left sibling and parse an even number of
+    // nodes.
+    for (size_t j = first_node & ~1; j < last_node;) {
+      const size_t pairs(min(kHashBatchSize, (last_node - j + 1) / 2));
+      nodes.resize(2 * pairs);
+      tree_->CopyNodes(level, j, 2 * pairs, nodes[0].data());
+      treehasher_.HashChildrenPairs(nodes.data(), pairs, nodes.data());
+      assert(LazyLevelCount() > level + 1);
+      tree_->PushBack(level + 1, nodes[0].data(), pairs);
+      j += 2 * pairs;
     }
     // If the last node at the current level is a left sibling,
     // dummy-propagate it one level up.
@@ -151,11 +287,12 @@ string MerkleTree::UpdateToSnapshot(size_t snapshot) {
   };
 
   leaves_processed_ = snapshot;
-  return Root();
+  tree_->SetLeavesProcessed(leaves_processed_);
+  return Root().ToString();
 }
 
-string MerkleTree::RecomputePastSnapshot(size_t snapshot, size_t node_level,
-                                         string* node) {
+Digest MerkleTree::RecomputePastSnapshot(size_t snapshot, size_t node_level,
+                                         Digest* node) {
   size_t level = 0;
   // Index of the rightmost node at the current level for this snapshot.
   size_t last_node = snapshot - 1;
@@ -164,10 +301,10 @@ string MerkleTree::RecomputePastSnapshot(size_t snapshot, size_t node_level,
     // Nothing to recompute.
     if (node && LazyLevelCount() > node_level) {
       if (node_level > 0) {
-        node->assign(LastNode(node_level));
+        *node = LastNode(node_level);
       } else {
         // Leaf level: grab the last processed leaf.
-        node->assign(Node(node_level, last_node));
+        *node = Node(node_level, last_node);
       }
     }
     return Root();
@@ -178,7 +315,7 @@ string MerkleTree::RecomputePastSnapshot(size_t snapshot, size_t node_level,
   // Recompute nodes on the path of the last leaf.
   while (MerkleTreeMath::IsRightChild(last_node)) {
     if (node && node_level == level)
-      node->assign(Node(level, last_node));
+      *node = Node(level, last_node);
     // Left sibling and parent exist in the snapshot, and are equal to
     // those in the tree; no need to rehash, move one level up.
     last_node = MerkleTreeMath::Parent(last_node);
@@ -187,38 +324,37 @@ string MerkleTree::RecomputePastSnapshot(size_t snapshot, size_t node_level,
 
   // Now last_node is the index of a left sibling with no right sibling.
   // Record the node.
-  string subtree_root = Node(level, last_node);
+  Digest subtree_root = Node(level, last_node);
 
   if (node && node_level == level)
-    node->assign(subtree_root);
+    *node = subtree_root;
 
   while (last_node) {
     if (MerkleTreeMath::IsRightChild(last_node)) {
       // Recompute the parent of tree_[level][last_node].
-      subtree_root =
-          treehasher_.HashChildren(Node(level, last_node - 1), subtree_root);
+      treehasher_.HashChildren(Node(level, last_node - 1), subtree_root,
+                               &subtree_root);
     }
     // Else the parent is a dummy copy of the current node; do nothing.
 
     last_node = MerkleTreeMath::Parent(last_node);
     ++level;
     if (node && node_level == level)
-      node->assign(subtree_root);
+      *node = subtree_root;
   }
 
   return subtree_root;
 }
 
-std::vector<string> MerkleTree::PathFromNodeToRootAtSnapshot(size_t node,
-                                                             size_t level,
-                                                             size_t snapshot) {
-  std::vector<string> path;
+void MerkleTree::PathFromNodeToRootAtSnapshot(size_t node, size_t level,
+                                              size_t snapshot,
+                                              std::vector<Digest>* path) {
   if (snapshot == 0)
-    return path;
+    return;
   // Index of the last node.
   size_t last_node = (snapshot - 1) >> level;
   if (level >= level_count_ || node > last_node || snapshot > LeafCount())
-    return path;
+    return;
 
   if (snapshot > leaves_processed_) {
     // Bring the tree sufficiently up to date.
@@ -231,13 +367,12 @@ std::vector<string> MerkleTree::PathFromNodeToRootAtSnapshot(size_t node,
     if (sibling < last_node) {
       // The sibling is not the last node of the level in the snapshot
       // tree, so its value is correct in the tree.
-      path.push_back(Node(level, sibling));
+      path->push_back(Node(level, sibling));
     } else if (sibling == last_node) {
       // The sibling is the last node of the level in the snapshot tree,
       // so we get its value for the snapshot. Get the root in the same pass.
-      string recompute_node;
-      RecomputePastSnapshot(snapshot, level, &recompute_node);
-      path.push_back(recompute_node);
+      path->emplace_back();
+      RecomputePastSnapshot(snapshot, level, &path->back());
     }
     // Else sibling > last_node so the sibling does not exist. Do nothing.
     // Continue moving up in the tree, ignoring dummy copies.
@@ -246,46 +381,92 @@ std::vector<string> MerkleTree::PathFromNodeToRootAtSnapshot(size_t node,
     last_node = MerkleTreeMath::Parent(last_node);
     ++level;
   };
+}
+
+void MerkleTree::LoadFromStore() {
+  const size_t leaf_count(LeafCount());
+  if (leaf_count == 0) {
+    return;
+  }
+
+  level_count_ = LevelsForLeaves(leaf_count);
+
+  // The store only guarantees that the nodes of the snapshot it claims
+  // to have processed were durable as of the last Sync(). Since then,
+  // nodes may have been appended past that snapshot, and the rightmost
+  // node of each level rewritten in place, and any of these may or may
+  // not have made it to disk before a crash. The others are usable as
+  // long as they are all there.
+  leaves_processed_ = tree_->LeavesProcessed();
+  bool consistent(leaves_processed_ >= 1 && leaves_processed_ <= leaf_count);
+  const size_t levels(consistent ? LevelsForLeaves(leaves_processed_) : 0);
+  if (consistent)
+    consistent = LazyLevelCount() >= levels;
+  for (size_t level = 1; consistent && level < levels; ++level) {
+    consistent = NodeCount(level) >= ((leaves_processed_ - 1) >> level) + 1;
+  }
+
+  if (consistent) {
+    while (LazyLevelCount() > levels)
+      tree_->RemoveLevel();
+    RecomputeLastNodes(leaves_processed_);
+    return;
+  }
 
-  return path;
+  LOG(WARNING) << "Interior nodes do not match the " << leaves_processed_
+               << " leaves processed, recomputing them.";
+  // Keep the leaves, and recompute the rest lazily, as if only the
+  // first leaf had been processed.
+  while (LazyLevelCount() > 1)
+    tree_->RemoveLevel();
+  leaves_processed_ = 1;
+  tree_->SetLeavesProcessed(leaves_processed_);
 }
 
-string MerkleTree::Node(size_t level, size_t index) const {
+Digest MerkleTree::Node(size_t level, size_t index) const {
   assert(NodeCount(level) > index);
-  return tree_[level].substr(index * treehasher_.DigestSize(),
-                             treehasher_.DigestSize());
+  Digest node;
+  tree_->CopyNodes(level, index, 1, node.data());
+  return node;
 }
 
-string MerkleTree::Root() const {
-  assert(tree_.back().size() == treehasher_.DigestSize());
-  return tree_.back();
+Digest MerkleTree::Root() const {
+  assert(NodeCount(LazyLevelCount() - 1) == 1U);
+  return Node(LazyLevelCount() - 1, 0);
 }
 
 size_t MerkleTree::NodeCount(size_t level) const {
   assert(LazyLevelCount() > level);
-  return tree_[level].size() / treehasher_.DigestSize();
+  return tree_->NodeCount(level);
 }
 
-string MerkleTree::LastNode(size_t level) const {
+Digest MerkleTree::LastNode(size_t level) const {
   assert(NodeCount(level) >= 1U);
-  return tree_[level].substr(tree_[level].size() - treehasher_.DigestSize());
+  return Node(level, NodeCount(level) - 1);
 }
 
 void MerkleTree::PopBack(size_t level) {
   assert(NodeCount(level) >= 1U);
-  tree_[level].erase(tree_[level].size() - treehasher_.DigestSize());
+  tree_->PopBack(level);
 }
 
-void MerkleTree::PushBack(size_t level, string node) {
-  assert(node.size() == treehasher_.DigestSize());
+void MerkleTree::PushBack(size_t level, const Digest& node) {
   assert(LazyLevelCount() > level);
-  tree_[level].append(node);
+  tree_->PushBack(level, node.data(), 1);
 }
 
 void MerkleTree::AddLevel() {
-  tree_.push_back(string());
+  tree_->AddLevel();
 }
 
 size_t MerkleTree::LazyLevelCount() const {
-  return tree_.size();
+  return tree_->LevelCount();
+}
+
+size_t MerkleTree::NodeBytes() const {
+  size_t nodes(0);
+  for (size_t level = 0; level < tree_->LevelCount(); ++level) {
+    nodes += tree_->NodeCount(level);
+  }
+  return nodes * tree_->NodeSize();
 }
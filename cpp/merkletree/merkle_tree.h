@@ -6,6 +6,8 @@
 #include <string>
 #include <vector>
 
+#include "merkletree/digest.h"
+#include "merkletree/merkle_node_store.h"
 #include "merkletree/merkle_tree_interface.h"
 #include "merkletree/tree_hasher.h"
 
@@ -25,6 +27,12 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
   // The constructor takes a pointer to some concrete hash function
   // instantiation of the SerialHasher abstract class.
   explicit MerkleTree(std::unique_ptr<SerialHasher> hasher);
+  // Same as above, but keeps the nodes in |store| (which must have the
+  // same node size as |hasher|'s digests). If the store already
+  // contains nodes (say, from a previous run with a persistent store),
+  // the tree resumes from them.
+  MerkleTree(std::unique_ptr<SerialHasher> hasher,
+             std::unique_ptr<cert_trans::MerkleNodeStore> store);
   virtual ~MerkleTree();
 
   // Length of a node (i.e., a hash), in bytes.
@@ -34,14 +42,14 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
 
   // Number of leaves in the tree.
   virtual size_t LeafCount() const {
-    return tree_.empty() ? 0 : NodeCount(0);
+    return tree_->LevelCount() == 0 ? 0 : NodeCount(0);
   }
 
   // The |leaf|th leaf hash in the tree. Indexing starts from 1.
   std::string LeafHash(size_t leaf) const {
     if (leaf == 0 || leaf > LeafCount())
       return std::string();
-    return Node(0, leaf - 1);
+    return Node(0, leaf - 1).ToString();
   }
 
   // Return the leaf hash, but do not append the data to the tree.
@@ -56,6 +64,10 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
     return level_count_;
   }
 
+  // The memory taken by the nodes of the tree, which are in the page
+  // cache rather than the heap with a node store backed by a file.
+  size_t NodeBytes() const;
+
   // Add a new leaf to the hash tree. Stores the hash of the leaf data in the
   // tree structure, does not store the data itself.
   //
@@ -79,6 +91,17 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
   // @param hash leaf hash
   virtual size_t AddLeafHash(const std::string& hash);
 
+  // Add new leaves in bulk. The interior nodes above them are computed
+  // (in batches) on the next evaluation of the tree.
+  //
+  // Returns the number of leaves in the tree after this update.
+  virtual size_t AddLeafHashes(const std::vector<Digest>& hashes);
+
+  // Discard all the leaves past the first |leaf_count| ones (if any),
+  // as if they had never been added. Useful to roll back a persistent
+  // tree that got ahead of its data source.
+  void Truncate(size_t leaf_count);
+
   // Get the current root of the tree.
   // Update the root to reflect the current shape of the tree,
   // and return the tree digest.
@@ -119,6 +142,10 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
   // @param leaf the index of the leaf the path is for.
   // @param snapshot point in time (= number of leaves at that point)
   std::vector<std::string> PathToRootAtSnapshot(size_t leaf, size_t snapshot);
+  // Same as above, into |path| (cleared first), which does not
+  // allocate once |path| has grown to the height of the tree.
+  void PathToRootAtSnapshot(size_t leaf, size_t snapshot,
+                            std::vector<Digest>* path);
 
   // Get the Merkle consistency proof between two snapshots.
   // Returns a vector of node hashes, ordered according to levels.
@@ -129,40 +156,66 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
   // @param snapshot2 the second point in time
   std::vector<std::string> SnapshotConsistency(size_t snapshot1,
                                                size_t snapshot2);
+  // Same as above, into |proof| (cleared first), which does not
+  // allocate once |proof| has grown to the height of the tree.
+  void SnapshotConsistency(size_t snapshot1, size_t snapshot2,
+                           std::vector<Digest>* proof);
+
+  // Make sure the nodes computed so far are durable, if the node store
+  // is persistent.
+  void SyncNodes() {
+    tree_->Sync();
+  }
+
+  // The nodes of the tree, for instance to compute proofs without
+  // modifying the tree, with SubtreeProofs.
+  const cert_trans::MerkleNodeStore* NodeStore() const {
+    return tree_.get();
+  }
 
  private:
+  // Reload the lazy evaluation state from a (possibly non-empty) node
+  // store, recomputing the interior nodes it does not vouch for.
+  void LoadFromStore();
+
+  // Recompute the rightmost node of every interior level from the
+  // level below, for a tree of |leaf_count| leaves, dropping the nodes
+  // past it.
+  void RecomputeLastNodes(size_t leaf_count);
+
+  size_t AddLeafDigest(const Digest& hash);
+
   // Update to a given snapshot, return the root.
   std::string UpdateToSnapshot(size_t snapshot);
-  // Return the root of a past snapshot.
+  // Return the root of a past snapshot (which must not be empty).
   // If node is not NULL, additionally record the rightmost node
   // for the given snapshot and node_level.
-  std::string RecomputePastSnapshot(size_t snapshot, size_t node_level,
-                                    std::string* node);
+  Digest RecomputePastSnapshot(size_t snapshot, size_t node_level,
+                               Digest* node);
   // Path from a node at a given level (both indexed starting with 0)
-  // to the root at a given snapshot.
-  std::vector<std::string> PathFromNodeToRootAtSnapshot(size_t node_index,
-                                                        size_t level,
-                                                        size_t snapshot);
+  // to the root at a given snapshot, appended to |path|.
+  void PathFromNodeToRootAtSnapshot(size_t node_index, size_t level,
+                                    size_t snapshot, std::vector<Digest>* path);
   // Get the |index|-th node at level |level|. Indexing starts at 0;
   // caller is responsible for ensuring tree is sufficiently up to date.
-  std::string Node(size_t level, size_t index) const;
+  Digest Node(size_t level, size_t index) const;
 
   // Get the current root (of the lazily evaluated tree).
   // Caller is responsible for keeping track of the lazy evaluation status.
-  std::string Root() const;
+  Digest Root() const;
 
   // Get the current node count (of the lazily evaluated tree).
   // Caller is responsible for keeping track of the lazy evaluation status.
   size_t NodeCount(size_t level) const;
 
   // Last node of the given level.
-  std::string LastNode(size_t level) const;
+  Digest LastNode(size_t level) const;
 
   // Pop the last node of the level.
   void PopBack(size_t level);
 
   // Append a node to the level.
-  void PushBack(size_t level, std::string node);
+  void PushBack(size_t level, const Digest& node);
 
   // Start a new level.
   void AddLevel();
@@ -171,6 +224,7 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
   size_t LazyLevelCount() const;
   // A container for nodes, organized according to levels and sorted
   // left-to-right in each level. tree_[0] is the leaf level, etc.
+  // (The notation below uses tree_[i][j] for tree_->Node(i, j).)
   // The hash of nodes tree_[i][j] and tree_[i][j+1] (j even) is stored
   // at tree_[i+1][j/2]. When tree_[i][j] is the last node of the level with
   // no right sibling, we store its dummy copy: tree_[i+1][j/2] = tree_[i][j].
@@ -200,7 +254,7 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
   // Since the tree is append-only from the right, at any given point in time,
   // at each level, all nodes computed so far, except possibly the last node,
   // are fixed and will no longer change.
-  std::vector<std::string> tree_;
+  const std::unique_ptr<cert_trans::MerkleNodeStore> tree_;
   TreeHasher treehasher_;
   // Number of leaves propagated up to the root,
   // to keep track of lazy evaluation.
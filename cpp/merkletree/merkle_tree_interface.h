@@ -6,8 +6,10 @@
 
 #include <stddef.h>
 #include <string>
+#include <vector>
 
 #include "base/macros.h"
+#include "merkletree/digest.h"
 
 namespace cert_trans {
 
@@ -49,6 +51,12 @@ class MerkleTreeInterface {
   // @param hash leaf hash
   virtual size_t AddLeafHash(const std::string& hash) = 0;
 
+  // Same as calling AddLeafHash() for each of |hashes|, in order, but
+  // faster.
+  //
+  // Returns the number of leaves in the tree after this update.
+  virtual size_t AddLeafHashes(const std::vector<Digest>& hashes) = 0;
+
   // Get the current root of the tree.
   // Update the root to reflect the current shape of the tree,
   // and return the tree digest.
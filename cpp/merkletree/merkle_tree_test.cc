@@ -239,6 +239,30 @@ TEST_F(MerkleTreeFuzzTest, ConsistencyFuzz) {
   }
 }
 
+// The Digest versions fill in the same proofs, reusing their vector.
+TEST_F(MerkleTreeFuzzTest, DigestProofsFuzz) {
+  MerkleTree tree(NewSha256Hasher());
+  std::vector<Digest> proof;
+  for (size_t tree_size = 1; tree_size <= data_.size(); ++tree_size) {
+    tree.AddLeaf(data_[tree_size - 1]);
+    for (size_t j = 0; j < 8; ++j) {
+      const size_t snapshot2 = rand() % (tree_size + 1);
+      const size_t snapshot1 = rand() % (snapshot2 + 1);
+      tree.PathToRootAtSnapshot(snapshot1, snapshot2, &proof);
+      std::vector<string> strings;
+      for (const Digest& digest : proof)
+        strings.push_back(digest.ToString());
+      EXPECT_EQ(tree.PathToRootAtSnapshot(snapshot1, snapshot2), strings);
+
+      tree.SnapshotConsistency(snapshot1, snapshot2, &proof);
+      strings.clear();
+      for (const Digest& digest : proof)
+        strings.push_back(digest.ToString());
+      EXPECT_EQ(tree.SnapshotConsistency(snapshot1, snapshot2), strings);
+    }
+  }
+}
+
 // KNOWN ANSWER TESTS
 
 typedef struct {
@@ -582,6 +606,123 @@ TEST_F(MerkleTreeTest, AddLeafHash) {
   EXPECT_EQ(kHashValue, tree.LeafHash(index));
 }
 
+// Adds the leaves for data_[begin, end) in bulk.
+template <class Tree>
+size_t AddLeafHashes(const std::vector<string>& data, size_t begin,
+                     size_t end, Tree* tree) {
+  std::vector<Digest> hashes;
+  for (size_t i = begin; i < end; ++i)
+    hashes.push_back(Digest(tree->LeafHash(data[i])));
+  return tree->AddLeafHashes(hashes);
+}
+
+TEST_F(MerkleTreeTest, AddLeafHashes) {
+  for (size_t first = 0; first <= 17; ++first) {
+    for (size_t second = 0; second <= 40; ++second) {
+      MerkleTree reference(NewSha256Hasher());
+      MerkleTree tree(NewSha256Hasher());
+      for (size_t i = 0; i < first + second; ++i)
+        reference.AddLeaf(data_[i]);
+      AddLeafHashes(data_, 0, first, &tree);
+      // Leave the tree partially evaluated some of the time.
+      if (first % 2 == 0)
+        tree.CurrentRoot();
+      EXPECT_EQ(first + second,
+                AddLeafHashes(data_, first, first + second, &tree));
+      EXPECT_EQ(reference.LevelCount(), tree.LevelCount());
+      EXPECT_EQ(reference.CurrentRoot(), tree.CurrentRoot());
+      EXPECT_EQ(reference.PathToCurrentRoot(1), tree.PathToCurrentRoot(1));
+    }
+  }
+}
+
+TEST_F(CompactMerkleTreeTest, AddLeafHashes) {
+  for (size_t first = 0; first <= 17; ++first) {
+    for (size_t second = 0; second <= 40; ++second) {
+      CompactMerkleTree reference(NewSha256Hasher());
+      CompactMerkleTree tree(NewSha256Hasher());
+      for (size_t i = 0; i < first + second; ++i)
+        reference.AddLeaf(data_[i]);
+      AddLeafHashes(data_, 0, first, &tree);
+      if (first % 2 == 0)
+        tree.CurrentRoot();
+      EXPECT_EQ(first + second,
+                AddLeafHashes(data_, first, first + second, &tree));
+      EXPECT_EQ(reference.LevelCount(), tree.LevelCount());
+      EXPECT_EQ(reference.CurrentRoot(), tree.CurrentRoot());
+
+      // Both trees grow the same way afterwards.
+      reference.AddLeaf("new");
+      tree.AddLeaf("new");
+      EXPECT_EQ(reference.CurrentRoot(), tree.CurrentRoot());
+    }
+  }
+}
+
+TEST_F(CompactMerkleTreeTest, Frontier) {
+  for (size_t tree_size = 0; tree_size <= 40; ++tree_size) {
+    CompactMerkleTree reference(NewSha256Hasher());
+    for (size_t i = 0; i < tree_size; ++i)
+      reference.AddLeaf(data_[i]);
+    const string frontier(reference.SerializeFrontier());
+    size_t nodes(0);
+    for (size_t bits = tree_size; bits != 0; bits >>= 1)
+      nodes += bits & 1;
+    EXPECT_EQ(8 + nodes * Digest::kSize, frontier.size());
+
+    CompactMerkleTree tree(NewSha256Hasher());
+    tree.AddLeaf("overwritten");
+    ASSERT_TRUE(tree.LoadFrontier(frontier));
+    EXPECT_EQ(reference.LeafCount(), tree.LeafCount());
+    EXPECT_EQ(reference.LevelCount(), tree.LevelCount());
+    EXPECT_EQ(reference.CurrentRoot(), tree.CurrentRoot());
+    EXPECT_EQ(frontier, tree.SerializeFrontier());
+
+    // Both trees grow the same way afterwards.
+    reference.AddLeaf("new");
+    tree.AddLeaf("new");
+    EXPECT_EQ(reference.LevelCount(), tree.LevelCount());
+    EXPECT_EQ(reference.CurrentRoot(), tree.CurrentRoot());
+
+    // A truncated or padded frontier is rejected, and leaves the tree
+    // alone.
+    EXPECT_FALSE(tree.LoadFrontier(frontier.substr(0, frontier.size() - 1)));
+    EXPECT_FALSE(tree.LoadFrontier(frontier + "x"));
+    EXPECT_EQ(reference.CurrentRoot(), tree.CurrentRoot());
+  }
+}
+
+TEST_F(MerkleTreeTest, Truncate) {
+  for (size_t tree_size = 1; tree_size <= 33; ++tree_size) {
+    for (size_t truncated_size = 0; truncated_size < tree_size;
+         ++truncated_size) {
+      MerkleTree reference(NewSha256Hasher());
+      MerkleTree tree(NewSha256Hasher());
+      for (size_t i = 0; i < tree_size; ++i) {
+        if (i < truncated_size)
+          reference.AddLeaf(std::to_string(i));
+        tree.AddLeaf(std::to_string(i));
+        // Leave the tree partially evaluated some of the time.
+        if (i % 3 == 0)
+          tree.CurrentRoot();
+      }
+      tree.Truncate(truncated_size);
+      EXPECT_EQ(reference.LeafCount(), tree.LeafCount());
+      EXPECT_EQ(reference.LevelCount(), tree.LevelCount());
+      EXPECT_EQ(reference.CurrentRoot(), tree.CurrentRoot());
+
+      // Both trees grow the same way afterwards.
+      for (size_t i = 0; i < 5; ++i) {
+        reference.AddLeaf("new" + std::to_string(i));
+        tree.AddLeaf("new" + std::to_string(i));
+      }
+      EXPECT_EQ(reference.CurrentRoot(), tree.CurrentRoot());
+      EXPECT_EQ(reference.SnapshotConsistency(1, reference.LeafCount()),
+                tree.SnapshotConsistency(1, tree.LeafCount()));
+    }
+  }
+}
+
 TEST_F(CompactMerkleTreeTest, TestCloneEmptyTreeProducesWorkingTree) {
   MerkleTree tree(NewSha256Hasher());
   CompactMerkleTree compact(&tree, NewSha256Hasher());
@@ -786,6 +927,61 @@ TEST_F(MerkleVerifierTest, VerifyPath) {
   }
 }
 
+TEST_F(MerkleVerifierTest, VerifyPaths) {
+  std::vector<MerkleVerifier::AuditPath> paths;
+  EXPECT_FALSE(verifier_.VerifyPaths(1, paths, S(kSHA256EmptyTreeHash)));
+
+  for (size_t tree_size = 1; tree_size <= 33; ++tree_size) {
+    const string root(
+        ReferenceMerkleTreeHash(data_.data(), tree_size, &tree_hasher_));
+    // Every other leaf, then every third one, and so on.
+    for (size_t step = 1; step <= tree_size; ++step) {
+      paths.clear();
+      for (size_t leaf = 1; leaf <= tree_size; leaf += step) {
+        paths.push_back(MerkleVerifier::AuditPath{
+            leaf, tree_hasher_.HashLeaf(data_[leaf - 1]),
+            ReferenceMerklePath(data_.data(), tree_size, leaf,
+                                &tree_hasher_)});
+      }
+      EXPECT_EQ(H(root), H(verifier_.RootFromPaths(tree_size, paths)));
+      EXPECT_TRUE(verifier_.VerifyPaths(tree_size, paths, root));
+      // The same path twice.
+      paths.push_back(paths.front());
+      EXPECT_TRUE(verifier_.VerifyPaths(tree_size, paths, root));
+      paths.pop_back();
+
+      // Wrong tree height.
+      EXPECT_FALSE(verifier_.VerifyPaths(tree_size * 2, paths, root));
+      EXPECT_FALSE(verifier_.VerifyPaths(tree_size / 2, paths, root));
+
+      // Wrong leaf.
+      std::vector<MerkleVerifier::AuditPath> wrong_paths(paths);
+      wrong_paths.back().leaf_hash = tree_hasher_.HashLeaf("WrongLeaf");
+      EXPECT_FALSE(verifier_.VerifyPaths(tree_size, wrong_paths, root));
+      const size_t wrong_leaf = wrong_paths.back().leaf == tree_size
+                                    ? tree_size + 1
+                                    : wrong_paths.back().leaf + 1;
+      wrong_paths = paths;
+      wrong_paths.back().leaf = wrong_leaf;
+      EXPECT_FALSE(verifier_.VerifyPaths(tree_size, wrong_paths, root));
+
+      // Modify a single path element.
+      for (size_t i = 0; i < paths.size(); ++i) {
+        for (size_t j = 0; j < paths[i].path.size(); ++j) {
+          wrong_paths = paths;
+          wrong_paths[i].path[j] = S(kSHA256EmptyTreeHash);
+          EXPECT_FALSE(verifier_.VerifyPaths(tree_size, wrong_paths, root));
+        }
+      }
+
+      // Garbage at the end of a path.
+      wrong_paths = paths;
+      wrong_paths.back().path.push_back(root);
+      EXPECT_FALSE(verifier_.VerifyPaths(tree_size, wrong_paths, root));
+    }
+  }
+}
+
 TEST_F(MerkleVerifierTest, VerifyConsistencyProof) {
   std::vector<string> proof;
   string root1, root2;
@@ -1,9 +1,13 @@
 #include "merkletree/merkle_verifier.h"
 
 #include <stddef.h>
+#include <iterator>
 #include <vector>
 
+using std::make_pair;
+using std::map;
 using std::move;
+using std::next;
 using std::string;
 using std::unique_ptr;
 
@@ -65,6 +69,137 @@ string MerkleVerifier::RootFromPath(size_t leaf, size_t tree_size,
   return node_hash;
 }
 
+string MerkleVerifier::RootFromPaths(size_t tree_size,
+                                     const std::vector<AuditPath>& paths) {
+  if (paths.empty())
+    return string();
+
+  // The nodes known at the current level, by index: first those on
+  // the paths (starting with the leaves), then their siblings as given
+  // by the paths.
+  map<size_t, string> nodes;
+  std::vector<std::vector<string>::const_iterator> its;
+  for (const AuditPath& path : paths) {
+    if (path.leaf > tree_size || path.leaf == 0)
+      return string();
+    const auto it = nodes.insert(make_pair(path.leaf - 1, path.leaf_hash));
+    if (it.first->second != path.leaf_hash)
+      return string();
+    its.push_back(path.path.begin());
+  }
+
+  size_t last_node = tree_size - 1;
+  for (size_t level = 0; last_node; ++level) {
+    map<size_t, string> siblings;
+    for (size_t i = 0; i < paths.size(); ++i) {
+      const size_t node = (paths[i].leaf - 1) >> level;
+      size_t sibling;
+      if (IsRightChild(node))
+        sibling = node - 1;
+      else if (node < last_node)
+        sibling = node + 1;
+      else
+        // The parent is a dummy copy.
+        continue;
+
+      if (its[i] == paths[i].path.end())
+        // We've reached the end but we're not done yet.
+        return string();
+      const string& hash = *its[i]++;
+      const auto computed = nodes.find(sibling);
+      if (computed == nodes.end()) {
+        const auto it = siblings.insert(make_pair(sibling, hash));
+        if (it.first->second != hash)
+          return string();
+      } else if (computed->second != hash) {
+        return string();
+      }
+    }
+    nodes.insert(siblings.begin(), siblings.end());
+
+    // Every node now has its sibling, if it exists, next to it.
+    map<size_t, string> parents;
+    for (auto it = nodes.begin(); it != nodes.end(); ++it) {
+      const size_t node = it->first;
+      const auto right = next(it);
+      if (right != nodes.end() && right->first == node + 1 &&
+          !IsRightChild(node)) {
+        parents.emplace_hint(parents.end(), Parent(node),
+                             treehasher_.HashChildren(it->second,
+                                                      right->second));
+        it = right;
+      } else {
+        parents.emplace_hint(parents.end(), Parent(node), it->second);
+      }
+    }
+    nodes.swap(parents);
+    last_node = Parent(last_node);
+  }
+
+  // Check that we've reached the end of every path.
+  for (size_t i = 0; i < paths.size(); ++i)
+    if (its[i] != paths[i].path.end())
+      return string();
+  return nodes.begin()->second;
+}
+
+bool MerkleVerifier::VerifyPaths(size_t tree_size,
+                                 const std::vector<AuditPath>& paths,
+                                 const string& root) {
+  string paths_root = RootFromPaths(tree_size, paths);
+  if (paths_root.empty())
+    return false;
+  return paths_root == root;
+}
+
+string MerkleVerifier::RootFromMultiLeafProof(
+    size_t tree_size, const map<size_t, string>& leaf_hashes,
+    const std::vector<string>& proof) {
+  if (leaf_hashes.empty() || leaf_hashes.begin()->first == 0 ||
+      leaf_hashes.rbegin()->first > tree_size)
+    return string();
+
+  // The nodes computed from the leaves at the current level, by index.
+  map<size_t, string> nodes;
+  for (const auto& leaf : leaf_hashes)
+    nodes.emplace_hint(nodes.end(), leaf.first - 1, leaf.second);
+  std::vector<string>::const_iterator proof_it = proof.begin();
+
+  size_t last_node = tree_size - 1;
+  while (last_node) {
+    map<size_t, string> parents;
+    for (auto it = nodes.begin(); it != nodes.end(); ++it) {
+      const size_t node = it->first;
+      const auto right = next(it);
+      string parent_hash;
+      if (IsRightChild(node)) {
+        // We'd have gotten here from the left sibling otherwise.
+        if (proof_it == proof.end())
+          return string();
+        parent_hash = treehasher_.HashChildren(*proof_it++, it->second);
+      } else if (right != nodes.end() && right->first == node + 1) {
+        parent_hash = treehasher_.HashChildren(it->second, right->second);
+        it = right;
+      } else if (node < last_node) {
+        if (proof_it == proof.end())
+          return string();
+        parent_hash = treehasher_.HashChildren(it->second, *proof_it++);
+      } else {
+        // The sibling does not exist and the parent is a dummy copy.
+        parent_hash = it->second;
+      }
+      parents.emplace_hint(parents.end(), Parent(node), move(parent_hash));
+    }
+    nodes.swap(parents);
+    last_node = Parent(last_node);
+  }
+
+  // Check that we've reached the end.
+  if (proof_it != proof.end())
+    return string();
+  return nodes.begin()->second;
+}
+
 bool MerkleVerifier::VerifyConsistency(size_t snapshot1, size_t snapshot2,
                                        const string& root1,
                                        const string& root2,
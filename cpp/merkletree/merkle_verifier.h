@@ -2,7 +2,9 @@
 #define CERT_TRANS_MERKLETREE_MERKLE_VERIFIER_H_
 
 #include <stddef.h>
+#include <map>
 #include <memory>
+#include <string>
 #include <vector>
 
 #include "merkletree/tree_hasher.h"
@@ -14,6 +16,16 @@ class SerialHasher;
 
 class MerkleVerifier {
  public:
+  // The audit path of one leaf, given by its leaf hash, for
+  // RootFromPaths().
+  struct AuditPath {
+    // Index of the leaf, starting at 1.
+    size_t leaf;
+    std::string leaf_hash;
+    // From leaf to root, as for VerifyPath().
+    std::vector<std::string> path;
+  };
+
   MerkleVerifier(std::unique_ptr<SerialHasher> hasher);
   ~MerkleVerifier();
 
@@ -43,6 +55,32 @@ class MerkleVerifier {
                            const std::vector<std::string>& path,
                            const std::string& data);
 
+  // Compute the root that all of |paths| lead to, in a tree of
+  // |tree_size| leaves. Interior nodes shared by several of the paths
+  // are only hashed once. Returns an empty string if |paths| is empty,
+  // if any of them is not valid, or if they do not agree on the nodes
+  // they share.
+  std::string RootFromPaths(size_t tree_size,
+                            const std::vector<AuditPath>& paths);
+
+  // Returns true iff RootFromPaths() returns |root|.
+  bool VerifyPaths(size_t tree_size, const std::vector<AuditPath>& paths,
+                   const std::string& root);
+
+  // Compute the root corresponding to a multi-leaf proof, as returned
+  // by SubtreeProofs::MultiLeafProof(): the node hashes needed to get
+  // to the root from a set of leaves, without those that can be
+  // computed from the leaves themselves. They are ordered by levels,
+  // from the leaves up, and from left to right within a level.
+  // Returns an empty string if the proof is not valid.
+  //
+  // @param tree_size number of leaves in the tree.
+  // @param leaf_hashes the leaf hashes, by leaf index (starting at 1).
+  // @param proof the multi-leaf proof.
+  std::string RootFromMultiLeafProof(
+      size_t tree_size, const std::map<size_t, std::string>& leaf_hashes,
+      const std::vector<std::string>& proof);
+
   bool VerifyConsistency(size_t snapshot1, size_t snapshot2,
                          const std::string& root1, const std::string& root2,
                          const std::vector<std::string>& proof);
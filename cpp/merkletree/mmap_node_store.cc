@@ -0,0 +1,275 @@
+#include "merkletree/mmap_node_store.h"
+
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+
+using std::max;
+using std::string;
+using std::unique_ptr;
+
+namespace cert_trans {
+namespace {
+
+
+const char kMagic[] = "CTNODES1";
+const char kLeavesProcessedFile[] = "leaves-processed";
+// Files are grown by doubling, starting with this size.
+const size_t kInitialFileSize = 1 << 20;
+
+
+struct Header {
+  char magic[8];
+  uint64_t node_size;
+  uint64_t node_count;
+  uint64_t reserved[5];
+};
+
+static_assert(sizeof(Header) == 64, "unexpected node store header size");
+
+
+}  // namespace
+
+
+class MmapNodeStore::Level {
+ public:
+  // Opens |path|, creating it if |create| is true.
+  Level(const string& path, size_t node_size, bool create);
+  ~Level();
+
+  static bool Exists(const string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+  }
+
+  Header* header() const {
+    return reinterpret_cast<Header*>(base_);
+  }
+
+  size_t count() const {
+    return header()->node_count;
+  }
+
+  const char* node(size_t index) const {
+    return base_ + sizeof(Header) + index * node_size_;
+  }
+
+  // Appends the |num_nodes| nodes (of node_size_ bytes each) at
+  // |nodes|.
+  void PushBack(const void* nodes, size_t num_nodes);
+
+  void PopBack() {
+    CHECK_GT(count(), 0U);
+    --header()->node_count;
+  }
+
+  void Sync() const {
+    PCHECK(msync(base_, sizeof(Header) + count() * node_size_, MS_SYNC) == 0)
+        << "msync failed for " << path_;
+  }
+
+ private:
+  size_t Capacity() const {
+    return (mapped_size_ - sizeof(Header)) / node_size_;
+  }
+
+  void Map(size_t size);
+
+  const string path_;
+  const size_t node_size_;
+  int fd_;
+  char* base_;
+  size_t mapped_size_;
+
+  DISALLOW_COPY_AND_ASSIGN(Level);
+};
+
+
+MmapNodeStore::Level::Level(const string& path, size_t node_size, bool create)
+    : path_(path),
+      node_size_(node_size),
+      fd_(open(path.c_str(), O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0644)),
+      base_(nullptr),
+      mapped_size_(0) {
+  PCHECK(fd_ >= 0) << "failed to open " << path_;
+
+  if (create) {
+    PCHECK(ftruncate(fd_, kInitialFileSize) == 0) << "ftruncate failed for "
+                                                  << path_;
+    Map(kInitialFileSize);
+    memcpy(header()->magic, kMagic, sizeof(header()->magic));
+    header()->node_size = node_size_;
+    return;
+  }
+
+  struct stat st;
+  PCHECK(fstat(fd_, &st) == 0) << "fstat failed for " << path_;
+  CHECK_GE(static_cast<size_t>(st.st_size), sizeof(Header))
+      << "truncated node store file " << path_;
+  Map(st.st_size);
+  CHECK_EQ(0, memcmp(header()->magic, kMagic, sizeof(header()->magic)))
+      << "bad magic in node store file " << path_;
+  CHECK_EQ(node_size_, header()->node_size) << "node size mismatch in "
+                                            << path_;
+  CHECK_LE(count(), Capacity()) << "corrupt node count in " << path_;
+}
+
+
+MmapNodeStore::Level::~Level() {
+  PCHECK(munmap(base_, mapped_size_) == 0) << "munmap failed for " << path_;
+  PCHECK(close(fd_) == 0) << "close failed for " << path_;
+}
+
+
+void MmapNodeStore::Level::PushBack(const void* nodes, size_t num_nodes) {
+  if (count() + num_nodes > Capacity()) {
+    size_t new_size(max(mapped_size_, kInitialFileSize));
+    while ((new_size - sizeof(Header)) / node_size_ < count() + num_nodes)
+      new_size *= 2;
+    PCHECK(ftruncate(fd_, new_size) == 0) << "ftruncate failed for " << path_;
+    Map(new_size);
+  }
+  memcpy(base_ + sizeof(Header) + count() * node_size_, nodes,
+         num_nodes * node_size_);
+  header()->node_count += num_nodes;
+}
+
+
+void MmapNodeStore::Level::Map(size_t size) {
+  if (base_) {
+    PCHECK(munmap(base_, mapped_size_) == 0) << "munmap failed for " << path_;
+  }
+  void* const addr(
+      mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0));
+  PCHECK(addr != MAP_FAILED) << "mmap failed for " << path_;
+  base_ = static_cast<char*>(addr);
+  mapped_size_ = size;
+}
+
+
+MmapNodeStore::MmapNodeStore(const string& dir, size_t node_size)
+    : dir_(dir),
+      node_size_(node_size),
+      leaves_processed_fd_(open((dir_ + "/" + kLeavesProcessedFile).c_str(),
+                                O_RDWR | O_CREAT, 0644)),
+      leaves_processed_(0) {
+  CHECK_GT(node_size_, 0U);
+  PCHECK(leaves_processed_fd_ >= 0) << "failed to open "
+                                    << kLeavesProcessedFile << " in " << dir_;
+  for (size_t level = 0; Level::Exists(LevelPath(level)); ++level) {
+    levels_.emplace_back(new Level(LevelPath(level), node_size_, false));
+  }
+  // Empty until the first Sync().
+  uint64_t leaves_processed;
+  const ssize_t len(pread(leaves_processed_fd_, &leaves_processed,
+                          sizeof(leaves_processed), 0));
+  PCHECK(len >= 0) << "failed to read " << kLeavesProcessedFile << " in "
+                   << dir_;
+  if (len == sizeof(leaves_processed)) {
+    leaves_processed_ = leaves_processed;
+  }
+  LOG(INFO) << "Opened node store in " << dir_ << " with " << levels_.size()
+            << " levels";
+}
+
+
+MmapNodeStore::~MmapNodeStore() {
+  PCHECK(close(leaves_processed_fd_) == 0) << "close failed for "
+                                           << kLeavesProcessedFile << " in "
+                                           << dir_;
+}
+
+
+void MmapNodeStore::AddLevel() {
+  levels_.emplace_back(new Level(LevelPath(levels_.size()), node_size_, true));
+}
+
+
+void MmapNodeStore::RemoveLevel() {
+  CHECK(!levels_.empty());
+  levels_.pop_back();
+  const string path(LevelPath(levels_.size()));
+  PCHECK(unlink(path.c_str()) == 0) << "failed to remove " << path;
+}
+
+
+size_t MmapNodeStore::NodeCount(size_t level) const {
+  CHECK_LT(level, levels_.size());
+  return levels_[level]->count();
+}
+
+
+string MmapNodeStore::Node(size_t level, size_t index) const {
+  CHECK_LT(index, NodeCount(level));
+  return string(levels_[level]->node(index), node_size_);
+}
+
+
+void MmapNodeStore::CopyNodes(size_t level, size_t index, size_t count,
+                              uint8_t* nodes) const {
+  CHECK_LE(index + count, NodeCount(level));
+  memcpy(nodes, levels_[level]->node(index), count * node_size_);
+}
+
+
+void MmapNodeStore::PushBack(size_t level, const string& node) {
+  CHECK_LT(level, levels_.size());
+  CHECK_EQ(node_size_, node.size());
+  levels_[level]->PushBack(node.data(), 1);
+}
+
+
+void MmapNodeStore::PushBack(size_t level, const uint8_t* nodes,
+                             size_t count) {
+  CHECK_LT(level, levels_.size());
+  levels_[level]->PushBack(nodes, count);
+}
+
+
+void MmapNodeStore::PopBack(size_t level) {
+  CHECK_LT(level, levels_.size());
+  levels_[level]->PopBack();
+}
+
+
+size_t MmapNodeStore::LeavesProcessed() const {
+  return leaves_processed_;
+}
+
+
+void MmapNodeStore::SetLeavesProcessed(size_t leaves_processed) {
+  leaves_processed_ = leaves_processed;
+}
+
+
+void MmapNodeStore::Sync() {
+  // The kernel writes the mapped pages back in no particular order, so
+  // the leaves processed count is only written once all the nodes it
+  // covers are on disk. It fits in a single sector, which is written
+  // atomically.
+  for (const auto& level : levels_) {
+    level->Sync();
+  }
+  const uint64_t leaves_processed(leaves_processed_);
+  PCHECK(pwrite(leaves_processed_fd_, &leaves_processed,
+                sizeof(leaves_processed), 0) == sizeof(leaves_processed))
+      << "failed to write " << kLeavesProcessedFile << " in " << dir_;
+  PCHECK(fdatasync(leaves_processed_fd_) == 0)
+      << "fdatasync failed for " << kLeavesProcessedFile << " in " << dir_;
+}
+
+
+string MmapNodeStore::LevelPath(size_t level) const {
+  char name[16];
+  snprintf(name, sizeof(name), "level-%02zu", level);
+  return dir_ + "/" + name;
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,86 @@
+#ifndef CERT_TRANS_MERKLETREE_MMAP_NODE_STORE_H_
+#define CERT_TRANS_MERKLETREE_MMAP_NODE_STORE_H_
+
+#include <stddef.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "base/macros.h"
+#include "merkletree/merkle_node_store.h"
+
+namespace cert_trans {
+
+
+// A persistent MerkleNodeStore, keeping each level of the tree in its
+// own memory-mapped file:
+//
+// <dir>/level-00 - the leaf hashes
+// <dir>/level-01 - the first level of interior nodes
+// ...
+// <dir>/leaves-processed - the number of leaves processed by the
+//                          MerkleTree, as of the last Sync()
+//
+// Each file starts with a small fixed-size header (magic, node size
+// and node count), followed by the nodes themselves, packed without
+// padding. The files are grown geometrically, so the file size is
+// larger than the data it holds. The header uses the native byte
+// order, these files are not meant to be moved between machines.
+//
+// The pages are written back in no particular order, so only the
+// nodes of the snapshot recorded in leaves-processed can be relied
+// upon after a crash; see MerkleTree::LoadFromStore().
+//
+// Only the nodes that are actually touched need to be resident, so
+// the memory footprint of a large tree is mostly up to the page
+// cache, and a MerkleTree built on top of an existing store resumes
+// by only rehashing the rightmost node of each level.
+//
+// MmapNodeStore aborts upon any filesystem error (like FileStorage).
+class MmapNodeStore : public MerkleNodeStore {
+ public:
+  // Opens the store in |dir| (which must exist), loading any existing
+  // levels.
+  MmapNodeStore(const std::string& dir, size_t node_size);
+  ~MmapNodeStore() override;
+
+  size_t NodeSize() const override {
+    return node_size_;
+  }
+
+  size_t LevelCount() const override {
+    return levels_.size();
+  }
+
+  void AddLevel() override;
+  void RemoveLevel() override;
+  size_t NodeCount(size_t level) const override;
+  std::string Node(size_t level, size_t index) const override;
+  void CopyNodes(size_t level, size_t index, size_t count,
+                 uint8_t* nodes) const override;
+  void PushBack(size_t level, const std::string& node) override;
+  void PushBack(size_t level, const uint8_t* nodes, size_t count) override;
+  void PopBack(size_t level) override;
+  size_t LeavesProcessed() const override;
+  void SetLeavesProcessed(size_t leaves_processed) override;
+  void Sync() override;
+
+ private:
+  class Level;
+
+  std::string LevelPath(size_t level) const;
+
+  const std::string dir_;
+  const size_t node_size_;
+  std::vector<std::unique_ptr<Level>> levels_;
+  // The leaves-processed file, only written by Sync().
+  const int leaves_processed_fd_;
+  size_t leaves_processed_;
+
+  DISALLOW_COPY_AND_ASSIGN(MmapNodeStore);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_MERKLETREE_MMAP_NODE_STORE_H_
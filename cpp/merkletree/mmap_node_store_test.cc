@@ -0,0 +1,245 @@
+#include "merkletree/mmap_node_store.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "merkletree/merkle_tree.h"
+#include "merkletree/serial_hasher.h"
+#include "util/test_db.h"
+#include "util/testing.h"
+
+namespace {
+
+using cert_trans::MerkleNodeStore;
+using cert_trans::MmapNodeStore;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+
+string TestNode(size_t i) {
+  string node(Sha256Hasher::Sha256Digest(std::to_string(i)));
+  CHECK_EQ(32U, node.size());
+  return node;
+}
+
+
+class MmapNodeStoreTest : public ::testing::Test {
+ protected:
+  unique_ptr<MmapNodeStore> OpenStore() const {
+    return unique_ptr<MmapNodeStore>(
+        new MmapNodeStore(tmp_.TmpStorageDir(), 32));
+  }
+
+  unique_ptr<MerkleTree> OpenTree() const {
+    return unique_ptr<MerkleTree>(
+        new MerkleTree(unique_ptr<Sha256Hasher>(new Sha256Hasher),
+                       unique_ptr<MerkleNodeStore>(OpenStore())));
+  }
+
+  TmpStorage tmp_;
+};
+
+
+TEST_F(MmapNodeStoreTest, Empty) {
+  unique_ptr<MmapNodeStore> store(OpenStore());
+  EXPECT_EQ(32U, store->NodeSize());
+  EXPECT_EQ(0U, store->LevelCount());
+  EXPECT_EQ(0U, store->LeavesProcessed());
+}
+
+
+TEST_F(MmapNodeStoreTest, PushPopAndResume) {
+  // Enough nodes to grow the file a few times.
+  const size_t kNumNodes(100000);
+  {
+    unique_ptr<MmapNodeStore> store(OpenStore());
+    store->AddLevel();
+    store->AddLevel();
+    for (size_t i = 0; i < kNumNodes; ++i)
+      store->PushBack(0, TestNode(i));
+    store->PushBack(1, TestNode(0));
+    store->PushBack(1, TestNode(1));
+    store->PopBack(1);
+    store->SetLeavesProcessed(42);
+    store->Sync();
+  }
+
+  unique_ptr<MmapNodeStore> store(OpenStore());
+  ASSERT_EQ(2U, store->LevelCount());
+  ASSERT_EQ(kNumNodes, store->NodeCount(0));
+  for (size_t i = 0; i < kNumNodes; i += 997)
+    EXPECT_EQ(TestNode(i), store->Node(0, i));
+  ASSERT_EQ(1U, store->NodeCount(1));
+  EXPECT_EQ(TestNode(0), store->Node(1, 0));
+  EXPECT_EQ(42U, store->LeavesProcessed());
+
+  store->RemoveLevel();
+  EXPECT_EQ(1U, unique_ptr<MmapNodeStore>(OpenStore())->LevelCount());
+}
+
+
+TEST_F(MmapNodeStoreTest, LeavesProcessedOnlyDurableAfterSync) {
+  {
+    unique_ptr<MmapNodeStore> store(OpenStore());
+    store->AddLevel();
+    store->SetLeavesProcessed(42);
+  }
+  EXPECT_EQ(0U, OpenStore()->LeavesProcessed());
+
+  {
+    unique_ptr<MmapNodeStore> store(OpenStore());
+    store->SetLeavesProcessed(42);
+    store->Sync();
+    store->SetLeavesProcessed(50);
+    EXPECT_EQ(50U, store->LeavesProcessed());
+  }
+  EXPECT_EQ(42U, OpenStore()->LeavesProcessed());
+}
+
+
+TEST_F(MmapNodeStoreTest, MerkleTreeMatchesInMemoryTree) {
+  MerkleTree reference(unique_ptr<Sha256Hasher>(new Sha256Hasher));
+  unique_ptr<MerkleTree> tree(OpenTree());
+
+  for (size_t i = 0; i < 300; ++i) {
+    EXPECT_EQ(reference.AddLeaf(std::to_string(i)),
+              tree->AddLeaf(std::to_string(i)));
+    if (i % 7 == 0) {
+      EXPECT_EQ(reference.CurrentRoot(), tree->CurrentRoot());
+    }
+  }
+
+  for (size_t snapshot = 1; snapshot <= 300; snapshot += 13) {
+    EXPECT_EQ(reference.RootAtSnapshot(snapshot),
+              tree->RootAtSnapshot(snapshot));
+    EXPECT_EQ(reference.PathToRootAtSnapshot(snapshot / 2 + 1, snapshot),
+              tree->PathToRootAtSnapshot(snapshot / 2 + 1, snapshot));
+    EXPECT_EQ(reference.SnapshotConsistency(snapshot, 300),
+              tree->SnapshotConsistency(snapshot, 300));
+  }
+}
+
+
+TEST_F(MmapNodeStoreTest, MerkleTreeResumes) {
+  MerkleTree reference(unique_ptr<Sha256Hasher>(new Sha256Hasher));
+  {
+    unique_ptr<MerkleTree> tree(OpenTree());
+    for (size_t i = 0; i < 100; ++i) {
+      reference.AddLeaf(std::to_string(i));
+      tree->AddLeaf(std::to_string(i));
+    }
+    EXPECT_EQ(reference.RootAtSnapshot(77), tree->RootAtSnapshot(77));
+    // Leave some leaves unprocessed.
+    for (size_t i = 100; i < 120; ++i) {
+      reference.AddLeaf(std::to_string(i));
+      tree->AddLeaf(std::to_string(i));
+    }
+    tree->SyncNodes();
+  }
+
+  unique_ptr<MerkleTree> tree(OpenTree());
+  EXPECT_EQ(reference.LeafCount(), tree->LeafCount());
+  EXPECT_EQ(reference.LevelCount(), tree->LevelCount());
+  EXPECT_EQ(reference.LeafHash(13), tree->LeafHash(13));
+  EXPECT_EQ(reference.CurrentRoot(), tree->CurrentRoot());
+  EXPECT_EQ(reference.PathToCurrentRoot(5), tree->PathToCurrentRoot(5));
+
+  reference.AddLeaf("more");
+  tree->AddLeaf("more");
+  EXPECT_EQ(reference.CurrentRoot(), tree->CurrentRoot());
+  EXPECT_EQ(reference.SnapshotConsistency(50, 121),
+            tree->SnapshotConsistency(50, 121));
+}
+
+
+TEST_F(MmapNodeStoreTest, MerkleTreeRecomputesInconsistentNodes) {
+  MerkleTree reference(unique_ptr<Sha256Hasher>(new Sha256Hasher));
+  {
+    unique_ptr<MerkleTree> tree(OpenTree());
+    for (size_t i = 0; i < 50; ++i) {
+      reference.AddLeaf(std::to_string(i));
+      tree->AddLeaf(std::to_string(i));
+    }
+    tree->CurrentRoot();
+    tree->SyncNodes();
+  }
+  {
+    // Pretend we crashed after the update of the interior levels, but
+    // before the leaves processed count was synced.
+    unique_ptr<MmapNodeStore> store(OpenStore());
+    ASSERT_LT(1U, store->LevelCount());
+    store->SetLeavesProcessed(store->LeavesProcessed() - 3);
+    store->Sync();
+  }
+
+  unique_ptr<MerkleTree> tree(OpenTree());
+  EXPECT_EQ(reference.LeafCount(), tree->LeafCount());
+  EXPECT_EQ(reference.CurrentRoot(), tree->CurrentRoot());
+  EXPECT_EQ(reference.PathToRootAtSnapshot(3, 40),
+            tree->PathToRootAtSnapshot(3, 40));
+}
+
+
+// Updating from 3 to 4 leaves rewrites the rightmost node of each
+// interior level, without changing how many nodes there are.
+TEST_F(MmapNodeStoreTest, MerkleTreeRecomputesRewrittenNodes) {
+  MerkleTree reference(unique_ptr<Sha256Hasher>(new Sha256Hasher));
+  {
+    unique_ptr<MerkleTree> tree(OpenTree());
+    for (size_t i = 0; i < 4; ++i) {
+      reference.AddLeaf(std::to_string(i));
+      tree->AddLeaf(std::to_string(i));
+      if (i == 2) {
+        tree->CurrentRoot();
+        tree->SyncNodes();
+      }
+    }
+    // Not synced, as if we had crashed once these nodes were written
+    // back, but not the leaves processed count.
+    tree->CurrentRoot();
+  }
+
+  unique_ptr<MerkleTree> tree(OpenTree());
+  EXPECT_EQ(reference.RootAtSnapshot(3), tree->RootAtSnapshot(3));
+  EXPECT_EQ(reference.PathToRootAtSnapshot(3, 3),
+            tree->PathToRootAtSnapshot(3, 3));
+  EXPECT_EQ(reference.CurrentRoot(), tree->CurrentRoot());
+}
+
+
+TEST_F(MmapNodeStoreTest, MerkleTreeRebuildsMissingNodes) {
+  MerkleTree reference(unique_ptr<Sha256Hasher>(new Sha256Hasher));
+  {
+    unique_ptr<MerkleTree> tree(OpenTree());
+    for (size_t i = 0; i < 50; ++i) {
+      reference.AddLeaf(std::to_string(i));
+      tree->AddLeaf(std::to_string(i));
+    }
+    tree->CurrentRoot();
+    tree->SyncNodes();
+  }
+  {
+    // The root level is missing.
+    unique_ptr<MmapNodeStore> store(OpenStore());
+    store->RemoveLevel();
+  }
+
+  unique_ptr<MerkleTree> tree(OpenTree());
+  EXPECT_EQ(1U, tree->NodeStore()->LevelCount());
+  EXPECT_EQ(reference.CurrentRoot(), tree->CurrentRoot());
+  EXPECT_EQ(reference.PathToRootAtSnapshot(3, 40),
+            tree->PathToRootAtSnapshot(3, 40));
+}
+
+
+}  // namespace
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
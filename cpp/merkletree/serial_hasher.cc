@@ -8,6 +8,12 @@ using std::unique_ptr;
 
 const size_t Sha256Hasher::kDigestSize = SHA256_DIGEST_LENGTH;
 
+string SerialHasher::Final() {
+  string digest(DigestSize(), '\0');
+  Final(reinterpret_cast<uint8_t*>(&digest[0]));
+  return digest;
+}
+
 Sha256Hasher::Sha256Hasher() : initialized_(false) {
 }
 
@@ -16,21 +22,19 @@ void Sha256Hasher::Reset() {
   initialized_ = true;
 }
 
-void Sha256Hasher::Update(const std::string& data) {
+void Sha256Hasher::Update(const uint8_t* data, size_t size) {
   if (!initialized_)
     Reset();
 
-  SHA256_Update(&ctx_, data.data(), data.size());
+  SHA256_Update(&ctx_, data, size);
 }
 
-string Sha256Hasher::Final() {
+void Sha256Hasher::Final(uint8_t* digest) {
   if (!initialized_)
     Reset();
 
-  unsigned char hash[SHA256_DIGEST_LENGTH];
-  SHA256_Final(hash, &ctx_);
+  SHA256_Final(digest, &ctx_);
   initialized_ = false;
-  return string(reinterpret_cast<char*>(hash), SHA256_DIGEST_LENGTH);
 }
 
 unique_ptr<SerialHasher> Sha256Hasher::Create() const {
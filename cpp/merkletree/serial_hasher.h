@@ -3,6 +3,7 @@
 
 #include <openssl/sha.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <memory>
 #include <string>
 
@@ -22,10 +23,16 @@ class SerialHasher {
   virtual void Reset() = 0;
 
   // Update the hash context with (binary) data.
-  virtual void Update(const std::string& data) = 0;
+  virtual void Update(const uint8_t* data, size_t size) = 0;
+  void Update(const std::string& data) {
+    Update(reinterpret_cast<const uint8_t*>(data.data()), data.size());
+  }
 
-  // Finalize the hash context and return the binary digest blob.
-  virtual std::string Final() = 0;
+  // Finalize the hash context and write the binary digest, of
+  // DigestSize() bytes, to |digest|.
+  virtual void Final(uint8_t* digest) = 0;
+  // Same as above, returning the digest as a binary blob.
+  std::string Final();
 
   // A virtual constructor, creates a new instance of the same type.
   virtual std::unique_ptr<SerialHasher> Create() const = 0;
@@ -42,9 +49,12 @@ class Sha256Hasher : public SerialHasher {
     return kDigestSize;
   }
 
+  using SerialHasher::Final;
+  using SerialHasher::Update;
+
   void Reset();
-  void Update(const std::string& data);
-  std::string Final();
+  void Update(const uint8_t* data, size_t size);
+  void Final(uint8_t* digest);
   std::unique_ptr<SerialHasher> Create() const;
 
   // Create a new hasher and call Reset(), Update(), and Final().
@@ -58,4 +68,24 @@ class Sha256Hasher : public SerialHasher {
   DISALLOW_COPY_AND_ASSIGN(Sha256Hasher);
 };
 
+// The SHA-256 functions, for BasicTreeHasher<>. Unlike Sha256Hasher,
+// they are not virtual and the context is the caller's, so they can be
+// inlined into the tree hashing loops and used from several threads.
+struct Sha256 {
+  typedef SHA256_CTX Context;
+  static const size_t kDigestSize = SHA256_DIGEST_LENGTH;
+
+  static void Init(Context* ctx) {
+    SHA256_Init(ctx);
+  }
+
+  static void Update(Context* ctx, const uint8_t* data, size_t size) {
+    SHA256_Update(ctx, data, size);
+  }
+
+  static void Final(Context* ctx, uint8_t* digest) {
+    SHA256_Final(digest, ctx);
+  }
+};
+
 #endif  // CERT_TRANS_MERKLETREE_SERIAL_HASHER_H_
@@ -94,6 +94,20 @@ TYPED_TEST(SerialHasherTest, Update) {
   EXPECT_EQ(H(digest), H(output));
 }
 
+TYPED_TEST(SerialHasherTest, RawBuffers) {
+  const string input(kTestString, kTestStringLength);
+  this->hasher_->Reset();
+  this->hasher_->Update(input);
+  const string digest(this->hasher_->Final());
+
+  string output(this->hasher_->DigestSize(), '\0');
+  this->hasher_->Reset();
+  this->hasher_->Update(reinterpret_cast<const uint8_t*>(input.data()),
+                        input.size());
+  this->hasher_->Final(reinterpret_cast<uint8_t*>(&output[0]));
+  EXPECT_EQ(H(digest), H(output));
+}
+
 TYPED_TEST(SerialHasherTest, Create) {
   string input, output, digest;
 
@@ -0,0 +1,295 @@
+#include "merkletree/sha256_multi_buffer.h"
+
+#include <openssl/sha.h>
+#include <string.h>
+#include <algorithm>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_SHA256_AVX2 1
+#endif
+
+using std::min;
+
+namespace {
+
+#ifdef HAVE_SHA256_AVX2
+// The lanes of a 256-bit vector of 32-bit words.
+const int kLanes = 8;
+const size_t kBlockSize = 64;
+
+const uint32_t kRoundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+const uint32_t kInitialState[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                   0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                   0x1f83d9ab, 0x5be0cd19};
+
+// The number of blocks of a message of |size| bytes once padded: a
+// 0x80 byte and the 64-bit length in bits must fit after it.
+size_t NumBlocks(size_t size) {
+  return (size + 8) / kBlockSize + 1;
+}
+
+// Writes the |index|-th block of the padded message made of |prefix|
+// followed by the |size| bytes at |data|.
+void PaddedBlock(uint8_t prefix, const uint8_t* data, size_t size,
+                 size_t index, uint8_t* block) {
+  const size_t length(size + 1);
+  const size_t begin(index * kBlockSize);
+  const size_t end(begin + kBlockSize);
+  uint8_t* out(block);
+  size_t pos(begin);
+  if (pos == 0) {
+    *out++ = prefix;
+    ++pos;
+  }
+  if (pos < length) {
+    const size_t n(min(end, length) - pos);
+    memcpy(out, data + pos - 1, n);
+    out += n;
+    pos += n;
+  }
+  if (pos == end) {
+    return;
+  }
+
+  memset(out, 0, end - pos);
+  if (length >= begin) {
+    block[length - begin] = 0x80;
+  }
+  if (index == NumBlocks(length) - 1) {
+    const uint64_t bits(static_cast<uint64_t>(length) * 8);
+    for (int i = 0; i < 8; ++i) {
+      block[kBlockSize - 1 - i] = static_cast<uint8_t>(bits >> (8 * i));
+    }
+  }
+}
+
+#define SHA256_AVX2 __attribute__((target("avx2")))
+
+SHA256_AVX2 inline __m256i Add(__m256i a, __m256i b) {
+  return _mm256_add_epi32(a, b);
+}
+
+SHA256_AVX2 inline __m256i RotateRight(__m256i x, int n) {
+  return _mm256_or_si256(_mm256_srli_epi32(x, n),
+                         _mm256_slli_epi32(x, 32 - n));
+}
+
+SHA256_AVX2 inline __m256i Xor3(__m256i a, __m256i b, __m256i c) {
+  return _mm256_xor_si256(_mm256_xor_si256(a, b), c);
+}
+
+// Transposes the 8x8 matrix of 32-bit words in |rows|: the word |j| of
+// row |i| becomes the word |i| of row |j|.
+SHA256_AVX2 inline void Transpose(__m256i* rows) {
+  const __m256i t0(_mm256_unpacklo_epi32(rows[0], rows[1]));
+  const __m256i t1(_mm256_unpackhi_epi32(rows[0], rows[1]));
+  const __m256i t2(_mm256_unpacklo_epi32(rows[2], rows[3]));
+  const __m256i t3(_mm256_unpackhi_epi32(rows[2], rows[3]));
+  const __m256i t4(_mm256_unpacklo_epi32(rows[4], rows[5]));
+  const __m256i t5(_mm256_unpackhi_epi32(rows[4], rows[5]));
+  const __m256i t6(_mm256_unpacklo_epi32(rows[6], rows[7]));
+  const __m256i t7(_mm256_unpackhi_epi32(rows[6], rows[7]));
+  const __m256i s0(_mm256_unpacklo_epi64(t0, t2));
+  const __m256i s1(_mm256_unpackhi_epi64(t0, t2));
+  const __m256i s2(_mm256_unpacklo_epi64(t1, t3));
+  const __m256i s3(_mm256_unpackhi_epi64(t1, t3));
+  const __m256i s4(_mm256_unpacklo_epi64(t4, t6));
+  const __m256i s5(_mm256_unpackhi_epi64(t4, t6));
+  const __m256i s6(_mm256_unpacklo_epi64(t5, t7));
+  const __m256i s7(_mm256_unpackhi_epi64(t5, t7));
+  rows[0] = _mm256_permute2x128_si256(s0, s4, 0x20);
+  rows[1] = _mm256_permute2x128_si256(s1, s5, 0x20);
+  rows[2] = _mm256_permute2x128_si256(s2, s6, 0x20);
+  rows[3] = _mm256_permute2x128_si256(s3, s7, 0x20);
+  rows[4] = _mm256_permute2x128_si256(s0, s4, 0x31);
+  rows[5] = _mm256_permute2x128_si256(s1, s5, 0x31);
+  rows[6] = _mm256_permute2x128_si256(s2, s6, 0x31);
+  rows[7] = _mm256_permute2x128_si256(s3, s7, 0x31);
+}
+
+// Swaps the bytes of each 32-bit word, between the big-endian words of
+// SHA-256 and the little-endian ones of x86.
+SHA256_AVX2 inline __m256i ByteSwap(__m256i x) {
+  const __m256i mask(_mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8,
+                                      15, 14, 13, 12, 3, 2, 1, 0, 7, 6, 5, 4,
+                                      11, 10, 9, 8, 15, 14, 13, 12));
+  return _mm256_shuffle_epi8(x, mask);
+}
+
+// Runs the compression function over one block of each lane, whose
+// words are in |blocks[lane]|, only updating the state of the lanes set
+// in |active|.
+SHA256_AVX2 void Compress(const uint8_t (*blocks)[kBlockSize],
+                          __m256i active, __m256i* state) {
+  __m256i w[16];
+  for (int half = 0; half < 2; ++half) {
+    for (int lane = 0; lane < kLanes; ++lane) {
+      w[8 * half + lane] = _mm256_loadu_si256(
+          reinterpret_cast<const __m256i*>(blocks[lane] + 32 * half));
+    }
+    Transpose(w + 8 * half);
+  }
+  for (int i = 0; i < 16; ++i) {
+    w[i] = ByteSwap(w[i]);
+  }
+
+  __m256i a(state[0]), b(state[1]), c(state[2]), d(state[3]);
+  __m256i e(state[4]), f(state[5]), g(state[6]), h(state[7]);
+  for (int t = 0; t < 64; ++t) {
+    if (t >= 16) {
+      const __m256i w2(w[(t - 2) & 15]);
+      const __m256i w15(w[(t - 15) & 15]);
+      const __m256i s0(Xor3(RotateRight(w15, 7), RotateRight(w15, 18),
+                            _mm256_srli_epi32(w15, 3)));
+      const __m256i s1(Xor3(RotateRight(w2, 17), RotateRight(w2, 19),
+                            _mm256_srli_epi32(w2, 10)));
+      w[t & 15] = Add(Add(w[t & 15], s0), Add(w[(t - 7) & 15], s1));
+    }
+
+    const __m256i sigma1(
+        Xor3(RotateRight(e, 6), RotateRight(e, 11), RotateRight(e, 25)));
+    const __m256i choose(
+        _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g)));
+    const __m256i t1(Add(Add(h, sigma1),
+                         Add(Add(choose, w[t & 15]),
+                             _mm256_set1_epi32(kRoundConstants[t]))));
+    const __m256i sigma0(
+        Xor3(RotateRight(a, 2), RotateRight(a, 13), RotateRight(a, 22)));
+    const __m256i majority(
+        _mm256_or_si256(_mm256_and_si256(a, b),
+                        _mm256_and_si256(c, _mm256_or_si256(a, b))));
+    h = g;
+    g = f;
+    f = e;
+    e = Add(d, t1);
+    d = c;
+    c = b;
+    b = a;
+    a = Add(t1, Add(sigma0, majority));
+  }
+
+  const __m256i updated[8] = {a, b, c, d, e, f, g, h};
+  for (int i = 0; i < 8; ++i) {
+    state[i] =
+        _mm256_blendv_epi8(state[i], Add(state[i], updated[i]), active);
+  }
+}
+
+// Hashes the |kLanes| messages starting at index 0 of the arrays.
+SHA256_AVX2 void HashGroup(uint8_t prefix, const uint8_t* const* data,
+                           const size_t* sizes, Digest* digests) {
+  __m256i state[8];
+  for (int i = 0; i < 8; ++i) {
+    state[i] = _mm256_set1_epi32(kInitialState[i]);
+  }
+
+  size_t num_blocks[kLanes];
+  size_t max_blocks(0);
+  for (int lane = 0; lane < kLanes; ++lane) {
+    num_blocks[lane] = NumBlocks(sizes[lane] + 1);
+    max_blocks = std::max(max_blocks, num_blocks[lane]);
+  }
+
+  alignas(32) uint8_t blocks[kLanes][kBlockSize];
+  for (size_t index = 0; index < max_blocks; ++index) {
+    alignas(32) int32_t active[kLanes];
+    for (int lane = 0; lane < kLanes; ++lane) {
+      active[lane] = index < num_blocks[lane] ? -1 : 0;
+      if (active[lane]) {
+        PaddedBlock(prefix, data[lane], sizes[lane], index, blocks[lane]);
+      }
+    }
+    Compress(blocks,
+             _mm256_load_si256(reinterpret_cast<const __m256i*>(active)),
+             state);
+  }
+
+  // The state has a word of each lane in each vector, a digest needs
+  // the words of its lane.
+  Transpose(state);
+  for (int lane = 0; lane < kLanes; ++lane) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(digests[lane].data()),
+                        ByteSwap(state[lane]));
+  }
+}
+
+#undef SHA256_AVX2
+#endif  // HAVE_SHA256_AVX2
+
+}  // namespace
+
+void Sha256MultiBuffer(uint8_t prefix, size_t count,
+                       const uint8_t* const* data, const size_t* sizes,
+                       Digest* digests) {
+  static const bool use_avx2(Sha256MultiBufferUsesAvx2());
+  if (use_avx2) {
+    internal::Sha256MultiBufferAvx2(prefix, count, data, sizes, digests);
+  } else {
+    internal::Sha256MultiBufferScalar(prefix, count, data, sizes, digests);
+  }
+}
+
+bool Sha256MultiBufferUsesAvx2() {
+  if (!internal::CpuHasAvx2()) {
+    return false;
+  }
+#ifdef HAVE_SHA256_AVX2
+  unsigned int eax, ebx, ecx, edx;
+  if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA)) {
+    return false;
+  }
+#endif
+  return true;
+}
+
+namespace internal {
+
+bool CpuHasAvx2() {
+#ifdef HAVE_SHA256_AVX2
+  // This also checks that the OS saves the AVX registers.
+  return __builtin_cpu_supports("avx2");
+#else
+  return false;
+#endif
+}
+
+void Sha256MultiBufferScalar(uint8_t prefix, size_t count,
+                             const uint8_t* const* data, const size_t* sizes,
+                             Digest* digests) {
+  for (size_t i = 0; i < count; ++i) {
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, &prefix, 1);
+    SHA256_Update(&ctx, data[i], sizes[i]);
+    SHA256_Final(digests[i].data(), &ctx);
+  }
+}
+
+void Sha256MultiBufferAvx2(uint8_t prefix, size_t count,
+                           const uint8_t* const* data, const size_t* sizes,
+                           Digest* digests) {
+  size_t i(0);
+#ifdef HAVE_SHA256_AVX2
+  for (; i + kLanes <= count; i += kLanes) {
+    HashGroup(prefix, data + i, sizes + i, digests + i);
+  }
+#endif
+  Sha256MultiBufferScalar(prefix, count - i, data + i, sizes + i,
+                          digests + i);
+}
+
+}  // namespace internal
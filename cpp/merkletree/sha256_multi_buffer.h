@@ -0,0 +1,47 @@
+#ifndef CERT_TRANS_MERKLETREE_SHA256_MULTI_BUFFER_H_
+#define CERT_TRANS_MERKLETREE_SHA256_MULTI_BUFFER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "merkletree/digest.h"
+
+// SHA-256 of many independent messages, several at a time. Each
+// message is the byte |prefix| followed by the |sizes[i]| bytes at
+// |data[i]| (the shape of the leaf and node hashes of RFC 6962), and
+// its digest goes to |digests[i]|, for |i| < |count|. The digests are
+// written after all the messages of a group have been read, so
+// |digests| may overlap the messages of the previous groups.
+//
+// On x86-64 CPUs with AVX2 (checked at runtime), eight messages are
+// hashed at once, one in each 32-bit lane of the vector registers,
+// which is about three times faster than one at a time. Otherwise, and
+// for the messages left over once the lanes cannot all be filled, they
+// are hashed one at a time with OpenSSL. So they are too on CPUs with
+// the SHA extensions, with which OpenSSL is as fast as the AVX2 kernel.
+void Sha256MultiBuffer(uint8_t prefix, size_t count,
+                       const uint8_t* const* data, const size_t* sizes,
+                       Digest* digests);
+
+// Whether Sha256MultiBuffer() uses the AVX2 kernel on this CPU.
+bool Sha256MultiBufferUsesAvx2();
+
+namespace internal {
+
+// Whether this CPU can run Sha256MultiBufferAvx2().
+bool CpuHasAvx2();
+
+// The two implementations of Sha256MultiBuffer(), for testing.
+// Sha256MultiBufferAvx2() must only be called if CpuHasAvx2(); it
+// hashes the messages left over after the groups of eight with
+// Sha256MultiBufferScalar().
+void Sha256MultiBufferScalar(uint8_t prefix, size_t count,
+                             const uint8_t* const* data, const size_t* sizes,
+                             Digest* digests);
+void Sha256MultiBufferAvx2(uint8_t prefix, size_t count,
+                           const uint8_t* const* data, const size_t* sizes,
+                           Digest* digests);
+
+}  // namespace internal
+
+#endif  // CERT_TRANS_MERKLETREE_SHA256_MULTI_BUFFER_H_
@@ -0,0 +1,162 @@
+#include <gtest/gtest.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "merkletree/serial_hasher.h"
+#include "merkletree/sha256_multi_buffer.h"
+#include "util/testing.h"
+#include "util/util.h"
+
+namespace {
+
+using std::string;
+using std::vector;
+
+typedef void (*MultiBufferFunction)(uint8_t, size_t, const uint8_t* const*,
+                                    const size_t*, Digest*);
+
+// The SHA-256 of |prefix| followed by |message|, with OpenSSL.
+string Expected(uint8_t prefix, const string& message) {
+  return Sha256Hasher::Sha256Digest(string(1, prefix) + message);
+}
+
+// Hashes |messages| with |hash|, and checks every digest.
+void ExpectDigests(MultiBufferFunction hash, uint8_t prefix,
+                   const vector<string>& messages) {
+  vector<const uint8_t*> data;
+  vector<size_t> sizes;
+  for (const auto& message : messages) {
+    data.push_back(reinterpret_cast<const uint8_t*>(message.data()));
+    sizes.push_back(message.size());
+  }
+  vector<Digest> digests(messages.size());
+  hash(prefix, messages.size(), data.data(), sizes.data(), digests.data());
+  for (size_t i = 0; i < messages.size(); ++i) {
+    EXPECT_EQ(util::HexString(Expected(prefix, messages[i])),
+              util::HexString(digests[i].ToString()))
+        << "message " << i << " of " << messages.size() << ", "
+        << messages[i].size() << " bytes";
+  }
+}
+
+// Messages of every size from 0 to |max_size|, which covers the
+// padding of one to several blocks, with varied bytes.
+vector<string> MessagesUpTo(size_t max_size) {
+  vector<string> messages;
+  for (size_t size = 0; size <= max_size; ++size) {
+    string message(size, '\0');
+    for (size_t i = 0; i < size; ++i) {
+      message[i] = static_cast<char>(size * 31 + i * 7);
+    }
+    messages.push_back(message);
+  }
+  return messages;
+}
+
+class Sha256MultiBufferTest
+    : public ::testing::TestWithParam<MultiBufferFunction> {
+ protected:
+  void SetUp() {
+    if (GetParam() == &internal::Sha256MultiBufferAvx2 &&
+        !internal::CpuHasAvx2()) {
+      skip_ = true;
+    }
+  }
+
+  bool skip_ = false;
+};
+
+TEST_P(Sha256MultiBufferTest, KnownDigest) {
+  if (skip_) {
+    return;
+  }
+  // The RFC 6962 hash of an empty leaf.
+  const vector<string> messages(8, string());
+  vector<const uint8_t*> data(8, nullptr);
+  vector<size_t> sizes(8, 0);
+  vector<Digest> digests(8);
+  GetParam()(0x00, messages.size(), data.data(), sizes.data(),
+             digests.data());
+  for (const auto& digest : digests) {
+    EXPECT_EQ(
+        "6e340b9cffb37a989ca544e6bb780a2c78901d3fb33738768511a30617afa01d",
+        util::HexString(digest.ToString()));
+  }
+}
+
+TEST_P(Sha256MultiBufferTest, AllSizes) {
+  if (skip_) {
+    return;
+  }
+  ExpectDigests(GetParam(), 0x00, MessagesUpTo(300));
+  ExpectDigests(GetParam(), 0x01, MessagesUpTo(300));
+}
+
+// Messages of different sizes in the same group of lanes, which need
+// different numbers of blocks.
+TEST_P(Sha256MultiBufferTest, MixedSizes) {
+  if (skip_) {
+    return;
+  }
+  vector<string> messages;
+  const size_t sizes[] = {0, 1000, 54, 55, 63, 64, 119, 5000, 2, 64, 128};
+  for (size_t size : sizes) {
+    messages.push_back(string(size, static_cast<char>('a' + size % 26)));
+  }
+  ExpectDigests(GetParam(), 0x00, messages);
+}
+
+// Batches which do not fill the lanes, or leave some over.
+TEST_P(Sha256MultiBufferTest, BatchSizes) {
+  if (skip_) {
+    return;
+  }
+  const vector<string> all(MessagesUpTo(40));
+  for (size_t count = 0; count <= all.size(); ++count) {
+    ExpectDigests(GetParam(), 0x01,
+                  vector<string>(all.begin(), all.begin() + count));
+  }
+}
+
+// The digests can overwrite the messages already hashed, like the
+// parents of pairs of nodes.
+TEST_P(Sha256MultiBufferTest, InPlace) {
+  if (skip_) {
+    return;
+  }
+  vector<Digest> nodes(2 * 37);
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    nodes[i] = Digest(Sha256Hasher::Sha256Digest(std::to_string(i)));
+  }
+  vector<string> expected;
+  vector<const uint8_t*> data;
+  vector<size_t> sizes;
+  for (size_t i = 0; i < nodes.size() / 2; ++i) {
+    expected.push_back(Expected(
+        0x01, nodes[2 * i].ToString() + nodes[2 * i + 1].ToString()));
+    data.push_back(nodes[2 * i].data());
+    sizes.push_back(2 * Digest::kSize);
+  }
+
+  GetParam()(0x01, data.size(), data.data(), sizes.data(), nodes.data());
+  for (size_t i = 0; i < expected.size(); ++i) {
+    EXPECT_EQ(util::HexString(expected[i]),
+              util::HexString(nodes[i].ToString()))
+        << i;
+  }
+}
+
+INSTANTIATE_TEST_CASE_P(Implementations, Sha256MultiBufferTest,
+                        ::testing::Values(
+                            &internal::Sha256MultiBufferScalar,
+                            &internal::Sha256MultiBufferAvx2,
+                            &Sha256MultiBuffer));
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
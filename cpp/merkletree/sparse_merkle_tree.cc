@@ -2,18 +2,34 @@
 
 #include <stddef.h>
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include <vector>
 
+#include "base/macros.h"
 #include "merkletree/merkle_tree_math.h"
+#include "util/executor.h"
 #include "util/util.h"
 
-using std::make_pair;
+using std::array;
+using std::atomic;
+using std::condition_variable;
+using std::copy;
+using std::lock_guard;
+using std::make_shared;
+using std::map;
+using std::min;
+using std::mutex;
 using std::ostream;
 using std::ostringstream;
+using std::pair;
 using std::reverse;
+using std::shared_ptr;
 using std::string;
+using std::unique_lock;
 using std::unique_ptr;
-using std::unordered_map;
 using std::vector;
 
 
@@ -33,73 +49,156 @@ const vector<string>* GetNullHashes(const TreeHasher& hasher) {
 }
 
 
+const int SparseMerkleTree::kDigestSizeBits;
+
+
+// The subtrees rehashed by one CurrentRoot(executor) call, shared by
+// all the threads that take part in it. As with LeafHasher, helpers
+// might only start running once CurrentRoot() has returned, so they
+// hold a reference to this, but only touch the tree if there are
+// subtrees left, which means it has not returned.
+class SparseMerkleTree::RehashJob {
+ public:
+  RehashJob(SparseMerkleTree* tree,
+            const vector<pair<size_t, NodeRef>>* subtrees)
+      : tree_(CHECK_NOTNULL(tree)),
+        subtrees_(CHECK_NOTNULL(subtrees)),
+        num_subtrees_(subtrees_->size()),
+        next_subtree_(0),
+        done_subtrees_(0) {
+  }
+
+  size_t num_subtrees() const {
+    return num_subtrees_;
+  }
+
+  // Rehashes subtrees until there are none left. They are disjoint, so
+  // this only writes to nodes no other thread is looking at.
+  void Run() {
+    unique_ptr<TreeHasher> hasher;
+    for (size_t i = next_subtree_++; i < num_subtrees_; i = next_subtree_++) {
+      if (!hasher) {
+        // TreeHasher serializes its callers, so every thread needs its
+        // own.
+        hasher.reset(new TreeHasher(tree_->hasher_model_->Create()));
+      }
+      tree_->CalculateSubtreeHash((*subtrees_)[i].first,
+                                  (*subtrees_)[i].second, *hasher);
+
+      lock_guard<mutex> lock(lock_);
+      if (++done_subtrees_ == num_subtrees_) {
+        done_.notify_all();
+      }
+    }
+  }
+
+  // Blocks until all the subtrees have been rehashed.
+  void Wait() {
+    unique_lock<mutex> lock(lock_);
+    done_.wait(lock, [this]() { return done_subtrees_ == num_subtrees_; });
+  }
+
+ private:
+  SparseMerkleTree* const tree_;
+  const vector<pair<size_t, NodeRef>>* const subtrees_;
+  const size_t num_subtrees_;
+  atomic<size_t> next_subtree_;
+
+  mutex lock_;
+  condition_variable done_;
+  size_t done_subtrees_;
+
+  DISALLOW_COPY_AND_ASSIGN(RehashJob);
+};
+
+
 SparseMerkleTree::SparseMerkleTree(SerialHasher* hasher)
-    : treehasher_(unique_ptr<SerialHasher>(hasher)),
-      null_hashes_(GetNullHashes(treehasher_)) {
+    : hasher_model_(CHECK_NOTNULL(hasher)->Create()),
+      treehasher_(unique_ptr<SerialHasher>(hasher)),
+      null_hashes_(GetNullHashes(treehasher_)),
+      internal_nodes_(1) {
+  CHECK_EQ(Digest::kSize, treehasher_.DigestSize());
+  for (const auto& null_hash : *null_hashes_) {
+    null_nodes_.emplace_back(null_hash);
+  }
 }
 
 
-void SparseMerkleTree::EnsureHaveLevel(size_t level) {
-  if (tree_.size() < (level + 1)) {
-    tree_.resize(level + 1);
-  }
+SparseMerkleTree::NodeRef SparseMerkleTree::AddLeafNode(
+    const Path& path, const Digest& leaf_hash) {
+  CHECK_LT(leaf_nodes_.size(), static_cast<size_t>(kLeafBit));
+  leaf_nodes_.emplace_back(path, leaf_hash);
+  return (leaf_nodes_.size() - 1) | kLeafBit;
+}
+
+
+SparseMerkleTree::NodeRef SparseMerkleTree::AddInternalNode() {
+  CHECK_LT(internal_nodes_.size(), static_cast<size_t>(kLeafBit));
+  internal_nodes_.emplace_back();
+  return internal_nodes_.size() - 1;
 }
 
 
 void SparseMerkleTree::SetLeaf(const Path& path, const string& data) {
   CHECK_EQ(treehasher_.DigestSize(), path.size());
-  // Mark the tree dirty:
-  root_hash_.clear();
-  string leaf_hash(treehasher_.HashLeaf(data));
-
-  IndexType node_index(0);
-  for (int depth(0); depth <= kDigestSizeBits; ++depth) {
-    node_index += PathBit(path, depth);
-    EnsureHaveLevel(depth);
-    auto it(tree_[depth].find(node_index));
-    if (it == tree_[depth].end()) {
-      CHECK(tree_[depth]
-                .emplace(make_pair(node_index, TreeNode(path, leaf_hash)))
-                .second);
+  Digest leaf_hash;
+  treehasher_.HashLeaf(reinterpret_cast<const uint8_t*>(data.data()),
+                       data.size(), &leaf_hash);
+
+  // Walk down from the root, marking every internal node on the way
+  // dirty. Since |internal_nodes_| and |leaf_nodes_| can grow (and so
+  // move) in the loop, nodes are only ever referred to by index.
+  NodeRef node(0);
+  for (int depth(0); depth < kDigestSizeBits; ++depth) {
+    internal_nodes_[node].hash_valid = false;
+    const int bit(PathBit(path, depth));
+    const NodeRef child(internal_nodes_[node].children[bit]);
+    if (child == kNoNode) {
+      const NodeRef leaf(AddLeafNode(path, leaf_hash));
+      internal_nodes_[node].children[bit] = leaf;
       return;
-    } else if (it->second.type_ == TreeNode::INTERNAL) {
-      // Mark the internal node hash dirty
-      it->second.hash_.clear();
-    } else if (*it->second.path_ == path) {
+    } else if (!IsLeaf(child)) {
+      node = child;
+      continue;
+    }
+
+    LeafNode& existing(leaf_nodes_[child & ~kLeafBit]);
+    if (existing.path == path) {
       // replacement
-      CHECK_EQ(TreeNode::LEAF, it->second.type_);
-      it->second.hash_ = std::move(leaf_hash);
+      existing.leaf_hash = leaf_hash;
+      existing.hash_valid = false;
       return;
-    } else {
-      // restructure: push the existing node down a level and replace this one
-      // with an INTERNAL node
-      CHECK_LT(depth, kDigestSizeBits);
-      EnsureHaveLevel(depth + 1);
-      IndexType child_index((node_index << 1) +
-                            PathBit(*it->second.path_, depth + 1));
-      CHECK(tree_[depth + 1]
-                .emplace(make_pair(child_index, std::move(it->second)))
-                .second);
-      it->second.type_ = TreeNode::INTERNAL;
-      it->second.hash_.clear();
-    }
-    node_index <<= 1;
+    }
+
+    // restructure: push the existing leaf down a level and replace it with
+    // an INTERNAL node
+    CHECK_LT(depth + 1, kDigestSizeBits);
+    existing.hash_valid = false;
+    const int existing_bit(PathBit(existing.path, depth + 1));
+    const NodeRef internal(AddInternalNode());
+    internal_nodes_[internal].children[existing_bit] = child;
+    internal_nodes_[node].children[bit] = internal;
+    node = internal;
   }
   LOG(FATAL) << "Failed to set " << path << " to " << data;
 }
 
 
 void SparseMerkleTree::DumpTree(ostream* os, size_t depth,
-                                IndexType index) const {
-  if (tree_.size() <= depth) {
-    return;
-  }
+                                NodeRef node) const {
   const string indent((depth + 1) * 2, '-');
   for (int side(0); side < 2; ++side) {
-    auto child(tree_[depth].find(index + side));
-    if (child != tree_[depth].end()) {
-      *os << indent << side << ": " << child->second.DebugString() << "\n";
-      DumpTree(os, depth + 1, (index + side) << 1);
+    const NodeRef child(internal_nodes_[node].children[side]);
+    if (child == kNoNode) {
+      continue;
+    }
+    if (IsLeaf(child)) {
+      *os << indent << side << ": "
+          << leaf_nodes_[child & ~kLeafBit].DebugString() << "\n";
+    } else {
+      *os << indent << side << ": " << internal_nodes_[child].DebugString()
+          << "\n";
+      DumpTree(os, depth + 1, child);
     }
   }
 }
@@ -107,99 +206,314 @@ void SparseMerkleTree::DumpTree(ostream* os, size_t depth,
 
 string SparseMerkleTree::Dump() const {
   ostringstream ret;
-  ret << "\nTree [Root: " << util::ToBase64(root_hash_) << "]:\n";
-  if (!tree_.empty()) {
-    DumpTree(&ret, 0, 0);
-  }
+  ret << "\nTree [Root: "
+      << (internal_nodes_[0].hash_valid
+              ? util::ToBase64(internal_nodes_[0].hash.ToString())
+              : "")
+      << "]:\n";
+  DumpTree(&ret, 0, 0);
   return ret.str();
 }
 
 
-string SparseMerkleTree::CalculateSubtreeHash(size_t depth, IndexType index) {
-  if (tree_.size() <= depth) {
-    return null_hashes_->at(depth);
+const Digest& SparseMerkleTree::CalculateSubtreeHash(
+    size_t depth, NodeRef node, const TreeHasher& hasher) {
+  // (The root, at depth 0, has the same index as kNoNode.)
+  if (depth > 0 && node == kNoNode) {
+    return null_nodes_[depth - 1];
   }
 
-  auto it(tree_[depth].find(index));
-  if (it != tree_[depth].end()) {
-    switch (it->second.type_) {
-      case TreeNode::INTERNAL: {
-        if (!it->second.hash_.empty()) {
-          return it->second.hash_;
-        }
-        IndexType left_child_index(index << 1);
-        const string left(CalculateSubtreeHash(depth + 1, left_child_index));
-        const string right(
-            CalculateSubtreeHash(depth + 1, left_child_index + 1));
-        it->second.hash_.assign(treehasher_.HashChildren(left, right));
-        return it->second.hash_;
-      }
+  if (IsLeaf(node)) {
+    LeafNode& leaf(leaf_nodes_[node & ~kLeafBit]);
+    if (!leaf.hash_valid) {
+      HashUpFromLeaf(leaf.path, leaf.leaf_hash, depth, hasher, &leaf.hash);
+      leaf.hash_valid = true;
+    }
+    return leaf.hash;
+  }
 
-      case TreeNode::LEAF: {
-        string ret(it->second.hash_);
-        const int64_t signed_depth(depth);
-        CHECK_LE(0, signed_depth);
-        for (int i(kDigestSizeBits - 1); i > signed_depth; --i) {
-          if (PathBit(*(it->second.path_), i) == 0) {
-            ret = treehasher_.HashChildren(ret, null_hashes_->at(i));
-          } else {
-            ret = treehasher_.HashChildren(null_hashes_->at(i), ret);
-          }
-        }
-        // TODO(alcutter): maybe cache this?
-        return ret;
-      }
+  if (!internal_nodes_[node].hash_valid) {
+    // The recursion does not add nodes, so the references into the node
+    // arrays stay valid.
+    const NodeRef left(internal_nodes_[node].children[0]);
+    const NodeRef right(internal_nodes_[node].children[1]);
+    const Digest& left_hash(CalculateSubtreeHash(depth + 1, left, hasher));
+    const Digest& right_hash(CalculateSubtreeHash(depth + 1, right, hasher));
+    hasher.HashChildren(left_hash, right_hash, &internal_nodes_[node].hash);
+    internal_nodes_[node].hash_valid = true;
+  }
+  return internal_nodes_[node].hash;
+}
+
+
+void SparseMerkleTree::HashUpFromLeaf(const Path& path,
+                                      const Digest& leaf_hash, size_t depth,
+                                      const TreeHasher& hasher,
+                                      Digest* hash) const {
+  CHECK_LT(0U, depth);
+  *hash = leaf_hash;
+  for (size_t i(kDigestSizeBits - 1); i >= depth; --i) {
+    if (PathBit(path, i) == 0) {
+      hasher.HashChildren(*hash, null_nodes_[i], hash);
+    } else {
+      hasher.HashChildren(null_nodes_[i], *hash, hash);
     }
-    LOG(FATAL) << "Unknown node type " << it->second.type_ << " !";
   }
+}
+
 
-  return null_hashes_->at(depth);
+bool SparseMerkleTree::IsDirty(NodeRef node) const {
+  if (IsLeaf(node)) {
+    return !leaf_nodes_[node & ~kLeafBit].hash_valid;
+  }
+  return !internal_nodes_[node].hash_valid;
+}
+
+
+void SparseMerkleTree::FindDirtySubtrees(
+    size_t depth, NodeRef node, size_t max_depth,
+    vector<pair<size_t, NodeRef>>* subtrees) {
+  if (depth == max_depth || IsLeaf(node)) {
+    subtrees->emplace_back(depth, node);
+    return;
+  }
+  for (const NodeRef child : internal_nodes_[node].children) {
+    if (child != kNoNode && IsDirty(child)) {
+      FindDirtySubtrees(depth + 1, child, max_depth, subtrees);
+    }
+  }
 }
 
 
 string SparseMerkleTree::CurrentRoot() {
-  if (root_hash_.empty()) {
-    root_hash_ = treehasher_.HashChildren(CalculateSubtreeHash(0, 0),
-                                          CalculateSubtreeHash(0, 1));
+  return CalculateSubtreeHash(0, 0, treehasher_).ToString();
+}
+
+
+string SparseMerkleTree::CurrentRoot(util::Executor* executor) {
+  CHECK_NOTNULL(executor);
+  if (!IsDirty(0)) {
+    return internal_nodes_[0].hash.ToString();
+  }
+
+  // Rehash the dirty subtrees kParallelDepth levels down concurrently,
+  // which leaves only the few nodes above them to rehash here.
+  vector<pair<size_t, NodeRef>> subtrees;
+  FindDirtySubtrees(0, 0, kParallelDepth, &subtrees);
+  const shared_ptr<RehashJob> job(make_shared<RehashJob>(this, &subtrees));
+
+  const size_t num_helpers(min<size_t>(job->num_subtrees(),
+                                       std::thread::hardware_concurrency()));
+  // The calling thread is one of them.
+  for (size_t i = 1; i < num_helpers; ++i) {
+    executor->Add([job]() { job->Run(); });
   }
-  return root_hash_;
+  job->Run();
+  job->Wait();
+
+  return CurrentRoot();
 }
 
 
 std::vector<string> SparseMerkleTree::InclusionProof(const Path& path) {
-  // TODO(alcutter): implement
-  LOG(FATAL) << "Not implemented.";
-}
+  // Bring all the node hashes up to date.
+  CurrentRoot();
 
+  // |siblings[i]| is the sibling of the node at depth i + 1 along |path|,
+  // which is null unless we find otherwise on the way down.
+  array<Digest, kDigestSizeBits> siblings;
+  copy(null_nodes_.begin(), null_nodes_.end(), siblings.begin());
 
-string SparseMerkleTree::TreeNode::DebugString() const {
-  ostringstream os;
-  os << "[TreeNode type: ";
-  switch (type_) {
-    case INTERNAL:
-      os << "I";
-      break;
-    case LEAF:
-      os << "L";
+  NodeRef node(0);
+  for (size_t depth(0); depth < siblings.size(); ++depth) {
+    const int bit(PathBit(path, depth));
+    const NodeRef sibling(internal_nodes_[node].children[1 - bit]);
+    if (sibling != kNoNode) {
+      siblings[depth] = IsLeaf(sibling) ? leaf_nodes_[sibling & ~kLeafBit].hash
+                                        : internal_nodes_[sibling].hash;
+    }
+
+    const NodeRef child(internal_nodes_[node].children[bit]);
+    if (child == kNoNode) {
       break;
+    } else if (!IsLeaf(child)) {
+      node = child;
+      continue;
+    }
+
+    const LeafNode& leaf(leaf_nodes_[child & ~kLeafBit]);
+    if (leaf.path != path) {
+      // Were |path| set, |leaf| would be pushed down to where their paths
+      // diverge, as the sibling of the node along |path| there.
+      const size_t diverge(FirstDifferingBit(leaf.path, path, depth + 1));
+      CHECK_LT(diverge, siblings.size());
+      HashUpFromLeaf(leaf.path, leaf.leaf_hash, diverge + 1, treehasher_,
+                     &siblings[diverge]);
+    }
+    break;
+  }
+
+  vector<string> proof;
+  proof.reserve(kDigestSizeBits);
+  for (auto it(siblings.rbegin()); it != siblings.rend(); ++it) {
+    proof.emplace_back(it->ToString());
   }
+  return proof;
+}
 
-  os << " hash: ";
-  if (!hash_.empty()) {
-    os << util::ToBase64(hash_);
+
+string SparseMerkleTree::InternalNode::DebugString() const {
+  ostringstream os;
+  os << "[TreeNode type: I hash: ";
+  if (hash_valid) {
+    os << util::ToBase64(hash.ToString());
   } else {
     os << "(unset)";
   }
+  os << "]";
+  return os.str();
+}
 
-  if (path_) {
-    os << " path: ";
-    os << *path_;
+
+string SparseMerkleTree::LeafNode::DebugString() const {
+  ostringstream os;
+  os << "[TreeNode type: L hash: ";
+  if (hash_valid) {
+    os << util::ToBase64(hash.ToString());
+  } else {
+    os << "(unset)";
   }
-  os << "]";
+  os << " path: " << path << "]";
   return os.str();
 }
 
 
+size_t FirstDifferingBit(const SparseMerkleTree::Path& a,
+                         const SparseMerkleTree::Path& b, size_t start) {
+  size_t byte(start >> 3);
+  if (byte >= a.size()) {
+    return SparseMerkleTree::kDigestSizeBits;
+  }
+  // Ignore the bits before |start| in the first byte.
+  uint8_t diff((a[byte] ^ b[byte]) & (0xff >> (start & 7)));
+  while (diff == 0) {
+    if (++byte == a.size()) {
+      return SparseMerkleTree::kDigestSizeBits;
+    }
+    diff = a[byte] ^ b[byte];
+  }
+  size_t bit(byte * 8);
+  for (; (diff & 0x80) == 0; diff <<= 1) {
+    ++bit;
+  }
+  return bit;
+}
+
+
+namespace {
+
+
+// Reads the proof of VerifyMultiInclusionProof() sibling by sibling.
+class MultiProofReader {
+ public:
+  MultiProofReader(const MultiInclusionProof& proof,
+                   const vector<string>& null_hashes)
+      : proof_(proof), null_hashes_(null_hashes), sibling_(0), hash_(0) {
+  }
+
+  // The next sibling, at |depth|, in |hash|. Returns false if the
+  // proof is too short.
+  bool Next(size_t depth, string* hash) {
+    const size_t byte(sibling_ >> 3);
+    if (byte >= proof_.bitmap.size()) {
+      return false;
+    }
+    const bool set((proof_.bitmap[byte] >> (7 - (sibling_ & 7))) & 1);
+    ++sibling_;
+    if (!set) {
+      *hash = null_hashes_[depth - 1];
+      return true;
+    }
+    if (hash_ >= proof_.hashes.size()) {
+      return false;
+    }
+    *hash = proof_.hashes[hash_++];
+    return true;
+  }
+
+  // Whether all of the proof was used (but the padding of the bitmap).
+  bool Done() const {
+    return hash_ == proof_.hashes.size() &&
+           (sibling_ + 7) / 8 == proof_.bitmap.size();
+  }
+
+ private:
+  const MultiInclusionProof& proof_;
+  const vector<string>& null_hashes_;
+  size_t sibling_;
+  size_t hash_;
+};
+
+
+typedef map<SparseMerkleTree::Path, string>::const_iterator LeafIterator;
+
+
+// The hash of the subtree at |depth| with the leaves from |first| to
+// |last|, all with the same first |depth| bits.
+bool MultiProofSubtreeHash(const TreeHasher& hasher, size_t depth,
+                           LeafIterator first, LeafIterator last,
+                           MultiProofReader* reader, string* hash) {
+  if (depth == SparseMerkleTree::kDigestSizeBits) {
+    *hash = first->second;
+    return true;
+  }
+  LeafIterator middle(first);
+  while (middle != last && PathBit(middle->first, depth) == 0) {
+    ++middle;
+  }
+  string left, right;
+  if (middle == first) {
+    if (!reader->Next(depth + 1, &left) ||
+        !MultiProofSubtreeHash(hasher, depth + 1, middle, last, reader,
+                               &right)) {
+      return false;
+    }
+  } else if (middle == last) {
+    if (!reader->Next(depth + 1, &right) ||
+        !MultiProofSubtreeHash(hasher, depth + 1, first, middle, reader,
+                               &left)) {
+      return false;
+    }
+  } else if (!MultiProofSubtreeHash(hasher, depth + 1, first, middle, reader,
+                                    &left) ||
+             !MultiProofSubtreeHash(hasher, depth + 1, middle, last, reader,
+                                    &right)) {
+    return false;
+  }
+  *hash = hasher.HashChildren(left, right);
+  return true;
+}
+
+
+}  // namespace
+
+
+bool VerifyMultiInclusionProof(const TreeHasher& hasher,
+                               const map<SparseMerkleTree::Path, string>&
+                                   leaf_hashes,
+                               const MultiInclusionProof& proof,
+                               const string& root) {
+  if (leaf_hashes.empty()) {
+    return false;
+  }
+  MultiProofReader reader(proof, *GetNullHashes(hasher));
+  string hash;
+  return MultiProofSubtreeHash(hasher, 0, leaf_hashes.begin(),
+                               leaf_hashes.end(), &reader, &hash) &&
+         reader.Done() && hash == root;
+}
+
+
 ostream& operator<<(ostream& out, const SparseMerkleTree::Path& path) {
   for (size_t i(0); i < path.size(); ++i) {
     uint8_t t(path[i]);
@@ -3,16 +3,25 @@
 
 #include <glog/logging.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 #include <array>
+#include <map>
+#include <memory>
 #include <string>
-#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "merkletree/digest.h"
 #include "merkletree/merkle_tree_interface.h"
 #include "merkletree/tree_hasher.h"
 
 class SerialHasher;
 
+namespace util {
+class Executor;
+}  // namespace util
+
 
 // Calculates the set of "null" hashes:
 // ...H(H(H("")||H(""))||H("")||(H(""))||...)...
@@ -105,6 +114,15 @@ const std::vector<std::string>* GetNullHashes(const TreeHasher& hasher);
  * optimised by cribbing the value of "missing" nodes from a simple cache. This
  * removes the need to calculate the vast majority of nodes from scratch.
  *
+ * * Node layout
+ * The nodes are kept in two flat arrays (one for internal nodes, one for
+ * leaves), linked by 32-bit indices, with their hashes and paths inline, so
+ * that a tree with millions of leaves costs a couple of allocations rather
+ * than several per node. SetLeaf() only marks the nodes along the path as
+ * dirty, and CurrentRoot() then rehashes every dirty node once, however many
+ * leaves were set below it since the last time: a batch of updates is
+ * cheaper than the same updates with a CurrentRoot() call after each.
+ *
  * TODO(alcutter): LOTS!
  *
  * This class is thread-compatible, but not thread-safe.
@@ -162,13 +180,18 @@ class SparseMerkleTree {
   // (and hence, no root).
   virtual std::string CurrentRoot();
 
+  // Same as above, but rehashes the dirty subtrees a few levels below
+  // the root in parallel on |executor|, along with the calling thread
+  // (which can be one of the threads of |executor| itself).
+  std::string CurrentRoot(util::Executor* executor);
+
   // Get the Merkle path from the leaf at |path| to the current root.
   //
-  // Returns a vector of node hashes, ordered by levels from leaf to root.
-  // The first element is the sibling of the leaf hash, and the last element
-  // is one below the root.
-  // Returns an empty vector if the tree is not large enough
-  // or the leaf index is 0.
+  // Returns a vector of kDigestSizeBits node hashes, ordered by levels from
+  // leaf to root. The first element is the sibling of the leaf hash, and the
+  // last element is one below the root.
+  // If no leaf is set at |path|, this is the path from the null leaf
+  // (the hash of an empty string) there, which proves that it is not set.
   //
   // @param path the path of the leaf whose inclusion proof to return.
   std::vector<std::string> InclusionProof(const Path& path);
@@ -176,43 +199,82 @@ class SparseMerkleTree {
   std::string Dump() const;
 
  private:
-  // WARNING WARNING WARNING
-  // 64 < 256 !
-  // WARNING WARNING WARNING
-  // TODO(alcutter): BIGNUM probably.
-  typedef uint64_t IndexType;
-
-  struct TreeNode {
-    TreeNode(const std::string& hash) : type_(INTERNAL), hash_(hash) {
-    }
-
-    TreeNode(const Path& path, const std::string& leaf_hash)
-        : type_(LEAF), path_(new Path(path)), hash_(leaf_hash) {
+  // Reference to a node: kNoNode, the index of an InternalNode in
+  // |internal_nodes_|, or that of a LeafNode in |leaf_nodes_| with
+  // kLeafBit set. The root is internal node 0, which is nobody's child.
+  typedef uint32_t NodeRef;
+  static const NodeRef kNoNode = 0;
+  static const NodeRef kLeafBit = 1U << 31;
+  // Depth of the subtrees rehashed concurrently by CurrentRoot(), which
+  // makes for up to 2^kParallelDepth of them.
+  static const size_t kParallelDepth = 8;
+
+  class RehashJob;
+
+  struct InternalNode {
+    InternalNode() : hash_valid(false), children{kNoNode, kNoNode} {
     }
 
     std::string DebugString() const;
 
-    enum { INTERNAL, LEAF } type_;
-    std::unique_ptr<Path> path_;
-    std::string hash_;
+    // Whether |hash| is up to date with the subtree.
+    bool hash_valid;
+    NodeRef children[2];
+    Digest hash;
   };
 
-  std::string CalculateSubtreeHash(size_t depth, IndexType index);
+  // The only leaf set in the subtree rooted at this node, which can be
+  // anywhere above the actual position of the leaf (at the bottom of
+  // the tree).
+  struct LeafNode {
+    LeafNode(const Path& p, const Digest& h)
+        : hash_valid(false), path(p), leaf_hash(h) {
+    }
 
-  void DumpTree(std::ostream* os, size_t depth, IndexType index) const;
+    std::string DebugString() const;
 
-  // Get the |index|-th node at level |level|. Indexing starts at 0;
-  // caller is responsible for ensuring tree is sufficiently up to date.
-  std::string Node(size_t level, size_t index) const;
+    // Whether |hash| is up to date with |leaf_hash| and the position of
+    // the node.
+    bool hash_valid;
+    Path path;
+    Digest leaf_hash;
+    // The root of the subtree rooted here: |leaf_hash|, hashed with the
+    // null hashes all the way up from the bottom of the tree.
+    Digest hash;
+  };
 
-  // Maybe add a new tree level.
-  void EnsureHaveLevel(size_t n);
+  static bool IsLeaf(NodeRef node) {
+    return (node & kLeafBit) != 0;
+  }
 
+  NodeRef AddLeafNode(const Path& path, const Digest& leaf_hash);
+  NodeRef AddInternalNode();
+
+  // The hash of the subtree rooted at |node|, at |depth| bits from the
+  // root (which is at depth 0), computed with |hasher|.
+  const Digest& CalculateSubtreeHash(size_t depth, NodeRef node,
+                                     const TreeHasher& hasher);
+  // The hash of a subtree at |depth| containing nothing but |leaf_hash|
+  // at |path|, into |hash|.
+  void HashUpFromLeaf(const Path& path, const Digest& leaf_hash, size_t depth,
+                      const TreeHasher& hasher, Digest* hash) const;
+  // Whether the hash of |node| needs to be recomputed.
+  bool IsDirty(NodeRef node) const;
+  // Appends the dirty subtrees at |max_depth| below |node| (at
+  // |depth|), or above it if their root is a leaf, to |subtrees|.
+  void FindDirtySubtrees(size_t depth, NodeRef node, size_t max_depth,
+                         std::vector<std::pair<size_t, NodeRef>>* subtrees);
+
+  void DumpTree(std::ostream* os, size_t depth, NodeRef node) const;
+
+  // Used to create the hashers of the threads of CurrentRoot().
+  const std::unique_ptr<SerialHasher> hasher_model_;
   TreeHasher treehasher_;
   const std::vector<std::string>* const null_hashes_;
-  // TODO(alcutter): investigate other structures
-  std::vector<std::unordered_map<IndexType, TreeNode>> tree_;
-  std::string root_hash_;
+  // Same as |null_hashes_|.
+  std::vector<Digest> null_nodes_;
+  std::vector<InternalNode> internal_nodes_;
+  std::vector<LeafNode> leaf_nodes_;
 };
 
 
@@ -234,15 +296,55 @@ inline SparseMerkleTree::Path PathFromBytes(const std::string& bytes) {
 
 // Extracts the |n|th most significant bit from |path|
 inline int PathBit(const SparseMerkleTree::Path& path, size_t bit) {
-  CHECK_LT(bit, path.size() * 8);
-  return (path[bit / 8] & (1 << (7 - bit % 8))) == 0 ? 0 : 1;
+  DCHECK_LT(bit, path.size() * 8);
+  return (path[bit >> 3] >> (7 - (bit & 7))) & 1;
 }
 
 
+// Index of the first bit (from the most significant, as in PathBit())
+// after |start| where |a| and |b| differ, or kDigestSizeBits if there
+// is none.
+size_t FirstDifferingBit(const SparseMerkleTree::Path& a,
+                         const SparseMerkleTree::Path& b, size_t start);
+
+
+// A proof of the leaves at several paths at once, smaller than their
+// InclusionProof()s together: it has the siblings of the nodes along
+// the paths which are not along any of the paths themselves, once
+// each, and without the hashes of the empty subtrees.
+//
+// The siblings are in the order of a depth-first walk of the paths
+// (taken in order, without duplicates) from the root, the sibling of
+// a node coming before the node itself.
+struct MultiInclusionProof {
+  // Bit i (from the most significant bit of the first byte) is set if
+  // sibling i is the next of |hashes|, rather than an empty subtree.
+  std::string bitmap;
+  std::vector<std::string> hashes;
+};
+
+
+// Returns true if |proof| proves that the tree with |root| has the
+// leaves of |leaf_hashes| (keyed by their path), as hashed by
+// |hasher|. The leaves which are not set are proven with the hash of
+// an empty leaf, TreeHasher::HashLeaf("").
+bool VerifyMultiInclusionProof(
+    const TreeHasher& hasher,
+    const std::map<SparseMerkleTree::Path, std::string>& leaf_hashes,
+    const MultiInclusionProof& proof, const std::string& root);
+
+
 struct PathHasher {
   size_t operator()(const SparseMerkleTree::Path& p) const {
-    return std::hash<std::string>()(
-        std::string(reinterpret_cast<const char*>(p.data()), p.size()));
+    // Fold the path 64 bits at a time, without copying it into a string.
+    uint64_t words[sizeof(p) / sizeof(uint64_t)];
+    memcpy(words, p.data(), sizeof(words));
+    uint64_t hash(0);
+    for (const uint64_t word : words) {
+      hash = (hash ^ word) * 0x100000001b3ULL;
+      hash ^= hash >> 29;
+    }
+    return hash;
   }
 };
 
@@ -10,11 +10,13 @@
 #include "merkletree/sparse_merkle_tree.h"
 #include "util/openssl_scoped_types.h"
 #include "util/testing.h"
+#include "util/thread_pool.h"
 #include "util/util.h"
 
 namespace {
 
 using cert_trans::ScopedBIGNUM;
+using cert_trans::ThreadPool;
 using std::fill;
 using std::lower_bound;
 using std::map;
@@ -267,6 +269,118 @@ TEST_F(SparseMerkleTreeTest, RandomReferenceTest) {
 }
 
 
+TEST_F(SparseMerkleTreeTest, BatchedUpdates) {
+  SparseMerkleTree incremental(new Sha256Hasher);
+  vector<SparseMerkleTree::Path> paths;
+  for (int i(0); i < 1000; ++i) {
+    paths.emplace_back(RandomPath());
+    // Some of them share long prefixes.
+    if (i % 10 == 0) {
+      paths.back() = paths.front();
+      paths.back()[31] ^= i;
+    }
+  }
+
+  for (int round(0); round < 3; ++round) {
+    for (size_t i(0); i < paths.size(); ++i) {
+      const string value(to_string(round * paths.size() + i));
+      tree_.SetLeaf(paths[i], value);
+      incremental.SetLeaf(paths[i], value);
+      incremental.CurrentRoot();
+    }
+    EXPECT_EQ(ToBase64(incremental.CurrentRoot()),
+              ToBase64(tree_.CurrentRoot()));
+  }
+}
+
+
+TEST_F(SparseMerkleTreeTest, ParallelCurrentRoot) {
+  ThreadPool pool(4);
+  SparseMerkleTree parallel(new Sha256Hasher);
+  EXPECT_EQ(ToBase64(tree_.CurrentRoot()),
+            ToBase64(parallel.CurrentRoot(&pool)));
+
+  vector<SparseMerkleTree::Path> paths;
+  for (int i(0); i < 2000; ++i) {
+    paths.emplace_back(RandomPath());
+    // Some leaves above the depth of the parallel subtrees, too.
+    if (i % 100 == 0) {
+      paths.back() = paths.front();
+      paths.back()[0] ^= i / 100;
+    }
+  }
+
+  for (int round(0); round < 3; ++round) {
+    // Update fewer and fewer leaves, so that some subtrees stay clean.
+    for (size_t i(0); i < paths.size(); i += round + 1) {
+      const string value(to_string(round * paths.size() + i));
+      tree_.SetLeaf(paths[i], value);
+      parallel.SetLeaf(paths[i], value);
+    }
+    EXPECT_EQ(ToBase64(tree_.CurrentRoot()),
+              ToBase64(parallel.CurrentRoot(&pool)));
+    // Nothing left to rehash.
+    EXPECT_EQ(ToBase64(tree_.CurrentRoot()),
+              ToBase64(parallel.CurrentRoot(&pool)));
+  }
+}
+
+
+TEST_F(SparseMerkleTreeTest, FirstDifferingBit) {
+  const SparseMerkleTree::Path p(RandomPath());
+  EXPECT_EQ(SparseMerkleTree::kDigestSizeBits, FirstDifferingBit(p, p, 0));
+  for (size_t bit(0); bit < SparseMerkleTree::kDigestSizeBits; ++bit) {
+    SparseMerkleTree::Path q(p);
+    q[bit / 8] ^= 0x80 >> (bit % 8);
+    EXPECT_EQ(bit, FirstDifferingBit(p, q, 0));
+    EXPECT_EQ(bit, FirstDifferingBit(p, q, bit));
+    EXPECT_EQ(SparseMerkleTree::kDigestSizeBits,
+              FirstDifferingBit(p, q, bit + 1));
+  }
+}
+
+
+TEST_F(SparseMerkleTreeTest, InclusionProof) {
+  vector<SparseMerkleTree::Path> paths;
+  map<SparseMerkleTree::Path, string> values;
+  for (int i(0); i < 200; ++i) {
+    paths.emplace_back(RandomPath());
+    if (i % 4 == 0) {
+      // Close neighbours (and the odd replacement).
+      paths.back() = paths.front();
+      paths.back()[31 - i % 32] ^= i % 3;
+    }
+    tree_.SetLeaf(paths.back(), to_string(i));
+    values[paths.back()] = to_string(i);
+  }
+  // And some that are not set.
+  for (int i(0); i < 50; ++i) {
+    paths.emplace_back(RandomPath());
+  }
+  SparseMerkleTree::Path neighbour(paths.front());
+  neighbour[0] ^= 0x01;
+  paths.push_back(neighbour);
+
+  const string root(tree_.CurrentRoot());
+  for (size_t i(0); i < paths.size(); ++i) {
+    const vector<string> proof(tree_.InclusionProof(paths[i]));
+    ASSERT_EQ(static_cast<size_t>(SparseMerkleTree::kDigestSizeBits),
+              proof.size());
+    const auto it(values.find(paths[i]));
+    string hash(tree_hasher_.HashLeaf(it != values.end() ? it->second : ""));
+    for (int depth(SparseMerkleTree::kDigestSizeBits - 1); depth >= 0;
+         --depth) {
+      const string& sibling(proof[SparseMerkleTree::kDigestSizeBits - 1 -
+                                  depth]);
+      hash = PathBit(paths[i], depth) == 0
+                 ? tree_hasher_.HashChildren(hash, sibling)
+                 : tree_hasher_.HashChildren(sibling, hash);
+    }
+    EXPECT_EQ(ToBase64(root), ToBase64(hash)) << i;
+  }
+}
+
+
 TEST_F(SparseMerkleTreeTest, DISABLED_RefMemTest) {
   Reference ref(new Sha256Hasher);
   ValueList values;
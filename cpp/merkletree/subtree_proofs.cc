@@ -0,0 +1,200 @@
+#include "merkletree/subtree_proofs.h"
+
+#include <assert.h>
+#include <algorithm>
+#include <set>
+
+#include "merkletree/serial_hasher.h"
+
+using cert_trans::MerkleNodeStore;
+using std::min;
+using std::move;
+using std::reverse;
+using std::set;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace {
+
+// The largest power of two strictly smaller than |size|, which must
+// be at least 2: the number of leaves in the left subtree of a tree of
+// |size| leaves.
+size_t LeftSubtreeSize(size_t size) {
+  assert(size >= 2);
+  size_t left = 1;
+  while (left << 1 < size)
+    left <<= 1;
+  return left;
+}
+
+// log2(|size|), for a power of two.
+size_t LevelOf(size_t size) {
+  size_t level = 0;
+  while (size > 1) {
+    size >>= 1;
+    ++level;
+  }
+  return level;
+}
+
+}  // namespace
+
+SubtreeProofs::SubtreeProofs(unique_ptr<SerialHasher> hasher,
+                             const MerkleNodeStore* store)
+    : treehasher_(move(hasher)), store_(store) {
+  assert(store_);
+  assert(treehasher_.DigestSize() == Digest::kSize);
+  assert(store_->NodeSize() == Digest::kSize);
+}
+
+size_t SubtreeProofs::LeafCount() const {
+  return store_->LevelCount() == 0 ? 0 : store_->NodeCount(0);
+}
+
+string SubtreeProofs::RootAtSnapshot(size_t snapshot) const {
+  if (snapshot == 0)
+    return treehasher_.HashEmpty();
+  if (snapshot > LeafCount())
+    return string();
+  return SubtreeRoot(0, snapshot).ToString();
+}
+
+vector<string> SubtreeProofs::PathToRootAtSnapshot(size_t leaf,
+                                                   size_t snapshot) const {
+  vector<string> path;
+  if (leaf == 0 || leaf > snapshot || snapshot > LeafCount())
+    return path;
+
+  // PATH(m, D[n]) from RFC 6962, section 2.1.1, walking down from the
+  // root: at every step, the sibling of the subtree containing the
+  // leaf is part of the path.
+  size_t index = leaf - 1;
+  size_t begin = 0;
+  size_t size = snapshot;
+  while (size > 1) {
+    const size_t left = LeftSubtreeSize(size);
+    if (index < begin + left) {
+      path.push_back(SubtreeRoot(begin + left, size - left).ToString());
+      size = left;
+    } else {
+      path.push_back(SubtreeRoot(begin, left).ToString());
+      begin += left;
+      size -= left;
+    }
+  }
+
+  // The path goes up from the leaf.
+  reverse(path.begin(), path.end());
+  return path;
+}
+
+vector<string> SubtreeProofs::MultiLeafProof(const vector<size_t>& leaves,
+                                             size_t snapshot) const {
+  vector<string> proof;
+  if (leaves.empty() || snapshot > LeafCount())
+    return proof;
+
+  set<size_t> nodes;
+  for (const size_t leaf : leaves) {
+    if (leaf == 0 || leaf > snapshot)
+      return proof;
+    nodes.insert(leaf - 1);
+  }
+
+  // Going up one level at a time, the siblings of the nodes we know
+  // are part of the proof, unless we know them already.
+  size_t last_node = snapshot - 1;
+  for (size_t level = 0; last_node; ++level) {
+    set<size_t> parents;
+    for (const size_t node : nodes) {
+      if (node & 1) {
+        if (nodes.count(node - 1) == 0)
+          proof.push_back(NodeAtSnapshot(level, node - 1, snapshot).ToString());
+      } else if (node < last_node && nodes.count(node + 1) == 0) {
+        proof.push_back(NodeAtSnapshot(level, node + 1, snapshot).ToString());
+      }
+      parents.insert(parents.end(), node >> 1);
+    }
+    nodes.swap(parents);
+    last_node >>= 1;
+  }
+  return proof;
+}
+
+vector<string> SubtreeProofs::SnapshotConsistency(size_t snapshot1,
+                                                  size_t snapshot2) const {
+  vector<string> proof;
+  if (snapshot1 == 0 || snapshot1 >= snapshot2 || snapshot2 > LeafCount())
+    return proof;
+
+  // SUBPROOF(m, D[n], true) from RFC 6962, section 2.1.2, walking down
+  // from the root of |snapshot2| until the subtree is that of the
+  // (remaining) |snapshot1| leaves.
+  size_t begin = 0;
+  size_t size = snapshot2;
+  size_t old_size = snapshot1;
+  bool complete_subtree = true;
+  while (old_size != size) {
+    const size_t left = LeftSubtreeSize(size);
+    if (old_size <= left) {
+      proof.push_back(SubtreeRoot(begin + left, size - left).ToString());
+      size = left;
+    } else {
+      proof.push_back(SubtreeRoot(begin, left).ToString());
+      begin += left;
+      size -= left;
+      old_size -= left;
+      complete_subtree = false;
+    }
+  }
+  // The verifier already knows the root of |snapshot1|, but otherwise
+  // needs the subtree we stopped at.
+  if (!complete_subtree)
+    proof.push_back(SubtreeRoot(begin, size).ToString());
+
+  // The proof goes up from there.
+  reverse(proof.begin(), proof.end());
+  return proof;
+}
+
+Digest SubtreeProofs::SubtreeRoot(size_t begin, size_t size) const {
+  assert(size > 0);
+  if ((size & (size - 1)) == 0) {
+    const size_t level = LevelOf(size);
+    assert(begin % size == 0);
+    return PerfectSubtreeRoot(level, begin >> level);
+  }
+
+  const size_t left = LeftSubtreeSize(size);
+  Digest root = SubtreeRoot(begin + left, size - left);
+  treehasher_.HashChildren(SubtreeRoot(begin, left), root, &root);
+  return root;
+}
+
+Digest SubtreeProofs::NodeAtSnapshot(size_t level, size_t index,
+                                     size_t snapshot) const {
+  // The node covers 2^|level| leaves, or whichever of those are in the
+  // snapshot.
+  const size_t begin = index << level;
+  assert(begin < snapshot);
+  return SubtreeRoot(begin, min(size_t(1) << level, snapshot - begin));
+}
+
+Digest SubtreeProofs::PerfectSubtreeRoot(size_t level, size_t index) const {
+  Digest root;
+  // Leaves are always there, but interior nodes are only final (rather
+  // than, say, dummy copies of their left child) once the tree has
+  // processed all the leaves below them.
+  if (level < store_->LevelCount() && index < store_->NodeCount(level) &&
+      (level == 0 || (index + 1) << level <= store_->LeavesProcessed())) {
+    store_->CopyNodes(level, index, 1, root.data());
+    return root;
+  }
+
+  assert(level > 0);
+  root = PerfectSubtreeRoot(level - 1, 2 * index + 1);
+  treehasher_.HashChildren(PerfectSubtreeRoot(level - 1, 2 * index), root,
+                           &root);
+  return root;
+}
@@ -0,0 +1,89 @@
+#ifndef CERT_TRANS_MERKLETREE_SUBTREE_PROOFS_H_
+#define CERT_TRANS_MERKLETREE_SUBTREE_PROOFS_H_
+
+#include <stddef.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "base/macros.h"
+#include "merkletree/digest.h"
+#include "merkletree/merkle_node_store.h"
+#include "merkletree/tree_hasher.h"
+
+class SerialHasher;
+
+// Computes roots, audit paths and consistency proofs for any snapshot
+// of a Merkle tree, straight from the nodes of a MerkleNodeStore (as
+// laid out by MerkleTree), without updating or otherwise modifying it.
+//
+// Rather than re-hashing the right edge of a past snapshot, as
+// MerkleTree does, this only ever reads the roots of perfect subtrees
+// (those of 2^level leaves, which never change once complete), and
+// splits every query following the recursive definitions of RFC 6962:
+// any root or proof is made of O(log n) such subtrees. A subtree that
+// is not available in the store yet (because the tree has not
+// processed its leaves) is computed from its children instead.
+//
+// The results are the same as those of the MerkleTree methods of the
+// same name.
+//
+// This class is thread-compatible: since it does not modify the
+// store, its methods can be called concurrently, so long as the store
+// is not being modified at the same time.
+class SubtreeProofs {
+ public:
+  // Does not take ownership of |store|, which must outlive this object,
+  // and have the same node size as |hasher|'s digests (Digest::kSize).
+  SubtreeProofs(std::unique_ptr<SerialHasher> hasher,
+                const cert_trans::MerkleNodeStore* store);
+
+  // Number of leaves in the store.
+  size_t LeafCount() const;
+
+  // The root of the tree with the first |snapshot| leaves. Returns the
+  // hash of an empty string if |snapshot| is 0, and an empty string if
+  // the store does not have that many leaves.
+  std::string RootAtSnapshot(size_t snapshot) const;
+
+  // The Merkle path from |leaf| (indexed starting at 1) to the root of
+  // |snapshot|, from the sibling of the leaf up. Returns an empty
+  // vector if |leaf| is 0 or not in the snapshot, or if the store does
+  // not have |snapshot| leaves.
+  std::vector<std::string> PathToRootAtSnapshot(size_t leaf,
+                                                size_t snapshot) const;
+
+  // The multi-leaf proof for all of |leaves| (indexed starting at 1) in
+  // |snapshot|, as verified by MerkleVerifier::RootFromMultiLeafProof():
+  // the union of their audit paths, without the nodes that can be
+  // computed from the leaves themselves. Returns an empty vector if
+  // |leaves| is empty, if any of them is 0 or not in the snapshot, or
+  // if the store does not have |snapshot| leaves.
+  std::vector<std::string> MultiLeafProof(const std::vector<size_t>& leaves,
+                                          size_t snapshot) const;
+
+  // The consistency proof between |snapshot1| and |snapshot2|. Returns
+  // an empty vector if |snapshot1| is 0, |snapshot1| >= |snapshot2|, or
+  // if the store does not have |snapshot2| leaves.
+  std::vector<std::string> SnapshotConsistency(size_t snapshot1,
+                                               size_t snapshot2) const;
+
+ private:
+  // The root of the |size| leaves starting with the |begin|-th one
+  // (indexed starting at 0), where |begin| is a multiple of the
+  // largest power of two smaller than |size|, and |size| > 0.
+  Digest SubtreeRoot(size_t begin, size_t size) const;
+  // The hash of the node at |level| and |index| of the tree of
+  // |snapshot| leaves, which may be a dummy copy of its left child.
+  Digest NodeAtSnapshot(size_t level, size_t index, size_t snapshot) const;
+  // The root of the perfect subtree of 2^|level| leaves starting with
+  // leaf |index| << |level|.
+  Digest PerfectSubtreeRoot(size_t level, size_t index) const;
+
+  const TreeHasher treehasher_;
+  const cert_trans::MerkleNodeStore* const store_;
+
+  DISALLOW_COPY_AND_ASSIGN(SubtreeProofs);
+};
+
+#endif  // CERT_TRANS_MERKLETREE_SUBTREE_PROOFS_H_
@@ -0,0 +1,168 @@
+#include "merkletree/subtree_proofs.h"
+
+#include <gtest/gtest.h>
+#include <stddef.h>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "merkletree/merkle_tree.h"
+#include "merkletree/merkle_verifier.h"
+#include "merkletree/serial_hasher.h"
+#include "util/testing.h"
+
+namespace {
+
+using std::map;
+using std::reverse;
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+
+
+unique_ptr<SerialHasher> NewSha256Hasher() {
+  return unique_ptr<SerialHasher>(new Sha256Hasher);
+}
+
+
+class SubtreeProofsTest : public ::testing::Test {
+ protected:
+  static void AddLeaves(size_t leaf_count, MerkleTree* tree) {
+    while (tree->LeafCount() < leaf_count)
+      tree->AddLeaf(to_string(tree->LeafCount()));
+  }
+
+  // Checks every query about the snapshots of |tree| against those of
+  // a MerkleTree with the same leaves.
+  static void ExpectSameProofs(const MerkleTree& tree) {
+    const SubtreeProofs proofs(NewSha256Hasher(), tree.NodeStore());
+    const size_t leaf_count(tree.LeafCount());
+    ASSERT_EQ(leaf_count, proofs.LeafCount());
+    MerkleTree reference(NewSha256Hasher());
+    AddLeaves(leaf_count, &reference);
+    for (size_t snapshot = 0; snapshot <= leaf_count + 1; ++snapshot) {
+      EXPECT_EQ(reference.RootAtSnapshot(snapshot),
+                proofs.RootAtSnapshot(snapshot))
+          << snapshot;
+      for (size_t leaf = 0; leaf <= snapshot + 1; ++leaf) {
+        EXPECT_EQ(reference.PathToRootAtSnapshot(leaf, snapshot),
+                  proofs.PathToRootAtSnapshot(leaf, snapshot))
+            << leaf << " " << snapshot;
+      }
+      for (size_t snapshot2 = 0; snapshot2 <= leaf_count + 1; ++snapshot2) {
+        EXPECT_EQ(reference.SnapshotConsistency(snapshot, snapshot2),
+                  proofs.SnapshotConsistency(snapshot, snapshot2))
+            << snapshot << " " << snapshot2;
+      }
+    }
+  }
+};
+
+
+TEST_F(SubtreeProofsTest, Empty) {
+  MerkleTree tree(NewSha256Hasher());
+  const SubtreeProofs proofs(NewSha256Hasher(), tree.NodeStore());
+  EXPECT_EQ(0U, proofs.LeafCount());
+  EXPECT_EQ(tree.CurrentRoot(), proofs.RootAtSnapshot(0));
+  EXPECT_EQ(string(), proofs.RootAtSnapshot(1));
+  EXPECT_TRUE(proofs.PathToRootAtSnapshot(1, 1).empty());
+  EXPECT_TRUE(proofs.SnapshotConsistency(0, 1).empty());
+}
+
+
+TEST_F(SubtreeProofsTest, EvaluatedTree) {
+  MerkleTree tree(NewSha256Hasher());
+  for (size_t leaf_count = 1; leaf_count <= 40; ++leaf_count) {
+    AddLeaves(leaf_count, &tree);
+    tree.CurrentRoot();
+    ExpectSameProofs(tree);
+  }
+}
+
+
+TEST_F(SubtreeProofsTest, PartiallyEvaluatedTree) {
+  for (size_t processed = 1; processed <= 20; ++processed) {
+    for (size_t leaf_count = processed; leaf_count <= 36; leaf_count += 5) {
+      MerkleTree tree(NewSha256Hasher());
+      AddLeaves(processed, &tree);
+      tree.CurrentRoot();
+      AddLeaves(leaf_count, &tree);
+      ExpectSameProofs(tree);
+      // The tree was left alone.
+      EXPECT_EQ(processed, tree.NodeStore()->LeavesProcessed());
+    }
+  }
+}
+
+
+TEST_F(SubtreeProofsTest, MultiLeafProof) {
+  MerkleTree tree(NewSha256Hasher());
+  AddLeaves(37, &tree);
+  tree.CurrentRoot();
+  const SubtreeProofs proofs(NewSha256Hasher(), tree.NodeStore());
+  MerkleVerifier verifier(NewSha256Hasher());
+
+  EXPECT_TRUE(proofs.MultiLeafProof(vector<size_t>(), 37).empty());
+  EXPECT_TRUE(proofs.MultiLeafProof({1, 0}, 37).empty());
+  EXPECT_TRUE(proofs.MultiLeafProof({1, 38}, 37).empty());
+  EXPECT_TRUE(proofs.MultiLeafProof({1}, 38).empty());
+
+  for (size_t snapshot = 1; snapshot <= 37; ++snapshot) {
+    const string root(tree.RootAtSnapshot(snapshot));
+    for (size_t step = 1; step <= snapshot; ++step) {
+      vector<size_t> leaves;
+      map<size_t, string> leaf_hashes;
+      size_t path_nodes = 0;
+      for (size_t leaf = 1; leaf <= snapshot; leaf += step) {
+        leaves.push_back(leaf);
+        leaf_hashes[leaf] = tree.LeafHash(leaf);
+        path_nodes += tree.PathToRootAtSnapshot(leaf, snapshot).size();
+      }
+      // In any order.
+      reverse(leaves.begin(), leaves.end());
+      const vector<string> proof(proofs.MultiLeafProof(leaves, snapshot));
+      EXPECT_LE(proof.size(), path_nodes);
+      if (leaves.size() == 1) {
+        EXPECT_EQ(tree.PathToRootAtSnapshot(leaves[0], snapshot), proof);
+      }
+      EXPECT_EQ(root,
+                verifier.RootFromMultiLeafProof(snapshot, leaf_hashes, proof))
+          << snapshot << " " << step;
+
+      // Wrong tree height.
+      EXPECT_NE(root, verifier.RootFromMultiLeafProof(snapshot * 2,
+                                                      leaf_hashes, proof));
+      EXPECT_NE(root, verifier.RootFromMultiLeafProof(snapshot / 2,
+                                                      leaf_hashes, proof));
+      // Wrong leaf.
+      map<size_t, string> wrong_leaves(leaf_hashes);
+      wrong_leaves.begin()->second = tree.LeafHash(37 - snapshot / 2);
+      EXPECT_NE(root,
+                verifier.RootFromMultiLeafProof(snapshot, wrong_leaves, proof));
+      // Modify a single proof element.
+      for (size_t i = 0; i < proof.size(); ++i) {
+        vector<string> wrong_proof(proof);
+        wrong_proof[i] = root;
+        EXPECT_NE(root, verifier.RootFromMultiLeafProof(snapshot, leaf_hashes,
+                                                        wrong_proof));
+      }
+      // Garbage at the end of the proof.
+      vector<string> wrong_proof(proof);
+      wrong_proof.push_back(root);
+      EXPECT_EQ(string(), verifier.RootFromMultiLeafProof(
+                              snapshot, leaf_hashes, wrong_proof));
+    }
+  }
+}
+
+
+}  // namespace
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
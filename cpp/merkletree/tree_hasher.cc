@@ -1,8 +1,11 @@
 #include "merkletree/tree_hasher.h"
 
 #include <assert.h>
+#include <algorithm>
+#include <typeinfo>
 
 #include "merkletree/serial_hasher.h"
+#include "merkletree/sha256_multi_buffer.h"
 
 using std::lock_guard;
 using std::move;
@@ -12,25 +15,29 @@ using std::unique_ptr;
 
 namespace {
 
-const char kLeafPrefix('\x00');
-const char kNodePrefix('\x01');
+const uint8_t kLeafPrefix(0x00);
+const uint8_t kNodePrefix(0x01);
 
 std::string EmptyHash(SerialHasher* hasher) {
   hasher->Reset();
   return hasher->Final();
 }
 
+typedef BasicTreeHasher<Sha256> Sha256TreeHasher;
+
 }  // namespace
 
 TreeHasher::TreeHasher(unique_ptr<SerialHasher> hasher)
-    : hasher_(move(hasher)), empty_hash_(EmptyHash(hasher_.get())) {
+    : hasher_(move(hasher)),
+      sha256_(typeid(*hasher_) == typeid(Sha256Hasher)),
+      empty_hash_(EmptyHash(hasher_.get())) {
   assert(hasher_);
 }
 
 string TreeHasher::HashLeaf(const string& data) const {
   lock_guard<mutex> lock(lock_);
   hasher_->Reset();
-  hasher_->Update(string(1, kLeafPrefix));
+  hasher_->Update(&kLeafPrefix, 1);
   hasher_->Update(data);
   return hasher_->Final();
 }
@@ -39,8 +46,87 @@ string TreeHasher::HashChildren(const string& left_child,
                                 const string& right_child) const {
   lock_guard<mutex> lock(lock_);
   hasher_->Reset();
-  hasher_->Update(string(1, kNodePrefix));
+  hasher_->Update(&kNodePrefix, 1);
   hasher_->Update(left_child);
   hasher_->Update(right_child);
   return hasher_->Final();
 }
+
+void TreeHasher::HashLeaf(const uint8_t* data, size_t size,
+                          Digest* digest) const {
+  assert(hasher_->DigestSize() == Digest::kSize);
+  if (sha256_) {
+    Sha256TreeHasher::HashLeaf(data, size, digest);
+    return;
+  }
+  lock_guard<mutex> lock(lock_);
+  hasher_->Reset();
+  hasher_->Update(&kLeafPrefix, 1);
+  hasher_->Update(data, size);
+  hasher_->Final(digest->data());
+}
+
+void TreeHasher::HashChildren(const Digest& left_child,
+                              const Digest& right_child,
+                              Digest* digest) const {
+  assert(hasher_->DigestSize() == Digest::kSize);
+  if (sha256_) {
+    Sha256TreeHasher::HashChildren(left_child, right_child, digest);
+    return;
+  }
+  lock_guard<mutex> lock(lock_);
+  hasher_->Reset();
+  hasher_->Update(&kNodePrefix, 1);
+  hasher_->Update(left_child.data(), left_child.size());
+  hasher_->Update(right_child.data(), right_child.size());
+  hasher_->Final(digest->data());
+}
+
+void TreeHasher::HashLeaves(size_t count, const uint8_t* const* data,
+                            const size_t* sizes, Digest* digests) const {
+  assert(hasher_->DigestSize() == Digest::kSize);
+  if (sha256_) {
+    Sha256MultiBuffer(kLeafPrefix, count, data, sizes, digests);
+    return;
+  }
+  // One lock for the whole batch, and the prefix and the leaf are
+  // separate updates, so that nothing is copied.
+  lock_guard<mutex> lock(lock_);
+  for (size_t i = 0; i < count; ++i) {
+    hasher_->Reset();
+    hasher_->Update(&kLeafPrefix, 1);
+    hasher_->Update(data[i], sizes[i]);
+    hasher_->Final(digests[i].data());
+  }
+}
+
+void TreeHasher::HashChildrenPairs(const Digest* children, size_t count,
+                                   Digest* parents) const {
+  assert(hasher_->DigestSize() == Digest::kSize);
+  if (sha256_) {
+    // Each pair is a contiguous message. Parent |i| is written once
+    // the pairs up to |i| have been read, so only overwrites children
+    // already hashed.
+    const size_t kChunk(64);
+    const uint8_t* data[kChunk];
+    size_t sizes[kChunk];
+    for (size_t begin = 0; begin < count; begin += kChunk) {
+      const size_t n(std::min(kChunk, count - begin));
+      for (size_t i = 0; i < n; ++i) {
+        data[i] = children[2 * (begin + i)].data();
+        sizes[i] = 2 * Digest::kSize;
+      }
+      Sha256MultiBuffer(kNodePrefix, n, data, sizes, parents + begin);
+    }
+    return;
+  }
+  // Parent |i| only overwrites children already hashed.
+  lock_guard<mutex> lock(lock_);
+  for (size_t i = 0; i < count; ++i) {
+    hasher_->Reset();
+    hasher_->Update(&kNodePrefix, 1);
+    hasher_->Update(children[2 * i].data(), Digest::kSize);
+    hasher_->Update(children[2 * i + 1].data(), Digest::kSize);
+    hasher_->Final(parents[i].data());
+  }
+}
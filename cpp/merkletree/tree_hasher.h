@@ -2,13 +2,64 @@
 #define CERT_TRANS_MERKLETREE_TREE_HASHER_H_
 
 #include <stddef.h>
+#include <stdint.h>
 #include <memory>
 #include <mutex>
 #include <string>
 
 #include "base/macros.h"
+#include "merkletree/digest.h"
 #include "merkletree/serial_hasher.h"
 
+// The tree hashing of RFC 6962 over a concrete |Hasher| (such as
+// Sha256), with the Init(), Update() and Final() of a |Hasher::Context|
+// as static functions, which the compiler can inline. TreeHasher uses
+// this for the hashers it knows.
+template <class Hasher>
+class BasicTreeHasher {
+ public:
+  static_assert(Hasher::kDigestSize == Digest::kSize,
+                "the hasher does not produce Digests");
+
+  static const uint8_t kLeafPrefix = 0x00;
+  static const uint8_t kNodePrefix = 0x01;
+
+  static void HashLeaf(const uint8_t* data, size_t size, Digest* digest) {
+    const uint8_t prefix(kLeafPrefix);
+    typename Hasher::Context ctx;
+    Hasher::Init(&ctx);
+    Hasher::Update(&ctx, &prefix, 1);
+    Hasher::Update(&ctx, data, size);
+    Hasher::Final(&ctx, digest->data());
+  }
+
+  // |digest| may be one of the children.
+  static void HashChildren(const Digest& left_child,
+                           const Digest& right_child, Digest* digest) {
+    const uint8_t prefix(kNodePrefix);
+    typename Hasher::Context ctx;
+    Hasher::Init(&ctx);
+    Hasher::Update(&ctx, &prefix, 1);
+    Hasher::Update(&ctx, left_child.data(), left_child.size());
+    Hasher::Update(&ctx, right_child.data(), right_child.size());
+    Hasher::Final(&ctx, digest->data());
+  }
+
+  // See TreeHasher.
+  static void HashLeaves(size_t count, const uint8_t* const* data,
+                         const size_t* sizes, Digest* digests) {
+    for (size_t i = 0; i < count; ++i)
+      HashLeaf(data[i], sizes[i], &digests[i]);
+  }
+
+  static void HashChildrenPairs(const Digest* children, size_t count,
+                                Digest* parents) {
+    // Parent |i| only overwrites children already hashed.
+    for (size_t i = 0; i < count; ++i)
+      HashChildren(children[2 * i], children[2 * i + 1], &parents[i]);
+  }
+};
+
 class TreeHasher {
  public:
   TreeHasher(std::unique_ptr<SerialHasher> hasher);
@@ -29,9 +80,33 @@ class TreeHasher {
   std::string HashChildren(const std::string& left_child,
                            const std::string& right_child) const;
 
+  // Same as above, but write the hash into |digest|, without
+  // allocating. These can only be used if DigestSize() is
+  // Digest::kSize. |digest| may be one of the children. With a
+  // Sha256Hasher, these go through BasicTreeHasher<Sha256>, without
+  // virtual calls nor locking.
+  void HashLeaf(const uint8_t* data, size_t size, Digest* digest) const;
+  void HashChildren(const Digest& left_child, const Digest& right_child,
+                    Digest* digest) const;
+
+  // Batched versions of the above, which are faster than hashing one
+  // node at a time (the lock is taken once, and with a Sha256Hasher,
+  // the nodes are hashed several at a time by Sha256MultiBuffer()).
+  // HashLeaves() hashes |count| leaves, the |i|-th being the
+  // |sizes[i]| bytes at |data[i]|, into |digests|.
+  // HashChildrenPairs() hashes the |count| pairs of consecutive nodes
+  // in |children| (2 * |count| nodes), into |parents|, which may be
+  // |children|.
+  void HashLeaves(size_t count, const uint8_t* const* data,
+                  const size_t* sizes, Digest* digests) const;
+  void HashChildrenPairs(const Digest* children, size_t count,
+                         Digest* parents) const;
+
  private:
   mutable std::mutex lock_;
   const std::unique_ptr<SerialHasher> hasher_;
+  // Whether |hasher_| is exactly a Sha256Hasher.
+  const bool sha256_;
   // The pre-computed hash of an empty tree.
   const std::string empty_hash_;
 
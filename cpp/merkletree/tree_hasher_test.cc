@@ -1,6 +1,7 @@
 #include <gtest/gtest.h>
 #include <stddef.h>
 #include <string>
+#include <vector>
 
 #include "merkletree/serial_hasher.h"
 #include "merkletree/tree_hasher.h"
@@ -11,6 +12,7 @@ namespace {
 
 using std::string;
 using std::unique_ptr;
+using std::vector;
 
 typedef struct {
   size_t input_length;
@@ -65,6 +67,15 @@ TestVector* TestVectors<Sha256Hasher>() {
   return &test_sha256;
 }
 
+// Not exactly a Sha256Hasher, so TreeHasher goes through its virtual
+// interface rather than BasicTreeHasher<Sha256>.
+class VirtualSha256Hasher : public Sha256Hasher {};
+
+template <>
+TestVector* TestVectors<VirtualSha256Hasher>() {
+  return &test_sha256;
+}
+
 template <class T>
 class TreeHasherTest : public ::testing::Test {
  protected:
@@ -75,7 +86,7 @@ class TreeHasherTest : public ::testing::Test {
   }
 };
 
-typedef ::testing::Types<Sha256Hasher> Hashers;
+typedef ::testing::Types<Sha256Hasher, VirtualSha256Hasher> Hashers;
 
 TYPED_TEST_CASE(TreeHasherTest, Hashers);
 
@@ -149,6 +160,76 @@ TYPED_TEST(TreeHasherTest, TestVectors) {
   }
 }
 
+// The Digest variants must agree with the std::string ones.
+TYPED_TEST(TreeHasherTest, Digest) {
+  for (size_t i = 0; this->test_vectors_->leaves[i].input != NULL; ++i) {
+    const string leaf(S(this->test_vectors_->leaves[i].input,
+                        this->test_vectors_->leaves[i].input_length));
+    Digest digest;
+    this->tree_hasher_.HashLeaf(reinterpret_cast<const uint8_t*>(leaf.data()),
+                                leaf.size(), &digest);
+    EXPECT_STREQ(this->test_vectors_->leaves[i].output,
+                 H(digest.ToString()).c_str());
+  }
+
+  for (size_t i = 0; this->test_vectors_->nodes[i].left != NULL; ++i) {
+    const Digest left(S(this->test_vectors_->nodes[i].left,
+                        this->tree_hasher_.DigestSize()));
+    const Digest right(S(this->test_vectors_->nodes[i].right,
+                         this->tree_hasher_.DigestSize()));
+    Digest digest;
+    this->tree_hasher_.HashChildren(left, right, &digest);
+    EXPECT_STREQ(this->test_vectors_->nodes[i].output,
+                 H(digest.ToString()).c_str());
+
+    // The output can also be one of the inputs.
+    Digest in_place(left);
+    this->tree_hasher_.HashChildren(in_place, right, &in_place);
+    EXPECT_EQ(digest, in_place);
+    in_place = right;
+    this->tree_hasher_.HashChildren(left, in_place, &in_place);
+    EXPECT_EQ(digest, in_place);
+  }
+}
+
+// The batched variants must agree with hashing one node at a time.
+TYPED_TEST(TreeHasherTest, Batches) {
+  vector<string> leaves;
+  for (int i = 0; i < 10; ++i) {
+    leaves.push_back(string(i * 7, 'a' + i));
+  }
+  vector<const uint8_t*> data;
+  vector<size_t> sizes;
+  for (const auto& leaf : leaves) {
+    data.push_back(reinterpret_cast<const uint8_t*>(leaf.data()));
+    sizes.push_back(leaf.size());
+  }
+
+  vector<Digest> nodes(leaves.size());
+  this->tree_hasher_.HashLeaves(leaves.size(), data.data(), sizes.data(),
+                                nodes.data());
+  for (size_t i = 0; i < leaves.size(); ++i) {
+    EXPECT_EQ(H(this->tree_hasher_.HashLeaf(leaves[i])),
+              H(nodes[i].ToString()));
+  }
+
+  vector<Digest> parents(nodes.size() / 2);
+  this->tree_hasher_.HashChildrenPairs(nodes.data(), parents.size(),
+                                       parents.data());
+  for (size_t i = 0; i < parents.size(); ++i) {
+    EXPECT_EQ(H(this->tree_hasher_.HashChildren(nodes[2 * i].ToString(),
+                                                nodes[2 * i + 1].ToString())),
+              H(parents[i].ToString()));
+  }
+
+  // In place.
+  this->tree_hasher_.HashChildrenPairs(nodes.data(), parents.size(),
+                                       nodes.data());
+  for (size_t i = 0; i < parents.size(); ++i) {
+    EXPECT_EQ(parents[i], nodes[i]);
+  }
+}
+
 #undef S
 #undef H
 
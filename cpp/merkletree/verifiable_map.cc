@@ -20,24 +20,32 @@ VerifiableMap::VerifiableMap(SerialHasher* hasher)
 
 
 void VerifiableMap::Set(const string& key, const string& value) {
-  const SparseMerkleTree::Path path(PathFromKey(key));
-  merkle_tree_.SetLeaf(path, value);
-  values_[path] = value;
+  merkle_tree_.SetLeaf(PathFromKey(key), value);
 }
 
 
 StatusOr<string> VerifiableMap::Get(const string& key) const {
-  const SparseMerkleTree::Path path(PathFromKey(key));
-  const auto it(values_.find(path));
-  if (it == values_.end()) {
+  string value;
+  if (!merkle_tree_.Current()->GetLeaf(PathFromKey(key), &value)) {
     return Status(util::error::NOT_FOUND, "No such entry.");
   }
-  return it->second;
+  return value;
 }
 
 
-vector<string> VerifiableMap::InclusionProof(const string& key) {
-  return merkle_tree_.InclusionProof(PathFromKey(key));
+vector<string> VerifiableMap::InclusionProof(const string& key) const {
+  return merkle_tree_.Current()->InclusionProof(PathFromKey(key));
+}
+
+
+MultiInclusionProof VerifiableMap::InclusionProofs(
+    const vector<string>& keys) const {
+  vector<SparseMerkleTree::Path> paths;
+  paths.reserve(keys.size());
+  for (const auto& key : keys) {
+    paths.emplace_back(PathFromKey(key));
+  }
+  return merkle_tree_.Current()->InclusionProof(paths);
 }
 
 
@@ -1,40 +1,61 @@
 #ifndef CERT_TRANS_MERKLETREE_VERIFIABLE_MAP_H_
 #define CERT_TRANS_MERKLETREE_VERIFIABLE_MAP_H_
 
+#include <memory>
 #include <string>
-#include <unordered_map>
 #include <vector>
 
 #include "base/macros.h"
-#include "merkletree/sparse_merkle_tree.h"
+#include "merkletree/versioned_sparse_merkle_tree.h"
 #include "util/statusor.h"
 
 namespace cert_trans {
 
 
-// Implements a Verifiable Map using a SparseMerkleTree and hashmap.
+// Implements a Verifiable Map using a VersionedSparseMerkleTree, whose
+// leaves keep the values.
+//
+// Set() only stages the update, CurrentRoot() applies all the staged
+// updates at once, making a new version of the map. Get() and
+// InclusionProof() look at the latest version, without waiting for
+// the updates being applied.
+//
+// This class is thread-safe.
 class VerifiableMap {
  public:
+  typedef VersionedSparseMerkleTree::Version Snapshot;
+
   VerifiableMap(SerialHasher* hasher);
 
+  // Applies the updates staged so far, and returns the root of the
+  // map with them.
   std::string CurrentRoot() {
-    return merkle_tree_.CurrentRoot();
+    return merkle_tree_.Commit()->Root();
   }
 
   void Set(const std::string& key, const std::string& value);
 
   util::StatusOr<std::string> Get(const std::string& key) const;
 
-  std::vector<std::string> InclusionProof(const std::string& key);
+  std::vector<std::string> InclusionProof(const std::string& key) const;
 
- private:
-  SparseMerkleTree::Path PathFromKey(const std::string& key) const;
+  // The proof of all of |keys| at once, see VerifyMultiInclusionProof()
+  // (the paths of the keys being given by PathFromKey()).
+  MultiInclusionProof InclusionProofs(
+      const std::vector<std::string>& keys) const;
 
-  std::unique_ptr<SerialHasher> hasher_model_;
-  SparseMerkleTree merkle_tree_;
+  // The latest version of the map, which does not change with later
+  // updates, for looking up several keys consistently.
+  std::shared_ptr<const Snapshot> CurrentSnapshot() const {
+    return merkle_tree_.Current();
+  }
 
-  // TODO(alcutter): allow arbitrary stores here.
-  std::unordered_map<SparseMerkleTree::Path, std::string, PathHasher> values_;
+  // The path of |key| in the snapshots.
+  SparseMerkleTree::Path PathFromKey(const std::string& key) const;
+
+ private:
+  const std::unique_ptr<SerialHasher> hasher_model_;
+  VersionedSparseMerkleTree merkle_tree_;
 
   DISALLOW_COPY_AND_ASSIGN(VerifiableMap);
 };
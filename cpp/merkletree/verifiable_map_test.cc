@@ -1,6 +1,8 @@
 #include <glog/logging.h>
 #include <gtest/gtest.h>
+#include <map>
 #include <string>
+#include <vector>
 
 #include "merkletree/verifiable_map.h"
 #include "util/status_test_util.h"
@@ -12,8 +14,11 @@ namespace cert_trans {
 namespace {
 
 using std::array;
+using std::map;
 using std::string;
+using std::to_string;
 using std::unique_ptr;
+using std::vector;
 using util::StatusOr;
 using util::testing::StatusIs;
 using util::ToBase64;
@@ -40,6 +45,9 @@ TEST_F(VerifiableMapTest, TestSetGet) {
   const string kKey("key");
   const string kValue("value");
   map_.Set(kKey, kValue);
+  // Not applied yet.
+  EXPECT_THAT(map_.Get(kKey).status(), StatusIs(util::error::NOT_FOUND));
+  map_.CurrentRoot();
 
   const StatusOr<string> retrieved(map_.Get(kKey));
   EXPECT_OK(retrieved);
@@ -47,6 +55,43 @@ TEST_F(VerifiableMapTest, TestSetGet) {
 }
 
 
+TEST_F(VerifiableMapTest, SnapshotsDoNotChange) {
+  map_.Set("key", "value");
+  const string root(map_.CurrentRoot());
+  const std::shared_ptr<const VerifiableMap::Snapshot> snapshot(
+      map_.CurrentSnapshot());
+
+  map_.Set("key", "other value");
+  map_.Set("other key", "value");
+  EXPECT_NE(root, map_.CurrentRoot());
+
+  EXPECT_EQ(root, snapshot->Root());
+  string value;
+  EXPECT_TRUE(snapshot->GetLeaf(map_.PathFromKey("key"), &value));
+  EXPECT_EQ("value", value);
+  EXPECT_FALSE(snapshot->GetLeaf(map_.PathFromKey("other key"), nullptr));
+  EXPECT_EQ("other value", map_.Get("key").ValueOrDie());
+}
+
+
+TEST_F(VerifiableMapTest, InclusionProofs) {
+  const TreeHasher hasher(unique_ptr<SerialHasher>(new Sha256Hasher));
+  map<SparseMerkleTree::Path, string> leaf_hashes;
+  vector<string> keys;
+  for (int i(0); i < 10; ++i) {
+    keys.emplace_back("key" + to_string(i));
+    map_.Set(keys.back(), "value");
+    leaf_hashes[map_.PathFromKey(keys.back())] = hasher.HashLeaf("value");
+  }
+  keys.emplace_back("unknown_key");
+  leaf_hashes[map_.PathFromKey(keys.back())] = hasher.HashLeaf("");
+
+  const string root(map_.CurrentRoot());
+  EXPECT_TRUE(VerifyMultiInclusionProof(hasher, leaf_hashes,
+                                        map_.InclusionProofs(keys), root));
+}
+
+
 // TODO(alcutter): Lots and lots more tests.
 
 
@@ -0,0 +1,388 @@
+#include "merkletree/versioned_sparse_merkle_tree.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+#include <array>
+#include <memory>
+
+#include "merkletree/serial_hasher.h"
+
+using std::array;
+using std::atomic_load;
+using std::atomic_store;
+using std::copy;
+using std::lock_guard;
+using std::lower_bound;
+using std::make_shared;
+using std::map;
+using std::mutex;
+using std::partition_point;
+using std::shared_ptr;
+using std::sort;
+using std::string;
+using std::unique;
+using std::unique_ptr;
+using std::vector;
+
+
+struct VersionedSparseMerkleTree::Hashing {
+  explicit Hashing(const SerialHasher& hasher) : model(hasher.Create()) {
+    for (const auto& null_hash : *GetNullHashes(TreeHasher(hasher.Create()))) {
+      null_nodes.emplace_back(null_hash);
+    }
+  }
+
+  // The hash of a subtree at |depth| containing nothing but |leaf_hash|
+  // at |path|, into |hash|.
+  void HashUpFromLeaf(const Path& path, const Digest& leaf_hash, size_t depth,
+                      const TreeHasher& hasher, Digest* hash) const {
+    CHECK_LT(0U, depth);
+    *hash = leaf_hash;
+    for (size_t i(SparseMerkleTree::kDigestSizeBits - 1); i >= depth; --i) {
+      if (PathBit(path, i) == 0) {
+        hasher.HashChildren(*hash, null_nodes[i], hash);
+      } else {
+        hasher.HashChildren(null_nodes[i], *hash, hash);
+      }
+    }
+  }
+
+  // Used to create the hashers of the readers.
+  const unique_ptr<SerialHasher> model;
+  // The hash of an empty subtree at depth i + 1 is |null_nodes[i]|.
+  vector<Digest> null_nodes;
+};
+
+
+// Either an internal node, with up to two children, or the only leaf
+// of the subtree rooted at its position (which, as in
+// SparseMerkleTree, can be anywhere above the actual position of the
+// leaf). Its hash is that of the subtree.
+struct VersionedSparseMerkleTree::Node {
+  bool is_leaf = false;
+  Digest hash;
+  shared_ptr<const Node> children[2];
+  // For leaves only.
+  Path path;
+  Digest leaf_hash;
+  string data;
+};
+
+
+struct VersionedSparseMerkleTree::Update {
+  Path path;
+  Digest leaf_hash;
+  string data;
+};
+
+
+VersionedSparseMerkleTree::VersionedSparseMerkleTree(SerialHasher* hasher)
+    : hashing_(make_shared<Hashing>(*CHECK_NOTNULL(hasher))),
+      treehasher_(unique_ptr<SerialHasher>(hasher)) {
+  CHECK_EQ(Digest::kSize, treehasher_.DigestSize());
+  atomic_store(&current_,
+               shared_ptr<const Version>(new Version(
+                   hashing_, NewInternal(0, nullptr, nullptr))));
+}
+
+
+VersionedSparseMerkleTree::~VersionedSparseMerkleTree() {
+}
+
+
+void VersionedSparseMerkleTree::SetLeaf(const Path& path,
+                                        const string& data) {
+  lock_guard<mutex> lock(pending_lock_);
+  pending_[path] = data;
+}
+
+
+shared_ptr<const VersionedSparseMerkleTree::Version>
+VersionedSparseMerkleTree::Commit() {
+  lock_guard<mutex> commit_lock(commit_lock_);
+  map<Path, string> pending;
+  {
+    lock_guard<mutex> lock(pending_lock_);
+    pending.swap(pending_);
+  }
+  const shared_ptr<const Version> current(Current());
+  if (pending.empty()) {
+    return current;
+  }
+
+  // In the order of the paths, which is also that of the leaves.
+  vector<Update> updates(pending.size());
+  auto update(updates.begin());
+  for (auto& it : pending) {
+    update->path = it.first;
+    treehasher_.HashLeaf(reinterpret_cast<const uint8_t*>(it.second.data()),
+                         it.second.size(), &update->leaf_hash);
+    update->data.swap(it.second);
+    ++update;
+  }
+
+  const shared_ptr<const Version> version(
+      new Version(hashing_, Apply(current->root_, 0, updates.data(),
+                                  updates.data() + updates.size())));
+  atomic_store(&current_, version);
+  return version;
+}
+
+
+shared_ptr<const VersionedSparseMerkleTree::Version>
+VersionedSparseMerkleTree::Current() const {
+  return atomic_load(&current_);
+}
+
+
+shared_ptr<const VersionedSparseMerkleTree::Node>
+VersionedSparseMerkleTree::Apply(const shared_ptr<const Node>& node,
+                                 size_t depth, const Update* first,
+                                 const Update* last) {
+  if (first == last) {
+    return node;
+  }
+
+  if (node && node->is_leaf) {
+    // The leaf already here goes down with the updates, unless one of
+    // them replaces it.
+    const Update* const it(
+        lower_bound(first, last, node->path,
+                    [](const Update& u, const Path& p) { return u.path < p; }));
+    if (it != last && it->path == node->path) {
+      return Apply(nullptr, depth, first, last);
+    }
+    vector<Update> merged(first, it);
+    merged.push_back(Update{node->path, node->leaf_hash, node->data});
+    merged.insert(merged.end(), it, last);
+    return Apply(nullptr, depth, merged.data(),
+                 merged.data() + merged.size());
+  }
+
+  // The root is always an internal node.
+  if (!node && depth > 0 && last - first == 1) {
+    return NewLeaf(*first, depth);
+  }
+
+  CHECK_LT(depth, static_cast<size_t>(SparseMerkleTree::kDigestSizeBits));
+  const Update* const middle(partition_point(
+      first, last,
+      [depth](const Update& u) { return PathBit(u.path, depth) == 0; }));
+  return NewInternal(
+      depth, Apply(node ? node->children[0] : nullptr, depth + 1, first,
+                   middle),
+      Apply(node ? node->children[1] : nullptr, depth + 1, middle, last));
+}
+
+
+shared_ptr<const VersionedSparseMerkleTree::Node>
+VersionedSparseMerkleTree::NewLeaf(const Update& update, size_t depth) {
+  const shared_ptr<Node> leaf(make_shared<Node>());
+  leaf->is_leaf = true;
+  leaf->path = update.path;
+  leaf->leaf_hash = update.leaf_hash;
+  leaf->data = update.data;
+  hashing_->HashUpFromLeaf(leaf->path, leaf->leaf_hash, depth, treehasher_,
+                           &leaf->hash);
+  return leaf;
+}
+
+
+shared_ptr<const VersionedSparseMerkleTree::Node>
+VersionedSparseMerkleTree::NewInternal(size_t depth,
+                                       const shared_ptr<const Node>& left,
+                                       const shared_ptr<const Node>& right) {
+  const shared_ptr<Node> node(make_shared<Node>());
+  node->children[0] = left;
+  node->children[1] = right;
+  const Digest& null_child(hashing_->null_nodes[depth]);
+  treehasher_.HashChildren(left ? left->hash : null_child,
+                           right ? right->hash : null_child, &node->hash);
+  return node;
+}
+
+
+VersionedSparseMerkleTree::Version::Version(
+    const shared_ptr<const Hashing>& hashing,
+    const shared_ptr<const Node>& root)
+    : hashing_(hashing), root_(root) {
+  CHECK(root_ && !root_->is_leaf);
+}
+
+
+string VersionedSparseMerkleTree::Version::Root() const {
+  return root_->hash.ToString();
+}
+
+
+bool VersionedSparseMerkleTree::Version::GetLeaf(const Path& path,
+                                                 string* data) const {
+  const Node* node(root_.get());
+  for (size_t depth(0); node && !node->is_leaf; ++depth) {
+    node = node->children[PathBit(path, depth)].get();
+  }
+  if (!node || node->path != path) {
+    return false;
+  }
+  if (data) {
+    *data = node->data;
+  }
+  return true;
+}
+
+
+vector<string> VersionedSparseMerkleTree::Version::InclusionProof(
+    const Path& path) const {
+  // |siblings[i]| is the sibling of the node at depth i + 1 along |path|,
+  // which is null unless we find otherwise on the way down.
+  array<Digest, SparseMerkleTree::kDigestSizeBits> siblings;
+  copy(hashing_->null_nodes.begin(), hashing_->null_nodes.end(),
+       siblings.begin());
+
+  const Node* node(root_.get());
+  for (size_t depth(0); depth < siblings.size(); ++depth) {
+    const int bit(PathBit(path, depth));
+    const Node* const sibling(node->children[1 - bit].get());
+    if (sibling) {
+      siblings[depth] = sibling->hash;
+    }
+
+    const Node* const child(node->children[bit].get());
+    if (!child) {
+      break;
+    } else if (!child->is_leaf) {
+      node = child;
+      continue;
+    }
+
+    if (child->path != path) {
+      // Were |path| set, |child| would be pushed down to where their
+      // paths diverge, as the sibling of the node along |path| there.
+      const size_t diverge(FirstDifferingBit(child->path, path, depth + 1));
+      CHECK_LT(diverge, siblings.size());
+      // TreeHasher serializes its callers, so every reader needs its
+      // own.
+      const TreeHasher hasher(hashing_->model->Create());
+      hashing_->HashUpFromLeaf(child->path, child->leaf_hash, diverge + 1,
+                               hasher, &siblings[diverge]);
+    }
+    break;
+  }
+
+  vector<string> proof;
+  proof.reserve(siblings.size());
+  for (auto it(siblings.rbegin()); it != siblings.rend(); ++it) {
+    proof.emplace_back(it->ToString());
+  }
+  return proof;
+}
+
+
+// Builds a MultiInclusionProof, sibling by sibling.
+class VersionedSparseMerkleTree::Version::ProofWriter {
+ public:
+  ProofWriter(const Hashing* hashing, MultiInclusionProof* proof)
+      : hashing_(hashing), proof_(proof), num_siblings_(0) {
+  }
+
+  void AddEmpty() {
+    AddBit(false);
+  }
+
+  void AddHash(const Digest& hash) {
+    AddBit(true);
+    proof_->hashes.emplace_back(hash.ToString());
+  }
+
+  // Adds the hash of a subtree at |depth| with only |leaf| in it.
+  void AddLeaf(const Node& leaf, size_t depth) {
+    if (!hasher_) {
+      // TreeHasher serializes its callers, so every reader needs its
+      // own.
+      hasher_.reset(new TreeHasher(hashing_->model->Create()));
+    }
+    Digest hash;
+    hashing_->HashUpFromLeaf(leaf.path, leaf.leaf_hash, depth, *hasher_,
+                             &hash);
+    AddHash(hash);
+  }
+
+ private:
+  void AddBit(bool set) {
+    if (num_siblings_ % 8 == 0) {
+      proof_->bitmap.push_back(0);
+    }
+    if (set) {
+      proof_->bitmap.back() |= 0x80 >> (num_siblings_ % 8);
+    }
+    ++num_siblings_;
+  }
+
+  const Hashing* const hashing_;
+  MultiInclusionProof* const proof_;
+  size_t num_siblings_;
+  unique_ptr<TreeHasher> hasher_;
+};
+
+
+MultiInclusionProof VersionedSparseMerkleTree::Version::InclusionProof(
+    const vector<Path>& paths) const {
+  vector<Path> sorted(paths);
+  sort(sorted.begin(), sorted.end());
+  sorted.erase(unique(sorted.begin(), sorted.end()), sorted.end());
+
+  MultiInclusionProof proof;
+  if (!sorted.empty()) {
+    ProofWriter writer(hashing_.get(), &proof);
+    AddSiblings(root_.get(), 0, sorted.data(),
+                sorted.data() + sorted.size(), &writer);
+  }
+  return proof;
+}
+
+
+void VersionedSparseMerkleTree::Version::AddSiblings(
+    const Node* node, size_t depth, const Path* first, const Path* last,
+    ProofWriter* proof) const {
+  if (depth == SparseMerkleTree::kDigestSizeBits) {
+    return;
+  }
+  const Path* const middle(partition_point(
+      first, last,
+      [depth](const Path& p) { return PathBit(p, depth) == 0; }));
+
+  // A leaf stays the only one of the subtrees along its path, whose
+  // hashes are not those of the node.
+  const bool leaf_below(node && node->is_leaf);
+  const Node* children[2] = {nullptr, nullptr};
+  if (leaf_below) {
+    children[PathBit(node->path, depth)] = node;
+  } else if (node) {
+    children[0] = node->children[0].get();
+    children[1] = node->children[1].get();
+  }
+
+  for (int side(0); side < 2; ++side) {
+    const Path* const side_first(side == 0 ? first : middle);
+    const Path* const side_last(side == 0 ? middle : last);
+    if (side_first != side_last) {
+      continue;
+    }
+    // Only the other side has paths, this one is a sibling.
+    const Node* const sibling(children[side]);
+    if (!sibling) {
+      proof->AddEmpty();
+    } else if (leaf_below) {
+      proof->AddLeaf(*sibling, depth + 1);
+    } else {
+      proof->AddHash(sibling->hash);
+    }
+  }
+
+  if (first != middle) {
+    AddSiblings(children[0], depth + 1, first, middle, proof);
+  }
+  if (middle != last) {
+    AddSiblings(children[1], depth + 1, middle, last, proof);
+  }
+}
@@ -0,0 +1,125 @@
+#ifndef CERT_TRANS_MERKLETREE_VERSIONED_SPARSE_MERKLE_TREE_H_
+#define CERT_TRANS_MERKLETREE_VERSIONED_SPARSE_MERKLE_TREE_H_
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "base/macros.h"
+#include "merkletree/digest.h"
+#include "merkletree/sparse_merkle_tree.h"
+#include "merkletree/tree_hasher.h"
+
+class SerialHasher;
+
+
+// A sparse Merkle tree with the same shape, and so the same roots and
+// proofs, as a SparseMerkleTree, but which is persistent: every
+// Commit() makes a new, immutable Version of the tree, which shares
+// all the nodes that did not change with the previous one. A Version
+// can be read by any number of threads without locking, while the
+// tree is being updated, and its nodes are freed once the last
+// reference to it (and to any newer version still using them) goes.
+//
+// Committing a batch of leaves copies and rehashes every node along
+// their paths once, however many of the leaves go through it.
+//
+// Unlike SparseMerkleTree, the leaves also keep their data.
+//
+// This class is thread-safe.
+class VersionedSparseMerkleTree {
+ public:
+  typedef SparseMerkleTree::Path Path;
+
+  class Version;
+
+  // Takes ownership of |hasher|.
+  explicit VersionedSparseMerkleTree(SerialHasher* hasher);
+  ~VersionedSparseMerkleTree();
+
+  // Sets the leaf at |path| to |data| in the next Commit().
+  void SetLeaf(const Path& path, const std::string& data);
+
+  // Makes a new version with the leaves set since the last time, which
+  // becomes the current one, and returns it. Commits are serialized,
+  // but do not block the readers of any version.
+  std::shared_ptr<const Version> Commit();
+
+  // The latest committed version (which has no leaves at first).
+  std::shared_ptr<const Version> Current() const;
+
+ private:
+  struct Hashing;
+  struct Node;
+  struct Update;
+
+  // Returns the node replacing |node|, at |depth|, with the updates
+  // from |first| to |last| (sorted by path, all with the same |depth|
+  // first bits) applied.
+  std::shared_ptr<const Node> Apply(const std::shared_ptr<const Node>& node,
+                                    size_t depth, const Update* first,
+                                    const Update* last);
+  std::shared_ptr<const Node> NewLeaf(const Update& update, size_t depth);
+  std::shared_ptr<const Node> NewInternal(
+      size_t depth, const std::shared_ptr<const Node>& left,
+      const std::shared_ptr<const Node>& right);
+
+  // Shared with the versions, which need the null hashes.
+  const std::shared_ptr<const Hashing> hashing_;
+  // Only used by Commit().
+  TreeHasher treehasher_;
+
+  std::mutex commit_lock_;
+
+  std::mutex pending_lock_;  // covers |pending_|
+  std::map<Path, std::string> pending_;
+
+  // Only ever accessed with std::atomic_load() and std::atomic_store().
+  std::shared_ptr<const Version> current_;
+
+  DISALLOW_COPY_AND_ASSIGN(VersionedSparseMerkleTree);
+};
+
+
+// An immutable version of a VersionedSparseMerkleTree, which stays
+// valid even once the tree is gone.
+class VersionedSparseMerkleTree::Version {
+ public:
+  // The root hash of the tree.
+  std::string Root() const;
+
+  // Returns false if no leaf is set at |path|, otherwise puts its data
+  // in |data| (which can be NULL).
+  bool GetLeaf(const Path& path, std::string* data) const;
+
+  // Same as SparseMerkleTree::InclusionProof().
+  std::vector<std::string> InclusionProof(const Path& path) const;
+
+  // The proof of all of |paths| (in any order, possibly with
+  // duplicates) at once, see VerifyMultiInclusionProof().
+  MultiInclusionProof InclusionProof(const std::vector<Path>& paths) const;
+
+ private:
+  friend class VersionedSparseMerkleTree;
+  class ProofWriter;
+
+  // Adds the siblings along the paths from |first| to |last| below
+  // |node|, at |depth|, to |proof|. |node| is NULL for an empty
+  // subtree, and can be a leaf from above |depth|.
+  void AddSiblings(const Node* node, size_t depth, const Path* first,
+                   const Path* last, ProofWriter* proof) const;
+
+  Version(const std::shared_ptr<const Hashing>& hashing,
+          const std::shared_ptr<const Node>& root);
+
+  const std::shared_ptr<const Hashing> hashing_;
+  // Always an internal node.
+  const std::shared_ptr<const Node> root_;
+
+  DISALLOW_COPY_AND_ASSIGN(Version);
+};
+
+
+#endif  // CERT_TRANS_MERKLETREE_VERSIONED_SPARSE_MERKLE_TREE_H_
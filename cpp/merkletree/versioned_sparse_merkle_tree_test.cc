@@ -0,0 +1,249 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "merkletree/serial_hasher.h"
+#include "merkletree/sparse_merkle_tree.h"
+#include "merkletree/versioned_sparse_merkle_tree.h"
+#include "util/testing.h"
+#include "util/util.h"
+
+namespace {
+
+using std::atomic;
+using std::map;
+using std::mt19937;
+using std::shared_ptr;
+using std::string;
+using std::thread;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+using util::ToBase64;
+
+typedef VersionedSparseMerkleTree::Version Version;
+
+
+class VersionedSparseMerkleTreeTest : public testing::Test {
+ public:
+  VersionedSparseMerkleTreeTest()
+      : reference_(new Sha256Hasher),
+        tree_(new Sha256Hasher),
+        rand_(1234) {
+  }
+
+ protected:
+  SparseMerkleTree::Path RandomPath() {
+    SparseMerkleTree::Path ret;
+    for (SparseMerkleTree::Path::size_type i(0); i < ret.size(); ++i) {
+      ret[i] = rand_() & 0xff;
+    }
+    return ret;
+  }
+
+  // Random paths, some of them sharing long prefixes, and some set
+  // more than once.
+  vector<SparseMerkleTree::Path> RandomPaths(int count) {
+    vector<SparseMerkleTree::Path> paths;
+    for (int i(0); i < count; ++i) {
+      paths.emplace_back(RandomPath());
+      if (i % 4 == 0) {
+        paths.back() = paths.front();
+        paths.back()[31 - i % 32] ^= i % 3;
+      }
+    }
+    return paths;
+  }
+
+  void Set(const SparseMerkleTree::Path& path, const string& data) {
+    reference_.SetLeaf(path, data);
+    tree_.SetLeaf(path, data);
+  }
+
+  void ExpectSameAsReference(const Version& version,
+                             const vector<SparseMerkleTree::Path>& paths) {
+    EXPECT_EQ(ToBase64(reference_.CurrentRoot()), ToBase64(version.Root()));
+    for (const auto& path : paths) {
+      EXPECT_EQ(reference_.InclusionProof(path),
+                version.InclusionProof(path));
+    }
+    // And a path that is not set.
+    const SparseMerkleTree::Path path(RandomPath());
+    EXPECT_EQ(reference_.InclusionProof(path), version.InclusionProof(path));
+    EXPECT_FALSE(version.GetLeaf(path, nullptr));
+  }
+
+  SparseMerkleTree reference_;
+  VersionedSparseMerkleTree tree_;
+  mt19937 rand_;
+};
+
+
+TEST_F(VersionedSparseMerkleTreeTest, Empty) {
+  EXPECT_EQ(ToBase64(reference_.CurrentRoot()),
+            ToBase64(tree_.Current()->Root()));
+  EXPECT_EQ(tree_.Current(), tree_.Commit());
+  ExpectSameAsReference(*tree_.Current(), {});
+}
+
+
+TEST_F(VersionedSparseMerkleTreeTest, SameAsSparseMerkleTree) {
+  const vector<SparseMerkleTree::Path> paths(RandomPaths(300));
+  for (int round(0); round < 3; ++round) {
+    for (size_t i(0); i < paths.size(); ++i) {
+      Set(paths[i], to_string(round * paths.size() + i));
+      // In batches of various sizes.
+      if (i % ((round + 1) * 50) == 0) {
+        tree_.Commit();
+      }
+    }
+    ExpectSameAsReference(*tree_.Commit(), paths);
+  }
+
+  string data;
+  EXPECT_TRUE(tree_.Current()->GetLeaf(paths.back(), &data));
+  EXPECT_EQ(to_string(3 * paths.size() - 1), data);
+}
+
+
+TEST_F(VersionedSparseMerkleTreeTest, VersionsDoNotChange) {
+  const vector<SparseMerkleTree::Path> paths(RandomPaths(100));
+  map<SparseMerkleTree::Path, string> old_values;
+  for (size_t i(0); i < paths.size(); ++i) {
+    Set(paths[i], to_string(i));
+    old_values[paths[i]] = to_string(i);
+  }
+  const shared_ptr<const Version> old_version(tree_.Commit());
+  const string old_root(reference_.CurrentRoot());
+  vector<vector<string>> old_proofs;
+  for (const auto& path : paths) {
+    old_proofs.emplace_back(reference_.InclusionProof(path));
+  }
+
+  // Replace some, and push others down.
+  for (size_t i(0); i < paths.size(); i += 2) {
+    Set(paths[i], "new " + to_string(i));
+    SparseMerkleTree::Path neighbour(paths[i]);
+    neighbour[31] ^= 0x01;
+    Set(neighbour, "neighbour " + to_string(i));
+  }
+  const shared_ptr<const Version> new_version(tree_.Commit());
+  ExpectSameAsReference(*new_version, paths);
+
+  EXPECT_EQ(ToBase64(old_root), ToBase64(old_version->Root()));
+  for (size_t i(0); i < paths.size(); ++i) {
+    EXPECT_EQ(old_proofs[i], old_version->InclusionProof(paths[i]));
+    string data;
+    EXPECT_TRUE(old_version->GetLeaf(paths[i], &data));
+    EXPECT_EQ(old_values[paths[i]], data);
+  }
+}
+
+
+TEST_F(VersionedSparseMerkleTreeTest, MultiInclusionProof) {
+  TreeHasher hasher(unique_ptr<SerialHasher>(new Sha256Hasher));
+  const vector<SparseMerkleTree::Path> paths(RandomPaths(300));
+  map<SparseMerkleTree::Path, string> leaf_hashes;
+  for (size_t i(0); i < paths.size(); ++i) {
+    Set(paths[i], to_string(i));
+    leaf_hashes[paths[i]] = hasher.HashLeaf(to_string(i));
+  }
+  const shared_ptr<const Version> version(tree_.Commit());
+  const string root(version->Root());
+
+  // With all the leaves, the other siblings are all empty.
+  EXPECT_TRUE(VerifyMultiInclusionProof(
+      hasher, leaf_hashes, version->InclusionProof(paths), root));
+  EXPECT_TRUE(version->InclusionProof(paths).hashes.empty());
+
+  // Every other one, and some that are not set.
+  vector<SparseMerkleTree::Path> proven;
+  for (size_t i(0); i < paths.size(); i += 2) {
+    proven.emplace_back(paths[i]);
+  }
+  for (int i(0); i < 20; ++i) {
+    proven.emplace_back(RandomPath());
+    leaf_hashes.emplace(proven.back(), hasher.HashLeaf(""));
+  }
+  for (size_t i(1); i < paths.size(); i += 2) {
+    leaf_hashes.erase(paths[i]);
+  }
+  const MultiInclusionProof proof(version->InclusionProof(proven));
+  EXPECT_TRUE(VerifyMultiInclusionProof(hasher, leaf_hashes, proof, root));
+  // Much smaller than the proofs one by one.
+  EXPECT_FALSE(proof.hashes.empty());
+  EXPECT_LT(proof.hashes.size(), leaf_hashes.size() * 2);
+
+  // Any one of them on its own.
+  for (const auto& it : leaf_hashes) {
+    const map<SparseMerkleTree::Path, string> one{it};
+    EXPECT_TRUE(VerifyMultiInclusionProof(
+        hasher, one,
+        version->InclusionProof(vector<SparseMerkleTree::Path>{it.first}),
+        root));
+  }
+
+  // But not with a different leaf, or a tampered proof.
+  map<SparseMerkleTree::Path, string> wrong_leaf(leaf_hashes);
+  wrong_leaf.begin()->second = hasher.HashLeaf("wrong");
+  EXPECT_FALSE(VerifyMultiInclusionProof(hasher, wrong_leaf, proof, root));
+  MultiInclusionProof tampered(proof);
+  tampered.hashes.back()[0] ^= 1;
+  EXPECT_FALSE(
+      VerifyMultiInclusionProof(hasher, leaf_hashes, tampered, root));
+  tampered = proof;
+  tampered.hashes.pop_back();
+  EXPECT_FALSE(
+      VerifyMultiInclusionProof(hasher, leaf_hashes, tampered, root));
+  map<SparseMerkleTree::Path, string> fewer(leaf_hashes);
+  fewer.erase(fewer.begin());
+  EXPECT_FALSE(VerifyMultiInclusionProof(hasher, fewer, proof, root));
+}
+
+
+TEST_F(VersionedSparseMerkleTreeTest, ReadersDuringCommits) {
+  const vector<SparseMerkleTree::Path> paths(RandomPaths(200));
+  atomic<bool> done(false);
+  vector<thread> readers;
+  for (int i(0); i < 4; ++i) {
+    readers.emplace_back([this, &paths, &done]() {
+      while (!done) {
+        // Whichever version it gets, it is consistent with itself.
+        const shared_ptr<const Version> version(tree_.Current());
+        const string root(version->Root());
+        for (const auto& path : paths) {
+          version->InclusionProof(path);
+        }
+        EXPECT_EQ(root, version->Root());
+      }
+    });
+  }
+
+  for (size_t i(0); i < paths.size(); ++i) {
+    Set(paths[i], to_string(i));
+    if (i % 10 == 0) {
+      tree_.Commit();
+    }
+  }
+  ExpectSameAsReference(*tree_.Commit(), paths);
+
+  done = true;
+  for (auto& reader : readers) {
+    reader.join();
+  }
+}
+
+
+}  // namespace
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
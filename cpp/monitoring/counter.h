@@ -17,6 +17,10 @@ namespace cert_trans {
 template <class... LabelTypes>
 class Counter : public Metric {
  public:
+  // A handle on the value for one combination of labels, for callers
+  // updating it often: see LabelledValues::Cell.
+  typedef typename LabelledValues<LabelTypes...>::Cell Cell;
+
   static Counter<LabelTypes...>* New(
       const std::string& name,
       const typename NameType<LabelTypes>::name&... label_names,
@@ -28,8 +32,11 @@ class Counter : public Metric {
 
   double Get(const LabelTypes&... labels) const;
 
-  std::map<std::vector<std::string>, Metric::TimestampedValue> CurrentValues()
-      const override;
+  // Returns the handle for |labels|, which stays valid for as long as
+  // this metric.
+  Cell* Bind(const LabelTypes&... labels);
+
+  void VisitValues(const ValueCallback& callback) const override;
 
  private:
   Counter(const std::string& name,
@@ -82,9 +89,15 @@ double Counter<LabelTypes...>::Get(const LabelTypes&... labels) const {
 
 
 template <class... LabelTypes>
-std::map<std::vector<std::string>, Metric::TimestampedValue>
-Counter<LabelTypes...>::CurrentValues() const {
-  return values_.CurrentValues();
+typename Counter<LabelTypes...>::Cell* Counter<LabelTypes...>::Bind(
+    const LabelTypes&... labels) {
+  return values_.Bind(labels...);
+}
+
+
+template <class... LabelTypes>
+void Counter<LabelTypes...>::VisitValues(const ValueCallback& callback) const {
+  values_.VisitValues(callback);
 }
 
 
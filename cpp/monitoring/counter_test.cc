@@ -4,12 +4,14 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 #include <memory>
+#include <thread>
 
 #include "util/testing.h"
 
 namespace cert_trans {
 
 using std::string;
+using std::thread;
 using std::vector;
 using testing::ElementsAre;
 
@@ -91,6 +93,41 @@ TEST_F(CounterTest, TestCounterWithLabelsMultiValues) {
 }
 
 
+TEST_F(CounterTest, TestCounterBound) {
+  std::unique_ptr<Counter<std::string>> counter(
+      Counter<std::string>::New("name", "a string", "help"));
+  Counter<std::string>::Cell* const cell(counter->Bind("alpha"));
+  EXPECT_EQ(cell, counter->Bind("alpha"));
+  cell->Increment();
+  counter->IncrementBy("alpha", 2);
+  cell->IncrementBy(3);
+  EXPECT_EQ(6, cell->Get());
+  EXPECT_EQ(6, counter->Get("alpha"));
+  EXPECT_EQ(0, counter->Get("beta"));
+  EXPECT_EQ(6, counter->CurrentValues()[vector<string>{"alpha"}].second);
+}
+
+
+TEST_F(CounterTest, TestCounterBoundFromManyThreads) {
+  std::unique_ptr<Counter<>> counter(Counter<>::New("name", "help"));
+  Counter<>::Cell* const cell(counter->Bind());
+  const int kNumThreads(8);
+  const int kNumIncrements(10000);
+  vector<thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([cell]() {
+      for (int j = 0; j < kNumIncrements; ++j) {
+        cell->Increment();
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  EXPECT_EQ(kNumThreads * kNumIncrements, counter->Get());
+}
+
+
 }  // namespace cert_trans
 
 
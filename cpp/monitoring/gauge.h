@@ -16,6 +16,10 @@ namespace cert_trans {
 template <class... LabelTypes>
 class Gauge : public Metric {
  public:
+  // A handle on the value for one combination of labels, for callers
+  // updating it often: see LabelledValues::Cell.
+  typedef typename LabelledValues<LabelTypes...>::Cell Cell;
+
   static Gauge<LabelTypes...>* New(
       const std::string& name,
       const typename NameType<LabelTypes>::name&... label_names,
@@ -25,9 +29,11 @@ class Gauge : public Metric {
 
   void Set(const LabelTypes&... labels, double value);
 
-  // TODO(alcutter): Not over the moon about having this here.
-  std::map<std::vector<std::string>, Metric::TimestampedValue> CurrentValues()
-      const override;
+  // Returns the handle for |labels|, which stays valid for as long as
+  // this metric.
+  Cell* Bind(const LabelTypes&... labels);
+
+  void VisitValues(const ValueCallback& callback) const override;
 
  private:
   Gauge(const std::string& name,
@@ -73,9 +79,15 @@ void Gauge<LabelTypes...>::Set(const LabelTypes&... labels, double value) {
 
 
 template <class... LabelTypes>
-std::map<std::vector<std::string>, Metric::TimestampedValue>
-Gauge<LabelTypes...>::CurrentValues() const {
-  return values_.CurrentValues();
+typename Gauge<LabelTypes...>::Cell* Gauge<LabelTypes...>::Bind(
+    const LabelTypes&... labels) {
+  return values_.Bind(labels...);
+}
+
+
+template <class... LabelTypes>
+void Gauge<LabelTypes...>::VisitValues(const ValueCallback& callback) const {
+  values_.VisitValues(callback);
 }
 
 
@@ -96,6 +96,19 @@ TEST_F(GaugeTest, TestGaugeWithLabelsMultiValues) {
 }
 
 
+TEST_F(GaugeTest, TestGaugeBound) {
+  std::unique_ptr<Gauge<std::string>> gauge(
+      Gauge<std::string>::New("name", "a string", "help"));
+  Gauge<std::string>::Cell* const cell(gauge->Bind("alpha"));
+  cell->Set(100);
+  EXPECT_EQ(100, gauge->Get("alpha"));
+  gauge->Set("alpha", 5);
+  EXPECT_EQ(5, cell->Get());
+  cell->Set(7);
+  EXPECT_EQ(7, gauge->CurrentValues()[vector<string>{"alpha"}].second);
+}
+
+
 }  // namespace cert_trans
 
 
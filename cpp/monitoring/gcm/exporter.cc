@@ -2,6 +2,8 @@
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <zlib.h>
+#include <algorithm>
 #include <sstream>
 
 #include "monitoring/monitoring.h"
@@ -24,6 +26,16 @@ DEFINE_int32(google_compute_monitoring_credentials_refresh_interval_minutes,
              "GCM.");
 DEFINE_int32(google_compute_monitoring_retry_delay_seconds, 5,
              "Seconds between retrying failed GCM requests.");
+DEFINE_int32(google_compute_monitoring_full_push_interval_seconds, 600,
+             "Seconds between pushing all the series to GCM, rather than "
+             "only those which changed since they were last pushed. GCM "
+             "stops showing series which are not pushed for a while. If "
+             "zero, all the series are always pushed.");
+DEFINE_int32(google_compute_monitoring_max_timeseries_per_request, 200,
+             "Most series to push to GCM in a single request.");
+DEFINE_bool(google_compute_monitoring_gzip_requests, true,
+            "Whether to compress the requests pushing metric values to "
+            "GCM.");
 
 
 namespace cert_trans {
@@ -31,16 +43,20 @@ namespace cert_trans {
 using std::bind;
 using std::chrono::minutes;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::chrono::system_clock;
 using std::make_pair;
+using std::min;
+using std::move;
 using std::mutex;
 using std::ostringstream;
+using std::pair;
 using std::placeholders::_1;
 using std::string;
 using std::thread;
 using std::unique_lock;
 using std::unique_ptr;
-using util::Executor;
+using std::vector;
 using util::SyncTask;
 using util::Task;
 
@@ -74,14 +90,15 @@ inline std::string RFC3339Time(const system_clock::time_point& when) {
 }  // namespace
 
 
-GCMExporter::GCMExporter(const string& instance_name, UrlFetcher* fetcher,
-                         Executor* executor)
+GCMExporter::GCMExporter(const string& instance_name, UrlFetcher* fetcher)
     : instance_name_(instance_name),
       fetcher_(CHECK_NOTNULL(fetcher)),
-      executor_(CHECK_NOTNULL(executor)),
-      task_(executor_),
+      // CreateMetric() blocks a thread while the callback of its request
+      // runs on the other.
+      pool_("gcm", 2),
+      task_(&pool_),
       metrics_created_(false) {
-  executor_->Add(bind(&GCMExporter::PushMetrics, this));
+  pool_.Add(bind(&GCMExporter::PushMetrics, this));
 }
 
 
@@ -112,7 +129,7 @@ void GCMExporter::RefreshCredentialsDone(UrlFetcher::Response* resp,
     LOG(WARNING) << "Failed to refresh GCM credentials, status: "
                  << task->status() << ", response code: " << resp->status_code;
     num_gcm_token_fetch_failures->Increment();
-    executor_->Delay(
+    pool_.Delay(
         seconds(FLAGS_google_compute_monitoring_retry_delay_seconds),
         task_.task()->AddChild(bind(&GCMExporter::RefreshCredentials, this)));
     return;
@@ -143,9 +160,62 @@ void AddLabelDescription(const string& key, const string& desc,
 }
 
 
+// Custom metrics in GCM hold a single value, so each histogram is pushed as
+// a few gauges derived from it, named by appending these suffixes.
+vector<pair<string, double>> HistogramGauges(
+    const Metric::HistogramValue& value) {
+  return {
+      make_pair("_count", static_cast<double>(value.count)),
+      make_pair("_overall_sum", value.sum),
+      make_pair("_p50", value.Quantile(0.5)),
+      make_pair("_p90", value.Quantile(0.9)),
+      make_pair("_p99", value.Quantile(0.99)),
+      make_pair("_p999", value.Quantile(0.999)),
+  };
+}
+
+
 }  // namespace
 
 
+void GCMExporter::CreateMetric(const string& name, const string& help,
+                               const JsonArray& labels,
+                               const JsonObject& desc) {
+  JsonObject metric;
+  metric.Add("name", kCloudPrefix + name);
+  metric.Add("description", help);
+  metric.Add("labels", labels);
+  metric.Add("typeDescriptor", desc);
+
+  do {
+    UrlFetcher::Request req(
+        (URL(FLAGS_google_compute_monitoring_base_url + "/metricDescriptors")));
+    req.verb = UrlFetcher::Verb::POST;
+    req.headers.insert(make_pair("Content-Type", "application/json"));
+    req.headers.insert(make_pair("Authorization", "Bearer " + bearer_token_));
+    req.body = metric.ToString();
+
+    UrlFetcher::Response resp;
+    SyncTask task(&pool_);
+    VLOG(1) << "Creating metric " << name << "...";
+    VLOG(2) << req.body;
+    fetcher_->Fetch(req, &resp, task.task());
+    task.Wait();
+    if (!task.status().ok() || resp.status_code != 200) {
+      LOG(WARNING) << "Failed to create/update metric metadata; status: "
+                   << task.status() << ", response_code: " << resp.status_code;
+      num_gcm_create_metric_failures->Increment();
+      // TODO(alcutter): consider breaking this up into separate child tasks.
+      sleep(FLAGS_google_compute_monitoring_retry_delay_seconds);
+      continue;
+    }
+    VLOG(1) << "Metrics Created.";
+    VLOG(2) << resp.body;
+    break;
+  } while (true);
+}
+
+
 void GCMExporter::CreateMetrics() {
   const std::set<const Metric*> metrics(Registry::Instance()->GetMetrics());
   for (auto& m : metrics) {
@@ -163,54 +233,32 @@ void GCMExporter::CreateMetrics() {
     }
 
     JsonObject desc;
+    vector<string> names;
     switch (m->Type()) {
       case Metric::COUNTER:
         // only gauge type metrics are supported for custom metrics currently:
         // https://cloud.google.com/monitoring/api/metrics#metric-types
         desc.Add("metricType", "gauge");
+        names.push_back(m->Name());
         break;
       case Metric::GAUGE:
         desc.Add("metricType", "gauge");
+        names.push_back(m->Name());
+        break;
+      case Metric::HISTOGRAM:
+        desc.Add("metricType", "gauge");
+        for (const auto& gauge : HistogramGauges(Metric::HistogramValue())) {
+          names.push_back(m->Name() + gauge.first);
+        }
         break;
       default:
         LOG(FATAL) << "Unknown type: " << m->Type();
     }
     desc.Add("valueType", "double");
 
-    JsonObject metric;
-    metric.Add("name", kCloudPrefix + m->Name());
-    metric.Add("description", m->Help());
-    metric.Add("labels", labels);
-    metric.Add("typeDescriptor", desc);
-
-    do {
-      UrlFetcher::Request req((URL(FLAGS_google_compute_monitoring_base_url +
-                                   "/metricDescriptors")));
-      req.verb = UrlFetcher::Verb::POST;
-      req.headers.insert(make_pair("Content-Type", "application/json"));
-      req.headers.insert(
-          make_pair("Authorization", "Bearer " + bearer_token_));
-      req.body = metric.ToString();
-
-      UrlFetcher::Response resp;
-      SyncTask task(executor_);
-      VLOG(1) << "Creating metric m.Name()...";
-      VLOG(2) << req.body;
-      fetcher_->Fetch(req, &resp, task.task());
-      task.Wait();
-      if (!task.status().ok() || resp.status_code != 200) {
-        LOG(WARNING) << "Failed to create/update metric metadata; status: "
-                     << task.status()
-                     << ", response_code: " << resp.status_code;
-        num_gcm_create_metric_failures->Increment();
-        // TODO(alcutter): consider breaking this up into separate child tasks.
-        sleep(FLAGS_google_compute_monitoring_retry_delay_seconds);
-        continue;
-      }
-      VLOG(1) << "Metrics Created.";
-      VLOG(2) << resp.body;
-      break;
-    } while (true);
+    for (const auto& name : names) {
+      CreateMetric(name, m->Help(), labels, desc);
+    }
   }
   metrics_created_ = true;
 }
@@ -219,11 +267,110 @@ void GCMExporter::CreateMetrics() {
 namespace {
 
 
+// The value of one series, as of the start of a push.
+struct Series {
+  const Metric* metric;
+  string name;
+  vector<string> label_values;
+  double value;
+  system_clock::time_point changed_at;
+};
+
+
+// Identifies a series in GCMExporter::pushed_.
+string SeriesKey(const Series& series) {
+  string key(series.name);
+  for (const auto& value : series.label_values) {
+    key += '\0';
+    key += value;
+  }
+  return key;
+}
+
+
 void AddLabel(const string& key, const string& value, JsonObject* labels) {
   CHECK_NOTNULL(labels)->Add((kCloudPrefix + key).c_str(), value);
 }
 
 
+void AddTimeseries(const Series& series, JsonArray* timeseries) {
+  JsonObject labels;
+  for (size_t i(0); i < series.label_values.size(); ++i) {
+    AddLabel(series.metric->LabelName(i), series.label_values[i], &labels);
+  }
+
+  JsonObject desc;
+  desc.Add("labels", labels);
+  desc.Add("metric", kCloudPrefix + series.name);
+
+  JsonObject ts;
+  ts.Add("timeseriesDesc", desc);
+
+  JsonObject point;
+  // According to
+  // https://cloud.google.com/monitoring/v2beta2/timeseries/write
+  // GAUGE types should have a zero size timerange here
+  // Which implies we need to use the current time rather than the time the
+  // value was set because there's a [short ~5m] horizon over which GCM
+  // won't accept samples.
+  const auto now(system_clock::now());
+  point.Add("start", RFC3339Time(now));
+  point.Add("end", RFC3339Time(now));
+  point.Add("doubleValue", series.value);
+  ts.Add("point", point);
+
+  CHECK_NOTNULL(timeseries)->Add(&ts);
+}
+
+
+vector<Series> CurrentSeries() {
+  vector<Series> ret;
+  const std::set<const Metric*> metrics(Registry::Instance()->GetMetrics());
+  for (auto& m : metrics) {
+    CHECK_NOTNULL(m);
+    if (m->Type() == Metric::HISTOGRAM) {
+      for (auto& p : m->CurrentHistogramValues()) {
+        for (const auto& gauge : HistogramGauges(p.second)) {
+          ret.emplace_back(Series{m, m->Name() + gauge.first, p.first,
+                                  gauge.second, p.second.timestamp});
+        }
+      }
+      continue;
+    }
+    for (auto& p : m->CurrentValues()) {
+      ret.emplace_back(
+          Series{m, m->Name(), p.first, p.second.second, p.second.first});
+    }
+  }
+  return ret;
+}
+
+
+bool Gzip(const string& data, string* out) {
+  z_stream stream;
+  stream.zalloc = Z_NULL;
+  stream.zfree = Z_NULL;
+  stream.opaque = Z_NULL;
+  // Adding 16 to the window bits asks for a gzip header.
+  if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return false;
+  }
+
+  out->resize(deflateBound(&stream, data.size()));
+  stream.next_in =
+      reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  stream.avail_in = data.size();
+  stream.next_out = reinterpret_cast<Bytef*>(&(*out)[0]);
+  stream.avail_out = out->size();
+  const int ret(deflate(&stream, Z_FINISH));
+  out->resize(stream.total_out);
+  deflateEnd(&stream);
+
+  return ret == Z_STREAM_END;
+}
+
+
 }  // namespace
 
 
@@ -246,59 +393,80 @@ void GCMExporter::PushMetrics() {
     CreateMetrics();
   }
 
-  // Build up the JSON write request into this object:
-  JsonObject metric_write;
-  metric_write.Add("kind", "cloudmonitoring#writeTimeseriesRequest");
+  const steady_clock::time_point now(steady_clock::now());
+  const bool full_push(
+      now - last_full_push_ >=
+      seconds(FLAGS_google_compute_monitoring_full_push_interval_seconds));
+  if (full_push) {
+    last_full_push_ = now;
+  }
 
-  JsonObject common_labels;
-  AddLabel("instance", instance_name_, &common_labels);
-  metric_write.Add("commonLabels", common_labels);
+  vector<Series> series;
+  for (auto& s : CurrentSeries()) {
+    const auto it(pushed_.find(SeriesKey(s)));
+    if (full_push || it == pushed_.end() || it->second != s.changed_at) {
+      series.emplace_back(move(s));
+    }
+  }
+  VLOG(1) << "Pushing " << series.size() << " series"
+          << (full_push ? " (all of them)..." : " (those changed)...");
+
+  CHECK(chunks_.empty());
+  CHECK_GT(FLAGS_google_compute_monitoring_max_timeseries_per_request, 0);
+  const size_t chunk_size(
+      FLAGS_google_compute_monitoring_max_timeseries_per_request);
+  for (size_t begin(0); begin < series.size(); begin += chunk_size) {
+    const size_t end(min(begin + chunk_size, series.size()));
+    chunks_.emplace_back();
+    Chunk* const chunk(&chunks_.back());
+
+    // Build up the JSON write request into this object:
+    JsonObject metric_write;
+    metric_write.Add("kind", "cloudmonitoring#writeTimeseriesRequest");
+
+    JsonObject common_labels;
+    AddLabel("instance", instance_name_, &common_labels);
+    metric_write.Add("commonLabels", common_labels);
+
+    JsonArray timeseries;
+    for (size_t i(begin); i < end; ++i) {
+      AddTimeseries(series[i], &timeseries);
+      chunk->series.emplace_back(SeriesKey(series[i]), series[i].changed_at);
+    }
+    metric_write.Add("timeseries", timeseries);
+    chunk->body = metric_write.ToString();
+  }
 
-  const std::set<const Metric*> metrics(Registry::Instance()->GetMetrics());
-  JsonArray timeseries;
-  for (auto& m : metrics) {
-    CHECK_NOTNULL(m);
-    for (auto& p : m->CurrentValues()) {
-      JsonObject labels;
-      for (size_t i(0); i < p.first.size(); ++i) {
-        AddLabel(m->LabelName(i), p.first[i], &labels);
-      }
+  PushNextChunk();
+}
 
-      JsonObject desc;
-      desc.Add("labels", labels);
-      desc.Add("metric", kCloudPrefix + m->Name());
-
-      JsonObject ts;
-      ts.Add("timeseriesDesc", desc);
-
-      JsonObject point;
-      // According to
-      // https://cloud.google.com/monitoring/v2beta2/timeseries/write
-      // GAUGE types should have a zero size timerange here
-      // Which implies we need to use the current time rather than the time the
-      // value was set because there's a [short ~5m] horizon over which GCM
-      // won't accept samples.
-      const auto now(system_clock::now());
-      point.Add("start", RFC3339Time(now));
-      point.Add("end", RFC3339Time(now));
-      point.Add("doubleValue", p.second.second);
-      ts.Add("point", point);
-
-      timeseries.Add(&ts);
-    }
+
+void GCMExporter::PushNextChunk() {
+  if (task_.task()->CancelRequested()) {
+    chunks_.clear();
+    task_.task()->Return(util::Status::CANCELLED);
+    return;
+  }
+
+  if (chunks_.empty()) {
+    ScheduleNextPush();
+    return;
   }
-  metric_write.Add("timeseries", timeseries);
 
   UrlFetcher::Request req(
       (URL(FLAGS_google_compute_monitoring_base_url + "/timeseries:write")));
   req.verb = UrlFetcher::Verb::POST;
   req.headers.insert(make_pair("Content-Type", "application/json"));
   req.headers.insert(make_pair("Authorization", "Bearer " + bearer_token_));
-  req.body = metric_write.ToString();
+  VLOG(2) << chunks_.front().body;
+  if (FLAGS_google_compute_monitoring_gzip_requests) {
+    req.headers.insert(make_pair("Content-Encoding", "gzip"));
+    CHECK(Gzip(chunks_.front().body, &req.body));
+  } else {
+    req.body = chunks_.front().body;
+  }
 
   UrlFetcher::Response* resp(new UrlFetcher::Response);
-  VLOG(1) << "Pushing metrics...";
-  VLOG(2) << req.body;
   fetcher_->Fetch(req, resp,
                   task_.task()->AddChild(
                       bind(&GCMExporter::PushMetricsDone, this, resp, _1)));
@@ -311,12 +479,24 @@ void GCMExporter::PushMetricsDone(UrlFetcher::Response* resp, Task* task) {
     num_gcm_push_failures->Increment();
     LOG(WARNING) << "Failed to push metrics to GCM, status: " << task->status()
                  << ", reponse code: " << resp->status_code;
+    // The series not pushed yet will be in the next push, whether they
+    // change or not.
+    chunks_.clear();
   } else {
     VLOG(1) << "Metrics pushed.";
     VLOG(2) << resp->body;
+    for (const auto& series : chunks_.front().series) {
+      pushed_[series.first] = series.second;
+    }
+    chunks_.pop_front();
   }
 
-  executor_->Delay(
+  PushNextChunk();
+}
+
+
+void GCMExporter::ScheduleNextPush() {
+  pool_.Delay(
       seconds(FLAGS_google_compute_monitoring_push_interval_seconds),
       task_.task()->AddChild(bind(&GCMExporter::PushMetrics, this)));
 }
@@ -3,39 +3,74 @@
 
 #include <chrono>
 #include <condition_variable>
+#include <deque>
+#include <map>
 #include <memory>
+#include <string>
 #include <thread>
+#include <utility>
+#include <vector>
 
 #include "net/url_fetcher.h"
-#include "util/executor.h"
 #include "util/sync_task.h"
+#include "util/thread_pool.h"
+
+class JsonArray;
+class JsonObject;
 
 namespace cert_trans {
 
 
+// Pushes the metrics of the Registry to GCM periodically. Only the series
+// which changed since they were last pushed are sent, except every
+// --google_compute_monitoring_full_push_interval_seconds, and they are
+// split over as many requests as needed.
+//
+// The requests are built and their replies handled on a thread of its
+// own, so that a large push does not hold up other work.
 class GCMExporter {
  public:
-  GCMExporter(const std::string& instance_name, UrlFetcher* fetcher,
-              util::Executor* executor);
+  GCMExporter(const std::string& instance_name, UrlFetcher* fetcher);
   ~GCMExporter();
 
  private:
+  // One request of a push, and the series it holds with the time they
+  // last changed, to be remembered once it succeeds.
+  struct Chunk {
+    std::string body;
+    std::vector<std::pair<std::string, std::chrono::system_clock::time_point>>
+        series;
+  };
+
   void RefreshCredentials();
   void RefreshCredentialsDone(UrlFetcher::Response* resp, util::Task* task);
 
+  // Creates the descriptor of one metric, retrying until it succeeds.
+  void CreateMetric(const std::string& name, const std::string& help,
+                    const JsonArray& labels, const JsonObject& desc);
   void CreateMetrics();
 
   void PushMetrics();
+  // Sends the first of |chunks_|, or schedules the next push if there
+  // are none left.
+  void PushNextChunk();
   void PushMetricsDone(UrlFetcher::Response* resp, util::Task* task);
+  void ScheduleNextPush();
 
   const std::string instance_name_;
   UrlFetcher* const fetcher_;
-  util::Executor* const executor_;
+  ThreadPool pool_;
   util::SyncTask task_;
   bool metrics_created_;
   std::chrono::system_clock::time_point token_refreshed_at_;
   std::string bearer_token_;
 
+  // Only used by one push at a time, which are never concurrent.
+  std::deque<Chunk> chunks_;
+  // When each series (see SeriesKey()) that was pushed had last changed.
+  std::map<std::string, std::chrono::system_clock::time_point> pushed_;
+  std::chrono::steady_clock::time_point last_full_push_;
+
   friend class GCMExporterTest;
 };
 
@@ -3,9 +3,12 @@
 #include <glog/logging.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
+#include <zlib.h>
+#include <atomic>
 #include <memory>
 
 #include "monitoring/monitoring.h"
+#include "monitoring/registry.h"
 #include "net/mock_url_fetcher.h"
 #include "util/json_wrapper.h"
 #include "util/testing.h"
@@ -16,6 +19,9 @@ DECLARE_string(google_compute_monitoring_base_url);
 DECLARE_int32(google_compute_monitoring_push_interval_seconds);
 DECLARE_string(google_compute_monitoring_service_account);
 DECLARE_int32(google_compute_monitoring_retry_delay_seconds);
+DECLARE_int32(google_compute_monitoring_full_push_interval_seconds);
+DECLARE_int32(google_compute_monitoring_max_timeseries_per_request);
+DECLARE_bool(google_compute_monitoring_gzip_requests);
 
 namespace cert_trans {
 
@@ -49,6 +55,7 @@ using testing::InSequence;
 using testing::Invoke;
 using testing::InvokeWithoutArgs;
 using testing::IsEmpty;
+using testing::Not;
 using util::Status;
 using util::SyncTask;
 using util::Task;
@@ -72,6 +79,31 @@ void HandleFetch(Status status, int status_code,
 }
 
 
+string Gunzip(const string& data) {
+  z_stream stream;
+  stream.zalloc = Z_NULL;
+  stream.zfree = Z_NULL;
+  stream.opaque = Z_NULL;
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  stream.avail_in = data.size();
+  CHECK_EQ(Z_OK, inflateInit2(&stream, 15 + 16));
+
+  string ret;
+  char buf[4096];
+  int status;
+  do {
+    stream.next_out = reinterpret_cast<Bytef*>(buf);
+    stream.avail_out = sizeof(buf);
+    status = inflate(&stream, Z_NO_FLUSH);
+    CHECK(status == Z_OK || status == Z_STREAM_END) << status;
+    ret.append(buf, sizeof(buf) - stream.avail_out);
+  } while (status != Z_STREAM_END);
+  inflateEnd(&stream);
+
+  return ret;
+}
+
+
 }  // namespace
 
 
@@ -85,13 +117,45 @@ class GCMExporterTest : public ::testing::Test {
     FLAGS_google_compute_monitoring_push_interval_seconds = kPushInterval;
     FLAGS_google_compute_metadata_url = kMetadataUrl;
     FLAGS_google_compute_monitoring_service_account = kServiceAccount;
+    // Most tests expect every push to hold every series, as plain JSON.
+    FLAGS_google_compute_monitoring_full_push_interval_seconds = 0;
+    FLAGS_google_compute_monitoring_max_timeseries_per_request = 200;
+    FLAGS_google_compute_monitoring_gzip_requests = false;
 
     ON_CALL(fetcher_, Fetch(_, _, _))
         .WillByDefault(Invoke(bind(&HandleFetch, util::Status::OK, 200,
                                    UrlFetcher::Headers{}, "", _1, _2, _3)));
   }
 
+  void TearDown() {
+    Registry::Instance()->ResetForTestingOnly();
+  }
+
  protected:
+  void ExpectCredentialsAndMetricCreation() {
+    EXPECT_CALL(
+        fetcher_,
+        Fetch(IsUrlFetchRequest(
+                  UrlFetcher::Verb::GET,
+                  URL(string(kMetadataUrl) + "/" + kServiceAccount + "/token"),
+                  UrlFetcher::Headers{make_pair("Metadata-Flavor", "Google")},
+                  ""),
+              _, _))
+        .WillRepeatedly(
+            Invoke(bind(&HandleFetch, util::Status::OK, 200,
+                        UrlFetcher::Headers{}, kCredentialsJson, _1, _2, _3)));
+    EXPECT_CALL(fetcher_,
+                Fetch(IsUrlFetchRequest(
+                          UrlFetcher::Verb::POST, URL(string(metrics_url_)),
+                          UrlFetcher::Headers{
+                              make_pair("Content-Type", "application/json"),
+                              make_pair("Authorization", "Bearer token")},
+                          _),
+                      _, _))
+        .WillRepeatedly(Invoke(bind(&HandleFetch, util::Status::OK, 200,
+                                    UrlFetcher::Headers{}, "", _1, _2, _3)));
+  }
+
   string GetBearerToken(const GCMExporter& e) {
     return e.bearer_token_;
   }
@@ -150,7 +214,7 @@ TEST_F(GCMExporterTest, TestCredentials) {
                     _, _))
       .WillRepeatedly(Invoke(bind(&HandleFetch, util::Status::OK, 200,
                                   UrlFetcher::Headers{}, "", _1, _2, _3)));
-  GCMExporter exporter("instance", &fetcher_, &pool_);
+  GCMExporter exporter("instance", &fetcher_);
   while (!HasFetchedToken(exporter)) {
     sleep(1);
   }
@@ -228,7 +292,7 @@ TEST_F(GCMExporterTest, TestRetriesFetchingCredentials) {
                     _, _))
       .WillRepeatedly(Invoke(bind(&HandleFetch, util::Status::OK, 200,
                                   UrlFetcher::Headers{}, "", _1, _2, _3)));
-  GCMExporter exporter("instance", &fetcher_, &pool_);
+  GCMExporter exporter("instance", &fetcher_);
   while (!HasFetchedToken(exporter)) {
     sleep(1);
   }
@@ -290,7 +354,7 @@ TEST_F(GCMExporterTest, TestPushesMetrics) {
                         Invoke(bind(&HandleFetch, util::Status::OK, 200,
                                     UrlFetcher::Headers{}, "", _1, _2, _3))));
   }
-  GCMExporter exporter("instance", &fetcher_, &pool_);
+  GCMExporter exporter("instance", &fetcher_);
   sync.Wait();
 }
 
@@ -373,7 +437,78 @@ TEST_F(GCMExporterTest, TestRetriesWhenPushingMetricsFails) {
                         Invoke(bind(&HandleFetch, util::Status::OK, 200,
                                     UrlFetcher::Headers{}, "", _1, _2, _3))));
   }
-  GCMExporter exporter("instance", &fetcher_, &pool_);
+  GCMExporter exporter("instance", &fetcher_);
+  sync.Wait();
+}
+
+
+TEST_F(GCMExporterTest, TestPushesOnlyChangedSeries) {
+  FLAGS_google_compute_monitoring_full_push_interval_seconds = 3600;
+  std::unique_ptr<Counter<>> one(Counter<>::New("one", "help1"));
+  one->Increment();
+  std::unique_ptr<Gauge<>> two(Gauge<>::New("two", "help2"));
+  two->Set(2);
+
+  SyncTask sync(&pool_);
+  ExpectCredentialsAndMetricCreation();
+  {
+    InSequence s;
+    EXPECT_CALL(fetcher_,
+                Fetch(IsUrlFetchRequest(
+                          UrlFetcher::Verb::POST, URL(push_url_), _,
+                          AllOf(HasSubstr("ct/one"), HasSubstr("ct/two"))),
+                      _, _))
+        .WillOnce(DoAll(InvokeWithoutArgs([&one] { one->Increment(); }),
+                        Invoke(bind(&HandleFetch, util::Status::OK, 200,
+                                    UrlFetcher::Headers{}, "", _1, _2, _3))));
+    EXPECT_CALL(fetcher_,
+                Fetch(IsUrlFetchRequest(
+                          UrlFetcher::Verb::POST, URL(push_url_), _,
+                          AllOf(HasSubstr("ct/one"), Not(HasSubstr("ct/two")))),
+                      _, _))
+        .WillOnce(DoAll(InvokeWithoutArgs([&sync] { sync.task()->Return(); }),
+                        Invoke(bind(&HandleFetch, util::Status::OK, 200,
+                                    UrlFetcher::Headers{}, "", _1, _2, _3))));
+  }
+  GCMExporter exporter("instance", &fetcher_);
+  sync.Wait();
+}
+
+
+TEST_F(GCMExporterTest, TestSplitsAndCompressesPushes) {
+  FLAGS_google_compute_monitoring_max_timeseries_per_request = 1;
+  FLAGS_google_compute_monitoring_gzip_requests = true;
+  std::unique_ptr<Counter<>> one(Counter<>::New("one", "help1"));
+  one->Increment();
+  std::unique_ptr<Gauge<>> two(Gauge<>::New("two", "help2"));
+  two->Set(2);
+
+  SyncTask sync(&pool_);
+  std::atomic<int> num_pushes(0);
+  ExpectCredentialsAndMetricCreation();
+  EXPECT_CALL(fetcher_,
+              Fetch(IsUrlFetchRequest(
+                        UrlFetcher::Verb::POST, URL(push_url_),
+                        UrlFetcher::Headers{
+                            make_pair("Authorization", "Bearer token"),
+                            make_pair("Content-Encoding", "gzip"),
+                            make_pair("Content-Type", "application/json")},
+                        _),
+                    _, _))
+      .WillRepeatedly(Invoke([&sync, &num_pushes](
+          const UrlFetcher::Request& req, UrlFetcher::Response* resp,
+          Task* task) {
+        JsonObject request(Gunzip(req.body));
+        CHECK(request.Ok());
+        EXPECT_EQ(1, JsonArray(request, "timeseries").Length());
+        resp->status_code = 200;
+        task->Return();
+        // Each series went in a request of its own.
+        if (++num_pushes == 2) {
+          sync.task()->Return();
+        }
+      }));
+  GCMExporter exporter("instance", &fetcher_);
   sync.Wait();
 }
 
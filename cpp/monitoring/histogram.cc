@@ -0,0 +1,98 @@
+#include "monitoring/histogram.h"
+
+#include <algorithm>
+
+using std::lower_bound;
+using std::make_pair;
+using std::memory_order_relaxed;
+using std::vector;
+
+namespace cert_trans {
+
+
+double Metric::HistogramValue::Quantile(double q) const {
+  const double rank(q * count);
+  double lower(0);
+  uint64_t below(0);
+  for (const auto& bucket : buckets) {
+    if (bucket.second >= rank && bucket.second > below) {
+      return lower +
+             (bucket.first - lower) * (rank - below) /
+                 (bucket.second - below);
+    }
+    lower = bucket.first;
+    below = bucket.second;
+  }
+  // Either nothing was recorded, or |rank| is among the values above the
+  // last bound, which is then the best we can say about it.
+  return lower;
+}
+
+
+HistogramCell::HistogramCell() {
+  for (std::atomic<uint64_t>& bucket : buckets_) {
+    bucket.store(0, memory_order_relaxed);
+  }
+  sum_.store(0, memory_order_relaxed);
+}
+
+
+void HistogramCell::Record(double value) {
+  const vector<double>& bounds(BucketBounds());
+  // Values above the last bound land in the extra bucket at the end.
+  const int bucket(lower_bound(bounds.begin(), bounds.end(), value) -
+                   bounds.begin());
+  buckets_[bucket].fetch_add(1, memory_order_relaxed);
+
+  double old_sum(sum_.load(memory_order_relaxed));
+  // There is no fetch_add() for floating point types.
+  while (!sum_.compare_exchange_weak(old_sum, old_sum + value,
+                                     memory_order_relaxed)) {
+  }
+}
+
+
+Metric::HistogramValue HistogramCell::Get() const {
+  const vector<double>& bounds(BucketBounds());
+  uint64_t counts[kNumBuckets];
+  int last_used(-1);
+  for (int i = 0; i < kNumBuckets; ++i) {
+    counts[i] = buckets_[i].load(memory_order_relaxed);
+    if (counts[i] > 0) {
+      last_used = i;
+    }
+  }
+
+  // Only report the buckets up to the last one used, since most of the
+  // range is usually empty.
+  Metric::HistogramValue ret;
+  for (int i = 0; i <= last_used && i < kNumBuckets - 1; ++i) {
+    ret.count += counts[i];
+    ret.buckets.push_back(make_pair(bounds[i], ret.count));
+  }
+  ret.count += counts[kNumBuckets - 1];
+  ret.sum = sum_.load(memory_order_relaxed);
+  return ret;
+}
+
+
+// static
+const vector<double>& HistogramCell::BucketBounds() {
+  static const vector<double>* const bounds([]() {
+    vector<double>* const ret(new vector<double>);
+    ret->push_back(1);
+    double base(1);
+    for (int exponent = 0; exponent < kMaxExponent; ++exponent) {
+      for (int i = 1; i <= kSubBuckets; ++i) {
+        ret->push_back(base + base * i / kSubBuckets);
+      }
+      base *= 2;
+    }
+    CHECK_EQ(static_cast<size_t>(kNumBuckets - 1), ret->size());
+    return ret;
+  }());
+  return *bounds;
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,188 @@
+#ifndef CERT_TRANS_MONITORING_HISTOGRAM_H_
+#define CERT_TRANS_MONITORING_HISTOGRAM_H_
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "base/macros.h"
+#include "monitoring/labelled_values.h"
+#include "monitoring/metric.h"
+
+namespace cert_trans {
+
+
+// The values recorded by a histogram for one combination of labels,
+// counted in fixed log-linear buckets: everything up to 1, then four
+// equal-width buckets per power of two up to 2^30, and one more for
+// anything larger. This keeps the error of a quantile estimate under
+// 25%, whatever the unit of the values.
+//
+// Recording a value takes no lock.
+class HistogramCell {
+ public:
+  HistogramCell();
+
+  void Record(double value);
+
+  // Returns the recorded values, with a default |timestamp|.
+  Metric::HistogramValue Get() const;
+
+  // The inclusive upper bounds of all but the last bucket, in increasing
+  // order.
+  static const std::vector<double>& BucketBounds();
+
+ private:
+  static const int kSubBuckets = 4;
+  static const int kMaxExponent = 30;
+  static const int kNumBuckets = kSubBuckets * kMaxExponent + 2;
+
+  std::atomic<uint64_t> buckets_[kNumBuckets];
+  std::atomic<double> sum_;
+
+  DISALLOW_COPY_AND_ASSIGN(HistogramCell);
+};
+
+
+// A metric recording the distribution of some values (e.g. request
+// latencies), so that quantiles can be computed from it.
+template <class... LabelTypes>
+class Histogram : public Metric {
+ public:
+  // A handle on the values for one combination of labels, for callers
+  // recording often.
+  typedef HistogramCell Cell;
+
+  static Histogram<LabelTypes...>* New(
+      const std::string& name,
+      const typename NameType<LabelTypes>::name&... label_names,
+      const std::string& help);
+
+  void Record(const LabelTypes&... labels, double value);
+
+  HistogramValue Get(const LabelTypes&... labels) const;
+
+  // Returns the handle for |labels|, creating it if needed. It stays
+  // valid for as long as this metric.
+  Cell* Bind(const LabelTypes&... labels);
+
+  // Visits the number of values recorded for each combination of labels.
+  void VisitValues(const ValueCallback& callback) const override;
+
+  // As with LabelledValues, the time reported for each histogram is the
+  // first time it was seen to have changed.
+  void VisitHistogramValues(const HistogramCallback& callback) const override;
+
+ private:
+  struct Entry {
+    Entry()
+        : exported_count(0), changed_at(std::chrono::system_clock::now()) {
+    }
+
+    Cell cell;
+    // Guarded by |mutex_|.
+    uint64_t exported_count;
+    std::chrono::system_clock::time_point changed_at;
+  };
+
+  Histogram(const std::string& name,
+            const typename NameType<LabelTypes>::name&... label_names,
+            const std::string& help);
+
+  mutable std::mutex mutex_;
+  std::map<std::tuple<LabelTypes...>, std::unique_ptr<Entry>> values_;
+
+  DISALLOW_COPY_AND_ASSIGN(Histogram);
+};
+
+
+// static
+template <class... LabelTypes>
+Histogram<LabelTypes...>* Histogram<LabelTypes...>::New(
+    const std::string& name,
+    const typename NameType<LabelTypes>::name&... label_names,
+    const std::string& help) {
+  return new Histogram(name, label_names..., help);
+}
+
+
+template <class... LabelTypes>
+Histogram<LabelTypes...>::Histogram(
+    const std::string& name,
+    const typename NameType<LabelTypes>::name&... label_names,
+    const std::string& help)
+    : Metric(HISTOGRAM, name, {label_names...}, help) {
+}
+
+
+template <class... LabelTypes>
+void Histogram<LabelTypes...>::Record(const LabelTypes&... labels,
+                                      double value) {
+  Bind(labels...)->Record(value);
+}
+
+
+template <class... LabelTypes>
+Metric::HistogramValue Histogram<LabelTypes...>::Get(
+    const LabelTypes&... labels) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it(values_.find(std::tuple<LabelTypes...>(labels...)));
+  if (it == values_.end()) {
+    return HistogramValue();
+  }
+  return it->second->cell.Get();
+}
+
+
+template <class... LabelTypes>
+typename Histogram<LabelTypes...>::Cell* Histogram<LabelTypes...>::Bind(
+    const LabelTypes&... labels) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::unique_ptr<Entry>& entry(
+      values_[std::tuple<LabelTypes...>(labels...)]);
+  if (!entry) {
+    entry.reset(new Entry);
+  }
+  return &entry->cell;
+}
+
+
+template <class... LabelTypes>
+void Histogram<LabelTypes...>::VisitValues(
+    const ValueCallback& callback) const {
+  VisitHistogramValues([&callback](const std::vector<std::string>& labels,
+                                   const HistogramValue& value) {
+    callback(labels, TimestampedValue(value.timestamp, value.count));
+  });
+}
+
+
+template <class... LabelTypes>
+void Histogram<LabelTypes...>::VisitHistogramValues(
+    const HistogramCallback& callback) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<std::string> labels;
+
+  for (const auto& v : values_) {
+    Entry* const entry(v.second.get());
+    HistogramValue value(entry->cell.Get());
+    if (value.count != entry->exported_count) {
+      entry->exported_count = value.count;
+      entry->changed_at = std::chrono::system_clock::now();
+    }
+    value.timestamp = entry->changed_at;
+    labels.clear();
+    label_values(v.first, &labels, i__<sizeof...(LabelTypes)>());
+    callback(labels, value);
+  }
+}
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_MONITORING_HISTOGRAM_H_
@@ -0,0 +1,164 @@
+#include "monitoring/monitoring.h"
+
+#include <glog/logging.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <thread>
+
+#include "monitoring/latency.h"
+#include "util/testing.h"
+
+namespace cert_trans {
+
+using std::chrono::milliseconds;
+using std::pair;
+using std::string;
+using std::thread;
+using std::vector;
+using testing::ElementsAre;
+
+typedef pair<double, uint64_t> Bucket;
+
+class HistogramTest : public ::testing::Test {
+ public:
+  void TearDown() {
+    Registry::Instance()->ResetForTestingOnly();
+  }
+
+ protected:
+  const vector<string>& GetLabelNames(const Metric& m) {
+    return m.LabelNames();
+  }
+};
+
+
+TEST_F(HistogramTest, TestHistogramLabelNames) {
+  std::unique_ptr<Histogram<string, int>> histogram(
+      Histogram<string, int>::New("name", "one", "two", "help"));
+  EXPECT_EQ(Metric::HISTOGRAM, histogram->Type());
+  EXPECT_THAT(GetLabelNames(*histogram), ElementsAre("one", "two"));
+}
+
+
+TEST_F(HistogramTest, TestEmpty) {
+  std::unique_ptr<Histogram<>> histogram(Histogram<>::New("name", "help"));
+  const Metric::HistogramValue value(histogram->Get());
+  EXPECT_EQ(0U, value.count);
+  EXPECT_EQ(0, value.sum);
+  EXPECT_TRUE(value.buckets.empty());
+  EXPECT_EQ(0, value.Quantile(0.99));
+}
+
+
+TEST_F(HistogramTest, TestBuckets) {
+  std::unique_ptr<Histogram<>> histogram(Histogram<>::New("name", "help"));
+  histogram->Record(0.5);
+  histogram->Record(1);
+  histogram->Record(1.1);
+  histogram->Record(3);
+  const Metric::HistogramValue value(histogram->Get());
+  EXPECT_EQ(4U, value.count);
+  EXPECT_DOUBLE_EQ(5.6, value.sum);
+  // Bounds are inclusive, and no buckets past the last value are reported.
+  EXPECT_THAT(value.buckets,
+              ElementsAre(Bucket(1, 2), Bucket(1.25, 3), Bucket(1.5, 3),
+                          Bucket(1.75, 3), Bucket(2, 3), Bucket(2.5, 3),
+                          Bucket(3, 4)));
+}
+
+
+TEST_F(HistogramTest, TestQuantile) {
+  std::unique_ptr<Histogram<>> histogram(Histogram<>::New("name", "help"));
+  for (int i = 1; i <= 1000; ++i) {
+    histogram->Record(i);
+  }
+  const Metric::HistogramValue value(histogram->Get());
+  EXPECT_NEAR(500, value.Quantile(0.5), 500 * 0.25);
+  EXPECT_NEAR(990, value.Quantile(0.99), 990 * 0.25);
+  EXPECT_NEAR(999, value.Quantile(0.999), 999 * 0.25);
+  EXPECT_GE(1024, value.Quantile(1));
+}
+
+
+TEST_F(HistogramTest, TestOverflow) {
+  std::unique_ptr<Histogram<>> histogram(Histogram<>::New("name", "help"));
+  histogram->Record(1e12);
+  const Metric::HistogramValue value(histogram->Get());
+  EXPECT_EQ(1U, value.count);
+  EXPECT_EQ(HistogramCell::BucketBounds().size(), value.buckets.size());
+  EXPECT_EQ(0U, value.buckets.back().second);
+  EXPECT_EQ(value.buckets.back().first, value.Quantile(0.5));
+}
+
+
+TEST_F(HistogramTest, TestBoundAndLabels) {
+  std::unique_ptr<Histogram<string>> histogram(
+      Histogram<string>::New("name", "a string", "help"));
+  Histogram<string>::Cell* const cell(histogram->Bind("alpha"));
+  cell->Record(5);
+  histogram->Record("alpha", 7);
+  histogram->Record("beta", 1);
+  EXPECT_EQ(2U, histogram->Get("alpha").count);
+  EXPECT_EQ(12, histogram->Get("alpha").sum);
+  EXPECT_EQ(1U, histogram->Get("beta").count);
+
+  const auto values(histogram->CurrentHistogramValues());
+  ASSERT_EQ(1U, values.count(vector<string>{"alpha"}));
+  EXPECT_EQ(2U, values.at(vector<string>{"alpha"}).count);
+  EXPECT_EQ(2, histogram->CurrentValues()[vector<string>{"alpha"}].second);
+}
+
+
+TEST_F(HistogramTest, TestConcurrentRecords) {
+  std::unique_ptr<Histogram<>> histogram(Histogram<>::New("name", "help"));
+  Histogram<>::Cell* const cell(histogram->Bind());
+  const int kNumThreads(8);
+  const int kRecordsPerThread(10000);
+  vector<thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([cell, kRecordsPerThread]() {
+      for (int j = 0; j < kRecordsPerThread; ++j) {
+        cell->Record(2);
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  const Metric::HistogramValue value(histogram->Get());
+  EXPECT_EQ(static_cast<uint64_t>(kNumThreads * kRecordsPerThread),
+            value.count);
+  EXPECT_EQ(2.0 * kNumThreads * kRecordsPerThread, value.sum);
+}
+
+
+TEST_F(HistogramTest, TestScopedLatency) {
+  Latency<milliseconds, string> latency("latency", "op", "help");
+  {
+    ScopedLatency scoped(latency.GetScopedLatency("op"));
+    // Moving it should still only record one measurement.
+    ScopedLatency moved(std::move(scoped));
+  }
+  latency.RecordLatency("op", milliseconds(5));
+
+  for (const Metric* m : Registry::Instance()->GetMetrics()) {
+    if (m->Name() == "latency") {
+      const auto values(m->CurrentHistogramValues());
+      ASSERT_EQ(1U, values.count(vector<string>{"op"}));
+      EXPECT_EQ(2U, values.at(vector<string>{"op"}).count);
+      EXPECT_LE(5, values.at(vector<string>{"op"}).sum);
+      return;
+    }
+  }
+  FAIL() << "Couldn't find the latency metric";
+}
+
+
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,34 @@
+#include "config.h"
+#include "monitoring/labelled_values.h"
+
+#include <atomic>
+
+namespace cert_trans {
+namespace internal {
+namespace {
+
+
+std::atomic<int> next_thread_index(0);
+
+#ifdef HAVE_THREAD_LOCAL
+thread_local int thread_index = -1;
+#elif HAVE___THREAD
+__thread int thread_index = -1;
+#else
+#error No suitable thread local storage available
+#endif
+
+
+}  // namespace
+
+
+int ThreadIndex() {
+  if (thread_index < 0) {
+    thread_index = next_thread_index++;
+  }
+  return thread_index;
+}
+
+
+}  // namespace internal
+}  // namespace cert_trans
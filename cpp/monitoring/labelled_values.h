@@ -2,8 +2,10 @@
 #define CERT_TRANS_MONITORING_LABELLED_VALUES_H_
 
 #include <glog/logging.h>
+#include <atomic>
 #include <chrono>
 #include <map>
+#include <memory>
 #include <mutex>
 
 #include "monitoring/metric.h"
@@ -14,6 +16,49 @@ namespace cert_trans {
 template <class... LabelTypes>
 class LabelledValues {
  public:
+  // The value for one combination of labels. Updating it through a
+  // Cell takes no lock: each thread adds to one of several atomic
+  // shards, which are only summed up when the value is read.
+  //
+  // Cells are never destroyed before their LabelledValues, so
+  // callers can look one up once with Bind() and keep it.
+  class Cell {
+   public:
+    Cell();
+
+    double Get() const;
+
+    // Concurrent increments of the same cell may be lost to a Set(),
+    // which is fine for the gauges using it.
+    void Set(double value);
+
+    void Increment() {
+      IncrementBy(1);
+    }
+
+    void IncrementBy(double amount);
+
+   private:
+    static const int kNumShards = 16;
+
+    // Padded to its own cache line, so that threads adding to
+    // different shards do not contend.
+    struct Shard {
+      std::atomic<double> value;
+      char padding[64 - sizeof(std::atomic<double>)];
+    };
+
+    Shard shards_[kNumShards];
+
+    // The value, and when it changed, as of the last VisitValues().
+    // Guarded by the |mutex_| of the owning LabelledValues.
+    friend class LabelledValues;
+    double exported_value_;
+    std::chrono::system_clock::time_point changed_at_;
+
+    DISALLOW_COPY_AND_ASSIGN(Cell);
+  };
+
   LabelledValues(const std::string& name,
                  const typename NameType<LabelTypes>::name&... label_names);
 
@@ -25,15 +70,19 @@ class LabelledValues {
 
   void IncrementBy(const LabelTypes&..., double value);
 
-  std::map<std::vector<std::string>, Metric::TimestampedValue> CurrentValues()
-      const;
+  // Returns the cell for |labels|, creating it if needed.
+  Cell* Bind(const LabelTypes&... labels);
+
+  // The time reported for each value is the first time it was seen
+  // to have changed, rather than the time of the update itself, which
+  // would have to be taken on every update.
+  void VisitValues(const Metric::ValueCallback& callback) const;
 
  private:
   const std::string name_;
   const std::vector<std::string> label_names_;
   mutable std::mutex mutex_;
-  std::map<std::tuple<LabelTypes...>,
-           std::pair<std::chrono::system_clock::time_point, double>> values_;
+  std::map<std::tuple<LabelTypes...>, std::unique_ptr<Cell>> values_;
 
   DISALLOW_COPY_AND_ASSIGN(LabelledValues);
 };
@@ -71,6 +120,57 @@ std::vector<std::string> label_values(const std::tuple<Types...>& t) {
 }  // namespace
 
 
+namespace internal {
+
+
+// A number for the current thread, given out in turn, to spread the
+// threads over the shards of the cells.
+int ThreadIndex();
+
+
+}  // namespace internal
+
+
+template <class... LabelTypes>
+LabelledValues<LabelTypes...>::Cell::Cell()
+    : exported_value_(0), changed_at_(std::chrono::system_clock::now()) {
+  for (Shard& shard : shards_) {
+    shard.value.store(0, std::memory_order_relaxed);
+  }
+}
+
+
+template <class... LabelTypes>
+double LabelledValues<LabelTypes...>::Cell::Get() const {
+  double ret(0);
+  for (const Shard& shard : shards_) {
+    ret += shard.value.load(std::memory_order_relaxed);
+  }
+  return ret;
+}
+
+
+template <class... LabelTypes>
+void LabelledValues<LabelTypes...>::Cell::Set(double value) {
+  shards_[0].value.store(value, std::memory_order_relaxed);
+  for (int i = 1; i < kNumShards; ++i) {
+    shards_[i].value.store(0, std::memory_order_relaxed);
+  }
+}
+
+
+template <class... LabelTypes>
+void LabelledValues<LabelTypes...>::Cell::IncrementBy(double amount) {
+  std::atomic<double>& value(
+      shards_[internal::ThreadIndex() % kNumShards].value);
+  double old_value(value.load(std::memory_order_relaxed));
+  // There is no fetch_add() for floating point types.
+  while (!value.compare_exchange_weak(old_value, old_value + amount,
+                                      std::memory_order_relaxed)) {
+  }
+}
+
+
 template <class... LabelTypes>
 LabelledValues<LabelTypes...>::LabelledValues(
     const std::string& name,
@@ -87,16 +187,14 @@ double LabelledValues<LabelTypes...>::Get(const LabelTypes&... labels) const {
   if (it == values_.end()) {
     return 0;
   }
-  return it->second.second;
+  return it->second->Get();
 }
 
 
 template <class... LabelTypes>
 void LabelledValues<LabelTypes...>::Set(const LabelTypes&... labels,
                                         double value) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  values_[std::tuple<LabelTypes...>(labels...)] =
-      make_pair(std::chrono::system_clock::now(), value);
+  Bind(labels...)->Set(value);
 }
 
 
@@ -109,28 +207,39 @@ void LabelledValues<LabelTypes...>::Increment(const LabelTypes&... labels) {
 template <class... LabelTypes>
 void LabelledValues<LabelTypes...>::IncrementBy(const LabelTypes&... labels,
                                                 double amount) {
+  Bind(labels...)->IncrementBy(amount);
+}
+
+
+template <class... LabelTypes>
+typename LabelledValues<LabelTypes...>::Cell*
+LabelledValues<LabelTypes...>::Bind(const LabelTypes&... labels) {
   std::lock_guard<std::mutex> lock(mutex_);
-  const std::tuple<LabelTypes...> key(labels...);
-  const auto it(values_.find(key));
-  if (it == values_.end()) {
-    values_[key] = make_pair(std::chrono::system_clock::now(), amount);
-    return;
+  std::unique_ptr<Cell>& cell(values_[std::tuple<LabelTypes...>(labels...)]);
+  if (!cell) {
+    cell.reset(new Cell);
   }
-  values_[key] = make_pair(std::chrono::system_clock::now(),
-                           values_[key].second + amount);
+  return cell.get();
 }
 
 
 template <class... LabelTypes>
-std::map<std::vector<std::string>, Metric::TimestampedValue>
-LabelledValues<LabelTypes...>::CurrentValues() const {
+void LabelledValues<LabelTypes...>::VisitValues(
+    const Metric::ValueCallback& callback) const {
   std::lock_guard<std::mutex> lock(mutex_);
-  std::map<std::vector<std::string>, Metric::TimestampedValue> ret;
+  std::vector<std::string> labels;
 
   for (const auto& v : values_) {
-    ret[label_values(v.first)] = v.second;
+    Cell* const cell(v.second.get());
+    const double value(cell->Get());
+    if (value != cell->exported_value_) {
+      cell->exported_value_ = value;
+      cell->changed_at_ = std::chrono::system_clock::now();
+    }
+    labels.clear();
+    label_values(v.first, &labels, i__<sizeof...(LabelTypes)>());
+    callback(labels, make_pair(cell->changed_at_, value));
   }
-  return ret;
 }
 
 
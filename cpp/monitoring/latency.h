@@ -1,12 +1,14 @@
 #ifndef CERT_TRANS_MONITORING_LATENCY_H_
 #define CERT_TRANS_MONITORING_LATENCY_H_
 
+#include <chrono>
+#include <memory>
 #include <string>
 
 #include "base/macros.h"
-#include "monitoring/counter.h"
-#include "monitoring/event_metric.h"
+#include "monitoring/histogram.h"
 #include "monitoring/monitoring.h"
+#include "monitoring/trace.h"
 
 namespace cert_trans {
 
@@ -14,10 +16,11 @@ class ScopedLatency;
 
 
 // A helper class for monitoring latency.
-// This class creates two Counter metrics, one called "|base_name|_overall_sum"
-// which contains the sum of all latencies broken down by labels, and another
-// called "|base_name|_count" which contains the number of latency measurements
-// taken, also broken down by labels.
+// This class creates a Histogram metric called "|base_name|", which contains
+// the distribution of latencies broken down by labels. Along with the buckets,
+// it is exported with the sum and the number of the latency measurements
+// taken, as "|base_name|_sum" and "|base_name|_count" by Prometheus, and as
+// "|base_name|_overall_sum" and "|base_name|_count" by GCM.
 //
 // To actually measure latency, you can either call RecordLatency() directly
 // with a latency sample, or use the ScopedLatency() method to return an object
@@ -26,9 +29,9 @@ class ScopedLatency;
 // returned object.
 //
 // The |TimeUnit| template parameter is used to specify the unit of the values
-// added to the counter, e.g. specifying std::chrono::milliseconds will
-// duration_cast all recorded latencies to milliseconds before adding to the
-// total count.
+// recorded in the histogram, e.g. specifying std::chrono::milliseconds will
+// duration_cast all recorded latencies to milliseconds before recording
+// them.
 //
 // |LabelTypes...| works as in the Counter<> and Gauge<> templates.
 //
@@ -66,7 +69,9 @@ class Latency {
   ScopedLatency GetScopedLatency(const LabelTypes&... labels);
 
  private:
-  EventMetric<LabelTypes...> metric_;
+  static double ToTimeUnit(std::chrono::duration<double> latency);
+
+  const std::unique_ptr<Histogram<LabelTypes...>> metric_;
 
   DISALLOW_COPY_AND_ASSIGN(Latency);
 };
@@ -75,23 +80,40 @@ class Latency {
 // Helper class to automatically calculate and record latency.
 // Measures the duration between its construction and destruction times, and
 // automatically registers that with the Latency<> class which created it.
+// The labels are looked up when it is created, so that recording the latency
+// takes no lock.
+// If the thread is in a trace, this also records a span named after the
+// Latency<>, tagged with the labels.
 class ScopedLatency {
  public:
-  ScopedLatency(ScopedLatency&& other) = default;
+  ScopedLatency(ScopedLatency&& other)
+      : cell_(other.cell_),
+        to_time_unit_(other.to_time_unit_),
+        start_(other.start_),
+        span_(std::move(other.span_)) {
+    other.cell_ = nullptr;
+  }
 
   ~ScopedLatency() {
-    record_latency_(std::chrono::steady_clock::now() - start_);
+    if (cell_) {
+      cell_->Record(to_time_unit_(std::chrono::steady_clock::now() - start_));
+    }
   }
 
  private:
-  ScopedLatency(
-      const std::function<void(std::chrono::duration<double>)>& record_latency)
-      : record_latency_(record_latency),
-        start_(std::chrono::steady_clock::now()) {
+  ScopedLatency(HistogramCell* cell,
+                double (*to_time_unit)(std::chrono::duration<double>),
+                ScopedSpan&& span)
+      : cell_(cell),
+        to_time_unit_(to_time_unit),
+        start_(std::chrono::steady_clock::now()),
+        span_(std::move(span)) {
   }
 
-  const std::function<void(std::chrono::duration<double>)> record_latency_;
+  HistogramCell* cell_;
+  double (*const to_time_unit_)(std::chrono::duration<double>);
   const std::chrono::steady_clock::time_point start_;
+  ScopedSpan span_;
 
   template <class TimeUnit, class... LabelTypes>
   friend class Latency;
@@ -105,24 +127,39 @@ Latency<TimeUnit, LabelTypes...>::Latency(
     const std::string& base_name,
     const typename NameType<LabelTypes>::name&... label_names,
     const std::string& help)
-    : metric_(base_name, label_names..., help) {
+    : metric_(
+          Histogram<LabelTypes...>::New(base_name, label_names..., help)) {
 }
 
 
 template <class TimeUnit, class... LabelTypes>
 void Latency<TimeUnit, LabelTypes...>::RecordLatency(
     const LabelTypes&... labels, std::chrono::duration<double> latency) {
-  metric_.RecordEvent(labels...,
-                      std::chrono::duration_cast<TimeUnit>(latency).count());
+  metric_->Record(labels..., ToTimeUnit(latency));
 }
 
 
 template <class TimeUnit, class... LabelTypes>
 ScopedLatency Latency<TimeUnit, LabelTypes...>::GetScopedLatency(
     const LabelTypes&... labels) {
-  return cert_trans::ScopedLatency(
-      std::bind(&Latency<TimeUnit, LabelTypes...>::RecordLatency, this,
-                labels..., std::placeholders::_1));
+  ScopedSpan span(metric_->Name());
+  if (span.sampled()) {
+    const std::vector<std::string> values(
+        label_values(std::make_tuple(labels...)));
+    for (size_t i = 0; i < values.size(); ++i) {
+      span.AddTag(metric_->LabelName(i), values[i]);
+    }
+  }
+  return cert_trans::ScopedLatency(metric_->Bind(labels...), &ToTimeUnit,
+                                   std::move(span));
+}
+
+
+// static
+template <class TimeUnit, class... LabelTypes>
+double Latency<TimeUnit, LabelTypes...>::ToTimeUnit(
+    std::chrono::duration<double> latency) {
+  return std::chrono::duration_cast<TimeUnit>(latency).count();
 }
 
 
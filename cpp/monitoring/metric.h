@@ -1,6 +1,9 @@
 #ifndef CERT_TRANS_MONITORING_METRIC_H_
 #define CERT_TRANS_MONITORING_METRIC_H_
 
+#include <chrono>
+#include <cstdint>
+#include <functional>
 #include <map>
 #include <ostream>
 #include <set>
@@ -27,9 +30,29 @@ class Metric {
   typedef std::pair<std::chrono::system_clock::time_point, double>
       TimestampedValue;
 
+  // The distribution of the values recorded by a histogram for one
+  // combination of labels.
+  struct HistogramValue {
+    HistogramValue() : count(0), sum(0) {
+    }
+
+    // Estimates the |q|'th quantile (0 <= q <= 1) of the recorded values,
+    // by interpolating within the bucket it falls in.
+    double Quantile(double q) const;
+
+    std::chrono::system_clock::time_point timestamp;
+    uint64_t count;
+    double sum;
+    // Pairs of (inclusive upper bound, number of values at or below it), in
+    // increasing order of upper bound. Values above the last bound are only
+    // included in |count|.
+    std::vector<std::pair<double, uint64_t>> buckets;
+  };
+
   enum Type {
     COUNTER,
     GAUGE,
+    HISTOGRAM,
   };
 
   Type Type() const {
@@ -61,10 +84,44 @@ class Metric {
     return name_ < rhs.name_;
   }
 
-  // TODO(alcutter): Not over the moon about having this here, but it'll do for
-  // now.
-  virtual std::map<std::vector<std::string>, TimestampedValue> CurrentValues()
-      const = 0;
+  // Calls |callback| with the label values and the value of each
+  // combination of labels this metric has. For HISTOGRAM metrics, the
+  // value is the number of values recorded.
+  // The metric is locked for the duration, so |callback| must not update
+  // it, and |label_values| are only valid during the call.
+  typedef std::function<void(const std::vector<std::string>& label_values,
+                             const TimestampedValue& value)>
+      ValueCallback;
+  virtual void VisitValues(const ValueCallback& callback) const = 0;
+
+  // As VisitValues(), but with the distribution of the values of HISTOGRAM
+  // metrics. Other metrics do not call |callback| at all.
+  typedef std::function<void(const std::vector<std::string>& label_values,
+                             const HistogramValue& value)>
+      HistogramCallback;
+  virtual void VisitHistogramValues(const HistogramCallback& callback) const {
+  }
+
+  // Returns a copy of what VisitValues() would go through.
+  std::map<std::vector<std::string>, TimestampedValue> CurrentValues() const {
+    std::map<std::vector<std::string>, TimestampedValue> ret;
+    VisitValues([&ret](const std::vector<std::string>& label_values,
+                       const TimestampedValue& value) {
+      ret[label_values] = value;
+    });
+    return ret;
+  }
+
+  // Returns a copy of what VisitHistogramValues() would go through.
+  std::map<std::vector<std::string>, HistogramValue> CurrentHistogramValues()
+      const {
+    std::map<std::vector<std::string>, HistogramValue> ret;
+    VisitHistogramValues([&ret](const std::vector<std::string>& label_values,
+                                const HistogramValue& value) {
+      ret[label_values] = value;
+    });
+    return ret;
+  }
 
  protected:
   Metric(enum Type type, const std::string& name,
@@ -83,6 +140,7 @@ class Metric {
 
   friend class CounterTest;
   friend class GaugeTest;
+  friend class HistogramTest;
 
   DISALLOW_COPY_AND_ASSIGN(Metric);
 };
@@ -1,4 +1,10 @@
 #include "monitoring/prometheus/exporter.h"
+
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <sstream>
+
 #include "monitoring/metric.h"
 #include "monitoring/prometheus/metrics.pb.h"
 #include "monitoring/registry.h"
@@ -26,6 +32,35 @@ void AddLabelTypes(::io::prometheus::client::Metric* metric,
 }
 
 
+void PopulateHistograms(const Metric& metric,
+                        ::io::prometheus::client::MetricFamily* family) {
+  CHECK_NOTNULL(family);
+  const vector<string>& label_names(metric.LabelNames());
+  metric.VisitHistogramValues([family, &label_names](
+      const vector<string>& label_values,
+      const Metric::HistogramValue& value) {
+    io::prometheus::client::Metric* m(family->add_metric());
+    AddLabelTypes(m, label_names, label_values);
+    m->set_timestamp_ms(
+        duration_cast<milliseconds>(value.timestamp.time_since_epoch())
+            .count());
+    io::prometheus::client::Histogram* const histogram(
+        m->mutable_histogram());
+    histogram->set_sample_count(value.count);
+    histogram->set_sample_sum(value.sum);
+    for (const auto& b : value.buckets) {
+      io::prometheus::client::Bucket* const bucket(histogram->add_bucket());
+      bucket->set_upper_bound(b.first);
+      bucket->set_cumulative_count(b.second);
+    }
+    // The +Inf bucket holds everything.
+    io::prometheus::client::Bucket* const bucket(histogram->add_bucket());
+    bucket->set_upper_bound(std::numeric_limits<double>::infinity());
+    bucket->set_cumulative_count(value.count);
+  });
+}
+
+
 ::io::prometheus::client::MetricFamily PopulateMetricFamily(
     const Metric& metric) {
   ::io::prometheus::client::MetricFamily family;
@@ -38,34 +73,164 @@ void AddLabelTypes(::io::prometheus::client::Metric* metric,
     case Metric::GAUGE:
       family.set_type(io::prometheus::client::MetricType::GAUGE);
       break;
+    case Metric::HISTOGRAM:
+      family.set_type(io::prometheus::client::MetricType::HISTOGRAM);
+      PopulateHistograms(metric, &family);
+      return family;
     default:
       LOG(FATAL) << "Unknown metric type: " << metric.Type();
   }
-  const map<vector<string>, Metric::TimestampedValue> values(
-      metric.CurrentValues());
-  const vector<string> label_names(metric.LabelNames());
-  for (auto it(values.begin()); it != values.end(); ++it) {
+  const vector<string>& label_names(metric.LabelNames());
+  metric.VisitValues([&metric, &family, &label_names](
+      const vector<string>& label_values,
+      const Metric::TimestampedValue& value) {
     io::prometheus::client::Metric* m(family.add_metric());
-    AddLabelTypes(m, label_names, it->first);
+    AddLabelTypes(m, label_names, label_values);
     m->set_timestamp_ms(
-        duration_cast<milliseconds>(it->second.first.time_since_epoch())
-            .count());
+        duration_cast<milliseconds>(value.first.time_since_epoch()).count());
     switch (metric.Type()) {
       case Metric::COUNTER:
-        m->mutable_counter()->set_value(it->second.second);
+        m->mutable_counter()->set_value(value.second);
         break;
       case Metric::GAUGE:
-        m->mutable_gauge()->set_value(it->second.second);
+        m->mutable_gauge()->set_value(value.second);
         break;
       default:
         LOG(FATAL) << "Unknown metric type: " << metric.Type();
     }
-  }
+  });
 
   return family;
 }
 
 
+// Writes |value| with the escaping the text format wants for help strings
+// or, if |in_quotes|, for label values.
+void WriteEscaped(const string& value, bool in_quotes, std::ostream* os) {
+  for (const char c : value) {
+    switch (c) {
+      case '\\':
+        *os << "\\\\";
+        break;
+      case '\n':
+        *os << "\\n";
+        break;
+      case '"':
+        *os << (in_quotes ? "\\\"" : "\"");
+        break;
+      default:
+        *os << c;
+    }
+  }
+}
+
+
+void WriteDouble(double value, std::ostream* os) {
+  if (std::isnan(value)) {
+    *os << "NaN";
+  } else if (std::isinf(value)) {
+    *os << (value > 0 ? "+Inf" : "-Inf");
+  } else {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.17g", value);
+    *os << buf;
+  }
+}
+
+
+// Writes the name of a sample with its labels, plus an extra label if
+// |extra_name| is not empty, e.g.: name{a="1",b="2"}
+void WriteSampleName(const string& name, const vector<string>& label_names,
+                     const vector<string>& label_values,
+                     const string& extra_name, const string& extra_value,
+                     std::ostream* os) {
+  CHECK_EQ(label_names.size(), label_values.size());
+  *os << name;
+  if (label_names.empty() && extra_name.empty()) {
+    return;
+  }
+  *os << '{';
+  for (size_t i(0); i < label_names.size(); ++i) {
+    if (i > 0) {
+      *os << ',';
+    }
+    *os << label_names[i] << "=\"";
+    WriteEscaped(label_values[i], true /* in_quotes */, os);
+    *os << '"';
+  }
+  if (!extra_name.empty()) {
+    if (!label_names.empty()) {
+      *os << ',';
+    }
+    *os << extra_name << "=\"" << extra_value << '"';
+  }
+  *os << '}';
+}
+
+
+void WriteSample(double value,
+                 const std::chrono::system_clock::time_point& timestamp,
+                 std::ostream* os) {
+  *os << ' ';
+  WriteDouble(value, os);
+  *os << ' '
+      << duration_cast<milliseconds>(timestamp.time_since_epoch()).count()
+      << '\n';
+}
+
+
+void WriteTextFamily(const Metric& metric, std::ostream* os) {
+  *os << "# HELP " << metric.Name() << ' ';
+  WriteEscaped(metric.Help(), false /* in_quotes */, os);
+  *os << "\n# TYPE " << metric.Name() << ' ';
+  switch (metric.Type()) {
+    case Metric::COUNTER:
+      *os << "counter\n";
+      break;
+    case Metric::GAUGE:
+      *os << "gauge\n";
+      break;
+    case Metric::HISTOGRAM:
+      *os << "histogram\n";
+      break;
+    default:
+      LOG(FATAL) << "Unknown metric type: " << metric.Type();
+  }
+
+  const string& name(metric.Name());
+  const vector<string>& label_names(metric.LabelNames());
+  if (metric.Type() != Metric::HISTOGRAM) {
+    metric.VisitValues([os, &name, &label_names](
+        const vector<string>& label_values,
+        const Metric::TimestampedValue& value) {
+      WriteSampleName(name, label_names, label_values, "", "", os);
+      WriteSample(value.second, value.first, os);
+    });
+    return;
+  }
+
+  const string bucket_name(name + "_bucket");
+  metric.VisitHistogramValues([os, &name, &bucket_name, &label_names](
+      const vector<string>& label_values,
+      const Metric::HistogramValue& value) {
+    std::ostringstream bound;
+    for (const auto& b : value.buckets) {
+      bound.str("");
+      WriteDouble(b.first, &bound);
+      WriteSampleName(bucket_name, label_names, label_values, "le",
+                      bound.str(), os);
+      WriteSample(b.second, value.timestamp, os);
+    }
+    WriteSampleName(bucket_name, label_names, label_values, "le", "+Inf", os);
+    WriteSample(value.count, value.timestamp, os);
+    WriteSampleName(name + "_sum", label_names, label_values, "", "", os);
+    WriteSample(value.sum, value.timestamp, os);
+    WriteSampleName(name + "_count", label_names, label_values, "", "", os);
+    WriteSample(value.count, value.timestamp, os);
+  });
+}
+
+
 }  // namespace
 
 void ExportMetricsToPrometheus(std::ostream* os) {
@@ -79,6 +244,15 @@ void ExportMetricsToPrometheus(std::ostream* os) {
 }
 
 
+void ExportMetricsToPrometheusText(std::ostream* os) {
+  const set<const Metric*> metrics(Registry::Instance()->GetMetrics());
+
+  for (const auto* m : metrics) {
+    WriteTextFamily(*m, os);
+  }
+}
+
+
 void ExportMetricsToHtml(std::ostream* os) {
   const set<const Metric*> metrics(Registry::Instance()->GetMetrics());
   *os << "<html>\n"
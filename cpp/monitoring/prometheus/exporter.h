@@ -10,6 +10,12 @@ namespace cert_trans {
 void ExportMetricsToPrometheus(std::ostream* os);
 
 
+// Writes the metrics in the Prometheus text exposition format. Unlike
+// ExportMetricsToPrometheus(), this streams out the values of one metric
+// at a time without taking a copy of them first.
+void ExportMetricsToPrometheusText(std::ostream* os);
+
+
 void ExportMetricsToHtml(std::ostream* os);
 
 
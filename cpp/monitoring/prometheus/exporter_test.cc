@@ -0,0 +1,83 @@
+#include "monitoring/prometheus/exporter.h"
+
+#include <glog/logging.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <sstream>
+
+#include "monitoring/monitoring.h"
+#include "monitoring/registry.h"
+#include "util/testing.h"
+
+namespace cert_trans {
+
+using std::ostringstream;
+using std::string;
+using std::unique_ptr;
+using testing::HasSubstr;
+using testing::Not;
+
+
+class PrometheusExporterTest : public ::testing::Test {
+ public:
+  void TearDown() {
+    Registry::Instance()->ResetForTestingOnly();
+  }
+
+ protected:
+  string ExportText() {
+    ostringstream oss;
+    ExportMetricsToPrometheusText(&oss);
+    return oss.str();
+  }
+};
+
+
+TEST_F(PrometheusExporterTest, TestTextCounter) {
+  unique_ptr<Counter<string>> counter(
+      Counter<string>::New("requests", "path", "Requests\nserved."));
+  counter->IncrementBy("/a\"b\\", 3);
+
+  const string text(ExportText());
+  EXPECT_THAT(text, HasSubstr("# HELP requests Requests\\nserved.\n"
+                              "# TYPE requests counter\n"));
+  EXPECT_THAT(text, HasSubstr("requests{path=\"/a\\\"b\\\\\"} 3 "));
+}
+
+
+TEST_F(PrometheusExporterTest, TestTextGaugeWithoutLabels) {
+  unique_ptr<Gauge<>> gauge(Gauge<>::New("temperature", "help"));
+  gauge->Set(0.5);
+
+  const string text(ExportText());
+  EXPECT_THAT(text, HasSubstr("# TYPE temperature gauge\n"));
+  EXPECT_THAT(text, HasSubstr("\ntemperature 0.5 "));
+}
+
+
+TEST_F(PrometheusExporterTest, TestTextHistogram) {
+  unique_ptr<Histogram<string>> histogram(
+      Histogram<string>::New("latency", "op", "help"));
+  histogram->Record("get", 1);
+  histogram->Record("get", 3);
+
+  const string text(ExportText());
+  EXPECT_THAT(text, HasSubstr("# TYPE latency histogram\n"));
+  EXPECT_THAT(text, HasSubstr("latency_bucket{op=\"get\",le=\"1\"} 1 "));
+  EXPECT_THAT(text, HasSubstr("latency_bucket{op=\"get\",le=\"1.25\"} 1 "));
+  EXPECT_THAT(text, HasSubstr("latency_bucket{op=\"get\",le=\"3\"} 2 "));
+  EXPECT_THAT(text, Not(HasSubstr("le=\"3.5\"")));
+  EXPECT_THAT(text, HasSubstr("latency_bucket{op=\"get\",le=\"+Inf\"} 2 "));
+  EXPECT_THAT(text, HasSubstr("latency_sum{op=\"get\"} 4 "));
+  EXPECT_THAT(text, HasSubstr("latency_count{op=\"get\"} 2 "));
+}
+
+
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
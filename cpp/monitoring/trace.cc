@@ -0,0 +1,312 @@
+#include "config.h"
+#include "monitoring/trace.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <algorithm>
+#include <random>
+
+DEFINE_double(trace_sample_rate, 0,
+              "Fraction of the requests to trace, between 0 and 1.");
+DEFINE_int32(trace_buffer_size, 100,
+             "Number of the most recent traces to keep for exporting.");
+
+namespace cert_trans {
+
+using std::chrono::duration_cast;
+using std::chrono::steady_clock;
+using std::chrono::system_clock;
+using std::lock_guard;
+using std::make_shared;
+using std::min;
+using std::move;
+using std::mutex;
+using std::shared_ptr;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace {
+
+
+// Points into the ScopedTrace or ScopedTraceContext which made it
+// current, if any.
+#ifdef HAVE_THREAD_LOCAL
+thread_local TraceContext* current_context = nullptr;
+#elif HAVE___THREAD
+__thread TraceContext* current_context = nullptr;
+#else
+#error No suitable thread local storage available
+#endif
+
+
+uint64_t Random() {
+#ifdef HAVE_THREAD_LOCAL
+  static thread_local std::mt19937_64 engine((std::random_device())());
+  return engine();
+#else
+  // __thread only takes plain old data, so the threads share an engine.
+  static mutex engine_mutex;
+  static std::mt19937_64 engine((std::random_device())());
+  lock_guard<mutex> lock(engine_mutex);
+  return engine();
+#endif
+}
+
+
+bool ShouldSample() {
+  if (FLAGS_trace_sample_rate <= 0) {
+    return false;
+  }
+  // The top 53 bits, as a fraction in [0, 1).
+  return static_cast<double>(Random() >> 11) / (UINT64_C(1) << 53) <
+         FLAGS_trace_sample_rate;
+}
+
+
+uint64_t NewTraceId() {
+  uint64_t id;
+  do {
+    id = Random();
+  } while (id == 0);
+  return id;
+}
+
+
+}  // namespace
+
+
+Trace::Trace(const string& name)
+    : id_(NewTraceId()), started_at_(steady_clock::now()) {
+  StartSpan(0, name);
+}
+
+
+Trace::~Trace() {
+  unique_ptr<TraceBuffer::FinishedTrace> finished(
+      new TraceBuffer::FinishedTrace);
+  finished->id = id_;
+  {
+    lock_guard<mutex> lock(mutex_);
+    spans_[0].duration =
+        duration_cast<system_clock::duration>(steady_clock::now() -
+                                              started_at_);
+    finished->spans = move(spans_);
+  }
+  TraceBuffer::Instance()->Add(move(finished));
+}
+
+
+uint64_t Trace::StartSpan(uint64_t parent_id, const string& name) {
+  lock_guard<mutex> lock(mutex_);
+  Span span;
+  span.id = spans_.size() + 1;
+  span.parent_id = parent_id;
+  span.name = name;
+  span.start = system_clock::now();
+  span.duration = system_clock::duration::zero();
+  spans_.emplace_back(move(span));
+  span_starts_.emplace_back(steady_clock::now());
+  return spans_.back().id;
+}
+
+
+void Trace::EndSpan(uint64_t span_id) {
+  lock_guard<mutex> lock(mutex_);
+  CHECK_GT(span_id, 0U);
+  CHECK_LE(span_id, spans_.size());
+  spans_[span_id - 1].duration = duration_cast<system_clock::duration>(
+      steady_clock::now() - span_starts_[span_id - 1]);
+}
+
+
+void Trace::AddSpan(uint64_t parent_id, const string& name,
+                    steady_clock::duration duration) {
+  const uint64_t span_id(StartSpan(parent_id, name));
+  lock_guard<mutex> lock(mutex_);
+  Span* const span(&spans_[span_id - 1]);
+  span->duration = duration_cast<system_clock::duration>(duration);
+  span->start -= span->duration;
+}
+
+
+void Trace::AddTag(uint64_t span_id, const string& key, const string& value) {
+  lock_guard<mutex> lock(mutex_);
+  CHECK_GT(span_id, 0U);
+  CHECK_LE(span_id, spans_.size());
+  spans_[span_id - 1].tags.emplace_back(key, value);
+}
+
+
+TraceContext CurrentTraceContext() {
+  return current_context ? *current_context : TraceContext();
+}
+
+
+ScopedTrace::ScopedTrace(const string& name) : previous_(current_context) {
+  if (previous_) {
+    context_.trace = previous_->trace;
+    context_.span_id = context_.trace->StartSpan(previous_->span_id, name);
+  } else if (ShouldSample()) {
+    context_.trace = make_shared<Trace>(name);
+    context_.span_id = 1;
+  } else {
+    return;
+  }
+  current_context = &context_;
+}
+
+
+ScopedTrace::~ScopedTrace() {
+  if (!context_.trace) {
+    return;
+  }
+  if (previous_) {
+    context_.trace->EndSpan(context_.span_id);
+  }
+  current_context = previous_;
+}
+
+
+ScopedTraceContext::ScopedTraceContext(const TraceContext& context)
+    : context_(context), previous_(current_context) {
+  if (context_.trace) {
+    current_context = &context_;
+  }
+}
+
+
+ScopedTraceContext::~ScopedTraceContext() {
+  if (context_.trace) {
+    current_context = previous_;
+  }
+}
+
+
+ScopedSpan::ScopedSpan(const char* name) {
+  Start(name);
+}
+
+
+ScopedSpan::ScopedSpan(const string& name) {
+  Start(name.c_str());
+}
+
+
+ScopedSpan::ScopedSpan(ScopedSpan&& other)
+    : context_(other.context_), id_(other.id_), parent_id_(other.parent_id_) {
+  other.context_ = nullptr;
+}
+
+
+ScopedSpan::~ScopedSpan() {
+  End();
+}
+
+
+void ScopedSpan::Start(const char* name) {
+  context_ = current_context;
+  if (!context_) {
+    return;
+  }
+  parent_id_ = context_->span_id;
+  id_ = context_->trace->StartSpan(parent_id_, name);
+  context_->span_id = id_;
+}
+
+
+void ScopedSpan::AddTag(const string& key, const string& value) {
+  if (context_) {
+    context_->trace->AddTag(id_, key, value);
+  }
+}
+
+
+void ScopedSpan::End() {
+  if (!context_) {
+    return;
+  }
+  context_->trace->EndSpan(id_);
+  context_->span_id = parent_id_;
+  context_ = nullptr;
+}
+
+
+AsyncSpan::AsyncSpan(const char* name)
+    : trace_(current_context ? current_context->trace : nullptr),
+      id_(trace_ ? trace_->StartSpan(current_context->span_id, name) : 0) {
+}
+
+
+AsyncSpan::~AsyncSpan() {
+  if (trace_) {
+    trace_->EndSpan(id_);
+  }
+}
+
+
+void AsyncSpan::AddTag(const string& key, const string& value) {
+  if (trace_) {
+    trace_->AddTag(id_, key, value);
+  }
+}
+
+
+void RecordSpan(const char* name, steady_clock::duration duration) {
+  if (current_context) {
+    current_context->trace->AddSpan(current_context->span_id, name,
+                                    duration);
+  }
+}
+
+
+// static
+TraceBuffer* TraceBuffer::Instance() {
+  static TraceBuffer* buffer(new TraceBuffer);
+  return buffer;
+}
+
+
+void TraceBuffer::Add(unique_ptr<FinishedTrace> trace) {
+  lock_guard<mutex> lock(mutex_);
+  traces_.emplace_back(move(trace));
+  ++num_added_;
+  while (traces_.size() > static_cast<size_t>(FLAGS_trace_buffer_size)) {
+    traces_.pop_front();
+  }
+}
+
+
+vector<shared_ptr<const TraceBuffer::FinishedTrace>> TraceBuffer::GetTraces()
+    const {
+  lock_guard<mutex> lock(mutex_);
+  return vector<shared_ptr<const FinishedTrace>>(traces_.begin(),
+                                                  traces_.end());
+}
+
+
+vector<shared_ptr<const TraceBuffer::FinishedTrace>>
+TraceBuffer::GetTracesAddedSince(uint64_t position,
+                                 uint64_t* next_position) const {
+  CHECK_NOTNULL(next_position);
+  lock_guard<mutex> lock(mutex_);
+  *next_position = num_added_;
+  // The traces before |first_kept| were dropped already.
+  const uint64_t first_kept(num_added_ - traces_.size());
+  const size_t skipped(position > first_kept
+                           ? min<uint64_t>(position - first_kept,
+                                           traces_.size())
+                           : 0);
+  return vector<shared_ptr<const FinishedTrace>>(traces_.begin() + skipped,
+                                                  traces_.end());
+}
+
+
+void TraceBuffer::ResetForTestingOnly() {
+  lock_guard<mutex> lock(mutex_);
+  traces_.clear();
+  num_added_ = 0;
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,220 @@
+#ifndef CERT_TRANS_MONITORING_TRACE_H_
+#define CERT_TRANS_MONITORING_TRACE_H_
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "base/macros.h"
+
+namespace cert_trans {
+
+
+// A request picked for tracing (see --trace_sample_rate), and the spans
+// of the work done for it. The first span, started with the trace, ends
+// when the last reference to the trace goes away, at which point the
+// trace is handed to the TraceBuffer.
+//
+// Traces are not usually handled directly, but through ScopedTrace,
+// ScopedSpan and AsyncSpan. This class is thread-safe.
+class Trace {
+ public:
+  struct Span {
+    // Span ids are only unique within their trace, and start at 1. The
+    // first span has no parent, which is 0.
+    uint64_t id;
+    uint64_t parent_id;
+    std::string name;
+    std::chrono::system_clock::time_point start;
+    std::chrono::system_clock::duration duration;
+    std::vector<std::pair<std::string, std::string>> tags;
+  };
+
+  explicit Trace(const std::string& name);
+  ~Trace();
+
+  uint64_t id() const {
+    return id_;
+  }
+
+  // Returns the id of the new span, which should be passed to EndSpan()
+  // once the work is done.
+  uint64_t StartSpan(uint64_t parent_id, const std::string& name);
+  void EndSpan(uint64_t span_id);
+
+  // Records a span which ended just now, having started |duration| ago.
+  void AddSpan(uint64_t parent_id, const std::string& name,
+               std::chrono::steady_clock::duration duration);
+
+  void AddTag(uint64_t span_id, const std::string& key,
+              const std::string& value);
+
+ private:
+  const uint64_t id_;
+  const std::chrono::steady_clock::time_point started_at_;
+  std::mutex mutex_;
+  // Indexed by span id - 1.
+  std::vector<Span> spans_;
+  std::vector<std::chrono::steady_clock::time_point> span_starts_;
+
+  DISALLOW_COPY_AND_ASSIGN(Trace);
+};
+
+
+// Where a thread is in a trace: new spans are children of |span_id|.
+// A default constructed one, with no |trace|, is not tracing anything.
+struct TraceContext {
+  TraceContext() : span_id(0) {
+  }
+
+  std::shared_ptr<Trace> trace;
+  uint64_t span_id;
+};
+
+
+// Returns the context of the current thread, to carry work of a trace
+// over to other threads with a ScopedTraceContext.
+TraceContext CurrentTraceContext();
+
+
+// Samples a new trace, and makes it current on this thread for the
+// lifetime of this object. If the thread is already in a trace, this
+// just starts a span in it.
+class ScopedTrace {
+ public:
+  explicit ScopedTrace(const std::string& name);
+  ~ScopedTrace();
+
+ private:
+  TraceContext context_;
+  TraceContext* const previous_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedTrace);
+};
+
+
+// Makes |context| current on this thread, for the lifetime of this
+// object.
+class ScopedTraceContext {
+ public:
+  explicit ScopedTraceContext(const TraceContext& context);
+  ~ScopedTraceContext();
+
+ private:
+  TraceContext context_;
+  TraceContext* const previous_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedTraceContext);
+};
+
+
+// Records a span for its lifetime, as a child of the current span of
+// this thread, if it is in a trace. Otherwise, creating one costs
+// little more than checking a thread-local variable, and |name| is not
+// even copied.
+//
+// Spans must end in the reverse order they started in, which scoping
+// takes care of.
+class ScopedSpan {
+ public:
+  explicit ScopedSpan(const char* name);
+  explicit ScopedSpan(const std::string& name);
+  ScopedSpan(ScopedSpan&& other);
+  ~ScopedSpan();
+
+  bool sampled() const {
+    return context_ != nullptr;
+  }
+
+  // Does nothing if this span is not sampled.
+  void AddTag(const std::string& key, const std::string& value);
+
+  // Ends the span before the end of the scope.
+  void End();
+
+ private:
+  void Start(const char* name);
+
+  TraceContext* context_;
+  uint64_t id_;
+  uint64_t parent_id_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedSpan);
+};
+
+
+// Records a span which does not end on the thread that started it, for
+// asynchronous operations.
+class AsyncSpan {
+ public:
+  // Starts a child of the current span of this thread, if it is in a
+  // trace.
+  explicit AsyncSpan(const char* name);
+  ~AsyncSpan();
+
+  bool sampled() const {
+    return trace_ != nullptr;
+  }
+
+  // Does nothing if this span is not sampled.
+  void AddTag(const std::string& key, const std::string& value);
+
+ private:
+  const std::shared_ptr<Trace> trace_;
+  const uint64_t id_;
+
+  DISALLOW_COPY_AND_ASSIGN(AsyncSpan);
+};
+
+
+// Records a span that ended just now, having started |duration| ago, as
+// a child of the current span of this thread, if it is in a trace.
+void RecordSpan(const char* name,
+                std::chrono::steady_clock::duration duration);
+
+
+// Keeps the most recent finished traces (see --trace_buffer_size), to be
+// exported. This class is thread-safe.
+class TraceBuffer {
+ public:
+  struct FinishedTrace {
+    uint64_t id;
+    std::vector<Trace::Span> spans;
+  };
+
+  static TraceBuffer* Instance();
+
+  void Add(std::unique_ptr<FinishedTrace> trace);
+
+  // Returns the traces kept, oldest first.
+  std::vector<std::shared_ptr<const FinishedTrace>> GetTraces() const;
+
+  // Returns those of the traces kept which were added after the first
+  // |position| ones ever added, oldest first, and sets |next_position|
+  // to pass to the next call to only get the traces added since.
+  std::vector<std::shared_ptr<const FinishedTrace>> GetTracesAddedSince(
+      uint64_t position, uint64_t* next_position) const;
+
+  // This method is only for use in testing.
+  void ResetForTestingOnly();
+
+ private:
+  TraceBuffer() : num_added_(0) {
+  }
+
+  mutable std::mutex mutex_;
+  std::deque<std::shared_ptr<const FinishedTrace>> traces_;
+  uint64_t num_added_;
+
+  DISALLOW_COPY_AND_ASSIGN(TraceBuffer);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_MONITORING_TRACE_H_
@@ -0,0 +1,144 @@
+#include "monitoring/trace.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <thread>
+
+#include "monitoring/latency.h"
+#include "util/testing.h"
+
+DECLARE_double(trace_sample_rate);
+
+namespace cert_trans {
+
+using std::chrono::milliseconds;
+using std::make_pair;
+using std::shared_ptr;
+using std::string;
+using std::thread;
+using std::unique_ptr;
+using std::vector;
+using testing::ElementsAre;
+
+
+class TraceTest : public ::testing::Test {
+ public:
+  void SetUp() {
+    FLAGS_trace_sample_rate = 1;
+    TraceBuffer::Instance()->ResetForTestingOnly();
+  }
+
+ protected:
+  shared_ptr<const TraceBuffer::FinishedTrace> OnlyTrace() {
+    const vector<shared_ptr<const TraceBuffer::FinishedTrace>> traces(
+        TraceBuffer::Instance()->GetTraces());
+    CHECK_EQ(1U, traces.size());
+    return traces[0];
+  }
+};
+
+
+TEST_F(TraceTest, TestNotSampled) {
+  FLAGS_trace_sample_rate = 0;
+  {
+    ScopedTrace trace("request");
+    ScopedSpan span("work");
+    EXPECT_FALSE(span.sampled());
+    EXPECT_FALSE(CurrentTraceContext().trace);
+  }
+  EXPECT_TRUE(TraceBuffer::Instance()->GetTraces().empty());
+}
+
+
+TEST_F(TraceTest, TestNestedSpans) {
+  {
+    ScopedTrace trace("request");
+    ScopedSpan outer("outer");
+    EXPECT_TRUE(outer.sampled());
+    {
+      ScopedSpan inner("inner");
+      inner.AddTag("key", "value");
+    }
+    ScopedSpan sibling("sibling");
+  }
+  EXPECT_FALSE(CurrentTraceContext().trace);
+
+  const shared_ptr<const TraceBuffer::FinishedTrace> trace(OnlyTrace());
+  ASSERT_EQ(4U, trace->spans.size());
+  EXPECT_EQ("request", trace->spans[0].name);
+  EXPECT_EQ(0U, trace->spans[0].parent_id);
+  EXPECT_EQ("outer", trace->spans[1].name);
+  EXPECT_EQ(1U, trace->spans[1].parent_id);
+  EXPECT_EQ("inner", trace->spans[2].name);
+  EXPECT_EQ(2U, trace->spans[2].parent_id);
+  EXPECT_THAT(trace->spans[2].tags, ElementsAre(make_pair("key", "value")));
+  EXPECT_EQ("sibling", trace->spans[3].name);
+  EXPECT_EQ(2U, trace->spans[3].parent_id);
+}
+
+
+TEST_F(TraceTest, TestEndEarly) {
+  {
+    ScopedTrace trace("request");
+    ScopedSpan first("first");
+    first.End();
+    ScopedSpan second("second");
+  }
+  const shared_ptr<const TraceBuffer::FinishedTrace> trace(OnlyTrace());
+  ASSERT_EQ(3U, trace->spans.size());
+  EXPECT_EQ(1U, trace->spans[2].parent_id);
+}
+
+
+TEST_F(TraceTest, TestOtherThreads) {
+  unique_ptr<thread> worker;
+  unique_ptr<AsyncSpan> async;
+  {
+    ScopedTrace trace("request");
+    async.reset(new AsyncSpan("async"));
+    const TraceContext context(CurrentTraceContext());
+    worker.reset(new thread([context]() {
+      const ScopedTraceContext scoped_context(context);
+      RecordSpan("waited", milliseconds(5));
+      ScopedSpan span("worker");
+    }));
+  }
+  worker->join();
+  // The trace is only finished once the async span is.
+  EXPECT_TRUE(TraceBuffer::Instance()->GetTraces().empty());
+  async.reset();
+
+  const shared_ptr<const TraceBuffer::FinishedTrace> trace(OnlyTrace());
+  ASSERT_EQ(4U, trace->spans.size());
+  for (size_t i = 1; i < trace->spans.size(); ++i) {
+    EXPECT_EQ(1U, trace->spans[i].parent_id);
+  }
+  EXPECT_EQ("waited", trace->spans[2].name);
+  EXPECT_EQ(milliseconds(5), trace->spans[2].duration);
+  EXPECT_LE(trace->spans[3].duration, trace->spans[0].duration);
+}
+
+
+TEST_F(TraceTest, TestScopedLatency) {
+  Latency<milliseconds, string> latency("traced_latency", "op", "help");
+  {
+    ScopedTrace trace("request");
+    ScopedLatency scoped(latency.GetScopedLatency("lookup"));
+  }
+  const shared_ptr<const TraceBuffer::FinishedTrace> trace(OnlyTrace());
+  ASSERT_EQ(2U, trace->spans.size());
+  EXPECT_EQ("traced_latency", trace->spans[1].name);
+  EXPECT_THAT(trace->spans[1].tags, ElementsAre(make_pair("op", "lookup")));
+}
+
+
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,207 @@
+#include "monitoring/zipkin/exporter.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <cinttypes>
+#include <cstdio>
+#include <memory>
+#include <string>
+
+#include "monitoring/monitoring.h"
+#include "monitoring/trace.h"
+#include "net/url.h"
+#include "util/json_wrapper.h"
+
+DEFINE_string(trace_service_name, "ct-server",
+              "Service name to report the traced spans under.");
+DEFINE_string(zipkin_collector_url, "",
+              "URL of a Zipkin (v2) collector to push the traces to, such "
+              "as http://zipkin:9411/api/v2/spans. If empty, traces are "
+              "only served on /traces.");
+DEFINE_int32(zipkin_push_interval_seconds, 10,
+             "Seconds between pushing the new traces to Zipkin.");
+DEFINE_int32(zipkin_max_spans_per_request, 500,
+             "Most spans to push to Zipkin in a single request.");
+
+namespace cert_trans {
+
+using std::bind;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::seconds;
+using std::make_pair;
+using std::placeholders::_1;
+using std::shared_ptr;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using util::Task;
+
+Counter<>* num_zipkin_push_failures =
+    Counter<>::New("num_zipkin_push_failures",
+                   "Number of failures to push traces to Zipkin.");
+
+namespace {
+
+
+string HexId(uint64_t id) {
+  char buf[17];
+  snprintf(buf, sizeof(buf), "%016" PRIx64, id);
+  return buf;
+}
+
+
+void AddSpans(const TraceBuffer::FinishedTrace& trace, JsonArray* spans) {
+  JsonObject endpoint;
+  endpoint.Add("serviceName", FLAGS_trace_service_name);
+
+  const string trace_id(HexId(trace.id));
+  for (const auto& span : trace.spans) {
+    JsonObject json_span;
+    json_span.Add("traceId", trace_id);
+    json_span.Add("id", HexId(span.id));
+    if (span.parent_id != 0) {
+      json_span.Add("parentId", HexId(span.parent_id));
+    }
+    json_span.Add("name", span.name);
+    const int64_t timestamp_us(
+        duration_cast<microseconds>(span.start.time_since_epoch()).count());
+    const int64_t duration_us(
+        duration_cast<microseconds>(span.duration).count());
+    json_span.Add("timestamp", timestamp_us);
+    json_span.Add("duration", duration_us);
+    json_span.Add("localEndpoint", endpoint);
+    if (!span.tags.empty()) {
+      JsonObject tags;
+      for (const auto& tag : span.tags) {
+        tags.Add(tag.first.c_str(), tag.second);
+      }
+      json_span.Add("tags", tags);
+    }
+    spans->Add(&json_span);
+  }
+}
+
+
+}  // namespace
+
+
+void ExportTracesToZipkin(std::ostream* os) {
+  JsonArray spans;
+  for (const auto& trace : TraceBuffer::Instance()->GetTraces()) {
+    AddSpans(*trace, &spans);
+  }
+
+  *os << spans.ToString();
+}
+
+
+ZipkinExporter::ZipkinExporter(UrlFetcher* fetcher)
+    : fetcher_(CHECK_NOTNULL(fetcher)),
+      pool_("zipkin", 1),
+      task_(&pool_),
+      position_(0) {
+  CHECK(!FLAGS_zipkin_collector_url.empty());
+  pool_.Add(bind(&ZipkinExporter::PushTraces, this));
+}
+
+
+ZipkinExporter::~ZipkinExporter() {
+  task_.task()->Cancel();
+  task_.Wait();
+}
+
+
+void ZipkinExporter::PushTraces() {
+  if (task_.task()->CancelRequested()) {
+    task_.task()->Return(util::Status::CANCELLED);
+    return;
+  }
+
+  uint64_t next_position;
+  const vector<shared_ptr<const TraceBuffer::FinishedTrace>> traces(
+      TraceBuffer::Instance()->GetTracesAddedSince(position_,
+                                                   &next_position));
+  VLOG(1) << "Pushing " << traces.size() << " traces...";
+
+  CHECK(batches_.empty());
+  CHECK_GT(FLAGS_zipkin_max_spans_per_request, 0);
+  const size_t max_spans(FLAGS_zipkin_max_spans_per_request);
+  const uint64_t first_position(next_position - traces.size());
+  size_t end(0);
+  while (end < traces.size()) {
+    JsonArray spans;
+    size_t num_spans(0);
+    // A trace with too many spans still goes in a request of its own.
+    do {
+      AddSpans(*traces[end], &spans);
+      num_spans += traces[end]->spans.size();
+      ++end;
+    } while (end < traces.size() &&
+             num_spans + traces[end]->spans.size() <= max_spans);
+    batches_.push_back(Batch{spans.ToString(), first_position + end});
+  }
+  // Even with nothing to push, traces dropped by the TraceBuffer since
+  // the last push are not to be looked for again.
+  if (batches_.empty()) {
+    position_ = next_position;
+  }
+
+  PushNextBatch();
+}
+
+
+void ZipkinExporter::PushNextBatch() {
+  if (task_.task()->CancelRequested()) {
+    batches_.clear();
+    task_.task()->Return(util::Status::CANCELLED);
+    return;
+  }
+
+  if (batches_.empty()) {
+    ScheduleNextPush();
+    return;
+  }
+
+  UrlFetcher::Request req((URL(FLAGS_zipkin_collector_url)));
+  req.verb = UrlFetcher::Verb::POST;
+  req.headers.insert(make_pair("Content-Type", "application/json"));
+  req.body = batches_.front().body;
+  VLOG(2) << req.body;
+
+  UrlFetcher::Response* resp(new UrlFetcher::Response);
+  fetcher_->Fetch(req, resp,
+                  task_.task()->AddChild(bind(&ZipkinExporter::PushTracesDone,
+                                              this, resp, _1)));
+}
+
+
+void ZipkinExporter::PushTracesDone(UrlFetcher::Response* resp, Task* task) {
+  unique_ptr<UrlFetcher::Response> resp_deleter(resp);
+  // The collector answers 202 Accepted.
+  if (!task->status().ok() || resp->status_code / 100 != 2) {
+    num_zipkin_push_failures->Increment();
+    LOG(WARNING) << "Failed to push traces to Zipkin, status: "
+                 << task->status()
+                 << ", response code: " << resp->status_code;
+    // The traces not pushed yet will be in the next push, if they are
+    // still kept by then.
+    batches_.clear();
+  } else {
+    VLOG(1) << "Traces pushed.";
+    position_ = batches_.front().next_position;
+    batches_.pop_front();
+  }
+
+  PushNextBatch();
+}
+
+
+void ZipkinExporter::ScheduleNextPush() {
+  pool_.Delay(seconds(FLAGS_zipkin_push_interval_seconds),
+              task_.task()->AddChild(bind(&ZipkinExporter::PushTraces,
+                                          this)));
+}
+
+
+}  // namespace cert_trans
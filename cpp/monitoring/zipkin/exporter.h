@@ -0,0 +1,62 @@
+#ifndef CERT_TRANS_MONITORING_ZIPKIN_EXPORTER_H_
+#define CERT_TRANS_MONITORING_ZIPKIN_EXPORTER_H_
+
+#include <cstdint>
+#include <deque>
+#include <ostream>
+#include <string>
+
+#include "base/macros.h"
+#include "net/url_fetcher.h"
+#include "util/sync_task.h"
+#include "util/thread_pool.h"
+
+namespace cert_trans {
+
+
+// Writes the traces kept by the TraceBuffer as a JSON list of Zipkin (v2)
+// spans, as accepted by the Zipkin API and UI.
+void ExportTracesToZipkin(std::ostream* os);
+
+
+// Pushes the traces added to the TraceBuffer to a Zipkin collector (see
+// --zipkin_collector_url) periodically, split over as many requests as
+// needed to keep under --zipkin_max_spans_per_request. The spans of a
+// trace always go in the same request, unless there are too many of
+// them for any one.
+class ZipkinExporter {
+ public:
+  explicit ZipkinExporter(UrlFetcher* fetcher);
+  ~ZipkinExporter();
+
+ private:
+  // One request of a push, and the TraceBuffer position to carry on from
+  // once it succeeds.
+  struct Batch {
+    std::string body;
+    uint64_t next_position;
+  };
+
+  void PushTraces();
+  // Sends the first of |batches_|, or schedules the next push if there
+  // are none left.
+  void PushNextBatch();
+  void PushTracesDone(UrlFetcher::Response* resp, util::Task* task);
+  void ScheduleNextPush();
+
+  UrlFetcher* const fetcher_;
+  ThreadPool pool_;
+  util::SyncTask task_;
+
+  // Only used by one push at a time, which are never concurrent.
+  std::deque<Batch> batches_;
+  // How many of the traces ever added to the TraceBuffer were pushed.
+  uint64_t position_;
+
+  DISALLOW_COPY_AND_ASSIGN(ZipkinExporter);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_MONITORING_ZIPKIN_EXPORTER_H_
@@ -0,0 +1,252 @@
+#include "monitoring/zipkin/exporter.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include "monitoring/trace.h"
+#include "net/mock_url_fetcher.h"
+#include "util/json_wrapper.h"
+#include "util/testing.h"
+
+DECLARE_double(trace_sample_rate);
+DECLARE_string(trace_service_name);
+DECLARE_string(zipkin_collector_url);
+DECLARE_int32(zipkin_push_interval_seconds);
+DECLARE_int32(zipkin_max_spans_per_request);
+
+namespace cert_trans {
+
+const char kCollectorUrl[] = "http://example.com/api/v2/spans";
+const char kServiceName[] = "test-service";
+
+
+using std::chrono::milliseconds;
+using std::lock_guard;
+using std::make_pair;
+using std::mutex;
+using std::ostringstream;
+using std::shared_ptr;
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+using testing::_;
+using testing::ElementsAre;
+using testing::Invoke;
+using util::Task;
+
+namespace {
+
+
+// Finishes a trace with |num_spans| spans: the first one, and as many
+// children of it.
+void AddTrace(const string& name, int num_spans) {
+  ScopedTrace trace(name);
+  for (int i = 1; i < num_spans; ++i) {
+    ScopedSpan span(name + "." + to_string(i));
+    span.AddTag("index", to_string(i));
+  }
+}
+
+
+// Wraps a JSON list in an object, for JsonArray to get at it.
+unique_ptr<JsonObject> ParseList(const string& json) {
+  unique_ptr<JsonObject> ret(new JsonObject("{\"list\":" + json + "}"));
+  CHECK(ret->Ok()) << json;
+  return ret;
+}
+
+
+// The names of the spans in a list of Zipkin spans.
+vector<string> SpanNames(const string& json) {
+  const JsonArray spans(*ParseList(json), "list");
+  CHECK(spans.Ok());
+  vector<string> names;
+  for (int i = 0; i < spans.Length(); ++i) {
+    const JsonObject span(spans, i);
+    names.emplace_back(JsonString(span, "name").Value());
+  }
+  return names;
+}
+
+
+string HexId(uint64_t id) {
+  char buf[17];
+  snprintf(buf, sizeof(buf), "%016" PRIx64, id);
+  return buf;
+}
+
+
+}  // namespace
+
+
+class ZipkinExporterTest : public ::testing::Test {
+ public:
+  void SetUp() {
+    FLAGS_trace_sample_rate = 1;
+    FLAGS_trace_service_name = kServiceName;
+    FLAGS_zipkin_collector_url = kCollectorUrl;
+    FLAGS_zipkin_push_interval_seconds = 1;
+    FLAGS_zipkin_max_spans_per_request = 100;
+    TraceBuffer::Instance()->ResetForTestingOnly();
+  }
+
+ protected:
+  // Makes the collector answer |status_code| to the |n|th push (counting
+  // from 1), 202 to the others, and keeps the body of each push.
+  void ExpectPushes(int n, int status_code) {
+    EXPECT_CALL(fetcher_,
+                Fetch(IsUrlFetchRequest(UrlFetcher::Verb::POST,
+                                        URL(kCollectorUrl),
+                                        UrlFetcher::Headers{make_pair(
+                                            "Content-Type",
+                                            "application/json")},
+                                        _),
+                      _, _))
+        .WillRepeatedly(Invoke([this, n, status_code](
+            const UrlFetcher::Request& req, UrlFetcher::Response* resp,
+            Task* task) {
+          lock_guard<mutex> lock(mutex_);
+          pushes_.push_back(req.body);
+          resp->status_code =
+              pushes_.size() == static_cast<size_t>(n) ? status_code : 202;
+          task->Return();
+        }));
+  }
+
+  // Waits for the collector to have received |n| pushes, and returns
+  // their bodies.
+  vector<string> WaitForPushes(size_t n) {
+    while (true) {
+      {
+        lock_guard<mutex> lock(mutex_);
+        if (pushes_.size() >= n) {
+          return vector<string>(pushes_.begin(), pushes_.begin() + n);
+        }
+      }
+      std::this_thread::sleep_for(milliseconds(10));
+    }
+  }
+
+  MockUrlFetcher fetcher_;
+  mutex mutex_;
+  vector<string> pushes_;
+};
+
+
+TEST_F(ZipkinExporterTest, TestExportsSpans) {
+  AddTrace("request", 2);
+  const vector<shared_ptr<const TraceBuffer::FinishedTrace>> traces(
+      TraceBuffer::Instance()->GetTraces());
+  ASSERT_EQ(1U, traces.size());
+
+  ostringstream oss;
+  ExportTracesToZipkin(&oss);
+  const JsonArray spans(*ParseList(oss.str()), "list");
+  ASSERT_TRUE(spans.Ok());
+  ASSERT_EQ(2, spans.Length());
+
+  const JsonObject root(spans, 0);
+  EXPECT_EQ(HexId(traces[0]->id), JsonString(root, "traceId").Value());
+  EXPECT_STREQ("0000000000000001", JsonString(root, "id").Value());
+  EXPECT_FALSE(JsonString(root, "parentId").Ok());
+  EXPECT_STREQ("request", JsonString(root, "name").Value());
+  EXPECT_LT(0, JsonInt(root, "timestamp").Value());
+  EXPECT_LE(0, JsonInt(root, "duration").Value());
+  EXPECT_STREQ(kServiceName,
+               JsonString(JsonObject(root, "localEndpoint"), "serviceName")
+                   .Value());
+  EXPECT_FALSE(JsonObject(root, "tags").Ok());
+
+  const JsonObject child(spans, 1);
+  EXPECT_EQ(HexId(traces[0]->id), JsonString(child, "traceId").Value());
+  EXPECT_STREQ("0000000000000002", JsonString(child, "id").Value());
+  EXPECT_STREQ("0000000000000001", JsonString(child, "parentId").Value());
+  EXPECT_STREQ("request.1", JsonString(child, "name").Value());
+  EXPECT_STREQ("1", JsonString(JsonObject(child, "tags"), "index").Value());
+}
+
+
+TEST_F(ZipkinExporterTest, TestPushesSpans) {
+  AddTrace("one", 1);
+  AddTrace("two", 2);
+  ExpectPushes(0, 202);
+
+  ZipkinExporter exporter(&fetcher_);
+  const vector<string> pushes(WaitForPushes(1));
+  EXPECT_THAT(SpanNames(pushes[0]), ElementsAre("one", "two", "two.1"));
+
+  // The body is what the collector would have been served.
+  ostringstream oss;
+  ExportTracesToZipkin(&oss);
+  EXPECT_EQ(oss.str(), pushes[0]);
+}
+
+
+TEST_F(ZipkinExporterTest, TestSplitsPushesBetweenTraces) {
+  FLAGS_zipkin_max_spans_per_request = 3;
+  AddTrace("one", 1);
+  AddTrace("two", 2);
+  AddTrace("three", 2);
+  // Too many spans for any request, it goes in one of its own.
+  AddTrace("four", 4);
+  AddTrace("five", 1);
+  ExpectPushes(0, 202);
+
+  ZipkinExporter exporter(&fetcher_);
+  const vector<string> pushes(WaitForPushes(4));
+  EXPECT_THAT(SpanNames(pushes[0]), ElementsAre("one", "two", "two.1"));
+  EXPECT_THAT(SpanNames(pushes[1]), ElementsAre("three", "three.1"));
+  EXPECT_THAT(SpanNames(pushes[2]),
+              ElementsAre("four", "four.1", "four.2", "four.3"));
+  EXPECT_THAT(SpanNames(pushes[3]), ElementsAre("five"));
+}
+
+
+TEST_F(ZipkinExporterTest, TestPushesOnlyNewTraces) {
+  AddTrace("one", 1);
+  ExpectPushes(0, 202);
+
+  ZipkinExporter exporter(&fetcher_);
+  WaitForPushes(1);
+  AddTrace("two", 1);
+  const vector<string> pushes(WaitForPushes(2));
+  EXPECT_THAT(SpanNames(pushes[0]), ElementsAre("one"));
+  EXPECT_THAT(SpanNames(pushes[1]), ElementsAre("two"));
+}
+
+
+TEST_F(ZipkinExporterTest, TestRetriesWhenPushingTracesFails) {
+  FLAGS_zipkin_max_spans_per_request = 1;
+  AddTrace("one", 1);
+  AddTrace("two", 1);
+  AddTrace("three", 1);
+  // The rest of the push is not tried after the second request fails,
+  // it all goes in the next push.
+  ExpectPushes(2, 500);
+
+  ZipkinExporter exporter(&fetcher_);
+  const vector<string> pushes(WaitForPushes(4));
+  EXPECT_THAT(SpanNames(pushes[0]), ElementsAre("one"));
+  EXPECT_THAT(SpanNames(pushes[1]), ElementsAre("two"));
+  EXPECT_THAT(SpanNames(pushes[2]), ElementsAre("two"));
+  EXPECT_THAT(SpanNames(pushes[3]), ElementsAre("three"));
+}
+
+
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -3,8 +3,10 @@
 #include <event2/event.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <algorithm>
 #include <chrono>
 
+#include "monitoring/latency.h"
 #include "monitoring/monitoring.h"
 #include "util/openssl_util.h"
 
@@ -16,11 +18,15 @@ extern "C" {
 
 using std::bind;
 using std::chrono::duration_cast;
+using std::chrono::milliseconds;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::chrono::system_clock;
+using std::find;
 using std::lock_guard;
 using std::make_pair;
 using std::map;
+using std::min;
 using std::move;
 using std::mutex;
 using std::pair;
@@ -31,8 +37,12 @@ using std::to_string;
 using std::unique_lock;
 using std::unique_ptr;
 using std::shared_ptr;
+using std::thread;
+using std::vector;
 using util::ClearOpenSSLErrors;
 using util::DumpOpenSSLErrorStack;
+using util::Status;
+using util::Task;
 
 DEFINE_int32(
     connection_read_timeout_seconds, 60,
@@ -50,6 +60,21 @@ DEFINE_string(trusted_root_certs, "",
               "connections.");
 DEFINE_int32(url_fetcher_max_conn_per_host_port, 4,
              "maximum number of URL fetcher connections per host:port");
+DEFINE_int32(connection_pool_max_active_per_host_port, 0,
+             "If non-zero, the maximum number of requests in flight at once "
+             "to any given host:port, further requests wait for one of them "
+             "to finish (and reuse its connection).");
+DEFINE_bool(connection_pool_tls_session_resumption, true,
+            "Remember the last TLS session with each host:port, and try to "
+            "resume it when opening a new connection, skipping the full "
+            "handshake.");
+DEFINE_int32(connection_pool_min_idle_per_host_port, 0,
+             "If non-zero, open connections in the background to every "
+             "host:port used so far, to keep at least this many idle ones "
+             "ready (up to --url_fetcher_max_conn_per_host_port).");
+DEFINE_int32(connection_pool_prewarm_interval_seconds, 10,
+             "How often to check for --connection_pool_min_idle_per_host_port "
+             "idle connections.");
 
 DEFINE_string(tls_client_minimum_protocol, "tlsv12",
               "Minimum acceptable TLS "
@@ -80,6 +105,27 @@ const int kZeroMillis = 0;
 static Gauge<string>* connections_per_host_port(
     Gauge<string>::New("connections_per_host_port", "host_port",
                        "Number of cached connections port host:port"));
+static Gauge<string>* active_connections_per_host_port(
+    Gauge<string>::New("active_connections_per_host_port", "host_port",
+                       "Number of connections in use per host:port"));
+static Counter<string>* connections_opened(Counter<string>::New(
+    "connection_pool_connections_opened", "host_port",
+    "Number of new connections opened per host:port"));
+static Counter<string>* connections_reused(Counter<string>::New(
+    "connection_pool_connections_reused", "host_port",
+    "Number of times a cached connection was reused per host:port"));
+static Counter<string>* connection_waits(Counter<string>::New(
+    "connection_pool_waits", "host_port",
+    "Number of requests which had to wait for a connection to become "
+    "available, because of --connection_pool_max_active_per_host_port"));
+static Counter<string>* connections_prewarmed(Counter<string>::New(
+    "connection_pool_connections_prewarmed", "host_port",
+    "Number of connections opened in the background per host:port, because "
+    "of --connection_pool_min_idle_per_host_port"));
+static Latency<milliseconds, string> connection_wait_ms(
+    "connection_pool_wait_ms", "host_port",
+    "Time spent waiting for a connection to become available, because of "
+    "--connection_pool_max_active_per_host_port, per host:port");
 
 
 namespace {
@@ -92,6 +138,13 @@ int GetSSLConnectionIndex() {
 }
 
 
+int GetSSLCTXPoolIndex() {
+  static const int ssl_ctx_pool_index(
+      SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr));
+  return ssl_ctx_pool_index;
+}
+
+
 string HostPortString(const HostPortPair& pair) {
   return pair.first + ":" + to_string(pair.second);
 }
@@ -244,6 +297,31 @@ const HostPortPair& ConnectionPool::Connection::other_end() const {
 }
 
 
+struct ConnectionPool::Waiter {
+  Waiter(const URL& u, unique_ptr<Connection>* c, Task* t)
+      : url(u), conn(c), task(t), queued_at(steady_clock::now()) {
+  }
+
+  const URL url;
+  unique_ptr<Connection>* const conn;
+  Task* const task;
+  const steady_clock::time_point queued_at;
+};
+
+
+struct ConnectionPool::Host {
+  std::mutex lock;
+  // We get and put connections from the back of the deque, and when
+  // there are too many, we prune them from the front (LIFO).
+  std::deque<TimestampedConnection> conns;
+  // Number of connections handed out by Get() and not yet returned.
+  int active = 0;
+  // Waiting for |active| to go down, in order.
+  std::deque<Waiter*> waiters;
+  bool https = false;
+};
+
+
 namespace {
 
 // No SSLv2 or SSLv3, thanks.
@@ -283,7 +361,7 @@ SSL_CTX* CreateSSLCTXFromFlags() {
 
 ConnectionPool::ConnectionPool(libevent::Base* base)
     : base_(CHECK_NOTNULL(base)),
-      cleanup_scheduled_(false),
+      shutdown_(false),
       ssl_ctx_(CreateSSLCTXFromFlags(), SSL_CTX_free) {
   CHECK(ssl_ctx_) << "could not build SSL context: "
                   << DumpOpenSSLErrorStack();
@@ -309,6 +387,53 @@ ConnectionPool::ConnectionPool(libevent::Base* base)
 
   SSL_CTX_set_verify(ssl_ctx_.get(), SSL_VERIFY_PEER,
                      EvConnection::SSLVerifyCallback);
+
+  if (FLAGS_connection_pool_tls_session_resumption) {
+    // We keep the sessions ourselves, by host:port, see
+    // NewSessionCallback().
+    SSL_CTX_set_session_cache_mode(ssl_ctx_.get(),
+                                   SSL_SESS_CACHE_CLIENT |
+                                       SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    CHECK_EQ(1,
+             SSL_CTX_set_ex_data(ssl_ctx_.get(), GetSSLCTXPoolIndex(), this));
+    SSL_CTX_sess_set_new_cb(ssl_ctx_.get(),
+                            &ConnectionPool::NewSessionCallback);
+  }
+
+  CHECK_GE(FLAGS_connection_pool_min_idle_per_host_port, 0);
+  if (FLAGS_connection_pool_min_idle_per_host_port > 0) {
+    CHECK_GT(FLAGS_connection_pool_prewarm_interval_seconds, 0);
+    prewarm_thread_ = thread(&ConnectionPool::PrewarmLoop, this);
+  }
+}
+
+
+ConnectionPool::~ConnectionPool() {
+  {
+    lock_guard<mutex> lock(shutdown_lock_);
+    shutdown_ = true;
+  }
+  shutdown_cv_.notify_all();
+  if (prewarm_thread_.joinable()) {
+    prewarm_thread_.join();
+  }
+}
+
+
+// static
+int ConnectionPool::NewSessionCallback(SSL* ssl, SSL_SESSION* session) {
+  ConnectionPool* const pool(static_cast<ConnectionPool*>(CHECK_NOTNULL(
+      SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), GetSSLCTXPoolIndex()))));
+  const EvConnection* const connection(
+      CHECK_NOTNULL(static_cast<const EvConnection*>(
+          SSL_get_ex_data(ssl, GetSSLConnectionIndex()))));
+  VLOG(1) << "new TLS session for "
+          << HostPortString(connection->other_end());
+
+  lock_guard<mutex> lock(pool->sessions_lock_);
+  // Returning 1 means that we keep the reference we were given.
+  pool->sessions_[connection->other_end()].reset(session);
+  return 1;
 }
 
 
@@ -407,7 +532,7 @@ void ConnectionPool::RemoveDeadConnectionsFromDeque(
   // Do a sweep and remove any dead connections
   for (auto deque_it(deque->begin()); deque_it != deque->end();) {
     CHECK(deque_it->second);
-    if (!deque_it->second->connection()) {
+    if (!deque_it->second->connection() || deque_it->second->GetErrored()) {
       VLOG(1) << "Removing dead connection to "
               << deque_it->second->other_end().first << ":"
               << deque_it->second->other_end().second;
@@ -419,61 +544,166 @@ void ConnectionPool::RemoveDeadConnectionsFromDeque(
 }
 
 
-unique_ptr<ConnectionPool::Connection> ConnectionPool::Get(const URL& url) {
+unique_ptr<ConnectionPool::Connection> ConnectionPool::NewConnection(
+    bool https, HostPortPair&& key) {
+  // This EvConnection has a slightly complicated lifetime; it needs to hang
+  // around until libevhtp/libevent have entirely finished with the
+  // evhtp_connection_t it references, and for at least as long as the life
+  // of the Connection we return from this method.
+  //
+  // This is accomplished through the use of a couple of shared_ptrs;
+  // this one, which goes inside the returned Connection object, and another
+  // created further below which gets passed in to the
+  // ConnectionFinishedHook.
+  evhtp_connection_t* const ev_conn(
+      https ? base_->HttpsConnectionNew(key.first, key.second, ssl_ctx_.get())
+            : base_->HttpConnectionNew(key.first, key.second));
+  if (https && FLAGS_connection_pool_tls_session_resumption) {
+    // Try to resume the last session with this host:port, to save a
+    // full handshake. SSL_set_session() takes its own reference, and
+    // the handshake only starts once the socket is connected.
+    lock_guard<mutex> lock(sessions_lock_);
+    const auto it(sessions_.find(key));
+    if (it != sessions_.end()) {
+      CHECK_EQ(1, SSL_set_session(CHECK_NOTNULL(ev_conn->ssl),
+                                  it->second.get()));
+    }
+  }
+  auto conn(std::make_shared<EvConnection>(ev_conn, move(key)));
+  unique_ptr<ConnectionPool::Connection> handle(new Connection(conn));
+  struct timeval read_timeout = {FLAGS_connection_read_timeout_seconds,
+                                 kZeroMillis};
+  struct timeval write_timeout = {FLAGS_connection_write_timeout_seconds,
+                                  kZeroMillis};
+  evhtp_connection_set_timeouts(handle->connection(), &read_timeout,
+                                &write_timeout);
+  evhtp_set_hook(&handle->connection()->hooks, evhtp_hook_on_conn_error,
+                 reinterpret_cast<evhtp_hook>(
+                     EvConnection::ConnectionErrorHook),
+                 reinterpret_cast<void*>(conn.get()));
+  evhtp_set_hook(
+      &handle->connection()->hooks, evhtp_hook_on_connection_fini,
+      reinterpret_cast<evhtp_hook>(EvConnection::ConnectionFinishedHook),
+      // We'll hold on to another shared_ptr to the Connection
+      // until evhtp tells us that it's finished with the cnxn.
+      reinterpret_cast<void*>(new shared_ptr<EvConnection>(conn)));
+  return handle;
+}
+
+
+// static
+void ConnectionPool::PruneIdleConnections(const unique_lock<mutex>& lock,
+                                          const string& hostport,
+                                          Host* host) {
+  CHECK(lock.owns_lock());
+  const system_clock::time_point cutoff(
+      system_clock::now() -
+      seconds(FLAGS_connection_pool_max_unused_age_seconds));
+  RemoveDeadConnectionsFromDeque(lock, &host->conns);
+  while (host->conns.size() >
+             static_cast<uint>(FLAGS_url_fetcher_max_conn_per_host_port) &&
+         host->conns.front().first < cutoff) {
+    host->conns.pop_front();
+  }
+  VLOG(1) << "ConnectionPool for " << hostport
+          << " size : " << host->conns.size();
+  connections_per_host_port->Set(hostport, host->conns.size());
+}
+
+
+ConnectionPool::Host* ConnectionPool::GetHost(const HostPortPair& key) {
+  {
+    SharedLock lock(&hosts_lock_);
+    const auto it(hosts_.find(key));
+    if (it != hosts_.end()) {
+      return it->second.get();
+    }
+  }
+
+  lock_guard<SharedMutex> lock(hosts_lock_);
+  unique_ptr<Host>& host(hosts_[key]);
+  if (!host) {
+    host.reset(new Host);
+  }
+  return host.get();
+}
+
+
+void ConnectionPool::Get(const URL& url, unique_ptr<Connection>* conn,
+                         Task* task) {
   CHECK(url.Protocol() == "http" || url.Protocol() == "https");
   const uint16_t default_port(url.Protocol() == "https" ? 443 : 80);
-  HostPortPair key(url.Host(), url.Port() != 0 ? url.Port() : default_port);
-  unique_lock<mutex> lock(lock_);
+  const HostPortPair key(url.Host(),
+                         url.Port() != 0 ? url.Port() : default_port);
+  const string hostport(HostPortString(key));
+  Host* const host(GetHost(key));
+  unique_lock<mutex> lock(host->lock);
+  host->https = url.Protocol() == "https";
+
+  CHECK_GE(FLAGS_connection_pool_max_active_per_host_port, 0);
+  if (FLAGS_connection_pool_max_active_per_host_port > 0 &&
+      host->active >= FLAGS_connection_pool_max_active_per_host_port) {
+    VLOG(1) << "waiting for a connection to " << hostport;
+    connection_waits->Increment(hostport);
+    Waiter* const waiter(new Waiter(url, conn, task));
+    task->DeleteWhenDone(waiter);
+    // Before it can be handed a connection, which may finish |task|.
+    task->WhenCancelled(bind(&ConnectionPool::CancelWait, host, waiter));
+    host->waiters.push_back(waiter);
+    return;
+  }
+  ++host->active;
+  active_connections_per_host_port->Set(hostport, host->active);
+  lock.unlock();
+
+  TakeConnection(url, conn, task);
+}
 
-  auto it(conns_.find(key));
 
-  if (it != conns_.end() && !it->second.empty()) {
-    RemoveDeadConnectionsFromDeque(lock, &it->second);
+void ConnectionPool::TakeConnection(const URL& url,
+                                    unique_ptr<Connection>* conn,
+                                    Task* task) {
+  const uint16_t default_port(url.Protocol() == "https" ? 443 : 80);
+  HostPortPair key(url.Host(), url.Port() != 0 ? url.Port() : default_port);
+  const string hostport(HostPortString(key));
+  Host* const host(GetHost(key));
+  unique_lock<mutex> lock(host->lock);
+
+  if (!host->conns.empty()) {
+    RemoveDeadConnectionsFromDeque(lock, &host->conns);
   }
 
-  if (it == conns_.end() || it->second.empty()) {
-    VLOG(1) << "new evhtp_connection for " << key.first << ":" << key.second;
-    // This EvConnection has a slightly complicated lifetime; it needs to hang
-    // around until libevhtp/libevent have entirely finished with the
-    // evhtp_connection_t it references, and for at least as long as the life
-    // of the Connection we return from this method.
-    //
-    // This is accomplished through the use of a couple of shared_ptrs;
-    // this one, which goes inside the returned Connection object, and another
-    // created further below which gets passed in to the
-    // ConnectionFinishedHook.
-    auto conn(std::make_shared<EvConnection>(
-        url.Protocol() == "https"
-            ? base_->HttpsConnectionNew(key.first, key.second, ssl_ctx_.get())
-            : base_->HttpConnectionNew(key.first, key.second),
-        move(key)));
-    unique_ptr<ConnectionPool::Connection> handle(new Connection(conn));
-    struct timeval read_timeout = {FLAGS_connection_read_timeout_seconds,
-                                   kZeroMillis};
-    struct timeval write_timeout = {FLAGS_connection_write_timeout_seconds,
-                                    kZeroMillis};
-    evhtp_connection_set_timeouts(handle->connection(), &read_timeout,
-                                  &write_timeout);
-    evhtp_set_hook(&handle->connection()->hooks, evhtp_hook_on_conn_error,
-                   reinterpret_cast<evhtp_hook>(
-                       EvConnection::ConnectionErrorHook),
-                   reinterpret_cast<void*>(conn.get()));
-    evhtp_set_hook(
-        &handle->connection()->hooks, evhtp_hook_on_connection_fini,
-        reinterpret_cast<evhtp_hook>(EvConnection::ConnectionFinishedHook),
-        // We'll hold on to another shared_ptr to the Connection
-        // until evhtp tells us that it's finished with the cnxn.
-        reinterpret_cast<void*>(new shared_ptr<EvConnection>(conn)));
-    return handle;
+  if (host->conns.empty()) {
+    lock.unlock();
+    VLOG(1) << "new evhtp_connection for " << hostport;
+    connections_opened->Increment(hostport);
+    *conn = NewConnection(url.Protocol() == "https", move(key));
+    task->Return();
+    return;
   }
 
-  VLOG(1) << "cached evhtp_connection for " << key.first << ":" << key.second;
-  unique_ptr<ConnectionPool::Connection> retval(
-      move(it->second.back().second));
-  it->second.pop_back();
-  CHECK_NOTNULL(retval->connection());
+  VLOG(1) << "cached evhtp_connection for " << hostport;
+  connections_reused->Increment(hostport);
+  *conn = move(host->conns.back().second);
+  host->conns.pop_back();
+  CHECK_NOTNULL((*conn)->connection());
+  lock.unlock();
 
-  return retval;
+  task->Return();
+}
+
+
+// static
+void ConnectionPool::CancelWait(Host* host, Waiter* waiter) {
+  unique_lock<mutex> lock(host->lock);
+  const auto it(find(host->waiters.begin(), host->waiters.end(), waiter));
+  if (it == host->waiters.end()) {
+    return;
+  }
+  host->waiters.erase(it);
+  lock.unlock();
+
+  waiter->task->Return(Status::CANCELLED);
 }
 
 
@@ -483,56 +713,116 @@ void ConnectionPool::Put(unique_ptr<ConnectionPool::Connection> handle) {
     return;
   }
 
+  const HostPortPair key(handle->other_end());
+  const string hostport(HostPortString(key));
+  Host* const host(GetHost(key));
+  unique_lock<mutex> lock(host->lock);
+  CHECK_GT(host->active, 0);
+  --host->active;
+
   if (!handle->connection()) {
     VLOG(1) << "returned dead Connection";
     handle.reset();
-    return;
-  }
-
-  if (handle->GetErrored()) {
+  } else if (handle->GetErrored()) {
     VLOG(1) << "returned errored Connection";
     handle.reset();
-    return;
+  } else {
+    VLOG(1) << "returned Connection for " << hostport;
+    CHECK_GE(FLAGS_url_fetcher_max_conn_per_host_port, 0);
+    host->conns.emplace_back(make_pair(system_clock::now(), move(handle)));
+    // Only this host's connections need looking at, so it is cheap
+    // enough to do right away, rather than on the event loop for all
+    // of them.
+    if (host->conns.size() >
+        static_cast<uint>(FLAGS_url_fetcher_max_conn_per_host_port)) {
+      PruneIdleConnections(lock, hostport, host);
+    } else {
+      VLOG(1) << "ConnectionPool for " << hostport
+              << " size : " << host->conns.size();
+      connections_per_host_port->Set(hostport, host->conns.size());
+    }
   }
 
-  const HostPortPair& key(handle->other_end());
-  VLOG(1) << "returned Connection for " << key.first << ":" << key.second;
-  lock_guard<mutex> lock(lock_);
-  auto& entry(conns_[key]);
+  // The slot just freed up goes to the first in line (more than one,
+  // if the limit was raised meanwhile), which then most likely reuses
+  // the connection just put back.
+  vector<Waiter*> cancelled;
+  vector<Waiter*> handed;
+  while (!host->waiters.empty() &&
+         (FLAGS_connection_pool_max_active_per_host_port <= 0 ||
+          host->active < FLAGS_connection_pool_max_active_per_host_port)) {
+    Waiter* const waiter(host->waiters.front());
+    host->waiters.pop_front();
+    if (waiter->task->CancelRequested()) {
+      cancelled.push_back(waiter);
+      continue;
+    }
+    ++host->active;
+    handed.push_back(waiter);
+  }
+  active_connections_per_host_port->Set(hostport, host->active);
+  lock.unlock();
 
-  CHECK_GE(FLAGS_url_fetcher_max_conn_per_host_port, 0);
-  entry.emplace_back(make_pair(system_clock::now(), move(handle)));
-  const string hostport(HostPortString(key));
-  VLOG(1) << "ConnectionPool for " << hostport << " size : " << entry.size();
-  connections_per_host_port->Set(hostport, entry.size());
-  if (!cleanup_scheduled_ &&
-      entry.size() >
-          static_cast<uint>(FLAGS_url_fetcher_max_conn_per_host_port)) {
-    cleanup_scheduled_ = true;
-    base_->Add(bind(&ConnectionPool::Cleanup, this));
+  for (Waiter* const waiter : cancelled) {
+    waiter->task->Return(Status::CANCELLED);
+  }
+  for (Waiter* const waiter : handed) {
+    connection_wait_ms.RecordLatency(hostport,
+                                     steady_clock::now() - waiter->queued_at);
+    // This is probably on the libevent dispatch thread, which must not
+    // block opening a connection.
+    waiter->task->executor()->Add(bind(&ConnectionPool::TakeConnection,
+                                       this, waiter->url, waiter->conn,
+                                       waiter->task));
   }
 }
 
 
-void ConnectionPool::Cleanup() {
-  unique_lock<mutex> lock(lock_);
-  cleanup_scheduled_ = false;
-  const system_clock::time_point cutoff(
-      system_clock::now() -
-      seconds(FLAGS_connection_pool_max_unused_age_seconds));
+void ConnectionPool::PrewarmLoop() {
+  unique_lock<mutex> shutdown_lock(shutdown_lock_);
+  while (!shutdown_cv_.wait_for(
+      shutdown_lock, seconds(FLAGS_connection_pool_prewarm_interval_seconds),
+      [this]() { return shutdown_; })) {
+    const size_t min_idle(
+        min(FLAGS_connection_pool_min_idle_per_host_port,
+            FLAGS_url_fetcher_max_conn_per_host_port));
+    vector<pair<HostPortPair, Host*>> hosts;
+    {
+      SharedLock lock(&hosts_lock_);
+      for (const auto& host : hosts_) {
+        hosts.emplace_back(host.first, host.second.get());
+      }
+    }
 
-  // conns_ is a std::map<HostPortPair, std::deque<TimestampedConnection>>
-  for (auto& entry : conns_) {
-    RemoveDeadConnectionsFromDeque(lock, &entry.second);
-    while (entry.second.front().first < cutoff &&
-           entry.second.size() >
-               static_cast<uint>(FLAGS_url_fetcher_max_conn_per_host_port)) {
-      entry.second.pop_front();
+    // Opening connections might block on DNS resolution, don't hold
+    // up anybody else meanwhile.
+    for (auto& host : hosts) {
+      unique_lock<mutex> lock(host.second->lock);
+      RemoveDeadConnectionsFromDeque(lock, &host.second->conns);
+      const size_t missing(min_idle > host.second->conns.size()
+                               ? min_idle - host.second->conns.size()
+                               : 0);
+      const bool https(host.second->https);
+      lock.unlock();
+
+      const string hostport(HostPortString(host.first));
+      vector<unique_ptr<Connection>> opened;
+      for (size_t i = 0; i < missing; ++i) {
+        VLOG(1) << "pre-warming a connection to " << hostport;
+        connections_prewarmed->Increment(hostport);
+        opened.emplace_back(NewConnection(https, HostPortPair(host.first)));
+      }
+      if (opened.empty()) {
+        continue;
+      }
+
+      lock.lock();
+      for (auto& conn : opened) {
+        host.second->conns.emplace_back(
+            make_pair(system_clock::now(), move(conn)));
+      }
+      connections_per_host_port->Set(hostport, host.second->conns.size());
     }
-    const string hostport(HostPortString(entry.first));
-    VLOG(1) << "ConnectionPool for " << hostport
-            << " size : " << entry.second.size();
-    connections_per_host_port->Set(hostport, entry.second.size());
   }
 }
 
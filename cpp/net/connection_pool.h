@@ -3,15 +3,20 @@
 
 #include <openssl/ssl.h>
 #include <stdint.h>
+#include <condition_variable>
 #include <deque>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <thread>
 
 #include "base/macros.h"
 #include "net/url.h"
+#include "util/openssl_scoped_ssl_types.h"
 #include "util/libevent_wrapper.h"
+#include "util/shared_mutex.h"
+#include "util/task.h"
 
 namespace cert_trans {
 
@@ -60,30 +65,81 @@ class ConnectionPool {
   };
 
   ConnectionPool(libevent::Base* base);
-
-  std::unique_ptr<Connection> Get(const URL& url);
+  ~ConnectionPool();
+
+  // Gets a connection to the host and port of |url| into |*conn|,
+  // reusing an idle one if possible, and returns |task|. Once
+  // --connection_pool_max_active_per_host_port connections to that
+  // host:port are handed out, |task| waits in line for one of them to
+  // be put back, without holding up the caller, and cancelling it
+  // gives up its place. Opening a connection can block on DNS
+  // resolution, so neither the caller nor the executor of |task| may
+  // be the libevent dispatch thread.
+  void Get(const URL& url, std::unique_ptr<Connection>* conn,
+           util::Task* task);
+  // Every connection returned by Get() must be handed back here once
+  // its request is done, even if it failed.
   void Put(std::unique_ptr<Connection> conn);
 
  private:
   typedef std::pair<std::chrono::system_clock::time_point,
                     std::unique_ptr<Connection>> TimestampedConnection;
+  // The connections to a host:port, with their own lock, so that the
+  // requests to different hosts do not contend with each other.
+  struct Host;
+  // A Get() waiting for a connection to be put back.
+  struct Waiter;
 
   static void RemoveDeadConnectionsFromDeque(
       const std::unique_lock<std::mutex>& lock,
       std::deque<TimestampedConnection>* deque);
-
-  void Cleanup();
+  // Drops the idle connections to |host| in excess of
+  // --url_fetcher_max_conn_per_host_port that have been unused for
+  // long enough.
+  static void PruneIdleConnections(const std::unique_lock<std::mutex>& lock,
+                                   const std::string& hostport, Host* host);
+
+  // Returns the Host for |key|, which is never deleted, creating it if
+  // needed.
+  Host* GetHost(const HostPortPair& key);
+
+  // Does the rest of Get(), once the connection is counted as handed
+  // out.
+  void TakeConnection(const URL& url, std::unique_ptr<Connection>* conn,
+                      util::Task* task);
+  // Takes |waiter| out of the line for |host|, unless Put() has handed
+  // it a connection already.
+  static void CancelWait(Host* host, Waiter* waiter);
+
+  std::unique_ptr<Connection> NewConnection(bool https, HostPortPair&& key);
+
+  // Called by OpenSSL when a TLS session is established, to keep it
+  // for resuming later.
+  static int NewSessionCallback(SSL* ssl, SSL_SESSION* session);
+
+  // Keeps --connection_pool_min_idle_per_host_port connections open
+  // to the hosts in |hosts_|, until |shutdown_| is set.
+  void PrewarmLoop();
 
   libevent::Base* const base_;
 
-  std::mutex lock_;
-  // We get and put connections from the back of the deque, and when
-  // there are too many, we prune them from the front (LIFO).
-  std::map<HostPortPair, std::deque<TimestampedConnection>> conns_;
-  bool cleanup_scheduled_;
+  // Only held to find or add a Host, every host:port we were asked for
+  // so far.
+  SharedMutex hosts_lock_;
+  std::map<HostPortPair, std::unique_ptr<Host>> hosts_;
+
+  std::mutex shutdown_lock_;
+  std::condition_variable shutdown_cv_;
+  bool shutdown_;
 
   std::unique_ptr<evhtp_ssl_ctx_t, void (*)(evhtp_ssl_ctx_t*)> ssl_ctx_;
 
+  std::mutex sessions_lock_;
+  // The last TLS session with each host:port.
+  std::map<HostPortPair, ScopedSSL_SESSION> sessions_;
+
+  std::thread prewarm_thread_;
+
   DISALLOW_COPY_AND_ASSIGN(ConnectionPool);
 };
 
@@ -5,19 +5,28 @@
 #include <evhtp.h>
 #include <glog/logging.h>
 #include <htparse.h>
+#include <algorithm>
+#include <vector>
 
+#include "monitoring/trace.h"
 #include "net/connection_pool.h"
 #include "util/thread_pool.h"
 
 using cert_trans::internal::ConnectionPool;
 using std::bind;
+using std::chrono::steady_clock;
 using std::endl;
 using std::make_pair;
+using std::make_shared;
+using std::max;
 using std::move;
 using std::ostream;
+using std::placeholders::_1;
+using std::shared_ptr;
 using std::string;
 using std::to_string;
 using std::unique_ptr;
+using std::vector;
 using util::Status;
 using util::Task;
 using util::TaskHold;
@@ -60,8 +69,21 @@ htp_method VerbToCmdType(UrlFetcher::Verb verb) {
 }
 
 
+// The state of pausing reads for Response::on_body, which can
+// outlive the State, as the resume callback can be called at any
+// time. Only accessed on the libevent dispatch thread.
+struct ReadPause {
+  ReadPause() : conn(nullptr), paused(false) {
+  }
+
+  // Set while the request is in flight.
+  evhtp_connection_t* conn;
+  bool paused;
+};
+
+
 struct State {
-  State(libevent::Base* base, ConnectionPool* pool,
+  State(libevent::Base* base, ThreadPool* thread_pool, ConnectionPool* pool,
         const UrlFetcher::Request& request, UrlFetcher::Response* response,
         Task* task);
 
@@ -70,19 +92,31 @@ struct State {
   }
 
   void MakeRequest();
+  void ConnectionReady(Task* get_task);
 
   // The following methods must only be called on the libevent
   // dispatch thread.
   void RunRequest();
+  void HeadersDone(evhtp_request_t* req);
+  void BodyRead(evbuffer* data);
   void RequestDone(evhtp_request_t* req);
+  // Returns |status| on the task, closing the connection if the
+  // request is in flight, unless the task was returned already.
+  void Abort(const Status& status);
+  void DeadlineReached(Task* timer);
 
   libevent::Base* const base_;
+  ThreadPool* const thread_pool_;
   ConnectionPool* const pool_;
   const UrlFetcher::Request request_;
   UrlFetcher::Response* const response_;
   Task* const task_;
+  // Lasts until the task is done, when this object is deleted.
+  AsyncSpan span_;
 
   unique_ptr<ConnectionPool::Connection> conn_;
+  bool headers_done_;
+  const shared_ptr<ReadPause> pause_;
 };
 
 
@@ -91,6 +125,36 @@ void RequestCallback(evhtp_request_t* req, void* userdata) {
 }
 
 
+evhtp_res HeadersHook(evhtp_request_t* req, evhtp_headers_t* headers,
+                      void* userdata) {
+  static_cast<State*>(CHECK_NOTNULL(userdata))->HeadersDone(req);
+  return EVHTP_RES_OK;
+}
+
+
+evhtp_res BodyHook(evhtp_request_t* req, evbuffer* data, void* userdata) {
+  static_cast<State*>(CHECK_NOTNULL(userdata))->BodyRead(data);
+  return EVHTP_RES_OK;
+}
+
+
+void ResumeReading(const shared_ptr<ReadPause>& pause) {
+  CHECK(libevent::Base::OnEventThread());
+  if (pause->paused && pause->conn) {
+    evhtp_connection_resume(pause->conn);
+  }
+  pause->paused = false;
+}
+
+
+void CopyHeaders(evhtp_headers_t* in, UrlFetcher::Headers* out) {
+  out->clear();
+  for (evhtp_kv_s* ptr = in->tqh_first; ptr; ptr = ptr->next.tqe_next) {
+    out->insert(make_pair(ptr->key, ptr->val));
+  }
+}
+
+
 UrlFetcher::Request NormaliseRequest(UrlFetcher::Request req) {
   if (req.url.Path().empty()) {
     req.url.SetPath("/");
@@ -104,14 +168,21 @@ UrlFetcher::Request NormaliseRequest(UrlFetcher::Request req) {
 }
 
 
-State::State(libevent::Base* base, ConnectionPool* pool,
-             const UrlFetcher::Request& request,
+State::State(libevent::Base* base, ThreadPool* thread_pool,
+             ConnectionPool* pool, const UrlFetcher::Request& request,
              UrlFetcher::Response* response, Task* task)
     : base_(CHECK_NOTNULL(base)),
+      thread_pool_(CHECK_NOTNULL(thread_pool)),
       pool_(CHECK_NOTNULL(pool)),
       request_(NormaliseRequest(request)),
       response_(CHECK_NOTNULL(response)),
-      task_(CHECK_NOTNULL(task)) {
+      task_(CHECK_NOTNULL(task)),
+      span_("url_fetch"),
+      headers_done_(false),
+      pause_(make_shared<ReadPause>()) {
+  if (span_.sampled()) {
+    span_.AddTag("url", request_.url.Host() + request_.url.Path());
+  }
   if (request_.url.Protocol() != "http" &&
       request_.url.Protocol() != "https") {
     VLOG(1) << "unsupported protocol: " << request_.url.Protocol();
@@ -125,15 +196,47 @@ State::State(libevent::Base* base, ConnectionPool* pool,
 
 void State::MakeRequest() {
   CHECK(!libevent::Base::OnEventThread());
-  conn_ = pool_->Get(request_.url);
+  // Aborted already, no need to wait for a connection.
+  if (!task_->IsActive()) {
+    base_->Add(bind(&State::RunRequest, this));
+    return;
+  }
+  // Cancelled along with |task_|, or when it is aborted, should it
+  // have to wait for a connection.
+  pool_->Get(request_.url, &conn_,
+             task_->AddChildWithExecutor(
+                 bind(&State::ConnectionReady, this, _1), thread_pool_));
+}
+
+
+void State::ConnectionReady(Task* get_task) {
+  // |conn_| is only set if |get_task| succeeded, otherwise |task_|
+  // is no longer active, which RunRequest() deals with.
   base_->Add(bind(&State::RunRequest, this));
 }
 
 
 void State::RunRequest() {
   CHECK(libevent::Base::OnEventThread());
+  // Takes over the hold from UrlFetcher::Fetch(), which kept us around
+  // in case the task was aborted before getting here.
+  TaskHold hold(task_);
+  task_->RemoveHold();
+  if (!task_->IsActive()) {
+    pool_->Put(move(conn_));
+    return;
+  }
+
   evhtp_request_t* const http_req(
       CHECK_NOTNULL(evhtp_request_new(&RequestCallback, this)));
+  if (response_->on_headers) {
+    evhtp_set_hook(&http_req->hooks, evhtp_hook_on_headers,
+                   reinterpret_cast<evhtp_hook>(&HeadersHook), this);
+  }
+  if (response_->on_body) {
+    evhtp_set_hook(&http_req->hooks, evhtp_hook_on_read,
+                   reinterpret_cast<evhtp_hook>(&BodyHook), this);
+  }
   if (!request_.body.empty() &&
       request_.headers.find("Content-Length") == request_.headers.end()) {
     evhtp_headers_add_header(
@@ -148,7 +251,9 @@ void State::RunRequest() {
   }
 
   if (!conn_->connection() || conn_->GetErrored()) {
-    conn_.reset();
+    // The pool will drop it, but still needs to know it is no longer
+    // in use.
+    pool_->Put(move(conn_));
     task_->Return(Status(util::error::UNAVAILABLE, "connection failed."));
     return;
   }
@@ -167,6 +272,7 @@ void State::RunRequest() {
     task_->Return(Status(util::error::INTERNAL, "evhtp_make_request error"));
     return;
   }
+  pause_->conn = conn_->connection();
 
   // evhtp_make_request doesn't know anything about the body, so we send it
   // outselves here:
@@ -191,9 +297,40 @@ struct evhtp_request_deleter {
 };
 
 
+void State::HeadersDone(evhtp_request_t* req) {
+  CHECK(libevent::Base::OnEventThread());
+  // Unlike in RequestDone(), the status is not in |req| yet.
+  response_->status_code = htparser_get_status(req->conn->parser);
+  CopyHeaders(req->headers_in, &response_->headers);
+  headers_done_ = true;
+  response_->on_headers();
+}
+
+
+void State::BodyRead(evbuffer* data) {
+  CHECK(libevent::Base::OnEventThread());
+  libevent::Base* const base(base_);
+  const shared_ptr<ReadPause> pause(pause_);
+  if (!response_->on_body(data, [base, pause]() {
+        base->Add(bind(&ResumeReading, pause));
+      }) &&
+      !pause_->paused) {
+    // Whatever evhtp has already read will still come through.
+    evhtp_connection_pause(CHECK_NOTNULL(pause_->conn));
+    pause_->paused = true;
+  }
+  // Whatever was left in there would otherwise accumulate in the
+  // request.
+  CHECK_EQ(0, evbuffer_drain(data, evbuffer_get_length(data)));
+}
+
+
 void State::RequestDone(evhtp_request_t* req) {
   CHECK(libevent::Base::OnEventThread());
   CHECK(conn_);
+  // The connection cannot go back to the pool paused.
+  ResumeReading(pause_);
+  pause_->conn = nullptr;
   this->pool_->Put(move(conn_));
   unique_ptr<evhtp_request_t, evhtp_request_deleter> req_deleter(req);
 
@@ -209,10 +346,10 @@ void State::RequestDone(evhtp_request_t* req) {
     return;
   }
 
-  response_->status_code = req->status;
-  if (response_->status_code < 100) {
+  if (req->status < 100) {
+    response_->status_code = req->status;
     util::Status status;
-    switch (response_->status_code) {
+    switch (req->status) {
       case kTimeout:
         status =
             Status(util::error::DEADLINE_EXCEEDED, "connection timed out");
@@ -234,17 +371,29 @@ void State::RequestDone(evhtp_request_t* req) {
     return;
   }
 
-  response_->headers.clear();
-  for (evhtp_kv_s* ptr = req->headers_in->tqh_first; ptr;
-       ptr = ptr->next.tqe_next) {
-    response_->headers.insert(make_pair(ptr->key, ptr->val));
+  if (!headers_done_) {
+    response_->status_code = req->status;
+    CopyHeaders(req->headers_in, &response_->headers);
+  }
+
+  if (response_->on_body) {
+    VLOG(2) << "status_code: " << response_->status_code << " (streamed)";
+    task_->Return();
+    return;
   }
 
-  const size_t body_length(evbuffer_get_length(req->buffer_in));
-  string body(reinterpret_cast<const char*>(
-                  evbuffer_pullup(req->buffer_in, body_length)),
-              body_length);
-  response_->body.swap(body);
+  // Bodies can be megabytes, so copy them straight out of the chains
+  // of the evbuffer, rather than having it make them contiguous first.
+  const int num_chains(evbuffer_peek(req->buffer_in, -1, NULL, NULL, 0));
+  vector<evbuffer_iovec> chains(max(num_chains, 0));
+  CHECK_EQ(num_chains, evbuffer_peek(req->buffer_in, -1, NULL, chains.data(),
+                                     chains.size()));
+  response_->body.clear();
+  response_->body.reserve(evbuffer_get_length(req->buffer_in));
+  for (const evbuffer_iovec& chain : chains) {
+    response_->body.append(static_cast<const char*>(chain.iov_base),
+                           chain.iov_len);
+  }
 
   VLOG(2) << *response_;
 
@@ -252,6 +401,35 @@ void State::RequestDone(evhtp_request_t* req) {
 }
 
 
+void State::Abort(const Status& status) {
+  CHECK(libevent::Base::OnEventThread());
+  if (!task_->IsActive()) {
+    return;
+  }
+
+  if (pause_->conn) {
+    // The request is in flight, evhtp frees it along with the
+    // connection, without calling RequestDone(). Otherwise,
+    // RunRequest() has yet to run, and hands back the connection.
+    evhtp_connection_t* const conn(pause_->conn);
+    pause_->conn = nullptr;
+    evhtp_connection_free(conn);
+    this->pool_->Put(move(conn_));
+  }
+  VLOG(1) << "aborting fetch of " << request_.url.Host()
+          << request_.url.PathQuery() << ": " << status;
+  task_->Return(status);
+}
+
+
+void State::DeadlineReached(Task* timer) {
+  // The timer is cancelled once the task is returned.
+  if (timer->status().ok()) {
+    Abort(Status(util::error::DEADLINE_EXCEEDED, "fetch deadline exceeded"));
+  }
+}
+
+
 }  // namespace
 
 
@@ -273,13 +451,35 @@ UrlFetcher::~UrlFetcher() {
 void UrlFetcher::Fetch(const Request& req, Response* resp, Task* task) {
   TaskHold hold(task);
 
-  State* const state(new State(impl_->base_, &impl_->pool_, req, resp, task));
+  State* const state(new State(impl_->base_, impl_->thread_pool_,
+                               &impl_->pool_, req, resp, task));
   task->DeleteWhenDone(state);
+  if (!task->IsActive()) {
+    // Bad request.
+    return;
+  }
+
+  libevent::Base* const base(impl_->base_);
+  if (req.deadline != steady_clock::time_point::max()) {
+    base->Delay(req.deadline - steady_clock::now(),
+                task->AddChildWithExecutor(
+                    bind(&State::DeadlineReached, state, _1), base));
+  }
+  // Aborted on the event thread, as RequestDone() would be.
+  task->WhenCancelled([state, task, base]() {
+    task->AddChildWithExecutor([state](Task*) {
+                                 state->Abort(Status::CANCELLED);
+                               },
+                               base)
+        ->Return();
+  });
 
   // Run State::MakeRequest() on the task's executor because it may
   // block doing DNS resolution etc.
   // TODO(alcutter): this can go back to being put straight on the event Base
   // once evhtp supports creating SSL connections to a DNS name.
+  // Released by State::RunRequest().
+  task->AddHold();
   impl_->thread_pool_->Add(bind(&State::MakeRequest, state));
 }
 
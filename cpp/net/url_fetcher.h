@@ -2,6 +2,7 @@
 #define CERT_TRANS_NET_URL_FETCHER_H_
 
 #include <chrono>
+#include <functional>
 #include <map>
 #include <memory>
 #include <ostream>
@@ -12,6 +13,8 @@
 #include "util/compare.h"
 #include "util/task.h"
 
+struct evbuffer;
+
 namespace cert_trans {
 
 namespace libevent {
@@ -34,15 +37,24 @@ class UrlFetcher {
   };
 
   struct Request {
-    Request() : verb(Verb::GET) {
+    Request()
+        : verb(Verb::GET),
+          deadline(std::chrono::steady_clock::time_point::max()) {
     }
-    Request(const URL& input_url) : verb(Verb::GET), url(input_url) {
+    Request(const URL& input_url)
+        : verb(Verb::GET),
+          url(input_url),
+          deadline(std::chrono::steady_clock::time_point::max()) {
     }
 
     Verb verb;
     URL url;
     Headers headers;
     std::string body;
+    // If the fetch is not done by then, it fails with
+    // DEADLINE_EXCEEDED, and its connection is closed. The default is
+    // to rely on the connection timeouts only.
+    std::chrono::steady_clock::time_point deadline;
   };
 
   struct Response {
@@ -52,6 +64,21 @@ class UrlFetcher {
     int status_code;
     Headers headers;
     std::string body;
+
+    // The following are optional, to act on the response as it
+    // arrives rather than once it is complete. They are called on the
+    // event thread of the fetcher, and must not block.
+
+    // Called once |status_code| and |headers| are filled in, before
+    // any of the body.
+    std::function<void()> on_headers;
+    // If set, the body is handed to this as it arrives, instead of
+    // being accumulated in |body|. It should take what it wants out
+    // of |data| (evbuffer_add_buffer() does so without copying).
+    // Returning false stops reading from the server until |resume| is
+    // called, from any thread, even after the fetch is done.
+    std::function<bool(evbuffer* data, const std::function<void()>& resume)>
+        on_body;
   };
 
   UrlFetcher(libevent::Base* base, ThreadPool* thread_pool);
@@ -61,6 +88,9 @@ class UrlFetcher {
   // undefined state. If it is OK, it only means that the transaction
   // with the remote server went correctly, you should still check
   // Response::status_code.
+  //
+  // Cancelling |task| aborts the fetch, which then fails with
+  // CANCELLED.
   virtual void Fetch(const Request& req, Response* resp, util::Task* task);
 
  protected:
@@ -4,11 +4,15 @@
 #ifdef HAVE_ARPA_NAMESER_H
 #include <arpa/nameser.h> /* DNS HEADER struct */
 #endif
+#include <event2/buffer.h>
 #include <fcntl.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <gtest/gtest.h>
+#include <chrono>
 #include <csignal>
+#include <functional>
+#include <mutex>
 #ifdef HAVE_NETDB_H
 #include <netdb.h>
 #endif
@@ -20,13 +24,18 @@
 #include <sys/types.h>
 #endif
 #include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <thread>
+#include <vector>
 #ifdef HAVE_VFORK_H
 #include <vfork.h>
 #endif
 
+#include "base/notification.h"
 #include "net/connection_pool.h"
 #include "net/url_fetcher.h"
 #include "util/libevent_wrapper.h"
@@ -35,17 +44,25 @@
 #include "util/testing.h"
 #include "util/thread_pool.h"
 
+DECLARE_int32(connection_pool_max_active_per_host_port);
 DECLARE_int32(connection_read_timeout_seconds);
 DECLARE_int32(connection_write_timeout_seconds);
 DECLARE_string(trusted_root_certs);
 
 namespace cert_trans {
 
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::function;
+using std::lock_guard;
 using std::make_shared;
+using std::mutex;
 using std::shared_ptr;
 using std::string;
+using std::thread;
 using std::to_string;
 using std::unique_ptr;
+using std::vector;
 using util::SyncTask;
 using util::testing::StatusIs;
 
@@ -60,6 +77,7 @@ const uint16_t kBinkyExampleComPort = 4436;
 const uint16_t kExampleComPort = 4437;
 const uint16_t k127_0_0_1Port = 4438;
 const uint16_t kHangPort = 4439;
+const uint16_t kScriptedPort = 4440;
 
 
 namespace {
@@ -99,6 +117,133 @@ pid_t RunOpenSSLServer(uint16_t port, const std::string& cert_file,
 }
 
 
+// Writes all of |data| to |fd|.
+void Send(int fd, const string& data) {
+  PCHECK(write(fd, data.data(), data.size()) ==
+         static_cast<ssize_t>(data.size()));
+}
+
+
+// Moves what is in |data| to the end of |out|.
+void Append(evbuffer* data, string* out) {
+  const size_t length(evbuffer_get_length(data));
+  const size_t offset(out->size());
+  out->resize(offset + length);
+  CHECK_EQ(static_cast<int>(length),
+           evbuffer_remove(data, &(*out)[offset], length));
+}
+
+
+// A plain HTTP server on localhost, whose replies are written out by
+// hand, so that tests can control how a response arrives.
+class ScriptedServer {
+ public:
+  // Called on a thread of the server for each request, once its
+  // headers are read (request bodies are not supported), to write the
+  // reply to |fd|. Returns whether to keep the connection open for
+  // more requests.
+  typedef function<bool(int fd)> Handler;
+
+  ScriptedServer(uint16_t port, const Handler& handler)
+      : handler_(handler),
+        listen_fd_(socket(AF_INET, SOCK_STREAM, 0)),
+        stopping_(false),
+        connections_(0) {
+    PCHECK(listen_fd_ >= 0);
+    const int one(1);
+    PCHECK(setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one,
+                      sizeof(one)) == 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    PCHECK(bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr),
+                sizeof(addr)) == 0);
+    PCHECK(listen(listen_fd_, 10) == 0);
+    accept_thread_ = thread(&ScriptedServer::AcceptLoop, this);
+  }
+
+  ~ScriptedServer() {
+    {
+      lock_guard<mutex> lock(lock_);
+      stopping_ = true;
+      // Wakes up the threads blocked on them.
+      shutdown(listen_fd_, SHUT_RDWR);
+      for (int fd : fds_) {
+        shutdown(fd, SHUT_RDWR);
+      }
+    }
+    accept_thread_.join();
+    // No more get added once the accept thread is done.
+    for (thread& connection_thread : connection_threads_) {
+      connection_thread.join();
+    }
+    for (int fd : fds_) {
+      close(fd);
+    }
+    close(listen_fd_);
+  }
+
+  // The number of connections accepted so far.
+  int connections() {
+    lock_guard<mutex> lock(lock_);
+    return connections_;
+  }
+
+ private:
+  void AcceptLoop() {
+    while (true) {
+      const int fd(accept(listen_fd_, nullptr, nullptr));
+      if (fd < 0) {
+        return;
+      }
+      lock_guard<mutex> lock(lock_);
+      if (stopping_) {
+        close(fd);
+        return;
+      }
+      ++connections_;
+      fds_.push_back(fd);
+      connection_threads_.emplace_back(&ScriptedServer::Serve, this, fd);
+    }
+  }
+
+  void Serve(int fd) {
+    string received;
+    while (true) {
+      size_t end;
+      while ((end = received.find("\r\n\r\n")) == string::npos) {
+        char buf[4096];
+        const ssize_t len(read(fd, buf, sizeof(buf)));
+        if (len <= 0) {
+          return;
+        }
+        received.append(buf, len);
+      }
+      received.erase(0, end + 4);
+      if (!handler_(fd)) {
+        // Closed for good by the destructor.
+        shutdown(fd, SHUT_RDWR);
+        return;
+      }
+    }
+  }
+
+  const Handler handler_;
+  const int listen_fd_;
+  thread accept_thread_;
+
+  mutex lock_;
+  bool stopping_;
+  int connections_;
+  vector<int> fds_;
+  vector<thread> connection_threads_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScriptedServer);
+};
+
+
 }  // namespace
 
 
@@ -290,6 +435,263 @@ TEST_F(UrlFetcherTest, TestTimeout) {
 }
 
 
+TEST_F(UrlFetcherTest, TestDeadline) {
+  UrlFetcher::Request req(URL("http://localhost:" + to_string(kHangPort)));
+  req.deadline = std::chrono::steady_clock::now() + milliseconds(500);
+  UrlFetcher::Response resp;
+
+  // Well before the connection would time out.
+  FLAGS_connection_read_timeout_seconds = 60;
+  FLAGS_connection_write_timeout_seconds = 60;
+
+  const std::chrono::steady_clock::time_point start(
+      std::chrono::steady_clock::now());
+  SyncTask task(&pool_);
+  fetcher_->Fetch(req, &resp, task.task());
+  task.Wait();
+
+  EXPECT_THAT(task.status(), StatusIs(util::error::DEADLINE_EXCEEDED));
+  EXPECT_LT(std::chrono::steady_clock::now() - start, seconds(30));
+}
+
+
+TEST_F(UrlFetcherTest, TestCancel) {
+  UrlFetcher::Request req(URL("http://localhost:" + to_string(kHangPort)));
+  UrlFetcher::Response resp;
+
+  FLAGS_connection_read_timeout_seconds = 60;
+  FLAGS_connection_write_timeout_seconds = 60;
+
+  SyncTask task(&pool_);
+  fetcher_->Fetch(req, &resp, task.task());
+  std::this_thread::sleep_for(milliseconds(200));
+  task.Cancel();
+  task.Wait();
+
+  EXPECT_THAT(task.status(), StatusIs(util::error::CANCELLED));
+}
+
+
+TEST_F(UrlFetcherTest, TestOnHeadersBeforeBody) {
+  Notification headers_seen;
+  ScriptedServer server(kScriptedPort, [&headers_seen](int fd) {
+    Send(fd, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n");
+    // The body only goes out once the client has seen the headers.
+    headers_seen.WaitForNotificationWithTimeout(seconds(5));
+    Send(fd, "4\r\nbody\r\n0\r\n\r\n");
+    return true;
+  });
+  UrlFetcher::Request req(URL("http://localhost:" + to_string(kScriptedPort)));
+  UrlFetcher::Response resp;
+  // Only touched on the event thread until the fetch is done.
+  int status_at_headers(0);
+  string body;
+  string body_at_headers("unset");
+  resp.on_headers = [&]() {
+    status_at_headers = resp.status_code;
+    body_at_headers = body;
+    headers_seen.Notify();
+  };
+  resp.on_body = [&body](evbuffer* data, const function<void()>& resume) {
+    Append(data, &body);
+    return true;
+  };
+
+  SyncTask task(&pool_);
+  fetcher_->Fetch(req, &resp, task.task());
+  task.Wait();
+  EXPECT_OK(task.status());
+  EXPECT_TRUE(headers_seen.HasBeenNotified());
+  EXPECT_EQ(200, status_at_headers);
+  EXPECT_EQ("", body_at_headers);
+  EXPECT_EQ("body", body);
+  // Streamed rather than accumulated.
+  EXPECT_EQ("", resp.body);
+  EXPECT_EQ(200, resp.status_code);
+}
+
+
+TEST_F(UrlFetcherTest, TestOnBodyPausesUntilResumed) {
+  Notification first_read;
+  ScriptedServer server(kScriptedPort, [&first_read](int fd) {
+    Send(fd,
+         "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+         "5\r\nfirst\r\n");
+    // Only sent once reading is paused.
+    first_read.WaitForNotificationWithTimeout(seconds(5));
+    Send(fd, "6\r\nsecond\r\n0\r\n\r\n");
+    return true;
+  });
+  UrlFetcher::Request req(URL("http://localhost:" + to_string(kScriptedPort)));
+  UrlFetcher::Response resp;
+  mutex lock;
+  string body;
+  function<void()> resume;
+  resp.on_body = [&](evbuffer* data, const function<void()>& resume_cb) {
+    lock_guard<mutex> l(lock);
+    Append(data, &body);
+    if (first_read.HasBeenNotified() || body.empty()) {
+      return true;
+    }
+    resume = resume_cb;
+    first_read.Notify();
+    return false;
+  };
+
+  SyncTask task(&pool_);
+  fetcher_->Fetch(req, &resp, task.task());
+  ASSERT_TRUE(first_read.WaitForNotificationWithTimeout(seconds(5)));
+  std::this_thread::sleep_for(milliseconds(300));
+  function<void()> resume_copy;
+  {
+    lock_guard<mutex> l(lock);
+    EXPECT_EQ("first", body);
+    resume_copy = resume;
+  }
+  EXPECT_FALSE(task.IsDone());
+
+  resume_copy();
+  task.Wait();
+  EXPECT_OK(task.status());
+  EXPECT_EQ(200, resp.status_code);
+  lock_guard<mutex> l(lock);
+  EXPECT_EQ("firstsecond", body);
+}
+
+
+TEST_F(UrlFetcherTest, TestPausedConnectionReturnsToPoolResumed) {
+  ScriptedServer server(kScriptedPort, [](int fd) {
+    // All in one go, so that the response is complete even though
+    // reading is paused as soon as the body arrives.
+    Send(fd, "HTTP/1.1 200 OK\r\nContent-Length: 4\r\n\r\nbody");
+    return true;
+  });
+  const URL url("http://localhost:" + to_string(kScriptedPort));
+
+  UrlFetcher::Response paused_resp;
+  string paused_body;
+  function<void()> resume;
+  paused_resp.on_body = [&](evbuffer* data,
+                            const function<void()>& resume_cb) {
+    Append(data, &paused_body);
+    resume = resume_cb;
+    return false;
+  };
+  SyncTask paused_task(&pool_);
+  fetcher_->Fetch(UrlFetcher::Request(url), &paused_resp, paused_task.task());
+  paused_task.Wait();
+  EXPECT_OK(paused_task.status());
+  EXPECT_EQ("body", paused_body);
+
+  // Goes over the same connection, which would never be read from
+  // again had it been left paused.
+  UrlFetcher::Request req(url);
+  req.deadline = std::chrono::steady_clock::now() + seconds(5);
+  UrlFetcher::Response resp;
+  SyncTask task(&pool_);
+  fetcher_->Fetch(req, &resp, task.task());
+  task.Wait();
+  EXPECT_OK(task.status());
+  EXPECT_EQ(200, resp.status_code);
+  EXPECT_EQ("body", resp.body);
+  EXPECT_EQ(1, server.connections());
+
+  // Resuming after the fetch is done is harmless.
+  ASSERT_TRUE(resume);
+  resume();
+}
+
+
+TEST_F(UrlFetcherTest, TestWaitsInLineForAConnection) {
+  FLAGS_connection_pool_max_active_per_host_port = 1;
+  Notification release;
+  mutex lock;
+  int requests(0);
+  ScriptedServer server(kScriptedPort, [&](int fd) {
+    bool first;
+    {
+      lock_guard<mutex> l(lock);
+      first = requests++ == 0;
+    }
+    if (first) {
+      release.WaitForNotificationWithTimeout(seconds(5));
+    }
+    Send(fd, "HTTP/1.1 200 OK\r\nContent-Length: 4\r\n\r\nbody");
+    return true;
+  });
+  const URL url("http://localhost:" + to_string(kScriptedPort));
+
+  UrlFetcher::Response first_resp;
+  SyncTask first_task(&pool_);
+  fetcher_->Fetch(UrlFetcher::Request(url), &first_resp, first_task.task());
+  UrlFetcher::Response resp;
+  SyncTask task(&pool_);
+  fetcher_->Fetch(UrlFetcher::Request(url), &resp, task.task());
+  std::this_thread::sleep_for(milliseconds(300));
+  EXPECT_FALSE(task.IsDone());
+
+  release.Notify();
+  first_task.Wait();
+  EXPECT_OK(first_task.status());
+  task.Wait();
+  EXPECT_OK(task.status());
+  EXPECT_EQ("body", resp.body);
+  // Handed the connection of the first one.
+  EXPECT_EQ(1, server.connections());
+  FLAGS_connection_pool_max_active_per_host_port = 0;
+}
+
+
+TEST_F(UrlFetcherTest, TestGivesUpWaitingForAConnection) {
+  FLAGS_connection_pool_max_active_per_host_port = 1;
+  Notification release;
+  ScriptedServer server(kScriptedPort, [&release](int fd) {
+    release.WaitForNotificationWithTimeout(seconds(5));
+    Send(fd, "HTTP/1.1 200 OK\r\nContent-Length: 4\r\n\r\nbody");
+    return true;
+  });
+  const URL url("http://localhost:" + to_string(kScriptedPort));
+
+  UrlFetcher::Response first_resp;
+  SyncTask first_task(&pool_);
+  fetcher_->Fetch(UrlFetcher::Request(url), &first_resp, first_task.task());
+
+  // Both come back while the first one is still holding on to the
+  // only connection allowed.
+  UrlFetcher::Request req(url);
+  req.deadline = std::chrono::steady_clock::now() + milliseconds(300);
+  UrlFetcher::Response deadline_resp;
+  SyncTask deadline_task(&pool_);
+  fetcher_->Fetch(req, &deadline_resp, deadline_task.task());
+  UrlFetcher::Response cancelled_resp;
+  SyncTask cancelled_task(&pool_);
+  fetcher_->Fetch(UrlFetcher::Request(url), &cancelled_resp,
+                  cancelled_task.task());
+  std::this_thread::sleep_for(milliseconds(100));
+  cancelled_task.Cancel();
+
+  cancelled_task.Wait();
+  EXPECT_THAT(cancelled_task.status(), StatusIs(util::error::CANCELLED));
+  deadline_task.Wait();
+  EXPECT_THAT(deadline_task.status(),
+              StatusIs(util::error::DEADLINE_EXCEEDED));
+  EXPECT_FALSE(first_task.IsDone());
+
+  release.Notify();
+  first_task.Wait();
+  EXPECT_OK(first_task.status());
+
+  // Nobody is left in line holding up the next one.
+  UrlFetcher::Response resp;
+  SyncTask task(&pool_);
+  fetcher_->Fetch(UrlFetcher::Request(url), &resp, task.task());
+  task.Wait();
+  EXPECT_OK(task.status());
+  EXPECT_EQ(1, server.connections());
+  FLAGS_connection_pool_max_active_per_host_port = 0;
+}
+
+
 }  // namespace cert_trans
 
 
@@ -10,6 +10,7 @@
 
 using cert_trans::serialization::SerializeResult;
 using cert_trans::serialization::DeserializeResult;
+using cert_trans::serialization::VarBytesLength;
 using cert_trans::serialization::WriteFixedBytes;
 using cert_trans::serialization::WriteList;
 using cert_trans::serialization::WriteUint;
@@ -80,13 +81,13 @@ SerializeResult SerializeV1CertSCTSignatureInput(uint64_t timestamp,
   if (res != SerializeResult::OK) {
     return res;
   }
-  WriteUint(ct::V1, Serializer::kVersionLengthInBytes, result);
-  WriteUint(ct::CERTIFICATE_TIMESTAMP, Serializer::kSignatureTypeLengthInBytes,
-            result);
-  WriteUint(timestamp, Serializer::kTimestampLengthInBytes, result);
-  WriteUint(ct::X509_ENTRY, Serializer::kLogEntryTypeLengthInBytes, result);
-  WriteVarBytes(certificate, kMaxCertificateLength, result);
-  WriteVarBytes(extensions, Serializer::kMaxExtensionsLength, result);
+  WriteUint<Serializer::kVersionLengthInBytes>(ct::V1, result);
+  WriteUint<Serializer::kSignatureTypeLengthInBytes>(ct::CERTIFICATE_TIMESTAMP,
+                                                     result);
+  WriteUint<Serializer::kTimestampLengthInBytes>(timestamp, result);
+  WriteUint<Serializer::kLogEntryTypeLengthInBytes>(ct::X509_ENTRY, result);
+  WriteVarBytes<kMaxCertificateLength>(certificate, result);
+  WriteVarBytes<Serializer::kMaxExtensionsLength>(extensions, result);
   return SerializeResult::OK;
 }
 
@@ -107,14 +108,14 @@ SerializeResult SerializeV1PrecertSCTSignatureInput(
     return res;
   }
   result->clear();
-  WriteUint(ct::V1, Serializer::kVersionLengthInBytes, result);
-  WriteUint(ct::CERTIFICATE_TIMESTAMP, Serializer::kSignatureTypeLengthInBytes,
-            result);
-  WriteUint(timestamp, Serializer::kTimestampLengthInBytes, result);
-  WriteUint(ct::PRECERT_ENTRY, Serializer::kLogEntryTypeLengthInBytes, result);
+  WriteUint<Serializer::kVersionLengthInBytes>(ct::V1, result);
+  WriteUint<Serializer::kSignatureTypeLengthInBytes>(ct::CERTIFICATE_TIMESTAMP,
+                                                     result);
+  WriteUint<Serializer::kTimestampLengthInBytes>(timestamp, result);
+  WriteUint<Serializer::kLogEntryTypeLengthInBytes>(ct::PRECERT_ENTRY, result);
   WriteFixedBytes(issuer_key_hash, result);
-  WriteVarBytes(tbs_certificate, kMaxCertificateLength, result);
-  WriteVarBytes(extensions, Serializer::kMaxExtensionsLength, result);
+  WriteVarBytes<kMaxCertificateLength>(tbs_certificate, result);
+  WriteVarBytes<Serializer::kMaxExtensionsLength>(extensions, result);
   return SerializeResult::OK;
 }
 
@@ -155,13 +156,20 @@ SerializeResult SerializeV1CertSCTMerkleTreeLeaf(uint64_t timestamp,
     return res;
   }
   result->clear();
-  WriteUint(ct::V1, Serializer::kVersionLengthInBytes, result);
-  WriteUint(ct::TIMESTAMPED_ENTRY, Serializer::kMerkleLeafTypeLengthInBytes,
-            result);
-  WriteUint(timestamp, Serializer::kTimestampLengthInBytes, result);
-  WriteUint(ct::X509_ENTRY, Serializer::kLogEntryTypeLengthInBytes, result);
-  WriteVarBytes(certificate, kMaxCertificateLength, result);
-  WriteVarBytes(extensions, Serializer::kMaxExtensionsLength, result);
+  result->reserve(Serializer::kVersionLengthInBytes +
+                  Serializer::kMerkleLeafTypeLengthInBytes +
+                  Serializer::kTimestampLengthInBytes +
+                  Serializer::kLogEntryTypeLengthInBytes +
+                  VarBytesLength(certificate, kMaxCertificateLength) +
+                  VarBytesLength(extensions,
+                                 Serializer::kMaxExtensionsLength));
+  WriteUint<Serializer::kVersionLengthInBytes>(ct::V1, result);
+  WriteUint<Serializer::kMerkleLeafTypeLengthInBytes>(ct::TIMESTAMPED_ENTRY,
+                                                      result);
+  WriteUint<Serializer::kTimestampLengthInBytes>(timestamp, result);
+  WriteUint<Serializer::kLogEntryTypeLengthInBytes>(ct::X509_ENTRY, result);
+  WriteVarBytes<kMaxCertificateLength>(certificate, result);
+  WriteVarBytes<Serializer::kMaxExtensionsLength>(extensions, result);
   return SerializeResult::OK;
 }
 
@@ -182,14 +190,22 @@ SerializeResult SerializeV1PrecertSCTMerkleTreeLeaf(
     return res;
   }
   result->clear();
-  WriteUint(ct::V1, Serializer::kVersionLengthInBytes, result);
-  WriteUint(ct::TIMESTAMPED_ENTRY, Serializer::kMerkleLeafTypeLengthInBytes,
-            result);
-  WriteUint(timestamp, Serializer::kTimestampLengthInBytes, result);
-  WriteUint(ct::PRECERT_ENTRY, Serializer::kLogEntryTypeLengthInBytes, result);
+  result->reserve(Serializer::kVersionLengthInBytes +
+                  Serializer::kMerkleLeafTypeLengthInBytes +
+                  Serializer::kTimestampLengthInBytes +
+                  Serializer::kLogEntryTypeLengthInBytes +
+                  issuer_key_hash.size() +
+                  VarBytesLength(tbs_certificate, kMaxCertificateLength) +
+                  VarBytesLength(extensions,
+                                 Serializer::kMaxExtensionsLength));
+  WriteUint<Serializer::kVersionLengthInBytes>(ct::V1, result);
+  WriteUint<Serializer::kMerkleLeafTypeLengthInBytes>(ct::TIMESTAMPED_ENTRY,
+                                                      result);
+  WriteUint<Serializer::kTimestampLengthInBytes>(timestamp, result);
+  WriteUint<Serializer::kLogEntryTypeLengthInBytes>(ct::PRECERT_ENTRY, result);
   WriteFixedBytes(issuer_key_hash, result);
-  WriteVarBytes(tbs_certificate, kMaxCertificateLength, result);
-  WriteVarBytes(extensions, Serializer::kMaxExtensionsLength, result);
+  WriteVarBytes<kMaxCertificateLength>(tbs_certificate, result);
+  WriteVarBytes<Serializer::kMaxExtensionsLength>(extensions, result);
   return SerializeResult::OK;
 }
 
@@ -260,27 +276,23 @@ DeserializeResult DeserializeV1SCTMerkleTreeLeaf(TLSDeserializer* des,
 
   switch (entry_type) {
     case ct::X509_ENTRY: {
-      string x509;
-      if (!des->ReadVarBytes(kMaxCertificateLength, &x509)) {
+      if (!des->ReadVarBytes(kMaxCertificateLength,
+                             entry->mutable_signed_entry()->mutable_x509())) {
         return DeserializeResult::INPUT_TOO_SHORT;
       }
-      entry->mutable_signed_entry()->set_x509(x509);
       return ReadExtensionsV1(des, entry);
     }
 
     case ct::PRECERT_ENTRY: {
-      string issuer_key_hash;
-      if (!des->ReadFixedBytes(32, &issuer_key_hash)) {
+      ct::PreCert* const precert(
+          entry->mutable_signed_entry()->mutable_precert());
+      if (!des->ReadFixedBytes(32, precert->mutable_issuer_key_hash())) {
         return DeserializeResult::INPUT_TOO_SHORT;
       }
-      entry->mutable_signed_entry()->mutable_precert()->set_issuer_key_hash(
-          issuer_key_hash);
-      string tbs_certificate;
-      if (!des->ReadVarBytes(kMaxCertificateLength, &tbs_certificate)) {
+      if (!des->ReadVarBytes(kMaxCertificateLength,
+                             precert->mutable_tbs_certificate())) {
         return DeserializeResult::INPUT_TOO_SHORT;
       }
-      entry->mutable_signed_entry()->mutable_precert()->set_tbs_certificate(
-          tbs_certificate);
       return ReadExtensionsV1(des, entry);
     }
   }
@@ -331,13 +343,13 @@ SerializeResult SerializeV2CertSCTSignatureInput(
     return res;
   }
   result->clear();
-  WriteUint(ct::V2, Serializer::kVersionLengthInBytes, result);
-  WriteUint(ct::CERTIFICATE_TIMESTAMP, Serializer::kSignatureTypeLengthInBytes,
-            result);
-  WriteUint(timestamp, Serializer::kTimestampLengthInBytes, result);
-  WriteUint(ct::X509_ENTRY, Serializer::kLogEntryTypeLengthInBytes, result);
+  WriteUint<Serializer::kVersionLengthInBytes>(ct::V2, result);
+  WriteUint<Serializer::kSignatureTypeLengthInBytes>(ct::CERTIFICATE_TIMESTAMP,
+                                                     result);
+  WriteUint<Serializer::kTimestampLengthInBytes>(timestamp, result);
+  WriteUint<Serializer::kLogEntryTypeLengthInBytes>(ct::X509_ENTRY, result);
   WriteFixedBytes(issuer_key_hash, result);
-  WriteVarBytes(tbs_certificate, kMaxCertificateLength, result);
+  WriteVarBytes<kMaxCertificateLength>(tbs_certificate, result);
   WriteSctExtension(sct_extension, result);
   return SerializeResult::OK;
 }
@@ -357,14 +369,14 @@ SerializeResult SerializeV2PrecertSCTSignatureInput(
     return res;
   }
   result->clear();
-  WriteUint(ct::V2, Serializer::kVersionLengthInBytes, result);
-  WriteUint(ct::CERTIFICATE_TIMESTAMP, Serializer::kSignatureTypeLengthInBytes,
-            result);
-  WriteUint(timestamp, Serializer::kTimestampLengthInBytes, result);
-  WriteUint(ct::PRECERT_ENTRY_V2, Serializer::kLogEntryTypeLengthInBytes,
-            result);
+  WriteUint<Serializer::kVersionLengthInBytes>(ct::V2, result);
+  WriteUint<Serializer::kSignatureTypeLengthInBytes>(ct::CERTIFICATE_TIMESTAMP,
+                                                     result);
+  WriteUint<Serializer::kTimestampLengthInBytes>(timestamp, result);
+  WriteUint<Serializer::kLogEntryTypeLengthInBytes>(ct::PRECERT_ENTRY_V2,
+                                                    result);
   WriteFixedBytes(issuer_key_hash, result);
-  WriteVarBytes(tbs_certificate, kMaxCertificateLength, result);
+  WriteVarBytes<kMaxCertificateLength>(tbs_certificate, result);
   WriteSctExtension(sct_extension, result);
   return SerializeResult::OK;
 }
@@ -408,13 +420,13 @@ SerializeResult SerializeV2CertSCTMerkleTreeLeaf(
     return res;
   }
   result->clear();
-  WriteUint(ct::V2, Serializer::kVersionLengthInBytes, result);
-  WriteUint(ct::TIMESTAMPED_ENTRY, Serializer::kMerkleLeafTypeLengthInBytes,
-            result);
-  WriteUint(timestamp, Serializer::kTimestampLengthInBytes, result);
-  WriteUint(ct::X509_ENTRY, Serializer::kLogEntryTypeLengthInBytes, result);
+  WriteUint<Serializer::kVersionLengthInBytes>(ct::V2, result);
+  WriteUint<Serializer::kMerkleLeafTypeLengthInBytes>(ct::TIMESTAMPED_ENTRY,
+                                                      result);
+  WriteUint<Serializer::kTimestampLengthInBytes>(timestamp, result);
+  WriteUint<Serializer::kLogEntryTypeLengthInBytes>(ct::X509_ENTRY, result);
   WriteFixedBytes(issuer_key_hash, result);
-  WriteVarBytes(tbs_certificate, kMaxCertificateLength, result);
+  WriteVarBytes<kMaxCertificateLength>(tbs_certificate, result);
   WriteSctExtension(sct_extension, result);
   return SerializeResult::OK;
 }
@@ -438,14 +450,14 @@ SerializeResult SerializeV2PrecertSCTMerkleTreeLeaf(
     return res;
   }
   result->clear();
-  WriteUint(ct::V2, Serializer::kVersionLengthInBytes, result);
-  WriteUint(ct::TIMESTAMPED_ENTRY, Serializer::kMerkleLeafTypeLengthInBytes,
-            result);
-  WriteUint(timestamp, Serializer::kTimestampLengthInBytes, result);
-  WriteUint(ct::PRECERT_ENTRY_V2, Serializer::kLogEntryTypeLengthInBytes,
-            result);
+  WriteUint<Serializer::kVersionLengthInBytes>(ct::V2, result);
+  WriteUint<Serializer::kMerkleLeafTypeLengthInBytes>(ct::TIMESTAMPED_ENTRY,
+                                                      result);
+  WriteUint<Serializer::kTimestampLengthInBytes>(timestamp, result);
+  WriteUint<Serializer::kLogEntryTypeLengthInBytes>(ct::PRECERT_ENTRY_V2,
+                                                    result);
   WriteFixedBytes(issuer_key_hash, result);
-  WriteVarBytes(tbs_certificate, kMaxCertificateLength, result);
+  WriteVarBytes<kMaxCertificateLength>(tbs_certificate, result);
   WriteSctExtension(sct_extension, result);
   return SerializeResult::OK;
 }
@@ -518,18 +530,15 @@ DeserializeResult DeserializeV2SCTMerkleTreeLeaf(TLSDeserializer* des,
     // In V2 both X509 and Precert entries use CertInfo
     case ct::X509_ENTRY:
     case ct::PRECERT_ENTRY_V2: {
-      string issuer_key_hash;
-      if (!des->ReadFixedBytes(32, &issuer_key_hash)) {
+      ct::CertInfo* const cert_info(
+          entry->mutable_signed_entry()->mutable_cert_info());
+      if (!des->ReadFixedBytes(32, cert_info->mutable_issuer_key_hash())) {
         return DeserializeResult::INPUT_TOO_SHORT;
       }
-      entry->mutable_signed_entry()->mutable_cert_info()->set_issuer_key_hash(
-          issuer_key_hash);
-      string tbs_certificate;
-      if (!des->ReadVarBytes(kMaxCertificateLength, &tbs_certificate)) {
+      if (!des->ReadVarBytes(kMaxCertificateLength,
+                             cert_info->mutable_tbs_certificate())) {
         return DeserializeResult::INPUT_TOO_SHORT;
       }
-      entry->mutable_signed_entry()->mutable_cert_info()->set_tbs_certificate(
-          tbs_certificate);
       // TODO(eranm): This is wrong, V2 Extensions should be read using
       // ReadSctExtensions
       return ReadExtensionsV1(des, entry);
@@ -590,7 +599,9 @@ SerializeResult SerializePrecertChainEntry(
   }
 
   result->clear();
-  WriteVarBytes(pre_certificate, kMaxCertificateLength, result);
+  // WriteList() reserves room for the chain.
+  result->reserve(VarBytesLength(pre_certificate, kMaxCertificateLength));
+  WriteVarBytes<kMaxCertificateLength>(pre_certificate, result);
 
   SerializeResult res = WriteList(precertificate_chain, kMaxCertificateLength,
                                   kMaxCertificateChainLength, result);
@@ -609,8 +620,8 @@ SerializeResult SerializeV1SignedCertEntryWithType(
     return res;
   }
   result->clear();
-  WriteUint(ct::X509_ENTRY, Serializer::kLogEntryTypeLengthInBytes, result);
-  WriteVarBytes(leaf_certificate, kMaxCertificateLength, result);
+  WriteUint<Serializer::kLogEntryTypeLengthInBytes>(ct::X509_ENTRY, result);
+  WriteVarBytes<kMaxCertificateLength>(leaf_certificate, result);
   return SerializeResult::OK;
 }
 
@@ -627,9 +638,9 @@ SerializeResult SerializeV1SignedPrecertEntryWithType(
     return res;
   }
   result->clear();
-  WriteUint(ct::PRECERT_ENTRY, Serializer::kLogEntryTypeLengthInBytes, result);
+  WriteUint<Serializer::kLogEntryTypeLengthInBytes>(ct::PRECERT_ENTRY, result);
   WriteFixedBytes(issuer_key_hash, result);
-  WriteVarBytes(tbs_certificate, kMaxCertificateLength, result);
+  WriteVarBytes<kMaxCertificateLength>(tbs_certificate, result);
   return SerializeResult::OK;
 }
 
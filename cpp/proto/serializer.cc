@@ -14,6 +14,7 @@ using cert_trans::serialization::DeserializeResult;
 using cert_trans::serialization::WriteDigitallySigned;
 using cert_trans::serialization::WriteFixedBytes;
 using cert_trans::serialization::WriteUint;
+using cert_trans::serialization::VarBytesLength;
 using cert_trans::serialization::WriteVarBytes;
 using cert_trans::serialization::constants::kMaxSignatureLength;
 using cert_trans::serialization::constants::kHashAlgorithmLengthInBytes;
@@ -36,17 +37,17 @@ using std::string;
 
 const size_t Serializer::kMaxV2ExtensionType = (1 << 16) - 1;
 const size_t Serializer::kMaxV2ExtensionsCount = (1 << 16) - 2;
-const size_t Serializer::kMaxExtensionsLength = (1 << 16) - 1;
+const size_t Serializer::kMaxExtensionsLength;
 const size_t Serializer::kMaxSerializedSCTLength = (1 << 16) - 1;
 const size_t Serializer::kMaxSCTListLength = (1 << 16) - 1;
 
-const size_t Serializer::kLogEntryTypeLengthInBytes = 2;
-const size_t Serializer::kSignatureTypeLengthInBytes = 1;
-const size_t Serializer::kVersionLengthInBytes = 1;
-const size_t Serializer::kKeyIDLengthInBytes = 32;
-const size_t Serializer::kMerkleLeafTypeLengthInBytes = 1;
-const size_t Serializer::kKeyHashLengthInBytes = 32;
-const size_t Serializer::kTimestampLengthInBytes = 8;
+const size_t Serializer::kLogEntryTypeLengthInBytes;
+const size_t Serializer::kSignatureTypeLengthInBytes;
+const size_t Serializer::kVersionLengthInBytes;
+const size_t Serializer::kKeyIDLengthInBytes;
+const size_t Serializer::kMerkleLeafTypeLengthInBytes;
+const size_t Serializer::kKeyHashLengthInBytes;
+const size_t Serializer::kTimestampLengthInBytes;
 
 DEFINE_bool(allow_reconfigure_serializer_test_only, false,
             "Allow tests to reconfigure the serializer multiple times.");
@@ -114,10 +115,13 @@ static SerializeResult SerializeV1STHSignatureInput(uint64_t timestamp,
   result->clear();
   if (root_hash.size() != 32)
     return SerializeResult::INVALID_HASH_LENGTH;
-  WriteUint(ct::V1, Serializer::kVersionLengthInBytes, result);
-  WriteUint(ct::TREE_HEAD, Serializer::kSignatureTypeLengthInBytes, result);
-  WriteUint(timestamp, Serializer::kTimestampLengthInBytes, result);
-  WriteUint(tree_size, 8, result);
+  result->reserve(Serializer::kVersionLengthInBytes +
+                  Serializer::kSignatureTypeLengthInBytes +
+                  Serializer::kTimestampLengthInBytes + 8 + root_hash.size());
+  WriteUint<Serializer::kVersionLengthInBytes>(ct::V1, result);
+  WriteUint<Serializer::kSignatureTypeLengthInBytes>(ct::TREE_HEAD, result);
+  WriteUint<Serializer::kTimestampLengthInBytes>(timestamp, result);
+  WriteUint<8>(tree_size, result);
   WriteFixedBytes(root_hash, result);
   return SerializeResult::OK;
 }
@@ -152,19 +156,19 @@ static SerializeResult SerializeV2STHSignatureInput(
     return SerializeResult::INVALID_KEYID_LENGTH;
   }
 
-  WriteUint(ct::V2, Serializer::kVersionLengthInBytes, result);
-  WriteUint(ct::TREE_HEAD, Serializer::kSignatureTypeLengthInBytes, result);
+  WriteUint<Serializer::kVersionLengthInBytes>(ct::V2, result);
+  WriteUint<Serializer::kSignatureTypeLengthInBytes>(ct::TREE_HEAD, result);
   // TODO(eranm): This is wrong, V2 Log IDs are OIDs.
   WriteFixedBytes(log_id, result);
-  WriteUint(timestamp, Serializer::kTimestampLengthInBytes, result);
-  WriteUint(tree_size, 8, result);
+  WriteUint<Serializer::kTimestampLengthInBytes>(timestamp, result);
+  WriteUint<8>(tree_size, result);
   WriteFixedBytes(root_hash, result);
   // V2 STH can have multiple extensions
-  WriteUint(sth_extension.size(), 2, result);
+  WriteUint<2>(sth_extension.size(), result);
   for (auto it = sth_extension.begin(); it != sth_extension.end(); ++it) {
-    WriteUint(it->sth_extension_type(), 2, result);
-    WriteVarBytes(it->sth_extension_data(), Serializer::kMaxExtensionsLength,
-                  result);
+    WriteUint<2>(it->sth_extension_type(), result);
+    WriteVarBytes<Serializer::kMaxExtensionsLength>(it->sth_extension_data(),
+                                                    result);
   }
 
   return SerializeResult::OK;
@@ -225,20 +229,26 @@ SerializeResult WriteSCTV1(const SignedCertificateTimestamp& sct,
   if (sct.id().key_id().size() != Serializer::kKeyIDLengthInBytes) {
     return SerializeResult::INVALID_KEYID_LENGTH;
   }
-  WriteUint(sct.version(), Serializer::kVersionLengthInBytes, output);
+  // WriteDigitallySigned() reserves room for the signature.
+  output->reserve(Serializer::kVersionLengthInBytes +
+                  Serializer::kKeyIDLengthInBytes +
+                  Serializer::kTimestampLengthInBytes +
+                  VarBytesLength(sct.extensions(),
+                                 Serializer::kMaxExtensionsLength));
+  WriteUint<Serializer::kVersionLengthInBytes>(sct.version(), output);
   WriteFixedBytes(sct.id().key_id(), output);
-  WriteUint(sct.timestamp(), Serializer::kTimestampLengthInBytes, output);
-  WriteVarBytes(sct.extensions(), Serializer::kMaxExtensionsLength, output);
+  WriteUint<Serializer::kTimestampLengthInBytes>(sct.timestamp(), output);
+  WriteVarBytes<Serializer::kMaxExtensionsLength>(sct.extensions(), output);
   return WriteDigitallySigned(sct.signature(), output);
 }
 
 void WriteSctExtension(const RepeatedPtrField<SctExtension>& extension,
                        std::string* output) {
-  WriteUint(extension.size(), 2, output);
+  WriteUint<2>(extension.size(), output);
   for (auto it = extension.begin(); it != extension.end(); ++it) {
-    WriteUint(it->sct_extension_type(), 2, output);
-    WriteVarBytes(it->sct_extension_data(), Serializer::kMaxExtensionsLength,
-                  output);
+    WriteUint<2>(it->sct_extension_type(), output);
+    WriteVarBytes<Serializer::kMaxExtensionsLength>(it->sct_extension_data(),
+                                                    output);
   }
 }
 
@@ -253,9 +263,9 @@ SerializeResult WriteSCTV2(const SignedCertificateTimestamp& sct,
   if (sct.id().key_id().size() != Serializer::kKeyIDLengthInBytes) {
     return SerializeResult::INVALID_KEYID_LENGTH;
   }
-  WriteUint(sct.version(), Serializer::kVersionLengthInBytes, output);
+  WriteUint<Serializer::kVersionLengthInBytes>(sct.version(), output);
   WriteFixedBytes(sct.id().key_id(), output);
-  WriteUint(sct.timestamp(), Serializer::kTimestampLengthInBytes, output);
+  WriteUint<Serializer::kTimestampLengthInBytes>(sct.timestamp(), output);
   // V2 SCT can have a number of extensions. They must be ordered by type
   // but we already checked that above.
   WriteSctExtension(sct.sct_extension(), output);
@@ -308,14 +318,13 @@ SerializeResult Serializer::SerializeList(const repeated_string& in,
                                           size_t max_elem_length,
                                           size_t max_total_length,
                                           string* result) {
-  std::string output;
+  result->clear();
   SerializeResult res =
       cert_trans::serialization::WriteList(in, max_elem_length,
-                                           max_total_length, &output);
+                                           max_total_length, result);
   if (res != SerializeResult::OK)
-    return res;
-  result->assign(output);
-  return SerializeResult::OK;
+    result->clear();
+  return res;
 }
 
 SerializeResult CheckKeyHashFormat(const string& key_hash) {
@@ -412,9 +421,11 @@ DeserializeResult ReadSCTV1(TLSDeserializer* deserializer,
     return DeserializeResult::INPUT_TOO_SHORT;
   }
   sct->set_timestamp(timestamp);
-  string extensions;
+  // V1 SCT extensions are not kept, so there is no need to copy them.
+  const char* extensions;
+  size_t extensions_length;
   if (!deserializer->ReadVarBytes(Serializer::kMaxExtensionsLength,
-                                  &extensions)) {
+                                  &extensions, &extensions_length)) {
     // In theory, could also be an invalid length prefix, but not if
     // length limits follow byte boundaries.
     return DeserializeResult::INPUT_TOO_SHORT;
@@ -442,15 +453,16 @@ DeserializeResult ReadSctExtension(TLSDeserializer* deserializer,
       return DeserializeResult::INPUT_TOO_SHORT;
     }
 
-    string ext_data;
+    const char* ext_data;
+    size_t ext_data_length;
     if (!deserializer->ReadVarBytes(Serializer::kMaxExtensionsLength,
-                                    &ext_data)) {
+                                    &ext_data, &ext_data_length)) {
       return DeserializeResult::INPUT_TOO_SHORT;
     }
 
     SctExtension* new_ext = extension->Add();
     new_ext->set_sct_extension_type(ext_type);
-    new_ext->set_sct_extension_data(ext_data);
+    new_ext->set_sct_extension_data(ext_data, ext_data_length);
   }
 
   // This makes sure they're correctly ordered (See RFC section 5.3)
@@ -488,12 +500,10 @@ DeserializeResult ReadSCTV2(TLSDeserializer* deserializer,
 DeserializeResult ReadExtensionsV1(TLSDeserializer* deserializer,
                                    ct::TimestampedEntry* entry) {
   CHECK_NOTNULL(deserializer);
-  string extensions;
   if (!deserializer->ReadVarBytes(Serializer::kMaxExtensionsLength,
-                                  &extensions)) {
+                                  CHECK_NOTNULL(entry)->mutable_extensions())) {
     return DeserializeResult::INPUT_TOO_SHORT;
   }
-  CHECK_NOTNULL(entry)->set_extensions(extensions);
   return DeserializeResult::OK;
 }
 
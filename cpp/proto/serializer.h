@@ -38,21 +38,23 @@ cert_trans::serialization::DeserializeResult ReadMerkleTreeLeaf(
 // A utility class for writing protocol buffer fields in canonical TLS style.
 class Serializer {
  public:
+  // Those initialized here can be used as template arguments, with the
+  // fixed-width encoders of tls_encoding.h.
   static const size_t kMaxV2ExtensionType;
   static const size_t kMaxV2ExtensionsCount;
-  static const size_t kMaxExtensionsLength;
+  static const size_t kMaxExtensionsLength = (1 << 16) - 1;
   static const size_t kMaxSerializedSCTLength;
   static const size_t kMaxSCTListLength;
 
-  static const size_t kLogEntryTypeLengthInBytes;
-  static const size_t kSignatureTypeLengthInBytes;
-  static const size_t kVersionLengthInBytes;
+  static const size_t kLogEntryTypeLengthInBytes = 2;
+  static const size_t kSignatureTypeLengthInBytes = 1;
+  static const size_t kVersionLengthInBytes = 1;
   // Log Key ID
-  static const size_t kKeyIDLengthInBytes;
-  static const size_t kMerkleLeafTypeLengthInBytes;
+  static const size_t kKeyIDLengthInBytes = 32;
+  static const size_t kMerkleLeafTypeLengthInBytes = 1;
   // Public key hash from cert
-  static const size_t kKeyHashLengthInBytes;
-  static const size_t kTimestampLengthInBytes;
+  static const size_t kKeyHashLengthInBytes = 32;
+  static const size_t kTimestampLengthInBytes = 8;
 
   // API
   // TODO(alcutter): typedef these function<> bits
@@ -3,6 +3,7 @@
 #include <glog/logging.h>
 #include <google/protobuf/repeated_field.h>
 #include <gtest/gtest.h>
+#include <random>
 #include <string>
 
 #include "proto/cert_serializer.h"
@@ -17,6 +18,13 @@ namespace {
 
 using cert_trans::serialization::SerializeResult;
 using cert_trans::serialization::DeserializeResult;
+using cert_trans::serialization::VarBytesLength;
+using cert_trans::serialization::WriteFixedBytes;
+using cert_trans::serialization::WriteVarBytes;
+using cert_trans::serialization::internal::PrefixLength;
+using cert_trans::serialization::WriteDigitallySigned;
+using cert_trans::serialization::WriteUint;
+using cert_trans::serialization::constants::kMaxSignatureLength;
 using ct::DigitallySigned;
 using ct::LogEntry;
 using ct::LogEntryType;
@@ -30,6 +38,7 @@ using ct::SthExtension;
 using ct::Version;
 using ct::X509ChainEntry;
 using google::protobuf::RepeatedPtrField;
+using std::mt19937_64;
 using std::string;
 
 // A slightly shorter notation for constructing binary blobs from test vectors.
@@ -1564,6 +1573,108 @@ TEST_F(SerializerTest, SerializeSCTSignedEntryWithType_BadIssuerKeyHash) {
                                                   &result));
 }
 
+TEST_F(SerializerTest, PrefixLength) {
+  EXPECT_EQ(0U, PrefixLength(1));
+  EXPECT_EQ(1U, PrefixLength(2));
+  EXPECT_EQ(1U, PrefixLength(256));
+  EXPECT_EQ(2U, PrefixLength(257));
+  EXPECT_EQ(2U, PrefixLength(65535));
+  EXPECT_EQ(2U, PrefixLength(65536));
+  EXPECT_EQ(3U, PrefixLength(65537));
+  EXPECT_EQ(3U, PrefixLength(0xffffff));
+}
+
+TEST_F(SerializerTest, ReadVarBytesWithoutCopying) {
+  string input;
+  WriteVarBytes("abc", 0xffff, &input);
+  WriteFixedBytes("de", &input);
+  EXPECT_EQ(2U + 3U, VarBytesLength("abc", 0xffff));
+
+  TLSDeserializer deserializer(input);
+  const char* data;
+  size_t length;
+  ASSERT_TRUE(deserializer.ReadVarBytes(0xffff, &data, &length));
+  EXPECT_EQ("abc", string(data, length));
+  ASSERT_TRUE(deserializer.ReadFixedBytes(2, &data));
+  EXPECT_EQ("de", string(data, 2));
+  EXPECT_TRUE(deserializer.ReachedEnd());
+  EXPECT_FALSE(deserializer.ReadFixedBytes(1, &data));
+}
+
+// The fixed-width encoders must produce the same bytes as the runtime
+// ones they replace, which these check on random inputs.
+template <size_t bytes>
+void ExpectSameUintEncoding(mt19937_64* rand) {
+  for (int i = 0; i < 1000; ++i) {
+    const uint64_t value((*rand)() >> (64 - bytes * 8));
+    string expected, actual;
+    WriteUint(value, bytes, &expected);
+    WriteUint<bytes>(value, &actual);
+    ASSERT_EQ(H(expected), H(actual));
+  }
+}
+
+template <size_t max_length>
+void ExpectSameVarBytesEncoding(mt19937_64* rand) {
+  for (int i = 0; i < 100; ++i) {
+    string value((*rand)() % std::min<size_t>(max_length + 1, 70000), '\0');
+    for (char& c : value) {
+      c = static_cast<char>((*rand)());
+    }
+    string expected, actual;
+    WriteVarBytes(value, max_length, &expected);
+    WriteVarBytes<max_length>(value, &actual);
+    ASSERT_EQ(H(expected), H(actual));
+  }
+}
+
+TEST_F(SerializerTest, FixedWidthEncodersMatchRuntimeOnes) {
+  mt19937_64 rand(1234);
+  ExpectSameUintEncoding<1>(&rand);
+  ExpectSameUintEncoding<2>(&rand);
+  ExpectSameUintEncoding<3>(&rand);
+  ExpectSameUintEncoding<8>(&rand);
+  ExpectSameVarBytesEncoding<255>(&rand);
+  ExpectSameVarBytesEncoding<Serializer::kMaxExtensionsLength>(&rand);
+  ExpectSameVarBytesEncoding<(1 << 24) - 1>(&rand);
+}
+
+TEST_F(SerializerTest, FixedWidthStructuresMatchRuntimeEncoding) {
+  mt19937_64 rand(1234);
+  for (int i = 0; i < 100; ++i) {
+    const uint64_t timestamp(rand());
+    const int64_t tree_size(rand() >> 1);
+    string root_hash(32, '\0');
+    for (char& c : root_hash) {
+      c = static_cast<char>(rand());
+    }
+    string expected;
+    WriteUint(ct::V1, Serializer::kVersionLengthInBytes, &expected);
+    WriteUint(ct::TREE_HEAD, Serializer::kSignatureTypeLengthInBytes,
+              &expected);
+    WriteUint(timestamp, Serializer::kTimestampLengthInBytes, &expected);
+    WriteUint(tree_size, 8, &expected);
+    expected.append(root_hash);
+    string actual;
+    ASSERT_EQ(SerializeResult::OK,
+              Serializer::SerializeV1STHSignatureInput(timestamp, tree_size,
+                                                       root_hash, &actual));
+    ASSERT_EQ(H(expected), H(actual));
+
+    DigitallySigned sig;
+    sig.set_hash_algorithm(DigitallySigned::SHA256);
+    sig.set_sig_algorithm(DigitallySigned::ECDSA);
+    sig.set_signature(root_hash.substr(0, rand() % 33));
+    expected.clear();
+    WriteUint(sig.hash_algorithm(), 1, &expected);
+    WriteUint(sig.sig_algorithm(), 1, &expected);
+    WriteVarBytes(sig.signature(), kMaxSignatureLength, &expected);
+    actual.clear();
+    ASSERT_EQ(SerializeResult::OK, WriteDigitallySigned(sig, &actual));
+    ASSERT_EQ(H(expected), H(actual));
+  }
+}
+
 }  // namespace
 
 int main(int argc, char** argv) {
@@ -1,7 +1,6 @@
 /* -*- indent-tabs-mode: nil -*- */
 #include "proto/tls_encoding.h"
 
-#include <math.h>
 #include <ostream>
 #include <string>
 
@@ -131,6 +130,10 @@ void WriteVarBytes(const std::string& in, size_t max_length,
   WriteFixedBytes(in, output);
 }
 
+size_t VarBytesLength(const std::string& in, size_t max_length) {
+  return internal::PrefixLength(max_length) + in.size();
+}
+
 SerializeResult WriteList(const repeated_string& in, size_t max_elem_length,
                           size_t max_total_length, std::string* output) {
   for (int i = 0; i < in.size(); ++i) {
@@ -145,6 +148,7 @@ SerializeResult WriteList(const repeated_string& in, size_t max_elem_length,
   size_t prefix_length = internal::PrefixLength(max_total_length);
   CHECK_GE(length, prefix_length);
 
+  output->reserve(output->size() + length);
   WriteUint(length - prefix_length, prefix_length, output);
 
   for (int i = 0; i < in.size(); ++i)
@@ -157,11 +161,14 @@ SerializeResult WriteDigitallySigned(const DigitallySigned& sig,
   SerializeResult res = CheckSignatureFormat(sig);
   if (res != SerializeResult::OK)
     return res;
-  WriteUint(sig.hash_algorithm(), constants::kHashAlgorithmLengthInBytes,
-            output);
-  WriteUint(sig.sig_algorithm(), constants::kSigAlgorithmLengthInBytes,
-            output);
-  WriteVarBytes(sig.signature(), constants::kMaxSignatureLength, output);
+  output->reserve(output->size() + constants::kHashAlgorithmLengthInBytes +
+                  constants::kSigAlgorithmLengthInBytes +
+                  VarBytesLength(sig.signature(),
+                                 constants::kMaxSignatureLength));
+  WriteUint<constants::kHashAlgorithmLengthInBytes>(sig.hash_algorithm(),
+                                                    output);
+  WriteUint<constants::kSigAlgorithmLengthInBytes>(sig.sig_algorithm(), output);
+  WriteVarBytes<constants::kMaxSignatureLength>(sig.signature(), output);
   return SerializeResult::OK;
 }
 
@@ -169,7 +176,12 @@ namespace internal {
 
 size_t PrefixLength(size_t max_length) {
   CHECK_GT(max_length, 0U);
-  return ceil(log2(max_length) / float(8));
+  // This is ceil(log2(max_length) / 8), without going through floating
+  // point for every field.
+  size_t length = 0;
+  for (size_t rest = max_length - 1; rest > 0; rest >>= 8)
+    ++length;
+  return length;
 }
 
 }  // namespace internal
@@ -192,10 +204,24 @@ TLSDeserializer::TLSDeserializer(const std::string& input)
 }
 
 
+TLSDeserializer::TLSDeserializer(const char* input, size_t length)
+    : current_pos_(input), bytes_remaining_(length) {
+}
+
+
 bool TLSDeserializer::ReadFixedBytes(size_t bytes, std::string* result) {
+  const char* data;
+  if (!ReadFixedBytes(bytes, &data))
+    return false;
+  result->assign(data, bytes);
+  return true;
+}
+
+
+bool TLSDeserializer::ReadFixedBytes(size_t bytes, const char** data) {
   if (bytes_remaining_ < bytes)
     return false;
-  result->assign(current_pos_, bytes);
+  *data = current_pos_;
   current_pos_ += bytes;
   bytes_remaining_ -= bytes;
   return true;
@@ -219,25 +245,35 @@ bool TLSDeserializer::ReadVarBytes(size_t max_length, std::string* result) {
   return ReadFixedBytes(length, result);
 }
 
+
+bool TLSDeserializer::ReadVarBytes(size_t max_length, const char** data,
+                                   size_t* length) {
+  return ReadLengthPrefix(max_length, length) &&
+         ReadFixedBytes(*length, data);
+}
+
 DeserializeResult TLSDeserializer::ReadList(size_t max_total_length,
                                             size_t max_elem_length,
                                             repeated_string* out) {
-  std::string serialized_list;
-  if (!ReadVarBytes(max_total_length, &serialized_list))
+  const char* serialized_list;
+  size_t list_length;
+  if (!ReadVarBytes(max_total_length, &serialized_list, &list_length))
     // TODO(ekasper): could also be a length that's too large, if
     // length limits don't follow byte boundaries.
     return DeserializeResult::INPUT_TOO_SHORT;
   if (!ReachedEnd())
     return DeserializeResult::INPUT_TOO_LONG;
 
-  TLSDeserializer list_reader(serialized_list);
+  // The elements are copied once, straight into |out|.
+  TLSDeserializer list_reader(serialized_list, list_length);
   while (!list_reader.ReachedEnd()) {
-    std::string elem;
-    if (!list_reader.ReadVarBytes(max_elem_length, &elem))
+    const char* elem;
+    size_t elem_length;
+    if (!list_reader.ReadVarBytes(max_elem_length, &elem, &elem_length))
       return DeserializeResult::INVALID_LIST_ENCODING;
-    if (elem.empty())
+    if (elem_length == 0)
       return DeserializeResult::EMPTY_ELEM_IN_LIST;
-    *(out->Add()) = elem;
+    out->Add()->assign(elem, elem_length);
   }
   return DeserializeResult::OK;
 }
@@ -254,13 +290,15 @@ DeserializeResult TLSDeserializer::ReadDigitallySigned(DigitallySigned* sig) {
   if (!ct::DigitallySigned_SignatureAlgorithm_IsValid(sig_algo))
     return DeserializeResult::INVALID_SIGNATURE_ALGORITHM;
 
-  std::string sig_string;
-  if (!ReadVarBytes(constants::kMaxSignatureLength, &sig_string))
+  const char* signature;
+  size_t signature_length;
+  if (!ReadVarBytes(constants::kMaxSignatureLength, &signature,
+                    &signature_length))
     return DeserializeResult::INPUT_TOO_SHORT;
   sig->set_hash_algorithm(
       static_cast<DigitallySigned::HashAlgorithm>(hash_algo));
   sig->set_sig_algorithm(
       static_cast<DigitallySigned::SignatureAlgorithm>(sig_algo));
-  sig->set_signature(sig_string);
+  sig->set_signature(signature, signature_length);
   return DeserializeResult::OK;
 }
@@ -60,13 +60,17 @@ std::ostream& operator<<(std::ostream& stream, const DeserializeResult& r);
 ///////////////////////////////////////////////////////////////////////////////
 // Basic serialization functions.                                            //
 ///////////////////////////////////////////////////////////////////////////////
+// The Write*() functions append to |output|. Callers serializing
+// something large should reserve() its final size first, so that it is
+// not reallocated along the way.
 template <class T>
 void WriteUint(T in, size_t bytes, std::string* output) {
   CHECK_LE(bytes, sizeof(in));
   CHECK(bytes == sizeof(in) || in >> (bytes * 8) == 0);
-  for (; bytes > 0; --bytes)
-    output->push_back(((in & (static_cast<T>(0xff) << ((bytes - 1) * 8))) >>
-                       ((bytes - 1) * 8)));
+  const size_t end(output->size() + bytes);
+  output->resize(end);
+  for (size_t i = 0; i < bytes; ++i)
+    (*output)[end - 1 - i] = static_cast<char>((in >> (i * 8)) & 0xff);
 }
 
 // Fixed-length byte array.
@@ -78,6 +82,9 @@ void WriteFixedBytes(const std::string& in, std::string* output);
 void WriteVarBytes(const std::string& in, size_t max_length,
                    std::string* output);
 
+// Returns the number of bytes WriteVarBytes() would append.
+size_t VarBytesLength(const std::string& in, size_t max_length);
+
 SerializeResult WriteList(const repeated_string& in, size_t max_elem_length,
                           size_t max_total_length, std::string* output);
 
@@ -95,8 +102,42 @@ namespace internal {
 // Returns the number of bytes needed to store a value up to max_length.
 size_t PrefixLength(size_t max_length);
 
+// The same, at compile time.
+constexpr size_t BytesToStore(size_t value) {
+  return value == 0 ? 0 : 1 + BytesToStore(value >> 8);
+}
+
+constexpr size_t StaticPrefixLength(size_t max_length) {
+  return BytesToStore(max_length - 1);
+}
+
 }  // namespace internal
 
+///////////////////////////////////////////////////////////////////////////////
+// Fixed-width serialization functions.                                      //
+///////////////////////////////////////////////////////////////////////////////
+// These produce the same bytes as the functions above, but take the
+// widths as template arguments, so that the encoding of fixed-shape
+// structures compiles down to straight-line code.
+template <size_t bytes, class T>
+void WriteUint(T in, std::string* output) {
+  static_assert(bytes > 0 && bytes <= sizeof(T), "invalid width");
+  // Shifting by the full width of T is undefined, hence the modulo, in
+  // the case where the comparison is not evaluated anyway.
+  CHECK(bytes == sizeof(in) || in >> ((bytes % sizeof(T)) * 8) == 0);
+  char encoded[bytes];
+  for (size_t i = 0; i < bytes; ++i)
+    encoded[bytes - 1 - i] = static_cast<char>((in >> (i * 8)) & 0xff);
+  output->append(encoded, bytes);
+}
+
+template <size_t max_length>
+void WriteVarBytes(const std::string& in, std::string* output) {
+  CHECK_LE(in.size(), max_length);
+  WriteUint<internal::StaticPrefixLength(max_length)>(in.size(), output);
+  output->append(in);
+}
+
 }  // namespace serializer
 
 }  // namespace cert_trans
@@ -113,6 +154,13 @@ class TLSDeserializer {
 
   bool ReadVarBytes(size_t max_length, std::string* result);
 
+  // As above, but pointing |*data| into the input rather than copying
+  // it, for callers which skip it, or copy it straight to where it
+  // belongs.
+  bool ReadFixedBytes(size_t bytes, const char** data);
+
+  bool ReadVarBytes(size_t max_length, const char** data, size_t* length);
+
   cert_trans::serialization::DeserializeResult ReadList(
       size_t max_total_length, size_t max_elem_length, repeated_string* out);
 
@@ -139,6 +187,9 @@ class TLSDeserializer {
   }
 
  private:
+  // For reading the elements of a list, within the input of another.
+  TLSDeserializer(const char* input, size_t length);
+
   bool ReadLengthPrefix(size_t max_length, size_t* result);
   const char* current_pos_;
   size_t bytes_remaining_;
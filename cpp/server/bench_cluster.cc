@@ -0,0 +1,678 @@
+// Simulates a log cluster in a single process, to evaluate changes to
+// the sequencing, signing and replication before deploying them: runs
+// --num_nodes nodes, each with its own database, Server (with its
+// ClusterStateController, ContinuousFetcher and LogLookup), TreeSigner
+// and log threads, like ct-server, sharing a FakeEtcdClient with
+// --etcd_latency_ms added to every request and watch notification.
+//
+// Submissions are sent to the nodes in turn at --qps, and the nodes
+// fetch the entries from each other over HTTP, on consecutive ports
+// from --base_port. At the end, it reports the merge delay (from the
+// submission to the first serving STH including it), how long the
+// nodes took to all serve each new serving STH, and the CPU time
+// used by each kind of thread.
+//
+// The usual ct-server flags (--sequencing_frequency_seconds,
+// --tree_signing_frequency_seconds, and so on) apply to all nodes.
+#include <dirent.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/obj_mac.h>
+#include <openssl/pem.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "log/cluster_state_controller.h"
+#include "log/frontend.h"
+#include "log/frontend_signer.h"
+#include "log/leveldb_db.h"
+#include "log/log_lookup.h"
+#include "log/log_signer.h"
+#include "log/log_verifier.h"
+#include "log/tree_signer.h"
+#include "merkletree/merkle_verifier.h"
+#include "merkletree/serial_hasher.h"
+#include "net/url_fetcher.h"
+#include "proto/cert_serializer.h"
+#include "server/certificate_handler.h"
+#include "server/log_processes.h"
+#include "server/server.h"
+#include "server/staleness_tracker.h"
+#include "tools/clustertool.h"
+#include "util/etcd.h"
+#include "util/fake_etcd.h"
+#include "util/init.h"
+#include "util/libevent_wrapper.h"
+#include "util/openssl_scoped_types.h"
+#include "util/status.h"
+#include "util/thread_pool.h"
+#include "util/util.h"
+
+DECLARE_int32(port);
+
+DEFINE_int32(num_nodes, 3, "number of nodes in the simulated cluster");
+DEFINE_int32(base_port, 16962,
+             "HTTP port of the first node, the others using the following "
+             "ones");
+DEFINE_int32(etcd_latency_ms, 5,
+             "delay added to every etcd request, and to every watch "
+             "notification");
+DEFINE_double(qps, 100, "number of submissions to send per second");
+DEFINE_int32(load_threads, 16,
+             "number of threads sending the submissions, each one at a "
+             "time");
+DEFINE_int32(duration_seconds, 60, "how long to send submissions for");
+DEFINE_int32(drain_seconds, 30,
+             "how long to keep running once the submissions stop, for the "
+             "last ones to make it into a serving STH");
+DEFINE_int32(sample_interval_ms, 20,
+             "how often to look at the serving STH and at the trees of the "
+             "nodes");
+DEFINE_double(guard_window_seconds, 5,
+              "unsequenced entries newer than this number of seconds will "
+              "not be sequenced (ct-server defaults to 60)");
+DEFINE_int32(minimum_serving_nodes, 2,
+             "minimum_serving_nodes of the cluster configuration");
+DEFINE_double(minimum_serving_fraction, 0.5,
+              "minimum_serving_fraction of the cluster configuration");
+DEFINE_string(sim_dir, "/tmp",
+              "existing directory to create the databases of the nodes in "
+              "(a new directory in it)");
+
+namespace libevent = cert_trans::libevent;
+
+using cert_trans::CertificateHttpHandler;
+using cert_trans::Database;
+using cert_trans::EtcdClient;
+using cert_trans::FakeEtcdClient;
+using cert_trans::LevelDB;
+using cert_trans::LoggedEntry;
+using cert_trans::ScopedBIO;
+using cert_trans::ScopedEC_KEY;
+using cert_trans::ScopedEVP_PKEY;
+using cert_trans::Server;
+using cert_trans::StalenessTracker;
+using cert_trans::ThreadPool;
+using cert_trans::TreeSigner;
+using cert_trans::UrlFetcher;
+using std::atomic;
+using std::bind;
+using std::chrono::duration;
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::cout;
+using std::endl;
+using std::function;
+using std::make_shared;
+using std::map;
+using std::mt19937_64;
+using std::shared_ptr;
+using std::string;
+using std::this_thread::sleep_for;
+using std::thread;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+using util::Task;
+
+namespace {
+
+
+// Forwards to another EtcdClient, delaying every request, and every
+// watch notification, by a fixed latency.
+class DelayedEtcdClient : public EtcdClient {
+ public:
+  // Does not take ownership of |etcd|. The delays run on |base|,
+  // which must be dispatched.
+  DelayedEtcdClient(EtcdClient* etcd, libevent::Base* base,
+                    const duration<double>& latency)
+      : etcd_(CHECK_NOTNULL(etcd)),
+        base_(CHECK_NOTNULL(base)),
+        latency_(latency) {
+  }
+
+  void Get(const Request& req, GetResponse* resp, Task* task) override {
+    Delayed(task, [this, req, resp](Task* task) {
+      etcd_->Get(req, resp, task);
+    });
+  }
+
+  void Create(const string& key, const string& value, Response* resp,
+              Task* task) override {
+    Delayed(task, [this, key, value, resp](Task* task) {
+      etcd_->Create(key, value, resp, task);
+    });
+  }
+
+  void CreateWithTTL(const string& key, const string& value,
+                     const seconds& ttl, Response* resp,
+                     Task* task) override {
+    Delayed(task, [this, key, value, ttl, resp](Task* task) {
+      etcd_->CreateWithTTL(key, value, ttl, resp, task);
+    });
+  }
+
+  void Update(const string& key, const string& value,
+              const int64_t previous_index, Response* resp,
+              Task* task) override {
+    Delayed(task, [this, key, value, previous_index, resp](Task* task) {
+      etcd_->Update(key, value, previous_index, resp, task);
+    });
+  }
+
+  void UpdateWithTTL(const string& key, const string& value,
+                     const seconds& ttl, const int64_t previous_index,
+                     Response* resp, Task* task) override {
+    Delayed(task,
+            [this, key, value, ttl, previous_index, resp](Task* task) {
+              etcd_->UpdateWithTTL(key, value, ttl, previous_index, resp,
+                                   task);
+            });
+  }
+
+  void ForceSet(const string& key, const string& value, Response* resp,
+                Task* task) override {
+    Delayed(task, [this, key, value, resp](Task* task) {
+      etcd_->ForceSet(key, value, resp, task);
+    });
+  }
+
+  void ForceSetWithTTL(const string& key, const string& value,
+                       const seconds& ttl, Response* resp,
+                       Task* task) override {
+    Delayed(task, [this, key, value, ttl, resp](Task* task) {
+      etcd_->ForceSetWithTTL(key, value, ttl, resp, task);
+    });
+  }
+
+  void RefreshTTL(const string& key, const seconds& ttl, Response* resp,
+                  Task* task) override {
+    Delayed(task, [this, key, ttl, resp](Task* task) {
+      etcd_->RefreshTTL(key, ttl, resp, task);
+    });
+  }
+
+  void Delete(const string& key, const int64_t current_index,
+              Task* task) override {
+    Delayed(task, [this, key, current_index](Task* task) {
+      etcd_->Delete(key, current_index, task);
+    });
+  }
+
+  void ForceDelete(const string& key, Task* task) override {
+    Delayed(task,
+            [this, key](Task* task) { etcd_->ForceDelete(key, task); });
+  }
+
+  void GetStoreStats(StatsResponse* resp, Task* task) override {
+    Delayed(task,
+            [this, resp](Task* task) { etcd_->GetStoreStats(resp, task); });
+  }
+
+  void Watch(const string& key, const WatchCallback& cb,
+             Task* task) override {
+    Delayed(task, [this, key, cb](Task* task) {
+      etcd_->Watch(key, [this, cb, task](const vector<Node>& updates) {
+        // The notifications all run on |base_|, and so stay in order.
+        base_->Delay(latency_, task->AddChildWithExecutor(
+                                   [cb, updates](Task* child) {
+                                     if (child->status().ok()) {
+                                       cb(updates);
+                                     }
+                                   },
+                                   base_));
+      }, task);
+    });
+  }
+
+ private:
+  // Runs |op| with |task| after the latency, unless |task| is
+  // cancelled first.
+  void Delayed(Task* task, const function<void(Task*)>& op) {
+    base_->Delay(latency_, task->AddChildWithExecutor(
+                               [task, op](Task* child) {
+                                 if (child->status().ok()) {
+                                   op(task);
+                                 } else {
+                                   task->Return(child->status());
+                                 }
+                               },
+                               base_));
+  }
+
+  EtcdClient* const etcd_;
+  libevent::Base* const base_;
+  const duration<double> latency_;
+
+  DISALLOW_COPY_AND_ASSIGN(DelayedEtcdClient);
+};
+
+
+// A new log key, as PEM, so that every signer and verifier can have
+// its own copy.
+string NewKeyPem() {
+  ScopedEC_KEY ec_key(EC_KEY_new_by_curve_name(NID_X9_62_prime256v1));
+  CHECK(ec_key);
+  CHECK_EQ(1, EC_KEY_generate_key(ec_key.get()));
+  EC_KEY_set_asn1_flag(ec_key.get(), OPENSSL_EC_NAMED_CURVE);
+  ScopedEVP_PKEY pkey(EVP_PKEY_new());
+  CHECK_EQ(1, EVP_PKEY_set1_EC_KEY(pkey.get(), ec_key.get()));
+
+  ScopedBIO bio(BIO_new(BIO_s_mem()));
+  CHECK_EQ(1, PEM_write_bio_PrivateKey(bio.get(), pkey.get(), nullptr,
+                                       nullptr, 0, nullptr, nullptr));
+  char* data;
+  const long size(BIO_get_mem_data(bio.get(), &data));
+  return string(data, size);
+}
+
+
+EVP_PKEY* ReadKeyPem(const string& pem) {
+  ScopedBIO bio(BIO_new_mem_buf(const_cast<char*>(pem.data()), pem.size()));
+  return CHECK_NOTNULL(
+      PEM_read_bio_PrivateKey(bio.get(), nullptr, nullptr, nullptr));
+}
+
+
+// Starts a thread running |closure|, named |name|, to account for
+// its CPU time.
+thread NamedThread(const string& name, const function<void()>& closure) {
+  return thread([name, closure]() {
+    util::SetThreadName(name);
+    closure();
+  });
+}
+
+
+// One node of the cluster, set up like ct-server sets up its log,
+// apart from accepting submissions directly rather than over HTTP.
+struct Node {
+  Node(int index, const string& dir, const string& key_pem,
+       EtcdClient* etcd)
+      : db(new LevelDB(dir)),
+        log_signer(new LogSigner(ReadKeyPem(key_pem))),
+        log_verifier(new LogVerifier(
+            new LogSigVerifier(ReadKeyPem(key_pem)),
+            new MerkleVerifier(unique_ptr<Sha256Hasher>(new Sha256Hasher)))),
+        event_base(make_shared<libevent::Base>()),
+        internal_pool(new ThreadPool("internal", 8)),
+        http_pool(new ThreadPool("http", 4)),
+        url_fetcher(new UrlFetcher(event_base.get(), internal_pool.get())) {
+    // The Server listens on --port, and publishes it for the others to
+    // fetch from.
+    FLAGS_port = FLAGS_base_port + index;
+    server.reset(new Server(event_base, internal_pool.get(), http_pool.get(),
+                            db.get(), etcd, url_fetcher.get(),
+                            log_verifier.get()));
+    server->Initialise(false /* is_mirror */);
+
+    frontend.reset(new Frontend(new FrontendSigner(
+        db.get(), server->consistent_store(), log_signer.get())));
+    staleness_tracker.reset(
+        new StalenessTracker(server->cluster_state_controller(),
+                             internal_pool.get(), event_base.get()));
+    // Only to serve the entries to the other nodes.
+    handler.reset(new CertificateHttpHandler(
+        server->log_lookup(), db.get(), server->cluster_state_controller(),
+        nullptr /* checker */, nullptr /* frontend */, internal_pool.get(),
+        nullptr /* crypto_pool */, event_base.get(),
+        staleness_tracker.get()));
+    handler->SetProxy(server->proxy());
+    handler->Add(server->http_server());
+
+    tree_signer.reset(new TreeSigner(
+        duration<double>(FLAGS_guard_window_seconds), db.get(),
+        server->log_lookup()->GetCompactMerkleTree(new Sha256Hasher),
+        server->consistent_store(), log_signer.get(), internal_pool.get()));
+  }
+
+  // Like StartLogThreads() in ct-server.
+  void StartLogThreads() {
+    const function<bool()> is_master(bind(&Server::IsMaster, server.get()));
+    threads.emplace_back(NamedThread(
+        "sequencer", bind(&cert_trans::SequenceEntries, tree_signer.get(),
+                          server->consistent_store(), is_master)));
+    threads.emplace_back(NamedThread(
+        "cleanup", bind(&cert_trans::CleanUpEntries,
+                        server->consistent_store(), is_master)));
+    threads.emplace_back(NamedThread(
+        "signer", bind(&cert_trans::SignMerkleTree, tree_signer.get(),
+                       server->consistent_store(),
+                       server->cluster_state_controller())));
+  }
+
+  const unique_ptr<Database> db;
+  const unique_ptr<LogSigner> log_signer;
+  const unique_ptr<LogVerifier> log_verifier;
+  const shared_ptr<libevent::Base> event_base;
+  const unique_ptr<ThreadPool> internal_pool;
+  const unique_ptr<ThreadPool> http_pool;
+  const unique_ptr<UrlFetcher> url_fetcher;
+  unique_ptr<Server> server;
+  unique_ptr<Frontend> frontend;
+  unique_ptr<StalenessTracker> staleness_tracker;
+  unique_ptr<CertificateHttpHandler> handler;
+  unique_ptr<TreeSigner> tree_signer;
+  vector<thread> threads;
+};
+
+
+// A new X.509 entry, with a leaf and intermediate of about the size
+// of real ones.
+ct::LogEntry NewEntry(int64_t index) {
+  mt19937_64 rng(index);
+  string leaf(1000 + rng() % 1000, '\0');
+  for (char& c : leaf) {
+    c = static_cast<char>(rng());
+  }
+  ct::LogEntry entry;
+  entry.set_type(ct::X509_ENTRY);
+  entry.mutable_x509_entry()->set_leaf_certificate(leaf);
+  entry.mutable_x509_entry()->add_certificate_chain(string(1200, 'i'));
+  return entry;
+}
+
+
+// Sends the submissions to the nodes in turn, at --qps.
+class LoadGenerator {
+ public:
+  explicit LoadGenerator(const vector<unique_ptr<Node>>* nodes)
+      : nodes_(nodes),
+        pool_("load", FLAGS_load_threads),
+        sent_(0),
+        failed_(0),
+        skipped_(0),
+        outstanding_(0) {
+  }
+
+  void Run(const steady_clock::duration& how_long) {
+    const steady_clock::time_point start(steady_clock::now());
+    const duration<double> interval(1 / FLAGS_qps);
+    for (int64_t i = 0;; ++i) {
+      const steady_clock::time_point due(
+          start + std::chrono::duration_cast<steady_clock::duration>(
+                      interval * i));
+      if (due - start >= how_long) {
+        break;
+      }
+      sleep_for(due - steady_clock::now());
+      // Do not let the submissions pile up if the cluster cannot keep
+      // up, so that the rate stays the one asked for.
+      if (outstanding_.load() >= FLAGS_load_threads) {
+        ++skipped_;
+        continue;
+      }
+      ++outstanding_;
+      Node* const node((*nodes_)[i % nodes_->size()].get());
+      pool_.Add([this, node, i]() {
+        ct::SignedCertificateTimestamp sct;
+        const util::Status status(node->frontend->QueueProcessedEntry(
+            util::Status::OK, NewEntry(i), &sct));
+        ++(status.ok() ? sent_ : failed_);
+        --outstanding_;
+      });
+    }
+  }
+
+  void Report() const {
+    cout << "Submissions: " << sent_.load() << " accepted, "
+         << failed_.load() << " failed, " << skipped_.load()
+         << " skipped (too many in flight)" << endl;
+  }
+
+ private:
+  const vector<unique_ptr<Node>>* const nodes_;
+  ThreadPool pool_;
+  atomic<int64_t> sent_;
+  atomic<int64_t> failed_;
+  atomic<int64_t> skipped_;
+  atomic<int> outstanding_;
+
+  DISALLOW_COPY_AND_ASSIGN(LoadGenerator);
+};
+
+
+// Watches the serving STH of the cluster and the trees of the nodes.
+class Observer {
+ public:
+  explicit Observer(const vector<unique_ptr<Node>>* nodes)
+      : nodes_(nodes), serving_size_(0) {
+  }
+
+  void Sample() {
+    const uint64_t now_ms(util::TimeInMilliseconds());
+    const util::StatusOr<ct::SignedTreeHead> serving_sth(
+        (*nodes_)[0]->server->consistent_store()->GetServingSTH());
+    if (serving_sth.ok() &&
+        serving_sth.ValueOrDie().tree_size() > serving_size_) {
+      NewServingSTH(serving_sth.ValueOrDie().tree_size(), now_ms);
+    }
+
+    // Which of the serving STHs all the nodes have caught up with.
+    int64_t min_node_size(-1);
+    for (const auto& node : *nodes_) {
+      const int64_t size(node->server->log_lookup()->GetSTH().tree_size());
+      min_node_size = min_node_size < 0 ? size : std::min(min_node_size, size);
+    }
+    while (!converging_.empty() &&
+           converging_.begin()->first <= min_node_size) {
+      convergence_ms_.push_back(now_ms - converging_.begin()->second);
+      converging_.erase(converging_.begin());
+    }
+  }
+
+  void Report() const {
+    cout << "Serving tree size: " << serving_size_ << endl;
+    ReportDistribution("Merge delay", merge_delay_ms_);
+    ReportDistribution("STH convergence", convergence_ms_);
+    if (!converging_.empty()) {
+      cout << "  " << converging_.size()
+           << " serving STHs not on all nodes yet" << endl;
+    }
+  }
+
+ private:
+  void NewServingSTH(int64_t tree_size, uint64_t now_ms) {
+    // The entries were sequenced by the master, which has them all.
+    const Database* db(nullptr);
+    for (const auto& node : *nodes_) {
+      if (node->server->IsMaster()) {
+        db = node->db.get();
+      }
+    }
+    for (int64_t i = serving_size_; db && i < tree_size; ++i) {
+      LoggedEntry logged;
+      if (db->LookupByIndex(i, &logged) == Database::LOOKUP_OK) {
+        // The SCT timestamp is when the entry was submitted.
+        merge_delay_ms_.push_back(now_ms - logged.timestamp());
+      }
+    }
+    serving_size_ = tree_size;
+    converging_.emplace(tree_size, now_ms);
+  }
+
+  static void ReportDistribution(const string& name, vector<double> ms) {
+    cout << name << ": " << ms.size() << " samples";
+    if (ms.empty()) {
+      cout << endl;
+      return;
+    }
+    std::sort(ms.begin(), ms.end());
+    const auto percentile([&ms](double p) {
+      return ms[std::min(ms.size() - 1, static_cast<size_t>(p * ms.size()))];
+    });
+    cout << std::fixed << std::setprecision(0) << ", ms: p50 "
+         << percentile(0.5) << ", p90 " << percentile(0.9) << ", p99 "
+         << percentile(0.99) << ", max " << ms.back() << endl;
+  }
+
+  const vector<unique_ptr<Node>>* const nodes_;
+  int64_t serving_size_;
+  vector<double> merge_delay_ms_;
+  // The serving STHs not served by all nodes yet, by tree size, with
+  // when they were first seen.
+  map<int64_t, uint64_t> converging_;
+  vector<double> convergence_ms_;
+};
+
+
+// The CPU time used by the threads of this process so far, in
+// seconds, by thread name.
+map<string, double> CpuSecondsByThreadName() {
+  map<string, double> cpu;
+  DIR* const dir(opendir("/proc/self/task"));
+  if (!dir) {
+    return cpu;
+  }
+  const double ticks_per_second(sysconf(_SC_CLK_TCK));
+  while (const dirent* const entry = readdir(dir)) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    const string task(string("/proc/self/task/") + entry->d_name);
+    string name, stat;
+    std::ifstream comm_file(task + "/comm");
+    std::ifstream stat_file(task + "/stat");
+    if (!std::getline(comm_file, name) || !std::getline(stat_file, stat)) {
+      continue;
+    }
+    // The fields after the name, in parentheses, which may contain
+    // anything: utime and stime are the 12th and 13th.
+    std::istringstream fields(stat.substr(stat.rfind(')') + 2));
+    string field;
+    double utime(0), stime(0);
+    for (int i = 1; i <= 13 && fields >> field; ++i) {
+      if (i == 12) {
+        utime = std::stod(field);
+      } else if (i == 13) {
+        stime = std::stod(field);
+      }
+    }
+    cpu[name] += (utime + stime) / ticks_per_second;
+  }
+  closedir(dir);
+  return cpu;
+}
+
+
+void ReportCpu(const map<string, double>& before,
+               const map<string, double>& after,
+               const duration<double>& elapsed) {
+  cout << "CPU by thread name (seconds, and cores used on average):"
+       << endl;
+  for (const auto& it : after) {
+    const auto before_it(before.find(it.first));
+    const double used(it.second -
+                      (before_it == before.end() ? 0 : before_it->second));
+    cout << "  " << std::left << std::setw(16) << it.first << std::right
+         << std::fixed << std::setprecision(2) << std::setw(10) << used
+         << std::setw(8) << used / elapsed.count() << endl;
+  }
+}
+
+
+}  // namespace
+
+
+int main(int argc, char* argv[]) {
+  // Ignore various signals whilst we start up.
+  signal(SIGHUP, SIG_IGN);
+  signal(SIGINT, SIG_IGN);
+  signal(SIGTERM, SIG_IGN);
+
+  ConfigureSerializerForV1CT();
+  util::InitCT(&argc, &argv);
+  Server::StaticInit();
+
+  CHECK_GT(FLAGS_num_nodes, 0);
+  CHECK_GT(FLAGS_qps, 0);
+  CHECK_GT(FLAGS_load_threads, 0);
+  CHECK_GT(FLAGS_sample_interval_ms, 0);
+
+  string root(FLAGS_sim_dir + "/bench_cluster.XXXXXX");
+  PCHECK(mkdtemp(&root[0])) << "mkdtemp(" << root << ")";
+  LOG(INFO) << "Databases in " << root;
+
+  // The cluster state, shared by all the nodes.
+  const shared_ptr<libevent::Base> etcd_base(make_shared<libevent::Base>());
+  libevent::EventPumpThread etcd_pump(etcd_base, "etcd");
+  FakeEtcdClient fake_etcd(etcd_base.get());
+  DelayedEtcdClient etcd(&fake_etcd, etcd_base.get(),
+                         milliseconds(FLAGS_etcd_latency_ms));
+
+  const string key_pem(NewKeyPem());
+  vector<unique_ptr<Node>> nodes;
+  for (int i = 0; i < FLAGS_num_nodes; ++i) {
+    nodes.emplace_back(
+        new Node(i, root + "/node" + to_string(i), key_pem, &etcd));
+  }
+
+  // Initialise the log, from whichever node wins the election, like
+  // ct-clustertool initlog does.
+  Node* master(nullptr);
+  while (!master) {
+    sleep_for(milliseconds(100));
+    for (const auto& node : nodes) {
+      if (node->server->IsMaster()) {
+        master = node.get();
+      }
+    }
+  }
+  ct::ClusterConfig config;
+  config.set_minimum_serving_nodes(FLAGS_minimum_serving_nodes);
+  config.set_minimum_serving_fraction(FLAGS_minimum_serving_fraction);
+  CHECK_EQ(util::Status::OK,
+           cert_trans::InitLog(config, master->tree_signer.get(),
+                               master->server->consistent_store()));
+  for (const auto& node : nodes) {
+    node->StartLogThreads();
+  }
+
+  LOG(INFO) << "Sending submissions for " << FLAGS_duration_seconds << "s.";
+  const map<string, double> cpu_before(CpuSecondsByThreadName());
+  const steady_clock::time_point start(steady_clock::now());
+  LoadGenerator load(&nodes);
+  thread load_thread(NamedThread(
+      "load", bind(&LoadGenerator::Run, &load,
+                   steady_clock::duration(seconds(FLAGS_duration_seconds)))));
+
+  Observer observer(&nodes);
+  const steady_clock::time_point end(
+      start + seconds(FLAGS_duration_seconds + FLAGS_drain_seconds));
+  while (steady_clock::now() < end) {
+    observer.Sample();
+    sleep_for(milliseconds(FLAGS_sample_interval_ms));
+  }
+  load_thread.join();
+
+  ReportCpu(cpu_before, CpuSecondsByThreadName(),
+            steady_clock::now() - start);
+  load.Report();
+  observer.Report();
+  cout.flush();
+
+  // Like ct-server, the log threads never return, so do not wait for
+  // them (or for the nodes, which they use). The databases are left
+  // for inspection.
+  LOG(INFO) << "Databases left in " << root;
+  _exit(EXIT_SUCCESS);
+}
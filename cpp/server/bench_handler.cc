@@ -0,0 +1,648 @@
+// Measures the cost of the HTTP endpoints of ct-server, away from the
+// load of a real cluster: sets up a single node in the process (its
+// database, Server with its LogLookup, and CertificateHttpHandler with
+// a CertChecker and Frontend, like ct-server), populates it with
+// --num_entries entries under a serving STH, and then sends it
+// --requests of each kind in turn, one at a time, from a client
+// thread of its own:
+//   - get-sth,
+//   - get-entries, for each of --get_entries_sizes,
+//   - get-proof-by-hash and get-sth-consistency, for random leaves and
+//     tree sizes,
+//   - add-chain, with new chains (issued by a CA of its own, which the
+//     log trusts) and with a chain already submitted.
+//
+// The requests go over a loopback connection, as libevent only replies
+// to requests that came on one, but the client is kept out of the
+// figures: for each kind of request, it reports the latency, the CPU
+// time used by the threads of the server, and the C++ heap allocations
+// they made (counted by replacing operator new), per request.
+//
+// The usual ct-server flags (--get_entries_cache_tiles,
+// --proof_cache_size, and so on) apply.
+#include <event2/http.h>
+#include <dirent.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/obj_mac.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "config.h"
+#include "log/cert_checker.h"
+#include "log/frontend.h"
+#include "log/frontend_signer.h"
+#include "log/leveldb_db.h"
+#include "log/log_lookup.h"
+#include "log/log_signer.h"
+#include "log/log_verifier.h"
+#include "log/tree_signer.h"
+#include "merkletree/merkle_verifier.h"
+#include "merkletree/serial_hasher.h"
+#include "net/url_fetcher.h"
+#include "proto/cert_serializer.h"
+#include "server/certificate_handler.h"
+#include "server/server.h"
+#include "server/staleness_tracker.h"
+#include "tools/clustertool.h"
+#include "util/fake_etcd.h"
+#include "util/init.h"
+#include "util/json_wrapper.h"
+#include "util/libevent_wrapper.h"
+#include "util/openssl_scoped_types.h"
+#include "util/status.h"
+#include "util/sync_task.h"
+#include "util/thread_pool.h"
+#include "util/util.h"
+
+DECLARE_int32(port);
+
+DEFINE_int32(num_entries, 10000,
+             "number of entries to populate the log with before sending "
+             "the requests");
+DEFINE_int32(requests, 2000, "number of requests of each kind to send");
+DEFINE_string(get_entries_sizes, "1,32,256,1000",
+              "comma-separated numbers of entries to ask for with "
+              "get-entries, each one measured apart");
+DEFINE_string(bench_dir, "/tmp",
+              "existing directory to create the database in (a new "
+              "directory in it)");
+
+namespace libevent = cert_trans::libevent;
+
+using cert_trans::CertChecker;
+using cert_trans::CertificateHttpHandler;
+using cert_trans::Database;
+using cert_trans::FakeEtcdClient;
+using cert_trans::LevelDB;
+using cert_trans::LoggedEntry;
+using cert_trans::ScopedBIO;
+using cert_trans::ScopedEC_KEY;
+using cert_trans::ScopedEVP_PKEY;
+using cert_trans::ScopedX509;
+using cert_trans::ScopedX509_EXTENSION;
+using cert_trans::Server;
+using cert_trans::StalenessTracker;
+using cert_trans::ThreadPool;
+using cert_trans::TreeSigner;
+using cert_trans::URL;
+using cert_trans::UrlFetcher;
+using std::atomic;
+using std::chrono::duration;
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::cout;
+using std::endl;
+using std::make_shared;
+using std::map;
+using std::mt19937_64;
+using std::shared_ptr;
+using std::string;
+using std::this_thread::sleep_for;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+using util::SyncTask;
+
+namespace {
+
+
+// The C++ heap allocations so far, made by the threads which do not
+// have |not_counted| set.
+atomic<int64_t> num_allocations(0);
+atomic<int64_t> allocated_bytes(0);
+#ifdef HAVE_THREAD_LOCAL
+thread_local bool not_counted(false);
+#elif HAVE___THREAD
+__thread bool not_counted(false);
+#else
+#error No suitable thread local storage available
+#endif
+
+
+}  // namespace
+
+
+void* operator new(size_t size) {
+  if (!not_counted) {
+    num_allocations.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+  }
+  void* const ptr(malloc(size == 0 ? 1 : size));
+  CHECK(ptr) << "out of memory allocating " << size << " bytes";
+  return ptr;
+}
+
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+
+void operator delete(void* ptr) noexcept {
+  free(ptr);
+}
+
+
+void operator delete[](void* ptr) noexcept {
+  free(ptr);
+}
+
+
+namespace {
+
+
+// A new EC key, as PEM, so that every signer and verifier can have
+// its own copy.
+string NewKeyPem() {
+  ScopedEC_KEY ec_key(EC_KEY_new_by_curve_name(NID_X9_62_prime256v1));
+  CHECK(ec_key);
+  CHECK_EQ(1, EC_KEY_generate_key(ec_key.get()));
+  EC_KEY_set_asn1_flag(ec_key.get(), OPENSSL_EC_NAMED_CURVE);
+  ScopedEVP_PKEY pkey(EVP_PKEY_new());
+  CHECK_EQ(1, EVP_PKEY_set1_EC_KEY(pkey.get(), ec_key.get()));
+
+  ScopedBIO bio(BIO_new(BIO_s_mem()));
+  CHECK_EQ(1, PEM_write_bio_PrivateKey(bio.get(), pkey.get(), nullptr,
+                                       nullptr, 0, nullptr, nullptr));
+  char* data;
+  const long size(BIO_get_mem_data(bio.get(), &data));
+  return string(data, size);
+}
+
+
+EVP_PKEY* ReadKeyPem(const string& pem) {
+  ScopedBIO bio(BIO_new_mem_buf(const_cast<char*>(pem.data()), pem.size()));
+  return CHECK_NOTNULL(
+      PEM_read_bio_PrivateKey(bio.get(), nullptr, nullptr, nullptr));
+}
+
+
+// A certificate for |key|, named |name|, signed by |issuer| (with
+// |issuer_key|), or self-signed if |issuer| is NULL.
+ScopedX509 NewCertificate(const string& name, long serial, EVP_PKEY* key,
+                          X509* issuer, EVP_PKEY* issuer_key, bool is_ca) {
+  ScopedX509 cert(CHECK_NOTNULL(X509_new()));
+  CHECK_EQ(1, X509_set_version(cert.get(), 2));
+  CHECK_EQ(1, ASN1_INTEGER_set(X509_get_serialNumber(cert.get()), serial));
+  CHECK(X509_gmtime_adj(X509_get_notBefore(cert.get()), -3600));
+  CHECK(X509_gmtime_adj(X509_get_notAfter(cert.get()), 365 * 24 * 3600));
+  X509_NAME* const subject(X509_get_subject_name(cert.get()));
+  CHECK_EQ(1, X509_NAME_add_entry_by_txt(
+                  subject, "CN", MBSTRING_ASC,
+                  reinterpret_cast<const unsigned char*>(name.c_str()), -1,
+                  -1, 0));
+  CHECK_EQ(1, X509_set_issuer_name(
+                  cert.get(), issuer ? X509_get_subject_name(issuer)
+                                     : subject));
+  CHECK_EQ(1, X509_set_pubkey(cert.get(), key));
+  if (is_ca) {
+    ScopedX509_EXTENSION constraints(CHECK_NOTNULL(X509V3_EXT_conf_nid(
+        nullptr, nullptr, NID_basic_constraints,
+        const_cast<char*>("critical,CA:TRUE"))));
+    CHECK_EQ(1, X509_add_ext(cert.get(), constraints.get(), -1));
+  }
+  CHECK_GT(X509_sign(cert.get(), issuer ? issuer_key : key, EVP_sha256()),
+           0);
+  return cert;
+}
+
+
+string DerEncoding(X509* cert) {
+  unsigned char* der(nullptr);
+  const int size(i2d_X509(cert, &der));
+  CHECK_GT(size, 0);
+  const string ret(reinterpret_cast<char*>(der), size);
+  OPENSSL_free(der);
+  return ret;
+}
+
+
+string PemEncoding(X509* cert) {
+  ScopedBIO bio(BIO_new(BIO_s_mem()));
+  CHECK_EQ(1, PEM_write_bio_X509(bio.get(), cert));
+  char* data;
+  const long size(BIO_get_mem_data(bio.get(), &data));
+  return string(data, size);
+}
+
+
+// Issues the certificates submitted with add-chain, under a root the
+// log trusts.
+class TestCa {
+ public:
+  TestCa()
+      : key_(ReadKeyPem(NewKeyPem())),
+        leaf_key_(ReadKeyPem(NewKeyPem())),
+        root_(NewCertificate("bench_handler root", 1, key_.get(), nullptr,
+                             nullptr, true)),
+        next_serial_(2) {
+  }
+
+  string RootPem() const {
+    return PemEncoding(root_.get());
+  }
+
+  // The body of an add-chain request, for a new leaf certificate.
+  string NewChainBody() {
+    const long serial(next_serial_++);
+    const ScopedX509 leaf(NewCertificate("leaf " + to_string(serial),
+                                         serial, leaf_key_.get(),
+                                         root_.get(), key_.get(), false));
+    JsonArray chain;
+    chain.AddBase64(DerEncoding(leaf.get()));
+    chain.AddBase64(DerEncoding(root_.get()));
+    JsonObject body;
+    body.Add("chain", chain);
+    return body.ToString();
+  }
+
+ private:
+  const ScopedEVP_PKEY key_;
+  // Shared by all the leaves, which only differ by their serial.
+  const ScopedEVP_PKEY leaf_key_;
+  const ScopedX509 root_;
+  long next_serial_;
+};
+
+
+// A new X.509 entry, with a leaf and intermediate of about the size
+// of real ones.
+ct::LogEntry NewEntry(int64_t index) {
+  mt19937_64 rng(index);
+  string leaf(1000 + rng() % 1000, '\0');
+  for (char& c : leaf) {
+    c = static_cast<char>(rng());
+  }
+  ct::LogEntry entry;
+  entry.set_type(ct::X509_ENTRY);
+  entry.mutable_x509_entry()->set_leaf_certificate(leaf);
+  entry.mutable_x509_entry()->add_certificate_chain(string(1200, 'i'));
+  return entry;
+}
+
+
+// The log, set up like ct-server sets up its own, apart from the log
+// threads: the entries are sequenced and signed by Populate() instead.
+struct Node {
+  Node(const string& dir, const string& key_pem, const string& root_pem)
+      : db(new LevelDB(dir)),
+        log_signer(new LogSigner(ReadKeyPem(key_pem))),
+        log_verifier(new LogVerifier(
+            new LogSigVerifier(ReadKeyPem(key_pem)),
+            new MerkleVerifier(unique_ptr<Sha256Hasher>(new Sha256Hasher)))),
+        event_base(make_shared<libevent::Base>()),
+        etcd_base(make_shared<libevent::Base>()),
+        etcd_pump(etcd_base, "etcd"),
+        etcd(etcd_base.get()),
+        internal_pool(new ThreadPool("internal", 8)),
+        http_pool(new ThreadPool("http", 4)),
+        url_fetcher(new UrlFetcher(event_base.get(), internal_pool.get())) {
+    CHECK(checker.LoadTrustedCertificates(vector<string>{root_pem}));
+    server.reset(new Server(event_base, internal_pool.get(), http_pool.get(),
+                            db.get(), &etcd, url_fetcher.get(),
+                            log_verifier.get()));
+    server->Initialise(false /* is_mirror */);
+
+    frontend.reset(new Frontend(new FrontendSigner(
+        db.get(), server->consistent_store(), log_signer.get())));
+    staleness_tracker.reset(
+        new StalenessTracker(server->cluster_state_controller(),
+                             internal_pool.get(), event_base.get()));
+    handler.reset(new CertificateHttpHandler(
+        server->log_lookup(), db.get(), server->cluster_state_controller(),
+        &checker, frontend.get(), http_pool.get(), nullptr /* crypto_pool */,
+        event_base.get(), staleness_tracker.get()));
+    handler->SetProxy(server->proxy());
+    handler->Add(server->http_server());
+
+    tree_signer.reset(new TreeSigner(
+        duration<double>(0), db.get(),
+        server->log_lookup()->GetCompactMerkleTree(new Sha256Hasher),
+        server->consistent_store(), log_signer.get(), internal_pool.get()));
+  }
+
+  // Adds |num_entries| entries, and makes a serving STH with them.
+  void Populate(int64_t num_entries) {
+    while (!server->IsMaster()) {
+      sleep_for(milliseconds(100));
+    }
+    ct::ClusterConfig config;
+    config.set_minimum_serving_nodes(1);
+    config.set_minimum_serving_fraction(1);
+    CHECK_EQ(util::Status::OK,
+             cert_trans::InitLog(config, tree_signer.get(),
+                                 server->consistent_store()));
+
+    const int64_t kBatchSize(1000);
+    for (int64_t i = 0; i < num_entries; ++i) {
+      ct::SignedCertificateTimestamp sct;
+      CHECK_EQ(util::Status::OK, frontend->QueueProcessedEntry(
+                                     util::Status::OK, NewEntry(i), &sct));
+      if ((i + 1) % kBatchSize == 0 || i + 1 == num_entries) {
+        while (db->TreeSize() <= i) {
+          CHECK_EQ(util::Status::OK, tree_signer->SequenceNewEntries());
+        }
+      }
+    }
+    CHECK_EQ(TreeSigner::OK, tree_signer->UpdateTree());
+    server->cluster_state_controller()->NewTreeHead(
+        tree_signer->LatestSTH());
+
+    // Until then, the requests would be proxied.
+    const steady_clock::time_point deadline(steady_clock::now() +
+                                            seconds(60));
+    while (server->log_lookup()->GetSTH().tree_size() < num_entries ||
+           staleness_tracker->IsNodeStale()) {
+      CHECK(steady_clock::now() < deadline)
+          << "the node did not serve the entries in time";
+      sleep_for(milliseconds(100));
+    }
+  }
+
+  const unique_ptr<Database> db;
+  const unique_ptr<LogSigner> log_signer;
+  const unique_ptr<LogVerifier> log_verifier;
+  const shared_ptr<libevent::Base> event_base;
+  // The cluster state, on a base of its own, as the Server pumps
+  // |event_base|.
+  const shared_ptr<libevent::Base> etcd_base;
+  libevent::EventPumpThread etcd_pump;
+  FakeEtcdClient etcd;
+  const unique_ptr<ThreadPool> internal_pool;
+  const unique_ptr<ThreadPool> http_pool;
+  const unique_ptr<UrlFetcher> url_fetcher;
+  CertChecker checker;
+  unique_ptr<Server> server;
+  unique_ptr<Frontend> frontend;
+  unique_ptr<StalenessTracker> staleness_tracker;
+  unique_ptr<CertificateHttpHandler> handler;
+  unique_ptr<TreeSigner> tree_signer;
+};
+
+
+// The CPU time used by the threads of this process so far, in
+// seconds, by thread name.
+map<string, double> CpuSecondsByThreadName() {
+  map<string, double> cpu;
+  DIR* const dir(opendir("/proc/self/task"));
+  if (!dir) {
+    return cpu;
+  }
+  const double ticks_per_second(sysconf(_SC_CLK_TCK));
+  while (const dirent* const entry = readdir(dir)) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    const string task(string("/proc/self/task/") + entry->d_name);
+    string name, stat;
+    std::ifstream comm_file(task + "/comm");
+    std::ifstream stat_file(task + "/stat");
+    if (!std::getline(comm_file, name) || !std::getline(stat_file, stat)) {
+      continue;
+    }
+    // The fields after the name, in parentheses, which may contain
+    // anything: utime and stime are the 12th and 13th.
+    std::istringstream fields(stat.substr(stat.rfind(')') + 2));
+    string field;
+    double utime(0), stime(0);
+    for (int i = 1; i <= 13 && fields >> field; ++i) {
+      if (i == 12) {
+        utime = std::stod(field);
+      } else if (i == 13) {
+        stime = std::stod(field);
+      }
+    }
+    cpu[name] += (utime + stime) / ticks_per_second;
+  }
+  closedir(dir);
+  return cpu;
+}
+
+
+// The CPU time of the threads of the server, leaving out those of
+// the client (and the main thread, which waits for it).
+double ServerCpuSeconds() {
+  double total(0);
+  for (const auto& it : CpuSecondsByThreadName()) {
+    if (it.first != "client" && it.first != "bench_handler") {
+      total += it.second;
+    }
+  }
+  return total;
+}
+
+
+string UriEncode(const string& input) {
+  const unique_ptr<char, void (*)(void*)> output(
+      evhttp_uriencode(input.data(), input.size(), false), &free);
+
+  return output.get();
+}
+
+
+vector<int> SplitSizes(const string& flag) {
+  vector<int> sizes;
+  std::istringstream in(flag);
+  string part;
+  while (std::getline(in, part, ',')) {
+    if (!part.empty()) {
+      sizes.push_back(std::stoi(part));
+      CHECK_GT(sizes.back(), 0);
+    }
+  }
+  return sizes;
+}
+
+
+// Sends the requests of each kind in turn, one at a time, and reports
+// what they cost the server.
+class Client {
+ public:
+  Client()
+      : base_(make_shared<libevent::Base>()),
+        pump_(base_, "client"),
+        pool_("client", 1),
+        fetcher_(base_.get(), &pool_) {
+    // The allocations of the client are not those of the server.
+    base_->Add([]() { not_counted = true; });
+    pool_.Add([]() { not_counted = true; });
+    cout << std::left << std::setw(24) << "endpoint" << std::right
+         << std::setw(8) << "errors" << std::setw(10) << "p50 ms"
+         << std::setw(10) << "p99 ms" << std::setw(12) << "cpu us"
+         << std::setw(10) << "allocs" << std::setw(12) << "alloc KB"
+         << std::setw(12) << "reply KB" << endl;
+  }
+
+  // Sends |requests|, and reports them as |name|, per request.
+  void Run(const string& name, const vector<UrlFetcher::Request>& requests) {
+    vector<double> latencies_ms;
+    int64_t errors(0), reply_bytes(0);
+    const double cpu_before(ServerCpuSeconds());
+    const int64_t allocations_before(num_allocations.load());
+    const int64_t bytes_before(allocated_bytes.load());
+    for (const auto& request : requests) {
+      UrlFetcher::Response response;
+      const steady_clock::time_point start(steady_clock::now());
+      SyncTask task(&pool_);
+      fetcher_.Fetch(request, &response, task.task());
+      task.Wait();
+      latencies_ms.push_back(
+          duration<double, std::milli>(steady_clock::now() - start)
+              .count());
+      if (!task.status().ok() || response.status_code != 200) {
+        ++errors;
+      }
+      reply_bytes += response.body.size();
+    }
+    const double cpu(ServerCpuSeconds() - cpu_before);
+    const double count(requests.size());
+
+    std::sort(latencies_ms.begin(), latencies_ms.end());
+    const auto percentile([&latencies_ms](double p) {
+      return latencies_ms[std::min(
+          latencies_ms.size() - 1,
+          static_cast<size_t>(p * latencies_ms.size()))];
+    });
+    cout << std::left << std::setw(24) << name << std::right << std::fixed
+         << std::setw(8) << errors << std::setprecision(3) << std::setw(10)
+         << percentile(0.5) << std::setw(10) << percentile(0.99)
+         << std::setprecision(1) << std::setw(12) << cpu * 1e6 / count
+         << std::setw(10)
+         << (num_allocations.load() - allocations_before) / count
+         << std::setw(12)
+         << (allocated_bytes.load() - bytes_before) / count / 1024
+         << std::setw(12) << reply_bytes / count / 1024 << endl;
+  }
+
+ private:
+  const shared_ptr<libevent::Base> base_;
+  libevent::EventPumpThread pump_;
+  ThreadPool pool_;
+  UrlFetcher fetcher_;
+};
+
+
+UrlFetcher::Request Get(const string& path) {
+  return UrlFetcher::Request(
+      URL("http://127.0.0.1:" + to_string(FLAGS_port) + path));
+}
+
+
+UrlFetcher::Request Post(const string& path, const string& body) {
+  UrlFetcher::Request request(Get(path));
+  request.verb = UrlFetcher::Verb::POST;
+  request.body = body;
+  return request;
+}
+
+
+}  // namespace
+
+
+int main(int argc, char* argv[]) {
+  // Ignore various signals whilst we start up.
+  signal(SIGHUP, SIG_IGN);
+  signal(SIGINT, SIG_IGN);
+  signal(SIGTERM, SIG_IGN);
+
+  ConfigureSerializerForV1CT();
+  util::InitCT(&argc, &argv);
+  Server::StaticInit();
+  util::SetThreadName("bench_handler");
+  not_counted = true;
+
+  CHECK_GT(FLAGS_num_entries, 1);
+  CHECK_GT(FLAGS_requests, 0);
+  const vector<int> get_entries_sizes(SplitSizes(FLAGS_get_entries_sizes));
+
+  string dir(FLAGS_bench_dir + "/bench_handler.XXXXXX");
+  PCHECK(mkdtemp(&dir[0])) << "mkdtemp(" << dir << ")";
+  LOG(INFO) << "Database in " << dir;
+
+  TestCa ca;
+  Node node(dir, NewKeyPem(), ca.RootPem());
+  LOG(INFO) << "Populating the log with " << FLAGS_num_entries
+            << " entries.";
+  node.Populate(FLAGS_num_entries);
+
+  // All the requests are made up front, to keep their cost out of the
+  // measurements.
+  mt19937_64 rng(42);
+  const int64_t tree_size(FLAGS_num_entries);
+  map<string, vector<UrlFetcher::Request>> requests;
+  vector<string> order;
+  const auto add([&requests, &order](const string& name,
+                                     const UrlFetcher::Request& request) {
+    if (requests.find(name) == requests.end()) {
+      order.push_back(name);
+    }
+    requests[name].push_back(request);
+  });
+  for (int i = 0; i < FLAGS_requests; ++i) {
+    add("get-sth", Get("/ct/v1/get-sth"));
+  }
+  for (const int size : get_entries_sizes) {
+    for (int i = 0; i < FLAGS_requests; ++i) {
+      const int64_t start(rng() % std::max<int64_t>(1, tree_size - size));
+      add("get-entries " + to_string(size),
+          Get("/ct/v1/get-entries?start=" + to_string(start) + "&end=" +
+              to_string(start + size - 1)));
+    }
+  }
+  for (int i = 0; i < FLAGS_requests; ++i) {
+    LoggedEntry logged;
+    CHECK_EQ(Database::LOOKUP_OK,
+             node.db->LookupByIndex(rng() % tree_size, &logged));
+    add("get-proof-by-hash",
+        Get("/ct/v1/get-proof-by-hash?hash=" +
+            UriEncode(util::ToBase64(
+                node.server->log_lookup()->LeafHash(logged))) +
+            "&tree_size=" + to_string(tree_size)));
+  }
+  for (int i = 0; i < FLAGS_requests; ++i) {
+    add("get-sth-consistency",
+        Get("/ct/v1/get-sth-consistency?first=" +
+            to_string(1 + rng() % (tree_size - 1)) + "&second=" +
+            to_string(tree_size)));
+  }
+  const string duplicate(ca.NewChainBody());
+  for (int i = 0; i < FLAGS_requests; ++i) {
+    add("add-chain new", Post("/ct/v1/add-chain", ca.NewChainBody()));
+  }
+  for (int i = 0; i < FLAGS_requests; ++i) {
+    add("add-chain duplicate", Post("/ct/v1/add-chain", duplicate));
+  }
+
+  LOG(INFO) << "Sending " << FLAGS_requests << " requests of each kind.";
+  Client client;
+  for (const auto& name : order) {
+    client.Run(name, requests[name]);
+  }
+  cout.flush();
+
+  // The database is left for inspection.
+  LOG(INFO) << "Database left in " << dir;
+  _exit(EXIT_SUCCESS);
+}
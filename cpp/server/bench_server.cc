@@ -0,0 +1,510 @@
+// A load generator for ct-server: sends a mix of submissions (from a
+// corpus of chains, or generated JSON objects for xjson-server) and
+// reads at a fixed rate, and reports the latency of each kind of
+// request. Pointed at ct-server and ct-server-v2 in turn (see
+// --api_version), with only read weights, it compares the read
+// throughput of both.
+#include <event2/http.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "log/cert.h"
+#include "merkletree/serial_hasher.h"
+#include "net/url_fetcher.h"
+#include "util/init.h"
+#include "util/json_wrapper.h"
+#include "util/libevent_wrapper.h"
+#include "util/task.h"
+#include "util/thread_pool.h"
+#include "util/util.h"
+
+namespace libevent = cert_trans::libevent;
+
+using cert_trans::CertChain;
+using cert_trans::ThreadPool;
+using cert_trans::URL;
+using cert_trans::UrlFetcher;
+using std::atomic;
+using std::bind;
+using std::chrono::duration;
+using std::chrono::duration_cast;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::condition_variable;
+using std::cout;
+using std::endl;
+using std::lock_guard;
+using std::make_shared;
+using std::map;
+using std::mt19937;
+using std::mutex;
+using std::placeholders::_1;
+using std::shared_ptr;
+using std::string;
+using std::to_string;
+using std::uniform_int_distribution;
+using std::uniform_real_distribution;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+using util::Task;
+
+DEFINE_string(log_url, "http://localhost:6962", "URL of the log to load");
+DEFINE_string(api_version, "v1",
+              "version of the API to send the requests to, \"v1\" or \"v2\"");
+DEFINE_string(chains, "",
+              "comma-separated list of PEM files, each with a chain (leaf "
+              "first) to submit with add-chain");
+DEFINE_string(precert_chains, "",
+              "comma-separated list of PEM files, each with a precertificate "
+              "chain to submit with add-pre-chain");
+DEFINE_double(qps, 100, "number of requests to send per second, of all kinds");
+DEFINE_int32(duration_seconds, 10, "how long to send requests for");
+DEFINE_int32(max_outstanding, 1000,
+             "number of requests in flight beyond which the ones due are "
+             "skipped (and counted) until some complete");
+DEFINE_double(duplicate_ratio, 0,
+              "fraction of the submissions that resend a chain already sent, "
+              "instead of the next one of the corpus (which is resent anyway "
+              "once the corpus is exhausted)");
+DEFINE_int32(add_chain_weight, 1, "relative share of add-chain requests");
+DEFINE_int32(add_pre_chain_weight, 0,
+             "relative share of add-pre-chain requests");
+DEFINE_int32(add_json_weight, 0,
+             "relative share of add-json requests (for xjson-server)");
+DEFINE_int32(add_json_size, 256,
+             "approximate size of the JSON objects sent with add-json, each "
+             "one different unless resent (see --duplicate_ratio)");
+DEFINE_int32(get_sth_weight, 1, "relative share of get-sth requests");
+DEFINE_int32(get_entries_weight, 0, "relative share of get-entries requests");
+DEFINE_int32(get_proof_weight, 0,
+             "relative share of get-proof-by-hash requests, for the leaves "
+             "returned by get-entries so far");
+DEFINE_int32(get_entries_count, 32,
+             "number of entries asked for by each get-entries request");
+
+namespace {
+
+
+const size_t kMaxKnownLeaves = 10000;
+
+
+enum class Op {
+  ADD_CHAIN,
+  ADD_PRE_CHAIN,
+  ADD_JSON,
+  GET_STH,
+  GET_ENTRIES,
+  GET_PROOF,
+};
+
+
+string OpName(Op op) {
+  switch (op) {
+    case Op::ADD_CHAIN:
+      return "add-chain";
+    case Op::ADD_PRE_CHAIN:
+      return "add-pre-chain";
+    case Op::ADD_JSON:
+      return "add-json";
+    case Op::GET_STH:
+      return "get-sth";
+    case Op::GET_ENTRIES:
+      return "get-entries";
+    case Op::GET_PROOF:
+      return "get-proof-by-hash";
+  }
+  LOG(FATAL) << "unknown op " << static_cast<int>(op);
+  abort();
+}
+
+
+string UriEncode(const string& input) {
+  const unique_ptr<char, void (*)(void*)> output(
+      evhttp_uriencode(input.data(), input.size(), false), &free);
+
+  return output.get();
+}
+
+
+vector<string> SplitFlag(const string& flag) {
+  vector<string> parts;
+  std::istringstream in(flag);
+  string part;
+  while (std::getline(in, part, ',')) {
+    if (!part.empty()) {
+      parts.emplace_back(part);
+    }
+  }
+  return parts;
+}
+
+
+// Reads the chains in |files|, as add-chain request bodies.
+vector<string> LoadCorpus(const string& files) {
+  vector<string> bodies;
+  for (const auto& file : SplitFlag(files)) {
+    string pem;
+    CHECK(util::ReadTextFile(file, &pem)) << "could not read " << file;
+    const CertChain chain(pem);
+    CHECK(chain.IsLoaded()) << "no valid chain in " << file;
+
+    JsonArray json_chain;
+    for (size_t i = 0; i < chain.Length(); ++i) {
+      string der;
+      CHECK(chain.CertAt(i)->DerEncoding(&der).ok());
+      json_chain.AddBase64(der);
+    }
+    JsonObject body;
+    body.Add("chain", json_chain);
+    bodies.emplace_back(body.ToString());
+  }
+  return bodies;
+}
+
+
+// The latencies of one kind of request, and how they ended.
+struct Stats {
+  Stats() : failed(0) {
+  }
+
+  vector<double> latencies_ms;
+  // By HTTP status code.
+  map<int, int64_t> codes;
+  // Requests that got no response at all.
+  int64_t failed;
+};
+
+
+class LoadGenerator {
+ public:
+  LoadGenerator(UrlFetcher* fetcher, ThreadPool* pool)
+      : fetcher_(CHECK_NOTNULL(fetcher)),
+        pool_(CHECK_NOTNULL(pool)),
+        corpus_{{Op::ADD_CHAIN, LoadCorpus(FLAGS_chains)},
+                {Op::ADD_PRE_CHAIN, LoadCorpus(FLAGS_precert_chains)}},
+        tree_size_(0),
+        outstanding_(0),
+        skipped_(0) {
+    next_submission_[Op::ADD_CHAIN] = 0;
+    next_submission_[Op::ADD_PRE_CHAIN] = 0;
+    next_submission_[Op::ADD_JSON] = 0;
+    AddWeight(Op::ADD_CHAIN, FLAGS_add_chain_weight);
+    AddWeight(Op::ADD_PRE_CHAIN, FLAGS_add_pre_chain_weight);
+    AddWeight(Op::ADD_JSON, FLAGS_add_json_weight);
+    AddWeight(Op::GET_STH, FLAGS_get_sth_weight);
+    AddWeight(Op::GET_ENTRIES, FLAGS_get_entries_weight);
+    AddWeight(Op::GET_PROOF, FLAGS_get_proof_weight);
+    CHECK(!ops_.empty()) << "all the weights are zero";
+  }
+
+  // Sends the requests for --duration_seconds, and waits for them.
+  void Run();
+
+  void Report() const;
+
+ private:
+  struct Pending {
+    Op op;
+    steady_clock::time_point sent;
+    UrlFetcher::Request request;
+    UrlFetcher::Response response;
+  };
+
+  void AddWeight(Op op, int weight);
+  void Send(Op op);
+  void Done(Pending* pending, Task* task);
+  // Takes what is useful for later requests from a successful reply.
+  void Learn(Op op, const string& body);
+
+  UrlFetcher* const fetcher_;
+  ThreadPool* const pool_;
+  const map<Op, vector<string>> corpus_;
+  // Each op once for every point of its weight.
+  vector<Op> ops_;
+  // Only used by the sending thread.
+  mt19937 random_;
+  map<Op, size_t> next_submission_;
+
+  atomic<int64_t> tree_size_;
+
+  mutable mutex lock_;
+  condition_variable all_done_;
+  int64_t outstanding_;
+  int64_t skipped_;
+  map<Op, Stats> stats_;
+  // Base64 leaf hashes seen in get-entries replies.
+  vector<string> known_leaves_;
+
+  DISALLOW_COPY_AND_ASSIGN(LoadGenerator);
+};
+
+
+void LoadGenerator::AddWeight(Op op, int weight) {
+  CHECK_GE(weight, 0) << OpName(op);
+  if (weight > 0 && (op == Op::ADD_CHAIN || op == Op::ADD_PRE_CHAIN)) {
+    CHECK(!corpus_.at(op).empty()) << "no chains to send with "
+                                   << OpName(op);
+  }
+  ops_.insert(ops_.end(), weight, op);
+}
+
+
+void LoadGenerator::Run() {
+  CHECK_GT(FLAGS_qps, 0);
+  CHECK(FLAGS_api_version == "v1" || FLAGS_api_version == "v2")
+      << "unknown --api_version: " << FLAGS_api_version;
+  const steady_clock::time_point start(steady_clock::now());
+  const steady_clock::time_point end(start + seconds(FLAGS_duration_seconds));
+  const duration<double> interval(1 / FLAGS_qps);
+  uniform_int_distribution<size_t> pick_op(0, ops_.size() - 1);
+
+  for (int64_t i = 0;; ++i) {
+    const steady_clock::time_point due(
+        start + duration_cast<steady_clock::duration>(interval * i));
+    if (due >= end) {
+      break;
+    }
+    std::this_thread::sleep_until(due);
+
+    {
+      lock_guard<mutex> lock(lock_);
+      if (outstanding_ >= FLAGS_max_outstanding) {
+        ++skipped_;
+        continue;
+      }
+      ++outstanding_;
+    }
+    Send(ops_[pick_op(random_)]);
+  }
+
+  unique_lock<mutex> lock(lock_);
+  all_done_.wait(lock, [this]() { return outstanding_ == 0; });
+}
+
+
+void LoadGenerator::Send(Op op) {
+  Pending* const pending(new Pending);
+  pending->op = op;
+  string path;
+  switch (op) {
+    case Op::ADD_CHAIN:
+    case Op::ADD_PRE_CHAIN: {
+      const vector<string>& corpus(corpus_.at(op));
+      size_t& next(next_submission_[op]);
+      size_t index;
+      if (next > 0 &&
+          uniform_real_distribution<double>()(random_) <
+              FLAGS_duplicate_ratio) {
+        index = uniform_int_distribution<size_t>(0, next - 1)(random_);
+      } else {
+        index = next % corpus.size();
+        next = std::min(next + 1, corpus.size());
+      }
+      path = op == Op::ADD_CHAIN ? "add-chain" : "add-pre-chain";
+      pending->request.verb = UrlFetcher::Verb::POST;
+      pending->request.body = corpus[index];
+      break;
+    }
+    case Op::ADD_JSON: {
+      size_t& next(next_submission_[op]);
+      size_t index(next++);
+      if (index > 0 &&
+          uniform_real_distribution<double>()(random_) <
+              FLAGS_duplicate_ratio) {
+        index = uniform_int_distribution<size_t>(0, index - 1)(random_);
+      }
+      JsonObject body;
+      body.Add("index", static_cast<int64_t>(index));
+      body.Add("data", string(std::max(FLAGS_add_json_size - 32, 0), 'x'));
+      path = "add-json";
+      pending->request.verb = UrlFetcher::Verb::POST;
+      pending->request.body = body.ToString();
+      break;
+    }
+    case Op::GET_STH:
+      path = "get-sth";
+      break;
+    case Op::GET_ENTRIES: {
+      const int64_t tree_size(tree_size_.load());
+      const int64_t start(
+          tree_size > 0
+              ? uniform_int_distribution<int64_t>(0, tree_size - 1)(random_)
+              : 0);
+      path = "get-entries?start=" + to_string(start) + "&end=" +
+             to_string(start + FLAGS_get_entries_count - 1);
+      break;
+    }
+    case Op::GET_PROOF: {
+      string hash;
+      {
+        lock_guard<mutex> lock(lock_);
+        if (!known_leaves_.empty()) {
+          hash = known_leaves_[uniform_int_distribution<size_t>(
+              0, known_leaves_.size() - 1)(random_)];
+        }
+      }
+      if (hash.empty()) {
+        // Nothing to ask for yet.
+        hash = util::ToBase64(string(32, '\0'));
+      }
+      path = "get-proof-by-hash?hash=" + UriEncode(hash) +
+             "&tree_size=" + to_string(tree_size_.load());
+      break;
+    }
+  }
+  pending->request.url =
+      URL(FLAGS_log_url + "/ct/" + FLAGS_api_version + "/" + path);
+
+  pending->sent = steady_clock::now();
+  fetcher_->Fetch(pending->request, &pending->response,
+                  new Task(bind(&LoadGenerator::Done, this, pending, _1),
+                           pool_));
+}
+
+
+void LoadGenerator::Done(Pending* pending, Task* task) {
+  const double latency_ms(
+      duration<double, std::milli>(steady_clock::now() - pending->sent)
+          .count());
+  if (task->status().ok() && pending->response.status_code == 200) {
+    Learn(pending->op, pending->response.body);
+  }
+
+  {
+    lock_guard<mutex> lock(lock_);
+    Stats& stats(stats_[pending->op]);
+    if (task->status().ok()) {
+      stats.latencies_ms.push_back(latency_ms);
+      ++stats.codes[pending->response.status_code];
+    } else {
+      ++stats.failed;
+    }
+    if (--outstanding_ == 0) {
+      all_done_.notify_all();
+    }
+  }
+
+  delete pending;
+  delete task;
+}
+
+
+void LoadGenerator::Learn(Op op, const string& body) {
+  const JsonObject reply(body);
+  if (!reply.Ok()) {
+    return;
+  }
+
+  if (op == Op::GET_STH) {
+    const JsonInt tree_size(reply, "tree_size");
+    if (tree_size.Ok()) {
+      tree_size_.store(tree_size.Value());
+    }
+  } else if (op == Op::GET_ENTRIES) {
+    const JsonArray entries(reply, "entries");
+    if (!entries.Ok()) {
+      return;
+    }
+    vector<string> leaves;
+    for (int i = 0; i < entries.Length(); ++i) {
+      JsonString leaf_input(JsonObject(entries, i), "leaf_input");
+      if (leaf_input.Ok()) {
+        leaves.emplace_back(util::ToBase64(Sha256Hasher::Sha256Digest(
+            string(1, '\0') + leaf_input.FromBase64())));
+      }
+    }
+    lock_guard<mutex> lock(lock_);
+    for (auto& leaf : leaves) {
+      if (known_leaves_.size() >= kMaxKnownLeaves) {
+        break;
+      }
+      known_leaves_.emplace_back(std::move(leaf));
+    }
+  }
+}
+
+
+void LoadGenerator::Report() const {
+  lock_guard<mutex> lock(lock_);
+  cout << std::fixed << std::setprecision(2);
+  if (skipped_ > 0) {
+    cout << skipped_ << " requests skipped, with "
+         << FLAGS_max_outstanding << " in flight already" << endl;
+  }
+
+  for (const auto& it : stats_) {
+    vector<double> latencies(it.second.latencies_ms);
+    std::sort(latencies.begin(), latencies.end());
+    cout << OpName(it.first) << ": " << latencies.size() << " replies";
+    for (const auto& code : it.second.codes) {
+      cout << ", " << code.second << " x HTTP " << code.first;
+    }
+    if (it.second.failed > 0) {
+      cout << ", " << it.second.failed << " failed";
+    }
+    cout << endl;
+    if (latencies.empty()) {
+      continue;
+    }
+
+    const auto percentile([&latencies](double p) {
+      return latencies[std::min(latencies.size() - 1,
+                                static_cast<size_t>(p * latencies.size()))];
+    });
+    cout << "  latency ms: p50 " << percentile(0.5) << ", p90 "
+         << percentile(0.9) << ", p99 " << percentile(0.99) << ", max "
+         << latencies.back() << endl;
+
+    // Powers of two, from 1 ms.
+    map<double, int64_t> buckets;
+    for (const double latency : latencies) {
+      double bound(1);
+      while (bound < latency) {
+        bound *= 2;
+      }
+      ++buckets[bound];
+    }
+    for (const auto& bucket : buckets) {
+      cout << "  <= " << std::setw(8) << bucket.first << " ms: "
+           << std::setw(8) << bucket.second << " "
+           << string(bucket.second * 50 / latencies.size(), '#') << endl;
+    }
+  }
+}
+
+
+}  // namespace
+
+
+int main(int argc, char* argv[]) {
+  util::InitCT(&argc, &argv);
+
+  const shared_ptr<libevent::Base> event_base(make_shared<libevent::Base>());
+  libevent::EventPumpThread pump(event_base);
+  ThreadPool pool;
+  UrlFetcher fetcher(event_base.get(), &pool);
+
+  LoadGenerator generator(&fetcher, &pool);
+  generator.Run();
+  generator.Report();
+
+  return 0;
+}
@@ -1,31 +1,57 @@
+#include <gflags/gflags.h>
 #include <functional>
+#include <memory>
 
 #include "log/frontend.h"
 #include "server/certificate_handler.h"
 #include "server/json_output.h"
+#include "util/json_reader.h"
 #include "util/json_wrapper.h"
 #include "util/status.h"
+#include "util/task.h"
 #include "util/thread_pool.h"
 
 namespace cert_trans {
 
 using ct::LogEntry;
 using ct::SignedCertificateTimestamp;
+using std::atomic_load;
+using std::atomic_store;
 using std::bind;
+using std::function;
 using std::make_shared;
 using std::move;
 using std::multimap;
 using std::placeholders::_1;
 using std::shared_ptr;
 using std::string;
+using std::to_string;
 using std::unique_ptr;
 using util::Status;
 
+DEFINE_int32(submission_cache_size, 10000,
+             "number of recent add-chain and add-pre-chain submissions whose "
+             "SCT is kept, to answer resubmissions without checking their "
+             "chain again (0 to disable)");
+DEFINE_int32(max_queued_submissions, 1000,
+             "maximum number of add-chain and add-pre-chain requests waiting "
+             "for a thread of the crypto pool, beyond which they get a 503 "
+             "(0 for no limit)");
+DEFINE_int32(max_chain_certs, 16,
+             "largest number of certificates in a submitted chain (0 for no "
+             "limit)");
 
 namespace {
 
 
+const int kHttpTemporaryRedirect = 307;
+
+
+// The |check_leaf| callback gets the DER encoding of the leaf
+// certificate before it is parsed, and returns false if it replied
+// to |req| already, rejecting the submission.
 bool ExtractChain(libevent::Base* base, evhttp_request* req,
+                  const function<bool(const string&)>& check_leaf,
                   CertChain* chain) {
   if (evhttp_request_get_command(req) != EVHTTP_REQ_POST) {
     SendJsonError(base, req, HTTP_BADMETHOD, "Method not allowed.");
@@ -34,41 +60,98 @@ bool ExtractChain(libevent::Base* base, evhttp_request* req,
 
   // TODO(pphaneuf): Should we check that Content-Type says
   // "application/json", as recommended by RFC4627?
-  JsonObject json_body(evhttp_request_get_input_buffer(req));
-  if (!json_body.Ok() || !json_body.IsType(json_type_object)) {
+  //
+  // The body is read in place (it usually is in a single chunk
+  // already), and each certificate is decoded straight from it.
+  evbuffer* const input(evhttp_request_get_input_buffer(req));
+  const size_t length(evbuffer_get_length(input));
+  const char* const body(
+      reinterpret_cast<const char*>(evbuffer_pullup(input, -1)));
+  JsonReader reader(body ? body : "", body ? length : 0);
+  if (!reader.BeginObject()) {
     SendJsonError(base, req, HTTP_BADREQUEST,
                   "Unable to parse provided JSON.");
     return false;
   }
 
-  JsonArray json_chain(json_body, "chain");
-  if (!json_chain.Ok()) {
+  bool has_chain(false);
+  string key;
+  string der;
+  while (reader.NextKey(&key)) {
+    if (key != "chain" || has_chain) {
+      if (!reader.Skip()) {
+        break;
+      }
+      continue;
+    }
+
+    has_chain = true;
+    if (!reader.BeginArray()) {
+      break;
+    }
+    int num_certs(0);
+    while (reader.NextElement()) {
+      // Refuse long chains without decoding the rest of it (the size
+      // of the body is already limited while reading it, see
+      // --max_http_body_size).
+      if (FLAGS_max_chain_certs > 0 && ++num_certs > FLAGS_max_chain_certs) {
+        SendJsonError(base, req, HTTP_BADREQUEST,
+                      "Too many certificates in chain.");
+        return false;
+      }
+
+      if (!reader.Base64(&der)) {
+        break;
+      }
+
+      if (chain->Length() == 0 && !check_leaf(der)) {
+        return false;
+      }
+
+      unique_ptr<Cert> cert(Cert::FromDerString(der));
+      if (!cert) {
+        SendJsonError(base, req, HTTP_BADREQUEST,
+                      "Unable to parse provided chain.");
+        return false;
+      }
+
+      chain->AddCert(move(cert));
+    }
+  }
+
+  if (!reader.ok() || !has_chain) {
     SendJsonError(base, req, HTTP_BADREQUEST,
                   "Unable to parse provided JSON.");
     return false;
   }
 
-  VLOG(2) << "ExtractChain chain:\n" << json_chain.DebugString();
-
-  for (int i = 0; i < json_chain.Length(); ++i) {
-    JsonString json_cert(json_chain, i);
-    if (!json_cert.Ok()) {
-      SendJsonError(base, req, HTTP_BADREQUEST,
-                    "Unable to parse provided JSON.");
-      return false;
-    }
+  return true;
+}
 
-    unique_ptr<Cert> cert(Cert::FromDerString(json_cert.FromBase64()));
-    if (!cert) {
-      SendJsonError(base, req, HTTP_BADREQUEST,
-                    "Unable to parse provided chain.");
-      return false;
-    }
 
-    chain->AddCert(move(cert));
+// Returns the key of a submission in the cache, empty if there is
+// none. A cached SCT is returned without checking the chain again, so
+// the key covers everything the check depends on: the whole chain (an
+// X.509 entry is made from the leaf alone, but a known leaf could come
+// with a chain that does not verify), and the generation of the
+// trusted certificates (so that none of the SCTs cached before a
+// reload of the roots are used after it).
+string SubmissionKey(const CertChain& chain, bool precert,
+                     const CertChecker* checker) {
+  if (chain.Length() == 0 || !checker) {
+    return string();
   }
 
-  return true;
+  string key(precert ? "precert:" : "x509:");
+  key += to_string(checker->TrustedCertificatesGeneration()) + ":";
+  for (size_t i = 0; i < chain.Length(); ++i) {
+    string digest;
+    if (!chain.CertAt(i)->Sha256Digest(&digest).ok()) {
+      return string();
+    }
+    key += digest;
+  }
+  return key;
 }
 
 
@@ -81,112 +164,255 @@ CertSubmissionHandler* MaybeCreateSubmissionHandler(
 }
 
 
+RequestQueue* MaybeCreateCryptoQueue(ThreadPool* crypto_pool) {
+  if (crypto_pool != nullptr) {
+    return new RequestQueue(crypto_pool, FLAGS_max_queued_submissions,
+                            FLAGS_max_queued_submissions,
+                            FLAGS_max_queued_submissions);
+  }
+  return nullptr;
+}
+
+
 }  // namespace
 
 
 CertificateHttpHandler::CertificateHttpHandler(
     LogLookup* log_lookup, const ReadOnlyDatabase* db,
     const ClusterStateController* controller, const CertChecker* cert_checker,
-    Frontend* frontend, ThreadPool* pool, libevent::Base* event_base,
-    StalenessTracker* staleness_tracker)
+    Frontend* frontend, ThreadPool* pool, ThreadPool* crypto_pool,
+    libevent::Base* event_base, StalenessTracker* staleness_tracker)
     : HttpHandler(log_lookup, db, controller, pool, event_base,
                   staleness_tracker),
       cert_checker_(cert_checker),
       submission_handler_(MaybeCreateSubmissionHandler(cert_checker_)),
-      frontend_(frontend) {
+      frontend_(frontend),
+      crypto_queue_(MaybeCreateCryptoQueue(crypto_pool)),
+      submissions_(FLAGS_submission_cache_size) {
 }
 
 
 void CertificateHttpHandler::AddHandlers(libevent::HttpServer* server) {
   // TODO(alcutter): Support this for mirrors too
   if (cert_checker_) {
-    // Don't really need to proxy this one, but may as well just to keep
-    // everything tidy:
+    // The roots do not depend on the tree, so this one is always
+    // served locally.
     AddProxyWrappedHandler(server, "/ct/v1/get-roots",
-                           bind(&CertificateHttpHandler::GetRoots, this, _1));
+                           bind(&CertificateHttpHandler::GetRoots, this, _1),
+                           RequestQueue::Priority::HIGH,
+                           [](evhttp_request*) { return true; });
   }
   if (frontend_) {
     // Proxy the add-* calls too, technically we could serve them, but a
     // more up-to-date node will have a better chance of handling dupes
     // correctly, rather than bloating the tree.
     AddProxyWrappedHandler(server, "/ct/v1/add-chain",
-                           bind(&CertificateHttpHandler::AddChain, this, _1));
+                           bind(&CertificateHttpHandler::AddChain, this, _1),
+                           RequestQueue::Priority::LOW);
     AddProxyWrappedHandler(server, "/ct/v1/add-pre-chain",
                            bind(&CertificateHttpHandler::AddPreChain, this,
-                                _1));
+                                _1),
+                           RequestQueue::Priority::LOW);
   }
 }
 
 
+void CertificateHttpHandler::AddShard(const string& path_prefix,
+                                      const CertChecker* checker) {
+  CHECK_NOTNULL(checker);
+  CHECK(checker->HasNotAfterRange());
+  shards_.emplace_back(path_prefix, checker);
+}
+
+
+bool CertificateHttpHandler::CheckLeafNotAfter(evhttp_request* req,
+                                               const string& path,
+                                               const string& der) const {
+  if (!cert_checker_ || !cert_checker_->HasNotAfterRange()) {
+    return true;
+  }
+
+  const util::StatusOr<int64_t> not_after(CertChecker::ParseNotAfter(der));
+  if (!not_after.ok()) {
+    SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                  "Unable to parse provided chain.");
+    return false;
+  }
+  if (cert_checker_->AcceptsNotAfter(not_after.ValueOrDie())) {
+    return true;
+  }
+
+  for (const auto& shard : shards_) {
+    if (shard.second->AcceptsNotAfter(not_after.ValueOrDie())) {
+      const string location(shard.first + path);
+      CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(req),
+                                 "Location", location.c_str()),
+               0);
+      SendJsonError(event_base_, req, kHttpTemporaryRedirect,
+                    "Certificate expiry outside of the range of this log, "
+                    "submit it to " + location + ".");
+      return false;
+    }
+  }
+
+  SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                "Certificate expiry outside of the range of this log.");
+  return false;
+}
+
+
 void CertificateHttpHandler::GetRoots(evhttp_request* req) const {
   if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
     return SendJsonError(event_base_, req, HTTP_BADMETHOD,
                          "Method not allowed.");
   }
 
-  JsonArray roots;
-  for (const auto& trusted_cert : cert_checker_->GetTrustedCertificates()) {
-    string cert;
-    if (trusted_cert.second->DerEncoding(&cert) != util::Status::OK) {
-      LOG(ERROR) << "Cert encoding failed";
-      return SendJsonError(event_base_, req, HTTP_INTERNAL,
-                           "Serialisation failed.");
+  // Read before the certificates, so that a reload in between makes
+  // the next request render them again.
+  const int64_t generation(cert_checker_->TrustedCertificatesGeneration());
+  shared_ptr<const CachedReply> reply(atomic_load(&roots_reply_));
+  if (!reply || reply->version != generation) {
+    JsonArray roots;
+    for (const auto& trusted_cert :
+         *cert_checker_->GetTrustedCertificates()) {
+      string cert;
+      if (trusted_cert.second->DerEncoding(&cert) != util::Status::OK) {
+        LOG(ERROR) << "Cert encoding failed";
+        return SendJsonError(event_base_, req, HTTP_INTERNAL,
+                             "Serialisation failed.");
+      }
+      roots.AddBase64(cert);
     }
-    roots.AddBase64(cert);
-  }
 
-  JsonObject json_reply;
-  json_reply.Add("certificates", roots);
+    JsonObject json_reply;
+    json_reply.Add("certificates", roots);
 
-  SendJsonReply(event_base_, req, HTTP_OK, json_reply);
+    reply = MakeCachedReply(generation, json_reply);
+    atomic_store(&roots_reply_, reply);
+  }
+
+  SendCachedJsonReply(event_base_, req, reply->json, reply->gzip_json,
+                      reply->etag);
 }
 
 
 void CertificateHttpHandler::AddChain(evhttp_request* req) {
   const shared_ptr<CertChain> chain(make_shared<CertChain>());
-  if (!ExtractChain(event_base_, req, chain.get())) {
+  if (!ExtractChain(event_base_, req,
+                    bind(&CertificateHttpHandler::CheckLeafNotAfter, this,
+                         req, "/ct/v1/add-chain", _1),
+                    chain.get())) {
     return;
   }
 
-  pool_->Add(
-      bind(&CertificateHttpHandler::BlockingAddChain, this, req, chain));
+  // A resubmission gets the same SCT, there is no need to check it
+  // all again.
+  const string key(SubmissionKey(*chain, false, cert_checker_));
+  SignedCertificateTimestamp sct;
+  if (!key.empty() && submissions_.Lookup(key, &sct)) {
+    return AddEntryReply(req, Status::OK, sct);
+  }
+
+  RunOnCryptoPool(req, "/ct/v1/add-chain",
+                  bind(&CertificateHttpHandler::BlockingAddChain, this, req,
+                       chain, key));
 }
 
 
 void CertificateHttpHandler::AddPreChain(evhttp_request* req) {
   const shared_ptr<PreCertChain> chain(make_shared<PreCertChain>());
-  if (!ExtractChain(event_base_, req, chain.get())) {
+  if (!ExtractChain(event_base_, req,
+                    bind(&CertificateHttpHandler::CheckLeafNotAfter, this,
+                         req, "/ct/v1/add-pre-chain", _1),
+                    chain.get())) {
     return;
   }
 
-  pool_->Add(
-      bind(&CertificateHttpHandler::BlockingAddPreChain, this, req, chain));
+  const string key(SubmissionKey(*chain, true, cert_checker_));
+  SignedCertificateTimestamp sct;
+  if (!key.empty() && submissions_.Lookup(key, &sct)) {
+    return AddEntryReply(req, Status::OK, sct);
+  }
+
+  RunOnCryptoPool(req, "/ct/v1/add-pre-chain",
+                  bind(&CertificateHttpHandler::BlockingAddPreChain, this,
+                       req, chain, key));
 }
 
 
-void CertificateHttpHandler::BlockingAddChain(
-    evhttp_request* req, const shared_ptr<CertChain>& chain) const {
-  SignedCertificateTimestamp sct;
+void CertificateHttpHandler::RunOnCryptoPool(
+    evhttp_request* req, const string& path, const function<void()>& closure) {
+  if (!crypto_queue_) {
+    return RunOnPool(req, path, closure);
+  }
+
+  if (!crypto_queue_->Add(RequestQueue::Priority::LOW, path, closure)) {
+    SendJsonError(event_base_, req, HTTP_SERVUNAVAIL,
+                  "Too many requests waiting, try again later.");
+  }
+}
+
 
+void CertificateHttpHandler::BlockingAddChain(
+    evhttp_request* req, const shared_ptr<CertChain>& chain,
+    const string& key) const {
   LogEntry entry;
-  const Status status(frontend_->QueueProcessedEntry(
-      submission_handler_->ProcessX509Submission(chain.get(), &entry), entry,
-      &sct));
+  const Status status(
+      submission_handler_->ProcessX509Submission(chain.get(), &entry));
 
-  AddEntryReply(req, status, sct);
+  QueueEntry(req, status, entry, key);
 }
 
 
 void CertificateHttpHandler::BlockingAddPreChain(
-    evhttp_request* req, const shared_ptr<PreCertChain>& chain) const {
-  SignedCertificateTimestamp sct;
-
+    evhttp_request* req, const shared_ptr<PreCertChain>& chain,
+    const string& key) const {
   LogEntry entry;
-  const Status status(frontend_->QueueProcessedEntry(
-      submission_handler_->ProcessPreCertSubmission(chain.get(), &entry),
-      entry, &sct));
+  const Status status(
+      submission_handler_->ProcessPreCertSubmission(chain.get(), &entry));
+
+  QueueEntry(req, status, entry, key);
+}
+
 
-  AddEntryReply(req, status, sct);
+void CertificateHttpHandler::QueueEntry(evhttp_request* req,
+                                        const Status& pre_status,
+                                        const LogEntry& entry,
+                                        const string& key) const {
+  // The reply is sent once the entry is in the consistent store, from
+  // the thread completing the write, rather than holding on to this
+  // one until then.
+  SignedCertificateTimestamp* const sct(new SignedCertificateTimestamp);
+  frontend_->QueueProcessedEntry(
+      pre_status, entry, sct,
+      new util::Task(bind(&CertificateHttpHandler::QueueEntryDone, this, req,
+                          sct, key, _1),
+                     pool_));
+}
+
+
+void CertificateHttpHandler::QueueEntryDone(evhttp_request* req,
+                                            SignedCertificateTimestamp* sct,
+                                            const string& key,
+                                            util::Task* task) const {
+  const unique_ptr<SignedCertificateTimestamp> sct_deleter(sct);
+  const Status status(task->status());
+  delete task;
+
+  KeepSCT(key, status, *sct);
+  AddEntryReply(req, status, *sct);
+}
+
+
+void CertificateHttpHandler::KeepSCT(
+    const string& key, const Status& status,
+    const SignedCertificateTimestamp& sct) const {
+  // Only for the submissions that were accepted, possibly earlier.
+  if (!key.empty() &&
+      (status.ok() ||
+       status.CanonicalCode() == util::error::ALREADY_EXISTS)) {
+    submissions_.Insert(key, sct);
+  }
 }
 
 
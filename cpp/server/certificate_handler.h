@@ -6,6 +6,7 @@
 #include "log/logged_entry.h"
 #include "server/handler.h"
 #include "server/staleness_tracker.h"
+#include "server/submission_cache.h"
 
 namespace cert_trans {
 
@@ -15,15 +16,23 @@ class CertificateHttpHandler : public HttpHandler {
   // Does not take ownership of its parameters, which must outlive
   // this instance. The |frontend| and |cert_checker| parameters can be NULL,
   // in which case this server will not accept "add-chain" and "add-pre-chain"
-  // requests.
+  // requests. Those are checked on |crypto_pool|, keeping them from
+  // delaying the reads on |pool|, unless it is NULL too.
   CertificateHttpHandler(LogLookup* log_lookup, const ReadOnlyDatabase* db,
                          const ClusterStateController* controller,
                          const CertChecker* cert_checker, Frontend* frontend,
-                         ThreadPool* pool, libevent::Base* event_base,
+                         ThreadPool* pool, ThreadPool* crypto_pool,
+                         libevent::Base* event_base,
                          StalenessTracker* staleness_tracker);
 
   ~CertificateHttpHandler() = default;
 
+  // For a log sharded by expiry (see CertChecker::SetNotAfterRange()),
+  // adds another shard, served from |path_prefix| of the same server,
+  // to which the submissions outside of the range of this log are
+  // redirected if |checker| accepts them. Must be called before Add().
+  void AddShard(const std::string& path_prefix, const CertChecker* checker);
+
  protected:
   void AddHandlers(libevent::HttpServer* server) override;
 
@@ -31,15 +40,49 @@ class CertificateHttpHandler : public HttpHandler {
   const CertChecker* const cert_checker_;
   const std::unique_ptr<CertSubmissionHandler> submission_handler_;
   Frontend* const frontend_;
+  // The submissions waiting for the crypto pool, NULL if there is
+  // none.
+  const std::unique_ptr<RequestQueue> crypto_queue_;
+  // The get-roots reply, by generation of the trusted certificates,
+  // only accessed atomically.
+  mutable std::shared_ptr<const CachedReply> roots_reply_;
+  // The SCTs issued for recent submissions.
+  mutable SubmissionCache submissions_;
+  // The other shards of the log, by path prefix.
+  std::vector<std::pair<std::string, const CertChecker*>> shards_;
 
   void GetRoots(evhttp_request* req) const;
   void AddChain(evhttp_request* req);
   void AddPreChain(evhttp_request* req);
 
+  // Rejects the submission to |path| whose leaf certificate is |der|
+  // if its expiry is outside of the range of this log, replying to
+  // |req| with a redirect to the shard that accepts it, if any.
+  // Returns whether the submission can go on.
+  bool CheckLeafNotAfter(evhttp_request* req, const std::string& path,
+                         const std::string& der) const;
+
+  // Same as RunOnPool(), but on the crypto pool if there is one.
+  void RunOnCryptoPool(evhttp_request* req, const std::string& path,
+                       const std::function<void()>& closure);
+
+  // The |key| is that of the submission in |submissions_|, empty if
+  // it should not be kept there.
   void BlockingAddChain(evhttp_request* req,
-                        const std::shared_ptr<CertChain>& chain) const;
+                        const std::shared_ptr<CertChain>& chain,
+                        const std::string& key) const;
   void BlockingAddPreChain(evhttp_request* req,
-                           const std::shared_ptr<PreCertChain>& chain) const;
+                           const std::shared_ptr<PreCertChain>& chain,
+                           const std::string& key) const;
+  // Adds the processed submission to the log (unless |pre_status| is
+  // an error), replying to |req| once done.
+  void QueueEntry(evhttp_request* req, const util::Status& pre_status,
+                  const ct::LogEntry& entry, const std::string& key) const;
+  void QueueEntryDone(evhttp_request* req,
+                      ct::SignedCertificateTimestamp* sct,
+                      const std::string& key, util::Task* task) const;
+  void KeepSCT(const std::string& key, const util::Status& status,
+               const ct::SignedCertificateTimestamp& sct) const;
 
   DISALLOW_COPY_AND_ASSIGN(CertificateHttpHandler);
 };
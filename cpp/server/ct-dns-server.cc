@@ -1,29 +1,63 @@
 #include <gflags/gflags.h>
 #include <ldns/ldns.h>
 #include <iostream>
+#include <memory>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
+#include "log/leveldb_db.h"
 #include "log/log_lookup.h"
 #include "log/logged_entry.h"
+#include "log/segment_db.h"
 #include "log/sqlite_db.h"
 #include "proto/cert_serializer.h"
 #include "proto/ct.pb.h"
 #include "server/event.h"
 #include "util/init.h"
+#include "util/single_flight_cache.h"
 #include "util/util.h"
 
+using cert_trans::Database;
+using cert_trans::LevelDB;
 using cert_trans::LogLookup;
 using cert_trans::LoggedEntry;
 using cert_trans::SQLiteDB;
+using cert_trans::SegmentDB;
+using cert_trans::SingleFlightCache;
 using ct::SignedTreeHead;
 using google::RegisterFlagValidator;
+using std::make_pair;
+using std::pair;
 using std::string;
 using std::stringstream;
+using std::thread;
+using std::unique_ptr;
+using std::vector;
 
 DEFINE_int32(port, 0, "Server port");
 DEFINE_string(domain, "", "Domain");
-DEFINE_string(db, "", "Database for certificate and tree storage");
+DEFINE_string(db, "",
+              "SQLite database for certificate and tree storage, shared "
+              "with a running ct-server");
+DEFINE_string(leveldb_db, "",
+              "LevelDB database for certificate and tree storage. It cannot "
+              "be open in another process, so it is served as it was when "
+              "the server started.");
+DEFINE_string(segment_db, "",
+              "Directory of segment files for certificate and tree storage. "
+              "It cannot be open in another process, so it is served as it "
+              "was when the server started.");
+DEFINE_int32(num_threads, 1,
+             "Number of threads serving queries, each with its own socket "
+             "bound to --port with SO_REUSEPORT");
+DEFINE_int32(response_cache_size, 100000,
+             "Number of responses to keep, by question name, for the "
+             "current STH");
+DEFINE_int32(sth_refresh_interval_seconds, 1,
+             "How often to check the SQLite database for a new STH");
 
 // Basic sanity checks on flag values.
 static bool ValidatePort(const char*, int32_t port) {
@@ -40,10 +74,35 @@ static bool NonEmptyString(const char*, const string& str) {
 static const bool domain_dummy =
     RegisterFlagValidator(&FLAGS_domain, &NonEmptyString);
 
+static bool ValidateIsPositive(const char* flagname, int value) {
+  if (value <= 0) {
+    std::cout << flagname << " must be greater than 0" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+static const bool num_threads_dummy =
+    RegisterFlagValidator(&FLAGS_num_threads, &ValidateIsPositive);
+
+static const bool sth_refresh_dummy =
+    RegisterFlagValidator(&FLAGS_sth_refresh_interval_seconds,
+                          &ValidateIsPositive);
+
+// Responses only depend on the question and the STH the lookup is at,
+// so they are kept by both: the ones for an older STH are never asked
+// for again, and fall out of the cache.
+typedef SingleFlightCache<pair<uint64_t, string>, string> ResponseCache;
+
 class CTUDPDNSServer : public UDPServer {
  public:
-  CTUDPDNSServer(const string& domain, SQLiteDB* db, EventLoop* loop, int fd)
-      : UDPServer(loop, fd), domain_(domain), lookup_(db), db_(db) {
+  CTUDPDNSServer(const string& domain, Database* db, LogLookup* lookup,
+                 ResponseCache* cache, EventLoop* loop, int fd)
+      : UDPServer(loop, fd),
+        domain_(domain),
+        db_(db),
+        lookup_(lookup),
+        cache_(cache) {
   }
 
   virtual void PacketRead(const sockaddr_in& from, const char* buf,
@@ -105,7 +164,7 @@ class CTUDPDNSServer : public UDPServer {
       ldns_buffer_free(dname);
       dname = NULL;
 
-      LOG(INFO) << "Question is TXT of " << owner_name;
+      VLOG(1) << "Question is TXT of " << owner_name;
 
       if (owner_name.length() <= domain_.length() ||
           owner_name.compare(owner_name.length() - domain_.length(),
@@ -128,9 +187,11 @@ class CTUDPDNSServer : public UDPServer {
     }
     ldns_pkt_free(packet);
 
-    char* answer_str = ldns_pkt2str(answers);
-    LOG(INFO) << "Answer is " << answer_str;
-    free(answer_str);
+    if (VLOG_IS_ON(1)) {
+      char* answer_str = ldns_pkt2str(answers);
+      VLOG(1) << "Answer is " << answer_str;
+      free(answer_str);
+    }
 
     uint8_t* wire_answer;
     size_t answer_size;
@@ -144,7 +205,17 @@ class CTUDPDNSServer : public UDPServer {
   }
 
  private:
-  string Response(string question) {
+  string Response(const string& question) {
+    // The STH is read first: if it moves on while computing the
+    // response, the response is at least as recent as its key.
+    const uint64_t timestamp(lookup_->GetSTHSnapshot()->timestamp());
+    return cache_->Get(make_pair(timestamp, question),
+                       [this, &question]() {
+                         return ComputeResponse(question);
+                       });
+  }
+
+  string ComputeResponse(const string& question) {
     if (question == "sth")
       return STH();
 
@@ -154,7 +225,7 @@ class CTUDPDNSServer : public UDPServer {
 
     string head = question.substr(0, dot);
     string tail = question.substr(dot + 1);
-    LOG(INFO) << "head = " << head << ", tail = " << tail;
+    VLOG(1) << "head = " << head << ", tail = " << tail;
     if (tail == "tree")
       return Tree(head);
     else if (tail == "hash")
@@ -168,17 +239,15 @@ class CTUDPDNSServer : public UDPServer {
   string LeafHash(const string& index_str) const {
     int index = atoi(index_str.c_str());
     LoggedEntry cert;
-    if (db_->LookupByIndex(index, &cert) != db_->LOOKUP_OK)
+    if (db_->LookupByIndex(index, &cert) != Database::LOOKUP_OK)
       return "No such index";
-    return util::ToBase64(lookup_.LeafHash(cert));
+    return util::ToBase64(lookup_->LeafHash(cert));
   }
 
   string Hash(const string& hash) {
-    db_->ForceNotifySTH();
-
     // FIXME: decode hash!
     int64_t index;
-    if (lookup_.GetIndex(hash, &index) != lookup_.OK)
+    if (lookup_->GetIndex(hash, &index) != LogLookup::OK)
       return "No such hash";
 
     stringstream ss;
@@ -199,12 +268,12 @@ class CTUDPDNSServer : public UDPServer {
     string index = question.substr(dot + 1, dot2 - dot - 1);
     string size = question.substr(dot2 + 1);
 
-    LOG(INFO) << "level = " << level << ", index = " << index
-              << ", size = " << size;
+    VLOG(1) << "level = " << level << ", index = " << index
+            << ", size = " << size;
 
     ct::ShortMerkleAuditProof proof;
-    if (lookup_.AuditProof(atoi(index.c_str()), atoi(size.c_str()), &proof) !=
-        lookup_.OK)
+    if (lookup_->AuditProof(atoi(index.c_str()), atoi(size.c_str()),
+                            &proof) != LogLookup::OK)
       return "Lookup of node " + index + "." + size + " failed";
 
     int l = atoi(level.c_str());
@@ -216,9 +285,7 @@ class CTUDPDNSServer : public UDPServer {
   }
 
   string STH() {
-    db_->ForceNotifySTH();
-
-    const SignedTreeHead& sth = lookup_.GetSTH();
+    const SignedTreeHead& sth = *lookup_->GetSTHSnapshot();
 
     std::string signature;
     CHECK_EQ(Serializer::SerializeDigitallySigned(sth.signature(), &signature),
@@ -233,7 +300,29 @@ class CTUDPDNSServer : public UDPServer {
   }
 
   string domain_;
-  LogLookup lookup_;
+  Database* const db_;
+  LogLookup* const lookup_;
+  ResponseCache* const cache_;
+};
+
+// Picks up the tree heads ct-server writes to the shared SQLite
+// database, rather than checking for one on every query.
+class STHRefresher : public RepeatedEvent {
+ public:
+  STHRefresher(SQLiteDB* db, EventLoop* loop)
+      : RepeatedEvent(FLAGS_sth_refresh_interval_seconds), db_(db) {
+    loop->Add(this);
+  }
+
+  std::string Description() {
+    return "STH refresh";
+  }
+
+  void Execute() {
+    db_->ForceNotifySTH();
+  }
+
+ private:
   SQLiteDB* const db_;
 };
 
@@ -266,24 +355,66 @@ class Keyboard : public Server {
   }
 };
 
+static unique_ptr<Database> ProvideDatabase() {
+  if (!FLAGS_db.empty() + !FLAGS_leveldb_db.empty() +
+          !FLAGS_segment_db.empty() !=
+      1) {
+    LOG(FATAL) << "Must specify exactly one database type. Check flags.";
+  }
+
+  if (!FLAGS_db.empty()) {
+    return unique_ptr<Database>(new SQLiteDB(FLAGS_db));
+  } else if (!FLAGS_leveldb_db.empty()) {
+    return unique_ptr<Database>(new LevelDB(FLAGS_leveldb_db));
+  } else {
+    return unique_ptr<Database>(new SegmentDB(FLAGS_segment_db));
+  }
+}
+
 int main(int argc, char* argv[]) {
   util::InitCT(&argc, &argv);
   ConfigureSerializerForV1CT();
 
-  // TODO(pphaneuf): This current *has* to be SQLite, because it
-  // depends on sharing the database with a ct-server that will
-  // populate it (which FileDB does not support).
-  SQLiteDB db(FLAGS_db);
+  // Only SQLite can be shared with a ct-server that populates it, the
+  // other databases are locked by whoever opens them first.
+  const unique_ptr<Database> db(ProvideDatabase());
+  SQLiteDB* const sqlite_db(dynamic_cast<SQLiteDB*>(db.get()));
+
+  LogLookup lookup(db.get(), NULL);
+  ResponseCache cache(FLAGS_response_cache_size);
 
   EventLoop loop;
 
   // Mostly so we can have a clean exit for valgrind etc.
   Keyboard keyboard(&loop);
 
+  unique_ptr<STHRefresher> sth_refresher;
+  if (sqlite_db)
+    sth_refresher.reset(new STHRefresher(sqlite_db, &loop));
+
+  const bool reuse_port(FLAGS_num_threads > 1);
   int dns_fd;
-  CHECK(Services::InitServer(&dns_fd, FLAGS_port, NULL, SOCK_DGRAM));
-  CTUDPDNSServer dns(FLAGS_domain, &db, &loop, dns_fd);
+  CHECK(Services::InitServer(&dns_fd, FLAGS_port, NULL, SOCK_DGRAM,
+                             reuse_port));
+  CTUDPDNSServer dns(FLAGS_domain, db.get(), &lookup, &cache, &loop, dns_fd);
+
+  // The other threads each get a socket and a loop of their own. They
+  // do not stop with the main loop, the process exits from under them.
+  for (int i = 1; i < FLAGS_num_threads; ++i) {
+    int fd;
+    CHECK(Services::InitServer(&fd, FLAGS_port, NULL, SOCK_DGRAM, true));
+    EventLoop* const thread_loop(new EventLoop);
+    new CTUDPDNSServer(FLAGS_domain, db.get(), &lookup, &cache, thread_loop,
+                       fd);
+    thread([thread_loop]() { thread_loop->Forever(); }).detach();
+  }
 
-  LOG(INFO) << "Server listening on port " << FLAGS_port;
+  LOG(INFO) << "Server listening on port " << FLAGS_port << " with "
+            << FLAGS_num_threads << " thread(s)";
   loop.Forever();
+
+  // Do not destroy the database and the lookup while the other
+  // threads may still be using them.
+  if (FLAGS_num_threads > 1)
+    exit(0);
 }
@@ -7,6 +7,7 @@
 #include <openssl/err.h>
 #include <signal.h>
 #include <unistd.h>
+#include <algorithm>
 #include <chrono>
 #include <csignal>
 #include <cstring>
@@ -16,7 +17,9 @@
 #include <mutex>
 #include <string>
 #include <utility>
+#include <vector>
 
+#include "base/notification.h"
 #include "client/async_log_client.h"
 #include "config.h"
 #include "fetcher/continuous_fetcher.h"
@@ -40,10 +43,12 @@
 #include "server/proxy.h"
 #include "server/server.h"
 #include "server/server_helper.h"
+#include "util/allocator_stats.h"
 #include "util/etcd.h"
 #include "util/init.h"
 #include "util/libevent_wrapper.h"
 #include "util/masterelection.h"
+#include "util/memory_accounting.h"
 #include "util/periodic_closure.h"
 #include "util/read_key.h"
 #include "util/status.h"
@@ -61,12 +66,32 @@ DEFINE_int32(target_poll_frequency_seconds, 10,
 DEFINE_int32(num_http_server_threads, 16,
              "Number of threads for servicing the incoming HTTP requests.");
 DEFINE_string(target_log_uri, "",
-              "URI of the log to mirror, or empty to disable mirroring.");
+              "URI of the log to mirror, or a comma-separated list of the "
+              "URIs of the nodes of that log, to fetch from any of them; "
+              "empty disables mirroring.");
+DEFINE_string(extra_targets, "",
+              "Comma-separated list of other logs to mirror in this "
+              "process, each as "
+              "path_prefix;etcd_root;target_log_uri;target_public_key;"
+              "database, with a single URI. The mirror is served under "
+              "path_prefix (such as /logs/foo), and the database is of the "
+              "type selected for the main one. They share the pools, the URL "
+              "fetcher and --fetcher_global_max_concurrent_fetches.");
 DEFINE_string(
     target_public_key, "",
     "PEM-encoded server public key file of the log we're mirroring.");
 DEFINE_int32(local_sth_update_frequency_seconds, 30,
              "Number of seconds between local checks for updated tree data.");
+DEFINE_int32(mirror_verify_tile_size, 0,
+             "If non-zero, check the local tree against the target log "
+             "every this many entries, using a consistency proof to the "
+             "latest STH of the target, rather than only at the sizes of the "
+             "STHs it publishes. When bootstrapping a mirror of a large log, "
+             "this finds bad entries early rather than at the very end.");
+DEFINE_int32(memory_accounting_interval_seconds, 10,
+             "how often to update the memory_bytes and allocator metrics, "
+             "and to shrink the caches if over --memory_budget_mb, in "
+             "seconds");
 
 namespace libevent = cert_trans::libevent;
 
@@ -85,6 +110,8 @@ using cert_trans::Latency;
 using cert_trans::LogLookup;
 using cert_trans::LoggedEntry;
 using cert_trans::MasterElection;
+using cert_trans::MemoryAccounting;
+using cert_trans::Notification;
 using cert_trans::PeriodicClosure;
 using cert_trans::Proxy;
 using cert_trans::ReadPublicKey;
@@ -110,12 +137,15 @@ using std::lock_guard;
 using std::make_pair;
 using std::make_shared;
 using std::map;
+using std::min;
 using std::mutex;
 using std::placeholders::_1;
 using std::shared_ptr;
 using std::string;
 using std::thread;
+using std::to_string;
 using std::unique_ptr;
+using std::vector;
 using util::HexString;
 using util::StatusOr;
 using util::SyncTask;
@@ -134,6 +164,16 @@ Counter<>* inconsistent_sths_received =
                    "Number of STHs received from the mirror target whose root "
                    "hash does not match the locally built tree.");
 
+Gauge<>* verified_local_tree_size_gauge = Gauge<>::New(
+    "verified_local_tree_size",
+    "Size of the local tree last found consistent with the mirror target, "
+    "with --mirror_verify_tile_size.");
+
+Counter<>* inconsistent_tiles_found =
+    Counter<>::New("inconsistent_tiles_found",
+                   "Number of times the local tree was found inconsistent "
+                   "with the mirror target, with --mirror_verify_tile_size.");
+
 
 // Basic sanity checks on flag values.
 static bool ValidateRead(const char* flagname, const string& path) {
@@ -251,25 +291,285 @@ void STHUpdater(Database* db, ClusterStateController* cluster_state_controller,
 }
 
 
-shared_ptr<RemotePeer> createTargetPeerFromFlags(
-    ThreadPool* pool, UrlFetcher* url_fetcher, EVP_PKEY* pubkey, Task* task,
+// Checks the local tree against |latest_sth| (the latest STH of the
+// target) every --mirror_verify_tile_size entries, as they are written.
+void TileVerifier(Database* db, AsyncLogClient* client, mutex* sth_mutex,
+                  const SignedTreeHead* latest_sth, LogLookup* log_lookup,
+                  Task* task) {
+  CHECK_NOTNULL(db);
+  CHECK_NOTNULL(client);
+  CHECK_NOTNULL(sth_mutex);
+  CHECK_NOTNULL(latest_sth);
+  CHECK_NOTNULL(log_lookup);
+  CHECK_NOTNULL(task);
+  CHECK_GT(FLAGS_mirror_verify_tile_size, 0);
+  const int64_t tile_size(FLAGS_mirror_verify_tile_size);
+  MerkleVerifier verifier(unique_ptr<Sha256Hasher>(new Sha256Hasher));
+
+  // Wakes up the wait between the rounds. The callback can run after
+  // this function returns, hence the shared_ptr.
+  const shared_ptr<Notification> cancelled(make_shared<Notification>());
+  task->WhenCancelled([cancelled]() { cancelled->Notify(); });
+
+  // The serving tree was already checked against the STHs of the
+  // target, carry on from there.
+  const unique_ptr<CompactMerkleTree> tree(
+      log_lookup->GetCompactMerkleTree(new Sha256Hasher));
+  verified_local_tree_size_gauge->Set(tree->LeafCount());
+
+  while (!task->CancelRequested()) {
+    SignedTreeHead target_sth;
+    {
+      lock_guard<mutex> lock(*sth_mutex);
+      target_sth = *latest_sth;
+    }
+    const int64_t limit(min(db->TreeSize(), target_sth.tree_size()));
+    unique_ptr<Database::Iterator> entries(
+        db->ScanEntries(tree->LeafCount()));
+
+    int64_t tile_end(
+        (static_cast<int64_t>(tree->LeafCount()) / tile_size + 1) *
+        tile_size);
+    for (; tile_end <= limit && !task->CancelRequested();
+         tile_end += tile_size) {
+      LoggedEntry entry;
+      while (static_cast<int64_t>(tree->LeafCount()) < tile_end) {
+        CHECK(entries->GetNextEntry(&entry));
+        CHECK_EQ(static_cast<int64_t>(tree->LeafCount()),
+                 entry.sequence_number());
+        string serialized_leaf;
+        CHECK(entry.SerializeForLeaf(&serialized_leaf));
+        tree->AddLeaf(serialized_leaf);
+      }
+
+      vector<string> proof;
+      AsyncLogClient::Status status(AsyncLogClient::OK);
+      if (tile_end < target_sth.tree_size()) {
+        Notification done;
+        client->GetSTHConsistency(tile_end, target_sth.tree_size(), &proof,
+                                  [&status, &done](AsyncLogClient::Status s) {
+                                    status = s;
+                                    done.Notify();
+                                  });
+        done.WaitForNotification();
+      }
+      if (status != AsyncLogClient::OK) {
+        LOG(WARNING) << "could not get a consistency proof from " << tile_end
+                     << " to " << target_sth.tree_size() << ": " << status;
+        // Try again with the next round.
+        break;
+      }
+
+      if (!verifier.VerifyConsistency(tile_end, target_sth.tree_size(),
+                                      tree->CurrentRoot(),
+                                      target_sth.sha256_root_hash(), proof)) {
+        LOG(ERROR) << "local tree at size " << tile_end
+                   << " is not consistent with the target STH:\n"
+                   << target_sth.DebugString() << "some of the last "
+                   << tile_size
+                   << " entries are wrong, giving up on verifying tiles.";
+        inconsistent_tiles_found->Increment();
+        task->Return(util::Status(util::error::DATA_LOSS,
+                                  "local tree inconsistent with target"));
+        return;
+      }
+      VLOG(1) << "local tree consistent with the target up to " << tile_end;
+      verified_local_tree_size_gauge->Set(tile_end);
+    }
+
+    cancelled->WaitForNotificationWithTimeout(duration_cast<milliseconds>(
+        seconds(FLAGS_local_sth_update_frequency_seconds)));
+  }
+
+  task->Return(util::Status::CANCELLED);
+}
+
+
+// A log being mirrored, the one of --target_log_uri, or one of
+// --extra_targets.
+struct Mirror {
+  // The target, and its public key.
+  string target_uris;
+  EVP_PKEY* pubkey = nullptr;
+
+  // Only set for --extra_targets, main() has those of the main one.
+  unique_ptr<Database> db;
+  unique_ptr<LogVerifier> log_verifier;
+  unique_ptr<Server> server;
+  unique_ptr<StalenessTracker> staleness_tracker;
+  unique_ptr<CertificateHttpHandler> handler;
+
+  mutex queue_mutex;
+  // The STHs of the target, by tree size, for STHUpdater().
+  map<int64_t, ct::SignedTreeHead> queue;
+  // The largest STH of the target, for TileVerifier().
+  ct::SignedTreeHead latest_sth;
+
+  vector<shared_ptr<RemotePeer>> peers;
+  thread sth_updater;
+  thread tile_verifier;
+};
+
+
+void QueueSTH(Mirror* mirror, const ct::SignedTreeHead& sth) {
+  lock_guard<mutex> lock(mirror->queue_mutex);
+  if (sth.tree_size() > mirror->latest_sth.tree_size()) {
+    mirror->latest_sth = sth;
+  }
+  const auto it(mirror->queue.find(sth.tree_size()));
+  if (it != mirror->queue.end() && sth.timestamp() < it->second.timestamp()) {
+    LOG(WARNING) << "Received older STH:\nHad:\n" << it->second.DebugString()
+                 << "\nGot:\n" << sth.DebugString();
+    return;
+  }
+  mirror->queue.insert(make_pair(sth.tree_size(), sth));
+}
+
+
+// One peer per URI in |target_uris|, so that a mirror of a clustered
+// log keeps up as long as any of its nodes does.
+vector<shared_ptr<RemotePeer>> createTargetPeers(
+    const string& target_uris, ThreadPool* pool, UrlFetcher* url_fetcher,
+    EVP_PKEY* pubkey, Task* task,
     function<void(const ct::SignedTreeHead&)> new_sth) {
-  if (FLAGS_target_log_uri.empty()) {
+  vector<shared_ptr<RemotePeer>> peers;
+  if (target_uris.empty()) {
     LOG(WARNING) << "Empty target_log_uri flag; mirroring DISABLED";
-    return shared_ptr<RemotePeer>();
+    return peers;
+  }
+
+  for (const string& uri : util::split(target_uris)) {
+    if (uri.empty()) {
+      continue;
+    }
+    peers.emplace_back(make_shared<RemotePeer>(
+        unique_ptr<AsyncLogClient>(
+            new AsyncLogClient(CHECK_NOTNULL(pool), CHECK_NOTNULL(url_fetcher),
+                               uri)),
+        unique_ptr<LogVerifier>(new LogVerifier(
+            new LogSigVerifier(CHECK_NOTNULL(pubkey)),
+            new MerkleVerifier(unique_ptr<Sha256Hasher>(new Sha256Hasher)))),
+        new_sth, CHECK_NOTNULL(task)->AddChild([uri](Task*) {
+          LOG(INFO) << "RemotePeer for " << uri << " exited.";
+        })));
   }
+  CHECK(!peers.empty()) << "No URI in " << target_uris;
+  return peers;
+}
+
+
+// Set up a simple single-node mirror environment, for testing, or as
+// a read replica of a clustered log (see MirrorLog.md), which then
+// adds no load to its etcd.
+//
+// TODO(alcutter): Note that we're currently broken wrt to restarting the
+// log server when there's data in the log.  It's a temporary thing though,
+// so fear ye not.
+void BootstrapStandalone(Server* server) {
+  // Put a sensible single-node config into FakeEtcd. For a real
+  // clustered log we'd expect a ClusterConfig already to be present
+  // within etcd as part of the provisioning of the log.
+  ct::ClusterConfig config;
+  config.set_minimum_serving_nodes(1);
+  config.set_minimum_serving_fraction(1);
+  LOG(INFO) << "Setting default single-node ClusterConfig:\n"
+            << config.DebugString();
+  server->consistent_store()->SetClusterConfig(config);
+
+  // Since we're a single node cluster, we'll settle that we're the
+  // master here, so that we can populate the initial STH
+  // (StrictConsistentStore won't allow us to do so unless we're master.)
+  server->election()->StartElection();
+  server->election()->WaitToBecomeMaster();
+}
 
-  return make_shared<RemotePeer>(
-      unique_ptr<AsyncLogClient>(new AsyncLogClient(CHECK_NOTNULL(pool),
-                                                    CHECK_NOTNULL(url_fetcher),
-                                                    FLAGS_target_log_uri)),
-      unique_ptr<LogVerifier>(new LogVerifier(
-          new LogSigVerifier(CHECK_NOTNULL(pubkey)),
-          new MerkleVerifier(unique_ptr<Sha256Hasher>(new Sha256Hasher)))),
-      new_sth, CHECK_NOTNULL(task)->AddChild(
-                   [](Task*) { LOG(INFO) << "RemotePeer exited."; }));
+
+// Sets up the mirror of a target from --extra_targets, hosted by the
+// server of the main one, sharing its event loop, pools and URL
+// fetcher, with a database of its own.
+unique_ptr<Mirror> SetUpExtraTarget(const string& spec, Server* host,
+                                    ThreadPool* internal_pool,
+                                    libevent::Base* event_base,
+                                    bool stand_alone_mode) {
+  const vector<string> fields(util::split(spec, ';'));
+  CHECK_EQ(fields.size(), 5U) << "Invalid --extra_targets entry: " << spec;
+  const string& path_prefix(fields[0]);
+  const string& etcd_root(fields[1]);
+  LOG(INFO) << "Mirroring " << fields[2] << " under " << path_prefix << ".";
+
+  unique_ptr<Mirror> mirror(new Mirror);
+  mirror->target_uris = fields[2];
+  const StatusOr<EVP_PKEY*> pubkey(ReadPublicKey(fields[3]));
+  CHECK(pubkey.ok()) << "Failed to read public key file " << fields[3]
+                     << ": " << pubkey.status();
+  mirror->pubkey = pubkey.ValueOrDie();
+
+  mirror->db = cert_trans::ProvideDatabase(fields[4]);
+  mirror->log_verifier.reset(
+      new LogVerifier(new LogSigVerifier(mirror->pubkey),
+                      new MerkleVerifier(
+                          unique_ptr<Sha256Hasher>(new Sha256Hasher))));
+
+  mirror->server.reset(new Server(host, path_prefix, etcd_root,
+                                  mirror->db.get(),
+                                  mirror->log_verifier.get()));
+  mirror->server->Initialise(true /* is_mirror */);
+
+  mirror->staleness_tracker.reset(
+      new StalenessTracker(mirror->server->cluster_state_controller(),
+                           internal_pool, event_base));
+  mirror->handler.reset(new CertificateHttpHandler(
+      mirror->server->log_lookup(), mirror->db.get(),
+      mirror->server->cluster_state_controller(), nullptr /* checker */,
+      nullptr /* Frontend */, internal_pool, nullptr /* crypto_pool */,
+      event_base, mirror->staleness_tracker.get()));
+  mirror->handler->SetProxy(mirror->server->proxy());
+  mirror->handler->SetPathPrefix(path_prefix);
+  mirror->handler->Add(mirror->server->http_server());
+
+  if (stand_alone_mode) {
+    BootstrapStandalone(mirror->server.get());
+  }
+
+  return mirror;
+}
+
+
+// Starts fetching the target of |mirror| into |db|, and the threads
+// checking its STHs.
+void StartMirroring(Server* server, Database* db, Mirror* mirror,
+                    ThreadPool* pool, UrlFetcher* url_fetcher,
+                    Task* fetcher_task) {
+  mirror->latest_sth.set_tree_size(0);
+  mirror->peers = createTargetPeers(mirror->target_uris, pool, url_fetcher,
+                                    mirror->pubkey, fetcher_task,
+                                    bind(&QueueSTH, mirror, _1));
+  for (size_t i = 0; i < mirror->peers.size(); ++i) {
+    LOG(INFO) << "Adding remote peer for target log.";
+    server->continuous_fetcher()->AddPeer(
+        i == 0 ? string("target") : "target_" + to_string(i),
+        mirror->peers[i]);
+  }
+
+  server->WaitForReplication();
+
+  mirror->sth_updater =
+      thread(&STHUpdater, db, server->cluster_state_controller(),
+             &mirror->queue_mutex, &mirror->queue, server->log_lookup(),
+             fetcher_task->AddChild(
+                 [](Task*) { LOG(INFO) << "STHUpdater exited."; }));
+
+  if (!mirror->peers.empty() && FLAGS_mirror_verify_tile_size > 0) {
+    mirror->tile_verifier = thread(
+        &TileVerifier, db, &mirror->peers.front()->client(),
+        &mirror->queue_mutex, &mirror->latest_sth, server->log_lookup(),
+        fetcher_task->AddChild([](Task* task) {
+          LOG(INFO) << "TileVerifier exited: " << task->status();
+        }));
+  }
 }
 
+
 int main(int argc, char* argv[]) {
   // Ignore various signals whilst we start up.
   signal(SIGHUP, SIG_IGN);
@@ -277,6 +577,7 @@ int main(int argc, char* argv[]) {
   signal(SIGTERM, SIG_IGN);
 
   util::InitCT(&argc, &argv);
+  cert_trans::ConfigureAllocator();
   ConfigureSerializerForV1CT();
 
   Server::StaticInit();
@@ -287,7 +588,8 @@ int main(int argc, char* argv[]) {
 
   const bool stand_alone_mode(cert_trans::IsStandalone(false));
   const shared_ptr<libevent::Base> event_base(make_shared<libevent::Base>());
-  ThreadPool internal_pool(8);
+  ThreadPool internal_pool("internal", 8,
+                           cert_trans::ThreadPoolSchedulingFromFlags());
   UrlFetcher url_fetcher(event_base.get(), &internal_pool);
 
   const unique_ptr<EtcdClient> etcd_client(
@@ -303,7 +605,8 @@ int main(int argc, char* argv[]) {
                                  new MerkleVerifier(unique_ptr<Sha256Hasher>(
                                      new Sha256Hasher)));
 
-  ThreadPool http_pool(FLAGS_num_http_server_threads);
+  ThreadPool http_pool("http", FLAGS_num_http_server_threads,
+                       cert_trans::ThreadPoolSchedulingFromFlags());
 
   Server server(event_base, &internal_pool, &http_pool, db.get(),
                 etcd_client.get(), &url_fetcher, &log_verifier);
@@ -316,7 +619,8 @@ int main(int argc, char* argv[]) {
   CertificateHttpHandler handler(server.log_lookup(), db.get(),
                                  server.cluster_state_controller(),
                                  nullptr /* checker */, nullptr /* Frontend */,
-                                 &internal_pool, event_base.get(),
+                                 &internal_pool, nullptr /* crypto_pool */,
+                                 event_base.get(),
                                  staleness_tracker.get());
 
   // Connect the handler, proxy and server together
@@ -324,70 +628,55 @@ int main(int argc, char* argv[]) {
   handler.Add(server.http_server());
 
   if (stand_alone_mode) {
-    // Set up a simple single-node mirror environment for testing.
-    //
-    // Put a sensible single-node config into FakeEtcd. For a real clustered
-    // log
-    // we'd expect a ClusterConfig already to be present within etcd as part of
-    // the provisioning of the log.
-    //
-    // TODO(alcutter): Note that we're currently broken wrt to restarting the
-    // log server when there's data in the log.  It's a temporary thing though,
-    // so fear ye not.
-    ct::ClusterConfig config;
-    config.set_minimum_serving_nodes(1);
-    config.set_minimum_serving_fraction(1);
-    LOG(INFO) << "Setting default single-node ClusterConfig:\n"
-              << config.DebugString();
-    server.consistent_store()->SetClusterConfig(config);
-
-    // Since we're a single node cluster, we'll settle that we're the
-    // master here, so that we can populate the initial STH
-    // (StrictConsistentStore won't allow us to do so unless we're master.)
-    server.election()->StartElection();
-    server.election()->WaitToBecomeMaster();
+    BootstrapStandalone(&server);
+  }
+
+  vector<unique_ptr<Mirror>> extra_targets;
+  for (const string& spec : util::split(FLAGS_extra_targets)) {
+    if (!spec.empty()) {
+      extra_targets.emplace_back(SetUpExtraTarget(spec, &server,
+                                                  &internal_pool,
+                                                  event_base.get(),
+                                                  stand_alone_mode));
+    }
   }
 
 
   ThreadPool pool(16);
   SyncTask fetcher_task(&pool);
 
-  mutex queue_mutex;
-  map<int64_t, ct::SignedTreeHead> queue;
-
-  const function<void(const ct::SignedTreeHead&)> new_sth(
-      [&queue_mutex, &queue](const ct::SignedTreeHead& sth) {
-        lock_guard<mutex> lock(queue_mutex);
-        const auto it(queue.find(sth.tree_size()));
-        if (it != queue.end() && sth.timestamp() < it->second.timestamp()) {
-          LOG(WARNING) << "Received older STH:\nHad:\n"
-                       << it->second.DebugString() << "\nGot:\n"
-                       << sth.DebugString();
-          return;
-        }
-        queue.insert(make_pair(sth.tree_size(), sth));
-      });
-
-  const shared_ptr<RemotePeer> peer(
-      createTargetPeerFromFlags(&pool, &url_fetcher, pubkey.ValueOrDie(),
-                                fetcher_task.task(), new_sth));
-  if (peer) {
-    LOG(INFO) << "Adding remote peer for target log.";
-    server.continuous_fetcher()->AddPeer("target", peer);
+  Mirror main_target;
+  main_target.target_uris = FLAGS_target_log_uri;
+  main_target.pubkey = pubkey.ValueOrDie();
+  StartMirroring(&server, db.get(), &main_target, &pool, &url_fetcher,
+                 fetcher_task.task());
+  vector<Mirror*> mirrors{&main_target};
+  for (const auto& mirror : extra_targets) {
+    StartMirroring(mirror->server.get(), mirror->db.get(), mirror.get(),
+                   &pool, &url_fetcher, fetcher_task.task());
+    mirrors.push_back(mirror.get());
   }
 
-  server.WaitForReplication();
-
-  thread sth_updater(&STHUpdater, db.get(), server.cluster_state_controller(),
-                     &queue_mutex, &queue, server.log_lookup(),
-                     fetcher_task.task()->AddChild(
-                         [](Task*) { LOG(INFO) << "STHUpdater exited."; }));
+  PeriodicClosure memory_accounting(
+      event_base,
+      std::chrono::seconds(FLAGS_memory_accounting_interval_seconds),
+      [&internal_pool]() {
+        internal_pool.Add([]() {
+          MemoryAccounting::Instance()->Update();
+          cert_trans::UpdateAllocatorStats();
+        });
+      });
 
   server.Run();
 
   fetcher_task.task()->Return();
   fetcher_task.Wait();
-  sth_updater.join();
+  for (Mirror* const mirror : mirrors) {
+    mirror->sth_updater.join();
+    if (mirror->tile_verifier.joinable()) {
+      mirror->tile_verifier.join();
+    }
+  }
 
   return 0;
 }
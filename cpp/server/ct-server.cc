@@ -7,6 +7,7 @@
 #include <unistd.h>
 #include <iostream>
 #include <string>
+#include <vector>
 
 #include "config.h"
 #include "log/cert_checker.h"
@@ -19,6 +20,7 @@
 #include "log/log_signer.h"
 #include "log/log_verifier.h"
 #include "log/strict_consistent_store.h"
+#include "log/submission_journal.h"
 #include "log/tree_signer.h"
 #include "merkletree/merkle_verifier.h"
 #include "proto/cert_serializer.h"
@@ -27,11 +29,15 @@
 #include "server/server.h"
 #include "server/server_helper.h"
 #include "server/staleness_tracker.h"
+#include "util/allocator_stats.h"
 #include "util/etcd.h"
 #include "util/init.h"
 #include "util/libevent_wrapper.h"
+#include "util/memory_accounting.h"
+#include "util/periodic_closure.h"
 #include "util/read_key.h"
 #include "util/status.h"
+#include "util/util.h"
 #include "util/uuid.h"
 
 DEFINE_string(key, "", "PEM-encoded server private key file");
@@ -42,6 +48,28 @@ DEFINE_double(guard_window_seconds, 60,
               "number of seconds will not be sequenced.");
 DEFINE_int32(num_http_server_threads, 16,
              "Number of threads for servicing the incoming HTTP requests.");
+DEFINE_int64(not_after_start, 0,
+             "only accept certificates expiring at or after this time, in "
+             "seconds since the epoch (0 for no bound)");
+DEFINE_int64(not_after_limit, 0,
+             "only accept certificates expiring before this time, in "
+             "seconds since the epoch (0 for no bound)");
+DEFINE_string(extra_logs, "",
+              "Comma-separated list of other logs to host in this process, "
+              "each as path_prefix:etcd_root:key:trusted_cert_file:database, "
+              "optionally followed by :not_after_start:not_after_limit. The "
+              "log is served under path_prefix (such as /logs/foo), and the "
+              "database is of the type selected for the main log. "
+              "Submissions outside of the expiry range of a log are "
+              "redirected to the one accepting them.");
+DEFINE_int32(memory_accounting_interval_seconds, 10,
+             "how often to update the memory_bytes and allocator metrics, "
+             "and to shrink the caches if over --memory_budget_mb, in "
+             "seconds");
+DEFINE_string(submission_journal_dir, "",
+              "directory of a local journal the new entries of the main log "
+              "are written to, returning their SCT without waiting for etcd "
+              "(empty to add them to etcd directly)");
 
 namespace libevent = cert_trans::libevent;
 
@@ -54,11 +82,15 @@ using cert_trans::Database;
 using cert_trans::EtcdClient;
 using cert_trans::EtcdConsistentStore;
 using cert_trans::LoggedEntry;
+using cert_trans::MemoryAccounting;
+using cert_trans::PeriodicClosure;
 using cert_trans::ReadPrivateKey;
 using cert_trans::SequenceEntries;
 using cert_trans::Server;
 using cert_trans::SignMerkleTree;
 using cert_trans::StalenessTracker;
+using cert_trans::StartupPhase;
+using cert_trans::SubmissionJournal;
 using cert_trans::ThreadPool;
 using cert_trans::TreeSigner;
 using cert_trans::UrlFetcher;
@@ -72,6 +104,7 @@ using std::shared_ptr;
 using std::string;
 using std::thread;
 using std::unique_ptr;
+using std::vector;
 
 
 namespace {
@@ -90,6 +123,150 @@ static const bool key_dummy = RegisterFlagValidator(&FLAGS_key, &ValidateRead);
 static const bool cert_dummy =
     RegisterFlagValidator(&FLAGS_trusted_cert_file, &ValidateRead);
 
+
+// Set up a simple single-node environment.
+//
+// Put a sensible single-node config into FakeEtcd. For a real clustered
+// log
+// we'd expect a ClusterConfig already to be present within etcd as part of
+// the provisioning of the log.
+//
+// TODO(alcutter): Note that we're currently broken wrt to restarting the
+// log server when there's data in the log.  It's a temporary thing though,
+// so fear ye not.
+void BootstrapStandalone(Server* server, TreeSigner* tree_signer) {
+  ct::ClusterConfig config;
+  config.set_minimum_serving_nodes(1);
+  config.set_minimum_serving_fraction(1);
+  LOG(INFO) << "Setting default single-node ClusterConfig:\n"
+            << config.DebugString();
+  server->consistent_store()->SetClusterConfig(config);
+
+  // Since we're a single node cluster, we'll settle that we're the
+  // master here, so that we can populate the initial STH
+  // (StrictConsistentStore won't allow us to do so unless we're master.)
+  server->election()->StartElection();
+  server->election()->WaitToBecomeMaster();
+
+  // Do an initial signing run to get the initial STH, again this is
+  // temporary until we re-populate FakeEtcd from the DB.
+  CHECK_EQ(tree_signer->UpdateTree(), TreeSigner::OK);
+
+  // Need to boot-strap the Serving STH too because we consider it an error
+  // if it's not set, which in turn causes us to not attempt to become
+  // master:
+  server->consistent_store()->SetServingSTH(tree_signer->LatestSTH());
+}
+
+
+int64_t ParseNotAfterBound(const string& value) {
+  char* end;
+  const long long bound(strtoll(value.c_str(), &end, 10));
+  CHECK(!value.empty() && *end == '\0' && bound >= 0)
+      << "Invalid expiry bound in --extra_logs: " << value;
+  return bound;
+}
+
+
+// A log from --extra_logs, hosted by the server of the main log.
+struct ExtraLog {
+  string path_prefix;
+  string trusted_cert_file;
+  unique_ptr<LogSigner> log_signer;
+  unique_ptr<CertChecker> checker;
+  unique_ptr<Database> db;
+  unique_ptr<LogVerifier> log_verifier;
+  unique_ptr<Server> server;
+  unique_ptr<Frontend> frontend;
+  unique_ptr<StalenessTracker> staleness_tracker;
+  unique_ptr<CertificateHttpHandler> handler;
+  unique_ptr<TreeSigner> tree_signer;
+};
+
+
+unique_ptr<ExtraLog> SetUpExtraLog(const string& spec, Server* host,
+                                   ThreadPool* internal_pool,
+                                   ThreadPool* crypto_pool,
+                                   libevent::Base* event_base,
+                                   bool stand_alone_mode) {
+  const vector<string> fields(util::split(spec, ':'));
+  CHECK(fields.size() == 5 || fields.size() == 7)
+      << "Invalid --extra_logs entry: " << spec;
+  const string& path_prefix(fields[0]);
+  const string& etcd_root(fields[1]);
+  const string& key(fields[2]);
+  const string& trusted_cert_file(fields[3]);
+  LOG(INFO) << "Hosting the log under " << path_prefix << ".";
+
+  unique_ptr<ExtraLog> log(new ExtraLog);
+  log->path_prefix = path_prefix;
+  log->trusted_cert_file = trusted_cert_file;
+  util::StatusOr<EVP_PKEY*> pkey(ReadPrivateKey(key));
+  CHECK_EQ(pkey.status(), util::Status::OK) << "Could not read " << key;
+  log->log_signer.reset(new LogSigner(pkey.ValueOrDie()));
+
+  log->checker.reset(new CertChecker(crypto_pool));
+  CHECK(log->checker->LoadTrustedCertificates(trusted_cert_file))
+      << "Could not load CA certs from " << trusted_cert_file;
+  if (fields.size() == 7) {
+    log->checker->SetNotAfterRange(ParseNotAfterBound(fields[5]),
+                                   ParseNotAfterBound(fields[6]));
+  }
+
+  log->db = cert_trans::ProvideDatabase(fields[4]);
+  log->log_verifier.reset(
+      new LogVerifier(new LogSigVerifier(pkey.ValueOrDie()),
+                      new MerkleVerifier(
+                          unique_ptr<Sha256Hasher>(new Sha256Hasher))));
+
+  log->server.reset(new Server(host, path_prefix, etcd_root, log->db.get(),
+                               log->log_verifier.get()));
+  log->server->Initialise(false /* is_mirror */);
+
+  log->frontend.reset(new Frontend(new FrontendSigner(
+      log->db.get(), log->server->consistent_store(),
+      log->log_signer.get())));
+  log->staleness_tracker.reset(
+      new StalenessTracker(log->server->cluster_state_controller(),
+                           internal_pool, event_base));
+  log->handler.reset(new CertificateHttpHandler(
+      log->server->log_lookup(), log->db.get(),
+      log->server->cluster_state_controller(), log->checker.get(),
+      log->frontend.get(), internal_pool, crypto_pool, event_base,
+      log->staleness_tracker.get()));
+
+  log->handler->SetProxy(log->server->proxy());
+  log->handler->SetPathPrefix(path_prefix);
+
+  log->tree_signer.reset(new TreeSigner(
+      std::chrono::duration<double>(FLAGS_guard_window_seconds),
+      log->db.get(),
+      log->server->SignerTree(),
+      log->server->consistent_store(), log->log_signer.get(),
+      internal_pool));
+
+  if (stand_alone_mode) {
+    BootstrapStandalone(log->server.get(), log->tree_signer.get());
+  }
+
+  return log;
+}
+
+
+// Starts the threads that sequence, clean up and sign the log of
+// |server|, adding them to |threads|.
+void StartLogThreads(Server* server, TreeSigner* tree_signer,
+                     vector<thread>* threads) {
+  const function<bool()> is_master(bind(&Server::IsMaster, server));
+  threads->emplace_back(&SequenceEntries, tree_signer,
+                        server->consistent_store(), is_master);
+  threads->emplace_back(&CleanUpEntries, server->consistent_store(),
+                        is_master);
+  threads->emplace_back(&SignMerkleTree, tree_signer,
+                        server->consistent_store(),
+                        server->cluster_state_controller());
+}
+
 }  // namespace
 
 
@@ -101,23 +278,39 @@ int main(int argc, char* argv[]) {
 
   ConfigureSerializerForV1CT();
   util::InitCT(&argc, &argv);
+  cert_trans::ConfigureAllocator();
 
   Server::StaticInit();
+  unique_ptr<StartupPhase> total_phase(new StartupPhase("total"));
+
+  // Opening the database can take minutes for a large log (the FileDB
+  // and LevelDB index their entries), so do it while the rest is set
+  // up, as none of it needs the database until the Server.
+  cert_trans::EnsureValidatorsRegistered();
+  unique_ptr<Database> db;
+  thread db_thread([&db]() {
+    StartupPhase phase("database");
+    db = cert_trans::ProvideDatabase();
+  });
 
   util::StatusOr<EVP_PKEY*> pkey(ReadPrivateKey(FLAGS_key));
   CHECK_EQ(pkey.status(), util::Status::OK);
   LogSigner log_signer(pkey.ValueOrDie());
 
-  CertChecker checker;
-  CHECK(checker.LoadTrustedCertificates(FLAGS_trusted_cert_file))
-      << "Could not load CA certs from " << FLAGS_trusted_cert_file;
-
-  cert_trans::EnsureValidatorsRegistered();
-  const unique_ptr<Database> db(cert_trans::ProvideDatabase());
-  CHECK(db) << "No database instance created, check flag settings";
+  // Checking submitted chains is CPU bound, so it gets a thread per
+  // core, apart from the HTTP pool.
+  ThreadPool crypto_pool;
+  CertChecker checker(&crypto_pool);
+  {
+    StartupPhase phase("trusted_certificates");
+    CHECK(checker.LoadTrustedCertificates(FLAGS_trusted_cert_file))
+        << "Could not load CA certs from " << FLAGS_trusted_cert_file;
+  }
+  checker.SetNotAfterRange(FLAGS_not_after_start, FLAGS_not_after_limit);
 
   shared_ptr<libevent::Base> event_base(make_shared<libevent::Base>());
-  ThreadPool internal_pool(8);
+  ThreadPool internal_pool("internal", 8,
+                           cert_trans::ThreadPoolSchedulingFromFlags());
   UrlFetcher url_fetcher(event_base.get(), &internal_pool);
 
   const bool stand_alone_mode(cert_trans::IsStandalone(true));
@@ -132,83 +325,132 @@ int main(int argc, char* argv[]) {
                                  new MerkleVerifier(unique_ptr<Sha256Hasher>(
                                      new Sha256Hasher)));
 
-  ThreadPool http_pool(FLAGS_num_http_server_threads);
+  ThreadPool http_pool("http", FLAGS_num_http_server_threads,
+                       cert_trans::ThreadPoolSchedulingFromFlags());
+
+  db_thread.join();
+  CHECK(db) << "No database instance created, check flag settings";
 
+  // From here on, the HTTP server is listening, and answers /ready
+  // with 503 until server.Run().
   Server server(event_base, &internal_pool, &http_pool, db.get(),
                 etcd_client.get(), &url_fetcher, &log_verifier);
-  server.Initialise(false /* is_mirror */);
+  {
+    StartupPhase phase("initialise");
+    server.Initialise(false /* is_mirror */);
+  }
+
+  unique_ptr<SubmissionJournal> journal;
+  if (!FLAGS_submission_journal_dir.empty()) {
+    StartupPhase phase("submission_journal");
+    journal.reset(new SubmissionJournal(FLAGS_submission_journal_dir,
+                                        db.get(), server.consistent_store()));
+  }
 
-  Frontend frontend(
-      new FrontendSigner(db.get(), server.consistent_store(), &log_signer));
+  Frontend frontend(new FrontendSigner(db.get(), server.consistent_store(),
+                                       &log_signer, journal.get()));
   unique_ptr<StalenessTracker> staleness_tracker(
       new StalenessTracker(server.cluster_state_controller(), &internal_pool,
                            event_base.get()));
   CertificateHttpHandler handler(server.log_lookup(), db.get(),
                                  server.cluster_state_controller(), &checker,
-                                 &frontend, &internal_pool, event_base.get(),
-                                 staleness_tracker.get());
+                                 &frontend, &internal_pool, &crypto_pool,
+                                 event_base.get(), staleness_tracker.get());
 
   // Connect the handler, proxy and server together
   handler.SetProxy(server.proxy());
-  handler.Add(server.http_server());
 
   TreeSigner tree_signer(
       std::chrono::duration<double>(FLAGS_guard_window_seconds), db.get(),
-      server.log_lookup()->GetCompactMerkleTree(new Sha256Hasher),
-      server.consistent_store(), &log_signer);
+      server.SignerTree(),
+      server.consistent_store(), &log_signer, &internal_pool);
 
   if (stand_alone_mode) {
-    // Set up a simple single-node environment.
-    //
-    // Put a sensible single-node config into FakeEtcd. For a real clustered
-    // log
-    // we'd expect a ClusterConfig already to be present within etcd as part of
-    // the provisioning of the log.
-    //
-    // TODO(alcutter): Note that we're currently broken wrt to restarting the
-    // log server when there's data in the log.  It's a temporary thing though,
-    // so fear ye not.
-    ct::ClusterConfig config;
-    config.set_minimum_serving_nodes(1);
-    config.set_minimum_serving_fraction(1);
-    LOG(INFO) << "Setting default single-node ClusterConfig:\n"
-              << config.DebugString();
-    server.consistent_store()->SetClusterConfig(config);
-
-    // Since we're a single node cluster, we'll settle that we're the
-    // master here, so that we can populate the initial STH
-    // (StrictConsistentStore won't allow us to do so unless we're master.)
-    server.election()->StartElection();
-    server.election()->WaitToBecomeMaster();
-
-    {
-      EtcdClient::Response resp;
-      util::SyncTask task(event_base.get());
-      etcd_client->Create("/root/sequence_mapping", "", &resp, task.task());
-      task.Wait();
-      CHECK_EQ(util::Status::OK, task.status());
+    BootstrapStandalone(&server, &tree_signer);
+  }
+
+  vector<unique_ptr<ExtraLog>> extra_logs;
+  if (!FLAGS_extra_logs.empty()) {
+    StartupPhase phase("extra_logs");
+    for (const string& spec : util::split(FLAGS_extra_logs)) {
+      extra_logs.emplace_back(SetUpExtraLog(spec, &server, &internal_pool,
+                                            &crypto_pool, event_base.get(),
+                                            stand_alone_mode));
     }
+  }
 
-    // Do an initial signing run to get the initial STH, again this is
-    // temporary until we re-populate FakeEtcd from the DB.
-    CHECK_EQ(tree_signer.UpdateTree(), TreeSigner::OK);
+  // Let the logs sharded by expiry redirect submissions to each other.
+  if (checker.HasNotAfterRange()) {
+    for (const auto& log : extra_logs) {
+      if (log->checker->HasNotAfterRange()) {
+        handler.AddShard(log->path_prefix, log->checker.get());
+        log->handler->AddShard("", &checker);
+      }
+    }
+  }
+  for (const auto& log : extra_logs) {
+    for (const auto& other : extra_logs) {
+      if (log != other && log->checker->HasNotAfterRange() &&
+          other->checker->HasNotAfterRange()) {
+        log->handler->AddShard(other->path_prefix, other->checker.get());
+      }
+    }
+  }
 
-    // Need to boot-strap the Serving STH too because we consider it an error
-    // if it's not set, which in turn causes us to not attempt to become
-    // master:
-    server.consistent_store()->SetServingSTH(tree_signer.LatestSTH());
+  handler.Add(server.http_server());
+  for (const auto& log : extra_logs) {
+    log->handler->Add(log->server->http_server());
   }
 
-  server.WaitForReplication();
+  {
+    StartupPhase phase("replication");
+    server.WaitForReplication();
+    for (const auto& log : extra_logs) {
+      log->server->WaitForReplication();
+    }
+  }
 
   // TODO(pphaneuf): We should be remaining in an "unhealthy state"
   // (either not accepting any requests, or returning some internal
   // server error) until we have an STH to serve.
-  const function<bool()> is_master(bind(&Server::IsMaster, &server));
-  thread sequencer(&SequenceEntries, &tree_signer, is_master);
-  thread cleanup(&CleanUpEntries, server.consistent_store(), is_master);
-  thread signer(&SignMerkleTree, &tree_signer, server.consistent_store(),
-                server.cluster_state_controller());
+  vector<thread> log_threads;
+  StartLogThreads(&server, &tree_signer, &log_threads);
+  for (const auto& log : extra_logs) {
+    StartLogThreads(log->server.get(), log->tree_signer.get(), &log_threads);
+  }
+  total_phase.reset();
+
+  // SIGHUP reloads the trusted certificates of every log, on the
+  // internal pool rather than the event loop. Submissions keep being
+  // checked against the old ones until the new ones are swapped in.
+  libevent::Event reload_event(
+      *event_base, SIGHUP, EV_SIGNAL | EV_PERSIST,
+      [&checker, &extra_logs, &internal_pool](evutil_socket_t, short) {
+        internal_pool.Add([&checker, &extra_logs]() {
+          LOG(INFO) << "Reloading trusted certificates";
+          LOG_IF(ERROR,
+                 !checker.ReloadTrustedCertificates(FLAGS_trusted_cert_file))
+              << "Could not reload CA certs from "
+              << FLAGS_trusted_cert_file;
+          for (const auto& log : extra_logs) {
+            LOG_IF(ERROR, !log->checker->ReloadTrustedCertificates(
+                              log->trusted_cert_file))
+                << "Could not reload CA certs from "
+                << log->trusted_cert_file;
+          }
+        });
+      });
+  reload_event.Add(std::chrono::seconds(0));
+
+  PeriodicClosure memory_accounting(
+      event_base,
+      std::chrono::seconds(FLAGS_memory_accounting_interval_seconds),
+      [&internal_pool]() {
+        internal_pool.Add([]() {
+          MemoryAccounting::Instance()->Update();
+          cert_trans::UpdateAllocatorStats();
+        });
+      });
 
   server.Run();
 
@@ -0,0 +1,342 @@
+#include "server/entries_streamer.h"
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/http.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "log/database.h"
+#include "log/logged_entry.h"
+#include "monitoring/monitoring.h"
+#include "server/get_entries_cache.h"
+#include "server/json_output.h"
+#include "util/json_writer.h"
+#include "util/thread_pool.h"
+
+DEFINE_int32(get_entries_chunk_size, 100,
+             "number of entries read from the database at a time for "
+             "get-entries requests and entries streams, sent as they "
+             "come");
+DEFINE_int32(max_entries_followers, 1000,
+             "maximum number of clients following the entries of the log "
+             "at once, beyond which they get a 503");
+DEFINE_int32(entries_stream_max_buffered_bytes, 1 << 20,
+             "stop reading entries for a follower while this many bytes "
+             "are waiting to be written to it");
+DEFINE_int32(entries_stream_retry_delay_ms, 1000,
+             "how long to wait before reading entries for a follower "
+             "again, when the database of this node does not have them "
+             "yet");
+
+using std::bind;
+using std::chrono::milliseconds;
+using std::function;
+using std::lock_guard;
+using std::make_shared;
+using std::min;
+using std::mutex;
+using std::placeholders::_1;
+using std::shared_ptr;
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+
+static Gauge<>* entries_followers(
+    Gauge<>::New("entries_followers",
+                 "Number of clients following the entries of the log."));
+
+static Counter<>* entries_streamed(
+    Counter<>::New("entries_streamed",
+                   "Number of entries sent to the followers of the log."));
+
+
+}  // namespace
+
+
+struct EntriesStreamer::Follower {
+  Follower(EntriesStreamer* streamer, int64_t id, evhttp_request* req,
+           int64_t next)
+      : streamer(streamer),
+        id(id),
+        req(req),
+        base(libevent::Base::ForRequest(req)),
+        next(next),
+        event(CHECK_NOTNULL(evbuffer_new()), evbuffer_free) {
+  }
+
+  EntriesStreamer* const streamer;
+  const int64_t id;
+  evhttp_request* const req;
+  libevent::Base* const base;
+
+  // Only accessed on the event thread of |req|, or on the pool while
+  // |reading|.
+  int64_t next;
+  bool reading = false;
+  bool waiting_for_drain = false;
+  // Set while waiting for the database to catch up.
+  bool retrying = false;
+  // Once set, |req| is gone.
+  bool closed = false;
+  // Set if the chunk being read could not be sent.
+  bool failed = false;
+  int64_t requested = 0;
+  vector<LoggedEntry> entries;
+  // The event for the chunk read.
+  const unique_ptr<evbuffer, void (*)(evbuffer*)> event;
+};
+
+
+EntriesStreamer::EntriesStreamer(const ReadOnlyDatabase* db, ThreadPool* pool,
+                                 int64_t tree_size)
+    : db_(CHECK_NOTNULL(db)),
+      pool_(CHECK_NOTNULL(pool)),
+      task_(pool_),
+      tree_size_(tree_size),
+      next_id_(0) {
+  CHECK_GT(FLAGS_get_entries_chunk_size, 0);
+  CHECK_GT(FLAGS_entries_stream_retry_delay_ms, 0);
+}
+
+
+EntriesStreamer::~EntriesStreamer() {
+  task_.task()->Return();
+  task_.Wait();
+}
+
+
+bool EntriesStreamer::Follow(evhttp_request* req, int64_t start) {
+  CHECK_GE(start, 0);
+  shared_ptr<Follower> follower;
+  {
+    lock_guard<mutex> lock(lock_);
+    if (FLAGS_max_entries_followers > 0 &&
+        followers_.size() >=
+            static_cast<size_t>(FLAGS_max_entries_followers)) {
+      return false;
+    }
+    follower = make_shared<Follower>(this, next_id_++, req, start);
+    followers_[follower->id] = follower;
+    entries_followers->Set(followers_.size());
+  }
+
+  // We find out about the client going away this way only.
+  evhttp_connection_set_closecb(evhttp_request_get_connection(req),
+                                &EntriesStreamer::ConnectionClosed,
+                                follower.get());
+  StartEventStream(follower->base, req);
+  ReadChunk(follower);
+  return true;
+}
+
+
+void EntriesStreamer::SetTreeSize(int64_t tree_size) {
+  lock_guard<mutex> lock(lock_);
+  if (tree_size <= tree_size_) {
+    return;
+  }
+  tree_size_ = tree_size;
+  for (const auto& it : followers_) {
+    RunOnFollowerThread(it.second,
+                        bind(&EntriesStreamer::ReadChunk, this, it.second));
+  }
+}
+
+
+// static
+void EntriesStreamer::ConnectionClosed(evhttp_connection* conn, void* arg) {
+  Follower* const follower(static_cast<Follower*>(arg));
+  VLOG(1) << "entries follower " << follower->id << " went away";
+  follower->closed = true;
+  // libevent detaches a request that was not replied to in full from
+  // its connection, and leaves it to us to free.
+  if (!evhttp_request_get_connection(follower->req)) {
+    evhttp_request_free(follower->req);
+  }
+  EntriesStreamer* const streamer(follower->streamer);
+  lock_guard<mutex> lock(streamer->lock_);
+  // This might be the last reference to |follower|.
+  streamer->followers_.erase(follower->id);
+  entries_followers->Set(streamer->followers_.size());
+}
+
+
+// static
+void EntriesStreamer::Drained(evhttp_connection* conn, void* arg) {
+  Follower* const follower(static_cast<Follower*>(arg));
+  if (follower->closed || !follower->waiting_for_drain) {
+    return;
+  }
+  follower->waiting_for_drain = false;
+
+  EntriesStreamer* const streamer(follower->streamer);
+  shared_ptr<Follower> ref;
+  {
+    lock_guard<mutex> lock(streamer->lock_);
+    ref = streamer->followers_.at(follower->id);
+  }
+  streamer->ReadChunk(ref);
+}
+
+
+void EntriesStreamer::ReadChunk(const shared_ptr<Follower>& follower) {
+  if (follower->closed || follower->reading) {
+    return;
+  }
+  int64_t tree_size;
+  {
+    lock_guard<mutex> lock(lock_);
+    tree_size = tree_size_;
+  }
+  if (follower->next >= tree_size) {
+    // Caught up, SetTreeSize() will get us going again.
+    return;
+  }
+
+  const evbuffer* const output(bufferevent_get_output(
+      evhttp_connection_get_bufferevent(
+          evhttp_request_get_connection(follower->req))));
+  if (evbuffer_get_length(output) >
+      static_cast<size_t>(FLAGS_entries_stream_max_buffered_bytes)) {
+    // Drained() gets us going again.
+    follower->waiting_for_drain = true;
+    return;
+  }
+
+  follower->reading = true;
+  follower->requested =
+      min<int64_t>(tree_size - follower->next, FLAGS_get_entries_chunk_size);
+  db_->ReadEntries(follower->next, follower->next + follower->requested - 1,
+                   pool_, &follower->entries,
+                   task_.task()->AddChild(
+                       bind(&EntriesStreamer::ChunkRead, this, follower, _1)));
+}
+
+
+void EntriesStreamer::ChunkRead(const shared_ptr<Follower>& follower,
+                                util::Task* task) {
+  if (!task->status().ok()) {
+    if (task->status().CanonicalCode() == util::error::CANCELLED) {
+      // We're shutting down.
+      return;
+    }
+    LOG(WARNING) << "error reading entries for follower " << follower->id
+                 << ": " << task->status();
+    follower->failed = true;
+  }
+
+  // The id goes first, so that the event can be rendered straight
+  // into the buffer.
+  const int64_t start(follower->next);
+  const int64_t end(start + follower->entries.size());
+  if (!follower->failed && end > start) {
+    const string header("id: " + to_string(end) +
+                        "\nevent: entries\ndata: ");
+    CHECK_EQ(evbuffer_add(follower->event.get(), header.data(),
+                          header.size()),
+             0);
+    JsonWriter writer(follower->event.get());
+    writer.BeginObject();
+    writer.Key("start");
+    writer.Int(start);
+    writer.Key("entries");
+    writer.BeginArray();
+    for (const auto& entry : follower->entries) {
+      const util::Status status(
+          GetEntriesCache::WriteEntry(entry, false, &writer));
+      if (!status.ok()) {
+        LOG(WARNING) << "error rendering entry " << entry.sequence_number()
+                     << " for follower " << follower->id << ": " << status;
+        follower->failed = true;
+        break;
+      }
+    }
+    writer.EndArray();
+    writer.EndObject();
+    CHECK_EQ(evbuffer_add(follower->event.get(), "\n\n", 2), 0);
+    follower->next = end;
+    entries_streamed->IncrementBy(end - start);
+  }
+
+  RunOnFollowerThread(follower,
+                      bind(&EntriesStreamer::SendChunk, this, follower));
+}
+
+
+void EntriesStreamer::SendChunk(const shared_ptr<Follower>& follower) {
+  follower->reading = false;
+  if (follower->closed) {
+    return;
+  }
+
+  evhttp_request* const req(follower->req);
+  if (follower->failed) {
+    // Rather than leave it hanging, the follower can reconnect from
+    // where it got to.
+    evhttp_connection_set_closecb(evhttp_request_get_connection(req),
+                                  nullptr, nullptr);
+    follower->closed = true;
+    evhttp_send_reply_end(req);
+    lock_guard<mutex> lock(lock_);
+    followers_.erase(follower->id);
+    entries_followers->Set(followers_.size());
+    return;
+  }
+
+  if (evbuffer_get_length(follower->event.get()) == 0) {
+    // The database of this node did not have the entries yet, which
+    // the next tree size might take a while to make up for.
+    RetryLater(follower);
+    return;
+  }
+  evhttp_send_reply_chunk_with_cb(req, follower->event.get(),
+                                  &EntriesStreamer::Drained, follower.get());
+  ReadChunk(follower);
+}
+
+
+void EntriesStreamer::RetryLater(const shared_ptr<Follower>& follower) {
+  if (follower->retrying) {
+    return;
+  }
+  follower->retrying = true;
+  // Cancelled if we're shutting down.
+  follower->base->Delay(milliseconds(FLAGS_entries_stream_retry_delay_ms),
+                        task_.task()->AddChildWithExecutor(
+                            [this, follower](util::Task* child_task) {
+                              follower->retrying = false;
+                              if (child_task->status().ok()) {
+                                ReadChunk(follower);
+                              }
+                            },
+                            follower->base));
+}
+
+
+void EntriesStreamer::RunOnFollowerThread(
+    const shared_ptr<Follower>& follower, const function<void()>& closure) {
+  // The task does not complete until this has run, which keeps us
+  // around.
+  task_.task()
+      ->AddChildWithExecutor(
+          [this, closure](util::Task*) {
+            if (task_.task()->IsActive()) {
+              closure();
+            }
+          },
+          follower->base)
+      ->Return();
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,91 @@
+#ifndef CERT_TRANS_SERVER_ENTRIES_STREAMER_H_
+#define CERT_TRANS_SERVER_ENTRIES_STREAMER_H_
+
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include "base/macros.h"
+#include "util/libevent_wrapper.h"
+#include "util/sync_task.h"
+#include "util/task.h"
+
+namespace cert_trans {
+
+class ReadOnlyDatabase;
+class ThreadPool;
+
+
+// Streams the entries of the log to its followers (mirrors,
+// monitors), from the index they ask for up to the tree size, and
+// then the new entries as they are integrated, over a single
+// long-lived reply rather than repeated get-entries requests.
+//
+// The reply is a stream of server-sent events, an "entries" event
+// for every chunk of --get_entries_chunk_size entries (or fewer),
+// whose data is {"start":<index>,"entries":[...]}, the entries being
+// as in get-entries. The id of every event is the index of the entry
+// following it, so that a follower reconnecting with a Last-Event-ID
+// header resumes right where it was.
+//
+// Only one chunk per follower is read at a time, and none while more
+// than --entries_stream_max_buffered_bytes are waiting to be written
+// to it, so a slow follower just gets the entries more slowly.
+//
+// This class is thread-safe.
+class EntriesStreamer {
+ public:
+  // Does not take ownership of its parameters, which must outlive
+  // this instance. The entries are read and rendered on |pool|.
+  EntriesStreamer(const ReadOnlyDatabase* db, ThreadPool* pool,
+                  int64_t tree_size);
+  ~EntriesStreamer();
+
+  // Starts streaming the entries from |start| in reply to |req|.
+  // Returns false if there are too many followers already, in which
+  // case the caller must reply to |req| itself. Must be called on the
+  // event thread of |req|.
+  bool Follow(evhttp_request* req, int64_t start);
+
+  // Lets the followers have the entries up to |tree_size| (exclusive).
+  void SetTreeSize(int64_t tree_size);
+
+ private:
+  struct Follower;
+
+  // Called by libevent on the event thread of a follower, when its
+  // connection closes, or when everything sent to it was written.
+  static void ConnectionClosed(evhttp_connection* conn, void* follower);
+  static void Drained(evhttp_connection* conn, void* follower);
+
+  // These run on the event thread of |follower|, ReadChunk() reading
+  // the next chunk, if it can.
+  void ReadChunk(const std::shared_ptr<Follower>& follower);
+  void SendChunk(const std::shared_ptr<Follower>& follower);
+  // Runs on |pool_|, once a chunk was read.
+  void ChunkRead(const std::shared_ptr<Follower>& follower, util::Task* task);
+  // Calls ReadChunk() again after --entries_stream_retry_delay_ms, on
+  // the event thread of |follower|.
+  void RetryLater(const std::shared_ptr<Follower>& follower);
+  // Runs |closure| on the event thread of |follower|, unless shutting
+  // down.
+  void RunOnFollowerThread(const std::shared_ptr<Follower>& follower,
+                           const std::function<void()>& closure);
+
+  const ReadOnlyDatabase* const db_;
+  ThreadPool* const pool_;
+  util::SyncTask task_;
+
+  std::mutex lock_;
+  int64_t tree_size_;
+  int64_t next_id_;
+  std::map<int64_t, std::shared_ptr<Follower>> followers_;
+
+  DISALLOW_COPY_AND_ASSIGN(EntriesStreamer);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_ENTRIES_STREAMER_H_
@@ -0,0 +1,341 @@
+#include "server/entries_streamer.h"
+
+#include <arpa/inet.h>
+#include <event2/http.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "log/file_db.h"
+#include "log/logged_entry.h"
+#include "log/test_db.h"
+#include "log/test_signer.h"
+#include "monitoring/metric.h"
+#include "monitoring/registry.h"
+#include "proto/cert_serializer.h"
+#include "util/libevent_wrapper.h"
+#include "util/testing.h"
+#include "util/thread_pool.h"
+
+DECLARE_int32(entries_stream_max_buffered_bytes);
+DECLARE_int32(entries_stream_retry_delay_ms);
+DECLARE_int32(get_entries_chunk_size);
+DECLARE_int32(max_entries_followers);
+
+namespace cert_trans {
+
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::make_shared;
+using std::shared_ptr;
+using std::string;
+using std::this_thread::sleep_for;
+using std::to_string;
+using std::vector;
+using testing::HasSubstr;
+using testing::Not;
+
+namespace {
+
+const uint16_t kPort = 4451;
+
+
+// Sends a GET request for |path|, with the extra |headers| (each
+// ending with "\r\n"), to the test server, and returns the socket to
+// read the reply from. A non-zero |receive_buffer| shrinks the receive
+// buffer of the socket.
+int SendGet(const string& path, const string& headers = "",
+            int receive_buffer = 0) {
+  const int fd(socket(AF_INET, SOCK_STREAM, 0));
+  PCHECK(fd >= 0);
+  if (receive_buffer > 0) {
+    PCHECK(setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &receive_buffer,
+                      sizeof(receive_buffer)) == 0);
+  }
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(kPort);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  PCHECK(connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) ==
+         0);
+  const string request("GET " + path +
+                       " HTTP/1.1\r\nHost: localhost\r\n" + headers +
+                       "\r\n");
+  PCHECK(write(fd, request.data(), request.size()) ==
+         static_cast<ssize_t>(request.size()));
+  return fd;
+}
+
+
+// Reads from |fd| until |expected| has been received, the connection
+// is closed, or |timeout| passes, and returns all that was read.
+string ReadUntil(int fd, const string& expected, milliseconds timeout) {
+  const steady_clock::time_point deadline(steady_clock::now() + timeout);
+  string received;
+  while (received.find(expected) == string::npos) {
+    const milliseconds left(
+        duration_cast<milliseconds>(deadline - steady_clock::now()));
+    pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (left.count() <= 0 || poll(&pfd, 1, left.count()) <= 0) {
+      break;
+    }
+    char buf[4096];
+    const ssize_t len(read(fd, buf, sizeof(buf)));
+    if (len <= 0) {
+      break;
+    }
+    received.append(buf, len);
+  }
+  return received;
+}
+
+
+// Returns the value of the metric called |name|, which has no labels.
+double MetricValue(const string& name) {
+  for (const Metric* metric : Registry::Instance()->GetMetrics()) {
+    if (metric->Name() == name) {
+      const auto values(metric->CurrentValues());
+      const auto it(values.find(vector<string>()));
+      return it == values.end() ? 0 : it->second.second;
+    }
+  }
+  return 0;
+}
+
+
+// Returns the beginning of the event for the entries from |start| to
+// |end| (exclusive).
+string Event(int64_t start, int64_t end) {
+  return "id: " + to_string(end) + "\nevent: entries\ndata: {\"start\":" +
+         to_string(start) + ",";
+}
+
+
+class EntriesStreamerTest : public ::testing::Test {
+ protected:
+  EntriesStreamerTest()
+      : next_sequence_number_(0),
+        base_(make_shared<libevent::Base>()),
+        event_pump_(base_),
+        server_(*base_),
+        streamer_(test_db_.db(), &pool_, 0) {
+    FLAGS_get_entries_chunk_size = 2;
+    CHECK(server_.AddHandler("/entries", [this](evhttp_request* req) {
+      // As the real handler, without the checks.
+      const char* const last_event_id(evhttp_find_header(
+          evhttp_request_get_input_headers(req), "Last-Event-ID"));
+      const int64_t start(last_event_id
+                              ? atoll(last_event_id)
+                              : libevent::GetIntParam(
+                                    libevent::ParseQuery(req), "start"));
+      if (!streamer_.Follow(req, start)) {
+        evhttp_send_error(req, HTTP_SERVUNAVAIL, nullptr);
+      }
+    }));
+    server_.Bind("127.0.0.1", kPort);
+  }
+
+  ~EntriesStreamerTest() {
+    for (int fd : fds_) {
+      close(fd);
+    }
+    // The followers must all be gone before the streamer.
+    WaitForFollowers(0);
+  }
+
+  // Adds |count| entries to the database, after those already there,
+  // with a chain certificate of |chain_cert_size| bytes if not zero.
+  void AddEntries(int count, size_t chain_cert_size = 0) {
+    for (int i = 0; i < count; ++i) {
+      LoggedEntry entry;
+      test_signer_.CreateUnique(&entry);
+      if (chain_cert_size > 0) {
+        entry.mutable_entry()->mutable_x509_entry()->add_certificate_chain(
+            string(chain_cert_size, 'c'));
+      }
+      entry.set_sequence_number(next_sequence_number_++);
+      CHECK_EQ(Database::OK, test_db_.db()->CreateSequencedEntry(entry));
+    }
+  }
+
+  int Follow(const string& path, const string& headers = "",
+             int receive_buffer = 0) {
+    fds_.push_back(SendGet(path, headers, receive_buffer));
+    return fds_.back();
+  }
+
+  void Close(int fd) {
+    for (auto it(fds_.begin()); it != fds_.end(); ++it) {
+      if (*it == fd) {
+        fds_.erase(it);
+        break;
+      }
+    }
+    close(fd);
+  }
+
+  void WaitForFollowers(int followers) {
+    const steady_clock::time_point deadline(steady_clock::now() +
+                                            seconds(5));
+    while (MetricValue("entries_followers") != followers &&
+           steady_clock::now() < deadline) {
+      sleep_for(milliseconds(10));
+    }
+    EXPECT_EQ(followers, MetricValue("entries_followers"));
+  }
+
+  google::FlagSaver saver_;
+  TestDB<FileDB> test_db_;
+  TestSigner test_signer_;
+  int64_t next_sequence_number_;
+  ThreadPool pool_;
+  const shared_ptr<libevent::Base> base_;
+  libevent::EventPumpThread event_pump_;
+  libevent::HttpServer server_;
+  EntriesStreamer streamer_;
+  vector<int> fds_;
+};
+
+
+TEST_F(EntriesStreamerTest, StreamsEntriesAsTheyAreIntegrated) {
+  AddEntries(5);
+  streamer_.SetTreeSize(5);
+
+  const int fd(Follow("/entries?start=0"));
+  string events(ReadUntil(fd, Event(4, 5), seconds(5)));
+  EXPECT_THAT(events, HasSubstr("200 OK"));
+  EXPECT_THAT(events, HasSubstr("text/event-stream"));
+  EXPECT_THAT(events, HasSubstr(Event(0, 2)));
+  EXPECT_THAT(events, HasSubstr(Event(2, 4)));
+  EXPECT_THAT(events, HasSubstr(Event(4, 5)));
+  EXPECT_THAT(events, HasSubstr("leaf_input"));
+
+  // Caught up.
+  EXPECT_THAT(ReadUntil(fd, "id:", milliseconds(300)),
+              Not(HasSubstr("id:")));
+
+  AddEntries(2);
+  streamer_.SetTreeSize(7);
+  events = ReadUntil(fd, Event(5, 7), seconds(5));
+  EXPECT_THAT(events, HasSubstr(Event(5, 7)));
+}
+
+
+TEST_F(EntriesStreamerTest, ResumesFromLastEventId) {
+  AddEntries(6);
+  streamer_.SetTreeSize(6);
+
+  int fd(Follow("/entries?start=0"));
+  EXPECT_THAT(ReadUntil(fd, Event(2, 4), seconds(5)),
+              HasSubstr(Event(2, 4)));
+  Close(fd);
+
+  // Picks up from the id of the last event received.
+  fd = Follow("/entries", "Last-Event-ID: 4\r\n");
+  const string events(ReadUntil(fd, Event(4, 6), seconds(5)));
+  EXPECT_THAT(events, HasSubstr(Event(4, 6)));
+  EXPECT_THAT(events, Not(HasSubstr(Event(0, 2))));
+  EXPECT_THAT(events, Not(HasSubstr(Event(2, 4))));
+}
+
+
+TEST_F(EntriesStreamerTest, RetriesWhenTheDatabaseIsBehind) {
+  FLAGS_entries_stream_retry_delay_ms = 100;
+  AddEntries(1);
+  // The tree already has entries this node has not got yet.
+  streamer_.SetTreeSize(3);
+
+  const int fd(Follow("/entries?start=0"));
+  EXPECT_THAT(ReadUntil(fd, Event(0, 1), seconds(5)),
+              HasSubstr(Event(0, 1)));
+  EXPECT_THAT(ReadUntil(fd, "id:", milliseconds(300)),
+              Not(HasSubstr("id:")));
+
+  // Sent without waiting for the next tree size.
+  AddEntries(2);
+  EXPECT_THAT(ReadUntil(fd, Event(1, 3), seconds(5)),
+              HasSubstr(Event(1, 3)));
+}
+
+
+TEST_F(EntriesStreamerTest, DoesNotReadAheadOfASlowFollower) {
+  // Events much bigger than what the socket buffers hold.
+  FLAGS_get_entries_chunk_size = 1;
+  FLAGS_entries_stream_max_buffered_bytes = 1024;
+  const int kNumEntries(300);
+  AddEntries(kNumEntries, 64 << 10);
+  streamer_.SetTreeSize(kNumEntries);
+  const double streamed(MetricValue("entries_streamed"));
+
+  // Not reading anything for now.
+  const int fd(Follow("/entries?start=0", "", 4096));
+  WaitForFollowers(1);
+  sleep_for(milliseconds(500));
+  EXPECT_LT(MetricValue("entries_streamed") - streamed, kNumEntries / 2);
+
+  // Everything comes through once it does.
+  EXPECT_THAT(ReadUntil(fd, Event(kNumEntries - 1, kNumEntries), seconds(10)),
+              HasSubstr(Event(kNumEntries - 1, kNumEntries)));
+  EXPECT_EQ(kNumEntries, MetricValue("entries_streamed") - streamed);
+}
+
+
+TEST_F(EntriesStreamerTest, FollowerRemovedWhenConnectionCloses) {
+  AddEntries(2);
+  streamer_.SetTreeSize(2);
+  const int fd(Follow("/entries?start=0"));
+  ReadUntil(fd, Event(0, 2), seconds(5));
+  WaitForFollowers(1);
+
+  Close(fd);
+  WaitForFollowers(0);
+
+  // Nobody left to send them to.
+  AddEntries(2);
+  streamer_.SetTreeSize(4);
+}
+
+
+TEST_F(EntriesStreamerTest, TooManyFollowers) {
+  FLAGS_max_entries_followers = 1;
+  const int fd(Follow("/entries?start=0"));
+  WaitForFollowers(1);
+
+  EXPECT_THAT(ReadUntil(Follow("/entries?start=0"), "\r\n", seconds(5)),
+              HasSubstr("503"));
+  WaitForFollowers(1);
+
+  // There is room again once the first one goes away.
+  Close(fd);
+  WaitForFollowers(0);
+  Follow("/entries?start=0");
+  WaitForFollowers(1);
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  ConfigureSerializerForV1CT();
+  return RUN_ALL_TESTS();
+}
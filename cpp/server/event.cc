@@ -1,11 +1,35 @@
 /* -*- indent-tabs-mode: nil -*- */
+#include "config.h"
 #include "server/event.h"
 
 #include <limits.h>
 #include <openssl/evp.h>
 #include <openssl/pem.h>
 
-time_t Services::rough_time_;
+namespace {
+
+// Each thread running an EventLoop samples its own.
+#ifdef HAVE_THREAD_LOCAL
+thread_local time_t rough_time = 0;
+#elif HAVE___THREAD
+__thread time_t rough_time = 0;
+#else
+#error No suitable thread local storage available
+#endif
+
+}  // namespace
+
+// static
+time_t Services::RoughTime() {
+  if (rough_time == 0)
+    rough_time = time(NULL);
+  return rough_time;
+}
+
+// static
+void Services::SetRoughTime() {
+  rough_time = 0;
+}
 
 FD::FD(EventLoop* loop, int fd, CanDelete deletable)
     : fd_(fd), loop_(loop), wants_erase_(false), deletable_(deletable) {
@@ -242,7 +266,8 @@ void UDPServer::QueuePacket(const sockaddr_in& to, const char* buf,
   write_queue_.push_back(wbuf);
 }
 
-bool Services::InitServer(int* sock, int port, const char* ip, int type) {
+bool Services::InitServer(int* sock, int port, const char* ip, int type,
+                          bool reuse_port) {
   bool ret = false;
   struct sockaddr_in server;
   int s = -1;
@@ -265,6 +290,11 @@ bool Services::InitServer(int* sock, int port, const char* ip, int type) {
   {
     int j = 1;
     setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &j, sizeof j);
+    if (reuse_port &&
+        setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &j, sizeof j) == -1) {
+      perror("setsockopt(SO_REUSEPORT)");
+      goto err;
+    }
   }
 
   if (bind(s, (struct sockaddr*)&server, sizeof(server)) == -1) {
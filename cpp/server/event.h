@@ -17,25 +17,21 @@ class Services {
   // because time is expensive, for most tasks we can just use some
   // time sampled within this event handling loop. So, the main loop
   // needs to call SetRoughTime() appropriately.
-  static time_t RoughTime() {
-    if (rough_time_ == 0)
-      rough_time_ = time(NULL);
-    return rough_time_;
-  }
+  static time_t RoughTime();
 
-  static void SetRoughTime() {
-    rough_time_ = 0;
-  }
+  static void SetRoughTime();
 
-  static bool InitServer(int* sock, int port, const char* ip, int type);
+  // With |reuse_port|, several sockets (usually one per thread) can
+  // be bound to the same port, and the kernel spreads the incoming
+  // connections or datagrams between them.
+  static bool InitServer(int* sock, int port, const char* ip, int type,
+                         bool reuse_port = false);
 
  private:
   // This class is only used as a namespace, it should never be
   // instantiated.
   // TODO(pphaneuf): Make this into normal functions in a namespace.
   Services();
-
-  static time_t rough_time_;
 };
 
 class EventLoop;
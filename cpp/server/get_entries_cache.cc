@@ -0,0 +1,250 @@
+#include "server/get_entries_cache.h"
+
+#include <event2/buffer.h>
+#include <glog/logging.h>
+#include <algorithm>
+
+#include "log/database.h"
+#include "log/logged_entry.h"
+#include "monitoring/monitoring.h"
+#include "proto/serializer.h"
+
+using std::bind;
+using std::lock_guard;
+using std::max;
+using std::min;
+using std::mutex;
+using std::placeholders::_1;
+using std::shared_ptr;
+using std::string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+using util::Status;
+using util::StatusOr;
+
+namespace cert_trans {
+namespace {
+
+
+static Counter<string>* get_entries_cache_tile_lookups(
+    Counter<string>::New("get_entries_cache_tile_lookups", "result",
+                         "Number of tile lookups in the get-entries cache, "
+                         "broken down by result (hit, extended or miss)."));
+
+
+}  // namespace
+
+
+struct GetEntriesCache::Tile {
+  int64_t size() const {
+    return ends.size();
+  }
+
+  size_t MemoryUsage() const {
+    return sizeof(Tile) + json.capacity() + ends.capacity() * sizeof(size_t);
+  }
+
+  // The JSON objects for the entries of the tile, back to back.
+  string json;
+  // Where every entry ends in |json|.
+  vector<size_t> ends;
+};
+
+
+GetEntriesCache::GetEntriesCache(const ReadOnlyDatabase* db,
+                                 int64_t tile_size, size_t max_tiles)
+    : db_(CHECK_NOTNULL(db)),
+      tile_size_(tile_size),
+      max_tiles_(max_tiles),
+      bytes_(0),
+      memory_(MemoryAccounting::Instance()->Register(
+          "get_entries_cache",
+          [this]() {
+            lock_guard<mutex> lock(lock_);
+            return bytes_;
+          },
+          bind(&GetEntriesCache::Shrink, this, _1))) {
+  CHECK_GT(tile_size_, 0);
+  CHECK_GT(max_tiles_, 0U);
+}
+
+
+GetEntriesCache::~GetEntriesCache() {
+}
+
+
+StatusOr<int64_t> GetEntriesCache::WriteEntries(int64_t start, int64_t end,
+                                                size_t max_bytes,
+                                                JsonWriter* writer) {
+  CHECK_GE(start, 0);
+  CHECK_NOTNULL(writer);
+  int64_t num_written(0);
+  size_t bytes_written(0);
+  for (int64_t index = start / tile_size_; index <= end / tile_size_;
+       ++index) {
+    const StatusOr<shared_ptr<const Tile>> tile(GetTile(index));
+    if (!tile.ok()) {
+      return tile.status();
+    }
+    const Tile& t(*tile.ValueOrDie());
+
+    const int64_t first(index * tile_size_);
+    const int64_t begin(max(start, first) - first);
+    const int64_t stop(min(end - first + 1, t.size()));
+    for (int64_t i = begin; i < stop; ++i) {
+      const size_t offset(i > 0 ? t.ends[i - 1] : 0);
+      writer->RawValue(t.json.data() + offset, t.ends[i] - offset);
+      ++num_written;
+      bytes_written += t.ends[i] - offset;
+      if (max_bytes > 0 && bytes_written >= max_bytes) {
+        return num_written;
+      }
+    }
+
+    if (t.size() < tile_size_) {
+      // This is the end of the log (for now).
+      break;
+    }
+  }
+
+  return num_written;
+}
+
+
+// static
+Status GetEntriesCache::WriteEntry(const LoggedEntry& entry,
+                                   bool include_scts, JsonWriter* writer) {
+  string leaf_input;
+  string extra_data;
+  string sct_data;
+  if (!entry.SerializeForLeaf(&leaf_input) ||
+      !entry.SerializeExtraData(&extra_data) ||
+      (include_scts &&
+       Serializer::SerializeSCT(entry.sct(), &sct_data) !=
+           serialization::SerializeResult::OK)) {
+    LOG(WARNING) << "Failed to serialize entry @ " << entry.sequence_number()
+                 << ":\n" << entry.DebugString();
+    return Status(util::error::INTERNAL, "Serialization failed.");
+  }
+
+  writer->BeginObject();
+  writer->Key("leaf_input");
+  writer->Base64(leaf_input);
+  writer->Key("extra_data");
+  writer->Base64(extra_data);
+
+  if (include_scts) {
+    // This is non-standard for this implementation, and is currently only
+    // used by other nodes when "following" to fetch data from each other:
+    writer->Key("sct");
+    writer->Base64(sct_data);
+  }
+
+  writer->EndObject();
+  return Status::OK;
+}
+
+
+StatusOr<shared_ptr<const GetEntriesCache::Tile>> GetEntriesCache::GetTile(
+    int64_t index) {
+  unique_lock<mutex> lock(lock_);
+  shared_ptr<const Tile> tile;
+  const auto it(tiles_.find(index));
+  if (it != tiles_.end()) {
+    tile = it->second.tile;
+    lru_.splice(lru_.begin(), lru_, it->second.lru_position);
+    // Entries are only ever added at the end of the log, so a tile is
+    // only stale if it is incomplete and the log has grown since.
+    if (tile->size() == tile_size_ ||
+        index * tile_size_ + tile->size() >= db_->TreeSize()) {
+      get_entries_cache_tile_lookups->Increment("hit");
+      return tile;
+    }
+  }
+  get_entries_cache_tile_lookups->Increment(tile ? "extended" : "miss");
+  lock.unlock();
+
+  const StatusOr<shared_ptr<const Tile>> extended(ExtendTile(index, tile));
+  if (!extended.ok()) {
+    return extended;
+  }
+
+  lock.lock();
+  Store(index, extended.ValueOrDie());
+  return extended;
+}
+
+
+StatusOr<shared_ptr<const GetEntriesCache::Tile>> GetEntriesCache::ExtendTile(
+    int64_t index, const shared_ptr<const Tile>& tile) const {
+  unique_ptr<Tile> extended(tile ? new Tile(*tile) : new Tile);
+  const unique_ptr<evbuffer, void (*)(evbuffer*)> buffer(
+      CHECK_NOTNULL(evbuffer_new()), evbuffer_free);
+  JsonWriter writer(buffer.get());
+
+  const int64_t first(index * tile_size_ + extended->size());
+  const int64_t end((index + 1) * tile_size_);
+  const size_t initial_length(extended->json.size());
+  vector<LoggedEntry> entries;
+  db_->ReadRange(first, end - first, &entries);
+  for (const auto& entry : entries) {
+    const Status status(WriteEntry(entry, false, &writer));
+    if (!status.ok()) {
+      return status;
+    }
+    extended->ends.push_back(initial_length +
+                             evbuffer_get_length(buffer.get()));
+  }
+
+  const size_t length(evbuffer_get_length(buffer.get()));
+  extended->json.resize(initial_length + length);
+  CHECK_EQ(static_cast<int>(length),
+           evbuffer_remove(buffer.get(), &extended->json[initial_length],
+                           length));
+
+  return shared_ptr<const Tile>(extended.release());
+}
+
+
+void GetEntriesCache::Store(int64_t index, const shared_ptr<const Tile>& tile) {
+  const auto it(tiles_.find(index));
+  if (it != tiles_.end()) {
+    // Another thread might have extended it further in the meantime.
+    if (it->second.tile->size() < tile->size()) {
+      bytes_ -= it->second.tile->MemoryUsage();
+      bytes_ += tile->MemoryUsage();
+      it->second.tile = tile;
+    }
+    return;
+  }
+
+  lru_.push_front(index);
+  tiles_[index] = CachedTile{tile, lru_.begin()};
+  bytes_ += tile->MemoryUsage();
+  while (tiles_.size() > max_tiles_) {
+    EvictLeastRecentlyUsed();
+  }
+}
+
+
+void GetEntriesCache::EvictLeastRecentlyUsed() {
+  const auto it(tiles_.find(lru_.back()));
+  CHECK(it != tiles_.end());
+  bytes_ -= it->second.tile->MemoryUsage();
+  tiles_.erase(it);
+  lru_.pop_back();
+}
+
+
+size_t GetEntriesCache::Shrink(size_t bytes) {
+  lock_guard<mutex> lock(lock_);
+  const size_t before(bytes_);
+  while (!lru_.empty() && before - bytes_ < bytes) {
+    EvictLeastRecentlyUsed();
+  }
+  return before - bytes_;
+}
+
+
+}  // namespace cert_trans
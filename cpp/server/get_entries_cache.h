@@ -0,0 +1,99 @@
+#ifndef CERT_TRANS_SERVER_GET_ENTRIES_CACHE_H_
+#define CERT_TRANS_SERVER_GET_ENTRIES_CACHE_H_
+
+#include <stdint.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "base/macros.h"
+#include "util/json_writer.h"
+#include "util/memory_accounting.h"
+#include "util/status.h"
+#include "util/statusor.h"
+
+namespace cert_trans {
+
+class LoggedEntry;
+class ReadOnlyDatabase;
+
+
+// Keeps the get-entries JSON objects ({"leaf_input":...,
+// "extra_data":...}) of recently requested entries, so that repeated
+// requests for the same ranges (typically the tail of the log, which
+// all the monitors poll) are served without reading the database or
+// serializing anything.
+//
+// The entries are cached by aligned tiles of |tile_size| consecutive
+// entries, and at most |max_tiles| of them are kept (least recently
+// used first out, fewer if MemoryAccounting asks for some of them
+// back). Since entries never change once they are in the database,
+// the only time a tile needs to be updated is when it was incomplete
+// and the log has grown since; the new entries are then
+// rendered and appended to it.
+//
+// This class is thread-safe.
+class GetEntriesCache {
+ public:
+  // Does not take ownership of |db|, which must outlive this object.
+  GetEntriesCache(const ReadOnlyDatabase* db, int64_t tile_size,
+                  size_t max_tiles);
+  ~GetEntriesCache();
+
+  // Writes the JSON objects for the entries from |start| to |end|
+  // (inclusive) into |writer|, stopping short at the first entry that
+  // is not in the database, or once they add up to |max_bytes| or
+  // more (unless it is zero). Returns the number of entries written.
+  util::StatusOr<int64_t> WriteEntries(int64_t start, int64_t end,
+                                       size_t max_bytes, JsonWriter* writer);
+
+  // Writes the JSON object for |entry| into |writer|, optionally with
+  // its (serialized) SCT.
+  static util::Status WriteEntry(const LoggedEntry& entry, bool include_scts,
+                                 JsonWriter* writer);
+
+ private:
+  struct Tile;
+  struct CachedTile {
+    std::shared_ptr<const Tile> tile;
+    std::list<int64_t>::iterator lru_position;
+  };
+
+  // Returns tile number |index|, with all the entries currently
+  // available in the database.
+  util::StatusOr<std::shared_ptr<const Tile>> GetTile(int64_t index);
+  // Makes a copy of |tile| (which can be NULL), extended with the
+  // entries from the database that it is missing.
+  util::StatusOr<std::shared_ptr<const Tile>> ExtendTile(
+      int64_t index, const std::shared_ptr<const Tile>& tile) const;
+  // |lock_| must be held.
+  void Store(int64_t index, const std::shared_ptr<const Tile>& tile);
+  // |lock_| must be held.
+  void EvictLeastRecentlyUsed();
+  // Evicts the least recently used tiles until |bytes| have been
+  // freed, returns how many were.
+  size_t Shrink(size_t bytes);
+
+  const ReadOnlyDatabase* const db_;
+  const int64_t tile_size_;
+  const size_t max_tiles_;
+
+  std::mutex lock_;
+  // Tile indices, most recently used first.
+  std::list<int64_t> lru_;
+  std::unordered_map<int64_t, CachedTile> tiles_;
+  // How much memory the tiles in |tiles_| take.
+  size_t bytes_;
+
+  const std::unique_ptr<MemoryAccounting::Registration> memory_;
+
+  DISALLOW_COPY_AND_ASSIGN(GetEntriesCache);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_GET_ENTRIES_CACHE_H_
@@ -0,0 +1,150 @@
+#include "server/get_entries_cache.h"
+
+#include <event2/buffer.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "log/file_db.h"
+#include "log/logged_entry.h"
+#include "log/test_db.h"
+#include "proto/cert_serializer.h"
+#include "util/json_writer.h"
+#include "util/testing.h"
+#include "util/util.h"
+
+namespace cert_trans {
+namespace {
+
+using std::min;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+
+class GetEntriesCacheTest : public ::testing::Test {
+ protected:
+  void AddEntries(int count) {
+    for (int i = 0; i < count; ++i) {
+      LoggedEntry entry;
+      entry.RandomForTest();
+      entry.set_sequence_number(entries_.size());
+      ASSERT_EQ(Database::OK, test_db_.db()->CreateSequencedEntry(entry));
+      entries_.push_back(entry);
+    }
+  }
+
+  // What the cache should produce for entries |start| to |end|
+  // (inclusive), rendered directly from the entries.
+  string Expected(int64_t start, int64_t end) const {
+    const unique_ptr<evbuffer, void (*)(evbuffer*)> buffer(
+        CHECK_NOTNULL(evbuffer_new()), evbuffer_free);
+    JsonWriter writer(buffer.get());
+    writer.BeginArray();
+    const int64_t stop(min<int64_t>(end, entries_.size() - 1));
+    for (int64_t i = start; i <= stop; ++i) {
+      CHECK(GetEntriesCache::WriteEntry(entries_[i], false, &writer).ok());
+    }
+    writer.EndArray();
+    return Contents(buffer.get());
+  }
+
+  string Actual(GetEntriesCache* cache, int64_t start, int64_t end,
+                int64_t expected_count, size_t max_bytes = 0) const {
+    const unique_ptr<evbuffer, void (*)(evbuffer*)> buffer(
+        CHECK_NOTNULL(evbuffer_new()), evbuffer_free);
+    JsonWriter writer(buffer.get());
+    writer.BeginArray();
+    const util::StatusOr<int64_t> count(
+        cache->WriteEntries(start, end, max_bytes, &writer));
+    EXPECT_TRUE(count.ok()) << count.status();
+    EXPECT_EQ(expected_count, count.ValueOrDie());
+    writer.EndArray();
+    return Contents(buffer.get());
+  }
+
+  static string Contents(evbuffer* buffer) {
+    const size_t length(evbuffer_get_length(buffer));
+    return string(reinterpret_cast<const char*>(
+                      evbuffer_pullup(buffer, length)),
+                  length);
+  }
+
+  TestDB<FileDB> test_db_;
+  vector<LoggedEntry> entries_;
+};
+
+
+TEST_F(GetEntriesCacheTest, Empty) {
+  GetEntriesCache cache(test_db_.db(), 4, 2);
+  EXPECT_EQ("[]", Actual(&cache, 0, 9, 0));
+}
+
+
+TEST_F(GetEntriesCacheTest, WritesRanges) {
+  AddEntries(10);
+  GetEntriesCache cache(test_db_.db(), 4, 8);
+
+  EXPECT_EQ(Expected(0, 9), Actual(&cache, 0, 9, 10));
+  // Same again, from the cache this time.
+  EXPECT_EQ(Expected(0, 9), Actual(&cache, 0, 9, 10));
+  // Within a tile, across tiles, and on tile boundaries.
+  EXPECT_EQ(Expected(1, 2), Actual(&cache, 1, 2, 2));
+  EXPECT_EQ(Expected(3, 6), Actual(&cache, 3, 6, 4));
+  EXPECT_EQ(Expected(4, 7), Actual(&cache, 4, 7, 4));
+  EXPECT_EQ(Expected(8, 8), Actual(&cache, 8, 8, 1));
+  // Past the end of the log.
+  EXPECT_EQ(Expected(7, 20), Actual(&cache, 7, 20, 3));
+  EXPECT_EQ("[]", Actual(&cache, 10, 20, 0));
+}
+
+
+TEST_F(GetEntriesCacheTest, ExtendsIncompleteTiles) {
+  AddEntries(5);
+  GetEntriesCache cache(test_db_.db(), 4, 8);
+  EXPECT_EQ(Expected(0, 9), Actual(&cache, 0, 9, 5));
+
+  AddEntries(6);
+  EXPECT_EQ(Expected(0, 10), Actual(&cache, 0, 10, 11));
+  EXPECT_EQ(Expected(5, 10), Actual(&cache, 5, 10, 6));
+}
+
+
+TEST_F(GetEntriesCacheTest, EvictsTiles) {
+  AddEntries(12);
+  GetEntriesCache cache(test_db_.db(), 4, 1);
+
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(Expected(0, 3), Actual(&cache, 0, 3, 4));
+    EXPECT_EQ(Expected(8, 11), Actual(&cache, 8, 11, 4));
+    EXPECT_EQ(Expected(2, 9), Actual(&cache, 2, 9, 8));
+  }
+}
+
+
+TEST_F(GetEntriesCacheTest, StopsAtMaxBytes) {
+  AddEntries(10);
+  GetEntriesCache cache(test_db_.db(), 4, 8);
+
+  // At least one entry, however small the limit.
+  EXPECT_EQ(Expected(2, 2), Actual(&cache, 2, 9, 1, 1));
+
+  // Stops with the entry that reaches the limit, across tiles.
+  const size_t first_two(Expected(3, 4).size() - 3);
+  EXPECT_EQ(Expected(3, 4), Actual(&cache, 3, 9, 2, first_two));
+  EXPECT_EQ(Expected(3, 5), Actual(&cache, 3, 9, 3, first_two + 1));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  ConfigureSerializerForV1CT();
+  return RUN_ALL_TESTS();
+}
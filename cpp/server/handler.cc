@@ -2,8 +2,10 @@
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <zlib.h>
 #include <algorithm>
 #include <algorithm>
 #include <functional>
@@ -17,33 +19,50 @@
 #include "log/cluster_state_controller.h"
 #include "log/log_lookup.h"
 #include "log/logged_entry.h"
+#include "merkletree/serial_hasher.h"
+#include "monitoring/histogram.h"
 #include "monitoring/latency.h"
 #include "monitoring/monitoring.h"
+#include "monitoring/trace.h"
+#include "server/get_entries_cache.h"
 #include "server/json_output.h"
 #include "server/proxy.h"
 #include "util/json_wrapper.h"
+#include "util/json_writer.h"
+#include "util/logging.h"
 #include "util/thread_pool.h"
+#include "util/util.h"
 
 namespace libevent = cert_trans::libevent;
 
 using cert_trans::Counter;
+using cert_trans::GetEntriesCache;
+using cert_trans::Histogram;
 using cert_trans::HttpHandler;
+using cert_trans::kHttpTooManyRequests;
+using cert_trans::JsonWriter;
 using cert_trans::Latency;
 using cert_trans::LoggedEntry;
 using cert_trans::Proxy;
 using cert_trans::ScopedLatency;
+using cert_trans::ScopedTrace;
 using ct::ShortMerkleAuditProof;
 using ct::SignedCertificateTimestamp;
 using ct::SignedTreeHead;
+using std::atomic_load;
+using std::atomic_store;
 using std::bind;
 using std::chrono::milliseconds;
 using std::chrono::seconds;
+using std::function;
 using std::lock_guard;
+using std::make_pair;
 using std::make_shared;
 using std::multimap;
 using std::min;
 using std::mutex;
 using std::placeholders::_1;
+using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
 using std::vector;
@@ -51,6 +70,60 @@ using std::vector;
 DEFINE_int32(max_leaf_entries_per_response, 1000,
              "maximum number of entries to put in the response of a "
              "get-entries request");
+DEFINE_int32(max_entries_and_proofs_per_response, 64,
+             "maximum number of entries, with their audit paths, to put in "
+             "the response of a get-entries-and-proofs request");
+DEFINE_int32(max_get_entries_response_bytes, 4 << 20,
+             "stop adding entries to the response of a get-entries request "
+             "once it is at least this large, as entries vary a lot in size "
+             "(0 for no limit, there is always at least one entry)");
+DEFINE_int32(get_entries_cache_tiles, 16,
+             "number of tiles of rendered entries to keep in memory for "
+             "get-entries requests (0 to disable the cache)");
+DEFINE_int32(get_entries_cache_tile_size, 256,
+             "number of entries per tile in the get-entries cache");
+DEFINE_bool(get_entries_aligned_tiles, false,
+            "clip get-entries replies to tiles of "
+            "--get_entries_cache_tile_size entries, and let front caches "
+            "keep the full tiles below the tree size forever");
+DEFINE_int32(proof_cache_size, 1024,
+             "number of rendered audit proofs, and of consistency proofs, to "
+             "keep in memory, for the many clients requesting the same ones "
+             "after a new STH");
+DEFINE_int32(http_max_queued_high_priority, 1000,
+             "maximum number of high priority requests (get-sth, proofs) "
+             "waiting for a thread of the HTTP pool, beyond which they get a "
+             "503 (0 for no limit)");
+DEFINE_int32(http_max_queued_normal_priority, 500,
+             "maximum number of normal priority requests (get-entries) "
+             "waiting for a thread of the HTTP pool (0 for no limit)");
+DEFINE_int32(http_max_queued_low_priority, 200,
+             "maximum number of low priority requests (add-chain and the "
+             "like) waiting for a thread of the HTTP pool (0 for no limit)");
+DEFINE_double(http_read_rate_limit_qps, 0,
+              "maximum sustained rate of read requests (get-entries, "
+              "get-sth, proofs) per client, beyond which they get a 429 "
+              "(0 for no limit)");
+DEFINE_double(http_read_rate_limit_burst, 50,
+              "number of read requests a client can send at once, above "
+              "--http_read_rate_limit_qps");
+DEFINE_double(http_write_rate_limit_qps, 0,
+              "maximum sustained rate of submissions (add-chain and the "
+              "like) per client, beyond which they get a 429 (0 for no "
+              "limit)");
+DEFINE_double(http_write_rate_limit_burst, 20,
+              "number of submissions a client can send at once, above "
+              "--http_write_rate_limit_qps");
+DEFINE_int32(http_rate_limit_max_clients, 100000,
+             "number of clients to keep track of for the rate limits, the "
+             "least recently seen being forgotten");
+DEFINE_string(http_rate_limit_client_header, "",
+              "request header identifying the client for the rate limits, "
+              "such as X-Forwarded-For behind a load balancer, of which "
+              "only the last entry (the one the load balancer added) is "
+              "used (by default, or when it is missing, the address of the "
+              "peer)");
+DECLARE_int32(get_entries_chunk_size);
 
 namespace {
 
@@ -59,6 +132,77 @@ static Latency<milliseconds, string> http_server_request_latency_ms(
     "total_http_server_request_latency_ms", "path",
     "Total request latency in ms broken down by path");
 
+static Counter<string>* http_rate_limited_requests(
+    Counter<string>::New("http_rate_limited_requests", "path",
+                         "Number of requests refused for going over the rate "
+                         "limits of their client, by path."));
+
+static Histogram<>* get_entries_response_bytes(Histogram<>::New(
+    "get_entries_response_bytes",
+    "Size in bytes of the JSON body of get-entries responses."));
+
+
+// What identifies the client of |req| for the rate limits.
+//
+// Only the last entry of --http_rate_limit_client_header counts. Lists
+// such as X-Forwarded-For are appended to by every proxy on the way,
+// and the entries before the one added by the load balancer in front
+// of us (which we trust) come from the client itself. A client could
+// send different ones with every request, to get around its limit and
+// push the other clients out of the limiter.
+string ClientKey(evhttp_request* req) {
+  if (!FLAGS_http_rate_limit_client_header.empty()) {
+    const char* const value(
+        evhttp_find_header(evhttp_request_get_input_headers(req),
+                           FLAGS_http_rate_limit_client_header.c_str()));
+    if (value) {
+      const string list(value);
+      const size_t comma(list.rfind(','));
+      const string last(comma == string::npos ? list
+                                              : list.substr(comma + 1));
+      const size_t begin(last.find_first_not_of(" \t"));
+      if (begin != string::npos) {
+        return last.substr(begin, last.find_last_not_of(" \t") - begin + 1);
+      }
+    }
+  }
+
+  char* peer_addr;
+  ev_uint16_t peer_port;
+  evhttp_connection_get_peer(evhttp_request_get_connection(req), &peer_addr,
+                             &peer_port);
+  return peer_addr;
+}
+
+
+// Appends |record| to |body|, prefixed by its size (4 bytes,
+// big-endian), which is how the binary replies are framed.
+void AppendRecord(const string& record, string* body) {
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    body->push_back(static_cast<char>(record.size() >> shift));
+  }
+  body->append(record);
+}
+
+
+// Sends |body| as a successful binary reply.
+void SendBinaryString(libevent::Base* base, evhttp_request* req,
+                      const string& body) {
+  const unique_ptr<evbuffer, void (*)(evbuffer*)> buffer(
+      CHECK_NOTNULL(evbuffer_new()), evbuffer_free);
+  CHECK_EQ(evbuffer_add(buffer.get(), body.data(), body.size()), 0);
+  cert_trans::SendBinaryReply(base, req, HTTP_OK, buffer.get());
+}
+
+
+// For get-entries replies that can never change.
+void AddImmutableCacheHeaders(evhttp_request* req) {
+  CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(req),
+                             "Cache-Control",
+                             "public, max-age=31536000, immutable"),
+           0);
+}
+
 
 }  // namespace
 
@@ -73,17 +217,46 @@ HttpHandler::HttpHandler(LogLookup* log_lookup, const ReadOnlyDatabase* db,
       proxy_(nullptr),
       pool_(CHECK_NOTNULL(pool)),
       event_base_(CHECK_NOTNULL(event_base)),
-      staleness_tracker_(CHECK_NOTNULL(staleness_tracker)) {
+      staleness_tracker_(CHECK_NOTNULL(staleness_tracker)),
+      request_queue_(pool_, FLAGS_http_max_queued_high_priority,
+                     FLAGS_http_max_queued_normal_priority,
+                     FLAGS_http_max_queued_low_priority),
+      read_limiter_(FLAGS_http_read_rate_limit_qps,
+                    FLAGS_http_read_rate_limit_burst,
+                    FLAGS_http_rate_limit_max_clients),
+      write_limiter_(FLAGS_http_write_rate_limit_qps,
+                     FLAGS_http_write_rate_limit_burst,
+                     FLAGS_http_rate_limit_max_clients),
+      sth_notifier_(new STHNotifier(event_base_,
+                                    bind(&HttpHandler::SendSTH, this, _1))),
+      entries_streamer_(new EntriesStreamer(
+          db_, pool_, log_lookup_->GetSTHSnapshot()->tree_size())),
+      new_sth_cb_(bind(&HttpHandler::NewSTH, this, _1)),
+      audit_proofs_(FLAGS_proof_cache_size),
+      consistency_proofs_(FLAGS_proof_cache_size) {
+  CHECK(!FLAGS_get_entries_aligned_tiles ||
+        FLAGS_get_entries_cache_tile_size > 0)
+      << "--get_entries_aligned_tiles needs a tile size";
+  if (FLAGS_get_entries_cache_tiles > 0) {
+    entries_cache_.reset(
+        new GetEntriesCache(db_, FLAGS_get_entries_cache_tile_size,
+                            FLAGS_get_entries_cache_tiles));
+  }
+  log_lookup_->AddNewSTHCallback(&new_sth_cb_);
 }
 
 
 HttpHandler::~HttpHandler() {
+  log_lookup_->RemoveNewSTHCallback(&new_sth_cb_);
 }
 
 
 void StatsHandlerInterceptor(const string& path,
                              const libevent::HttpServer::HandlerCallback& cb,
                              evhttp_request* req) {
+  // The trace lasts until the last of the work done for the request on
+  // other threads (see RequestQueue) finishes.
+  ScopedTrace trace(path);
   ScopedLatency total_http_server_request_latency(
       http_server_request_latency_ms.GetScopedLatency(path));
 
@@ -96,7 +269,7 @@ void HttpHandler::AddEntryReply(evhttp_request* req,
                                 const SignedCertificateTimestamp& sct) const {
   if (!add_status.ok() &&
       add_status.CanonicalCode() != util::error::ALREADY_EXISTS) {
-    VLOG(1) << "error adding chain: " << add_status;
+    VLOG_EVERY_N_SEC(1, 1) << "error adding chain: " << add_status;
     const int response_code(add_status.CanonicalCode() ==
                                     util::error::RESOURCE_EXHAUSTED
                                 ? HTTP_SERVUNAVAIL
@@ -116,16 +289,21 @@ void HttpHandler::AddEntryReply(evhttp_request* req,
 }
 
 void HttpHandler::ProxyInterceptor(
+    const string& path,
     const libevent::HttpServer::HandlerCallback& local_handler,
-    evhttp_request* request) {
+    const ServableWhenStale& servable_when_stale, evhttp_request* request) {
   VLOG(2) << "Running proxy interceptor...";
-  // TODO(alcutter): We can be a bit smarter about when to proxy off
-  // the request - being stale wrt to the current serving STH doesn't
-  // automatically mean we're unable to answer this request.
-  if (staleness_tracker_->IsNodeStale()) {
+  if (!CheckRateLimit(path, request)) {
+    return;
+  }
+
+  // Being stale wrt to the current serving STH doesn't mean we're
+  // unable to answer this request, if it is about data we have.
+  if (staleness_tracker_->IsNodeStale() &&
+      !(servable_when_stale && servable_when_stale(request))) {
     // Can't do this on the libevent thread since it can block on the lock in
     // ClusterStatusController::GetFreshNodes().
-    pool_->Add(bind(&Proxy::ProxyRequest, proxy_, request));
+    RunOnPool(request, path, bind(&Proxy::ProxyRequest, proxy_, request));
   } else {
     local_handler(request);
   }
@@ -134,40 +312,162 @@ void HttpHandler::ProxyInterceptor(
 
 void HttpHandler::AddProxyWrappedHandler(
     libevent::HttpServer* server, const string& path,
-    const libevent::HttpServer::HandlerCallback& local_handler) {
+    const libevent::HttpServer::HandlerCallback& local_handler,
+    RequestQueue::Priority priority,
+    const ServableWhenStale& servable_when_stale) {
+  priorities_[path] = priority;
+  // The other nodes of the cluster are not limited.
+  rate_limiters_[path] =
+      path.find("/internal/") != string::npos
+          ? nullptr
+          : priority == RequestQueue::Priority::LOW ? &write_limiter_
+                                                    : &read_limiter_;
   const libevent::HttpServer::HandlerCallback stats_handler(
-      bind(&StatsHandlerInterceptor, path, local_handler, _1));
-  CHECK(server->AddHandler(path, bind(&HttpHandler::ProxyInterceptor, this,
-                                      stats_handler, _1)));
+      bind(&StatsHandlerInterceptor, path_prefix_ + path, local_handler, _1));
+  CHECK(server->AddHandler(path_prefix_ + path,
+                           bind(&HttpHandler::ProxyInterceptor, this, path,
+                                stats_handler, servable_when_stale, _1)));
+}
+
+
+bool HttpHandler::CheckRateLimit(const string& path, evhttp_request* request) {
+  const auto it(rate_limiters_.find(path));
+  if (it == rate_limiters_.end() || !it->second ||
+      it->second->Allow(ClientKey(request))) {
+    return true;
+  }
+
+  http_rate_limited_requests->Increment(path_prefix_ + path);
+  SendJsonError(event_base_, request, kHttpTooManyRequests,
+                "Too many requests from this client, try again later.");
+  return false;
+}
+
+
+bool HttpHandler::EntriesServableWhenStale(evhttp_request* req) const {
+  const libevent::QueryParams query(libevent::ParseQuery(req));
+  const int64_t start(libevent::GetIntParam(query, "start"));
+  const int64_t end(libevent::GetIntParam(query, "end"));
+  if (start < 0 || end < start) {
+    return true;
+  }
+
+  // As clipped by GetEntries(). With aligned tiles, the reply might
+  // end sooner still, which this errs on the side of proxying.
+  return min(end, start + FLAGS_max_leaf_entries_per_response) <
+         log_lookup_->GetSTHSnapshot()->tree_size();
+}
+
+
+bool HttpHandler::ProofServableWhenStale(evhttp_request* req) const {
+  // Whether the hash is found or not, the reply is the same as from a
+  // fresh node, as long as we have the whole tree it is about.
+  return libevent::GetIntParam(libevent::ParseQuery(req), "tree_size") <=
+         log_lookup_->GetSTHSnapshot()->tree_size();
+}
+
+
+bool HttpHandler::ConsistencyServableWhenStale(evhttp_request* req) const {
+  return libevent::GetIntParam(libevent::ParseQuery(req), "second") <=
+         log_lookup_->GetSTHSnapshot()->tree_size();
+}
+
+
+void HttpHandler::RunOnPool(evhttp_request* req, const string& path,
+                            const function<void()>& closure) {
+  const auto it(priorities_.find(path));
+  if (!request_queue_.Add(it != priorities_.end()
+                              ? it->second
+                              : RequestQueue::Priority::NORMAL,
+                          path, closure)) {
+    // The reply tells the client when to retry.
+    SendJsonError(event_base_, req, HTTP_SERVUNAVAIL,
+                  "Too many requests waiting, try again later.");
+  }
 }
 
 
 void HttpHandler::Add(libevent::HttpServer* server) {
   CHECK_NOTNULL(server);
-  // TODO(pphaneuf): An optional prefix might be nice?
   // TODO(pphaneuf): Find out which methods are CPU intensive enough
   // that they should be spun off to the thread pool.
   AddProxyWrappedHandler(server, "/ct/v1/get-entries",
-                         bind(&HttpHandler::GetEntries, this, _1));
+                         bind(&HttpHandler::GetEntries, this, _1),
+                         RequestQueue::Priority::NORMAL,
+                         bind(&HttpHandler::EntriesServableWhenStale, this,
+                              _1));
   AddProxyWrappedHandler(server, "/ct/v1/get-proof-by-hash",
-                         bind(&HttpHandler::GetProof, this, _1));
+                         bind(&HttpHandler::GetProof, this, _1),
+                         RequestQueue::Priority::HIGH,
+                         bind(&HttpHandler::ProofServableWhenStale, this,
+                              _1));
+  AddProxyWrappedHandler(server, "/ct/v1/get-entry-and-proof",
+                         bind(&HttpHandler::GetEntryAndProof, this, _1),
+                         RequestQueue::Priority::NORMAL,
+                         bind(&HttpHandler::ProofServableWhenStale, this,
+                              _1));
+  AddProxyWrappedHandler(server, "/ct/v1/get-entries-and-proofs",
+                         bind(&HttpHandler::GetEntriesAndProofs, this, _1),
+                         RequestQueue::Priority::NORMAL,
+                         bind(&HttpHandler::ProofServableWhenStale, this,
+                              _1));
   AddProxyWrappedHandler(server, "/ct/v1/get-sth",
-                         bind(&HttpHandler::GetSTH, this, _1));
+                         bind(&HttpHandler::GetSTH, this, _1),
+                         RequestQueue::Priority::HIGH);
+  // A stale node sends the newer entries and STHs once it has them.
+  AddProxyWrappedHandler(server, "/ct/v1/get-entries-stream",
+                         bind(&HttpHandler::GetEntriesStream, this, _1),
+                         RequestQueue::Priority::NORMAL,
+                         [](evhttp_request*) { return true; });
+  AddProxyWrappedHandler(server, "/ct/v1/get-sth-events",
+                         bind(&HttpHandler::GetSTHEvents, this, _1),
+                         RequestQueue::Priority::HIGH,
+                         [](evhttp_request*) { return true; });
   AddProxyWrappedHandler(server, "/ct/v1/get-sth-consistency",
-                         bind(&HttpHandler::GetConsistency, this, _1));
+                         bind(&HttpHandler::GetConsistency, this, _1),
+                         RequestQueue::Priority::HIGH,
+                         bind(&HttpHandler::ConsistencyServableWhenStale,
+                              this, _1));
+  AddProxyWrappedHandler(server, "/ct/v1/internal/get-proof-by-hash",
+                         bind(&HttpHandler::GetProofBinary, this, _1),
+                         RequestQueue::Priority::HIGH,
+                         bind(&HttpHandler::ProofServableWhenStale, this,
+                              _1));
+  AddProxyWrappedHandler(server, "/ct/v1/internal/get-sth",
+                         bind(&HttpHandler::GetSTHBinary, this, _1),
+                         RequestQueue::Priority::HIGH);
+  AddProxyWrappedHandler(server, "/ct/v1/internal/get-sth-consistency",
+                         bind(&HttpHandler::GetConsistencyBinary, this, _1),
+                         RequestQueue::Priority::HIGH,
+                         bind(&HttpHandler::ConsistencyServableWhenStale,
+                              this, _1));
+  // Only used by the other nodes of the cluster, for the entries they
+  // know we have, so never proxied.
+  AddProxyWrappedHandler(server, "/ct/v1/internal/get-logged-entries",
+                         bind(&HttpHandler::GetLoggedEntries, this, _1),
+                         RequestQueue::Priority::NORMAL,
+                         [](evhttp_request*) { return true; });
 
   // Now add any sub-class handlers.
   AddHandlers(server);
 }
 
 
+void HttpHandler::SetPathPrefix(const string& prefix) {
+  CHECK(priorities_.empty()) << "Handlers already added.";
+  CHECK(prefix.empty() || (prefix[0] == '/' && prefix.back() != '/'))
+      << "Invalid path prefix: " << prefix;
+  path_prefix_ = prefix;
+}
+
+
 void HttpHandler::SetProxy(Proxy* proxy) {
   LOG_IF(FATAL, proxy_) << "Attempting to re-add a Proxy.";
   proxy_ = CHECK_NOTNULL(proxy);
 }
 
 
-void HttpHandler::GetEntries(evhttp_request* req) const {
+void HttpHandler::GetEntries(evhttp_request* req) {
   if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
     return SendJsonError(event_base_, req, HTTP_BADMETHOD,
                          "Method not allowed.");
@@ -195,11 +495,64 @@ void HttpHandler::GetEntries(evhttp_request* req) const {
   // "following" nodes with more data.
   const bool include_scts(libevent::GetBoolParam(query, "include_scts"));
 
-  BlockingGetEntries(req, start, end, include_scts);
+  bool immutable(false);
+  if (FLAGS_get_entries_aligned_tiles) {
+    // Clients have to cope with getting fewer entries than they asked
+    // for, so a reply never goes past the end of the tile where it
+    // starts. The replies for a whole tile are then always the same,
+    // and, once the tree has grown past it, can be cached for good.
+    const int64_t tile_size(FLAGS_get_entries_cache_tile_size);
+    const int64_t tile_end((start / tile_size + 1) * tile_size - 1);
+    end = min(end, tile_end);
+    immutable = !include_scts && start % tile_size == 0 && end == tile_end &&
+                end < log_lookup_->GetSTHSnapshot()->tree_size();
+  }
+
+  if (entries_cache_ && !include_scts) {
+    return RunOnPool(req, "/ct/v1/get-entries",
+                     bind(&HttpHandler::BlockingGetEntries, this, req, start,
+                          end, immutable));
+  }
+
+  const shared_ptr<EntriesReply> reply(
+      make_shared<EntriesReply>(req, start, end, include_scts, immutable));
+  RunOnPool(req, "/ct/v1/get-entries",
+            bind(&HttpHandler::ReadEntriesChunk, this, reply));
 }
 
 
-void HttpHandler::GetProof(evhttp_request* req) const {
+void HttpHandler::GetEntriesStream(evhttp_request* req) {
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    return SendJsonError(event_base_, req, HTTP_BADMETHOD,
+                         "Method not allowed.");
+  }
+
+  // A follower reconnecting resumes where it got to.
+  const char* const last_event_id(evhttp_find_header(
+      evhttp_request_get_input_headers(req), "Last-Event-ID"));
+  int64_t start(-1);
+  if (last_event_id) {
+    char* end;
+    start = strtoll(last_event_id, &end, 10);
+    if (end == last_event_id || *end != '\0') {
+      start = -1;
+    }
+  } else {
+    start = libevent::GetIntParam(libevent::ParseQuery(req), "start");
+  }
+  if (start < 0 || start > log_lookup_->GetSTHSnapshot()->tree_size()) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Missing or invalid \"start\" parameter.");
+  }
+
+  if (!entries_streamer_->Follow(req, start)) {
+    SendJsonError(event_base_, req, HTTP_SERVUNAVAIL,
+                  "Too many clients following the entries.");
+  }
+}
+
+
+void HttpHandler::GetLoggedEntries(evhttp_request* req) {
   if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
     return SendJsonError(event_base_, req, HTTP_BADMETHOD,
                          "Method not allowed.");
@@ -207,146 +560,614 @@ void HttpHandler::GetProof(evhttp_request* req) const {
 
   const libevent::QueryParams query(libevent::ParseQuery(req));
 
-  string b64_hash;
-  if (!libevent::GetParam(query, "hash", &b64_hash)) {
+  const int64_t start(libevent::GetIntParam(query, "start"));
+  if (start < 0) {
     return SendJsonError(event_base_, req, HTTP_BADREQUEST,
-                         "Missing or invalid \"hash\" parameter.");
+                         "Missing or invalid \"start\" parameter.");
   }
 
-  const string hash(util::FromBase64(b64_hash.c_str()));
-  if (hash.empty()) {
+  int64_t end(libevent::GetIntParam(query, "end"));
+  if (end < start) {
     return SendJsonError(event_base_, req, HTTP_BADREQUEST,
-                         "Invalid \"hash\" parameter.");
+                         "Missing or invalid \"end\" parameter.");
   }
 
-  const int64_t tree_size(libevent::GetIntParam(query, "tree_size"));
-  if (tree_size < 0 ||
-      static_cast<int64_t>(tree_size) > log_lookup_->GetSTH().tree_size()) {
-    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
-                         "Missing or invalid \"tree_size\" parameter.");
+  end = std::min(end, start + FLAGS_max_leaf_entries_per_response);
+  const bool compress(libevent::GetBoolParam(query, "compress"));
+
+  RunOnPool(req, "/ct/v1/internal/get-logged-entries",
+            bind(&HttpHandler::BlockingGetLoggedEntries, this, req, start,
+                 end, compress));
+}
+
+
+bool HttpHandler::ParseProofQuery(evhttp_request* req, string* hash,
+                                  int64_t* tree_size) const {
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    SendJsonError(event_base_, req, HTTP_BADMETHOD, "Method not allowed.");
+    return false;
   }
 
-  ShortMerkleAuditProof proof;
-  if (log_lookup_->AuditProof(hash, tree_size, &proof) != LogLookup::OK) {
+  const libevent::QueryParams query(libevent::ParseQuery(req));
+
+  string b64_hash;
+  if (!libevent::GetParam(query, "hash", &b64_hash)) {
+    SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                  "Missing or invalid \"hash\" parameter.");
+    return false;
+  }
+
+  *hash = util::FromBase64(b64_hash.c_str());
+  if (hash->empty()) {
+    SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                  "Invalid \"hash\" parameter.");
+    return false;
+  }
+
+  *tree_size = libevent::GetIntParam(query, "tree_size");
+  if (*tree_size < 0 ||
+      *tree_size > log_lookup_->GetSTHSnapshot()->tree_size()) {
+    SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                  "Missing or invalid \"tree_size\" parameter.");
+    return false;
+  }
+
+  return true;
+}
+
+
+void HttpHandler::GetProof(evhttp_request* req) const {
+  string hash;
+  int64_t tree_size;
+  if (!ParseProofQuery(req, &hash, &tree_size)) {
+    return;
+  }
+
+  // The tree is complete up to |tree_size|, so the answer for it
+  // (including "not found") does not change anymore.
+  const shared_ptr<const CachedReply> reply(audit_proofs_.Get(
+      make_pair(hash, tree_size),
+      [this, &hash, tree_size]() -> shared_ptr<const CachedReply> {
+        ShortMerkleAuditProof proof;
+        if (log_lookup_->AuditProof(hash, tree_size, &proof) !=
+            LogLookup::OK) {
+          return nullptr;
+        }
+
+        JsonArray json_audit;
+        for (int i = 0; i < proof.path_node_size(); ++i) {
+          json_audit.AddBase64(proof.path_node(i));
+        }
+
+        JsonObject json_reply;
+        json_reply.Add("leaf_index", proof.leaf_index());
+        json_reply.Add("audit_path", json_audit);
+        return MakeCachedReply(tree_size, json_reply);
+      }));
+  if (!reply) {
     return SendJsonError(event_base_, req, HTTP_BADREQUEST,
                          "Couldn't find hash.");
   }
 
-  JsonArray json_audit;
-  for (int i = 0; i < proof.path_node_size(); ++i) {
-    json_audit.AddBase64(proof.path_node(i));
+  SendCachedJsonReply(event_base_, req, reply->json, reply->gzip_json,
+                      reply->etag);
+}
+
+
+void HttpHandler::GetEntryAndProof(evhttp_request* req) {
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    return SendJsonError(event_base_, req, HTTP_BADMETHOD,
+                         "Method not allowed.");
   }
 
-  JsonObject json_reply;
-  json_reply.Add("leaf_index", proof.leaf_index());
-  json_reply.Add("audit_path", json_audit);
+  const libevent::QueryParams query(libevent::ParseQuery(req));
+  const int64_t leaf_index(libevent::GetIntParam(query, "leaf_index"));
+  const int64_t tree_size(libevent::GetIntParam(query, "tree_size"));
+  if (leaf_index < 0 || tree_size <= leaf_index ||
+      tree_size > log_lookup_->GetSTHSnapshot()->tree_size()) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Missing or invalid \"leaf_index\" or "
+                         "\"tree_size\" parameter.");
+  }
 
-  SendJsonReply(event_base_, req, HTTP_OK, json_reply);
+  RunOnPool(req, "/ct/v1/get-entry-and-proof",
+            bind(&HttpHandler::BlockingGetEntriesAndProofs, this, req,
+                 leaf_index, leaf_index, tree_size, false));
 }
 
 
-void HttpHandler::GetSTH(evhttp_request* req) const {
+void HttpHandler::GetEntriesAndProofs(evhttp_request* req) {
   if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
     return SendJsonError(event_base_, req, HTTP_BADMETHOD,
                          "Method not allowed.");
   }
 
-  const SignedTreeHead& sth(log_lookup_->GetSTH());
+  const libevent::QueryParams query(libevent::ParseQuery(req));
+  const int64_t start(libevent::GetIntParam(query, "start"));
+  int64_t end(libevent::GetIntParam(query, "end"));
+  const int64_t tree_size(libevent::GetIntParam(query, "tree_size"));
+  if (start < 0 || end < start || tree_size <= start ||
+      tree_size > log_lookup_->GetSTHSnapshot()->tree_size()) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Missing or invalid \"start\", \"end\" or "
+                         "\"tree_size\" parameter.");
+  }
 
-  VLOG(2) << "SignedTreeHead:\n" << sth.DebugString();
+  // Clip the range to the tree, and to what fits in a response.
+  end = min(end, tree_size - 1);
+  CHECK_GT(FLAGS_max_entries_and_proofs_per_response, 0);
+  end = min(end, start + FLAGS_max_entries_and_proofs_per_response - 1);
 
-  JsonObject json_reply;
-  json_reply.Add("tree_size", sth.tree_size());
-  json_reply.Add("timestamp", sth.timestamp());
-  json_reply.AddBase64("sha256_root_hash", sth.sha256_root_hash());
-  json_reply.Add("tree_head_signature", sth.signature());
+  RunOnPool(req, "/ct/v1/get-entries-and-proofs",
+            bind(&HttpHandler::BlockingGetEntriesAndProofs, this, req, start,
+                 end, tree_size, true));
+}
 
-  VLOG(2) << "GetSTH:\n" << json_reply.DebugString();
 
-  SendJsonReply(event_base_, req, HTTP_OK, json_reply);
+void HttpHandler::GetSTH(evhttp_request* req) const {
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    return SendJsonError(event_base_, req, HTTP_BADMETHOD,
+                         "Method not allowed.");
+  }
+
+  const libevent::QueryParams query(libevent::ParseQuery(req));
+  string newer_than_param;
+  if (libevent::GetParam(query, "newer_than", &newer_than_param)) {
+    // Timestamps do not fit in GetIntParam().
+    char* end;
+    errno = 0;
+    const int64_t newer_than(strtoll(newer_than_param.c_str(), &end, 10));
+    if (newer_than_param.empty() || *end != '\0' || errno != 0 ||
+        newer_than < 0) {
+      return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                           "Invalid \"newer_than\" parameter.");
+    }
+    if (log_lookup_->GetSTHSnapshot()->timestamp() <= newer_than) {
+      if (!sth_notifier_->Wait(req, newer_than)) {
+        SendJsonError(event_base_, req, HTTP_SERVUNAVAIL,
+                      "Too many requests waiting for a new STH.");
+      }
+      return;
+    }
+  }
+
+  SendSTH(req);
 }
 
 
-void HttpHandler::GetConsistency(evhttp_request* req) const {
+void HttpHandler::GetSTHEvents(evhttp_request* req) {
   if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
     return SendJsonError(event_base_, req, HTTP_BADMETHOD,
                          "Method not allowed.");
   }
 
+  const shared_ptr<const SignedTreeHead> sth(log_lookup_->GetSTHSnapshot());
+  if (!sth_notifier_->Subscribe(req, sth->timestamp(), STHReply(sth)->json)) {
+    SendJsonError(event_base_, req, HTTP_SERVUNAVAIL,
+                  "Too many requests waiting for a new STH.");
+  }
+}
+
+
+void HttpHandler::SendSTH(evhttp_request* req) const {
+  const shared_ptr<const CachedReply> reply(
+      STHReply(log_lookup_->GetSTHSnapshot()));
+  SendCachedJsonReply(event_base_, req, reply->json, reply->gzip_json,
+                      reply->etag);
+}
+
+
+void HttpHandler::NewSTH(const shared_ptr<const SignedTreeHead>& sth) const {
+  entries_streamer_->SetTreeSize(sth->tree_size());
+  sth_notifier_->Publish(sth->timestamp(), STHReply(sth)->json);
+}
+
+
+shared_ptr<const HttpHandler::CachedReply> HttpHandler::STHReply(
+    const shared_ptr<const SignedTreeHead>& sth) const {
+  shared_ptr<const CachedReply> reply(atomic_load(&sth_reply_));
+  if (!reply || reply->version != sth->timestamp()) {
+    VLOG(2) << "SignedTreeHead:\n" << sth->DebugString();
+
+    JsonObject json_reply;
+    json_reply.Add("tree_size", sth->tree_size());
+    json_reply.Add("timestamp", sth->timestamp());
+    json_reply.AddBase64("sha256_root_hash", sth->sha256_root_hash());
+    json_reply.Add("tree_head_signature", sth->signature());
+
+    VLOG(2) << "GetSTH:\n" << json_reply.DebugString();
+
+    // Racing requests might both render it, which is harmless.
+    reply = MakeCachedReply(sth->timestamp(), json_reply);
+    atomic_store(&sth_reply_, reply);
+  }
+  return reply;
+}
+
+
+// static
+shared_ptr<const HttpHandler::CachedReply> HttpHandler::MakeCachedReply(
+    int64_t version, const JsonObject& json) {
+  const shared_ptr<CachedReply> reply(make_shared<CachedReply>());
+  reply->version = version;
+  reply->json = make_shared<const string>(json.ToString());
+  reply->gzip_json = GzipCachedJson(*reply->json);
+  // Strong validator: the hash of the body itself.
+  reply->etag =
+      "\"" +
+      util::HexString(Sha256Hasher::Sha256Digest(*reply->json)).substr(0, 32) +
+      "\"";
+  return reply;
+}
+
+
+bool HttpHandler::ParseConsistencyQuery(evhttp_request* req, int64_t* first,
+                                        int64_t* second) const {
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    SendJsonError(event_base_, req, HTTP_BADMETHOD, "Method not allowed.");
+    return false;
+  }
+
   const libevent::QueryParams query(libevent::ParseQuery(req));
 
-  const int64_t first(libevent::GetIntParam(query, "first"));
-  if (first < 0) {
-    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
-                         "Missing or invalid \"first\" parameter.");
+  *first = libevent::GetIntParam(query, "first");
+  if (*first < 0) {
+    SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                  "Missing or invalid \"first\" parameter.");
+    return false;
+  }
+
+  *second = libevent::GetIntParam(query, "second");
+  if (*second < *first) {
+    SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                  "Missing or invalid \"second\" parameter.");
+    return false;
+  }
+
+  return true;
+}
+
+
+void HttpHandler::GetConsistency(evhttp_request* req) const {
+  int64_t first;
+  int64_t second;
+  if (!ParseConsistencyQuery(req, &first, &second)) {
+    return;
   }
 
-  const int64_t second(libevent::GetIntParam(query, "second"));
-  if (second < first) {
+  const function<shared_ptr<const CachedReply>()> compute(
+      [this, first, second]() {
+        const vector<string> consistency(
+            log_lookup_->ConsistencyProof(first, second));
+        JsonArray json_cons;
+        for (vector<string>::const_iterator it = consistency.begin();
+             it != consistency.end(); ++it) {
+          json_cons.AddBase64(*it);
+        }
+
+        JsonObject json_reply;
+        json_reply.Add("consistency", json_cons);
+        return MakeCachedReply(second, json_reply);
+      });
+  // A proof to a tree size we do not have yet would change later.
+  const shared_ptr<const CachedReply> reply(
+      second <= log_lookup_->GetSTHSnapshot()->tree_size()
+          ? consistency_proofs_.Get(make_pair(first, second), compute)
+          : compute());
+
+  SendCachedJsonReply(event_base_, req, reply->json, reply->gzip_json,
+                      reply->etag);
+}
+
+
+void HttpHandler::GetProofBinary(evhttp_request* req) const {
+  string hash;
+  int64_t tree_size;
+  if (!ParseProofQuery(req, &hash, &tree_size)) {
+    return;
+  }
+
+  ShortMerkleAuditProof proof;
+  if (log_lookup_->AuditProof(hash, tree_size, &proof) != LogLookup::OK) {
     return SendJsonError(event_base_, req, HTTP_BADREQUEST,
-                         "Missing or invalid \"second\" parameter.");
+                         "Couldn't find hash.");
   }
 
-  const vector<string> consistency(
-      log_lookup_->ConsistencyProof(first, second));
-  JsonArray json_cons;
-  for (vector<string>::const_iterator it = consistency.begin();
-       it != consistency.end(); ++it) {
-    json_cons.AddBase64(*it);
+  // A single record, the serialized ShortMerkleAuditProof.
+  string body;
+  AppendRecord(proof.SerializeAsString(), &body);
+  SendBinaryString(event_base_, req, body);
+}
+
+
+void HttpHandler::GetSTHBinary(evhttp_request* req) const {
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    return SendJsonError(event_base_, req, HTTP_BADMETHOD,
+                         "Method not allowed.");
   }
 
-  JsonObject json_reply;
-  json_reply.Add("consistency", json_cons);
+  // A single record, the serialized SignedTreeHead.
+  string body;
+  AppendRecord(log_lookup_->GetSTHSnapshot()->SerializeAsString(), &body);
+  SendBinaryString(event_base_, req, body);
+}
 
-  SendJsonReply(event_base_, req, HTTP_OK, json_reply);
+
+void HttpHandler::GetConsistencyBinary(evhttp_request* req) const {
+  int64_t first;
+  int64_t second;
+  if (!ParseConsistencyQuery(req, &first, &second)) {
+    return;
+  }
+
+  // A record for every node of the proof.
+  string body;
+  for (const auto& node : log_lookup_->ConsistencyProof(first, second)) {
+    AppendRecord(node, &body);
+  }
+  SendBinaryString(event_base_, req, body);
 }
 
 
 void HttpHandler::BlockingGetEntries(evhttp_request* req, int64_t start,
-                                     int64_t end, bool include_scts) const {
-  JsonArray json_entries;
-  auto it(db_->ScanEntries(start));
-  for (int64_t i = start; i <= end; ++i) {
-    LoggedEntry entry;
+                                     int64_t end, bool immutable) const {
+  // The reply is rendered into its own buffer, so that we can still
+  // send an error instead if something goes wrong halfway.
+  const unique_ptr<evbuffer, void (*)(evbuffer*)> buffer(
+      CHECK_NOTNULL(evbuffer_new()), evbuffer_free);
+  JsonWriter writer(buffer.get());
+  writer.BeginObject();
+  writer.Key("entries");
+  writer.BeginArray();
+
+  const util::StatusOr<int64_t> written(entries_cache_->WriteEntries(
+      start, end, FLAGS_max_get_entries_response_bytes, &writer));
+  if (!written.ok()) {
+    return SendJsonError(event_base_, req, HTTP_INTERNAL,
+                         written.status().error_message());
+  }
+
+  if (written.ValueOrDie() < 1) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Entry not found.");
+  }
+
+  writer.EndArray();
+  writer.EndObject();
+
+  if (immutable && written.ValueOrDie() == end - start + 1) {
+    AddImmutableCacheHeaders(req);
+  }
+  get_entries_response_bytes->Record(evbuffer_get_length(buffer.get()));
+  SendJsonReply(event_base_, req, HTTP_OK, buffer.get());
+}
 
-    if (!it->GetNextEntry(&entry) || entry.sequence_number() != i) {
-      break;
-    }
 
-    string leaf_input;
-    string extra_data;
-    string sct_data;
-    if (!entry.SerializeForLeaf(&leaf_input) ||
-        !entry.SerializeExtraData(&extra_data) ||
-        (include_scts &&
-         Serializer::SerializeSCT(entry.sct(), &sct_data) !=
-             cert_trans::serialization::SerializeResult::OK)) {
-      LOG(WARNING) << "Failed to serialize entry @ " << i << ":\n"
-                   << entry.DebugString();
+void HttpHandler::BlockingGetEntriesAndProofs(evhttp_request* req,
+                                              int64_t start, int64_t end,
+                                              int64_t tree_size,
+                                              bool batch) const {
+  vector<LoggedEntry> entries;
+  db_->ReadRange(start, end - start + 1, &entries);
+  if (entries.empty()) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Entry not found.");
+  }
+  vector<ShortMerkleAuditProof> proofs;
+  log_lookup_->AuditProofs(start, start + entries.size(), tree_size,
+                           &proofs);
+
+  const unique_ptr<evbuffer, void (*)(evbuffer*)> buffer(
+      CHECK_NOTNULL(evbuffer_new()), evbuffer_free);
+  JsonWriter writer(buffer.get());
+  if (batch) {
+    writer.BeginObject();
+    writer.Key("entries");
+    writer.BeginArray();
+  }
+  string leaf_input;
+  string extra_data;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (!entries[i].SerializeForLeaf(&leaf_input) ||
+        !entries[i].SerializeExtraData(&extra_data)) {
+      LOG_EVERY_N_SEC(WARNING, 1) << "Failed to serialize entry @ "
+                                  << start + i;
       return SendJsonError(event_base_, req, HTTP_INTERNAL,
                            "Serialization failed.");
     }
 
-    JsonObject json_entry;
-    json_entry.AddBase64("leaf_input", leaf_input);
-    json_entry.AddBase64("extra_data", extra_data);
-
-    if (include_scts) {
-      // This is non-standard for this implementation, and is currently only
-      // used by other nodes when "following" to fetch data from each other:
-      json_entry.AddBase64("sct", sct_data);
+    writer.BeginObject();
+    if (batch) {
+      writer.Key("leaf_index");
+      writer.Int(start + i);
     }
-
-    json_entries.Add(&json_entry);
+    writer.Key("leaf_input");
+    writer.Base64(leaf_input);
+    writer.Key("extra_data");
+    writer.Base64(extra_data);
+    writer.Key("audit_path");
+    writer.BeginArray();
+    for (const auto& node : proofs[i].path_node()) {
+      writer.Base64(node);
+    }
+    writer.EndArray();
+    writer.EndObject();
+  }
+  if (batch) {
+    writer.EndArray();
+    writer.EndObject();
   }
 
-  if (json_entries.Length() < 1) {
+  SendJsonReply(event_base_, req, HTTP_OK, buffer.get());
+}
+
+
+void HttpHandler::BlockingGetLoggedEntries(evhttp_request* req,
+                                           int64_t start, int64_t end,
+                                           bool compress) const {
+  vector<string> entries;
+  db_->ReadRawRange(start, end - start + 1, &entries);
+  if (entries.empty()) {
     return SendJsonError(event_base_, req, HTTP_BADREQUEST,
                          "Entry not found.");
   }
 
-  JsonObject json_reply;
-  json_reply.Add("entries", json_entries);
+  // Every entry, as stored, prefixed by its size (4 bytes, big-endian).
+  string body;
+  size_t size(0);
+  for (const auto& entry : entries) {
+    size += 4 + entry.size();
+  }
+  body.reserve(size);
+  for (const auto& entry : entries) {
+    AppendRecord(entry, &body);
+  }
 
-  SendJsonReply(event_base_, req, HTTP_OK, json_reply);
+  if (compress) {
+    // Prefixed by the uncompressed size (4 bytes, big-endian).
+    uLongf compressed_size(compressBound(body.size()));
+    string compressed(4 + compressed_size, '\0');
+    for (int i = 0; i < 4; ++i) {
+      compressed[i] = static_cast<char>(body.size() >> (24 - 8 * i));
+    }
+    CHECK_EQ(Z_OK,
+             compress2(reinterpret_cast<Bytef*>(&compressed[4]),
+                       &compressed_size,
+                       reinterpret_cast<const Bytef*>(body.data()),
+                       body.size(), Z_BEST_SPEED));
+    compressed.resize(4 + compressed_size);
+    body.swap(compressed);
+  }
+
+  SendBinaryString(event_base_, req, body);
+}
+
+
+struct HttpHandler::EntriesReply {
+  EntriesReply(evhttp_request* req, int64_t start, int64_t end,
+               bool include_scts, bool immutable)
+      : req(req),
+        next(start),
+        end(end),
+        include_scts(include_scts),
+        immutable(immutable),
+        buffer(CHECK_NOTNULL(evbuffer_new()), evbuffer_free),
+        writer(buffer.get()) {
+  }
+
+  evhttp_request* const req;
+  int64_t next;
+  const int64_t end;
+  const bool include_scts;
+  // Whether the reply can be cached forever, if it is complete.
+  const bool immutable;
+  // The chunk being read.
+  int64_t requested;
+  vector<LoggedEntry> entries;
+  // Only holds what was rendered since the last chunk was sent, the
+  // writer lives on for the whole reply.
+  const unique_ptr<evbuffer, void (*)(evbuffer*)> buffer;
+  // What was in |buffer| for the chunks already sent.
+  size_t sent_bytes = 0;
+  JsonWriter writer;
+  // Set once the headers (and some entries) have been sent.
+  unique_ptr<ChunkedJsonReply> chunked;
+};
+
+
+void HttpHandler::ReadEntriesChunk(
+    const shared_ptr<EntriesReply>& reply) const {
+  // A reply that can be cached forever is sent in one go, so that it
+  // cannot be cut short after its headers went out.
+  reply->requested =
+      reply->immutable
+          ? reply->end - reply->next + 1
+          : min<int64_t>(reply->end - reply->next + 1,
+                         FLAGS_get_entries_chunk_size);
+  // Reading into the entries of the previous chunk reuses their memory.
+  reply->entries.reserve(reply->requested);
+  db_->ReadEntries(reply->next, reply->next + reply->requested - 1, pool_,
+                   &reply->entries,
+                   new util::Task(bind(&HttpHandler::EntriesChunkRead, this,
+                                       reply, _1),
+                                  pool_));
+}
+
+
+void HttpHandler::EntriesChunkRead(const shared_ptr<EntriesReply>& reply,
+                                   util::Task* task) const {
+  const util::Status read_status(task->status());
+  delete task;
+  evhttp_request* const req(reply->req);
+
+  if (!reply->chunked) {
+    if (!read_status.ok()) {
+      return SendJsonError(event_base_, req, HTTP_INTERNAL,
+                           read_status.error_message());
+    }
+    if (reply->entries.empty()) {
+      return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                           "Entry not found.");
+    }
+    reply->writer.BeginObject();
+    reply->writer.Key("entries");
+    reply->writer.BeginArray();
+  }
+
+  // Past the first chunk, it is too late to send an error, the reply
+  // is cut short instead (but still valid), like for a missing entry.
+  bool done(!read_status.ok() ||
+            static_cast<int64_t>(reply->entries.size()) < reply->requested);
+  if (!read_status.ok()) {
+    LOG_EVERY_N_SEC(WARNING, 1) << "error reading entries: " << read_status;
+  }
+  for (const auto& entry : reply->entries) {
+    const util::Status status(
+        GetEntriesCache::WriteEntry(entry, reply->include_scts,
+                                    &reply->writer));
+    if (!status.ok()) {
+      if (!reply->chunked) {
+        return SendJsonError(event_base_, req, HTTP_INTERNAL,
+                             status.error_message());
+      }
+      LOG_EVERY_N_SEC(WARNING, 1) << "error rendering entry "
+                                  << entry.sequence_number() << ": "
+                                  << status;
+      done = true;
+      break;
+    }
+    ++reply->next;
+    if (FLAGS_max_get_entries_response_bytes > 0 &&
+        reply->sent_bytes + evbuffer_get_length(reply->buffer.get()) >=
+            static_cast<size_t>(FLAGS_max_get_entries_response_bytes)) {
+      // Clients have to cope with getting fewer entries than they
+      // asked for anyway.
+      done = true;
+      break;
+    }
+  }
+  done = done || reply->next > reply->end;
+
+  if (done) {
+    reply->writer.EndArray();
+    reply->writer.EndObject();
+    get_entries_response_bytes->Record(
+        reply->sent_bytes + evbuffer_get_length(reply->buffer.get()));
+    if (!reply->chunked) {
+      // All of it fit in a single chunk, no need for chunked encoding.
+      if (reply->immutable && reply->next > reply->end) {
+        AddImmutableCacheHeaders(req);
+      }
+      return SendJsonReply(event_base_, req, HTTP_OK, reply->buffer.get());
+    }
+    SendJsonReplyChunk(reply->chunked.get(), reply->buffer.get());
+    return EndJsonReply(reply->chunked.get());
+  }
+
+  if (!reply->chunked) {
+    reply->chunked = StartJsonReply(event_base_, req, HTTP_OK);
+  }
+  reply->sent_bytes += evbuffer_get_length(reply->buffer.get());
+  SendJsonReplyChunk(reply->chunked.get(), reply->buffer.get());
+  ReadEntriesChunk(reply);
 }
@@ -2,23 +2,33 @@
 #define CERT_TRANS_SERVER_HANDLER_H_
 
 #include <stdint.h>
+#include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <utility>
 
 #include "proto/ct.pb.h"
+#include "server/entries_streamer.h"
+#include "server/rate_limiter.h"
+#include "server/request_queue.h"
 #include "server/staleness_tracker.h"
+#include "server/sth_notifier.h"
+#include "util/single_flight_cache.h"
 #include "util/libevent_wrapper.h"
 #include "util/sync_task.h"
 #include "util/task.h"
 
 class Frontend;
+class JsonObject;
 
 namespace cert_trans {
 
 class CertChain;
 class CertChecker;
 class ClusterStateController;
+class GetEntriesCache;
 class LogLookup;
 class LoggedEntry;
 class PreCertChain;
@@ -38,6 +48,11 @@ class HttpHandler {
 
   void Add(libevent::HttpServer* server);
 
+  // Serves the log under |prefix| (such as "/logs/foo", for
+  // "/logs/foo/ct/v1/get-sth"), so that the server can host other
+  // logs. Must be called before Add().
+  void SetPathPrefix(const std::string& prefix);
+
   void SetProxy(Proxy* proxy);
 
  protected:
@@ -47,21 +62,125 @@ class HttpHandler {
   void AddEntryReply(evhttp_request* req, const util::Status& add_status,
                      const ct::SignedCertificateTimestamp& sct) const;
 
+  // Whether a request can be answered correctly from the local data,
+  // even though this node is behind the serving STH.
+  typedef std::function<bool(evhttp_request*)> ServableWhenStale;
+
   void ProxyInterceptor(
+      const std::string& path,
       const libevent::HttpServer::HandlerCallback& local_handler,
-      evhttp_request* request);
-
+      const ServableWhenStale& servable_when_stale, evhttp_request* request);
+
+  // The work of the requests for |path| that goes to the pool (see
+  // RunOnPool()) is scheduled with |priority|. While this node is
+  // stale, the requests are proxied to another node, unless
+  // |servable_when_stale| says otherwise.
+  //
+  // The requests are rate limited by client, on the event thread,
+  // with the write limits for the low priority ones (the
+  // submissions), and the read limits for the others, except the
+  // internal ones.
   void AddProxyWrappedHandler(
       libevent::HttpServer* server, const std::string& path,
-      const libevent::HttpServer::HandlerCallback& local_handler);
-
-  void GetEntries(evhttp_request* req) const;
+      const libevent::HttpServer::HandlerCallback& local_handler,
+      RequestQueue::Priority priority = RequestQueue::Priority::NORMAL,
+      const ServableWhenStale& servable_when_stale = ServableWhenStale());
+
+  // Whether |request| is within the rate limits of its client for
+  // |path|, or else replies with a 429 and returns false.
+  bool CheckRateLimit(const std::string& path, evhttp_request* request);
+
+  // Requests with invalid parameters are servable, as the reply is
+  // the same error either way.
+  bool EntriesServableWhenStale(evhttp_request* req) const;
+  bool ProofServableWhenStale(evhttp_request* req) const;
+  bool ConsistencyServableWhenStale(evhttp_request* req) const;
+
+  // Runs |closure| on the pool, with the priority of |path|, or else
+  // replies to |req| with a 503 if too many requests of that priority
+  // are waiting already.
+  void RunOnPool(evhttp_request* req, const std::string& path,
+                 const std::function<void()>& closure);
+
+  void GetEntries(evhttp_request* req);
+  // Non-standard, for the other nodes of the cluster: the entries as
+  // stored in the database, see AsyncLogClient::GetLoggedEntries().
+  void GetLoggedEntries(evhttp_request* req);
+  // Non-standard: the entries from "start" (or the Last-Event-ID
+  // header), and then the new ones as they come, see EntriesStreamer.
+  void GetEntriesStream(evhttp_request* req);
   void GetProof(evhttp_request* req) const;
+  void GetEntryAndProof(evhttp_request* req);
+  // Non-standard, the same for a range of entries.
+  void GetEntriesAndProofs(evhttp_request* req);
+  // With "newer_than", waits for an STH with a later timestamp, see
+  // STHNotifier.
   void GetSTH(evhttp_request* req) const;
+  // Non-standard: a stream of server-sent events, one for every new
+  // STH, see STHNotifier.
+  void GetSTHEvents(evhttp_request* req);
+  // Replies with the current STH.
+  void SendSTH(evhttp_request* req) const;
+  // Passes every new STH of |log_lookup_| on to |sth_notifier_| and
+  // |entries_streamer_|.
+  void NewSTH(const std::shared_ptr<const ct::SignedTreeHead>& sth) const;
   void GetConsistency(evhttp_request* req) const;
-
+  // Parse the parameters of the requests for proofs, or reply with an
+  // error and return false.
+  bool ParseProofQuery(evhttp_request* req, std::string* hash,
+                       int64_t* tree_size) const;
+  bool ParseConsistencyQuery(evhttp_request* req, int64_t* first,
+                             int64_t* second) const;
+  // Non-standard, for internal readers: the same as the above, in the
+  // binary framing of GetLoggedEntries(), see
+  // AsyncLogClient::GetSTHBinary() and the like.
+  void GetProofBinary(evhttp_request* req) const;
+  void GetSTHBinary(evhttp_request* req) const;
+  void GetConsistencyBinary(evhttp_request* req) const;
+
+  // Replies from the get-entries cache, which can block on the
+  // database. If |immutable|, a complete reply gets headers letting it
+  // be cached forever.
   void BlockingGetEntries(evhttp_request* req, int64_t start, int64_t end,
-                          bool include_scts) const;
+                          bool immutable) const;
+
+  // Otherwise, the entries are read a chunk at a time, without holding
+  // on to a thread of the pool while waiting for the database, and
+  // the reply is sent as they come.
+  struct EntriesReply;
+  void ReadEntriesChunk(const std::shared_ptr<EntriesReply>& reply) const;
+  void EntriesChunkRead(const std::shared_ptr<EntriesReply>& reply,
+                        util::Task* task) const;
+
+  // Replies with the entries from |start| to |end| (inclusive), read
+  // in one go, along with their audit paths for |tree_size|, which
+  // can block on the database. Unless |batch|, there is only one
+  // entry, replied to as get-entry-and-proof does.
+  void BlockingGetEntriesAndProofs(evhttp_request* req, int64_t start,
+                                   int64_t end, int64_t tree_size,
+                                   bool batch) const;
+
+  // Replies with the entries from |start| to |end| (inclusive),
+  // optionally compressed, which can block on the database.
+  void BlockingGetLoggedEntries(evhttp_request* req, int64_t start,
+                                int64_t end, bool compress) const;
+
+  // A reply rendered once, and served for as long as the |version| of
+  // the data it was made from does not change.
+  struct CachedReply {
+    int64_t version;
+    std::shared_ptr<const std::string> json;
+    // NULL if not worth it, see GzipCachedJson().
+    std::shared_ptr<const std::string> gzip_json;
+    std::string etag;
+  };
+
+  static std::shared_ptr<const CachedReply> MakeCachedReply(
+      int64_t version, const JsonObject& json);
+
+  // The get-sth reply for |sth|, from |sth_reply_| if it is current.
+  std::shared_ptr<const CachedReply> STHReply(
+      const std::shared_ptr<const ct::SignedTreeHead>& sth) const;
 
   LogLookup* const log_lookup_;
   const ReadOnlyDatabase* const db_;
@@ -70,6 +189,32 @@ class HttpHandler {
   ThreadPool* const pool_;
   libevent::Base* const event_base_;
   StalenessTracker* const staleness_tracker_;
+  RequestQueue request_queue_;
+  RateLimiter read_limiter_;
+  RateLimiter write_limiter_;
+  // Only changed while adding the handlers.
+  std::string path_prefix_;
+  std::map<std::string, RequestQueue::Priority> priorities_;
+  // NULL for the paths which are not limited.
+  std::map<std::string, RateLimiter*> rate_limiters_;
+  // NULL if disabled.
+  std::unique_ptr<GetEntriesCache> entries_cache_;
+  // The get-sth reply for the current STH (by timestamp), only
+  // accessed atomically.
+  mutable std::shared_ptr<const CachedReply> sth_reply_;
+  const std::unique_ptr<STHNotifier> sth_notifier_;
+  const std::unique_ptr<EntriesStreamer> entries_streamer_;
+  // Registered with |log_lookup_|, see LogLookup::NewSTHCallback.
+  const std::function<void(const std::shared_ptr<const ct::SignedTreeHead>&)>
+      new_sth_cb_;
+  // Rendered proofs, by (hash, tree_size) and by (first, second), NULL
+  // for hashes that were not found.
+  mutable SingleFlightCache<std::pair<std::string, int64_t>,
+                            std::shared_ptr<const CachedReply>>
+      audit_proofs_;
+  mutable SingleFlightCache<std::pair<int64_t, int64_t>,
+                            std::shared_ptr<const CachedReply>>
+      consistency_proofs_;
 
   DISALLOW_COPY_AND_ASSIGN(HttpHandler);
 };
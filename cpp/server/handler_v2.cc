@@ -3,6 +3,8 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <algorithm>
+#include <functional>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -11,33 +13,48 @@
 #include "log/cluster_state_controller.h"
 #include "log/log_lookup.h"
 #include "log/logged_entry.h"
+#include "merkletree/serial_hasher.h"
+#include "monitoring/histogram.h"
 #include "monitoring/latency.h"
 #include "monitoring/monitoring.h"
+#include "monitoring/trace.h"
+#include "server/get_entries_cache.h"
 #include "server/json_output.h"
 #include "server/proxy.h"
 #include "util/json_wrapper.h"
+#include "util/json_writer.h"
 #include "util/thread_pool.h"
+#include "util/util.h"
 
 namespace libevent = cert_trans::libevent;
 
 using cert_trans::Counter;
+using cert_trans::GetEntriesCache;
+using cert_trans::Histogram;
 using cert_trans::HttpHandlerV2;
+using cert_trans::JsonWriter;
 using cert_trans::Latency;
 using cert_trans::LoggedEntry;
 using cert_trans::Proxy;
 using cert_trans::ScopedLatency;
+using cert_trans::ScopedTrace;
 using ct::ShortMerkleAuditProof;
 using ct::SignedCertificateTimestamp;
 using ct::SignedTreeHead;
+using std::atomic_load;
+using std::atomic_store;
 using std::bind;
 using std::chrono::milliseconds;
 using std::chrono::seconds;
+using std::function;
 using std::lock_guard;
+using std::make_pair;
 using std::make_shared;
 using std::multimap;
 using std::min;
 using std::mutex;
 using std::placeholders::_1;
+using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
 using std::vector;
@@ -45,6 +62,19 @@ using std::vector;
 DEFINE_int32(max_leaf_entries_per_response, 1000,
              "maximum number of entries to put in the response of a "
              "get-entries request");
+DEFINE_int32(max_get_entries_response_bytes, 4 << 20,
+             "stop adding entries to the response of a get-entries request "
+             "once it is at least this large, as entries vary a lot in size "
+             "(0 for no limit, there is always at least one entry)");
+DEFINE_int32(get_entries_cache_tiles, 16,
+             "number of tiles of rendered entries to keep in memory for "
+             "get-entries requests (0 to disable the cache)");
+DEFINE_int32(get_entries_cache_tile_size, 256,
+             "number of entries per tile in the get-entries cache");
+DEFINE_int32(proof_cache_size, 1024,
+             "number of rendered audit proofs, and of consistency proofs, to "
+             "keep in memory, for the many clients requesting the same ones "
+             "after a new STH");
 
 namespace {
 
@@ -53,6 +83,10 @@ static Latency<milliseconds, string> http_server_request_latency_ms(
     "total_http_server_request_latency_ms", "path",
     "Total request latency in ms broken down by path");
 
+static Histogram<>* get_entries_response_bytes(Histogram<>::New(
+    "get_entries_response_bytes",
+    "Size in bytes of the JSON body of get-entries responses."));
+
 
 }  // namespace
 
@@ -67,7 +101,14 @@ HttpHandlerV2::HttpHandlerV2(LogLookup* log_lookup, const ReadOnlyDatabase* db,
       proxy_(nullptr),
       pool_(CHECK_NOTNULL(pool)),
       event_base_(CHECK_NOTNULL(event_base)),
-      staleness_tracker_(CHECK_NOTNULL(staleness_tracker)) {
+      staleness_tracker_(CHECK_NOTNULL(staleness_tracker)),
+      audit_proofs_(FLAGS_proof_cache_size),
+      consistency_proofs_(FLAGS_proof_cache_size) {
+  if (FLAGS_get_entries_cache_tiles > 0) {
+    entries_cache_.reset(
+        new GetEntriesCache(db_, FLAGS_get_entries_cache_tile_size,
+                            FLAGS_get_entries_cache_tiles));
+  }
 }
 
 
@@ -78,6 +119,9 @@ HttpHandlerV2::~HttpHandlerV2() {
 void StatsHandlerInterceptor(const string& path,
                              const libevent::HttpServer::HandlerCallback& cb,
                              evhttp_request* req) {
+  // The trace lasts until the last of the work done for the request on
+  // other threads (see RequestQueue) finishes.
+  ScopedTrace trace(path);
   ScopedLatency total_http_server_request_latency(
       http_server_request_latency_ms.GetScopedLatency(path));
 
@@ -145,31 +189,228 @@ void HttpHandlerV2::SetProxy(Proxy* proxy) {
 
 
 void HttpHandlerV2::GetEntries(evhttp_request* req) const {
-  return SendJsonError(event_base_, req, HTTP_NOTIMPLEMENTED,
-                       "Not yet implemented.");
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    return SendJsonError(event_base_, req, HTTP_BADMETHOD,
+                         "Method not allowed.");
+  }
+
+  const libevent::QueryParams query(libevent::ParseQuery(req));
+
+  const int64_t start(libevent::GetIntParam(query, "start"));
+  if (start < 0) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Missing or invalid \"start\" parameter.");
+  }
+
+  int64_t end(libevent::GetIntParam(query, "end"));
+  if (end < start) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Missing or invalid \"end\" parameter.");
+  }
+
+  // Limit the number of entries returned in a single request.
+  end = min(end, start + FLAGS_max_leaf_entries_per_response);
+
+  // Sekrit parameter to indicate that SCTs should be included too.
+  // This is non-standard, and is only used internally by other log nodes when
+  // "following" nodes with more data.
+  const bool include_scts(libevent::GetBoolParam(query, "include_scts"));
+
+  pool_->Add(bind(&HttpHandlerV2::BlockingGetEntries, this, req, start, end,
+                  include_scts));
 }
 
 
 void HttpHandlerV2::GetProof(evhttp_request* req) const {
-  return SendJsonError(event_base_, req, HTTP_NOTIMPLEMENTED,
-                       "Not yet implemented.");
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    return SendJsonError(event_base_, req, HTTP_BADMETHOD,
+                         "Method not allowed.");
+  }
+
+  const libevent::QueryParams query(libevent::ParseQuery(req));
+
+  string b64_hash;
+  if (!libevent::GetParam(query, "hash", &b64_hash)) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Missing or invalid \"hash\" parameter.");
+  }
+
+  const string hash(util::FromBase64(b64_hash.c_str()));
+  if (hash.empty()) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Invalid \"hash\" parameter.");
+  }
+
+  const int64_t tree_size(libevent::GetIntParam(query, "tree_size"));
+  if (tree_size < 0 ||
+      tree_size > log_lookup_->GetSTHSnapshot()->tree_size()) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Missing or invalid \"tree_size\" parameter.");
+  }
+
+  // The tree is complete up to |tree_size|, so the answer for it
+  // (including "not found") does not change anymore.
+  const shared_ptr<const CachedReply> reply(audit_proofs_.Get(
+      make_pair(hash, tree_size),
+      [this, &hash, tree_size]() -> shared_ptr<const CachedReply> {
+        ShortMerkleAuditProof proof;
+        if (log_lookup_->AuditProof(hash, tree_size, &proof) !=
+            LogLookup::OK) {
+          return nullptr;
+        }
+
+        JsonArray json_audit;
+        for (int i = 0; i < proof.path_node_size(); ++i) {
+          json_audit.AddBase64(proof.path_node(i));
+        }
+
+        JsonObject json_reply;
+        json_reply.Add("leaf_index", proof.leaf_index());
+        json_reply.Add("audit_path", json_audit);
+        return MakeCachedReply(tree_size, json_reply);
+      }));
+  if (!reply) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Couldn't find hash.");
+  }
+
+  SendCachedJsonReply(event_base_, req, reply->json, reply->gzip_json,
+                      reply->etag);
 }
 
 
 void HttpHandlerV2::GetSTH(evhttp_request* req) const {
-  return SendJsonError(event_base_, req, HTTP_NOTIMPLEMENTED,
-                       "Not yet implemented.");
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    return SendJsonError(event_base_, req, HTTP_BADMETHOD,
+                         "Method not allowed.");
+  }
+
+  const shared_ptr<const SignedTreeHead> sth(log_lookup_->GetSTHSnapshot());
+  shared_ptr<const CachedReply> reply(atomic_load(&sth_reply_));
+  if (!reply || reply->version != sth->timestamp()) {
+    JsonObject json_reply;
+    json_reply.Add("tree_size", sth->tree_size());
+    json_reply.Add("timestamp", sth->timestamp());
+    json_reply.AddBase64("sha256_root_hash", sth->sha256_root_hash());
+    json_reply.Add("tree_head_signature", sth->signature());
+
+    // Racing requests might both render it, which is harmless.
+    reply = MakeCachedReply(sth->timestamp(), json_reply);
+    atomic_store(&sth_reply_, reply);
+  }
+
+  SendCachedJsonReply(event_base_, req, reply->json, reply->gzip_json,
+                      reply->etag);
 }
 
 
 void HttpHandlerV2::GetConsistency(evhttp_request* req) const {
-  return SendJsonError(event_base_, req, HTTP_NOTIMPLEMENTED,
-                       "Not yet implemented.");
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    return SendJsonError(event_base_, req, HTTP_BADMETHOD,
+                         "Method not allowed.");
+  }
+
+  const libevent::QueryParams query(libevent::ParseQuery(req));
+
+  const int64_t first(libevent::GetIntParam(query, "first"));
+  if (first < 0) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Missing or invalid \"first\" parameter.");
+  }
+
+  const int64_t second(libevent::GetIntParam(query, "second"));
+  if (second < first) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Missing or invalid \"second\" parameter.");
+  }
+
+  const function<shared_ptr<const CachedReply>()> compute(
+      [this, first, second]() {
+        JsonArray json_cons;
+        for (const auto& node : log_lookup_->ConsistencyProof(first, second)) {
+          json_cons.AddBase64(node);
+        }
+
+        JsonObject json_reply;
+        json_reply.Add("consistency", json_cons);
+        return MakeCachedReply(second, json_reply);
+      });
+  // A proof to a tree size we do not have yet would change later.
+  const shared_ptr<const CachedReply> reply(
+      second <= log_lookup_->GetSTHSnapshot()->tree_size()
+          ? consistency_proofs_.Get(make_pair(first, second), compute)
+          : compute());
+
+  SendCachedJsonReply(event_base_, req, reply->json, reply->gzip_json,
+                      reply->etag);
+}
+
+
+// static
+shared_ptr<const HttpHandlerV2::CachedReply> HttpHandlerV2::MakeCachedReply(
+    int64_t version, const JsonObject& json) {
+  const shared_ptr<CachedReply> reply(make_shared<CachedReply>());
+  reply->version = version;
+  reply->json = make_shared<const string>(json.ToString());
+  reply->gzip_json = GzipCachedJson(*reply->json);
+  // Strong validator: the hash of the body itself.
+  reply->etag =
+      "\"" +
+      util::HexString(Sha256Hasher::Sha256Digest(*reply->json)).substr(0, 32) +
+      "\"";
+  return reply;
 }
 
 
 void HttpHandlerV2::BlockingGetEntries(evhttp_request* req, int64_t start,
                                        int64_t end, bool include_scts) const {
-  return SendJsonError(event_base_, req, HTTP_NOTIMPLEMENTED,
-                       "Not yet implemented.");
+  // The reply is rendered into its own buffer, so that we can still
+  // send an error instead if something goes wrong halfway.
+  const unique_ptr<evbuffer, void (*)(evbuffer*)> buffer(
+      CHECK_NOTNULL(evbuffer_new()), evbuffer_free);
+  JsonWriter writer(buffer.get());
+  writer.BeginObject();
+  writer.Key("entries");
+  writer.BeginArray();
+
+  int64_t written(0);
+  if (entries_cache_ && !include_scts) {
+    const util::StatusOr<int64_t> cached(
+        entries_cache_->WriteEntries(
+            start, end, FLAGS_max_get_entries_response_bytes, &writer));
+    if (!cached.ok()) {
+      return SendJsonError(event_base_, req, HTTP_INTERNAL,
+                           cached.status().error_message());
+    }
+    written = cached.ValueOrDie();
+  } else {
+    // A single range read, rendered straight into the reply.
+    vector<LoggedEntry> entries;
+    db_->ReadRange(start, end - start + 1, &entries);
+    for (const auto& entry : entries) {
+      const util::Status status(
+          GetEntriesCache::WriteEntry(entry, include_scts, &writer));
+      if (!status.ok()) {
+        return SendJsonError(event_base_, req, HTTP_INTERNAL,
+                             status.error_message());
+      }
+      ++written;
+      if (FLAGS_max_get_entries_response_bytes > 0 &&
+          evbuffer_get_length(buffer.get()) >=
+              static_cast<size_t>(FLAGS_max_get_entries_response_bytes)) {
+        break;
+      }
+    }
+  }
+
+  if (written < 1) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Entry not found.");
+  }
+
+  writer.EndArray();
+  writer.EndObject();
+
+  get_entries_response_bytes->Record(evbuffer_get_length(buffer.get()));
+  SendJsonReply(event_base_, req, HTTP_OK, buffer.get());
 }
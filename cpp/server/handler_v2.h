@@ -5,20 +5,24 @@
 #include <memory>
 #include <mutex>
 #include <string>
+#include <utility>
 
 #include "proto/ct.pb.h"
 #include "server/staleness_tracker.h"
 #include "util/libevent_wrapper.h"
+#include "util/single_flight_cache.h"
 #include "util/sync_task.h"
 #include "util/task.h"
 
 class Frontend;
+class JsonObject;
 
 namespace cert_trans {
 
 class CertChain;
 class CertChecker;
 class ClusterStateController;
+class GetEntriesCache;
 class LogLookup;
 class LoggedEntry;
 class PreCertChain;
@@ -61,9 +65,25 @@ class HttpHandlerV2 {
   void GetSTH(evhttp_request* req) const;
   void GetConsistency(evhttp_request* req) const;
 
+  // Replies with the entries from |start| to |end| (inclusive), from
+  // the get-entries cache if possible, which can block on the
+  // database.
   void BlockingGetEntries(evhttp_request* req, int64_t start, int64_t end,
                           bool include_scts) const;
 
+  // A reply rendered once, and served for as long as the |version| of
+  // the data it was made from does not change.
+  struct CachedReply {
+    int64_t version;
+    std::shared_ptr<const std::string> json;
+    // NULL if not worth it, see GzipCachedJson().
+    std::shared_ptr<const std::string> gzip_json;
+    std::string etag;
+  };
+
+  static std::shared_ptr<const CachedReply> MakeCachedReply(
+      int64_t version, const JsonObject& json);
+
   LogLookup* const log_lookup_;
   const ReadOnlyDatabase* const db_;
   const ClusterStateController* const controller_;
@@ -71,6 +91,19 @@ class HttpHandlerV2 {
   ThreadPool* const pool_;
   libevent::Base* const event_base_;
   StalenessTracker* const staleness_tracker_;
+  // NULL if disabled.
+  std::unique_ptr<GetEntriesCache> entries_cache_;
+  // The get-sth reply for the current STH (by timestamp), only
+  // accessed atomically.
+  mutable std::shared_ptr<const CachedReply> sth_reply_;
+  // Rendered proofs, by (hash, tree_size) and by (first, second), NULL
+  // for hashes that were not found.
+  mutable SingleFlightCache<std::pair<std::string, int64_t>,
+                            std::shared_ptr<const CachedReply>>
+      audit_proofs_;
+  mutable SingleFlightCache<std::pair<int64_t, int64_t>,
+                            std::shared_ptr<const CachedReply>>
+      consistency_proofs_;
 
   DISALLOW_COPY_AND_ASSIGN(HttpHandlerV2);
 };
@@ -1,16 +1,106 @@
 #include "server/json_output.h"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <zlib.h>
+#include <functional>
 #include <string>
+#include <vector>
 
+#include "base/macros.h"
 #include "monitoring/latency.h"
 #include "monitoring/monitoring.h"
 #include "util/json_wrapper.h"
 #include "util/libevent_wrapper.h"
+#include "util/util.h"
 
+using std::function;
+using std::make_shared;
+using std::move;
+using std::shared_ptr;
 using std::string;
+using std::unique_ptr;
+using std::vector;
+
+DEFINE_int32(http_gzip_level, 0,
+             "zlib compression level of the JSON replies to the clients "
+             "accepting gzip, from 1 (fastest) to 9 (smallest), or 0 to "
+             "never compress them");
 
 namespace cert_trans {
+
+
+// Compresses a reply, possibly sent in several chunks, in the gzip
+// format.
+class GzipStream {
+ public:
+  GzipStream() {
+    stream_.zalloc = Z_NULL;
+    stream_.zfree = Z_NULL;
+    stream_.opaque = Z_NULL;
+    // 16 more window bits selects the gzip header and trailer.
+    CHECK_EQ(deflateInit2(&stream_, FLAGS_http_gzip_level, Z_DEFLATED,
+                          15 + 16, 8, Z_DEFAULT_STRATEGY),
+             Z_OK);
+  }
+
+  ~GzipStream() {
+    deflateEnd(&stream_);
+  }
+
+  // Compresses all of |in|, draining it, and appends the result to
+  // |out|. The output is flushed, so that it can be sent as is, and
+  // finishes the stream if |finish| is set.
+  void Compress(evbuffer* in, bool finish, evbuffer* out);
+
+ private:
+  void Deflate(const void* data, size_t length, int flush, evbuffer* out);
+
+  z_stream stream_;
+
+  DISALLOW_COPY_AND_ASSIGN(GzipStream);
+};
+
+
+void GzipStream::Compress(evbuffer* in, bool finish, evbuffer* out) {
+  const int flush(finish ? Z_FINISH : Z_SYNC_FLUSH);
+  const int num_vecs(evbuffer_peek(in, -1, nullptr, nullptr, 0));
+  vector<evbuffer_iovec> vecs(num_vecs);
+  CHECK_EQ(evbuffer_peek(in, -1, nullptr, vecs.data(), num_vecs), num_vecs);
+  for (int i = 0; i < num_vecs; ++i) {
+    Deflate(vecs[i].iov_base, vecs[i].iov_len,
+            i + 1 < num_vecs ? Z_NO_FLUSH : flush, out);
+  }
+  if (num_vecs == 0) {
+    Deflate(nullptr, 0, flush, out);
+  }
+  CHECK_EQ(evbuffer_drain(in, evbuffer_get_length(in)), 0);
+}
+
+
+void GzipStream::Deflate(const void* data, size_t length, int flush,
+                         evbuffer* out) {
+  // The output goes straight into the reserved space of |out|.
+  const size_t kOutputSize(16384);
+  stream_.next_in =
+      const_cast<Bytef*>(static_cast<const Bytef*>(data));
+  stream_.avail_in = length;
+  int ret;
+  do {
+    evbuffer_iovec vec;
+    CHECK_EQ(evbuffer_reserve_space(out, kOutputSize, &vec, 1), 1);
+    stream_.next_out = static_cast<Bytef*>(vec.iov_base);
+    stream_.avail_out = vec.iov_len;
+    ret = deflate(&stream_, flush);
+    CHECK(ret == Z_OK || ret == Z_STREAM_END || ret == Z_BUF_ERROR) << ret;
+    vec.iov_len -= stream_.avail_out;
+    CHECK_EQ(evbuffer_commit_space(out, &vec, 1), 0);
+  } while (stream_.avail_out == 0 ||
+           (flush == Z_FINISH && ret != Z_STREAM_END));
+  CHECK_EQ(stream_.avail_in, 0U);
+}
+
+
 namespace {
 
 
@@ -25,6 +115,91 @@ static Counter<string, int>* total_http_server_response_codes(
                               "HTTP response code for a given path."));
 
 static const char kJsonContentType[] = "application/json; charset=utf-8";
+static const char kBinaryContentType[] = "application/octet-stream";
+static const char kEventStreamContentType[] = "text/event-stream";
+// Smaller replies are not worth compressing.
+static const size_t kMinGzipSize = 1024;
+
+
+string Trim(const string& s) {
+  const size_t begin(s.find_first_not_of(" \t"));
+  if (begin == string::npos) {
+    return string();
+  }
+  return s.substr(begin, s.find_last_not_of(" \t") - begin + 1);
+}
+
+
+// Returns whether gzip is one of the content codings of
+// |accept_encoding|, without a "q=0" parameter.
+bool AcceptsGzip(const char* accept_encoding) {
+  if (!accept_encoding) {
+    return false;
+  }
+  for (const string& coding : util::split(accept_encoding, ',')) {
+    const vector<string> params(util::split(coding, ';'));
+    if (params.empty() || Trim(params[0]) != "gzip") {
+      continue;
+    }
+    for (size_t i = 1; i < params.size(); ++i) {
+      const string param(Trim(params[i]));
+      if (param == "q=0" || param == "q=0." || param == "q=0.0" ||
+          param == "q=0.00" || param == "q=0.000") {
+        return false;
+      }
+    }
+    return true;
+  }
+  return false;
+}
+
+
+// Whether the reply to |req| should be compressed, if it is at least
+// |length| bytes.
+bool UseGzip(evhttp_request* req, size_t length) {
+  return FLAGS_http_gzip_level > 0 && length >= kMinGzipSize &&
+         AcceptsGzip(evhttp_find_header(evhttp_request_get_input_headers(req),
+                                        "Accept-Encoding"));
+}
+
+
+void AddGzipHeader(evhttp_request* req) {
+  CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(req),
+                             "Content-Encoding", "gzip"),
+           0);
+}
+
+
+// Returns whether |etag| is one of the entity tags of |if_none_match|
+// (or it is "*").
+bool MatchesETag(const char* if_none_match, const string& etag) {
+  if (!if_none_match) {
+    return false;
+  }
+  const string header(if_none_match);
+  if (header == "*") {
+    return true;
+  }
+  size_t pos(0);
+  while ((pos = header.find(etag, pos)) != string::npos) {
+    const size_t end(pos + etag.size());
+    // Weak comparison, as a cache revalidating would do.
+    const bool starts(pos == 0 || header[pos - 1] == ' ' ||
+                      header[pos - 1] == ',' || header[pos - 1] == '/');
+    const bool ends(end == header.size() || header[end] == ' ' ||
+                    header[end] == ',');
+    if (starts && ends) {
+      return true;
+    }
+    pos = end;
+  }
+  return false;
+}
+
+
+void ReleaseCachedJson(const void*, size_t, void* json) {
+  delete static_cast<shared_ptr<const string>*>(json);
+}
 
 
 string LogRequest(evhttp_request* req, int http_status, int resp_body_length) {
@@ -65,38 +240,252 @@ string LogRequest(evhttp_request* req, int http_status, int resp_body_length) {
 }
 
 
-}  // namespace
+// Runs |closure| on the event thread of |req|, right away if this is
+// it.
+void RunOnRequestThread(evhttp_request* req, const function<void()>& closure) {
+  // With several HTTP server threads, this is not necessarily the
+  // base of the handler.
+  libevent::Base* const req_base(libevent::Base::ForRequest(req));
+  if (!req_base->OnThisEventThread()) {
+    req_base->Add(closure);
+  } else {
+    closure();
+  }
+}
 
 
-void SendJsonReply(libevent::Base* base, evhttp_request* req, int http_status,
-                   const JsonObject& json) {
-  CHECK_NOTNULL(base);
-  CHECK_NOTNULL(req);
+void SetHeaders(evhttp_request* req, int http_status,
+                const char* content_type = kJsonContentType) {
   CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(req),
-                             "Content-Type", kJsonContentType),
+                             "Content-Type", content_type),
            0);
+  if (FLAGS_http_gzip_level > 0 && content_type == kJsonContentType) {
+    CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(req),
+                               "Vary", "Accept-Encoding"),
+             0);
+  }
   if (http_status == HTTP_SERVUNAVAIL) {
     CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(req),
                                "Retry-After", "10"),
              0);
+  } else if (http_status == kHttpTooManyRequests) {
+    // A client over its rate limit can usually retry soon.
+    CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(req),
+                               "Retry-After", "1"),
+             0);
   }
+}
+
+
+// Sends the reply, whose body is already in the output buffer of
+// |req|.
+void SendReply(libevent::Base* base, evhttp_request* req, int http_status,
+               const char* content_type = kJsonContentType) {
+  CHECK_NOTNULL(base);
+  SetHeaders(req, http_status, content_type);
+
+  const string logstr(LogRequest(
+      req, http_status,
+      evbuffer_get_length(evhttp_request_get_output_buffer(req))));
+  RunOnRequestThread(req, [req, http_status, logstr]() {
+    evhttp_send_reply(req, http_status, /*reason*/ NULL, /*databuf*/ NULL);
+
+    VLOG(1) << logstr;
+  });
+}
+
+
+}  // namespace
+
+
+void SendJsonReply(libevent::Base* base, evhttp_request* req, int http_status,
+                   const JsonObject& json) {
+  CHECK_NOTNULL(req);
   const string resp_body(json.ToString());
+  if (UseGzip(req, resp_body.size())) {
+    const unique_ptr<evbuffer, void (*)(evbuffer*)> buffer(
+        CHECK_NOTNULL(evbuffer_new()), evbuffer_free);
+    CHECK_EQ(evbuffer_add_reference(buffer.get(), resp_body.data(),
+                                    resp_body.size(), nullptr, nullptr),
+             0);
+    return SendJsonReply(base, req, http_status, buffer.get());
+  }
   CHECK_GT(evbuffer_add_printf(evhttp_request_get_output_buffer(req), "%s",
                                resp_body.c_str()),
            0);
 
-  const string logstr(LogRequest(req, http_status, resp_body.size()));
-  const auto send_reply([req, http_status, logstr]() {
-    evhttp_send_reply(req, http_status, /*reason*/ NULL, /*databuf*/ NULL);
+  SendReply(base, req, http_status);
+}
+
+
+void SendJsonReply(libevent::Base* base, evhttp_request* req, int http_status,
+                   evbuffer* json) {
+  CHECK_NOTNULL(req);
+  if (UseGzip(req, evbuffer_get_length(CHECK_NOTNULL(json)))) {
+    // Compressed here, on the calling thread, rather than on the
+    // event loop.
+    GzipStream().Compress(json, true, evhttp_request_get_output_buffer(req));
+    AddGzipHeader(req);
+  } else {
+    CHECK_EQ(evbuffer_add_buffer(evhttp_request_get_output_buffer(req), json),
+             0);
+  }
+
+  SendReply(base, req, http_status);
+}
+
+
+void SendBinaryReply(libevent::Base* base, evhttp_request* req,
+                     int http_status, evbuffer* body) {
+  CHECK_NOTNULL(req);
+  CHECK_EQ(evbuffer_add_buffer(evhttp_request_get_output_buffer(req),
+                               CHECK_NOTNULL(body)),
+           0);
+
+  SendReply(base, req, http_status, kBinaryContentType);
+}
+
+
+void SendCachedJsonReply(libevent::Base* base, evhttp_request* req,
+                         const shared_ptr<const string>& json,
+                         const shared_ptr<const string>& gzip_json,
+                         const string& etag) {
+  CHECK_NOTNULL(req);
+  CHECK(json);
+  // The compressed body is another representation, with its own
+  // entity tag.
+  const bool use_gzip(gzip_json && UseGzip(req, json->size()));
+  const shared_ptr<const string>& body(use_gzip ? gzip_json : json);
+  const string body_etag(use_gzip
+                             ? etag.substr(0, etag.size() - 1) + "-gzip\""
+                             : etag);
+  evkeyvalq* const output_headers(evhttp_request_get_output_headers(req));
+  CHECK_EQ(evhttp_add_header(output_headers, "ETag", body_etag.c_str()), 0);
+  if (use_gzip) {
+    AddGzipHeader(req);
+  }
+
+  if (MatchesETag(evhttp_find_header(evhttp_request_get_input_headers(req),
+                                     "If-None-Match"),
+                  body_etag)) {
+    return SendReply(base, req, HTTP_NOTMODIFIED);
+  }
+
+  // The buffer keeps a reference to |body| until it is done with it.
+  CHECK_EQ(evbuffer_add_reference(evhttp_request_get_output_buffer(req),
+                                  body->data(), body->size(),
+                                  &ReleaseCachedJson,
+                                  new shared_ptr<const string>(body)),
+           0);
+
+  SendReply(base, req, HTTP_OK);
+}
+
+
+shared_ptr<const string> GzipCachedJson(const string& json) {
+  if (FLAGS_http_gzip_level <= 0 || json.size() < kMinGzipSize) {
+    return nullptr;
+  }
+
+  const unique_ptr<evbuffer, void (*)(evbuffer*)> in(
+      CHECK_NOTNULL(evbuffer_new()), evbuffer_free);
+  const unique_ptr<evbuffer, void (*)(evbuffer*)> out(
+      CHECK_NOTNULL(evbuffer_new()), evbuffer_free);
+  CHECK_EQ(evbuffer_add_reference(in.get(), json.data(), json.size(),
+                                  nullptr, nullptr),
+           0);
+  GzipStream().Compress(in.get(), true, out.get());
+
+  string gzip_json(evbuffer_get_length(out.get()), '\0');
+  CHECK_EQ(evbuffer_remove(out.get(), &gzip_json[0], gzip_json.size()),
+           static_cast<int>(gzip_json.size()));
+  return make_shared<const string>(move(gzip_json));
+}
+
+
+ChunkedJsonReply::ChunkedJsonReply(evhttp_request* req)
+    : req_(CHECK_NOTNULL(req)),
+      gzip_(UseGzip(req, kMinGzipSize) ? new GzipStream : nullptr) {
+}
+
+
+ChunkedJsonReply::~ChunkedJsonReply() {
+}
+
+
+unique_ptr<ChunkedJsonReply> StartJsonReply(libevent::Base* base,
+                                                 evhttp_request* req,
+                                                 int http_status) {
+  CHECK_NOTNULL(base);
+  unique_ptr<ChunkedJsonReply> reply(new ChunkedJsonReply(req));
+  SetHeaders(req, http_status);
+  if (reply->gzip_) {
+    AddGzipHeader(req);
+  }
+
+  // The length of the body is not known yet.
+  const string logstr(LogRequest(req, http_status, -1));
+  RunOnRequestThread(req, [req, http_status, logstr]() {
+    evhttp_send_reply_start(req, http_status, /*reason*/ NULL);
 
     VLOG(1) << logstr;
   });
+  return reply;
+}
+
 
-  if (!libevent::Base::OnEventThread()) {
-    base->Add(send_reply);
+void SendJsonReplyChunk(ChunkedJsonReply* reply, evbuffer* json) {
+  CHECK_NOTNULL(reply);
+  const shared_ptr<evbuffer> chunk(CHECK_NOTNULL(evbuffer_new()),
+                                   evbuffer_free);
+  if (reply->gzip_) {
+    reply->gzip_->Compress(json, false, chunk.get());
   } else {
-    send_reply();
+    CHECK_EQ(evbuffer_add_buffer(chunk.get(), json), 0);
   }
+
+  // If the client went away, this does nothing.
+  evhttp_request* const req(reply->req_);
+  RunOnRequestThread(req, [req, chunk]() {
+    evhttp_send_reply_chunk(req, chunk.get());
+  });
+}
+
+
+void EndJsonReply(ChunkedJsonReply* reply) {
+  CHECK_NOTNULL(reply);
+  evhttp_request* const req(reply->req_);
+  if (reply->gzip_) {
+    // The end of the stream goes in a last chunk.
+    const unique_ptr<evbuffer, void (*)(evbuffer*)> empty(
+        CHECK_NOTNULL(evbuffer_new()), evbuffer_free);
+    const shared_ptr<evbuffer> chunk(CHECK_NOTNULL(evbuffer_new()),
+                                     evbuffer_free);
+    reply->gzip_->Compress(empty.get(), true, chunk.get());
+    RunOnRequestThread(req, [req, chunk]() {
+      evhttp_send_reply_chunk(req, chunk.get());
+      evhttp_send_reply_end(req);
+    });
+    return;
+  }
+  RunOnRequestThread(req, [req]() { evhttp_send_reply_end(req); });
+}
+
+
+void StartEventStream(libevent::Base* base, evhttp_request* req) {
+  CHECK_NOTNULL(base);
+  CHECK_NOTNULL(req);
+  SetHeaders(req, HTTP_OK, kEventStreamContentType);
+  CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(req),
+                             "Cache-Control", "no-cache"),
+           0);
+
+  const string logstr(LogRequest(req, HTTP_OK, -1));
+  RunOnRequestThread(req, [req, logstr]() {
+    evhttp_send_reply_start(req, HTTP_OK, /*reason*/ NULL);
+
+    VLOG(1) << logstr;
+  });
 }
 
 
@@ -1,8 +1,10 @@
 #ifndef CERT_TRANS_SERVER_JSON_OUTPUT_H_
 #define CERT_TRANS_SERVER_JSON_OUTPUT_H_
 
+#include <memory>
 #include <string>
 
+struct evbuffer;
 struct evhttp_request;
 class JsonObject;
 
@@ -12,10 +14,90 @@ class Base;
 }  // namespace libevent
 
 
+// The HTTP status of replies to the clients over their rate limits,
+// which libevent has no constant for.
+const int kHttpTooManyRequests = 429;
+
+
 void SendJsonReply(libevent::Base* base, evhttp_request* req, int http_status,
                    const JsonObject& json);
 
 
+// Same as above, for a JSON document already rendered into |json| (for
+// example with a JsonWriter). The contents of |json| are moved to the
+// reply, without copying.
+void SendJsonReply(libevent::Base* base, evhttp_request* req, int http_status,
+                   evbuffer* json);
+
+
+// Same as above, for a body that is not JSON at all, sent as
+// "application/octet-stream".
+void SendBinaryReply(libevent::Base* base, evhttp_request* req,
+                     int http_status, evbuffer* body);
+
+
+// Sends |json|, a document rendered once for many replies (which is
+// not copied, only referenced until the reply is sent), with |etag|
+// as its ETag. Replies with a 304 and no body instead if the request
+// has that ETag in its If-None-Match header. If |gzip_json| is not
+// NULL, it is sent instead to the clients accepting gzip (see
+// GzipCachedJson()).
+void SendCachedJsonReply(libevent::Base* base, evhttp_request* req,
+                         const std::shared_ptr<const std::string>& json,
+                         const std::shared_ptr<const std::string>& gzip_json,
+                         const std::string& etag);
+
+
+// Returns |json| compressed for SendCachedJsonReply(), or NULL if it
+// is not worth it (or --http_gzip_level is zero).
+std::shared_ptr<const std::string> GzipCachedJson(const std::string& json);
+
+
+class GzipStream;
+
+
+// A reply sent in several chunks, see StartJsonReply().
+class ChunkedJsonReply {
+ public:
+  ~ChunkedJsonReply();
+
+ private:
+  explicit ChunkedJsonReply(evhttp_request* req);
+
+  evhttp_request* const req_;
+  // NULL if the reply is not compressed.
+  const std::unique_ptr<GzipStream> gzip_;
+
+  friend std::unique_ptr<ChunkedJsonReply> StartJsonReply(
+      libevent::Base* base, evhttp_request* req, int http_status);
+  friend void SendJsonReplyChunk(ChunkedJsonReply* reply, evbuffer* json);
+  friend void EndJsonReply(ChunkedJsonReply* reply);
+};
+
+
+// To send a reply in several chunks (with the chunked transfer
+// encoding), as its body becomes available: StartJsonReply sends the
+// headers, every SendJsonReplyChunk moves the contents of |json| to
+// the reply, and EndJsonReply finishes it. EndJsonReply must always be
+// called once the reply is started, even if the client went away in
+// the meantime (the chunks are then dropped).
+//
+// The replies (chunked or not) to the clients accepting gzip are
+// compressed according to --http_gzip_level, on the calling thread.
+std::unique_ptr<ChunkedJsonReply> StartJsonReply(libevent::Base* base,
+                                                 evhttp_request* req,
+                                                 int http_status);
+void SendJsonReplyChunk(ChunkedJsonReply* reply, evbuffer* json);
+void EndJsonReply(ChunkedJsonReply* reply);
+
+
+// Starts a stream of server-sent events ("text/event-stream") in
+// reply to |req|, never compressed nor cached. The events are then
+// sent as chunks, with evhttp_send_reply_chunk() on the event thread
+// of |req|, for as long as the client is there.
+void StartEventStream(libevent::Base* base, evhttp_request* req);
+
+
 void SendJsonError(libevent::Base* base, evhttp_request* req, int http_status,
                    const std::string& error_msg);
 
@@ -1,6 +1,7 @@
 #include "server/log_processes.h"
 
 #include <gflags/gflags.h>
+#include <algorithm>
 #include <iostream>
 
 #include "monitoring/latency.h"
@@ -13,9 +14,20 @@ DEFINE_int32(tree_signing_frequency_seconds, 600,
              "server select loop, at least this period has elapsed since the "
              "last signing. Set this well below the MMD to ensure we sign in "
              "a timely manner. Must be greater than 0.");
+DEFINE_int32(tree_signing_min_interval_ms, 10000,
+             "Sign a new tree head as soon as newly sequenced entries are in "
+             "the local database, rather than waiting for "
+             "--tree_signing_frequency_seconds, but no more often than this.");
 DEFINE_int32(sequencing_frequency_seconds, 10,
              "How often should new entries be sequenced. The sequencing runs "
              "in parallel with the tree signing and cleanup.");
+DEFINE_int32(sequencing_backlog_threshold, 1000,
+             "Sequence new entries as soon as this many were added since the "
+             "last run, rather than waiting for "
+             "--sequencing_frequency_seconds. 0 disables this.");
+DEFINE_int32(sequencing_min_interval_ms, 1000,
+             "Minimum time between two runs of the sequencer, however many "
+             "new entries there are.");
 DEFINE_int32(cleanup_frequency_seconds, 10,
              "How often should new entries be cleanedup. The cleanup runs in "
              "in parallel with the tree signing and sequencing.");
@@ -29,6 +41,7 @@ using std::function;
 using std::chrono::milliseconds;
 using std::chrono::seconds;
 using std::chrono::steady_clock;
+using std::min;
 
 namespace {
 
@@ -73,9 +86,12 @@ void SignMerkleTree(TreeSigner* tree_signer, ConsistentStore* store,
   CHECK_NOTNULL(controller);
   const steady_clock::duration period(
       (seconds(FLAGS_tree_signing_frequency_seconds)));
+  const steady_clock::duration min_interval(
+      (milliseconds(FLAGS_tree_signing_min_interval_ms)));
   steady_clock::time_point target_run_time(steady_clock::now());
 
   while (true) {
+    const steady_clock::time_point run_time(steady_clock::now());
     {
       ScopedLatency signer_run_latency(
           signer_run_latency_ms.GetScopedLatency());
@@ -102,7 +118,10 @@ void SignMerkleTree(TreeSigner* tree_signer, ConsistentStore* store,
     while (target_run_time <= now) {
       target_run_time += period;
     }
-    std::this_thread::sleep_for(target_run_time - now);
+    // Run again early if entries get sequenced in the meantime.
+    std::this_thread::sleep_until(min(run_time + min_interval,
+                                      target_run_time));
+    tree_signer->WaitForSequencedEntries(target_run_time);
   }
 }
 
@@ -142,15 +161,20 @@ void CleanUpEntries(ConsistentStore* store,
 }
 
 
-void SequenceEntries(TreeSigner* tree_signer,
+void SequenceEntries(TreeSigner* tree_signer, ConsistentStore* store,
                      const function<bool()>& is_master) {
   CHECK_NOTNULL(tree_signer);
+  CHECK_NOTNULL(store);
   CHECK(is_master);
   const steady_clock::duration period(
       (seconds(FLAGS_sequencing_frequency_seconds)));
+  const steady_clock::duration min_interval(
+      (milliseconds(FLAGS_sequencing_min_interval_ms)));
   steady_clock::time_point target_run_time(steady_clock::now());
 
   while (true) {
+    const steady_clock::time_point run_time(steady_clock::now());
+    const int64_t num_added(store->NumPendingEntriesAdded());
     if (is_master()) {
       const ScopedLatency sequencer_sequence_latency(
           sequencer_sequence_latency_ms.GetScopedLatency());
@@ -166,7 +190,15 @@ void SequenceEntries(TreeSigner* tree_signer,
       target_run_time += period;
     }
 
-    std::this_thread::sleep_for(target_run_time - now);
+    // Run again early if enough new entries come in.
+    std::this_thread::sleep_until(min(run_time + min_interval,
+                                      target_run_time));
+    if (FLAGS_sequencing_backlog_threshold > 0) {
+      store->WaitForPendingEntriesAdded(
+          num_added + FLAGS_sequencing_backlog_threshold, target_run_time);
+    } else {
+      std::this_thread::sleep_until(target_run_time);
+    }
   }
 }
 
@@ -15,9 +15,13 @@ namespace cert_trans {
 void CleanUpEntries(ConsistentStore* store,
                     const std::function<bool()>& is_master);
 
-void SequenceEntries(TreeSigner* tree_signer,
+// Runs every --sequencing_frequency_seconds, or as soon as
+// --sequencing_backlog_threshold new entries were added to |store|.
+void SequenceEntries(TreeSigner* tree_signer, ConsistentStore* store,
                      const std::function<bool()>& is_master);
 
+// Runs every --tree_signing_frequency_seconds, or as soon as the
+// sequencer has written new entries to the local database.
 void SignMerkleTree(TreeSigner* tree_signer, ConsistentStore* store,
                     ClusterStateController* controller);
 }
@@ -6,8 +6,10 @@
 #include <sstream>
 
 #include "monitoring/prometheus/exporter.h"
+#include "monitoring/zipkin/exporter.h"
 
 using std::ostringstream;
+using std::string;
 using std::strncmp;
 
 namespace cert_trans {
@@ -18,6 +20,7 @@ const char kPrometheusProtoContentType[] =
     "proto=io.prometheus.client.MetricFamily;encoding=delimited";
 const size_t kPrometheusProtoContentTypeLen =
     std::strlen(kPrometheusProtoContentType);
+const char kPrometheusTextContentType[] = "text/plain; version=0.0.4";
 
 }  // namespace
 
@@ -37,14 +40,38 @@ void ExportPrometheusMetrics(evhttp_request* req) {
     evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
                       kPrometheusProtoContentType);
     ExportMetricsToPrometheus(&oss);
-  } else {
+  } else if (req_accept && std::strstr(req_accept, "text/html")) {
     evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
                       "text/html");
     ExportMetricsToHtml(&oss);
+  } else {
+    // Prometheus scrapers not asking for protobufs, and tools like curl.
+    evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
+                      kPrometheusTextContentType);
+    ExportMetricsToPrometheusText(&oss);
+  }
+
+  const string body(oss.str());
+  evbuffer_add(evhttp_request_get_output_buffer(req), body.data(),
+               body.size());
+  evhttp_send_reply(req, HTTP_OK, /*reason*/ nullptr, /*databuf*/ nullptr);
+}
+
+
+void ExportZipkinTraces(evhttp_request* req) {
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    evhttp_send_reply(req, HTTP_BADMETHOD, /*reason*/ nullptr,
+                      /*databuf*/ nullptr);
+    return;
   }
+  ostringstream oss;
+  ExportTracesToZipkin(&oss);
+  evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
+                    "application/json");
 
-  evbuffer_add(evhttp_request_get_output_buffer(req), oss.str().data(),
-               oss.str().size());
+  const string body(oss.str());
+  evbuffer_add(evhttp_request_get_output_buffer(req), body.data(),
+               body.size());
   evhttp_send_reply(req, HTTP_OK, /*reason*/ nullptr, /*databuf*/ nullptr);
 }
 
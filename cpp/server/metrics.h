@@ -9,6 +9,10 @@ namespace cert_trans {
 void ExportPrometheusMetrics(evhttp_request* req);
 
 
+// Serves the most recent traces, as Zipkin JSON.
+void ExportZipkinTraces(evhttp_request* req);
+
+
 }  // namespace cert_trans
 
 #endif  // CERT_TRANS_SERVER_METRICS_H_
@@ -0,0 +1,176 @@
+#include "config.h"
+#include "server/pprof.h"
+
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+#ifdef HAVE_LIBPROFILER
+#include <gperftools/profiler.h>
+#endif
+#ifdef HAVE_LIBTCMALLOC
+#include <gperftools/malloc_extension.h>
+#endif
+
+#include "util/libevent_wrapper.h"
+#include "util/task.h"
+#include "util/util.h"
+
+DEFINE_string(pprof_allowed_peers, "127.0.0.1,::1",
+              "Comma-separated addresses of the peers allowed to fetch "
+              "profiles from /debugz/pprof/. If empty, the handlers are not "
+              "added at all.");
+DEFINE_int32(pprof_max_profile_seconds, 120,
+             "Longest CPU profile that /debugz/pprof/profile will take.");
+
+using std::atomic;
+using std::find;
+using std::string;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+// Not in the HTTP status codes defined by libevent.
+const int kHttpForbidden = 403;
+const char kPprofContentType[] = "application/octet-stream";
+
+
+bool CheckAllowed(evhttp_request* req) {
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    evhttp_send_error(req, HTTP_BADMETHOD, "Method not allowed.");
+    return false;
+  }
+
+  char* peer_addr;
+  ev_uint16_t peer_port;
+  evhttp_connection_get_peer(evhttp_request_get_connection(req), &peer_addr,
+                             &peer_port);
+  const vector<string> allowed(util::split(FLAGS_pprof_allowed_peers));
+  if (find(allowed.begin(), allowed.end(), peer_addr) == allowed.end()) {
+    LOG(WARNING) << "Refusing a profile to " << peer_addr;
+    evhttp_send_error(req, kHttpForbidden, "Forbidden.");
+    return false;
+  }
+
+  return true;
+}
+
+
+void SendProfile(evhttp_request* req, const string& profile) {
+  evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
+                    kPprofContentType);
+  evbuffer_add(evhttp_request_get_output_buffer(req), profile.data(),
+               profile.size());
+  evhttp_send_reply(req, HTTP_OK, /*reason*/ nullptr, /*databuf*/ nullptr);
+}
+
+
+#ifdef HAVE_LIBPROFILER
+// The profiler is process-wide, so only one CPU profile can be taken
+// at a time.
+atomic<bool> cpu_profiling(false);
+
+
+void FinishCpuProfile(evhttp_request* req, const string& file,
+                      util::Task* task) {
+  ProfilerStop();
+  cpu_profiling = false;
+
+  string profile;
+  if (!task->status().ok()) {
+    evhttp_send_error(req, HTTP_SERVUNAVAIL, "Shutting down.");
+  } else if (!util::ReadBinaryFile(file, &profile)) {
+    evhttp_send_error(req, HTTP_INTERNAL, "Could not read the profile.");
+  } else {
+    SendProfile(req, profile);
+  }
+  unlink(file.c_str());
+  delete task;
+}
+#endif
+
+
+void CpuProfile(evhttp_request* req) {
+  if (!CheckAllowed(req)) {
+    return;
+  }
+
+  // A bad request is refused as such, whether or not the profiler is
+  // linked.
+  int64_t profile_seconds(30);
+  const libevent::QueryParams query(libevent::ParseQuery(req));
+  if (query.count("seconds") > 0) {
+    profile_seconds = libevent::GetIntParam(query, "seconds");
+  }
+  if (profile_seconds <= 0 ||
+      profile_seconds > FLAGS_pprof_max_profile_seconds) {
+    evhttp_send_error(req, HTTP_BADREQUEST, "Invalid \"seconds\".");
+    return;
+  }
+
+#ifdef HAVE_LIBPROFILER
+  if (cpu_profiling.exchange(true)) {
+    evhttp_send_error(req, HTTP_SERVUNAVAIL,
+                      "Another CPU profile is being taken.");
+    return;
+  }
+  const string file(
+      util::WriteTemporaryBinaryFile("/tmp/ct-cpu-profile.XXXXXX", ""));
+  if (file.empty() || !ProfilerStart(file.c_str())) {
+    cpu_profiling = false;
+    evhttp_send_error(req, HTTP_INTERNAL, "Could not start the profiler.");
+    return;
+  }
+  LOG(INFO) << "Taking a CPU profile for " << profile_seconds << " seconds";
+
+  // Replies from the event thread of the request, without holding it up
+  // meanwhile.
+  libevent::Base* const base(libevent::Base::ForRequest(req));
+  base->Delay(std::chrono::seconds(profile_seconds),
+              new util::Task(std::bind(&FinishCpuProfile, req, file,
+                                       std::placeholders::_1),
+                             base));
+#else
+  evhttp_send_error(req, HTTP_NOTIMPLEMENTED,
+                    "Not linked with the gperftools CPU profiler.");
+#endif
+}
+
+
+void HeapProfile(evhttp_request* req) {
+  if (!CheckAllowed(req)) {
+    return;
+  }
+
+#ifdef HAVE_LIBTCMALLOC
+  string profile;
+  MallocExtension::instance()->GetHeapSample(&profile);
+  SendProfile(req, profile);
+#else
+  evhttp_send_error(req, HTTP_NOTIMPLEMENTED, "Not linked with tcmalloc.");
+#endif
+}
+
+
+}  // namespace
+
+
+void AddPprofHandlers(libevent::HttpServer* server) {
+  if (FLAGS_pprof_allowed_peers.empty()) {
+    return;
+  }
+
+  CHECK(server->AddHandler("/debugz/pprof/profile", CpuProfile));
+  CHECK(server->AddHandler("/debugz/pprof/heap", HeapProfile));
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,25 @@
+#ifndef CERT_TRANS_SERVER_PPROF_H_
+#define CERT_TRANS_SERVER_PPROF_H_
+
+namespace cert_trans {
+namespace libevent {
+class HttpServer;
+}  // namespace libevent
+
+
+// Adds handlers serving profiles of this process in the format of
+// pprof, for the peers listed in --pprof_allowed_peers (if any):
+//
+//   /debugz/pprof/profile?seconds=N  a CPU profile of the next N seconds
+//                                    (30 by default), if linked with the
+//                                    gperftools CPU profiler
+//                                    (see --with-profiler).
+//   /debugz/pprof/heap               a sample of the live allocations, if
+//                                    linked with tcmalloc and run with
+//                                    TCMALLOC_SAMPLE_PARAMETER set.
+void AddPprofHandlers(libevent::HttpServer* server);
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_PPROF_H_
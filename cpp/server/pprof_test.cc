@@ -0,0 +1,194 @@
+#include "config.h"
+#include "server/pprof.h"
+
+#include <arpa/inet.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <chrono>
+#include <memory>
+#include <string>
+
+#include "util/libevent_wrapper.h"
+#include "util/testing.h"
+
+DECLARE_string(pprof_allowed_peers);
+DECLARE_int32(pprof_max_profile_seconds);
+
+namespace cert_trans {
+
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::make_shared;
+using std::shared_ptr;
+using std::string;
+using testing::HasSubstr;
+using testing::StartsWith;
+
+namespace {
+
+const uint16_t kPort = 4452;
+
+
+// Sends a |method| request for |path| to the test server, and returns
+// the whole reply, once the server has closed the connection.
+string Fetch(const string& method, const string& path) {
+  const int fd(socket(AF_INET, SOCK_STREAM, 0));
+  PCHECK(fd >= 0);
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(kPort);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  PCHECK(connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) ==
+         0);
+  const string request(method + " " + path +
+                       " HTTP/1.1\r\nHost: localhost\r\n"
+                       "Content-Length: 0\r\nConnection: close\r\n\r\n");
+  PCHECK(write(fd, request.data(), request.size()) ==
+         static_cast<ssize_t>(request.size()));
+
+  const steady_clock::time_point deadline(steady_clock::now() +
+                                          seconds(10));
+  string received;
+  while (true) {
+    const milliseconds left(
+        duration_cast<milliseconds>(deadline - steady_clock::now()));
+    pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (left.count() <= 0 || poll(&pfd, 1, left.count()) <= 0) {
+      ADD_FAILURE() << "timed out fetching " << path;
+      break;
+    }
+    char buf[4096];
+    const ssize_t len(read(fd, buf, sizeof(buf)));
+    if (len <= 0) {
+      break;
+    }
+    received.append(buf, len);
+  }
+  close(fd);
+  return received;
+}
+
+
+string Get(const string& path) {
+  return Fetch("GET", path);
+}
+
+
+class PprofTest : public ::testing::Test {
+ protected:
+  PprofTest()
+      : base_(make_shared<libevent::Base>()),
+        event_pump_(base_),
+        server_(*base_) {
+  }
+
+  // Adds the handlers with the flags set by the test, and starts
+  // serving.
+  void Start() {
+    AddPprofHandlers(&server_);
+    server_.Bind("127.0.0.1", kPort);
+  }
+
+  google::FlagSaver saver_;
+  const shared_ptr<libevent::Base> base_;
+  libevent::EventPumpThread event_pump_;
+  libevent::HttpServer server_;
+};
+
+
+TEST_F(PprofTest, NoHandlersWithoutAllowedPeers) {
+  FLAGS_pprof_allowed_peers = "";
+  Start();
+
+  EXPECT_THAT(Get("/debugz/pprof/profile"), StartsWith("HTTP/1.1 404"));
+  EXPECT_THAT(Get("/debugz/pprof/heap"), StartsWith("HTTP/1.1 404"));
+}
+
+
+TEST_F(PprofTest, RefusesOtherPeers) {
+  FLAGS_pprof_allowed_peers = "192.0.2.1,::1";
+  Start();
+
+  EXPECT_THAT(Get("/debugz/pprof/profile?seconds=1"),
+              StartsWith("HTTP/1.1 403"));
+  EXPECT_THAT(Get("/debugz/pprof/heap"), StartsWith("HTTP/1.1 403"));
+}
+
+
+TEST_F(PprofTest, RefusesOtherMethods) {
+  Start();
+
+  EXPECT_THAT(Fetch("POST", "/debugz/pprof/profile?seconds=1"),
+              StartsWith("HTTP/1.1 405"));
+  EXPECT_THAT(Fetch("POST", "/debugz/pprof/heap"),
+              StartsWith("HTTP/1.1 405"));
+}
+
+
+TEST_F(PprofTest, RejectsBadSeconds) {
+  FLAGS_pprof_max_profile_seconds = 10;
+  Start();
+
+  for (const string& value : {"0", "-1", "abc", "11", "99999999999"}) {
+    EXPECT_THAT(Get("/debugz/pprof/profile?seconds=" + value),
+                StartsWith("HTTP/1.1 400"))
+        << value;
+  }
+}
+
+
+#ifdef HAVE_LIBPROFILER
+TEST_F(PprofTest, TakesCpuProfile) {
+  Start();
+
+  const string reply(Get("/debugz/pprof/profile?seconds=1"));
+  EXPECT_THAT(reply, StartsWith("HTTP/1.1 200"));
+  EXPECT_THAT(reply, HasSubstr("Content-Type: application/octet-stream\r\n"));
+}
+#else
+TEST_F(PprofTest, CpuProfilerNotLinked) {
+  Start();
+
+  EXPECT_THAT(Get("/debugz/pprof/profile?seconds=1"),
+              StartsWith("HTTP/1.1 501"));
+}
+#endif
+
+
+#ifdef HAVE_LIBTCMALLOC
+TEST_F(PprofTest, TakesHeapProfile) {
+  Start();
+
+  const string reply(Get("/debugz/pprof/heap"));
+  EXPECT_THAT(reply, StartsWith("HTTP/1.1 200"));
+  EXPECT_THAT(reply, HasSubstr("Content-Type: application/octet-stream\r\n"));
+}
+#else
+TEST_F(PprofTest, TcmallocNotLinked) {
+  Start();
+
+  EXPECT_THAT(Get("/debugz/pprof/heap"), StartsWith("HTTP/1.1 501"));
+}
+#endif
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
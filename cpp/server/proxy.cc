@@ -4,8 +4,14 @@
 #include <event2/http.h>
 #include <event2/http_compat.h>
 #include <event2/keyvalq_struct.h>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_set>
 #include <vector>
@@ -15,17 +21,38 @@
 #include "server/json_output.h"
 #include "util/libevent_wrapper.h"
 
+DEFINE_int32(proxy_max_buffered_bytes, 4 << 20,
+             "Most bytes of a proxied response held in memory, waiting "
+             "to be written to the client, before reading from the node "
+             "it came from is paused.");
+DEFINE_int32(proxy_get_entries_affinity_span, 256,
+             "Number of entries in the ranges of get-entries requests "
+             "which are proxied to the same node, to make the most of its "
+             "caches (0 to spread them like other requests). Works best as "
+             "a multiple of --get_entries_cache_tile_size.");
 
 using ct::ClusterNodeState;
+using std::atomic;
 using std::bind;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::steady_clock;
+using std::enable_shared_from_this;
+using std::function;
 using std::getline;
+using std::lock_guard;
 using std::make_pair;
+using std::make_shared;
+using std::map;
+using std::max;
+using std::mutex;
 using std::pair;
 using std::placeholders::_1;
+using std::shared_ptr;
 using std::rand;
 using std::string;
 using std::stringstream;
-using std::unique_ptr;
+using std::to_string;
 using std::unordered_set;
 using std::vector;
 using util::Executor;
@@ -34,6 +61,13 @@ using util::Task;
 namespace cert_trans {
 namespace {
 
+// A node gets a get-entries request for its range unless it is this
+// many times as loaded as the one it would otherwise go to.
+const int64_t kAffinityMaxLoadRatio = 2;
+// Failed requests count as taking at least this long, to steer
+// requests away from failing nodes.
+const int64_t kFailureLatencyMicros = 1000000;
+
 
 static Counter<string>* total_proxied_requests(
     Counter<string>::New("total_proxied_requests", "path",
@@ -44,45 +78,281 @@ static Counter<string, int>* total_proxied_responses(
                               "and status code."));
 
 
-void ProxyRequestDone(libevent::Base* base, evhttp_request* request,
-                      const string& path, UrlFetcher::Response* response,
-                      Task* task) {
-  CHECK_NOTNULL(request);
-  CHECK_NOTNULL(task);
-  unique_ptr<UrlFetcher::Response> response_deleter(CHECK_NOTNULL(response));
-
-  total_proxied_requests->Increment(path);
-  total_proxied_responses->Increment(path, response->status_code);
+// Streams a response from another node to the client as it arrives.
+// The chunks of the body are passed on by reference, and are only
+// released once written out to the client, so that at most about
+// --proxy_max_buffered_bytes of them are held at any time.
+//
+// The UrlFetcher callbacks come in on its event thread, while
+// everything touching |request_| is done on the event thread of the
+// request.
+class ProxiedResponse : public enable_shared_from_this<ProxiedResponse> {
+ public:
+  // |done| is called with whether the fetch went well, on the
+  // executor of the fetch.
+  ProxiedResponse(libevent::Base* base, evhttp_request* request,
+                  const string& path, const function<void(bool)>& done)
+      : base_(CHECK_NOTNULL(base)),
+        request_(CHECK_NOTNULL(request)),
+        request_base_(libevent::Base::ForRequest(request)),
+        path_(path),
+        done_(done),
+        buffered_(0),
+        headers_sent_(false) {
+  }
 
-  if (!task->status().ok()) {
-    return SendJsonError(base, request, HTTP_INTERNAL,
-                         "Proxied request failed.");
+  UrlFetcher::Response* response() {
+    return &response_;
   }
 
+  // Sets up the streaming callbacks of response(), which then keep
+  // this object alive until the fetch is done.
+  void Start();
+
+  // The done callback of the fetch.
+  void Done(Task* task);
+
+ private:
+  // A chunk of the body, which is moved rather than copied into the
+  // output of |request_|, and released as that gets written out.
+  struct Chunk {
+    evbuffer* data;
+    size_t length;
+    int references;
+    shared_ptr<ProxiedResponse> owner;
+  };
+
+  static void ChunkWritten(const void* data, size_t length, void* extra);
+
+  void OnHeaders();
+  bool OnBody(evbuffer* data, const function<void()>& resume);
+  void SendChunk(evbuffer* chunk);
+  void Written(size_t length);
+  void Finish(bool ok);
+
+  libevent::Base* const base_;
+  evhttp_request* const request_;
+  libevent::Base* const request_base_;
+  const string path_;
+  const function<void(bool)> done_;
+  UrlFetcher::Response response_;
+
+  mutex lock_;
+  size_t buffered_;
+  function<void()> resume_;
+
+  // Only accessed on |request_base_|.
+  bool headers_sent_;
+
+  DISALLOW_COPY_AND_ASSIGN(ProxiedResponse);
+};
+
+
+void ProxiedResponse::Start() {
+  const shared_ptr<ProxiedResponse> self(shared_from_this());
+  response_.on_headers = [self]() { self->OnHeaders(); };
+  response_.on_body = [self](evbuffer* data, const function<void()>& resume) {
+    return self->OnBody(data, resume);
+  };
+}
+
+
+void ProxiedResponse::OnHeaders() {
   // TODO(alcutter): Consider retrying the proxied request some number of times
   // in the case where the request fails.
-  FilterHeaders(&response->headers);
-  for (auto it(response->headers.begin()); it != response->headers.end();
-       ++it) {
-    CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(request),
-                               it->first.c_str(), it->second.c_str()),
-             0);
-  }
-  CHECK_GT(evbuffer_add_printf(evhttp_request_get_output_buffer(request), "%s",
-                               response->body.c_str()),
-           -1);
-
-  const int response_code(response->status_code);
-  base->Add([request, response_code]() {
-    evhttp_send_reply(request, response_code, /*reason*/ NULL,
-                      /*databuf*/ NULL);
+  UrlFetcher::Headers headers(response_.headers);
+  FilterHeaders(&headers);
+  // The fetcher has already undone any chunking, and evhttp redoes
+  // it as needed when there is no Content-Length.
+  headers.erase("Transfer-Encoding");
+  const int status_code(response_.status_code);
+  const shared_ptr<ProxiedResponse> self(shared_from_this());
+  request_base_->Add([self, headers, status_code]() {
+    for (const auto& header : headers) {
+      CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(
+                                     self->request_),
+                                 header.first.c_str(), header.second.c_str()),
+               0);
+    }
+    evhttp_send_reply_start(self->request_, status_code, /*reason*/ NULL);
+    self->headers_sent_ = true;
   });
 }
 
 
+bool ProxiedResponse::OnBody(evbuffer* data, const function<void()>& resume) {
+  const size_t length(evbuffer_get_length(data));
+  if (length == 0) {
+    return true;
+  }
+
+  Chunk* const chunk(new Chunk);
+  chunk->data = CHECK_NOTNULL(evbuffer_new());
+  CHECK_EQ(0, evbuffer_add_buffer(chunk->data, data));
+  chunk->length = length;
+  chunk->owner = shared_from_this();
+
+  const int num_extents(evbuffer_peek(chunk->data, -1, NULL, NULL, 0));
+  vector<evbuffer_iovec> extents(num_extents);
+  CHECK_EQ(num_extents, evbuffer_peek(chunk->data, -1, NULL, extents.data(),
+                                      extents.size()));
+  chunk->references = num_extents;
+  evbuffer* const out(CHECK_NOTNULL(evbuffer_new()));
+  for (const evbuffer_iovec& extent : extents) {
+    CHECK_EQ(0, evbuffer_add_reference(out, extent.iov_base, extent.iov_len,
+                                       &ChunkWritten, chunk));
+  }
+
+  bool keep_reading;
+  {
+    lock_guard<mutex> lock(lock_);
+    buffered_ += length;
+    keep_reading = buffered_ <
+                   static_cast<size_t>(FLAGS_proxy_max_buffered_bytes);
+    if (!keep_reading) {
+      resume_ = resume;
+    }
+  }
+
+  const shared_ptr<ProxiedResponse> self(shared_from_this());
+  request_base_->Add([self, out]() { self->SendChunk(out); });
+
+  return keep_reading;
+}
+
+
+void ProxiedResponse::SendChunk(evbuffer* chunk) {
+  // This only moves the references into the output of the request,
+  // and frees those left behind if the client has gone away.
+  evhttp_send_reply_chunk(request_, chunk);
+  evbuffer_free(chunk);
+}
+
+
+// static
+void ProxiedResponse::ChunkWritten(const void* data, size_t length,
+                                   void* extra) {
+  Chunk* const chunk(static_cast<Chunk*>(extra));
+  if (--chunk->references > 0) {
+    return;
+  }
+  evbuffer_free(chunk->data);
+  chunk->owner->Written(chunk->length);
+  delete chunk;
+}
+
+
+void ProxiedResponse::Written(size_t length) {
+  function<void()> resume;
+  {
+    lock_guard<mutex> lock(lock_);
+    CHECK_GE(buffered_, length);
+    buffered_ -= length;
+    if (resume_ && buffered_ <= static_cast<size_t>(
+                                    FLAGS_proxy_max_buffered_bytes / 2)) {
+      resume.swap(resume_);
+    }
+  }
+  if (resume) {
+    resume();
+  }
+}
+
+
+void ProxiedResponse::Done(Task* task) {
+  // Deleting |task| and the callbacks drops the other references.
+  const shared_ptr<ProxiedResponse> self(shared_from_this());
+  const bool ok(task->status().ok());
+  if (!ok) {
+    LOG(WARNING) << "Proxied request for " << path_
+                 << " failed: " << task->status();
+  }
+  total_proxied_requests->Increment(path_);
+  total_proxied_responses->Increment(path_, response_.status_code);
+  done_(ok);
+  delete task;
+  response_.on_headers = nullptr;
+  response_.on_body = nullptr;
+
+  // Queued after any chunk the fetcher handed over.
+  request_base_->Add([self, ok]() { self->Finish(ok); });
+}
+
+
+void ProxiedResponse::Finish(bool ok) {
+  if (!headers_sent_) {
+    return SendJsonError(base_, request_, HTTP_INTERNAL,
+                         "Proxied request failed.");
+  }
+  evhttp_connection* const conn(evhttp_request_get_connection(request_));
+  if (!ok && conn) {
+    // Ending the reply normally would have a truncated chunked body
+    // look complete to the client.
+    return evhttp_connection_free(conn);
+  }
+  // If the client has gone away, this frees |request_|.
+  evhttp_send_reply_end(request_);
+}
+
+
+bool IsGetEntries(const string& path) {
+  static const string kGetEntries("/get-entries");
+  return path.size() >= kGetEntries.size() &&
+         path.compare(path.size() - kGetEntries.size(), kGetEntries.size(),
+                      kGetEntries) == 0;
+}
+
+
 }  // namespace
 
 
+// A node requests can be proxied to, and how loaded it looks from
+// here. Shared by the successive routing tables, as long as the node
+// stays fresh.
+struct Proxy::Target {
+  Target(const string& host, int port, int64_t initial_latency_micros)
+      : hostname(host),
+        log_port(port),
+        key(host + ":" + to_string(port)),
+        in_flight(0),
+        latency_micros(initial_latency_micros) {
+  }
+
+  // Lower is better.
+  int64_t Load() const {
+    return (in_flight + 1) * max<int64_t>(latency_micros, 1);
+  }
+
+  void Done(bool ok, steady_clock::duration elapsed) {
+    --in_flight;
+    int64_t sample(duration_cast<microseconds>(elapsed).count());
+    if (!ok) {
+      sample = max(sample, kFailureLatencyMicros);
+    }
+    // An exponentially weighted moving average. Updates racing each
+    // other can get lost, which only makes it a little less accurate.
+    const int64_t previous(latency_micros);
+    latency_micros =
+        previous == 0 ? sample : previous + (sample - previous) / 8;
+  }
+
+  const string hostname;
+  const int log_port;
+  const string key;
+  atomic<int64_t> in_flight;
+  atomic<int64_t> latency_micros;
+
+  DISALLOW_COPY_AND_ASSIGN(Target);
+};
+
+
+struct Proxy::Routes {
+  // The snapshot this was built from.
+  shared_ptr<const vector<ClusterNodeState>> fresh_nodes;
+  vector<shared_ptr<Target>> targets;
+};
+
+
 // Filters out any headers which should not be proxied on.
 // See http://www.w3.org/Protocols/rfc2616/rfc2616-sec14.html#sec14.10
 void FilterHeaders(UrlFetcher::Headers* headers) {
@@ -122,20 +392,110 @@ Proxy::Proxy(libevent::Base* base,
 }
 
 
+shared_ptr<const Proxy::Routes> Proxy::GetRoutes() const {
+  const shared_ptr<const vector<ClusterNodeState>> fresh_nodes(
+      get_fresh_nodes_());
+  lock_guard<mutex> lock(lock_);
+  if (routes_ && routes_->fresh_nodes == fresh_nodes) {
+    return routes_;
+  }
+
+  // Nodes which stay fresh keep their load, and new ones start off
+  // with the average response time, so as not to be swamped.
+  map<string, shared_ptr<Target>> previous;
+  int64_t average_latency_micros(0);
+  if (routes_ && !routes_->targets.empty()) {
+    for (const auto& target : routes_->targets) {
+      previous.emplace(target->key, target);
+      average_latency_micros += target->latency_micros;
+    }
+    average_latency_micros /= routes_->targets.size();
+  }
+
+  const shared_ptr<Routes> routes(make_shared<Routes>());
+  routes->fresh_nodes = fresh_nodes;
+  if (fresh_nodes) {
+    routes->targets.reserve(fresh_nodes->size());
+    for (const ClusterNodeState& node : *fresh_nodes) {
+      const auto it(
+          previous.find(node.hostname() + ":" + to_string(node.log_port())));
+      routes->targets.emplace_back(
+          it != previous.end()
+              ? it->second
+              : make_shared<Target>(node.hostname(), node.log_port(),
+                                    average_latency_micros));
+    }
+  }
+  VLOG(1) << "Rebuilt the proxy routes, " << routes->targets.size()
+          << " fresh nodes";
+  routes_ = routes;
+
+  return routes_;
+}
+
+
+shared_ptr<Proxy::Target> Proxy::PickTarget(const Routes& routes,
+                                            const string& path,
+                                            evhttp_request* req) const {
+  const vector<shared_ptr<Target>>& targets(routes.targets);
+  if (targets.size() <= 1) {
+    return targets.empty() ? nullptr : targets[0];
+  }
+
+  // The power of two choices.
+  const size_t first(rand() % targets.size());
+  size_t second(rand() % (targets.size() - 1));
+  if (second >= first) {
+    ++second;
+  }
+  const shared_ptr<Target>& least_loaded(
+      targets[first]->Load() <= targets[second]->Load() ? targets[first]
+                                                          : targets[second]);
+
+  if (FLAGS_proxy_get_entries_affinity_span <= 0 || !IsGetEntries(path)) {
+    return least_loaded;
+  }
+  const int64_t start(
+      libevent::GetIntParam(libevent::ParseQuery(req), "start"));
+  if (start < 0) {
+    return least_loaded;
+  }
+
+  // Rendezvous hashing, so that only the ranges of the nodes which
+  // come and go move around.
+  const string span(
+      to_string(start / FLAGS_proxy_get_entries_affinity_span));
+  const std::hash<string> hasher;
+  const shared_ptr<Target>* preferred(nullptr);
+  size_t preferred_score(0);
+  for (const auto& target : targets) {
+    const size_t score(hasher(target->key + "/" + span));
+    if (!preferred || score > preferred_score) {
+      preferred = &target;
+      preferred_score = score;
+    }
+  }
+
+  return (*preferred)->Load() <= kAffinityMaxLoadRatio * least_loaded->Load()
+             ? *preferred
+             : least_loaded;
+}
+
+
 void Proxy::ProxyRequest(evhttp_request* req) const {
   CHECK_NOTNULL(req);
 
-  const vector<ClusterNodeState> fresh_nodes(get_fresh_nodes_());
-  if (fresh_nodes.empty()) {
+  URL url(evhttp_request_uri(req));
+  const shared_ptr<const Routes> routes(GetRoutes());
+  const shared_ptr<Target> target(PickTarget(*routes, url.Path(), req));
+  if (!target) {
     return SendJsonError(base_, req, HTTP_SERVUNAVAIL,
                          "No node able to serve request.");
   }
-  const ClusterNodeState& target(fresh_nodes[rand() % fresh_nodes.size()]);
 
-  URL url(evhttp_request_uri(req));
   url.SetProtocol("http");
-  url.SetHost(target.hostname());
-  url.SetPort(target.log_port());
+  url.SetHost(target->hostname);
+  url.SetPort(target->log_port);
 
   UrlFetcher::Request fetcher_req(url);
 
@@ -176,10 +536,16 @@ void Proxy::ProxyRequest(evhttp_request* req) const {
   }
   VLOG(1) << "Proxying request to " << url.Host() << ":" << url.Port()
           << url.PathQuery();
-  UrlFetcher::Response* resp(new UrlFetcher::Response);
-  fetcher_->Fetch(fetcher_req, resp, new Task(bind(&ProxyRequestDone, base_,
-                                                   req, url.Path(), resp, _1),
-                                              executor_));
+  ++target->in_flight;
+  const steady_clock::time_point started(steady_clock::now());
+  const shared_ptr<ProxiedResponse> proxied(make_shared<ProxiedResponse>(
+      base_, req, url.Path(), [target, started](bool ok) {
+        target->Done(ok, steady_clock::now() - started);
+      }));
+  proxied->Start();
+  fetcher_->Fetch(fetcher_req, proxied->response(),
+                  new Task(bind(&ProxiedResponse::Done, proxied, _1),
+                           executor_));
 }
 
 
@@ -2,6 +2,9 @@
 #define CERT_TRANS_SERVER_PROXY_H_
 
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <vector>
 
 #include "base/macros.h"
@@ -31,9 +34,19 @@ class Base;
 void FilterHeaders(UrlFetcher::Headers* headers);
 
 
+// Proxies requests to the other nodes of the cluster which are fresh.
+//
+// The routing table is only rebuilt when the list of fresh nodes
+// changes, which is detected by the identity of the snapshot returned
+// by the GetFreshNodesFunction. Each request goes to the less loaded
+// of two randomly picked nodes (by requests in flight and average
+// response time), except for get-entries, which go to the node a
+// range of entries is assigned to, to make the most of its caches, as
+// long as it is not much more loaded than that.
 class Proxy {
  public:
-  typedef std::function<std::vector<ct::ClusterNodeState>()>
+  typedef std::function<
+      std::shared_ptr<const std::vector<ct::ClusterNodeState>>()>
       GetFreshNodesFunction;
   Proxy(libevent::Base* base, const GetFreshNodesFunction& get_fresh_nodes,
         UrlFetcher* fetcher, util::Executor* executor);
@@ -43,11 +56,22 @@ class Proxy {
   virtual void ProxyRequest(evhttp_request* req) const;
 
  private:
+  struct Target;
+  struct Routes;
+
+  std::shared_ptr<const Routes> GetRoutes() const;
+  std::shared_ptr<Target> PickTarget(const Routes& routes,
+                                     const std::string& path,
+                                     evhttp_request* req) const;
+
   libevent::Base* const base_;
   const GetFreshNodesFunction get_fresh_nodes_;
   UrlFetcher* const fetcher_;
   util::Executor* const executor_;
 
+  mutable std::mutex lock_;
+  mutable std::shared_ptr<const Routes> routes_;
+
   DISALLOW_COPY_AND_ASSIGN(Proxy);
 };
 
@@ -1,15 +1,55 @@
 #include "server/proxy.h"
 
+#include <arpa/inet.h>
+#include <event2/http.h>
+#include <glog/logging.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
+#include "base/notification.h"
+#include "proto/ct.pb.h"
+#include "util/libevent_wrapper.h"
 #include "util/testing.h"
+#include "util/thread_pool.h"
 
 using cert_trans::FilterHeaders;
+using cert_trans::Notification;
+using cert_trans::Proxy;
+using cert_trans::ThreadPool;
 using cert_trans::UrlFetcher;
+using ct::ClusterNodeState;
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::function;
+using std::lock_guard;
 using std::make_pair;
+using std::make_shared;
+using std::mutex;
 using std::shared_ptr;
 using std::string;
+using std::thread;
+using std::vector;
+using testing::HasSubstr;
+using testing::Not;
+
+namespace libevent = cert_trans::libevent;
+
+const uint16_t kProxyPort = 4452;
+const uint16_t kNodePort = 4453;
 
 class ProxyTest : public ::testing::Test {};
 
@@ -98,6 +138,241 @@ TEST_F(ProxyTest, TestFilterHeadersHandlesMultipleConnectionHeaders) {
 }
 
 
+// Writes all of |data| to |fd|.
+void Send(int fd, const string& data) {
+  PCHECK(write(fd, data.data(), data.size()) ==
+         static_cast<ssize_t>(data.size()));
+}
+
+
+// Sends a GET request for |path| to the proxy, and returns the socket
+// to read the reply from.
+int SendGet(const string& path) {
+  const int fd(socket(AF_INET, SOCK_STREAM, 0));
+  PCHECK(fd >= 0);
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(kProxyPort);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  PCHECK(connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) ==
+         0);
+  Send(fd, "GET " + path + " HTTP/1.1\r\nHost: localhost\r\n\r\n");
+  return fd;
+}
+
+
+// Reads from |fd| until |expected| has been received, the connection
+// is closed, or |timeout| passes, and returns all that was read.
+// |closed| is set to whether the connection was closed.
+string ReadUntil(int fd, const string& expected, milliseconds timeout,
+                 bool* closed = nullptr) {
+  const steady_clock::time_point deadline(steady_clock::now() + timeout);
+  string received;
+  if (closed) {
+    *closed = false;
+  }
+  while (received.find(expected) == string::npos) {
+    const milliseconds left(
+        duration_cast<milliseconds>(deadline - steady_clock::now()));
+    pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (left.count() <= 0 || poll(&pfd, 1, left.count()) <= 0) {
+      break;
+    }
+    char buf[4096];
+    const ssize_t len(read(fd, buf, sizeof(buf)));
+    if (len <= 0) {
+      if (closed) {
+        *closed = true;
+      }
+      break;
+    }
+    received.append(buf, len);
+  }
+  return received;
+}
+
+
+// Stands in for the node requests are proxied to, answering each
+// request on a new thread with |reply|, which writes the response to
+// the socket by hand, and returns whether to keep the connection open.
+class FakeNode {
+ public:
+  typedef function<bool(int fd)> Reply;
+
+  explicit FakeNode(const Reply& reply)
+      : reply_(reply),
+        listen_fd_(socket(AF_INET, SOCK_STREAM, 0)),
+        stopping_(false) {
+    PCHECK(listen_fd_ >= 0);
+    const int one(1);
+    PCHECK(setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one,
+                      sizeof(one)) == 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kNodePort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    PCHECK(bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr),
+                sizeof(addr)) == 0);
+    PCHECK(listen(listen_fd_, 10) == 0);
+    accept_thread_ = thread(&FakeNode::AcceptLoop, this);
+  }
+
+  ~FakeNode() {
+    {
+      lock_guard<mutex> lock(lock_);
+      stopping_ = true;
+      // Wakes up the threads blocked on them.
+      shutdown(listen_fd_, SHUT_RDWR);
+      for (int fd : fds_) {
+        shutdown(fd, SHUT_RDWR);
+      }
+    }
+    accept_thread_.join();
+    // No more get added once the accept thread is done.
+    for (thread& connection_thread : connection_threads_) {
+      connection_thread.join();
+    }
+    for (int fd : fds_) {
+      close(fd);
+    }
+    close(listen_fd_);
+  }
+
+ private:
+  void AcceptLoop() {
+    while (true) {
+      const int fd(accept(listen_fd_, nullptr, nullptr));
+      if (fd < 0) {
+        return;
+      }
+      lock_guard<mutex> lock(lock_);
+      if (stopping_) {
+        close(fd);
+        return;
+      }
+      fds_.push_back(fd);
+      connection_threads_.emplace_back(&FakeNode::Serve, this, fd);
+    }
+  }
+
+  void Serve(int fd) {
+    string received;
+    while (true) {
+      size_t end;
+      while ((end = received.find("\r\n\r\n")) == string::npos) {
+        char buf[4096];
+        const ssize_t len(read(fd, buf, sizeof(buf)));
+        if (len <= 0) {
+          return;
+        }
+        received.append(buf, len);
+      }
+      received.erase(0, end + 4);
+      if (!reply_(fd)) {
+        // Closed for good by the destructor.
+        shutdown(fd, SHUT_RDWR);
+        return;
+      }
+    }
+  }
+
+  const Reply reply_;
+  const int listen_fd_;
+  thread accept_thread_;
+
+  mutex lock_;
+  bool stopping_;
+  vector<int> fds_;
+  vector<thread> connection_threads_;
+};
+
+
+// Proxies requests for /ct/v1/get-sth to a FakeNode.
+class ProxyStreamingTest : public ::testing::Test {
+ protected:
+  ProxyStreamingTest()
+      : base_(make_shared<libevent::Base>()),
+        event_pump_(base_),
+        fetcher_(base_.get(), &pool_),
+        nodes_(make_shared<vector<ClusterNodeState>>(1)),
+        proxy_(base_.get(), [this]() { return nodes_; }, &fetcher_, &pool_),
+        server_(*base_) {
+    (*nodes_)[0].set_hostname("127.0.0.1");
+    (*nodes_)[0].set_log_port(kNodePort);
+    CHECK(server_.AddHandler("/ct/v1/get-sth", [this](evhttp_request* req) {
+      proxy_.ProxyRequest(req);
+    }));
+    server_.Bind("127.0.0.1", kProxyPort);
+  }
+
+  ThreadPool pool_;
+  const shared_ptr<libevent::Base> base_;
+  libevent::EventPumpThread event_pump_;
+  UrlFetcher fetcher_;
+  const shared_ptr<vector<ClusterNodeState>> nodes_;
+  Proxy proxy_;
+  libevent::HttpServer server_;
+};
+
+
+TEST_F(ProxyStreamingTest, StreamsReplyEndToEnd) {
+  Notification first_received;
+  FakeNode node([&first_received](int fd) {
+    Send(fd,
+         "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n"
+         "Content-Type: text/plain\r\n\r\n"
+         "5\r\nfirst\r\n");
+    // The rest only goes out once the client got the beginning.
+    first_received.WaitForNotificationWithTimeout(seconds(5));
+    Send(fd, "6\r\nsecond\r\n0\r\n\r\n");
+    return true;
+  });
+
+  const int fd(SendGet("/ct/v1/get-sth"));
+  string reply(ReadUntil(fd, "first", seconds(5)));
+  EXPECT_THAT(reply, HasSubstr("200 OK"));
+  EXPECT_THAT(reply, HasSubstr("text/plain"));
+  EXPECT_THAT(reply, HasSubstr("first"));
+  EXPECT_THAT(reply, Not(HasSubstr("second")));
+  first_received.Notify();
+
+  bool closed;
+  reply += ReadUntil(fd, "\r\n0\r\n\r\n", seconds(5), &closed);
+  EXPECT_THAT(reply, HasSubstr("second"));
+  // Re-chunked by the proxy, and ended normally.
+  EXPECT_THAT(reply, HasSubstr("Transfer-Encoding: chunked"));
+  EXPECT_THAT(reply, HasSubstr("\r\n0\r\n\r\n"));
+  EXPECT_FALSE(closed);
+  close(fd);
+}
+
+
+TEST_F(ProxyStreamingTest, NodeFailureMidBodyClosesClientConnection) {
+  FakeNode node([](int fd) {
+    Send(fd,
+         "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+         "5\r\nfirst\r\n");
+    // Gone before the end of the body.
+    return false;
+  });
+
+  const int fd(SendGet("/ct/v1/get-sth"));
+  bool closed;
+  const string reply(ReadUntil(fd, "\r\n0\r\n\r\n", seconds(5), &closed));
+  EXPECT_THAT(reply, HasSubstr("200 OK"));
+  EXPECT_THAT(reply, HasSubstr("first"));
+  // Rather than a last chunk, which would have the truncated body look
+  // complete.
+  EXPECT_THAT(reply, Not(HasSubstr("\r\n0\r\n\r\n")));
+  EXPECT_TRUE(closed);
+  close(fd);
+}
+
+
 int main(int argc, char** argv) {
   cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
   return RUN_ALL_TESTS();
@@ -0,0 +1,70 @@
+#include "server/rate_limiter.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+
+using std::chrono::duration;
+using std::lock_guard;
+using std::max;
+using std::min;
+using std::mutex;
+using std::string;
+
+namespace cert_trans {
+
+
+RateLimiter::RateLimiter(double rate, double burst, size_t max_clients)
+    : rate_(rate), burst_(max(burst, 1.0)), max_clients_(max_clients) {
+  CHECK_GE(rate_, 0);
+  CHECK_GT(max_clients_, 0U);
+}
+
+
+RateLimiter::~RateLimiter() {
+}
+
+
+bool RateLimiter::Allow(const string& client) {
+  return Allow(client, clock::now());
+}
+
+
+bool RateLimiter::Allow(const string& client, clock::time_point now) {
+  if (rate_ == 0) {
+    return true;
+  }
+
+  lock_guard<mutex> lock(lock_);
+  auto it(buckets_.find(client));
+  if (it == buckets_.end()) {
+    lru_.push_front(client);
+    it = buckets_.emplace(client, Bucket{burst_, now, lru_.begin()}).first;
+    while (buckets_.size() > max_clients_) {
+      buckets_.erase(lru_.back());
+      lru_.pop_back();
+    }
+  } else {
+    lru_.splice(lru_.begin(), lru_, it->second.lru_position);
+  }
+
+  Bucket& bucket(it->second);
+  if (now > bucket.updated) {
+    const duration<double> elapsed(now - bucket.updated);
+    bucket.tokens = min(burst_, bucket.tokens + elapsed.count() * rate_);
+    bucket.updated = now;
+  }
+  if (bucket.tokens < 1) {
+    return false;
+  }
+  bucket.tokens -= 1;
+  return true;
+}
+
+
+size_t RateLimiter::size() const {
+  lock_guard<mutex> lock(lock_);
+  return buckets_.size();
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,65 @@
+#ifndef CERT_TRANS_SERVER_RATE_LIMITER_H_
+#define CERT_TRANS_SERVER_RATE_LIMITER_H_
+
+#include <stddef.h>
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "base/macros.h"
+
+namespace cert_trans {
+
+
+// Limits the rate of the requests of every client (by whatever
+// identifies it, such as its address), with a token bucket each:
+// a client can send |burst| requests at once, and |rate| per second
+// after that, so that a single one cannot take all the threads of
+// the pool for itself.
+//
+// Only the |max_clients| clients seen most recently are remembered,
+// the others starting over with a full bucket.
+//
+// This class is thread-safe.
+class RateLimiter {
+ public:
+  typedef std::chrono::steady_clock clock;
+
+  // A |rate| of 0 lets everything through.
+  RateLimiter(double rate, double burst, size_t max_clients);
+  ~RateLimiter();
+
+  // Whether the next request of |client| can go through now, taking a
+  // token from its bucket if so.
+  bool Allow(const std::string& client);
+  // The same, at |now|.
+  bool Allow(const std::string& client, clock::time_point now);
+
+  // The number of clients remembered.
+  size_t size() const;
+
+ private:
+  struct Bucket {
+    double tokens;
+    clock::time_point updated;
+    std::list<std::string>::iterator lru_position;
+  };
+
+  const double rate_;
+  const double burst_;
+  const size_t max_clients_;
+
+  mutable std::mutex lock_;
+  // Clients, most recently seen first.
+  std::list<std::string> lru_;
+  std::unordered_map<std::string, Bucket> buckets_;
+
+  DISALLOW_COPY_AND_ASSIGN(RateLimiter);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_RATE_LIMITER_H_
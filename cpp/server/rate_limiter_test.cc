@@ -0,0 +1,88 @@
+#include "server/rate_limiter.h"
+
+#include <gtest/gtest.h>
+#include <string>
+
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::to_string;
+
+
+class RateLimiterTest : public ::testing::Test {
+ protected:
+  RateLimiterTest() : start_(RateLimiter::clock::now()) {
+  }
+
+  const RateLimiter::clock::time_point start_;
+};
+
+
+TEST_F(RateLimiterTest, Unlimited) {
+  RateLimiter limiter(0, 1, 10);
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_TRUE(limiter.Allow("client", start_));
+  }
+  EXPECT_EQ(0U, limiter.size());
+}
+
+
+TEST_F(RateLimiterTest, BurstThenRate) {
+  RateLimiter limiter(10, 5, 10);
+  for (int i = 0; i < 5; ++i) {
+    EXPECT_TRUE(limiter.Allow("client", start_)) << i;
+  }
+  EXPECT_FALSE(limiter.Allow("client", start_));
+
+  // One more token every 100ms.
+  EXPECT_FALSE(limiter.Allow("client", start_ + milliseconds(50)));
+  EXPECT_TRUE(limiter.Allow("client", start_ + milliseconds(100)));
+  EXPECT_FALSE(limiter.Allow("client", start_ + milliseconds(100)));
+
+  // Never more than the burst, however long the client was idle.
+  const RateLimiter::clock::time_point later(start_ + seconds(60));
+  for (int i = 0; i < 5; ++i) {
+    EXPECT_TRUE(limiter.Allow("client", later)) << i;
+  }
+  EXPECT_FALSE(limiter.Allow("client", later));
+}
+
+
+TEST_F(RateLimiterTest, ClientsAreSeparate) {
+  RateLimiter limiter(1, 1, 10);
+  EXPECT_TRUE(limiter.Allow("one", start_));
+  EXPECT_FALSE(limiter.Allow("one", start_));
+  EXPECT_TRUE(limiter.Allow("two", start_));
+  EXPECT_FALSE(limiter.Allow("two", start_));
+  EXPECT_EQ(2U, limiter.size());
+}
+
+
+TEST_F(RateLimiterTest, ForgetsLeastRecentlySeen) {
+  RateLimiter limiter(1, 1, 3);
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_TRUE(limiter.Allow(to_string(i), start_));
+  }
+  // Seen again, so "1" is now the least recently seen.
+  EXPECT_FALSE(limiter.Allow("0", start_));
+  EXPECT_TRUE(limiter.Allow("3", start_));
+  EXPECT_EQ(3U, limiter.size());
+
+  EXPECT_FALSE(limiter.Allow("0", start_));
+  EXPECT_TRUE(limiter.Allow("1", start_));
+  EXPECT_FALSE(limiter.Allow("3", start_));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
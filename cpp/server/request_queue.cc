@@ -0,0 +1,109 @@
+#include "server/request_queue.h"
+
+#include <glog/logging.h>
+#include <functional>
+
+#include "monitoring/latency.h"
+#include "monitoring/monitoring.h"
+#include "util/thread_pool.h"
+
+using std::bind;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::function;
+using std::lock_guard;
+using std::move;
+using std::mutex;
+using std::string;
+
+namespace cert_trans {
+namespace {
+
+
+static Gauge<string>* http_queued_requests(
+    Gauge<string>::New("http_queued_requests", "path",
+                       "Number of requests waiting for a thread of the HTTP "
+                       "pool, by path."));
+
+static Counter<string>* http_shed_requests(
+    Counter<string>::New("http_shed_requests", "path",
+                         "Number of requests refused because too many of the "
+                         "same priority were waiting, by path."));
+
+static Latency<milliseconds, string> http_queue_wait_time_ms(
+    "http_queue_wait_time_ms", "path",
+    "Time requests spent waiting for a thread of the HTTP pool in ms, by "
+    "path.");
+
+
+}  // namespace
+
+
+RequestQueue::RequestQueue(ThreadPool* pool, size_t max_high,
+                           size_t max_normal, size_t max_low)
+    : pool_(CHECK_NOTNULL(pool)) {
+  lanes_[Priority::HIGH].limit = max_high;
+  lanes_[Priority::NORMAL].limit = max_normal;
+  lanes_[Priority::LOW].limit = max_low;
+}
+
+
+RequestQueue::~RequestQueue() {
+}
+
+
+bool RequestQueue::Add(Priority priority, const string& path,
+                       const function<void()>& closure) {
+  CHECK(closure);
+  {
+    lock_guard<mutex> lock(lock_);
+    Lane& lane(lanes_[priority]);
+    if (lane.limit > 0 && lane.requests.size() >= lane.limit) {
+      http_shed_requests->Increment(path);
+      return false;
+    }
+    lane.requests.emplace_back(
+        Request{path, steady_clock::now(), closure, CurrentTraceContext()});
+    http_queued_requests->Set(path, ++queued_by_path_[path]);
+  }
+
+  // Whichever request is the most urgent by the time a thread gets to
+  // it will run, not necessarily this one.
+  pool_->Add(bind(&RequestQueue::RunNext, this));
+  return true;
+}
+
+
+size_t RequestQueue::queued(Priority priority) const {
+  lock_guard<mutex> lock(lock_);
+  const auto it(lanes_.find(priority));
+  return it == lanes_.end() ? 0 : it->second.requests.size();
+}
+
+
+void RequestQueue::RunNext() {
+  Request request;
+  {
+    lock_guard<mutex> lock(lock_);
+    auto lane(lanes_.begin());
+    while (lane->second.requests.empty()) {
+      // There is one call for every request added.
+      ++lane;
+      CHECK(lane != lanes_.end());
+    }
+    request = move(lane->second.requests.front());
+    lane->second.requests.pop_front();
+    http_queued_requests->Set(request.path, --queued_by_path_[request.path]);
+  }
+
+  const steady_clock::duration waited(steady_clock::now() -
+                                     request.queued_at);
+  http_queue_wait_time_ms.RecordLatency(request.path, waited);
+
+  const ScopedTraceContext trace_context(request.trace_context);
+  RecordSpan("http_queue_wait", waited);
+  request.closure();
+}
+
+
+}  // namespace cert_trans
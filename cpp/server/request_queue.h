@@ -0,0 +1,84 @@
+#ifndef CERT_TRANS_SERVER_REQUEST_QUEUE_H_
+#define CERT_TRANS_SERVER_REQUEST_QUEUE_H_
+
+#include <stddef.h>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "base/macros.h"
+#include "monitoring/trace.h"
+
+namespace cert_trans {
+
+class ThreadPool;
+
+
+// Runs the work of the HTTP handlers on a thread pool, in order of
+// priority rather than arrival: each thread of the pool that becomes
+// free takes the oldest request of the most urgent class waiting.
+// Every class also has a bounded number of requests waiting, beyond
+// which new ones are refused, for the handler to shed them (with a
+// 503), instead of letting a burst of slow requests (like add-chain)
+// delay the cheap ones (like get-sth) indefinitely.
+//
+// This class is thread-safe.
+class RequestQueue {
+ public:
+  enum class Priority {
+    HIGH,
+    NORMAL,
+    LOW,
+  };
+
+  // Does not take ownership of |pool|, which must outlive this
+  // object. The limits are on the requests waiting in each class (0
+  // for no limit).
+  RequestQueue(ThreadPool* pool, size_t max_high, size_t max_normal,
+               size_t max_low);
+  ~RequestQueue();
+
+  // Arranges for |closure| to run on the pool. Returns false, without
+  // running it, if there are too many requests of that priority
+  // waiting already. The |path| is only used for the metrics.
+  bool Add(Priority priority, const std::string& path,
+           const std::function<void()>& closure);
+
+  // The number of requests of |priority| waiting for a thread.
+  size_t queued(Priority priority) const;
+
+ private:
+  struct Request {
+    std::string path;
+    std::chrono::steady_clock::time_point queued_at;
+    std::function<void()> closure;
+    // The closure runs in the trace of whoever added it, if any.
+    TraceContext trace_context;
+  };
+
+  struct Lane {
+    size_t limit;
+    std::deque<Request> requests;
+  };
+
+  // Run on the pool, once for every request added.
+  void RunNext();
+
+  ThreadPool* const pool_;
+
+  mutable std::mutex lock_;
+  // By priority, the most urgent first.
+  std::map<Priority, Lane> lanes_;
+  // The number of waiting requests by path, for the metrics.
+  std::map<std::string, int64_t> queued_by_path_;
+
+  DISALLOW_COPY_AND_ASSIGN(RequestQueue);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_REQUEST_QUEUE_H_
@@ -0,0 +1,103 @@
+#include "server/request_queue.h"
+
+#include <gtest/gtest.h>
+#include <mutex>
+#include <vector>
+
+#include "base/notification.h"
+#include "util/testing.h"
+#include "util/thread_pool.h"
+
+namespace cert_trans {
+namespace {
+
+using std::lock_guard;
+using std::mutex;
+using std::vector;
+
+
+class RequestQueueTest : public ::testing::Test {
+ protected:
+  RequestQueueTest() : queue_(&pool_, 0, 3, 2), pool_(1) {
+  }
+
+  // Keeps the only thread of the pool busy until |unblock| is
+  // notified.
+  void BlockPool(Notification* unblock) {
+    pool_.Add([unblock]() { unblock->WaitForNotification(); });
+  }
+
+  void Record(int value) {
+    lock_guard<mutex> lock(lock_);
+    order_.push_back(value);
+  }
+
+  // Declared first, so that the pool is done running it before it
+  // goes away.
+  RequestQueue queue_;
+  ThreadPool pool_;
+  mutex lock_;
+  vector<int> order_;
+};
+
+
+TEST_F(RequestQueueTest, MostUrgentFirst) {
+  Notification unblock;
+  BlockPool(&unblock);
+
+  Notification done;
+  EXPECT_TRUE(queue_.Add(RequestQueue::Priority::LOW, "/low",
+                         [this]() { Record(3); }));
+  EXPECT_TRUE(queue_.Add(RequestQueue::Priority::NORMAL, "/normal",
+                         [this]() { Record(2); }));
+  EXPECT_TRUE(queue_.Add(RequestQueue::Priority::HIGH, "/high",
+                         [this]() { Record(1); }));
+  EXPECT_TRUE(queue_.Add(RequestQueue::Priority::LOW, "/low", [this, &done]() {
+    Record(4);
+    done.Notify();
+  }));
+  EXPECT_EQ(1U, queue_.queued(RequestQueue::Priority::HIGH));
+  EXPECT_EQ(1U, queue_.queued(RequestQueue::Priority::NORMAL));
+  EXPECT_EQ(2U, queue_.queued(RequestQueue::Priority::LOW));
+
+  unblock.Notify();
+  done.WaitForNotification();
+  EXPECT_EQ((vector<int>{1, 2, 3, 4}), order_);
+  EXPECT_EQ(0U, queue_.queued(RequestQueue::Priority::LOW));
+}
+
+
+TEST_F(RequestQueueTest, ShedsWhenFull) {
+  Notification unblock;
+  BlockPool(&unblock);
+
+  Notification done;
+  EXPECT_TRUE(queue_.Add(RequestQueue::Priority::LOW, "/low", []() {}));
+  EXPECT_TRUE(queue_.Add(RequestQueue::Priority::LOW, "/low",
+                         [&done]() { done.Notify(); }));
+  EXPECT_FALSE(queue_.Add(RequestQueue::Priority::LOW, "/low",
+                          []() { ADD_FAILURE() << "should not run"; }));
+  // The other classes have their own limits.
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_TRUE(queue_.Add(RequestQueue::Priority::HIGH, "/high", []() {}));
+  }
+
+  unblock.Notify();
+  done.WaitForNotification();
+
+  // There is room again.
+  Notification done_again;
+  EXPECT_TRUE(queue_.Add(RequestQueue::Priority::LOW, "/low",
+                         [&done_again]() { done_again.Notify(); }));
+  done_again.WaitForNotification();
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
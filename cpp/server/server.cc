@@ -1,18 +1,27 @@
 #include "server/server.h"
 
+#include <event2/buffer.h>
+#include <event2/http.h>
 #include <gflags/gflags.h>
+#include <algorithm>
 #include <chrono>
 #include <csignal>
 #include <functional>
+#include <memory>
 
 #include "log/cluster_state_controller.h"
 #include "log/etcd_consistent_store.h"
 #include "log/frontend.h"
 #include "log/log_lookup.h"
 #include "log/log_verifier.h"
+#include "log/tree_signer.h"
+#include "merkletree/mmap_node_store.h"
+#include "merkletree/serial_hasher.h"
 #include "monitoring/gcm/exporter.h"
 #include "monitoring/monitoring.h"
+#include "monitoring/zipkin/exporter.h"
 #include "server/metrics.h"
+#include "server/pprof.h"
 #include "server/proxy.h"
 #include "util/thread_pool.h"
 #include "util/uuid.h"
@@ -20,18 +29,22 @@
 using std::bind;
 using std::chrono::seconds;
 using std::chrono::steady_clock;
+using std::make_shared;
 using std::placeholders::_1;
 using std::shared_ptr;
 using std::signal;
 using std::string;
 using std::this_thread::sleep_for;
 using std::thread;
+using std::to_string;
+using std::unique_ptr;
 
 // These flags are DEFINEd in server_helper to keep the validation logic
 // related to server startup options in one place.
 DECLARE_string(server);
 DECLARE_int32(port);
 DECLARE_string(etcd_root);
+DECLARE_string(zipkin_collector_url);
 
 DEFINE_int32(node_state_refresh_seconds, 10,
              "How often to refresh the ClusterNodeState entry for this node.");
@@ -40,6 +53,14 @@ DEFINE_int32(watchdog_seconds, 120,
              "before firing the watchdog timer.");
 DEFINE_bool(watchdog_timeout_is_fatal, true,
             "Exit if the watchdog timer fires.");
+DEFINE_string(merkle_node_store_dir, "",
+              "If set, keep the Merkle tree used to serve proofs in "
+              "memory-mapped files in this (existing) directory, instead "
+              "of rebuilding it in memory from the database at startup.");
+DEFINE_int32(num_http_event_threads, 1,
+             "Number of threads accepting, parsing and replying to HTTP "
+             "requests, each with its own event loop (the handlers can "
+             "still hand off work to --num_http_server_threads).");
 
 namespace cert_trans {
 
@@ -117,41 +138,89 @@ Server::Server(const shared_ptr<libevent::Base>& event_base,
                ThreadPool* internal_pool, ThreadPool* http_pool, Database* db,
                EtcdClient* etcd_client, UrlFetcher* url_fetcher,
                const LogVerifier* log_verifier)
-    : event_base_(event_base),
-      event_pump_(new libevent::EventPumpThread(event_base_)),
-      http_server_(*event_base_),
+    : Server(nullptr, event_base, internal_pool, http_pool, db, etcd_client,
+             url_fetcher, log_verifier, "", FLAGS_etcd_root) {
+  CHECK_LT(0, FLAGS_port);
+  http_server_.reset(new libevent::HttpServer(*event_base_));
+
+  // The main event loop is the first HTTP event thread.
+  CHECK_GT(FLAGS_num_http_event_threads, 0);
+  for (int i = 1; i < FLAGS_num_http_event_threads; ++i) {
+    http_bases_.emplace_back(make_shared<libevent::Base>());
+    http_server_->AddBase(*http_bases_.back());
+    http_pumps_.emplace_back(new libevent::EventPumpThread(
+        http_bases_.back(), "http_" + to_string(i)));
+  }
+
+  if (FLAGS_monitoring == kPrometheus) {
+    http_server_->AddHandler("/metrics", ExportPrometheusMetrics);
+  } else if (FLAGS_monitoring == kGcm) {
+    gcm_exporter_.reset(new GCMExporter(FLAGS_server, url_fetcher_));
+  } else {
+    LOG(FATAL) << "Please set --monitoring to one of the supported values.";
+  }
+  http_server_->AddHandler("/traces", ExportZipkinTraces);
+  if (!FLAGS_zipkin_collector_url.empty()) {
+    zipkin_exporter_.reset(new ZipkinExporter(url_fetcher_));
+  }
+  http_server_->AddHandler("/ready", bind(&Server::HandleReady, this, _1));
+  AddPprofHandlers(http_server_.get());
+
+  http_server_->Bind(nullptr, FLAGS_port);
+  election_.StartElection();
+}
+
+
+Server::Server(Server* host, const string& path_prefix,
+               const string& etcd_root, Database* db,
+               const LogVerifier* log_verifier)
+    : Server(CHECK_NOTNULL(host), host->event_base_, host->internal_pool_,
+             host->http_pool_, db, host->etcd_client_, host->url_fetcher_,
+             log_verifier, path_prefix, etcd_root) {
+  CHECK(!host_->host_) << "Hosted servers cannot host others.";
+  CHECK(!path_prefix_.empty());
+  CHECK_NE(etcd_root_, host_->etcd_root_);
+  host_->hosted_.push_back(this);
+  election_.StartElection();
+}
+
+
+Server::Server(Server* host, const shared_ptr<libevent::Base>& event_base,
+               ThreadPool* internal_pool, ThreadPool* http_pool, Database* db,
+               EtcdClient* etcd_client, UrlFetcher* url_fetcher,
+               const LogVerifier* log_verifier, const string& path_prefix,
+               const string& etcd_root)
+    : host_(host),
+      path_prefix_(path_prefix),
+      etcd_root_(etcd_root),
+      event_base_(event_base),
+      event_pump_(host_ ? nullptr
+                        : new libevent::EventPumpThread(event_base_, "main")),
+      ready_(false),
       db_(CHECK_NOTNULL(db)),
       log_verifier_(CHECK_NOTNULL(log_verifier)),
       node_id_(GetNodeId(db_)),
       url_fetcher_(CHECK_NOTNULL(url_fetcher)),
       etcd_client_(CHECK_NOTNULL(etcd_client)),
-      election_(event_base_, etcd_client_, FLAGS_etcd_root + "/election",
+      election_(event_base_, etcd_client_, etcd_root_ + "/election",
                 node_id_),
       internal_pool_(CHECK_NOTNULL(internal_pool)),
       server_task_(internal_pool_),
       consistent_store_(&election_,
                         new EtcdConsistentStore(event_base_.get(),
                                                 internal_pool_, etcd_client_,
-                                                &election_, FLAGS_etcd_root,
+                                                &election_, etcd_root_,
                                                 node_id_)),
       http_pool_(CHECK_NOTNULL(http_pool)) {
-  CHECK_LT(0, FLAGS_port);
-
-  if (FLAGS_monitoring == kPrometheus) {
-    http_server_.AddHandler("/metrics", ExportPrometheusMetrics);
-  } else if (FLAGS_monitoring == kGcm) {
-    gcm_exporter_.reset(
-        new GCMExporter(FLAGS_server, url_fetcher_, internal_pool_));
-  } else {
-    LOG(FATAL) << "Please set --monitoring to one of the supported values.";
-  }
-
-  http_server_.Bind(nullptr, FLAGS_port);
-  election_.StartElection();
 }
 
 
 Server::~Server() {
+  CHECK(hosted_.empty()) << "Hosted servers must be destroyed first.";
+  if (host_) {
+    host_->hosted_.erase(
+        std::find(host_->hosted_.begin(), host_->hosted_.end(), this));
+  }
   server_task_.Cancel();
   node_refresh_thread_->join();
   server_task_.Wait();
@@ -194,7 +263,22 @@ Proxy* Server::proxy() {
 
 
 libevent::HttpServer* Server::http_server() {
-  return &http_server_;
+  return host_ ? host_->http_server() : http_server_.get();
+}
+
+
+const string& Server::path_prefix() const {
+  return path_prefix_;
+}
+
+
+unique_ptr<CompactMerkleTree> Server::SignerTree() {
+  unique_ptr<CompactMerkleTree> tree(
+      TreeSigner::LoadTree(db_, &consistent_store_));
+  if (!tree) {
+    tree = log_lookup_->GetCompactMerkleTree(new Sha256Hasher);
+  }
+  return tree;
 }
 
 
@@ -219,12 +303,26 @@ void Server::Initialise(bool is_mirror) {
   fetcher_ = ContinuousFetcher::New(event_base_.get(), internal_pool_, db_,
                                     log_verifier_, !is_mirror);
 
-  log_lookup_.reset(new LogLookup(db_));
+  // Rebuilding the tree from the database can take a while, so do it
+  // while the cluster state controller syncs with etcd. Nothing else
+  // here uses |log_lookup_|.
+  thread log_lookup_thread([this]() {
+    // The node store directory holds a single tree, so hosted logs
+    // keep theirs in memory.
+    if (FLAGS_merkle_node_store_dir.empty() || host_) {
+      log_lookup_.reset(new LogLookup(db_, internal_pool_));
+    } else {
+      log_lookup_.reset(new LogLookup(
+          db_, unique_ptr<MerkleNodeStore>(new MmapNodeStore(
+                   FLAGS_merkle_node_store_dir, Sha256Hasher().DigestSize())),
+          internal_pool_));
+    }
+  });
 
   cluster_controller_.reset(
       new ClusterStateController(internal_pool_, event_base_, url_fetcher_,
                                  db_, &consistent_store_, &election_,
-                                 fetcher_.get()));
+                                 fetcher_.get(), path_prefix_));
 
   // Publish this node's hostname:port info
   cluster_controller_->SetNodeHostPort(FLAGS_server, FLAGS_port);
@@ -246,16 +344,46 @@ void Server::Initialise(bool is_mirror) {
                                         server_task_.task()));
 
   proxy_.reset(new Proxy(event_base_.get(),
-                         bind(&ClusterStateController::GetFreshNodes,
+                         bind(&ClusterStateController::GetFreshNodesSnapshot,
                               cluster_controller_.get()),
                          url_fetcher_, http_pool_));
+
+  log_lookup_thread.join();
 }
 
 
 void Server::Run() {
+  CHECK(!host_) << "Only the host runs the event loop.";
+  ready_ = true;
   // Ding the temporary event pump because we're about to enter the event loop
   event_pump_.reset();
   event_base_->Dispatch();
+
+  // We were asked to exit. Leave the elections (which need the event
+  // loop) right away, so that other nodes can become master without
+  // waiting for our proposals to expire.
+  LOG(INFO) << "Leaving the election.";
+  event_pump_.reset(new libevent::EventPumpThread(event_base_, "main"));
+  for (Server* const hosted : hosted_) {
+    hosted->election_.StopElection();
+  }
+  election_.StopElection();
+}
+
+
+void Server::HandleReady(evhttp_request* req) const {
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    evhttp_send_reply(req, HTTP_BADMETHOD, /*reason*/ nullptr,
+                      /*databuf*/ nullptr);
+    return;
+  }
+  const bool ready(ready_);
+  evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
+                    "text/plain");
+  evbuffer_add_printf(evhttp_request_get_output_buffer(req), "%s\n",
+                      ready ? "ready" : "starting");
+  evhttp_send_reply(req, ready ? HTTP_OK : HTTP_SERVUNAVAIL,
+                    /*reason*/ nullptr, /*databuf*/ nullptr);
 }
 
 
@@ -2,9 +2,11 @@
 #define CERT_TRANS_SERVER_SERVER_H_
 
 #include <stdint.h>
+#include <atomic>
 #include <memory>
 #include <string>
 #include <thread>
+#include <vector>
 
 #include "base/macros.h"
 #include "log/strict_consistent_store.h"
@@ -13,8 +15,10 @@
 #include "util/masterelection.h"
 #include "util/sync_task.h"
 
+class CompactMerkleTree;
 class Frontend;
 class LogVerifier;
+struct evhttp_request;
 
 namespace cert_trans {
 
@@ -31,6 +35,7 @@ class LoggedEntry;
 class Proxy;
 class ThreadPool;
 class UrlFetcher;
+class ZipkinExporter;
 
 // Size of latest locally generated STH.
 Gauge<>* latest_local_tree_size_gauge();
@@ -40,11 +45,22 @@ class Server {
  public:
   static void StaticInit();
 
-  // Doesn't take ownership of anything.
+  // Hosts the log in |db|, serving it on --port, with its cluster
+  // state under --etcd_root. Doesn't take ownership of anything.
   Server(const std::shared_ptr<libevent::Base>& event_base,
          ThreadPool* internal_pool, ThreadPool* http_pool, Database* db,
          EtcdClient* etcd_client, UrlFetcher* url_fetcher,
          const LogVerifier* log_verifier);
+  // Hosts another log, in |db|, in the same process as |host|, sharing
+  // its event loops, HTTP server, pools, etcd client and URL fetcher.
+  // Its handlers go under |path_prefix| (see
+  // HttpHandler::SetPathPrefix()), and its cluster state under
+  // |etcd_root|. Doesn't take ownership of anything, and |host| must
+  // outlive this instance. Only the Run() of |host| is called, for
+  // all of them.
+  Server(Server* host, const std::string& path_prefix,
+         const std::string& etcd_root, Database* db,
+         const LogVerifier* log_verifier);
   ~Server();
 
   bool IsMaster() const;
@@ -55,15 +71,47 @@ class Server {
   ContinuousFetcher* continuous_fetcher();
   Proxy* proxy();
   libevent::HttpServer* http_server();
+  const std::string& path_prefix() const;
+
+  // The tree for the TreeSigner of this log, from the frontier stored
+  // in the database if it is usable (see TreeSigner::LoadTree()), or
+  // else from log_lookup().
+  std::unique_ptr<CompactMerkleTree> SignerTree();
 
+  // Builds the Merkle tree of the log from the database, overlapped
+  // with getting the cluster state from etcd.
   void Initialise(bool is_mirror);
   void WaitForReplication() const;
+  // The HTTP server is listening from the construction of the host,
+  // but its /ready handler answers 503 (Service Unavailable) until
+  // Run() is called, so that load balancers and orchestrators can
+  // tell a node still warming up from one which is down.
   void Run();
 
  private:
+  Server(Server* host, const std::shared_ptr<libevent::Base>& event_base,
+         ThreadPool* internal_pool, ThreadPool* http_pool, Database* db,
+         EtcdClient* etcd_client, UrlFetcher* url_fetcher,
+         const LogVerifier* log_verifier, const std::string& path_prefix,
+         const std::string& etcd_root);
+
+  void HandleReady(evhttp_request* req) const;
+
+  // NULL if this is the host, which has the members below as well.
+  Server* const host_;
+  // The other logs hosted in this process.
+  std::vector<Server*> hosted_;
+  const std::string path_prefix_;
+  const std::string etcd_root_;
   const std::shared_ptr<libevent::Base> event_base_;
   std::unique_ptr<libevent::EventPumpThread> event_pump_;
-  libevent::HttpServer http_server_;
+  // The extra event loops for --num_http_event_threads.
+  std::vector<std::shared_ptr<libevent::Base>> http_bases_;
+  std::vector<std::unique_ptr<libevent::EventPumpThread>> http_pumps_;
+  std::unique_ptr<libevent::HttpServer> http_server_;
+  // Set when the host is Run().
+  std::atomic<bool> ready_;
+
   Database* const db_;
   const LogVerifier* const log_verifier_;
   const std::string node_id_;
@@ -81,6 +129,7 @@ class Server {
   std::unique_ptr<Proxy> proxy_;
   std::unique_ptr<std::thread> node_refresh_thread_;
   std::unique_ptr<GCMExporter> gcm_exporter_;
+  std::unique_ptr<ZipkinExporter> zipkin_exporter_;
 
   DISALLOW_COPY_AND_ASSIGN(Server);
 };
@@ -1,10 +1,14 @@
 #include "log/strict_consistent_store.h"
+#include "monitoring/gauge.h"
 #include "server/server.h"
 #include "server/server_helper.h"
+#include "util/etcd_v3.h"
 #include "util/fake_etcd.h"
 
 using cert_trans::Server;
 using google::RegisterFlagValidator;
+using std::chrono::duration;
+using std::chrono::steady_clock;
 using std::string;
 using std::unique_ptr;
 
@@ -14,9 +18,16 @@ DEFINE_int32(port, 6962, "Server port");
 DEFINE_string(etcd_root, "/root", "Root of cluster entries in etcd.");
 DEFINE_string(etcd_servers, "",
               "Comma separated list of 'hostname:port' of the etcd server(s)");
+DEFINE_int32(etcd_api_version, 2,
+             "Version of the etcd API to use: 2, or 3 through the JSON "
+             "gateway of etcd 3.4 or later.");
 DEFINE_bool(i_know_stand_alone_mode_can_lose_data, false,
             "Set this to allow stand-alone mode, even though it will lose "
             "submissions in the case of a crash.");
+DEFINE_bool(work_stealing_thread_pools, false,
+            "Give each thread of the internal and HTTP thread pools its own "
+            "queue, with idle threads stealing from the others, instead of "
+            "a single queue shared by all of them.");
 
 // Storage related flags
 // TODO(alcutter): Just specify a root dir with a single flag.
@@ -27,6 +38,8 @@ DEFINE_string(sqlite_db, "",
               "SQLite database for certificate and tree storage");
 DEFINE_string(leveldb_db, "",
               "LevelDB database for certificate and tree storage");
+DEFINE_string(segment_db, "",
+              "Directory of segment files for certificate and tree storage");
 // TODO(ekasper): sanity-check these against the directory structure.
 DEFINE_int32(cert_storage_depth, 0,
              "Subdirectory depth for certificates; if the directory is not "
@@ -60,6 +73,14 @@ static bool ValidatePort(const char*, int port) {
   return true;
 }
 
+static bool ValidateEtcdApiVersion(const char* flagname, int version) {
+  if (version != 2 && version != 3) {
+    std::cout << flagname << " must be 2 or 3" << std::endl;
+    return false;
+  }
+  return true;
+}
+
 static const bool port_dummy =
     RegisterFlagValidator(&FLAGS_port, &ValidatePort);
 
@@ -75,11 +96,28 @@ static const bool c_st_dummy =
 static const bool t_st_dummy =
     RegisterFlagValidator(&FLAGS_tree_storage_depth, &ValidateIsNonNegative);
 
+static const bool etcd_api_version_dummy =
+    RegisterFlagValidator(&FLAGS_etcd_api_version, &ValidateEtcdApiVersion);
+
 namespace cert_trans {
+namespace {
+
+
+Gauge<string>* startup_phase_seconds() {
+  static Gauge<string>* const gauge(
+      Gauge<string>::New("startup_phase_seconds", "phase",
+                         "Time taken by each phase of the server startup, "
+                         "in seconds."));
+  return gauge;
+}
+
+
+}  // namespace
+
 
 void EnsureValidatorsRegistered() {
   CHECK(cert_dir_dummy && tree_dir_dummy && c_st_dummy && t_st_dummy &&
-        port_dummy);
+        port_dummy && etcd_api_version_dummy);
 }
 
 
@@ -102,12 +140,14 @@ bool IsStandalone(bool warn_data_loss) {
 
 unique_ptr<Database> ProvideDatabase() {
   if (!FLAGS_sqlite_db.empty() + !FLAGS_leveldb_db.empty() +
+          !FLAGS_segment_db.empty() +
           (!FLAGS_cert_dir.empty() | !FLAGS_tree_dir.empty()) !=
       1) {
     LOG(FATAL) << "Must specify exactly one database type. Check flags.";
   }
 
-  if (FLAGS_sqlite_db.empty() && FLAGS_leveldb_db.empty()) {
+  if (FLAGS_sqlite_db.empty() && FLAGS_leveldb_db.empty() &&
+      FLAGS_segment_db.empty()) {
     CHECK_NE(FLAGS_cert_dir, FLAGS_tree_dir)
         << "Certificate directory and tree directory must differ";
   }
@@ -116,6 +156,8 @@ unique_ptr<Database> ProvideDatabase() {
     return unique_ptr<Database>(new SQLiteDB(FLAGS_sqlite_db));
   } else if (!FLAGS_leveldb_db.empty()) {
     return unique_ptr<Database>(new LevelDB(FLAGS_leveldb_db));
+  } else if (!FLAGS_segment_db.empty()) {
+    return unique_ptr<Database>(new SegmentDB(FLAGS_segment_db));
   } else {
     return unique_ptr<Database>(
         new FileDB(new FileStorage(FLAGS_cert_dir, FLAGS_cert_storage_depth),
@@ -127,14 +169,57 @@ unique_ptr<Database> ProvideDatabase() {
 }
 
 
+unique_ptr<Database> ProvideDatabase(const string& path) {
+  CHECK(!path.empty());
+  if (!FLAGS_sqlite_db.empty()) {
+    return unique_ptr<Database>(new SQLiteDB(path));
+  } else if (!FLAGS_leveldb_db.empty()) {
+    return unique_ptr<Database>(new LevelDB(path));
+  } else if (!FLAGS_segment_db.empty()) {
+    return unique_ptr<Database>(new SegmentDB(path));
+  }
+
+  LOG(FATAL) << "Only --sqlite_db, --leveldb_db and --segment_db support "
+             << "more than one database";
+}
+
+
 unique_ptr<EtcdClient> ProvideEtcdClient(libevent::Base* event_base,
                                          ThreadPool* pool,
                                          UrlFetcher* fetcher) {
   // No need to enforce --warn-data-loss here as it will already have been
   // done if required
+  if (IsStandalone(false)) {
+    return unique_ptr<EtcdClient>(new FakeEtcdClient(event_base));
+  }
+  if (FLAGS_etcd_api_version == 3) {
+    return unique_ptr<EtcdClient>(
+        new EtcdV3Client(pool, fetcher, SplitHosts(FLAGS_etcd_servers)));
+  }
   return unique_ptr<EtcdClient>(
-      IsStandalone(false)
-          ? new FakeEtcdClient(event_base)
-          : new EtcdClient(pool, fetcher, SplitHosts(FLAGS_etcd_servers)));
+      new EtcdClient(pool, fetcher, SplitHosts(FLAGS_etcd_servers)));
+}
+
+
+ThreadPool::Scheduling ThreadPoolSchedulingFromFlags() {
+  return FLAGS_work_stealing_thread_pools
+             ? ThreadPool::Scheduling::WORK_STEALING
+             : ThreadPool::Scheduling::SHARED_QUEUE;
 }
+
+
+StartupPhase::StartupPhase(const string& name)
+    : name_(name), start_(steady_clock::now()) {
+  LOG(INFO) << "Starting up: " << name_;
+}
+
+
+StartupPhase::~StartupPhase() {
+  const double seconds(
+      duration<double>(steady_clock::now() - start_).count());
+  LOG(INFO) << "Started up: " << name_ << " (" << seconds << "s)";
+  startup_phase_seconds()->Set(name_, seconds);
+}
+
+
 }  // namespace cert_trans
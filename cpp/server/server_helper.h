@@ -10,12 +10,14 @@
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <string>
 
 #include "base/macros.h"
 #include "log/database.h"
 #include "log/file_db.h"
 #include "log/file_storage.h"
 #include "log/leveldb_db.h"
+#include "log/segment_db.h"
 #include "log/sqlite_db.h"
 #include "util/etcd.h"
 #include "util/executor.h"
@@ -48,11 +50,36 @@ bool IsStandalone(bool warn_data_loss);
 // Create one of the supported database types based on flags settings
 std::unique_ptr<Database> ProvideDatabase();
 
+// Create another database of the same type as ProvideDatabase(), at
+// |path| instead of the one given by the flags. Not supported for the
+// FileDB, which takes several directories.
+std::unique_ptr<Database> ProvideDatabase(const std::string& path);
+
 // Create an EtcdClient implementation, either fake or real based on flags
 std::unique_ptr<EtcdClient> ProvideEtcdClient(libevent::Base* event_base,
                                               ThreadPool* pool,
                                               UrlFetcher* fetcher);
 
+// How the internal and HTTP thread pools should schedule their
+// closures, based on flags.
+ThreadPool::Scheduling ThreadPoolSchedulingFromFlags();
+
+// Times a phase of the server startup, from construction to
+// destruction, logging how long it took and exporting it as the
+// "startup_phase_seconds" gauge, labelled with |name|. Phases may
+// overlap, when they run on different threads.
+class StartupPhase {
+ public:
+  explicit StartupPhase(const std::string& name);
+  ~StartupPhase();
+
+ private:
+  const std::string name_;
+  const std::chrono::steady_clock::time_point start_;
+
+  DISALLOW_COPY_AND_ASSIGN(StartupPhase);
+};
+
 }  // namespace cert_trans
 
 #endif  // CERT_TRANS_SERVER_SERVER_HELPER_H_
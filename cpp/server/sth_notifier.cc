@@ -0,0 +1,295 @@
+#include "server/sth_notifier.h"
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/http.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <algorithm>
+
+#include "monitoring/monitoring.h"
+#include "server/json_output.h"
+
+DEFINE_int32(sth_long_poll_timeout_seconds, 30,
+             "how long a get-sth request with newer_than waits for a new "
+             "STH, before getting the current one anyway");
+DEFINE_int32(max_sth_waiters, 10000,
+             "maximum number of get-sth long polls and STH event streams "
+             "held at once, beyond which they get a 503");
+
+using std::bind;
+using std::chrono::seconds;
+using std::function;
+using std::lock_guard;
+using std::mutex;
+using std::shared_ptr;
+using std::string;
+using std::unique_lock;
+using std::unique_ptr;
+
+namespace cert_trans {
+namespace {
+
+
+static Gauge<string>* sth_waiters(
+    Gauge<string>::New("sth_waiters", "kind",
+                       "Number of requests waiting for a new STH, by kind "
+                       "(long_poll or stream)."));
+
+
+// libevent only notices that a client went away while sending it a
+// reply, so this keeps reading from the connection of |req| in the
+// meantime, like it does then. Whatever the client sends is left in
+// the input buffer rather than parsed, and the callbacks are set back
+// once the reply is sent.
+void DetectClose(evhttp_request* req) {
+  bufferevent* const bev(CHECK_NOTNULL(evhttp_connection_get_bufferevent(
+      evhttp_request_get_connection(req))));
+  bufferevent_data_cb write_cb;
+  bufferevent_event_cb event_cb;
+  void* arg;
+  bufferevent_getcb(bev, nullptr, &write_cb, &event_cb, &arg);
+  bufferevent_setcb(bev, nullptr, write_cb, event_cb, arg);
+  CHECK_EQ(bufferevent_enable(bev, EV_READ), 0);
+}
+
+
+}  // namespace
+
+
+STHNotifier::STHNotifier(libevent::Base* base, const ReplyCallback& reply)
+    : base_(CHECK_NOTNULL(base)),
+      reply_(reply),
+      task_(base_),
+      next_id_(0),
+      expiry_scheduled_(false),
+      latest_timestamp_(-1) {
+  CHECK(reply_);
+  CHECK_GT(FLAGS_sth_long_poll_timeout_seconds, 0);
+}
+
+
+STHNotifier::~STHNotifier() {
+  task_.task()->Return();
+  task_.Wait();
+}
+
+
+bool STHNotifier::Wait(evhttp_request* req, int64_t timestamp) {
+  unique_lock<mutex> lock(lock_);
+  if (latest_timestamp_ > timestamp) {
+    // Published since the caller looked.
+    lock.unlock();
+    reply_(req);
+    return true;
+  }
+
+  Waiter* const waiter(AddLocked(req, false, timestamp));
+  if (!waiter) {
+    return false;
+  }
+  waiter->deadline =
+      clock::now() + seconds(FLAGS_sth_long_poll_timeout_seconds);
+  DetectClose(req);
+  if (!expiry_scheduled_) {
+    ScheduleExpiryLocked();
+  }
+  return true;
+}
+
+
+bool STHNotifier::Subscribe(evhttp_request* req, int64_t timestamp,
+                            const shared_ptr<const string>& json) {
+  CHECK(json);
+  lock_guard<mutex> lock(lock_);
+  Waiter* const waiter(AddLocked(req, true, -1));
+  if (!waiter) {
+    return false;
+  }
+
+  StartEventStream(base_, req);
+  if (latest_timestamp_ > timestamp) {
+    // Published since the caller looked, sent below.
+    RunOnRequestThread(req, bind(&STHNotifier::SendEvents, this, waiter->id));
+    return true;
+  }
+  waiter->timestamp = timestamp;
+  const unique_ptr<evbuffer, void (*)(evbuffer*)> event(
+      CHECK_NOTNULL(evbuffer_new()), evbuffer_free);
+  CHECK_GE(evbuffer_add_printf(event.get(), "event: sth\ndata: %s\n\n",
+                               json->c_str()),
+           0);
+  evhttp_send_reply_chunk(req, event.get());
+  return true;
+}
+
+
+void STHNotifier::Publish(int64_t timestamp,
+                          const shared_ptr<const string>& json) {
+  CHECK(json);
+  lock_guard<mutex> lock(lock_);
+  if (timestamp <= latest_timestamp_) {
+    return;
+  }
+  latest_timestamp_ = timestamp;
+  latest_json_ = json;
+
+  for (const auto& it : long_polls_) {
+    if (it.second->timestamp < timestamp) {
+      RunOnRequestThread(it.second->req,
+                         bind(&STHNotifier::AnswerLongPoll, this, it.first));
+    }
+  }
+  for (const auto& it : streams_) {
+    RunOnRequestThread(it.second->req,
+                       bind(&STHNotifier::SendEvents, this, it.first));
+  }
+}
+
+
+// static
+void STHNotifier::ConnectionClosed(evhttp_connection* conn, void* arg) {
+  const Waiter* const waiter(static_cast<const Waiter*>(arg));
+  VLOG(1) << "STH " << (waiter->stream ? "stream" : "long poll") << " "
+          << waiter->id << " went away";
+  evhttp_request* const req(waiter->req);
+  waiter->notifier->Remove(waiter->id, waiter->stream);
+  // libevent detaches a request that was not replied to in full from
+  // its connection, and leaves it to us to free.
+  if (!evhttp_request_get_connection(req)) {
+    evhttp_request_free(req);
+  }
+}
+
+
+STHNotifier::Waiter* STHNotifier::AddLocked(evhttp_request* req, bool stream,
+                                            int64_t timestamp) {
+  if (FLAGS_max_sth_waiters > 0 &&
+      long_polls_.size() + streams_.size() >=
+          static_cast<size_t>(FLAGS_max_sth_waiters)) {
+    return nullptr;
+  }
+
+  Waiter* const waiter(new Waiter);
+  waiter->notifier = this;
+  waiter->id = next_id_++;
+  waiter->req = CHECK_NOTNULL(req);
+  waiter->stream = stream;
+  waiter->timestamp = timestamp;
+  (stream ? streams_ : long_polls_)[waiter->id].reset(waiter);
+  // We find out about the client going away this way only.
+  evhttp_connection_set_closecb(evhttp_request_get_connection(req),
+                                &STHNotifier::ConnectionClosed, waiter);
+  UpdateGaugesLocked();
+  return waiter;
+}
+
+
+void STHNotifier::RunOnRequestThread(evhttp_request* req,
+                                     const function<void()>& closure) {
+  // The task does not complete until this has run, which keeps us
+  // around.
+  task_.task()
+      ->AddChildWithExecutor(
+          [this, closure](util::Task*) {
+            if (task_.task()->IsActive()) {
+              closure();
+            }
+          },
+          libevent::Base::ForRequest(req))
+      ->Return();
+}
+
+
+void STHNotifier::AnswerLongPoll(int64_t id) {
+  evhttp_request* req;
+  {
+    lock_guard<mutex> lock(lock_);
+    const auto it(long_polls_.find(id));
+    if (it == long_polls_.end()) {
+      // Already answered, or gone.
+      return;
+    }
+    req = it->second->req;
+    evhttp_connection_set_closecb(evhttp_request_get_connection(req),
+                                  nullptr, nullptr);
+    long_polls_.erase(it);
+    UpdateGaugesLocked();
+  }
+  reply_(req);
+}
+
+
+void STHNotifier::SendEvents(int64_t id) {
+  const unique_ptr<evbuffer, void (*)(evbuffer*)> event(
+      CHECK_NOTNULL(evbuffer_new()), evbuffer_free);
+  evhttp_request* req;
+  {
+    lock_guard<mutex> lock(lock_);
+    const auto it(streams_.find(id));
+    if (it == streams_.end() ||
+        it->second->timestamp >= latest_timestamp_) {
+      // Gone, or already sent (several STHs published in a row are
+      // coalesced into the latest).
+      return;
+    }
+    req = it->second->req;
+    it->second->timestamp = latest_timestamp_;
+    // The get-sth reply is on a single line, as an event needs.
+    CHECK_GE(evbuffer_add_printf(event.get(), "event: sth\ndata: %s\n\n",
+                                 latest_json_->c_str()),
+             0);
+  }
+  evhttp_send_reply_chunk(req, event.get());
+}
+
+
+void STHNotifier::Remove(int64_t id, bool stream) {
+  lock_guard<mutex> lock(lock_);
+  CHECK_EQ(1U, (stream ? streams_ : long_polls_).erase(id));
+  UpdateGaugesLocked();
+}
+
+
+void STHNotifier::ExpireLongPolls() {
+  if (!task_.task()->IsActive()) {
+    // We're shutting down, just return.
+    return;
+  }
+
+  lock_guard<mutex> lock(lock_);
+  expiry_scheduled_ = false;
+  const clock::time_point now(clock::now());
+  for (const auto& it : long_polls_) {
+    if (it.second->deadline > now) {
+      break;
+    }
+    RunOnRequestThread(it.second->req,
+                       bind(&STHNotifier::AnswerLongPoll, this, it.first));
+  }
+  if (!long_polls_.empty()) {
+    ScheduleExpiryLocked();
+  }
+}
+
+
+void STHNotifier::ScheduleExpiryLocked() {
+  // The long polls all wait for as long, so the first is the first to
+  // expire (the others are answered a bit late, at most by a second).
+  CHECK(!long_polls_.empty());
+  const clock::duration delay(long_polls_.begin()->second->deadline -
+                              clock::now());
+  base_->Delay(std::max(delay, clock::duration(seconds(1))),
+               task_.task()->AddChild(
+                   bind(&STHNotifier::ExpireLongPolls, this)));
+  expiry_scheduled_ = true;
+}
+
+
+void STHNotifier::UpdateGaugesLocked() const {
+  sth_waiters->Set("long_poll", long_polls_.size());
+  sth_waiters->Set("stream", streams_.size());
+}
+
+
+}  // namespace cert_trans
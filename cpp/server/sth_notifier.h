@@ -0,0 +1,114 @@
+#ifndef CERT_TRANS_SERVER_STH_NOTIFIER_H_
+#define CERT_TRANS_SERVER_STH_NOTIFIER_H_
+
+#include <stdint.h>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "base/macros.h"
+#include "util/libevent_wrapper.h"
+#include "util/sync_task.h"
+
+namespace cert_trans {
+
+
+// Holds on to the requests waiting for a new STH, on the event loop
+// rather than on a thread of the pool, so that monitors do not have
+// to poll get-sth:
+//
+// - long polls (get-sth?newer_than=<timestamp>), answered once with
+//   the first STH newer than they asked for, or with the current one
+//   after --sth_long_poll_timeout_seconds,
+// - streams of server-sent events, which get every new STH (as an
+//   "sth" event, with the get-sth reply as its data) until the client
+//   goes away.
+//
+// The STHs come from Publish(). This class is thread-safe.
+class STHNotifier {
+ public:
+  // Replies to a long poll with the current STH.
+  typedef std::function<void(evhttp_request*)> ReplyCallback;
+
+  // Does not take ownership of |base|, which runs the timeouts of the
+  // long polls.
+  STHNotifier(libevent::Base* base, const ReplyCallback& reply);
+  ~STHNotifier();
+
+  // Answers |req| with |reply| once an STH newer than |timestamp| is
+  // published (right away if it already was), or at the latest after
+  // the timeout. Returns false if there are too many requests waiting
+  // already, in which case the caller must reply to |req| itself.
+  // Must be called on the event thread of |req|.
+  bool Wait(evhttp_request* req, int64_t timestamp);
+
+  // Starts a stream of events in reply to |req|, the first being
+  // |json|, the current STH (with its |timestamp|), or the latest
+  // published, if newer. Returns false like Wait().
+  bool Subscribe(evhttp_request* req, int64_t timestamp,
+                 const std::shared_ptr<const std::string>& json);
+
+  // Passes a new STH (with its |timestamp|, rendered as the get-sth
+  // reply |json|) to the requests waiting for it.
+  void Publish(int64_t timestamp,
+               const std::shared_ptr<const std::string>& json);
+
+ private:
+  typedef std::chrono::steady_clock clock;
+
+  struct Waiter {
+    STHNotifier* notifier;
+    int64_t id;
+    evhttp_request* req;
+    bool stream;
+    // For a long poll, the timestamp the STH must be newer than, for a
+    // stream, that of the last STH sent.
+    int64_t timestamp;
+    // Long polls only.
+    clock::time_point deadline;
+  };
+
+  // Called by libevent when the connection of a waiter closes, on its
+  // event thread.
+  static void ConnectionClosed(evhttp_connection* conn, void* waiter);
+
+  // Registers a new waiter, if there is room. |lock_| must be held.
+  Waiter* AddLocked(evhttp_request* req, bool stream, int64_t timestamp);
+  // Runs |closure| on the event thread of |req|, unless shutting down.
+  void RunOnRequestThread(evhttp_request* req,
+                          const std::function<void()>& closure);
+  // These run on the event thread of the waiter (if it is still
+  // there), which is the only one removing it.
+  void AnswerLongPoll(int64_t id);
+  void SendEvents(int64_t id);
+  void Remove(int64_t id, bool stream);
+  // Answers the long polls that have waited long enough.
+  void ExpireLongPolls();
+  // |lock_| must be held.
+  void ScheduleExpiryLocked();
+  void UpdateGaugesLocked() const;
+
+  libevent::Base* const base_;
+  const ReplyCallback reply_;
+  util::SyncTask task_;
+
+  std::mutex lock_;
+  int64_t next_id_;
+  // By id, which also orders the long polls by deadline.
+  std::map<int64_t, std::unique_ptr<Waiter>> long_polls_;
+  std::map<int64_t, std::unique_ptr<Waiter>> streams_;
+  bool expiry_scheduled_;
+  // The latest STH published, -1 and NULL before the first.
+  int64_t latest_timestamp_;
+  std::shared_ptr<const std::string> latest_json_;
+
+  DISALLOW_COPY_AND_ASSIGN(STHNotifier);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_STH_NOTIFIER_H_
@@ -0,0 +1,319 @@
+#include "server/sth_notifier.h"
+
+#include <arpa/inet.h>
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "monitoring/metric.h"
+#include "monitoring/registry.h"
+#include "util/libevent_wrapper.h"
+#include "util/testing.h"
+
+DECLARE_int32(max_sth_waiters);
+DECLARE_int32(sth_long_poll_timeout_seconds);
+
+namespace cert_trans {
+
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::lock_guard;
+using std::make_shared;
+using std::mutex;
+using std::shared_ptr;
+using std::string;
+using std::this_thread::sleep_for;
+using std::to_string;
+using std::vector;
+using testing::HasSubstr;
+using testing::Not;
+
+namespace {
+
+const uint16_t kPort = 4450;
+
+
+// Sends a GET request for |path| to the test server, and returns the
+// socket to read the reply from.
+int SendGet(const string& path) {
+  const int fd(socket(AF_INET, SOCK_STREAM, 0));
+  PCHECK(fd >= 0);
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(kPort);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  PCHECK(connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) ==
+         0);
+  const string request("GET " + path +
+                       " HTTP/1.1\r\nHost: localhost\r\n\r\n");
+  PCHECK(write(fd, request.data(), request.size()) ==
+         static_cast<ssize_t>(request.size()));
+  return fd;
+}
+
+
+// Reads from |fd| until |expected| has been received, the connection
+// is closed, or |timeout| passes, and returns all that was read.
+string ReadUntil(int fd, const string& expected, milliseconds timeout) {
+  const steady_clock::time_point deadline(steady_clock::now() + timeout);
+  string received;
+  while (received.find(expected) == string::npos) {
+    const milliseconds left(
+        duration_cast<milliseconds>(deadline - steady_clock::now()));
+    pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (left.count() <= 0 || poll(&pfd, 1, left.count()) <= 0) {
+      break;
+    }
+    char buf[4096];
+    const ssize_t len(read(fd, buf, sizeof(buf)));
+    if (len <= 0) {
+      break;
+    }
+    received.append(buf, len);
+  }
+  return received;
+}
+
+
+// Returns the value of the sth_waiters gauge for |kind|.
+double Waiters(const string& kind) {
+  for (const Metric* metric : Registry::Instance()->GetMetrics()) {
+    if (metric->Name() == "sth_waiters") {
+      const auto values(metric->CurrentValues());
+      const auto it(values.find(vector<string>{kind}));
+      return it == values.end() ? 0 : it->second.second;
+    }
+  }
+  return 0;
+}
+
+
+class STHNotifierTest : public ::testing::Test {
+ protected:
+  STHNotifierTest()
+      : base_(make_shared<libevent::Base>()),
+        event_pump_(base_),
+        server_(*base_),
+        notifier_(base_.get(),
+                  [this](evhttp_request* req) { ReplyWithSTH(req); }) {
+    CHECK(server_.AddHandler("/poll", [this](evhttp_request* req) {
+      if (!notifier_.Wait(req, libevent::GetIntParam(
+                                   libevent::ParseQuery(req), "newer_than"))) {
+        evhttp_send_error(req, HTTP_SERVUNAVAIL, nullptr);
+      }
+    }));
+    CHECK(server_.AddHandler("/stream", [this](evhttp_request* req) {
+      int64_t timestamp;
+      shared_ptr<const string> json;
+      {
+        lock_guard<mutex> lock(lock_);
+        timestamp = timestamp_;
+        json = json_;
+      }
+      if (!notifier_.Subscribe(req, timestamp, json)) {
+        evhttp_send_error(req, HTTP_SERVUNAVAIL, nullptr);
+      }
+    }));
+    server_.Bind("127.0.0.1", kPort);
+    Publish(1);
+  }
+
+  ~STHNotifierTest() {
+    for (int fd : fds_) {
+      close(fd);
+    }
+    // The waiters must all be gone before the notifier.
+    WaitForWaiters(0, 0);
+  }
+
+  // Publishes an STH with |timestamp|, rendered as "sth-<timestamp>".
+  void Publish(int64_t timestamp) {
+    const shared_ptr<const string> json(
+        make_shared<string>("sth-" + to_string(timestamp)));
+    {
+      lock_guard<mutex> lock(lock_);
+      timestamp_ = timestamp;
+      json_ = json;
+    }
+    notifier_.Publish(timestamp, json);
+  }
+
+  int Get(const string& path) {
+    fds_.push_back(SendGet(path));
+    return fds_.back();
+  }
+
+  void Close(int fd) {
+    for (auto it(fds_.begin()); it != fds_.end(); ++it) {
+      if (*it == fd) {
+        fds_.erase(it);
+        break;
+      }
+    }
+    close(fd);
+  }
+
+  void WaitForWaiters(int long_polls, int streams) {
+    const steady_clock::time_point deadline(steady_clock::now() +
+                                            seconds(5));
+    while ((Waiters("long_poll") != long_polls ||
+            Waiters("stream") != streams) &&
+           steady_clock::now() < deadline) {
+      sleep_for(milliseconds(10));
+    }
+    EXPECT_EQ(long_polls, Waiters("long_poll"));
+    EXPECT_EQ(streams, Waiters("stream"));
+  }
+
+  const shared_ptr<libevent::Base> base_;
+  libevent::EventPumpThread event_pump_;
+  libevent::HttpServer server_;
+  STHNotifier notifier_;
+  vector<int> fds_;
+
+ private:
+  void ReplyWithSTH(evhttp_request* req) {
+    const std::unique_ptr<evbuffer, void (*)(evbuffer*)> body(
+        CHECK_NOTNULL(evbuffer_new()), evbuffer_free);
+    {
+      lock_guard<mutex> lock(lock_);
+      CHECK_EQ(evbuffer_add(body.get(), json_->data(), json_->size()), 0);
+    }
+    evhttp_send_reply(req, HTTP_OK, "OK", body.get());
+  }
+
+  mutex lock_;
+  int64_t timestamp_;
+  shared_ptr<const string> json_;
+};
+
+
+TEST_F(STHNotifierTest, LongPollAnsweredRightAwayIfAlreadyNewer) {
+  Publish(2);
+  const int fd(Get("/poll?newer_than=1"));
+  const string reply(ReadUntil(fd, "sth-2", seconds(5)));
+  EXPECT_THAT(reply, HasSubstr("200 OK"));
+  EXPECT_THAT(reply, HasSubstr("sth-2"));
+  WaitForWaiters(0, 0);
+}
+
+
+TEST_F(STHNotifierTest, LongPollAnsweredByNewerSTH) {
+  const int fd(Get("/poll?newer_than=1"));
+  WaitForWaiters(1, 0);
+  EXPECT_EQ("", ReadUntil(fd, "HTTP", milliseconds(300)));
+
+  // Not newer than asked for.
+  Publish(1);
+  EXPECT_EQ("", ReadUntil(fd, "HTTP", milliseconds(300)));
+
+  Publish(2);
+  const string reply(ReadUntil(fd, "sth-2", seconds(5)));
+  EXPECT_THAT(reply, HasSubstr("200 OK"));
+  EXPECT_THAT(reply, HasSubstr("sth-2"));
+  WaitForWaiters(0, 0);
+}
+
+
+TEST_F(STHNotifierTest, LongPollTimesOut) {
+  google::FlagSaver saver;
+  FLAGS_sth_long_poll_timeout_seconds = 1;
+  const steady_clock::time_point start(steady_clock::now());
+  const int fd(Get("/poll?newer_than=1"));
+  WaitForWaiters(1, 0);
+
+  // Answered with the current STH anyway.
+  const string reply(ReadUntil(fd, "sth-1", seconds(5)));
+  EXPECT_THAT(reply, HasSubstr("200 OK"));
+  EXPECT_THAT(reply, HasSubstr("sth-1"));
+  EXPECT_GE(steady_clock::now() - start, seconds(1));
+  WaitForWaiters(0, 0);
+}
+
+
+TEST_F(STHNotifierTest, StreamGetsEveryNewSTH) {
+  const int fd(Get("/stream"));
+  string events(ReadUntil(fd, "data: sth-1\n\n", seconds(5)));
+  EXPECT_THAT(events, HasSubstr("200 OK"));
+  EXPECT_THAT(events, HasSubstr("text/event-stream"));
+  EXPECT_THAT(events, HasSubstr("event: sth\ndata: sth-1\n\n"));
+  WaitForWaiters(0, 1);
+
+  Publish(2);
+  events = ReadUntil(fd, "data: sth-2\n\n", seconds(5));
+  EXPECT_THAT(events, HasSubstr("event: sth\ndata: sth-2\n\n"));
+
+  // Only newer STHs are sent.
+  Publish(2);
+  EXPECT_EQ("", ReadUntil(fd, "data:", milliseconds(300)));
+
+  Publish(3);
+  events = ReadUntil(fd, "data: sth-3\n\n", seconds(5));
+  EXPECT_THAT(events, HasSubstr("event: sth\ndata: sth-3\n\n"));
+  EXPECT_THAT(events, Not(HasSubstr("sth-2")));
+}
+
+
+TEST_F(STHNotifierTest, WaitersRemovedWhenConnectionCloses) {
+  const int poll_fd(Get("/poll?newer_than=1"));
+  const int stream_fd(Get("/stream"));
+  ReadUntil(stream_fd, "data: sth-1\n\n", seconds(5));
+  WaitForWaiters(1, 1);
+
+  Close(poll_fd);
+  WaitForWaiters(0, 1);
+  Close(stream_fd);
+  WaitForWaiters(0, 0);
+
+  // Nobody left to send it to.
+  Publish(2);
+}
+
+
+TEST_F(STHNotifierTest, TooManyWaiters) {
+  google::FlagSaver saver;
+  FLAGS_max_sth_waiters = 1;
+  const int fd(Get("/poll?newer_than=1"));
+  WaitForWaiters(1, 0);
+
+  EXPECT_THAT(ReadUntil(Get("/poll?newer_than=1"), "\r\n", seconds(5)),
+              HasSubstr("503"));
+  EXPECT_THAT(ReadUntil(Get("/stream"), "\r\n", seconds(5)),
+              HasSubstr("503"));
+  WaitForWaiters(1, 0);
+
+  // There is room again once the first one goes away.
+  Close(fd);
+  WaitForWaiters(0, 0);
+  Get("/poll?newer_than=1");
+  WaitForWaiters(1, 0);
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,119 @@
+#include "server/submission_cache.h"
+
+#include <glog/logging.h>
+
+#include "monitoring/monitoring.h"
+
+using ct::SignedCertificateTimestamp;
+using std::bind;
+using std::lock_guard;
+using std::make_pair;
+using std::mutex;
+using std::placeholders::_1;
+using std::string;
+
+namespace cert_trans {
+namespace {
+
+
+static Counter<bool>* submission_cache_lookups(
+    Counter<bool>::New("submission_cache_lookups", "hit",
+                       "Number of lookups for submissions already answered, "
+                       "by whether an SCT was found."));
+
+
+// Roughly how much memory an SCT kept for |key| takes: the key twice,
+// the SCT, the list and hash table nodes.
+size_t EntryMemoryUsage(const string& key,
+                        const SignedCertificateTimestamp& sct) {
+  return 2 * (sizeof(string) + key.size()) + sct.SpaceUsed() +
+         8 * sizeof(void*);
+}
+
+
+}  // namespace
+
+
+SubmissionCache::SubmissionCache(size_t max_size)
+    : max_size_(max_size),
+      bytes_(0),
+      memory_(MemoryAccounting::Instance()->Register(
+          "submission_cache",
+          [this]() {
+            lock_guard<mutex> lock(lock_);
+            return bytes_;
+          },
+          bind(&SubmissionCache::Shrink, this, _1))) {
+}
+
+
+SubmissionCache::~SubmissionCache() {
+}
+
+
+bool SubmissionCache::Lookup(const string& key,
+                             SignedCertificateTimestamp* sct) const {
+  CHECK_NOTNULL(sct);
+  lock_guard<mutex> lock(lock_);
+  const auto it(scts_.find(key));
+  submission_cache_lookups->Increment(it != scts_.end());
+  if (it == scts_.end()) {
+    return false;
+  }
+
+  lru_.splice(lru_.begin(), lru_, it->second.second);
+  sct->CopyFrom(it->second.first);
+  return true;
+}
+
+
+void SubmissionCache::Insert(const string& key,
+                             const SignedCertificateTimestamp& sct) {
+  if (max_size_ == 0) {
+    return;
+  }
+
+  lock_guard<mutex> lock(lock_);
+  const auto it(scts_.find(key));
+  if (it != scts_.end()) {
+    lru_.splice(lru_.begin(), lru_, it->second.second);
+    bytes_ -= EntryMemoryUsage(key, it->second.first);
+    it->second.first.CopyFrom(sct);
+    bytes_ += EntryMemoryUsage(key, it->second.first);
+    return;
+  }
+
+  scts_.emplace(key, make_pair(sct, lru_.insert(lru_.begin(), key)));
+  bytes_ += EntryMemoryUsage(key, sct);
+  while (lru_.size() > max_size_) {
+    EvictLeastRecentlyUsed();
+  }
+}
+
+
+size_t SubmissionCache::size() const {
+  lock_guard<mutex> lock(lock_);
+  return lru_.size();
+}
+
+
+void SubmissionCache::EvictLeastRecentlyUsed() {
+  const auto it(scts_.find(lru_.back()));
+  CHECK(it != scts_.end());
+  bytes_ -= EntryMemoryUsage(it->first, it->second.first);
+  scts_.erase(it);
+  lru_.pop_back();
+}
+
+
+size_t SubmissionCache::Shrink(size_t bytes) {
+  lock_guard<mutex> lock(lock_);
+  const size_t before(bytes_);
+  while (!lru_.empty() && before - bytes_ < bytes) {
+    EvictLeastRecentlyUsed();
+  }
+  return before - bytes_;
+}
+
+
+}  // namespace cert_trans
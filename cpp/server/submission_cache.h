@@ -0,0 +1,67 @@
+#ifndef CERT_TRANS_SERVER_SUBMISSION_CACHE_H_
+#define CERT_TRANS_SERVER_SUBMISSION_CACHE_H_
+
+#include <stddef.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "base/macros.h"
+#include "proto/ct.pb.h"
+#include "util/memory_accounting.h"
+
+namespace cert_trans {
+
+
+// Remembers the SCTs issued for the most recent submissions, by a
+// fingerprint of what was submitted, so that the many resubmissions
+// of the same certificates can be answered without checking their
+// chain or going to the consistent store again.
+//
+// This class is thread-safe.
+class SubmissionCache {
+ public:
+  // Keeps at most |max_size| SCTs (none if 0), fewer if
+  // MemoryAccounting asks for some of them back.
+  explicit SubmissionCache(size_t max_size);
+  ~SubmissionCache();
+
+  // Returns whether an SCT was kept for |key|, and puts it in |sct|.
+  bool Lookup(const std::string& key,
+              ct::SignedCertificateTimestamp* sct) const;
+
+  void Insert(const std::string& key,
+              const ct::SignedCertificateTimestamp& sct);
+
+  size_t size() const;
+
+ private:
+  // |lock_| must be held.
+  void EvictLeastRecentlyUsed();
+  // Evicts the least recently used SCTs until |bytes| have been
+  // freed, returns how many were.
+  size_t Shrink(size_t bytes);
+
+  const size_t max_size_;
+
+  mutable std::mutex lock_;
+  // The keys, most recently used first.
+  mutable std::list<std::string> lru_;
+  std::unordered_map<std::string,
+                     std::pair<ct::SignedCertificateTimestamp,
+                               std::list<std::string>::iterator>> scts_;
+  // Roughly how much memory |scts_| and |lru_| take.
+  size_t bytes_;
+
+  const std::unique_ptr<MemoryAccounting::Registration> memory_;
+
+  DISALLOW_COPY_AND_ASSIGN(SubmissionCache);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_SUBMISSION_CACHE_H_
@@ -0,0 +1,68 @@
+#include "server/submission_cache.h"
+
+#include <gtest/gtest.h>
+
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using ct::SignedCertificateTimestamp;
+
+
+SignedCertificateTimestamp MakeSCT(uint64_t timestamp) {
+  SignedCertificateTimestamp sct;
+  sct.set_version(ct::V1);
+  sct.set_timestamp(timestamp);
+  return sct;
+}
+
+
+TEST(SubmissionCacheTest, LookupAndInsert) {
+  SubmissionCache cache(10);
+  SignedCertificateTimestamp sct;
+  EXPECT_FALSE(cache.Lookup("a", &sct));
+
+  cache.Insert("a", MakeSCT(1));
+  cache.Insert("b", MakeSCT(2));
+  ASSERT_TRUE(cache.Lookup("a", &sct));
+  EXPECT_EQ(1U, sct.timestamp());
+  ASSERT_TRUE(cache.Lookup("b", &sct));
+  EXPECT_EQ(2U, sct.timestamp());
+  EXPECT_EQ(2U, cache.size());
+}
+
+
+TEST(SubmissionCacheTest, EvictsLeastRecentlyUsed) {
+  SubmissionCache cache(2);
+  cache.Insert("a", MakeSCT(1));
+  cache.Insert("b", MakeSCT(2));
+
+  SignedCertificateTimestamp sct;
+  EXPECT_TRUE(cache.Lookup("a", &sct));
+  cache.Insert("c", MakeSCT(3));
+  EXPECT_EQ(2U, cache.size());
+  EXPECT_TRUE(cache.Lookup("a", &sct));
+  EXPECT_FALSE(cache.Lookup("b", &sct));
+  EXPECT_TRUE(cache.Lookup("c", &sct));
+}
+
+
+TEST(SubmissionCacheTest, Disabled) {
+  SubmissionCache cache(0);
+  cache.Insert("a", MakeSCT(1));
+
+  SignedCertificateTimestamp sct;
+  EXPECT_FALSE(cache.Lookup("a", &sct));
+  EXPECT_EQ(0U, cache.size());
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
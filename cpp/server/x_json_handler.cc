@@ -1,9 +1,12 @@
 #include "server/x_json_handler.h"
 
+#include <event2/buffer.h>
 #include <functional>
 
 #include "log/frontend.h"
 #include "server/json_output.h"
+#include "util/json_reader.h"
+#include "util/json_writer.h"
 #include "util/statusor.h"
 #include "util/thread_pool.h"
 
@@ -19,38 +22,10 @@ using std::multimap;
 using std::placeholders::_1;
 using std::shared_ptr;
 using std::string;
+using std::unique_ptr;
 using util::Status;
 
 
-namespace {
-
-
-shared_ptr<JsonObject> ExtractJson(libevent::Base* base, evhttp_request* req) {
-  CHECK_NOTNULL(base);
-  CHECK_NOTNULL(req);
-  if (evhttp_request_get_command(req) != EVHTTP_REQ_POST) {
-    SendJsonError(base, req, HTTP_BADMETHOD, "Method not allowed.");
-    return nullptr;
-  }
-
-  // TODO(pphaneuf): Should we check that Content-Type says
-  // "application/json", as recommended by RFC4627?
-  shared_ptr<JsonObject> json_body(
-      make_shared<JsonObject>(evhttp_request_get_input_buffer(req)));
-  if (!json_body->Ok() || !json_body->IsType(json_type_object)) {
-    SendJsonError(base, req, HTTP_BADREQUEST,
-                  "Unable to parse provided JSON.");
-    return nullptr;
-  }
-
-  VLOG(2) << "ExtractJson:\n" << json_body->DebugString();
-  return json_body;
-}
-
-
-}  // namespace
-
-
 XJsonHttpHandler::XJsonHttpHandler(LogLookup* log_lookup,
                                    const ReadOnlyDatabase* db,
                                    const ClusterStateController* controller,
@@ -69,33 +44,75 @@ void XJsonHttpHandler::AddHandlers(libevent::HttpServer* server) {
     // more up-to-date node will have a better chance of handling dupes
     // correctly, rather than bloating the tree.
     AddProxyWrappedHandler(server, "/ct/v1/add-json",
-                           bind(&XJsonHttpHandler::AddJson, this, _1));
+                           bind(&XJsonHttpHandler::AddJson, this, _1),
+                           RequestQueue::Priority::LOW);
   }
 }
 
 
 void XJsonHttpHandler::AddJson(evhttp_request* req) {
-  shared_ptr<JsonObject> json(ExtractJson(event_base_, req));
-  if (!json) {
-    return;
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_POST) {
+    return SendJsonError(event_base_, req, HTTP_BADMETHOD,
+                         "Method not allowed.");
   }
 
-  pool_->Add(bind(&XJsonHttpHandler::BlockingAddJson, this, req, json));
+  // TODO(pphaneuf): Should we check that Content-Type says
+  // "application/json", as recommended by RFC4627?
+  evbuffer* const input(evhttp_request_get_input_buffer(req));
+  const size_t length(evbuffer_get_length(input));
+  const shared_ptr<const string> body(
+      length > 0 ? make_shared<const string>(
+                       reinterpret_cast<const char*>(
+                           evbuffer_pullup(input, length)),
+                       length)
+                 : make_shared<const string>());
+
+  RunOnPool(req, "/ct/v1/add-json",
+            bind(&XJsonHttpHandler::BlockingAddJson, this, req, body));
 }
 
 
-void XJsonHttpHandler::BlockingAddJson(evhttp_request* req,
-                                       shared_ptr<JsonObject> json) const {
-  SignedCertificateTimestamp sct;
+void XJsonHttpHandler::BlockingAddJson(
+    evhttp_request* req, const shared_ptr<const string>& body) const {
+  // The canonical form is written straight from the request, without
+  // building a json-c tree of it first.
+  const unique_ptr<evbuffer, void (*)(evbuffer*)> buffer(
+      CHECK_NOTNULL(evbuffer_new()), evbuffer_free);
+  JsonWriter writer(buffer.get());
+  JsonReader reader(*body);
+  if (!reader.Copy(&writer) || !reader.AtEnd() ||
+      *evbuffer_pullup(buffer.get(), 1) != '{') {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Unable to parse provided JSON.");
+  }
 
   LogEntry entry;
   // do this here for now
   entry.set_type(X_JSON_ENTRY);
-  entry.mutable_x_json_entry()->set_json(json->ToString());
+  entry.mutable_x_json_entry()->set_json(
+      reinterpret_cast<const char*>(evbuffer_pullup(buffer.get(), -1)),
+      evbuffer_get_length(buffer.get()));
+
+  // Like for certificates, the reply is sent once the entry is in the
+  // consistent store, from the thread completing the write, which lets
+  // the frontend batch the writes of concurrent submissions.
+  SignedCertificateTimestamp* const sct(new SignedCertificateTimestamp);
+  CHECK_NOTNULL(frontend_)->QueueProcessedEntry(
+      Status::OK, entry, sct,
+      new util::Task(bind(&XJsonHttpHandler::QueueEntryDone, this, req, sct,
+                          _1),
+                     pool_));
+}
+
+
+void XJsonHttpHandler::QueueEntryDone(evhttp_request* req,
+                                      SignedCertificateTimestamp* sct,
+                                      util::Task* task) const {
+  const unique_ptr<SignedCertificateTimestamp> sct_deleter(sct);
+  const Status status(task->status());
+  delete task;
 
-  AddEntryReply(req, CHECK_NOTNULL(frontend_)
-                         ->QueueProcessedEntry(Status::OK, entry, &sct),
-                sct);
+  AddEntryReply(req, status, *sct);
 }
 
 
@@ -2,11 +2,12 @@
 #define CERT_TRANS_SERVER_X_JSON_HANDLER_H_
 
 #include <memory>
+#include <string>
 
 #include "log/logged_entry.h"
 #include "server/handler.h"
 #include "server/staleness_tracker.h"
-#include "util/json_wrapper.h"
+#include "util/task.h"
 
 namespace cert_trans {
 
@@ -31,8 +32,11 @@ class XJsonHttpHandler : public HttpHandler {
 
   void AddJson(evhttp_request* req);
 
+  // Canonicalizes the JSON object in |body|, and queues it.
   void BlockingAddJson(evhttp_request* req,
-                       std::shared_ptr<JsonObject> json) const;
+                       const std::shared_ptr<const std::string>& body) const;
+  void QueueEntryDone(evhttp_request* req, ct::SignedCertificateTimestamp* sct,
+                      util::Task* task) const;
 
   DISALLOW_COPY_AND_ASSIGN(XJsonHttpHandler);
 };
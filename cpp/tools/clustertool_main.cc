@@ -91,7 +91,7 @@ unique_ptr<TreeSigner> BuildTreeSigner(Database* db,
       new TreeSigner(std::chrono::duration<double>(0), db,
                      unique_ptr<CompactMerkleTree>(new CompactMerkleTree(
                          unique_ptr<Sha256Hasher>(new Sha256Hasher))),
-                     consistent_store, log_signer));
+                     consistent_store, log_signer, NULL));
 }
 
 
@@ -1,18 +1,33 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <limits.h>
+#include <algorithm>
+#include <atomic>
 #include <functional>
 #include <iostream>
+#include <iterator>
+#include <map>
 #include <memory>
+#include <set>
+#include <thread>
+#include <vector>
 
 #include "log/database.h"
 #include "log/file_db.h"
 #include "log/file_storage.h"
+#include "log/leaf_hasher.h"
 #include "log/leveldb_db.h"
 #include "log/logged_entry.h"
+#include "log/segment_db.h"
 #include "log/sqlite_db.h"
+#include "merkletree/compact_merkle_tree.h"
+#include "merkletree/digest.h"
+#include "merkletree/merkle_tree.h"
+#include "merkletree/mmap_node_store.h"
+#include "merkletree/serial_hasher.h"
 #include "proto/serializer.h"
 #include "util/init.h"
+#include "util/thread_pool.h"
 #include "util/util.h"
 
 DEFINE_string(cert_dir, "", "Storage directory for certificates");
@@ -28,31 +43,133 @@ DEFINE_string(sqlite_db, "",
               "SQLite database for certificate and tree storage");
 DEFINE_string(leveldb_db, "",
               "LevelDB database for certificate and tree storage");
+DEFINE_string(segment_db, "",
+              "Directory of segment files for certificate and tree storage");
+
+DEFINE_string(dest_sqlite_db, "",
+              "SQLite database to copy or import the entries to");
+DEFINE_string(dest_leveldb_db, "",
+              "LevelDB database to copy or import the entries to");
+DEFINE_string(dest_segment_db, "",
+              "Directory of segment files to copy or import the entries to");
+DEFINE_string(dest_merkle_node_store_dir, "",
+              "Existing, empty directory to build the Merkle tree nodes of a "
+              "snapshot in, for the node started on it with "
+              "--merkle_node_store_dir");
 
 DEFINE_int64(start, 0, "Starting sequence number (inclusive).");
 DEFINE_int64(end, std::numeric_limits<int64_t>::max(),
              "Ending sequence number (inclusive).");
+DEFINE_int32(num_threads, 8,
+             "Number of threads copying, importing or hashing entries.");
+DEFINE_int32(batch_size, 1000,
+             "Number of entries read or written at a time.");
 
+using cert_trans::Database;
 using cert_trans::FileDB;
 using cert_trans::FileStorage;
+using cert_trans::LeafHasher;
 using cert_trans::LevelDB;
 using cert_trans::LoggedEntry;
+using cert_trans::MmapNodeStore;
 using cert_trans::ReadOnlyDatabase;
+using cert_trans::SegmentDB;
 using cert_trans::SQLiteDB;
+using cert_trans::ThreadPool;
+using cert_trans::serialization::DeserializeResult;
 using cert_trans::serialization::SerializeResult;
+using std::atomic;
 using std::cerr;
+using std::cin;
 using std::cout;
 using std::function;
+using std::map;
+using std::min;
+using std::prev;
+using std::set;
 using std::string;
+using std::thread;
 using std::unique_ptr;
+using std::vector;
 using util::InitCT;
 using util::ToBase64;
 
+namespace {
+
+
+// The records of the export format: a type byte, then the size of
+// the data (4 bytes, big-endian), then the data.
+const char kEntryRecord = 'e';
+const char kTreeHeadRecord = 's';
+
+// Must be a power of two, see VerifyTree().
+const int64_t kSubtreeSize = 1 << 16;
+
 
 void Usage() {
   cerr << "Usage: db_tool [flags] <command>\n"
        << "Where <command> is one of:\n"
-       << "  dump_leaf_inputs\n";
+       << "  dump_leaf_inputs\n"
+       << "  copy         copy the entries and the latest tree head to the "
+       << "--dest_* database\n"
+       << "  export       write the entries and the latest tree head to "
+       << "stdout\n"
+       << "  import       read what export wrote from stdin, into the "
+       << "--dest_* database\n"
+       << "  snapshot     copy the latest tree head and its entries to the "
+       << "--dest_* database, and\n"
+       << "               build its Merkle tree in "
+       << "--dest_merkle_node_store_dir\n"
+       << "  verify_tree  check the entries against all the tree heads\n";
+}
+
+
+// Returns NULL if none of the flags is set.
+unique_ptr<Database> OpenDatabase(const string& sqlite_db,
+                                  const string& leveldb_db,
+                                  const string& segment_db) {
+  unique_ptr<Database> db;
+  if (!sqlite_db.empty()) {
+    db.reset(new SQLiteDB(sqlite_db));
+  } else if (!leveldb_db.empty()) {
+    db.reset(new LevelDB(leveldb_db));
+  } else if (!segment_db.empty()) {
+    db.reset(new SegmentDB(segment_db));
+  }
+  return db;
+}
+
+
+unique_ptr<Database> OpenDestination() {
+  CHECK_EQ(!FLAGS_dest_sqlite_db.empty() + !FLAGS_dest_leveldb_db.empty() +
+               !FLAGS_dest_segment_db.empty(),
+           1)
+      << "Must specify exactly one destination database.";
+  return OpenDatabase(FLAGS_dest_sqlite_db, FLAGS_dest_leveldb_db,
+                      FLAGS_dest_segment_db);
+}
+
+
+// Calls |f| with the entries from |start| to |end| (inclusive), in
+// order and batch by batch, skipping over the missing ones.
+void ForEachBatch(const ReadOnlyDatabase* db, int64_t start, int64_t end,
+                  const function<void(const vector<LoggedEntry>&)>& f) {
+  vector<LoggedEntry> entries;
+  while (start <= end) {
+    db->ReadRange(start, min<int64_t>(FLAGS_batch_size, end - start + 1),
+                  &entries);
+    if (entries.empty()) {
+      // Find where the entries start again.
+      LoggedEntry next;
+      if (!db->ScanEntries(start)->GetNextEntry(&next)) {
+        return;
+      }
+      start = next.sequence_number();
+      continue;
+    }
+    f(entries);
+    start = entries.back().sequence_number() + 1;
+  }
 }
 
 
@@ -69,6 +186,385 @@ void ForEachLeaf(const ReadOnlyDatabase* db,
 }
 
 
+void WriteRecord(char type, const string& data) {
+  cout << type << Serializer::SerializeUint(data.size(), 4) << data;
+}
+
+
+// Returns false at the end of the input.
+bool ReadRecord(char* type, string* data) {
+  string size_bytes(4, '\0');
+  if (!cin.get(*type)) {
+    return false;
+  }
+  CHECK(cin.read(&size_bytes[0], size_bytes.size())) << "Truncated input";
+  uint64_t size;
+  CHECK_EQ(DeserializeResult::OK,
+           Deserializer::DeserializeUint(size_bytes, 4, &size));
+  data->resize(size);
+  CHECK(cin.read(&(*data)[0], size)) << "Truncated input";
+  return true;
+}
+
+
+// The root hashes of an aligned subtree of the log.
+struct Subtree {
+  Subtree() : first_missing(-1) {
+  }
+
+  // The first entry of the subtree that is missing, if any (in which
+  // case |root| is not set).
+  int64_t first_missing;
+  Digest root;
+  // The roots of the first leaves of the subtree, by the tree sizes
+  // of the tree heads that fall in it.
+  map<int64_t, Digest> partial_roots;
+};
+
+
+// Fills |subtree| with the roots of the entries from |start| to |end|
+// (exclusive).
+void HashSubtree(const ReadOnlyDatabase* db, int64_t start, int64_t end,
+                 const set<int64_t>& tree_sizes, Subtree* subtree) {
+  // The parallelism is between subtrees, so this is all done here.
+  const LeafHasher leaf_hasher(
+      unique_ptr<SerialHasher>(new Sha256Hasher), nullptr);
+  CompactMerkleTree tree(unique_ptr<SerialHasher>(new Sha256Hasher));
+  set<int64_t>::const_iterator tree_size(tree_sizes.upper_bound(start));
+  vector<LoggedEntry> entries;
+  for (int64_t batch_start = start; batch_start < end;
+       batch_start += entries.size()) {
+    db->ReadLeafRange(batch_start,
+                      min<int64_t>(FLAGS_batch_size, end - batch_start),
+                      &entries);
+    if (entries.empty()) {
+      subtree->first_missing = batch_start;
+      return;
+    }
+
+    const vector<Digest> hashes(leaf_hasher.HashLeaves(entries));
+    const int64_t batch_end(batch_start + entries.size());
+    vector<Digest>::const_iterator added(hashes.begin());
+    for (; tree_size != tree_sizes.end() && *tree_size < batch_end;
+         ++tree_size) {
+      const vector<Digest>::const_iterator next(
+          hashes.begin() + (*tree_size - batch_start));
+      tree.AddLeafHashes(vector<Digest>(added, next));
+      added = next;
+      subtree->partial_roots[*tree_size] = Digest(tree.CurrentRoot());
+    }
+    tree.AddLeafHashes(vector<Digest>(added, hashes.end()));
+  }
+  subtree->root = Digest(tree.CurrentRoot());
+}
+
+
+// Checks the entries of |db| against all of its tree heads, hashing
+// aligned subtrees of kSubtreeSize entries on --num_threads threads.
+// Since kSubtreeSize is a power of two, the root of the first n
+// entries is that of the tree of the roots of the subtrees they
+// cover (the last of which can be partial), so every root can be
+// computed from them. Reports the problems found rather than
+// stopping at the first one.
+int VerifyTree(const ReadOnlyDatabase* db) {
+  vector<ct::SignedTreeHead> sths;
+  db->ReadTreeHeads(&sths);
+  if (sths.empty()) {
+    LOG(WARNING) << "No tree head to verify the entries against";
+    return 0;
+  }
+
+  int ret(0);
+  set<int64_t> tree_sizes;
+  for (size_t i = 0; i < sths.size(); ++i) {
+    if (i > 0 && sths[i].tree_size() < sths[i - 1].tree_size()) {
+      LOG(ERROR) << "The tree head of timestamp " << sths[i].timestamp()
+                 << " has a smaller tree size than the previous one ("
+                 << sths[i].tree_size() << " < "
+                 << sths[i - 1].tree_size() << ")";
+      ret = 1;
+    }
+    tree_sizes.insert(sths[i].tree_size());
+  }
+
+  const int64_t num_entries(*tree_sizes.rbegin());
+  vector<Subtree> subtrees((num_entries + kSubtreeSize - 1) / kSubtreeSize);
+  atomic<size_t> next_subtree(0);
+  vector<thread> threads;
+  for (int i = 0; i < FLAGS_num_threads; ++i) {
+    threads.emplace_back([&]() {
+      for (size_t j = next_subtree++; j < subtrees.size();
+           j = next_subtree++) {
+        const int64_t start(j * kSubtreeSize);
+        HashSubtree(db, start, min(start + kSubtreeSize, num_entries),
+                    tree_sizes, &subtrees[j]);
+        LOG_EVERY_N(INFO, 100) << "Hashed " << google::COUNTER << " of "
+                               << subtrees.size() << " subtrees";
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  // The root for every tree size we have all the entries for.
+  map<int64_t, string> roots;
+  int64_t first_missing(-1);
+  CompactMerkleTree tree(unique_ptr<SerialHasher>(new Sha256Hasher));
+  roots[0] = tree.CurrentRoot();
+  for (size_t i = 0; i < subtrees.size(); ++i) {
+    for (const auto& partial_root : subtrees[i].partial_roots) {
+      CompactMerkleTree partial_tree(
+          tree, unique_ptr<SerialHasher>(new Sha256Hasher));
+      partial_tree.AddLeafHashes({partial_root.second});
+      roots[partial_root.first] = partial_tree.CurrentRoot();
+    }
+    if (subtrees[i].first_missing >= 0) {
+      first_missing = subtrees[i].first_missing;
+      break;
+    }
+    tree.AddLeafHashes({subtrees[i].root});
+    roots[min<int64_t>((i + 1) * kSubtreeSize, num_entries)] =
+        tree.CurrentRoot();
+  }
+  if (first_missing >= 0) {
+    LOG(ERROR) << "Entry " << first_missing << " is missing, the tree "
+               << "heads of larger trees cannot be verified";
+    ret = 1;
+  }
+
+  // The smallest tree size with a root that does not match, and the
+  // largest one below it with a root that does: the first bad entry
+  // is between them.
+  int64_t first_bad(-1);
+  set<int64_t> good_tree_sizes;
+  for (const auto& sth : sths) {
+    const map<int64_t, string>::const_iterator root(
+        roots.find(sth.tree_size()));
+    if (root == roots.end()) {
+      continue;
+    }
+    if (root->second == sth.sha256_root_hash()) {
+      good_tree_sizes.insert(sth.tree_size());
+    } else {
+      LOG(ERROR) << "The root hash of the tree head of timestamp "
+                 << sth.timestamp() << " (tree size " << sth.tree_size()
+                 << ") does not match the one of the entries";
+      if (first_bad < 0 || sth.tree_size() < first_bad) {
+        first_bad = sth.tree_size();
+      }
+    }
+  }
+  if (first_bad >= 0) {
+    const set<int64_t>::const_iterator last_good(
+        good_tree_sizes.lower_bound(first_bad));
+    const int64_t first_suspect(
+        last_good == good_tree_sizes.begin() ? 0 : *prev(last_good));
+    LOG(ERROR) << "The first mismatching entry is one of " << first_suspect
+               << " to " << first_bad - 1;
+    ret = 1;
+  }
+
+  if (ret == 0) {
+    LOG(INFO) << "Verified " << num_entries << " entries against "
+              << sths.size() << " tree heads";
+  }
+  return ret;
+}
+
+
+// Copies the entries from |start| to |end| (inclusive) to |dest|,
+// splitting the range into batches, copied by --num_threads threads.
+void CopyEntries(const ReadOnlyDatabase* db, Database* dest, int64_t start,
+                 int64_t end) {
+  atomic<int64_t> next_chunk(start);
+  atomic<int64_t> num_copied(0);
+  // Large enough for the threads not to hit the same segments or
+  // pages, small enough to keep them all busy until the end.
+  const int64_t chunk_size(static_cast<int64_t>(FLAGS_batch_size) * 16);
+  vector<thread> threads;
+  for (int i = 0; i < FLAGS_num_threads; ++i) {
+    threads.emplace_back([&]() {
+      for (int64_t start = next_chunk.fetch_add(chunk_size); start <= end;
+           start = next_chunk.fetch_add(chunk_size)) {
+        ForEachBatch(db, start, min(end, start + chunk_size - 1),
+                     [&](const vector<LoggedEntry>& entries) {
+                       CHECK_EQ(Database::OK,
+                                dest->CreateSequencedEntries(entries,
+                                                             nullptr));
+                       const int64_t copied(num_copied += entries.size());
+                       LOG_EVERY_N(INFO, 100) << "Copied " << copied
+                                              << " entries";
+                     });
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  LOG(INFO) << "Copied " << num_copied << " entries";
+}
+
+
+int Copy(const ReadOnlyDatabase* db) {
+  const unique_ptr<Database> dest(OpenDestination());
+  CopyEntries(db, dest.get(), FLAGS_start,
+              min(FLAGS_end, db->TreeSize() - 1));
+
+  ct::SignedTreeHead sth;
+  if (db->LatestTreeHead(&sth) == Database::LOOKUP_OK) {
+    CHECK_EQ(Database::OK, dest->WriteTreeHead(sth));
+  }
+  return VerifyTree(dest.get());
+}
+
+
+// Builds the Merkle tree of the first |sth.tree_size()| entries of
+// |db| in a node store in |dir|, checking its root against |sth|.
+// This is what LogLookup would otherwise do when starting, entry by
+// entry, on the node using the snapshot.
+void BuildNodeStore(const ReadOnlyDatabase* db, const ct::SignedTreeHead& sth,
+                    const string& dir) {
+  MerkleTree tree(unique_ptr<Sha256Hasher>(new Sha256Hasher),
+                  unique_ptr<MmapNodeStore>(
+                      new MmapNodeStore(dir, Sha256Hasher().DigestSize())));
+  CHECK_EQ(0U, tree.LeafCount()) << "Node store in " << dir
+                                 << " is not empty";
+
+  ThreadPool pool(FLAGS_num_threads);
+  const LeafHasher leaf_hasher(unique_ptr<SerialHasher>(new Sha256Hasher),
+                               &pool);
+  ForEachBatch(db, 0, sth.tree_size() - 1,
+               [&](const vector<LoggedEntry>& entries) {
+                 CHECK_EQ(tree.LeafCount(), static_cast<size_t>(
+                                                entries[0].sequence_number()))
+                     << "Entry " << tree.LeafCount() << " is missing";
+                 tree.AddLeafHashes(leaf_hasher.HashLeaves(entries));
+                 LOG_EVERY_N(INFO, 100) << "Hashed " << tree.LeafCount()
+                                        << " entries";
+               });
+  CHECK_EQ(static_cast<size_t>(sth.tree_size()), tree.LeafCount())
+      << "Entry " << tree.LeafCount() << " is missing";
+  CHECK_EQ(util::HexString(tree.CurrentRoot()),
+           util::HexString(sth.sha256_root_hash()))
+      << "The root hash of the entries does not match the tree head";
+  tree.SyncNodes();
+  LOG(INFO) << "Built the Merkle tree of " << tree.LeafCount()
+            << " entries in " << dir;
+}
+
+
+// Copies a consistent snapshot of the log to the --dest_* database:
+// its latest tree head, and exactly the entries covered by it (not
+// the node ID, the node using the copy picks its own). With
+// --dest_merkle_node_store_dir, the Merkle tree is built as well, so
+// that a node started on the snapshot can serve right away, and only
+// has to fetch and hash the entries added to the log since.
+int Snapshot(const ReadOnlyDatabase* db) {
+  ct::SignedTreeHead sth;
+  CHECK_EQ(Database::LOOKUP_OK, db->LatestTreeHead(&sth))
+      << "No tree head to snapshot";
+
+  const unique_ptr<Database> dest(OpenDestination());
+  CopyEntries(db, dest.get(), 0, sth.tree_size() - 1);
+  CHECK_EQ(Database::OK, dest->WriteTreeHead(sth));
+
+  if (FLAGS_dest_merkle_node_store_dir.empty()) {
+    return VerifyTree(dest.get());
+  }
+  BuildNodeStore(dest.get(), sth, FLAGS_dest_merkle_node_store_dir);
+  LOG(INFO) << "Snapshot at tree size " << sth.tree_size() << " done";
+  return 0;
+}
+
+
+int Export(const ReadOnlyDatabase* db) {
+  vector<string> entries;
+  int64_t start(FLAGS_start);
+  int64_t num_exported(0);
+  while (start <= FLAGS_end) {
+    db->ReadRawRange(start, min<int64_t>(FLAGS_batch_size,
+                                         FLAGS_end - start + 1),
+                     &entries);
+    if (entries.empty()) {
+      LoggedEntry next;
+      if (!db->ScanEntries(start)->GetNextEntry(&next)) {
+        break;
+      }
+      start = next.sequence_number();
+      continue;
+    }
+    for (const auto& entry : entries) {
+      WriteRecord(kEntryRecord, entry);
+    }
+    num_exported += entries.size();
+    start += entries.size();
+  }
+
+  ct::SignedTreeHead sth;
+  if (db->LatestTreeHead(&sth) == Database::LOOKUP_OK) {
+    string serialized;
+    CHECK(sth.SerializeToString(&serialized));
+    WriteRecord(kTreeHeadRecord, serialized);
+  }
+  CHECK(cout.flush());
+  LOG(INFO) << "Exported " << num_exported << " entries";
+  return 0;
+}
+
+
+// Reads --num_threads batches at a time, and writes them in parallel.
+int Import() {
+  const unique_ptr<Database> dest(OpenDestination());
+  vector<vector<LoggedEntry>> batches(FLAGS_num_threads);
+  int64_t num_imported(0);
+  bool done(false);
+  char type;
+  string data;
+  while (!done) {
+    size_t num_batches(0);
+    for (; num_batches < batches.size(); ++num_batches) {
+      vector<LoggedEntry>* const batch(&batches[num_batches]);
+      batch->clear();
+      while (batch->size() < static_cast<size_t>(FLAGS_batch_size)) {
+        if (!ReadRecord(&type, &data)) {
+          done = true;
+          break;
+        }
+        if (type == kTreeHeadRecord) {
+          ct::SignedTreeHead sth;
+          CHECK(sth.ParseFromString(data));
+          CHECK_EQ(Database::OK, dest->WriteTreeHead(sth));
+          continue;
+        }
+        CHECK_EQ(kEntryRecord, type) << "Unexpected record";
+        batch->emplace_back();
+        CHECK(batch->back().ParseFromString(data));
+      }
+      if (done) {
+        ++num_batches;
+        break;
+      }
+    }
+
+    vector<thread> threads;
+    for (size_t i = 0; i < num_batches; ++i) {
+      num_imported += batches[i].size();
+      threads.emplace_back([&dest, &batches, i]() {
+        CHECK_EQ(Database::OK,
+                 dest->CreateSequencedEntries(batches[i], nullptr));
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    LOG(INFO) << "Imported " << num_imported << " entries";
+  }
+
+  return VerifyTree(dest.get());
+}
+
+
 int DumpLeafInputs(const ReadOnlyDatabase* db) {
   CHECK_NOTNULL(db);
   ForEachLeaf(db, [](const LoggedEntry& cert) {
@@ -86,6 +582,9 @@ int DumpLeafInputs(const ReadOnlyDatabase* db) {
 }
 
 
+}  // namespace
+
+
 int main(int argc, char* argv[]) {
   InitCT(&argc, &argv);
 
@@ -98,23 +597,21 @@ int main(int argc, char* argv[]) {
   // TODO(alcutter): Refactor this out into a common CreateDatabase() call
   // somewhere.
   if (!FLAGS_sqlite_db.empty() + !FLAGS_leveldb_db.empty() +
+          !FLAGS_segment_db.empty() +
           (!FLAGS_cert_dir.empty() | !FLAGS_tree_dir.empty()) !=
       1) {
     LOG(FATAL) << "Must only specify one database type.";
   }
 
-  if (FLAGS_sqlite_db.empty() && FLAGS_leveldb_db.empty()) {
+  if (FLAGS_sqlite_db.empty() && FLAGS_leveldb_db.empty() &&
+      FLAGS_segment_db.empty()) {
     CHECK_NE(FLAGS_cert_dir, FLAGS_tree_dir)
         << "Certificate directory and tree directory must differ";
   }
 
-  unique_ptr<ReadOnlyDatabase> db;
-
-  if (!FLAGS_sqlite_db.empty()) {
-    db.reset(new SQLiteDB(FLAGS_sqlite_db));
-  } else if (!FLAGS_leveldb_db.empty()) {
-    db.reset(new LevelDB(FLAGS_leveldb_db));
-  } else {
+  unique_ptr<Database> db(OpenDatabase(FLAGS_sqlite_db, FLAGS_leveldb_db,
+                                      FLAGS_segment_db));
+  if (!db) {
     db.reset(
         new FileDB(new FileStorage(FLAGS_cert_dir, FLAGS_cert_storage_depth),
                    new FileStorage(FLAGS_tree_dir, FLAGS_tree_storage_depth),
@@ -124,6 +621,16 @@ int main(int argc, char* argv[]) {
 
   if (strcmp(argv[1], "dump_leaf_inputs") == 0) {
     return DumpLeafInputs(db.get());
+  } else if (strcmp(argv[1], "copy") == 0) {
+    return Copy(db.get());
+  } else if (strcmp(argv[1], "export") == 0) {
+    return Export(db.get());
+  } else if (strcmp(argv[1], "import") == 0) {
+    return Import();
+  } else if (strcmp(argv[1], "snapshot") == 0) {
+    return Snapshot(db.get());
+  } else if (strcmp(argv[1], "verify_tree") == 0) {
+    return VerifyTree(db.get());
   } else {
     Usage();
     return 1;
@@ -0,0 +1,163 @@
+#include "config.h"
+#include "util/allocator_stats.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#if defined(HAVE_LIBTCMALLOC)
+#include <gperftools/malloc_extension.h>
+#elif defined(HAVE_LIBJEMALLOC)
+#include <jemalloc/jemalloc.h>
+#elif defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#include "monitoring/monitoring.h"
+
+using std::string;
+using std::to_string;
+
+DEFINE_int32(tcmalloc_max_total_thread_cache_mb, 0,
+             "upper bound on the memory held by the thread caches of "
+             "tcmalloc, in MB (0 for the tcmalloc default). Ignored with "
+             "other allocators (jemalloc takes its tuning from MALLOC_CONF)");
+
+namespace cert_trans {
+namespace {
+
+
+static Gauge<string>* allocator_bytes(
+    Gauge<string>::New("allocator_bytes", "stat",
+                       "Memory statistics of the malloc implementation, in "
+                       "bytes: in_use by the application, heap mapped from "
+                       "the system, free in it, in the thread_caches, "
+                       "metadata, and unmapped (returned to the system)."));
+
+static Gauge<>* allocator_fragmentation_ratio(
+    Gauge<>::New("allocator_fragmentation_ratio",
+                 "Share of the heap mapped by the malloc implementation "
+                 "which is not in use by the application."));
+
+
+void SetStats(size_t in_use, size_t heap) {
+  allocator_bytes->Set("in_use", in_use);
+  allocator_bytes->Set("heap", heap);
+  allocator_fragmentation_ratio->Set(
+      heap > in_use ? static_cast<double>(heap - in_use) / heap : 0);
+}
+
+
+#if defined(HAVE_LIBTCMALLOC)
+size_t TcmallocProperty(const char* name) {
+  size_t value(0);
+  LOG_IF(WARNING, !MallocExtension::instance()->GetNumericProperty(name,
+                                                                   &value))
+      << "tcmalloc has no property " << name;
+  return value;
+}
+#elif defined(HAVE_LIBJEMALLOC)
+// Returns false if this version of jemalloc does not have |name|.
+bool JemallocStat(const char* name, size_t* value) {
+  size_t size(sizeof(*value));
+  return mallctl(name, value, &size, nullptr, 0) == 0;
+}
+#endif
+
+
+}  // namespace
+
+
+const char* AllocatorName() {
+#if defined(HAVE_LIBTCMALLOC)
+  return "tcmalloc";
+#elif defined(HAVE_LIBJEMALLOC)
+  return "jemalloc";
+#else
+  return "glibc";
+#endif
+}
+
+
+void ConfigureAllocator() {
+  LOG(INFO) << "Using the " << AllocatorName() << " allocator";
+  if (FLAGS_tcmalloc_max_total_thread_cache_mb <= 0) {
+    return;
+  }
+#ifdef HAVE_LIBTCMALLOC
+  CHECK(MallocExtension::instance()->SetNumericProperty(
+      "tcmalloc.max_total_thread_cache_bytes",
+      static_cast<size_t>(FLAGS_tcmalloc_max_total_thread_cache_mb) << 20));
+#else
+  LOG(WARNING) << "--tcmalloc_max_total_thread_cache_mb is ignored, "
+               << "tcmalloc is not linked in";
+#endif
+}
+
+
+bool UpdateAllocatorStats() {
+#if defined(HAVE_LIBTCMALLOC)
+  const size_t heap(TcmallocProperty("generic.heap_size"));
+  const size_t unmapped(TcmallocProperty("tcmalloc.pageheap_unmapped_bytes"));
+  SetStats(TcmallocProperty("generic.current_allocated_bytes"),
+           heap - unmapped);
+  allocator_bytes->Set("unmapped", unmapped);
+  allocator_bytes->Set("free",
+                       TcmallocProperty("tcmalloc.pageheap_free_bytes") +
+                           TcmallocProperty(
+                               "tcmalloc.central_cache_free_bytes") +
+                           TcmallocProperty(
+                               "tcmalloc.transfer_cache_free_bytes"));
+  allocator_bytes->Set("thread_caches",
+                       TcmallocProperty(
+                           "tcmalloc.current_total_thread_cache_bytes"));
+  allocator_bytes->Set("max_thread_caches",
+                       TcmallocProperty(
+                           "tcmalloc.max_total_thread_cache_bytes"));
+#elif defined(HAVE_LIBJEMALLOC)
+  // The statistics are only refreshed when the epoch is bumped.
+  uint64_t epoch(1);
+  mallctl("epoch", nullptr, nullptr, &epoch, sizeof(epoch));
+  size_t allocated(0), resident(0), active(0), value(0);
+  if (!JemallocStat("stats.allocated", &allocated) ||
+      !JemallocStat("stats.resident", &resident) ||
+      !JemallocStat("stats.active", &active)) {
+    LOG(WARNING) << "jemalloc was built without statistics";
+    return false;
+  }
+  SetStats(allocated, resident);
+  allocator_bytes->Set("free", active - allocated);
+  if (JemallocStat("stats.metadata", &value)) {
+    allocator_bytes->Set("metadata", value);
+  }
+  if (JemallocStat("stats.retained", &value)) {
+    allocator_bytes->Set("unmapped", value);
+  }
+#ifdef MALLCTL_ARENAS_ALL
+  const string tcache_bytes("stats.arenas." +
+                            to_string(MALLCTL_ARENAS_ALL) +
+                            ".tcache_bytes");
+  if (JemallocStat(tcache_bytes.c_str(), &value)) {
+    allocator_bytes->Set("thread_caches", value);
+  }
+#endif
+#elif defined(__GLIBC__)
+  // mallinfo() has int fields, which wrap past 2GB.
+#if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33)
+  const struct mallinfo2 info(mallinfo2());
+#else
+  const struct mallinfo info(mallinfo());
+#endif
+  // The chunks allocated with mmap() are counted apart from the arenas.
+  SetStats(static_cast<size_t>(info.uordblks) + info.hblkhd,
+           static_cast<size_t>(info.arena) + info.hblkhd);
+  allocator_bytes->Set("free", info.fordblks);
+#else
+  return false;
+#endif
+  return true;
+}
+
+
+}  // namespace cert_trans
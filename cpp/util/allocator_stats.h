@@ -0,0 +1,28 @@
+#ifndef CERT_TRANS_UTIL_ALLOCATOR_STATS_H_
+#define CERT_TRANS_UTIL_ALLOCATOR_STATS_H_
+
+namespace cert_trans {
+
+
+// The name of the malloc implementation linked in ("tcmalloc",
+// "jemalloc" or "glibc"), as chosen with the --with-tcmalloc and
+// --with-jemalloc configure options.
+const char* AllocatorName();
+
+// Applies the allocator tuning flags (such as
+// --tcmalloc_max_total_thread_cache_mb). To be called once, early in
+// main().
+void ConfigureAllocator();
+
+// Updates the allocator_bytes and allocator_fragmentation_ratio
+// gauges from the statistics of the allocator: the bytes in use by the
+// application, held by the heap, in the thread caches, free or
+// returned to the system... Returns false, leaving the gauges alone, if
+// the allocator has no statistics to give (jemalloc built without
+// them, or an unknown libc).
+bool UpdateAllocatorStats();
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_UTIL_ALLOCATOR_STATS_H_
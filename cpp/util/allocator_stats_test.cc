@@ -0,0 +1,126 @@
+#include "config.h"
+#include "util/allocator_stats.h"
+
+#include <gtest/gtest.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "monitoring/metric.h"
+#include "monitoring/registry.h"
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::map;
+using std::string;
+using std::vector;
+
+const size_t kBlockSize(1 << 20);
+const int kNumBlocks(64);
+
+
+const Metric* FindMetric(const string& name) {
+  for (const Metric* metric : Registry::Instance()->GetMetrics()) {
+    if (metric->Name() == name) {
+      return metric;
+    }
+  }
+  return nullptr;
+}
+
+
+// Returns the values of the allocator_bytes gauge, by stat.
+map<string, double> AllocatorBytes() {
+  map<string, double> bytes;
+  const Metric* const metric(FindMetric("allocator_bytes"));
+  CHECK_NOTNULL(metric);
+  for (const auto& it : metric->CurrentValues()) {
+    bytes[it.first[0]] = it.second.second;
+  }
+  return bytes;
+}
+
+
+TEST(AllocatorStatsTest, NamesAllocator) {
+#if defined(HAVE_LIBTCMALLOC)
+  EXPECT_STREQ("tcmalloc", AllocatorName());
+#elif defined(HAVE_LIBJEMALLOC)
+  EXPECT_STREQ("jemalloc", AllocatorName());
+#else
+  EXPECT_STREQ("glibc", AllocatorName());
+#endif
+}
+
+
+TEST(AllocatorStatsTest, MetricsExist) {
+  EXPECT_NE(nullptr, FindMetric("allocator_bytes"));
+  EXPECT_NE(nullptr, FindMetric("allocator_fragmentation_ratio"));
+}
+
+
+#if defined(HAVE_LIBTCMALLOC) || defined(HAVE_LIBJEMALLOC) || \
+    defined(__GLIBC__)
+TEST(AllocatorStatsTest, ExportsStats) {
+  // jemalloc can be built without statistics, there is nothing to
+  // check then.
+  if (!UpdateAllocatorStats()) {
+    return;
+  }
+
+  const map<string, double> bytes(AllocatorBytes());
+  ASSERT_EQ(1U, bytes.count("in_use"));
+  ASSERT_EQ(1U, bytes.count("heap"));
+  EXPECT_GT(bytes.at("in_use"), 0);
+  EXPECT_GE(bytes.at("heap"), bytes.at("in_use"));
+  EXPECT_EQ(1U, bytes.count("free"));
+
+  const auto ratio(
+      FindMetric("allocator_fragmentation_ratio")->CurrentValues());
+  ASSERT_EQ(1U, ratio.size());
+  EXPECT_GE(ratio.begin()->second.second, 0);
+  EXPECT_LT(ratio.begin()->second.second, 1);
+}
+
+
+TEST(AllocatorStatsTest, GrowsWithAllocations) {
+  if (!UpdateAllocatorStats()) {
+    return;
+  }
+  const map<string, double> before(AllocatorBytes());
+
+  vector<vector<char>> blocks;
+  for (int i = 0; i < kNumBlocks; ++i) {
+    // Touched, so that it is really in use.
+    blocks.emplace_back(kBlockSize, 'x');
+  }
+  ASSERT_TRUE(UpdateAllocatorStats());
+  const map<string, double> after(AllocatorBytes());
+
+  EXPECT_GE(after.at("in_use"),
+            before.at("in_use") + kNumBlocks * kBlockSize);
+  EXPECT_GE(after.at("heap"), after.at("in_use"));
+
+  blocks.clear();
+  ASSERT_TRUE(UpdateAllocatorStats());
+  EXPECT_LT(AllocatorBytes().at("in_use"), after.at("in_use"));
+}
+#else
+TEST(AllocatorStatsTest, NoStatsWithoutAllocatorHooks) {
+  // Nothing to read the statistics with: the gauges are left without
+  // values, rather than exported as zeroes.
+  EXPECT_FALSE(UpdateAllocatorStats());
+  EXPECT_TRUE(AllocatorBytes().empty());
+}
+#endif
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
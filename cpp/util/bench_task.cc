@@ -0,0 +1,221 @@
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <stdint.h>
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "util/executor.h"
+#include "util/sync_task.h"
+#include "util/task.h"
+#include "util/thread_pool.h"
+
+namespace sc = std::chrono;
+
+using cert_trans::ThreadPool;
+using std::cout;
+using std::function;
+using std::make_shared;
+using std::setw;
+using std::shared_ptr;
+using std::string;
+using std::to_string;
+using util::Executor;
+using util::SyncTask;
+using util::Task;
+
+DEFINE_string(benchmark_filter, "",
+              "only run the benchmarks whose name contains this");
+DEFINE_uint64(max_fanout, 1000,
+              "largest number of child tasks per parent to benchmark (they "
+              "go up by a factor of 10, from 1)");
+DEFINE_int32(num_threads, 4,
+             "number of threads of the pool used by the ThreadPool "
+             "benchmarks");
+DEFINE_int32(min_time_ms, 500,
+             "run every benchmark until it takes at least this long");
+
+namespace {
+
+
+// Runs the callbacks right away, so that the benchmarks measure the
+// task bookkeeping rather than a queue.
+class InlineExecutor : public Executor {
+ public:
+  void Add(const function<void()>& closure) override {
+    closure();
+  }
+
+  void Delay(const sc::duration<double>&, Task*) override {
+    LOG(FATAL) << "Not implemented.";
+  }
+};
+
+
+void DoNothing(Task*) {
+}
+
+
+// Runs |iterations| operations of a benchmark.
+typedef function<void(uint64_t iterations)> BenchmarkLoop;
+// A benchmark, for a given number of child tasks.
+typedef function<BenchmarkLoop(uint64_t fanout)> BenchmarkSetup;
+
+struct Benchmark {
+  string name;
+  // Whether the benchmark depends on the number of child tasks.
+  bool uses_fanout;
+  BenchmarkSetup setup;
+};
+
+
+// A task that returns right away.
+BenchmarkLoop Return(uint64_t) {
+  const shared_ptr<InlineExecutor> executor(make_shared<InlineExecutor>());
+  return [executor](uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; ++i) {
+      Task task(DoNothing, executor.get());
+      task.Return();
+    }
+  };
+}
+
+
+// Taking and releasing a hold on a task.
+BenchmarkLoop Hold(uint64_t) {
+  const shared_ptr<InlineExecutor> executor(make_shared<InlineExecutor>());
+  return [executor](uint64_t iterations) {
+    Task task(DoNothing, executor.get());
+    for (uint64_t i = 0; i < iterations; ++i) {
+      task.AddHold();
+      task.RemoveHold();
+    }
+    task.Return();
+  };
+}
+
+
+// A parent task with |fanout| child tasks, which all return before
+// the parent does.
+BenchmarkLoop AddChild(uint64_t fanout) {
+  const shared_ptr<InlineExecutor> executor(make_shared<InlineExecutor>());
+  return [executor, fanout](uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; ++i) {
+      Task task(DoNothing, executor.get());
+      for (uint64_t j = 0; j < fanout; ++j) {
+        task.AddChild(DoNothing)->Return();
+      }
+      task.Return();
+    }
+  };
+}
+
+
+// A parent task with |fanout| pending child tasks, which return once
+// the parent is cancelled.
+BenchmarkLoop Cancel(uint64_t fanout) {
+  const shared_ptr<InlineExecutor> executor(make_shared<InlineExecutor>());
+  return [executor, fanout](uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; ++i) {
+      Task task(DoNothing, executor.get());
+      for (uint64_t j = 0; j < fanout; ++j) {
+        Task* const child(task.AddChild(DoNothing));
+        child->WhenCancelled([child]() { child->Return(); });
+      }
+      task.Cancel();
+      task.Return();
+    }
+  };
+}
+
+
+// Same as AddChild(), but with the child tasks returning from the
+// threads of a pool, so that they contend on their parent.
+BenchmarkLoop AddChildOnThreadPool(uint64_t fanout) {
+  const shared_ptr<ThreadPool> pool(
+      make_shared<ThreadPool>(FLAGS_num_threads));
+  return [pool, fanout](uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; ++i) {
+      SyncTask task(pool.get());
+      for (uint64_t j = 0; j < fanout; ++j) {
+        Task* const child(task.task()->AddChild(DoNothing));
+        pool->Add([child]() { child->Return(); });
+      }
+      task.task()->Return();
+      task.Wait();
+    }
+  };
+}
+
+
+const Benchmark kBenchmarks[] = {
+    {"Task::Return", false, Return},
+    {"Task::AddHold+RemoveHold", false, Hold},
+    {"Task::AddChild", true, AddChild},
+    {"Task::Cancel", true, Cancel},
+    {"Task::AddChild/ThreadPool", true, AddChildOnThreadPool},
+};
+
+
+void RunBenchmark(const string& name, const BenchmarkSetup& setup,
+                  uint64_t fanout) {
+  const BenchmarkLoop loop(setup(fanout));
+  const sc::nanoseconds min_time = sc::milliseconds(FLAGS_min_time_ms);
+
+  // Warm up, then keep doubling the number of iterations until they
+  // take long enough to be measured.
+  loop(1);
+  uint64_t iterations(1);
+  sc::nanoseconds elapsed;
+  while (true) {
+    const sc::steady_clock::time_point start(sc::steady_clock::now());
+    loop(iterations);
+    elapsed = sc::steady_clock::now() - start;
+    if (elapsed >= min_time) {
+      break;
+    }
+    iterations *= 2;
+  }
+
+  const double ns_per_op(static_cast<double>(elapsed.count()) / iterations);
+  cout << std::left << setw(50) << name << std::right << setw(12) << iterations
+       << setw(14) << std::fixed << std::setprecision(1) << ns_per_op
+       << " ns/op" << setw(14) << std::setprecision(0) << 1e9 / ns_per_op
+       << " op/s" << std::endl;
+}
+
+
+}  // namespace
+
+
+int main(int argc, char* argv[]) {
+  google::SetUsageMessage(
+      "Benchmarks util::Task, printing the time per operation of each "
+      "(an operation being a whole parent task, for those with child "
+      "tasks).");
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  CHECK_GT(FLAGS_max_fanout, 0U);
+  CHECK_GT(FLAGS_num_threads, 0);
+  CHECK_GT(FLAGS_min_time_ms, 0);
+
+  for (const Benchmark& benchmark : kBenchmarks) {
+    if (benchmark.name.find(FLAGS_benchmark_filter) == string::npos) {
+      continue;
+    }
+    if (!benchmark.uses_fanout) {
+      RunBenchmark(benchmark.name, benchmark.setup, 0);
+      continue;
+    }
+    for (uint64_t fanout = 1; fanout <= FLAGS_max_fanout; fanout *= 10) {
+      RunBenchmark(benchmark.name + "/" + to_string(fanout), benchmark.setup,
+                   fanout);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,120 @@
+#include "util/bloom_filter.h"
+
+#include <glog/logging.h>
+#include <string.h>
+#include <algorithm>
+
+using std::max;
+using std::min;
+using std::string;
+
+namespace cert_trans {
+
+namespace {
+
+
+const size_t kMinBits = 64;
+
+
+// The optimal number of bits to set per key is |bits_per_key| * ln(2).
+int ProbesFor(int bits_per_key) {
+  return max(1, min(30, static_cast<int>(bits_per_key * 0.69 + 0.5)));
+}
+
+
+}  // namespace
+
+
+const size_t BloomFilter::kMinKeySize;
+
+
+BloomFilter::BloomFilter(size_t capacity, int bits_per_key)
+    : initial_capacity_(max<size_t>(capacity, 1)),
+      bits_per_key_(bits_per_key),
+      probes_(ProbesFor(bits_per_key)),
+      size_(0),
+      last_stage_size_(0) {
+  CHECK_GT(bits_per_key_, 0);
+  AddStage(initial_capacity_);
+}
+
+
+size_t BloomFilter::MemoryUsage() const {
+  size_t usage(0);
+  for (const Stage& stage : stages_) {
+    usage += stage.bits.capacity() * sizeof(uint64_t);
+  }
+  return usage;
+}
+
+
+void BloomFilter::Add(const string& key) {
+  CHECK_GE(key.size(), kMinKeySize);
+  if (last_stage_size_ >= stages_.back().capacity) {
+    AddStage(2 * stages_.back().capacity);
+  }
+
+  Stage* const stage(&stages_.back());
+  const uint64_t mask(stage->bits.size() * 64 - 1);
+  uint64_t h1, h2;
+  memcpy(&h1, key.data(), sizeof(h1));
+  memcpy(&h2, key.data() + sizeof(h1), sizeof(h2));
+  h2 |= 1;
+  for (int i = 0; i < probes_; ++i, h1 += h2) {
+    const uint64_t bit(h1 & mask);
+    stage->bits[bit / 64] |= uint64_t(1) << (bit % 64);
+  }
+  ++size_;
+  ++last_stage_size_;
+}
+
+
+bool BloomFilter::MayContain(const string& key) const {
+  if (key.size() < kMinKeySize) {
+    return false;
+  }
+
+  uint64_t h2;
+  memcpy(&h2, key.data() + sizeof(uint64_t), sizeof(h2));
+  h2 |= 1;
+  for (const Stage& stage : stages_) {
+    const uint64_t mask(stage.bits.size() * 64 - 1);
+    uint64_t h1;
+    memcpy(&h1, key.data(), sizeof(h1));
+    int i(0);
+    for (; i < probes_; ++i, h1 += h2) {
+      const uint64_t bit(h1 & mask);
+      if ((stage.bits[bit / 64] & (uint64_t(1) << (bit % 64))) == 0) {
+        break;
+      }
+    }
+    if (i == probes_) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+void BloomFilter::Clear() {
+  stages_.clear();
+  size_ = 0;
+  AddStage(initial_capacity_);
+}
+
+
+void BloomFilter::AddStage(size_t capacity) {
+  // Rounded up to a power of two, so that the bits are picked with a
+  // mask.
+  size_t bits(kMinBits);
+  while (bits < capacity * bits_per_key_) {
+    bits *= 2;
+  }
+  stages_.emplace_back();
+  stages_.back().bits.assign(bits / 64, 0);
+  stages_.back().capacity = capacity;
+  last_stage_size_ = 0;
+}
+
+
+}  // namespace cert_trans
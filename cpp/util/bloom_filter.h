@@ -0,0 +1,79 @@
+#ifndef CERT_TRANS_UTIL_BLOOM_FILTER_H_
+#define CERT_TRANS_UTIL_BLOOM_FILTER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "base/macros.h"
+#include "util/huge_page_allocator.h"
+
+namespace cert_trans {
+
+
+// An in-memory set of hashes, which can tell that one was never
+// added without looking it up where they are actually kept (such as
+// the on-disk index of a database). It can have false positives, but
+// no false negatives.
+//
+// Every key sets |bits_per_key| / 1.44 bits of a bit array, for a
+// false positive rate of about 0.62^|bits_per_key| (e.g. 1% with
+// 10 bits per key). Since the keys are the output of a cryptographic
+// hash, their first bytes are used to pick the bits directly.
+//
+// Once |capacity| keys were added, a new bit array of twice the
+// capacity takes the next ones (as in a scalable Bloom filter), so
+// that the false positive rate does not climb as the set grows past
+// what was expected (checking the bit arrays one after the other
+// only costs a few more cache misses).
+//
+// Keys must be at least kMinKeySize bytes long.
+//
+// This class is thread-compatible.
+class BloomFilter {
+ public:
+  static const size_t kMinKeySize = 16;
+
+  BloomFilter(size_t capacity, int bits_per_key);
+
+  // The number of keys added.
+  size_t size() const {
+    return size_;
+  }
+
+  // The memory taken by the bit arrays.
+  size_t MemoryUsage() const;
+
+  void Add(const std::string& key);
+
+  // Returns false if |key| was never added.
+  bool MayContain(const std::string& key) const;
+
+  void Clear();
+
+ private:
+  struct Stage {
+    std::vector<uint64_t, HugePageAllocator<uint64_t>> bits;
+    size_t capacity;
+  };
+
+  void AddStage(size_t capacity);
+
+  const size_t initial_capacity_;
+  const int bits_per_key_;
+  // Number of bits set per key.
+  const int probes_;
+  // Keys are added to the last one.
+  std::vector<Stage> stages_;
+  size_t size_;
+  // The keys added to the last stage.
+  size_t last_stage_size_;
+
+  DISALLOW_COPY_AND_ASSIGN(BloomFilter);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_UTIL_BLOOM_FILTER_H_
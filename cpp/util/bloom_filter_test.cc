@@ -0,0 +1,99 @@
+#include "util/bloom_filter.h"
+
+#include <gtest/gtest.h>
+#include <string>
+
+#include "merkletree/serial_hasher.h"
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+using std::to_string;
+
+
+string Key(int i) {
+  return Sha256Hasher::Sha256Digest(to_string(i));
+}
+
+
+TEST(BloomFilterTest, Empty) {
+  BloomFilter filter(1000, 10);
+  EXPECT_EQ(0U, filter.size());
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_FALSE(filter.MayContain(Key(i)));
+  }
+  // Too short to have been added.
+  EXPECT_FALSE(filter.MayContain(""));
+}
+
+
+TEST(BloomFilterTest, NoFalseNegatives) {
+  BloomFilter filter(1000, 10);
+  for (int i = 0; i < 1000; ++i) {
+    filter.Add(Key(i));
+  }
+  EXPECT_EQ(1000U, filter.size());
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_TRUE(filter.MayContain(Key(i))) << i;
+  }
+}
+
+
+TEST(BloomFilterTest, FalsePositiveRate) {
+  BloomFilter filter(10000, 10);
+  for (int i = 0; i < 10000; ++i) {
+    filter.Add(Key(i));
+  }
+  int false_positives(0);
+  for (int i = 10000; i < 110000; ++i) {
+    false_positives += filter.MayContain(Key(i));
+  }
+  // About 1% at 10 bits per key.
+  EXPECT_LT(false_positives, 2000);
+}
+
+
+TEST(BloomFilterTest, GrowsPastCapacity) {
+  BloomFilter filter(100, 10);
+  const size_t initial_usage(filter.MemoryUsage());
+  for (int i = 0; i < 10000; ++i) {
+    filter.Add(Key(i));
+  }
+  EXPECT_LT(initial_usage, filter.MemoryUsage());
+  for (int i = 0; i < 10000; ++i) {
+    EXPECT_TRUE(filter.MayContain(Key(i))) << i;
+  }
+
+  // Each stage keeps its own rate, so all together stay well below
+  // what a single overfilled stage would give.
+  int false_positives(0);
+  for (int i = 10000; i < 110000; ++i) {
+    false_positives += filter.MayContain(Key(i));
+  }
+  EXPECT_LT(false_positives, 10000);
+}
+
+
+TEST(BloomFilterTest, Clear) {
+  BloomFilter filter(100, 10);
+  for (int i = 0; i < 1000; ++i) {
+    filter.Add(Key(i));
+  }
+  filter.Clear();
+  EXPECT_EQ(0U, filter.size());
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_FALSE(filter.MayContain(Key(i)));
+  }
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,149 @@
+#include "util/cpu_affinity.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "util/util.h"
+
+DEFINE_string(cpu_affinity, "",
+              "semicolon-separated list of name:cpus, pinning the threads "
+              "of that name (the pools, such as http or internal, and the "
+              "event loops, such as main or http_1, the number of which can "
+              "be left out) to the CPUs given in the format of the kernel, "
+              "such as http:0-7,16-23;main:0");
+DEFINE_bool(numa_interleave_memory, false,
+            "spread the memory of the process (such as the Merkle tree and "
+            "the hash indexes) evenly over all the NUMA nodes, rather than "
+            "on the node of the thread first touching it");
+
+using std::string;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+
+// Parses a non-negative number making up the whole of |s|.
+bool ParseNumber(const string& s, int* number) {
+  if (s.empty() || s.size() > 6 ||
+      s.find_first_not_of("0123456789") != string::npos) {
+    return false;
+  }
+  *number = atoi(s.c_str());
+  return true;
+}
+
+
+// The CPUs --cpu_affinity gives for |name| (or for |name| without its
+// numeric suffix), empty if none.
+vector<int> CpusForThread(const string& name) {
+  const size_t underscore(name.rfind('_'));
+  int unused;
+  const string base(underscore != string::npos &&
+                            ParseNumber(name.substr(underscore + 1), &unused)
+                        ? name.substr(0, underscore)
+                        : name);
+
+  vector<int> cpus;
+  for (const auto& entry : util::split(FLAGS_cpu_affinity, ';')) {
+    const size_t colon(entry.find(':'));
+    CHECK_NE(colon, string::npos) << "Invalid --cpu_affinity entry: "
+                                  << entry;
+    const string entry_name(entry.substr(0, colon));
+    if (entry_name == name || entry_name == base) {
+      CHECK(ParseCpuList(entry.substr(colon + 1), &cpus))
+          << "Invalid --cpu_affinity entry: " << entry;
+      // An entry for the exact name wins.
+      if (entry_name == name) {
+        break;
+      }
+    }
+  }
+  return cpus;
+}
+
+
+}  // namespace
+
+
+bool ParseCpuList(const string& list, vector<int>* cpus) {
+  CHECK_NOTNULL(cpus)->clear();
+  for (const auto& range : util::split(list)) {
+    const size_t dash(range.find('-'));
+    int first, last;
+    if (dash == string::npos) {
+      if (!ParseNumber(range, &first)) {
+        return false;
+      }
+      last = first;
+    } else if (!ParseNumber(range.substr(0, dash), &first) ||
+               !ParseNumber(range.substr(dash + 1), &last) || last < first) {
+      return false;
+    }
+    for (int cpu = first; cpu <= last; ++cpu) {
+      cpus->push_back(cpu);
+    }
+  }
+  return !cpus->empty();
+}
+
+
+void PinThread(const string& name) {
+#ifdef __linux__
+  if (FLAGS_cpu_affinity.empty() || name.empty()) {
+    return;
+  }
+  const vector<int> cpus(CpusForThread(name));
+  if (cpus.empty()) {
+    return;
+  }
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (const auto& cpu : cpus) {
+    CHECK_LT(cpu, CPU_SETSIZE);
+    CPU_SET(cpu, &set);
+  }
+  const int ret(pthread_setaffinity_np(pthread_self(), sizeof(set), &set));
+  LOG_IF(ERROR, ret != 0) << "Could not pin thread " << name << ": "
+                          << strerror(ret);
+#endif
+}
+
+
+void SetNumaMemoryPolicy() {
+#ifdef __linux__
+  if (!FLAGS_numa_interleave_memory) {
+    return;
+  }
+  string online;
+  vector<int> nodes;
+  if (!util::ReadTextFile("/sys/devices/system/node/online", &online) ||
+      !ParseCpuList(online.substr(0, online.find('\n')), &nodes)) {
+    LOG(WARNING) << "Could not find the NUMA nodes, not interleaving memory";
+    return;
+  }
+
+  unsigned long mask(0);
+  for (const auto& node : nodes) {
+    CHECK_LT(node, static_cast<int>(8 * sizeof(mask)));
+    mask |= 1UL << node;
+  }
+  // The kernel ignores the last bit of |maxnode|.
+  PCHECK(syscall(SYS_set_mempolicy, MPOL_INTERLEAVE, &mask,
+                 8 * sizeof(mask) + 1) == 0);
+  LOG(INFO) << "Interleaving memory over " << nodes.size() << " NUMA nodes";
+#endif
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,30 @@
+#ifndef CERT_TRANS_UTIL_CPU_AFFINITY_H_
+#define CERT_TRANS_UTIL_CPU_AFFINITY_H_
+
+#include <string>
+#include <vector>
+
+namespace cert_trans {
+
+
+// Parses a list of CPUs (or of NUMA nodes) in the format of the
+// kernel, such as "0-3,8,10-11", into |*cpus|. Returns false if it
+// is malformed.
+bool ParseCpuList(const std::string& list, std::vector<int>* cpus);
+
+// Pins the calling thread to the CPUs --cpu_affinity gives for the
+// threads named |name| (such as "http" for the threads of the pool of
+// that name, or for "http_3"), if any. Does nothing on systems other
+// than Linux.
+void PinThread(const std::string& name);
+
+// With --numa_interleave_memory, spreads the memory allocated from
+// then on by the process (by the threads started afterwards, too)
+// evenly over all the NUMA nodes. Does nothing on systems other than
+// Linux.
+void SetNumaMemoryPolicy();
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_UTIL_CPU_AFFINITY_H_
@@ -0,0 +1,84 @@
+#include "util/cpu_affinity.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <sched.h>
+#include <thread>
+#include <vector>
+
+#include "util/testing.h"
+
+DECLARE_string(cpu_affinity);
+
+namespace cert_trans {
+namespace {
+
+using std::thread;
+using std::vector;
+
+
+TEST(CpuAffinityTest, ParseCpuList) {
+  vector<int> cpus;
+  EXPECT_TRUE(ParseCpuList("3", &cpus));
+  EXPECT_EQ(vector<int>({3}), cpus);
+  EXPECT_TRUE(ParseCpuList("0-3,8,10-11", &cpus));
+  EXPECT_EQ(vector<int>({0, 1, 2, 3, 8, 10, 11}), cpus);
+
+  EXPECT_FALSE(ParseCpuList("", &cpus));
+  EXPECT_FALSE(ParseCpuList("a", &cpus));
+  EXPECT_FALSE(ParseCpuList("3-1", &cpus));
+  EXPECT_FALSE(ParseCpuList("1-", &cpus));
+  EXPECT_FALSE(ParseCpuList("-1", &cpus));
+}
+
+
+#ifdef __linux__
+// The CPUs the calling thread can run on.
+vector<int> CurrentCpus() {
+  cpu_set_t set;
+  CHECK_EQ(0, sched_getaffinity(0, sizeof(set), &set));
+  vector<int> cpus;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &set)) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+
+TEST(CpuAffinityTest, PinThread) {
+  FLAGS_cpu_affinity = "other:1;test:0";
+  vector<int> before, not_pinned, exact, numbered;
+  thread([&]() {
+    before = CurrentCpus();
+    PinThread("");
+    PinThread("unknown");
+    not_pinned = CurrentCpus();
+  }).join();
+  thread([&]() {
+    PinThread("test");
+    exact = CurrentCpus();
+  }).join();
+  thread([&]() {
+    PinThread("test_3");
+    numbered = CurrentCpus();
+  }).join();
+  FLAGS_cpu_affinity.clear();
+
+  EXPECT_EQ(before, not_pinned);
+  EXPECT_EQ(vector<int>({0}), exact);
+  EXPECT_EQ(vector<int>({0}), numbered);
+}
+#endif
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
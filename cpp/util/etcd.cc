@@ -6,17 +6,23 @@
 #include <utility>
 #include <event2/http.h>
 
+#include "monitoring/latency.h"
+#include "monitoring/monitoring.h"
 #include "util/json_wrapper.h"
 #include "util/libevent_wrapper.h"
 #include "util/statusor.h"
+#include "util/task_sequence.h"
 
 namespace libevent = cert_trans::libevent;
 
 using std::atoll;
 using std::bind;
+using std::chrono::milliseconds;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::chrono::system_clock;
 using std::ctime;
+using std::deque;
 using std::list;
 using std::lock_guard;
 using std::make_pair;
@@ -32,6 +38,7 @@ using std::stoi;
 using std::string;
 using std::time_t;
 using std::to_string;
+using std::unique_lock;
 using std::unique_ptr;
 using std::vector;
 using util::Executor;
@@ -39,6 +46,7 @@ using util::Status;
 using util::StatusOr;
 using util::SyncTask;
 using util::Task;
+using util::TaskSequence;
 
 DEFINE_int32(etcd_watch_error_retry_delay_seconds, 5,
              "delay between retrying etcd watch requests");
@@ -50,6 +58,15 @@ DEFINE_bool(etcd_quorum, true,
             "unless you *know* what you're doing.");
 DEFINE_int32(etcd_connection_timeout_seconds, 10,
              "Number of seconds after which to timeout etcd connections.");
+DEFINE_int32(etcd_max_concurrent_requests, 0,
+             "Maximum number of etcd requests (not counting watches) to "
+             "have in flight at once, the others waiting their turn with "
+             "bulk deletes last. 0 means no limit.");
+DEFINE_int32(etcd_request_deadline_seconds, 30,
+             "Number of seconds after which an etcd request (not counting "
+             "watches) fails with DEADLINE_EXCEEDED, including the time "
+             "spent queued and retrying on other etcd servers. 0 means no "
+             "deadline.");
 
 namespace cert_trans {
 
@@ -78,6 +95,17 @@ const char kStatsSpace[] = "/v2/stats";
 const char kStoreStatsKey[] = "/store";
 
 
+static Counter<string>* etcd_watch_snapshots = Counter<string>::New(
+    "etcd_watch_snapshots", "key",
+    "Number of times a watch had to get the whole contents of the watched "
+    "key, broken down by key.");
+
+static Latency<milliseconds, string> etcd_queue_wait_ms(
+    "etcd_queue_wait_ms", "operation",
+    "Time in ms etcd requests waited for --etcd_max_concurrent_requests, "
+    "broken down by operation.");
+
+
 util::error::Code ErrorCodeForHttpResponseCode(int response_code) {
   switch (response_code) {
     case 200:
@@ -123,6 +151,9 @@ util::error::Code StatusCodeFromEtcdErrorCode(int etcd_code) {
       return util::error::UNAVAILABLE;
 
     case 400:  // Watcher is cleared due to etcd recovery
+      // The watch can simply be retried at the same index.
+      return util::error::UNAVAILABLE;
+
     case 401:  // Event in requested index is outdated and cleared.
       return util::error::ABORTED;
 
@@ -167,6 +198,29 @@ Status StatusFromResponse(int response_code, const JsonObject& json) {
 }
 
 
+// Errors from the JSON gateway of the v3 API carry the gRPC code,
+// which util::Status shares.
+Status StatusFromGatewayResponse(int response_code, const JsonObject& json) {
+  if (json.Ok()) {
+    const JsonInt code(json, "code");
+    if (code.Ok() && code.Value() != util::error::OK) {
+      const JsonString message(json, "message");
+      return Status(code.Value() <= util::error::DATA_LOSS
+                        ? static_cast<util::error::Code>(code.Value())
+                        : util::error::UNKNOWN,
+                    "Etcd message: " + string(message.Ok()
+                                                  ? message.Value()
+                                                  : json.DebugString()));
+    }
+  }
+  const util::error::Code error_code(
+      ErrorCodeForHttpResponseCode(response_code));
+  const string error_message(
+      error_code == util::error::OK ? "" : json.DebugString());
+  return Status(error_code, error_message);
+}
+
+
 StatusOr<EtcdClient::Node> ParseNodeFromJson(const JsonObject& json_node) {
   const JsonInt createdIndex(json_node, "createdIndex");
   if (!createdIndex.Ok()) {
@@ -397,6 +451,19 @@ string UrlEscapeAndJoinParams(const map<string, string>& params) {
 }
 
 
+// Adds |node|, or all the non-directory nodes under it if it is a
+// directory, to |leaves|.
+void AppendLeaves(EtcdClient::Node&& node, vector<EtcdClient::Node>* leaves) {
+  if (!node.is_dir_) {
+    leaves->emplace_back(move(node));
+    return;
+  }
+  for (auto& child : node.nodes_) {
+    AppendLeaves(move(child), leaves);
+  }
+}
+
+
 static const EtcdClient::Node kInvalidNode(-1, -1, "", false, "", {}, true);
 
 
@@ -409,7 +476,9 @@ struct EtcdClient::RequestState {
                const HostPortPair& host_port, GenericResponse* gen_resp,
                Task* parent_task)
       : gen_resp_(CHECK_NOTNULL(gen_resp)),
-        parent_task_(CHECK_NOTNULL(parent_task)) {
+        parent_task_(CHECK_NOTNULL(parent_task)),
+        queued_at_(steady_clock::now()),
+        json_gateway_(false) {
     CHECK(!key.empty());
     CHECK_EQ(key[0], '/');
 
@@ -450,6 +519,21 @@ struct EtcdClient::RequestState {
     VLOG(2) << "path query: " << req_.url.PathQuery();
   }
 
+  RequestState(const string& path, const JsonObject& body,
+               const HostPortPair& host_port, GenericResponse* gen_resp,
+               Task* parent_task)
+      : gen_resp_(CHECK_NOTNULL(gen_resp)),
+        parent_task_(CHECK_NOTNULL(parent_task)),
+        queued_at_(steady_clock::now()),
+        json_gateway_(true) {
+    req_.verb = UrlFetcher::Verb::POST;
+    SetHostPort(host_port);
+    req_.url.SetPath(path);
+    req_.headers.insert(make_pair("Content-Type", "application/json"));
+    req_.body = body.ToString();
+    VLOG(2) << "path: " << path << " body: " << req_.body;
+  }
+
   void SetHostPort(const HostPortPair& host_port) {
     CHECK(!host_port.first.empty());
     CHECK_GT(host_port.second, 0);
@@ -460,6 +544,8 @@ struct EtcdClient::RequestState {
 
   GenericResponse* const gen_resp_;
   Task* const parent_task_;
+  const steady_clock::time_point queued_at_;
+  const bool json_gateway_;
 
   UrlFetcher::Request req_;
   UrlFetcher::Response resp_;
@@ -512,12 +598,10 @@ void EtcdClient::WatchInitialGetDone(WatchState* state, GetResponse* resp,
   state->highest_index_seen_ =
       max(state->highest_index_seen_, resp->etcd_index);
 
+  // The initial get is recursive, so that the keys in subdirectories
+  // are reported the same way as their later updates.
   vector<Node> nodes;
-  if (resp->node.is_dir_) {
-    nodes = move(resp->node.nodes_);
-  } else {
-    nodes.push_back(resp->node);
-  }
+  AppendLeaves(move(resp->node), &nodes);
 
   vector<Node> updates;
   map<string, int64_t> new_known_keys;
@@ -587,17 +671,32 @@ void EtcdClient::WatchRequestDone(WatchState* state, GetResponse* get_resp,
           max(state->highest_index_seen_, get_resp->etcd_index);
     }
 
+    etcd_watch_snapshots->Increment(state->key_);
+    Request req(state->key_);
+    req.recursive = true;
     GetResponse* const resp(new GetResponse);
-    Get(state->key_, resp,
+    Get(req, resp,
         state->task_->AddChild(
             bind(&EtcdClient::WatchInitialGetDone, this, state, resp, _1)));
 
     return;
   }
 
+  // Otherwise, we carry on from the last index we saw.
   if (!child_task->status().ok()) {
     VLOG(1) << "Watch request errored: " << child_task->status();
-    StartWatchRequest(state);
+    // The hanging get timing out only means that nothing happened in
+    // the meantime, but other errors get a delay, to avoid hammering an
+    // etcd that is having problems.
+    if (child_task->status().CanonicalCode() ==
+        util::error::DEADLINE_EXCEEDED) {
+      StartWatchRequest(state);
+    } else {
+      state->task_->executor()->Delay(
+          seconds(FLAGS_etcd_watch_error_retry_delay_seconds),
+          state->task_->AddChild(
+              [this, state](Task*) { this->StartWatchRequest(state); }));
+    }
     return;
   }
 
@@ -703,7 +802,8 @@ EtcdClient::EtcdClient(Executor* executor, UrlFetcher* fetcher,
       log_version_task_(new SyncTask(executor_)),
       fetcher_(CHECK_NOTNULL(fetcher)),
       etcds_(etcds),
-      logged_version_(false) {
+      logged_version_(false),
+      requests_in_flight_(0) {
   CHECK(!etcds_.empty()) << "No etcd hosts provided.";
   VLOG(1) << "EtcdClient: " << this;
 
@@ -727,7 +827,10 @@ EtcdClient::HostPortPair EtcdClient::ChooseNextServer() {
 
 
 EtcdClient::EtcdClient()
-    : executor_(nullptr), log_version_task_(nullptr), fetcher_(nullptr) {
+    : executor_(nullptr),
+      log_version_task_(nullptr),
+      fetcher_(nullptr),
+      requests_in_flight_(0) {
 }
 
 
@@ -807,8 +910,11 @@ void EtcdClient::FetchDone(RequestState* etcd_req, Task* task) {
   }
 
   etcd_req->parent_task_->Return(
-      StatusFromResponse(etcd_req->resp_.status_code,
-                         *etcd_req->gen_resp_->json_body));
+      etcd_req->json_gateway_
+          ? StatusFromGatewayResponse(etcd_req->resp_.status_code,
+                                      *etcd_req->gen_resp_->json_body)
+          : StatusFromResponse(etcd_req->resp_.status_code,
+                               *etcd_req->gen_resp_->json_body));
 }
 
 
@@ -854,7 +960,8 @@ void EtcdClient::Get(const Request& req, GetResponse* resp, Task* task) {
   }
   GenericResponse* const gen_resp(new GenericResponse);
   task->DeleteWhenDone(gen_resp);
-  Generic(req.key, kKeysSpace, params, UrlFetcher::Verb::GET, gen_resp,
+  Generic(req.key, kKeysSpace, params, UrlFetcher::Verb::GET,
+          req.wait_index > 0 ? Priority::WATCH : Priority::NORMAL, gen_resp,
           task->AddChild(
               bind(&GetRequestDone, req.key, resp, task, gen_resp, _1)));
 }
@@ -867,7 +974,8 @@ void EtcdClient::Create(const string& key, const string& value, Response* resp,
   params["prevExist"] = "false";
   GenericResponse* const gen_resp(new GenericResponse);
   task->DeleteWhenDone(gen_resp);
-  Generic(key, kKeysSpace, params, UrlFetcher::Verb::PUT, gen_resp,
+  Generic(key, kKeysSpace, params, UrlFetcher::Verb::PUT, Priority::NORMAL,
+          gen_resp,
           task->AddChild(bind(&CreateRequestDone, resp, task, gen_resp, _1)));
 }
 
@@ -881,7 +989,8 @@ void EtcdClient::CreateWithTTL(const string& key, const string& value,
   params["ttl"] = to_string(ttl.count());
   GenericResponse* const gen_resp(new GenericResponse);
   task->DeleteWhenDone(gen_resp);
-  Generic(key, kKeysSpace, params, UrlFetcher::Verb::PUT, gen_resp,
+  Generic(key, kKeysSpace, params, UrlFetcher::Verb::PUT, Priority::NORMAL,
+          gen_resp,
           task->AddChild(bind(&CreateRequestDone, resp, task, gen_resp, _1)));
 }
 
@@ -894,7 +1003,8 @@ void EtcdClient::Update(const string& key, const string& value,
   params["prevIndex"] = to_string(previous_index);
   GenericResponse* const gen_resp(new GenericResponse);
   task->DeleteWhenDone(gen_resp);
-  Generic(key, kKeysSpace, params, UrlFetcher::Verb::PUT, gen_resp,
+  Generic(key, kKeysSpace, params, UrlFetcher::Verb::PUT, Priority::NORMAL,
+          gen_resp,
           task->AddChild(bind(&UpdateRequestDone, resp, task, gen_resp, _1)));
 }
 
@@ -909,7 +1019,8 @@ void EtcdClient::UpdateWithTTL(const string& key, const string& value,
   params["ttl"] = to_string(ttl.count());
   GenericResponse* const gen_resp(new GenericResponse);
   task->DeleteWhenDone(gen_resp);
-  Generic(key, kKeysSpace, params, UrlFetcher::Verb::PUT, gen_resp,
+  Generic(key, kKeysSpace, params, UrlFetcher::Verb::PUT, Priority::NORMAL,
+          gen_resp,
           task->AddChild(bind(&UpdateRequestDone, resp, task, gen_resp, _1)));
 }
 
@@ -920,7 +1031,8 @@ void EtcdClient::ForceSet(const string& key, const string& value,
   params["value"] = value;
   GenericResponse* const gen_resp(new GenericResponse);
   task->DeleteWhenDone(gen_resp);
-  Generic(key, kKeysSpace, params, UrlFetcher::Verb::PUT, gen_resp,
+  Generic(key, kKeysSpace, params, UrlFetcher::Verb::PUT, Priority::NORMAL,
+          gen_resp,
           task->AddChild(
               bind(&ForceSetRequestDone, resp, task, gen_resp, _1)));
 }
@@ -934,7 +1046,23 @@ void EtcdClient::ForceSetWithTTL(const string& key, const string& value,
   params["ttl"] = to_string(ttl.count());
   GenericResponse* const gen_resp(new GenericResponse);
   task->DeleteWhenDone(gen_resp);
-  Generic(key, kKeysSpace, params, UrlFetcher::Verb::PUT, gen_resp,
+  Generic(key, kKeysSpace, params, UrlFetcher::Verb::PUT, Priority::NORMAL,
+          gen_resp,
+          task->AddChild(
+              bind(&ForceSetRequestDone, resp, task, gen_resp, _1)));
+}
+
+
+void EtcdClient::RefreshTTL(const string& key, const seconds& ttl,
+                            Response* resp, Task* task) {
+  map<string, string> params;
+  params["ttl"] = to_string(ttl.count());
+  params["refresh"] = "true";
+  params["prevExist"] = "true";
+  GenericResponse* const gen_resp(new GenericResponse);
+  task->DeleteWhenDone(gen_resp);
+  Generic(key, kKeysSpace, params, UrlFetcher::Verb::PUT, Priority::NORMAL,
+          gen_resp,
           task->AddChild(
               bind(&ForceSetRequestDone, resp, task, gen_resp, _1)));
 }
@@ -947,7 +1075,8 @@ void EtcdClient::Delete(const string& key, const int64_t current_index,
   GenericResponse* const gen_resp(new GenericResponse);
   task->DeleteWhenDone(gen_resp);
 
-  Generic(key, kKeysSpace, params, UrlFetcher::Verb::DELETE, gen_resp, task);
+  Generic(key, kKeysSpace, params, UrlFetcher::Verb::DELETE,
+          Priority::NORMAL, gen_resp, task);
 }
 
 
@@ -956,7 +1085,41 @@ void EtcdClient::ForceDelete(const string& key, Task* task) {
   task->DeleteWhenDone(gen_resp);
 
   Generic(key, kKeysSpace, map<string, string>(), UrlFetcher::Verb::DELETE,
-          gen_resp, task);
+          Priority::BULK, gen_resp, task);
+}
+
+
+void EtcdClient::Txn(const vector<TxnOp>& ops, TxnResponse* resp,
+                     Task* task) {
+  *resp = TxnResponse();
+  resp->indices.resize(ops.size(), -1);
+  TaskSequence sequence(task);
+  for (size_t i = 0; i < ops.size(); ++i) {
+    const TxnOp op(ops[i]);
+    Response* const op_resp(new Response);
+    task->DeleteWhenDone(op_resp);
+    sequence.Then([this, op, op_resp](Task* step) {
+      switch (op.type) {
+        case TxnOp::Type::CREATE:
+          Create(op.key, op.value, op_resp, step);
+          return;
+        case TxnOp::Type::UPDATE:
+          Update(op.key, op.value, op.index, op_resp, step);
+          return;
+        case TxnOp::Type::DELETE:
+          Delete(op.key, op.index, step);
+          return;
+      }
+      LOG(FATAL) << "unknown op type";
+    });
+    sequence.Then([resp, i, op_resp](Task* step) {
+      resp->indices[i] = op_resp->etcd_index;
+      resp->etcd_index = max(resp->etcd_index, op_resp->etcd_index);
+      ++resp->num_applied;
+      step->Return();
+    });
+  }
+  sequence.Run();
 }
 
 
@@ -965,7 +1128,8 @@ void EtcdClient::GetStoreStats(StatsResponse* resp, Task* task) {
   GenericResponse* const gen_resp(new GenericResponse);
   task->DeleteWhenDone(gen_resp);
 
-  Generic(kStoreStatsKey, kStatsSpace, params, UrlFetcher::Verb::GET, gen_resp,
+  Generic(kStoreStatsKey, kStatsSpace, params, UrlFetcher::Verb::GET,
+          Priority::NORMAL, gen_resp,
           task->AddChild(
               bind(&GetStoreStatsRequestDone, resp, task, gen_resp, _1)));
 }
@@ -985,18 +1149,90 @@ void EtcdClient::Watch(const string& key, const WatchCallback& cb,
 
 void EtcdClient::Generic(const string& key, const string& key_space,
                          const map<string, string>& params,
-                         UrlFetcher::Verb verb, GenericResponse* resp,
-                         Task* task) {
+                         UrlFetcher::Verb verb, Priority priority,
+                         GenericResponse* resp, Task* task) {
+  MaybeLogEtcdVersion();
+  Enqueue(new RequestState(verb, key, key_space, params, GetEndpoint(), resp,
+                           task),
+          priority);
+}
+
+
+void EtcdClient::PostJson(const string& path, const JsonObject& body,
+                          Priority priority, GenericResponse* resp,
+                          Task* task) {
   MaybeLogEtcdVersion();
-  RequestState* const etcd_req(new RequestState(verb, key, key_space, params,
-                                                GetEndpoint(), resp, task));
-  task->DeleteWhenDone(etcd_req);
+  Enqueue(new RequestState(path, body, GetEndpoint(), resp, task), priority);
+}
+
+
+void EtcdClient::Enqueue(RequestState* etcd_req, Priority priority) {
+  etcd_req->parent_task_->DeleteWhenDone(etcd_req);
+  if (priority != Priority::WATCH && FLAGS_etcd_request_deadline_seconds > 0) {
+    // Kept by the retries, which reuse the request.
+    etcd_req->req_.deadline =
+        etcd_req->queued_at_ + seconds(FLAGS_etcd_request_deadline_seconds);
+  }
+
+  StartRequest(etcd_req, priority);
+}
+
+
+void EtcdClient::StartRequest(RequestState* etcd_req, Priority priority) {
+  if (priority != Priority::WATCH && FLAGS_etcd_max_concurrent_requests > 0) {
+    unique_lock<mutex> lock(lock_);
+    if (requests_in_flight_ >= FLAGS_etcd_max_concurrent_requests) {
+      (priority == Priority::BULK ? queued_bulk_requests_ : queued_requests_)
+          .push_back(etcd_req);
+      return;
+    }
+    ++requests_in_flight_;
+    lock.unlock();
+    etcd_req->parent_task_->CleanupWhenDone(
+        bind(&EtcdClient::RequestFinished, this));
+  }
+
+  SendRequest(etcd_req);
+}
+
+
+void EtcdClient::SendRequest(RequestState* etcd_req) {
+  ostringstream op;
+  op << etcd_req->req_.verb;
+  etcd_queue_wait_ms.RecordLatency(op.str(),
+                                   steady_clock::now() - etcd_req->queued_at_);
 
   fetcher_->Fetch(etcd_req->req_, &etcd_req->resp_,
                   etcd_req->parent_task_->AddChild(
                       bind(&EtcdClient::FetchDone, this, etcd_req, _1)));
 }
 
+
+void EtcdClient::RequestFinished() {
+  unique_lock<mutex> lock(lock_);
+  --requests_in_flight_;
+  while (!queued_requests_.empty() || !queued_bulk_requests_.empty()) {
+    deque<RequestState*>& queue(!queued_requests_.empty()
+                                    ? queued_requests_
+                                    : queued_bulk_requests_);
+    RequestState* const etcd_req(queue.front());
+    queue.pop_front();
+    lock.unlock();
+
+    if (etcd_req->parent_task_->CancelRequested()) {
+      etcd_req->parent_task_->Return(Status::CANCELLED);
+      lock.lock();
+      continue;
+    }
+
+    // The slot we just freed up goes to this request.
+    etcd_req->parent_task_->CleanupWhenDone(
+        bind(&EtcdClient::RequestFinished, this));
+    SendRequest(etcd_req);
+    return;
+  }
+}
+
 list<EtcdClient::HostPortPair> SplitHosts(const string& hosts_string) {
   vector<string> hosts(util::split(hosts_string, ','));
 
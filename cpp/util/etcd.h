@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <chrono>
+#include <deque>
 #include <list>
 #include <map>
 #include <memory>
@@ -80,6 +81,41 @@ class EtcdClient {
     std::map<std::string, int64_t> stats;
   };
 
+  // One of the writes of a transaction, see Txn().
+  struct TxnOp {
+    enum class Type {
+      // Like Create(), |index| is unused.
+      CREATE,
+      // Like Update(), with |index| as the previous index.
+      UPDATE,
+      // Like Delete(), with |index| as the current index, and |value|
+      // unused.
+      DELETE,
+    };
+
+    TxnOp(Type thetype, const std::string& thekey, const std::string& thevalue,
+          int64_t theindex)
+        : type(thetype), key(thekey), value(thevalue), index(theindex) {
+    }
+
+    Type type;
+    std::string key;
+    std::string value;
+    int64_t index;
+  };
+
+  struct TxnResponse : public Response {
+    TxnResponse() : num_applied(0) {
+    }
+
+    // The number of ops applied, which are always the first ones,
+    // even if the transaction failed.
+    size_t num_applied;
+    // The index of each of the ops applied (-1 for deletes), the
+    // highest one being |etcd_index|.
+    std::vector<int64_t> indices;
+  };
+
   typedef std::function<void(const std::vector<Node>& updates)> WatchCallback;
 
   EtcdClient(util::Executor* executor, UrlFetcher* fetcher,
@@ -116,11 +152,28 @@ class EtcdClient {
                                const std::chrono::seconds& ttl, Response* resp,
                                util::Task* task);
 
+  // Resets the TTL of |key|, which must exist, to |ttl|, without
+  // changing its value or notifying the watchers.
+  virtual void RefreshTTL(const std::string& key,
+                          const std::chrono::seconds& ttl, Response* resp,
+                          util::Task* task);
+
   virtual void Delete(const std::string& key, const int64_t current_index,
                       util::Task* task);
 
+  // Deletes made through this method are bulk requests: when
+  // --etcd_max_concurrent_requests is set, they only get sent once no
+  // other request is waiting.
   virtual void ForceDelete(const std::string& key, util::Task* task);
 
+  // Applies |ops|, with the same conditions as the methods they are
+  // named after. Returns the error of the first op whose condition
+  // does not hold. This implementation sends them one at a time, in
+  // order, so the ones before a failure stay applied, while an
+  // EtcdV3Client applies either all of them or none, atomically.
+  virtual void Txn(const std::vector<TxnOp>& ops, TxnResponse* resp,
+                   util::Task* task);
+
   virtual void GetStoreStats(StatsResponse* resp, util::Task* task);
 
   // The "cb" will be called on the "task" executor. Also, only one
@@ -131,20 +184,53 @@ class EtcdClient {
                      util::Task* task);
 
  protected:
+  // The order in which requests are sent when there are already
+  // --etcd_max_concurrent_requests in flight.
+  enum class Priority {
+    // Long-polling watch requests, which can stay in flight
+    // indefinitely, so they neither wait nor count towards the limit.
+    WATCH,
+    NORMAL,
+    // Only sent when no NORMAL request is waiting.
+    BULK,
+  };
+
   // Testing only
   EtcdClient();
 
+  UrlFetcher* fetcher() const {
+    return fetcher_;
+  }
+
+  HostPortPair ChooseNextServer();
+  HostPortPair GetEndpoint() const;
+
+  // Sends |body| to |path| of the JSON gateway of the etcd v3 API
+  // (such as "/v3/kv/range"), queued, retried and with a deadline
+  // like the other requests. The status comes from the "code" of an
+  // error response, which uses the same codes as util::Status.
+  void PostJson(const std::string& path, const JsonObject& body,
+                Priority priority, GenericResponse* resp, util::Task* task);
+
  private:
   struct RequestState;
   struct WatchState;
 
-  HostPortPair ChooseNextServer();
-  HostPortPair GetEndpoint() const;
   HostPortPair UpdateEndpoint(HostPortPair&& new_endpoint);
   void FetchDone(RequestState* etcd_req, util::Task* task);
+  // Queues |etcd_req|, with the deadline of requests of |priority|.
+  void Enqueue(RequestState* etcd_req, Priority priority);
   void Generic(const std::string& key, const std::string& key_space,
                const std::map<std::string, std::string>& params,
-               UrlFetcher::Verb verb, GenericResponse* resp, util::Task* task);
+               UrlFetcher::Verb verb, Priority priority,
+               GenericResponse* resp, util::Task* task);
+  // Sends |etcd_req| now, or queues it if there are too many requests
+  // in flight already.
+  void StartRequest(RequestState* etcd_req, Priority priority);
+  void SendRequest(RequestState* etcd_req);
+  // Called when a request that counted towards the limit is done, to
+  // send the next queued request, if any.
+  void RequestFinished();
 
   void WatchInitialGetDone(WatchState* state, GetResponse* resp,
                            util::Task* task);
@@ -162,6 +248,9 @@ class EtcdClient {
   mutable std::mutex lock_;
   std::list<HostPortPair> etcds_;
   bool logged_version_;
+  int requests_in_flight_;
+  std::deque<RequestState*> queued_requests_;
+  std::deque<RequestState*> queued_bulk_requests_;
 
   DISALLOW_COPY_AND_ASSIGN(EtcdClient);
 };
@@ -2,10 +2,16 @@
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <algorithm>
+#include <chrono>
 #include <functional>
 #include <mutex>
 
 using std::bind;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::max;
+using std::min;
 using std::move;
 using std::mutex;
 using std::placeholders::_1;
@@ -17,7 +23,12 @@ using util::Task;
 using util::TaskHold;
 
 DEFINE_int32(etcd_delete_concurrency, 4,
-             "number of etcd keys to delete at a time");
+             "initial number of etcd keys to delete at a time");
+DEFINE_int32(etcd_delete_max_concurrency, 32,
+             "maximum number of etcd keys to delete at a time");
+DEFINE_int32(etcd_delete_target_latency_ms, 100,
+             "the number of etcd keys deleted at a time is reduced when "
+             "deleting one takes longer than this many milliseconds");
 
 namespace cert_trans {
 namespace {
@@ -28,7 +39,12 @@ class DeleteState {
   DeleteState(EtcdClient* client, vector<string>&& keys, Task* task)
       : client_(CHECK_NOTNULL(client)),
         task_(CHECK_NOTNULL(task)),
+        max_concurrency_(max(FLAGS_etcd_delete_concurrency,
+                             FLAGS_etcd_delete_max_concurrency)),
+        target_latency_(milliseconds(FLAGS_etcd_delete_target_latency_ms)),
         outstanding_(0),
+        concurrency_(FLAGS_etcd_delete_concurrency),
+        last_decrease_(steady_clock::now()),
         keys_(move(keys)),
         it_(keys_.begin()) {
     CHECK_GT(FLAGS_etcd_delete_concurrency, 0);
@@ -46,22 +62,40 @@ class DeleteState {
   }
 
  private:
-  void RequestDone(Task* child_task);
+  void RequestDone(const steady_clock::time_point& started, Task* child_task);
   void StartNextRequest(unique_lock<mutex>&& lock);
 
   EtcdClient* const client_;
   Task* const task_;
+  const int max_concurrency_;
+  const steady_clock::duration target_latency_;
   mutex mutex_;
   int outstanding_;
+  // Fractional, so that it grows by about one for every round of
+  // requests completing in time.
+  double concurrency_;
+  steady_clock::time_point last_decrease_;
   const vector<string> keys_;
   vector<string>::const_iterator it_;
 };
 
 
-void DeleteState::RequestDone(Task* child_task) {
+void DeleteState::RequestDone(const steady_clock::time_point& started,
+                              Task* child_task) {
   unique_lock<mutex> lock(mutex_);
   --outstanding_;
 
+  const steady_clock::time_point now(steady_clock::now());
+  if (now - started <= target_latency_) {
+    concurrency_ =
+        min<double>(max_concurrency_, concurrency_ + 1 / concurrency_);
+  } else if (started >= last_decrease_) {
+    // Only back off once for the requests that were outstanding at the
+    // same time.
+    concurrency_ = max(1.0, concurrency_ / 2);
+    last_decrease_ = now;
+  }
+
   // If a child task has an error (except for not found, this is close
   // enough to success), return that error, and do not start any more
   // requests.
@@ -94,7 +128,7 @@ void DeleteState::StartNextRequest(unique_lock<mutex>&& lock) {
     return;
   }
 
-  while (outstanding_ < FLAGS_etcd_delete_concurrency && it_ != keys_.end() &&
+  while (outstanding_ < static_cast<int>(concurrency_) && it_ != keys_.end() &&
          task_->IsActive()) {
     CHECK(lock.owns_lock());
     const string& key(*it_);
@@ -104,8 +138,9 @@ void DeleteState::StartNextRequest(unique_lock<mutex>&& lock) {
     // In case the task uses an inline executor.
     lock.unlock();
 
-    client_->ForceDelete(key, task_->AddChild(
-                                  bind(&DeleteState::RequestDone, this, _1)));
+    client_->ForceDelete(key,
+                         task_->AddChild(bind(&DeleteState::RequestDone, this,
+                                              steady_clock::now(), _1)));
 
     // We must be holding the lock to evaluate the loop condition.
     lock.lock();
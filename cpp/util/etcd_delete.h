@@ -12,6 +12,12 @@ namespace cert_trans {
 
 // Force delete keys in batches (implemented using concurrent
 // requests). The "keys" argument are pairs of key and modified index.
+//
+// The number of concurrent requests starts at --etcd_delete_concurrency,
+// and adapts to how long they take: it slowly grows (up to
+// --etcd_delete_max_concurrency) while they complete within
+// --etcd_delete_target_latency_ms, and is halved when they don't, so as
+// to go as fast as etcd allows without overloading it.
 void EtcdForceDeleteKeys(EtcdClient* client, std::vector<std::string>&& keys,
                          util::Task* task);
 
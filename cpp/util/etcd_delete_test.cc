@@ -9,6 +9,7 @@
 #include "util/thread_pool.h"
 
 using std::bind;
+using std::chrono::milliseconds;
 using std::chrono::seconds;
 using std::move;
 using std::placeholders::_2;
@@ -32,6 +33,7 @@ using util::Task;
 using util::testing::StatusIs;
 
 DECLARE_int32(etcd_delete_concurrency);
+DECLARE_int32(etcd_delete_target_latency_ms);
 
 namespace cert_trans {
 namespace {
@@ -41,6 +43,7 @@ class EtcdDeleteTest : public ::testing::Test {
  protected:
   EtcdDeleteTest() : pool_(1) {
     FLAGS_etcd_delete_concurrency = 2;
+    FLAGS_etcd_delete_target_latency_ms = 100;
   }
 
   ThreadPool pool_;
@@ -179,6 +182,56 @@ TEST_F(EtcdDeleteTest, WithinConcurrency) {
 }
 
 
+TEST_F(EtcdDeleteTest, BacksOffWhenSlow) {
+  // Every request will be too slow.
+  FLAGS_etcd_delete_target_latency_ms = 0;
+  vector<string> keys{"/one", "/two", "/three"};
+  SyncTask sync(&pool_);
+
+  Task* first_task(nullptr);
+  Notification first;
+  Task* second_task(nullptr);
+  Notification second;
+  EXPECT_CALL(client_, ForceDelete("/one", _))
+      .WillOnce(DoAll(SaveArg<1>(&first_task),
+                      InvokeWithoutArgs(&first, &Notification::Notify)));
+  EXPECT_CALL(client_, ForceDelete("/two", _))
+      .WillOnce(DoAll(SaveArg<1>(&second_task),
+                      InvokeWithoutArgs(&second, &Notification::Notify)));
+  EtcdForceDeleteKeys(&client_, move(keys), sync.task());
+
+  ASSERT_TRUE(first.WaitForNotificationWithTimeout(seconds(1)));
+  ASSERT_TRUE(first_task);
+  ASSERT_TRUE(second.WaitForNotificationWithTimeout(seconds(1)));
+  ASSERT_TRUE(second_task);
+  Mock::VerifyAndClearExpectations(&client_);
+
+  // This halves the concurrency, so the third request must wait for
+  // the second one to be done.
+  MockFunction<void()> cleanup;
+  first_task->CleanupWhenDone(bind(&MockFunction<void()>::Call, &cleanup));
+  second_task->CleanupWhenDone(bind(&MockFunction<void()>::Call, &cleanup));
+  Expectation first_done(EXPECT_CALL(cleanup, Call()).Times(Exactly(2)));
+  Task* third_task(nullptr);
+  Notification third;
+  EXPECT_CALL(client_, ForceDelete("/three", _))
+      .After(first_done)
+      .WillOnce(DoAll(SaveArg<1>(&third_task),
+                      InvokeWithoutArgs(&third, &Notification::Notify)));
+
+  first_task->Return();
+  EXPECT_FALSE(third.WaitForNotificationWithTimeout(milliseconds(100)));
+  second_task->Return();
+
+  ASSERT_TRUE(third.WaitForNotificationWithTimeout(seconds(1)));
+  ASSERT_TRUE(third_task);
+  third_task->Return();
+
+  sync.Wait();
+  EXPECT_OK(sync.status());
+}
+
+
 TEST_F(EtcdDeleteTest, ErrorHandling) {
   vector<string> keys{"/one", "/two", "/three"};
   ASSERT_LT(static_cast<size_t>(FLAGS_etcd_delete_concurrency), keys.size());
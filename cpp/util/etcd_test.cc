@@ -12,6 +12,7 @@
 #include "util/sync_task.h"
 #include "util/testing.h"
 
+DECLARE_int32(etcd_max_concurrent_requests);
 DECLARE_int32(etcd_watch_error_retry_delay_seconds);
 
 namespace cert_trans {
@@ -152,6 +153,23 @@ const char kCompareFailedJson[] =
     "   \"index\": 8"
     "}";
 
+const char kWatcherClearedJson[] =
+    "{"
+    "   \"errorCode\": 400,"
+    "   \"message\": \"watcher is cleared due to etcd recovery\","
+    "   \"cause\": \"\","
+    "   \"index\": 12"
+    "}";
+
+const char kIndexClearedJson[] =
+    "{"
+    "   \"errorCode\": 401,"
+    "   \"message\": \"The event in requested index is outdated and "
+    "cleared\","
+    "   \"cause\": \"the requested history has been cleared [1010/10]\","
+    "   \"index\": 2009"
+    "}";
+
 const char kStoreStatsJson[] =
     "{"
     "   \"setsFail\" : 1,"
@@ -630,6 +648,29 @@ TEST_F(EtcdTest, ForceSetWithTTLForNewKey) {
 }
 
 
+TEST_F(EtcdTest, RefreshTTL) {
+  EXPECT_CALL(
+      url_fetcher_,
+      Fetch(IsUrlFetchRequest(
+                UrlFetcher::Verb::PUT, URL(GetEtcdUrl(kEntryKey)),
+                ElementsAre(Pair(StrCaseEq("content-type"),
+                                 "application/x-www-form-urlencoded")),
+                "consistent=true&prevExist=true&quorum=true&refresh=true&"
+                "ttl=100"),
+            _, _))
+      .WillOnce(
+          Invoke(bind(HandleFetch, Status::OK, 200,
+                      UrlFetcher::Headers{make_pair("x-etcd-index", "1")},
+                      kUpdateJson, _1, _2, _3)));
+  SyncTask task(base_.get());
+  EtcdClient::Response resp;
+  client_.RefreshTTL(kEntryKey, seconds(100), &resp, task.task());
+  task.Wait();
+  EXPECT_OK(task);
+  EXPECT_EQ(6, resp.etcd_index);
+}
+
+
 TEST_F(EtcdTest, Delete) {
   EXPECT_CALL(
       url_fetcher_,
@@ -687,6 +728,79 @@ TEST_F(EtcdTest, ForceDelete) {
 }
 
 
+TEST_F(EtcdTest, QueuesRequestsOverLimit) {
+  FLAGS_etcd_max_concurrent_requests = 1;
+  Task* get_fetch_task(nullptr);
+  UrlFetcher::Response* get_fetch_resp(nullptr);
+  {
+    InSequence s;
+    EXPECT_CALL(url_fetcher_,
+                Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
+                                        URL(GetEtcdUrl(kEntryKey) +
+                                            "?consistent=true&quorum=true"),
+                                        IsEmpty(), ""),
+                      _, _))
+        .WillOnce(Invoke([&get_fetch_task, &get_fetch_resp](
+            const UrlFetcher::Request&, UrlFetcher::Response* resp,
+            Task* task) {
+          get_fetch_resp = resp;
+          get_fetch_task = task;
+        }));
+    // The bulk delete was started first, but goes last.
+    EXPECT_CALL(url_fetcher_,
+                Fetch(IsUrlFetchRequest(UrlFetcher::Verb::PUT,
+                                        URL(GetEtcdUrl(kEntryKey)),
+                                        ElementsAre(Pair(
+                                            StrCaseEq("content-type"),
+                                            "application/x-www-form-"
+                                            "urlencoded")),
+                                        "consistent=true&prevExist=false&"
+                                        "quorum=true&value=123"),
+                      _, _))
+        .WillOnce(
+            Invoke(bind(HandleFetch, Status::OK, 201,
+                        UrlFetcher::Headers{make_pair("x-etcd-index", "7")},
+                        kCreateJson, _1, _2, _3)));
+    EXPECT_CALL(url_fetcher_,
+                Fetch(IsUrlFetchRequest(UrlFetcher::Verb::DELETE,
+                                        URL(GetEtcdUrl(kEntryKey) +
+                                            "?consistent=true&quorum=true"),
+                                        IsEmpty(), ""),
+                      _, _))
+        .WillOnce(
+            Invoke(bind(HandleFetch, Status::OK, 200,
+                        UrlFetcher::Headers{make_pair("x-etcd-index", "8")},
+                        kDeleteJson, _1, _2, _3)));
+  }
+
+  SyncTask get_task(base_.get());
+  EtcdClient::GetResponse get_resp;
+  client_.Get(string(kEntryKey), &get_resp, get_task.task());
+  SyncTask delete_task(base_.get());
+  client_.ForceDelete(kEntryKey, delete_task.task());
+  SyncTask create_task(base_.get());
+  EtcdClient::Response create_resp;
+  client_.Create(kEntryKey, "123", &create_resp, create_task.task());
+
+  // The other two requests wait for the first one.
+  ASSERT_TRUE(get_fetch_task);
+  EXPECT_FALSE(create_task.IsDone());
+  EXPECT_FALSE(delete_task.IsDone());
+  HandleFetch(Status::OK, 200,
+              UrlFetcher::Headers{make_pair("x-etcd-index", "11")}, kGetJson,
+              UrlFetcher::Request(), get_fetch_resp, get_fetch_task);
+
+  get_task.Wait();
+  EXPECT_OK(get_task);
+  create_task.Wait();
+  EXPECT_OK(create_task);
+  EXPECT_EQ(7, create_resp.etcd_index);
+  delete_task.Wait();
+  EXPECT_OK(delete_task);
+  FLAGS_etcd_max_concurrent_requests = 0;
+}
+
+
 TEST_F(EtcdTest, WatchInitialGetFailureCausesRetry) {
   FLAGS_etcd_watch_error_retry_delay_seconds = 1;
   {
@@ -694,7 +808,8 @@ TEST_F(EtcdTest, WatchInitialGetFailureCausesRetry) {
     EXPECT_CALL(url_fetcher_,
                 Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
                                         URL(GetEtcdUrl(kEntryKey) +
-                                            "?consistent=true&quorum=true"),
+                                            "?consistent=true&quorum=true" +
+                                            "&recursive=true"),
                                         IsEmpty(), ""),
                       _, _))
         .WillOnce(
@@ -703,7 +818,8 @@ TEST_F(EtcdTest, WatchInitialGetFailureCausesRetry) {
     EXPECT_CALL(url_fetcher_,
                 Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
                                         URL(GetEtcdUrl(kEntryKey) +
-                                            "?consistent=true&quorum=true"),
+                                            "?consistent=true&quorum=true" +
+                                            "&recursive=true"),
                                         IsEmpty(), ""),
                       _, _))
         .WillOnce(
@@ -735,7 +851,8 @@ TEST_F(EtcdTest, WatchInitialGetFailureRetriesOnNextEtcd) {
     EXPECT_CALL(url_fetcher_,
                 Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
                                         URL(GetEtcdUrl(kEntryKey) +
-                                            "?consistent=true&quorum=true"),
+                                            "?consistent=true&quorum=true" +
+                                            "&recursive=true"),
                                         IsEmpty(), ""),
                       _, _))
         .WillOnce(
@@ -746,7 +863,8 @@ TEST_F(EtcdTest, WatchInitialGetFailureRetriesOnNextEtcd) {
         Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
                                 URL(GetEtcdUrl(kEntryKey, kDefaultSpace,
                                                kEtcdHost2, kEtcdPort2) +
-                                    "?consistent=true&quorum=true"),
+                                    "?consistent=true&quorum=true" +
+                                    "&recursive=true"),
                                 IsEmpty(), ""),
               _, _))
         .WillOnce(
@@ -776,7 +894,8 @@ TEST_F(EtcdTest, WatchHangingGetTimeoutCausesRetry) {
     EXPECT_CALL(url_fetcher_,
                 Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
                                         URL(GetEtcdUrl(kEntryKey) +
-                                            "?consistent=true&quorum=true"),
+                                            "?consistent=true&quorum=true" +
+                                            "&recursive=true"),
                                         IsEmpty(), ""),
                       _, _))
         .WillOnce(
@@ -826,6 +945,137 @@ TEST_F(EtcdTest, WatchHangingGetTimeoutCausesRetry) {
 }
 
 
+TEST_F(EtcdTest, WatchResumesAfterWatcherCleared) {
+  FLAGS_etcd_watch_error_retry_delay_seconds = 1;
+
+  {
+    InSequence s;
+    EXPECT_CALL(url_fetcher_,
+                Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
+                                        URL(GetEtcdUrl(kEntryKey) +
+                                            "?consistent=true&quorum=true" +
+                                            "&recursive=true"),
+                                        IsEmpty(), ""),
+                      _, _))
+        .WillOnce(
+            Invoke(bind(HandleFetch, Status::OK, 200,
+                        UrlFetcher::Headers{make_pair("x-etcd-index", "9")},
+                        kGetJson, _1, _2, _3)));
+    EXPECT_CALL(url_fetcher_,
+                Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
+                                        URL(GetEtcdUrl(kEntryKey) +
+                                            "?consistent=true&quorum=false" +
+                                            "&recursive=true&wait=true" +
+                                            "&waitIndex=10"),
+                                        IsEmpty(), ""),
+                      _, _))
+        .WillOnce(
+            Invoke(bind(HandleFetch, Status::OK, 400,
+                        UrlFetcher::Headers{make_pair("x-etcd-index", "12")},
+                        kWatcherClearedJson, _1, _2, _3)));
+    // No new initial get, the watch carries on from where it was.
+    EXPECT_CALL(url_fetcher_,
+                Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
+                                        URL(GetEtcdUrl(kEntryKey) +
+                                            "?consistent=true&quorum=false" +
+                                            "&recursive=true&wait=true" +
+                                            "&waitIndex=10"),
+                                        IsEmpty(), ""),
+                      _, _))
+        .WillOnce(
+            Invoke(bind(HandleFetch, Status::OK, 200,
+                        UrlFetcher::Headers{make_pair("x-etcd-index", "9")},
+                        kGetJson, _1, _2, _3)));
+  }
+
+  SyncTask task(base_.get());
+  int num_updates(0);
+  client_.Watch(kEntryKey,
+                [&task,
+                 &num_updates](const vector<EtcdClient::Node>& updates) {
+                  EXPECT_EQ(static_cast<size_t>(1), updates.size());
+                  EXPECT_EQ(9, updates[0].modified_index_);
+                  if (num_updates == 1) {
+                    task.Cancel();
+                  }
+                  ++num_updates;
+                },
+                task.task());
+  task.Wait();
+  EXPECT_EQ(2, num_updates);
+}
+
+
+TEST_F(EtcdTest, WatchOutdatedIndexGetsEverythingAgain) {
+  const char kLaterGetJson[] =
+      "{"
+      "  \"action\": \"get\","
+      "  \"node\": {"
+      "    \"createdIndex\": 6,"
+      "    \"key\": \"/some/key\","
+      "    \"modifiedIndex\": 2000,"
+      "    \"value\": \"456\""
+      "  }"
+      "}";
+  {
+    InSequence s;
+    EXPECT_CALL(url_fetcher_,
+                Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
+                                        URL(GetEtcdUrl(kEntryKey) +
+                                            "?consistent=true&quorum=true" +
+                                            "&recursive=true"),
+                                        IsEmpty(), ""),
+                      _, _))
+        .WillOnce(
+            Invoke(bind(HandleFetch, Status::OK, 200,
+                        UrlFetcher::Headers{make_pair("x-etcd-index", "9")},
+                        kGetJson, _1, _2, _3)));
+    EXPECT_CALL(url_fetcher_,
+                Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
+                                        URL(GetEtcdUrl(kEntryKey) +
+                                            "?consistent=true&quorum=false" +
+                                            "&recursive=true&wait=true" +
+                                            "&waitIndex=10"),
+                                        IsEmpty(), ""),
+                      _, _))
+        .WillOnce(
+            Invoke(bind(HandleFetch, Status::OK, 400,
+                        UrlFetcher::Headers{make_pair("x-etcd-index", "2009")},
+                        kIndexClearedJson, _1, _2, _3)));
+    EXPECT_CALL(url_fetcher_,
+                Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
+                                        URL(GetEtcdUrl(kEntryKey) +
+                                            "?consistent=true&quorum=true" +
+                                            "&recursive=true"),
+                                        IsEmpty(), ""),
+                      _, _))
+        .WillOnce(
+            Invoke(bind(HandleFetch, Status::OK, 200,
+                        UrlFetcher::Headers{make_pair("x-etcd-index", "2009")},
+                        kLaterGetJson, _1, _2, _3)));
+  }
+
+  SyncTask task(base_.get());
+  int num_updates(0);
+  client_.Watch(kEntryKey,
+                [&task,
+                 &num_updates](const vector<EtcdClient::Node>& updates) {
+                  ASSERT_EQ(static_cast<size_t>(1), updates.size());
+                  if (num_updates == 0) {
+                    EXPECT_EQ(9, updates[0].modified_index_);
+                  } else {
+                    EXPECT_EQ(2000, updates[0].modified_index_);
+                    EXPECT_EQ("456", updates[0].value_);
+                    task.Cancel();
+                  }
+                  ++num_updates;
+                },
+                task.task());
+  task.Wait();
+  EXPECT_EQ(2, num_updates);
+}
+
+
 TEST_F(EtcdTest, UnavailableEtcdRetriesOnNewServer) {
   EtcdClient multi_client(base_.get(), &url_fetcher_,
                           {EtcdClient::HostPortPair(kEtcdHost, kEtcdPort),
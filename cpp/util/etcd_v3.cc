@@ -0,0 +1,1028 @@
+#include "util/etcd_v3.h"
+
+#include <event2/buffer.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <algorithm>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include "monitoring/monitoring.h"
+#include "util/json_wrapper.h"
+#include "util/task_sequence.h"
+
+using std::atoll;
+using std::bind;
+using std::chrono::seconds;
+using std::copy;
+using std::deque;
+using std::function;
+using std::list;
+using std::lock_guard;
+using std::make_pair;
+using std::map;
+using std::max;
+using std::min;
+using std::move;
+using std::mutex;
+using std::placeholders::_1;
+using std::placeholders::_2;
+using std::string;
+using std::to_string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+using util::Executor;
+using util::Status;
+using util::Task;
+using util::TaskSequence;
+
+DEFINE_int32(etcd_v3_max_txn_ops, 128,
+             "maximum number of ops in each transaction sent to etcd, which "
+             "must not be more than its --max-txn-ops");
+
+DECLARE_int32(etcd_watch_error_retry_delay_seconds);
+
+namespace cert_trans {
+
+namespace {
+
+const char kRangePath[] = "/v3/kv/range";
+const char kPutPath[] = "/v3/kv/put";
+const char kDeleteRangePath[] = "/v3/kv/deleterange";
+const char kTxnPath[] = "/v3/kv/txn";
+const char kLeaseGrantPath[] = "/v3/lease/grant";
+const char kLeaseKeepAlivePath[] = "/v3/lease/keepalive";
+const char kLeaseRevokePath[] = "/v3/lease/revoke";
+const char kWatchPath[] = "/v3/watch";
+
+
+static Counter<string>* etcd_v3_watch_snapshots = Counter<string>::New(
+    "etcd_v3_watch_snapshots", "key",
+    "Number of times an etcd v3 watch had to get the whole contents of "
+    "the watched key, broken down by key.");
+
+
+// The gateway sends the 64-bit integers as strings, and leaves out
+// the fields which have their default value.
+int64_t GetInt64(const JsonObject& json, const char* field) {
+  const JsonString value(json, field);
+  return value.Ok() ? atoll(value.Value()) : 0;
+}
+
+
+// Keys and values are sent base64-encoded.
+string GetBytes(const JsonObject& json, const char* field) {
+  JsonString value(json, field);
+  return value.Ok() ? value.FromBase64() : "";
+}
+
+
+int64_t GetRevision(const JsonObject& json) {
+  const JsonObject header(json, "header");
+  return header.Ok() ? GetInt64(header, "revision") : -1;
+}
+
+
+struct KeyValue {
+  string key;
+  string value;
+  int64_t create_revision;
+  int64_t mod_revision;
+  int64_t lease;
+};
+
+
+KeyValue ParseKeyValue(const JsonObject& json) {
+  KeyValue kv;
+  kv.key = GetBytes(json, "key");
+  kv.value = GetBytes(json, "value");
+  kv.create_revision = GetInt64(json, "create_revision");
+  kv.mod_revision = GetInt64(json, "mod_revision");
+  kv.lease = GetInt64(json, "lease");
+  return kv;
+}
+
+
+// The key-values of a range response, sorted by key.
+vector<KeyValue> ParseKeyValues(const JsonObject& json) {
+  vector<KeyValue> kvs;
+  const JsonArray json_kvs(json, "kvs");
+  if (!json_kvs.Ok()) {
+    return kvs;
+  }
+  for (int i = 0; i < json_kvs.Length(); ++i) {
+    const JsonObject json_kv(json_kvs, i);
+    if (json_kv.Ok()) {
+      kvs.emplace_back(ParseKeyValue(json_kv));
+    }
+  }
+  return kvs;
+}
+
+
+// The lease of the "prev_kv" of a put response, zero if the key did not
+// exist or had no lease.
+int64_t GetPreviousLease(const JsonObject& json) {
+  const JsonObject prev_kv(json, "prev_kv");
+  return prev_kv.Ok() ? GetInt64(prev_kv, "lease") : 0;
+}
+
+
+// The prefix of the keys in the "directory" |key|.
+string DirPrefix(const string& key) {
+  return key[key.size() - 1] == '/' ? key : key + "/";
+}
+
+
+// Sets the range of |json| to cover |key| and the keys under it, and
+// a few more (such as "/a-b" for "/a"), which InKeyRange() filters
+// out.
+void AddKeyRange(const string& key, JsonObject* json) {
+  const string prefix(DirPrefix(key));
+  const string file(prefix.substr(0, prefix.size() - 1));
+  json->AddBase64("key", file.empty() ? prefix : file);
+  // The byte after '/'.
+  json->AddBase64("range_end", file + "0");
+}
+
+
+bool InKeyRange(const string& key, const string& candidate) {
+  const string prefix(DirPrefix(key));
+  return candidate.compare(0, prefix.size(), prefix) == 0 ||
+         candidate == prefix.substr(0, prefix.size() - 1);
+}
+
+
+// Adds |leaf| to |dir|, whose keys start with |prefix_size| bytes of
+// prefix, creating the directories in between.
+void AddToDir(EtcdClient::Node&& leaf, size_t prefix_size,
+              EtcdClient::Node* dir) {
+  dir->created_index_ = min(dir->created_index_, leaf.created_index_);
+  dir->modified_index_ = max(dir->modified_index_, leaf.modified_index_);
+  const size_t slash(leaf.key_.find('/', prefix_size));
+  if (slash == string::npos) {
+    dir->nodes_.emplace_back(move(leaf));
+    return;
+  }
+
+  const string sub_key(leaf.key_.substr(0, slash));
+  // The keys are sorted, so the ones under a directory are together.
+  if (dir->nodes_.empty() || !dir->nodes_.back().is_dir_ ||
+      dir->nodes_.back().key_ != sub_key) {
+    dir->nodes_.emplace_back(EtcdClient::Node(leaf.created_index_,
+                                              leaf.modified_index_, sub_key,
+                                              true, "", {}, false));
+  }
+  AddToDir(move(leaf), slash + 1, &dir->nodes_.back());
+}
+
+
+// Errors in the middle of a stream come as a message of their own.
+Status StatusFromStreamError(const JsonObject& message) {
+  const JsonObject error(message, "error");
+  if (!error.Ok()) {
+    return Status(util::error::INTERNAL,
+                  "Unexpected message from etcd: " + message.DebugString());
+  }
+  const JsonInt code(error, "grpc_code");
+  const JsonString error_message(error, "message");
+  return Status(code.Ok() && code.Value() > util::error::OK &&
+                        code.Value() <= util::error::DATA_LOSS
+                    ? static_cast<util::error::Code>(code.Value())
+                    : util::error::UNKNOWN,
+                "Etcd message: " + string(error_message.Ok()
+                                              ? error_message.Value()
+                                              : error.DebugString()));
+}
+
+
+void GetRequestDone(const EtcdClient::Request& req,
+                    EtcdClient::GetResponse* resp, Task* parent_task,
+                    EtcdClient::GenericResponse* gen_resp, Task* task) {
+  *resp = EtcdClient::GetResponse();
+  if (!task->status().ok()) {
+    parent_task->Return(
+        Status(task->status().CanonicalCode(),
+               task->status().error_message() + " (" + req.key + ")"));
+    return;
+  }
+  resp->etcd_index = GetRevision(*gen_resp->json_body);
+
+  const string prefix(DirPrefix(req.key));
+  const string file(prefix.substr(0, prefix.size() - 1));
+  EtcdClient::Node dir(resp->etcd_index, -1, file.empty() ? prefix : file,
+                       true, "", {}, false);
+  EtcdClient::Node file_node;
+  for (const KeyValue& kv : ParseKeyValues(*gen_resp->json_body)) {
+    EtcdClient::Node node(kv.create_revision, kv.mod_revision, kv.key, false,
+                          kv.value, {}, false);
+    if (kv.key == file) {
+      file_node = move(node);
+    } else if (InKeyRange(req.key, kv.key)) {
+      AddToDir(move(node), prefix.size(), &dir);
+    }
+  }
+
+  if (!dir.nodes_.empty()) {
+    LOG_IF(WARNING, !file_node.deleted_) << "Both a key and a directory: "
+                                         << file;
+    if (!req.recursive) {
+      // Like the v2 API, only list the subdirectories.
+      for (auto& node : dir.nodes_) {
+        node.nodes_.clear();
+      }
+    }
+    resp->node = move(dir);
+  } else if (!file_node.deleted_) {
+    resp->node = move(file_node);
+  } else {
+    parent_task->Return(
+        Status(util::error::NOT_FOUND, "Key not found (" + req.key + ")"));
+    return;
+  }
+  parent_task->Return();
+}
+
+
+void TxnRequestDone(const vector<EtcdClient::TxnOp>& ops,
+                    vector<int64_t>* previous_leases,
+                    EtcdClient::TxnResponse* resp, Task* parent_task,
+                    EtcdClient::GenericResponse* gen_resp, Task* task) {
+  *resp = EtcdClient::TxnResponse();
+  resp->indices.resize(ops.size(), -1);
+  if (!task->status().ok()) {
+    parent_task->Return(task->status());
+    return;
+  }
+
+  const JsonObject& json(*gen_resp->json_body);
+  const JsonBoolean succeeded(json, "succeeded");
+  const JsonArray responses(json, "responses");
+  if (succeeded.Ok() && succeeded.Value()) {
+    resp->etcd_index = GetRevision(json);
+    resp->num_applied = ops.size();
+    if (previous_leases) {
+      previous_leases->assign(ops.size(), 0);
+    }
+    for (size_t i = 0; i < ops.size(); ++i) {
+      if (ops[i].type == EtcdClient::TxnOp::Type::DELETE) {
+        continue;
+      }
+      resp->indices[i] = resp->etcd_index;
+      if (previous_leases && responses.Ok() &&
+          static_cast<int>(i) < responses.Length()) {
+        const JsonObject response(responses, i);
+        const JsonObject put(response, "response_put");
+        if (put.Ok()) {
+          (*previous_leases)[i] = GetPreviousLease(put);
+        }
+      }
+    }
+    parent_task->Return();
+    return;
+  }
+
+  // The failure branch got each of the keys, to find the first op
+  // whose condition did not hold.
+  if (!responses.Ok() || responses.Length() != static_cast<int>(ops.size())) {
+    parent_task->Return(
+        Status(util::error::FAILED_PRECONDITION,
+               "Etcd transaction failed: " + json.DebugString()));
+    return;
+  }
+  for (size_t i = 0; i < ops.size(); ++i) {
+    const JsonObject response(responses, i);
+    const JsonObject range(response, "response_range");
+    const vector<KeyValue> kvs(range.Ok() ? ParseKeyValues(range)
+                                          : vector<KeyValue>());
+    const EtcdClient::TxnOp& op(ops[i]);
+    if (op.type == EtcdClient::TxnOp::Type::CREATE) {
+      if (!kvs.empty()) {
+        parent_task->Return(Status(util::error::FAILED_PRECONDITION,
+                                   "Key already exists (" + op.key + ")"));
+        return;
+      }
+    } else if (kvs.empty()) {
+      parent_task->Return(
+          Status(util::error::NOT_FOUND, "Key not found (" + op.key + ")"));
+      return;
+    } else if (kvs[0].mod_revision != op.index) {
+      parent_task->Return(Status(util::error::FAILED_PRECONDITION,
+                                 "Compare failed (" + op.key + ")"));
+      return;
+    }
+  }
+  parent_task->Return(Status(util::error::FAILED_PRECONDITION,
+                             "Etcd transaction failed"));
+}
+
+
+}  // namespace
+
+
+struct EtcdV3Client::WatchState {
+  WatchState(const string& key, const WatchCallback& cb, Task* task)
+      : key_(key),
+        cb_(cb),
+        task_(CHECK_NOTNULL(task)),
+        revision_(-1),
+        delivering_(false) {
+  }
+
+  ~WatchState() {
+    VLOG(1) << "EtcdV3Client::Watch: no longer watching " << key_;
+  }
+
+  const string key_;
+  const WatchCallback cb_;
+  Task* const task_;
+
+  mutex lock_;
+  // The revision up to which the updates have been received.
+  int64_t revision_;
+  map<string, int64_t> known_keys_;
+  deque<vector<Node>> pending_updates_;
+  bool delivering_;
+  // To call once the pending updates have been delivered.
+  vector<function<void()>> resumes_;
+};
+
+
+struct EtcdV3Client::WatchFetch {
+  WatchFetch()
+      : buffer_(evbuffer_new(), evbuffer_free),
+        task_(nullptr),
+        compacted_(false) {
+  }
+
+  UrlFetcher::Request req_;
+  UrlFetcher::Response resp_;
+  // What was received and not parsed yet.
+  const unique_ptr<evbuffer, void (*)(evbuffer*)> buffer_;
+  Task* task_;
+
+  // Set when the fetch is stopped early, because the watch was
+  // cancelled by etcd, which also sets |compacted_| if it was because
+  // the revision to start from was compacted.
+  Status status_;
+  bool compacted_;
+};
+
+
+EtcdV3Client::EtcdV3Client(Executor* executor, UrlFetcher* fetcher,
+                           const list<HostPortPair>& etcds)
+    : EtcdClient(executor, fetcher, etcds) {
+}
+
+
+EtcdV3Client::~EtcdV3Client() {
+}
+
+
+void EtcdV3Client::Get(const Request& req, GetResponse* resp, Task* task) {
+  if (req.wait_index > 0) {
+    task->Return(Status(util::error::UNIMPLEMENTED,
+                        "waiting is not supported with etcd v3"));
+    return;
+  }
+  JsonObject body;
+  AddKeyRange(req.key, &body);
+  GenericResponse* const gen_resp(new GenericResponse);
+  task->DeleteWhenDone(gen_resp);
+  PostJson(kRangePath, body, Priority::NORMAL, gen_resp,
+           task->AddChild(
+               bind(&GetRequestDone, req, resp, task, gen_resp, _1)));
+}
+
+
+void EtcdV3Client::Create(const string& key, const string& value,
+                          Response* resp, Task* task) {
+  Write(TxnOp(TxnOp::Type::CREATE, key, value, -1), seconds(0), resp, task);
+}
+
+
+void EtcdV3Client::CreateWithTTL(const string& key, const string& value,
+                                 const seconds& ttl, Response* resp,
+                                 Task* task) {
+  CHECK_GT(ttl.count(), 0);
+  Write(TxnOp(TxnOp::Type::CREATE, key, value, -1), ttl, resp, task);
+}
+
+
+void EtcdV3Client::Update(const string& key, const string& value,
+                          const int64_t previous_index, Response* resp,
+                          Task* task) {
+  Write(TxnOp(TxnOp::Type::UPDATE, key, value, previous_index), seconds(0),
+        resp, task);
+}
+
+
+void EtcdV3Client::UpdateWithTTL(const string& key, const string& value,
+                                 const seconds& ttl,
+                                 const int64_t previous_index, Response* resp,
+                                 Task* task) {
+  CHECK_GT(ttl.count(), 0);
+  Write(TxnOp(TxnOp::Type::UPDATE, key, value, previous_index), ttl, resp,
+        task);
+}
+
+
+void EtcdV3Client::ForceSet(const string& key, const string& value,
+                            Response* resp, Task* task) {
+  Put(key, value, seconds(0), resp, task);
+}
+
+
+void EtcdV3Client::ForceSetWithTTL(const string& key, const string& value,
+                                   const seconds& ttl, Response* resp,
+                                   Task* task) {
+  CHECK_GT(ttl.count(), 0);
+  Put(key, value, ttl, resp, task);
+}
+
+
+void EtcdV3Client::RefreshTTL(const string& key, const seconds& ttl,
+                              Response* resp, Task* task) {
+  GenericResponse* const range_resp(new GenericResponse);
+  task->DeleteWhenDone(range_resp);
+  GenericResponse* const keep_alive_resp(new GenericResponse);
+  task->DeleteWhenDone(keep_alive_resp);
+  TaskSequence(task)
+      .Then([this, key, range_resp](Task* step) {
+        JsonObject range;
+        range.AddBase64("key", key);
+        PostJson(kRangePath, range, Priority::NORMAL, range_resp, step);
+      })
+      .Then([this, key, resp, range_resp, keep_alive_resp](Task* step) {
+        const vector<KeyValue> kvs(ParseKeyValues(*range_resp->json_body));
+        if (kvs.empty()) {
+          step->Return(
+              Status(util::error::NOT_FOUND, "Key not found (" + key + ")"));
+          return;
+        }
+        if (kvs[0].lease == 0) {
+          step->Return(Status(util::error::FAILED_PRECONDITION,
+                              "Key has no TTL (" + key + ")"));
+          return;
+        }
+        resp->etcd_index = kvs[0].mod_revision;
+        JsonObject keep_alive;
+        keep_alive.Add("ID", to_string(kvs[0].lease));
+        PostJson(kLeaseKeepAlivePath, keep_alive, Priority::NORMAL,
+                 keep_alive_resp, step);
+      })
+      .Then([key, keep_alive_resp](Task* step) {
+        const JsonObject result(*keep_alive_resp->json_body, "result");
+        if (!result.Ok()) {
+          step->Return(StatusFromStreamError(*keep_alive_resp->json_body));
+          return;
+        }
+        // The lease expired since we got the key.
+        if (GetInt64(result, "TTL") <= 0) {
+          step->Return(
+              Status(util::error::NOT_FOUND, "Key not found (" + key + ")"));
+          return;
+        }
+        step->Return();
+      })
+      .Run();
+}
+
+
+void EtcdV3Client::Delete(const string& key, const int64_t current_index,
+                          Task* task) {
+  TxnResponse* const resp(new TxnResponse);
+  task->DeleteWhenDone(resp);
+  SendTxn({TxnOp(TxnOp::Type::DELETE, key, "", current_index)}, 0, nullptr,
+          resp, task);
+}
+
+
+void EtcdV3Client::ForceDelete(const string& key, Task* task) {
+  JsonObject body;
+  body.AddBase64("key", key);
+  GenericResponse* const gen_resp(new GenericResponse);
+  task->DeleteWhenDone(gen_resp);
+  PostJson(kDeleteRangePath, body, Priority::BULK, gen_resp,
+           task->AddChild([key, task, gen_resp](Task* child_task) {
+             if (!child_task->status().ok()) {
+               task->Return(child_task->status());
+               return;
+             }
+             // Like with the v2 API.
+             if (GetInt64(*gen_resp->json_body, "deleted") == 0) {
+               task->Return(Status(util::error::NOT_FOUND,
+                                   "Key not found (" + key + ")"));
+               return;
+             }
+             task->Return();
+           }));
+}
+
+
+void EtcdV3Client::Txn(const vector<TxnOp>& ops, TxnResponse* resp,
+                       Task* task) {
+  CHECK_GT(FLAGS_etcd_v3_max_txn_ops, 0);
+  *resp = TxnResponse();
+  resp->indices.resize(ops.size(), -1);
+  TaskSequence sequence(task);
+  for (size_t begin = 0; begin < ops.size();
+       begin += FLAGS_etcd_v3_max_txn_ops) {
+    const vector<TxnOp> batch(
+        ops.begin() + begin,
+        ops.begin() + min(ops.size(), begin + FLAGS_etcd_v3_max_txn_ops));
+    TxnResponse* const batch_resp(new TxnResponse);
+    task->DeleteWhenDone(batch_resp);
+    sequence.Then([this, batch, batch_resp](Task* step) {
+      SendTxn(batch, 0, nullptr, batch_resp, step);
+    });
+    sequence.Then([resp, begin, batch_resp](Task* step) {
+      copy(batch_resp->indices.begin(), batch_resp->indices.end(),
+           resp->indices.begin() + begin);
+      resp->etcd_index = max(resp->etcd_index, batch_resp->etcd_index);
+      resp->num_applied += batch_resp->num_applied;
+      step->Return();
+    });
+  }
+  sequence.Run();
+}
+
+
+void EtcdV3Client::GetStoreStats(StatsResponse* resp, Task* task) {
+  JsonObject body;
+  // All the keys.
+  body.AddBase64("key", string(1, '\0'));
+  body.AddBase64("range_end", string(1, '\0'));
+  body.AddBoolean("count_only", true);
+  GenericResponse* const gen_resp(new GenericResponse);
+  task->DeleteWhenDone(gen_resp);
+  PostJson(kRangePath, body, Priority::NORMAL, gen_resp,
+           task->AddChild([resp, task, gen_resp](Task* child_task) {
+             *resp = StatsResponse();
+             if (!child_task->status().ok()) {
+               task->Return(child_task->status());
+               return;
+             }
+             resp->etcd_index = GetRevision(*gen_resp->json_body);
+             resp->stats["keys"] = GetInt64(*gen_resp->json_body, "count");
+             task->Return();
+           }));
+}
+
+
+void EtcdV3Client::Watch(const string& key, const WatchCallback& cb,
+                         Task* task) {
+  VLOG(1) << "EtcdV3Client::Watch: " << key;
+
+  WatchState* const state(new WatchState(key, cb, task));
+  task->DeleteWhenDone(state);
+
+  StartWatchSnapshot(state);
+}
+
+
+void EtcdV3Client::Write(const TxnOp& op, const seconds& ttl, Response* resp,
+                         Task* task) {
+  int64_t* const lease(new int64_t(0));
+  task->DeleteWhenDone(lease);
+  vector<int64_t>* const previous_leases(new vector<int64_t>);
+  task->DeleteWhenDone(previous_leases);
+  TxnResponse* const txn_resp(new TxnResponse);
+  task->DeleteWhenDone(txn_resp);
+  TaskSequence sequence(task);
+  if (ttl.count() > 0) {
+    sequence.Then(
+        [this, ttl, lease](Task* step) { GrantLease(ttl, lease, step); });
+  }
+  sequence
+      .Then([this, op, lease, previous_leases, txn_resp](Task* step) {
+        SendTxn({op}, *lease, *lease != 0 ? previous_leases : nullptr,
+                txn_resp, step);
+      })
+      .Then([this, lease, previous_leases, resp, txn_resp](Task* step) {
+        resp->etcd_index = txn_resp->etcd_index;
+        RevokePreviousLease(
+            previous_leases->empty() ? 0 : previous_leases->front(), *lease,
+            step);
+      })
+      .Run();
+}
+
+
+void EtcdV3Client::Put(const string& key, const string& value,
+                       const seconds& ttl, Response* resp, Task* task) {
+  int64_t* const lease(new int64_t(0));
+  task->DeleteWhenDone(lease);
+  GenericResponse* const gen_resp(new GenericResponse);
+  task->DeleteWhenDone(gen_resp);
+  TaskSequence sequence(task);
+  if (ttl.count() > 0) {
+    sequence.Then(
+        [this, ttl, lease](Task* step) { GrantLease(ttl, lease, step); });
+  }
+  sequence
+      .Then([this, key, value, lease, gen_resp](Task* step) {
+        JsonObject body;
+        body.AddBase64("key", key);
+        body.AddBase64("value", value);
+        if (*lease != 0) {
+          body.Add("lease", to_string(*lease));
+          body.AddBoolean("prev_kv", true);
+        }
+        PostJson(kPutPath, body, Priority::NORMAL, gen_resp, step);
+      })
+      .Then([this, lease, resp, gen_resp](Task* step) {
+        resp->etcd_index = GetRevision(*gen_resp->json_body);
+        RevokePreviousLease(
+            *lease != 0 ? GetPreviousLease(*gen_resp->json_body) : 0, *lease,
+            step);
+      })
+      .Run();
+}
+
+
+void EtcdV3Client::SendTxn(const vector<TxnOp>& ops, int64_t lease,
+                           vector<int64_t>* previous_leases,
+                           TxnResponse* resp, Task* task) {
+  JsonArray compare;
+  JsonArray success;
+  JsonArray failure;
+  for (const TxnOp& op : ops) {
+    JsonObject condition;
+    condition.AddBase64("key", op.key);
+    condition.Add("result", "EQUAL");
+    if (op.type == TxnOp::Type::CREATE) {
+      condition.Add("target", "CREATE");
+      condition.Add("create_revision", "0");
+    } else {
+      condition.Add("target", "MOD");
+      condition.Add("mod_revision", to_string(op.index));
+    }
+    compare.Add(&condition);
+
+    JsonObject request;
+    JsonObject key;
+    key.AddBase64("key", op.key);
+    if (op.type == TxnOp::Type::DELETE) {
+      request.Add("request_delete_range", key);
+    } else {
+      key.AddBase64("value", op.value);
+      if (lease != 0) {
+        key.Add("lease", to_string(lease));
+      }
+      if (previous_leases) {
+        key.AddBoolean("prev_kv", true);
+      }
+      request.Add("request_put", key);
+    }
+    success.Add(&request);
+
+    JsonObject get;
+    JsonObject get_key;
+    get_key.AddBase64("key", op.key);
+    get.Add("request_range", get_key);
+    failure.Add(&get);
+  }
+
+  JsonObject body;
+  body.Add("compare", compare);
+  body.Add("success", success);
+  body.Add("failure", failure);
+  GenericResponse* const gen_resp(new GenericResponse);
+  task->DeleteWhenDone(gen_resp);
+  PostJson(kTxnPath, body, Priority::NORMAL, gen_resp,
+           task->AddChild(bind(&TxnRequestDone, ops, previous_leases, resp,
+                               task, gen_resp, _1)));
+}
+
+
+void EtcdV3Client::GrantLease(const seconds& ttl, int64_t* lease,
+                              Task* task) {
+  JsonObject body;
+  body.Add("TTL", to_string(ttl.count()));
+  GenericResponse* const gen_resp(new GenericResponse);
+  task->DeleteWhenDone(gen_resp);
+  PostJson(kLeaseGrantPath, body, Priority::NORMAL, gen_resp,
+           task->AddChild([lease, task, gen_resp](Task* child_task) {
+             if (!child_task->status().ok()) {
+               task->Return(child_task->status());
+               return;
+             }
+             *lease = GetInt64(*gen_resp->json_body, "ID");
+             if (*lease == 0) {
+               task->Return(Status(util::error::INTERNAL,
+                                   "No lease granted: " +
+                                       gen_resp->json_body->DebugString()));
+               return;
+             }
+             task->Return();
+           }));
+}
+
+
+void EtcdV3Client::RevokePreviousLease(int64_t previous_lease, int64_t lease,
+                                       Task* task) {
+  if (previous_lease == 0 || previous_lease == lease) {
+    task->Return();
+    return;
+  }
+  JsonObject body;
+  body.Add("ID", to_string(previous_lease));
+  GenericResponse* const gen_resp(new GenericResponse);
+  task->DeleteWhenDone(gen_resp);
+  PostJson(kLeaseRevokePath, body, Priority::BULK, gen_resp,
+           task->AddChild([previous_lease, task](Task* child_task) {
+             // The write itself succeeded, and the lease expires on its
+             // own anyway.
+             LOG_IF(WARNING, !child_task->status().ok())
+                 << "Failed to revoke lease " << previous_lease << ": "
+                 << child_task->status();
+             task->Return();
+           }));
+}
+
+
+void EtcdV3Client::StartWatchSnapshot(WatchState* state) {
+  if (state->task_->CancelRequested()) {
+    state->task_->Return(Status::CANCELLED);
+    return;
+  }
+
+  etcd_v3_watch_snapshots->Increment(state->key_);
+  JsonObject body;
+  AddKeyRange(state->key_, &body);
+  GenericResponse* const gen_resp(new GenericResponse);
+  PostJson(kRangePath, body, Priority::NORMAL, gen_resp,
+           state->task_->AddChild(bind(&EtcdV3Client::WatchSnapshotDone, this,
+                                       state, gen_resp, _1)));
+}
+
+
+void EtcdV3Client::WatchSnapshotDone(WatchState* state,
+                                     GenericResponse* gen_resp, Task* task) {
+  // Not with util::Task::DeleteWhenDone, as the task is long-lived.
+  unique_ptr<GenericResponse> gen_resp_deleter(gen_resp);
+  if (state->task_->CancelRequested()) {
+    state->task_->Return(Status::CANCELLED);
+    return;
+  }
+
+  if (!task->status().ok()) {
+    LOG(WARNING) << "Watch snapshot error: " << task->status()
+                 << ", will retry in "
+                 << FLAGS_etcd_watch_error_retry_delay_seconds
+                 << " second(s)";
+    state->task_->executor()->Delay(
+        seconds(FLAGS_etcd_watch_error_retry_delay_seconds),
+        state->task_->AddChild(
+            [this, state](Task*) { StartWatchSnapshot(state); }));
+    return;
+  }
+
+  // Like with the v2 API, the keys gone since the last snapshot are
+  // reported as deleted.
+  vector<Node> updates;
+  bool first;
+  {
+    lock_guard<mutex> lock(state->lock_);
+    first = state->revision_ < 0;
+    state->revision_ = GetRevision(*gen_resp->json_body);
+    map<string, int64_t> new_known_keys;
+    for (const KeyValue& kv : ParseKeyValues(*gen_resp->json_body)) {
+      if (!InKeyRange(state->key_, kv.key)) {
+        continue;
+      }
+      const auto it(state->known_keys_.find(kv.key));
+      if (it == state->known_keys_.end() || it->second < kv.mod_revision) {
+        updates.emplace_back(Node(kv.create_revision, kv.mod_revision,
+                                  kv.key, false, kv.value, {}, false));
+      }
+      new_known_keys[kv.key] = kv.mod_revision;
+      if (it != state->known_keys_.end()) {
+        state->known_keys_.erase(it);
+      }
+    }
+    for (const auto& key : state->known_keys_) {
+      updates.emplace_back(Node(-1, -1, key.first, false, "", {}, true));
+    }
+    state->known_keys_.swap(new_known_keys);
+  }
+
+  // The first one is always delivered, even if empty, so that the
+  // caller knows it has the whole contents.
+  if (first || !updates.empty()) {
+    QueueWatchUpdates(state, move(updates), function<void()>());
+  }
+  StartWatchFetch(state);
+}
+
+
+void EtcdV3Client::StartWatchFetch(WatchState* state) {
+  if (state->task_->CancelRequested()) {
+    state->task_->Return(Status::CANCELLED);
+    return;
+  }
+
+  JsonObject create;
+  AddKeyRange(state->key_, &create);
+  {
+    lock_guard<mutex> lock(state->lock_);
+    create.Add("start_revision", to_string(state->revision_ + 1));
+  }
+  JsonObject body;
+  body.Add("create_request", create);
+
+  const HostPortPair endpoint(GetEndpoint());
+  WatchFetch* const fetch(new WatchFetch);
+  fetch->req_.verb = UrlFetcher::Verb::POST;
+  fetch->req_.url = URL("http://" + endpoint.first + ":" +
+                        to_string(endpoint.second) + kWatchPath);
+  fetch->req_.headers.insert(make_pair("Content-Type", "application/json"));
+  fetch->req_.body = body.ToString();
+  fetch->resp_.on_body =
+      bind(&EtcdV3Client::WatchBody, this, state, fetch, _1, _2);
+  fetch->task_ = state->task_->AddChild(
+      bind(&EtcdV3Client::WatchFetchDone, this, state, fetch, _1));
+  fetcher()->Fetch(fetch->req_, &fetch->resp_, fetch->task_);
+}
+
+
+bool EtcdV3Client::WatchBody(WatchState* state, WatchFetch* fetch,
+                             evbuffer* data,
+                             const function<void()>& resume) {
+  evbuffer_add_buffer(fetch->buffer_.get(), data);
+  if (!fetch->status_.ok()) {
+    // Stopping already, drop the rest.
+    evbuffer_drain(fetch->buffer_.get(),
+                   evbuffer_get_length(fetch->buffer_.get()));
+    return true;
+  }
+
+  vector<Node> updates;
+  while (fetch->status_.ok()) {
+    const JsonObject message(fetch->buffer_.get());
+    if (!message.Ok()) {
+      // Wait for the rest of it.
+      break;
+    }
+
+    const JsonObject result(message, "result");
+    if (fetch->resp_.status_code != 200 || !result.Ok()) {
+      fetch->status_ = fetch->resp_.status_code != 200
+                           ? Status(util::error::UNKNOWN,
+                                    "Etcd watch failed: " +
+                                        message.DebugString())
+                           : StatusFromStreamError(message);
+      break;
+    }
+
+    const JsonBoolean canceled(result, "canceled");
+    if (canceled.Ok() && canceled.Value()) {
+      fetch->compacted_ = GetInt64(result, "compact_revision") > 0;
+      fetch->status_ =
+          Status(util::error::ABORTED,
+                 "Etcd watch cancelled: " + message.DebugString());
+      break;
+    }
+
+    const JsonArray events(result, "events");
+    if (!events.Ok()) {
+      // Such as the one confirming that the watch was created.
+      continue;
+    }
+    lock_guard<mutex> lock(state->lock_);
+    for (int i = 0; i < events.Length(); ++i) {
+      const JsonObject event(events, i);
+      const JsonObject json_kv(event, "kv");
+      if (!json_kv.Ok()) {
+        continue;
+      }
+      const KeyValue kv(ParseKeyValue(json_kv));
+      state->revision_ = max(state->revision_, kv.mod_revision);
+      if (!InKeyRange(state->key_, kv.key)) {
+        continue;
+      }
+      // Puts have the default type, which is left out.
+      const JsonString type(event, "type");
+      if (type.Ok() && string(type.Value()) == "DELETE") {
+        updates.emplace_back(Node(kv.create_revision, kv.mod_revision,
+                                  kv.key, false, "", {}, true));
+        state->known_keys_.erase(kv.key);
+      } else {
+        updates.emplace_back(Node(kv.create_revision, kv.mod_revision,
+                                  kv.key, false, kv.value, {}, false));
+        state->known_keys_[kv.key] = kv.mod_revision;
+      }
+    }
+  }
+
+  // Once the fetch task is cancelled, |fetch| can go away at any time.
+  Task* const stop(!fetch->status_.ok() ? fetch->task_ : nullptr);
+  bool keep_reading(true);
+  if (!updates.empty()) {
+    // Stop reading until they are delivered, so that they do not
+    // pile up.
+    QueueWatchUpdates(state, move(updates), resume);
+    keep_reading = false;
+  }
+  if (stop) {
+    stop->Cancel();
+  }
+  return keep_reading;
+}
+
+
+void EtcdV3Client::WatchFetchDone(WatchState* state, WatchFetch* fetch,
+                                  Task* task) {
+  unique_ptr<WatchFetch> fetch_deleter(fetch);
+  if (state->task_->CancelRequested()) {
+    state->task_->Return(Status::CANCELLED);
+    return;
+  }
+
+  if (fetch->compacted_) {
+    VLOG(1) << "Watch of " << state->key_ << " fell behind compaction";
+    StartWatchSnapshot(state);
+    return;
+  }
+
+  Status status(!fetch->status_.ok() ? fetch->status_ : task->status());
+  if (status.ok() && fetch->resp_.status_code != 200) {
+    status = Status(util::error::UNKNOWN,
+                    "Etcd watch failed with HTTP status " +
+                        to_string(fetch->resp_.status_code));
+  }
+  // The stream ending or timing out only means that it was idle, but
+  // other errors get a delay, to avoid hammering an etcd that is
+  // having problems.
+  if (status.ok() ||
+      status.CanonicalCode() == util::error::DEADLINE_EXCEEDED) {
+    StartWatchFetch(state);
+    return;
+  }
+
+  LOG(WARNING) << "Watch of " << state->key_ << " failed: " << status
+               << ", will retry in "
+               << FLAGS_etcd_watch_error_retry_delay_seconds << " second(s)";
+  if (status.CanonicalCode() == util::error::UNAVAILABLE) {
+    ChooseNextServer();
+  }
+  state->task_->executor()->Delay(
+      seconds(FLAGS_etcd_watch_error_retry_delay_seconds),
+      state->task_->AddChild(
+          [this, state](Task*) { StartWatchFetch(state); }));
+}
+
+
+void EtcdV3Client::QueueWatchUpdates(WatchState* state,
+                                     vector<Node>&& updates,
+                                     const function<void()>& resume) {
+  {
+    lock_guard<mutex> lock(state->lock_);
+    state->pending_updates_.emplace_back(move(updates));
+    if (resume) {
+      state->resumes_.push_back(resume);
+    }
+    if (state->delivering_) {
+      return;
+    }
+    state->delivering_ = true;
+  }
+
+  // Only one at a time, so that they are delivered in order.
+  state->task_->AddChild(
+                  bind(&EtcdV3Client::DeliverWatchUpdates, this, state, _1))
+      ->Return();
+}
+
+
+// This method is called on the executor of state->task_.
+void EtcdV3Client::DeliverWatchUpdates(WatchState* state, Task* task) {
+  unique_lock<mutex> lock(state->lock_);
+  while (!state->pending_updates_.empty()) {
+    const vector<Node> updates(move(state->pending_updates_.front()));
+    state->pending_updates_.pop_front();
+    lock.unlock();
+    if (task->status().ok() && !state->task_->CancelRequested()) {
+      state->cb_(updates);
+    }
+    lock.lock();
+  }
+  state->delivering_ = false;
+  vector<function<void()>> resumes;
+  resumes.swap(state->resumes_);
+  lock.unlock();
+
+  for (const auto& resume : resumes) {
+    resume();
+  }
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,133 @@
+#ifndef CERT_TRANS_UTIL_ETCD_V3_H_
+#define CERT_TRANS_UTIL_ETCD_V3_H_
+
+#include <stdint.h>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <string>
+#include <vector>
+
+#include "base/macros.h"
+#include "util/etcd.h"
+
+namespace cert_trans {
+
+
+// An EtcdClient speaking the etcd v3 API, through the JSON gateway
+// etcd serves next to gRPC, so the same UrlFetcher can be used.
+//
+// The v3 key space is flat, so the directories of the v2 API are
+// emulated with key prefixes: getting "/a" also returns all the keys
+// under "/a/", as a directory node, and watching it reports those
+// keys too. The indices are the v3 revisions, and TTLs are leases.
+class EtcdV3Client : public EtcdClient {
+ public:
+  EtcdV3Client(util::Executor* executor, UrlFetcher* fetcher,
+               const std::list<HostPortPair>& etcds);
+
+  ~EtcdV3Client() override;
+
+  // Waiting for a change (with |req.wait_index|) is not supported,
+  // use Watch() instead.
+  void Get(const Request& req, GetResponse* resp, util::Task* task) override;
+
+  void Create(const std::string& key, const std::string& value,
+              Response* resp, util::Task* task) override;
+
+  void CreateWithTTL(const std::string& key, const std::string& value,
+                     const std::chrono::seconds& ttl, Response* resp,
+                     util::Task* task) override;
+
+  void Update(const std::string& key, const std::string& value,
+              const int64_t previous_index, Response* resp,
+              util::Task* task) override;
+
+  void UpdateWithTTL(const std::string& key, const std::string& value,
+                     const std::chrono::seconds& ttl,
+                     const int64_t previous_index, Response* resp,
+                     util::Task* task) override;
+
+  void ForceSet(const std::string& key, const std::string& value,
+                Response* resp, util::Task* task) override;
+
+  void ForceSetWithTTL(const std::string& key, const std::string& value,
+                       const std::chrono::seconds& ttl, Response* resp,
+                       util::Task* task) override;
+
+  // Keeps the lease of |key| alive, which resets it to the TTL it was
+  // granted with, rather than to |ttl|. The index in |resp| is the
+  // one of |key|, which does not change.
+  void RefreshTTL(const std::string& key, const std::chrono::seconds& ttl,
+                  Response* resp, util::Task* task) override;
+
+  void Delete(const std::string& key, const int64_t current_index,
+              util::Task* task) override;
+
+  void ForceDelete(const std::string& key, util::Task* task) override;
+
+  // Applies the ops in transactions of at most --etcd_v3_max_txn_ops
+  // ops each (etcd rejects larger ones), which are only atomic if
+  // there is a single one.
+  void Txn(const std::vector<TxnOp>& ops, TxnResponse* resp,
+           util::Task* task) override;
+
+  // There are no store statistics in the v3 API, this only reports
+  // the number of keys, as "keys".
+  void GetStoreStats(StatsResponse* resp, util::Task* task) override;
+
+  void Watch(const std::string& key, const WatchCallback& cb,
+             util::Task* task) override;
+
+ private:
+  struct WatchState;
+  struct WatchFetch;
+
+  // Sends |op|, attaching its key to a new lease of |ttl|, unless it
+  // is zero. The lease the key was attached to before is then revoked,
+  // rather than left to expire, so that each key holds at most one.
+  // Writes without a TTL do not ask for the previous key (whose value
+  // can be large), and leave its lease to expire.
+  void Write(const TxnOp& op, const std::chrono::seconds& ttl,
+             Response* resp, util::Task* task);
+  // Like Write(), without any condition.
+  void Put(const std::string& key, const std::string& value,
+           const std::chrono::seconds& ttl, Response* resp,
+           util::Task* task);
+  // Sends a single transaction of |ops|, attaching the keys written
+  // to |lease|, unless it is zero. If |previous_leases| is set and the
+  // transaction is applied, it gets the lease each key was attached to
+  // before (zero for none, and for deletes).
+  void SendTxn(const std::vector<TxnOp>& ops, int64_t lease,
+               std::vector<int64_t>* previous_leases, TxnResponse* resp,
+               util::Task* task);
+  void GrantLease(const std::chrono::seconds& ttl, int64_t* lease,
+                  util::Task* task);
+  // Revokes |previous_lease|, unless it is zero or |lease|. This never
+  // fails, an unrevoked lease just lives until it expires.
+  void RevokePreviousLease(int64_t previous_lease, int64_t lease,
+                           util::Task* task);
+
+  void StartWatchSnapshot(WatchState* state);
+  void WatchSnapshotDone(WatchState* state, GenericResponse* gen_resp,
+                         util::Task* task);
+  void StartWatchFetch(WatchState* state);
+  // Called on the event thread of the fetcher.
+  bool WatchBody(WatchState* state, WatchFetch* fetch, evbuffer* data,
+                 const std::function<void()>& resume);
+  void WatchFetchDone(WatchState* state, WatchFetch* fetch,
+                      util::Task* task);
+  // Sends |updates| to the callback of the watch, after the ones
+  // queued before. If |resume| is set, it is called once they have
+  // all been delivered.
+  void QueueWatchUpdates(WatchState* state, std::vector<Node>&& updates,
+                         const std::function<void()>& resume);
+  void DeliverWatchUpdates(WatchState* state, util::Task* task);
+
+  DISALLOW_COPY_AND_ASSIGN(EtcdV3Client);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_UTIL_ETCD_V3_H_
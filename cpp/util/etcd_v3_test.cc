@@ -0,0 +1,662 @@
+#include "util/etcd_v3.h"
+
+#include <event2/buffer.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "net/mock_url_fetcher.h"
+#include "util/json_wrapper.h"
+#include "util/libevent_wrapper.h"
+#include "util/status_test_util.h"
+#include "util/sync_task.h"
+#include "util/testing.h"
+#include "util/util.h"
+
+namespace cert_trans {
+
+using std::bind;
+using std::chrono::seconds;
+using std::make_shared;
+using std::placeholders::_1;
+using std::placeholders::_2;
+using std::placeholders::_3;
+using std::shared_ptr;
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+using testing::InSequence;
+using testing::Invoke;
+using testing::IsEmpty;
+using testing::_;
+using util::Status;
+using util::SyncTask;
+using util::Task;
+using util::ToBase64;
+using util::testing::StatusIs;
+
+namespace {
+
+const char kEtcdHost[] = "etcd.example.net";
+const int kEtcdPort = 4242;
+
+const char kKey[] = "/some/key";
+const char kDir[] = "/some";
+
+
+string Join(const vector<string>& parts) {
+  string joined;
+  for (const string& part : parts) {
+    joined += (joined.empty() ? "" : ", ") + part;
+  }
+  return joined;
+}
+
+
+string Quoted(const string& str) {
+  return "\"" + str + "\"";
+}
+
+
+string Base64(const string& str) {
+  return Quoted(ToBase64(str));
+}
+
+
+string KeyRangeJson(const string& key) {
+  return "\"key\": " + Base64(key) + ", \"range_end\": " + Base64(key + "0");
+}
+
+
+string KeyValueJson(const string& key, const string& value,
+                    int64_t create_revision, int64_t mod_revision) {
+  return "{\"key\": " + Base64(key) + ", \"create_revision\": " +
+         Quoted(to_string(create_revision)) + ", \"mod_revision\": " +
+         Quoted(to_string(mod_revision)) + ", \"value\": " + Base64(value) +
+         "}";
+}
+
+
+string HeaderJson(int64_t revision) {
+  return "\"header\": {\"revision\": " + Quoted(to_string(revision)) + "}";
+}
+
+
+string RangeResponseJson(int64_t revision, const vector<string>& kvs) {
+  string json("{" + HeaderJson(revision));
+  if (!kvs.empty()) {
+    json += ", \"kvs\": [" + Join(kvs) + "]";
+  }
+  return json + "}";
+}
+
+
+string WatchEventJson(const string& kv, bool deleted) {
+  return string("{") + (deleted ? "\"type\": \"DELETE\", " : "") +
+         "\"kv\": " + kv + "}";
+}
+
+
+string WatchResponseJson(int64_t revision, const vector<string>& events) {
+  return "{\"result\": {" + HeaderJson(revision) + ", \"events\": [" +
+         Join(events) + "]}}\n";
+}
+
+
+// Compares the JSON bodies once both are parsed, so only the spacing
+// can differ, the fields must be in the same order.
+MATCHER_P2(IsJsonPost, path, json, "") {
+  if (arg.verb != UrlFetcher::Verb::POST || arg.url.Host() != kEtcdHost ||
+      arg.url.Port() != kEtcdPort || arg.url.Path() != path) {
+    return false;
+  }
+  const JsonObject expected((string(json)));
+  CHECK(expected.Ok()) << json;
+  const JsonObject actual(arg.body);
+  if (!actual.Ok() || string(actual.ToString()) != expected.ToString()) {
+    *result_listener << "body: " << arg.body;
+    return false;
+  }
+  return true;
+}
+
+
+void HandleFetch(int status_code, const string& body,
+                 const UrlFetcher::Request& req, UrlFetcher::Response* resp,
+                 Task* task) {
+  resp->status_code = status_code;
+  resp->body = body;
+  task->Return();
+}
+
+
+// Sends |body| to the streaming callback, in two parts, to split a
+// message. The fetch is then done if |end| is set, otherwise it goes
+// on until cancelled.
+void HandleStream(const string& body, bool end,
+                  const UrlFetcher::Request& req, UrlFetcher::Response* resp,
+                  Task* task) {
+  resp->status_code = 200;
+  task->WhenCancelled([task]() { task->Return(Status::CANCELLED); });
+  const unique_ptr<evbuffer, void (*)(evbuffer*)> buffer(evbuffer_new(),
+                                                         evbuffer_free);
+  const size_t half(body.size() / 2);
+  evbuffer_add(buffer.get(), body.data(), half);
+  resp->on_body(buffer.get(), []() {});
+  evbuffer_add(buffer.get(), body.data() + half, body.size() - half);
+  resp->on_body(buffer.get(), []() {});
+  if (end) {
+    task->Return();
+  }
+}
+
+
+class EtcdV3Test : public ::testing::Test {
+ public:
+  EtcdV3Test()
+      : base_(make_shared<libevent::Base>()),
+        pump_(base_),
+        client_(base_.get(), &url_fetcher_,
+                {EtcdClient::HostPortPair(kEtcdHost, kEtcdPort)}) {
+    EXPECT_CALL(url_fetcher_,
+                Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
+                                        URL("http://" + string(kEtcdHost) +
+                                            ":" + to_string(kEtcdPort) +
+                                            "/version"),
+                                        IsEmpty(), ""),
+                      _, _))
+        .WillRepeatedly(
+            Invoke(bind(HandleFetch, 200, "{}", _1, _2, _3)));
+  }
+
+ protected:
+  void ExpectPost(const string& path, const string& request,
+                  int status_code, const string& response) {
+    EXPECT_CALL(url_fetcher_, Fetch(IsJsonPost(path, request), _, _))
+        .WillOnce(
+            Invoke(bind(HandleFetch, status_code, response, _1, _2, _3)));
+  }
+
+  const shared_ptr<libevent::Base> base_;
+  MockUrlFetcher url_fetcher_;
+  libevent::EventPumpThread pump_;
+  EtcdV3Client client_;
+};
+
+
+TEST_F(EtcdV3Test, Get) {
+  ExpectPost("/v3/kv/range", "{" + KeyRangeJson(kKey) + "}", 200,
+             RangeResponseJson(11, {KeyValueJson(kKey, "123", 6, 9)}));
+
+  SyncTask task(base_.get());
+  EtcdClient::GetResponse resp;
+  client_.Get(string(kKey), &resp, task.task());
+  task.Wait();
+  ASSERT_OK(task);
+  EXPECT_EQ(11, resp.etcd_index);
+  EXPECT_FALSE(resp.node.is_dir_);
+  EXPECT_EQ(kKey, resp.node.key_);
+  EXPECT_EQ(6, resp.node.created_index_);
+  EXPECT_EQ(9, resp.node.modified_index_);
+  EXPECT_EQ("123", resp.node.value_);
+}
+
+
+TEST_F(EtcdV3Test, GetNotFound) {
+  ExpectPost("/v3/kv/range", "{" + KeyRangeJson(kKey) + "}", 200,
+             RangeResponseJson(11, {}));
+
+  SyncTask task(base_.get());
+  EtcdClient::GetResponse resp;
+  client_.Get(string(kKey), &resp, task.task());
+  task.Wait();
+  EXPECT_THAT(task.status(), StatusIs(util::error::NOT_FOUND));
+}
+
+
+TEST_F(EtcdV3Test, GetDirectory) {
+  const string response(RangeResponseJson(
+      20, {KeyValueJson("/some-other", "x", 1, 1),
+           KeyValueJson("/some/key1", "123", 6, 9),
+           KeyValueJson("/some/sub/key2", "456", 4, 12),
+           KeyValueJson("/some/sub/key3", "789", 8, 8)}));
+  {
+    InSequence s;
+    ExpectPost("/v3/kv/range", "{" + KeyRangeJson(kDir) + "}", 200, response);
+    ExpectPost("/v3/kv/range", "{" + KeyRangeJson(kDir) + "}", 200, response);
+  }
+
+  SyncTask task(base_.get());
+  EtcdClient::GetResponse resp;
+  client_.Get(string(kDir), &resp, task.task());
+  task.Wait();
+  ASSERT_OK(task);
+  EXPECT_TRUE(resp.node.is_dir_);
+  EXPECT_EQ(kDir, resp.node.key_);
+  EXPECT_EQ(4, resp.node.created_index_);
+  EXPECT_EQ(12, resp.node.modified_index_);
+  ASSERT_EQ(2U, resp.node.nodes_.size());
+  EXPECT_EQ("/some/key1", resp.node.nodes_[0].key_);
+  EXPECT_EQ("123", resp.node.nodes_[0].value_);
+  EXPECT_EQ("/some/sub", resp.node.nodes_[1].key_);
+  EXPECT_TRUE(resp.node.nodes_[1].is_dir_);
+  EXPECT_TRUE(resp.node.nodes_[1].nodes_.empty());
+
+  SyncTask recursive_task(base_.get());
+  EtcdClient::Request req(kDir);
+  req.recursive = true;
+  client_.Get(req, &resp, recursive_task.task());
+  recursive_task.Wait();
+  ASSERT_OK(recursive_task);
+  ASSERT_EQ(2U, resp.node.nodes_.size());
+  ASSERT_EQ(2U, resp.node.nodes_[1].nodes_.size());
+  EXPECT_EQ("/some/sub/key2", resp.node.nodes_[1].nodes_[0].key_);
+  EXPECT_EQ("/some/sub/key3", resp.node.nodes_[1].nodes_[1].key_);
+  EXPECT_EQ("789", resp.node.nodes_[1].nodes_[1].value_);
+}
+
+
+TEST_F(EtcdV3Test, Create) {
+  ExpectPost("/v3/kv/txn",
+             "{\"compare\": [{\"key\": " + Base64(kKey) +
+                 ", \"result\": \"EQUAL\", \"target\": \"CREATE\", "
+                 "\"create_revision\": \"0\"}], "
+                 "\"success\": [{\"request_put\": {\"key\": " +
+                 Base64(kKey) + ", \"value\": " + Base64("123") +
+                 "}}], "
+                 "\"failure\": [{\"request_range\": {\"key\": " +
+                 Base64(kKey) + "}}]}",
+             200, "{" + HeaderJson(7) + ", \"succeeded\": true}");
+
+  SyncTask task(base_.get());
+  EtcdClient::Response resp;
+  client_.Create(kKey, "123", &resp, task.task());
+  task.Wait();
+  EXPECT_OK(task);
+  EXPECT_EQ(7, resp.etcd_index);
+}
+
+
+TEST_F(EtcdV3Test, CreateFailsIfKeyExists) {
+  EXPECT_CALL(url_fetcher_, Fetch(IsUrlFetchRequest(UrlFetcher::Verb::POST,
+                                                    _, _, _),
+                                  _, _))
+      .WillOnce(Invoke(bind(
+          HandleFetch, 200,
+          "{" + HeaderJson(8) + ", \"responses\": [{\"response_range\": " +
+              RangeResponseJson(8, {KeyValueJson(kKey, "old", 3, 5)}) +
+              "}]}",
+          _1, _2, _3)));
+
+  SyncTask task(base_.get());
+  EtcdClient::Response resp;
+  client_.Create(kKey, "123", &resp, task.task());
+  task.Wait();
+  EXPECT_THAT(task.status(), StatusIs(util::error::FAILED_PRECONDITION));
+}
+
+
+TEST_F(EtcdV3Test, UpdateFailsIfKeyIsMissing) {
+  EXPECT_CALL(url_fetcher_, Fetch(IsUrlFetchRequest(UrlFetcher::Verb::POST,
+                                                    _, _, _),
+                                  _, _))
+      .WillOnce(Invoke(
+          bind(HandleFetch, 200,
+               "{" + HeaderJson(8) + ", \"responses\": [{\"response_range\": " +
+                   RangeResponseJson(8, {}) + "}]}",
+               _1, _2, _3)));
+
+  SyncTask task(base_.get());
+  EtcdClient::Response resp;
+  client_.Update(kKey, "123", 5, &resp, task.task());
+  task.Wait();
+  EXPECT_THAT(task.status(), StatusIs(util::error::NOT_FOUND));
+}
+
+
+TEST_F(EtcdV3Test, UpdateFailsIfKeyChanged) {
+  EXPECT_CALL(url_fetcher_, Fetch(IsUrlFetchRequest(UrlFetcher::Verb::POST,
+                                                    _, _, _),
+                                  _, _))
+      .WillOnce(Invoke(bind(
+          HandleFetch, 200,
+          "{" + HeaderJson(8) + ", \"responses\": [{\"response_range\": " +
+              RangeResponseJson(8, {KeyValueJson(kKey, "new", 3, 6)}) +
+              "}]}",
+          _1, _2, _3)));
+
+  SyncTask task(base_.get());
+  EtcdClient::Response resp;
+  client_.Update(kKey, "123", 5, &resp, task.task());
+  task.Wait();
+  EXPECT_THAT(task.status(), StatusIs(util::error::FAILED_PRECONDITION));
+}
+
+
+TEST_F(EtcdV3Test, CreateWithTTLUsesLease) {
+  {
+    InSequence s;
+    ExpectPost("/v3/lease/grant", "{\"TTL\": \"30\"}", 200,
+               "{" + HeaderJson(6) + ", \"ID\": \"1234\", \"TTL\": \"30\"}");
+    ExpectPost("/v3/kv/txn",
+               "{\"compare\": [{\"key\": " + Base64(kKey) +
+                   ", \"result\": \"EQUAL\", \"target\": \"CREATE\", "
+                   "\"create_revision\": \"0\"}], "
+                   "\"success\": [{\"request_put\": {\"key\": " +
+                   Base64(kKey) + ", \"value\": " + Base64("123") +
+                   ", \"lease\": \"1234\", \"prev_kv\": true}}], "
+                   "\"failure\": [{\"request_range\": {\"key\": " +
+                   Base64(kKey) + "}}]}",
+               200, "{" + HeaderJson(7) +
+                        ", \"succeeded\": true, \"responses\": "
+                        "[{\"response_put\": {" +
+                        HeaderJson(7) + "}}]}");
+  }
+
+  SyncTask task(base_.get());
+  EtcdClient::Response resp;
+  client_.CreateWithTTL(kKey, "123", seconds(30), &resp, task.task());
+  task.Wait();
+  EXPECT_OK(task);
+  EXPECT_EQ(7, resp.etcd_index);
+}
+
+
+TEST_F(EtcdV3Test, UpdateWithTTLRevokesPreviousLease) {
+  {
+    InSequence s;
+    ExpectPost("/v3/lease/grant", "{\"TTL\": \"30\"}", 200,
+               "{" + HeaderJson(6) + ", \"ID\": \"1235\", \"TTL\": \"30\"}");
+    ExpectPost("/v3/kv/txn",
+               "{\"compare\": [{\"key\": " + Base64(kKey) +
+                   ", \"result\": \"EQUAL\", \"target\": \"MOD\", "
+                   "\"mod_revision\": \"5\"}], "
+                   "\"success\": [{\"request_put\": {\"key\": " +
+                   Base64(kKey) + ", \"value\": " + Base64("123") +
+                   ", \"lease\": \"1235\", \"prev_kv\": true}}], "
+                   "\"failure\": [{\"request_range\": {\"key\": " +
+                   Base64(kKey) + "}}]}",
+               200, "{" + HeaderJson(7) +
+                        ", \"succeeded\": true, \"responses\": "
+                        "[{\"response_put\": {" +
+                        HeaderJson(7) + ", \"prev_kv\": {\"key\": " +
+                        Base64(kKey) + ", \"mod_revision\": \"5\", "
+                                       "\"lease\": \"1234\"}}}]}");
+    ExpectPost("/v3/lease/revoke", "{\"ID\": \"1234\"}", 200,
+               "{" + HeaderJson(7) + "}");
+  }
+
+  SyncTask task(base_.get());
+  EtcdClient::Response resp;
+  client_.UpdateWithTTL(kKey, "123", seconds(30), 5, &resp, task.task());
+  task.Wait();
+  EXPECT_OK(task);
+  EXPECT_EQ(7, resp.etcd_index);
+}
+
+
+TEST_F(EtcdV3Test, ForceSetWithTTLRevokesPreviousLease) {
+  {
+    InSequence s;
+    ExpectPost("/v3/lease/grant", "{\"TTL\": \"30\"}", 200,
+               "{" + HeaderJson(6) + ", \"ID\": \"1235\", \"TTL\": \"30\"}");
+    ExpectPost("/v3/kv/put", "{\"key\": " + Base64(kKey) + ", \"value\": " +
+                                 Base64("123") +
+                                 ", \"lease\": \"1235\", \"prev_kv\": true}",
+               200, "{" + HeaderJson(7) + ", \"prev_kv\": {\"key\": " +
+                        Base64(kKey) + ", \"lease\": \"1234\"}}");
+    // The previous lease expired in the meantime, which does not fail
+    // the write.
+    ExpectPost("/v3/lease/revoke", "{\"ID\": \"1234\"}", 404,
+               "{\"error\": \"etcdserver: requested lease not found\", "
+               "\"code\": 5, "
+               "\"message\": \"etcdserver: requested lease not found\"}");
+  }
+
+  SyncTask task(base_.get());
+  EtcdClient::Response resp;
+  client_.ForceSetWithTTL(kKey, "123", seconds(30), &resp, task.task());
+  task.Wait();
+  EXPECT_OK(task);
+  EXPECT_EQ(7, resp.etcd_index);
+}
+
+
+TEST_F(EtcdV3Test, RefreshTTLKeepsLeaseAlive) {
+  {
+    InSequence s;
+    ExpectPost("/v3/kv/range", "{\"key\": " + Base64(kKey) + "}", 200,
+               "{" + HeaderJson(9) + ", \"kvs\": [{\"key\": " +
+                   Base64(kKey) + ", \"mod_revision\": \"7\", "
+                                  "\"lease\": \"1234\"}]}");
+    ExpectPost("/v3/lease/keepalive", "{\"ID\": \"1234\"}", 200,
+               "{\"result\": {" + HeaderJson(9) +
+                   ", \"ID\": \"1234\", \"TTL\": \"30\"}}\n");
+  }
+
+  SyncTask task(base_.get());
+  EtcdClient::Response resp;
+  client_.RefreshTTL(kKey, seconds(30), &resp, task.task());
+  task.Wait();
+  EXPECT_OK(task);
+  EXPECT_EQ(7, resp.etcd_index);
+}
+
+
+TEST_F(EtcdV3Test, TxnIsSentAtOnce) {
+  ExpectPost("/v3/kv/txn",
+             "{\"compare\": ["
+             "{\"key\": " +
+                 Base64("/a") +
+                 ", \"result\": \"EQUAL\", \"target\": \"CREATE\", "
+                 "\"create_revision\": \"0\"}, "
+                 "{\"key\": " +
+                 Base64("/b") +
+                 ", \"result\": \"EQUAL\", \"target\": \"MOD\", "
+                 "\"mod_revision\": \"3\"}, "
+                 "{\"key\": " +
+                 Base64("/c") +
+                 ", \"result\": \"EQUAL\", \"target\": \"MOD\", "
+                 "\"mod_revision\": \"4\"}], "
+                 "\"success\": ["
+                 "{\"request_put\": {\"key\": " +
+                 Base64("/a") + ", \"value\": " + Base64("1") +
+                 "}}, "
+                 "{\"request_put\": {\"key\": " +
+                 Base64("/b") + ", \"value\": " + Base64("2") +
+                 "}}, "
+                 "{\"request_delete_range\": {\"key\": " +
+                 Base64("/c") +
+                 "}}], "
+                 "\"failure\": ["
+                 "{\"request_range\": {\"key\": " +
+                 Base64("/a") +
+                 "}}, "
+                 "{\"request_range\": {\"key\": " +
+                 Base64("/b") +
+                 "}}, "
+                 "{\"request_range\": {\"key\": " +
+                 Base64("/c") + "}}]}",
+             200, "{" + HeaderJson(10) + ", \"succeeded\": true}");
+
+  SyncTask task(base_.get());
+  EtcdClient::TxnResponse resp;
+  client_.Txn({EtcdClient::TxnOp(EtcdClient::TxnOp::Type::CREATE, "/a", "1",
+                                 -1),
+               EtcdClient::TxnOp(EtcdClient::TxnOp::Type::UPDATE, "/b", "2",
+                                 3),
+               EtcdClient::TxnOp(EtcdClient::TxnOp::Type::DELETE, "/c", "",
+                                 4)},
+              &resp, task.task());
+  task.Wait();
+  EXPECT_OK(task);
+  EXPECT_EQ(10, resp.etcd_index);
+  EXPECT_EQ(3U, resp.num_applied);
+  EXPECT_EQ((vector<int64_t>{10, 10, -1}), resp.indices);
+}
+
+
+TEST_F(EtcdV3Test, ErrorCodeFromGateway) {
+  ExpectPost("/v3/kv/range", "{" + KeyRangeJson(kKey) + "}", 403,
+             "{\"error\": \"etcdserver: permission denied\", \"code\": 7, "
+             "\"message\": \"etcdserver: permission denied\"}");
+
+  SyncTask task(base_.get());
+  EtcdClient::GetResponse resp;
+  client_.Get(string(kKey), &resp, task.task());
+  task.Wait();
+  EXPECT_THAT(task.status(), StatusIs(util::error::PERMISSION_DENIED));
+}
+
+
+TEST_F(EtcdV3Test, ForceDeleteMissingKey) {
+  ExpectPost("/v3/kv/deleterange", "{\"key\": " + Base64(kKey) + "}", 200,
+             "{" + HeaderJson(10) + "}");
+
+  SyncTask task(base_.get());
+  client_.ForceDelete(kKey, task.task());
+  task.Wait();
+  EXPECT_THAT(task.status(), StatusIs(util::error::NOT_FOUND));
+}
+
+
+TEST_F(EtcdV3Test, GetStoreStatsCountsKeys) {
+  ExpectPost("/v3/kv/range",
+             "{\"key\": \"AA==\", \"range_end\": \"AA==\", "
+             "\"count_only\": true}",
+             200, "{" + HeaderJson(10) + ", \"count\": \"42\"}");
+
+  SyncTask task(base_.get());
+  EtcdClient::StatsResponse resp;
+  client_.GetStoreStats(&resp, task.task());
+  task.Wait();
+  EXPECT_OK(task);
+  EXPECT_EQ(42, resp.stats["keys"]);
+}
+
+
+TEST_F(EtcdV3Test, Watch) {
+  {
+    InSequence s;
+    ExpectPost("/v3/kv/range", "{" + KeyRangeJson(kDir) + "}", 200,
+               RangeResponseJson(10, {KeyValueJson("/some/key1", "1", 5, 6)}));
+    EXPECT_CALL(url_fetcher_,
+                Fetch(IsJsonPost("/v3/watch",
+                                 "{\"create_request\": {" +
+                                     KeyRangeJson(kDir) +
+                                     ", \"start_revision\": \"11\"}}"),
+                      _, _))
+        .WillOnce(Invoke(bind(
+            HandleStream,
+            "{\"result\": {" + HeaderJson(10) + ", \"created\": true}}\n" +
+                WatchResponseJson(
+                    11, {WatchEventJson(KeyValueJson("/some/key2", "2", 11,
+                                                     11),
+                                        false),
+                         WatchEventJson(KeyValueJson("/some-other", "x", 11,
+                                                     11),
+                                        false)}) +
+                WatchResponseJson(
+                    12, {WatchEventJson("{\"key\": " + Base64("/some/key1") +
+                                            ", \"mod_revision\": \"12\"}",
+                                        true)}),
+            true, _1, _2, _3)));
+  }
+  // Carries on from where it was.
+  EXPECT_CALL(url_fetcher_,
+              Fetch(IsJsonPost("/v3/watch", "{\"create_request\": {" +
+                                                KeyRangeJson(kDir) +
+                                                ", \"start_revision\": "
+                                                "\"13\"}}"),
+                    _, _))
+      .WillRepeatedly(Invoke(bind(HandleStream, "", false, _1, _2, _3)));
+
+  SyncTask task(base_.get());
+  // The events may be delivered together, or not.
+  vector<EtcdClient::Node> updates;
+  client_.Watch(kDir,
+                [&task, &updates](const vector<EtcdClient::Node>& nodes) {
+                  updates.insert(updates.end(), nodes.begin(), nodes.end());
+                  if (updates.size() == 3) {
+                    task.Cancel();
+                  }
+                },
+                task.task());
+  task.Wait();
+
+  ASSERT_EQ(3U, updates.size());
+  EXPECT_EQ("/some/key1", updates[0].key_);
+  EXPECT_EQ("1", updates[0].value_);
+  EXPECT_EQ("/some/key2", updates[1].key_);
+  EXPECT_EQ("2", updates[1].value_);
+  EXPECT_FALSE(updates[1].deleted_);
+  EXPECT_EQ("/some/key1", updates[2].key_);
+  EXPECT_EQ(12, updates[2].modified_index_);
+  EXPECT_TRUE(updates[2].deleted_);
+}
+
+
+TEST_F(EtcdV3Test, WatchGetsEverythingAgainAfterCompaction) {
+  {
+    InSequence s;
+    ExpectPost("/v3/kv/range", "{" + KeyRangeJson(kDir) + "}", 200,
+               RangeResponseJson(10, {KeyValueJson("/some/key1", "1", 5, 6),
+                                      KeyValueJson("/some/key2", "2", 7, 7)}));
+    EXPECT_CALL(url_fetcher_,
+                Fetch(IsJsonPost("/v3/watch",
+                                 "{\"create_request\": {" +
+                                     KeyRangeJson(kDir) +
+                                     ", \"start_revision\": \"11\"}}"),
+                      _, _))
+        .WillOnce(Invoke(bind(HandleStream,
+                              "{\"result\": {" + HeaderJson(30) +
+                                  ", \"canceled\": true, "
+                                  "\"compact_revision\": \"20\"}}\n",
+                              false, _1, _2, _3)));
+    ExpectPost("/v3/kv/range", "{" + KeyRangeJson(kDir) + "}", 200,
+               RangeResponseJson(30, {KeyValueJson("/some/key2", "2", 7, 7),
+                                      KeyValueJson("/some/key3", "3", 25,
+                                                   25)}));
+  }
+  EXPECT_CALL(url_fetcher_,
+              Fetch(IsJsonPost("/v3/watch", "{\"create_request\": {" +
+                                                KeyRangeJson(kDir) +
+                                                ", \"start_revision\": "
+                                                "\"31\"}}"),
+                    _, _))
+      .WillRepeatedly(Invoke(bind(HandleStream, "", false, _1, _2, _3)));
+
+  SyncTask task(base_.get());
+  vector<vector<EtcdClient::Node>> updates;
+  client_.Watch(kDir,
+                [&task, &updates](const vector<EtcdClient::Node>& nodes) {
+                  updates.push_back(nodes);
+                  if (updates.size() == 2) {
+                    task.Cancel();
+                  }
+                },
+                task.task());
+  task.Wait();
+
+  ASSERT_EQ(2U, updates.size());
+  EXPECT_EQ(2U, updates[0].size());
+  // Only what changed, with the key gone reported as deleted.
+  ASSERT_EQ(2U, updates[1].size());
+  EXPECT_EQ("/some/key3", updates[1][0].key_);
+  EXPECT_FALSE(updates[1][0].deleted_);
+  EXPECT_EQ("/some/key1", updates[1][1].key_);
+  EXPECT_TRUE(updates[1][1].deleted_);
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -459,6 +459,28 @@ void FakeEtcdClient::ForceSetWithTTL(const std::string& key,
 }
 
 
+void FakeEtcdClient::RefreshTTL(const string& rawkey, const seconds& ttl,
+                                Response* resp, Task* task) {
+  task->CleanupWhenDone(
+      bind(&FakeEtcdClient::UpdateOperationStats, this, "sets", task));
+  const string key(NormalizeKey(rawkey));
+  *resp = EtcdClient::Response();
+  unique_lock<mutex> lock(mutex_);
+  PurgeExpiredEntriesWithLock(lock);
+  const map<string, Node>::iterator entry(entries_.find(key));
+  if (entry == entries_.end()) {
+    task->Return(Status(util::error::NOT_FOUND, "node doesn't exist: " + key));
+    return;
+  }
+  // Unlike a set, this does not notify the watchers.
+  entry->second.expires_ = system_clock::now() + ttl;
+  resp->etcd_index = entry->second.modified_index_;
+  task->Return();
+  base_->Delay(ttl, parent_task_.task()->AddChild(
+                        bind(&FakeEtcdClient::PurgeExpiredEntries, this)));
+}
+
+
 void FakeEtcdClient::Delete(const string& key, const int64_t current_index,
                             Task* task) {
   CHECK_GT(current_index, 0);
@@ -47,6 +47,9 @@ class FakeEtcdClient : public EtcdClient {
                        const std::chrono::seconds& ttl, Response* resp,
                        util::Task* task) override;
 
+  void RefreshTTL(const std::string& key, const std::chrono::seconds& ttl,
+                  Response* resp, util::Task* task) override;
+
   void Delete(const std::string& key, const int64_t current_index,
               util::Task* task) override;
 
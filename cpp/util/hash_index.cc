@@ -0,0 +1,155 @@
+#include "util/hash_index.h"
+
+#include <glog/logging.h>
+#include <string.h>
+
+using std::string;
+using std::vector;
+
+namespace cert_trans {
+
+namespace {
+
+
+const size_t kMinCapacity = 16;
+
+
+// Maximum load factor, as a fraction of kLoadDenominator.
+const size_t kMaxLoad = 7;
+const size_t kLoadDenominator = 10;
+
+
+}  // namespace
+
+
+const size_t HashIndex::kKeySize;
+
+
+HashIndex::HashIndex() : size_(0) {
+}
+
+
+void HashIndex::Reserve(size_t count) {
+  size_t capacity(slots_.empty() ? kMinCapacity : slots_.size());
+  while (count * kLoadDenominator > capacity * kMaxLoad) {
+    capacity *= 2;
+  }
+  if (capacity > slots_.size()) {
+    Rehash(capacity);
+  }
+}
+
+
+bool HashIndex::Find(const string& key, int64_t* value) const {
+  if (key.size() != kKeySize || slots_.empty()) {
+    return false;
+  }
+
+  const Slot& slot(slots_[Probe(key.data())]);
+  if (slot.value < 0) {
+    return false;
+  }
+  if (value) {
+    *value = slot.value;
+  }
+  return true;
+}
+
+
+bool HashIndex::Insert(const string& key, int64_t value) {
+  CHECK_EQ(kKeySize, key.size());
+  CHECK_GE(value, 0);
+  Reserve(size_ + 1);
+
+  Slot* const slot(&slots_[Probe(key.data())]);
+  if (slot->value >= 0) {
+    return false;
+  }
+  memcpy(slot->key, key.data(), kKeySize);
+  slot->value = value;
+  ++size_;
+  return true;
+}
+
+
+void HashIndex::Set(const string& key, int64_t value) {
+  CHECK_EQ(kKeySize, key.size());
+  CHECK_GE(value, 0);
+  Reserve(size_ + 1);
+
+  Slot* const slot(&slots_[Probe(key.data())]);
+  if (slot->value < 0) {
+    memcpy(slot->key, key.data(), kKeySize);
+    ++size_;
+  }
+  slot->value = value;
+}
+
+
+bool HashIndex::Erase(const string& key) {
+  if (key.size() != kKeySize || slots_.empty()) {
+    return false;
+  }
+
+  const size_t mask(slots_.size() - 1);
+  size_t hole(Probe(key.data()));
+  if (slots_[hole].value < 0) {
+    return false;
+  }
+
+  // Backward-shift deletion: move up any following entry that would
+  // no longer be reachable from its bucket once |hole| is empty, so
+  // that we do not need tombstones.
+  for (size_t i = (hole + 1) & mask; slots_[i].value >= 0;
+       i = (i + 1) & mask) {
+    const size_t bucket(Bucket(slots_[i].key));
+    if (((i - bucket) & mask) >= ((i - hole) & mask)) {
+      slots_[hole] = slots_[i];
+      hole = i;
+    }
+  }
+  slots_[hole].value = -1;
+  --size_;
+  return true;
+}
+
+
+void HashIndex::Clear() {
+  slots_.clear();
+  size_ = 0;
+}
+
+
+size_t HashIndex::Bucket(const char* key) const {
+  uint64_t bits;
+  memcpy(&bits, key, sizeof(bits));
+  return bits & (slots_.size() - 1);
+}
+
+
+size_t HashIndex::Probe(const char* key) const {
+  const size_t mask(slots_.size() - 1);
+  size_t i(Bucket(key));
+  while (slots_[i].value >= 0 && memcmp(slots_[i].key, key, kKeySize) != 0) {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+
+void HashIndex::Rehash(size_t capacity) {
+  CHECK_EQ(0U, capacity & (capacity - 1)) << "capacity must be a power of 2";
+  Slot empty;
+  empty.value = -1;
+  Slots old_slots(capacity, empty);
+  old_slots.swap(slots_);
+
+  for (const auto& slot : old_slots) {
+    if (slot.value >= 0) {
+      slots_[Probe(slot.key)] = slot;
+    }
+  }
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,92 @@
+#ifndef CERT_TRANS_UTIL_HASH_INDEX_H_
+#define CERT_TRANS_UTIL_HASH_INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "base/macros.h"
+#include "util/huge_page_allocator.h"
+
+namespace cert_trans {
+
+
+// A compact map from SHA-256 hashes to non-negative int64_t values
+// (typically sequence numbers), for the in-memory indices of the log.
+//
+// This is an open-addressing (linear probing) hash table, storing the
+// 32-byte key inline next to its value, so every entry takes 40 bytes
+// (divided by the load factor, which is at most 70%), and a
+// lookup is usually a single cache miss (and, with --huge_pages, no
+// TLB miss). Since the keys are the output of a cryptographic hash,
+// their first bytes are used as the bucket index directly.
+//
+// Keys of the wrong size can be looked up (they are simply never
+// found), but not inserted.
+//
+// This class is thread-compatible.
+class HashIndex {
+ public:
+  static const size_t kKeySize = 32;
+
+  HashIndex();
+
+  size_t size() const {
+    return size_;
+  }
+
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  // The memory taken by the slots, empty or not.
+  size_t MemoryUsage() const {
+    return slots_.capacity() * sizeof(Slot);
+  }
+
+  // Make room for at least |count| entries, without further
+  // reallocation.
+  void Reserve(size_t count);
+
+  // Returns true and sets |*value| (if not NULL) if |key| is present.
+  bool Find(const std::string& key, int64_t* value) const;
+
+  // Adds |key| -> |value| and returns true, unless |key| is already
+  // present, in which case it returns false and leaves the existing
+  // value alone.
+  bool Insert(const std::string& key, int64_t value);
+
+  // Adds |key| -> |value|, replacing any existing value.
+  void Set(const std::string& key, int64_t value);
+
+  // Returns false if |key| was not present.
+  bool Erase(const std::string& key);
+
+  void Clear();
+
+ private:
+  struct Slot {
+    char key[kKeySize];
+    // Negative for an empty slot.
+    int64_t value;
+  };
+  typedef std::vector<Slot, HugePageAllocator<Slot>> Slots;
+
+  size_t Bucket(const char* key) const;
+  // Returns the slot holding |key|, or the empty slot where it would
+  // go. There must be at least one empty slot.
+  size_t Probe(const char* key) const;
+  void Rehash(size_t capacity);
+
+  // Always a power of two (or empty, before the first insertion).
+  Slots slots_;
+  size_t size_;
+
+  DISALLOW_COPY_AND_ASSIGN(HashIndex);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_UTIL_HASH_INDEX_H_
@@ -0,0 +1,144 @@
+#include "util/hash_index.h"
+
+#include <gtest/gtest.h>
+#include <map>
+#include <string>
+
+#include "merkletree/serial_hasher.h"
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::map;
+using std::string;
+using std::to_string;
+
+
+string Key(int i) {
+  return Sha256Hasher::Sha256Digest(to_string(i));
+}
+
+
+TEST(HashIndexTest, Empty) {
+  HashIndex index;
+  EXPECT_TRUE(index.empty());
+  EXPECT_EQ(0U, index.size());
+  int64_t value(-1);
+  EXPECT_FALSE(index.Find(Key(0), &value));
+  EXPECT_EQ(-1, value);
+  EXPECT_FALSE(index.Erase(Key(0)));
+}
+
+
+TEST(HashIndexTest, InsertAndFind) {
+  HashIndex index;
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_TRUE(index.Insert(Key(i), i));
+  }
+  EXPECT_EQ(1000U, index.size());
+
+  for (int i = 0; i < 1000; ++i) {
+    int64_t value;
+    ASSERT_TRUE(index.Find(Key(i), &value));
+    EXPECT_EQ(i, value);
+  }
+  EXPECT_TRUE(index.Find(Key(0), nullptr));
+  EXPECT_FALSE(index.Find(Key(1000), nullptr));
+}
+
+
+TEST(HashIndexTest, InsertKeepsExistingValue) {
+  HashIndex index;
+  EXPECT_TRUE(index.Insert(Key(0), 5));
+  EXPECT_FALSE(index.Insert(Key(0), 3));
+  int64_t value;
+  ASSERT_TRUE(index.Find(Key(0), &value));
+  EXPECT_EQ(5, value);
+  EXPECT_EQ(1U, index.size());
+}
+
+
+TEST(HashIndexTest, Set) {
+  HashIndex index;
+  index.Set(Key(0), 5);
+  index.Set(Key(0), 3);
+  int64_t value;
+  ASSERT_TRUE(index.Find(Key(0), &value));
+  EXPECT_EQ(3, value);
+  EXPECT_EQ(1U, index.size());
+}
+
+
+TEST(HashIndexTest, WrongKeySize) {
+  HashIndex index;
+  index.Insert(Key(0), 0);
+  EXPECT_FALSE(index.Find("", nullptr));
+  EXPECT_FALSE(index.Find(Key(0).substr(0, 16), nullptr));
+  EXPECT_FALSE(index.Erase(Key(0) + "x"));
+}
+
+
+TEST(HashIndexTest, EraseMatchesMap) {
+  HashIndex index;
+  map<string, int64_t> reference;
+  // Use keys that collide in the low bits, so that erasing them needs
+  // to shift entries around.
+  for (int i = 0; i < 3000; ++i) {
+    string key(Key(i));
+    key[0] = 0;
+    key[1] = i % 3;
+    index.Set(key, i);
+    reference[key] = i;
+    if (i % 3 == 1) {
+      const string erased(reference.begin()->first);
+      EXPECT_TRUE(index.Erase(erased));
+      reference.erase(erased);
+    }
+  }
+  EXPECT_EQ(reference.size(), index.size());
+
+  for (int i = 0; i < 3000; ++i) {
+    string key(Key(i));
+    key[0] = 0;
+    key[1] = i % 3;
+    int64_t value;
+    const auto it(reference.find(key));
+    if (it == reference.end()) {
+      EXPECT_FALSE(index.Find(key, &value)) << i;
+    } else {
+      ASSERT_TRUE(index.Find(key, &value)) << i;
+      EXPECT_EQ(it->second, value);
+    }
+  }
+}
+
+
+TEST(HashIndexTest, ReserveAndClear) {
+  HashIndex index;
+  index.Reserve(100);
+  for (int i = 0; i < 100; ++i) {
+    index.Insert(Key(i), i);
+  }
+  EXPECT_EQ(100U, index.size());
+  index.Clear();
+  EXPECT_TRUE(index.empty());
+  EXPECT_FALSE(index.Find(Key(1), nullptr));
+  EXPECT_TRUE(index.Insert(Key(1), 1));
+}
+
+
+TEST(HashIndexDeathTest, InsertWrongKeySize) {
+  HashIndex index;
+  EXPECT_DEATH(index.Insert("short", 0), "kKeySize");
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,95 @@
+#include "util/huge_page_allocator.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <sys/mman.h>
+#include <new>
+#include <string>
+
+#include "monitoring/monitoring.h"
+
+DEFINE_string(huge_pages, "off",
+              "back the large in-memory indexes and Merkle tree levels with "
+              "huge pages: off, transparent (asking for transparent huge "
+              "pages with madvise), or explicit (from the pool reserved in "
+              "/proc/sys/vm/nr_hugepages, falling back to transparent ones "
+              "once it is exhausted)");
+
+using std::string;
+
+namespace cert_trans {
+namespace {
+
+
+static Counter<string>* large_allocations(
+    Counter<string>::New("large_allocations", "pages",
+                         "Number of allocations of large in-memory "
+                         "structures, by the pages backing them (explicit, "
+                         "transparent, fallback or normal)."));
+
+
+const size_t kHugePageSize = 2 << 20;
+
+
+size_t MappedLength(size_t bytes) {
+  return (bytes + kHugePageSize - 1) & ~(kHugePageSize - 1);
+}
+
+
+void* Map(size_t length, int extra_flags) {
+  return mmap(nullptr, length, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS | extra_flags, -1, 0);
+}
+
+
+}  // namespace
+
+
+void* AllocateLarge(size_t bytes) {
+  if (bytes < kHugePageSize) {
+    return ::operator new(bytes);
+  }
+
+  const size_t length(MappedLength(bytes));
+  const bool explicit_pages(FLAGS_huge_pages == "explicit");
+  const bool transparent_pages(FLAGS_huge_pages == "transparent");
+  CHECK(explicit_pages || transparent_pages || FLAGS_huge_pages == "off")
+      << "Invalid --huge_pages: " << FLAGS_huge_pages;
+
+#ifdef MAP_HUGETLB
+  if (explicit_pages) {
+    void* const addr(Map(length, MAP_HUGETLB));
+    if (addr != MAP_FAILED) {
+      large_allocations->Increment("explicit");
+      return addr;
+    }
+    LOG_FIRST_N(WARNING, 1) << "Out of explicit huge pages, falling back to "
+                               "transparent ones";
+  }
+#endif
+
+  void* const addr(Map(length, 0));
+  PCHECK(addr != MAP_FAILED) << "Could not map " << length << " bytes";
+#ifdef MADV_HUGEPAGE
+  if (explicit_pages || transparent_pages) {
+    // Only a hint, which the kernel can ignore.
+    madvise(addr, length, MADV_HUGEPAGE);
+    large_allocations->Increment(explicit_pages ? "fallback" : "transparent");
+    return addr;
+  }
+#endif
+  large_allocations->Increment("normal");
+  return addr;
+}
+
+
+void FreeLarge(void* ptr, size_t bytes) {
+  if (bytes < kHugePageSize) {
+    ::operator delete(ptr);
+    return;
+  }
+  PCHECK(munmap(ptr, MappedLength(bytes)) == 0);
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,61 @@
+#ifndef CERT_TRANS_UTIL_HUGE_PAGE_ALLOCATOR_H_
+#define CERT_TRANS_UTIL_HUGE_PAGE_ALLOCATOR_H_
+
+#include <stddef.h>
+#include <memory>
+
+namespace cert_trans {
+
+
+// Allocates |bytes|. Allocations of at least a huge page (2 MB) are
+// mapped directly, backed by huge pages as --huge_pages says, falling
+// back to normal pages if there are none to be had. Smaller ones come
+// from the heap.
+void* AllocateLarge(size_t bytes);
+
+// Frees what AllocateLarge() returned for the same |bytes|.
+void FreeLarge(void* ptr, size_t bytes);
+
+
+// An allocator for the big, randomly accessed arrays (the hash
+// indexes, the levels of the Merkle tree), where backing them with
+// huge pages saves a TLB miss on most lookups.
+template <class T>
+class HugePageAllocator : public std::allocator<T> {
+ public:
+  template <class U>
+  struct rebind {
+    typedef HugePageAllocator<U> other;
+  };
+
+  HugePageAllocator() = default;
+
+  template <class U>
+  HugePageAllocator(const HugePageAllocator<U>&) {
+  }
+
+  T* allocate(size_t n, const void* = nullptr) {
+    return static_cast<T*>(AllocateLarge(n * sizeof(T)));
+  }
+
+  void deallocate(T* ptr, size_t n) {
+    FreeLarge(ptr, n * sizeof(T));
+  }
+};
+
+
+template <class T, class U>
+bool operator==(const HugePageAllocator<T>&, const HugePageAllocator<U>&) {
+  return true;
+}
+
+
+template <class T, class U>
+bool operator!=(const HugePageAllocator<T>&, const HugePageAllocator<U>&) {
+  return false;
+}
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_UTIL_HUGE_PAGE_ALLOCATOR_H_
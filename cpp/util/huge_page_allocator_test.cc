@@ -0,0 +1,77 @@
+#include "util/huge_page_allocator.h"
+
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "util/testing.h"
+
+DECLARE_string(huge_pages);
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+using std::vector;
+
+
+class HugePageAllocatorTest : public ::testing::TestWithParam<string> {
+ protected:
+  HugePageAllocatorTest() : saved_huge_pages_(FLAGS_huge_pages) {
+    FLAGS_huge_pages = GetParam();
+  }
+
+  ~HugePageAllocatorTest() {
+    FLAGS_huge_pages = saved_huge_pages_;
+  }
+
+  const string saved_huge_pages_;
+};
+
+
+// Fills a vector of |count| elements, growing it one at a time, and
+// checks it all.
+void FillAndCheck(size_t count) {
+  vector<uint64_t, HugePageAllocator<uint64_t>> values;
+  for (uint64_t i = 0; i < count; ++i) {
+    values.push_back(i * 7);
+  }
+  ASSERT_EQ(count, values.size());
+  for (uint64_t i = 0; i < count; ++i) {
+    ASSERT_EQ(i * 7, values[i]) << i;
+  }
+
+  // Shrinking and growing back again.
+  values.resize(count / 2);
+  values.shrink_to_fit();
+  values.resize(count, 1);
+  EXPECT_EQ(count / 2 * 7 - 7, values[count / 2 - 1]);
+  EXPECT_EQ(1U, values.back());
+}
+
+
+TEST_P(HugePageAllocatorTest, Small) {
+  FillAndCheck(1000);
+}
+
+
+TEST_P(HugePageAllocatorTest, Large) {
+  // 8 MB and a bit, not a multiple of the huge page size.
+  FillAndCheck((1 << 20) + 123);
+}
+
+
+INSTANTIATE_TEST_CASE_P(Modes, HugePageAllocatorTest,
+                        ::testing::Values("off", "transparent", "explicit"));
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -13,6 +13,8 @@
 #include "config.h"
 #include "log/ct_extensions.h"
 #include "proto/cert_serializer.h"
+#include "util/cpu_affinity.h"
+#include "util/logging.h"
 #include "version.h"
 
 using std::string;
@@ -52,7 +54,10 @@ void InitCT(int* argc, char** argv[]) {
   google::SetVersionString(cert_trans::kBuildVersion);
   google::ParseCommandLineFlags(argc, argv, true);
   google::InitGoogleLogging(*argv[0]);
+  cert_trans::InstallAsyncLoggers();
   google::InstallFailureSignalHandler();
+  // Before any other thread is started, for them to follow it.
+  cert_trans::SetNumaMemoryPolicy();
 
   event_set_log_callback(&LibEventLog);
 
@@ -0,0 +1,294 @@
+#include "config.h"
+#include "util/io_batch.h"
+
+#include <errno.h>
+#include <glog/logging.h>
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+
+using std::min;
+using std::vector;
+
+namespace cert_trans {
+
+
+const unsigned IoBatch::kDefaultDepth = 64;
+
+
+#ifdef HAVE_LINUX_IO_URING_H
+// A bare io_uring, set up and driven with the system calls directly,
+// as we only need a small part of liburing.
+class IoBatch::Ring {
+ public:
+  // Returns NULL if the kernel cannot set up a ring (too old, or
+  // forbidden by a seccomp policy, for example).
+  static Ring* New(unsigned depth);
+  ~Ring();
+
+  void Run(vector<Op>* ops, vector<ssize_t>* results);
+
+ private:
+  explicit Ring(int fd) : fd_(fd) {
+  }
+
+  bool Map(const io_uring_params& params);
+  // Queues as many of |ops| from |*next| as there is room for, and
+  // returns how many.
+  unsigned Queue(vector<Op>* ops, size_t* next, unsigned in_flight);
+  // Returns the number of completions reaped into |results|.
+  unsigned Reap(const vector<Op>& ops, vector<ssize_t>* results);
+
+  const int fd_;
+  unsigned sq_entries_;
+  unsigned cq_entries_;
+
+  void* sq_ring_ = MAP_FAILED;
+  size_t sq_ring_size_ = 0;
+  void* cq_ring_ = MAP_FAILED;
+  size_t cq_ring_size_ = 0;
+  io_uring_sqe* sqes_ = static_cast<io_uring_sqe*>(MAP_FAILED);
+  size_t sqes_size_ = 0;
+
+  unsigned* sq_head_;
+  unsigned* sq_tail_;
+  unsigned* sq_mask_;
+  unsigned* sq_array_;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned* cq_mask_;
+  io_uring_cqe* cqes_;
+
+  DISALLOW_COPY_AND_ASSIGN(Ring);
+};
+
+
+// static
+IoBatch::Ring* IoBatch::Ring::New(unsigned depth) {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  const int fd(syscall(__NR_io_uring_setup, depth, &params));
+  if (fd < 0) {
+    LOG_FIRST_N(WARNING, 1) << "Could not set up an io_uring ("
+                            << strerror(errno)
+                            << "), doing blocking reads and writes";
+    return nullptr;
+  }
+
+  Ring* const ring(new Ring(fd));
+  if (!ring->Map(params)) {
+    delete ring;
+    return nullptr;
+  }
+  return ring;
+}
+
+
+bool IoBatch::Ring::Map(const io_uring_params& params) {
+  sq_entries_ = params.sq_entries;
+  cq_entries_ = params.cq_entries;
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+
+  // Newer kernels map both rings at once.
+  const bool single_mmap(params.features & IORING_FEAT_SINGLE_MMAP);
+  if (single_mmap) {
+    sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+  }
+
+  sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    PLOG(WARNING) << "mmap(IORING_OFF_SQ_RING)";
+    return false;
+  }
+  if (!single_mmap) {
+    cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+      PLOG(WARNING) << "mmap(IORING_OFF_CQ_RING)";
+      return false;
+    }
+  }
+  void* const sqes(mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES));
+  if (sqes == MAP_FAILED) {
+    PLOG(WARNING) << "mmap(IORING_OFF_SQES)";
+    return false;
+  }
+  sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+  char* const sq(static_cast<char*>(sq_ring_));
+  char* const cq(static_cast<char*>(single_mmap ? sq_ring_ : cq_ring_));
+  sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  sq_mask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  cq_mask_ = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+  return true;
+}
+
+
+IoBatch::Ring::~Ring() {
+  if (sqes_ != MAP_FAILED) {
+    munmap(sqes_, sqes_size_);
+  }
+  if (cq_ring_ != MAP_FAILED) {
+    munmap(cq_ring_, cq_ring_size_);
+  }
+  if (sq_ring_ != MAP_FAILED) {
+    munmap(sq_ring_, sq_ring_size_);
+  }
+  PCHECK(close(fd_) == 0);
+}
+
+
+void IoBatch::Ring::Run(vector<Op>* ops, vector<ssize_t>* results) {
+  size_t next(0);
+  size_t completed(0);
+  unsigned in_flight(0);
+  while (completed < ops->size()) {
+    const unsigned queued(Queue(ops, &next, in_flight));
+    in_flight += queued;
+
+    // Submits everything the kernel has not consumed yet, and waits
+    // for at least one completion.
+    const unsigned to_submit(*sq_tail_ -
+                             __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE));
+    const int ret(syscall(__NR_io_uring_enter, fd_, to_submit, 1,
+                          IORING_ENTER_GETEVENTS, nullptr, 0));
+    PCHECK(ret >= 0 || errno == EINTR || errno == EAGAIN ||
+           errno == EBUSY)
+        << "io_uring_enter";
+
+    const unsigned reaped(Reap(*ops, results));
+    in_flight -= reaped;
+    completed += reaped;
+  }
+}
+
+
+unsigned IoBatch::Ring::Queue(vector<Op>* ops, size_t* next,
+                              unsigned in_flight) {
+  // Also keep the completions from overflowing their ring.
+  const unsigned room(min(sq_entries_, cq_entries_) - in_flight);
+  unsigned tail(*sq_tail_);
+  unsigned queued(0);
+  for (; queued < room && *next < ops->size(); ++queued, ++*next) {
+    Op* const op(&(*ops)[*next]);
+    const unsigned index(tail & *sq_mask_);
+    io_uring_sqe* const sqe(&sqes_[index]);
+    memset(sqe, 0, sizeof(*sqe));
+    // The vectored operations are available since the first kernels
+    // with io_uring, unlike IORING_OP_READ and IORING_OP_WRITE.
+    sqe->opcode = op->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = op->fd;
+    sqe->off = op->offset;
+    sqe->addr = reinterpret_cast<uint64_t>(&op->iov);
+    sqe->len = 1;
+    sqe->user_data = *next;
+    sq_array_[index] = index;
+    ++tail;
+  }
+  __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+  return queued;
+}
+
+
+unsigned IoBatch::Ring::Reap(const vector<Op>& ops,
+                             vector<ssize_t>* results) {
+  unsigned head(*cq_head_);
+  const unsigned tail(__atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE));
+  unsigned reaped(0);
+  for (; head != tail; ++head, ++reaped) {
+    const io_uring_cqe& cqe(cqes_[head & *cq_mask_]);
+    const Op& op(ops[cqe.user_data]);
+    (*results)[cqe.user_data] =
+        cqe.res > 0 && static_cast<size_t>(cqe.res) < op.iov.iov_len
+            ? Finish(op, cqe.res)
+            : cqe.res;
+  }
+  __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  return reaped;
+}
+#else
+class IoBatch::Ring {
+ public:
+  static Ring* New(unsigned) {
+    return nullptr;
+  }
+
+  void Run(vector<Op>*, vector<ssize_t>*) {
+    LOG(FATAL) << "no io_uring";
+  }
+};
+#endif  // HAVE_LINUX_IO_URING_H
+
+
+IoBatch::IoBatch(unsigned depth) : ring_(Ring::New(depth)) {
+  CHECK_GT(depth, 0U);
+}
+
+
+IoBatch::~IoBatch() {
+}
+
+
+void IoBatch::AddRead(int fd, char* buf, size_t size, off_t offset) {
+  ops_.push_back(Op{false, fd, {buf, size}, offset});
+}
+
+
+void IoBatch::AddWrite(int fd, const char* buf, size_t size, off_t offset) {
+  ops_.push_back(Op{true, fd, {const_cast<char*>(buf), size}, offset});
+}
+
+
+void IoBatch::Run(vector<ssize_t>* results) {
+  CHECK_NOTNULL(results)->assign(ops_.size(), 0);
+  if (ring_) {
+    ring_->Run(&ops_, results);
+  } else {
+    for (size_t i = 0; i < ops_.size(); ++i) {
+      (*results)[i] = Finish(ops_[i], 0);
+    }
+  }
+  ops_.clear();
+}
+
+
+// static
+ssize_t IoBatch::Finish(const Op& op, ssize_t done) {
+  char* const buf(static_cast<char*>(op.iov.iov_base));
+  while (static_cast<size_t>(done) < op.iov.iov_len) {
+    const size_t left(op.iov.iov_len - done);
+    const ssize_t ret(
+        op.write ? pwrite(op.fd, buf + done, left, op.offset + done)
+                 : pread(op.fd, buf + done, left, op.offset + done));
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return done > 0 ? done : -errno;
+    }
+    if (ret == 0) {
+      // End of file.
+      break;
+    }
+    done += ret;
+  }
+  return done;
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,72 @@
+#ifndef CERT_TRANS_UTIL_IO_BATCH_H_
+#define CERT_TRANS_UTIL_IO_BATCH_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <memory>
+#include <vector>
+
+#include "base/macros.h"
+
+namespace cert_trans {
+
+
+// Does a batch of reads and writes on file descriptors, waiting for
+// all of them to complete.
+//
+// With io_uring (Linux 5.1 and later), they are all submitted to the
+// kernel together, up to the depth of the ring at a time, so that a
+// single thread keeps many of them in flight, rather than blocking on
+// them one after the other. Without it (or if the kernel refuses to
+// set up a ring), they are done in order with pread() and pwrite().
+//
+// An IoBatch can be reused for several batches, but must only be used
+// by one thread at a time.
+class IoBatch {
+ public:
+  static const unsigned kDefaultDepth;
+
+  explicit IoBatch(unsigned depth = kDefaultDepth);
+  ~IoBatch();
+
+  // Adds a read of |size| bytes from |fd| at |offset| into |buf|,
+  // which must stay valid until Run() returns.
+  void AddRead(int fd, char* buf, size_t size, off_t offset);
+
+  // Adds a write of |size| bytes from |buf| to |fd| at |offset|.
+  void AddWrite(int fd, const char* buf, size_t size, off_t offset);
+
+  // Runs the operations added since the last call, and sets
+  // |results| to the number of bytes transferred by each of them, in
+  // the order they were added, or to minus the errno of the ones that
+  // failed. Reads are only short at the end of their file.
+  void Run(std::vector<ssize_t>* results);
+
+  // Whether the operations are submitted to io_uring.
+  bool async() const {
+    return ring_ != nullptr;
+  }
+
+ private:
+  class Ring;
+  struct Op {
+    bool write;
+    int fd;
+    iovec iov;
+    off_t offset;
+  };
+
+  // Completes a short transfer of |op| (which has already moved
+  // |done| bytes) with blocking calls.
+  static ssize_t Finish(const Op& op, ssize_t done);
+
+  const std::unique_ptr<Ring> ring_;
+  std::vector<Op> ops_;
+
+  DISALLOW_COPY_AND_ASSIGN(IoBatch);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_UTIL_IO_BATCH_H_
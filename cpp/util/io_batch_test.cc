@@ -0,0 +1,110 @@
+#include "util/io_batch.h"
+
+#include <errno.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+using std::to_string;
+using std::vector;
+
+
+class IoBatchTest : public ::testing::Test {
+ protected:
+  IoBatchTest() : file_(tmpfile()) {
+    CHECK_NOTNULL(file_);
+  }
+
+  ~IoBatchTest() {
+    fclose(file_);
+  }
+
+  int fd() const {
+    return fileno(file_);
+  }
+
+  FILE* const file_;
+};
+
+
+TEST_F(IoBatchTest, Empty) {
+  IoBatch batch;
+  vector<ssize_t> results{1, 2, 3};
+  batch.Run(&results);
+  EXPECT_TRUE(results.empty());
+}
+
+
+TEST_F(IoBatchTest, WriteThenRead) {
+  // More operations than the ring holds at a time.
+  const int kNumChunks = 100;
+  const size_t kChunkSize = 16;
+  IoBatch batch(8);
+
+  vector<string> chunks;
+  for (int i = 0; i < kNumChunks; ++i) {
+    chunks.push_back(to_string(i));
+    chunks.back().resize(kChunkSize, '.');
+  }
+  for (int i = 0; i < kNumChunks; ++i) {
+    batch.AddWrite(fd(), chunks[i].data(), kChunkSize, i * kChunkSize);
+  }
+  vector<ssize_t> results;
+  batch.Run(&results);
+  ASSERT_EQ(static_cast<size_t>(kNumChunks), results.size());
+  for (int i = 0; i < kNumChunks; ++i) {
+    EXPECT_EQ(static_cast<ssize_t>(kChunkSize), results[i]) << i;
+  }
+
+  // Read them back in reverse order, into separate buffers.
+  vector<string> read(kNumChunks, string(kChunkSize, '\0'));
+  for (int i = kNumChunks - 1; i >= 0; --i) {
+    batch.AddRead(fd(), &read[i][0], kChunkSize, i * kChunkSize);
+  }
+  batch.Run(&results);
+  ASSERT_EQ(static_cast<size_t>(kNumChunks), results.size());
+  for (int i = 0; i < kNumChunks; ++i) {
+    EXPECT_EQ(static_cast<ssize_t>(kChunkSize), results[i]) << i;
+    EXPECT_EQ(chunks[i], read[i]);
+  }
+}
+
+
+TEST_F(IoBatchTest, ShortReadAndErrors) {
+  IoBatch batch;
+  batch.AddWrite(fd(), "hello", 5, 0);
+  vector<ssize_t> results;
+  batch.Run(&results);
+  ASSERT_EQ(1U, results.size());
+  EXPECT_EQ(5, results[0]);
+
+  char buf[16];
+  batch.AddRead(fd(), buf, sizeof(buf), 0);
+  batch.AddRead(fd(), buf, sizeof(buf), 100);
+  batch.AddRead(-1, buf, sizeof(buf), 0);
+  batch.Run(&results);
+  ASSERT_EQ(3U, results.size());
+  // Only as much as there is in the file.
+  EXPECT_EQ(5, results[0]);
+  EXPECT_EQ("hello", string(buf, 5));
+  EXPECT_EQ(0, results[1]);
+  EXPECT_EQ(-EBADF, results[2]);
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,573 @@
+#include "util/json_reader.h"
+
+#include <glog/logging.h>
+#include <string.h>
+#include <limits>
+
+#include "util/json_writer.h"
+
+using std::numeric_limits;
+using std::string;
+
+namespace cert_trans {
+
+namespace {
+
+
+const char kBase64Chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+
+// The value of every base64 character, or -1.
+class Base64Values {
+ public:
+  Base64Values() {
+    memset(values_, -1, sizeof(values_));
+    for (int i = 0; kBase64Chars[i]; ++i) {
+      values_[static_cast<unsigned char>(kBase64Chars[i])] = i;
+    }
+  }
+
+  int operator[](char c) const {
+    return values_[static_cast<unsigned char>(c)];
+  }
+
+ private:
+  signed char values_[256];
+};
+
+
+const Base64Values kBase64Values;
+
+
+int HexValue(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+
+void AppendUtf8(uint32_t code_point, string* out) {
+  if (code_point < 0x80) {
+    out->push_back(code_point);
+  } else if (code_point < 0x800) {
+    out->push_back(0xc0 | (code_point >> 6));
+    out->push_back(0x80 | (code_point & 0x3f));
+  } else if (code_point < 0x10000) {
+    out->push_back(0xe0 | (code_point >> 12));
+    out->push_back(0x80 | ((code_point >> 6) & 0x3f));
+    out->push_back(0x80 | (code_point & 0x3f));
+  } else {
+    out->push_back(0xf0 | (code_point >> 18));
+    out->push_back(0x80 | ((code_point >> 12) & 0x3f));
+    out->push_back(0x80 | ((code_point >> 6) & 0x3f));
+    out->push_back(0x80 | (code_point & 0x3f));
+  }
+}
+
+
+}  // namespace
+
+
+JsonReader::JsonReader(const char* data, size_t length)
+    : pos_(CHECK_NOTNULL(data)), end_(data + length), ok_(true) {
+}
+
+
+JsonReader::JsonReader(const string& json)
+    : JsonReader(json.data(), json.size()) {
+}
+
+
+bool JsonReader::BeginObject() {
+  if (!Expect('{')) {
+    return false;
+  }
+  has_elements_.push_back(false);
+  return true;
+}
+
+
+bool JsonReader::NextKey(string* key) {
+  if (!NextInContainer('}')) {
+    return false;
+  }
+  return Expect('"') && ReadString(CHECK_NOTNULL(key)) && Expect(':');
+}
+
+
+bool JsonReader::BeginArray() {
+  if (!Expect('[')) {
+    return false;
+  }
+  has_elements_.push_back(false);
+  return true;
+}
+
+
+bool JsonReader::NextElement() {
+  return NextInContainer(']');
+}
+
+
+bool JsonReader::String(string* value) {
+  return Expect('"') && ReadString(CHECK_NOTNULL(value));
+}
+
+
+bool JsonReader::Base64(string* data) {
+  CHECK_NOTNULL(data)->clear();
+  if (!Expect('"')) {
+    return false;
+  }
+
+  // Decoding never takes more space than the encoded value.
+  const void* const quote(memchr(pos_, '"', end_ - pos_));
+  if (!quote) {
+    return Fail();
+  }
+  const char* const encoded_end(static_cast<const char*>(quote));
+  data->resize((encoded_end - pos_) / 4 * 3);
+
+  // Most of the value is plain groups of four characters, which are
+  // decoded in one go straight into |data|. The rest (padding, escaped
+  // slashes and errors) is left to the loop below, a character at a
+  // time.
+  char* const out_begin(data->empty() ? nullptr : &(*data)[0]);
+  char* out(out_begin);
+  while (encoded_end - pos_ >= 4) {
+    const int a(kBase64Values[pos_[0]]);
+    const int b(kBase64Values[pos_[1]]);
+    const int c(kBase64Values[pos_[2]]);
+    const int d(kBase64Values[pos_[3]]);
+    if ((a | b | c | d) < 0) {
+      break;
+    }
+    const uint32_t group((a << 18) | (b << 12) | (c << 6) | d);
+    out[0] = static_cast<char>(group >> 16);
+    out[1] = static_cast<char>(group >> 8);
+    out[2] = static_cast<char>(group);
+    out += 3;
+    pos_ += 4;
+  }
+  data->resize(out - out_begin);
+
+  uint32_t bits(0);
+  int num_bits(0);
+  size_t num_chars(0);
+  size_t num_padding(0);
+  while (pos_ < end_) {
+    char c(*pos_++);
+    if (c == '"') {
+      // Complete groups of four characters, with no leftover bits.
+      if ((num_chars + num_padding) % 4 != 0 || num_padding > 2 ||
+          (num_padding > 0 && num_chars % 4 != 4 - num_padding) ||
+          bits != 0) {
+        return Fail();
+      }
+      return true;
+    }
+    if (c == '\\') {
+      // Some encoders escape slashes, no other escape makes sense here.
+      if (pos_ == end_ || *pos_ != '/') {
+        return Fail();
+      }
+      c = *pos_++;
+    }
+    if (c == '=') {
+      ++num_padding;
+      continue;
+    }
+
+    const int value(kBase64Values[c]);
+    if (value < 0 || num_padding > 0) {
+      return Fail();
+    }
+    ++num_chars;
+    bits = (bits << 6) | value;
+    num_bits += 6;
+    if (num_bits >= 8) {
+      num_bits -= 8;
+      data->push_back(static_cast<char>(bits >> num_bits));
+      bits &= (1 << num_bits) - 1;
+    }
+  }
+
+  return Fail();
+}
+
+
+bool JsonReader::Int(int64_t* value) {
+  CHECK_NOTNULL(value);
+  if (!ok_) {
+    return false;
+  }
+  const char c(Peek());
+  const bool negative(c == '-');
+  if (negative) {
+    ++pos_;
+  }
+  if (pos_ == end_ || *pos_ < '0' || *pos_ > '9') {
+    return Fail();
+  }
+
+  // Accumulated as a negative number, which has the larger range.
+  int64_t result(0);
+  while (pos_ < end_ && *pos_ >= '0' && *pos_ <= '9') {
+    const int digit(*pos_++ - '0');
+    if (result < (numeric_limits<int64_t>::min() + digit) / 10) {
+      return Fail();
+    }
+    result = result * 10 - digit;
+  }
+  if (pos_ < end_ && (*pos_ == '.' || *pos_ == 'e' || *pos_ == 'E')) {
+    return Fail();
+  }
+  if (!negative) {
+    if (result == numeric_limits<int64_t>::min()) {
+      return Fail();
+    }
+    result = -result;
+  }
+
+  *value = result;
+  return true;
+}
+
+
+bool JsonReader::Bool(bool* value) {
+  CHECK_NOTNULL(value);
+  if (!ok_) {
+    return false;
+  }
+  switch (Peek()) {
+    case 't':
+      *value = true;
+      return SkipLiteral("true");
+    case 'f':
+      *value = false;
+      return SkipLiteral("false");
+    default:
+      return Fail();
+  }
+}
+
+
+bool JsonReader::Skip() {
+  if (!ok_) {
+    return false;
+  }
+  string unused;
+  switch (Peek()) {
+    case '{':
+      if (!BeginObject()) {
+        return false;
+      }
+      while (NextKey(&unused)) {
+        if (!Skip()) {
+          return false;
+        }
+      }
+      return ok_;
+
+    case '[':
+      if (!BeginArray()) {
+        return false;
+      }
+      while (NextElement()) {
+        if (!Skip()) {
+          return false;
+        }
+      }
+      return ok_;
+
+    case '"':
+      return String(&unused);
+
+    case 't':
+      return SkipLiteral("true");
+
+    case 'f':
+      return SkipLiteral("false");
+
+    case 'n':
+      return SkipLiteral("null");
+
+    default:
+      return SkipNumber();
+  }
+}
+
+
+bool JsonReader::Copy(JsonWriter* writer) {
+  CHECK_NOTNULL(writer);
+  if (!ok_) {
+    return false;
+  }
+  string value;
+  switch (Peek()) {
+    case '{':
+      if (!BeginObject()) {
+        return false;
+      }
+      writer->BeginObject();
+      while (NextKey(&value)) {
+        writer->Key(value);
+        if (!Copy(writer)) {
+          return false;
+        }
+      }
+      writer->EndObject();
+      return ok_;
+
+    case '[':
+      if (!BeginArray()) {
+        return false;
+      }
+      writer->BeginArray();
+      while (NextElement()) {
+        if (!Copy(writer)) {
+          return false;
+        }
+      }
+      writer->EndArray();
+      return ok_;
+
+    case '"':
+      if (!String(&value)) {
+        return false;
+      }
+      writer->String(value);
+      return true;
+
+    case 't':
+      if (!SkipLiteral("true")) {
+        return false;
+      }
+      writer->Bool(true);
+      return true;
+
+    case 'f':
+      if (!SkipLiteral("false")) {
+        return false;
+      }
+      writer->Bool(false);
+      return true;
+
+    case 'n':
+      if (!SkipLiteral("null")) {
+        return false;
+      }
+      writer->RawValue("null", 4);
+      return true;
+
+    default: {
+      // Numbers are kept as they were written.
+      const char* const start(pos_);
+      if (!SkipNumber()) {
+        return false;
+      }
+      writer->RawValue(start, pos_ - start);
+      return true;
+    }
+  }
+}
+
+
+bool JsonReader::AtEnd() {
+  Peek();
+  return ok_ && pos_ == end_;
+}
+
+
+char JsonReader::Peek() {
+  while (pos_ < end_ &&
+         (*pos_ == ' ' || *pos_ == '\t' || *pos_ == '\n' || *pos_ == '\r')) {
+    ++pos_;
+  }
+  return pos_ < end_ ? *pos_ : 0;
+}
+
+
+bool JsonReader::Expect(char c) {
+  if (!ok_ || Peek() != c) {
+    return Fail();
+  }
+  ++pos_;
+  return true;
+}
+
+
+bool JsonReader::NextInContainer(char end) {
+  if (!ok_) {
+    return false;
+  }
+  CHECK(!has_elements_.empty());
+
+  const char c(Peek());
+  if (c == end) {
+    ++pos_;
+    has_elements_.pop_back();
+    return false;
+  }
+  if (has_elements_.back()) {
+    if (c != ',') {
+      return Fail();
+    }
+    ++pos_;
+  }
+  has_elements_.back() = true;
+  return true;
+}
+
+
+bool JsonReader::ReadString(string* value) {
+  value->clear();
+  while (pos_ < end_) {
+    // Copy the characters up to the next special one all at once.
+    const char* run_end(pos_);
+    while (run_end < end_ && *run_end != '"' && *run_end != '\\' &&
+           static_cast<unsigned char>(*run_end) >= 0x20) {
+      ++run_end;
+    }
+    value->append(pos_, run_end);
+    pos_ = run_end;
+    if (pos_ == end_) {
+      break;
+    }
+
+    const char c(*pos_++);
+    if (c == '"') {
+      return true;
+    }
+    if (c != '\\') {
+      // A control character.
+      return Fail();
+    }
+
+    if (pos_ == end_) {
+      return Fail();
+    }
+    switch (*pos_++) {
+      case '"':
+        value->push_back('"');
+        break;
+      case '\\':
+        value->push_back('\\');
+        break;
+      case '/':
+        value->push_back('/');
+        break;
+      case 'b':
+        value->push_back('\b');
+        break;
+      case 'f':
+        value->push_back('\f');
+        break;
+      case 'n':
+        value->push_back('\n');
+        break;
+      case 'r':
+        value->push_back('\r');
+        break;
+      case 't':
+        value->push_back('\t');
+        break;
+      case 'u': {
+        uint32_t code_point(0);
+        for (int i = 0; i < 4; ++i) {
+          const int digit(pos_ < end_ ? HexValue(*pos_++) : -1);
+          if (digit < 0) {
+            return Fail();
+          }
+          code_point = (code_point << 4) | digit;
+        }
+        // A surrogate pair, for characters outside the BMP.
+        if (code_point >= 0xd800 && code_point < 0xdc00 &&
+            end_ - pos_ >= 6 && pos_[0] == '\\' && pos_[1] == 'u') {
+          uint32_t low(0);
+          for (int i = 2; i < 6; ++i) {
+            const int digit(HexValue(pos_[i]));
+            if (digit < 0) {
+              return Fail();
+            }
+            low = (low << 4) | digit;
+          }
+          if (low >= 0xdc00 && low < 0xe000) {
+            pos_ += 6;
+            code_point =
+                0x10000 + ((code_point - 0xd800) << 10) + (low - 0xdc00);
+          }
+        }
+        AppendUtf8(code_point, value);
+        break;
+      }
+      default:
+        return Fail();
+    }
+  }
+
+  return Fail();
+}
+
+
+bool JsonReader::SkipNumber() {
+  const char* const start(pos_);
+  const auto skip_digits = [this]() {
+    const char* const digits(pos_);
+    while (pos_ < end_ && *pos_ >= '0' && *pos_ <= '9') {
+      ++pos_;
+    }
+    return pos_ > digits;
+  };
+
+  // -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+  if (pos_ < end_ && *pos_ == '-') {
+    ++pos_;
+  }
+  const char* const integer(pos_);
+  bool valid(skip_digits() && (*integer != '0' || pos_ == integer + 1));
+  if (valid && pos_ < end_ && *pos_ == '.') {
+    ++pos_;
+    valid = skip_digits();
+  }
+  if (valid && pos_ < end_ && (*pos_ == 'e' || *pos_ == 'E')) {
+    ++pos_;
+    if (pos_ < end_ && (*pos_ == '+' || *pos_ == '-')) {
+      ++pos_;
+    }
+    valid = skip_digits();
+  }
+  if (!valid) {
+    pos_ = start;
+    return Fail();
+  }
+  return true;
+}
+
+
+bool JsonReader::SkipLiteral(const char* literal) {
+  const size_t length(strlen(literal));
+  if (!ok_ || static_cast<size_t>(end_ - pos_) < length ||
+      memcmp(pos_, literal, length) != 0) {
+    return Fail();
+  }
+  pos_ += length;
+  return true;
+}
+
+
+bool JsonReader::Fail() {
+  ok_ = false;
+  return false;
+}
+
+
+}  // namespace cert_trans
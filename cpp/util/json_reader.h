@@ -0,0 +1,115 @@
+#ifndef CERT_TRANS_UTIL_JSON_READER_H_
+#define CERT_TRANS_UTIL_JSON_READER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "base/macros.h"
+
+namespace cert_trans {
+
+class JsonWriter;
+
+
+// Reads JSON straight from a buffer, one value at a time, for
+// responses that are too big to be worth parsing into a json-c tree
+// first (see util/json_wrapper.h for that). Base64 values are decoded
+// straight into their destination, without an intermediate copy of
+// the encoded string.
+//
+// The caller walks the document in order, with the methods matching
+// the values it expects. They all return false if the next value is
+// of another type or malformed, in which case the reader is in error
+// (see ok()), and every later call returns false as well. The end of
+// a container also makes NextKey() or NextElement() return false,
+// without an error.
+//
+// Example, for {"entries":["..."]}:
+//
+//   JsonReader reader(json);
+//   string key, data;
+//   if (!reader.BeginObject()) ...
+//   while (reader.NextKey(&key)) {
+//     if (key != "entries") {
+//       reader.Skip();
+//       continue;
+//     }
+//     if (!reader.BeginArray()) ...
+//     while (reader.NextElement()) {
+//       if (!reader.Base64(&data)) ...
+//     }
+//   }
+//   if (!reader.ok()) ...
+class JsonReader {
+ public:
+  // The data must outlive this object.
+  JsonReader(const char* data, size_t length);
+  explicit JsonReader(const std::string& json);
+  // The data would not outlive the reader.
+  explicit JsonReader(std::string&& json) = delete;
+
+  bool BeginObject();
+  // Reads the key of the next member of the current object, leaving
+  // the reader at its value. Returns false at the end of the object.
+  bool NextKey(std::string* key);
+
+  bool BeginArray();
+  // Returns true if the current array has another element, which is
+  // then the next value. Returns false at the end of the array.
+  bool NextElement();
+
+  bool String(std::string* value);
+  // Replaces the contents of |data| with the decoded value of a base64
+  // string.
+  bool Base64(std::string* data);
+  bool Int(int64_t* value);
+  bool Bool(bool* value);
+  // Skips over the next value, whatever it is.
+  bool Skip();
+  // Reads the next value, whatever it is, into |writer|, without any
+  // whitespace and with its strings escaped the way JsonWriter does,
+  // so that equivalent documents come out the same. If this returns
+  // false, |writer| may have been left with part of the value.
+  bool Copy(JsonWriter* writer);
+
+  // Returns false if the input was not what the caller expected.
+  bool ok() const {
+    return ok_;
+  }
+
+  // Returns true once the whole input was read (but for whitespace).
+  bool AtEnd();
+
+ private:
+  // Skips whitespace, and returns the next character (or 0 at the end
+  // of the input), without consuming it.
+  char Peek();
+  // Consumes |c|, which must be the next character (after whitespace).
+  bool Expect(char c);
+  // Returns the key or element separator for the current container, if
+  // it is not empty yet, and returns false if it ends instead.
+  bool NextInContainer(char end);
+  // Reads the contents of the string (after the opening quote), up to
+  // and including the closing quote.
+  bool ReadString(std::string* value);
+  bool SkipNumber();
+  bool SkipLiteral(const char* literal);
+  // Sets the error, and returns false.
+  bool Fail();
+
+  const char* pos_;
+  const char* const end_;
+  // Whether each of the containers being read already had an element,
+  // the innermost last.
+  std::vector<bool> has_elements_;
+  bool ok_;
+
+  DISALLOW_COPY_AND_ASSIGN(JsonReader);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_UTIL_JSON_READER_H_
@@ -0,0 +1,206 @@
+#include "util/json_reader.h"
+
+#include <gtest/gtest.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits>
+#include <memory>
+#include <string>
+
+#include "util/json_writer.h"
+#include "util/testing.h"
+#include "util/util.h"
+
+namespace cert_trans {
+namespace {
+
+using std::numeric_limits;
+using std::string;
+using std::unique_ptr;
+
+
+TEST(JsonReaderTest, EmptyContainers) {
+  const string json(" [ {}, [ ] ] ");
+  JsonReader reader(json);
+  ASSERT_TRUE(reader.BeginArray());
+  ASSERT_TRUE(reader.NextElement());
+  ASSERT_TRUE(reader.BeginObject());
+  string key;
+  EXPECT_FALSE(reader.NextKey(&key));
+  ASSERT_TRUE(reader.NextElement());
+  ASSERT_TRUE(reader.BeginArray());
+  EXPECT_FALSE(reader.NextElement());
+  EXPECT_FALSE(reader.NextElement());
+  EXPECT_TRUE(reader.ok());
+  EXPECT_TRUE(reader.AtEnd());
+}
+
+
+TEST(JsonReaderTest, Object) {
+  const string json(
+      "{\"int\":-42,\"bool\":true,\"array\":[\"a\",false,1234567890123],"
+      "\"object\":{\"x\":\"y\"}}");
+  JsonReader reader(json);
+  string key, value;
+  int64_t int_value;
+  bool bool_value;
+  ASSERT_TRUE(reader.BeginObject());
+  ASSERT_TRUE(reader.NextKey(&key));
+  EXPECT_EQ("int", key);
+  ASSERT_TRUE(reader.Int(&int_value));
+  EXPECT_EQ(-42, int_value);
+  ASSERT_TRUE(reader.NextKey(&key));
+  EXPECT_EQ("bool", key);
+  ASSERT_TRUE(reader.Bool(&bool_value));
+  EXPECT_TRUE(bool_value);
+  ASSERT_TRUE(reader.NextKey(&key));
+  EXPECT_EQ("array", key);
+  ASSERT_TRUE(reader.BeginArray());
+  ASSERT_TRUE(reader.NextElement());
+  ASSERT_TRUE(reader.String(&value));
+  EXPECT_EQ("a", value);
+  ASSERT_TRUE(reader.NextElement());
+  ASSERT_TRUE(reader.Bool(&bool_value));
+  EXPECT_FALSE(bool_value);
+  ASSERT_TRUE(reader.NextElement());
+  ASSERT_TRUE(reader.Int(&int_value));
+  EXPECT_EQ(1234567890123LL, int_value);
+  EXPECT_FALSE(reader.NextElement());
+  ASSERT_TRUE(reader.NextKey(&key));
+  EXPECT_EQ("object", key);
+  ASSERT_TRUE(reader.Skip());
+  EXPECT_FALSE(reader.NextKey(&key));
+  EXPECT_TRUE(reader.AtEnd());
+}
+
+
+TEST(JsonReaderTest, Skip) {
+  const string json(
+      "[{\"a\":[1,2.5e-3,{\"b\":null}],\"c\":\"\\\"]\"},true,-0.5,[]]");
+  JsonReader reader(json);
+  ASSERT_TRUE(reader.Skip());
+  EXPECT_TRUE(reader.AtEnd());
+}
+
+
+TEST(JsonReaderTest, Copy) {
+  const string json(
+      " { \"a\" : [ 1 , -2.5E+3 , null ] ,\n\t\"b\\u00e9\\/\" : "
+      "{ \"c\" : true , \"d\" : [ ] } , \"e\" : false } ");
+  const unique_ptr<evbuffer, void (*)(evbuffer*)> buffer(evbuffer_new(),
+                                                         evbuffer_free);
+  JsonWriter writer(buffer.get());
+  JsonReader reader(json);
+  ASSERT_TRUE(reader.Copy(&writer));
+  EXPECT_TRUE(reader.AtEnd());
+  EXPECT_EQ(
+      "{\"a\":[1,-2.5E+3,null],\"b\xc3\xa9/\":{\"c\":true,\"d\":[]},"
+      "\"e\":false}",
+      string(reinterpret_cast<const char*>(
+                 evbuffer_pullup(buffer.get(), -1)),
+             evbuffer_get_length(buffer.get())));
+}
+
+
+TEST(JsonReaderTest, Escaping) {
+  const string json(
+      "\"a\\\"b\\\\c\\nd\\u0001\\te\\/\\u00e9\\u20ac\\ud83d\\ude00\"");
+  JsonReader reader(json);
+  string value;
+  ASSERT_TRUE(reader.String(&value));
+  EXPECT_EQ("a\"b\\c\nd\x01\te/\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80", value);
+}
+
+
+TEST(JsonReaderTest, Base64) {
+  for (size_t length = 0; length < 70; ++length) {
+    const string data(length, static_cast<char>(0xf0 + length % 7));
+    const string json("\"" + util::ToBase64(data) + "\"");
+    JsonReader reader(json);
+    string decoded("garbage");
+    ASSERT_TRUE(reader.Base64(&decoded)) << length;
+    EXPECT_EQ(data, decoded);
+  }
+
+  // Escaped slashes.
+  {
+    const string json("\"\\/\\/8=\"");
+    JsonReader reader(json);
+    string decoded;
+    ASSERT_TRUE(reader.Base64(&decoded));
+    EXPECT_EQ("\xff\xff", decoded);
+  }
+
+  // An escaped slash after a few whole groups, with more after it.
+  {
+    const string data("\x01\x02\x03\x04\x05\x06\xff\xf0\x01\x02\x03");
+    string encoded(util::ToBase64(data));
+    ASSERT_EQ("AQIDBAUG//ABAgM=", encoded);
+    encoded.replace(8, 1, "\\/");
+    const string json("\"" + encoded + "\"");
+    JsonReader reader(json);
+    string decoded;
+    ASSERT_TRUE(reader.Base64(&decoded));
+    EXPECT_EQ(data, decoded);
+  }
+}
+
+
+TEST(JsonReaderTest, Errors) {
+  const char* const kBadValues[] = {
+      "",     "[",      "[1,]",    "{\"a\"1}", "{,}", "[1 2]",
+      "tru",  "\"abc",  "\"\\x\"", "1.5x",     "-",   "\"\x01\"",
+      "{\"a\":}", "01",     "1.",      "1e",       "+1",  ".5",
+  };
+  for (const char* json : kBadValues) {
+    JsonReader reader(json, strlen(json));
+    EXPECT_FALSE(reader.Skip() && reader.AtEnd()) << json;
+  }
+
+  const char* const kBadInts[] = {
+      "1.5", "1e3", "-", "\"1\"", "9223372036854775808",
+  };
+  for (const char* json : kBadInts) {
+    JsonReader reader(json, strlen(json));
+    int64_t value;
+    EXPECT_FALSE(reader.Int(&value)) << json;
+  }
+  {
+    const string json("-9223372036854775808");
+    JsonReader reader(json);
+    int64_t value;
+    ASSERT_TRUE(reader.Int(&value));
+    EXPECT_EQ(numeric_limits<int64_t>::min(), value);
+  }
+
+  const char* const kBadBase64[] = {
+      "\"a\"", "\"ab=\"", "\"abc\"", "\"a===\"", "\"ab=c\"", "\"a!cd\"",
+      "\"ab\\ncd\"", "\"AB==\"", "\"abcd",
+  };
+  for (const char* json : kBadBase64) {
+    JsonReader reader(json, strlen(json));
+    string decoded;
+    EXPECT_FALSE(reader.Base64(&decoded)) << json;
+    EXPECT_FALSE(reader.ok());
+  }
+
+  // Errors are sticky.
+  const string json("[x, 1]");
+  JsonReader reader(json);
+  ASSERT_TRUE(reader.BeginArray());
+  ASSERT_TRUE(reader.NextElement());
+  int64_t value;
+  EXPECT_FALSE(reader.Int(&value));
+  EXPECT_FALSE(reader.NextElement());
+  EXPECT_FALSE(reader.ok());
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -166,7 +166,7 @@ class JsonString : public JsonObject {
   }
 
   std::string FromBase64() {
-    return util::FromBase64(Value());
+    return util::FromBase64(Value(), json_object_get_string_len(obj_));
   }
 };
 
@@ -0,0 +1,157 @@
+#include "util/json_writer.h"
+
+#include <glog/logging.h>
+#include <stdio.h>
+
+#include "util/util.h"
+
+using std::string;
+
+namespace cert_trans {
+
+
+JsonWriter::JsonWriter(evbuffer* buffer)
+    : buffer_(CHECK_NOTNULL(buffer)), after_key_(false) {
+}
+
+
+void JsonWriter::BeginObject() {
+  StartValue();
+  Add("{", 1);
+  has_elements_.push_back(false);
+}
+
+
+void JsonWriter::EndObject() {
+  CHECK(!has_elements_.empty());
+  CHECK(!after_key_);
+  has_elements_.pop_back();
+  Add("}", 1);
+}
+
+
+void JsonWriter::BeginArray() {
+  StartValue();
+  Add("[", 1);
+  has_elements_.push_back(false);
+}
+
+
+void JsonWriter::EndArray() {
+  CHECK(!has_elements_.empty());
+  has_elements_.pop_back();
+  Add("]", 1);
+}
+
+
+void JsonWriter::Key(const string& key) {
+  CHECK(!after_key_);
+  StartValue();
+  AddEscaped(key);
+  Add(":", 1);
+  after_key_ = true;
+}
+
+
+void JsonWriter::String(const string& value) {
+  StartValue();
+  AddEscaped(value);
+}
+
+
+void JsonWriter::Base64(const string& data) {
+  StartValue();
+  Add("\"", 1);
+
+  const size_t length(util::Base64EncodedSize(data.size()));
+  evbuffer_iovec iov;
+  CHECK_EQ(evbuffer_reserve_space(buffer_, length, &iov, 1), 1);
+  CHECK_GE(iov.iov_len, length);
+  char* const out(static_cast<char*>(iov.iov_base));
+  CHECK_EQ(util::EncodeBase64(data.data(), data.size(), out), out + length);
+  iov.iov_len = length;
+  CHECK_EQ(evbuffer_commit_space(buffer_, &iov, 1), 0);
+
+  Add("\"", 1);
+}
+
+
+void JsonWriter::Int(int64_t value) {
+  StartValue();
+  CHECK_GT(evbuffer_add_printf(buffer_, "%lld", static_cast<long long>(value)),
+           0);
+}
+
+
+void JsonWriter::Bool(bool value) {
+  StartValue();
+  if (value) {
+    Add("true", 4);
+  } else {
+    Add("false", 5);
+  }
+}
+
+
+void JsonWriter::RawValue(const char* json, size_t length) {
+  StartValue();
+  Add(json, length);
+}
+
+
+void JsonWriter::StartValue() {
+  if (after_key_) {
+    after_key_ = false;
+    return;
+  }
+  if (!has_elements_.empty()) {
+    if (has_elements_.back()) {
+      Add(",", 1);
+    }
+    has_elements_.back() = true;
+  }
+}
+
+
+void JsonWriter::Add(const char* data, size_t length) {
+  CHECK_EQ(evbuffer_add(buffer_, data, length), 0);
+}
+
+
+void JsonWriter::AddEscaped(const string& value) {
+  Add("\"", 1);
+  // Copy runs of characters that need no escaping in one go.
+  size_t run_start(0);
+  for (size_t i = 0; i < value.size(); ++i) {
+    const unsigned char c(value[i]);
+    if (c >= 0x20 && c != '"' && c != '\\') {
+      continue;
+    }
+    Add(value.data() + run_start, i - run_start);
+    run_start = i + 1;
+    switch (c) {
+      case '"':
+        Add("\\\"", 2);
+        break;
+      case '\\':
+        Add("\\\\", 2);
+        break;
+      case '\n':
+        Add("\\n", 2);
+        break;
+      case '\r':
+        Add("\\r", 2);
+        break;
+      case '\t':
+        Add("\\t", 2);
+        break;
+      default:
+        CHECK_GT(evbuffer_add_printf(buffer_, "\\u%04x", c), 0);
+    }
+  }
+  Add(value.data() + run_start, value.size() - run_start);
+  Add("\"", 1);
+}
+
+
+}  // namespace cert_trans
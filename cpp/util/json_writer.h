@@ -0,0 +1,78 @@
+#ifndef CERT_TRANS_UTIL_JSON_WRITER_H_
+#define CERT_TRANS_UTIL_JSON_WRITER_H_
+
+#include <event2/buffer.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "base/macros.h"
+
+namespace cert_trans {
+
+
+// Writes JSON straight into an evbuffer, one value at a time, for
+// replies that are too big to be worth building as a json-c tree
+// first (see util/json_wrapper.h for that). Base64 values are encoded
+// in place, in the evbuffer's own memory.
+//
+// The caller is responsible for producing a well-formed document
+// (matching every Begin*() with its End*(), calling Key() before
+// every value in an object, etc). Commas are taken care of.
+//
+// Example:
+//
+//   JsonWriter writer(buffer);
+//   writer.BeginObject();
+//   writer.Key("entries");
+//   writer.BeginArray();
+//   writer.Base64(data);
+//   writer.EndArray();
+//   writer.EndObject();
+//
+// produces {"entries":["..."]}.
+class JsonWriter {
+ public:
+  // |buffer| must outlive this object.
+  explicit JsonWriter(evbuffer* buffer);
+
+  void BeginObject();
+  void EndObject();
+  void BeginArray();
+  void EndArray();
+
+  // Start a member of the current object, the next call must write
+  // its value.
+  void Key(const std::string& key);
+
+  void String(const std::string& value);
+  void Base64(const std::string& data);
+  void Int(int64_t value);
+  void Bool(bool value);
+
+  // Writes the |length| bytes at |json| as is. They must form exactly
+  // one well-formed JSON value (which might have been produced by
+  // another JsonWriter).
+  void RawValue(const char* json, size_t length);
+
+ private:
+  // Emits a comma if this is not the first value in the current
+  // container.
+  void StartValue();
+  void Add(const char* data, size_t length);
+  void AddEscaped(const std::string& value);
+
+  evbuffer* const buffer_;
+  // Whether the containers being written already have some elements,
+  // the innermost last.
+  std::vector<bool> has_elements_;
+  // Set between a Key() and its value.
+  bool after_key_;
+
+  DISALLOW_COPY_AND_ASSIGN(JsonWriter);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_UTIL_JSON_WRITER_H_
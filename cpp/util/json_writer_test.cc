@@ -0,0 +1,154 @@
+#include "util/json_writer.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+
+#include "util/testing.h"
+#include "util/util.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+using std::unique_ptr;
+
+
+class JsonWriterTest : public ::testing::Test {
+ protected:
+  JsonWriterTest() : buffer_(CHECK_NOTNULL(evbuffer_new()), evbuffer_free) {
+  }
+
+  string Contents() const {
+    const size_t length(evbuffer_get_length(buffer_.get()));
+    return string(reinterpret_cast<const char*>(
+                      evbuffer_pullup(buffer_.get(), length)),
+                  length);
+  }
+
+  const unique_ptr<evbuffer, void (*)(evbuffer*)> buffer_;
+};
+
+
+TEST_F(JsonWriterTest, EmptyContainers) {
+  JsonWriter writer(buffer_.get());
+  writer.BeginArray();
+  writer.BeginObject();
+  writer.EndObject();
+  writer.BeginArray();
+  writer.EndArray();
+  writer.EndArray();
+  EXPECT_EQ("[{},[]]", Contents());
+}
+
+
+TEST_F(JsonWriterTest, Object) {
+  JsonWriter writer(buffer_.get());
+  writer.BeginObject();
+  writer.Key("int");
+  writer.Int(-42);
+  writer.Key("bool");
+  writer.Bool(true);
+  writer.Key("array");
+  writer.BeginArray();
+  writer.String("a");
+  writer.Bool(false);
+  writer.Int(1234567890123LL);
+  writer.EndArray();
+  writer.Key("object");
+  writer.BeginObject();
+  writer.Key("x");
+  writer.String("y");
+  writer.EndObject();
+  writer.EndObject();
+  EXPECT_EQ(
+      "{\"int\":-42,\"bool\":true,\"array\":[\"a\",false,1234567890123],"
+      "\"object\":{\"x\":\"y\"}}",
+      Contents());
+}
+
+
+TEST_F(JsonWriterTest, Escaping) {
+  JsonWriter writer(buffer_.get());
+  writer.String("a\"b\\c\nd\x01\te");
+  EXPECT_EQ("\"a\\\"b\\\\c\\nd\\u0001\\te\"", Contents());
+}
+
+
+TEST_F(JsonWriterTest, RawValue) {
+  JsonWriter writer(buffer_.get());
+  writer.BeginObject();
+  writer.Key("a");
+  writer.RawValue("{\"b\":1}", 7);
+  writer.Key("c");
+  writer.BeginArray();
+  writer.RawValue("2", 1);
+  writer.RawValue("[]", 2);
+  writer.EndArray();
+  writer.EndObject();
+  EXPECT_EQ("{\"a\":{\"b\":1},\"c\":[2,[]]}", Contents());
+}
+
+
+TEST_F(JsonWriterTest, Base64) {
+  JsonWriter writer(buffer_.get());
+  writer.BeginArray();
+  for (size_t length = 0; length < 70; ++length) {
+    writer.Base64(string(length, static_cast<char>(0xf0 + length % 7)));
+  }
+  writer.EndArray();
+
+  string expected("[");
+  for (size_t length = 0; length < 70; ++length) {
+    if (length > 0) {
+      expected += ",";
+    }
+    expected += "\"" +
+                util::ToBase64(
+                    string(length, static_cast<char>(0xf0 + length % 7))) +
+                "\"";
+  }
+  expected += "]";
+  EXPECT_EQ(expected, Contents());
+}
+
+
+TEST_F(JsonWriterTest, Base64KnownValues) {
+  // From RFC 4648.
+  JsonWriter writer(buffer_.get());
+  writer.BeginArray();
+  for (const char* value : {"", "f", "fo", "foo", "foob", "fooba", "foobar"}) {
+    writer.Base64(value);
+  }
+  writer.EndArray();
+  EXPECT_EQ(
+      "[\"\",\"Zg==\",\"Zm8=\",\"Zm9v\",\"Zm9vYg==\",\"Zm9vYmE=\","
+      "\"Zm9vYmFy\"]",
+      Contents());
+  EXPECT_EQ("foobar", util::FromBase64("Zm9v\nYmFy"));
+  EXPECT_EQ("fo", util::FromBase64("Zm8="));
+  // Missing padding, extra bits, and characters after the padding.
+  EXPECT_EQ("", util::FromBase64("Zm8"));
+  EXPECT_EQ("", util::FromBase64("Zm9="));
+  EXPECT_EQ("", util::FromBase64("Zg==Zg=="));
+}
+
+
+TEST_F(JsonWriterTest, LargeBase64) {
+  // Bigger than an evbuffer chain.
+  const string data(1 << 20, 'x');
+  JsonWriter writer(buffer_.get());
+  writer.Base64(data);
+  EXPECT_EQ("\"" + util::ToBase64(data) + "\"", Contents());
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
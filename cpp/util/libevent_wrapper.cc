@@ -6,12 +6,16 @@
 #ifdef HAVE_ARPA_NAMESER_H
 #include <arpa/nameser.h> /* DNS HEADER struct */
 #endif
+#include <event2/bufferevent_ssl.h>
 #include <event2/keyvalq_struct.h>
 #include <event2/thread.h>
 #include <evhtp.h>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <math.h>
+#include <algorithm>
 #include <climits>
+#include <map>
 #ifdef HAVE_NETDB_H
 #include <netdb.h>
 #endif
@@ -25,6 +29,11 @@
 #include <sys/types.h>
 #endif
 #include <signal.h>
+#include <unistd.h>
+
+#include "monitoring/monitoring.h"
+#include "util/cpu_affinity.h"
+#include "util/util.h"
 
 using std::bind;
 using std::chrono::duration;
@@ -32,10 +41,13 @@ using std::chrono::duration_cast;
 using std::chrono::microseconds;
 using std::chrono::milliseconds;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::chrono::system_clock;
 using std::function;
 using std::lock_guard;
 using std::make_pair;
+using std::map;
+using std::max;
 using std::multimap;
 using std::mutex;
 using std::placeholders::_1;
@@ -44,7 +56,18 @@ using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
 using std::vector;
-using util::TaskHold;
+
+DEFINE_int32(max_http_body_size, 32768,
+             "largest HTTP request body accepted, in bytes; anything larger "
+             "is refused with a 413 while reading it, before any handler "
+             "sees it");
+DEFINE_int32(event_loop_lag_probe_interval_ms, 100,
+             "how often to check how late the timers of a named event loop "
+             "fire, in milliseconds");
+DEFINE_int32(dns_cache_ttl_seconds, 60,
+             "how long the address a host name of an outgoing HTTPS "
+             "connection resolved to is reused for, in seconds; 0 resolves "
+             "it for every connection");
 
 namespace {
 
@@ -69,30 +92,56 @@ void SetExitLoopHandler(event_base* base, int signum) {
 }
 
 
-void DelayCancel(event* timer, util::Task* task) {
-  event_del(timer);
-  task->Return(util::Status::CANCELLED);
-}
-
-
-void DelayDispatch(evutil_socket_t, short, void* userdata) {
-  static_cast<util::Task*>(CHECK_NOTNULL(userdata))->Return();
-}
-
-
 #ifdef HAVE_THREAD_LOCAL
 thread_local bool on_event_thread = false;
+thread_local const void* dispatching_base = nullptr;
 #elif HAVE___THREAD
 __thread bool on_event_thread = false;
+__thread const void* dispatching_base = nullptr;
 #else
 #error No suitable thread local storage available
 #endif
 
 
+// Every Base, by the event_base it wraps, for Base::ForRequest().
+mutex bases_lock;
+map<const event_base*, cert_trans::libevent::Base*>* bases;
+
+
 }  // namespace
 
 namespace cert_trans {
 namespace libevent {
+namespace {
+
+
+static Histogram<string>* event_loop_lag_us(
+    Histogram<string>::New("event_loop_lag_us", "loop",
+                           "Time timers fired after they were due in us, by "
+                           "event loop."));
+
+static Counter<string>* dns_cache_lookups(
+    Counter<string>::New("dns_cache_lookups", "result",
+                         "Number of host names of outgoing HTTPS "
+                         "connections looked up in the DNS cache, by result "
+                         "(hit or miss)."));
+
+// The most closures run per iteration of the event loop, so that a
+// flood of them does not hold up the other events.
+const int kMaxClosuresPerRun = 1024;
+
+
+}  // namespace
+
+
+struct Base::ClosureNode {
+  explicit ClosureNode(const function<void()>& closure)
+      : closure(closure), next(nullptr) {
+  }
+
+  const function<void()> closure;
+  ClosureNode* next;
+};
 
 
 struct HttpServer::Handler {
@@ -120,7 +169,7 @@ class ResolverImpl : public Base::Resolver {
     if (resolved != 0) {
       LOG(WARNING) << "Failed to resolve HTTPS hostname " << host << ": "
                    << gai_strerror(resolved);
-      return nullptr;
+      return string();
     }
 
     struct addrinfo* res(info);
@@ -144,7 +193,8 @@ class ResolverImpl : public Base::Resolver {
 
     if (!addr) {
       LOG(WARNING) << "Got no usable address for " << host;
-      return nullptr;
+      freeaddrinfo(info);
+      return string();
     }
 
     char addr_str[INET6_ADDRSTRLEN];
@@ -164,9 +214,21 @@ Base::Base(unique_ptr<Resolver> resolver)
       dns_(nullptr, FreeEvDns),
       wake_closures_(event_new(base_.get(), -1, 0, &Base::RunClosures, this),
                      &event_free),
-      resolver_(std::move(resolver)) {
+      closures_(nullptr),
+      pending_closures_(nullptr),
+      resolver_(std::move(resolver)),
+      wake_timers_(evtimer_new(base_.get(), &Base::RunTimers, this),
+                   &event_free) {
   evthread_make_base_notifiable(base_.get());
 
+  {
+    lock_guard<mutex> lock(bases_lock);
+    if (!bases) {
+      bases = new map<const event_base*, Base*>;
+    }
+    CHECK(bases->emplace(base_.get(), this).second);
+  }
+
   // So much stuff breaks if there's not a Dns client around to keep the
   // event loop doing stuff that we may as well just have one from the get go.
   GetDns();
@@ -174,6 +236,25 @@ Base::Base(unique_ptr<Resolver> resolver)
 
 
 Base::~Base() {
+  {
+    lock_guard<mutex> lock(bases_lock);
+    CHECK_EQ(1U, bases->erase(base_.get()));
+  }
+
+  vector<util::Task*> to_be_cancelled;
+  timers_.Clear(&to_be_cancelled);
+  for (const auto& task : to_be_cancelled) {
+    task->Return(util::Status::CANCELLED);
+  }
+
+  // Like the timers, the closures that did not get to run are dropped.
+  for (ClosureNode* list : {pending_closures_, TakeClosures()}) {
+    while (list) {
+      ClosureNode* const next(list->next);
+      delete list;
+      list = next;
+    }
+  }
 }
 
 
@@ -189,10 +270,35 @@ void Base::CheckNotOnEventThread() {
 }
 
 
+// static
+Base* Base::ForRequest(evhttp_request* req) {
+  evhttp_connection* const conn(
+      CHECK_NOTNULL(evhttp_request_get_connection(CHECK_NOTNULL(req))));
+  lock_guard<mutex> lock(bases_lock);
+  const auto it(bases->find(evhttp_connection_get_base(conn)));
+  CHECK(it != bases->end());
+  return it->second;
+}
+
+
+bool Base::OnThisEventThread() const {
+  return dispatching_base == this;
+}
+
+
 void Base::Add(const function<void()>& cb) {
-  lock_guard<mutex> lock(closures_lock_);
-  closures_.push_back(cb);
-  event_active(wake_closures_.get(), 0, 0);
+  ClosureNode* const node(new ClosureNode(cb));
+  node->next = closures_.load(std::memory_order_relaxed);
+  while (!closures_.compare_exchange_weak(node->next, node,
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed)) {
+  }
+
+  // Whoever made the list non-empty wakes up the event loop, which
+  // takes all of it at once.
+  if (!node->next) {
+    event_active(wake_closures_.get(), 0, 0);
+  }
 }
 
 
@@ -203,29 +309,14 @@ void Base::Delay(const duration<double>& delay, util::Task* task) {
     return;
   }
 
-  // Make sure nothing "bad" happens while we're still setting up our
-  // callbacks.
-  TaskHold hold(task);
-
-  event* timer(CHECK_NOTNULL(evtimer_new(base_.get(), &DelayDispatch, task)));
-
-  // Ensure that the cancellation callback is run on this libevent::Base, to
-  // avoid races during cancellation.
-
-  // Cancellation callbacks are always called before the task enters
-  // the DONE state (and "timer" is freed), and "event_del" is
-  // thread-safe, so it does not matter on which thread "DelayCancel"
-  // is called on.
-  task->WhenCancelled(bind(DelayCancel, timer, task));
-
-  task->CleanupWhenDone(bind(event_free, timer));
-
-  timeval tv;
-  const seconds sec(duration_cast<seconds>(delay));
-  tv.tv_sec = sec.count();
-  tv.tv_usec = duration_cast<microseconds>(delay - sec).count();
-
-  CHECK_EQ(evtimer_add(timer, &tv), 0);
+  // Cancellation removes the task from the wheel (on whichever thread
+  // it is requested), so only the due tasks are returned from here.
+  lock_guard<mutex> lock(timers_lock_);
+  if (timers_.Add(steady_clock::now() +
+                      duration_cast<steady_clock::duration>(delay),
+                  task)) {
+    ScheduleTimersLocked();
+  }
 }
 
 
@@ -240,9 +331,12 @@ void Base::Dispatch() {
   LOG_IF(WARNING, on_event_thread)
       << "Huh?, Are you calling Dispatch() from a libevent thread?";
   const bool old_on_event_thread(on_event_thread);
+  const void* const old_dispatching_base(dispatching_base);
   on_event_thread = true;
+  dispatching_base = this;
   CHECK_EQ(event_base_dispatch(base_.get()), 0);
   on_event_thread = old_on_event_thread;
+  dispatching_base = old_dispatching_base;
   dispatch_lock_.unlock();
 }
 
@@ -253,9 +347,12 @@ void Base::DispatchOnce() {
   LOG_IF(WARNING, on_event_thread)
       << "Huh?, Are you calling Dispatch() from a libevent thread?";
   const bool old_on_event_thread(on_event_thread);
+  const void* const old_dispatching_base(dispatching_base);
   on_event_thread = true;
+  dispatching_base = this;
   CHECK_EQ(event_base_loop(base_.get(), EVLOOP_ONCE), 0);
   on_event_thread = old_on_event_thread;
+  dispatching_base = old_dispatching_base;
 }
 
 
@@ -273,10 +370,10 @@ event* Base::EventNew(evutil_socket_t& sock, short events,
 
 evhttp* Base::HttpNew() const {
   const ev_ssize_t max_http_header_size = 4096;
-  const ev_ssize_t max_http_post_body_size = 32768;
+  CHECK_GT(FLAGS_max_http_body_size, 0);
   evhttp* http_session = CHECK_NOTNULL(evhttp_new(base_.get()));
   evhttp_set_max_headers_size(http_session, max_http_header_size);
-  evhttp_set_max_body_size(http_session, max_http_post_body_size);
+  evhttp_set_max_body_size(http_session, FLAGS_max_http_body_size);
   return http_session;
 }
 
@@ -306,7 +403,8 @@ evhtp_connection_t* Base::HttpsConnectionNew(const string& host,
 
   // TODO(alcutter): remove this all temporary name resolution stuff when this
   // PR is merged: https://github.com/ellzey/libevhtp/pull/163
-  const string addr_str(resolver_->Resolve(host));
+  CheckNotOnEventThread();
+  const string addr_str(ResolveCached(host));
   VLOG(1) << "Got addr: " << addr_str << ":" << port;
   evhtp_connection_t* ret(CHECK_NOTNULL(
       evhtp_connection_ssl_new(base_.get(), addr_str.c_str(), port, ssl_ctx)));
@@ -314,21 +412,120 @@ evhtp_connection_t* Base::HttpsConnectionNew(const string& host,
 }
 
 
+string Base::ResolveCached(const string& host) {
+  const steady_clock::time_point now(steady_clock::now());
+  {
+    lock_guard<mutex> lock(dns_cache_lock_);
+    const auto it(dns_cache_.find(host));
+    if (it != dns_cache_.end()) {
+      if (it->second.second > now) {
+        dns_cache_lookups->Increment("hit");
+        return it->second.first;
+      }
+      dns_cache_.erase(it);
+    }
+  }
+  dns_cache_lookups->Increment("miss");
+
+  // Resolved without the lock, so that a slow name does not hold up
+  // the others. Failures are not remembered, the next connection tries
+  // again.
+  const string addr(resolver_->Resolve(host));
+  if (!addr.empty() && FLAGS_dns_cache_ttl_seconds > 0) {
+    lock_guard<mutex> lock(dns_cache_lock_);
+    dns_cache_[host] =
+        make_pair(addr, now + seconds(FLAGS_dns_cache_ttl_seconds));
+  }
+  return addr;
+}
+
+
+bufferevent* Base::SslSocketNew(SSL* ssl) const {
+  CHECK_NOTNULL(ssl);
+  return CHECK_NOTNULL(bufferevent_openssl_socket_new(
+      base_.get(), -1, ssl, BUFFEREVENT_SSL_CONNECTING,
+      BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS));
+}
+
+
+Base::ClosureNode* Base::TakeClosures() {
+  ClosureNode* node(closures_.exchange(nullptr, std::memory_order_acquire));
+  // Reverse the list, so that the closures run in the order they were
+  // added.
+  ClosureNode* oldest(nullptr);
+  while (node) {
+    ClosureNode* const next(node->next);
+    node->next = oldest;
+    oldest = node;
+    node = next;
+  }
+  return oldest;
+}
+
+
+// static
 void Base::RunClosures(evutil_socket_t, short, void* userdata) {
   Base* self(static_cast<Base*>(CHECK_NOTNULL(userdata)));
 
-  vector<function<void()>> closures;
+  ClosureNode* node(self->pending_closures_);
+  self->pending_closures_ = nullptr;
+  for (int i = 0; i < kMaxClosuresPerRun; ++i) {
+    if (!node) {
+      node = self->TakeClosures();
+      if (!node) {
+        break;
+      }
+    }
+    ClosureNode* const next(node->next);
+    node->closure();
+    delete node;
+    node = next;
+  }
+
+  // Come back for the rest on the next iteration of the loop, after
+  // polling for the other events (activating the event again would
+  // run it in this iteration). Closures added since the list was last
+  // taken might have found it non-empty, and not asked for a wakeup.
+  self->pending_closures_ = node;
+  if (node || self->closures_.load(std::memory_order_relaxed)) {
+    const timeval kNoDelay = {0, 0};
+    CHECK_EQ(event_add(self->wake_closures_.get(), &kNoDelay), 0);
+  }
+}
+
+
+// static
+void Base::RunTimers(evutil_socket_t, short, void* userdata) {
+  Base* self(static_cast<Base*>(CHECK_NOTNULL(userdata)));
+
+  vector<util::Task*> due;
   {
-    lock_guard<mutex> lock(self->closures_lock_);
-    closures.swap(self->closures_);
+    lock_guard<mutex> lock(self->timers_lock_);
+    if (self->timers_.Advance(steady_clock::now(), &due)) {
+      self->ScheduleTimersLocked();
+    }
   }
 
-  for (const auto& closure : closures) {
-    closure();
+  for (const auto& task : due) {
+    task->Return();
   }
 }
 
 
+void Base::ScheduleTimersLocked() {
+  const steady_clock::duration delay(
+      max(steady_clock::duration::zero(),
+          timers_.NextTick() - steady_clock::now()));
+  timeval tv;
+  const seconds sec(duration_cast<seconds>(delay));
+  tv.tv_sec = sec.count();
+  tv.tv_usec = duration_cast<microseconds>(delay - sec).count();
+
+  // Re-adding a pending timer reschedules it.
+  CHECK_EQ(evtimer_add(wake_timers_.get(), &tv), 0);
+}
+
+
 Event::Event(const Base& base, evutil_socket_t sock, short events,
              const Callback& cb)
     : cb_(cb), ev_(base.EventNew(sock, events, this)) {
@@ -360,12 +557,15 @@ void Event::Dispatch(evutil_socket_t sock, short events, void* userdata) {
 }
 
 
-HttpServer::HttpServer(const Base& base) : http_(base.HttpNew()) {
+HttpServer::HttpServer(const Base& base)
+    : https_{base.HttpNew()}, bound_(false) {
 }
 
 
 HttpServer::~HttpServer() {
-  evhttp_free(http_);
+  for (evhttp* http : https_) {
+    evhttp_free(http);
+  }
   for (vector<Handler*>::iterator it = handlers_.begin();
        it != handlers_.end(); ++it) {
     delete *it;
@@ -373,8 +573,86 @@ HttpServer::~HttpServer() {
 }
 
 
+void HttpServer::AddBase(const Base& base) {
+  CHECK(!bound_);
+  evhttp* const http(base.HttpNew());
+  for (const Handler* handler : handlers_) {
+    CHECK_EQ(evhttp_set_cb(http, handler->path.c_str(), &HandleRequest,
+                           const_cast<Handler*>(handler)),
+             0);
+  }
+  https_.push_back(http);
+}
+
+
+namespace {
+
+
+// Returns a listening socket, allowing others on the same port if
+// |reuse_port|.
+evutil_socket_t ListenSocket(const char* address, ev_uint16_t port,
+                             bool reuse_port) {
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  addrinfo* info;
+  const string port_str(std::to_string(port));
+  const int resolved(getaddrinfo(address, port_str.c_str(), &hints, &info));
+  CHECK_EQ(resolved, 0) << "could not resolve " << (address ? address : "*")
+                        << ":" << port << ": " << gai_strerror(resolved);
+
+  const evutil_socket_t fd(
+      socket(info->ai_family, info->ai_socktype, info->ai_protocol));
+  PCHECK(fd >= 0) << "socket";
+  CHECK_EQ(evutil_make_socket_nonblocking(fd), 0);
+  CHECK_EQ(evutil_make_socket_closeonexec(fd), 0);
+  CHECK_EQ(evutil_make_listen_socket_reuseable(fd), 0);
+#ifdef SO_REUSEPORT
+  if (reuse_port) {
+    const int on(1);
+    PCHECK(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == 0)
+        << "setsockopt(SO_REUSEPORT)";
+  }
+#else
+  CHECK(!reuse_port);
+#endif
+  PCHECK(bind(fd, info->ai_addr, info->ai_addrlen) == 0)
+      << "bind to " << (address ? address : "*") << ":" << port;
+  freeaddrinfo(info);
+  PCHECK(listen(fd, SOMAXCONN) == 0) << "listen";
+  return fd;
+}
+
+
+}  // namespace
+
+
 void HttpServer::Bind(const char* address, ev_uint16_t port) {
-  CHECK_EQ(evhttp_bind_socket(http_, address, port), 0);
+  CHECK(!bound_);
+  bound_ = true;
+  if (https_.size() == 1) {
+    CHECK_EQ(evhttp_bind_socket(https_.front(), address, port), 0);
+    return;
+  }
+
+#ifdef SO_REUSEPORT
+  // The kernel spreads the incoming connections over the sockets.
+  for (evhttp* http : https_) {
+    CHECK_EQ(evhttp_accept_socket(http, ListenSocket(address, port, true)),
+             0);
+  }
+#else
+  // Every base accepts from the same socket, whichever wakes up first
+  // gets the connection. Each needs its own descriptor to close.
+  const evutil_socket_t fd(ListenSocket(address, port, false));
+  for (evhttp* http : https_) {
+    const evutil_socket_t http_fd(http == https_.front() ? fd : dup(fd));
+    PCHECK(http_fd >= 0) << "dup";
+    CHECK_EQ(evhttp_accept_socket(http, http_fd), 0);
+  }
+#endif
 }
 
 
@@ -382,7 +660,13 @@ bool HttpServer::AddHandler(const string& path, const HandlerCallback& cb) {
   Handler* handler(new Handler(path, cb));
   handlers_.push_back(handler);
 
-  return evhttp_set_cb(http_, path.c_str(), &HandleRequest, handler) == 0;
+  bool retval(true);
+  for (evhttp* http : https_) {
+    retval =
+        evhttp_set_cb(http, path.c_str(), &HandleRequest, handler) == 0 &&
+        retval;
+  }
+  return retval;
 }
 
 
@@ -465,7 +749,31 @@ bool GetBoolParam(const QueryParams& query, const string& param) {
 
 
 EventPumpThread::EventPumpThread(const shared_ptr<Base>& base)
-    : base_(base), pump_thread_(bind(&EventPumpThread::Pump, this)) {
+    : EventPumpThread(base, string()) {
+}
+
+
+EventPumpThread::EventPumpThread(const shared_ptr<Base>& base,
+                                 const string& name)
+    : base_(base),
+      lag_(name.empty() ? nullptr : event_loop_lag_us->Bind(name)),
+      lag_probe_(lag_ ? new Event(*base_, -1, 0,
+                                  bind(&EventPumpThread::ProbeLag, this))
+                      : nullptr) {
+  if (lag_probe_) {
+    CHECK_GT(FLAGS_event_loop_lag_probe_interval_ms, 0);
+    const milliseconds interval(FLAGS_event_loop_lag_probe_interval_ms);
+    lag_probe_due_ = steady_clock::now() + interval;
+    lag_probe_->Add(interval);
+  }
+  // Only start dispatching once the probe is armed.
+  pump_thread_ = std::thread([this, name]() {
+    if (!name.empty()) {
+      util::SetThreadName(name);
+      PinThread(name);
+    }
+    Pump();
+  });
 }
 
 
@@ -480,5 +788,15 @@ void EventPumpThread::Pump() {
 }
 
 
+void EventPumpThread::ProbeLag() {
+  const steady_clock::time_point now(steady_clock::now());
+  lag_->Record(duration_cast<microseconds>(now - lag_probe_due_).count());
+
+  const milliseconds interval(FLAGS_event_loop_lag_probe_interval_ms);
+  lag_probe_due_ = now + interval;
+  lag_probe_->Add(interval);
+}
+
+
 }  // namespace libevent
 }  // namespace cert_trans
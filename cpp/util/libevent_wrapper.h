@@ -1,6 +1,7 @@
 #ifndef CERT_TRANS_UTIL_LIBEVENT_WRAPPER_H_
 #define CERT_TRANS_UTIL_LIBEVENT_WRAPPER_H_
 
+#include <event2/bufferevent.h>
 #include <event2/dns.h>
 #include <event2/event.h>
 #include <atomic>
@@ -8,6 +9,7 @@
 // TODO(alcutter): Use evhtp for the HttpServer too.
 #include <event2/http.h>
 #include <evhtp.h>
+#include <openssl/ssl.h>
 #include <functional>
 #include <map>
 #include <memory>
@@ -19,8 +21,12 @@
 #include "base/macros.h"
 #include "util/executor.h"
 #include "util/task.h"
+#include "util/timer_wheel.h"
 
 namespace cert_trans {
+
+class HistogramCell;
+
 namespace libevent {
 
 
@@ -31,12 +37,18 @@ class Base : public util::Executor {
  public:
   class Resolver {
    public:
+    virtual ~Resolver() = default;
+    // Returns an empty string if |host| could not be resolved.
     virtual std::string Resolve(const std::string& host) = 0;
   };
 
   static bool OnEventThread();
   static void CheckNotOnEventThread();
 
+  // Returns the Base that |req| was received on, which is the one its
+  // reply must be sent from.
+  static Base* ForRequest(evhttp_request* req);
+
   Base();
   Base(std::unique_ptr<Resolver> resolver);
   ~Base();
@@ -51,17 +63,39 @@ class Base : public util::Executor {
   void DispatchOnce();
   void LoopExit();
 
+  // Returns true if this Base is dispatching events on the current
+  // thread (as opposed to any Base, see OnEventThread()).
+  bool OnThisEventThread() const;
+
   event* EventNew(evutil_socket_t& sock, short events, Event* event) const;
   evhttp* HttpNew() const;
   evdns_base* GetDns();
+  // The host names of plain HTTP connections are resolved
+  // asynchronously, on the event loop. Those of HTTPS connections are
+  // resolved on the calling thread, which cannot be an event thread,
+  // and the addresses are then reused for --dns_cache_ttl_seconds.
   evhtp_connection_t* HttpConnectionNew(const std::string& host,
                                         unsigned short port);
   evhtp_connection_t* HttpsConnectionNew(const std::string& host,
                                          unsigned short port,
                                          SSL_CTX* ssl_ctx);
+  // Returns a bufferevent that will do a client handshake with |ssl|
+  // once it is connected (see bufferevent_socket_connect_hostname()),
+  // and frees |ssl| along with its socket.
+  bufferevent* SslSocketNew(SSL* ssl) const;
 
  private:
+  struct ClosureNode;
+
   static void RunClosures(evutil_socket_t sock, short flag, void* userdata);
+  // Takes all of |closures_|, returning them oldest first.
+  ClosureNode* TakeClosures();
+  static void RunTimers(evutil_socket_t sock, short flag, void* userdata);
+  // Arms |wake_timers_| for the next tick of |timers_|.
+  void ScheduleTimersLocked();
+  // Returns the address of |host|, from |dns_cache_| if it has not
+  // expired, or from |resolver_| otherwise.
+  std::string ResolveCached(const std::string& host);
 
   const std::unique_ptr<event_base, void (*)(event_base*)> base_;
   std::mutex dispatch_lock_;
@@ -70,13 +104,33 @@ class Base : public util::Executor {
   // "dns_" should be after base_, so that it gets destroyed first.
   std::unique_ptr<evdns_base, void (*)(evdns_base*)> dns_;
 
-  std::mutex closures_lock_;
   // "wake_closures_" should be after base_, so that it gets destroyed
   // first.
   const std::unique_ptr<event, void (*)(event*)> wake_closures_;
-  std::vector<std::function<void()>> closures_;
+  // The closures added since they were last taken, most recent first.
+  // Pushed without a lock, the one pushing on an empty list activates
+  // |wake_closures_|, so there is one wakeup per batch.
+  std::atomic<ClosureNode*> closures_;
+  // The closures taken but not run yet (for RunClosures() runs a
+  // bounded number at a time), oldest first. Only used on the event
+  // thread.
+  ClosureNode* pending_closures_;
   std::unique_ptr<Resolver> resolver_;
 
+  std::mutex dns_cache_lock_;
+  // The addresses resolved by |resolver_|, with when they expire.
+  std::map<std::string,
+           std::pair<std::string, std::chrono::steady_clock::time_point>>
+      dns_cache_;
+
+  // The delayed tasks, with a single libevent timer for the next tick
+  // of the wheel, rather than one per task.
+  std::mutex timers_lock_;
+  TimerWheel timers_;
+  // "wake_timers_" should be after base_, so that it gets destroyed
+  // first.
+  const std::unique_ptr<event, void (*)(event*)> wake_timers_;
+
   DISALLOW_COPY_AND_ASSIGN(Base);
 };
 
@@ -108,6 +162,14 @@ class HttpServer {
   explicit HttpServer(const Base& base);
   ~HttpServer();
 
+  // Also accepts, parses and replies to requests on |base|, so that
+  // the work is spread over the threads dispatching the bases. The
+  // handlers are called on the thread of the base that received the
+  // request. Must be called before Bind().
+  void AddBase(const Base& base);
+
+  // With several bases, each gets its own listening socket, bound with
+  // SO_REUSEPORT where available (or a shared socket, otherwise).
   void Bind(const char* address, ev_uint16_t port);
 
   // Returns false if there was an error adding the handler.
@@ -118,7 +180,10 @@ class HttpServer {
 
   static void HandleRequest(evhttp_request* req, void* userdata);
 
-  evhttp* const http_;
+  // One per base, the first one for the base passed to the
+  // constructor.
+  std::vector<evhttp*> https_;
+  bool bound_;
   // Could have been a vector<Handler>, but it is important that
   // pointers to entries remain valid.
   std::vector<Handler*> handlers_;
@@ -141,12 +206,21 @@ bool GetBoolParam(const QueryParams& query, const std::string& param);
 class EventPumpThread {
  public:
   EventPumpThread(const std::shared_ptr<Base>& base);
+  // Also exports how late the timers of |base| fire (see
+  // --event_loop_lag_probe_interval_ms), with the "loop" label set to
+  // |name|.
+  EventPumpThread(const std::shared_ptr<Base>& base, const std::string& name);
   ~EventPumpThread();
 
  private:
   void Pump();
+  void ProbeLag();
 
   const std::shared_ptr<Base> base_;
+  HistogramCell* const lag_;
+  // Only touched on the event thread, once it is started.
+  const std::unique_ptr<Event> lag_probe_;
+  std::chrono::steady_clock::time_point lag_probe_due_;
   std::thread pump_thread_;
 
   DISALLOW_COPY_AND_ASSIGN(EventPumpThread);
@@ -1,8 +1,12 @@
 #include "util/libevent_wrapper.h"
 
 #include <gtest/gtest.h>
+#include <thread>
+#include <vector>
 
+#include "util/sync_task.h"
 #include "util/testing.h"
+#include "util/thread_pool.h"
 
 namespace cert_trans {
 namespace libevent {
@@ -43,6 +47,85 @@ TEST_F(LibEventWrapperTest, TestTurtlesAllTheWayDown) {
 }
 
 
+TEST_F(LibEventWrapperTest, TestOnThisEventThread) {
+  std::shared_ptr<Base> base(std::make_shared<Base>());
+  std::shared_ptr<Base> other(std::make_shared<Base>());
+  EXPECT_FALSE(base->OnThisEventThread());
+  base->Add([base, other]() {
+    EXPECT_TRUE(base->OnThisEventThread());
+    EXPECT_FALSE(other->OnThisEventThread());
+    other->Add([base, other]() {
+      EXPECT_FALSE(base->OnThisEventThread());
+      EXPECT_TRUE(other->OnThisEventThread());
+    });
+    other->DispatchOnce();
+    EXPECT_TRUE(base->OnThisEventThread());
+  });
+  base->DispatchOnce();
+  EXPECT_FALSE(base->OnThisEventThread());
+}
+
+
+TEST_F(LibEventWrapperTest, TestAddRunsInOrder) {
+  const int kNumThreads(4);
+  const int kNumClosures(10000);
+  std::shared_ptr<Base> base(std::make_shared<Base>());
+  std::vector<std::vector<int>> seen(kNumThreads);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([base, &seen, i, kNumClosures]() {
+      for (int j = 0; j < kNumClosures; ++j) {
+        base->Add([&seen, i, j]() { seen[i].push_back(j); });
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  // They do not all run in a single iteration of the loop.
+  base->DispatchOnce();
+  int num_run(0);
+  for (const auto& closures : seen) {
+    num_run += closures.size();
+  }
+  EXPECT_LT(num_run, kNumThreads * kNumClosures);
+
+  while (num_run < kNumThreads * kNumClosures) {
+    base->DispatchOnce();
+    num_run = 0;
+    for (const auto& closures : seen) {
+      num_run += closures.size();
+    }
+  }
+  for (const auto& closures : seen) {
+    ASSERT_EQ(static_cast<size_t>(kNumClosures), closures.size());
+    for (int j = 0; j < kNumClosures; ++j) {
+      EXPECT_EQ(j, closures[j]);
+    }
+  }
+}
+
+
+TEST_F(LibEventWrapperTest, TestDelay) {
+  std::shared_ptr<Base> base(std::make_shared<Base>());
+  ThreadPool pool(1);
+  EventPumpThread pump(base);
+  util::SyncTask short_task(&pool);
+  util::SyncTask long_task(&pool);
+
+  base->Delay(std::chrono::seconds(60), long_task.task());
+  base->Delay(std::chrono::milliseconds(30), short_task.task());
+  short_task.Wait();
+  EXPECT_TRUE(short_task.status().ok());
+  EXPECT_FALSE(long_task.IsDone());
+
+  long_task.Cancel();
+  long_task.Wait();
+  EXPECT_EQ(util::Status::CANCELLED, long_task.status());
+}
+
+
 TEST_F(LibEventWrapperDeathTest, TestCheckNotOnEventThread) {
   // Should be fine:
   Base::CheckNotOnEventThread();
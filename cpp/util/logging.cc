@@ -0,0 +1,218 @@
+#include "util/logging.h"
+
+#include <gflags/gflags.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+
+#include "monitoring/monitoring.h"
+
+using std::condition_variable;
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::thread;
+using std::to_string;
+using std::unique_lock;
+using std::vector;
+
+DEFINE_bool(async_logging, false,
+            "write the INFO, WARNING and ERROR log files from a thread of "
+            "their own, so that logging does not block the server threads "
+            "on the disk (at the cost of the messages which do not fit "
+            "in --async_logging_buffer_kb, and of the last ones if the "
+            "process crashes)");
+DEFINE_int32(async_logging_buffer_kb, 2048,
+             "how much of the messages can be waiting to be written to each "
+             "log file with --async_logging, in KB, beyond which they are "
+             "dropped");
+
+namespace cert_trans {
+namespace {
+
+
+static Counter<>* log_messages_dropped(
+    Counter<>::New("log_messages_dropped",
+                   "Number of log messages dropped for lack of room in the "
+                   "buffers of --async_logging."));
+
+static Counter<string>* log_messages_rate_limited(
+    Counter<string>::New("log_messages_rate_limited", "call_site",
+                         "Number of log messages skipped by "
+                         "LOG_EVERY_N_SEC(), by call site."));
+
+
+int64_t SteadyNowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+
+// The loggers installed by InstallAsyncLoggers(), which live until the
+// end of the process.
+vector<AsyncLogger*>* installed_loggers(nullptr);
+
+
+void FlushInstalledLoggers() {
+  for (AsyncLogger* const logger : *installed_loggers) {
+    logger->Flush();
+  }
+}
+
+
+}  // namespace
+
+
+bool LogRateLimiter::ShouldLog(int seconds, const char* file, int line) {
+  const int64_t now(SteadyNowNs());
+  int64_t next(next_log_ns_.load());
+  if (now < next ||
+      !next_log_ns_.compare_exchange_strong(
+          next, now + static_cast<int64_t>(seconds) * 1000000000)) {
+    ++suppressed_;
+    return false;
+  }
+
+  const int64_t suppressed(suppressed_.exchange(0));
+  if (suppressed > 0) {
+    log_messages_rate_limited->IncrementBy(string(file) + ":" +
+                                               to_string(line),
+                                           suppressed);
+  }
+  return true;
+}
+
+
+AsyncLogger::AsyncLogger(google::base::Logger* wrapped,
+                         size_t max_buffer_bytes)
+    : wrapped_(CHECK_NOTNULL(wrapped)),
+      max_buffer_bytes_(max_buffer_bytes),
+      buffer_bytes_(0),
+      force_flush_(false),
+      unreported_drops_(0),
+      total_drops_(0),
+      flushes_requested_(0),
+      flushes_done_(0),
+      exiting_(false),
+      writer_(&AsyncLogger::WriterLoop, this) {
+}
+
+
+AsyncLogger::~AsyncLogger() {
+  {
+    lock_guard<mutex> lock(lock_);
+    exiting_ = true;
+  }
+  wake_writer_.notify_one();
+  writer_.join();
+}
+
+
+void AsyncLogger::Write(bool force_flush, time_t timestamp,
+                        const char* message, int message_len) {
+  {
+    lock_guard<mutex> lock(lock_);
+    if (buffer_bytes_ + message_len > max_buffer_bytes_) {
+      ++unreported_drops_;
+      ++total_drops_;
+      log_messages_dropped->Increment();
+      return;
+    }
+    buffer_.emplace_back(Message{timestamp, string(message, message_len)});
+    buffer_bytes_ += message_len;
+    force_flush_ |= force_flush;
+  }
+  wake_writer_.notify_one();
+}
+
+
+void AsyncLogger::Flush() {
+  unique_lock<mutex> lock(lock_);
+  const int64_t flush(++flushes_requested_);
+  wake_writer_.notify_one();
+  flushed_.wait(lock, [this, flush]() { return flushes_done_ >= flush; });
+}
+
+
+google::uint32 AsyncLogger::LogSize() {
+  return wrapped_->LogSize();
+}
+
+
+int64_t AsyncLogger::messages_dropped() const {
+  lock_guard<mutex> lock(lock_);
+  return total_drops_;
+}
+
+
+void AsyncLogger::WriterLoop() {
+  vector<Message> messages;
+  while (true) {
+    int64_t drops;
+    bool flush;
+    int64_t flushes_requested;
+    {
+      unique_lock<mutex> lock(lock_);
+      wake_writer_.wait(lock, [this]() {
+        return exiting_ || !buffer_.empty() || unreported_drops_ > 0 ||
+               flushes_done_ < flushes_requested_;
+      });
+      if (exiting_ && buffer_.empty() && unreported_drops_ == 0 &&
+          flushes_done_ == flushes_requested_) {
+        break;
+      }
+      messages.swap(buffer_);
+      buffer_bytes_ = 0;
+      drops = unreported_drops_;
+      unreported_drops_ = 0;
+      flushes_requested = flushes_requested_;
+      flush = force_flush_ || flushes_done_ < flushes_requested;
+      force_flush_ = false;
+    }
+
+    for (const Message& message : messages) {
+      wrapped_->Write(false, message.timestamp, message.text.data(),
+                      message.text.size());
+    }
+    messages.clear();
+    if (drops > 0) {
+      const string note("Dropped " + to_string(drops) +
+                        " log messages, see --async_logging_buffer_kb\n");
+      wrapped_->Write(false, time(nullptr), note.data(), note.size());
+    }
+    if (flush) {
+      wrapped_->Flush();
+    }
+
+    {
+      lock_guard<mutex> lock(lock_);
+      flushes_done_ = flushes_requested;
+    }
+    flushed_.notify_all();
+  }
+
+  wrapped_->Flush();
+}
+
+
+void InstallAsyncLoggers() {
+  if (!FLAGS_async_logging) {
+    return;
+  }
+  CHECK(!installed_loggers) << "InstallAsyncLoggers() called twice";
+  CHECK_GT(FLAGS_async_logging_buffer_kb, 0);
+  installed_loggers = new vector<AsyncLogger*>;
+  for (const google::LogSeverity severity :
+       {google::INFO, google::WARNING, google::ERROR}) {
+    AsyncLogger* const logger(new AsyncLogger(
+        google::base::GetLogger(severity),
+        static_cast<size_t>(FLAGS_async_logging_buffer_kb) << 10));
+    google::base::SetLogger(severity, logger);
+    installed_loggers->push_back(logger);
+  }
+  atexit(&FlushInstalledLoggers);
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,136 @@
+#ifndef CERT_TRANS_UTIL_LOGGING_H_
+#define CERT_TRANS_UTIL_LOGGING_H_
+
+#include <glog/logging.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base/macros.h"
+
+// Like LOG(severity), but logs at most once every |seconds| from a
+// given call site, and only counts the other messages in the
+// log_messages_rate_limited metric (without even formatting them). For
+// the messages that can come once per entry or per request.
+#define LOG_EVERY_N_SEC(severity, seconds) \
+  LOG_IF(severity,                         \
+         CT_LOG_RATE_LIMITER()->ShouldLog(seconds, __FILE__, __LINE__))
+
+// Same as LOG_EVERY_N_SEC(), for VLOG(verboselevel).
+#define VLOG_EVERY_N_SEC(verboselevel, seconds) \
+  LOG_IF(INFO,                                  \
+         VLOG_IS_ON(verboselevel) &&            \
+             CT_LOG_RATE_LIMITER()->ShouldLog(seconds, __FILE__, __LINE__))
+
+// The LogRateLimiter of the call site.
+#define CT_LOG_RATE_LIMITER()                     \
+  ([]() {                                         \
+    static ::cert_trans::LogRateLimiter limiter;  \
+    return &limiter;                              \
+  }())
+
+namespace cert_trans {
+
+
+// Lets through one message every so many seconds. See
+// LOG_EVERY_N_SEC().
+//
+// This class is thread-safe.
+class LogRateLimiter {
+ public:
+  LogRateLimiter() : next_log_ns_(0), suppressed_(0) {
+  }
+
+  // Returns true if nothing was logged in the last |seconds|. Counts
+  // the messages suppressed from |file|:|line| otherwise.
+  bool ShouldLog(int seconds, const char* file, int line);
+
+ private:
+  // In std::chrono::steady_clock time.
+  std::atomic<int64_t> next_log_ns_;
+  // Not yet added to the metric, which is only done once per period.
+  std::atomic<int64_t> suppressed_;
+
+  DISALLOW_COPY_AND_ASSIGN(LogRateLimiter);
+};
+
+
+// A glog logger which queues the messages, to be written to another
+// logger (such as the log file of a severity) by a thread of its own,
+// so that logging does not block on the disk.
+//
+// The queue is bounded, and the messages which do not fit are dropped,
+// counted in the log_messages_dropped metric (and in the log, once
+// there is room again). Messages asking for a flush (as those from
+// WARNING up do by default, see --logbuflevel) make the thread flush
+// the other logger once written, but do not wait for it, while Flush()
+// does.
+//
+// This class is thread-safe.
+class AsyncLogger : public google::base::Logger {
+ public:
+  // Does not take ownership of |wrapped|, which must outlive this
+  // object.
+  AsyncLogger(google::base::Logger* wrapped, size_t max_buffer_bytes);
+  ~AsyncLogger() override;
+
+  void Write(bool force_flush, time_t timestamp, const char* message,
+             int message_len) override;
+
+  // Waits until everything written so far is written to the other
+  // logger, and flushes it.
+  void Flush() override;
+
+  google::uint32 LogSize() override;
+
+  // The number of messages dropped so far.
+  int64_t messages_dropped() const;
+
+ private:
+  struct Message {
+    time_t timestamp;
+    std::string text;
+  };
+
+  void WriterLoop();
+
+  google::base::Logger* const wrapped_;
+  const size_t max_buffer_bytes_;
+
+  mutable std::mutex lock_;
+  std::condition_variable wake_writer_;
+  std::condition_variable flushed_;
+  std::vector<Message> buffer_;
+  size_t buffer_bytes_;
+  bool force_flush_;
+  // Dropped since the last time the writer noted it in the log.
+  int64_t unreported_drops_;
+  int64_t total_drops_;
+  // Flush() waits for |flushes_done_| to reach its request.
+  int64_t flushes_requested_;
+  int64_t flushes_done_;
+  bool exiting_;
+
+  std::thread writer_;
+
+  DISALLOW_COPY_AND_ASSIGN(AsyncLogger);
+};
+
+
+// With --async_logging, replaces the loggers of the INFO, WARNING and
+// ERROR log files with AsyncLoggers, which are flushed at exit. The
+// FATAL one stays synchronous, for the last words of the process to be
+// written before it aborts. To be called once, after
+// google::InitGoogleLogging().
+void InstallAsyncLoggers();
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_UTIL_LOGGING_H_
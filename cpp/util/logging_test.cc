@@ -0,0 +1,188 @@
+#include "util/logging.h"
+
+#include <gtest/gtest.h>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::condition_variable;
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::to_string;
+using std::unique_lock;
+using std::vector;
+
+
+// Keeps what is written to it. While blocked, Write() waits for
+// Unblock().
+class FakeLogger : public google::base::Logger {
+ public:
+  FakeLogger() : blocked_(false), writing_(false), flushes_(0) {
+  }
+
+  void Write(bool force_flush, time_t timestamp, const char* message,
+             int message_len) override {
+    unique_lock<mutex> lock(lock_);
+    writing_ = true;
+    cv_.notify_all();
+    cv_.wait(lock, [this]() { return !blocked_; });
+    writing_ = false;
+    messages_.emplace_back(message, message_len);
+  }
+
+  void Flush() override {
+    lock_guard<mutex> lock(lock_);
+    ++flushes_;
+  }
+
+  google::uint32 LogSize() override {
+    return 0;
+  }
+
+  void Block() {
+    lock_guard<mutex> lock(lock_);
+    blocked_ = true;
+  }
+
+  // Waits for a Write() to be blocked.
+  void WaitForWrite() {
+    unique_lock<mutex> lock(lock_);
+    cv_.wait(lock, [this]() { return writing_; });
+  }
+
+  void Unblock() {
+    lock_guard<mutex> lock(lock_);
+    blocked_ = false;
+    cv_.notify_all();
+  }
+
+  vector<string> messages() {
+    lock_guard<mutex> lock(lock_);
+    return messages_;
+  }
+
+  int flushes() {
+    lock_guard<mutex> lock(lock_);
+    return flushes_;
+  }
+
+ private:
+  mutex lock_;
+  condition_variable cv_;
+  bool blocked_;
+  bool writing_;
+  vector<string> messages_;
+  int flushes_;
+};
+
+
+void Write(AsyncLogger* logger, const string& message) {
+  logger->Write(false, 0, message.data(), message.size());
+}
+
+
+TEST(AsyncLoggerTest, WritesInOrder) {
+  FakeLogger wrapped;
+  AsyncLogger logger(&wrapped, 1 << 20);
+  vector<string> expected;
+  for (int i(0); i < 1000; ++i) {
+    expected.emplace_back("message " + to_string(i) + "\n");
+    Write(&logger, expected.back());
+  }
+  logger.Flush();
+
+  EXPECT_EQ(expected, wrapped.messages());
+  EXPECT_LE(1, wrapped.flushes());
+  EXPECT_EQ(0, logger.messages_dropped());
+}
+
+
+TEST(AsyncLoggerTest, DropsWhenFull) {
+  FakeLogger wrapped;
+  AsyncLogger logger(&wrapped, 100);
+  wrapped.Block();
+  Write(&logger, "first\n");
+  wrapped.WaitForWrite();
+
+  // Only 5 of them fit while the writer is stuck on the first one.
+  for (int i(0); i < 10; ++i) {
+    Write(&logger, string(19, 'a' + i) + "\n");
+  }
+  EXPECT_EQ(5, logger.messages_dropped());
+
+  wrapped.Unblock();
+  logger.Flush();
+  const vector<string> messages(wrapped.messages());
+  ASSERT_EQ(7U, messages.size());
+  EXPECT_EQ("first\n", messages[0]);
+  for (int i(0); i < 5; ++i) {
+    EXPECT_EQ(string(19, 'a' + i) + "\n", messages[i + 1]);
+  }
+  EXPECT_EQ(
+      "Dropped 5 log messages, see --async_logging_buffer_kb\n",
+      messages[6]);
+
+  // There is room again.
+  Write(&logger, "last\n");
+  logger.Flush();
+  EXPECT_EQ("last\n", wrapped.messages().back());
+  EXPECT_EQ(5, logger.messages_dropped());
+}
+
+
+TEST(AsyncLoggerTest, FlushesOnDestruction) {
+  FakeLogger wrapped;
+  {
+    AsyncLogger logger(&wrapped, 1 << 20);
+    Write(&logger, "message\n");
+  }
+  EXPECT_EQ(vector<string>{"message\n"}, wrapped.messages());
+  EXPECT_LE(1, wrapped.flushes());
+}
+
+
+TEST(LogRateLimiterTest, OncePerPeriod) {
+  LogRateLimiter limiter;
+  EXPECT_TRUE(limiter.ShouldLog(3600, __FILE__, __LINE__));
+  for (int i(0); i < 100; ++i) {
+    EXPECT_FALSE(limiter.ShouldLog(3600, __FILE__, __LINE__));
+  }
+
+  LogRateLimiter zero;
+  EXPECT_TRUE(zero.ShouldLog(0, __FILE__, __LINE__));
+  EXPECT_TRUE(zero.ShouldLog(0, __FILE__, __LINE__));
+}
+
+
+int Count(int* count) {
+  return ++*count;
+}
+
+
+TEST(LogRateLimiterTest, SkipsFormatting) {
+  int first(0), second(0);
+  for (int i(0); i < 10; ++i) {
+    LOG_EVERY_N_SEC(INFO, 3600) << "first " << Count(&first);
+    // Every call site has its own.
+    LOG_EVERY_N_SEC(INFO, 3600) << "second " << Count(&second);
+  }
+  EXPECT_EQ(1, first);
+  EXPECT_EQ(1, second);
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -12,7 +12,9 @@ namespace cert_trans {
 
 using cert_trans::Gauge;
 using std::bind;
+using std::chrono::milliseconds;
 using std::chrono::seconds;
+using std::min;
 using std::mutex;
 using std::placeholders::_1;
 using std::placeholders::_2;
@@ -23,11 +25,19 @@ using std::unique_ptr;
 using std::vector;
 using util::Task;
 
-DEFINE_int32(master_keepalive_interval_seconds, 60,
+DEFINE_int32(master_keepalive_interval_seconds, 5,
              "Interval between refreshing mastership proposal.");
+DEFINE_int32(master_proposal_ttl_seconds, 15,
+             "TTL of the mastership proposals, which is how long the other "
+             "nodes wait for a master that died before electing another "
+             "one (must be more than --master_keepalive_interval_seconds).");
+DEFINE_int32(masterelection_initial_retry_delay_ms, 250,
+             "Milliseconds to delay before retrying a failed attempt to "
+             "create a proposal file the first time, doubling for every "
+             "failure after that.");
 DEFINE_int32(masterelection_retry_delay_seconds, 5,
-             "Seconds to delay before retrying a failed attempt to create a "
-             "proposal file.");
+             "Maximum number of seconds to delay before retrying a failed "
+             "attempt to create a proposal file.");
 
 namespace {
 
@@ -105,9 +115,12 @@ MasterElection::MasterElection(const shared_ptr<libevent::Base>& base,
       my_proposal_path_(proposal_dir_ + node_id),
       proposal_state_(ProposalState::NONE),
       running_(false),
+      retry_delay_(FLAGS_masterelection_initial_retry_delay_ms),
       backed_proposal_(kNoBacking),
       is_master_(false) {
   CHECK_NE(kNoBacking, node_id);
+  CHECK_GT(FLAGS_master_proposal_ttl_seconds,
+           FLAGS_master_keepalive_interval_seconds);
   is_master_gauge->Set(0);
   participating_in_election_gauge->Set(0);
 }
@@ -267,7 +280,7 @@ void MasterElection::CreateProposal() {
   EtcdClient::Response* const resp(new EtcdClient::Response);
   client_->CreateWithTTL(
       my_proposal_path_, kNoBacking,
-      seconds(FLAGS_master_keepalive_interval_seconds * 2), resp,
+      seconds(FLAGS_master_proposal_ttl_seconds), resp,
       new Task(bind(&MasterElection::ProposalCreateDone, this, resp, _1),
                base_.get()));
 }
@@ -283,14 +296,17 @@ void MasterElection::ProposalCreateDone(EtcdClient::Response* resp,
     proposal_creation_failures->Increment();
     Transition(lock, ProposalState::AWAITING_CREATION);
     LOG(WARNING) << "Problem creating proposal: " << task->status() << " "
-                 << "will retry.";
-    base_->Delay(seconds(FLAGS_masterelection_retry_delay_seconds),
+                 << "will retry in " << retry_delay_.count() << " ms.";
+    base_->Delay(retry_delay_,
                  new Task(bind(&MasterElection::CreateProposal, this),
                           base_.get()));
+    retry_delay_ = min<milliseconds>(
+        retry_delay_ * 2, seconds(FLAGS_masterelection_retry_delay_seconds));
     return;
   }
 
   Transition(lock, ProposalState::UP_TO_DATE);
+  retry_delay_ = milliseconds(FLAGS_masterelection_initial_retry_delay_ms);
 
   VLOG(1) << my_proposal_path_ << ": Mastership proposal created at index "
           << resp->etcd_index;
@@ -317,7 +333,8 @@ void MasterElection::ProposalCreateDone(EtcdClient::Response* resp,
 
 
 bool MasterElection::MaybeUpdateProposal(const unique_lock<mutex>& lock,
-                                         const string& backed) {
+                                         const string& backed,
+                                         bool refresh_only) {
   CHECK(lock.owns_lock());
   if (proposal_state_ == ProposalState::UPDATING ||
       proposal_state_ == ProposalState::AWAITING_UPDATE) {
@@ -332,32 +349,48 @@ bool MasterElection::MaybeUpdateProposal(const unique_lock<mutex>& lock,
     return false;
   }
   Transition(lock, ProposalState::AWAITING_UPDATE);
-  base_->Add(bind(&MasterElection::UpdateProposal, this, backed));
+  base_->Add(
+      bind(&MasterElection::UpdateProposal, this, backed, refresh_only));
   return true;
 }
 
 
-void MasterElection::UpdateProposal(const string& backed) {
+void MasterElection::UpdateProposal(const string& backed, bool refresh_only) {
   unique_lock<mutex> lock(mutex_);
   Transition(lock, ProposalState::UPDATING);
 
-  VLOG(1) << my_proposal_path_ << ": Updating proposal backing " << backed;
-
   // TODO(alcutter): Set the HTTP timeout inside here to something sensible.
   EtcdClient::Response* const resp(new EtcdClient::Response);
+  Task* const task(new Task(bind(&MasterElection::ProposalUpdateDone, this,
+                                 resp, refresh_only, _1),
+                            base_.get()));
+  if (refresh_only) {
+    VLOG(1) << my_proposal_path_ << ": Refreshing proposal TTL";
+    client_->RefreshTTL(my_proposal_path_,
+                        seconds(FLAGS_master_proposal_ttl_seconds), resp,
+                        task);
+    return;
+  }
+
+  VLOG(1) << my_proposal_path_ << ": Updating proposal backing " << backed;
   client_->UpdateWithTTL(my_proposal_path_, backed,
-                         seconds(FLAGS_master_keepalive_interval_seconds * 2),
-                         my_proposal_modified_index_, resp,
-                         new Task(bind(&MasterElection::ProposalUpdateDone,
-                                       this, resp, _1),
-                                  base_.get()));
+                         seconds(FLAGS_master_proposal_ttl_seconds),
+                         my_proposal_modified_index_, resp, task);
 }
 
 
 void MasterElection::ProposalUpdateDone(EtcdClient::Response* resp,
-                                        Task* task) {
+                                        bool refresh_only, Task* task) {
   unique_ptr<EtcdClient::Response> resp_deleter(resp);
   unique_lock<mutex> lock(mutex_);
+  if (refresh_only && !task->status().ok()) {
+    // The proposal lives on until its TTL expires, the next keep-alive
+    // will try again.
+    LOG(WARNING) << my_proposal_path_ << ": Problem refreshing proposal: "
+                 << task->status();
+    Transition(lock, ProposalState::UP_TO_DATE);
+    return;
+  }
   // TODO(alcutter): Handle this
   CHECK(task->status().ok()) << my_proposal_path_ << ": " << task->status();
   Transition(lock, ProposalState::UP_TO_DATE);
@@ -405,7 +438,9 @@ void MasterElection::ProposalKeepAliveCallback() {
     return;
   }
 
-  MaybeUpdateProposal(lock, backed_proposal_);
+  // Our backing does not change, so only the TTL is refreshed, which
+  // does not wake up the other participants.
+  MaybeUpdateProposal(lock, backed_proposal_, true /* refresh_only */);
 }
 
 
@@ -2,6 +2,7 @@
 #define CERT_TRANS_UTIL_MASTERELECTION_H_
 
 #include <stdint.h>
+#include <chrono>
 #include <condition_variable>
 #include <memory>
 #include <mutex>
@@ -35,7 +36,9 @@ class PeriodicClosure;
 // This helps to detect failed candidates and clear up after them.
 // In order to keep this from happening to live candidates, each instance
 // maintains a periodic callback whose sole job is to update the TTL on its
-// proposal file.
+// proposal file.  This only refreshes the TTL, without rewriting the
+// proposal, so that it does not wake up the other participants, and the TTL
+// can be kept short.
 //
 // TODO(alcutter): Some enhancements:
 //   - Recover gracefully from a crash where an old proposal exists for this
@@ -97,15 +100,18 @@ class MasterElection {
   // in-flight.  |backed| should contain the id of the proposal this node is
   // backing.
   bool MaybeUpdateProposal(const std::unique_lock<std::mutex>& lock,
-                           const std::string& backed);
+                           const std::string& backed,
+                           bool refresh_only = false);
 
   // Updates this node's proposal.  |backed| should contain the id of the
-  // proposal this node is backing.
+  // proposal this node is backing.  If |refresh_only|, the proposal
+  // already says that, and only its TTL is refreshed.
   // This should only be called on the base_ event thread.
-  void UpdateProposal(const std::string& backed);
+  void UpdateProposal(const std::string& backed, bool refresh_only);
 
-  // Called when our proposal file has been refreshed by the KeepAlive thread.
-  void ProposalUpdateDone(EtcdClient::Response* resp, util::Task* task);
+  // Called when our proposal file has been updated or refreshed.
+  void ProposalUpdateDone(EtcdClient::Response* resp, bool refresh_only,
+                          util::Task* task);
 
   // Deletes this node's proposal.
   // This should only be called on the base_ event thread.
@@ -154,6 +160,10 @@ class MasterElection {
   int64_t my_proposal_create_index_;
   int64_t my_proposal_modified_index_;
 
+  // How long to wait before trying to create our proposal again, if
+  // that fails.
+  std::chrono::milliseconds retry_delay_;
+
   std::string backed_proposal_;
 
   bool is_master_;
@@ -52,6 +52,7 @@ const char kProposalDir[] = "/master/";
 DEFINE_string(etcd, "", "etcd server address");
 DEFINE_int32(etcd_port, 4001, "etcd server port");
 DECLARE_int32(master_keepalive_interval_seconds);
+DECLARE_int32(master_proposal_ttl_seconds);
 DECLARE_int32(masterelection_retry_delay_seconds);
 
 
@@ -299,6 +300,28 @@ TEST_F(ElectionTest, RetresCreatingProposal) {
 }
 
 
+TEST_F(ElectionTest, KeepAliveOutlivesTTL) {
+  FLAGS_master_keepalive_interval_seconds = 1;
+  FLAGS_master_proposal_ttl_seconds = 2;
+  Participant one(kProposalDir, "1", base_, client_.get());
+  one.ElectLikeABoss();
+
+  // Well past the TTL of the proposal, which must have been refreshed.
+  sleep(5);
+  EXPECT_TRUE(one.IsMaster());
+  {
+    EtcdClient::GetResponse resp;
+    SyncTask task(base_.get());
+    client_->Get(EtcdClient::Request(string(kProposalDir) + "1"), &resp,
+                 task.task());
+    task.Wait();
+    EXPECT_OK(task.status());
+  }
+
+  one.StopElection();
+}
+
+
 TEST_F(ElectionTest, ElectionMania) {
   const int kNumRounds(20);
   const int kNumParticipants(20);
@@ -0,0 +1,131 @@
+#include "util/memory_accounting.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "monitoring/monitoring.h"
+
+using std::lock_guard;
+using std::map;
+using std::min;
+using std::mutex;
+using std::pair;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+DEFINE_int32(memory_budget_mb, 0,
+             "memory the caches (get-entries tiles, submitted SCTs, chain "
+             "certificates) are allowed to push the total of the accounted "
+             "subsystems to, in MB, beyond which they evict entries (0 for "
+             "no budget); the leveldb block cache counts towards the total, "
+             "but is only bounded by --leveldb_block_cache_size_mb");
+
+namespace cert_trans {
+namespace {
+
+
+static Gauge<string>* memory_bytes(
+    Gauge<string>::New("memory_bytes", "subsystem",
+                       "Memory held by the big in-memory structures, in "
+                       "bytes, by subsystem."));
+
+static Counter<string>* memory_evicted_bytes(
+    Counter<string>::New("memory_evicted_bytes", "subsystem",
+                         "Memory freed by evicting from the caches to stay "
+                         "within --memory_budget_mb, in bytes, by "
+                         "subsystem."));
+
+
+}  // namespace
+
+
+MemoryAccounting::Registration::~Registration() {
+  accounting_->Unregister(id_);
+}
+
+
+MemoryAccounting::MemoryAccounting(size_t budget_bytes)
+    : budget_bytes_(budget_bytes), next_id_(0) {
+}
+
+
+MemoryAccounting::~MemoryAccounting() {
+  CHECK(subsystems_.empty());
+}
+
+
+// static
+MemoryAccounting* MemoryAccounting::Instance() {
+  static MemoryAccounting* const instance(new MemoryAccounting(
+      static_cast<size_t>(FLAGS_memory_budget_mb) << 20));
+  return instance;
+}
+
+
+unique_ptr<MemoryAccounting::Registration> MemoryAccounting::Register(
+    const string& subsystem, const UsageFunction& usage,
+    const ShrinkFunction& shrink) {
+  CHECK(usage);
+  lock_guard<mutex> lock(lock_);
+  const int64_t id(next_id_++);
+  subsystems_[id] = Subsystem{subsystem, usage, shrink};
+  return unique_ptr<Registration>(new Registration(this, id));
+}
+
+
+void MemoryAccounting::Unregister(int64_t id) {
+  lock_guard<mutex> lock(lock_);
+  CHECK_EQ(1U, subsystems_.erase(id));
+}
+
+
+map<string, size_t> MemoryAccounting::Update() {
+  lock_guard<mutex> lock(lock_);
+  map<string, size_t> usage;
+  // The caches, by how much they hold.
+  vector<pair<size_t, const Subsystem*>> caches;
+  size_t total(0);
+  for (const auto& it : subsystems_) {
+    const Subsystem& subsystem(it.second);
+    const size_t bytes(subsystem.usage());
+    usage[subsystem.name] += bytes;
+    total += bytes;
+    if (subsystem.shrink) {
+      caches.emplace_back(bytes, &subsystem);
+    }
+  }
+
+  if (budget_bytes_ > 0 && total > budget_bytes_) {
+    std::sort(caches.begin(), caches.end(),
+              [](const pair<size_t, const Subsystem*>& a,
+                 const pair<size_t, const Subsystem*>& b) {
+                return a.first > b.first;
+              });
+    size_t excess(total - budget_bytes_);
+    for (const auto& cache : caches) {
+      if (excess == 0) {
+        break;
+      }
+      const Subsystem& subsystem(*cache.second);
+      const size_t freed(min(subsystem.shrink(excess), cache.first));
+      usage[subsystem.name] -= freed;
+      excess -= min(freed, excess);
+      memory_evicted_bytes->IncrementBy(subsystem.name, freed);
+    }
+    LOG_IF(WARNING, excess > 0)
+        << "Over the memory budget by " << excess
+        << " bytes, with nothing left to evict from the caches";
+  }
+
+  for (const auto& it : usage) {
+    memory_bytes->Set(it.first, it.second);
+  }
+  return usage;
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,109 @@
+#ifndef CERT_TRANS_UTIL_MEMORY_ACCOUNTING_H_
+#define CERT_TRANS_UTIL_MEMORY_ACCOUNTING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include "base/macros.h"
+
+namespace cert_trans {
+
+
+// Keeps track of the memory held by the big in-memory structures of
+// the process (the Merkle tree, the hash indexes, the caches...), by
+// subsystem, so that it can be told which one grew when the process
+// gets too large. Update() exports them as the memory_bytes gauge.
+//
+// With a budget, Update() also makes the caches among them evict
+// entries until the total is back under it, the largest first.
+//
+// This class is thread-safe.
+class MemoryAccounting {
+ public:
+  // Returns the number of bytes held.
+  typedef std::function<size_t()> UsageFunction;
+  // Frees (at least) |bytes|, or as much as possible, and returns the
+  // number of bytes actually freed.
+  typedef std::function<size_t(size_t bytes)> ShrinkFunction;
+
+  // Counts a subsystem for as long as it exists.
+  class Registration {
+   public:
+    ~Registration();
+
+   private:
+    Registration(MemoryAccounting* accounting, int64_t id)
+        : accounting_(accounting), id_(id) {
+    }
+
+    MemoryAccounting* const accounting_;
+    const int64_t id_;
+
+    friend class MemoryAccounting;
+
+    DISALLOW_COPY_AND_ASSIGN(Registration);
+  };
+
+  // The caches are shrunk when the total goes over |budget_bytes|
+  // (never if 0).
+  explicit MemoryAccounting(size_t budget_bytes);
+  ~MemoryAccounting();
+
+  // The one for the process, with a budget of --memory_budget_mb.
+  static MemoryAccounting* Instance();
+
+  // Counts what |usage| returns as held by |subsystem| (which several
+  // registrations can share, adding up), until the returned
+  // Registration is destroyed. If |shrink| is set, it is called to
+  // evict from the subsystem when over budget.
+  //
+  // They are called with a lock of this object held, the
+  // Registration must be destroyed before what they use (typically
+  // by being the last member of the object registering itself), and
+  // they must not register anything themselves.
+  std::unique_ptr<Registration> Register(
+      const std::string& subsystem, const UsageFunction& usage,
+      const ShrinkFunction& shrink = ShrinkFunction());
+
+  // Updates the memory_bytes gauge, and shrinks the caches if the
+  // total is over budget. Returns the bytes held by subsystem,
+  // after any shrinking.
+  std::map<std::string, size_t> Update();
+
+ private:
+  struct Subsystem {
+    std::string name;
+    UsageFunction usage;
+    ShrinkFunction shrink;
+  };
+
+  void Unregister(int64_t id);
+
+  const size_t budget_bytes_;
+
+  std::mutex lock_;
+  int64_t next_id_;
+  std::map<int64_t, Subsystem> subsystems_;
+
+  DISALLOW_COPY_AND_ASSIGN(MemoryAccounting);
+};
+
+
+// Approximately how much memory |values| takes, for a usual
+// implementation of std::set (a red-black tree, with three pointers
+// and a colour per node).
+template <class T>
+size_t SetMemoryUsage(const std::set<T>& values) {
+  return values.size() * (sizeof(T) + 4 * sizeof(void*));
+}
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_UTIL_MEMORY_ACCOUNTING_H_
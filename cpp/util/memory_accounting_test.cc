@@ -0,0 +1,138 @@
+#include "util/memory_accounting.h"
+
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::map;
+using std::min;
+using std::string;
+using std::unique_ptr;
+
+
+// A cache holding |bytes_|, which it gives back when asked to.
+class FakeCache {
+ public:
+  explicit FakeCache(size_t bytes) : bytes_(bytes), shrunk_(0) {
+  }
+
+  size_t Usage() const {
+    return bytes_;
+  }
+
+  size_t Shrink(size_t bytes) {
+    ++shrunk_;
+    const size_t freed(min(bytes, bytes_));
+    bytes_ -= freed;
+    return freed;
+  }
+
+  size_t bytes_;
+  int shrunk_;
+};
+
+
+unique_ptr<MemoryAccounting::Registration> RegisterCache(
+    MemoryAccounting* accounting, const string& subsystem, FakeCache* cache) {
+  return accounting->Register(subsystem, [cache]() { return cache->Usage(); },
+                              [cache](size_t bytes) {
+                                return cache->Shrink(bytes);
+                              });
+}
+
+
+TEST(MemoryAccountingTest, SumsBySubsystem) {
+  MemoryAccounting accounting(0);
+  const unique_ptr<MemoryAccounting::Registration> one(
+      accounting.Register("tree", []() { return 100; }));
+  const unique_ptr<MemoryAccounting::Registration> two(
+      accounting.Register("tree", []() { return 20; }));
+  const unique_ptr<MemoryAccounting::Registration> three(
+      accounting.Register("index", []() { return 3; }));
+
+  const map<string, size_t> usage(accounting.Update());
+  EXPECT_EQ((map<string, size_t>{{"index", 3}, {"tree", 120}}), usage);
+}
+
+
+TEST(MemoryAccountingTest, Unregisters) {
+  MemoryAccounting accounting(0);
+  const unique_ptr<MemoryAccounting::Registration> kept(
+      accounting.Register("tree", []() { return 100; }));
+  accounting.Register("index", []() { return 3; }).reset();
+
+  const map<string, size_t> usage(accounting.Update());
+  EXPECT_EQ((map<string, size_t>{{"tree", 100}}), usage);
+}
+
+
+TEST(MemoryAccountingTest, NothingShrunkWithinBudget) {
+  MemoryAccounting accounting(1000);
+  FakeCache cache(500);
+  const unique_ptr<MemoryAccounting::Registration> registration(
+      RegisterCache(&accounting, "cache", &cache));
+  const unique_ptr<MemoryAccounting::Registration> tree(
+      accounting.Register("tree", []() { return 500; }));
+
+  accounting.Update();
+  EXPECT_EQ(0, cache.shrunk_);
+  EXPECT_EQ(500U, cache.bytes_);
+}
+
+
+TEST(MemoryAccountingTest, ShrinksLargestCacheFirst) {
+  MemoryAccounting accounting(1000);
+  FakeCache small(200);
+  FakeCache large(600);
+  const unique_ptr<MemoryAccounting::Registration> small_registration(
+      RegisterCache(&accounting, "small", &small));
+  const unique_ptr<MemoryAccounting::Registration> large_registration(
+      RegisterCache(&accounting, "large", &large));
+  // Not a cache, never shrunk.
+  const unique_ptr<MemoryAccounting::Registration> tree(
+      accounting.Register("tree", []() { return 500; }));
+
+  // 300 over, which the largest cache can free by itself.
+  map<string, size_t> usage(accounting.Update());
+  EXPECT_EQ(0, small.shrunk_);
+  EXPECT_EQ(1, large.shrunk_);
+  EXPECT_EQ(300U, large.bytes_);
+  EXPECT_EQ(
+      (map<string, size_t>{{"large", 300}, {"small", 200}, {"tree", 500}}),
+      usage);
+
+  // 400 over, all from the new cache, now the largest.
+  FakeCache more(400);
+  const unique_ptr<MemoryAccounting::Registration> more_registration(
+      RegisterCache(&accounting, "more", &more));
+  usage = accounting.Update();
+  EXPECT_EQ(0U, more.bytes_);
+  EXPECT_EQ(300U, large.bytes_);
+  EXPECT_EQ(200U, small.bytes_);
+
+  // More than all of them hold.
+  const unique_ptr<MemoryAccounting::Registration> huge_tree(
+      accounting.Register("tree", []() { return 2000; }));
+  usage = accounting.Update();
+  EXPECT_EQ(0U, large.bytes_);
+  EXPECT_EQ(0U, small.bytes_);
+  EXPECT_EQ(0U, usage["large"]);
+  EXPECT_EQ(2500U, usage["tree"]);
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
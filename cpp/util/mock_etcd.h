@@ -32,9 +32,14 @@ class MockEtcdClient : public EtcdClient {
                void(const std::string& key, const std::string& value,
                     const std::chrono::seconds& ttl, Response* resp,
                     util::Task* task));
+  MOCK_METHOD4(RefreshTTL,
+               void(const std::string& key, const std::chrono::seconds& ttl,
+                    Response* resp, util::Task* task));
   MOCK_METHOD3(Delete, void(const std::string& key,
                             const int64_t current_index, util::Task* task));
   MOCK_METHOD2(ForceDelete, void(const std::string& key, util::Task* task));
+  MOCK_METHOD3(Txn, void(const std::vector<TxnOp>& ops, TxnResponse* resp,
+                         util::Task* task));
   MOCK_METHOD2(GetStoreStats,
                void(EtcdClient::StatsResponse* resp, util::Task* task));
   MOCK_METHOD3(Watch, void(const std::string& key, const WatchCallback& cb,
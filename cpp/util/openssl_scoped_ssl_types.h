@@ -10,6 +10,7 @@ namespace cert_trans {
 
 using ScopedSSL = ScopedOpenSSLType<SSL, SSL_free>;
 using ScopedSSL_CTX = ScopedOpenSSLType<SSL_CTX, SSL_CTX_free>;
+using ScopedSSL_SESSION = ScopedOpenSSLType<SSL_SESSION, SSL_SESSION_free>;
 
 
 }  // namespace cert_trans
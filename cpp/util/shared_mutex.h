@@ -0,0 +1,80 @@
+#ifndef CERT_TRANS_UTIL_SHARED_MUTEX_H_
+#define CERT_TRANS_UTIL_SHARED_MUTEX_H_
+
+#include <glog/logging.h>
+#include <pthread.h>
+
+#include "base/macros.h"
+
+namespace cert_trans {
+
+
+// A reader/writer mutex, with the same interface as C++17's
+// std::shared_mutex (which we cannot use yet), so that it works with
+// std::lock_guard and std::unique_lock for exclusive ownership, and
+// with SharedLock below for shared ownership.
+//
+// Where supported, writers are given preference over new readers, so
+// that a steady stream of readers cannot starve them.
+class SharedMutex {
+ public:
+  SharedMutex() {
+    pthread_rwlockattr_t attr;
+    CHECK_EQ(0, pthread_rwlockattr_init(&attr));
+#ifdef __GLIBC__
+    CHECK_EQ(0, pthread_rwlockattr_setkind_np(
+                    &attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP));
+#endif
+    CHECK_EQ(0, pthread_rwlock_init(&rwlock_, &attr));
+    CHECK_EQ(0, pthread_rwlockattr_destroy(&attr));
+  }
+
+  ~SharedMutex() {
+    CHECK_EQ(0, pthread_rwlock_destroy(&rwlock_));
+  }
+
+  void lock() {
+    CHECK_EQ(0, pthread_rwlock_wrlock(&rwlock_));
+  }
+
+  void unlock() {
+    CHECK_EQ(0, pthread_rwlock_unlock(&rwlock_));
+  }
+
+  void lock_shared() {
+    CHECK_EQ(0, pthread_rwlock_rdlock(&rwlock_));
+  }
+
+  void unlock_shared() {
+    CHECK_EQ(0, pthread_rwlock_unlock(&rwlock_));
+  }
+
+ private:
+  pthread_rwlock_t rwlock_;
+
+  DISALLOW_COPY_AND_ASSIGN(SharedMutex);
+};
+
+
+// Holds a SharedMutex in shared mode for its lifetime (a minimal
+// std::shared_lock).
+class SharedLock {
+ public:
+  explicit SharedLock(SharedMutex* mutex) : mutex_(CHECK_NOTNULL(mutex)) {
+    mutex_->lock_shared();
+  }
+
+  ~SharedLock() {
+    mutex_->unlock_shared();
+  }
+
+ private:
+  SharedMutex* const mutex_;
+
+  DISALLOW_COPY_AND_ASSIGN(SharedLock);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_UTIL_SHARED_MUTEX_H_
@@ -0,0 +1,106 @@
+#ifndef CERT_TRANS_UTIL_SINGLE_FLIGHT_CACHE_H_
+#define CERT_TRANS_UTIL_SINGLE_FLIGHT_CACHE_H_
+
+#include <stddef.h>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include "base/macros.h"
+
+namespace cert_trans {
+
+
+// Computes values by key, at most once at a time for a given key:
+// callers asking for a key that is already being computed wait for
+// that result, rather than all computing it. The |max_size| most
+// recently used values are also kept for later callers.
+//
+// Only suitable for values that do not change once computed.
+//
+// This class is thread-safe.
+template <class Key, class Value>
+class SingleFlightCache {
+ public:
+  explicit SingleFlightCache(size_t max_size) : max_size_(max_size) {
+  }
+
+  // Returns the value for |key|, calling |compute| (without any lock
+  // held) if it is neither cached nor being computed already.
+  Value Get(const Key& key, const std::function<Value()>& compute);
+
+  // The number of values kept.
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(lock_);
+    return lru_.size();
+  }
+
+ private:
+  struct Flight {
+    bool ready;
+    Value value;
+  };
+
+  const size_t max_size_;
+
+  mutable std::mutex lock_;
+  std::condition_variable ready_cond_var_;
+  // The values being computed, shared with whoever waits for them.
+  std::map<Key, std::shared_ptr<Flight>> in_flight_;
+  // The values kept, with their position in |lru_|.
+  std::map<Key, std::pair<Value, typename std::list<Key>::iterator>> values_;
+  // The keys of |values_|, most recently used first.
+  std::list<Key> lru_;
+
+  DISALLOW_COPY_AND_ASSIGN(SingleFlightCache);
+};
+
+
+template <class Key, class Value>
+Value SingleFlightCache<Key, Value>::Get(
+    const Key& key, const std::function<Value()>& compute) {
+  std::unique_lock<std::mutex> lock(lock_);
+  const auto kept(values_.find(key));
+  if (kept != values_.end()) {
+    lru_.splice(lru_.begin(), lru_, kept->second.second);
+    return kept->second.first;
+  }
+
+  const auto in_flight(in_flight_.find(key));
+  if (in_flight != in_flight_.end()) {
+    // The result is ours even if it does not stay in the cache.
+    const std::shared_ptr<Flight> flight(in_flight->second);
+    ready_cond_var_.wait(lock, [&flight]() { return flight->ready; });
+    return flight->value;
+  }
+
+  const std::shared_ptr<Flight> flight(std::make_shared<Flight>());
+  flight->ready = false;
+  in_flight_.emplace(key, flight);
+  lock.unlock();
+  const Value value(compute());
+  lock.lock();
+
+  flight->ready = true;
+  flight->value = value;
+  in_flight_.erase(key);
+  if (max_size_ > 0) {
+    values_.emplace(key, std::make_pair(value, lru_.insert(lru_.begin(), key)));
+    while (lru_.size() > max_size_) {
+      values_.erase(lru_.back());
+      lru_.pop_back();
+    }
+  }
+  ready_cond_var_.notify_all();
+
+  return value;
+}
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_UTIL_SINGLE_FLIGHT_CACHE_H_
@@ -0,0 +1,108 @@
+#include "util/single_flight_cache.h"
+
+#include <gtest/gtest.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base/notification.h"
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::atomic;
+using std::string;
+using std::thread;
+using std::to_string;
+using std::vector;
+
+
+class SingleFlightCacheTest : public ::testing::Test {
+ protected:
+  SingleFlightCacheTest() : num_computed_(0) {
+  }
+
+  string Compute(int key) {
+    ++num_computed_;
+    return to_string(key);
+  }
+
+  std::function<string()> Computer(int key) {
+    return [this, key]() { return Compute(key); };
+  }
+
+  atomic<int> num_computed_;
+};
+
+
+TEST_F(SingleFlightCacheTest, KeepsRecentValues) {
+  SingleFlightCache<int, string> cache(2);
+  EXPECT_EQ("1", cache.Get(1, Computer(1)));
+  EXPECT_EQ("2", cache.Get(2, Computer(2)));
+  EXPECT_EQ("1", cache.Get(1, Computer(1)));
+  EXPECT_EQ(2, num_computed_.load());
+
+  // 2 is the least recently used.
+  EXPECT_EQ("3", cache.Get(3, Computer(3)));
+  EXPECT_EQ(2U, cache.size());
+  EXPECT_EQ("1", cache.Get(1, Computer(1)));
+  EXPECT_EQ(3, num_computed_.load());
+  EXPECT_EQ("2", cache.Get(2, Computer(2)));
+  EXPECT_EQ(4, num_computed_.load());
+}
+
+
+TEST_F(SingleFlightCacheTest, CoalescesConcurrentCalls) {
+  SingleFlightCache<int, string> cache(1);
+  Notification computing;
+  Notification finish;
+
+  thread first([this, &cache, &computing, &finish]() {
+    EXPECT_EQ("42", cache.Get(42, [this, &computing, &finish]() {
+      computing.Notify();
+      finish.WaitForNotification();
+      return Compute(42);
+    }));
+  });
+  computing.WaitForNotification();
+
+  vector<thread> others;
+  for (int i = 0; i < 4; ++i) {
+    others.emplace_back([this, &cache]() {
+      EXPECT_EQ("42", cache.Get(42, Computer(42)));
+    });
+  }
+  // Another key is not held up.
+  EXPECT_EQ("7", cache.Get(7, Computer(7)));
+
+  finish.Notify();
+  first.join();
+  for (auto& other : others) {
+    other.join();
+  }
+  // The others either waited for the first one, or came late enough
+  // to find its result in the cache.
+  EXPECT_EQ(2, num_computed_.load());
+  EXPECT_EQ(1U, cache.size());
+}
+
+
+TEST_F(SingleFlightCacheTest, NothingKept) {
+  SingleFlightCache<int, string> cache(0);
+  EXPECT_EQ("1", cache.Get(1, Computer(1)));
+  EXPECT_EQ("1", cache.Get(1, Computer(1)));
+  EXPECT_EQ(2, num_computed_.load());
+  EXPECT_EQ(0U, cache.size());
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
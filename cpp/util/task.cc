@@ -5,11 +5,8 @@
 using std::bind;
 using std::function;
 using std::lock_guard;
-using std::make_shared;
 using std::mutex;
 using std::ostream;
-using std::placeholders::_1;
-using std::shared_ptr;
 using std::unique_lock;
 using std::vector;
 
@@ -17,17 +14,29 @@ namespace util {
 
 
 Task::Task(const function<void(Task*)>& done_callback, Executor* executor)
+    : Task(done_callback, executor, nullptr) {
+}
+
+
+Task::Task(const function<void(Task*)>& done_callback, Executor* executor,
+           Task* parent)
     : done_callback_(done_callback),
       executor_(CHECK_NOTNULL(executor)),
+      parent_(parent),
       state_(ACTIVE),
       cancelled_(false),
-      holds_(0) {
+      holds_(0),
+      first_child_(nullptr),
+      prev_sibling_(nullptr),
+      next_sibling_(nullptr),
+      refs_(1) {
 }
 
 
 Task::~Task() {
   CHECK_EQ(state_, DONE);
   CHECK(cancel_callbacks_.empty());
+  CHECK(!first_child_);
 }
 
 
@@ -47,18 +56,18 @@ void Task::Cancel() {
   // into the DONE state until they all have completed.
   holds_ += cancel_callbacks.size();
 
-  // Take a copy of the child tasks before giving back the lock. Since
-  // these are shared_ptrs, having a copy will protect us in case some
-  // of them complete and get removed (which will free them). Any
-  // child tasks created after giving back the lock will be already
-  // cancelled, so no need to cancel them here.
-  const vector<shared_ptr<Task>> child_tasks(child_tasks_);
+  // Take references on the child tasks before giving back the lock,
+  // so that they are not freed if some of them complete in the
+  // meantime. Any child tasks created after giving back the lock will
+  // be already cancelled, so no need to cancel them here.
+  const vector<Task*> child_tasks(RefChildren());
 
   // Give up the lock, in case the executor is synchronous.
   lock.unlock();
 
-  for (const auto& child_task : child_tasks) {
+  for (Task* const child_task : child_tasks) {
     child_task->Cancel();
+    Unref(child_task);
   }
 
   for (const auto& cb : cancel_callbacks) {
@@ -68,7 +77,8 @@ void Task::Cancel() {
 
 
 Status Task::status() const {
-  lock_guard<mutex> lock(lock_);
+  // |status_| is set before leaving the ACTIVE state, and never
+  // changes after that.
   CHECK_NE(state_, ACTIVE);
   return status_;
 }
@@ -85,10 +95,10 @@ bool Task::Return(const Status& status) {
   state_ = PREPARED;
   cancel_callbacks_.clear();
 
-  // Take a copy of the child tasks, so we can still access it after
-  // calling TryDoneTransition(). See Task::Cancel() for more
+  // Take references on the child tasks, so we can still access them
+  // after calling TryDoneTransition(). See Task::Cancel() for more
   // explanation.
-  const vector<shared_ptr<Task>> child_tasks(child_tasks_);
+  const vector<Task*> child_tasks(RefChildren());
 
   // Do not touch any members after this, as the task object might be
   // deleted by the time this method returns.
@@ -100,8 +110,9 @@ bool Task::Return(const Status& status) {
     lock.unlock();
   }
 
-  for (const auto& child_task : child_tasks) {
+  for (Task* const child_task : child_tasks) {
     child_task->Cancel();
+    Unref(child_task);
   }
 
   return true;
@@ -129,19 +140,16 @@ void Task::RemoveHold() {
 
 
 bool Task::IsActive() const {
-  lock_guard<mutex> lock(lock_);
   return state_ == ACTIVE;
 }
 
 
 bool Task::IsDone() const {
-  lock_guard<mutex> lock(lock_);
   return state_ == DONE;
 }
 
 
 bool Task::CancelRequested() const {
-  lock_guard<mutex> lock(lock_);
   return cancelled_;
 }
 
@@ -167,26 +175,33 @@ void Task::WhenCancelled(const std::function<void()>& cancel_cb) {
 
 Task* Task::AddChildWithExecutor(const function<void(Task*)>& done_callback,
                                  Executor* executor) {
-  const shared_ptr<Task> child_task(make_shared<Task>(
-      bind(&Task::RunChildDoneCallback, this, done_callback, _1),
-      CHECK_NOTNULL(executor)));
+  Task* const child_task(
+      new Task(done_callback, CHECK_NOTNULL(executor), this));
   bool cancel;
 
   {
     lock_guard<mutex> lock(lock_);
     CHECK_NE(state_, DONE);
 
-    child_tasks_.emplace_back(child_task);
+    child_task->next_sibling_ = first_child_;
+    if (first_child_) {
+      first_child_->prev_sibling_ = child_task;
+    }
+    first_child_ = child_task;
     ++holds_;
 
     cancel = state_ != ACTIVE || cancelled_;
+    if (cancel) {
+      ++child_task->refs_;
+    }
   }
 
   if (cancel) {
     child_task->Cancel();
+    Unref(child_task);
   }
 
-  return child_task.get();
+  return child_task;
 }
 
 
@@ -219,8 +234,9 @@ void Task::TryDoneTransition(unique_lock<mutex>* lock) {
   // executor is synchronous.
   lock->unlock();
 
-  // Once this is called, the task might get deleted.
-  executor_->Add(bind(&Task::RunCleanupAndDoneCallbacks, this));
+  // Once this is called, the task might get deleted. A lambda with
+  // only a pointer fits in the std::function without an allocation.
+  executor_->Add([this]() { RunCleanupAndDoneCallbacks(); });
 }
 
 
@@ -247,28 +263,31 @@ void Task::RunCleanupAndDoneCallbacks() {
     cb();
   }
 
-  // Once this is called, the task might get deleted.
+  // Once this is called, the task might get deleted, unless it is a
+  // child task, which belongs to its parent.
+  Task* const parent(parent_);
   done_callback_(this);
+  if (parent) {
+    parent->ChildDone(this);
+  }
 }
 
 
-void Task::RunChildDoneCallback(const function<void(Task*)>& done_callback,
-                                Task* child_task) {
-  done_callback(child_task);
-
+void Task::ChildDone(Task* child_task) {
   unique_lock<mutex> lock(lock_);
-  vector<shared_ptr<Task>>::iterator it;
-  for (it = child_tasks_.begin(); it != child_tasks_.end(); ++it) {
-    if (it->get() == child_task) {
-      break;
-    }
-  }
-
-  CHECK(it != child_tasks_.end());
   CHECK_GT(holds_, 0);
   CHECK_NE(state_, DONE);
 
-  child_tasks_.erase(it);
+  if (child_task->prev_sibling_) {
+    child_task->prev_sibling_->next_sibling_ = child_task->next_sibling_;
+  } else {
+    CHECK_EQ(first_child_, child_task);
+    first_child_ = child_task->next_sibling_;
+  }
+  if (child_task->next_sibling_) {
+    child_task->next_sibling_->prev_sibling_ = child_task->prev_sibling_;
+  }
+  Unref(child_task);
   --holds_;
 
   // Do not touch any members after this, as the task object might be
@@ -277,4 +296,23 @@ void Task::RunChildDoneCallback(const function<void(Task*)>& done_callback,
 }
 
 
+vector<Task*> Task::RefChildren() const {
+  vector<Task*> child_tasks;
+  for (Task* child_task = first_child_; child_task;
+       child_task = child_task->next_sibling_) {
+    ++child_task->refs_;
+    child_tasks.push_back(child_task);
+  }
+  return child_tasks;
+}
+
+
+// static
+void Task::Unref(Task* child_task) {
+  if (--child_task->refs_ == 0) {
+    delete child_task;
+  }
+}
+
+
 }  // namespace util
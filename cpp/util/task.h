@@ -22,6 +22,7 @@
 #ifndef CERT_TRANS_UTIL_TASK_H_
 #define CERT_TRANS_UTIL_TASK_H_
 
+#include <atomic>
 #include <functional>
 #include <memory>
 #include <mutex>
@@ -162,23 +163,40 @@ class Task {
     DONE = 2,
   };
 
+  // For AddChildWithExecutor().
+  Task(const std::function<void(Task*)>& done_callback, Executor* executor,
+       Task* parent);
+
   void TryDoneTransition(std::unique_lock<std::mutex>* lock);
   void RunCancelCallback(const std::function<void()>& cb);
   void RunCleanupAndDoneCallbacks();
-  void RunChildDoneCallback(const std::function<void(Task*)>& done_callback,
-                            Task* child_task);
+  // Called once the done callback of |child_task| has returned.
+  void ChildDone(Task* child_task);
+  // Returns the child tasks, with a reference taken on each of them,
+  // to be released with Unref(). |lock_| must be held.
+  std::vector<Task*> RefChildren() const;
+  static void Unref(Task* child_task);
 
   const std::function<void(Task*)> done_callback_;
   Executor* const executor_;
+  // The task this is a child of, if any.
+  Task* const parent_;
 
   mutable std::mutex lock_;
-  State state_;
+  // These are only changed with |lock_| held, but can be read without
+  // it.
+  std::atomic<State> state_;
+  std::atomic<bool> cancelled_;
   Status status_;  // not protected by lock_
-  bool cancelled_;
   int holds_;
-  // References to child tasks are kept as shared pointers to avoid
-  // some races.
-  std::vector<std::shared_ptr<Task>> child_tasks_;
+  // The child tasks are linked through their |prev_sibling_| and
+  // |next_sibling_|, which are protected by the |lock_| of their
+  // parent. A child task is deleted once it is out of that list, and
+  // nobody else holds a reference to it (see RefChildren()).
+  Task* first_child_;
+  Task* prev_sibling_;
+  Task* next_sibling_;
+  std::atomic<int> refs_;
   std::vector<std::function<void()>> cancel_callbacks_;
   std::vector<std::function<void()>> cleanup_callbacks_;
 
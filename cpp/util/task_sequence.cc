@@ -0,0 +1,56 @@
+#include "util/task_sequence.h"
+
+#include <glog/logging.h>
+#include <memory>
+
+using std::make_shared;
+using std::shared_ptr;
+using std::vector;
+
+namespace util {
+namespace {
+
+
+typedef vector<TaskSequence::Step> Steps;
+
+
+void RunStep(Task* task, const shared_ptr<const Steps>& steps, size_t index) {
+  if (index == steps->size()) {
+    task->Return();
+    return;
+  }
+  if (task->CancelRequested()) {
+    task->Return(Status::CANCELLED);
+    return;
+  }
+
+  (*steps)[index](task->AddChild([task, steps, index](Task* step) {
+    if (!step->status().ok()) {
+      task->Return(step->status());
+      return;
+    }
+    RunStep(task, steps, index + 1);
+  }));
+}
+
+
+}  // namespace
+
+
+TaskSequence::TaskSequence(Task* task) : task_(CHECK_NOTNULL(task)) {
+}
+
+
+TaskSequence& TaskSequence::Then(const Step& step) {
+  CHECK(step);
+  steps_.push_back(step);
+  return *this;
+}
+
+
+void TaskSequence::Run() {
+  RunStep(task_, make_shared<const Steps>(steps_), 0);
+}
+
+
+}  // namespace util
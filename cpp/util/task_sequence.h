@@ -0,0 +1,60 @@
+#ifndef CERT_TRANS_UTIL_TASK_SEQUENCE_H_
+#define CERT_TRANS_UTIL_TASK_SEQUENCE_H_
+
+#include <functional>
+#include <vector>
+
+#include "base/macros.h"
+#include "util/task.h"
+
+namespace util {
+
+
+// Runs asynchronous operations one after the other on behalf of a
+// task, which reads like a series of co_await in a coroutine (which
+// C++11 does not have), without any thread waiting in between.
+//
+// Every step is started with a new child task of |task|, to pass to
+// an asynchronous operation such as EtcdClient::Get() or
+// UrlFetcher::Fetch() (or to return right away, for a step that does
+// not wait on anything). The next step starts, on the executor of
+// |task|, once that child task is done. The first step to fail
+// returns |task| with its status, and if |task| is cancelled, the
+// steps not started yet are not run and it returns CANCELLED.
+// Otherwise, |task| returns OK after the last step.
+//
+//   util::TaskSequence(task)
+//       .Then([client, path, resp](util::Task* step) {
+//         client->Get(path, resp, step);
+//       })
+//       .Then([client, path, resp, update_resp](util::Task* step) {
+//         client->Update(path, NewValue(resp->node.value_),
+//                        resp->node.modified_index_, update_resp, step);
+//       })
+//       .Run();
+//
+// The steps are copied when Run() is called, so the TaskSequence
+// object itself can go away right after. What they capture must stay
+// valid until |task| is done, which DeleteWhenDone() can help with.
+class TaskSequence {
+ public:
+  typedef std::function<void(Task* step)> Step;
+
+  explicit TaskSequence(Task* task);
+
+  TaskSequence& Then(const Step& step);
+
+  // Starts the first step.
+  void Run();
+
+ private:
+  Task* const task_;
+  std::vector<Step> steps_;
+
+  DISALLOW_COPY_AND_ASSIGN(TaskSequence);
+};
+
+
+}  // namespace util
+
+#endif  // CERT_TRANS_UTIL_TASK_SEQUENCE_H_
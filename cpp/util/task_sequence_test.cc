@@ -0,0 +1,106 @@
+#include <gtest/gtest.h>
+#include <mutex>
+#include <vector>
+
+#include "util/sync_task.h"
+#include "util/task_sequence.h"
+#include "util/testing.h"
+#include "util/thread_pool.h"
+
+using cert_trans::ThreadPool;
+using std::lock_guard;
+using std::mutex;
+using std::vector;
+
+namespace {
+
+
+class TaskSequenceTest : public ::testing::Test {
+ protected:
+  // Returns a step that records |id| and returns with |status|, from
+  // another thread of the pool.
+  util::TaskSequence::Step Record(int id, const util::Status& status) {
+    return [this, id, status](util::Task* step) {
+      pool_.Add([this, id, status, step]() {
+        {
+          lock_guard<mutex> lock(lock_);
+          ran_.push_back(id);
+        }
+        step->Return(status);
+      });
+    };
+  }
+
+  vector<int> ran() {
+    lock_guard<mutex> lock(lock_);
+    return ran_;
+  }
+
+  ThreadPool pool_;
+  mutex lock_;
+  vector<int> ran_;
+};
+
+
+TEST_F(TaskSequenceTest, RunsStepsInOrder) {
+  util::SyncTask s(&pool_);
+  util::TaskSequence(s.task())
+      .Then(Record(1, util::Status::OK))
+      .Then(Record(2, util::Status::OK))
+      .Then(Record(3, util::Status::OK))
+      .Run();
+  s.Wait();
+
+  EXPECT_EQ(util::Status::OK, s.status());
+  EXPECT_EQ(vector<int>({1, 2, 3}), ran());
+}
+
+
+TEST_F(TaskSequenceTest, NoSteps) {
+  util::SyncTask s(&pool_);
+  util::TaskSequence(s.task()).Run();
+  s.Wait();
+
+  EXPECT_EQ(util::Status::OK, s.status());
+}
+
+
+TEST_F(TaskSequenceTest, StopsAtFirstFailure) {
+  const util::Status status(util::error::NOT_FOUND, "no such thing");
+  util::SyncTask s(&pool_);
+  util::TaskSequence(s.task())
+      .Then(Record(1, util::Status::OK))
+      .Then(Record(2, status))
+      .Then(Record(3, util::Status::OK))
+      .Run();
+  s.Wait();
+
+  EXPECT_EQ(status, s.status());
+  EXPECT_EQ(vector<int>({1, 2}), ran());
+}
+
+
+TEST_F(TaskSequenceTest, StopsWhenCancelled) {
+  util::SyncTask s(&pool_);
+  util::TaskSequence(s.task())
+      .Then(Record(1, util::Status::OK))
+      .Then([&s](util::Task* step) {
+        s.Cancel();
+        step->Return();
+      })
+      .Then(Record(3, util::Status::OK))
+      .Run();
+  s.Wait();
+
+  EXPECT_EQ(util::Status::CANCELLED, s.status());
+  EXPECT_EQ(vector<int>({1}), ran());
+}
+
+
+}  // namespace
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
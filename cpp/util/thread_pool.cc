@@ -1,49 +1,258 @@
+#include "config.h"
 #include "util/thread_pool.h"
+#include "monitoring/monitoring.h"
+#include "util/cpu_affinity.h"
 #include "util/task.h"
+#include "util/timer_wheel.h"
+#include "util/util.h"
 
 #include <glog/logging.h>
+#include <atomic>
 #include <condition_variable>
+#include <deque>
 #include <mutex>
-#include <queue>
 #include <thread>
 #include <vector>
 
+using std::atomic;
+using std::bind;
 using std::chrono::duration;
 using std::chrono::duration_cast;
+using std::chrono::microseconds;
 using std::chrono::seconds;
 using std::chrono::steady_clock;
 using std::condition_variable;
+using std::deque;
 using std::function;
-using std::get;
 using std::lock_guard;
+using std::move;
 using std::mutex;
-using std::priority_queue;
+using std::placeholders::_1;
+using std::string;
 using std::thread;
-using std::tuple;
 using std::unique_lock;
+using std::unique_ptr;
 using std::vector;
 
 namespace cert_trans {
 namespace {
 
-typedef tuple<steady_clock::time_point, function<void()>, util::Task*>
-    QueueEntry;
 
+static Gauge<string>* thread_pool_queued_closures(
+    Gauge<string>::New("thread_pool_queued_closures", "pool",
+                       "Number of closures waiting for a thread, by pool."));
 
-struct QueueOrdering {
-  bool operator()(const QueueEntry& lhs, const QueueEntry& rhs) const {
-    return get<0>(lhs) > get<0>(rhs);
+static Histogram<string>* thread_pool_wait_time_us(
+    Histogram<string>::New("thread_pool_wait_time_us", "pool",
+                           "Time closures spent waiting for a thread in us, "
+                           "by pool."));
+
+static Histogram<string>* thread_pool_run_time_us(
+    Histogram<string>::New("thread_pool_run_time_us", "pool",
+                           "Time closures took to run in us, by pool."));
+
+
+// Names the threads of named pools after them, so that they can be
+// told apart in top -H, for example, and pins them to the CPUs given
+// for them in --cpu_affinity.
+void NameWorkerThread(const string& name) {
+  if (!name.empty()) {
+    util::SetThreadName(name);
+    PinThread(name);
   }
+}
+
+
+// Keeps the delayed tasks of a pool in a timer wheel, with a thread
+// adding them to the pool once they are due.
+class DelayedTasks {
+ public:
+  explicit DelayedTasks(const function<void(const function<void()>&)>& add);
+  ~DelayedTasks();
+
+  void Delay(const steady_clock::time_point& when, util::Task* task);
+
+  // Stops the thread, no more tasks are added to the pool after that.
+  void Stop();
+  // Cancels the tasks that are still pending.
+  void CancelPending();
+
+ private:
+  void Run();
+
+  const function<void(const function<void()>&)> add_;
+  TimerWheel wheel_;
+
+  mutex lock_;
+  condition_variable cond_var_;
+  bool stopping_;
+
+  thread thread_;
 };
 
 
+DelayedTasks::DelayedTasks(
+    const function<void(const function<void()>&)>& add)
+    : add_(add), stopping_(false), thread_(&DelayedTasks::Run, this) {
+}
+
+
+DelayedTasks::~DelayedTasks() {
+  CHECK(stopping_);
+}
+
+
+void DelayedTasks::Delay(const steady_clock::time_point& when,
+                         util::Task* task) {
+  // Cancellation takes the task back out of the wheel, without
+  // waking us up.
+  if (wheel_.Add(when, task)) {
+    lock_guard<mutex> lock(lock_);
+    cond_var_.notify_one();
+  }
+}
+
+
+void DelayedTasks::Stop() {
+  {
+    lock_guard<mutex> lock(lock_);
+    stopping_ = true;
+  }
+  cond_var_.notify_one();
+  thread_.join();
+}
+
+
+void DelayedTasks::CancelPending() {
+  VLOG(1) << "Cancelling delayed tasks...";
+  vector<util::Task*> to_be_cancelled;
+  wheel_.Clear(&to_be_cancelled);
+
+  for (const auto& t : to_be_cancelled) {
+    t->Return(util::Status::CANCELLED);
+  }
+
+  VLOG(1) << "Cancelled " << to_be_cancelled.size() << " delayed tasks.";
+}
+
+
+void DelayedTasks::Run() {
+  unique_lock<mutex> lock(lock_);
+  while (!stopping_) {
+    if (wheel_.size() == 0) {
+      cond_var_.wait(lock);
+      continue;
+    }
+
+    const steady_clock::time_point next(wheel_.NextTick());
+    if (next > steady_clock::now()) {
+      cond_var_.wait_until(lock, next);
+      continue;
+    }
+
+    vector<util::Task*> due;
+    wheel_.Advance(steady_clock::now(), &due);
+    // Not holding the lock, so that Delay() can go on meanwhile.
+    lock.unlock();
+    for (const auto& task : due) {
+      add_([task]() { task->Return(); });
+    }
+    lock.lock();
+  }
+}
+
+
+// The work-stealing pool (if any) the current thread is a worker of,
+// and its index there.
+#ifdef HAVE_THREAD_LOCAL
+thread_local const void* current_pool = nullptr;
+thread_local size_t current_worker = 0;
+#elif HAVE___THREAD
+__thread const void* current_pool = nullptr;
+__thread size_t current_worker = 0;
+#else
+#error No suitable thread local storage available
+#endif
+
+
 }  // namespace
 
 
 class ThreadPool::Impl {
  public:
-  ~Impl();
+  // Unnamed pools do not export any metrics.
+  explicit Impl(const string& name);
+  virtual ~Impl() = default;
+
+  virtual void Add(const function<void()>& closure) = 0;
+  virtual void Delay(const steady_clock::time_point& when,
+                     util::Task* task) = 0;
+
+ protected:
+  struct Closure {
+    function<void()> fn;
+    // Only set for named pools.
+    steady_clock::time_point added_at;
+  };
+
+  // Wraps a closure about to be queued.
+  Closure Queued(const function<void()>& fn);
+  // Runs a closure just taken off the queue.
+  void Run(const Closure& closure);
+
+ private:
+  Gauge<string>::Cell* const queued_;
+  Histogram<string>::Cell* const wait_time_;
+  Histogram<string>::Cell* const run_time_;
+};
+
 
+ThreadPool::Impl::Impl(const string& name)
+    : queued_(name.empty() ? nullptr
+                           : thread_pool_queued_closures->Bind(name)),
+      wait_time_(name.empty() ? nullptr
+                              : thread_pool_wait_time_us->Bind(name)),
+      run_time_(name.empty() ? nullptr : thread_pool_run_time_us->Bind(name)) {
+}
+
+
+ThreadPool::Impl::Closure ThreadPool::Impl::Queued(
+    const function<void()>& fn) {
+  Closure closure;
+  closure.fn = fn;
+  if (queued_) {
+    closure.added_at = steady_clock::now();
+    queued_->Increment();
+  }
+  return closure;
+}
+
+
+void ThreadPool::Impl::Run(const Closure& closure) {
+  if (!queued_) {
+    closure.fn();
+    return;
+  }
+
+  queued_->IncrementBy(-1);
+  const steady_clock::time_point started(steady_clock::now());
+  wait_time_->Record(
+      duration_cast<microseconds>(started - closure.added_at).count());
+  closure.fn();
+  run_time_->Record(
+      duration_cast<microseconds>(steady_clock::now() - started).count());
+}
+
+
+class ThreadPool::SharedQueueImpl : public ThreadPool::Impl {
+ public:
+  SharedQueueImpl(const string& name, size_t num_threads);
+  ~SharedQueueImpl() override;
+
+  void Add(const function<void()>& closure) override;
+  void Delay(const steady_clock::time_point& when, util::Task* task) override;
+
+ private:
   void Worker();
 
   // TODO(pphaneuf): I'd like this to be const, but it required
@@ -52,18 +261,39 @@ class ThreadPool::Impl {
 
   mutex queue_lock_;
   condition_variable queue_cond_var_;
-  priority_queue<QueueEntry, vector<QueueEntry>, QueueOrdering> queue_;
+  // An empty closure tells a thread to exit.
+  deque<Closure> queue_;
+
+  DelayedTasks delayed_;
 };
 
 
-ThreadPool::Impl::~Impl() {
+ThreadPool::SharedQueueImpl::SharedQueueImpl(const string& name,
+                                             size_t num_threads)
+    : Impl(name),
+      delayed_(bind(&SharedQueueImpl::Add, this, _1)) {
+  for (int i = 0; i < static_cast<int64_t>(num_threads); ++i)
+    threads_.emplace_back(thread([this, name]() {
+      NameWorkerThread(name);
+      Worker();
+    }));
+}
+
+
+ThreadPool::SharedQueueImpl::~SharedQueueImpl() {
+  // No delayed task should become due behind the exit sentinels. The
+  // pending ones are cancelled before the pool is closed, so that
+  // what their cancellation Add()s (such as the callback of their
+  // task) still runs.
+  delayed_.Stop();
+  delayed_.CancelPending();
+
   // Start by sending an empty closure to every thread (and notify
   // them), to have them exit cleanly.
   {
     lock_guard<mutex> lock(queue_lock_);
     for (int i = threads_.size(); i > 0; --i)
-      queue_.emplace(
-          make_tuple(steady_clock::time_point(), function<void()>(), nullptr));
+      queue_.emplace_back(Closure());
   }
   // Notify all the threads *after* adding all the empty closures, to
   // avoid any races.
@@ -74,66 +304,197 @@ ThreadPool::Impl::~Impl() {
     thread.join();
   }
 
-  // Workers should've drained everything from the queue.
+  // Anyone who Add()s more stuff once the pool is closed is going to
+  // cause a CHECK fail here, but at least they'll know about it that
+  // way. Workers should've drained everything else from the queue.
   CHECK(queue_.empty());
 }
 
 
-void ThreadPool::Impl::Worker() {
+void ThreadPool::SharedQueueImpl::Worker() {
   while (true) {
-    QueueEntry entry;
+    Closure closure;
 
     {
       unique_lock<mutex> lock(queue_lock_);
-      while (queue_.empty() || get<0>(queue_.top()) > steady_clock::now()) {
-        if (queue_.empty()) {
-          // If there's nothing to do, wait until there is.
-          queue_cond_var_.wait(lock);
-        } else {
-          // Otherwise, wait until the next thing we currently know about is
-          // ready.
-          const steady_clock::duration duration(get<0>(queue_.top()) -
-                                                steady_clock::now());
-          queue_cond_var_.wait_for(lock, duration);
-        }
-      }
-
-      entry = queue_.top();
-      queue_.pop();
-
-      // If we received an empty entry, exit cleanly.
-      if (!get<1>(entry)) {
-        // Anything left in the queue must be either other exit sentinels, or
-        // future (delayed) tasks, so we'll cancel anything we find, up until
-        // either the next exit sentinel, or the end of the queue.
-        VLOG(1) << "Cancelling delayed tasks...";
-        vector<util::Task*> to_be_cancelled;
-        while (!queue_.empty() && get<2>(queue_.top())) {
-          to_be_cancelled.push_back(CHECK_NOTNULL(get<2>(queue_.top())));
-          queue_.pop();
-        }
-
-        // Cancel the callbacks below outside of the lock to avoid deadlocking
-        // anyone who tries to Add() more stuff when they're cancelled.
-        // Anyone who does that is going to cause a CHECK fail in the d'tor of
-        // the pool anyway, but at least they'll know about it that way.
-        lock.unlock();
-
-        for (const auto& t : to_be_cancelled) {
-          t->Return(util::Status::CANCELLED);
-        }
-
-        VLOG(1) << "Cancelled " << to_be_cancelled.size() << " delayed tasks.";
-        return;
-      }
+      queue_cond_var_.wait(lock, [this]() { return !queue_.empty(); });
+
+      closure = move(queue_.front());
+      queue_.pop_front();
+    }
+
+    // If we received an empty closure, exit cleanly.
+    if (!closure.fn) {
+      return;
     }
 
     // Make sure not to hold the lock while calling the closure.
-    get<1>(entry)();
+    Run(closure);
+  }
+}
+
+
+void ThreadPool::SharedQueueImpl::Add(const function<void()>& closure) {
+  {
+    lock_guard<mutex> lock(queue_lock_);
+    queue_.emplace_back(Queued(closure));
+  }
+  queue_cond_var_.notify_one();
+}
+
+
+void ThreadPool::SharedQueueImpl::Delay(const steady_clock::time_point& when,
+                                        util::Task* task) {
+  delayed_.Delay(when, task);
+}
+
+
+class ThreadPool::WorkStealingImpl : public ThreadPool::Impl {
+ public:
+  WorkStealingImpl(const string& name, size_t num_threads);
+  ~WorkStealingImpl() override;
+
+  void Add(const function<void()>& closure) override;
+  void Delay(const steady_clock::time_point& when, util::Task* task) override;
+
+ private:
+  struct WorkerQueue {
+    mutex lock_;
+    deque<Closure> closures_;
+  };
+
+  void Worker(size_t index);
+  // Takes the oldest closure of the queue of worker |index|, or else
+  // of the first other queue that has one. Returns false if they are
+  // all empty.
+  bool TakeClosure(size_t index, Closure* closure);
+
+  vector<unique_ptr<WorkerQueue>> queues_;
+  // The number of closures in |queues_|, only changed with the lock
+  // of the queue held.
+  atomic<int64_t> pending_;
+  // The number of workers waiting (or about to wait) for closures,
+  // so that Add() only takes |idle_lock_| when one might need waking.
+  atomic<int> idle_;
+  // For spreading the closures added from outside the pool.
+  atomic<size_t> next_queue_;
+
+  mutex idle_lock_;
+  condition_variable idle_cond_var_;
+  bool stopping_;
+
+  vector<thread> threads_;
+  DelayedTasks delayed_;
+};
+
+
+ThreadPool::WorkStealingImpl::WorkStealingImpl(const string& name,
+                                               size_t num_threads)
+    : Impl(name),
+      pending_(0),
+      idle_(0),
+      next_queue_(0),
+      stopping_(false),
+      delayed_(bind(&WorkStealingImpl::Add, this, _1)) {
+  for (size_t i = 0; i < num_threads; ++i) {
+    queues_.emplace_back(new WorkerQueue);
+  }
+  for (size_t i = 0; i < num_threads; ++i) {
+    threads_.emplace_back(thread([this, name, i]() {
+      NameWorkerThread(name);
+      Worker(i);
+    }));
   }
 }
 
 
+ThreadPool::WorkStealingImpl::~WorkStealingImpl() {
+  // Cancel the delayed tasks first, while there are still workers to
+  // run whatever that triggers.
+  delayed_.Stop();
+  delayed_.CancelPending();
+
+  // The workers exit once there is nothing left to run.
+  {
+    lock_guard<mutex> lock(idle_lock_);
+    stopping_ = true;
+  }
+  idle_cond_var_.notify_all();
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+
+  // Workers should've drained everything from the queues.
+  CHECK_EQ(0, pending_.load()) << "closures added after shutting down";
+}
+
+
+void ThreadPool::WorkStealingImpl::Add(const function<void()>& closure) {
+  const size_t index(current_pool == this
+                         ? current_worker
+                         : next_queue_.fetch_add(1) % queues_.size());
+  {
+    WorkerQueue& queue(*queues_[index]);
+    lock_guard<mutex> lock(queue.lock_);
+    queue.closures_.push_back(Queued(closure));
+    ++pending_;
+  }
+
+  // A worker increments |idle_| before checking |pending_|, so either
+  // it sees this closure, or we see it is idle.
+  if (idle_.load() > 0) {
+    lock_guard<mutex> lock(idle_lock_);
+    idle_cond_var_.notify_one();
+  }
+}
+
+
+void ThreadPool::WorkStealingImpl::Delay(const steady_clock::time_point& when,
+                                         util::Task* task) {
+  delayed_.Delay(when, task);
+}
+
+
+void ThreadPool::WorkStealingImpl::Worker(size_t index) {
+  current_pool = this;
+  current_worker = index;
+
+  Closure closure;
+  while (true) {
+    if (TakeClosure(index, &closure)) {
+      Run(closure);
+      closure.fn = nullptr;
+      continue;
+    }
+
+    unique_lock<mutex> lock(idle_lock_);
+    ++idle_;
+    idle_cond_var_.wait(lock,
+                        [this]() { return pending_.load() > 0 || stopping_; });
+    --idle_;
+    if (stopping_ && pending_.load() == 0) {
+      return;
+    }
+  }
+}
+
+
+bool ThreadPool::WorkStealingImpl::TakeClosure(size_t index,
+                                               Closure* closure) {
+  for (size_t i = 0; i < queues_.size(); ++i) {
+    WorkerQueue& queue(*queues_[(index + i) % queues_.size()]);
+    lock_guard<mutex> lock(queue.lock_);
+    if (!queue.closures_.empty()) {
+      *closure = move(queue.closures_.front());
+      queue.closures_.pop_front();
+      --pending_;
+      return true;
+    }
+  }
+  return false;
+}
+
+
 ThreadPool::ThreadPool()
     : ThreadPool(thread::hardware_concurrency() > 0
                      ? thread::hardware_concurrency()
@@ -141,11 +502,21 @@ ThreadPool::ThreadPool()
 }
 
 
-ThreadPool::ThreadPool(size_t num_threads) : impl_(new Impl) {
+ThreadPool::ThreadPool(size_t num_threads, Scheduling scheduling)
+    : ThreadPool(string(), num_threads, scheduling) {
+}
+
+
+ThreadPool::ThreadPool(const string& name, size_t num_threads,
+                       Scheduling scheduling)
+    : impl_(scheduling == Scheduling::WORK_STEALING
+                ? static_cast<Impl*>(new WorkStealingImpl(name, num_threads))
+                : new SharedQueueImpl(name, num_threads)) {
   CHECK_GT(num_threads, static_cast<size_t>(0));
-  LOG(INFO) << "ThreadPool starting with " << num_threads << " threads";
-  for (int i = 0; i < static_cast<int64_t>(num_threads); ++i)
-    impl_->threads_.emplace_back(thread(&Impl::Worker, impl_.get()));
+  LOG(INFO) << "ThreadPool " << (name.empty() ? "" : "\"" + name + "\" ")
+            << "starting with " << num_threads << " threads"
+            << (scheduling == Scheduling::WORK_STEALING ? " (work-stealing)"
+                                                        : "");
 }
 
 
@@ -162,23 +533,15 @@ void ThreadPool::Add(const function<void()>& closure) {
     return;
   }
 
-  {
-    lock_guard<mutex> lock(impl_->queue_lock_);
-    impl_->queue_.emplace(make_tuple(steady_clock::now(), closure, nullptr));
-  }
-  impl_->queue_cond_var_.notify_one();
+  impl_->Add(closure);
 }
 
 
 void ThreadPool::Delay(const duration<double>& delay, util::Task* task) {
   CHECK_NOTNULL(task);
-  {
-    lock_guard<mutex> lock(impl_->queue_lock_);
-    impl_->queue_.emplace(make_tuple(
-        steady_clock::now() + duration_cast<std::chrono::microseconds>(delay),
-        [task]() { task->Return(); }, task));
-  }
-  impl_->queue_cond_var_.notify_one();
+  impl_->Delay(
+      steady_clock::now() + duration_cast<std::chrono::microseconds>(delay),
+      task);
 }
 
 
@@ -5,6 +5,7 @@
 #include <functional>
 #include <map>
 #include <memory>
+#include <string>
 
 #include "base/macros.h"
 #include "util/executor.h"
@@ -16,11 +17,28 @@ namespace cert_trans {
 // sized according to the number of cores in the system.
 class ThreadPool : public util::Executor {
  public:
+  enum class Scheduling {
+    // A single queue, shared by all the threads (closures start in
+    // the order they were added).
+    SHARED_QUEUE,
+    // A queue per thread, with idle threads stealing from the others,
+    // which avoids contending on a single lock when there are many
+    // threads and short closures. Closures added from a thread of the
+    // pool go to its own queue.
+    WORK_STEALING,
+  };
+
   // Creates the threads.
   ThreadPool();
 
   // Creates the threads.
-  ThreadPool(size_t num_threads);
+  ThreadPool(size_t num_threads,
+             Scheduling scheduling = Scheduling::SHARED_QUEUE);
+
+  // Creates the threads, for a pool exporting its queue length, and how
+  // long closures wait and run for, with the "pool" label set to |name|.
+  ThreadPool(const std::string& name, size_t num_threads,
+             Scheduling scheduling = Scheduling::SHARED_QUEUE);
 
   // The destructor will wait for any outstanding closures to finish.
   ~ThreadPool();
@@ -34,6 +52,8 @@ class ThreadPool : public util::Executor {
 
  private:
   class Impl;
+  class SharedQueueImpl;
+  class WorkStealingImpl;
   const std::unique_ptr<Impl> impl_;
 
   DISALLOW_COPY_AND_ASSIGN(ThreadPool);
@@ -4,15 +4,22 @@
 #include <gtest/gtest.h>
 #include <atomic>
 #include <memory>
+#include <thread>
+#include <vector>
 
 #include "base/notification.h"
+#include "monitoring/metric.h"
+#include "monitoring/registry.h"
 #include "util/sync_task.h"
 #include "util/testing.h"
 
 namespace cert_trans {
 
+using std::atomic;
 using std::chrono::milliseconds;
 using std::chrono::system_clock;
+using std::string;
+using std::this_thread::sleep_for;
 using std::unique_ptr;
 using util::SyncTask;
 
@@ -38,10 +45,17 @@ TEST_F(ThreadPoolTest, Delay) {
 
 TEST_F(ThreadPoolDeathTest, AddingMoreTasksAfterClosedGoesBang) {
   unique_ptr<ThreadPool> my_pool_of_one(new ThreadPool(1));
-  SyncTask task(my_pool_of_one.get());
-  my_pool_of_one->Delay(milliseconds(200), task.task());
+  ThreadPool* const pool(my_pool_of_one.get());
+  Notification added;
+  pool->Add([pool, &added]() {
+    // Still running once the pool is closed.
+    sleep_for(milliseconds(200));
+    pool->Add([]() {});
+    added.Notify();
+  });
   EXPECT_DEATH(my_pool_of_one.reset(), "queue_\\.empty()");
-  task.Wait();
+  // Only the child process got to close the pool.
+  added.WaitForNotification();
 }
 
 
@@ -76,6 +90,15 @@ TEST_F(ThreadPoolTest, NaturalOrderingPreserved) {
 }
 
 
+TEST_F(ThreadPoolTest, CancelDelay) {
+  SyncTask task(&pool_of_one_);
+  pool_of_one_.Delay(std::chrono::seconds(60), task.task());
+  task.Cancel();
+  task.Wait();
+  EXPECT_EQ(util::Status::CANCELLED, task.status());
+}
+
+
 TEST_F(ThreadPoolTest, CancelsDelayTasks) {
   unique_ptr<ThreadPool> pool(new ThreadPool(1));
 
@@ -89,6 +112,133 @@ TEST_F(ThreadPoolTest, CancelsDelayTasks) {
 }
 
 
+TEST_F(ThreadPoolTest, CancelledDelayTaskCanAddToThePool) {
+  unique_ptr<ThreadPool> pool(new ThreadPool(1));
+
+  // The cancelled task runs its callback on the pool being destroyed.
+  SyncTask task1(pool.get());
+
+  pool->Delay(milliseconds(500), task1.task());
+  pool.reset();
+
+  task1.Wait();
+  EXPECT_EQ(util::Status::CANCELLED, task1.status());
+}
+
+
+const Metric* FindMetric(const string& name) {
+  for (const Metric* metric : Registry::Instance()->GetMetrics()) {
+    if (metric->Name() == name) {
+      return metric;
+    }
+  }
+  return nullptr;
+}
+
+
+TEST_F(ThreadPoolTest, NamedPoolExportsMetrics) {
+  {
+    ThreadPool pool("test", 1);
+    Notification done;
+    pool.Add([]() {});
+    pool.Add([&done]() { done.Notify(); });
+    done.WaitForNotification();
+  }
+
+  const std::vector<string> labels{"test"};
+  const Metric* const queued(FindMetric("thread_pool_queued_closures"));
+  ASSERT_NE(nullptr, queued);
+  EXPECT_EQ(0, queued->CurrentValues().at(labels).second);
+  for (const string& name :
+       {"thread_pool_wait_time_us", "thread_pool_run_time_us"}) {
+    const Metric* const histogram(FindMetric(name));
+    ASSERT_NE(nullptr, histogram);
+    EXPECT_EQ(2U, histogram->CurrentHistogramValues().at(labels).count);
+  }
+}
+
+
+class WorkStealingThreadPoolTest : public ::testing::Test {
+ public:
+  WorkStealingThreadPoolTest()
+      : pool_(4, ThreadPool::Scheduling::WORK_STEALING) {
+  }
+
+ protected:
+  ThreadPool pool_;
+};
+
+
+TEST_F(WorkStealingThreadPoolTest, RunsEverything) {
+  const int kNumOuter(100);
+  const int kNumInner(10);
+  atomic<int> count(0);
+  Notification done;
+  for (int i = 0; i < kNumOuter; ++i) {
+    // Closures added from the pool's own threads go to their own
+    // queues, where others can steal them.
+    pool_.Add([this, &count, &done]() {
+      for (int j = 0; j < kNumInner; ++j) {
+        pool_.Add([&count, &done]() {
+          if (++count == kNumOuter * kNumInner) {
+            done.Notify();
+          }
+        });
+      }
+    });
+  }
+  done.WaitForNotification();
+  EXPECT_EQ(kNumOuter * kNumInner, count.load());
+}
+
+
+TEST_F(WorkStealingThreadPoolTest, OneThreadKeepsOrder) {
+  ThreadPool pool(1, ThreadPool::Scheduling::WORK_STEALING);
+  std::vector<int> order;
+  Notification done;
+  for (int i = 0; i < 10; ++i) {
+    pool.Add([i, &order, &done]() {
+      order.push_back(i);
+      if (i == 9) {
+        done.Notify();
+      }
+    });
+  }
+  done.WaitForNotification();
+  EXPECT_EQ((std::vector<int>{0, 1, 2, 3, 4, 5, 6, 7, 8, 9}), order);
+}
+
+
+TEST_F(WorkStealingThreadPoolTest, Delay) {
+  SyncTask task1(&pool_);
+  SyncTask task2(&pool_);
+
+  pool_.Delay(milliseconds(200), task2.task());
+  pool_.Delay(milliseconds(100), task1.task());
+  EXPECT_FALSE(task1.IsDone());
+
+  task1.Wait();
+  EXPECT_FALSE(task2.IsDone());
+  task2.Wait();
+  EXPECT_TRUE(task2.status().ok());
+}
+
+
+TEST_F(WorkStealingThreadPoolTest, CancelsDelayTasks) {
+  unique_ptr<ThreadPool> pool(
+      new ThreadPool(2, ThreadPool::Scheduling::WORK_STEALING));
+
+  // The task can even run its callback on the pool being destroyed.
+  SyncTask task1(pool.get());
+
+  pool->Delay(milliseconds(500), task1.task());
+  pool.reset();
+
+  task1.Wait();
+  EXPECT_EQ(util::Status::CANCELLED, task1.status());
+}
+
+
 }  // namespace cert_trans
 
 
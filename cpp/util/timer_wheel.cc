@@ -0,0 +1,160 @@
+#include "util/timer_wheel.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+#include <functional>
+
+using std::bind;
+using std::chrono::steady_clock;
+using std::lock_guard;
+using std::make_pair;
+using std::max;
+using std::mutex;
+using std::vector;
+
+namespace cert_trans {
+
+
+TimerWheel::TimerWheel(const steady_clock::duration& tick, size_t num_slots)
+    : tick_(tick),
+      start_(steady_clock::now()),
+      slots_(num_slots),
+      current_tick_(0),
+      next_tick_(0),
+      next_id_(0) {
+  CHECK_GT(tick_.count(), 0);
+  CHECK_GT(num_slots, static_cast<size_t>(0));
+}
+
+
+TimerWheel::~TimerWheel() {
+  // The cancellation callbacks of pending tasks would refer to us.
+  CHECK(timers_.empty()) << "destroyed with " << timers_.size()
+                         << " pending tasks";
+}
+
+
+bool TimerWheel::Add(const steady_clock::time_point& when, util::Task* task) {
+  CHECK_NOTNULL(task);
+  // Make sure the task does not go away before its cancellation
+  // callback is set up (even if it is already due).
+  util::TaskHold hold(task);
+  uint64_t id;
+  bool earlier;
+  {
+    lock_guard<mutex> lock(lock_);
+    if (timers_.empty()) {
+      // Catch up on the idle ticks, which have nothing to process.
+      const uint64_t now_tick((steady_clock::now() - start_) / tick_);
+      current_tick_ = max(current_tick_, now_tick);
+    }
+
+    id = next_id_++;
+    const uint64_t tick(max(TickFor(when), current_tick_ + 1));
+    Slot* const slot(&slots_[tick % slots_.size()]);
+    earlier = timers_.empty() || tick < next_tick_;
+    if (earlier) {
+      next_tick_ = tick;
+    }
+    timers_.emplace(id,
+                    make_pair(slot, slot->insert(slot->end(),
+                                                 Timer{id, tick, task})));
+  }
+
+  task->WhenCancelled(bind(&TimerWheel::Cancel, this, id));
+  return earlier;
+}
+
+
+bool TimerWheel::Advance(const steady_clock::time_point& now,
+                         vector<util::Task*>* due) {
+  CHECK_NOTNULL(due);
+  lock_guard<mutex> lock(lock_);
+  const uint64_t now_tick(now > start_ ? (now - start_) / tick_ : 0);
+  if (now_tick <= current_tick_) {
+    return !timers_.empty();
+  }
+
+  // Going around the wheel once is enough, whatever the lag.
+  const uint64_t num_slots(slots_.size());
+  const uint64_t first(max(current_tick_ + 1, now_tick >= num_slots
+                                                  ? now_tick - num_slots + 1
+                                                  : 0));
+  for (uint64_t tick = first; tick <= now_tick && !timers_.empty(); ++tick) {
+    Slot& slot(slots_[tick % num_slots]);
+    for (Slot::iterator it = slot.begin(); it != slot.end();) {
+      if (it->tick > now_tick) {
+        // Due on a later turn of the wheel.
+        ++it;
+        continue;
+      }
+      due->push_back(it->task);
+      CHECK_EQ(static_cast<size_t>(1), timers_.erase(it->id));
+      it = slot.erase(it);
+    }
+  }
+  current_tick_ = now_tick;
+
+  next_tick_ = current_tick_ + 1;
+  if (!timers_.empty()) {
+    while (slots_[next_tick_ % num_slots].empty()) {
+      ++next_tick_;
+    }
+  }
+
+  return !timers_.empty();
+}
+
+
+void TimerWheel::Clear(vector<util::Task*>* tasks) {
+  CHECK_NOTNULL(tasks);
+  lock_guard<mutex> lock(lock_);
+  for (Slot& slot : slots_) {
+    for (const Timer& timer : slot) {
+      tasks->push_back(timer.task);
+    }
+    slot.clear();
+  }
+  timers_.clear();
+}
+
+
+steady_clock::time_point TimerWheel::NextTick() const {
+  lock_guard<mutex> lock(lock_);
+  return start_ + tick_ * next_tick_;
+}
+
+
+size_t TimerWheel::size() const {
+  lock_guard<mutex> lock(lock_);
+  return timers_.size();
+}
+
+
+uint64_t TimerWheel::TickFor(const steady_clock::time_point& when) const {
+  if (when <= start_) {
+    return 0;
+  }
+  return (when - start_ + tick_ - steady_clock::duration(1)) / tick_;
+}
+
+
+void TimerWheel::Cancel(uint64_t id) {
+  util::Task* task;
+  {
+    lock_guard<mutex> lock(lock_);
+    const auto it(timers_.find(id));
+    if (it == timers_.end()) {
+      // Already due, the executor will return it.
+      return;
+    }
+    task = it->second.second->task;
+    it->second.first->erase(it->second.second);
+    timers_.erase(it);
+  }
+
+  task->Return(util::Status::CANCELLED);
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,91 @@
+#ifndef CERT_TRANS_UTIL_TIMER_WHEEL_H_
+#define CERT_TRANS_UTIL_TIMER_WHEEL_H_
+
+#include <stdint.h>
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "base/macros.h"
+#include "util/task.h"
+
+namespace cert_trans {
+
+
+// Keeps the tasks waiting on util::Executor::Delay(), for the
+// executors to return them once they are due. This is a hashed timing
+// wheel: the time is divided in ticks, and every task goes in the slot
+// of the tick when it is due (modulo the number of slots), so adding
+// and removing timers take constant time, however many are pending.
+// Tasks are due at the end of their tick, so at most one tick late.
+//
+// If cancellation of a pending task is requested, it is removed from
+// the wheel and returned with util::Status::CANCELLED.
+//
+// The wheel does not keep time by itself: the executor calls
+// Advance() once NextTick() has passed, and returns the due tasks
+// itself, in its own context. This class is thread-safe.
+class TimerWheel {
+ public:
+  explicit TimerWheel(const std::chrono::steady_clock::duration& tick =
+                          std::chrono::milliseconds(10),
+                      size_t num_slots = 512);
+  // The wheel must be empty by then (see Clear()).
+  ~TimerWheel();
+
+  // Returns true if this made NextTick() earlier (or the wheel was
+  // empty), in which case the executor should wake up sooner.
+  bool Add(const std::chrono::steady_clock::time_point& when,
+           util::Task* task);
+
+  // Removes the tasks that are due at |now|, and appends them to
+  // |due|, for the caller to return. Returns false if the wheel is
+  // now empty.
+  bool Advance(const std::chrono::steady_clock::time_point& now,
+               std::vector<util::Task*>* due);
+
+  // Removes all the pending tasks, and appends them to |tasks|, for
+  // the caller to cancel.
+  void Clear(std::vector<util::Task*>* tasks);
+
+  // When Advance() should be called next, if there are pending tasks
+  // (the end of the next tick with a non-empty slot, or earlier).
+  std::chrono::steady_clock::time_point NextTick() const;
+
+  size_t size() const;
+
+ private:
+  struct Timer {
+    uint64_t id;
+    uint64_t tick;
+    util::Task* task;
+  };
+
+  typedef std::list<Timer> Slot;
+
+  // The tick (since |start_|) that ends after |when|.
+  uint64_t TickFor(const std::chrono::steady_clock::time_point& when) const;
+  void Cancel(uint64_t id);
+
+  const std::chrono::steady_clock::duration tick_;
+  const std::chrono::steady_clock::time_point start_;
+
+  mutable std::mutex lock_;
+  std::vector<Slot> slots_;
+  // The slot and position of every pending timer, by id.
+  std::unordered_map<uint64_t, std::pair<Slot*, Slot::iterator>> timers_;
+  // Every tick up to this one has been processed.
+  uint64_t current_tick_;
+  // No timer is due before this tick.
+  uint64_t next_tick_;
+  uint64_t next_id_;
+
+  DISALLOW_COPY_AND_ASSIGN(TimerWheel);
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_UTIL_TIMER_WHEEL_H_
@@ -0,0 +1,133 @@
+#include "util/timer_wheel.h"
+
+#include <gtest/gtest.h>
+#include <vector>
+
+#include "util/sync_task.h"
+#include "util/testing.h"
+#include "util/thread_pool.h"
+
+namespace cert_trans {
+namespace {
+
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::vector;
+using util::SyncTask;
+
+
+class TimerWheelTest : public ::testing::Test {
+ public:
+  TimerWheelTest()
+      : wheel_(milliseconds(10), 8), start_(steady_clock::now()) {
+  }
+
+ protected:
+  ThreadPool pool_;
+  TimerWheel wheel_;
+  const steady_clock::time_point start_;
+};
+
+
+TEST_F(TimerWheelTest, ReturnsDueTasks) {
+  SyncTask task1(&pool_);
+  SyncTask task2(&pool_);
+  EXPECT_TRUE(wheel_.Add(start_ + milliseconds(45), task2.task()));
+  EXPECT_TRUE(wheel_.Add(start_ + milliseconds(25), task1.task()));
+  EXPECT_EQ(2U, wheel_.size());
+  EXPECT_LE(start_ + milliseconds(25), wheel_.NextTick());
+
+  vector<util::Task*> due;
+  EXPECT_TRUE(wheel_.Advance(start_ + milliseconds(20), &due));
+  EXPECT_TRUE(due.empty());
+
+  EXPECT_TRUE(wheel_.Advance(start_ + milliseconds(45), &due));
+  ASSERT_EQ(1U, due.size());
+  EXPECT_EQ(task1.task(), due[0]);
+  EXPECT_LE(start_ + milliseconds(45), wheel_.NextTick());
+
+  due.clear();
+  EXPECT_FALSE(wheel_.Advance(start_ + milliseconds(60), &due));
+  ASSERT_EQ(1U, due.size());
+  EXPECT_EQ(task2.task(), due[0]);
+  EXPECT_EQ(0U, wheel_.size());
+
+  task1.task()->Return();
+  task2.task()->Return();
+  task1.Wait();
+  task2.Wait();
+}
+
+
+TEST_F(TimerWheelTest, LaterTurnsOfTheWheel) {
+  SyncTask task(&pool_);
+  // Goes in the same slot as the first ticks, a few turns later.
+  wheel_.Add(start_ + milliseconds(250), task.task());
+
+  vector<util::Task*> due;
+  for (int i = 1; i < 25; ++i) {
+    EXPECT_TRUE(wheel_.Advance(start_ + milliseconds(10 * i), &due));
+    EXPECT_TRUE(due.empty());
+  }
+
+  // Catching up on more than a turn at once.
+  EXPECT_FALSE(wheel_.Advance(start_ + milliseconds(1000), &due));
+  ASSERT_EQ(1U, due.size());
+  due[0]->Return();
+  task.Wait();
+}
+
+
+TEST_F(TimerWheelTest, Cancel) {
+  SyncTask task1(&pool_);
+  SyncTask task2(&pool_);
+  wheel_.Add(start_ + milliseconds(30), task1.task());
+  wheel_.Add(start_ + milliseconds(30), task2.task());
+
+  task1.Cancel();
+  task1.Wait();
+  EXPECT_EQ(util::Status::CANCELLED, task1.status());
+  EXPECT_EQ(1U, wheel_.size());
+
+  vector<util::Task*> due;
+  EXPECT_FALSE(wheel_.Advance(start_ + milliseconds(40), &due));
+  ASSERT_EQ(1U, due.size());
+  EXPECT_EQ(task2.task(), due[0]);
+
+  // Too late to be taken out of the wheel, whoever took the task
+  // returns it.
+  task2.Cancel();
+  EXPECT_FALSE(task2.IsDone());
+  task2.task()->Return();
+  task2.Wait();
+  EXPECT_TRUE(task2.status().ok());
+}
+
+
+TEST_F(TimerWheelTest, Clear) {
+  SyncTask task1(&pool_);
+  SyncTask task2(&pool_);
+  wheel_.Add(start_ + milliseconds(30), task1.task());
+  wheel_.Add(start_ + milliseconds(3000), task2.task());
+
+  vector<util::Task*> tasks;
+  wheel_.Clear(&tasks);
+  EXPECT_EQ(2U, tasks.size());
+  EXPECT_EQ(0U, wheel_.size());
+
+  for (const auto& task : tasks) {
+    task->Return(util::Status::CANCELLED);
+  }
+  task1.Wait();
+  task2.Wait();
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
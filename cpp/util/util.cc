@@ -1,8 +1,10 @@
 #include "util/util.h"
 
 #include <glog/logging.h>
-#include <netinet/in.h>  // for resolv.h
-#include <resolv.h>      // for b64_ntop
+#include <ctype.h>
+#ifdef __linux__
+#include <pthread.h>
+#endif
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -175,31 +177,173 @@ string RandomString(size_t min_length, size_t max_length) {
   return ret;
 }
 
+namespace {
+
+
+const char kBase64Chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+// Set in the decoding tables for the characters that are not part of
+// the alphabet, out of the 24 bits of a group.
+const uint32_t kBadBase64 = 0xff000000;
+
+
+class Base64Tables {
+ public:
+  static const Base64Tables& Get() {
+    static const Base64Tables* const tables(new Base64Tables);
+    return *tables;
+  }
+
+  // The two characters encoding every 12 bits.
+  char pairs[1 << 12][2];
+  // The bits of every character, at each of the four positions of a
+  // group, or kBadBase64.
+  uint32_t values[4][256];
+
+ private:
+  Base64Tables() {
+    for (int i = 0; i < (1 << 12); ++i) {
+      pairs[i][0] = kBase64Chars[i >> 6];
+      pairs[i][1] = kBase64Chars[i & 0x3f];
+    }
+    for (int pos = 0; pos < 4; ++pos) {
+      for (int c = 0; c < 256; ++c) {
+        values[pos][c] = kBadBase64;
+      }
+      for (int i = 0; i < 64; ++i) {
+        values[pos][static_cast<unsigned char>(kBase64Chars[i])] =
+            i << (6 * (3 - pos));
+      }
+    }
+  }
+};
+
+
+}  // namespace
+
+
+size_t Base64EncodedSize(size_t size) {
+  return (size + 2) / 3 * 4;
+}
+
+
+char* EncodeBase64(const char* data, size_t size, char* out) {
+  const Base64Tables& tables(Base64Tables::Get());
+  const unsigned char* in(reinterpret_cast<const unsigned char*>(data));
+
+  // Every three bytes are four characters, looked up two at a time.
+  for (; size >= 3; size -= 3, in += 3, out += 4) {
+    const uint32_t group((in[0] << 16) | (in[1] << 8) | in[2]);
+    memcpy(out, tables.pairs[group >> 12], 2);
+    memcpy(out + 2, tables.pairs[group & 0xfff], 2);
+  }
+
+  if (size > 0) {
+    const uint32_t group((in[0] << 16) | (size > 1 ? in[1] << 8 : 0));
+    memcpy(out, tables.pairs[group >> 12], 2);
+    out[2] = size > 1 ? kBase64Chars[(group >> 6) & 0x3f] : '=';
+    out[3] = '=';
+    out += 4;
+  }
+
+  return out;
+}
+
+
+void AppendBase64(const char* data, size_t size, string* dst) {
+  const size_t old_size(dst->size());
+  dst->resize(old_size + Base64EncodedSize(size));
+  char* const out(&(*dst)[0] + old_size);
+  CHECK_EQ(EncodeBase64(data, size, out), out + Base64EncodedSize(size));
+}
+
+
+bool AppendFromBase64(const char* b64, size_t length, string* dst) {
+  const Base64Tables& tables(Base64Tables::Get());
+  const unsigned char* in(reinterpret_cast<const unsigned char*>(b64));
+  const unsigned char* const end(in + length);
+  const size_t old_size(dst->size());
+
+  // Most of the input is plain groups of four characters, decoded
+  // with a table lookup each, straight into |dst| (decoding never
+  // takes more space than the encoded value). The rest (padding,
+  // whitespace and errors) is left to the loop below, a character at a
+  // time.
+  dst->resize(old_size + length / 4 * 3);
+  char* const out_begin(&(*dst)[0] + old_size);
+  char* out(out_begin);
+  while (end - in >= 4) {
+    const uint32_t group(tables.values[0][in[0]] | tables.values[1][in[1]] |
+                         tables.values[2][in[2]] | tables.values[3][in[3]]);
+    if (group & kBadBase64) {
+      break;
+    }
+    out[0] = static_cast<char>(group >> 16);
+    out[1] = static_cast<char>(group >> 8);
+    out[2] = static_cast<char>(group);
+    out += 3;
+    in += 4;
+  }
+  dst->resize(old_size + (out - out_begin));
+
+  uint32_t bits(0);
+  int num_bits(0);
+  size_t num_chars(0);
+  size_t num_padding(0);
+  for (; in < end; ++in) {
+    if (isspace(*in)) {
+      continue;
+    }
+    if (*in == '=') {
+      ++num_padding;
+      continue;
+    }
+
+    const uint32_t value(tables.values[3][*in]);
+    if ((value & kBadBase64) || num_padding > 0) {
+      dst->resize(old_size);
+      return false;
+    }
+    ++num_chars;
+    bits = (bits << 6) | value;
+    num_bits += 6;
+    if (num_bits >= 8) {
+      num_bits -= 8;
+      dst->push_back(static_cast<char>(bits >> num_bits));
+      bits &= (1 << num_bits) - 1;
+    }
+  }
+
+  // Complete groups of four characters, with no leftover bits.
+  if ((num_chars + num_padding) % 4 != 0 || num_padding > 2 ||
+      (num_padding > 0 && num_chars % 4 != 4 - num_padding) || bits != 0) {
+    dst->resize(old_size);
+    return false;
+  }
+  return true;
+}
+
+
 string FromBase64(const char* b64) {
-  size_t length = strlen(b64);
-  // Lazy: base 64 encoding is always >= in length to decoded value
-  // (equality occurs for zero length).
-  u_char* buf = new u_char[length];
-  int rlength = b64_pton(b64, buf, length);
+  return FromBase64(b64, strlen(b64));
+}
+
+
+string FromBase64(const char* b64, size_t length) {
+  string ret;
   // Treat decode errors as empty strings.
-  if (rlength < 0)
-    rlength = 0;
-  string ret(reinterpret_cast<char*>(buf), rlength);
-  delete[] buf;
+  AppendFromBase64(b64, length, &ret);
   return ret;
 }
 
+
 string ToBase64(const string& from) {
-  // base 64 is 4 output bytes for every 3 input bytes (rounded up).
-  size_t length = ((from.size() + 2) / 3) * 4;
-  char* buf = new char[length + 1];
-  length =
-      b64_ntop((const u_char*)from.data(), from.length(), buf, length + 1);
-  string ret(buf, length);
-  delete[] buf;
+  string ret;
+  AppendBase64(from.data(), from.size(), &ret);
   return ret;
 }
 
+
 vector<string> split(const string& in, char delim) {
   vector<string> ret;
   string item;
@@ -213,4 +357,12 @@ vector<string> split(const string& in, char delim) {
   return ret;
 }
 
+
+void SetThreadName(const string& name) {
+#ifdef __linux__
+  // The kernel only keeps 16 bytes, including the NUL.
+  pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+#endif
+}
+
 }  // namespace util
@@ -32,12 +32,35 @@ uint64_t TimeInMilliseconds();
 // srand() is called if needed.
 std::string RandomString(size_t min_length, size_t max_length);
 
+// These treat invalid input as empty.
 std::string FromBase64(const char* b64);
+std::string FromBase64(const char* b64, size_t length);
 
 std::string ToBase64(const std::string& from);
 
+// The number of characters in the base64 encoding of |size| bytes.
+size_t Base64EncodedSize(size_t size);
+
+// Writes the base64 encoding of the |size| bytes at |data| to |out|,
+// which must have room for Base64EncodedSize(size) characters (no
+// terminating NUL is written). Returns the end of what was written.
+char* EncodeBase64(const char* data, size_t size, char* out);
+
+// Appends the base64 encoding of the |size| bytes at |data| to |*dst|.
+void AppendBase64(const char* data, size_t size, std::string* dst);
+
+// Appends the data encoded in the |length| characters at |b64| to
+// |*dst|, ignoring whitespace. Returns false, leaving |*dst| as it
+// was, if they are not valid (padded) base64.
+bool AppendFromBase64(const char* b64, size_t length, std::string* dst);
+
 std::vector<std::string> split(const std::string& in, char delim = ',');
 
+// Names the calling thread, as shown by top -H and in /proc (where
+// it is truncated to 15 characters). Does nothing on systems other
+// than Linux.
+void SetThreadName(const std::string& name);
+
 }  // namespace util
 
 #endif  // CERT_TRANS_UTIL_UTIL_H_